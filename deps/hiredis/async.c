@@ -582,6 +582,30 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
     c->funcs->async_write(ac);
 }
 
+/* Make the commands of the context only be appended to the output buffer,
+ * without scheduling a write event: the user is in charge of calling
+ * redisAsyncFlush(), typically once per event loop iteration. */
+void redisAsyncSetDeferWrite(redisAsyncContext *ac, int defer) {
+    if (defer)
+        ac->c.flags |= REDIS_DEFER_WRITE;
+    else
+        ac->c.flags &= ~REDIS_DEFER_WRITE;
+}
+
+/* Write the output buffer of the context right away. A write event is
+ * scheduled only if the socket could not take all of it. Note that the
+ * context is disconnected, and possibly freed, on write errors. */
+void redisAsyncFlush(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+
+    /* Before the connection is established, the pending commands are written
+     * by the connect handler. */
+    if (!(c->flags & REDIS_CONNECTED) || sdslen(c->obuf) == 0)
+        return;
+
+    c->funcs->async_write(ac);
+}
+
 void __redisSetError(redisContext *c, int type, const char *str);
 
 void redisAsyncHandleTimeout(redisAsyncContext *ac) {
@@ -705,8 +729,12 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
 
     __redisAppendCommand(c,cmd,len);
 
-    /* Always schedule a write when the write buffer is non-empty */
-    _EL_ADD_WRITE(ac);
+    /* Always schedule a write when the write buffer is non-empty, unless the
+     * user flushes it with redisAsyncFlush(). */
+    if (c->flags & REDIS_DEFER_WRITE)
+        refreshTimeout(ac);
+    else
+        _EL_ADD_WRITE(ac);
 
     return REDIS_OK;
 }
@@ -871,20 +871,23 @@ int redisEnableKeepAlive(redisContext *c) {
  * After this function is called, you may use redisGetReplyFromReader to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
+    char *buf;
     int nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    nread = c->funcs->read(c, buf, sizeof(buf));
+    /* Read directly into the reader buffer, so that the data is not copied
+     * once more by redisReaderFeed(). */
+    buf = redisReaderReserve(c->reader, REDIS_READER_READ_LEN);
+    if (buf == NULL) {
+        __redisSetError(c, c->reader->err, c->reader->errstr);
+        return REDIS_ERR;
+    }
+    nread = c->funcs->read(c, buf, REDIS_READER_READ_LEN);
     if (nread > 0) {
-        if (redisReaderFeed(c->reader, buf, nread) != REDIS_OK) {
-            __redisSetError(c, c->reader->err, c->reader->errstr);
-            return REDIS_ERR;
-        } else {
-        }
+        redisReaderCommit(c->reader, nread);
     } else if (nread < 0) {
         return REDIS_ERR;
     }
@@ -84,6 +84,11 @@ struct timeval; /* forward declaration */
  */
 #define REDIS_NO_AUTO_FREE 0x200
 
+/* Flag specific to the async API: commands are only appended to the output
+ * buffer, that the user writes with redisAsyncFlush(), so that the commands
+ * issued while handling a batch of events are sent with a single write. */
+#define REDIS_DEFER_WRITE 0x400
+
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
@@ -627,6 +627,57 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
     return REDIS_OK;
 }
 
+/* Return a pointer to at least 'len' bytes of free space at the end of the
+ * reader buffer: the caller can read from the network directly into it and
+ * then call redisReaderCommit() with the number of bytes actually stored,
+ * instead of copying the data with redisReaderFeed(). Returns NULL when the
+ * reader is in an erroneous state or on out of memory. */
+char *redisReaderReserve(redisReader *r, size_t len) {
+    sds newbuf;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return NULL;
+
+    /* Everything was consumed: reuse the buffer from the start. */
+    if (r->pos == r->len && r->len != 0) {
+        sdsclear(r->buf);
+        r->pos = 0;
+        r->len = 0;
+    }
+
+    /* Destroy internal buffer when it is empty and is quite large, like
+     * redisReaderFeed() does. The room reserved below may be twice 'len'
+     * because of the sds greedy allocation, that is not considered large. */
+    if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf &&
+        sdsavail(r->buf) > len*2)
+    {
+        sdsfree(r->buf);
+        r->buf = sdsempty();
+        r->pos = 0;
+
+        /* r->buf should not be NULL since we just free'd a larger one. */
+        assert(r->buf != NULL);
+    }
+
+    if (sdsavail(r->buf) < len) {
+        newbuf = sdsMakeRoomFor(r->buf,len);
+        if (newbuf == NULL) {
+            __redisReaderSetErrorOOM(r);
+            return NULL;
+        }
+        r->buf = newbuf;
+    }
+    return r->buf+sdslen(r->buf);
+}
+
+/* Account 'len' bytes written at the pointer returned by redisReaderReserve()
+ * as part of the buffer to parse. */
+void redisReaderCommit(redisReader *r, size_t len) {
+    sdsIncrLen(r->buf,len);
+    r->len = sdslen(r->buf);
+}
+
 int redisReaderGetReply(redisReader *r, void **reply) {
     /* Default target pointer to NULL. */
     if (reply != NULL)
@@ -64,6 +64,7 @@
 #define REDIS_REPLY_VERB 14
 
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
+#define REDIS_READER_READ_LEN (1024*16) /* Bytes read from the socket at once. */
 
 #ifdef __cplusplus
 extern "C" {
@@ -109,6 +110,8 @@ typedef struct redisReader {
 redisReader *redisReaderCreateWithFunctions(redisReplyObjectFunctions *fn);
 void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
+char *redisReaderReserve(redisReader *r, size_t len);
+void redisReaderCommit(redisReader *r, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
 
 #define redisReaderSetPrivdata(_r, _p) (int)(((redisReader*)(_r))->privdata = (_p))
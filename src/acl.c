@@ -75,6 +75,7 @@ struct ACLCategoryItem {
     {"connection", CMD_CATEGORY_CONNECTION},
     {"transaction", CMD_CATEGORY_TRANSACTION},
     {"scripting", CMD_CATEGORY_SCRIPTING},
+    {"bloom", CMD_CATEGORY_BLOOM},
     {NULL,0} /* Terminator. */
 };
 
@@ -93,6 +94,8 @@ struct ACLUserFlag {
 void ACLResetSubcommandsForCommand(user *u, unsigned long id);
 void ACLResetSubcommands(user *u);
 void ACLAddAllowedSubcommand(user *u, unsigned long id, const char *sub);
+void ACLCompileKeyPatterns(user *u);
+void ACLFreeKeyMatcher(struct aclKeyMatcher *m);
 
 /* The length of the string representation of a hashed password. */
 #define HASH_PASSWORD_LEN SHA256_BLOCK_SIZE*2
@@ -213,6 +216,10 @@ user *ACLCreateUser(const char *name, size_t namelen) {
     listSetFreeMethod(u->patterns,ACLListFreeSds);
     listSetDupMethod(u->patterns,ACLListDupSds);
     memset(u->allowed_commands,0,sizeof(u->allowed_commands));
+    u->keymatcher = NULL;
+    ACLCompileKeyPatterns(u);
+    u->authcache_len = 0;
+    u->authcache_next = 0;
     raxInsert(Users,(unsigned char*)name,namelen,u,NULL);
     return u;
 }
@@ -240,6 +247,7 @@ void ACLFreeUser(user *u) {
     sdsfree(u->name);
     listRelease(u->passwords);
     listRelease(u->patterns);
+    ACLFreeKeyMatcher(u->keymatcher);
     ACLResetSubcommands(u);
     zfree(u);
 }
@@ -276,6 +284,9 @@ void ACLCopyUser(user *dst, user *src) {
     listRelease(dst->patterns);
     dst->passwords = listDup(src->passwords);
     dst->patterns = listDup(src->patterns);
+    ACLCompileKeyPatterns(dst);
+    dst->authcache_len = 0;
+    dst->authcache_next = 0;
     memcpy(dst->allowed_commands,src->allowed_commands,
            sizeof(dst->allowed_commands));
     dst->flags = src->flags;
@@ -699,6 +710,9 @@ void ACLAddAllowedSubcommand(user *u, unsigned long id, const char *sub) {
  */
 int ACLSetUser(user *u, const char *op, ssize_t oplen) {
     if (oplen == -1) oplen = strlen(op);
+    /* The passwords that authenticated the user may no longer be valid. */
+    u->authcache_len = 0;
+    u->authcache_next = 0;
     if (!strcasecmp(op,"on")) {
         u->flags |= USER_FLAG_ENABLED;
         u->flags &= ~USER_FLAG_DISABLED;
@@ -710,9 +724,11 @@ int ACLSetUser(user *u, const char *op, ssize_t oplen) {
     {
         u->flags |= USER_FLAG_ALLKEYS;
         listEmpty(u->patterns);
+        ACLCompileKeyPatterns(u);
     } else if (!strcasecmp(op,"resetkeys")) {
         u->flags &= ~USER_FLAG_ALLKEYS;
         listEmpty(u->patterns);
+        ACLCompileKeyPatterns(u);
     } else if (!strcasecmp(op,"allcommands") ||
                !strcasecmp(op,"+@all"))
     {
@@ -789,10 +805,12 @@ int ACLSetUser(user *u, const char *op, ssize_t oplen) {
         sds newpat = sdsnewlen(op+1,oplen-1);
         listNode *ln = listSearchKey(u->patterns,newpat);
         /* Avoid re-adding the same pattern multiple times. */
-        if (ln == NULL)
+        if (ln == NULL) {
             listAddNodeTail(u->patterns,newpat);
-        else
+            ACLCompileKeyPatterns(u);
+        } else {
             sdsfree(newpat);
+        }
         u->flags &= ~USER_FLAG_ALLKEYS;
     } else if (op[0] == '+' && op[1] != '@') {
         if (strchr(op,'|') == NULL) {
@@ -946,23 +964,48 @@ int ACLCheckUserCredentials(robj *username, robj *password) {
      * are already fine here. */
     if (u->flags & USER_FLAG_NOPASS) return C_OK;
 
+    /* When many clients reconnect at the same time, hashing the password
+     * of every AUTH with SHA256 adds up: the passwords that authenticated
+     * the user recently are remembered as a 64 bit SipHash, keyed with the
+     * random seed of the dictionaries, that is much cheaper to compute. The
+     * seed is secret, so a wrong password can't be crafted to collide. */
+    long long start = ustime();
+    uint64_t authhash = dictGenHashFunction(password->ptr,
+                                            sdslen(password->ptr));
+    for (int j = 0; j < u->authcache_len; j++) {
+        if (u->authcache[j] == authhash) {
+            server.stat_auth_cache_hits++;
+            server.stat_auth_usec += ustime()-start;
+            return C_OK;
+        }
+    }
+    server.stat_auth_cache_misses++;
+
     /* Check all the user passwords for at least one to match. */
     listIter li;
     listNode *ln;
+    int retval = C_ERR;
     listRewind(u->passwords,&li);
     sds hashed = ACLHashPassword(password->ptr,sdslen(password->ptr));
     while((ln = listNext(&li))) {
         sds thispass = listNodeValue(ln);
         if (!time_independent_strcmp(hashed, thispass)) {
-            sdsfree(hashed);
-            return C_OK;
+            retval = C_OK;
+            break;
         }
     }
     sdsfree(hashed);
 
-    /* If we reached this point, no password matched. */
-    errno = EINVAL;
-    return C_ERR;
+    if (retval == C_OK) {
+        u->authcache[u->authcache_next] = authhash;
+        u->authcache_next = (u->authcache_next+1) % USER_AUTH_CACHE_SIZE;
+        if (u->authcache_len < USER_AUTH_CACHE_SIZE) u->authcache_len++;
+    } else {
+        /* If we reached this point, no password matched. */
+        errno = EINVAL;
+    }
+    server.stat_auth_usec += ustime()-start;
+    return retval;
 }
 
 /* This is like ACLCheckUserCredentials(), however if the user/pass
@@ -1024,6 +1067,102 @@ user *ACLGetUserByName(const char *name, size_t namelen) {
     return myuser;
 }
 
+/* The key patterns of an user compiled for matching: most patterns are
+ * either a plain key, or a plain prefix followed by '*', and can be matched
+ * with a lookup in a radix tree, with a lookup per length of the prefixes
+ * for the latter. Only the other patterns are matched one after the other
+ * with stringmatchlen(). The matcher is compiled every time the patterns
+ * change, and referenced by the user. */
+typedef struct aclKeyMatcher {
+    unsigned long long version; /* Never reused, see client->acl_key. */
+    rax *keys;                  /* The plain keys. */
+    rax *prefixes;              /* The plain prefixes. */
+    size_t *prefix_lens;        /* Lengths of the prefixes, ascending. */
+    int numprefix_lens;
+    sds *globs;                 /* The other patterns, owned by the user. */
+    int numglobs;
+} aclKeyMatcher;
+
+#define ACL_KEY_NOMATCH 0
+#define ACL_KEY_MATCH 1
+#define ACL_KEY_MATCH_GLOB 2 /* Matched by a pattern of 'globs'. */
+
+static unsigned long long ACLKeyMatcherVersion = 0;
+
+void ACLFreeKeyMatcher(aclKeyMatcher *m) {
+    if (m == NULL) return;
+    raxFree(m->keys);
+    raxFree(m->prefixes);
+    zfree(m->prefix_lens);
+    zfree(m->globs);
+    zfree(m);
+}
+
+/* Compile the key patterns of the user 'u', replacing its matcher. */
+void ACLCompileKeyPatterns(user *u) {
+    aclKeyMatcher *m = zmalloc(sizeof(*m));
+    unsigned long count = listLength(u->patterns);
+    listIter li;
+    listNode *ln;
+
+    m->version = ++ACLKeyMatcherVersion;
+    m->keys = raxNew();
+    m->prefixes = raxNew();
+    m->prefix_lens = zmalloc(sizeof(size_t)*count);
+    m->numprefix_lens = 0;
+    m->globs = zmalloc(sizeof(sds)*count);
+    m->numglobs = 0;
+
+    listRewind(u->patterns,&li);
+    while((ln = listNext(&li))) {
+        sds pattern = listNodeValue(ln);
+        size_t plen = sdslen(pattern), special;
+
+        for (special = 0; special < plen; special++) {
+            char c = pattern[special];
+            if (c == '*' || c == '?' || c == '[' || c == '\\') break;
+        }
+        if (special == plen) {
+            raxInsert(m->keys,(unsigned char*)pattern,plen,NULL,NULL);
+        } else if (special == plen-1 && pattern[special] == '*') {
+            int j = 0;
+
+            raxInsert(m->prefixes,(unsigned char*)pattern,special,NULL,NULL);
+            /* Insert the length keeping them sorted. */
+            while (j < m->numprefix_lens && m->prefix_lens[j] < special) j++;
+            if (j == m->numprefix_lens || m->prefix_lens[j] != special) {
+                memmove(m->prefix_lens+j+1,m->prefix_lens+j,
+                    sizeof(size_t)*(m->numprefix_lens-j));
+                m->prefix_lens[j] = special;
+                m->numprefix_lens++;
+            }
+        } else {
+            m->globs[m->numglobs++] = pattern;
+        }
+    }
+    ACLFreeKeyMatcher(u->keymatcher);
+    u->keymatcher = m;
+}
+
+/* Return ACL_KEY_MATCH or ACL_KEY_MATCH_GLOB if 'key' matches one of the
+ * patterns of the matcher 'm', otherwise ACL_KEY_NOMATCH. */
+static int ACLKeyMatcherMatch(aclKeyMatcher *m, sds key) {
+    size_t klen = sdslen(key);
+
+    if (raxSize(m->keys) &&
+        raxFind(m->keys,(unsigned char*)key,klen) != raxNotFound)
+        return ACL_KEY_MATCH;
+    for (int j = 0; j < m->numprefix_lens && m->prefix_lens[j] <= klen; j++) {
+        if (raxFind(m->prefixes,(unsigned char*)key,m->prefix_lens[j]) !=
+            raxNotFound) return ACL_KEY_MATCH;
+    }
+    for (int j = 0; j < m->numglobs; j++) {
+        if (stringmatchlen(m->globs[j],sdslen(m->globs[j]),key,klen,0))
+            return ACL_KEY_MATCH_GLOB;
+    }
+    return ACL_KEY_NOMATCH;
+}
+
 /* Check if the command is ready to be executed in the client 'c', already
  * referenced by c->cmd, and can be executed by this client according to the
  * ACLs associated to the client user c->user.
@@ -1072,32 +1211,29 @@ int ACLCheckCommandPerm(client *c) {
     if (!(c->user->flags & USER_FLAG_ALLKEYS) &&
         (c->cmd->getkeys_proc || c->cmd->firstkey))
     {
+        aclKeyMatcher *m = u->keymatcher;
         int numkeys;
-        int *keyidx = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+        int *keyidx = getClientCommandKeys(c,&numkeys);
         for (int j = 0; j < numkeys; j++) {
-            listIter li;
-            listNode *ln;
-            listRewind(u->patterns,&li);
-
-            /* Test this key against every pattern. */
-            int match = 0;
-            while((ln = listNext(&li))) {
-                sds pattern = listNodeValue(ln);
-                size_t plen = sdslen(pattern);
-                int idx = keyidx[j];
-                if (stringmatchlen(pattern,plen,c->argv[idx]->ptr,
-                                   sdslen(c->argv[idx]->ptr),0))
-                {
-                    match = 1;
-                    break;
-                }
-            }
-            if (!match) {
-                getKeysFreeResult(keyidx);
-                return ACL_DENIED_KEY;
+            sds key = c->argv[keyidx[j]]->ptr;
+
+            /* The clients tend to access the same keys over and over:
+             * the last key that needed the glob patterns to match is
+             * remembered, as long as the patterns don't change. */
+            if (c->acl_key_version == m->version &&
+                sdslen(key) == sdslen(c->acl_key) &&
+                memcmp(key,c->acl_key,sdslen(key)) == 0) continue;
+
+            int match = ACLKeyMatcherMatch(m,key);
+            if (match == ACL_KEY_NOMATCH) return ACL_DENIED_KEY;
+            if (match == ACL_KEY_MATCH_GLOB) {
+                if (c->acl_key)
+                    c->acl_key = sdscpylen(c->acl_key,key,sdslen(key));
+                else
+                    c->acl_key = sdsnewlen(key,sdslen(key));
+                c->acl_key_version = m->version;
             }
         }
-        getKeysFreeResult(keyidx);
     }
 
     /* If we survived all the above checks, the user can execute the
@@ -165,6 +165,17 @@ list *listInsertNode(list *list, listNode *old_node, void *value, int after) {
  *
  * This function can't fail. */
 void listDelNode(list *list, listNode *node)
+{
+    listUnlinkNode(list, node);
+    if (list->free) list->free(node->value);
+    zfree(node);
+}
+
+/* Remove the specified node from the list without freeing it, so that
+ * it can be linked again with listLinkNodeHead().
+ *
+ * This function can't fail. */
+void listUnlinkNode(list *list, listNode *node)
 {
     if (node->prev)
         node->prev->next = node->next;
@@ -174,11 +185,29 @@ void listDelNode(list *list, listNode *node)
         node->next->prev = node->prev;
     else
         list->tail = node->prev;
-    if (list->free) list->free(node->value);
-    zfree(node);
+    node->next = NULL;
+    node->prev = NULL;
     list->len--;
 }
 
+/* Add a node, previously unlinked with listUnlinkNode(), to the head
+ * of the list.
+ *
+ * This function can't fail. */
+void listLinkNodeHead(list *list, listNode *node)
+{
+    if (list->len == 0) {
+        list->head = list->tail = node;
+        node->prev = node->next = NULL;
+    } else {
+        node->prev = NULL;
+        node->next = list->head;
+        list->head->prev = node;
+        list->head = node;
+    }
+    list->len++;
+}
+
 /* Returns a list iterator 'iter'. After the initialization every
  * call to listNext() will return the next element of the list.
  *
@@ -342,6 +371,23 @@ void listRotate(list *list) {
     list->head = tail;
 }
 
+/* Rotate the list removing the head node and inserting it to the tail.
+ * The node itself is moved, so pointers to it remain valid. */
+void listRotateHeadToTail(list *list) {
+    listNode *head = list->head;
+
+    if (listLength(list) <= 1) return;
+
+    /* Detach current head */
+    list->head = head->next;
+    list->head->prev = NULL;
+    /* Move it as tail */
+    list->tail->next = head;
+    head->next = NULL;
+    head->prev = list->tail;
+    list->tail = head;
+}
+
 /* Add all the elements of the list 'o' at the end of the
  * list 'l'. The list 'other' remains empty but otherwise valid. */
 void listJoin(list *l, list *o) {
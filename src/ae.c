@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -49,13 +50,17 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_IOURING
+    #include "ae_iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -70,7 +75,11 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventHeapLen = 0;
+    eventLoop->timeEventHeapSize = 0;
+    eventLoop->timeEventFired = NULL;
+    eventLoop->timeEventDeleted = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -135,6 +144,7 @@ void aeDeleteEventLoop(aeEventLoop *eventLoop) {
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
+    zfree(eventLoop->timeEventHeap);
     zfree(eventLoop);
 }
 
@@ -214,6 +224,74 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* Time events are kept in a binary min-heap ordered by fire time, so that
+ * the nearest timer is always at index 0. Every event remembers its own
+ * position in the heap, which makes removing an arbitrary event O(log(N)). */
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when_sec < b->when_sec ||
+           (a->when_sec == b->when_sec && a->when_ms < b->when_ms);
+}
+
+static void aeTimeHeapSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[i] = te;
+    te->heap_index = i;
+}
+
+static void aeTimeHeapSiftUp(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[i];
+
+    while (i > 0) {
+        int parent = (i-1)/2;
+        if (!aeTimeEventBefore(te,heap[parent])) break;
+        aeTimeHeapSet(eventLoop,i,heap[parent]);
+        i = parent;
+    }
+    aeTimeHeapSet(eventLoop,i,te);
+}
+
+static void aeTimeHeapSiftDown(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **heap = eventLoop->timeEventHeap;
+    aeTimeEvent *te = heap[i];
+    int len = eventLoop->timeEventHeapLen;
+
+    while (1) {
+        int child = i*2+1;
+        if (child >= len) break;
+        if (child+1 < len && aeTimeEventBefore(heap[child+1],heap[child]))
+            child++;
+        if (!aeTimeEventBefore(heap[child],te)) break;
+        aeTimeHeapSet(eventLoop,i,heap[child]);
+        i = child;
+    }
+    aeTimeHeapSet(eventLoop,i,te);
+}
+
+static void aeTimeHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventHeapLen == eventLoop->timeEventHeapSize) {
+        eventLoop->timeEventHeapSize = eventLoop->timeEventHeapSize ?
+                                       eventLoop->timeEventHeapSize*2 : 16;
+        eventLoop->timeEventHeap = zrealloc(eventLoop->timeEventHeap,
+            sizeof(aeTimeEvent*)*eventLoop->timeEventHeapSize);
+    }
+    aeTimeHeapSet(eventLoop,eventLoop->timeEventHeapLen,te);
+    eventLoop->timeEventHeapLen++;
+    aeTimeHeapSiftUp(eventLoop,te->heap_index);
+}
+
+static void aeTimeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int i = te->heap_index;
+    int last = --eventLoop->timeEventHeapLen;
+
+    te->heap_index = -1;
+    if (i != last) {
+        aeTimeEvent *moved = eventLoop->timeEventHeap[last];
+        aeTimeHeapSet(eventLoop,i,moved);
+        aeTimeHeapSiftUp(eventLoop,i);
+        aeTimeHeapSiftDown(eventLoop,moved->heap_index);
+    }
+}
+
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
@@ -228,17 +306,36 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next)
-        te->next->prev = te;
-    eventLoop->timeEventHead = te;
+    te->next = NULL;
+    aeTimeHeapInsert(eventLoop,te);
     return id;
 }
 
+/* Mark the timer with the specified ID as deleted. The finalizer is called
+ * (and the memory released) by the next processTimeEvents() call, so it is
+ * safe to delete a timer from inside its own callback.
+ *
+ * Looking up the ID is a scan of the heap array: deleting timers is rare
+ * compared to running the event loop, so we don't pay for an index. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
+    aeTimeEvent *te;
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventHeapLen; j++) {
+        te = eventLoop->timeEventHeap[j];
+        if (te->id == id) {
+            aeTimeHeapRemove(eventLoop,te);
+            te->id = AE_DELETED_EVENT_ID;
+            te->next = eventLoop->timeEventDeleted;
+            eventLoop->timeEventDeleted = te;
+            return AE_OK;
+        }
+    }
+
+    /* Timers fired in the current iteration are temporarily out of the
+     * heap: processTimeEvents() will move them to the deleted list. */
+    te = eventLoop->timeEventFired;
     while(te) {
         if (te->id == id) {
             te->id = AE_DELETED_EVENT_ID;
@@ -254,25 +351,11 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * This is O(1) since the nearest timer is the top of the heap. */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    if (eventLoop->timeEventHeapLen == 0) return NULL;
+    return eventLoop->timeEventHeap[0];
 }
 
 /* Process time events */
@@ -282,6 +365,15 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
     long long maxId;
     time_t now = time(NULL);
 
+    /* Finalize the events deleted since the last call. */
+    while(eventLoop->timeEventDeleted) {
+        te = eventLoop->timeEventDeleted;
+        eventLoop->timeEventDeleted = te->next;
+        if (te->finalizerProc)
+            te->finalizerProc(eventLoop, te->clientData);
+        zfree(te);
+    }
+
     /* If the system clock is moved to the future, and then set back to the
      * right value, time events may be delayed in a random way. Often this
      * means that scheduled operations will not be performed soon enough.
@@ -291,61 +383,57 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * processing events earlier is less dangerous than delaying them
      * indefinitely, and practice suggests it is. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        int j;
+
+        for (j = 0; j < eventLoop->timeEventHeapLen; j++)
+            eventLoop->timeEventHeap[j]->when_sec = 0;
+        /* Only the milliseconds are left to compare: rebuild the heap. */
+        for (j = eventLoop->timeEventHeapLen/2-1; j >= 0; j--)
+            aeTimeHeapSiftDown(eventLoop,j);
     }
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
+    /* Pop every timer that is due. Fired timers are parked in the fired
+     * list and only inserted back into the heap once we are done, so that
+     * a timer rescheduled with a zero period (or created by a callback with
+     * a zero delay) does not run again in this same iteration. */
     maxId = eventLoop->timeEventNextId-1;
-    while(te) {
+    while(eventLoop->timeEventHeapLen) {
         long now_sec, now_ms;
-        long long id;
+        int retval;
 
-        /* Remove events scheduled for deletion. */
-        if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev)
-                te->prev->next = te->next;
-            else
-                eventLoop->timeEventHead = te->next;
-            if (te->next)
-                te->next->prev = te->prev;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
-            continue;
-        }
+        te = eventLoop->timeEventHeap[0];
+        aeGetTime(&now_sec, &now_ms);
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms)) break;
+
+        aeTimeHeapRemove(eventLoop,te);
+        te->next = eventLoop->timeEventFired;
+        eventLoop->timeEventFired = te;
 
         /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
+         * this iteration. */
+        if (te->id > maxId) continue;
+
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (retval != AE_NOMORE) {
+            aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+        } else {
+            te->id = AE_DELETED_EVENT_ID;
         }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
+    }
 
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
-            }
+    while(eventLoop->timeEventFired) {
+        te = eventLoop->timeEventFired;
+        eventLoop->timeEventFired = te->next;
+        if (te->id == AE_DELETED_EVENT_ID) {
+            te->next = eventLoop->timeEventDeleted;
+            eventLoop->timeEventDeleted = te;
+        } else {
+            te->next = NULL;
+            aeTimeHeapInsert(eventLoop,te);
         }
-        te = te->next;
     }
     return processed;
 }
@@ -527,3 +615,157 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef REDIS_TEST
+#include <assert.h>
+
+#define UNUSED(x) (void)(x)
+
+static long long aeTestUstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+static int aeTestHeapIsValid(aeEventLoop *eventLoop) {
+    int j;
+    for (j = 0; j < eventLoop->timeEventHeapLen; j++) {
+        aeTimeEvent *te = eventLoop->timeEventHeap[j];
+        if (te->heap_index != j) return 0;
+        if (j && aeTimeEventBefore(te,eventLoop->timeEventHeap[(j-1)/2]))
+            return 0;
+    }
+    return 1;
+}
+
+static int aeTestCount(struct aeEventLoop *eventLoop, long long id,
+                       void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    (*(int*)clientData)++;
+    return 0; /* Run again ASAP. */
+}
+
+static int aeTestOnce(struct aeEventLoop *eventLoop, long long id,
+                      void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    (*(int*)clientData)++;
+    return AE_NOMORE;
+}
+
+static int aeTestDeleteSelf(struct aeEventLoop *eventLoop, long long id,
+                            void *clientData)
+{
+    (*(int*)clientData)++;
+    aeDeleteTimeEvent(eventLoop,id);
+    return 1000;
+}
+
+static void aeTestFinalizer(struct aeEventLoop *eventLoop, void *clientData) {
+    UNUSED(eventLoop);
+    (*(int*)clientData) += 100;
+}
+
+static void aeTestFreeLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventHeapLen; j++)
+        zfree(eventLoop->timeEventHeap[j]);
+    while(eventLoop->timeEventDeleted) {
+        aeTimeEvent *te = eventLoop->timeEventDeleted;
+        eventLoop->timeEventDeleted = te->next;
+        zfree(te);
+    }
+    aeDeleteEventLoop(eventLoop);
+}
+
+/* Benchmark one event loop iteration with 'idle' timers that never fire
+ * plus a single timer firing at every iteration. */
+static void aeTestBenchmark(int idle, int iterations) {
+    aeEventLoop *el = aeCreateEventLoop(64);
+    long long start, *ids = zmalloc(sizeof(long long)*idle);
+    int j, fired = 0;
+
+    start = aeTestUstime();
+    for (j = 0; j < idle; j++)
+        ids[j] = aeCreateTimeEvent(el,3600000+(rand()%3600000),
+                                   aeTestCount,&fired,NULL);
+    printf("  %d timers: create %.1f ns/op, ", idle,
+        idle ? (double)(aeTestUstime()-start)*1000/idle : 0);
+
+    aeCreateTimeEvent(el,0,aeTestCount,&fired,NULL);
+    start = aeTestUstime();
+    for (j = 0; j < iterations; j++)
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    printf("loop %.1f ns/iteration, ",
+        (double)(aeTestUstime()-start)*1000/iterations);
+    assert(fired == iterations);
+
+    start = aeTestUstime();
+    for (j = 0; j < idle && j < 1000; j++)
+        aeDeleteTimeEvent(el,ids[idle-1-j]);
+    printf("delete %.1f ns/op\n",
+        j ? (double)(aeTestUstime()-start)*1000/j : 0);
+    assert(aeTestHeapIsValid(el));
+
+    aeTestFreeLoop(el);
+    zfree(ids);
+}
+
+int aeTest(int argc, char *argv[]) {
+    aeEventLoop *el;
+    long long id;
+    int j, count = 0, once = 0, self = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    printf("Heap ordering: ");
+    el = aeCreateEventLoop(64);
+    for (j = 0; j < 1000; j++)
+        aeCreateTimeEvent(el,rand()%100000,aeTestOnce,&once,NULL);
+    assert(aeTestHeapIsValid(el));
+    for (j = 0; j < 1000; j += 2)
+        assert(aeDeleteTimeEvent(el,j) == AE_OK);
+    assert(el->timeEventHeapLen == 500);
+    assert(aeTestHeapIsValid(el));
+    for (j = 1; j < el->timeEventHeapLen; j++)
+        assert(!aeTimeEventBefore(el->timeEventHeap[j],
+                                  aeSearchNearestTimer(el)));
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    assert(aeTestHeapIsValid(el));
+    aeTestFreeLoop(el);
+    printf("OK\n");
+
+    printf("Firing semantics: ");
+    el = aeCreateEventLoop(64);
+    once = 0;
+    aeCreateTimeEvent(el,0,aeTestCount,&count,NULL);
+    aeCreateTimeEvent(el,0,aeTestOnce,&once,aeTestFinalizer);
+    aeCreateTimeEvent(el,0,aeTestDeleteSelf,&self,aeTestFinalizer);
+    id = aeCreateTimeEvent(el,0,aeTestOnce,&once,aeTestFinalizer);
+    assert(aeDeleteTimeEvent(el,id) == AE_OK);
+    assert(aeDeleteTimeEvent(el,id) == AE_ERR);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    /* A timer rescheduled with a zero period fires once per iteration, and
+     * a timer deleted before firing is only finalized. */
+    assert(count == 1);
+    assert(once == 101 && self == 1);
+    aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+    assert(count == 2);
+    /* Timers deleted by their own callback are finalized once each. */
+    assert(once == 201 && self == 101);
+    assert(el->timeEventHeapLen == 1);
+    aeTestFreeLoop(el);
+    printf("OK\n");
+
+    printf("Benchmark:\n");
+    aeTestBenchmark(0,1000000);
+    aeTestBenchmark(1000,1000000);
+    aeTestBenchmark(100000,1000000);
+    return 0;
+}
+#endif
@@ -83,8 +83,8 @@ typedef struct aeTimeEvent {
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *prev;
-    struct aeTimeEvent *next;
+    int heap_index; /* Position in the timers heap, -1 if not in the heap. */
+    struct aeTimeEvent *next; /* Link in the fired / deleted timers lists. */
 } aeTimeEvent;
 
 /* A fired event */
@@ -101,7 +101,11 @@ typedef struct aeEventLoop {
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap; /* Min-heap of timers by fire time. */
+    int timeEventHeapLen;        /* Number of timers in the heap. */
+    int timeEventHeapSize;       /* Allocated heap slots. */
+    aeTimeEvent *timeEventFired;   /* Timers fired in this iteration. */
+    aeTimeEvent *timeEventDeleted; /* Timers waiting to be finalized. */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -131,4 +135,8 @@ int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
 
+#ifdef REDIS_TEST
+int aeTest(int argc, char *argv[]);
+#endif
+
 #endif
@@ -0,0 +1,493 @@
+/* Linux io_uring based ae.c module
+ *
+ * Readiness is tracked with one-shot IORING_OP_POLL_ADD requests. Instead of
+ * issuing one epoll_ctl() per registration change, changes are queued and
+ * flushed with the same io_uring_enter() call that waits for completions,
+ * so arming, re-arming and waiting cost a single syscall per iteration.
+ *
+ * The ring is driven with the raw system calls and requires Linux 6.1 or
+ * greater: IORING_FEAT_EXT_ARG provides the wait timeout, and completions
+ * must be deferred (IORING_SETUP_DEFER_TASKRUN) to the moment we wait for
+ * them. Otherwise the kernel interrupts the process to run the completion
+ * work, and blocking reads with a SO_RCVTIMEO timeout, like the ones used by
+ * diskless replicas loading the RDB, fail with EINTR.
+ *
+ * When the ring can't be set up, because the kernel is older, io_uring is
+ * disabled (kernel.io_uring_disabled, seccomp filters of containers) or the
+ * locked memory limit is too low, the event loop falls back to epoll.
+ *
+ * Only the readiness notification goes through the ring: reads and writes
+ * are still performed by connection.c with read() and writev(), once the
+ * event loop reports the socket ready.
+ *
+ * Copyright (c) 2020, Redis Labs, Inc
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* The epoll backend, renamed, is the fallback when the ring can't be set
+ * up. */
+#define aeApiState aeApiEpollState
+#define aeApiCreate aeApiEpollCreate
+#define aeApiResize aeApiEpollResize
+#define aeApiFree aeApiEpollFree
+#define aeApiAddEvent aeApiEpollAddEvent
+#define aeApiDelEvent aeApiEpollDelEvent
+#define aeApiPoll aeApiEpollPoll
+#define aeApiName aeApiEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+
+#define AE_IOURING_MAX_ENTRIES 4096
+
+/* Set in eventLoop->flags when the loop uses the epoll fallback. */
+#define AE_IOURING_EPOLL (1<<8)
+
+/* A completion belongs to the poll request armed for 'fd' only if it
+ * carries the same generation: completions of canceled requests are
+ * recognized as stale and ignored. */
+#define AE_IOURING_USER_DATA(fd,gen) (((uint64_t)(gen) << 32) | (uint32_t)(fd))
+#define AE_IOURING_FD(ud) ((int)((ud) & 0xffffffff))
+#define AE_IOURING_GEN(ud) ((uint32_t)((ud) >> 32))
+
+typedef struct aeApiFdState {
+    int armed;     /* AE_ mask of the poll request in flight, 0 if none. */
+    uint32_t gen;  /* Generation of the poll request in flight. */
+    int dirty;     /* Already queued in the dirty list. */
+} aeApiFdState;
+
+typedef struct aeApiState {
+    int ringfd;
+    int enabled; /* The ring was enabled by the thread running the loop. */
+    unsigned entries;
+
+    /* Submission ring. */
+    void *sq_ptr;
+    size_t sq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned to_submit;
+
+    /* Completion ring. */
+    void *cq_ptr;
+    size_t cq_len;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Per fd state, and fds whose registration changed since the last
+     * aeApiPoll() call. */
+    aeApiFdState *fds;
+    int *dirty;
+    int numdirty;
+} aeApiState;
+
+/* The rings are shared memory: a forked child (for instance the one saving
+ * the RDB) must never queue requests, or it would corrupt the parent ring. */
+static int aeApiForkedChild = 0;
+static int aeApiAtForkInstalled = 0;
+
+static void aeApiAtForkChild(void) {
+    aeApiForkedChild = 1;
+}
+
+static int aeApiRingSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeApiRingEnter(int ringfd, unsigned to_submit,
+                          unsigned min_complete, unsigned flags,
+                          void *arg, size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, ringfd, to_submit,
+                         min_complete, flags, arg, argsz);
+}
+
+static int aeApiRingRegister(int ringfd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, ringfd, opcode, arg, nr_args);
+}
+
+/* With IORING_SETUP_SINGLE_ISSUER only one thread may submit requests: the
+ * ring is created disabled and enabled by the first submission, so that
+ * event loops created by a thread and run by another one work as well. */
+static int aeApiEnable(aeApiState *state) {
+    if (aeApiForkedChild) return -1;
+    if (state->enabled) return 0;
+    if (aeApiRingRegister(state->ringfd,IORING_REGISTER_ENABLE_RINGS,
+                          NULL,0) == -1) return -1;
+    state->enabled = 1;
+    return 0;
+}
+
+static void aeApiUnmapRing(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqes_len);
+    if (state->cq_ptr && state->cq_ptr != state->sq_ptr)
+        munmap(state->cq_ptr,state->cq_len);
+    if (state->sq_ptr) munmap(state->sq_ptr,state->sq_len);
+}
+
+static int aeApiMapRing(aeApiState *state, struct io_uring_params *p) {
+    state->sq_len = p->sq_off.array + p->sq_entries*sizeof(unsigned);
+    state->cq_len = p->cq_off.cqes + p->cq_entries*sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_len > state->sq_len) state->sq_len = state->cq_len;
+        state->cq_len = state->sq_len;
+    }
+
+    state->sq_ptr = mmap(NULL,state->sq_len,PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE,state->ringfd,
+                         IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) {
+        state->sq_ptr = NULL;
+        return -1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ptr = state->sq_ptr;
+    } else {
+        state->cq_ptr = mmap(NULL,state->cq_len,PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_POPULATE,state->ringfd,
+                             IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) {
+            state->cq_ptr = NULL;
+            return -1;
+        }
+    }
+    state->sqes_len = p->sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqes_len,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,state->ringfd,
+                       IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        return -1;
+    }
+
+    state->sq_head = (unsigned*)((char*)state->sq_ptr + p->sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_ptr + p->sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_ptr + p->sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_ptr + p->sq_off.array);
+    state->cq_head = (unsigned*)((char*)state->cq_ptr + p->cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_ptr + p->cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_ptr + p->cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ptr + p->cq_off.cqes);
+    return 0;
+}
+
+static int aeApiRingCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned entries = AE_IOURING_MAX_ENTRIES;
+
+    if (!state) return -1;
+    memset(state,0,sizeof(*state));
+    if ((unsigned)eventLoop->setsize < entries) entries = eventLoop->setsize;
+
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_DEFER_TASKRUN|IORING_SETUP_SINGLE_ISSUER|
+              IORING_SETUP_R_DISABLED;
+    state->ringfd = aeApiRingSetup(entries,&p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG) || aeApiMapRing(state,&p) == -1) {
+        aeApiUnmapRing(state);
+        close(state->ringfd);
+        zfree(state);
+        return -1;
+    }
+    state->entries = p.sq_entries;
+    if (!aeApiAtForkInstalled) {
+        pthread_atfork(NULL,NULL,aeApiAtForkChild);
+        aeApiAtForkInstalled = 1;
+    }
+    state->fds = zcalloc(sizeof(aeApiFdState)*eventLoop->setsize);
+    state->dirty = zmalloc(sizeof(int)*eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiRingResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int j;
+
+    state->fds = zrealloc(state->fds,sizeof(aeApiFdState)*setsize);
+    for (j = eventLoop->setsize; j < setsize; j++)
+        memset(&state->fds[j],0,sizeof(aeApiFdState));
+    state->dirty = zrealloc(state->dirty,sizeof(int)*setsize);
+    return 0;
+}
+
+static void aeApiRingFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    aeApiUnmapRing(state);
+    close(state->ringfd);
+    zfree(state->fds);
+    zfree(state->dirty);
+    zfree(state);
+}
+
+/* Submit the queued SQEs without waiting, used when the ring is full. */
+static void aeApiFlushSubmissions(aeApiState *state) {
+    if (aeApiEnable(state) == -1) return;
+    while (state->to_submit) {
+        int retval = aeApiRingEnter(state->ringfd,state->to_submit,0,0,NULL,0);
+        if (retval < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        state->to_submit -= retval;
+    }
+}
+
+static struct io_uring_sqe *aeApiGetSqe(aeApiState *state) {
+    unsigned head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+    unsigned tail = *state->sq_tail;
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (aeApiForkedChild) return NULL;
+    if (tail - head >= state->entries) {
+        aeApiFlushSubmissions(state);
+        head = __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+        if (tail - head >= state->entries) return NULL;
+    }
+    idx = tail & *state->sq_mask;
+    sqe = &state->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    state->sq_array[idx] = idx;
+    __atomic_store_n(state->sq_tail,tail+1,__ATOMIC_RELEASE);
+    state->to_submit++;
+    return sqe;
+}
+
+static void aeApiMarkDirty(aeApiState *state, int fd) {
+    if (state->fds[fd].dirty) return;
+    state->fds[fd].dirty = 1;
+    state->dirty[state->numdirty++] = fd;
+}
+
+/* Queue the cancellation of the poll request in flight for 'fd', if any.
+ * Return -1 if the ring is full. */
+static int aeApiCancelFd(aeApiState *state, int fd) {
+    aeApiFdState *fs = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+
+    if (!fs->armed) return 0;
+    if ((sqe = aeApiGetSqe(state)) == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = AE_IOURING_USER_DATA(fd,fs->gen);
+    sqe->user_data = AE_IOURING_USER_DATA(fd,0);
+    fs->armed = 0;
+    return 0;
+}
+
+/* Bring the poll request in flight for 'fd' in sync with the registered
+ * mask: cancel the old request if the mask changed, then arm a new one. */
+static void aeApiSyncFd(aeEventLoop *eventLoop, int fd) {
+    aeApiState *state = eventLoop->apidata;
+    aeApiFdState *fs = &state->fds[fd];
+    int mask = eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE);
+    struct io_uring_sqe *sqe;
+
+    fs->dirty = 0;
+    if (fs->armed == mask) return;
+    if (aeApiCancelFd(state,fd) == -1) goto retry;
+    if (mask == AE_NONE) return;
+
+    if ((sqe = aeApiGetSqe(state)) == NULL) goto retry;
+    fs->gen++;
+    if (fs->gen == 0) fs->gen++; /* Generation 0 tags POLL_REMOVE requests. */
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & AE_READABLE) sqe->poll_events |= POLLIN;
+    if (mask & AE_WRITABLE) sqe->poll_events |= POLLOUT;
+    sqe->user_data = AE_IOURING_USER_DATA(fd,fs->gen);
+    fs->armed = mask;
+    return;
+
+retry:
+    /* The ring is full and could not be flushed: try again at the next
+     * iteration. */
+    aeApiMarkDirty(state,fd);
+}
+
+static int aeApiRingAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    AE_NOTUSED(mask);
+    /* The new mask is stored by the caller after we return: the poll
+     * request is armed lazily by aeApiPoll(). */
+    aeApiMarkDirty(state,fd);
+    return 0;
+}
+
+static void aeApiRingDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int mask = eventLoop->events[fd].mask & (~delmask);
+
+    /* When no event is left the fd is likely about to be closed, and its
+     * number reused by a new file before the next aeApiPoll(): cancel the
+     * request now, since it references the old file. */
+    if (!(mask & (AE_READABLE|AE_WRITABLE)) &&
+        aeApiCancelFd(state,fd) == 0) return;
+    aeApiMarkDirty(state,fd);
+}
+
+static int aeApiRingPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int numdirty = state->numdirty, numevents = 0, j, retval;
+    unsigned head, tail;
+
+    /* Arm the poll requests of the fds registered, modified or fired
+     * since the last call. New entries may be appended to the dirty list
+     * while we iterate, they are processed at the next iteration. */
+    state->numdirty = 0;
+    for (j = 0; j < numdirty; j++) aeApiSyncFd(eventLoop,state->dirty[j]);
+
+    memset(&arg,0,sizeof(arg));
+    arg.sigmask_sz = _NSIG/8;
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    if (aeApiEnable(state) == -1) return 0;
+
+    /* Submit and wait with a single system call. Don't wait if there are
+     * completions already queued. */
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    retval = aeApiRingEnter(state->ringfd,state->to_submit,
+                            head == tail ? 1 : 0,
+                            IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                            &arg,sizeof(arg));
+    if (retval >= 0) state->to_submit -= retval;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+        int fd = AE_IOURING_FD(cqe->user_data);
+        uint32_t gen = AE_IOURING_GEN(cqe->user_data);
+        aeApiFdState *fs;
+        int mask = 0;
+
+        head++;
+        if (gen == 0 || fd < 0 || fd >= eventLoop->setsize) continue;
+        fs = &state->fds[fd];
+        if (!fs->armed || fs->gen != gen) continue; /* Stale completion. */
+
+        /* Poll requests are one-shot: re-arm it at the next iteration, so
+         * that the usual level triggered semantic is preserved. */
+        fs->armed = 0;
+        aeApiMarkDirty(state,fd);
+
+        if (cqe->res < 0) {
+            mask = AE_READABLE|AE_WRITABLE;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_READABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE|AE_READABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+/* Set once an event loop fell back to epoll, see aeApiName(). */
+static int aeApiEpollFallback = 0;
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    if (aeApiRingCreate(eventLoop) == 0) return 0;
+    if (aeApiEpollCreate(eventLoop) == -1) return -1;
+    eventLoop->flags |= AE_IOURING_EPOLL;
+    aeApiEpollFallback = 1;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    if (eventLoop->flags & AE_IOURING_EPOLL)
+        return aeApiEpollResize(eventLoop,setsize);
+    return aeApiRingResize(eventLoop,setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (eventLoop->flags & AE_IOURING_EPOLL)
+        aeApiEpollFree(eventLoop);
+    else
+        aeApiRingFree(eventLoop);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (eventLoop->flags & AE_IOURING_EPOLL)
+        return aeApiEpollAddEvent(eventLoop,fd,mask);
+    return aeApiRingAddEvent(eventLoop,fd,mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    if (eventLoop->flags & AE_IOURING_EPOLL)
+        aeApiEpollDelEvent(eventLoop,fd,delmask);
+    else
+        aeApiRingDelEvent(eventLoop,fd,delmask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    if (eventLoop->flags & AE_IOURING_EPOLL)
+        return aeApiEpollPoll(eventLoop,tvp);
+    return aeApiRingPoll(eventLoop,tvp);
+}
+
+/* The name reported by INFO: the main event loop is the first one created,
+ * so it is "epoll" if the server runs with the fallback. */
+static char *aeApiName(void) {
+    return aeApiEpollFallback ? aeApiEpollName() : "io_uring";
+}
@@ -0,0 +1,221 @@
+/* AES-NI based hash function for the dictionary keys.
+ *
+ * On CPUs with the AES instructions this is used in place of SipHash 1-2
+ * (see siphash.c) by dictGenHashFunction(), since hashing the key is a
+ * big part of the cost of a lookup when keys are short, that is the common
+ * case. The function is keyed with the same 16 bytes random seed, so the
+ * hash values can't be predicted by a client that does not know the seed.
+ *
+ * Keys up to 16 bytes, the vast majority of the keys, are loaded into a
+ * single block that is encrypted with four AES rounds under the secret
+ * key: the transformation is a keyed permutation of the key bytes and
+ * its length, so different keys can collide only when the two 64 bit
+ * halves of the result are folded together. Longer keys are absorbed 16
+ * bytes at a time with two rounds per block, the last block overlapping
+ * the previous one, followed by two more rounds. This is not a
+ * cryptographic MAC like SipHash is, but it is believed to be enough to
+ * make hash flooding impractical when the seed is secret.
+ *
+ * The hash values are only used inside the process and are never
+ * persisted, so it is fine for them to change with the CPU or the
+ * function in use.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(NO_AESHASH)
+#define HAVE_AESHASH 1
+#endif
+
+#ifdef HAVE_AESHASH
+#include <immintrin.h>
+
+#define AESHASH_TARGET __attribute__((target("aes,sse2")))
+
+/* Return non zero if the CPU we are running on has the AES instructions. */
+int aeshash_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes");
+}
+
+/* Load a block of 'len' bytes (at most 16), padded with zeroes. We don't
+ * read past the end of the key, it may be at the end of a page. */
+static inline __m128i aeshashLoadPartial(const uint8_t *p, size_t len) {
+    uint8_t buf[16] = {0};
+    memcpy(buf,p,len);
+    return _mm_loadu_si128((const __m128i*)buf);
+}
+
+/* Turn A-Z into a-z, without caring about the locale, like siptlw(). */
+static inline __m128i aeshashToLower(__m128i b) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(b,_mm_set1_epi8('A'-1)),
+                                  _mm_cmplt_epi8(b,_mm_set1_epi8('Z'+1)));
+    return _mm_add_epi8(b,_mm_and_si128(upper,_mm_set1_epi8('a'-'A')));
+}
+
+static inline AESHASH_TARGET uint64_t aeshashGeneric(const uint8_t *in,
+    size_t inlen, const uint8_t *k, int nocase)
+{
+    __m128i k1 = _mm_loadu_si128((const __m128i*)k);
+    /* The second round key is derived from the seed, swapping its halves
+     * and mixing in the fractional part of pi. */
+    __m128i k2 = _mm_xor_si128(_mm_shuffle_epi32(k1,0x4e),
+        _mm_set_epi64x(0x243f6a8885a308d3LL,0x13198a2e03707344LL));
+    __m128i h = _mm_xor_si128(k1,_mm_set_epi64x(0,(long long)inlen));
+    __m128i b;
+
+    if (inlen <= 16) {
+        b = aeshashLoadPartial(in,inlen);
+        if (nocase) b = aeshashToLower(b);
+        h = _mm_aesenc_si128(_mm_xor_si128(h,b),k2);
+        h = _mm_aesenc_si128(h,k1);
+    } else {
+        const uint8_t *last = in+inlen-16;
+        while (in < last) {
+            b = _mm_loadu_si128((const __m128i*)in);
+            if (nocase) b = aeshashToLower(b);
+            h = _mm_aesenc_si128(_mm_xor_si128(h,b),k2);
+            h = _mm_aesenc_si128(h,k1);
+            in += 16;
+        }
+        b = _mm_loadu_si128((const __m128i*)last);
+        if (nocase) b = aeshashToLower(b);
+        h = _mm_aesenc_si128(_mm_xor_si128(h,b),k2);
+        h = _mm_aesenc_si128(h,k1);
+    }
+    h = _mm_aesenc_si128(h,k2);
+    h = _mm_aesenc_si128(h,k1);
+    return (uint64_t)_mm_cvtsi128_si64(h) ^
+           (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(h,h));
+}
+
+AESHASH_TARGET uint64_t aeshash(const uint8_t *in, const size_t inlen,
+                                const uint8_t *k)
+{
+    return aeshashGeneric(in,inlen,k,0);
+}
+
+AESHASH_TARGET uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen,
+                                       const uint8_t *k)
+{
+    return aeshashGeneric(in,inlen,k,1);
+}
+
+#else
+
+/* Not an x86_64 build, or disabled with "make USE_AESHASH=no": the
+ * functions are never called since aeshash_supported() returns zero. */
+int aeshash_supported(void) {
+    return 0;
+}
+
+uint64_t aeshash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    (void)in; (void)inlen; (void)k;
+    return 0;
+}
+
+uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen,
+                        const uint8_t *k)
+{
+    (void)in; (void)inlen; (void)k;
+    return 0;
+}
+
+#endif
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+/* ASCII only tolower(), the reference of the nocase variant. */
+static uint8_t aeshashTestLower(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c+('a'-'A') : c;
+}
+
+int aeshashTest(int argc, char *argv[]) {
+    (void)argc;
+    (void)argv;
+    uint8_t buf[256+16], copy[256+16], lower[256], seed[16], seed2[16];
+    int errors = 0, flips = 0, bits = 0;
+
+    if (!aeshash_supported()) {
+        printf("aeshash: not supported by this build or CPU, skipped\n");
+        return 0;
+    }
+    for (int j = 0; j < 16; j++) seed[j] = rand();
+    memcpy(seed2,seed,16);
+    seed2[rand() % 16] ^= 1 << (rand() % 8);
+
+    for (int j = 0; j < 10000; j++) {
+        size_t len = j < 512 ? (size_t)j % 257 : (size_t)rand() % 257;
+        size_t off = rand() % 16;
+        uint64_t h;
+
+        /* Random bytes, with many letters to exercise the nocase path. */
+        for (size_t i = 0; i < len; i++)
+            buf[off+i] = rand() & 1 ? "aZ@[`{Az"[rand() % 8] : rand();
+        h = aeshash(buf+off,len,seed);
+
+        /* The hash depends on the content only, not on the alignment. */
+        memcpy(copy+15-off,buf+off,len);
+        if (aeshash(copy+15-off,len,seed) != h) errors++;
+
+        /* The nocase variant hashes the ASCII lowercase version. */
+        for (size_t i = 0; i < len; i++)
+            lower[i] = aeshashTestLower(buf[off+i]);
+        if (aeshash_nocase(buf+off,len,seed) != aeshash(lower,len,seed))
+            errors++;
+
+        /* Any change of a bit of the seed, of a bit of the input or of the
+         * length must change the hash. */
+        if (aeshash(buf+off,len,seed2) == h) errors++;
+        if (len) {
+            size_t bit = rand() % (len*8);
+            buf[off+bit/8] ^= 1 << (bit%8);
+            uint64_t h2 = aeshash(buf+off,len,seed);
+            if (h2 == h) errors++;
+            bits += __builtin_popcountll(h^h2);
+            flips++;
+            buf[off+bit/8] ^= 1 << (bit%8);
+            if (len < 256 && aeshash(buf+off,len+1,seed) == h) errors++;
+            if (aeshash(buf+off,len-1,seed) == h) errors++;
+        }
+    }
+
+    /* A single bit flip should change about half of the 64 bits. */
+    double avalanche = (double)bits/flips;
+    if (avalanche < 28 || avalanche > 36) errors++;
+    printf("aeshash: %s (%.2f bits changed per input bit flip)\n",
+        errors ? "FAILED" : "OK", avalanche);
+    return errors != 0;
+}
+#endif
@@ -476,7 +476,22 @@ static int anetV6Only(char *err, int s) {
     return ANET_OK;
 }
 
-static int _anetTcpServer(char *err, int port, char *bindaddr, int af, int backlog)
+static int anetSetReusePort(char *err, int fd) {
+#ifdef SO_REUSEPORT
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+        return ANET_ERR;
+    }
+    return ANET_OK;
+#else
+    ((void) fd);
+    anetSetError(err, "SO_REUSEPORT is not supported");
+    return ANET_ERR;
+#endif
+}
+
+static int _anetTcpServer(char *err, int port, char *bindaddr, int af, int backlog, int flags)
 {
     int s = -1, rv;
     char _port[6];  /* strlen("65535") */
@@ -498,6 +513,8 @@ static int _anetTcpServer(char *err, int port, char *bindaddr, int af, int backl
 
         if (af == AF_INET6 && anetV6Only(err,s) == ANET_ERR) goto error;
         if (anetSetReuseAddr(err,s) == ANET_ERR) goto error;
+        if (flags & ANET_REUSEPORT && anetSetReusePort(err,s) == ANET_ERR)
+            goto error;
         if (anetListen(err,s,p->ai_addr,p->ai_addrlen,backlog) == ANET_ERR) s = ANET_ERR;
         goto end;
     }
@@ -516,12 +533,25 @@ end:
 
 int anetTcpServer(char *err, int port, char *bindaddr, int backlog)
 {
-    return _anetTcpServer(err, port, bindaddr, AF_INET, backlog);
+    return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, ANET_NONE);
 }
 
 int anetTcp6Server(char *err, int port, char *bindaddr, int backlog)
 {
-    return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog);
+    return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, ANET_NONE);
+}
+
+/* Like anetTcpServer() and anetTcp6Server(), but 'flags' can be
+ * ANET_REUSEPORT, so that many sockets can listen to the same address and
+ * port, the kernel balancing the incoming connections among them. */
+int anetTcpServerWithFlags(char *err, int port, char *bindaddr, int backlog, int flags)
+{
+    return _anetTcpServer(err, port, bindaddr, AF_INET, backlog, flags);
+}
+
+int anetTcp6ServerWithFlags(char *err, int port, char *bindaddr, int backlog, int flags)
+{
+    return _anetTcpServer(err, port, bindaddr, AF_INET6, backlog, flags);
 }
 
 int anetUnixServer(char *err, char *path, mode_t perm, int backlog)
@@ -30,6 +30,7 @@
 #include "server.h"
 #include "bio.h"
 #include "rio.h"
+#include "atomicvar.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -42,6 +43,11 @@
 
 void aofUpdateCurrentSize(void);
 void aofClosePipes(void);
+ssize_t aofWrite(int fd, const char *buf, size_t len);
+void aofWriterDrain(void);
+
+#define AOF_WRITE_LOG_ERROR_RATE 30 /* Seconds between errors logging. */
+void aof_background_fsync_and_close(int fd);
 
 /* ----------------------------------------------------------------------------
  * AOF rewrite buffer implementation.
@@ -193,6 +199,278 @@ ssize_t aofRewriteBufferWrite(int fd) {
     return count;
 }
 
+/* ----------------------------------------------------------------------------
+ * Multi part AOF
+ *
+ * When aof-multi-part is enabled the AOF is not a single file anymore, but
+ * a base file, produced by the latest rewrite, followed by a sequence of
+ * increment files where the commands are appended. A manifest lists the
+ * files that are part of the AOF, in the order they must be loaded:
+ *
+ *   file appendonly.aof.5.base seq 5 type b
+ *   file appendonly.aof.5.incr seq 5 type i
+ *   file appendonly.aof.6.incr seq 6 type i
+ *
+ * When a rewrite starts the parent switches the writes to a new increment
+ * and the child writes only the new base: there is no need to accumulate
+ * the differences in the rewrite buffer nor to send them to the child, and
+ * when the child is done the parent just publishes a new manifest and
+ * removes the files it no longer references.
+ * ------------------------------------------------------------------------- */
+
+sds aofGetBaseName(long long seq) {
+    return sdscatprintf(sdsempty(),"%s.%lld.base",server.aof_filename,seq);
+}
+
+sds aofGetIncrName(long long seq) {
+    return sdscatprintf(sdsempty(),"%s.%lld.incr",server.aof_filename,seq);
+}
+
+sds aofGetManifestName(void) {
+    return sdscatprintf(sdsempty(),"%s.manifest",server.aof_filename);
+}
+
+/* Atomically replace the manifest with one listing the current base and
+ * increments. Returns C_OK on success, otherwise C_ERR is returned and the
+ * old manifest is left untouched. */
+int aofWriteManifest(void) {
+    char tmpfile[256];
+    sds manifest = sdsnew("# Redis multi part AOF manifest\n");
+    sds filename;
+    int fd;
+
+    if (server.aof_base_name) {
+        long long seq = 0;
+        /* A base coming from a single file AOF has no sequence. */
+        if (strcmp(server.aof_base_name,server.aof_filename))
+            seq = strtoll(server.aof_base_name+strlen(server.aof_filename)+1,
+                          NULL,10);
+        manifest = sdscatprintf(manifest,"file %s seq %lld type b\n",
+            server.aof_base_name,seq);
+    }
+    if (server.aof_incr_first) {
+        for (long long seq = server.aof_incr_first; seq <= server.aof_seq;
+             seq++)
+        {
+            sds incr = aofGetIncrName(seq);
+            manifest = sdscatprintf(manifest,"file %s seq %lld type i\n",
+                incr,seq);
+            sdsfree(incr);
+        }
+    }
+
+    snprintf(tmpfile,sizeof(tmpfile),"temp-manifest-%d.aof",(int) getpid());
+    fd = open(tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (fd == -1) goto werr;
+    if (aofWrite(fd,manifest,sdslen(manifest)) != (ssize_t)sdslen(manifest) ||
+        redis_fsync(fd) == -1)
+    {
+        close(fd);
+        unlink(tmpfile);
+        goto werr;
+    }
+    close(fd);
+
+    filename = aofGetManifestName();
+    if (bioRenameFile(tmpfile,filename) == -1) {
+        unlink(tmpfile);
+        sdsfree(filename);
+        goto werr;
+    }
+    sdsfree(filename);
+    sdsfree(manifest);
+    return C_OK;
+
+werr:
+    serverLog(LL_WARNING,"Error writing the AOF manifest: %s",
+        strerror(errno));
+    sdsfree(manifest);
+    return C_ERR;
+}
+
+/* Load the manifest, if any, populating the base and increments fields.
+ * When there is no manifest but a single file AOF exists, it is used as
+ * base so that switching to the multi part AOF doesn't lose the data. */
+void aofLoadManifest(void) {
+    sds filename = aofGetManifestName();
+    FILE *fp = fopen(filename,"r");
+    char buf[1024];
+    int linenum = 0;
+    long long last_incr = 0;
+    struct redis_stat sb;
+
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            serverLog(LL_WARNING,"Fatal error: can't open the AOF manifest "
+                "%s for reading: %s", filename, strerror(errno));
+            exit(1);
+        }
+        if (redis_stat(server.aof_filename,&sb) == 0) {
+            serverLog(LL_NOTICE,"No AOF manifest found: using the single "
+                "file AOF %s as base", server.aof_filename);
+            server.aof_base_name = sdsnew(server.aof_filename);
+        }
+        sdsfree(filename);
+        return;
+    }
+
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        sds line = sdstrim(sdsnew(buf)," \t\r\n");
+        sds *argv, expected;
+        int argc;
+        long long seq;
+        char *eptr;
+
+        linenum++;
+        if (line[0] == '#' || line[0] == '\0') {
+            sdsfree(line);
+            continue;
+        }
+        argv = sdssplitargs(line,&argc);
+        sdsfree(line);
+        if (argv == NULL || argc != 6 || strcmp(argv[0],"file") ||
+            strcmp(argv[2],"seq") || strcmp(argv[4],"type"))
+            goto fmterr;
+        seq = strtoll(argv[3],&eptr,10);
+        if (*eptr != '\0' || seq < 0) goto fmterr;
+
+        if (!strcmp(argv[5],"b")) {
+            if (server.aof_base_name || server.aof_incr_first) goto fmterr;
+            server.aof_base_name = sdsnew(argv[1]);
+        } else if (!strcmp(argv[5],"i")) {
+            /* Increments are contiguous and follow the base. */
+            if (seq == 0 || (last_incr && seq != last_incr+1)) goto fmterr;
+            expected = aofGetIncrName(seq);
+            if (strcmp(expected,argv[1])) {
+                sdsfree(expected);
+                goto fmterr;
+            }
+            sdsfree(expected);
+            if (!server.aof_incr_first) server.aof_incr_first = seq;
+            last_incr = seq;
+        } else {
+            goto fmterr;
+        }
+        if (seq > server.aof_seq) server.aof_seq = seq;
+        sdsfreesplitres(argv,argc);
+        continue;
+
+fmterr:
+        if (argv) sdsfreesplitres(argv,argc);
+        serverLog(LL_WARNING,"Fatal error: invalid AOF manifest %s at "
+            "line %d", filename, linenum);
+        exit(1);
+    }
+    /* The last increment is the one receiving the writes. */
+    if (last_incr && last_incr != server.aof_seq) {
+        serverLog(LL_WARNING,"Fatal error: invalid AOF manifest %s: the "
+            "base is newer than the increments", filename);
+        exit(1);
+    }
+    fclose(fp);
+    sdsfree(filename);
+}
+
+/* Switch the AOF writes to a new increment file. When the AOF is on the
+ * new increment is published in the manifest before any write reaches it,
+ * so that a restart will find it. Returns C_ERR if the switch was not
+ * possible, in which case the old increment, if any, is still in use. */
+int aofOpenNewIncr(void) {
+    long long old_incr_first = server.aof_incr_first;
+    int newfd, oldfd = server.aof_fd;
+    sds filename;
+
+    /* Whatever was accumulated so far belongs to the old increment. */
+    if (oldfd != -1) {
+        flushAppendOnlyFile(1);
+        if (sdslen(server.aof_buf) != 0) {
+            serverLog(LL_WARNING,"Can't switch to a new AOF increment: "
+                "the AOF buffer can't be flushed to the current one");
+            return C_ERR;
+        }
+    }
+
+    filename = aofGetIncrName(server.aof_seq+1);
+    newfd = open(filename,O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,0644);
+    if (newfd == -1) {
+        serverLog(LL_WARNING,"Can't open the AOF increment %s: %s",
+            filename, strerror(errno));
+        sdsfree(filename);
+        return C_ERR;
+    }
+
+    server.aof_seq++;
+    if (!server.aof_incr_first) server.aof_incr_first = server.aof_seq;
+    if (server.aof_state == AOF_ON && aofWriteManifest() == C_ERR) {
+        server.aof_seq--;
+        server.aof_incr_first = old_incr_first;
+        close(newfd);
+        unlink(filename);
+        sdsfree(filename);
+        return C_ERR;
+    }
+    sdsfree(filename);
+
+    server.aof_fd = newfd;
+    server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
+    server.aof_fsync_offset = server.aof_current_size;
+    if (oldfd != -1) {
+        if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
+            aof_background_fsync_and_close(oldfd);
+        else
+            bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
+    }
+    return C_OK;
+}
+
+/* Called at startup when aof-multi-part is enabled: load the manifest and,
+ * if the AOF is on, open the increment receiving the writes. */
+void aofInitMultiPart(void) {
+    aofLoadManifest();
+    if (server.aof_state != AOF_ON) return;
+
+    if (server.aof_incr_first) {
+        sds filename = aofGetIncrName(server.aof_seq);
+        server.aof_fd = open(filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+        if (server.aof_fd == -1) {
+            serverLog(LL_WARNING,"Can't open the AOF increment %s: %s",
+                filename, strerror(errno));
+            exit(1);
+        }
+        sdsfree(filename);
+    } else if (aofOpenNewIncr() == C_ERR) {
+        exit(1);
+    }
+}
+
+/* Remove a file that is no longer part of the AOF. The last reference to
+ * the file is closed in a background thread, so that the actual deletion
+ * of a big file doesn't block the server. */
+void aofUnlinkInBackground(char *filename) {
+    if (bioUnlinkFile(filename) == -1 && errno != ENOENT)
+        serverLog(LL_WARNING,"Can't remove the old AOF file %s: %s",
+            filename, strerror(errno));
+}
+
+/* Return the size of all the files that are part of the AOF. */
+off_t aofMultiPartSize(void) {
+    struct redis_stat sb;
+    off_t size = 0;
+
+    if (server.aof_base_name && redis_stat(server.aof_base_name,&sb) == 0)
+        size += sb.st_size;
+    if (server.aof_incr_first) {
+        for (long long seq = server.aof_incr_first; seq <= server.aof_seq;
+             seq++)
+        {
+            sds filename = aofGetIncrName(seq);
+            if (redis_stat(filename,&sb) == 0) size += sb.st_size;
+            sdsfree(filename);
+        }
+    }
+    return size;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF file implementation
  * ------------------------------------------------------------------------- */
@@ -207,6 +485,13 @@ int aofFsyncInProgress(void) {
  * file descriptor (the one of the AOF file) in another thread. */
 void aof_background_fsync(int fd) {
     bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,NULL);
+    server.aof_fsync_pending_offset = server.aof_written_offset;
+}
+
+/* Like aof_background_fsync(), but the file is closed after the fsync. */
+void aof_background_fsync_and_close(int fd) {
+    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,(void*)1,NULL);
+    server.aof_fsync_pending_offset = server.aof_written_offset;
 }
 
 /* Kills an AOFRW child process if exists */
@@ -226,7 +511,7 @@ void killAppendOnlyChild(void) {
     server.aof_child_pid = -1;
     server.aof_rewrite_time_start = -1;
     /* Close pipes used for IPC between the two processes. */
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     closeChildInfoPipe();
     updateDictResizePolicy();
 }
@@ -238,6 +523,7 @@ void stopAppendOnly(void) {
     flushAppendOnlyFile(1);
     redis_fsync(server.aof_fd);
     close(server.aof_fd);
+    server.aof_fsynced_offset = server.aof_written_offset;
 
     server.aof_fd = -1;
     server.aof_selected_db = -1;
@@ -249,11 +535,14 @@ void stopAppendOnly(void) {
  * at runtime using the CONFIG command. */
 int startAppendOnly(void) {
     char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
-    int newfd;
+    int newfd = -1;
 
-    newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
     serverAssert(server.aof_state == AOF_OFF);
-    if (newfd == -1) {
+    /* With a multi part AOF the increment receiving the writes is opened
+     * by the rewrite itself, just before forking the child. */
+    if (!server.aof_multi_part)
+        newfd = open(server.aof_filename,O_WRONLY|O_APPEND|O_CREAT,0644);
+    if (!server.aof_multi_part && newfd == -1) {
         char *cwdp = getcwd(cwd,MAXPATHLEN);
 
         serverLog(LL_WARNING,
@@ -264,6 +553,7 @@ int startAppendOnly(void) {
             strerror(errno));
         return C_ERR;
     }
+    server.aof_state = AOF_WAIT_REWRITE;
     if (hasActiveChildProcess() && server.aof_child_pid == -1) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already another background operation. An AOF background was scheduled to start when possible.");
@@ -276,16 +566,16 @@ int startAppendOnly(void) {
             killAppendOnlyChild();
         }
         if (rewriteAppendOnlyFileBackground() == C_ERR) {
-            close(newfd);
+            server.aof_state = AOF_OFF;
+            if (newfd != -1) close(newfd);
             serverLog(LL_WARNING,"Redis needs to enable the AOF but can't trigger a background AOF rewrite operation. Check the above logs for more info about the error.");
             return C_ERR;
         }
     }
     /* We correctly switched on AOF, now wait for the rewrite to be complete
      * in order to append data on disk. */
-    server.aof_state = AOF_WAIT_REWRITE;
     server.aof_last_fsync = server.unixtime;
-    server.aof_fd = newfd;
+    if (!server.aof_multi_part) server.aof_fd = newfd;
     return C_OK;
 }
 
@@ -315,6 +605,264 @@ ssize_t aofWrite(int fd, const char *buf, size_t len) {
     return totwritten;
 }
 
+/* ----------------------------------------------------------------------------
+ * AOF background writer
+ *
+ * When aof-background-write is enabled (and the fsync policy is not
+ * 'always') the main thread doesn't call write(2) against the AOF: the AOF
+ * buffer is instead handed, as it is, to a dedicated thread using a bounded
+ * ring with a single producer (the main thread, moving the head) and a
+ * single consumer (the writer thread, moving the tail). A slow disk then
+ * stalls the writer thread, while the main thread keeps serving clients
+ * and accumulates the new writes in the AOF buffer if the ring is full.
+ *
+ * Every time the file descriptor of the AOF is going to change, or the
+ * data must be on the file before going on, aofWriterDrain() is called to
+ * wait for the ring to be empty.
+ * ------------------------------------------------------------------------- */
+
+#define AOF_WRITER_RING_SIZE 256 /* Must be a power of two. */
+#define AOF_WRITER_RETRY_US 100000 /* Sleep between failed writes. */
+
+typedef struct aofWriterChunk {
+    int fd;         /* The AOF file descriptor when the chunk was queued. */
+    sds buf;        /* Data to write, freed by the writer thread. */
+} aofWriterChunk;
+
+static aofWriterChunk aof_writer_ring[AOF_WRITER_RING_SIZE];
+static unsigned long aof_writer_head = 0;   /* Next slot to fill. */
+static unsigned long aof_writer_tail = 0;   /* Next slot to write. */
+static unsigned long long aof_writer_written = 0; /* Bytes written so far. */
+static unsigned long long aof_writer_dropped = 0; /* Bytes discarded. */
+static int aof_writer_errno = 0;    /* Errno of the failing write, or 0. */
+static int aof_writer_discard = 0;  /* Drop the queued chunks. */
+pthread_mutex_t aof_writer_head_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aof_writer_tail_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aof_writer_written_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aof_writer_dropped_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aof_writer_errno_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t aof_writer_discard_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only used to sleep when there is nothing to do, and to wake up. */
+static pthread_mutex_t aof_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aof_writer_newdata_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aof_writer_drained_cond = PTHREAD_COND_INITIALIZER;
+static int aof_writer_started = 0;
+
+/* Main thread side: bytes queued so far, and the part of the written bytes
+ * already accounted in server.aof_written_offset. */
+static unsigned long long aof_writer_queued = 0;
+static unsigned long long aof_writer_collected = 0;
+
+/* Return true if the AOF buffer is written by the writer thread. */
+int aofWriterActive(void) {
+    return aof_writer_started && server.aof_fsync != AOF_FSYNC_ALWAYS;
+}
+
+/* Write a chunk, retrying as long as the write fails, unless the main
+ * thread asks to discard the queued data. */
+void aofWriterWriteChunk(aofWriterChunk *chunk) {
+    size_t len = sdslen(chunk->buf), done = 0;
+    int discard;
+
+    while (done < len) {
+        ssize_t nwritten = aofWrite(chunk->fd,chunk->buf+done,len-done);
+
+        if (nwritten > 0) {
+            done += nwritten;
+            atomicIncr(aof_writer_written,nwritten);
+        }
+        if (done == len) break;
+        atomicSetWithSync(aof_writer_errno,nwritten == -1 ? errno : ENOSPC);
+        atomicGetWithSync(aof_writer_discard,discard);
+        if (discard) {
+            atomicIncr(aof_writer_dropped,len-done);
+            break;
+        }
+        usleep(AOF_WRITER_RETRY_US);
+    }
+    atomicSetWithSync(aof_writer_errno,0);
+}
+
+void *aofWriterMain(void *arg) {
+    unsigned long head, tail;
+    UNUSED(arg);
+
+    redisSetCpuAffinity(server.bio_cpulist);
+
+    while (1) {
+        atomicGetWithSync(aof_writer_tail,tail);
+        atomicGetWithSync(aof_writer_head,head);
+        if (head == tail) {
+            pthread_mutex_lock(&aof_writer_mutex);
+            pthread_cond_broadcast(&aof_writer_drained_cond);
+            atomicGetWithSync(aof_writer_head,head);
+            while (head == tail) {
+                pthread_cond_wait(&aof_writer_newdata_cond,&aof_writer_mutex);
+                atomicGetWithSync(aof_writer_head,head);
+            }
+            pthread_mutex_unlock(&aof_writer_mutex);
+        }
+
+        aofWriterChunk *chunk = aof_writer_ring+(tail&(AOF_WRITER_RING_SIZE-1));
+        int discard;
+        atomicGetWithSync(aof_writer_discard,discard);
+        if (discard)
+            atomicIncr(aof_writer_dropped,sdslen(chunk->buf));
+        else
+            aofWriterWriteChunk(chunk);
+        sdsfree(chunk->buf);
+        chunk->buf = NULL;
+        atomicSetWithSync(aof_writer_tail,tail+1);
+    }
+    return NULL;
+}
+
+/* Start the writer thread if aof-background-write is enabled. */
+void aofWriterInit(void) {
+    pthread_t tid;
+
+    if (!server.aof_background_write) return;
+    if (pthread_create(&tid,NULL,aofWriterMain,NULL) != 0) {
+        serverLog(LL_WARNING,"Fatal: Can't initialize the AOF writer thread.");
+        exit(1);
+    }
+    aof_writer_started = 1;
+}
+
+/* Return the number of chunks waiting to be written. */
+unsigned long aofWriterPendingChunks(void) {
+    unsigned long head, tail;
+
+    atomicGetWithSync(aof_writer_head,head);
+    atomicGetWithSync(aof_writer_tail,tail);
+    return head-tail;
+}
+
+/* Queue the AOF buffer to the writer thread. Returns C_ERR if the ring is
+ * full, in which case the AOF buffer is left untouched. */
+int aofWriterQueue(void) {
+    unsigned long head;
+    aofWriterChunk *chunk;
+
+    if (aofWriterPendingChunks() == AOF_WRITER_RING_SIZE) return C_ERR;
+    atomicGetWithSync(aof_writer_head,head);
+    chunk = aof_writer_ring+(head&(AOF_WRITER_RING_SIZE-1));
+    chunk->fd = server.aof_fd;
+    chunk->buf = server.aof_buf;
+    aof_writer_queued += sdslen(server.aof_buf);
+    server.aof_current_size += sdslen(server.aof_buf);
+    server.aof_buf = sdsempty();
+
+    pthread_mutex_lock(&aof_writer_mutex);
+    atomicSetWithSync(aof_writer_head,head+1);
+    pthread_cond_signal(&aof_writer_newdata_cond);
+    pthread_mutex_unlock(&aof_writer_mutex);
+    return C_OK;
+}
+
+/* Account the data written by the writer thread so far, and reflect its
+ * write errors into the AOF write status, so that writes are refused as
+ * long as the disk can't be written. */
+void aofWriterCollect(void) {
+    static time_t last_write_error_log = 0;
+    unsigned long long written;
+    int err;
+
+    atomicGetWithSync(aof_writer_written,written);
+    server.aof_written_offset += written-aof_writer_collected;
+    aof_writer_collected = written;
+
+    atomicGetWithSync(aof_writer_errno,err);
+    if (err) {
+        if (server.unixtime - last_write_error_log > AOF_WRITE_LOG_ERROR_RATE) {
+            serverLog(LL_WARNING,"Error writing to the AOF file: %s",
+                strerror(err));
+            last_write_error_log = server.unixtime;
+        }
+        server.aof_last_write_status = C_ERR;
+        server.aof_last_write_errno = err;
+    } else if (server.aof_last_write_status == C_ERR) {
+        serverLog(LL_WARNING,
+            "AOF write error looks solved, Redis can write again.");
+        server.aof_last_write_status = C_OK;
+    }
+}
+
+/* Wait for the writer thread to write all the queued chunks. If writing
+ * fails meanwhile the queued data is discarded instead, since a caller that
+ * is going to close the file can't wait forever. */
+void aofWriterDrain(void) {
+    int err;
+
+    if (!aof_writer_started) return;
+    pthread_mutex_lock(&aof_writer_mutex);
+    while (aofWriterPendingChunks() != 0) {
+        atomicGetWithSync(aof_writer_errno,err);
+        if (err) {
+            serverLog(LL_WARNING,"Discarding %lu AOF chunks that can't be "
+                "written: %s", aofWriterPendingChunks(), strerror(err));
+            atomicSetWithSync(aof_writer_discard,1);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME,&deadline);
+        deadline.tv_nsec += AOF_WRITER_RETRY_US*1000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&aof_writer_drained_cond,&aof_writer_mutex,
+                               &deadline);
+    }
+    pthread_mutex_unlock(&aof_writer_mutex);
+    atomicSetWithSync(aof_writer_discard,0);
+    aofWriterCollect();
+}
+
+/* The flushAppendOnlyFile() implementation used when the AOF buffer is
+ * written by the writer thread: queue the buffer and, with the 'everysec'
+ * policy, start a background fsync once per second if something was
+ * written since the last one. */
+void aofWriterFlush(int force) {
+    aofWriterCollect();
+    if (sdslen(server.aof_buf) && aofWriterQueue() == C_ERR) {
+        server.stat_aof_writer_ring_full++;
+        if (force) {
+            aofWriterDrain();
+            aofWriterQueue();
+        }
+    }
+    if (force) aofWriterDrain();
+
+    if (server.aof_no_fsync_on_rewrite && hasActiveChildProcess())
+        return;
+    if (server.aof_fsync == AOF_FSYNC_EVERYSEC &&
+        server.unixtime > server.aof_last_fsync &&
+        server.aof_written_offset > server.aof_fsync_pending_offset &&
+        !aofFsyncInProgress())
+    {
+        aof_background_fsync(server.aof_fd);
+        server.aof_fsync_offset = server.aof_current_size;
+        server.aof_last_fsync = server.unixtime;
+    }
+}
+
+/* Append the writer thread fields to the persistence INFO section. */
+sds genAofWriterInfoString(sds info) {
+    unsigned long long written, dropped;
+
+    if (!aof_writer_started) return info;
+    atomicGetWithSync(aof_writer_written,written);
+    atomicGetWithSync(aof_writer_dropped,dropped);
+    return sdscatprintf(info,
+        "aof_writer_pending_chunks:%lu\r\n"
+        "aof_writer_pending_bytes:%llu\r\n"
+        "aof_writer_ring_full:%llu\r\n",
+        aofWriterPendingChunks(),
+        aof_writer_queued-written-dropped,
+        server.stat_aof_writer_ring_full);
+}
+
 /* Write the append only file buffer on disk.
  *
  * Since we are required to write the AOF before replying to the client,
@@ -333,11 +881,15 @@ ssize_t aofWrite(int fd, const char *buf, size_t len) {
  *
  * However if force is set to 1 we'll write regardless of the background
  * fsync. */
-#define AOF_WRITE_LOG_ERROR_RATE 30 /* Seconds between errors logging. */
 void flushAppendOnlyFile(int force) {
     ssize_t nwritten;
     int sync_in_progress = 0;
-    mstime_t latency;
+    ustime_t latency;
+
+    if (aofWriterActive()) {
+        aofWriterFlush(force);
+        return;
+    }
 
     if (sdslen(server.aof_buf) == 0) {
         /* Check if we need to do fsync even the aof buffer is empty,
@@ -392,6 +944,7 @@ void flushAppendOnlyFile(int force) {
     latencyStartMonitor(latency);
     nwritten = aofWrite(server.aof_fd,server.aof_buf,sdslen(server.aof_buf));
     latencyEndMonitor(latency);
+    TRACE3(aof_write,sdslen(server.aof_buf),nwritten,latency);
     /* We want to capture different events for delayed writes:
      * when the delay happens with a pending fsync, or with a saving child
      * active, and when the above two conditions are missing.
@@ -468,6 +1021,7 @@ void flushAppendOnlyFile(int force) {
              * was no way to undo it with ftruncate(2). */
             if (nwritten > 0) {
                 server.aof_current_size += nwritten;
+                server.aof_written_offset += nwritten;
                 sdsrange(server.aof_buf,nwritten,-1);
             }
             return; /* We'll try again on the next call... */
@@ -482,6 +1036,7 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_written_offset += nwritten;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -503,10 +1058,13 @@ try_fsync:
         /* redis_fsync is defined as fdatasync() for Linux in order to avoid
          * flushing metadata. */
         latencyStartMonitor(latency);
+        TRACE1(aof_fsync_start,server.aof_fd);
         redis_fsync(server.aof_fd); /* Let's try to get this data on the disk */
+        TRACE1(aof_fsync_end,server.aof_fd);
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-fsync-always",latency);
         server.aof_fsync_offset = server.aof_current_size;
+        server.aof_fsynced_offset = server.aof_written_offset;
         server.aof_last_fsync = server.unixtime;
     } else if ((server.aof_fsync == AOF_FSYNC_EVERYSEC &&
                 server.unixtime > server.aof_last_fsync)) {
@@ -518,6 +1076,93 @@ try_fsync:
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * WAITAOF: group commit of the AOF fsync
+ *
+ * A client calling WAITAOF blocks until all the writes it performed so far
+ * are fsynced, while the other clients are served as usual. The fsync is
+ * performed by the BIO thread, and a single fsync makes durable all the
+ * writes of all the clients waiting when it starts.
+ * ------------------------------------------------------------------------- */
+
+/* Update the offset known to be on disk once the background fsync started
+ * last is done. */
+void aofUpdateFsyncedOffset(void) {
+    if (!aofFsyncInProgress() &&
+        server.aof_fsync_pending_offset > server.aof_fsynced_offset)
+    {
+        server.aof_fsynced_offset = server.aof_fsync_pending_offset;
+    }
+}
+
+/* WAITAOF <timeout>
+ *
+ * Reply with 1 once the writes performed by the client are fsynced, or
+ * with 0 if the timeout is reached first. */
+void waitaofCommand(client *c) {
+    mstime_t timeout;
+
+    if (server.aof_state != AOF_ON) {
+        addReplyError(c,"WAITAOF cannot be used when the AOF is not enabled or is still being created.");
+        return;
+    }
+    if (getTimeoutFromObjectOrReply(c,c->argv[1],&timeout,UNIT_MILLISECONDS)
+        != C_OK) return;
+
+    /* First try without blocking at all. */
+    aofUpdateFsyncedOffset();
+    if (server.aof_fsynced_offset >= c->aof_woff || c->flags & CLIENT_MULTI) {
+        addReplyLongLong(c,server.aof_fsynced_offset >= c->aof_woff);
+        return;
+    }
+
+    /* Otherwise block the client: the fsync is started, if needed, by
+     * processClientsWaitingAofFsync() after the AOF buffer is written. */
+    c->bpop.timeout = timeout;
+    c->bpop.reploffset = c->aof_woff;
+    listAddNodeTail(server.clients_waiting_aof,c);
+    blockClient(c,BLOCKED_WAITAOF);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingAofFsync(client *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_aof,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.clients_waiting_aof,ln);
+}
+
+/* Called in beforeSleep(), after the AOF buffer is written, when there are
+ * clients blocked in WAITAOF: unblock the ones whose writes are on disk, and
+ * if some client is still waiting start a new background fsync, unless one
+ * is already in progress, in which case the next one will cover all the
+ * writes performed meanwhile. */
+void processClientsWaitingAofFsync(void) {
+    listIter li;
+    listNode *ln;
+
+    aofUpdateFsyncedOffset();
+    listRewind(server.clients_waiting_aof,&li);
+    while((ln = listNext(&li))) {
+        client *c = ln->value;
+
+        if (c->bpop.reploffset <= server.aof_fsynced_offset) {
+            unblockClient(c);
+            addReplyLongLong(c,1);
+        }
+    }
+
+    if (listLength(server.clients_waiting_aof) &&
+        server.aof_fd != -1 &&
+        server.aof_fsynced_offset < server.aof_written_offset &&
+        !aofFsyncInProgress() &&
+        !(server.aof_no_fsync_on_rewrite && hasActiveChildProcess()))
+    {
+        aof_background_fsync(server.aof_fd);
+        server.aof_fsync_offset = server.aof_current_size;
+    }
+}
+
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     char buf[32];
     int len, j;
@@ -632,15 +1277,17 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
-     * positive reply about the operation performed. */
-    if (server.aof_state == AOF_ON)
+     * positive reply about the operation performed. With a multi part AOF
+     * the writes go to the new increment while waiting for the rewrite. */
+    if (server.aof_state == AOF_ON ||
+        (server.aof_multi_part && server.aof_fd != -1))
         server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
 
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
      * can append the differences to the new append only file. */
-    if (server.aof_child_pid != -1)
+    if (server.aof_child_pid != -1 && !server.aof_multi_part)
         aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
 
     sdsfree(buf);
@@ -663,7 +1310,11 @@ struct client *createAOFClient(void) {
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
+    memset(c->argv_pool,0,sizeof(c->argv_pool));
+    c->argv_pool_len = 0;
     c->bufpos = 0;
+    c->buf = NULL;
     c->flags = 0;
     c->btype = BLOCKED_NONE;
     /* We set the fake client as a slave waiting for the synchronization
@@ -676,28 +1327,135 @@ struct client *createAOFClient(void) {
     c->peerid = NULL;
     c->resp = 2;
     c->user = NULL;
+    c->acl_key = NULL;
+    c->acl_key_version = 0;
+    c->cmd_keys = NULL;
+    c->cmd_numkeys = 0;
+    c->cmd_keys_cmd = NULL;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
     return c;
 }
 
+/* Release the arguments of the command just executed. The argv array is
+ * kept, and reused for the next command. */
 void freeFakeClientArgv(struct client *c) {
     int j;
 
     for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
-    zfree(c->argv);
+        freeClientArgObject(c,c->argv[j]);
+    c->argc = 0;
+    resetClientCommandKeys(c);
 }
 
 void freeFakeClient(struct client *c) {
+    zfree(c->argv);
+    freeClientArgvPool(c);
+    resetClientCommandKeys(c);
+    sdsfree(c->acl_key);
     sdsfree(c->querybuf);
+    zfree(c->buf);
     listRelease(c->reply);
     listRelease(c->watched_keys);
     freeClientMultiState(c);
     zfree(c);
 }
 
+/* The commands of the AOF are parsed straight from big blocks of the file,
+ * read with a single fread() each, instead of going through stdio for every
+ * line and argument. The argument objects are created directly from the
+ * block, like it happens for the query buffer of the clients. */
+#define AOF_LOAD_BLOCK_SIZE (1024*1024)
+
+typedef struct aofLoadReader {
+    FILE *fp;
+    char *buf;
+    size_t pos, len;    /* The unparsed data is buf[pos..len). */
+    off_t offset;       /* File offset of buf[0]. */
+} aofLoadReader;
+
+/* Start parsing from the current position of 'fp'. */
+static void aofLoadReaderInit(aofLoadReader *r, FILE *fp) {
+    r->fp = fp;
+    r->buf = zmalloc(AOF_LOAD_BLOCK_SIZE);
+    r->pos = r->len = 0;
+    r->offset = ftello(fp);
+}
+
+/* File offset of the next byte to parse. */
+static off_t aofLoadReaderTell(aofLoadReader *r) {
+    return r->offset+r->pos;
+}
+
+/* Make sure at least 'need' (at most AOF_LOAD_BLOCK_SIZE) unparsed bytes
+ * are buffered. Returns the number of unparsed bytes, that can be less
+ * than 'need' at EOF or on read errors. */
+static size_t aofLoadReaderFill(aofLoadReader *r, size_t need) {
+    if (r->len-r->pos >= need) return r->len-r->pos;
+    memmove(r->buf,r->buf+r->pos,r->len-r->pos);
+    r->offset += r->pos;
+    r->len -= r->pos;
+    r->pos = 0;
+    while (r->len < need) {
+        size_t nread = fread(r->buf+r->len,1,AOF_LOAD_BLOCK_SIZE-r->len,r->fp);
+        if (nread == 0) break;
+        r->len += nread;
+    }
+    return r->len;
+}
+
+/* Return the next line, terminated by a newline that is not included in
+ * '*lenptr' but is guaranteed to follow the line in memory. NULL is returned
+ * if there is no complete line, because of EOF, a read error, or because
+ * the line is longer than the read block. */
+static char *aofLoadReaderLine(aofLoadReader *r, size_t *lenptr) {
+    char *line, *nl = memchr(r->buf+r->pos,'\n',r->len-r->pos);
+
+    if (nl == NULL) {
+        aofLoadReaderFill(r,AOF_LOAD_BLOCK_SIZE);
+        nl = memchr(r->buf+r->pos,'\n',r->len-r->pos);
+        if (nl == NULL) return NULL;
+    }
+    line = r->buf+r->pos;
+    *lenptr = nl-line;
+    r->pos += *lenptr+1;
+    return line;
+}
+
+/* Read a 'len' bytes argument, and the CRLF following it, returning it as
+ * a string object, or NULL on short read. Arguments bigger than the read
+ * block are read directly into their final buffer. */
+static robj *aofLoadReaderArg(aofLoadReader *r, client *c, size_t len) {
+    if (len+2 <= AOF_LOAD_BLOCK_SIZE) {
+        if (aofLoadReaderFill(r,len+2) < len+2) return NULL;
+        robj *o = createClientArgObject(c,r->buf+r->pos,len);
+        r->pos += len+2;
+        return o;
+    }
+
+    sds arg = sdsnewlen(SDS_NOINIT,len);
+    size_t copy = r->len-r->pos;
+    if (copy > len) copy = len;
+    memcpy(arg,r->buf+r->pos,copy);
+    r->pos += copy;
+    if (copy < len) {
+        r->offset += r->len;
+        r->pos = r->len = 0;
+        if (fread(arg+copy,len-copy,1,r->fp) != 1) {
+            sdsfree(arg);
+            return NULL;
+        }
+        r->offset += len-copy;
+    }
+    if (aofLoadReaderFill(r,2) < 2) {
+        sdsfree(arg);
+        return NULL;
+    }
+    r->pos += 2;
+    return createObject(OBJ_STRING,arg);
+}
+
 /* Replay the append log file. On success C_OK is returned. On non fatal
  * error (the append only file is zero-length) C_ERR is returned. On
  * fatal error an error message is logged and the program exists. */
@@ -709,6 +1467,8 @@ int loadAppendOnlyFile(char *filename) {
     long loops = 0;
     off_t valid_up_to = 0; /* Offset of latest well-formed command loaded. */
     off_t valid_before_multi = 0; /* Offset before MULTI command loaded. */
+    aofLoadReader reader = {0};
+    long long commands = 0, start = ustime();
 
     if (fp == NULL) {
         serverLog(LL_WARNING,"Fatal error: can't open the append log file for reading: %s",strerror(errno));
@@ -755,65 +1515,59 @@ int loadAppendOnlyFile(char *filename) {
     }
 
     /* Read the actual AOF file, in REPL format, command by command. */
+    aofLoadReaderInit(&reader,fp);
     while(1) {
         int argc, j;
         unsigned long len;
-        robj **argv;
-        char buf[128];
-        sds argsds;
+        char *line;
+        size_t linelen;
         struct redisCommand *cmd;
 
         /* Serve the clients from time to time */
         if (!(loops++ % 1000)) {
-            loadingProgress(ftello(fp));
+            loadingProgress(aofLoadReaderTell(&reader));
             processEventsWhileBlocked();
             processModuleLoadingProgressEvent(1);
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
-            if (feof(fp))
+        if ((line = aofLoadReaderLine(&reader,&linelen)) == NULL) {
+            if (aofLoadReaderFill(&reader,1) == 0 && feof(fp))
                 break;
-            else
+            else if (feof(fp) || ferror(fp))
                 goto readerr;
+            else
+                goto fmterr; /* The line doesn't fit the read block. */
         }
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        argc = atoi(buf+1);
+        if (line[0] != '*') goto fmterr;
+        if (linelen == 1) goto readerr;
+        argc = atoi(line+1);
         if (argc < 1) goto fmterr;
 
-        argv = zmalloc(sizeof(robj*)*argc);
-        fakeClient->argc = argc;
-        fakeClient->argv = argv;
-
+        clientEnsureArgvLen(fakeClient,argc);
+        fakeClient->argc = 0;
         for (j = 0; j < argc; j++) {
-            if (fgets(buf,sizeof(buf),fp) == NULL) {
-                fakeClient->argc = j; /* Free up to j-1. */
+            robj *arg;
+
+            if ((line = aofLoadReaderLine(&reader,&linelen)) == NULL) {
                 freeFakeClientArgv(fakeClient);
-                goto readerr;
+                if (feof(fp) || ferror(fp)) goto readerr;
+                goto fmterr;
             }
-            if (buf[0] != '$') goto fmterr;
-            len = strtol(buf+1,NULL,10);
-            argsds = sdsnewlen(SDS_NOINIT,len);
-            if (len && fread(argsds,len,1,fp) == 0) {
-                sdsfree(argsds);
-                fakeClient->argc = j; /* Free up to j-1. */
+            if (line[0] != '$') goto fmterr;
+            len = strtol(line+1,NULL,10);
+            if ((arg = aofLoadReaderArg(&reader,fakeClient,len)) == NULL) {
                 freeFakeClientArgv(fakeClient);
                 goto readerr;
             }
-            argv[j] = createObject(OBJ_STRING,argsds);
-            if (fread(buf,2,1,fp) == 0) {
-                fakeClient->argc = j+1; /* Free up to j. */
-                freeFakeClientArgv(fakeClient);
-                goto readerr; /* discard CRLF */
-            }
+            fakeClient->argv[fakeClient->argc++] = arg;
         }
 
         /* Command lookup */
-        cmd = lookupCommand(argv[0]->ptr);
+        cmd = lookupCommand(fakeClient->argv[0]->ptr);
         if (!cmd) {
             serverLog(LL_WARNING,
                 "Unknown command '%s' reading the append only file",
-                (char*)argv[0]->ptr);
+                (char*)fakeClient->argv[0]->ptr);
             exit(1);
         }
 
@@ -840,7 +1594,9 @@ int loadAppendOnlyFile(char *filename) {
          * argv/argc of the client instead of the local variables. */
         freeFakeClientArgv(fakeClient);
         fakeClient->cmd = NULL;
-        if (server.aof_load_truncated) valid_up_to = ftello(fp);
+        commands++;
+        if (server.aof_load_truncated)
+            valid_up_to = aofLoadReaderTell(&reader);
         if (server.key_load_delay)
             usleep(server.key_load_delay);
     }
@@ -857,6 +1613,15 @@ int loadAppendOnlyFile(char *filename) {
     }
 
 loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
+    if (reader.buf) {
+        double elapsed = (double)(ustime()-start)/1000000;
+        double mb = (double)aofLoadReaderTell(&reader)/(1024*1024);
+        serverLog(LL_NOTICE,
+            "AOF %s: %lld commands loaded, %.2f MB in %.3f seconds "
+            "(%.2f MB/sec)", filename, commands, mb, elapsed,
+            elapsed > 0 ? mb/elapsed : 0);
+    }
+    zfree(reader.buf);
     fclose(fp);
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
@@ -911,6 +1676,31 @@ fmterr: /* Format error. */
     exit(1);
 }
 
+/* Load the AOF: the single file AOF, or the base and the increments listed
+ * in the manifest when aof-multi-part is enabled. Returns C_OK if some data
+ * was loaded, C_ERR if the AOF is empty. */
+int loadAppendOnlyFiles(void) {
+    int loaded = 0;
+
+    if (!server.aof_multi_part) return loadAppendOnlyFile(server.aof_filename);
+
+    if (server.aof_base_name &&
+        loadAppendOnlyFile(server.aof_base_name) == C_OK) loaded = 1;
+    if (server.aof_incr_first) {
+        for (long long seq = server.aof_incr_first; seq <= server.aof_seq;
+             seq++)
+        {
+            sds filename = aofGetIncrName(seq);
+            if (loadAppendOnlyFile(filename) == C_OK) loaded = 1;
+            sdsfree(filename);
+        }
+    }
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
+    server.aof_fsync_offset = server.aof_current_size;
+    return loaded ? C_OK : C_ERR;
+}
+
 /* ----------------------------------------------------------------------------
  * AOF rewrite
  * ------------------------------------------------------------------------- */
@@ -924,11 +1714,56 @@ int rioWriteBulkObject(rio *r, robj *obj) {
         return rioWriteBulkLongLong(r,(long)obj->ptr);
     } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        size_t len;
+        char *buf = stringDecompressToScratch(obj,&len);
+        return rioWriteBulkString(r,buf,len);
     } else {
         serverPanic("Unknown string encoding");
     }
 }
 
+/* Emit a SETBIT command. The function returns 0 on error, 1 on success. */
+static int rioWriteSetbit(rio *r, robj *key, uint64_t offset, int on) {
+    if (rioWriteBulkCount(r,'*',4) == 0) return 0;
+    if (rioWriteBulkString(r,"SETBIT",6) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,offset) == 0) return 0;
+    return rioWriteBulkString(r,on ? "1" : "0",1);
+}
+
+/* Emit the commands needed to rebuild a roaring bitmap: clearing the last
+ * bit sets the length of the bitmap, and creates it with the same encoding
+ * if it is large enough, then every bit set is set again.
+ * The function returns 0 on error, 1 on success. */
+int rewriteRoaringObject(rio *r, robj *key, robj *o) {
+    roaring *rb = o->ptr;
+    unsigned char chunk[ROARING_CHUNK_BYTES];
+    uint32_t j, byte;
+
+    if (rb->len == 0) {
+        char cmd[]="*3\r\n$3\r\nSET\r\n";
+        if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+        if (rioWriteBulkObject(r,key) == 0) return 0;
+        return rioWriteBulkString(r,"",0);
+    }
+    if (rioWriteSetbit(r,key,(uint64_t)rb->len*8-1,0) == 0) return 0;
+    for (j = 0; j < rb->count; j++) {
+        uint64_t base = (uint64_t)rb->containers[j].key*ROARING_CHUNK_BITS;
+
+        roaringGetBytes(rb,base/8,ROARING_CHUNK_BYTES,chunk);
+        for (byte = 0; byte < ROARING_CHUNK_BYTES; byte++) {
+            unsigned char b = chunk[byte];
+            while (b) {
+                int bit = __builtin_clz(b)-24;
+                if (rioWriteSetbit(r,key,base+byte*8+bit,1) == 0) return 0;
+                b &= ~(0x80 >> bit);
+            }
+        }
+    }
+    return 1;
+}
+
 /* Emit the commands needed to rebuild a list object.
  * The function returns 0 on error, 1 on success. */
 int rewriteListObject(rio *r, robj *key, robj *o) {
@@ -1004,6 +1839,31 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             items--;
         }
         dictReleaseIterator(di);
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr, *p = lpFirst(lp);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+
+        while(p) {
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            vstr = lpGetValue(p,&vlen,&vll);
+            if (vstr) {
+                if (rioWriteBulkString(r,(char*)vstr,vlen) == 0) return 0;
+            } else {
+                if (rioWriteBulkLongLong(r,vll) == 0) return 0;
+            }
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+            p = lpNext(lp,p);
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -1015,7 +1875,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1023,13 +1883,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1086,12 +1946,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1133,6 +1993,44 @@ int rewriteHashObject(rio *r, robj *key, robj *o) {
     return 1;
 }
 
+/* Helper for rewriteHashFieldExpires(): emit the HPEXPIREAT setting the
+ * expire of a single field. */
+static int rioWriteHashFieldExpire(rio *r, robj *key, sds field,
+                                   long long when)
+{
+    char cmd[]="*4\r\n$10\r\nHPEXPIREAT\r\n";
+    if (rioWrite(r,cmd,sizeof(cmd)-1) == 0) return 0;
+    if (rioWriteBulkObject(r,key) == 0) return 0;
+    if (rioWriteBulkLongLong(r,when) == 0) return 0;
+    return rioWriteBulkString(r,field,sdslen(field));
+}
+
+/* Emit the HPEXPIREAT commands restoring the field expires 'zobj' of the
+ * hash at 'key'. The function returns 0 on error, 1 on success. */
+int rewriteHashFieldExpires(rio *r, robj *key, robj *zobj) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = zobj->ptr, *eptr = lpSeek(zl,0), *sptr;
+
+        while (eptr != NULL) {
+            sds field = lpGetObject(eptr);
+            int retval;
+
+            sptr = lpNext(zl,eptr);
+            retval = rioWriteHashFieldExpire(r,key,field,zzlGetScore(sptr));
+            sdsfree(field);
+            if (retval == 0) return 0;
+            eptr = lpNext(zl,sptr);
+        }
+    } else {
+        zskiplistNode *ln = ((zset*)zobj->ptr)->zsl->header->level[0].forward;
+
+        for (; ln != NULL; ln = ln->level[0].forward)
+            if (rioWriteHashFieldExpire(r,key,ln->ele,ln->score) == 0)
+                return 0;
+    }
+    return 1;
+}
+
 /* Helper for rewriteStreamObject() that generates a bulk string into the
  * AOF representing the ID 'id'. */
 int rioWriteBulkStreamID(rio *r,streamID *id) {
@@ -1212,11 +2110,16 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
     }
 
     /* Append XSETID after XADD, make sure lastid is correct,
-     * in case of XDEL lastid. */
-    if (rioWriteBulkCount(r,'*',3) == 0) return 0;
+     * in case of XDEL lastid. The counters the groups lag is computed
+     * from are restored as well. */
+    if (rioWriteBulkCount(r,'*',7) == 0) return 0;
     if (rioWriteBulkString(r,"XSETID",6) == 0) return 0;
     if (rioWriteBulkObject(r,key) == 0) return 0;
     if (rioWriteBulkStreamID(r,&s->last_id) == 0) return 0;
+    if (rioWriteBulkString(r,"ENTRIESADDED",12) == 0) return 0;
+    if (rioWriteBulkLongLong(r,s->entries_added) == 0) return 0;
+    if (rioWriteBulkString(r,"MAXDELETEDID",12) == 0) return 0;
+    if (rioWriteBulkStreamID(r,&s->max_deleted_entry_id) == 0) return 0;
 
 
     /* Create all the stream consumer groups. */
@@ -1227,12 +2130,14 @@ int rewriteStreamObject(rio *r, robj *key, robj *o) {
         while(raxNext(&ri)) {
             streamCG *group = ri.data;
             /* Emit the XGROUP CREATE in order to create the group. */
-            if (rioWriteBulkCount(r,'*',5) == 0) return 0;
+            if (rioWriteBulkCount(r,'*',7) == 0) return 0;
             if (rioWriteBulkString(r,"XGROUP",6) == 0) return 0;
             if (rioWriteBulkString(r,"CREATE",6) == 0) return 0;
             if (rioWriteBulkObject(r,key) == 0) return 0;
             if (rioWriteBulkString(r,(char*)ri.key,ri.key_len) == 0) return 0;
             if (rioWriteBulkStreamID(r,&group->last_id) == 0) return 0;
+            if (rioWriteBulkString(r,"ENTRIESREAD",11) == 0) return 0;
+            if (rioWriteBulkLongLong(r,group->entries_read) == 0) return 0;
 
             /* Generate XCLAIMs for each consumer that happens to
              * have pending entries. Empty consumers have no semantical
@@ -1290,6 +2195,9 @@ ssize_t aofReadDiffFromParent(void) {
     char buf[65536]; /* Default pipe buffer size on most Linux systems. */
     ssize_t nread, total = 0;
 
+    /* A multi part AOF rewrite only writes the base: there is no diff. */
+    if (server.aof_multi_part) return 0;
+
     while ((nread =
             read(server.aof_pipe_read_data_from_parent,buf,sizeof(buf))) > 0) {
         server.aof_child_diff = sdscatlen(server.aof_child_diff,buf,nread);
@@ -1325,10 +2233,21 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = dbEntryGetExpire(db,de);
+
+            /* The values in the tiered storage are loaded just to be
+             * rewritten, and released below. */
+            robj *loaded = NULL;
+            if (o->encoding == OBJ_ENCODING_SWAPPED) {
+                if ((loaded = tieredLoadValue(o,&key)) == NULL) goto werr;
+                o = loaded;
+            }
 
             /* Save the key and associated value */
-            if (o->type == OBJ_STRING) {
+            if (o->type == OBJ_STRING &&
+                o->encoding == OBJ_ENCODING_ROARING) {
+                if (rewriteRoaringObject(aof,&key,o) == 0) goto werr;
+            } else if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
                 char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(aof,cmd,sizeof(cmd)-1) == 0) goto werr;
@@ -1342,7 +2261,11 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             } else if (o->type == OBJ_ZSET) {
                 if (rewriteSortedSetObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_HASH) {
+                robj *fexpires = hashFieldExpiresGet(db,keystr);
+
                 if (rewriteHashObject(aof,&key,o) == 0) goto werr;
+                if (fexpires && rewriteHashFieldExpires(aof,&key,fexpires) == 0)
+                    goto werr;
             } else if (o->type == OBJ_STREAM) {
                 if (rewriteStreamObject(aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_MODULE) {
@@ -1357,6 +2280,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
                 if (rioWriteBulkObject(aof,&key) == 0) goto werr;
                 if (rioWriteBulkLongLong(aof,expiretime) == 0) goto werr;
             }
+            if (loaded) decrRefCount(loaded);
             /* Read some diff from the parent process from time to time. */
             if (aof->processed_bytes > processed+AOF_READ_DIFF_INTERVAL_BYTES) {
                 processed = aof->processed_bytes;
@@ -1418,6 +2342,10 @@ int rewriteAppendOnlyFile(char *filename) {
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
 
+    /* A multi part AOF base is complete: the parent is already appending
+     * the new writes to the next increment. */
+    if (server.aof_multi_part) goto done;
+
     /* Read again a few times to get more data from the parent.
      * We can't read forever (the server may receive data from clients
      * faster than it is able to send data to the child), so we try to read
@@ -1461,6 +2389,8 @@ int rewriteAppendOnlyFile(char *filename) {
     /* Make sure data will not remain on the OS's output buffers */
     if (fflush(fp) == EOF) goto werr;
     if (fsync(fileno(fp)) == -1) goto werr;
+
+done:
     if (fclose(fp) == EOF) goto werr;
 
     /* Use RENAME to make sure the DB file is changed atomically only
@@ -1577,13 +2507,25 @@ int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
-    if (aofCreatePipes() != C_OK) return C_ERR;
+    if (server.aof_multi_part) {
+        /* The writes from now on go to a new increment, and the base the
+         * child writes takes its sequence number. */
+        if (server.aof_state != AOF_OFF) {
+            if (aofOpenNewIncr() == C_ERR) return C_ERR;
+            server.aof_rewrite_seq = server.aof_seq;
+        } else {
+            server.aof_rewrite_seq = ++server.aof_seq;
+        }
+    } else if (aofCreatePipes() != C_OK) {
+        return C_ERR;
+    }
     openChildInfoPipe();
     if ((childpid = redisFork()) == 0) {
         char tmpfile[256];
 
         /* Child */
         redisSetProcTitle("redis-aof-rewrite");
+        redisSetCpuAffinity(server.aof_rewrite_cpulist);
         snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) getpid());
         if (rewriteAppendOnlyFile(tmpfile) == C_OK) {
             sendChildCOWInfo(CHILD_INFO_TYPE_AOF, "AOF rewrite");
@@ -1598,7 +2540,7 @@ int rewriteAppendOnlyFileBackground(void) {
             serverLog(LL_WARNING,
                 "Can't rewrite append only file in background: fork: %s",
                 strerror(errno));
-            aofClosePipes();
+            if (!server.aof_multi_part) aofClosePipes();
             return C_ERR;
         }
         serverLog(LL_NOTICE,
@@ -1635,10 +2577,10 @@ void aofRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
     snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) childpid);
-    unlink(tmpfile);
+    bioUnlinkFile(tmpfile);
 
     snprintf(tmpfile,256,"temp-rewriteaof-%d.aof", (int) childpid);
-    unlink(tmpfile);
+    bioUnlinkFile(tmpfile);
 }
 
 /* Update the server.aof_current_size field explicitly using stat(2)
@@ -1647,10 +2589,12 @@ void aofRemoveTempFile(pid_t childpid) {
  * to the current length, that is much faster. */
 void aofUpdateCurrentSize(void) {
     struct redis_stat sb;
-    mstime_t latency;
+    ustime_t latency;
 
     latencyStartMonitor(latency);
-    if (redis_fstat(server.aof_fd,&sb) == -1) {
+    if (server.aof_multi_part) {
+        server.aof_current_size = aofMultiPartSize();
+    } else if (redis_fstat(server.aof_fd,&sb) == -1) {
         serverLog(LL_WARNING,"Unable to obtain the AOF file length. stat: %s",
             strerror(errno));
     } else {
@@ -1660,18 +2604,98 @@ void aofUpdateCurrentSize(void) {
     latencyAddSampleIfNeeded("aof-fstat",latency);
 }
 
+/* A multi part AOF rewrite terminated with success: the temp file produced
+ * by the child becomes the new base, and the manifest is updated to list it
+ * followed by the increment opened when the rewrite started. The files that
+ * are no longer referenced are then removed. */
+int backgroundRewriteDoneMultiPart(char *tmpfile) {
+    sds old_base = server.aof_base_name;
+    long long old_incr_first = server.aof_incr_first;
+    long long seq = server.aof_rewrite_seq;
+    ustime_t latency;
+
+    server.aof_base_name = aofGetBaseName(seq);
+    latencyStartMonitor(latency);
+    if (bioRenameFile(tmpfile,server.aof_base_name) == -1) {
+        serverLog(LL_WARNING,
+            "Error trying to rename the temporary AOF file %s into %s: %s",
+            tmpfile, server.aof_base_name, strerror(errno));
+        goto err;
+    }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("aof-rename",latency);
+
+    /* The increment receiving the writes, if the AOF is on, is always the
+     * one opened when this rewrite started. */
+    if (server.aof_fd != -1) {
+        serverAssert(server.aof_seq == seq);
+        server.aof_incr_first = seq;
+    } else {
+        server.aof_incr_first = 0;
+    }
+    if (aofWriteManifest() == C_ERR) {
+        bioUnlinkFile(server.aof_base_name);
+        server.aof_incr_first = old_incr_first;
+        goto err;
+    }
+
+    if (old_base) {
+        aofUnlinkInBackground(old_base);
+        sdsfree(old_base);
+    }
+    if (old_incr_first) {
+        for (long long j = old_incr_first; j < seq; j++) {
+            sds filename = aofGetIncrName(j);
+            aofUnlinkInBackground(filename);
+            sdsfree(filename);
+        }
+    }
+
+    if (server.aof_fd != -1) {
+        aofUpdateCurrentSize();
+        server.aof_rewrite_base_size = server.aof_current_size;
+        server.aof_fsync_offset = server.aof_current_size;
+    }
+    return C_OK;
+
+err:
+    sdsfree(server.aof_base_name);
+    server.aof_base_name = old_base;
+    return C_ERR;
+}
+
 /* A background append only file rewriting (BGREWRITEAOF) terminated its work.
  * Handle this. */
 void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
-    if (!bysignal && exitcode == 0) {
+    if (server.aof_multi_part && !bysignal && exitcode == 0) {
+        char tmpfile[256];
+
+        serverLog(LL_NOTICE,
+            "Background AOF rewrite terminated with success");
+        snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof",
+            (int)server.aof_child_pid);
+        if (backgroundRewriteDoneMultiPart(tmpfile) == C_OK) {
+            server.aof_lastbgrewrite_status = C_OK;
+            serverLog(LL_NOTICE,
+                "Background AOF rewrite finished successfully");
+            if (server.aof_state == AOF_WAIT_REWRITE)
+                server.aof_state = AOF_ON;
+        } else {
+            server.aof_lastbgrewrite_status = C_ERR;
+        }
+    } else if (!bysignal && exitcode == 0) {
         int newfd, oldfd;
         char tmpfile[256];
         long long now = ustime();
-        mstime_t latency;
+        ustime_t latency;
 
         serverLog(LL_NOTICE,
             "Background AOF rewrite terminated with success");
 
+        /* The writer thread must be done with the old AOF before the file
+         * descriptor is switched. */
+        aofWriterDrain();
+
         /* Flush the differences accumulated by the parent to the
          * rewritten AOF. */
         latencyStartMonitor(latency);
@@ -1750,6 +2774,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
         }
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-rename",latency);
+        bioCreateSyscallJob(BIO_SYSCALL_FSYNC_DIR,server.aof_filename);
 
         if (server.aof_fd == -1) {
             /* AOF disabled, we don't need to set the AOF file descriptor
@@ -1759,10 +2784,15 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             /* AOF enabled, replace the old fd with the new one. */
             oldfd = server.aof_fd;
             server.aof_fd = newfd;
-            if (server.aof_fsync == AOF_FSYNC_ALWAYS)
+            /* The AOF buffer is already part of the rewritten AOF, and it
+             * is cleared below. */
+            server.aof_written_offset += sdslen(server.aof_buf);
+            if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
                 redis_fsync(newfd);
-            else if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
+                server.aof_fsynced_offset = server.aof_written_offset;
+            } else if (server.aof_fsync == AOF_FSYNC_EVERYSEC) {
                 aof_background_fsync(newfd);
+            }
             server.aof_selected_db = -1; /* Make sure SELECT is re-issued */
             aofUpdateCurrentSize();
             server.aof_rewrite_base_size = server.aof_current_size;
@@ -1801,7 +2831,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
     }
 
 cleanup:
-    aofClosePipes();
+    if (!server.aof_multi_part) aofClosePipes();
     aofRewriteBufferReset();
     aofRemoveTempFile(server.aof_child_pid);
     server.aof_child_pid = -1;
@@ -1,10 +1,11 @@
 /* Background I/O service for Redis.
  *
  * This file implements operations that we need to perform in the background.
- * Currently there is only a single operation, that is a background close(2)
- * system call. This is needed as when the process is the last owner of a
- * reference to a file closing it means unlinking it, and the deletion of the
- * file is slow, blocking the server.
+ * The first one was a background close(2) system call. This is needed as when
+ * the process is the last owner of a reference to a file closing it means
+ * unlinking it, and the deletion of the file is slow, blocking the server.
+ * The other slow filesystem calls, like the fsync(2) of a directory, are
+ * performed by the BIO_SYSCALL jobs, see bioUnlinkFile() and bioRenameFile().
  *
  * In the future we'll either continue implementing new things we need or
  * we'll switch to libeio. However there are probably long term uses for this
@@ -25,7 +26,10 @@
  * first).
  *
  * Currently there is no way for the creator of the job to be notified about
- * the completion of the operation, this will only be added when/if needed.
+ * the completion of the operation, this will only be added when/if needed:
+ * the tiered storage reads and the keyspace table allocations notify the
+ * main thread by themselves, see tieredReadFromBioThread() and
+ * dbDictAllocFromBioThread().
  *
  * ----------------------------------------------------------------------------
  *
@@ -61,7 +65,10 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+#include <fcntl.h>
+
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS];
+static int bio_threads_num[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
@@ -84,9 +91,18 @@ struct bio_job {
 };
 
 void *bioProcessBackgroundJobs(void *arg);
+static void bioSyscall(long op, const char *path);
+struct lazyfreeBatch;
+struct lazyfreeChunk;
+struct tieredRead;
+struct dbDictResize;
 void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
-void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *expires);
+void lazyfreeFreeBatchFromBioThread(struct lazyfreeBatch *batch);
+void lazyfreeFreeChunkFromBioThread(struct lazyfreeChunk *chunk);
+void lazyfreeFreeKeysIndexFromBioThread(rax *rt);
+void tieredReadFromBioThread(struct tieredRead *read);
+void dbDictAllocFromBioThread(struct dbDictResize *r);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -120,11 +136,15 @@ void bioInit(void) {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        bio_threads_num[j] =
+            (j == BIO_LAZY_FREE) ? server.lazyfree_threads : 1;
+        for (int t = 0; t < bio_threads_num[j]; t++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][t] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
@@ -159,6 +179,8 @@ void *bioProcessBackgroundJobs(void *arg) {
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
+    redisSetCpuAffinity(server.bio_cpulist);
+
     pthread_mutex_lock(&bio_mutex[type]);
     /* Block SIGALRM so we are sure that only the main thread will
      * receive the watchdog signal. */
@@ -176,9 +198,12 @@ void *bioProcessBackgroundJobs(void *arg) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
+        /* Pop the job from the queue. It is removed from the list right
+         * away, as other threads of the same type may be waiting for jobs,
+         * but it is still accounted as pending till it is processed. */
         ln = listFirst(bio_jobs[type]);
         job = ln->value;
+        listDelNode(bio_jobs[type],ln);
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
@@ -187,18 +212,36 @@ void *bioProcessBackgroundJobs(void *arg) {
         if (type == BIO_CLOSE_FILE) {
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
+            TRACE1(aof_fsync_start,(long)job->arg1);
             redis_fsync((long)job->arg1);
+            TRACE1(aof_fsync_end,(long)job->arg1);
+            /* A non NULL second argument asks to close the file as well. */
+            if (job->arg2) close((long)job->arg1);
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
+             * arg2 & arg3 -> free a dictionary and an expire index (a DB).
+             * only arg2 -> free a batch of objects.
+             * arg2 & arg3 set to the same pointer -> free a chunk of a
+             *   dictionary released by multiple threads in parallel.
+             * only arg3 -> free the keys index of a DB. */
             if (job->arg1)
                 lazyfreeFreeObjectFromBioThread(job->arg1);
+            else if (job->arg2 && job->arg2 == job->arg3)
+                lazyfreeFreeChunkFromBioThread(job->arg2);
             else if (job->arg2 && job->arg3)
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
+            else if (job->arg2)
+                lazyfreeFreeBatchFromBioThread(job->arg2);
             else if (job->arg3)
-                lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+                lazyfreeFreeKeysIndexFromBioThread(job->arg3);
+        } else if (type == BIO_TIERED_READ) {
+            tieredReadFromBioThread(job->arg1);
+        } else if (type == BIO_DICT_ALLOC) {
+            dbDictAllocFromBioThread(job->arg1);
+        } else if (type == BIO_SYSCALL) {
+            bioSyscall((long)job->arg1,job->arg2);
+            zfree(job->arg2);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
@@ -207,7 +250,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -254,15 +296,92 @@ void bioKillThreads(void) {
     int err, j;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can be joined: %s",
-                        j, strerror(err));
-            } else {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+        for (int t = 0; t < bio_threads_num[j]; t++) {
+            if (pthread_cancel(bio_threads[j][t]) == 0) {
+                if ((err = pthread_join(bio_threads[j][t],NULL)) != 0) {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d can be joined: %s",
+                            j, strerror(err));
+                } else {
+                    serverLog(LL_WARNING,
+                        "Bio thread for job type #%d terminated",j);
+                }
             }
         }
     }
 }
+
+/* ------------------------- Deferred file operations ----------------------- */
+
+/* Perform the BIO_SYSCALL operation 'op' on 'path'. */
+static void bioSyscall(long op, const char *path) {
+    if (op == BIO_SYSCALL_FSYNC_DIR) {
+        const char *slash = strrchr(path,'/');
+        sds dir = slash ? sdsnewlen(path,slash == path ? 1 : slash-path) :
+                          sdsnew(".");
+        int fd = open(dir,O_RDONLY);
+
+        /* Not every filesystem supports the fsync of directories. */
+        if (fd == -1 || (redis_fsync(fd) == -1 && errno != EINVAL))
+            serverLog(LL_WARNING,"Can't fsync the directory %s: %s",
+                dir, strerror(errno));
+        if (fd != -1) close(fd);
+        sdsfree(dir);
+    } else {
+        serverPanic("Wrong syscall in bioSyscall().");
+    }
+}
+
+/* Queue the BIO_SYSCALL operation 'op' on 'path'. Before the background
+ * threads are started the operation is performed synchronously. */
+void bioCreateSyscallJob(int op, const char *path) {
+    if (bio_jobs[BIO_SYSCALL] == NULL) {
+        bioSyscall(op,path);
+        return;
+    }
+    bioCreateBackgroundJob(BIO_SYSCALL,(void*)(long)op,zstrdup(path),NULL);
+}
+
+/* Close 'fd' in background: when it is the last reference to an unlinked
+ * file, the close(2) call releases its blocks, that is slow for big files. */
+void bioCloseFile(int fd) {
+    if (bio_jobs[BIO_CLOSE_FILE] == NULL) {
+        close(fd);
+        return;
+    }
+    bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,NULL,NULL);
+}
+
+/* Remove the file at 'path' without blocking while the filesystem releases
+ * its blocks: the name is removed right away, so that it can be reused, but
+ * the file is kept open and closed in background. Returns -1 and sets errno
+ * like unlink(2) on error, 0 otherwise. */
+int bioUnlinkFile(const char *path) {
+    int fd = open(path,O_RDONLY|O_NONBLOCK);
+
+    if (unlink(path) == -1) {
+        int err = errno;
+        if (fd != -1) close(fd);
+        errno = err;
+        return -1;
+    }
+    if (fd != -1) bioCloseFile(fd);
+    return 0;
+}
+
+/* Like rename(2), but a file replaced at 'to' is released in background like
+ * bioUnlinkFile() does, and the directory is then fsync-ed in background,
+ * so that the rename survives a crash of the system. */
+int bioRenameFile(const char *from, const char *to) {
+    int oldfd = open(to,O_RDONLY|O_NONBLOCK);
+
+    if (rename(from,to) == -1) {
+        int err = errno;
+        if (oldfd != -1) close(oldfd);
+        errno = err;
+        return -1;
+    }
+    if (oldfd != -1) bioCloseFile(oldfd);
+    bioCreateSyscallJob(BIO_SYSCALL_FSYNC_DIR,to);
+    return 0;
+}
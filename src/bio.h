@@ -34,9 +34,24 @@ unsigned long long bioPendingJobsOfType(int type);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
+void bioCloseFile(int fd);
+void bioCreateSyscallJob(int op, const char *path);
+int bioUnlinkFile(const char *path);
+int bioRenameFile(const char *from, const char *to);
 
 /* Background job opcodes */
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_TIERED_READ   3 /* Values read from the tiered storage. */
+#define BIO_DICT_ALLOC    4 /* Keyspace tables allocated in background. */
+#define BIO_SYSCALL       5 /* Deferred filesystem syscalls, see below. */
+#define BIO_NUM_OPS       6
+
+/* Operations performed by the BIO_SYSCALL jobs on a path. */
+#define BIO_SYSCALL_FSYNC_DIR 0 /* fsync(2) the directory of the path. */
+
+/* Every job type is served by a single thread, so that the jobs are executed
+ * in order, except the lazy free jobs, that can be served by a pool of up to
+ * BIO_MAX_THREADS threads, see the lazyfree-threads option. */
+#define BIO_MAX_THREADS   16
@@ -30,17 +30,257 @@
 
 #include "server.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* -----------------------------------------------------------------------------
+ * SIMD kernels.
+ *
+ * On x86_64 the hot loops of BITCOUNT, BITOP and BITPOS have versions using
+ * POPCNT, AVX2 and AVX-512, compiled with the target attribute so that the
+ * rest of the server doesn't need any special compiler flag. The best ones
+ * supported by the CPU are selected at startup by bitopsSelectKernels(): when
+ * a kernel is NULL the portable code is used. Every kernel processes only a
+ * multiple of BITOPS_SIMD_BLOCK bytes, the remaining bytes are handled by the
+ * portable code.
+ * -------------------------------------------------------------------------- */
+
+#define BITOPS_SIMD_BLOCK 128
+
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+static struct {
+    const char *name;   /* Instruction set of the selected kernels. */
+    /* Return the number of bits set in 'len' bytes at 'p'. */
+    uint64_t (*popcount)(const unsigned char *p, size_t len);
+    /* Store at 'res' 'len' bytes computing 'op' among the 'numkeys' strings
+     * of 'src'. */
+    void (*bitop)(int op, unsigned char *res, unsigned char **src,
+                  unsigned long numkeys, size_t len);
+    /* Return the number of bytes at the start of the 'len' bytes at 'p'
+     * that are all zero (if 'bit' is 1) or all 0xff (if 'bit' is 0). */
+    size_t (*bitpos)(const unsigned char *p, size_t len, int bit);
+} bitopsKernels = {"none",NULL,NULL,NULL};
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("popcnt")))
+static uint64_t popcountPOPCNT(const unsigned char *p, size_t len) {
+    uint64_t a = 0, b = 0, c = 0, d = 0, w[4];
+
+    for (size_t j = 0; j < len; j += 32) {
+        memcpy(w,p+j,sizeof(w));
+        a += __builtin_popcountll(w[0]);
+        b += __builtin_popcountll(w[1]);
+        c += __builtin_popcountll(w[2]);
+        d += __builtin_popcountll(w[3]);
+    }
+    return a+b+c+d;
+}
+
+/* Count the bits of every vector looking up the count of each nibble in a
+ * 16 entries table with PSHUFB, and sum the byte counts with PSADBW. */
+__attribute__((target("avx2")))
+static uint64_t popcountAVX2(const unsigned char *p, size_t len) {
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+
+    for (size_t j = 0; j < len; j += 64) {
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(p+j));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(p+j+32));
+        __m256i c1 = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut,_mm256_and_si256(v1,low)),
+            _mm256_shuffle_epi8(lut,_mm256_and_si256(_mm256_srli_epi16(v1,4),low)));
+        __m256i c2 = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut,_mm256_and_si256(v2,low)),
+            _mm256_shuffle_epi8(lut,_mm256_and_si256(_mm256_srli_epi16(v2,4),low)));
+        acc = _mm256_add_epi64(acc,_mm256_sad_epu8(_mm256_add_epi8(c1,c2),
+                                                   _mm256_setzero_si256()));
+    }
+    return (uint64_t)_mm256_extract_epi64(acc,0) +
+           (uint64_t)_mm256_extract_epi64(acc,1) +
+           (uint64_t)_mm256_extract_epi64(acc,2) +
+           (uint64_t)_mm256_extract_epi64(acc,3);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t popcountAVX512(const unsigned char *p, size_t len) {
+    const __m512i lut = _mm512_set_epi8(4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0,
+                                        4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0,
+                                        4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0,
+                                        4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0);
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    __m512i acc = _mm512_setzero_si512();
+
+    for (size_t j = 0; j < len; j += 128) {
+        __m512i v1 = _mm512_loadu_si512((const void*)(p+j));
+        __m512i v2 = _mm512_loadu_si512((const void*)(p+j+64));
+        __m512i c1 = _mm512_add_epi8(
+            _mm512_shuffle_epi8(lut,_mm512_and_si512(v1,low)),
+            _mm512_shuffle_epi8(lut,_mm512_and_si512(_mm512_srli_epi16(v1,4),low)));
+        __m512i c2 = _mm512_add_epi8(
+            _mm512_shuffle_epi8(lut,_mm512_and_si512(v2,low)),
+            _mm512_shuffle_epi8(lut,_mm512_and_si512(_mm512_srli_epi16(v2,4),low)));
+        acc = _mm512_add_epi64(acc,_mm512_sad_epu8(_mm512_add_epi8(c1,c2),
+                                                   _mm512_setzero_si512()));
+    }
+    return _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx2")))
+static void bitopAVX2(int op, unsigned char *res, unsigned char **src,
+                      unsigned long numkeys, size_t len)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    for (size_t j = 0; j < len; j += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src[0]+j));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src[0]+j+32));
+        for (unsigned long i = 1; i < numkeys; i++) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(src[i]+j));
+            __m256i y = _mm256_loadu_si256((const __m256i*)(src[i]+j+32));
+            if (op == BITOP_AND) {
+                a = _mm256_and_si256(a,x);
+                b = _mm256_and_si256(b,y);
+            } else if (op == BITOP_OR) {
+                a = _mm256_or_si256(a,x);
+                b = _mm256_or_si256(b,y);
+            } else {
+                a = _mm256_xor_si256(a,x);
+                b = _mm256_xor_si256(b,y);
+            }
+        }
+        if (op == BITOP_NOT) {
+            a = _mm256_xor_si256(a,ones);
+            b = _mm256_xor_si256(b,ones);
+        }
+        _mm256_storeu_si256((__m256i*)(res+j),a);
+        _mm256_storeu_si256((__m256i*)(res+j+32),b);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void bitopAVX512(int op, unsigned char *res, unsigned char **src,
+                        unsigned long numkeys, size_t len)
+{
+    const __m512i ones = _mm512_set1_epi8(-1);
+
+    for (size_t j = 0; j < len; j += 128) {
+        __m512i a = _mm512_loadu_si512((const void*)(src[0]+j));
+        __m512i b = _mm512_loadu_si512((const void*)(src[0]+j+64));
+        for (unsigned long i = 1; i < numkeys; i++) {
+            __m512i x = _mm512_loadu_si512((const void*)(src[i]+j));
+            __m512i y = _mm512_loadu_si512((const void*)(src[i]+j+64));
+            if (op == BITOP_AND) {
+                a = _mm512_and_si512(a,x);
+                b = _mm512_and_si512(b,y);
+            } else if (op == BITOP_OR) {
+                a = _mm512_or_si512(a,x);
+                b = _mm512_or_si512(b,y);
+            } else {
+                a = _mm512_xor_si512(a,x);
+                b = _mm512_xor_si512(b,y);
+            }
+        }
+        if (op == BITOP_NOT) {
+            a = _mm512_xor_si512(a,ones);
+            b = _mm512_xor_si512(b,ones);
+        }
+        _mm512_storeu_si512((void*)(res+j),a);
+        _mm512_storeu_si512((void*)(res+j+64),b);
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t bitposAVX2(const unsigned char *p, size_t len, int bit) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t j;
+
+    for (j = 0; j+BITOPS_SIMD_BLOCK <= len; j += BITOPS_SIMD_BLOCK) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p+j));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p+j+32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(p+j+64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(p+j+96));
+        if (bit) {
+            __m256i v = _mm256_or_si256(_mm256_or_si256(a,b),
+                                        _mm256_or_si256(c,d));
+            if (!_mm256_testz_si256(v,v)) break;
+        } else {
+            __m256i v = _mm256_and_si256(_mm256_and_si256(a,b),
+                                         _mm256_and_si256(c,d));
+            if (!_mm256_testc_si256(v,ones)) break;
+        }
+    }
+    return j;
+}
+
+__attribute__((target("avx512f")))
+static size_t bitposAVX512(const unsigned char *p, size_t len, int bit) {
+    const __m512i skip = _mm512_set1_epi8(bit ? 0 : -1);
+    size_t j;
+
+    for (j = 0; j+BITOPS_SIMD_BLOCK <= len; j += BITOPS_SIMD_BLOCK) {
+        __m512i a = _mm512_loadu_si512((const void*)(p+j));
+        __m512i b = _mm512_loadu_si512((const void*)(p+j+64));
+        if (_mm512_cmpneq_epi64_mask(a,skip) ||
+            _mm512_cmpneq_epi64_mask(b,skip)) break;
+    }
+    return j;
+}
+#endif
+
+/* Select the SIMD kernels supported by the CPU. Called at startup. */
+void bitopsSelectKernels(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw"))
+    {
+        bitopsKernels.name = "avx512";
+        bitopsKernels.popcount = popcountAVX512;
+        bitopsKernels.bitop = bitopAVX512;
+        bitopsKernels.bitpos = bitposAVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        bitopsKernels.name = "avx2";
+        bitopsKernels.popcount = popcountAVX2;
+        bitopsKernels.bitop = bitopAVX2;
+        bitopsKernels.bitpos = bitposAVX2;
+    } else if (__builtin_cpu_supports("popcnt")) {
+        bitopsKernels.name = "popcnt";
+        bitopsKernels.popcount = popcountPOPCNT;
+    }
+#endif
+}
+
+/* Return the name of the instruction set used by the bit operations. */
+const char *bitopsKernelsName(void) {
+    return bitopsKernels.name;
+}
+
 /* -----------------------------------------------------------------------------
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
 /* Count number of bits set in the binary array pointed by 's' and long
  * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+ * work with a input string length up to 512 MB. If 'simd' is zero the
+ * SIMD kernel is not used. */
+static size_t popcountGeneric(void *s, long count, int simd) {
     size_t bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
+
+    if (simd && bitopsKernels.popcount && count >= BITOPS_SIMD_BLOCK) {
+        long len = count & ~(BITOPS_SIMD_BLOCK-1);
+        bits = bitopsKernels.popcount(p,len);
+        p += len;
+        count -= len;
+    }
     static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
     /* Count initial bytes not aligned to 32 bit. */
@@ -91,14 +331,20 @@ size_t redisPopcount(void *s, long count) {
     return bits;
 }
 
+size_t redisPopcount(void *s, long count) {
+    return popcountGeneric(s,count,1);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
  * The function is guaranteed to return a value >= 0 if 'bit' is 0 since if
  * no zero bit is found, it returns count*8 assuming the string is zero
  * padded on the right. However if 'bit' is 1 it is possible that there is
- * not a single set bit in the bitmap. In this special case -1 is returned. */
-long redisBitpos(void *s, unsigned long count, int bit) {
+ * not a single set bit in the bitmap. In this special case -1 is returned.
+ *
+ * If 'simd' is zero the SIMD kernel is not used. */
+static long bitposGeneric(void *s, unsigned long count, int bit, int simd) {
     unsigned long *l;
     unsigned char *c;
     unsigned long skipval, word = 0, one;
@@ -129,6 +375,15 @@ long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
+    /* Skip whole blocks with the SIMD kernel, if any. The blocks are a
+     * multiple of the word size, so 'c' stays aligned. */
+    if (!found && simd && bitopsKernels.bitpos) {
+        size_t skipped = bitopsKernels.bitpos(c,count,bit);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
+
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
@@ -185,6 +440,10 @@ long redisBitpos(void *s, unsigned long count, int bit) {
     return 0; /* Just to avoid warnings. */
 }
 
+long redisBitpos(void *s, unsigned long count, int bit) {
+    return bitposGeneric(s,count,bit,1);
+}
+
 /* The following set.*Bitfield and get.*Bitfield functions implement setting
  * and getting arbitrary size (up to 64 bits) signed and unsigned integers
  * at arbitrary positions into a bitmap.
@@ -388,14 +647,227 @@ void printBits(unsigned char *p, unsigned long count) {
     printf("\n");
 }
 
+static unsigned long bitopFastPath(int op, unsigned char *res,
+                                   unsigned char **src, unsigned long numkeys,
+                                   unsigned long minlen, int simd);
+
+/* Implements DEBUG BITOPS-BENCHMARK: time the SIMD kernels selected for this
+ * CPU against the portable code, with random bitmaps of 'bytes' bytes, and
+ * verify that they return the same results. */
+void bitopsBenchmark(client *c, long long bytes, long long iterations) {
+    unsigned char *a = zmalloc(bytes), *b = zmalloc(bytes);
+    unsigned char *res[2] = {zmalloc(bytes), zmalloc(bytes)};
+    unsigned char *zero = zcalloc(bytes);
+    unsigned char *src[2] = {a,b};
+    long long elapsed[3][2];
+    size_t bits[2] = {0,0};
+    long pos[2] = {0,0};
+    int mismatch = 0;
+
+    getRandomBytes(a,bytes);
+    getRandomBytes(b,bytes);
+    zero[bytes-1] = 1;
+    for (int simd = 0; simd <= 1; simd++) {
+        long long start = ustime();
+        for (long long j = 0; j < iterations; j++)
+            bits[simd] = popcountGeneric(a,bytes,simd);
+        elapsed[0][simd] = ustime()-start;
+
+        start = ustime();
+        for (long long j = 0; j < iterations; j++) {
+            unsigned long done =
+                bitopFastPath(BITOP_AND,res[simd],src,2,bytes,simd);
+            for (; done < (unsigned long)bytes; done++)
+                res[simd][done] = a[done] & b[done];
+        }
+        elapsed[1][simd] = ustime()-start;
+
+        start = ustime();
+        for (long long j = 0; j < iterations; j++)
+            pos[simd] = bitposGeneric(zero,bytes,1,simd);
+        elapsed[2][simd] = ustime()-start;
+    }
+    if (bits[0] != bits[1] || pos[0] != pos[1] ||
+        memcmp(res[0],res[1],bytes) != 0) mismatch = 1;
+    zfree(a);
+    zfree(b);
+    zfree(res[0]);
+    zfree(res[1]);
+    zfree(zero);
+
+    if (mismatch) {
+        addReplyError(c,"The SIMD kernels returned a wrong result");
+        return;
+    }
+    const char *names[3] = {"bitcount","bitop-and","bitpos"};
+    addReplyArrayLen(c,4);
+    addReplyBulkSds(c,sdscatprintf(sdsempty(),"kernels: %s",
+                                   bitopsKernels.name));
+    for (int j = 0; j < 3; j++) {
+        addReplyBulkSds(c,sdscatprintf(sdsempty(),
+            "%s: portable %lld usec, simd %lld usec",
+            names[j],elapsed[j][0],elapsed[j][1]));
+    }
+}
+
 /* -----------------------------------------------------------------------------
- * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * Roaring bitmaps.
+ *
+ * Bitmaps that SETBIT would grow beyond bitmap-roaring-min-bytes are encoded
+ * as roaring bitmaps (see roaring.c) when this takes less memory than the
+ * plain string. SETBIT, GETBIT, BITCOUNT, BITPOS, BITOP and the BITFIELD
+ * reads work directly on them, every other command converts them to plain
+ * strings, see lookupKey(). As soon as a roaring bitmap takes more memory
+ * than the plain string, it is converted back.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
+/* Return true if a bitmap of 'len' bytes can be a roaring bitmap. */
+static int bitmapCanUseRoaring(size_t len) {
+    return server.bitmap_roaring_min_bytes &&
+           len > (unsigned long long)server.bitmap_roaring_min_bytes;
+}
+
+/* Return true if the roaring bitmap 'r' takes more memory than the plain
+ * string it represents. */
+static int bitmapRoaringIsDense(roaring *r) {
+    return roaringMemUsage(r) >= r->len;
+}
+
+/* Convert the roaring bitmap 'o' into a plain string, in place. */
+void bitmapConvertToRaw(robj *o) {
+    roaring *r = o->ptr;
+    sds s = sdsnewlen(NULL,r->len);
+
+    serverAssert(o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING);
+    roaringGetBytes(r,0,r->len,(unsigned char*)s);
+    roaringFree(r);
+    o->ptr = s;
+    o->encoding = OBJ_ENCODING_RAW;
+}
+
+/* Return the number of bits set in the 'count' bytes starting at byte
+ * 'start' of the roaring bitmap 'r'. */
+static long long roaringBitcount(roaring *r, size_t start, size_t count) {
+    unsigned char chunk[ROARING_CHUNK_BYTES];
+    size_t end = start+count;
+    long long bits = 0;
+    uint32_t j;
+
+    for (j = roaringFind(r,start/ROARING_CHUNK_BYTES); j < r->count; j++) {
+        size_t base = (size_t)r->containers[j].key*ROARING_CHUNK_BYTES;
+        if (base >= end) break;
+
+        if (base >= start && base+ROARING_CHUNK_BYTES <= end) {
+            bits += r->containers[j].card;
+        } else {
+            size_t from = base > start ? base : start;
+            size_t to = base+ROARING_CHUNK_BYTES < end ?
+                        base+ROARING_CHUNK_BYTES : end;
+            roaringGetBytes(r,from,to-from,chunk);
+            bits += redisPopcount(chunk,to-from);
+        }
+    }
+    return bits;
+}
+
+/* Like redisBitpos(), for the 'count' bytes starting at byte 'start' of the
+ * roaring bitmap 'r'. The chunks without a container are all zero. */
+static long roaringBitpos(roaring *r, size_t start, size_t count, int bit) {
+    unsigned char chunk[ROARING_CHUNK_BYTES];
+    size_t end = start+count, from = start;
+    uint32_t j = roaringFind(r,start/ROARING_CHUNK_BYTES);
+
+    while (from < end) {
+        size_t key = from/ROARING_CHUNK_BYTES;
+        size_t to = (key+1)*ROARING_CHUNK_BYTES;
+        if (to > end) to = end;
+
+        if (j == r->count || r->containers[j].key != key) {
+            /* Missing chunk: a clear bit is found, or we can jump to the
+             * next container. */
+            if (bit == 0) return (from-start)*8;
+            if (j == r->count) break;
+            from = (size_t)r->containers[j].key*ROARING_CHUNK_BYTES;
+            continue;
+        }
+
+        roaringGetBytes(r,from,to-from,chunk);
+        long pos = redisBitpos(chunk,to-from,bit);
+        if (pos != -1 && (size_t)pos != (to-from)*8)
+            return (from-start)*8+pos;
+        from = to;
+        j++;
+    }
+    return bit ? -1 : (long)count*8;
+}
+
+/* Compute BITOP 'op' (AND, OR or XOR) among the 'numkeys' roaring bitmaps
+ * of 'src', where NULL stands for a missing key, chunk by chunk. Only the
+ * chunks having a container in some source (in all the sources for AND) are
+ * computed, the others are all zero in the result. */
+static roaring *roaringBitop(int op, roaring **src, unsigned long numkeys,
+                             size_t maxlen)
+{
+    roaring *res = roaringNew(maxlen);
+    uint32_t *idx = zcalloc(sizeof(uint32_t)*numkeys);
+    unsigned char **chunks = zmalloc(sizeof(unsigned char*)*numkeys);
+    unsigned char *out = zmalloc(ROARING_CHUNK_BYTES*(numkeys+1));
+    unsigned long j;
+
+    for (j = 0; j < numkeys; j++)
+        chunks[j] = out+ROARING_CHUNK_BYTES*(j+1);
+
+    while(1) {
+        /* The next chunk is the lowest one of the containers not yet
+         * processed. */
+        uint64_t key = UINT64_MAX;
+        unsigned long present = 0;
+
+        for (j = 0; j < numkeys; j++) {
+            if (src[j] && idx[j] < src[j]->count &&
+                src[j]->containers[idx[j]].key < key)
+                key = src[j]->containers[idx[j]].key;
+        }
+        if (key == UINT64_MAX) break;
+
+        for (j = 0; j < numkeys; j++) {
+            if (src[j] && idx[j] < src[j]->count &&
+                src[j]->containers[idx[j]].key == key)
+            {
+                roaringGetBytes(src[j],key*ROARING_CHUNK_BYTES,
+                                ROARING_CHUNK_BYTES,chunks[j]);
+                idx[j]++;
+                present++;
+            } else {
+                memset(chunks[j],0,ROARING_CHUNK_BYTES);
+            }
+        }
+        if (op == BITOP_AND && present != numkeys) continue;
+
+        unsigned long i, k;
+        k = bitopFastPath(op,out,chunks,numkeys,ROARING_CHUNK_BYTES,1);
+        for (; k < ROARING_CHUNK_BYTES; k++) {
+            unsigned char output = chunks[0][k];
+            for (i = 1; i < numkeys; i++) {
+                switch(op) {
+                case BITOP_AND: output &= chunks[i][k]; break;
+                case BITOP_OR:  output |= chunks[i][k]; break;
+                case BITOP_XOR: output ^= chunks[i][k]; break;
+                }
+            }
+            out[k] = output;
+        }
+        roaringSetChunk(res,key,out);
+    }
+    zfree(idx);
+    zfree(chunks);
+    zfree(out);
+    return res;
+}
+
+/* -----------------------------------------------------------------------------
+ * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
+ * -------------------------------------------------------------------------- */
 
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
@@ -470,26 +942,6 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
     return C_OK;
 }
 
-/* This is an helper function for commands implementations that need to write
- * bits to a string object. The command creates or pad with zeroes the string
- * so that the 'maxbit' bit can be addressed. The object is finally
- * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
-robj *lookupStringForBitCommand(client *c, size_t maxbit) {
-    size_t byte = maxbit >> 3;
-    robj *o = lookupKeyWrite(c->db,c->argv[1]);
-
-    if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
-        dbAdd(c->db,c->argv[1],o);
-    } else {
-        if (checkType(c,o,OBJ_STRING)) return NULL;
-        o = dbUnshareStringValue(c->db,c->argv[1],o);
-        o->ptr = sdsgrowzero(o->ptr,byte+1);
-    }
-    return o;
-}
-
 /* Return a pointer to the string object content, and stores its length
  * in 'len'. The user is required to pass (likely stack allocated) buffer
  * 'llbuf' of at least LONG_STR_SIZE bytes. Such a buffer is used in the case
@@ -521,6 +973,56 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     return p;
 }
 
+/* This is an helper function for commands implementations that need to write
+ * bits to a string object. The command creates or pad with zeroes the string
+ * so that the 'maxbit' bit can be addressed. The object is finally
+ * returned. Otherwise if the key holds a wrong type NULL is returned and
+ * an error is sent to the client.
+ *
+ * If 'allow_roaring' is true the caller can handle roaring bitmaps: the returned
+ * object is one when it is, or when the string would be grown beyond
+ * bitmap-roaring-min-bytes and a roaring bitmap takes less memory. In this
+ * case the caller is in charge of extending the bitmap when setting bits
+ * after its end. Otherwise roaring bitmaps are converted to plain strings. */
+robj *lookupStringForBitCommand(client *c, size_t maxbit, int allow_roaring) {
+    size_t byte = maxbit >> 3;
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+
+    if (o == NULL) {
+        if (allow_roaring && bitmapCanUseRoaring(byte+1))
+            o = createRoaringObject(byte+1);
+        else
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        dbAdd(c->db,c->argv[1],o);
+        return o;
+    }
+
+    if (checkType(c,o,OBJ_STRING)) return NULL;
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        if (allow_roaring) return o;
+        bitmapConvertToRaw(o);
+    } else if (allow_roaring && bitmapCanUseRoaring(byte+1) &&
+               byte+1 > stringObjectLen(o))
+    {
+        char llbuf[LONG_STR_SIZE];
+        long len;
+        unsigned char *p = getObjectReadOnlyString(o,&len,llbuf);
+        roaring *r = roaringFromBuffer(p,len);
+
+        r->len = byte+1;
+        if (!bitmapRoaringIsDense(r)) {
+            o = createObject(OBJ_STRING,r);
+            o->encoding = OBJ_ENCODING_ROARING;
+            dbOverwrite(c->db,c->argv[1],o);
+            return o;
+        }
+        roaringFree(r);
+    }
+    o = dbUnshareStringValue(c->db,c->argv[1],o);
+    o->ptr = sdsgrowzero(o->ptr,byte+1);
+    return o;
+}
+
 /* SETBIT key offset bitvalue */
 void setbitCommand(client *c) {
     robj *o;
@@ -542,18 +1044,23 @@ void setbitCommand(client *c) {
         return;
     }
 
-    if ((o = lookupStringForBitCommand(c,bitoffset)) == NULL) return;
+    if ((o = lookupStringForBitCommand(c,bitoffset,1)) == NULL) return;
 
-    /* Get current values */
-    byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
-    bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringSetBit(o->ptr,bitoffset,on);
+        if (bitmapRoaringIsDense(o->ptr)) bitmapConvertToRaw(o);
+    } else {
+        /* Get current values */
+        byte = bitoffset >> 3;
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bit = 7 - (bitoffset & 0x7);
+        bitval = byteval & (1 << bit);
 
-    /* Update byte with new bit value and return original value */
-    byteval &= ~(1 << bit);
-    byteval |= ((on & 0x1) << bit);
-    ((uint8_t*)o->ptr)[byte] = byteval;
+        /* Update byte with new bit value and return original value */
+        byteval &= ~(1 << bit);
+        byteval |= ((on & 0x1) << bit);
+        ((uint8_t*)o->ptr)[byte] = byteval;
+    }
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
     server.dirty++;
@@ -576,7 +1083,9 @@ void getbitCommand(client *c) {
 
     byte = bitoffset >> 3;
     bit = 7 - (bitoffset & 0x7);
-    if (sdsEncodedObject(o)) {
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringGetBit(o->ptr,bitoffset);
+    } else if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
     } else {
@@ -587,12 +1096,102 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+/* Fast path of BITOP: as far as we have data for all the input bitmaps, that
+ * is for the first 'minlen' bytes, we can take a fast path that performs much
+ * better than the vanilla algorithm. Return the number of bytes of 'res'
+ * computed, starting from the first byte. If 'simd' is zero the SIMD kernel
+ * is not used.
+ *
+ * On ARM we skip the word at a time loop since it will result in GCC
+ * compiling the code using multiple-words load/store operations that are not
+ * supported even in ARM >= v6. */
+static unsigned long bitopFastPath(int op, unsigned char *res,
+                                   unsigned char **src, unsigned long numkeys,
+                                   unsigned long minlen, int simd)
+{
+    unsigned long j = 0;
+
+    if (simd && bitopsKernels.bitop && minlen >= BITOPS_SIMD_BLOCK) {
+        j = minlen & ~(BITOPS_SIMD_BLOCK-1);
+        bitopsKernels.bitop(op,res,src,numkeys,j);
+        minlen -= j;
+    }
+
+    #ifndef USE_ALIGNED_ACCESS
+    if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
+        unsigned long *lp[16], i;
+        unsigned long *lres = (unsigned long*) (res+j);
+
+        /* Note: sds pointer is always aligned to 8 byte boundary, and the
+         * SIMD kernel processes whole blocks. */
+        for (i = 0; i < numkeys; i++) lp[i] = (unsigned long*) (src[i]+j);
+        memcpy(res+j,src[0]+j,minlen);
+
+        /* Different branches per different operations for speed (sorry). */
+        if (op == BITOP_AND) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] &= lp[i][0];
+                    lres[1] &= lp[i][1];
+                    lres[2] &= lp[i][2];
+                    lres[3] &= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_OR) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] |= lp[i][0];
+                    lres[1] |= lp[i][1];
+                    lres[2] |= lp[i][2];
+                    lres[3] |= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_XOR) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                for (i = 1; i < numkeys; i++) {
+                    lres[0] ^= lp[i][0];
+                    lres[1] ^= lp[i][1];
+                    lres[2] ^= lp[i][2];
+                    lres[3] ^= lp[i][3];
+                    lp[i]+=4;
+                }
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        } else if (op == BITOP_NOT) {
+            while(minlen >= sizeof(unsigned long)*4) {
+                lres[0] = ~lres[0];
+                lres[1] = ~lres[1];
+                lres[2] = ~lres[2];
+                lres[3] = ~lres[3];
+                lres+=4;
+                j += sizeof(unsigned long)*4;
+                minlen -= sizeof(unsigned long)*4;
+            }
+        }
+    }
+    #endif
+    return j;
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 void bitopCommand(client *c) {
     char *opname = c->argv[1]->ptr;
     robj *o, *targetkey = c->argv[2];
     unsigned long op, j, numkeys;
     robj **objects;      /* Array of source objects. */
+    roaring **rsrc = NULL; /* Array of source roaring bitmaps. */
+    roaring *rres = NULL; /* Resulting roaring bitmap. */
+    unsigned long roaring_keys = 0; /* Number of roaring sources. */
     unsigned char **src; /* Array of source strings pointers. */
     unsigned long *len, maxlen = 0; /* Array of length of src strings,
                                        and max len. */
@@ -629,9 +1228,6 @@ void bitopCommand(client *c) {
         /* Handle non-existing keys as empty strings. */
         if (o == NULL) {
             objects[j] = NULL;
-            src[j] = NULL;
-            len[j] = 0;
-            minlen = 0;
             continue;
         }
         /* Return an error if one of the keys is not a string. */
@@ -646,89 +1242,53 @@ void bitopCommand(client *c) {
             zfree(objects);
             return;
         }
-        objects[j] = getDecodedObject(o);
-        src[j] = objects[j]->ptr;
-        len[j] = sdslen(objects[j]->ptr);
+        incrRefCount(o);
+        objects[j] = o;
+        if (o->encoding == OBJ_ENCODING_ROARING) roaring_keys++;
+    }
+
+    /* If all the existing sources are roaring bitmaps, the result is
+     * computed only for their chunks having bits set. Otherwise the roaring
+     * bitmaps are decoded as plain strings. */
+    if (roaring_keys && op != BITOP_NOT) {
+        for (j = 0; j < numkeys; j++) {
+            if (objects[j] && objects[j]->encoding != OBJ_ENCODING_ROARING)
+                break;
+        }
+        if (j == numkeys) rsrc = zmalloc(sizeof(roaring*) * numkeys);
+    }
+    for (j = 0; j < numkeys; j++) {
+        if (objects[j] == NULL) {
+            if (rsrc) rsrc[j] = NULL;
+            src[j] = NULL;
+            len[j] = 0;
+            minlen = 0;
+            continue;
+        }
+        if (rsrc) {
+            rsrc[j] = objects[j]->ptr;
+            len[j] = rsrc[j]->len;
+        } else {
+            o = getDecodedObject(objects[j]);
+            decrRefCount(objects[j]);
+            objects[j] = o;
+            src[j] = objects[j]->ptr;
+            len[j] = sdslen(objects[j]->ptr);
+        }
         if (len[j] > maxlen) maxlen = len[j];
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
     /* Compute the bit operation, if at least one string is not empty. */
-    if (maxlen) {
+    if (maxlen && rsrc) {
+        rres = roaringBitop(op,rsrc,numkeys,maxlen);
+    } else if (maxlen) {
         res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
 
-        /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
-        j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
-        }
-        #endif
-
-        /* j is set to the next byte to process by the previous loop. */
+        /* j is set to the next byte to process by the fast path. */
+        j = bitopFastPath(op,res,src,numkeys,minlen,1);
         for (; j < maxlen; j++) {
             output = (len[0] <= j) ? 0 : src[0][j];
             if (op == BITOP_NOT) output = ~output;
@@ -750,10 +1310,17 @@ void bitopCommand(client *c) {
     zfree(src);
     zfree(len);
     zfree(objects);
+    zfree(rsrc);
 
     /* Store the computed value into the target key */
     if (maxlen) {
-        o = createObject(OBJ_STRING,res);
+        if (rres) {
+            o = createObject(OBJ_STRING,rres);
+            o->encoding = OBJ_ENCODING_ROARING;
+            if (bitmapRoaringIsDense(rres)) bitmapConvertToRaw(o);
+        } else {
+            o = createObject(OBJ_STRING,res);
+        }
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -775,7 +1342,12 @@ void bitcountCommand(client *c) {
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = ((roaring*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4) {
@@ -810,7 +1382,10 @@ void bitcountCommand(client *c) {
     } else {
         long bytes = end-start+1;
 
-        addReplyLongLong(c,redisPopcount(p+start,bytes));
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            addReplyLongLong(c,roaringBitcount(o->ptr,start,bytes));
+        else
+            addReplyLongLong(c,redisPopcount(p+start,bytes));
     }
 }
 
@@ -839,7 +1414,12 @@ void bitposCommand(client *c) {
         return;
     }
     if (checkType(c,o,OBJ_STRING)) return;
-    p = getObjectReadOnlyString(o,&strlen,llbuf);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        p = NULL;
+        strlen = ((roaring*)o->ptr)->len;
+    } else {
+        p = getObjectReadOnlyString(o,&strlen,llbuf);
+    }
 
     /* Parse start/end range if any. */
     if (c->argc == 4 || c->argc == 5) {
@@ -874,7 +1454,9 @@ void bitposCommand(client *c) {
         addReplyLongLong(c, -1);
     } else {
         long bytes = end-start+1;
-        long pos = redisBitpos(p+start,bytes,bit);
+        long pos = o->encoding == OBJ_ENCODING_ROARING ?
+                   roaringBitpos(o->ptr,start,bytes,bit) :
+                   redisBitpos(p+start,bytes,bit);
 
         /* If we are looking for clear bits, and the user specified an exact
          * range with start-end, we can't consider the right of the range as
@@ -1002,7 +1584,7 @@ void bitfieldCommand(client *c) {
         /* Lookup by making room up to the farest bit reached by
          * this operation. */
         if ((o = lookupStringForBitCommand(c,
-            highest_write_offset)) == NULL) {
+            highest_write_offset,0)) == NULL) {
             zfree(ops);
             return;
         }
@@ -1093,7 +1675,7 @@ void bitfieldCommand(client *c) {
             unsigned char *src = NULL;
             char llbuf[LONG_STR_SIZE];
 
-            if (o != NULL)
+            if (o != NULL && o->encoding != OBJ_ENCODING_ROARING)
                 src = getObjectReadOnlyString(o,&strlen,llbuf);
 
             /* For GET we use a trick: before executing the operation
@@ -1103,9 +1685,13 @@ void bitfieldCommand(client *c) {
             memset(buf,0,9);
             int i;
             size_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (size_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_ROARING) {
+                roaringGetBytes(o->ptr,byte,9,buf);
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (size_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -51,8 +51,8 @@
  * to process the query buffer from unblocked clients and remove the clients
  * from the blocked_clients queue.
  *
- * replyToBlockedClientTimedOut() is called by the cron function when
- * a client blocked reaches the specified timeout (if the timeout is set
+ * replyToBlockedClientTimedOut() is called by handleBlockedClientsTimeout()
+ * when a client blocked reaches the specified timeout (if the timeout is set
  * to 0, no timeout is processed).
  * It usually just needs to send a reply to the client.
  *
@@ -111,6 +111,104 @@ void blockClient(client *c, int btype) {
     c->btype = btype;
     server.blocked_clients++;
     server.blocked_clients_by_type[btype]++;
+    addClientToTimeoutTable(c);
+}
+
+/* -----------------------------------------------------------------------------
+ * Blocked clients timeouts
+ *
+ * The clients blocked with a timeout are indexed in the radix tree
+ * server.clients_timeout_table by their timeout, so that the ones timed out
+ * are found in beforeSleep() by handleBlockedClientsTimeout() visiting just
+ * them, and a timer wakes up the event loop at the nearest timeout. Timeouts
+ * are this way handled with milliseconds precision, regardless of server.hz
+ * and of the number of connected clients.
+ * -------------------------------------------------------------------------- */
+
+#define CLIENT_TIMEOUT_KEY_LEN 16
+
+/* Encode the radix tree key: the timeout in big endian, so that the keys
+ * are ordered by time, followed by the client pointer to make it unique. */
+static void encodeTimeoutKey(unsigned char *buf, uint64_t timeout, client *c) {
+    timeout = htonu64(timeout);
+    memcpy(buf,&timeout,sizeof(timeout));
+    memset(buf+8,0,8);
+    memcpy(buf+8,&c,sizeof(c));
+}
+
+/* Decode a key encoded by encodeTimeoutKey(), returning the timeout and
+ * setting the client pointer. */
+static uint64_t decodeTimeoutKey(unsigned char *buf, client **c) {
+    uint64_t timeout;
+    memcpy(&timeout,buf,sizeof(timeout));
+    memcpy(c,buf+8,sizeof(*c));
+    return ntohu64(timeout);
+}
+
+/* Add the client to the timeout table if it is blocked with a timeout. */
+void addClientToTimeoutTable(client *c) {
+    if (c->bpop.timeout == 0) return;
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    if (raxTryInsert(server.clients_timeout_table,buf,sizeof(buf),NULL,NULL))
+        c->flags |= CLIENT_IN_TO_TABLE;
+}
+
+/* Remove the client from the timeout table, if it was there. */
+void removeClientFromTimeoutTable(client *c) {
+    if (!(c->flags & CLIENT_IN_TO_TABLE)) return;
+    c->flags &= ~CLIENT_IN_TO_TABLE;
+    unsigned char buf[CLIENT_TIMEOUT_KEY_LEN];
+    encodeTimeoutKey(buf,c->bpop.timeout,c);
+    raxRemove(server.clients_timeout_table,buf,sizeof(buf),NULL);
+}
+
+/* The timer only exists to wake up the event loop: the timeouts are then
+ * handled by beforeSleep(). */
+static int blockedClientsTimeoutTimerProc(struct aeEventLoop *eventLoop,
+                                          long long id, void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+    server.clients_timeout_timer_id = AE_ERR;
+    return AE_NOMORE;
+}
+
+/* Unblock the clients whose timeout elapsed, and arm the timer for the
+ * nearest timeout still in the table. Called by beforeSleep(). */
+void handleBlockedClientsTimeout(void) {
+    if (raxSize(server.clients_timeout_table) == 0) return;
+    uint64_t now = mstime();
+    raxIterator ri;
+    raxStart(&ri,server.clients_timeout_table);
+    raxSeek(&ri,"^",NULL,0);
+
+    uint64_t next = 0;
+    while(raxNext(&ri)) {
+        client *c;
+        uint64_t timeout = decodeTimeoutKey(ri.key,&c);
+        if (timeout >= now) {
+            next = timeout;
+            break;
+        }
+        c->flags &= ~CLIENT_IN_TO_TABLE;
+        raxRemove(server.clients_timeout_table,ri.key,ri.key_len,NULL);
+        replyToBlockedClientTimedOut(c);
+        unblockClient(c);
+        raxSeek(&ri,"^",NULL,0);
+    }
+    raxStop(&ri);
+
+    /* Make sure the event loop wakes up in time for the next timeout. */
+    if (next == 0) return;
+    if (server.clients_timeout_timer_id != AE_ERR) {
+        if (server.clients_timeout_timer_when <= next) return;
+        aeDeleteTimeEvent(server.el,server.clients_timeout_timer_id);
+    }
+    server.clients_timeout_timer_id = aeCreateTimeEvent(server.el,
+        next-now+1,blockedClientsTimeoutTimerProc,NULL,NULL);
+    server.clients_timeout_timer_when = next;
 }
 
 /* This function is called in the beforeSleep() function of the event loop
@@ -167,12 +265,27 @@ void queueClientForReprocessing(client *c) {
 /* Unblock a client calling the right function depending on the kind
  * of operation the client is blocking for. */
 void unblockClient(client *c) {
+    removeClientFromTimeoutTable(c);
     if (c->btype == BLOCKED_LIST ||
         c->btype == BLOCKED_ZSET ||
         c->btype == BLOCKED_STREAM) {
         unblockClientWaitingData(c);
     } else if (c->btype == BLOCKED_WAIT) {
         unblockClientWaitingReplicas(c);
+    } else if (c->btype == BLOCKED_WAITAOF) {
+        unblockClientWaitingAofFsync(c);
+    } else if (c->btype == BLOCKED_OFFSET) {
+        unblockClientWaitingOffset(c);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        unblockClientWaitingMigrate(c);
+    } else if (c->btype == BLOCKED_CLUSTER_READ) {
+        unblockClientWaitingCrossSlotRead(c);
+    } else if (c->btype == BLOCKED_SETOP) {
+        unblockClientWaitingSetop(c);
+    } else if (c->btype == BLOCKED_REPLY) {
+        unblockClientWaitingReply(c);
+    } else if (c->btype == BLOCKED_TIERED) {
+        unblockClientWaitingTiered(c);
     } else if (c->btype == BLOCKED_MODULE) {
         if (moduleClientIsBlockedOnKeys(c)) unblockClientWaitingData(c);
         unblockClientFromModule(c);
@@ -198,6 +311,17 @@ void replyToBlockedClientTimedOut(client *c) {
         addReplyNullArray(c);
     } else if (c->btype == BLOCKED_WAIT) {
         addReplyLongLong(c,replicationCountAcksByOffset(c->bpop.reploffset));
+    } else if (c->btype == BLOCKED_WAITAOF || c->btype == BLOCKED_OFFSET) {
+        addReplyLongLong(c,0);
+    } else if (c->btype == BLOCKED_MIGRATE) {
+        /* Only CLIENT UNBLOCK gets here, the transfer goes on. */
+        addReplyError(c,"-UNBLOCKED the keys are still migrated in the background");
+    } else if (c->btype == BLOCKED_CLUSTER_READ) {
+        /* Only CLIENT UNBLOCK gets here. */
+        addReplyError(c,"-UNBLOCKED client unblocked while reading the keys");
+    } else if (c->btype == BLOCKED_SETOP) {
+        /* Only CLIENT UNBLOCK gets here, the result is still stored. */
+        addReplyError(c,"-UNBLOCKED the result is still computed in the background");
     } else if (c->btype == BLOCKED_MODULE) {
         moduleBlockedClientTimedOut(c);
     } else {
@@ -220,7 +344,11 @@ void disconnectAllBlockedClients(void) {
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
 
-        if (c->flags & CLIENT_BLOCKED) {
+        /* Clients receiving a streamed reply are just reading, and the
+         * ones waiting for the tiered storage execute the command soon. */
+        if (c->flags & CLIENT_BLOCKED && c->btype != BLOCKED_REPLY &&
+            c->btype != BLOCKED_TIERED)
+        {
             addReplySds(c,sdsnew(
                 "-UNBLOCKED force unblock from blocking operation, "
                 "instance state changed (master -> replica?)\r\n"));
@@ -248,8 +376,7 @@ void serveClientsBlockedOnListKey(robj *o, readyList *rl) {
             if (receiver->btype != BLOCKED_LIST) {
                 /* Put at the tail, so that at the next call
                  * we'll not run into it again. */
-                listDelNode(clients,clientnode);
-                listAddNodeTail(clients,receiver);
+                listRotateHeadToTail(clients);
                 continue;
             }
 
@@ -310,8 +437,7 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
             if (receiver->btype != BLOCKED_ZSET) {
                 /* Put at the tail, so that at the next call
                  * we'll not run into it again. */
-                listDelNode(clients,clientnode);
-                listAddNodeTail(clients,receiver);
+                listRotateHeadToTail(clients);
                 continue;
             }
 
@@ -338,97 +464,221 @@ void serveClientsBlockedOnSortedSetKey(robj *o, readyList *rl) {
     }
 }
 
+/* The clients blocked on a stream key are also indexed in db->blocking_streams
+ * by consumer group, so that when new entries arrive just the clients that
+ * can receive them are visited: all the XREAD clients, but only as many
+ * XREADGROUP clients per group as needed to consume the new entries, instead
+ * of every consumer blocked on the key. */
+typedef struct streamBlockedClients {
+    list *readers;  /* Clients blocked in XREAD, in blocking order. */
+    dict *groups;   /* Group name -> list of the clients blocked in
+                       XREADGROUP for the group, in blocking order. */
+} streamBlockedClients;
+
+/* Value destructor of db->blocking_streams. */
+void freeStreamBlockedClients(void *privdata, void *val) {
+    streamBlockedClients *sbc = val;
+
+    UNUSED(privdata);
+    listRelease(sbc->readers);
+    dictRelease(sbc->groups);
+    zfree(sbc);
+}
+
+/* Value of the c->bpop.keys dictionary: the nodes of the lists where the
+ * client is queued for the key, so that it can be removed from them in O(1)
+ * when unblocked, whatever the number of clients blocked on the key. */
+typedef struct bkinfo {
+    listNode *listnode;     /* Node in the db->blocking_keys list. */
+    listNode *streamnode;   /* Node in the db->blocking_streams index. */
+    streamID stream_id;     /* The ID to read after, for BLOCKED_STREAM. */
+} bkinfo;
+
+/* Add the client 'c', that is blocking in XREAD or XREADGROUP, to the index
+ * of the clients blocked on the stream at 'key'. Returns the list node of
+ * the client in the index. */
+static listNode *streamBlockedClientsAdd(client *c, robj *key) {
+    dictEntry *de = dictFind(c->db->blocking_streams,key);
+    streamBlockedClients *sbc;
+
+    if (de == NULL) {
+        sbc = zmalloc(sizeof(*sbc));
+        sbc->readers = listCreate();
+        sbc->groups = dictCreate(&keylistDictType,NULL);
+        dictAdd(c->db->blocking_streams,key,sbc);
+        incrRefCount(key);
+    } else {
+        sbc = dictGetVal(de);
+    }
+
+    if (c->bpop.xread_group) {
+        list *l = dictFetchValue(sbc->groups,c->bpop.xread_group);
+        if (l == NULL) {
+            l = listCreate();
+            dictAdd(sbc->groups,c->bpop.xread_group,l);
+            incrRefCount(c->bpop.xread_group);
+        }
+        listAddNodeTail(l,c);
+        return listLast(l);
+    } else {
+        listAddNodeTail(sbc->readers,c);
+        return listLast(sbc->readers);
+    }
+}
+
+/* Remove the client 'c', queued at 'node', from the index of the clients
+ * blocked on the stream at 'key', releasing what remains empty. */
+static void streamBlockedClientsRemove(client *c, robj *key, listNode *node) {
+    dictEntry *de = dictFind(c->db->blocking_streams,key);
+    serverAssertWithInfo(c,key,de != NULL);
+    streamBlockedClients *sbc = dictGetVal(de);
+
+    if (c->bpop.xread_group) {
+        list *l = dictFetchValue(sbc->groups,c->bpop.xread_group);
+        serverAssertWithInfo(c,key,l != NULL);
+        listDelNode(l,node);
+        if (listLength(l) == 0)
+            dictDelete(sbc->groups,c->bpop.xread_group);
+    } else {
+        listDelNode(sbc->readers,node);
+    }
+    if (listLength(sbc->readers) == 0 && dictSize(sbc->groups) == 0)
+        dictDelete(c->db->blocking_streams,key);
+}
+
+/* Serve a client blocked in XREAD or XREADGROUP (when 'group' is not NULL)
+ * with the entries of the stream 's' at 'key' greater than the ID 'gt', and
+ * unblock it. */
+void serveStreamBlockedClient(client *receiver, robj *key, stream *s,
+                              streamCG *group, streamID *gt)
+{
+    streamID start = *gt;
+    start.seq++; /* Can't overflow, it's an uint64_t */
+
+    /* Lookup the consumer for the group, if any. */
+    streamConsumer *consumer = NULL;
+    int noack = 0;
+
+    if (group) {
+        consumer = streamLookupConsumer(group,
+                   receiver->bpop.xread_consumer->ptr,
+                   1);
+        noack = receiver->bpop.xread_group_noack;
+    }
+
+    /* Emit the two elements sub-array consisting of the name of the
+     * stream and the data we extracted from it. Wrapped in a single-item
+     * array, since we have just one key. */
+    if (receiver->resp == 2) {
+        addReplyArrayLen(receiver,1);
+        addReplyArrayLen(receiver,2);
+    } else {
+        addReplyMapLen(receiver,1);
+    }
+    addReplyBulk(receiver,key);
+
+    streamPropInfo pi = {
+        key,
+        receiver->bpop.xread_group
+    };
+    streamReplyWithRange(receiver,s,&start,NULL,
+                         receiver->bpop.xread_count,
+                         0, group, consumer, noack, &pi);
+
+    /* Note that after we unblock the client, 'gt' and other
+     * receiver->bpop stuff are no longer valid, so we must do the setup
+     * above before this call. */
+    unblockClient(receiver);
+}
+
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
  * when there may be clients blocked on a stream key, and there may be new
  * data to fetch (the key is ready). */
 void serveClientsBlockedOnStreamKey(robj *o, readyList *rl) {
-    dictEntry *de = dictFind(rl->db->blocking_keys,rl->key);
+    dictEntry *de = dictFind(rl->db->blocking_streams,rl->key);
     stream *s = o->ptr;
+    listNode *ln;
+    listIter li;
 
-    /* We need to provide the new data arrived on the stream
-     * to all the clients that are waiting for an offset smaller
-     * than the current top item. */
-    if (de) {
-        list *clients = dictGetVal(de);
-        listNode *ln;
-        listIter li;
-        listRewind(clients,&li);
+    if (de == NULL) return;
+    streamBlockedClients *sbc = dictGetVal(de);
 
-        while((ln = listNext(&li))) {
-            client *receiver = listNodeValue(ln);
-            if (receiver->btype != BLOCKED_STREAM) continue;
-            streamID *gt = dictFetchValue(receiver->bpop.keys,
-                                          rl->key);
-
-            /* If we blocked in the context of a consumer
-             * group, we need to resolve the group and update the
-             * last ID the client is blocked for: this is needed
-             * because serving other clients in the same consumer
-             * group will alter the "last ID" of the consumer
-             * group, and clients blocked in a consumer group are
-             * always blocked for the ">" ID: we need to deliver
-             * only new messages and avoid unblocking the client
-             * otherwise. */
-            streamCG *group = NULL;
-            if (receiver->bpop.xread_group) {
-                group = streamLookupCG(s,
-                        receiver->bpop.xread_group->ptr);
-                /* If the group was not found, send an error
-                 * to the consumer. */
-                if (!group) {
-                    addReplyError(receiver,
-                        "-NOGROUP the consumer group this client "
-                        "was blocked on no longer exists");
-                    unblockClient(receiver);
-                    continue;
-                } else {
-                    *gt = group->last_id;
-                }
-            }
+    /* We need to provide the new data arrived on the stream to all the
+     * XREAD clients that are waiting for an offset smaller than the
+     * current top item. */
+    listRewind(sbc->readers,&li);
+    while((ln = listNext(&li))) {
+        client *receiver = listNodeValue(ln);
+        bkinfo *bki = dictFetchValue(receiver->bpop.keys,rl->key);
+        streamID *gt = &bki->stream_id;
 
-            if (streamCompareID(&s->last_id, gt) > 0) {
-                streamID start = *gt;
-                start.seq++; /* Can't overflow, it's an uint64_t */
+        if (streamCompareID(&s->last_id,gt) > 0)
+            serveStreamBlockedClient(receiver,rl->key,s,NULL,gt);
+    }
 
-                /* Lookup the consumer for the group, if any. */
-                streamConsumer *consumer = NULL;
-                int noack = 0;
+    /* Unblocking the clients may have released the index of the key. */
+    if ((de = dictFind(rl->db->blocking_streams,rl->key)) == NULL) return;
+    sbc = dictGetVal(de);
+
+    /* The new entries of a consumer group are delivered only once, so for
+     * every group we serve the clients in the order they blocked, just
+     * until the group has nothing new: the other consumers of the group
+     * are not even visited. Since a served client blocks again at the tail
+     * of the list, the consumers are served round-robin. We take the names
+     * of the groups first, as serving the clients modifies the index. */
+    unsigned long numgroups = dictSize(sbc->groups), j = 0;
+    robj **groups = zmalloc(sizeof(robj*)*numgroups);
+    dictIterator *di = dictGetIterator(sbc->groups);
+    while((de = dictNext(di)) != NULL) {
+        groups[j] = dictGetKey(de);
+        incrRefCount(groups[j++]);
+    }
+    dictReleaseIterator(di);
 
-                if (group) {
-                    consumer = streamLookupConsumer(group,
-                               receiver->bpop.xread_consumer->ptr,
-                               1);
-                    noack = receiver->bpop.xread_group_noack;
-                }
+    for (j = 0; j < numgroups; j++) {
+        list *clients;
 
-                /* Emit the two elements sub-array consisting of
-                 * the name of the stream and the data we
-                 * extracted from it. Wrapped in a single-item
-                 * array, since we have just one key. */
-                if (receiver->resp == 2) {
-                    addReplyArrayLen(receiver,1);
-                    addReplyArrayLen(receiver,2);
-                } else {
-                    addReplyMapLen(receiver,1);
-                }
-                addReplyBulk(receiver,rl->key);
-
-                streamPropInfo pi = {
-                    rl->key,
-                    receiver->bpop.xread_group
-                };
-                streamReplyWithRange(receiver,s,&start,NULL,
-                                     receiver->bpop.xread_count,
-                                     0, group, consumer, noack, &pi);
-
-                /* Note that after we unblock the client, 'gt'
-                 * and other receiver->bpop stuff are no longer
-                 * valid, so we must do the setup above before
-                 * this call. */
+        if ((de = dictFind(rl->db->blocking_streams,rl->key)) == NULL ||
+            (clients = dictFetchValue(((streamBlockedClients*)
+                                       dictGetVal(de))->groups,
+                                      groups[j])) == NULL)
+        {
+            decrRefCount(groups[j]);
+            continue;
+        }
+
+        streamCG *group = streamLookupCG(s,groups[j]->ptr);
+        listRewind(clients,&li);
+        while((ln = listNext(&li))) {
+            client *receiver = listNodeValue(ln);
+
+            /* If the group was not found, send an error to the
+             * consumer. */
+            if (!group) {
+                addReplyError(receiver,
+                    "-NOGROUP the consumer group this client "
+                    "was blocked on no longer exists");
                 unblockClient(receiver);
+                continue;
             }
+
+            /* Clients blocked in a consumer group are always blocked for
+             * the ">" ID: as serving other consumers of the group alters
+             * its "last ID", stop as soon as there is nothing newer. */
+            if (streamCompareID(&s->last_id,&group->last_id) <= 0) break;
+            bkinfo *bki = dictFetchValue(receiver->bpop.keys,rl->key);
+            streamID *gt = &bki->stream_id;
+            streamID last_id = group->last_id;
+            *gt = group->last_id;
+            serveStreamBlockedClient(receiver,rl->key,s,group,gt);
+
+            /* Entries deleted after the last ID of the group can't be
+             * delivered: don't wake up all the consumers for nothing. */
+            if (streamCompareID(&group->last_id,&last_id) == 0) break;
         }
+        decrRefCount(groups[j]);
     }
+    zfree(groups);
 }
 
 /* Helper function for handleClientsBlockedOnKeys(). This function is called
@@ -456,8 +706,7 @@ void serveClientsBlockedOnKeyByModule(readyList *rl) {
              * ready to be served, so they'll remain in the list
              * sometimes. We want also be able to skip clients that are
              * not blocked for the MODULE type safely. */
-            listDelNode(clients,clientnode);
-            listAddNodeTail(clients,receiver);
+            listRotateHeadToTail(clients);
 
             if (receiver->btype != BLOCKED_MODULE) continue;
 
@@ -524,6 +773,10 @@ void handleClientsBlockedOnKeys(void) {
             server.fixed_time_expire++;
             updateCachedTime(0);
 
+            /* Serving the clients modifies the key, as their commands
+             * would do. */
+            redisDb *prev = dbMemoryAccountingSwitch(rl->db);
+
             /* Serve clients blocked on list key. */
             robj *o = lookupKeyWrite(rl->db,rl->key);
 
@@ -539,6 +792,7 @@ void handleClientsBlockedOnKeys(void) {
                  * module is trying to accomplish right now. */
                 serveClientsBlockedOnKeyByModule(rl);
             }
+            dbMemoryAccountingSwitch(prev);
             server.fixed_time_expire--;
 
             /* Free this item. */
@@ -589,16 +843,14 @@ void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeo
 
     for (j = 0; j < numkeys; j++) {
         /* The value associated with the key name in the bpop.keys dictionary
-         * is NULL for lists and sorted sets, or the stream ID for streams. */
-        void *key_data = NULL;
-        if (btype == BLOCKED_STREAM) {
-            key_data = zmalloc(sizeof(streamID));
-            memcpy(key_data,ids+j,sizeof(streamID));
-        }
+         * records where the client is queued, and the stream ID for
+         * streams. */
+        bkinfo *bki = zcalloc(sizeof(*bki));
+        if (btype == BLOCKED_STREAM) bki->stream_id = ids[j];
 
         /* If the key already exists in the dictionary ignore it. */
-        if (dictAdd(c->bpop.keys,keys[j],key_data) != DICT_OK) {
-            zfree(key_data);
+        if (dictAdd(c->bpop.keys,keys[j],bki) != DICT_OK) {
+            zfree(bki);
             continue;
         }
         incrRefCount(keys[j]);
@@ -617,6 +869,9 @@ void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeo
             l = dictGetVal(de);
         }
         listAddNodeTail(l,c);
+        bki->listnode = listLast(l);
+        if (btype == BLOCKED_STREAM)
+            bki->streamnode = streamBlockedClientsAdd(c,keys[j]);
     }
     blockClient(c,btype);
 }
@@ -633,14 +888,17 @@ void unblockClientWaitingData(client *c) {
     /* The client may wait for multiple keys, so unblock it for every key. */
     while((de = dictNext(di)) != NULL) {
         robj *key = dictGetKey(de);
+        bkinfo *bki = dictGetVal(de);
 
         /* Remove this client from the list of clients waiting for this key. */
         l = dictFetchValue(c->db->blocking_keys,key);
         serverAssertWithInfo(c,key,l != NULL);
-        listDelNode(l,listSearchKey(l,c));
+        listDelNode(l,bki->listnode);
         /* If the list is empty we need to remove it to avoid wasting memory */
         if (listLength(l) == 0)
             dictDelete(c->db->blocking_keys,key);
+        if (c->btype == BLOCKED_STREAM)
+            streamBlockedClientsRemove(c,key,bki->streamnode);
     }
     dictReleaseIterator(di);
 
@@ -674,7 +932,9 @@ void signalKeyAsReady(redisDb *db, robj *key) {
     /* Key was already signaled? No need to queue it again. */
     if (dictFind(db->ready_keys,key) != NULL) return;
 
-    /* Ok, we need to queue this key into server.ready_keys. */
+    /* Ok, we need to queue this key into server.ready_keys. The list is
+     * released outside of any command, so it is not accounted to the DB. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
     rl = zmalloc(sizeof(*rl));
     rl->key = key;
     rl->db = db;
@@ -686,6 +946,7 @@ void signalKeyAsReady(redisDb *db, robj *key) {
      * check. */
     incrRefCount(key);
     serverAssert(dictAdd(db->ready_keys,key,NULL) == DICT_OK);
+    dbMemoryAccountingSwitch(prev);
 }
 
 
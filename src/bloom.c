@@ -0,0 +1,564 @@
+/* bloom.c - Redis scalable Bloom filters.
+ *
+ * Like the HyperLogLogs, the Bloom filters are stored as strings with a
+ * small header, so they are saved in RDB files, rewritten in the AOF,
+ * replicated, dumped and defragmented like any other string, and can be
+ * transferred with GET/SET. The BFADD and BFEXISTS commands, and their
+ * multi element variants BFMADD and BFMEXISTS, replace the emulation of a
+ * filter with K calls to SETBIT/GETBIT: the K bits of an element are
+ * handled in a single command, and a single cache line.
+ *
+ * The filters are "blocked" Bloom filters: the first hash of an element
+ * selects a block of 512 bits (64 bytes, a cache line), and all the K bits
+ * of the element are set in that block, so that adding or checking an
+ * element touches a single cache line instead of K random ones. This
+ * needs a bit more memory than a classic filter for the same error rate,
+ * that we compensate with BLOOM_BLOCK_OVERHEAD more bits. The commands
+ * working on many elements hash them all first, and prefetch their blocks
+ * before accessing them, so that the cache misses overlap.
+ *
+ * The filters are scalable: a filter is created for a given capacity and
+ * error rate, and once that number of elements is added a new filter, with
+ * 'expansion' times the capacity of the last one, is appended to the
+ * string. The elements are added to the last filter and searched in all
+ * of them. The error rate of the filter N is error/2^(N+1), so that the
+ * sum of the error rates never exceeds the requested one.
+ *
+ * The hash function must give the same result on every server and CPU,
+ * since the bits are persisted: we use MurmurHash64A with a fixed seed,
+ * like the HyperLogLogs.
+ *
+ * The representation is:
+ *
+ *   +------+---+---+---+---+--------+-----------+----------+----------+
+ *   | BLOM | E | N | X | 0 | error  | capacity  | filter 0 | filter 1 | ...
+ *   +------+---+---+---+---+--------+-----------+----------+----------+
+ *
+ * E is the encoding (BLOOM_BLOCKED), N the number of filters, X the
+ * expansion factor, 'error' the error rate as a little endian double and
+ * 'capacity' the capacity of the first filter, a little endian 64 bit
+ * integer. Every filter is:
+ *
+ *   +----------+-------+---------+---+-------+---------------------------+
+ *   | capacity | items | nblocks | K | 0 0 0 | nblocks blocks of 64 bytes |
+ *   +----------+-------+---------+---+-------+---------------------------+
+ *
+ * With 64 bit 'capacity' and 'items', and a 32 bit 'nblocks', all little
+ * endian. The bit B of a block is the bit B&7 of its byte B>>3.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "endianconv.h"
+
+#include <math.h>
+
+struct bloomhdr {
+    char magic[4];          /* "BLOM" */
+    uint8_t encoding;       /* BLOOM_BLOCKED. */
+    uint8_t numfilters;     /* Number of filters that follow. */
+    uint8_t expansion;      /* Capacity growth of the next filter. */
+    uint8_t notused;        /* Reserved for future use, must be zero. */
+    uint8_t error[8];       /* Error rate, little endian double. */
+    uint8_t capacity[8];    /* Capacity of the first filter, little endian. */
+};
+
+struct bloomfilter {
+    uint8_t capacity[8];    /* Elements the filter is sized for. */
+    uint8_t items[8];       /* Elements added to the filter. */
+    uint8_t nblocks[4];     /* Number of blocks of BLOOM_BLOCK_BYTES. */
+    uint8_t k;              /* Bits set for every element. */
+    uint8_t notused[3];     /* Reserved for future use, must be zero. */
+    uint8_t blocks[];
+};
+
+#define BLOOM_HDR_SIZE sizeof(struct bloomhdr)
+#define BLOOM_FILTER_HDR_SIZE sizeof(struct bloomfilter)
+#define BLOOM_BLOCKED 0
+#define BLOOM_MAX_ENCODING 0
+#define BLOOM_BLOCK_BYTES 64 /* A cache line. */
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_BYTES*8)
+#define BLOOM_BLOCK_OVERHEAD 1.2 /* More bits than a classic filter. */
+#define BLOOM_MAX_K 16
+#define BLOOM_MAX_FILTERS 64
+#define BLOOM_MAX_EXPANSION 32
+#define BLOOM_BATCH 32 /* Elements hashed and prefetched at a time. */
+#define BLOOM_HASH_SEED 0x5f61767a
+
+#define BLOOM_DEFAULT_ERROR 0.01
+#define BLOOM_DEFAULT_CAPACITY 100
+#define BLOOM_DEFAULT_EXPANSION 2
+
+/* ========================= Low level functions ============================ */
+
+static uint64_t bloomGet64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,sizeof(v));
+    memrev64ifbe(&v);
+    return v;
+}
+
+static void bloomSet64(uint8_t *p, uint64_t v) {
+    memrev64ifbe(&v);
+    memcpy(p,&v,sizeof(v));
+}
+
+static uint32_t bloomGet32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    memrev32ifbe(&v);
+    return v;
+}
+
+static void bloomSet32(uint8_t *p, uint32_t v) {
+    memrev32ifbe(&v);
+    memcpy(p,&v,sizeof(v));
+}
+
+static double bloomGetError(struct bloomhdr *hdr) {
+    uint64_t bits = bloomGet64(hdr->error);
+    double error;
+    memcpy(&error,&bits,sizeof(error));
+    return error;
+}
+
+/* Return the size in bytes of the filter 'f', header included. */
+static size_t bloomFilterSize(struct bloomfilter *f) {
+    return BLOOM_FILTER_HDR_SIZE+(size_t)bloomGet32(f->nblocks)*BLOOM_BLOCK_BYTES;
+}
+
+/* Fill 'filters' with the filters of the Bloom filter string 's'. */
+static void bloomGetFilters(sds s, struct bloomfilter **filters) {
+    struct bloomhdr *hdr = (struct bloomhdr*)s;
+    unsigned char *p = (unsigned char*)s+BLOOM_HDR_SIZE;
+
+    for (int j = 0; j < hdr->numfilters; j++) {
+        filters[j] = (struct bloomfilter*)p;
+        p += bloomFilterSize(filters[j]);
+    }
+}
+
+/* Return the number of blocks and bits per element of a filter holding
+ * 'capacity' elements with the specified error rate. */
+static void bloomFilterGeometry(uint64_t capacity, double error,
+                                uint64_t *nblocks, int *k)
+{
+    double bits_per_item = -log(error)/(M_LN2*M_LN2)*BLOOM_BLOCK_OVERHEAD;
+    double bits = ceil((double)capacity*bits_per_item);
+
+    *nblocks = (uint64_t)((bits+BLOOM_BLOCK_BITS-1)/BLOOM_BLOCK_BITS);
+    if (*nblocks == 0) *nblocks = 1;
+    *k = (int)ceil(-log2(error));
+    if (*k < 1) *k = 1;
+    if (*k > BLOOM_MAX_K) *k = BLOOM_MAX_K;
+}
+
+/* Append to the Bloom filter string 's' a new filter for 'capacity'
+ * elements with the specified error rate. Returns the new string, or NULL
+ * if it would be larger than proto-max-bulk-len, in which case 's' is
+ * left untouched. */
+static sds bloomAppendFilter(sds s, uint64_t capacity, double error) {
+    struct bloomhdr *hdr;
+    struct bloomfilter *f;
+    uint64_t nblocks;
+    size_t oldlen = sdslen(s), size;
+    int k;
+
+    bloomFilterGeometry(capacity,error,&nblocks,&k);
+    if (nblocks > UINT32_MAX) return NULL;
+    size = BLOOM_FILTER_HDR_SIZE+nblocks*BLOOM_BLOCK_BYTES;
+    if (oldlen+size > (unsigned long long)server.proto_max_bulk_len)
+        return NULL;
+
+    s = sdsgrowzero(s,oldlen+size);
+    hdr = (struct bloomhdr*)s;
+    f = (struct bloomfilter*)(s+oldlen);
+    bloomSet64(f->capacity,capacity);
+    bloomSet32(f->nblocks,nblocks);
+    f->k = k;
+    hdr->numfilters++;
+    return s;
+}
+
+/* Create a Bloom filter string with a first filter of 'capacity' elements.
+ * Returns NULL if the filter would be too large. */
+static robj *createBloomObject(double error, uint64_t capacity, int expansion) {
+    struct bloomhdr *hdr;
+    uint64_t bits;
+    sds s = sdsnewlen(NULL,BLOOM_HDR_SIZE);
+
+    hdr = (struct bloomhdr*)s;
+    memcpy(hdr->magic,"BLOM",4);
+    hdr->encoding = BLOOM_BLOCKED;
+    hdr->expansion = expansion;
+    memcpy(&bits,&error,sizeof(bits));
+    bloomSet64(hdr->error,bits);
+    bloomSet64(hdr->capacity,capacity);
+    if ((s = bloomAppendFilter(s,capacity,error/2)) == NULL) {
+        sdsfree((sds)hdr);
+        return NULL;
+    }
+    return createObject(OBJ_STRING,s);
+}
+
+/* The hash of an element selects its block in every filter with its high
+ * 32 bits, and its bits inside the block with the low ones. */
+static uint64_t bloomHash(robj *ele) {
+    return MurmurHash64A(ele->ptr,sdslen(ele->ptr),BLOOM_HASH_SEED);
+}
+
+static unsigned char *bloomBlock(struct bloomfilter *f, uint64_t hash) {
+    uint64_t idx = ((hash>>32)*(uint64_t)bloomGet32(f->nblocks))>>32;
+    return f->blocks+idx*BLOOM_BLOCK_BYTES;
+}
+
+/* Bit 'i' of the element with the specified hash inside its block: the K
+ * bits are generated with double hashing from the low 32 bits, mixed since
+ * they are not independent from the ones used to select the block. */
+#define BLOOM_BIT(a,b,i) ((uint32_t)((a)+(i)*(b)) >> (32-9))
+#define BLOOM_MIX(hash,a,b) do { \
+    uint64_t _m = ((hash)&0xffffffff)*0x9e3779b97f4a7c15ULL; \
+    (a) = (uint32_t)(_m>>32); \
+    (b) = (uint32_t)_m | 1; \
+} while(0)
+
+static int bloomBlockTest(unsigned char *block, uint64_t hash, int k) {
+    uint32_t a, b;
+    BLOOM_MIX(hash,a,b);
+    for (int i = 0; i < k; i++) {
+        uint32_t bit = BLOOM_BIT(a,b,i);
+        if (!(block[bit>>3] & (1<<(bit&7)))) return 0;
+    }
+    return 1;
+}
+
+static void bloomBlockSet(unsigned char *block, uint64_t hash, int k) {
+    uint32_t a, b;
+    BLOOM_MIX(hash,a,b);
+    for (int i = 0; i < k; i++) {
+        uint32_t bit = BLOOM_BIT(a,b,i);
+        block[bit>>3] |= 1<<(bit&7);
+    }
+}
+
+/* Set found[j] to 1 for the 'count' elements with the hashes 'hashes'
+ * present in one of the filters from 'first' to 'last', included. The
+ * blocks of all the elements still not found are prefetched before
+ * checking them in every filter. The filters are checked from the last,
+ * the largest one, where most of the elements usually are. */
+static void bloomLookupBatch(struct bloomfilter **filters, int first,
+                             int last, uint64_t *hashes, int count,
+                             int *found)
+{
+    unsigned char *blocks[BLOOM_BATCH];
+
+    for (int f = last; f >= first; f--) {
+        struct bloomfilter *filter = filters[f];
+        for (int j = 0; j < count; j++) {
+            if (found[j]) continue;
+            blocks[j] = bloomBlock(filter,hashes[j]);
+            __builtin_prefetch(blocks[j]);
+        }
+        for (int j = 0; j < count; j++) {
+            if (found[j]) continue;
+            found[j] = bloomBlockTest(blocks[j],hashes[j],filter->k);
+        }
+    }
+}
+
+/* Add the 'count' elements with the hashes 'hashes' to the Bloom filter
+ * 'o', setting added[j] to 1 for the elements that were not already
+ * present. The last filter is expanded when full. Returns C_ERR if the
+ * filter needed to grow and could not. */
+static int bloomAddBatch(robj *o, uint64_t *hashes, int count, int *added) {
+    struct bloomfilter *filters[BLOOM_MAX_FILTERS];
+    struct bloomhdr *hdr = o->ptr;
+    int found[BLOOM_BATCH] = {0};
+    int batch_last = hdr->numfilters-1;
+
+    for (int j = 0; j < count; j++) added[j] = 0;
+    bloomGetFilters(o->ptr,filters);
+    bloomLookupBatch(filters,0,batch_last,hashes,count,found);
+
+    for (int j = 0; j < count; j++) {
+        struct bloomfilter *last;
+
+        if (found[j]) continue;
+
+        /* The previous elements of the batch may be the same element, or
+         * may have set its bits, in the filters modified since the lookup
+         * above. */
+        hdr = o->ptr;
+        bloomGetFilters(o->ptr,filters);
+        int dup = 0;
+        bloomLookupBatch(filters,batch_last,hdr->numfilters-1,hashes+j,1,&dup);
+        if (dup) continue;
+
+        last = filters[hdr->numfilters-1];
+        uint64_t items = bloomGet64(last->items);
+        uint64_t capacity = bloomGet64(last->capacity);
+        if (items >= capacity) {
+            sds s;
+            if (hdr->numfilters == BLOOM_MAX_FILTERS || hdr->expansion == 0)
+                return C_ERR;
+            s = bloomAppendFilter(o->ptr,capacity*hdr->expansion,
+                ldexp(bloomGetError(hdr),-(hdr->numfilters+1)));
+            if (s == NULL) return C_ERR;
+            o->ptr = s;
+            hdr = o->ptr;
+            bloomGetFilters(o->ptr,filters);
+            last = filters[hdr->numfilters-1];
+            items = 0;
+        }
+        bloomBlockSet(bloomBlock(last,hashes[j]),hashes[j],last->k);
+        bloomSet64(last->items,items+1);
+        added[j] = 1;
+    }
+    return C_OK;
+}
+
+/* ========================== Bloom filter commands ========================= */
+
+/* Check if the object is a String with a valid Bloom filter representation.
+ * Return C_OK if this is true, otherwise reply to the client with an error
+ * and return C_ERR. */
+int isBloomObjectOrReply(client *c, robj *o) {
+    struct bloomhdr *hdr;
+    struct bloomfilter *f;
+    size_t len, offset;
+
+    if (checkType(c,o,OBJ_STRING))
+        return C_ERR; /* Error already sent. */
+
+    if (!sdsEncodedObject(o)) goto invalid;
+    len = sdslen(o->ptr);
+    if (len < BLOOM_HDR_SIZE) goto invalid;
+    hdr = o->ptr;
+
+    /* Magic should be "BLOM". */
+    if (memcmp(hdr->magic,"BLOM",4) != 0) goto invalid;
+    if (hdr->encoding > BLOOM_MAX_ENCODING ||
+        hdr->numfilters == 0 ||
+        hdr->numfilters > BLOOM_MAX_FILTERS) goto invalid;
+
+    /* The filters must fill the string exactly. */
+    offset = BLOOM_HDR_SIZE;
+    for (int j = 0; j < hdr->numfilters; j++) {
+        if (len-offset < BLOOM_FILTER_HDR_SIZE) goto invalid;
+        f = (struct bloomfilter*)((char*)o->ptr+offset);
+        if (bloomGet32(f->nblocks) == 0 || f->k == 0 || f->k > BLOOM_MAX_K)
+            goto invalid;
+        if (len-offset < bloomFilterSize(f)) goto invalid;
+        offset += bloomFilterSize(f);
+    }
+    if (offset != len) goto invalid;
+    return C_OK;
+
+invalid:
+    addReplySds(c,
+        sdsnew("-WRONGTYPE Key is not a valid "
+               "Bloom filter string value.\r\n"));
+    return C_ERR;
+}
+
+/* BFRESERVE key error_rate capacity [EXPANSION expansion] */
+void bfreserveCommand(client *c) {
+    long double error;
+    long long capacity, expansion = BLOOM_DEFAULT_EXPANSION;
+    robj *o;
+
+    if (getLongDoubleFromObjectOrReply(c,c->argv[2],&error,NULL) != C_OK)
+        return;
+    if (error <= 0 || error >= 1) {
+        addReplyError(c,"error rate should be between 0 and 1");
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,c->argv[3],&capacity,NULL) != C_OK)
+        return;
+    if (capacity <= 0) {
+        addReplyError(c,"capacity should be larger than 0");
+        return;
+    }
+    for (int j = 4; j < c->argc; j++) {
+        if (!strcasecmp(c->argv[j]->ptr,"expansion") && j+1 < c->argc) {
+            if (getLongLongFromObjectOrReply(c,c->argv[++j],&expansion,NULL)
+                != C_OK) return;
+            if (expansion < 0 || expansion > BLOOM_MAX_EXPANSION) {
+                addReplyErrorFormat(c,"expansion should be between 0 and %d",
+                    BLOOM_MAX_EXPANSION);
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (lookupKeyWrite(c->db,c->argv[1]) != NULL) {
+        addReplyError(c,"key already exists");
+        return;
+    }
+    if ((o = createBloomObject(error,capacity,expansion)) == NULL) {
+        addReplyError(c,"capacity too large, see proto-max-bulk-len");
+        return;
+    }
+    dbAdd(c->db,c->argv[1],o);
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(NOTIFY_STRING,"bfreserve",c->argv[1],c->db->id);
+    server.dirty++;
+    addReply(c,shared.ok);
+}
+
+/* Implements BFADD and BFMADD: the elements start at argv[2]. */
+static void bfaddGenericCommand(client *c, int multi) {
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    uint64_t hashes[BLOOM_BATCH];
+    int added[BLOOM_BATCH];
+    int count = c->argc-2, updated = 0, err = 0;
+
+    if (o == NULL) {
+        o = createBloomObject(BLOOM_DEFAULT_ERROR,BLOOM_DEFAULT_CAPACITY,
+                              BLOOM_DEFAULT_EXPANSION);
+        dbAdd(c->db,c->argv[1],o);
+        updated++;
+    } else {
+        if (isBloomObjectOrReply(c,o) != C_OK) return;
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    if (multi) addReplyArrayLen(c,count);
+    for (int j = 0; j < count; j += BLOOM_BATCH) {
+        int batch = count-j < BLOOM_BATCH ? count-j : BLOOM_BATCH;
+
+        for (int i = 0; i < batch; i++) hashes[i] = bloomHash(c->argv[2+j+i]);
+        if (bloomAddBatch(o,hashes,batch,added) == C_ERR) err = 1;
+        for (int i = 0; i < batch; i++) {
+            if (added[i]) updated++;
+            if (multi) addReplyLongLong(c,added[i]);
+        }
+        if (err) {
+            /* The elements of the batch after the one that could not be
+             * added are not added either. */
+            for (j += batch; j < count; j++)
+                if (multi) addReplyLongLong(c,0);
+            break;
+        }
+    }
+
+    if (updated) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_STRING,multi ? "bfmadd" : "bfadd",
+            c->argv[1],c->db->id);
+        server.dirty++;
+    }
+    if (!multi) {
+        if (err) addReplyError(c,"Bloom filter is full");
+        else addReply(c,added[0] ? shared.cone : shared.czero);
+    }
+}
+
+/* BFADD key element => :0 or :1 */
+void bfaddCommand(client *c) {
+    bfaddGenericCommand(c,0);
+}
+
+/* BFMADD key element [element ...] => array of :0 or :1 */
+void bfmaddCommand(client *c) {
+    bfaddGenericCommand(c,1);
+}
+
+/* Implements BFEXISTS and BFMEXISTS: the elements start at argv[2]. */
+static void bfexistsGenericCommand(client *c, int multi) {
+    robj *o = lookupKeyRead(c->db,c->argv[1]);
+    struct bloomfilter *filters[BLOOM_MAX_FILTERS];
+    uint64_t hashes[BLOOM_BATCH];
+    int found[BLOOM_BATCH];
+    int count = c->argc-2;
+
+    if (o && isBloomObjectOrReply(c,o) != C_OK) return;
+    if (o) bloomGetFilters(o->ptr,filters);
+
+    if (multi) addReplyArrayLen(c,count);
+    for (int j = 0; j < count; j += BLOOM_BATCH) {
+        int batch = count-j < BLOOM_BATCH ? count-j : BLOOM_BATCH;
+
+        for (int i = 0; i < batch; i++) found[i] = 0;
+        if (o) {
+            for (int i = 0; i < batch; i++)
+                hashes[i] = bloomHash(c->argv[2+j+i]);
+            bloomLookupBatch(filters,0,((struct bloomhdr*)o->ptr)->numfilters-1,
+                             hashes,batch,found);
+        }
+        for (int i = 0; i < batch; i++) addReplyLongLong(c,found[i]);
+    }
+}
+
+/* BFEXISTS key element => :0 or :1 */
+void bfexistsCommand(client *c) {
+    bfexistsGenericCommand(c,0);
+}
+
+/* BFMEXISTS key element [element ...] => array of :0 or :1 */
+void bfmexistsCommand(client *c) {
+    bfexistsGenericCommand(c,1);
+}
+
+/* BFINFO key */
+void bfinfoCommand(client *c) {
+    robj *o = lookupKeyRead(c->db,c->argv[1]);
+    struct bloomfilter *filters[BLOOM_MAX_FILTERS];
+    struct bloomhdr *hdr;
+    uint64_t capacity = 0, items = 0;
+
+    if (o == NULL) {
+        addReplyError(c,"no such key");
+        return;
+    }
+    if (isBloomObjectOrReply(c,o) != C_OK) return;
+    hdr = o->ptr;
+    bloomGetFilters(o->ptr,filters);
+    for (int j = 0; j < hdr->numfilters; j++) {
+        capacity += bloomGet64(filters[j]->capacity);
+        items += bloomGet64(filters[j]->items);
+    }
+
+    addReplyMapLen(c,6);
+    addReplyBulkCString(c,"capacity");
+    addReplyLongLong(c,capacity);
+    addReplyBulkCString(c,"size");
+    addReplyLongLong(c,sdslen(o->ptr));
+    addReplyBulkCString(c,"filters");
+    addReplyLongLong(c,hdr->numfilters);
+    addReplyBulkCString(c,"items");
+    addReplyLongLong(c,items);
+    addReplyBulkCString(c,"expansion");
+    addReplyLongLong(c,hdr->expansion);
+    addReplyBulkCString(c,"error-rate");
+    addReplyDouble(c,bloomGetError(hdr));
+}
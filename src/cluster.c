@@ -51,6 +51,10 @@ int clusterAddNode(clusterNode *node);
 void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void clusterReadHandler(connection *conn);
 void clusterSendPing(clusterLink *link, int type);
+void clusterSendProbe(clusterLink *link, int type);
+static void clusterSendPingGeneric(clusterLink *link, int type, int gossip);
+void clusterBroadcastProbe(void);
+mstime_t clusterNodeFailTimeout(clusterNode *node);
 void clusterSendFail(char *nodename);
 void clusterSendFailoverAuthIfNeeded(clusterNode *node, clusterMsg *request);
 void clusterUpdateState(void);
@@ -66,6 +70,7 @@ void clusterSetMaster(clusterNode *n);
 void clusterHandleSlaveFailover(void);
 void clusterHandleSlaveMigration(int max_slaves);
 int bitmapTestBit(unsigned char *bitmap, int pos);
+void bitmapClearBit(unsigned char *bitmap, int pos);
 void clusterDoBeforeSleep(int flags);
 void clusterSendUpdate(clusterLink *link, clusterNode *node);
 void resetManualFailover(void);
@@ -76,6 +81,16 @@ sds representClusterNodeFlags(sds ci, uint16_t flags);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
 void moduleCallClusterReceivers(const char *sender_id, uint64_t module_id, uint8_t type, const unsigned char *payload, uint32_t len);
+void clusterMigrateSlotCommand(client *c);
+void clusterImportSlotCommand(client *c);
+void clusterSlotMigrationCron(void);
+int clusterSlotMigrationCommitted(clusterNode *sender, int slot);
+sds clusterCatSlotMigrationInfo(sds info);
+void freeClusterReadLink(struct clusterReadLink *link, const char *err);
+void clusterReadLinksCron(void);
+void clusterHotKeysCron(void);
+void clusterReplySlotStats(client *c);
+void clusterReplyHotKeys(client *c);
 
 /* -----------------------------------------------------------------------------
  * Initialization
@@ -450,7 +465,22 @@ void clusterInit(void) {
         server.cluster->stats_bus_messages_received[i] = 0;
     }
     server.cluster->stats_pfail_nodes = 0;
+    server.cluster->stats_bus_bytes_sent = 0;
+    server.cluster->stats_bus_bytes_received = 0;
+    server.cluster->stats_bus_light_hdr_sent = 0;
+    server.cluster->stats_cross_slot_reads = 0;
+    server.cluster->stats_fail_detection_time = 0;
+    server.cluster->stats_failover_election_time = 0;
+    server.cluster->stats_failover_time = 0;
+    server.cluster->stats_failovers = 0;
+    server.cluster->ping_rate = 0;
+    memset(server.cluster->slot_stats,0,sizeof(server.cluster->slot_stats));
+    memset(server.cluster->hotkeys_sketch,0,
+           sizeof(server.cluster->hotkeys_sketch));
+    server.cluster->hotkeys_count = 0;
+    server.cluster->hotkeys_last_decay = mstime();
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
+    memset(server.cluster->lost_slots,0,sizeof(server.cluster->lost_slots));
     clusterCloseAllSlots();
 
     /* Lock the cluster config file to make sure every node uses
@@ -487,7 +517,7 @@ void clusterInit(void) {
         exit(1);
     }
     if (listenToPort(port+CLUSTER_PORT_INCR,
-        server.cfd,&server.cfd_count) == C_ERR)
+        server.cfd,&server.cfd_count,ANET_NONE) == C_ERR)
     {
         exit(1);
     } else {
@@ -501,11 +531,6 @@ void clusterInit(void) {
         }
     }
 
-    /* The slots -> keys map is a radix tree. Initialize it here. */
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-
     /* Set myself->port / cport to my listening ports, we'll just need to
      * discover the IP address via MEET messages. */
     myself->port = port;
@@ -594,6 +619,9 @@ clusterLink *createClusterLink(clusterNode *node) {
     link->rcvbuf = sdsempty();
     link->node = node;
     link->conn = NULL;
+    link->light_hdr = 0;
+    link->sent_slots = NULL;
+    link->rcvd_slots = NULL;
     return link;
 }
 
@@ -607,6 +635,8 @@ void freeClusterLink(clusterLink *link) {
     }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
+    zfree(link->sent_slots);
+    zfree(link->rcvd_slots);
     if (link->node)
         link->node->link = NULL;
     zfree(link);
@@ -737,6 +767,7 @@ clusterNode *createClusterNode(char *nodename, int flags) {
     node->ping_sent = node->pong_received = 0;
     node->fail_time = 0;
     node->link = NULL;
+    node->read_link = NULL;
     memset(node->ip,0,sizeof(node->ip));
     node->port = 0;
     node->cport = 0;
@@ -745,6 +776,8 @@ clusterNode *createClusterNode(char *nodename, int flags) {
     node->orphaned_time = 0;
     node->repl_offset_time = 0;
     node->repl_offset = 0;
+    node->load = 0;
+    node->syncing = 0;
     listSetFreeMethod(node->fail_reports,zfree);
     return node;
 }
@@ -905,6 +938,7 @@ void freeClusterNode(clusterNode *n) {
 
     /* Release link and associated data structures. */
     if (n->link) freeClusterLink(n->link);
+    if (n->read_link) freeClusterReadLink(n->read_link,"the node was removed");
     listRelease(n->fail_reports);
     zfree(n->slaves);
     zfree(n);
@@ -1197,6 +1231,30 @@ int clusterBlacklistExists(char *nodeid) {
  * CLUSTER messages exchange - PING/PONG and gossip
  * -------------------------------------------------------------------------- */
 
+/* Return the time after which a node not replying to our pings is flagged
+ * as PFAIL. With cluster-fast-failover-timeout set, the masters serving
+ * slots use the shorter timeout, so that their failover starts early, while
+ * the node timeout still applies to everything else. */
+mstime_t clusterNodeFailTimeout(clusterNode *node) {
+    if (server.cluster_fast_failover_timeout &&
+        server.cluster_fast_failover_timeout < server.cluster_node_timeout &&
+        nodeIsMaster(node) && node->numslots > 0)
+    {
+        return server.cluster_fast_failover_timeout;
+    }
+    return server.cluster_node_timeout;
+}
+
+/* Flag the node as FAIL, and track how long the failure took to detect. */
+void clusterSetNodeAsFailing(clusterNode *node) {
+    node->flags &= ~CLUSTER_NODE_PFAIL;
+    node->flags |= CLUSTER_NODE_FAIL;
+    node->fail_time = mstime();
+    if (nodeIsMaster(node) && node->numslots > 0 && node->pong_received)
+        server.cluster->stats_fail_detection_time =
+            node->fail_time - node->pong_received;
+}
+
 /* This function checks if a given node should be marked as FAIL.
  * It happens if the following conditions are met:
  *
@@ -1234,9 +1292,7 @@ void markNodeAsFailingIfNeeded(clusterNode *node) {
         "Marking node %.40s as failing (quorum reached).", node->name);
 
     /* Mark the node as failing. */
-    node->flags &= ~CLUSTER_NODE_PFAIL;
-    node->flags |= CLUSTER_NODE_FAIL;
-    node->fail_time = mstime();
+    clusterSetNodeAsFailing(node);
 
     /* Broadcast the failing node name to everybody, forcing all the other
      * reachable nodes to flag the node as FAIL. */
@@ -1514,6 +1570,8 @@ int nodeUpdateAddressIfNeeded(clusterNode *node, clusterLink *link,
     node->port = port;
     node->cport = cport;
     if (node->link) freeClusterLink(node->link);
+    if (node->read_link)
+        freeClusterReadLink(node->read_link,"the node changed address");
     node->flags &= ~CLUSTER_NODE_NOADDR;
     serverLog(LL_WARNING,"Address updated for node %.40s, now %s:%d",
         node->name, node->ip, node->port);
@@ -1646,8 +1704,13 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
          *
          * In order to maintain a consistent state between keys and slots
          * we need to remove all the keys from the slots we lost. */
-        for (j = 0; j < dirty_slots_count; j++)
+        for (j = 0; j < dirty_slots_count; j++) {
+            /* The new owner of a slot we are migrating may announce it
+             * before we receive its commit reply. */
+            if (clusterSlotMigrationCommitted(sender,dirty_slots[j]))
+                continue;
             delKeysInSlot(dirty_slots[j]);
+        }
     }
 }
 
@@ -1742,6 +1805,10 @@ int clusterProcessPacket(clusterLink *link) {
         /* Update the replication offset info for this node. */
         sender->repl_offset = ntohu64(hdr->offset);
         sender->repl_offset_time = mstime();
+        uint32_t load;
+        memcpy(&load,hdr->load,sizeof(load));
+        sender->load = ntohl(load);
+        sender->syncing = (hdr->mflags[0] & CLUSTERMSG_FLAG0_SYNCING) != 0;
         /* If we are a slave performing a manual failover and our master
          * sent its offset while already paused, populate the MF state. */
         if (server.cluster->mf_end &&
@@ -1810,7 +1877,10 @@ int clusterProcessPacket(clusterLink *link) {
             clusterProcessGossipSection(hdr,link);
 
         /* Anyway reply with a PONG */
-        clusterSendPing(link,CLUSTERMSG_TYPE_PONG);
+        if (hdr->mflags[0] & CLUSTERMSG_FLAG0_PROBE)
+            clusterSendProbe(link,CLUSTERMSG_TYPE_PONG);
+        else
+            clusterSendPing(link,CLUSTERMSG_TYPE_PONG);
     }
 
     /* PING, PONG, MEET: process config information. */
@@ -2036,9 +2106,7 @@ int clusterProcessPacket(clusterLink *link) {
                 serverLog(LL_NOTICE,
                     "FAIL message received from %.40s about %.40s",
                     hdr->sender, hdr->data.fail.about.nodename);
-                failing->flags |= CLUSTER_NODE_FAIL;
-                failing->fail_time = mstime();
-                failing->flags &= ~CLUSTER_NODE_PFAIL;
+                clusterSetNodeAsFailing(failing);
                 clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
                                      CLUSTER_TODO_UPDATE_STATE);
             }
@@ -2054,7 +2122,7 @@ int clusterProcessPacket(clusterLink *link) {
         /* Don't bother creating useless objects if there are no
          * Pub/Sub subscribers. */
         if (dictSize(server.pubsub_channels) ||
-           listLength(server.pubsub_patterns))
+           dictSize(server.pubsub_patterns))
         {
             channel_len = ntohl(hdr->data.publish.msg.channel_len);
             message_len = ntohl(hdr->data.publish.msg.message_len);
@@ -2206,6 +2274,46 @@ void clusterLinkConnectHandler(connection *conn) {
             node->name, node->ip, node->cport);
 }
 
+/* Called when a whole message is in link->rcvbuf, before processing it:
+ * remember the slots bitmap of the full headers, and put it back into the
+ * light headers, see CLUSTERMSG_FLAG0_LIGHT_HDR. Returns 0 if the message
+ * must be discarded. */
+static int clusterPrepareReceivedMessage(clusterLink *link) {
+    clusterMsg *hdr = (clusterMsg*) link->rcvbuf;
+    uint32_t totlen = ntohl(hdr->totlen);
+    size_t slots_off = offsetof(clusterMsg,myslots);
+    uint16_t ver = ntohs(hdr->ver);
+
+    server.cluster->stats_bus_bytes_received += totlen;
+    if (ver == CLUSTER_PROTO_VER_LIGHT) {
+        if (link->rcvd_slots == NULL) {
+            serverLog(LL_VERBOSE,
+                "Light header received before any full header, "
+                "discarding the message.");
+            return 0;
+        }
+        sds full = sdsnewlen(NULL,totlen+CLUSTERMSG_SLOTS_LEN);
+        memcpy(full,link->rcvbuf,slots_off);
+        memcpy(full+slots_off,link->rcvd_slots,CLUSTERMSG_SLOTS_LEN);
+        memcpy(full+slots_off+CLUSTERMSG_SLOTS_LEN,link->rcvbuf+slots_off,
+               totlen-slots_off);
+        sdsfree(link->rcvbuf);
+        link->rcvbuf = full;
+        hdr = (clusterMsg*) full;
+        hdr->ver = htons(CLUSTER_PROTO_VER);
+        hdr->totlen = htonl(totlen+CLUSTERMSG_SLOTS_LEN);
+    } else if (ver == CLUSTER_PROTO_VER) {
+        if (totlen < CLUSTERMSG_MIN_LEN) return 0;
+        if (link->rcvd_slots == NULL)
+            link->rcvd_slots = zmalloc(CLUSTERMSG_SLOTS_LEN);
+        memcpy(link->rcvd_slots,hdr->myslots,CLUSTERMSG_SLOTS_LEN);
+    } else {
+        return 1; /* clusterProcessPacket() discards other versions. */
+    }
+    if (hdr->mflags[0] & CLUSTERMSG_FLAG0_LIGHT_HDR) link->light_hdr = 1;
+    return 1;
+}
+
 /* Read data. Try to read the first field of the header first to check the
  * full length of the packet. When a whole packet is in memory this function
  * will call the function to process the packet. And so forth. */
@@ -2229,7 +2337,7 @@ void clusterReadHandler(connection *conn) {
                 /* Perform some sanity check on the message signature
                  * and length. */
                 if (memcmp(hdr->sig,"RCmb",4) != 0 ||
-                    ntohl(hdr->totlen) < CLUSTERMSG_MIN_LEN)
+                    ntohl(hdr->totlen) < CLUSTERMSG_LIGHT_MIN_LEN)
                 {
                     serverLog(LL_WARNING,
                         "Bad message length or signature received "
@@ -2260,7 +2368,9 @@ void clusterReadHandler(connection *conn) {
 
         /* Total length obtained? Process this packet. */
         if (rcvbuflen >= 8 && rcvbuflen == ntohl(hdr->totlen)) {
-            if (clusterProcessPacket(link)) {
+            if (!clusterPrepareReceivedMessage(link) ||
+                clusterProcessPacket(link))
+            {
                 sdsfree(link->rcvbuf);
                 link->rcvbuf = sdsempty();
             } else {
@@ -2276,13 +2386,38 @@ void clusterReadHandler(connection *conn) {
  * the link to be invalidated, so it is safe to call this function
  * from event handlers that will do stuff with the same link later. */
 void clusterSendMessage(clusterLink *link, unsigned char *msg, size_t msglen) {
+    clusterMsg *hdr = (clusterMsg*) msg;
+    size_t slots_off = offsetof(clusterMsg,myslots);
+
     if (sdslen(link->sndbuf) == 0 && msglen != 0)
         connSetWriteHandlerWithBarrier(link->conn, clusterWriteHandler, 1);
 
-    link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    if (link->light_hdr && link->sent_slots &&
+        memcmp(link->sent_slots,hdr->myslots,CLUSTERMSG_SLOTS_LEN) == 0)
+    {
+        /* The peer already knows our slots: send a light header. */
+        size_t start = sdslen(link->sndbuf);
+        uint32_t totlen = htonl(msglen-CLUSTERMSG_SLOTS_LEN);
+        uint16_t ver = htons(CLUSTER_PROTO_VER_LIGHT);
+
+        link->sndbuf = sdscatlen(link->sndbuf, msg, slots_off);
+        link->sndbuf = sdscatlen(link->sndbuf,
+            msg+slots_off+CLUSTERMSG_SLOTS_LEN,
+            msglen-slots_off-CLUSTERMSG_SLOTS_LEN);
+        memcpy(link->sndbuf+start+offsetof(clusterMsg,totlen),&totlen,
+               sizeof(totlen));
+        memcpy(link->sndbuf+start+offsetof(clusterMsg,ver),&ver,sizeof(ver));
+        msglen -= CLUSTERMSG_SLOTS_LEN;
+        server.cluster->stats_bus_light_hdr_sent++;
+    } else {
+        if (link->sent_slots == NULL)
+            link->sent_slots = zmalloc(CLUSTERMSG_SLOTS_LEN);
+        memcpy(link->sent_slots,hdr->myslots,CLUSTERMSG_SLOTS_LEN);
+        link->sndbuf = sdscatlen(link->sndbuf, msg, msglen);
+    }
+    server.cluster->stats_bus_bytes_sent += msglen;
 
     /* Populate sent messages stats. */
-    clusterMsg *hdr = (clusterMsg*) msg;
     uint16_t type = ntohs(hdr->type);
     if (type < CLUSTERMSG_TYPE_COUNT)
         server.cluster->stats_bus_messages_sent[type]++;
@@ -2310,6 +2445,14 @@ void clusterBroadcastMessage(void *buf, size_t len) {
     dictReleaseIterator(di);
 }
 
+/* Return true if this node can't serve up to date reads: it is loading its
+ * data, or it is a slave not connected or still synchronizing with its
+ * master. */
+int clusterNodeIsSyncing(void) {
+    return server.loading ||
+           (nodeIsSlave(myself) && server.repl_state != REPL_STATE_CONNECTED);
+}
+
 /* Build the message header. hdr must point to a buffer at least
  * sizeof(clusterMsg) in bytes. */
 void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
@@ -2370,9 +2513,16 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
         offset = server.master_repl_offset;
     hdr->offset = htonu64(offset);
 
+    /* Advertise the load, and if we can serve consistent reads. */
+    uint32_t load = htonl(getInstantaneousMetric(STATS_METRIC_COMMAND));
+    memcpy(hdr->load,&load,sizeof(load));
+
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    hdr->mflags[0] |= CLUSTERMSG_FLAG0_LIGHT_HDR;
+    if (clusterNodeIsSyncing())
+        hdr->mflags[0] |= CLUSTERMSG_FLAG0_SYNCING;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2414,9 +2564,46 @@ void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
     gossip->notused1 = 0;
 }
 
+/* Return the number of gossip sections to add to PING, PONG and MEET
+ * messages, not counting the PFAIL nodes, see clusterSendPing().
+ *
+ * Since the PFAIL nodes are always added, failure reports no longer depend
+ * on the random sections, that just spread the state of the other nodes.
+ * In big clusters each node receives messages much more often than in small
+ * ones, since we ping every node at least every node_timeout/2: 1/10 of the
+ * nodes becomes way more than needed, and most of the bus bandwidth. So we
+ * use the rate of messages we receive to add just enough sections for every
+ * node to be featured CLUSTER_GOSSIP_MENTIONS times in the failure reports
+ * validity time, assuming the other nodes receive as many messages as us. */
+static int clusterGossipWanted(void) {
+    int nodes = dictSize(server.cluster->nodes);
+    int wanted = floor(nodes/10);
+    long long received = server.cluster->ping_rate *
+        server.cluster_node_timeout * CLUSTER_FAIL_REPORT_VALIDITY_MULT / 1000;
+
+    if (received > 0) {
+        long long adaptive = (CLUSTER_GOSSIP_MENTIONS*nodes+received-1) /
+                             received;
+        if (adaptive < wanted) wanted = adaptive;
+    }
+    if (wanted < 3) wanted = 3;
+    return wanted;
+}
+
 /* Send a PING or PONG packet to the specified node, making sure to add enough
  * gossip informations. */
 void clusterSendPing(clusterLink *link, int type) {
+    clusterSendPingGeneric(link,type,1);
+}
+
+/* PING without the random gossip sections, only the nodes in PFAIL state:
+ * used by cluster-fast-failover-timeout to probe the masters often. The
+ * receiver replies with a PONG of the same kind. */
+void clusterSendProbe(clusterLink *link, int type) {
+    clusterSendPingGeneric(link,type,0);
+}
+
+static void clusterSendPingGeneric(clusterLink *link, int type, int gossip) {
     unsigned char *buf;
     clusterMsg *hdr;
     int gossipcount = 0; /* Number of gossip sections added so far. */
@@ -2453,9 +2640,9 @@ void clusterSendPing(clusterLink *link, int type) {
      *
      * Since we have non-voting slaves that lower the probability of an entry
      * to feature our node, we set the number of entries per packet as
-     * 10% of the total nodes we have. */
-    wanted = floor(dictSize(server.cluster->nodes)/10);
-    if (wanted < 3) wanted = 3;
+     * 10% of the total nodes we have, or less in big clusters, see
+     * clusterGossipWanted(). */
+    wanted = gossip ? clusterGossipWanted() : 0;
     if (wanted > freshnodes) wanted = freshnodes;
 
     /* Include all the nodes in PFAIL state, so that failure reports are
@@ -2477,6 +2664,7 @@ void clusterSendPing(clusterLink *link, int type) {
     if (link->node && type == CLUSTERMSG_TYPE_PING)
         link->node->ping_sent = mstime();
     clusterBuildMessageHdr(hdr,type);
+    if (!gossip) hdr->mflags[0] |= CLUSTERMSG_FLAG0_PROBE;
 
     /* Populate the gossip fields */
     int maxiterations = wanted*3;
@@ -2581,6 +2769,25 @@ void clusterBroadcastPong(int target) {
     dictReleaseIterator(di);
 }
 
+/* Send our failure reports to the other masters right away, with a PONG
+ * carrying only the nodes in PFAIL state as gossip. Only the reports of
+ * masters count for the FAIL quorum. */
+void clusterBroadcastProbe(void) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (!nodeIsMaster(myself)) return;
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+
+        if (!node->link || !nodeIsMaster(node)) continue;
+        if (node == myself || nodeInHandshake(node)) continue;
+        clusterSendProbe(node->link,CLUSTERMSG_TYPE_PONG);
+    }
+    dictReleaseIterator(di);
+}
+
 /* Send a PUBLISH message.
  *
  * If link is NULL, then the message is broadcasted to the whole cluster. */
@@ -3087,17 +3294,27 @@ void clusterHandleSlaveFailover(void) {
     /* If the previous failover attempt timedout and the retry time has
      * elapsed, we can setup a new one. */
     if (auth_age > auth_retry_time) {
+        /* Fixed delay to let the FAIL message propagate, plus a random
+         * delay: 500 milliseconds each, or a quarter of the timeout when
+         * our master was flagged with cluster-fast-failover-timeout. */
+        mstime_t delay_unit = 500;
+        mstime_t fail_timeout = clusterNodeFailTimeout(myself->slaveof);
+        if (fail_timeout < server.cluster_node_timeout &&
+            fail_timeout/4 < delay_unit)
+        {
+            delay_unit = fail_timeout/4 ? fail_timeout/4 : 1;
+        }
         server.cluster->failover_auth_time = mstime() +
-            500 + /* Fixed delay of 500 milliseconds, let FAIL msg propagate. */
-            random() % 500; /* Random delay between 0 and 500 milliseconds. */
+            delay_unit + random() % delay_unit;
         server.cluster->failover_auth_count = 0;
         server.cluster->failover_auth_sent = 0;
         server.cluster->failover_auth_rank = clusterGetSlaveRank();
         /* We add another delay that is proportional to the slave rank.
-         * Specifically 1 second * rank. This way slaves that have a probably
-         * less updated replication offset, are penalized. */
+         * Specifically 1 second * rank (two delay units in fast failover).
+         * This way slaves that have a probably less updated replication
+         * offset, are penalized. */
         server.cluster->failover_auth_time +=
-            server.cluster->failover_auth_rank * 1000;
+            server.cluster->failover_auth_rank * delay_unit * 2;
         /* However if this is a manual failover, no delay is needed. */
         if (server.cluster->mf_end) {
             server.cluster->failover_auth_time = mstime();
@@ -3127,8 +3344,12 @@ void clusterHandleSlaveFailover(void) {
     {
         int newrank = clusterGetSlaveRank();
         if (newrank > server.cluster->failover_auth_rank) {
+            mstime_t fail_timeout = clusterNodeFailTimeout(myself->slaveof);
+            long long rank_delay = 1000;
+            if (fail_timeout < server.cluster_node_timeout &&
+                fail_timeout/2 < rank_delay) rank_delay = fail_timeout/2;
             long long added_delay =
-                (newrank - server.cluster->failover_auth_rank) * 1000;
+                (newrank - server.cluster->failover_auth_rank) * rank_delay;
             server.cluster->failover_auth_time += added_delay;
             server.cluster->failover_auth_rank = newrank;
             serverLog(LL_WARNING,
@@ -3178,6 +3399,17 @@ void clusterHandleSlaveFailover(void) {
                 (unsigned long long) myself->configEpoch);
         }
 
+        /* Track how long the failover took. */
+        clusterNode *oldmaster = myself->slaveof;
+        mstime_t now = mstime();
+        if (nodeFailed(oldmaster)) {
+            server.cluster->stats_failover_election_time =
+                now - oldmaster->fail_time;
+            server.cluster->stats_failover_time = oldmaster->pong_received ?
+                now - oldmaster->pong_received : 0;
+        }
+        server.cluster->stats_failovers++;
+
         /* Take responsibility for the cluster slots. */
         clusterFailoverReplaceYourMaster();
     } else {
@@ -3388,6 +3620,7 @@ void clusterCron(void) {
     clusterNode *min_pong_node = NULL;
     static unsigned long long iteration = 0;
     mstime_t handshake_timeout;
+    int broadcast_pfail = 0;
 
     iteration++; /* Number of times this function was called so far. */
 
@@ -3430,6 +3663,18 @@ void clusterCron(void) {
     /* Update myself flags. */
     clusterUpdateMyselfFlags();
 
+    /* Measure the rate of PING, PONG and MEET messages we receive, used to
+     * size the gossip sections, see clusterGossipWanted(). */
+    if (!(iteration % 10)) {
+        static long long prev_pings = 0;
+        long long pings =
+            server.cluster->stats_bus_messages_received[CLUSTERMSG_TYPE_PING] +
+            server.cluster->stats_bus_messages_received[CLUSTERMSG_TYPE_PONG] +
+            server.cluster->stats_bus_messages_received[CLUSTERMSG_TYPE_MEET];
+        server.cluster->ping_rate = pings > prev_pings ? pings-prev_pings : 0;
+        prev_pings = pings;
+    }
+
     /* Check if we have disconnected nodes and re-establish the connection.
      * Also update a few stats while we are here, that can be used to make
      * better decisions in other part of the code. */
@@ -3566,6 +3811,16 @@ void clusterCron(void) {
             continue;
         }
 
+        /* The masters with a shorter timeout are also probed with small
+         * pings, often enough to notice a failure within their timeout. */
+        if (node->link &&
+            node->ping_sent == 0 &&
+            (now - node->pong_received) > clusterNodeFailTimeout(node)/2)
+        {
+            clusterSendProbe(node->link, CLUSTERMSG_TYPE_PING);
+            continue;
+        }
+
         /* If we are a master and one of the slaves requested a manual
          * failover, ping it continuously. */
         if (server.cluster->mf_end &&
@@ -3585,7 +3840,7 @@ void clusterCron(void) {
          * code at all. */
         delay = now - node->ping_sent;
 
-        if (delay > server.cluster_node_timeout) {
+        if (delay > clusterNodeFailTimeout(node)) {
             /* Timeout reached. Set the node as possibly failing if it is
              * not already in this state. */
             if (!(node->flags & (CLUSTER_NODE_PFAIL|CLUSTER_NODE_FAIL))) {
@@ -3593,10 +3848,21 @@ void clusterCron(void) {
                     node->name);
                 node->flags |= CLUSTER_NODE_PFAIL;
                 update_state = 1;
+                if (clusterNodeFailTimeout(node) <
+                    server.cluster_node_timeout)
+                {
+                    /* Don't wait for the regular pings to gossip about
+                     * it: the other masters get our failure report now,
+                     * and we may have the quorum already. */
+                    server.cluster->stats_pfail_nodes++;
+                    broadcast_pfail = 1;
+                    markNodeAsFailingIfNeeded(node);
+                }
             }
         }
     }
     dictReleaseIterator(di);
+    if (broadcast_pfail) clusterBroadcastProbe();
 
     /* If we are a slave node but the replication is still turned off,
      * enable it if we know the address of our master and it appears to
@@ -3625,10 +3891,35 @@ void clusterCron(void) {
             clusterHandleSlaveMigration(max_slaves);
     }
 
+    clusterSlotMigrationCron();
+    clusterReadLinksCron();
+    clusterHotKeysCron();
+
     if (update_state || server.cluster->state == CLUSTER_FAIL)
         clusterUpdateState();
 }
 
+/* Unsubscribe the clients from the sharded channels of the slots no longer
+ * served by the shard of this node. The slots deleted from our master (or
+ * from myself) are checked only before sleeping, because after a failover
+ * the slots are just moved to another node of the same shard, once the new
+ * configuration is applied. */
+static void clusterHandleLostShardChannels(void) {
+    clusterNode *curmaster = nodeIsMaster(myself) ? myself : myself->slaveof;
+    int lost = 0;
+
+    for (int j = 0; j < CLUSTER_SLOTS; j++) {
+        if (!bitmapTestBit(server.cluster->lost_slots,j)) continue;
+        if (server.cluster->slots[j] != NULL &&
+            server.cluster->slots[j] == curmaster)
+            bitmapClearBit(server.cluster->lost_slots,j);
+        else
+            lost++;
+    }
+    if (lost) pubsubShardUnsubscribeChannelsInSlots(server.cluster->lost_slots);
+    memset(server.cluster->lost_slots,0,sizeof(server.cluster->lost_slots));
+}
+
 /* This function is called before the event handler returns to sleep for
  * events. It is useful to perform operations that must be done ASAP in
  * reaction to events fired but that are not safe to perform inside event
@@ -3644,6 +3935,10 @@ void clusterBeforeSleep(void) {
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_UPDATE_STATE)
         clusterUpdateState();
 
+    /* Unsubscribe clients from the sharded channels of the lost slots. */
+    if (server.cluster->todo_before_sleep & CLUSTER_TODO_SHARD_CHANNELS)
+        clusterHandleLostShardChannels();
+
     /* Save the config, possibly using fsync. */
     if (server.cluster->todo_before_sleep & CLUSTER_TODO_SAVE_CONFIG) {
         int fsync = server.cluster->todo_before_sleep &
@@ -3761,6 +4056,17 @@ int clusterDelSlot(int slot) {
     if (!n) return C_ERR;
     serverAssert(clusterNodeClearSlotBit(n,slot) == 1);
     server.cluster->slots[slot] = NULL;
+    /* The load of the slot is accounted again by its next owner. */
+    if (n == myself)
+        memset(server.cluster->slot_stats+slot,0,sizeof(clusterSlotStats));
+    /* The sharded channels of the slot may no longer be served by our
+     * shard: see clusterHandleLostShardChannels(). */
+    if ((n == myself || n == myself->slaveof) &&
+        dictSize(server.pubsubshard_channels))
+    {
+        bitmapSetBit(server.cluster->lost_slots,slot);
+        clusterDoBeforeSleep(CLUSTER_TODO_SHARD_CHANNELS);
+    }
     return C_OK;
 }
 
@@ -4231,6 +4537,104 @@ void clusterReplyMultiBulkSlots(client *c) {
     setDeferredArrayLen(c, slot_replylen, num_masters);
 }
 
+/* Add to the reply the description of a node for CLUSTER SHARDS. The lag
+ * of the slaves is how many bytes of the replication stream they are behind
+ * their master, according to the last offsets they advertised. */
+static void addNodeReplyForClusterShard(client *c, clusterNode *node) {
+    long long offset, lag = 0, load;
+    const char *health;
+    int syncing;
+
+    if (node == myself) {
+        offset = nodeIsSlave(myself) ? replicationGetSlaveOffset() :
+                                       server.master_repl_offset;
+        load = getInstantaneousMetric(STATS_METRIC_COMMAND);
+        syncing = clusterNodeIsSyncing();
+    } else {
+        offset = node->repl_offset;
+        load = node->load;
+        syncing = node->syncing;
+    }
+    if (nodeIsSlave(node) && node->slaveof) {
+        clusterNode *master = node->slaveof;
+        long long master_offset = (master == myself) ?
+            server.master_repl_offset : master->repl_offset;
+        if (master_offset > offset) lag = master_offset-offset;
+    }
+
+    if (nodeFailed(node) || nodeTimedOut(node))
+        health = "failed";
+    else if (syncing)
+        health = "syncing";
+    else
+        health = "online";
+
+    addReplyMapLen(c,9);
+    addReplyBulkCString(c,"id");
+    addReplyBulkCBuffer(c,node->name,CLUSTER_NAMELEN);
+    addReplyBulkCString(c,"port");
+    addReplyLongLong(c,node->port);
+    addReplyBulkCString(c,"ip");
+    addReplyBulkCString(c,node->ip);
+    addReplyBulkCString(c,"endpoint");
+    addReplyBulkCString(c,node->ip);
+    addReplyBulkCString(c,"role");
+    addReplyBulkCString(c,nodeIsSlave(node) ? "replica" : "master");
+    addReplyBulkCString(c,"replication-offset");
+    addReplyLongLong(c,offset);
+    addReplyBulkCString(c,"replication-lag");
+    addReplyLongLong(c,lag);
+    addReplyBulkCString(c,"health");
+    addReplyBulkCString(c,health);
+    addReplyBulkCString(c,"load");
+    addReplyLongLong(c,load);
+}
+
+/* CLUSTER SHARDS: every master, with the slot ranges it serves, followed
+ * by its slaves. Unlike CLUSTER SLOTS the nodes come with their health,
+ * replication lag and load, so that clients can route the READONLY
+ * queries away from the slaves that are lagging or resynchronizing. */
+void clusterReplyShards(client *c) {
+    dictEntry *de;
+    dictIterator *di;
+    int num_shards = 0;
+    void *shards_len = addReplyDeferredLen(c);
+
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+        int j, start = -1, num_ranges = 0;
+        void *slots_len;
+
+        if (!nodeIsMaster(node) || nodeInHandshake(node)) continue;
+        num_shards++;
+
+        addReplyMapLen(c,2);
+        addReplyBulkCString(c,"slots");
+        slots_len = addReplyDeferredLen(c);
+        for (j = 0; j <= CLUSTER_SLOTS; j++) {
+            int bit = j < CLUSTER_SLOTS && clusterNodeGetSlotBit(node,j);
+
+            if (bit && start == -1) start = j;
+            if (!bit && start != -1) {
+                addReplyLongLong(c,start);
+                addReplyLongLong(c,j-1);
+                num_ranges++;
+                start = -1;
+            }
+        }
+        setDeferredArrayLen(c,slots_len,num_ranges*2);
+
+        addReplyBulkCString(c,"nodes");
+        addReplyArrayLen(c,node->numslaves+1);
+        addNodeReplyForClusterShard(c,node);
+        for (j = 0; j < node->numslaves; j++)
+            addNodeReplyForClusterShard(c,node->slaves[j]);
+    }
+    dictReleaseIterator(di);
+    setDeferredArrayLen(c,shards_len,num_shards);
+}
+
 void clusterCommand(client *c) {
     if (server.cluster_enabled == 0) {
         addReplyError(c,"This instance has cluster support disabled");
@@ -4251,6 +4655,8 @@ void clusterCommand(client *c) {
 "INFO - Return onformation about the cluster.",
 "KEYSLOT <key> -- Return the hash slot for <key>.",
 "MEET <ip> <port> [bus-port] -- Connect nodes into a working cluster.",
+"MIGRATESLOT <slot> <node-id> -- Move <slot> with its keys to <node-id> in the background.",
+"MIGRATESLOT CANCEL -- Abort the slot migration in progress.",
 "MYID -- Return the node id.",
 "NODES -- Return cluster configuration seen by node. Output format:",
 "    <id> <ip:port> <flags> <master> <pings> <pongs> <epoch> <link> <slot> ... <slot>",
@@ -4259,8 +4665,17 @@ void clusterCommand(client *c) {
 "SET-config-epoch <epoch> - Set config epoch of current node.",
 "SETSLOT <slot> (importing|migrating|stable|node <node-id>) -- Set slot state.",
 "REPLICAS <node-id> -- Return <node-id> replicas.",
+"SHARDS -- Return the slots ranges of every master, and the id, address, role,",
+"    replication offset and lag, health and load of the master and its replicas.",
 "SLOTS -- Return information about slots range mappings. Each range is made of:",
 "    start, end, master and replicas IP addresses, ports and ids",
+"SLOT-STATS SLOTSRANGE <start> <end> -- Return the keys, commands, input and",
+"    output bytes of the slots served by this node in the range.",
+"SLOT-STATS ORDERBY <key-count|ops|network-bytes-in|network-bytes-out>",
+"    [LIMIT <count>] [ASC|DESC] -- Return the stats of the busiest slots.",
+"SLOT-STATS RESET -- Reset the slots stats and the hot keys.",
+"HOTKEYS [<count>] -- Return the most accessed keys, and the estimated number",
+"    of commands accessing them.",
 NULL
         };
         addReplyHelp(c, help);
@@ -4303,6 +4718,15 @@ NULL
     } else if (!strcasecmp(c->argv[1]->ptr,"slots") && c->argc == 2) {
         /* CLUSTER SLOTS */
         clusterReplyMultiBulkSlots(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"shards") && c->argc == 2) {
+        /* CLUSTER SHARDS */
+        clusterReplyShards(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"slot-stats") && c->argc >= 3) {
+        /* CLUSTER SLOT-STATS (SLOTSRANGE|ORDERBY|RESET) ... */
+        clusterReplySlotStats(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"hotkeys") && c->argc <= 3) {
+        /* CLUSTER HOTKEYS [count] */
+        clusterReplyHotKeys(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"flushslots") && c->argc == 2) {
         /* CLUSTER FLUSHSLOTS */
         if (dictSize(server.db[0].dict) != 0) {
@@ -4459,6 +4883,14 @@ NULL
         }
         clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|CLUSTER_TODO_UPDATE_STATE);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"migrateslot") && c->argc >= 3) {
+        /* CLUSTER MIGRATESLOT <slot> <node ID> */
+        /* CLUSTER MIGRATESLOT CANCEL */
+        clusterMigrateSlotCommand(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"importslot") && c->argc >= 4) {
+        /* CLUSTER IMPORTSLOT <slot> START <node ID> */
+        /* CLUSTER IMPORTSLOT <slot> COMMIT */
+        clusterImportSlotCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"bumpepoch") && c->argc == 2) {
         /* CLUSTER BUMPEPOCH */
         int retval = clusterBumpConfigEpochWithoutConsensus();
@@ -4535,7 +4967,28 @@ NULL
                 server.cluster->stats_bus_messages_received[i]);
         }
         info = sdscatprintf(info,
-            "cluster_stats_messages_received:%lld\r\n", tot_msg_received);
+            "cluster_stats_messages_received:%lld\r\n"
+            "cluster_stats_bus_bytes_sent:%lld\r\n"
+            "cluster_stats_bus_bytes_received:%lld\r\n"
+            "cluster_stats_bus_light_headers_sent:%lld\r\n"
+            "cluster_gossip_sections:%d\r\n"
+            "cluster_stats_cross_slot_reads:%lld\r\n",
+            tot_msg_received,
+            server.cluster->stats_bus_bytes_sent,
+            server.cluster->stats_bus_bytes_received,
+            server.cluster->stats_bus_light_hdr_sent,
+            clusterGossipWanted(),
+            server.cluster->stats_cross_slot_reads);
+        info = sdscatprintf(info,
+            "cluster_last_fail_detection_time:%lld\r\n"
+            "cluster_last_failover_election_time:%lld\r\n"
+            "cluster_last_failover_time:%lld\r\n"
+            "cluster_stats_failovers:%lld\r\n",
+            (long long) server.cluster->stats_fail_detection_time,
+            (long long) server.cluster->stats_failover_election_time,
+            (long long) server.cluster->stats_failover_time,
+            server.cluster->stats_failovers);
+        info = clusterCatSlotMigrationInfo(info);
 
         /* Produce the reply protocol. */
         addReplyVerbatim(c,info,sdslen(info),"txt");
@@ -4814,13 +5267,16 @@ NULL
 
 /* Generates a DUMP-format representation of the object 'o', adding it to the
  * io stream pointed by 'rio'. This function can't fail. */
-void createDumpPayload(rio *payload, robj *o, robj *key) {
+void createDumpPayload(rio *payload, robj *o, robj *key, robj *fexpires) {
     unsigned char buf[2];
     uint64_t crc;
 
     /* Serialize the object in a RDB-like format. It consist of an object type
-     * byte followed by the serialized object. This is understood by RESTORE. */
+     * byte followed by the serialized object. This is understood by RESTORE.
+     * The field expires of an hash, if any, are saved before the type as
+     * in RDB files. */
     rioInitWithBuffer(payload,sdsempty());
+    if (fexpires) serverAssert(rdbSaveHashFieldExpires(payload,fexpires) != -1);
     serverAssert(rdbSaveObjectType(payload,o));
     serverAssert(rdbSaveObject(payload,o,key));
 
@@ -4866,12 +5322,147 @@ int verifyDumpPayload(unsigned char *p, size_t len) {
     return (memcmp(&crc,footer+2,8) == 0) ? C_OK : C_ERR;
 }
 
-/* DUMP keyname
+/* Chunked DUMP.
+ *
+ * DUMP key CURSOR <cursor> [SIZE <bytes>] serializes the value in pieces of
+ * about 'bytes' bytes, so that a big key is not copied as a whole in memory
+ * and doesn't block the server for long. Every piece is a DUMP payload of
+ * a value of the same type containing a part of the elements, and the reply
+ * is a two elements array: the cursor of the next piece, "0" after the last
+ * one, and the payload. The first payload is restored with RESTORE, then
+ * the next ones with RESTORE ... CHUNK, merging them into the key.
+ *
+ * The cursor is the byte offset of the strings, the index of the lists, the
+ * rank of the sorted sets, and the hash table cursor of the sets and the
+ * hashes, like SCAN. The value is expected not to change between the calls,
+ * otherwise elements may be missing or repeated. The payload is null when
+ * there was nothing left to serialize at the cursor. The values that can't
+ * be split are serialized as a whole by the first call. */
+#define DUMP_CHUNK_DEFAULT_BYTES (1024*1024)
+
+static robj *migrateChunkObject(robj *o, sds *ele, int count);
+
+typedef struct dumpChunk {
+    sds *ele;
+    int count;
+    size_t bytes;
+} dumpChunk;
+
+static void dumpChunkAdd(dumpChunk *chunk, sds ele) {
+    chunk->ele = zrealloc(chunk->ele,sizeof(sds)*(chunk->count+1));
+    chunk->ele[chunk->count++] = ele;
+    chunk->bytes += sdslen(ele);
+}
+
+static void dumpChunkScanCallback(void *privdata, const dictEntry *de) {
+    void **pd = privdata;
+    dumpChunk *chunk = pd[0];
+    robj *o = pd[1];
+
+    dumpChunkAdd(chunk,sdsdup(dictGetKey(de)));
+    if (o->type == OBJ_HASH) dumpChunkAdd(chunk,sdsdup(dictGetVal(de)));
+}
+
+/* Return 1 if the value of 'key' can be serialized in pieces. */
+static int dumpValueIsChunked(redisDb *db, robj *key, robj *o) {
+    if (o->type == OBJ_STRING) {
+        return sdsEncodedObject(o);
+    } else if (o->type == OBJ_LIST) {
+        return o->encoding == OBJ_ENCODING_QUICKLIST;
+    } else if (o->type == OBJ_SET) {
+        return o->encoding == OBJ_ENCODING_HT;
+    } else if (o->type == OBJ_HASH) {
+        /* The field expires are only serialized with the whole value. */
+        return o->encoding == OBJ_ENCODING_HT &&
+               hashFieldExpiresGet(db,key->ptr) == NULL;
+    } else if (o->type == OBJ_ZSET) {
+        return o->encoding == OBJ_ENCODING_SKIPLIST;
+    }
+    return 0;
+}
+
+/* Collect in 'chunk' the elements of 'o' starting at 'cursor', until 'size'
+ * bytes are collected. Returns the cursor of the next chunk, or 0. */
+static unsigned long dumpChunkCollect(robj *o, unsigned long cursor,
+                                      size_t size, dumpChunk *chunk)
+{
+    if (o->type == OBJ_STRING) {
+        size_t len = sdslen(o->ptr);
+        if (cursor >= len) return 0;
+        if (len-cursor > size) len = cursor+size;
+        dumpChunkAdd(chunk,sdsnewlen((char*)o->ptr+cursor,len-cursor));
+        return len == sdslen(o->ptr) ? 0 : len;
+    } else if (o->type == OBJ_LIST) {
+        quicklistIter *qi;
+        quicklistEntry entry;
+        if (cursor >= quicklistCount(o->ptr)) return 0;
+        qi = quicklistGetIteratorAtIdx(o->ptr,AL_START_HEAD,cursor);
+        while (chunk->bytes < size && quicklistNext(qi,&entry)) {
+            dumpChunkAdd(chunk,entry.value ?
+                sdsnewlen(entry.value,entry.sz) :
+                sdsfromlonglong(entry.longval));
+            cursor++;
+        }
+        quicklistReleaseIterator(qi);
+        return cursor == quicklistCount(o->ptr) ? 0 : cursor;
+    } else if (o->type == OBJ_SET || o->type == OBJ_HASH) {
+        void *privdata[2] = {chunk,o};
+        do {
+            cursor = dictScan(o->ptr,cursor,dumpChunkScanCallback,NULL,
+                              privdata);
+        } while (cursor && chunk->bytes < size);
+        return cursor;
+    } else {
+        zskiplist *zsl = ((zset*)o->ptr)->zsl;
+        zskiplistNode *zn;
+        char buf[128];
+        if (cursor >= zsl->length) return 0;
+        zn = zslGetElementByRank(zsl,cursor+1);
+        while (zn && chunk->bytes < size) {
+            dumpChunkAdd(chunk,sdsnewlen(buf,
+                d2string(buf,sizeof(buf),zn->score)));
+            dumpChunkAdd(chunk,sdsdup(zn->ele));
+            zn = zn->level[0].forward;
+            cursor++;
+        }
+        return zn ? cursor : 0;
+    }
+}
+
+/* DUMP keyname [CURSOR cursor [SIZE bytes]]
  * DUMP is actually not used by Redis Cluster but it is the obvious
  * complement of RESTORE and can be useful for different applications. */
 void dumpCommand(client *c) {
     robj *o;
     rio payload;
+    unsigned long cursor = 0;
+    long long size = DUMP_CHUNK_DEFAULT_BYTES;
+    int chunked = 0;
+
+    for (int j = 2; j < c->argc; j++) {
+        int additional = c->argc-j-1;
+        if (!strcasecmp(c->argv[j]->ptr,"cursor") && additional >= 1 &&
+            !chunked)
+        {
+            if (parseScanCursorOrReply(c,c->argv[j+1],&cursor) == C_ERR)
+                return;
+            chunked = 1;
+            j++;
+        } else if (!strcasecmp(c->argv[j]->ptr,"size") && additional >= 1 &&
+                   chunked)
+        {
+            if (getLongLongFromObjectOrReply(c,c->argv[j+1],&size,NULL)
+                    != C_OK) return;
+            if (size < 1) {
+                addReplyError(c,"SIZE must be positive");
+                return;
+            }
+            j++;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
 
     /* Check if the key is here. */
     if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
@@ -4879,26 +5470,113 @@ void dumpCommand(client *c) {
         return;
     }
 
-    /* Create the DUMP encoded representation. */
-    createDumpPayload(&payload,o,c->argv[1]);
+    if (!chunked) {
+        /* Create the DUMP encoded representation. */
+        createDumpPayload(&payload,o,c->argv[1],
+                          hashFieldExpiresGet(c->db,c->argv[1]->ptr));
 
-    /* Transfer to the client */
-    addReplyBulkSds(c,payload.io.buffer.ptr);
-    return;
+        /* Transfer to the client */
+        addReplyBulkSds(c,payload.io.buffer.ptr);
+        return;
+    }
+
+    addReplyArrayLen(c,2);
+    if (!dumpValueIsChunked(c->db,c->argv[1],o)) {
+        addReplyBulkCBuffer(c,"0",1);
+        if (cursor == 0) {
+            createDumpPayload(&payload,o,c->argv[1],
+                              hashFieldExpiresGet(c->db,c->argv[1]->ptr));
+            addReplyBulkSds(c,payload.io.buffer.ptr);
+        } else {
+            addReplyNull(c);
+        }
+        return;
+    }
+
+    dumpChunk chunk = {NULL,0,0};
+    cursor = dumpChunkCollect(o,cursor,size,&chunk);
+    addReplyBulkLongLong(c,cursor);
+    if (chunk.count) {
+        robj *part = migrateChunkObject(o,chunk.ele,chunk.count);
+        createDumpPayload(&payload,part,c->argv[1],NULL);
+        addReplyBulkSds(c,payload.io.buffer.ptr);
+        decrRefCount(part);
+    } else {
+        addReplyNull(c);
+    }
+    for (int j = 0; j < chunk.count; j++) sdsfree(chunk.ele[j]);
+    zfree(chunk.ele);
+}
+
+/* Merge the elements of 'chunk', restored with RESTORE ... CHUNK, into the
+ * value 'o' of 'key', of the same type. Returns C_ERR if the values of this
+ * type can't be merged. */
+static int restoreMergeChunk(redisDb *db, robj *key, robj *o, robj *chunk) {
+    if (o->type == OBJ_STRING) {
+        robj *dec = getDecodedObject(chunk);
+        o = dbUnshareStringValue(db,key,o);
+        o->ptr = sdscatlen(o->ptr,dec->ptr,sdslen(dec->ptr));
+        decrRefCount(dec);
+    } else if (o->type == OBJ_LIST) {
+        listTypeIterator *li = listTypeInitIterator(chunk,0,LIST_TAIL);
+        listTypeEntry entry;
+        while (listTypeNext(li,&entry)) {
+            robj *value = listTypeGet(&entry);
+            listTypePush(o,value,LIST_TAIL);
+            decrRefCount(value);
+        }
+        listTypeReleaseIterator(li);
+    } else if (o->type == OBJ_SET) {
+        setTypeIterator *si = setTypeInitIterator(chunk);
+        sds ele;
+        while ((ele = setTypeNextObject(si)) != NULL) {
+            setTypeAdd(o,ele);
+            sdsfree(ele);
+        }
+        setTypeReleaseIterator(si);
+    } else if (o->type == OBJ_HASH) {
+        hashTypeIterator *hi = hashTypeInitIterator(chunk);
+        while (hashTypeNext(hi) != C_ERR) {
+            sds field = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY);
+            sds value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
+            if (o->encoding == OBJ_ENCODING_LISTPACK &&
+                (sdslen(field) > server.hash_max_listpack_value ||
+                 sdslen(value) > server.hash_max_listpack_value))
+                hashTypeConvert(o,OBJ_ENCODING_HT);
+            hashFieldRemoveExpire(db,key->ptr,field);
+            hashTypeSet(o,field,value,
+                        HASH_SET_TAKE_FIELD|HASH_SET_TAKE_VALUE);
+        }
+        hashTypeReleaseIterator(hi);
+    } else if (o->type == OBJ_ZSET) {
+        zskiplistNode *zn;
+        if (chunk->encoding != OBJ_ENCODING_SKIPLIST)
+            zsetConvert(chunk,OBJ_ENCODING_SKIPLIST);
+        zn = ((zset*)chunk->ptr)->zsl->header->level[0].forward;
+        for (; zn; zn = zn->level[0].forward) {
+            int flags = ZADD_NONE;
+            zsetAdd(o,zn->score,zn->ele,&flags,NULL);
+        }
+    } else {
+        return C_ERR;
+    }
+    return C_OK;
 }
 
-/* RESTORE key ttl serialized-value [REPLACE] */
+/* RESTORE key ttl serialized-value [REPLACE] [CHUNK] */
 void restoreCommand(client *c) {
     long long ttl, lfu_freq = -1, lru_idle = -1, lru_clock = -1;
     rio payload;
-    int j, type, replace = 0, absttl = 0;
-    robj *obj;
+    int j, type, replace = 0, absttl = 0, chunk = 0;
+    robj *obj = NULL, *fexpires = NULL, *old = NULL;
 
     /* Parse additional options */
     for (j = 4; j < c->argc; j++) {
         int additional = c->argc-j-1;
         if (!strcasecmp(c->argv[j]->ptr,"replace")) {
             replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"chunk")) {
+            chunk = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"absttl")) {
             absttl = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"idletime") && additional >= 1 &&
@@ -4928,8 +5606,16 @@ void restoreCommand(client *c) {
         }
     }
 
+    /* A chunk is merged into the key, that can't be replaced. */
+    if (replace && chunk) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
     /* Make sure this key does not already exist here... */
-    if (!replace && lookupKeyWrite(c->db,c->argv[1]) != NULL) {
+    if (!replace && (old = lookupKeyWrite(c->db,c->argv[1])) != NULL &&
+        !chunk)
+    {
         addReply(c,shared.busykeyerr);
         return;
     }
@@ -4950,18 +5636,44 @@ void restoreCommand(client *c) {
     }
 
     rioInitWithBuffer(&payload,c->argv[3]->ptr);
-    if (((type = rdbLoadObjectType(&payload)) == -1) ||
-        ((obj = rdbLoadObject(type,&payload,c->argv[1])) == NULL))
+    if ((type = rdbLoadType(&payload)) == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+        if ((fexpires = rdbLoadHashFieldExpires(&payload,RDB_VERSION)) == NULL)
+            type = -1;
+        else
+            type = rdbLoadType(&payload);
+    }
+    if (!rdbIsObjectType(type) ||
+        ((obj = rdbLoadObject(type,&payload,c->argv[1])) == NULL) ||
+        (fexpires && obj->type != OBJ_HASH))
     {
+        if (obj) decrRefCount(obj);
+        if (fexpires) decrRefCount(fexpires);
         addReplyError(c,"Bad data format");
         return;
     }
 
-    /* Remove the old key if needed. */
-    if (replace) dbDelete(c->db,c->argv[1]);
+    if (old) {
+        /* Merge the chunk into the existing key. */
+        int retval = C_ERR;
+        if (old->type != obj->type)
+            addReply(c,shared.wrongtypeerr);
+        else if (fexpires ||
+                 (retval = restoreMergeChunk(c->db,c->argv[1],old,obj)) == C_ERR)
+            addReplyError(c,"The chunk can't be merged into the key");
+        decrRefCount(obj);
+        if (fexpires) decrRefCount(fexpires);
+        if (retval == C_ERR) return;
+        obj = lookupKeyWrite(c->db,c->argv[1]);
+    } else {
+        /* Remove the old key if needed. */
+        if (replace) dbDelete(c->db,c->argv[1]);
+
+        /* Create the key */
+        dbAdd(c->db,c->argv[1],obj);
+        if (fexpires) hashFieldExpiresAttach(c->db,c->argv[1]->ptr,fexpires);
+    }
 
-    /* Create the key and set the TTL if any */
-    dbAdd(c->db,c->argv[1],obj);
+    /* Set the TTL if any */
     if (ttl) {
         if (!absttl) ttl+=mstime();
         setExpire(c,c->db,c->argv[1],ttl);
@@ -5082,89 +5794,816 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
-/* MIGRATE host port key dbid timeout [COPY | REPLACE | AUTH password]
+/* Non blocking MIGRATE.
  *
- * On in the multiple keys form:
+ * When the calling client can block, MIGRATE no longer transfers the keys
+ * with synchronous I/O: a migrateJob takes the connection with the target
+ * (from the cache, or connecting in the background), and the keys are
+ * serialized and written from the event loop, MIGRATE_CHUNK_BYTES per round,
+ * while the replies are read as they arrive. Only the client calling MIGRATE
+ * is blocked, until all the replies are received.
  *
- * MIGRATE host port "" dbid timeout [COPY | REPLACE | AUTH password] KEYS key1
- * key2 ... keyN */
-void migrateCommand(client *c) {
-    migrateCachedSocket *cs;
-    int copy = 0, replace = 0, j;
-    char *password = NULL;
-    long timeout;
-    long dbid;
-    robj **ov = NULL; /* Objects to migrate. */
-    robj **kv = NULL; /* Key names. */
-    robj **newargv = NULL; /* Used to rewrite the command as DEL ... keys ... */
-    rio cmd, payload;
-    int may_retry = 1;
-    int write_error = 0;
-    int argv_rewritten = 0;
+ * Big collections and strings are not serialized at once: a RESTORE creates
+ * the key with the first chunk of elements, then the other chunks are merged
+ * into it with RESTORE ... CHUNK, and PEXPIREAT sets the TTL at the end. The chunks after the first are only sent once RESTORE
+ * succeeded, so that an existing key is never modified without REPLACE.
+ *
+ * Until the job terminates the keys are locked: commands writing them are
+ * refused with -TRYAGAIN, so that the values we hold references to can't
+ * change while they are being transferred. */
+#define MIGRATE_CHUNK_BYTES (64*1024) /* Serialized data per write round. */
+#define MIGRATE_CHUNK_MIN_ITEMS 1024  /* Bigger collections are chunked. */
+
+/* migrateJob->keyflags. */
+#define MIGRATE_KEY_SENT (1<<0)    /* All the commands creating it were sent. */
+#define MIGRATE_KEY_SKIPPED (1<<1) /* Expired or deleted before being sent. */
+#define MIGRATE_KEY_FAILED (1<<2)  /* The target replied with an error. */
+#define MIGRATE_KEY_CHUNKED (1<<3) /* Sent in multiple commands. */
+
+/* Owners of the replies that are not related to a single key. */
+#define MIGRATE_REPLY_AUX -1    /* AUTH, SELECT or ASKING. */
+#define MIGRATE_REPLY_IGNORE -2 /* DEL of a partially transferred key. */
+
+typedef struct migrateJob {
+    client *c;              /* Client blocked in MIGRATE, NULL if freed. */
+    redisDb *db;            /* DB of the keys to migrate. */
+    sds name;               /* host:port of the target, the cache key. */
+    connection *conn;
+    int connected;          /* Set once the connection is established. */
+    long last_dbid;         /* DB selected in the target, -1 if unknown. */
+    long dbid, timeout;
+    int copy, replace, retried;
+    sds password;
+    int numkeys;
+    robj **keys, **vals;
+    unsigned char *keyflags; /* MIGRATE_KEY_* flags of every key. */
+    int *pending;           /* Replies still expected for every key. */
+    int next;               /* Next key to serialize. */
+    /* State of the key being sent in chunks. */
+    int chunk_key;          /* Index of the key, or -1. */
+    int chunk_first;        /* The next chunk is the RESTORE creating it. */
+    int chunk_wait;         /* Waiting the reply of the RESTORE. */
+    long long chunk_expire; /* Expire to set at the end, or -1. */
+    quicklistIter *qi;
+    dictIterator *di;
+    zskiplistNode *zn;
+    size_t stroff;
+    /* Commands to write and replies to read. */
+    sds buf;
+    size_t bufpos;
+    int *replies;           /* Owner of the replies still to read. */
+    size_t replies_alloc;
+    long long replies_base; /* Number of the reply at replies[0]. */
+    long long replies_queued, replies_read;
+    sds rbuf;
+    sds error;              /* First error received from the target. */
+    mstime_t last_io;
+    listNode *node;         /* Node in server.migrate_jobs. */
+} migrateJob;
+
+static void migrateJobConnect(migrateJob *job);
+static void migrateJobWriteHandler(connection *conn);
+
+static void migrateJobAddCommand(migrateJob *job, int owner, int argc) {
+    job->buf = sdscatfmt(job->buf,"*%i\r\n",argc);
+    size_t idx = job->replies_queued++ - job->replies_base;
+    if (idx == job->replies_alloc) {
+        job->replies_alloc = job->replies_alloc ? job->replies_alloc*2 : 16;
+        job->replies = zrealloc(job->replies,sizeof(int)*job->replies_alloc);
+    }
+    job->replies[idx] = owner;
+    if (owner >= 0) job->pending[owner]++;
+}
 
-    /* To support the KEYS option we need the following additional state. */
-    int first_key = 3; /* Argument index of the first key. */
-    int num_keys = 1;  /* By default only migrate the 'key' argument. */
+static void migrateJobAddArg(migrateJob *job, const char *p, size_t len) {
+    job->buf = sdscatfmt(job->buf,"$%U\r\n",(unsigned long long)len);
+    job->buf = sdscatlen(job->buf,p,len);
+    job->buf = sdscatlen(job->buf,"\r\n",2);
+}
 
-    /* Parse additional options */
-    for (j = 6; j < c->argc; j++) {
-        int moreargs = j < c->argc-1;
-        if (!strcasecmp(c->argv[j]->ptr,"copy")) {
-            copy = 1;
-        } else if (!strcasecmp(c->argv[j]->ptr,"replace")) {
-            replace = 1;
-        } else if (!strcasecmp(c->argv[j]->ptr,"auth")) {
-            if (!moreargs) {
-                addReply(c,shared.syntaxerr);
-                return;
-            }
-            j++;
-            password = c->argv[j]->ptr;
-        } else if (!strcasecmp(c->argv[j]->ptr,"keys")) {
-            if (sdslen(c->argv[3]->ptr) != 0) {
-                addReplyError(c,
-                    "When using MIGRATE KEYS option, the key argument"
-                    " must be set to the empty string");
-                return;
-            }
-            first_key = j+1;
-            num_keys = c->argc - j - 1;
-            break; /* All the remaining args are keys. */
-        } else {
-            addReply(c,shared.syntaxerr);
-            return;
-        }
-    }
+static void migrateJobAddLongLongArg(migrateJob *job, long long value) {
+    char buf[LONG_STR_SIZE];
+    int len = ll2string(buf,sizeof(buf),value);
+    migrateJobAddArg(job,buf,len);
+}
 
-    /* Sanity check */
-    if (getLongFromObjectOrReply(c,c->argv[5],&timeout,NULL) != C_OK ||
-        getLongFromObjectOrReply(c,c->argv[4],&dbid,NULL) != C_OK)
-    {
-        return;
-    }
-    if (timeout <= 0) timeout = 1000;
+/* The commands following RESTORE-ASKING need ASKING in cluster mode. */
+static void migrateJobAddAsking(migrateJob *job) {
+    if (!server.cluster_enabled) return;
+    migrateJobAddCommand(job,MIGRATE_REPLY_AUX,1);
+    migrateJobAddArg(job,"ASKING",6);
+}
 
-    /* Check if the keys are here. If at least one key is to migrate, do it
-     * otherwise if all the keys are missing reply with "NOKEY" to signal
-     * the caller there was nothing to migrate. We don't return an error in
-     * this case, since often this is due to a normal condition like the key
-     * expiring in the meantime. */
-    ov = zrealloc(ov,sizeof(robj*)*num_keys);
-    kv = zrealloc(kv,sizeof(robj*)*num_keys);
-    int oi = 0;
+/* Queue the RESTORE of 'o' as the key 'j', or as a chunk to merge into the
+ * key if 'merge' is true. */
+static void migrateJobAddRestore(migrateJob *job, int j, robj *o, long long ttl,
+                                 int merge)
+{
+    robj *key = job->keys[j];
+    rio payload;
 
-    for (j = 0; j < num_keys; j++) {
-        if ((ov[oi] = lookupKeyRead(c->db,c->argv[first_key+j])) != NULL) {
-            kv[oi] = c->argv[first_key+j];
-            oi++;
-        }
-    }
-    num_keys = oi;
-    if (num_keys == 0) {
-        zfree(ov); zfree(kv);
-        addReplySds(c,sdsnew("+NOKEY\r\n"));
-        return;
-    }
+    migrateJobAddCommand(job,j,(job->replace || merge) ? 5 : 4);
+    if (server.cluster_enabled)
+        migrateJobAddArg(job,"RESTORE-ASKING",14);
+    else
+        migrateJobAddArg(job,"RESTORE",7);
+    migrateJobAddArg(job,key->ptr,sdslen(key->ptr));
+    migrateJobAddLongLongArg(job,ttl);
+    createDumpPayload(&payload,o,key,o == job->vals[j] ?
+                      hashFieldExpiresGet(job->db,key->ptr) : NULL);
+    migrateJobAddArg(job,payload.io.buffer.ptr,sdslen(payload.io.buffer.ptr));
+    sdsfree(payload.io.buffer.ptr);
+    if (merge)
+        migrateJobAddArg(job,"CHUNK",5);
+    else if (job->replace)
+        migrateJobAddArg(job,"REPLACE",7);
+}
+
+/* Return 1 if the value should be sent in chunks. Only the encodings that
+ * can be iterated while other clients read the key are candidates. */
+static int migrateValueIsLarge(robj *o) {
+    if (o->type == OBJ_STRING) {
+        return sdsEncodedObject(o) && sdslen(o->ptr) > MIGRATE_CHUNK_BYTES;
+    } else if (o->type == OBJ_LIST) {
+        /* Reading compressed nodes decompresses them in place. */
+        quicklist *ql = o->ptr;
+        return o->encoding == OBJ_ENCODING_QUICKLIST && ql->compress == 0 &&
+               ql->count > MIGRATE_CHUNK_MIN_ITEMS;
+    } else if (o->type == OBJ_SET || o->type == OBJ_HASH) {
+        return o->encoding == OBJ_ENCODING_HT &&
+               dictSize((dict*)o->ptr) > MIGRATE_CHUNK_MIN_ITEMS;
+    } else if (o->type == OBJ_ZSET) {
+        return o->encoding == OBJ_ENCODING_SKIPLIST &&
+               zsetLength(o) > MIGRATE_CHUNK_MIN_ITEMS;
+    }
+    return 0;
+}
+
+static void migrateJobStopChunks(migrateJob *job) {
+    if (job->qi) quicklistReleaseIterator(job->qi);
+    if (job->di) dictReleaseIterator(job->di);
+    job->qi = NULL;
+    job->di = NULL;
+    job->zn = NULL;
+    job->chunk_key = -1;
+    job->chunk_wait = 0;
+}
+
+/* Store in 'ele' the next element of the key sent in chunks, as one new SDS
+ * string, or two for the hashes (field and value) and the sorted sets
+ * (score and member). Returns the number of strings, or 0 at the end. */
+static int migrateChunkNext(migrateJob *job, sds *ele) {
+    robj *o = job->vals[job->chunk_key];
+    dictEntry *de;
+
+    if (o->type == OBJ_STRING) {
+        size_t len = sdslen(o->ptr) - job->stroff;
+        if (len == 0) return 0;
+        if (len > MIGRATE_CHUNK_BYTES) len = MIGRATE_CHUNK_BYTES;
+        ele[0] = sdsnewlen((char*)o->ptr+job->stroff,len);
+        job->stroff += len;
+        return 1;
+    } else if (o->type == OBJ_LIST) {
+        quicklistEntry entry;
+        if (!quicklistNext(job->qi,&entry)) return 0;
+        ele[0] = entry.value ? sdsnewlen(entry.value,entry.sz) :
+                               sdsfromlonglong(entry.longval);
+        return 1;
+    } else if (o->type == OBJ_SET) {
+        if ((de = dictNext(job->di)) == NULL) return 0;
+        ele[0] = sdsdup(dictGetKey(de));
+        return 1;
+    } else if (o->type == OBJ_HASH) {
+        if ((de = dictNext(job->di)) == NULL) return 0;
+        ele[0] = sdsdup(dictGetKey(de));
+        ele[1] = sdsdup(dictGetVal(de));
+        return 2;
+    } else {
+        char buf[128];
+        if (job->zn == NULL) return 0;
+        ele[0] = sdsnewlen(buf,d2string(buf,sizeof(buf),job->zn->score));
+        ele[1] = sdsdup(job->zn->ele);
+        job->zn = job->zn->level[0].forward;
+        return 2;
+    }
+}
+
+/* Create an object of the type of 'o' with the elements 'ele'. */
+static robj *migrateChunkObject(robj *o, sds *ele, int count) {
+    robj *chunk;
+    int j;
+
+    if (o->type == OBJ_STRING) {
+        return createStringObject(ele[0],sdslen(ele[0]));
+    } else if (o->type == OBJ_LIST) {
+        chunk = createQuicklistObject();
+        quicklistSetOptions(chunk->ptr,server.list_max_ziplist_size,
+                            server.list_compress_depth);
+        for (j = 0; j < count; j++)
+            quicklistPushTail(chunk->ptr,ele[j],sdslen(ele[j]));
+    } else if (o->type == OBJ_SET) {
+        chunk = createSetObject();
+        for (j = 0; j < count; j++) setTypeAdd(chunk,ele[j]);
+    } else if (o->type == OBJ_HASH) {
+        chunk = createHashObject();
+        hashTypeConvert(chunk,OBJ_ENCODING_HT);
+        for (j = 0; j < count; j += 2)
+            hashTypeSet(chunk,ele[j],ele[j+1],HASH_SET_COPY);
+    } else {
+        chunk = createZsetObject();
+        for (j = 0; j < count; j += 2) {
+            int flags = ZADD_NONE;
+            zsetAdd(chunk,strtod(ele[j],NULL),ele[j+1],&flags,NULL);
+        }
+    }
+    return chunk;
+}
+
+/* Queue the next chunk of the key being sent in chunks. */
+static void migrateJobSendChunk(migrateJob *job) {
+    int j = job->chunk_key, count = 0, done = 0;
+    robj *o = job->vals[j], *key = job->keys[j];
+    sds *ele = NULL;
+    size_t bytes = 0;
+
+    /* A string is sent as a single element per chunk. */
+    while (bytes < MIGRATE_CHUNK_BYTES && !(o->type == OBJ_STRING && count)) {
+        sds e[2];
+        int n = migrateChunkNext(job,e);
+        if (n == 0) {
+            done = 1;
+            break;
+        }
+        ele = zrealloc(ele,sizeof(sds)*(count+n));
+        for (int i = 0; i < n; i++) {
+            ele[count++] = e[i];
+            bytes += sdslen(e[i]);
+        }
+    }
+
+    if (job->chunk_first) {
+        robj *chunk = migrateChunkObject(o,ele,count);
+        long long ttl = 0;
+        if (done) {
+            /* The key fit in a single chunk after all. */
+            job->keyflags[j] &= ~MIGRATE_KEY_CHUNKED;
+            if (job->chunk_expire != -1) {
+                ttl = job->chunk_expire-mstime();
+                if (ttl < 1) ttl = 1;
+            }
+        }
+        migrateJobAddRestore(job,j,chunk,ttl,0);
+        decrRefCount(chunk);
+        job->chunk_first = 0;
+        job->chunk_wait = 1;
+    } else if (count) {
+        robj *chunk = migrateChunkObject(o,ele,count);
+        migrateJobAddRestore(job,j,chunk,0,1);
+        decrRefCount(chunk);
+    }
+    for (int i = 0; i < count; i++) sdsfree(ele[i]);
+    zfree(ele);
+
+    if (done) {
+        if (job->chunk_expire != -1 &&
+            job->keyflags[j] & MIGRATE_KEY_CHUNKED)
+        {
+            migrateJobAddAsking(job);
+            migrateJobAddCommand(job,j,3);
+            migrateJobAddArg(job,"PEXPIREAT",9);
+            migrateJobAddArg(job,key->ptr,sdslen(key->ptr));
+            migrateJobAddLongLongArg(job,job->chunk_expire);
+        }
+        job->keyflags[j] |= MIGRATE_KEY_SENT;
+        migrateJobStopChunks(job);
+    }
+}
+
+/* Queue the commands creating the key 'j' in the target. */
+static void migrateJobSendKey(migrateJob *job, int j) {
+    robj *key = job->keys[j], *o = job->vals[j];
+
+    /* The key may be expired or evicted in the meantime. */
+    if (expireIfNeeded(job->db,key) ||
+        lookupKey(job->db,key,LOOKUP_NOTOUCH) != o)
+    {
+        job->keyflags[j] |= MIGRATE_KEY_SKIPPED;
+        return;
+    }
+
+    long long ttl = 0, expireat = getExpire(job->db,key);
+    /* The field expires of an hash are only sent with the whole value. */
+    if (migrateValueIsLarge(o) && !hashFieldExpiresGet(job->db,key->ptr)) {
+        job->keyflags[j] |= MIGRATE_KEY_CHUNKED;
+        job->chunk_key = j;
+        job->chunk_first = 1;
+        job->chunk_expire = expireat;
+        job->stroff = 0;
+        if (o->type == OBJ_LIST)
+            job->qi = quicklistGetIterator(o->ptr,AL_START_HEAD);
+        else if (o->type == OBJ_SET || o->type == OBJ_HASH)
+            job->di = dictGetSafeIterator(o->ptr);
+        else if (o->type == OBJ_ZSET)
+            job->zn = ((zset*)o->ptr)->zsl->header->level[0].forward;
+        migrateJobSendChunk(job);
+        return;
+    }
+
+    if (expireat != -1) {
+        ttl = expireat-mstime();
+        if (ttl < 1) ttl = 1;
+    }
+    migrateJobAddRestore(job,j,o,ttl,0);
+    job->keyflags[j] |= MIGRATE_KEY_SENT;
+}
+
+static int migrateJobHasDataToSend(migrateJob *job) {
+    return (job->chunk_key != -1 && !job->chunk_wait) ||
+           job->next < job->numkeys;
+}
+
+/* Serialize keys until MIGRATE_CHUNK_BYTES are ready to be written. */
+static void migrateJobFill(migrateJob *job) {
+    while (sdslen(job->buf)-job->bufpos < MIGRATE_CHUNK_BYTES &&
+           migrateJobHasDataToSend(job))
+    {
+        if (job->chunk_key != -1)
+            migrateJobSendChunk(job);
+        else
+            migrateJobSendKey(job,job->next++);
+    }
+}
+
+/* Terminate the job, replying to the client if it is still connected.
+ * When 'ioerr' is NULL the transfer completed, and the keys the target
+ * acknowledged are deleted unless COPY was given. */
+static void migrateJobFinish(migrateJob *job, const char *ioerr) {
+    int j;
+
+    listDelNode(server.migrate_jobs,job->node);
+
+    /* Put the connection back in the cache, unless it's broken. */
+    if (job->conn && job->connected && ioerr == NULL) {
+        migrateCachedSocket *cs = zmalloc(sizeof(*cs));
+        connSetReadHandler(job->conn,NULL);
+        connSetWriteHandler(job->conn,NULL);
+        if (dictSize(server.migrate_cached_sockets) ==
+            MIGRATE_SOCKET_CACHE_ITEMS)
+        {
+            dictEntry *de = dictGetRandomKey(server.migrate_cached_sockets);
+            migrateCachedSocket *old = dictGetVal(de);
+            connClose(old->conn);
+            zfree(old);
+            dictDelete(server.migrate_cached_sockets,dictGetKey(de));
+        }
+        cs->conn = job->conn;
+        /* On error assume that last_dbid is no longer valid. */
+        cs->last_dbid = job->error ? -1 : job->dbid;
+        cs->last_use_time = server.unixtime;
+        if (dictAdd(server.migrate_cached_sockets,sdsdup(job->name),cs)
+            != DICT_OK)
+        {
+            /* A MIGRATE to the same target cached a connection already. */
+            connClose(cs->conn);
+            zfree(cs);
+        }
+    } else if (job->conn) {
+        connClose(job->conn);
+    }
+
+    /* Delete the keys the target acknowledged, and propagate the DEL. */
+    if (!job->copy) {
+        robj **argv = zmalloc(sizeof(robj*)*(job->numkeys+1));
+        int argc = 1;
+
+        for (j = 0; j < job->numkeys; j++) {
+            robj *key = job->keys[j];
+            if ((job->keyflags[j] & (MIGRATE_KEY_SENT|MIGRATE_KEY_FAILED)) !=
+                MIGRATE_KEY_SENT || job->pending[j]) continue;
+            if (lookupKey(job->db,key,LOOKUP_NOTOUCH) != job->vals[j])
+                continue;
+            dbDelete(job->db,key);
+            signalModifiedKey(job->db,key);
+            server.dirty++;
+            argv[argc++] = key;
+        }
+        if (argc > 1) {
+            argv[0] = createStringObject("DEL",3);
+            propagate(server.delCommand,job->db->id,argv,argc,
+                      PROPAGATE_AOF|PROPAGATE_REPL);
+            decrRefCount(argv[0]);
+        }
+        zfree(argv);
+    }
+
+    if (job->c) {
+        if (job->error)
+            addReplyErrorFormat(job->c,"Target instance replied with error: %s",
+                job->error);
+        else if (ioerr)
+            addReplySds(job->c,sdsnew(ioerr));
+        else
+            addReply(job->c,shared.ok);
+        unblockClient(job->c);
+    }
+
+    migrateJobStopChunks(job);
+    for (j = 0; j < job->numkeys; j++) {
+        dictDelete(job->db->locked_keys,job->keys[j]);
+        decrRefCount(job->keys[j]);
+        decrRefCount(job->vals[j]);
+    }
+    zfree(job->keys);
+    zfree(job->vals);
+    zfree(job->keyflags);
+    zfree(job->pending);
+    zfree(job->replies);
+    sdsfree(job->name);
+    sdsfree(job->password);
+    sdsfree(job->buf);
+    sdsfree(job->rbuf);
+    sdsfree(job->error);
+    zfree(job);
+}
+
+/* Handle an I/O error or timeout. If nothing was received yet the cached
+ * connection may have been closed by the target in the meantime: retry once
+ * from scratch with a new connection. */
+static void migrateJobIOError(migrateJob *job, const char *doing, int timeout) {
+    if (job->connected && !job->retried && !timeout &&
+        job->replies_read == 0)
+    {
+        connClose(job->conn);
+        job->conn = NULL;
+        job->connected = 0;
+        job->retried = 1;
+        job->last_dbid = -1;
+        job->next = 0;
+        migrateJobStopChunks(job);
+        memset(job->keyflags,0,job->numkeys);
+        memset(job->pending,0,sizeof(int)*job->numkeys);
+        job->replies_base = job->replies_queued = 0;
+        sdsclear(job->buf);
+        sdsclear(job->rbuf);
+        job->bufpos = 0;
+        migrateJobConnect(job);
+        return;
+    }
+
+    sds err = sdscatprintf(sdsempty(),
+        "-IOERR error or timeout %s to target instance\r\n", doing);
+    migrateJobFinish(job,err);
+    sdsfree(err);
+}
+
+static void migrateJobCheckDone(migrateJob *job) {
+    if (!migrateJobHasDataToSend(job) && job->chunk_key == -1 &&
+        job->bufpos == sdslen(job->buf) &&
+        job->replies_read == job->replies_queued)
+    {
+        migrateJobFinish(job,NULL);
+    }
+}
+
+static void migrateJobProcessReply(migrateJob *job, int owner, char *reply) {
+    int first = job->chunk_wait && owner == job->chunk_key;
+
+    if (first) {
+        /* The RESTORE creating the key sent in chunks: go on with the
+         * other chunks. */
+        job->chunk_wait = 0;
+        connSetWriteHandler(job->conn,migrateJobWriteHandler);
+    }
+    if (owner >= 0) job->pending[owner]--;
+    if (reply[0] != '-' || owner == MIGRATE_REPLY_IGNORE) return;
+
+    if (job->error == NULL) job->error = sdsnew(reply+1);
+    if (owner < 0 || job->keyflags[owner] & MIGRATE_KEY_FAILED) return;
+    job->keyflags[owner] |= MIGRATE_KEY_FAILED;
+    if (owner == job->chunk_key) migrateJobStopChunks(job);
+
+    /* Don't leave in the target a key we sent only partially. */
+    if ((job->keyflags[owner] & MIGRATE_KEY_CHUNKED) && !first) {
+        robj *key = job->keys[owner];
+        migrateJobAddAsking(job);
+        migrateJobAddCommand(job,MIGRATE_REPLY_IGNORE,2);
+        migrateJobAddArg(job,"DEL",3);
+        migrateJobAddArg(job,key->ptr,sdslen(key->ptr));
+        connSetWriteHandler(job->conn,migrateJobWriteHandler);
+    }
+}
+
+static void migrateJobReadHandler(connection *conn) {
+    migrateJob *job = connGetPrivateData(conn);
+    char buf[PROTO_IOBUF_LEN];
+    int nread;
+
+    nread = connRead(conn,buf,sizeof(buf));
+    if (nread == -1 && connGetState(conn) == CONN_STATE_CONNECTED) return;
+    if (nread <= 0) {
+        migrateJobIOError(job,"reading",0);
+        return;
+    }
+    job->last_io = mstime();
+    job->rbuf = sdscatlen(job->rbuf,buf,nread);
+
+    char *p = job->rbuf, *nl;
+    while ((nl = memchr(p,'\n',sdslen(job->rbuf)-(p-job->rbuf))) != NULL) {
+        if (job->replies_read == job->replies_queued) {
+            migrateJobIOError(job,"reading",1);
+            return;
+        }
+        *nl = '\0';
+        if (nl > p && nl[-1] == '\r') nl[-1] = '\0';
+        int owner = job->replies[job->replies_read++ - job->replies_base];
+        migrateJobProcessReply(job,owner,p);
+        p = nl+1;
+    }
+    sdsrange(job->rbuf,p-job->rbuf,-1);
+
+    /* Drop the owners of the replies already read. */
+    long long consumed = job->replies_read - job->replies_base;
+    if (consumed > 1024 && consumed*2 > job->replies_queued-job->replies_base) {
+        memmove(job->replies,job->replies+consumed,
+                sizeof(int)*(job->replies_queued-job->replies_read));
+        job->replies_base = job->replies_read;
+    }
+    migrateJobCheckDone(job);
+}
+
+static void migrateJobWriteHandler(connection *conn) {
+    migrateJob *job = connGetPrivateData(conn);
+    size_t totwritten = 0;
+
+    while (totwritten < NET_MAX_WRITES_PER_EVENT) {
+        migrateJobFill(job);
+        size_t towrite = sdslen(job->buf)-job->bufpos;
+        if (towrite == 0) break;
+        int nwritten = connWrite(conn,job->buf+job->bufpos,towrite);
+        if (nwritten <= 0) {
+            if (nwritten == -1 && connGetState(conn) == CONN_STATE_CONNECTED)
+                return;
+            migrateJobIOError(job,"writing",0);
+            return;
+        }
+        job->bufpos += nwritten;
+        totwritten += nwritten;
+        job->last_io = mstime();
+        if (job->bufpos == sdslen(job->buf)) {
+            sdsclear(job->buf);
+            job->bufpos = 0;
+        }
+    }
+    if (job->bufpos > MIGRATE_CHUNK_BYTES) {
+        sdsrange(job->buf,job->bufpos,-1);
+        job->bufpos = 0;
+    }
+    if (sdslen(job->buf) == job->bufpos && !migrateJobHasDataToSend(job)) {
+        connSetWriteHandler(conn,NULL);
+        migrateJobCheckDone(job);
+    }
+}
+
+/* The connection is ready: queue AUTH and SELECT, and start the transfer. */
+static void migrateJobStartTransfer(migrateJob *job) {
+    job->connected = 1;
+    job->last_io = mstime();
+    if (job->password) {
+        migrateJobAddCommand(job,MIGRATE_REPLY_AUX,2);
+        migrateJobAddArg(job,"AUTH",4);
+        migrateJobAddArg(job,job->password,sdslen(job->password));
+    }
+    if (job->last_dbid != job->dbid) {
+        migrateJobAddCommand(job,MIGRATE_REPLY_AUX,2);
+        migrateJobAddArg(job,"SELECT",6);
+        migrateJobAddLongLongArg(job,job->dbid);
+    }
+    connSetPrivateData(job->conn,job);
+    connSetReadHandler(job->conn,migrateJobReadHandler);
+    connSetWriteHandler(job->conn,migrateJobWriteHandler);
+}
+
+static void migrateJobConnectHandler(connection *conn) {
+    migrateJob *job = connGetPrivateData(conn);
+
+    if (connGetState(conn) != CONN_STATE_CONNECTED) {
+        migrateJobFinish(job,
+            "-IOERR error or timeout connecting to the client\r\n");
+        return;
+    }
+    connEnableTcpNoDelay(conn);
+    migrateJobStartTransfer(job);
+}
+
+/* Take the cached connection to the target, or start connecting. */
+static void migrateJobConnect(migrateJob *job) {
+    migrateCachedSocket *cs;
+    char *colon = strrchr(job->name,':');
+
+    job->last_io = mstime();
+    if (!job->retried &&
+        (cs = dictFetchValue(server.migrate_cached_sockets,job->name)))
+    {
+        job->conn = cs->conn;
+        job->last_dbid = cs->last_dbid;
+        zfree(cs);
+        dictDelete(server.migrate_cached_sockets,job->name);
+        migrateJobStartTransfer(job);
+        return;
+    }
+
+    job->conn = server.tls_cluster ? connCreateTLS() : connCreateSocket();
+    connSetPrivateData(job->conn,job);
+    *colon = '\0';
+    int retval = connConnect(job->conn,job->name,atoi(colon+1),NULL,
+                             migrateJobConnectHandler);
+    *colon = ':';
+    if (retval != C_OK) {
+        migrateJobFinish(job,
+            "-IOERR error or timeout connecting to the client\r\n");
+    }
+}
+
+/* Block the client and migrate 'kv' (with values 'ov') in the background. */
+static void migrateStartJob(client *c, long dbid, long timeout, int copy,
+                            int replace, char *password, robj **kv,
+                            robj **ov, int num_keys)
+{
+    migrateJob *job = zcalloc(sizeof(*job));
+
+    job->c = c;
+    job->db = c->db;
+    job->name = sdscatfmt(sdsempty(),"%S:%S",c->argv[1]->ptr,c->argv[2]->ptr);
+    job->last_dbid = -1;
+    job->dbid = dbid;
+    job->timeout = timeout;
+    job->copy = copy;
+    job->replace = replace;
+    job->password = password ? sdsdup(password) : NULL;
+    job->numkeys = num_keys;
+    job->keys = kv;
+    job->vals = ov;
+    job->keyflags = zcalloc(num_keys);
+    job->pending = zcalloc(sizeof(int)*num_keys);
+    job->chunk_key = -1;
+    job->buf = sdsempty();
+    job->rbuf = sdsempty();
+    for (int j = 0; j < num_keys; j++) {
+        incrRefCount(kv[j]);
+        incrRefCount(ov[j]);
+        if (dictAdd(c->db->locked_keys,kv[j],job) == DICT_OK)
+            incrRefCount(kv[j]);
+    }
+    listAddNodeTail(server.migrate_jobs,job);
+    job->node = listLast(server.migrate_jobs);
+
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_MIGRATE);
+    migrateJobConnect(job);
+}
+
+/* The client blocked in MIGRATE is unblocked or freed: the job goes on. */
+void unblockClientWaitingMigrate(client *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.migrate_jobs,&li);
+    while((ln = listNext(&li))) {
+        migrateJob *job = ln->value;
+        if (job->c == c) job->c = NULL;
+    }
+}
+
+/* Called from serverCron() to abort the jobs not making progress. */
+void migrateJobsCron(void) {
+    listIter li;
+    listNode *ln;
+
+    mstime_t now = mstime();
+
+    listRewind(server.migrate_jobs,&li);
+    while((ln = listNext(&li))) {
+        migrateJob *job = ln->value;
+        if (now - job->last_io <= job->timeout) continue;
+        if (!job->connected)
+            migrateJobFinish(job,
+                "-IOERR error or timeout connecting to the client\r\n");
+        else if (sdslen(job->buf) != job->bufpos ||
+                 migrateJobHasDataToSend(job))
+            migrateJobIOError(job,"writing",1);
+        else
+            migrateJobIOError(job,"reading",1);
+    }
+}
+
+/* Abort the jobs migrating keys of 'db', that is about to be flushed or
+ * swapped with another DB. The local keys are never deleted. */
+void migrateAbortJobs(redisDb *db) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.migrate_jobs,&li);
+    while((ln = listNext(&li))) {
+        migrateJob *job = ln->value;
+        if (job->db != db) continue;
+        job->copy = 1;
+        sdsfree(job->error);
+        job->error = NULL;
+        migrateJobFinish(job,
+            "-ERR MIGRATE aborted, the DB was flushed or swapped\r\n");
+    }
+}
+
+/* MIGRATE host port key dbid timeout [COPY | REPLACE | AUTH password]
+ *
+ * On in the multiple keys form:
+ *
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE | AUTH password] KEYS key1
+ * key2 ... keyN */
+void migrateCommand(client *c) {
+    migrateCachedSocket *cs;
+    int copy = 0, replace = 0, j;
+    char *password = NULL;
+    long timeout;
+    long dbid;
+    robj **ov = NULL; /* Objects to migrate. */
+    robj **kv = NULL; /* Key names. */
+    robj **newargv = NULL; /* Used to rewrite the command as DEL ... keys ... */
+    rio cmd, payload;
+    int may_retry = 1;
+    int write_error = 0;
+    int argv_rewritten = 0;
+
+    /* To support the KEYS option we need the following additional state. */
+    int first_key = 3; /* Argument index of the first key. */
+    int num_keys = 1;  /* By default only migrate the 'key' argument. */
+
+    /* Parse additional options */
+    for (j = 6; j < c->argc; j++) {
+        int moreargs = j < c->argc-1;
+        if (!strcasecmp(c->argv[j]->ptr,"copy")) {
+            copy = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"replace")) {
+            replace = 1;
+        } else if (!strcasecmp(c->argv[j]->ptr,"auth")) {
+            if (!moreargs) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            j++;
+            password = c->argv[j]->ptr;
+        } else if (!strcasecmp(c->argv[j]->ptr,"keys")) {
+            if (sdslen(c->argv[3]->ptr) != 0) {
+                addReplyError(c,
+                    "When using MIGRATE KEYS option, the key argument"
+                    " must be set to the empty string");
+                return;
+            }
+            first_key = j+1;
+            num_keys = c->argc - j - 1;
+            break; /* All the remaining args are keys. */
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    /* Sanity check */
+    if (getLongFromObjectOrReply(c,c->argv[5],&timeout,NULL) != C_OK ||
+        getLongFromObjectOrReply(c,c->argv[4],&dbid,NULL) != C_OK)
+    {
+        return;
+    }
+    if (timeout <= 0) timeout = 1000;
+
+    /* Check if the keys are here. If at least one key is to migrate, do it
+     * otherwise if all the keys are missing reply with "NOKEY" to signal
+     * the caller there was nothing to migrate. We don't return an error in
+     * this case, since often this is due to a normal condition like the key
+     * expiring in the meantime. */
+    ov = zrealloc(ov,sizeof(robj*)*num_keys);
+    kv = zrealloc(kv,sizeof(robj*)*num_keys);
+    int oi = 0;
+
+    for (j = 0; j < num_keys; j++) {
+        if ((ov[oi] = lookupKeyRead(c->db,c->argv[first_key+j])) != NULL) {
+            kv[oi] = c->argv[first_key+j];
+            oi++;
+        }
+    }
+    num_keys = oi;
+    if (num_keys == 0) {
+        zfree(ov); zfree(kv);
+        addReplySds(c,sdsnew("+NOKEY\r\n"));
+        return;
+    }
+
+    /* Transfer the keys in the background, blocking only this client,
+     * unless it is a context where clients can't block. */
+    if (!(c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE))) {
+        migrateStartJob(c,dbid,timeout,copy,replace,password,kv,ov,num_keys);
+        return;
+    }
 
 try_again:
     write_error = 0;
@@ -5232,7 +6671,8 @@ try_again:
 
         /* Emit the payload argument, that is the serialized object using
          * the DUMP format. */
-        createDumpPayload(&payload,ov[j],kv[j]);
+        createDumpPayload(&payload,ov[j],kv[j],
+                          hashFieldExpiresGet(c->db,kv[j]->ptr));
         serverAssertWithInfo(c,NULL,
             rioWriteBulkString(&cmd,payload.io.buffer.ptr,
                                sdslen(payload.io.buffer.ptr)));
@@ -5387,28 +6827,808 @@ socket_err:
      * Note: Closing the migrate socket will also force SELECT next time. */
     sdsfree(cmd.io.buffer.ptr);
 
-    /* If the command was rewritten as DEL and there was a socket error,
-     * we already closed the socket earlier. While migrateCloseSocket()
-     * is idempotent, the host/port arguments are now gone, so don't do it
-     * again. */
-    if (!argv_rewritten) migrateCloseSocket(c->argv[1],c->argv[2]);
-    zfree(newargv);
-    newargv = NULL; /* This will get reallocated on retry. */
+    /* If the command was rewritten as DEL and there was a socket error,
+     * we already closed the socket earlier. While migrateCloseSocket()
+     * is idempotent, the host/port arguments are now gone, so don't do it
+     * again. */
+    if (!argv_rewritten) migrateCloseSocket(c->argv[1],c->argv[2]);
+    zfree(newargv);
+    newargv = NULL; /* This will get reallocated on retry. */
+
+    /* Retry only if it's not a timeout and we never attempted a retry
+     * (or the code jumping here did not set may_retry to zero). */
+    if (errno != ETIMEDOUT && may_retry) {
+        may_retry = 0;
+        goto try_again;
+    }
+
+    /* Cleanup we want to do if no retry is attempted. */
+    zfree(ov); zfree(kv);
+    addReplySds(c,
+        sdscatprintf(sdsempty(),
+            "-IOERR error or timeout %s to target instance\r\n",
+            write_error ? "writing" : "reading"));
+    return;
+}
+
+/* -----------------------------------------------------------------------------
+ * Atomic slot migration
+ *
+ * CLUSTER MIGRATESLOT moves a whole hash slot to another master without the
+ * synchronous round trips of MIGRATE. It works like the replication, but
+ * scoped to a single slot:
+ *
+ * 1) The source connects to the target and sends CLUSTER IMPORTSLOT START:
+ *    from now on the target accepts writes to the slot from this connection
+ *    only, while the other clients are still redirected to the source.
+ * 2) A child process serializes the keys of the slot as a stream of
+ *    RESTORE commands, that the parent relays to the target. The parent main
+ *    thread never serializes a value, so big keys don't block it.
+ * 3) Starting from the fork, all the writes to the slot that are propagated
+ *    to the replicas are also accumulated in a tail buffer, sent to the
+ *    target when the snapshot is transferred.
+ * 4) When the tail is small enough the clients are paused, so that the slot
+ *    can't change anymore, and the rest of the tail is sent followed by
+ *    CLUSTER IMPORTSLOT COMMIT. The target claims the slot with a new config
+ *    epoch and replies +COMMITTED, then the source assigns the slot to the
+ *    target, resumes the clients, that will be redirected to the target, and
+ *    deletes its copy of the keys incrementally.
+ *
+ * Every reply of the target is parsed by the source, that aborts the
+ * migration on the first error. When the migration is aborted the target
+ * deletes the keys it received, so the slot is always served by a single
+ * node with the full dataset.
+ * -------------------------------------------------------------------------- */
+
+#define SLOT_MIGRATION_NONE 0       /* No migration in progress. */
+#define SLOT_MIGRATION_WAIT_CHILD 1 /* Waiting for another child to exit. */
+#define SLOT_MIGRATION_SNAPSHOT 2   /* The child is serializing the slot. */
+#define SLOT_MIGRATION_TAIL 3       /* Sending the writes since the fork. */
+#define SLOT_MIGRATION_COMMIT 4     /* Clients paused, waiting for the target. */
+
+/* The clients are paused to commit the migration when the part of the tail
+ * still to send is less than this. */
+#define SLOT_MIGRATION_COMMIT_TAIL (64*1024)
+#define SLOT_MIGRATION_BUFLEN (64*1024) /* Snapshot relay buffer size. */
+#define SLOT_PURGE_TIME_LIMIT 10 /* Milliseconds of every cron spent deleting
+                                    the keys of the slots we lost. */
+
+static char *slotMigrationStateName[] = {
+    "none", "wait_child", "snapshot", "tail", "commit"
+};
+
+/* The migration of a slot from this node. Only one at a time is possible. */
+static struct {
+    int state;              /* SLOT_MIGRATION_* state. */
+    int slot;               /* The slot we are migrating. */
+    char target[CLUSTER_NAMELEN]; /* Name of the node receiving the slot. */
+    connection *conn;       /* Connection with the target. */
+    int pipe_fd;            /* Read end of the pipe with the child, or -1. */
+    int child_done;         /* The child terminated successfully. */
+    char *buf;              /* Snapshot data received from the child... */
+    size_t buf_len;         /* ...its length... */
+    size_t buf_pos;         /* ...and how much of it was sent. */
+    sds tail;               /* Writes to the slot since the fork. */
+    size_t tail_pos;        /* Bytes of the tail already sent. */
+    sds replies;            /* Replies of the target not yet parsed. */
+    mstime_t commit_end;    /* Clients are paused up to this time. */
+    long long sent_bytes;   /* Bytes sent to the target. */
+    long long stat_ok;      /* Number of successful migrations. */
+    long long stat_failed;  /* Number of aborted migrations. */
+} slot_migration = {SLOT_MIGRATION_NONE, -1, {0}, NULL, -1};
+
+/* The migration of a slot to this node. Only one at a time is possible. */
+static struct {
+    client *c;              /* Client streaming the slot, or NULL. */
+    int slot;               /* The slot we are receiving. */
+    char source[CLUSTER_NAMELEN]; /* Name of the node serving the slot. */
+} slot_import = {NULL, -1, {0}};
+
+/* Slots we are not serving anymore, but that still hold keys that are
+ * deleted incrementally by the cron. */
+static unsigned char slots_to_purge[CLUSTER_SLOTS/8];
+static int slots_to_purge_count = 0;
+
+static void slotMigrationWriteHandler(connection *conn);
+
+/* Schedule the deletion of the keys of a slot not served by this node. */
+static void clusterPurgeSlot(int slot) {
+    if (bitmapTestBit(slots_to_purge,slot)) return;
+    bitmapSetBit(slots_to_purge,slot);
+    slots_to_purge_count++;
+}
+
+/* Delete the keys of the slots to purge, for at most SLOT_PURGE_TIME_LIMIT
+ * milliseconds. The deletions are propagated, so that our replicas and the
+ * AOF remove the keys too. A slot assigned again to this node in the
+ * meantime is left untouched. */
+static void clusterPurgeSlotsCron(void) {
+    long long start = ustime();
+    int j, deleted = 0;
+
+    if (slots_to_purge_count == 0) return;
+    if (nodeIsSlave(myself)) {
+        /* Our dataset is going to be replaced by the one of the master. */
+        memset(slots_to_purge,0,sizeof(slots_to_purge));
+        slots_to_purge_count = 0;
+        return;
+    }
+    for (j = 0; j < CLUSTER_SLOTS && slots_to_purge_count; j++) {
+        robj *key;
+
+        if (!bitmapTestBit(slots_to_purge,j)) continue;
+        while (server.cluster->slots[j] != myself &&
+               !(slot_import.c && slot_import.slot == j) &&
+               getKeysInSlot(j,&key,1))
+        {
+            propagateExpire(&server.db[0],key,server.lazyfree_lazy_server_del);
+            if (server.lazyfree_lazy_server_del)
+                dbAsyncDelete(&server.db[0],key);
+            else
+                dbSyncDelete(&server.db[0],key);
+            decrRefCount(key);
+            server.dirty++;
+            if ((++deleted & 63) == 0 &&
+                ustime()-start > SLOT_PURGE_TIME_LIMIT*1000) return;
+        }
+        bitmapClearBit(slots_to_purge,j);
+        slots_to_purge_count--;
+    }
+}
+
+/* Release the resources of the migration and return to the idle state. */
+static void slotMigrationReset(void) {
+    if (slot_migration.conn) connClose(slot_migration.conn);
+    if (slot_migration.pipe_fd != -1) {
+        aeDeleteFileEvent(server.el,slot_migration.pipe_fd,AE_READABLE);
+        close(slot_migration.pipe_fd);
+    }
+    zfree(slot_migration.buf);
+    sdsfree(slot_migration.tail);
+    sdsfree(slot_migration.replies);
+    slot_migration.state = SLOT_MIGRATION_NONE;
+    slot_migration.slot = -1;
+    slot_migration.conn = NULL;
+    slot_migration.pipe_fd = -1;
+    slot_migration.child_done = 0;
+    slot_migration.buf = NULL;
+    slot_migration.buf_len = slot_migration.buf_pos = 0;
+    slot_migration.tail = NULL;
+    slot_migration.tail_pos = 0;
+    slot_migration.replies = NULL;
+    slot_migration.commit_end = 0;
+}
+
+/* Abort the migration in progress: we keep serving the slot, and the target
+ * deletes what it received as soon as the connection is closed. */
+static void slotMigrationAbort(const char *reason) {
+    serverLog(LL_WARNING,"Migration of slot %d to %.40s aborted: %s",
+        slot_migration.slot, slot_migration.target, reason);
+    if (server.cluster_slot_migration_child_pid != -1)
+        kill(server.cluster_slot_migration_child_pid,SIGUSR1);
+    /* If the connection is lost while committing, we don't know if the
+     * target claimed the slot: the clients stay paused until the commit
+     * timeout, so that its new configuration can reach us before accepting
+     * writes we may lose. */
+    slot_migration.stat_failed++;
+    slotMigrationReset();
+}
+
+/* Send a command to the target and read its reply, on a blocking fashion.
+ * Used only to start the migration. Returns NULL on success, otherwise an
+ * sds string with the error. */
+static sds slotMigrationSyncCommand(connection *conn, int argc, char **argv) {
+    long long timeout = server.repl_syncio_timeout*1000;
+    char buf[256];
+    sds cmd = sdscatprintf(sdsempty(),"*%d\r\n",argc);
+    int j;
+
+    for (j = 0; j < argc; j++)
+        cmd = sdscatprintf(cmd,"$%zu\r\n%s\r\n",strlen(argv[j]),argv[j]);
+    if (connSyncWrite(conn,cmd,sdslen(cmd),timeout) == -1) {
+        sdsfree(cmd);
+        return sdscatprintf(sdsempty(),"Writing to the target: %s",
+            connGetLastError(conn));
+    }
+    sdsfree(cmd);
+    if (connSyncReadLine(conn,buf,sizeof(buf),timeout) == -1)
+        return sdscatprintf(sdsempty(),"Reading from the target: %s",
+            connGetLastError(conn));
+    if (buf[0] == '-') return sdsnew(buf+1);
+    return NULL;
+}
+
+/* Serialize the keys of the slot as RESTORE commands into 'rdb'. Called by
+ * the child process, that sees the slot as it was at the time of the fork. */
+static int slotMigrationWriteSnapshot(rio *rdb, int slot) {
+    dictEntry *de;
+    long long now = mstime();
+
+    for (de = slotToKeyFirst(slot); de; de = slotToKeyNext(de)) {
+        sds keystr = dictGetKey(de);
+        robj key, *o = dictGetVal(de);
+        long long expire;
+        rio payload;
+        int retval;
+
+        initStaticStringObject(key,keystr);
+        expire = getExpire(&server.db[0],&key);
+        if (expire != -1 && expire < now) continue;
+
+        createDumpPayload(&payload,o,&key,
+                          hashFieldExpiresGet(&server.db[0],keystr));
+        retval = rioWriteBulkCount(rdb,'*',6) &&
+                 rioWriteBulkString(rdb,"RESTORE",7) &&
+                 rioWriteBulkString(rdb,keystr,sdslen(keystr)) &&
+                 rioWriteBulkLongLong(rdb,expire == -1 ? 0 : expire) &&
+                 rioWriteBulkString(rdb,payload.io.buffer.ptr,
+                                    sdslen(payload.io.buffer.ptr)) &&
+                 rioWriteBulkString(rdb,"REPLACE",7) &&
+                 rioWriteBulkString(rdb,"ABSTTL",6);
+        sdsfree(payload.io.buffer.ptr);
+        if (!retval) return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Relay the data the child writes into the pipe to the target. */
+static void slotMigrationReadSnapshot(aeEventLoop *el, int fd, void *privdata, int mask) {
+    ssize_t nread;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    nread = read(fd,slot_migration.buf,SLOT_MIGRATION_BUFLEN);
+    if (nread == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        slotMigrationAbort("error reading the snapshot from the child");
+        return;
+    }
+    if (nread == 0) {
+        /* EOF: the snapshot is complete once the child exits with success,
+         * that may have already happened. */
+        aeDeleteFileEvent(server.el,fd,AE_READABLE);
+        close(fd);
+        slot_migration.pipe_fd = -1;
+        if (slot_migration.child_done) {
+            slot_migration.state = SLOT_MIGRATION_TAIL;
+            slotMigrationWriteHandler(slot_migration.conn);
+        }
+        return;
+    }
+
+    /* Stop reading until the buffer is sent. */
+    slot_migration.buf_len = nread;
+    slot_migration.buf_pos = 0;
+    aeDeleteFileEvent(server.el,fd,AE_READABLE);
+    slotMigrationWriteHandler(slot_migration.conn);
+}
+
+/* Start the child serializing the slot. The writes to the slot are
+ * accumulated in the tail starting from now. */
+static int slotMigrationStartChild(void) {
+    int pipefds[2];
+    pid_t childpid;
+
+    if (pipe(pipefds) == -1) {
+        serverLog(LL_WARNING,"Can't create the slot migration pipe: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    if ((childpid = redisFork()) == 0) {
+        /* Child */
+        int retval;
+        rio rdb;
+
+        close(pipefds[0]);
+        redisSetProcTitle("redis-slot-migration");
+        redisSetCpuAffinity(server.bgsave_cpulist);
+        rioInitWithFd(&rdb,pipefds[1]);
+        retval = slotMigrationWriteSnapshot(&rdb,slot_migration.slot);
+        if (retval == C_OK && rioFlush(&rdb) == 0) retval = C_ERR;
+        rioFreeFd(&rdb);
+        close(pipefds[1]);
+        exitFromChild((retval == C_OK) ? 0 : 1);
+    }
+
+    /* Parent */
+    close(pipefds[1]);
+    if (childpid == -1) {
+        serverLog(LL_WARNING,"Can't fork the slot migration child: %s",
+            strerror(errno));
+        close(pipefds[0]);
+        return C_ERR;
+    }
+    serverLog(LL_NOTICE,"Streaming slot %d to %.40s by pid %d",
+        slot_migration.slot, slot_migration.target, (int) childpid);
+    server.cluster_slot_migration_child_pid = childpid;
+    anetNonBlock(NULL,pipefds[0]);
+    slot_migration.pipe_fd = pipefds[0];
+    slot_migration.buf = zmalloc(SLOT_MIGRATION_BUFLEN);
+    slot_migration.state = SLOT_MIGRATION_SNAPSHOT;
+    if (aeCreateFileEvent(server.el,pipefds[0],AE_READABLE,
+                          slotMigrationReadSnapshot,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the slot migration "
+                    "file event.");
+    }
+    return C_OK;
+}
+
+/* Called when the child exits. */
+void clusterSlotMigrationChildDone(int exitcode, int bysignal) {
+    server.cluster_slot_migration_child_pid = -1;
+    if (slot_migration.state != SLOT_MIGRATION_SNAPSHOT) return; /* Aborted. */
+    if (bysignal || exitcode != 0) {
+        slotMigrationAbort("the child serializing the slot failed");
+        return;
+    }
+    slot_migration.child_done = 1;
+    if (slot_migration.pipe_fd == -1) {
+        slot_migration.state = SLOT_MIGRATION_TAIL;
+        slotMigrationWriteHandler(slot_migration.conn);
+    }
+}
+
+/* Pause the clients so that the slot can't change anymore, and ask the
+ * target to claim the slot after the last part of the tail. */
+static void slotMigrationStartCommit(void) {
+    sds slot = sdsfromlonglong(slot_migration.slot);
+
+    slot_migration.tail = sdscatprintf(slot_migration.tail,
+        "*4\r\n$7\r\nCLUSTER\r\n$10\r\nIMPORTSLOT\r\n$%zu\r\n%s\r\n"
+        "$6\r\nCOMMIT\r\n", sdslen(slot), slot);
+    sdsfree(slot);
+    slot_migration.commit_end = mstime()+server.cluster_node_timeout;
+    pauseClients(slot_migration.commit_end);
+    slot_migration.state = SLOT_MIGRATION_COMMIT;
+}
+
+/* The target claimed the slot: assign it to the target and resume the
+ * clients, that are now redirected to the target. */
+static void slotMigrationDone(void) {
+    clusterNode *n = clusterLookupNode(slot_migration.target);
+    int slot = slot_migration.slot;
+
+    if (server.cluster->slots[slot] == myself) {
+        clusterDelSlot(slot);
+        if (n) clusterAddSlot(n,slot);
+        clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
+                             CLUSTER_TODO_UPDATE_STATE|
+                             CLUSTER_TODO_FSYNC_CONFIG);
+    }
+    server.clients_pause_end_time = 0;
+    clientsArePaused(); /* Just use the side effect of the function. */
+    serverLog(LL_NOTICE,"Slot %d migrated to %.40s (%lld bytes sent)",
+        slot, slot_migration.target, slot_migration.sent_bytes);
+    slot_migration.stat_ok++;
+    clusterPurgeSlot(slot);
+    slotMigrationReset();
+}
+
+/* Called when the configuration of a slot we are committing is updated by
+ * its new owner before we get the reply to the commit. Returns 1 if the
+ * slot was migrated, so that the keys are deleted incrementally. */
+int clusterSlotMigrationCommitted(clusterNode *sender, int slot) {
+    if (slot_migration.state != SLOT_MIGRATION_COMMIT ||
+        slot_migration.slot != slot ||
+        memcmp(sender->name,slot_migration.target,CLUSTER_NAMELEN))
+        return 0;
+    slotMigrationDone();
+    return 1;
+}
+
+/* Send to the target the snapshot data relayed from the child, then the
+ * tail. */
+static void slotMigrationWriteHandler(connection *conn) {
+    ssize_t nwritten;
+
+    while (slot_migration.buf_pos < slot_migration.buf_len) {
+        nwritten = connWrite(conn,slot_migration.buf+slot_migration.buf_pos,
+            slot_migration.buf_len-slot_migration.buf_pos);
+        if (nwritten <= 0) goto wait_writable;
+        slot_migration.buf_pos += nwritten;
+        slot_migration.sent_bytes += nwritten;
+    }
+
+    if (slot_migration.state == SLOT_MIGRATION_SNAPSHOT) {
+        /* Everything was sent, go back reading from the child. */
+        connSetWriteHandler(conn,NULL);
+        if (slot_migration.pipe_fd != -1 &&
+            aeCreateFileEvent(server.el,slot_migration.pipe_fd,AE_READABLE,
+                              slotMigrationReadSnapshot,NULL) == AE_ERR)
+        {
+            serverPanic("Unrecoverable error creating the slot migration "
+                        "file event.");
+        }
+        return;
+    }
+
+    if (slot_migration.state == SLOT_MIGRATION_TAIL &&
+        sdslen(slot_migration.tail)-slot_migration.tail_pos <=
+        SLOT_MIGRATION_COMMIT_TAIL)
+    {
+        slotMigrationStartCommit();
+    }
+
+    while (slot_migration.tail_pos < sdslen(slot_migration.tail)) {
+        nwritten = connWrite(conn,slot_migration.tail+slot_migration.tail_pos,
+            sdslen(slot_migration.tail)-slot_migration.tail_pos);
+        if (nwritten <= 0) goto wait_writable;
+        slot_migration.tail_pos += nwritten;
+        slot_migration.sent_bytes += nwritten;
+    }
+    sdsclear(slot_migration.tail);
+    slot_migration.tail_pos = 0;
+    connSetWriteHandler(conn,NULL);
+    return;
+
+wait_writable:
+    if (connGetState(conn) != CONN_STATE_CONNECTED) {
+        slotMigrationAbort("error writing to the target");
+        return;
+    }
+    /* Drop the part of the tail already sent from time to time, so that it
+     * does not grow forever when the target is slow. */
+    if (slot_migration.tail_pos > SLOT_MIGRATION_BUFLEN*16) {
+        sdsrange(slot_migration.tail,slot_migration.tail_pos,-1);
+        slot_migration.tail_pos = 0;
+    }
+    connSetWriteHandler(conn,slotMigrationWriteHandler);
+}
+
+/* Return the length of the RESP reply at 'p', or 0 if the reply was not
+ * received completely yet. */
+static size_t slotMigrationReplyLen(const char *p, size_t len) {
+    const char *nl = memchr(p,'\n',len);
+    size_t hdrlen, total;
+    long long count;
+
+    if (nl == NULL) return 0;
+    hdrlen = nl-p+1;
+    if (p[0] != '$' && p[0] != '*') return hdrlen;
+    if (hdrlen < 4 || !string2ll(p+1,hdrlen-3,&count) || count < 0)
+        return hdrlen;
+
+    if (p[0] == '$')
+        return (len >= hdrlen+count+2) ? hdrlen+count+2 : 0;
+    total = hdrlen;
+    while (count--) {
+        size_t elelen = slotMigrationReplyLen(p+total,len-total);
+        if (elelen == 0) return 0;
+        total += elelen;
+    }
+    return total;
+}
+
+/* Read the replies of the target: on errors the migration is aborted, and
+ * the reply to the commit concludes it. */
+static void slotMigrationReadHandler(connection *conn) {
+    char buf[PROTO_IOBUF_LEN];
+    size_t pos = 0, len;
+    int nread;
+
+    nread = connRead(conn,buf,sizeof(buf));
+    if (nread <= 0) {
+        if (nread == 0 || connGetState(conn) != CONN_STATE_CONNECTED)
+            slotMigrationAbort("connection with the target lost");
+        return;
+    }
+    slot_migration.replies = sdscatlen(slot_migration.replies,buf,nread);
+
+    while ((len = slotMigrationReplyLen(slot_migration.replies+pos,
+                sdslen(slot_migration.replies)-pos)) != 0)
+    {
+        char *reply = slot_migration.replies+pos;
+
+        if (reply[0] == '-') {
+            sds err = sdsnewlen(reply+1,len-3);
+
+            err = sdsmapchars(err,"\r\n","  ",2);
+            slotMigrationAbort(err);
+            sdsfree(err);
+            return;
+        }
+        if (slot_migration.state == SLOT_MIGRATION_COMMIT &&
+            len == 12 && !memcmp(reply,"+COMMITTED\r\n",12))
+        {
+            slotMigrationDone();
+            return;
+        }
+        pos += len;
+    }
+    sdsrange(slot_migration.replies,pos,-1);
+}
+
+/* Called for every command propagated to the replicas: the writes to the
+ * slot are appended to the tail from the fork of the child. */
+void clusterFeedSlotMigration(robj **argv, int argc) {
+    struct redisCommand *cmd;
+    unsigned long long limit;
+    int *keys, numkeys, j, found = 0;
+    size_t pending;
+
+    if (slot_migration.state != SLOT_MIGRATION_SNAPSHOT &&
+        slot_migration.state != SLOT_MIGRATION_TAIL) return;
+
+    cmd = lookupCommandOrOriginal(argv[0]->ptr);
+    if (cmd == NULL) return;
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (j = 0; j < numkeys && !found; j++) {
+        sds key = argv[keys[j]]->ptr;
+        found = keyHashSlot(key,sdslen(key)) == (unsigned int) slot_migration.slot;
+    }
+    getKeysFreeResult(keys);
+    if (!found) return;
+
+    pending = sdslen(slot_migration.tail)-slot_migration.tail_pos;
+    slot_migration.tail = sdscatfmt(slot_migration.tail,"*%i\r\n",argc);
+    for (j = 0; j < argc; j++) {
+        robj *o = getDecodedObject(argv[j]);
+
+        slot_migration.tail = sdscatfmt(slot_migration.tail,"$%U\r\n",
+            (unsigned long long) sdslen(o->ptr));
+        slot_migration.tail = sdscatlen(slot_migration.tail,o->ptr,
+            sdslen(o->ptr));
+        slot_migration.tail = sdscatlen(slot_migration.tail,"\r\n",2);
+        decrRefCount(o);
+    }
+
+    /* The tail is subject to the hard limit of the replicas output buffers,
+     * like the replication stream the target is not able to consume. */
+    limit = server.client_obuf_limits[CLIENT_TYPE_SLAVE].hard_limit_bytes;
+    if (limit && sdslen(slot_migration.tail)-slot_migration.tail_pos > limit) {
+        slotMigrationAbort("the writes to the slot exceed the replica "
+                           "output buffer limit");
+        return;
+    }
+    if (slot_migration.state == SLOT_MIGRATION_TAIL && pending == 0)
+        connSetWriteHandler(slot_migration.conn,slotMigrationWriteHandler);
+}
+
+/* Called by clusterCron() to make progress with the slot migration. */
+void clusterSlotMigrationCron(void) {
+    if (slot_migration.state != SLOT_MIGRATION_NONE) {
+        if (nodeIsSlave(myself) ||
+            server.cluster->slots[slot_migration.slot] != myself)
+        {
+            slotMigrationAbort("we are no longer the owner of the slot");
+        } else if (slot_migration.state == SLOT_MIGRATION_WAIT_CHILD &&
+                   !hasActiveChildProcess())
+        {
+            if (slotMigrationStartChild() == C_ERR)
+                slotMigrationAbort("can't start the child");
+        } else if (slot_migration.state == SLOT_MIGRATION_COMMIT &&
+                   mstime() > slot_migration.commit_end)
+        {
+            slotMigrationAbort("timeout waiting for the target to commit");
+        }
+    }
+    clusterPurgeSlotsCron();
+}
+
+/* CLUSTER MIGRATESLOT <slot> <node-id>
+ * CLUSTER MIGRATESLOT CANCEL */
+void clusterMigrateSlotCommand(client *c) {
+    char *argv[6];
+    int argc = 0, slot;
+    clusterNode *n;
+    connection *conn;
+    sds err, slotstr, name;
+
+    if (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"cancel")) {
+        if (slot_migration.state == SLOT_MIGRATION_NONE) {
+            addReplyError(c,"No slot migration in progress");
+            return;
+        }
+        slotMigrationAbort("canceled by the user");
+        addReply(c,shared.ok);
+        return;
+    }
+    if (c->argc != 4) {
+        addReplySubcommandSyntaxError(c);
+        return;
+    }
+    if (nodeIsSlave(myself)) {
+        addReplyError(c,"Please use MIGRATESLOT only with masters.");
+        return;
+    }
+    if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+    if (server.cluster->slots[slot] != myself) {
+        addReplyErrorFormat(c,"I'm not the owner of hash slot %u",slot);
+        return;
+    }
+    if (server.cluster->migrating_slots_to[slot] ||
+        server.cluster->importing_slots_from[slot])
+    {
+        addReplyErrorFormat(c,"Hash slot %u is open for a manual migration",
+            slot);
+        return;
+    }
+    if ((n = clusterLookupNode(c->argv[3]->ptr)) == NULL) {
+        addReplyErrorFormat(c,"I don't know about node %s",
+            (char*)c->argv[3]->ptr);
+        return;
+    }
+    if (n == myself || !nodeIsMaster(n) || !nodeHasAddr(n)) {
+        addReplyError(c,"The target of the migration must be another master");
+        return;
+    }
+    if (slot_migration.state != SLOT_MIGRATION_NONE ||
+        server.cluster_slot_migration_child_pid != -1)
+    {
+        addReplyError(c,"A slot migration is already in progress");
+        return;
+    }
+
+    /* The handshake is synchronous like the MIGRATE connection setup, the
+     * transfer of the slot is performed in the background. */
+    conn = server.tls_cluster ? connCreateTLS() : connCreateSocket();
+    if (connBlockingConnect(conn,n->ip,n->port,server.repl_syncio_timeout*1000)
+        != C_OK)
+    {
+        addReplyErrorFormat(c,"Can't connect to the target: %s",
+            connGetLastError(conn));
+        connClose(conn);
+        return;
+    }
+    if (server.masterauth) {
+        argv[argc++] = "AUTH";
+        if (server.masteruser) argv[argc++] = server.masteruser;
+        argv[argc++] = server.masterauth;
+        if ((err = slotMigrationSyncCommand(conn,argc,argv)) != NULL)
+            goto handshake_err;
+        argc = 0;
+    }
+    slotstr = sdsfromlonglong(slot);
+    name = sdsnewlen(myself->name,CLUSTER_NAMELEN);
+    argv[argc++] = "CLUSTER";
+    argv[argc++] = "IMPORTSLOT";
+    argv[argc++] = slotstr;
+    argv[argc++] = "START";
+    argv[argc++] = name;
+    err = slotMigrationSyncCommand(conn,argc,argv);
+    sdsfree(slotstr);
+    sdsfree(name);
+    if (err) goto handshake_err;
+
+    connNonBlock(conn);
+    connEnableTcpNoDelay(conn);
+    connSetReadHandler(conn,slotMigrationReadHandler);
+    slot_migration.conn = conn;
+    slot_migration.slot = slot;
+    memcpy(slot_migration.target,n->name,CLUSTER_NAMELEN);
+    slot_migration.tail = sdsempty();
+    slot_migration.replies = sdsempty();
+    slot_migration.sent_bytes = 0;
+    slot_migration.state = SLOT_MIGRATION_WAIT_CHILD;
+    serverLog(LL_NOTICE,"Migrating slot %d to %.40s", slot, n->name);
+
+    /* If there is another child, the fork is performed by the cron once it
+     * exits. */
+    if (!hasActiveChildProcess() && slotMigrationStartChild() == C_ERR) {
+        slotMigrationAbort("can't start the child");
+        addReplyError(c,"Can't fork the slot migration child");
+        return;
+    }
+    addReply(c,shared.ok);
+    return;
+
+handshake_err:
+    addReplyErrorFormat(c,"Slot migration refused by the target: %s",err);
+    sdsfree(err);
+    connClose(conn);
+}
+
+/* CLUSTER IMPORTSLOT <slot> START <node-id>
+ * CLUSTER IMPORTSLOT <slot> COMMIT
+ *
+ * Sent by a node migrating a slot to us with CLUSTER MIGRATESLOT. */
+void clusterImportSlotCommand(client *c) {
+    clusterNode *n;
+    int slot;
+
+    if ((slot = getSlotOrReply(c,c->argv[2])) == -1) return;
+
+    if (!strcasecmp(c->argv[3]->ptr,"start") && c->argc == 5) {
+        if (nodeIsSlave(myself)) {
+            addReplyError(c,"Only masters can import slots");
+            return;
+        }
+        if (slot_import.c) {
+            addReplyError(c,"A slot import is already in progress");
+            return;
+        }
+        if ((n = clusterLookupNode(c->argv[4]->ptr)) == NULL ||
+            server.cluster->slots[slot] != n || n == myself)
+        {
+            addReplyErrorFormat(c,"Hash slot %u is not served by %s",
+                slot, (char*)c->argv[4]->ptr);
+            return;
+        }
+        if (server.cluster->importing_slots_from[slot] ||
+            countKeysInSlot(slot))
+        {
+            addReplyErrorFormat(c,"I already have keys for hash slot %u",
+                slot);
+            return;
+        }
+        slot_import.c = c;
+        slot_import.slot = slot;
+        memcpy(slot_import.source,n->name,CLUSTER_NAMELEN);
+        c->flags |= CLIENT_SLOT_IMPORT;
+        serverLog(LL_NOTICE,"Importing slot %d from %.40s", slot, n->name);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[3]->ptr,"commit") && c->argc == 4) {
+        if (slot_import.c != c || slot_import.slot != slot) {
+            addReplyErrorFormat(c,"Hash slot %u is not imported by this "
+                                  "connection",slot);
+            return;
+        }
+        n = clusterLookupNode(slot_import.source);
+        if (nodeIsSlave(myself) || n == NULL || server.cluster->slots[slot] != n) {
+            addReplyErrorFormat(c,"The owner of hash slot %u changed",slot);
+            clusterAbortSlotImport(c);
+            return;
+        }
+        slot_import.c = NULL;
+        c->flags &= ~CLIENT_SLOT_IMPORT;
+
+        /* Claim the slot with a new epoch, so that the new version can be
+         * propagated by the cluster, like at the end of a manual migration. */
+        clusterDelSlot(slot);
+        clusterAddSlot(myself,slot);
+        if (clusterBumpConfigEpochWithoutConsensus() == C_OK) {
+            serverLog(LL_WARNING,
+                "configEpoch updated after importing slot %d", slot);
+        }
+        clusterDoBeforeSleep(CLUSTER_TODO_SAVE_CONFIG|
+                             CLUSTER_TODO_UPDATE_STATE|
+                             CLUSTER_TODO_FSYNC_CONFIG);
+        clusterBroadcastPong(CLUSTER_BROADCAST_ALL);
+        serverLog(LL_NOTICE,"Slot %d imported from %.40s (%u keys)",
+            slot, n->name, countKeysInSlot(slot));
+        addReplyStatus(c,"COMMITTED");
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
+
+/* Called when the client streaming a slot is freed before the commit: the
+ * keys received so far are deleted. */
+void clusterAbortSlotImport(client *c) {
+    if (slot_import.c != c) return;
+    serverLog(LL_WARNING,"Import of slot %d from %.40s aborted",
+        slot_import.slot, slot_import.source);
+    clusterPurgeSlot(slot_import.slot);
+    slot_import.c = NULL;
+    slot_import.slot = -1;
+    c->flags &= ~CLIENT_SLOT_IMPORT;
+}
 
-    /* Retry only if it's not a timeout and we never attempted a retry
-     * (or the code jumping here did not set may_retry to zero). */
-    if (errno != ETIMEDOUT && may_retry) {
-        may_retry = 0;
-        goto try_again;
-    }
+/* Append the state of the slot migrations to the CLUSTER INFO output. */
+sds clusterCatSlotMigrationInfo(sds info) {
+    return sdscatprintf(info,
+        "cluster_slot_migration_state:%s\r\n"
+        "cluster_slot_migration_slot:%d\r\n"
+        "cluster_slot_migration_sent_bytes:%lld\r\n"
+        "cluster_slot_migrations_ok:%lld\r\n"
+        "cluster_slot_migrations_failed:%lld\r\n"
+        "cluster_slot_import_slot:%d\r\n"
+        "cluster_slots_to_purge:%d\r\n",
+        slotMigrationStateName[slot_migration.state],
+        slot_migration.slot,
+        slot_migration.sent_bytes,
+        slot_migration.stat_ok,
+        slot_migration.stat_failed,
+        slot_import.c ? slot_import.slot : -1,
+        slots_to_purge_count);
+}
 
-    /* Cleanup we want to do if no retry is attempted. */
-    zfree(ov); zfree(kv);
-    addReplySds(c,
-        sdscatprintf(sdsempty(),
-            "-IOERR error or timeout %s to target instance\r\n",
-            write_error ? "writing" : "reading"));
-    return;
+/* Return 1 if the client is allowed to write the slot it is importing,
+ * that is still served by another node. */
+static int clusterClientImportsSlot(client *c, int slot) {
+    return slot_import.c == c && slot_import.slot == slot;
 }
 
 /* -----------------------------------------------------------------------------
@@ -5446,6 +7666,27 @@ void readwriteCommand(client *c) {
     addReply(c,shared.ok);
 }
 
+/* Return true if the keys checked by getNodeByQuery() are the only keys the
+ * command of the client can touch, so that their hash slot can be reused
+ * while the command runs. Scripts may access keys they did not declare, and
+ * modules can write any key, even from the notifications of a core command,
+ * so in both the cases the slot of every key is computed again. */
+int clusterCommandKeysAreDeclared(client *c) {
+    int j;
+
+    if (moduleCount()) return 0;
+    if (c->cmd->proc == execCommand) {
+        for (j = 0; j < c->mstate.count; j++) {
+            redisCommandProc *proc = c->mstate.commands[j].cmd->proc;
+            if (proc == evalCommand || proc == evalShaCommand ||
+                proc == evalRoCommand || proc == evalShaRoCommand) return 0;
+        }
+        return 1;
+    }
+    return c->cmd->proc != evalCommand && c->cmd->proc != evalShaCommand &&
+           c->cmd->proc != evalRoCommand && c->cmd->proc != evalShaRoCommand;
+}
+
 /* Return the pointer to the cluster node that is able to serve the command.
  * For the function to succeed the command should only target either:
  *
@@ -5521,23 +7762,25 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
     for (i = 0; i < ms->count; i++) {
         struct redisCommand *mcmd;
         robj **margv;
-        int margc, *keyindex, numkeys, j;
+        int margc, *keyindex, numkeys, j, cached;
 
         mcmd = ms->commands[i].cmd;
         margc = ms->commands[i].argc;
         margv = ms->commands[i].argv;
 
-        keyindex = getKeysFromCommand(mcmd,margv,margc,&numkeys);
+        /* The keys of the command of the client are shared with the ACL
+         * check, see getClientCommandKeys(). */
+        cached = mcmd == c->cmd && margv == c->argv;
+        keyindex = cached ? getClientCommandKeys(c,&numkeys) :
+                            getKeysFromCommand(mcmd,margv,margc,&numkeys);
         for (j = 0; j < numkeys; j++) {
             robj *thiskey = margv[keyindex[j]];
-            int thisslot = keyHashSlot((char*)thiskey->ptr,
-                                       sdslen(thiskey->ptr));
 
             if (firstkey == NULL) {
                 /* This is the first key we see. Check what is the slot
                  * and node. */
                 firstkey = thiskey;
-                slot = thisslot;
+                slot = keyHashSlot((char*)thiskey->ptr,sdslen(thiskey->ptr));
                 n = server.cluster->slots[slot];
 
                 /* Error: If a slot is not served, we are in "cluster down"
@@ -5545,7 +7788,7 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
                  * not trapped earlier in processCommand(). Report the same
                  * error to the client. */
                 if (n == NULL) {
-                    getKeysFreeResult(keyindex);
+                    if (!cached) getKeysFreeResult(keyindex);
                     if (error_code)
                         *error_code = CLUSTER_REDIR_DOWN_UNBOUND;
                     return NULL;
@@ -5566,10 +7809,14 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
             } else {
                 /* If it is not the first key, make sure it is exactly
                  * the same key as the first we saw. */
-                if (!equalStringObjects(firstkey,thiskey)) {
+                if (thiskey != firstkey &&
+                    !equalStringObjects(firstkey,thiskey))
+                {
+                    int thisslot = keyHashSlot((char*)thiskey->ptr,
+                                               sdslen(thiskey->ptr));
                     if (slot != thisslot) {
                         /* Error: multiple keys from different slots. */
-                        getKeysFreeResult(keyindex);
+                        if (!cached) getKeysFreeResult(keyindex);
                         if (error_code)
                             *error_code = CLUSTER_REDIR_CROSS_SLOT;
                         return NULL;
@@ -5588,13 +7835,17 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
                 missing_keys++;
             }
         }
-        getKeysFreeResult(keyindex);
+        if (!cached) getKeysFreeResult(keyindex);
     }
 
     /* No key at all in command? then we can serve the request
      * without redirections or errors in all the cases. */
     if (n == NULL) return myself;
 
+    /* The node migrating a slot to us writes it before we serve it. */
+    if (c->flags & CLIENT_SLOT_IMPORT && clusterClientImportsSlot(c,slot))
+        return myself;
+
     /* Cluster is globally down but we got keys? We can't serve the request. */
     if (server.cluster->state != CLUSTER_OK) {
         if (error_code) *error_code = CLUSTER_REDIR_DOWN_STATE;
@@ -5634,10 +7885,14 @@ clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, in
 
     /* Handle the read-only client case reading from a slave: if this
      * node is a slave and the request is about an hash slot our master
-     * is serving, we can reply without redirection. */
-    if (c->flags & CLIENT_READONLY &&
+     * is serving, we can reply without redirection. Sharded channels can
+     * always be subscribed in the replicas of the shard, that receive the
+     * messages with the replication stream. */
+    int shard_subscription = cmd->proc == ssubscribeCommand ||
+                             cmd->proc == sunsubscribeCommand;
+    if ((c->flags & CLIENT_READONLY || shard_subscription) &&
         (cmd->flags & CMD_READONLY || cmd->proc == evalCommand ||
-         cmd->proc == evalShaCommand) &&
+         cmd->proc == evalShaCommand || shard_subscription) &&
         nodeIsSlave(myself) &&
         myself->slaveof == n)
     {
@@ -5735,3 +7990,723 @@ int clusterRedirectBlockedClientIfNeeded(client *c) {
     }
     return 0;
 }
+
+/* -----------------------------------------------------------------------------
+ * Cross slot reads
+ *
+ * When cluster-cross-slot-reads is enabled, a MGET whose keys hash to
+ * different slots is no longer refused with -CROSSSLOT: the keys served by
+ * this node are read locally, and the others are fetched from the masters
+ * serving them, with GET commands pipelined over a persistent connection
+ * with every node (clusterNode->read_link). The calling client is blocked
+ * until all the values are received, and gets the reply in a single round
+ * trip.
+ *
+ * Like the MGETs a client would scatter itself, the read is not atomic
+ * across the slots. When a slot is being migrated, or a node fails to reply
+ * (for example with -MOVED since the configuration changed in the
+ * meantime), the command fails with -TRYAGAIN.
+ * -------------------------------------------------------------------------- */
+
+typedef struct clusterCrossSlotRead {
+    client *c;              /* Blocked client, NULL if it was unblocked. */
+    int numkeys;
+    robj **vals;            /* Values read, NULL for the missing keys. */
+    int pending;            /* Values not received yet. */
+    sds error;              /* Why a node failed to reply, or NULL. */
+} clusterCrossSlotRead;
+
+/* The read, and key inside it, every reply of a link belongs to. The
+ * replies to AUTH have no read. */
+typedef struct clusterReadOwner {
+    clusterCrossSlotRead *read;
+    int idx;
+} clusterReadOwner;
+
+typedef struct clusterReadLink {
+    clusterNode *node;
+    connection *conn;
+    int connected;
+    sds buf;                /* Commands to write. */
+    size_t bufpos;
+    sds rbuf;               /* Replies received and not yet parsed. */
+    long long bulklen;      /* Length of the bulk reply being read, or -1. */
+    clusterReadOwner *owners; /* Owners of the replies still to read. */
+    size_t owners_head, owners_tail, owners_alloc;
+    mstime_t last_io;
+} clusterReadLink;
+
+static void clusterReadLinkWriteHandler(connection *conn);
+
+/* Reply to the client once all the values were received. */
+static void clusterCrossSlotReadDone(clusterCrossSlotRead *read) {
+    int j;
+
+    if (read->pending) return;
+    if (read->c) {
+        client *c = read->c;
+
+        if (read->error) {
+            addReplyErrorFormat(c,"-TRYAGAIN Cross slot read failed: %s",
+                read->error);
+        } else {
+            addReplyArrayLen(c,read->numkeys);
+            for (j = 0; j < read->numkeys; j++) {
+                if (read->vals[j])
+                    addReplyBulk(c,read->vals[j]);
+                else
+                    addReplyNull(c);
+            }
+        }
+        if (c->flags & CLIENT_BLOCKED) unblockClient(c);
+    }
+    for (j = 0; j < read->numkeys; j++)
+        if (read->vals[j]) decrRefCount(read->vals[j]);
+    zfree(read->vals);
+    sdsfree(read->error);
+    zfree(read);
+}
+
+/* Set the value of a key of the read, or the error of the node about it. */
+static void clusterCrossSlotReadSet(clusterCrossSlotRead *read, int idx,
+                                    robj *val, const char *err)
+{
+    if (read == NULL) {
+        if (val) decrRefCount(val);
+        return;
+    }
+    read->vals[idx] = val;
+    /* MGET replies with a NULL to keys of the wrong type. */
+    if (err && strncmp(err,"WRONGTYPE",9) && read->error == NULL)
+        read->error = sdsnew(err);
+    read->pending--;
+    clusterCrossSlotReadDone(read);
+}
+
+static void clusterReadLinkAddOwner(clusterReadLink *link,
+                                    clusterCrossSlotRead *read, int idx)
+{
+    if (link->owners_tail == link->owners_alloc) {
+        if (link->owners_head) {
+            memmove(link->owners,link->owners+link->owners_head,
+                sizeof(clusterReadOwner)*(link->owners_tail-link->owners_head));
+            link->owners_tail -= link->owners_head;
+            link->owners_head = 0;
+        } else {
+            link->owners_alloc = link->owners_alloc ? link->owners_alloc*2 : 16;
+            link->owners = zrealloc(link->owners,
+                sizeof(clusterReadOwner)*link->owners_alloc);
+        }
+    }
+    link->owners[link->owners_tail].read = read;
+    link->owners[link->owners_tail].idx = idx;
+    link->owners_tail++;
+}
+
+/* Queue a command with the arguments 'argv' (sds or C strings are both
+ * fine, 'argvlen' has their lengths), its reply belonging to 'read'. */
+static void clusterReadLinkAddCommand(clusterReadLink *link,
+                                      clusterCrossSlotRead *read, int idx,
+                                      int argc, char **argv, size_t *argvlen)
+{
+    int j;
+
+    link->buf = sdscatfmt(link->buf,"*%i\r\n",argc);
+    for (j = 0; j < argc; j++) {
+        link->buf = sdscatfmt(link->buf,"$%U\r\n",
+            (unsigned long long) argvlen[j]);
+        link->buf = sdscatlen(link->buf,argv[j],argvlen[j]);
+        link->buf = sdscatlen(link->buf,"\r\n",2);
+    }
+    clusterReadLinkAddOwner(link,read,idx);
+    if (link->connected)
+        connSetWriteHandler(link->conn,clusterReadLinkWriteHandler);
+}
+
+/* Release the link, failing the reads waiting for its replies. Called on
+ * I/O errors, and when the node is deleted or changes address. */
+void freeClusterReadLink(clusterReadLink *link, const char *err) {
+    size_t j;
+
+    link->node->read_link = NULL;
+    if (link->conn) connClose(link->conn);
+    for (j = link->owners_head; j < link->owners_tail; j++)
+        clusterCrossSlotReadSet(link->owners[j].read,link->owners[j].idx,
+            NULL,err);
+    zfree(link->owners);
+    sdsfree(link->buf);
+    sdsfree(link->rbuf);
+    zfree(link);
+}
+
+/* Parse the replies received: the node only replies to GET and AUTH, that
+ * is, with bulk strings, errors, or status replies. */
+static void clusterReadLinkReadHandler(connection *conn) {
+    clusterReadLink *link = connGetPrivateData(conn);
+    char buf[PROTO_IOBUF_LEN];
+    size_t pos = 0, len;
+    int nread;
+
+    nread = connRead(conn,buf,sizeof(buf));
+    if (nread == -1 && connGetState(conn) == CONN_STATE_CONNECTED) return;
+    if (nread <= 0) {
+        freeClusterReadLink(link,"connection with the node lost");
+        return;
+    }
+    link->last_io = mstime();
+    link->rbuf = sdscatlen(link->rbuf,buf,nread);
+    len = sdslen(link->rbuf);
+
+    while (pos < len) {
+        char *p = link->rbuf+pos;
+        clusterReadOwner *owner;
+        robj *val = NULL;
+        char *err = NULL;
+
+        if (link->bulklen == -1) {
+            char *nl = memchr(p,'\n',len-pos);
+            if (nl == NULL) break;
+            if (link->owners_head == link->owners_tail || nl == p) {
+                freeClusterReadLink(link,"protocol error from the node");
+                return;
+            }
+            pos += nl-p+1;
+            *nl = '\0';
+            if (nl[-1] == '\r') nl[-1] = '\0';
+            if (p[0] == '$') {
+                link->bulklen = strtoll(p+1,NULL,10);
+                if (link->bulklen >= 0) continue;
+                link->bulklen = -1;
+            } else if (p[0] == '-') {
+                err = p+1;
+            }
+        } else {
+            if (len-pos < (size_t)link->bulklen+2) break;
+            val = createStringObject(p,link->bulklen);
+            pos += link->bulklen+2;
+            link->bulklen = -1;
+        }
+        owner = link->owners+link->owners_head++;
+        if (link->owners_head == link->owners_tail)
+            link->owners_head = link->owners_tail = 0;
+        clusterCrossSlotReadSet(owner->read,owner->idx,val,err);
+    }
+    sdsrange(link->rbuf,pos,-1);
+}
+
+static void clusterReadLinkWriteHandler(connection *conn) {
+    clusterReadLink *link = connGetPrivateData(conn);
+
+    while (link->bufpos < sdslen(link->buf)) {
+        int nwritten = connWrite(conn,link->buf+link->bufpos,
+                                 sdslen(link->buf)-link->bufpos);
+        if (nwritten <= 0) {
+            if (nwritten == -1 && connGetState(conn) == CONN_STATE_CONNECTED)
+                return;
+            freeClusterReadLink(link,"connection with the node lost");
+            return;
+        }
+        link->bufpos += nwritten;
+        link->last_io = mstime();
+    }
+    sdsclear(link->buf);
+    link->bufpos = 0;
+    connSetWriteHandler(conn,NULL);
+}
+
+static void clusterReadLinkConnectHandler(connection *conn) {
+    clusterReadLink *link = connGetPrivateData(conn);
+
+    if (connGetState(conn) != CONN_STATE_CONNECTED) {
+        freeClusterReadLink(link,"can't connect to the node");
+        return;
+    }
+    connEnableTcpNoDelay(conn);
+    link->connected = 1;
+    link->last_io = mstime();
+    connSetReadHandler(conn,clusterReadLinkReadHandler);
+    connSetWriteHandler(conn,clusterReadLinkWriteHandler);
+}
+
+/* Return the link to read from the node, connecting if needed, or NULL if
+ * the connection can't be started. */
+static clusterReadLink *clusterGetReadLink(clusterNode *node) {
+    clusterReadLink *link = node->read_link;
+
+    if (link) return link;
+    link = zcalloc(sizeof(*link));
+    link->node = node;
+    link->buf = sdsempty();
+    link->rbuf = sdsempty();
+    link->bulklen = -1;
+    link->last_io = mstime();
+    link->conn = server.tls_cluster ? connCreateTLS() : connCreateSocket();
+    connSetPrivateData(link->conn,link);
+    node->read_link = link;
+    if (connConnect(link->conn,node->ip,node->port,NULL,
+                    clusterReadLinkConnectHandler) != C_OK)
+    {
+        freeClusterReadLink(link,"can't connect to the node");
+        return NULL;
+    }
+
+    /* The nodes of a cluster share the credentials used to replicate. */
+    if (server.masterauth) {
+        char *argv[3];
+        size_t argvlen[3];
+        int argc = 0;
+
+        argv[argc] = "AUTH";
+        argvlen[argc++] = 4;
+        if (server.masteruser) {
+            argv[argc] = server.masteruser;
+            argvlen[argc++] = strlen(server.masteruser);
+        }
+        argv[argc] = server.masterauth;
+        argvlen[argc++] = strlen(server.masterauth);
+        clusterReadLinkAddCommand(link,NULL,0,argc,argv,argvlen);
+    }
+    return link;
+}
+
+/* Called from clusterCron(): release the links the nodes stopped replying
+ * to, so that the reads waiting for them fail. */
+void clusterReadLinksCron(void) {
+    dictIterator *di;
+    dictEntry *de;
+    mstime_t now = mstime();
+
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) {
+        clusterReadLink *link = ((clusterNode*)dictGetVal(de))->read_link;
+
+        if (link && (!link->connected ||
+                     link->owners_head != link->owners_tail) &&
+            now - link->last_io > server.cluster_node_timeout)
+        {
+            freeClusterReadLink(link,"timeout reading from the node");
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/* Called by processCommand() for commands refused with -CROSSSLOT. If the
+ * command is a MGET that can be served with a cross slot read, the read is
+ * started (or the error replied) and 1 is returned. Otherwise 0 is returned
+ * and the caller replies with -CROSSSLOT as usual. */
+int clusterProcessCrossSlotRead(client *c) {
+    clusterCrossSlotRead *read;
+    int j, readonly;
+
+    if (!server.cluster_cross_slot_reads || c->cmd->proc != mgetCommand ||
+        c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE)) return 0;
+
+    if (server.cluster->state != CLUSTER_OK) {
+        clusterRedirectClient(c,NULL,0,CLUSTER_REDIR_DOWN_STATE);
+        return 1;
+    }
+
+    /* Slaves serve locally the slots of their master to READONLY clients. */
+    readonly = c->flags & CLIENT_READONLY && nodeIsSlave(myself);
+    for (j = 1; j < c->argc; j++) {
+        robj *key = c->argv[j];
+        int slot = keyHashSlot(key->ptr,sdslen(key->ptr));
+        clusterNode *n = server.cluster->slots[slot];
+
+        if (n == NULL) {
+            clusterRedirectClient(c,NULL,0,CLUSTER_REDIR_DOWN_UNBOUND);
+            return 1;
+        }
+        if (server.cluster->migrating_slots_to[slot] ||
+            server.cluster->importing_slots_from[slot])
+        {
+            clusterRedirectClient(c,NULL,0,CLUSTER_REDIR_UNSTABLE);
+            return 1;
+        }
+    }
+
+    /* The extra pending value makes sure the read is not released before
+     * all the commands are queued. */
+    read = zcalloc(sizeof(*read));
+    read->c = c;
+    read->pending = 1;
+    read->numkeys = c->argc-1;
+    read->vals = zcalloc(sizeof(robj*)*read->numkeys);
+    for (j = 0; j < read->numkeys; j++) {
+        robj *key = c->argv[j+1];
+        int slot = keyHashSlot(key->ptr,sdslen(key->ptr));
+        clusterNode *n = server.cluster->slots[slot];
+        clusterReadLink *link;
+
+        if (n == myself || (readonly && myself->slaveof == n)) {
+            robj *o = lookupKeyRead(c->db,key);
+            if (o && o->type == OBJ_STRING) {
+                incrRefCount(o);
+                read->vals[j] = o;
+            }
+            continue;
+        }
+
+        read->pending++;
+        if ((link = clusterGetReadLink(n)) == NULL) {
+            clusterCrossSlotReadSet(read,j,NULL,"can't connect to the node");
+        } else {
+            char *argv[2] = {"GET",key->ptr};
+            size_t argvlen[2] = {3,sdslen(key->ptr)};
+            clusterReadLinkAddCommand(link,read,j,2,argv,argvlen);
+        }
+    }
+    server.cluster->stats_cross_slot_reads++;
+
+    /* Block the client until the values are received, unless they were all
+     * local. */
+    if (read->pending > 1) {
+        c->bpop.timeout = 0;
+        c->bpop.cross_slot_read = read;
+        blockClient(c,BLOCKED_CLUSTER_READ);
+    }
+    read->pending--;
+    clusterCrossSlotReadDone(read);
+    return 1;
+}
+
+/* The client blocked in a cross slot read is unblocked or freed: the
+ * values are still received, but no longer replied. */
+void unblockClientWaitingCrossSlotRead(client *c) {
+    c->bpop.cross_slot_read->c = NULL;
+    c->bpop.cross_slot_read = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+ * Slot stats and hot keys
+ *
+ * The commands accessing the slots served by this node are accounted per
+ * slot, with the size of their arguments and replies, so that the slots
+ * can be rebalanced according to their real load. A sample of the commands
+ * also feeds a Count-Min sketch with the first key of the command: the
+ * keys with the highest estimated count are kept in a small min-heap. The
+ * counters of the sketch are halved periodically, so that the hot keys
+ * reflect the recent traffic.
+ * -------------------------------------------------------------------------- */
+
+/* Size of the arguments of a command, as received from the client. */
+static size_t clusterArgvBytes(robj **argv, int argc) {
+    size_t bytes = 0;
+    int j;
+
+    for (j = 0; j < argc; j++) bytes += stringObjectLen(argv[j]);
+    return bytes;
+}
+
+/* Save the state needed by clusterSlotStatsAfterCall() to account the
+ * command the client is going to execute against 'slot'. */
+void clusterSlotStatsBeforeCall(client *c, int slot, clusterSlotStatsCall *st) {
+    int j;
+
+    st->slot = slot;
+    if (c->cmd->proc == execCommand) {
+        st->firstkey = 0;
+        st->bytes_in = 0;
+        for (j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+            st->bytes_in += clusterArgvBytes(mc->argv,mc->argc);
+        }
+    } else {
+        st->firstkey = c->cmd->firstkey;
+        st->bytes_in = clusterArgvBytes(c->argv,c->argc);
+    }
+    st->bufpos = c->bufpos;
+    st->tail = listLast(c->reply);
+    st->tail_used = st->tail ?
+        ((clientReplyBlock*)listNodeValue(st->tail))->used : 0;
+}
+
+/* Halve the counters of the hot keys. Halving preserves the order of the
+ * counts, so the heap doesn't need to be rebuilt. */
+static void clusterHotKeysDecay(void) {
+    int i, j;
+
+    for (i = 0; i < CLUSTER_HOTKEYS_DEPTH; i++) {
+        for (j = 0; j < CLUSTER_HOTKEYS_WIDTH; j++)
+            server.cluster->hotkeys_sketch[i][j] >>= 1;
+    }
+    for (j = 0; j < server.cluster->hotkeys_count; j++)
+        server.cluster->hotkeys[j].count >>= 1;
+}
+
+/* Restore the min-heap property of the hot keys after the count of the
+ * entry at 'pos' changed. */
+static void clusterHotKeysFix(int pos) {
+    clusterHotKey *heap = server.cluster->hotkeys, tmp;
+    int count = server.cluster->hotkeys_count;
+
+    while (pos > 0 && heap[pos].count < heap[(pos-1)/2].count) {
+        tmp = heap[pos];
+        heap[pos] = heap[(pos-1)/2];
+        heap[(pos-1)/2] = tmp;
+        pos = (pos-1)/2;
+    }
+    while (1) {
+        int child = pos*2+1;
+        if (child >= count) break;
+        if (child+1 < count && heap[child+1].count < heap[child].count)
+            child++;
+        if (heap[pos].count <= heap[child].count) break;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+/* Add a sample of 'key' to the sketch, and track it if it is now one of
+ * the hottest keys. */
+static void clusterHotKeysSample(sds key) {
+    uint64_t hash = dictGenHashFunction(key,sdslen(key));
+    uint32_t h1 = hash, h2 = hash >> 32, count = UINT32_MAX;
+    clusterHotKey *heap = server.cluster->hotkeys;
+    int j;
+
+    /* Use the double hashing to derive the counter of every row. */
+    for (j = 0; j < CLUSTER_HOTKEYS_DEPTH; j++) {
+        uint32_t *counter = &server.cluster->
+            hotkeys_sketch[j][(h1+j*h2) % CLUSTER_HOTKEYS_WIDTH];
+        if (*counter != UINT32_MAX) (*counter)++;
+        if (*counter < count) count = *counter;
+    }
+
+    for (j = 0; j < server.cluster->hotkeys_count; j++) {
+        if (sdslen(heap[j].key) == sdslen(key) &&
+            !memcmp(heap[j].key,key,sdslen(key)))
+        {
+            heap[j].count = count;
+            clusterHotKeysFix(j);
+            return;
+        }
+    }
+    if (server.cluster->hotkeys_count < CLUSTER_HOTKEYS_TOPK) {
+        j = server.cluster->hotkeys_count++;
+        heap[j].key = sdsdup(key);
+        heap[j].count = count;
+        clusterHotKeysFix(j);
+    } else if (count > heap[0].count) {
+        sdsfree(heap[0].key);
+        heap[0].key = sdsdup(key);
+        heap[0].count = count;
+        clusterHotKeysFix(0);
+    }
+}
+
+/* Account the command just executed by the client, see
+ * clusterSlotStatsBeforeCall(). The replies are only written to the socket
+ * after the command returns, so what was appended to the reply buffer and
+ * to the reply list is the reply of this command. */
+void clusterSlotStatsAfterCall(client *c, clusterSlotStatsCall *st) {
+    clusterSlotStats *stats = server.cluster->slot_stats+st->slot;
+    size_t bytes_out = 0;
+    listNode *ln;
+
+    if (c->bufpos > st->bufpos) bytes_out += c->bufpos-st->bufpos;
+    ln = st->tail ? st->tail : listFirst(c->reply);
+    while (ln) {
+        clientReplyBlock *block = listNodeValue(ln);
+        bytes_out += block->used;
+        if (ln == st->tail) bytes_out -= st->tail_used;
+        ln = listNextNode(ln);
+    }
+    stats->ops++;
+    stats->bytes_in += st->bytes_in;
+    stats->bytes_out += bytes_out;
+
+    if (server.cluster_hotkeys_sampling &&
+        st->firstkey > 0 && st->firstkey < c->argc &&
+        sdsEncodedObject(c->argv[st->firstkey]) &&
+        random() % server.cluster_hotkeys_sampling == 0)
+    {
+        clusterHotKeysSample(c->argv[st->firstkey]->ptr);
+    }
+}
+
+/* Called by clusterCron(). */
+void clusterHotKeysCron(void) {
+    mstime_t now = mstime();
+
+    if (now - server.cluster->hotkeys_last_decay >=
+        CLUSTER_HOTKEYS_DECAY_PERIOD)
+    {
+        clusterHotKeysDecay();
+        server.cluster->hotkeys_last_decay = now;
+    }
+}
+
+static void clusterResetSlotStats(void) {
+    int j;
+
+    memset(server.cluster->slot_stats,0,sizeof(server.cluster->slot_stats));
+    memset(server.cluster->hotkeys_sketch,0,
+           sizeof(server.cluster->hotkeys_sketch));
+    for (j = 0; j < server.cluster->hotkeys_count; j++)
+        sdsfree(server.cluster->hotkeys[j].key);
+    server.cluster->hotkeys_count = 0;
+    server.cluster->hotkeys_last_decay = mstime();
+}
+
+/* Metrics of CLUSTER SLOT-STATS. */
+static const char *clusterSlotStatsMetrics[] = {
+    "key-count","ops","network-bytes-in","network-bytes-out",NULL
+};
+
+static uint64_t clusterSlotStatsMetric(int slot, int metric) {
+    clusterSlotStats *stats = server.cluster->slot_stats+slot;
+
+    switch(metric) {
+    case 0: return countKeysInSlot(slot);
+    case 1: return stats->ops;
+    case 2: return stats->bytes_in;
+    default: return stats->bytes_out;
+    }
+}
+
+static void addReplySlotStats(client *c, int slot) {
+    int j;
+
+    addReplyArrayLen(c,2);
+    addReplyLongLong(c,slot);
+    addReplyMapLen(c,4);
+    for (j = 0; clusterSlotStatsMetrics[j]; j++) {
+        addReplyBulkCString(c,clusterSlotStatsMetrics[j]);
+        addReplyLongLong(c,clusterSlotStatsMetric(slot,j));
+    }
+}
+
+typedef struct {
+    int slot;
+    uint64_t value;
+} slotStatsEntry;
+
+static int slotStatsEntryCompare(const void *a, const void *b) {
+    const slotStatsEntry *ea = a, *eb = b;
+
+    if (ea->value != eb->value) return ea->value < eb->value ? -1 : 1;
+    return ea->slot - eb->slot;
+}
+
+/* CLUSTER SLOT-STATS SLOTSRANGE <start> <end>
+ * CLUSTER SLOT-STATS ORDERBY <metric> [LIMIT <count>] [ASC|DESC]
+ * CLUSTER SLOT-STATS RESET
+ *
+ * Only the slots served by this node are reported. */
+void clusterReplySlotStats(client *c) {
+    char *subcmd = c->argv[2]->ptr;
+    int j;
+
+    if (!strcasecmp(subcmd,"reset") && c->argc == 3) {
+        clusterResetSlotStats();
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(subcmd,"slotsrange") && c->argc == 5) {
+        long long start, end;
+        void *replylen;
+        int count = 0;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[3],&start,NULL) != C_OK ||
+            getLongLongFromObjectOrReply(c,c->argv[4],&end,NULL) != C_OK)
+            return;
+        if (start < 0 || end >= CLUSTER_SLOTS || start > end) {
+            addReplyError(c,"Invalid slot range");
+            return;
+        }
+        replylen = addReplyDeferredLen(c);
+        for (j = start; j <= end; j++) {
+            if (server.cluster->slots[j] != myself) continue;
+            addReplySlotStats(c,j);
+            count++;
+        }
+        setDeferredArrayLen(c,replylen,count);
+    } else if (!strcasecmp(subcmd,"orderby") && c->argc >= 4) {
+        long long limit = 16;
+        int metric, desc = 1, count = 0;
+
+        for (metric = 0; clusterSlotStatsMetrics[metric]; metric++) {
+            if (!strcasecmp(c->argv[3]->ptr,clusterSlotStatsMetrics[metric]))
+                break;
+        }
+        if (clusterSlotStatsMetrics[metric] == NULL) {
+            addReplyErrorFormat(c,"Unknown metric '%s'",
+                                (char*)c->argv[3]->ptr);
+            return;
+        }
+        for (j = 4; j < c->argc; j++) {
+            char *opt = c->argv[j]->ptr;
+            if (!strcasecmp(opt,"limit") && j+1 < c->argc) {
+                if (getLongLongFromObjectOrReply(c,c->argv[++j],&limit,NULL)
+                    != C_OK) return;
+                if (limit <= 0 || limit > CLUSTER_SLOTS) {
+                    addReplyError(c,"LIMIT must be between 1 and 16384");
+                    return;
+                }
+            } else if (!strcasecmp(opt,"asc")) {
+                desc = 0;
+            } else if (!strcasecmp(opt,"desc")) {
+                desc = 1;
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+
+        slotStatsEntry *entries = zmalloc(sizeof(*entries)*CLUSTER_SLOTS);
+        for (j = 0; j < CLUSTER_SLOTS; j++) {
+            if (server.cluster->slots[j] != myself) continue;
+            entries[count].slot = j;
+            entries[count].value = clusterSlotStatsMetric(j,metric);
+            count++;
+        }
+        qsort(entries,count,sizeof(*entries),slotStatsEntryCompare);
+        if (limit > count) limit = count;
+        addReplyArrayLen(c,limit);
+        for (j = 0; j < limit; j++)
+            addReplySlotStats(c,entries[desc ? count-1-j : j].slot);
+        zfree(entries);
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
+
+static int clusterHotKeyCompare(const void *a, const void *b) {
+    const clusterHotKey *ka = a, *kb = b;
+
+    if (ka->count != kb->count) return ka->count > kb->count ? -1 : 1;
+    return sdscmp(ka->key,kb->key);
+}
+
+/* CLUSTER HOTKEYS [count]
+ *
+ * Reply with the hottest keys, from the hottest, and the estimated number
+ * of commands that accessed them since the counters were last halved. */
+void clusterReplyHotKeys(client *c) {
+    clusterHotKey hotkeys[CLUSTER_HOTKEYS_TOPK];
+    int count = server.cluster->hotkeys_count, j;
+    long long limit = CLUSTER_HOTKEYS_TOPK;
+
+    if (c->argc == 3) {
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&limit,NULL) != C_OK)
+            return;
+        if (limit <= 0) {
+            addReplyError(c,"The count must be positive");
+            return;
+        }
+    }
+    memcpy(hotkeys,server.cluster->hotkeys,sizeof(clusterHotKey)*count);
+    qsort(hotkeys,count,sizeof(clusterHotKey),clusterHotKeyCompare);
+    /* Keys whose count dropped to zero are no longer hot. */
+    while (count > 0 && hotkeys[count-1].count == 0) count--;
+    if (limit > count) limit = count;
+    addReplyArrayLen(c,limit);
+    for (j = 0; j < limit; j++) {
+        addReplyArrayLen(c,2);
+        addReplyBulkCBuffer(c,hotkeys[j].key,sdslen(hotkeys[j].key));
+        addReplyLongLong(c,(long long)hotkeys[j].count *
+                           (server.cluster_hotkeys_sampling ?
+                            server.cluster_hotkeys_sampling : 1));
+    }
+}
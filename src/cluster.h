@@ -14,9 +14,11 @@
 /* The following defines are amount of time, sometimes expressed as
  * multiplicators of the node timeout value (when ending with MULT). */
 #define CLUSTER_DEFAULT_NODE_TIMEOUT 15000
+#define CLUSTER_DEFAULT_FAST_FAILOVER_TIMEOUT 0 /* Disabled. */
 #define CLUSTER_DEFAULT_SLAVE_VALIDITY 10 /* Slave max data age factor. */
 #define CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE 1
 #define CLUSTER_DEFAULT_SLAVE_NO_FAILOVER 0 /* Failover by default. */
+#define CLUSTER_DEFAULT_CROSS_SLOT_READS 0 /* -CROSSSLOT for MGET by default. */
 #define CLUSTER_FAIL_REPORT_VALIDITY_MULT 2 /* Fail report validity. */
 #define CLUSTER_FAIL_UNDO_TIME_MULT 2 /* Undo fail if master is back. */
 #define CLUSTER_FAIL_UNDO_TIME_ADD 10 /* Some additional time. */
@@ -25,6 +27,14 @@
 #define CLUSTER_MF_TIMEOUT 5000 /* Milliseconds to do a manual failover. */
 #define CLUSTER_MF_PAUSE_MULT 2 /* Master pause manual failover mult. */
 #define CLUSTER_SLAVE_MIGRATION_DELAY 5000 /* Delay for slave migration. */
+#define CLUSTER_GOSSIP_MENTIONS 8 /* Times every node should be featured in
+                                     the gossip received in the failure
+                                     reports validity time. */
+#define CLUSTER_DEFAULT_HOTKEYS_SAMPLING 10 /* Sample one command every 10. */
+#define CLUSTER_HOTKEYS_DEPTH 4   /* Rows of the hot keys Count-Min sketch. */
+#define CLUSTER_HOTKEYS_WIDTH 2048 /* Counters of every row of the sketch. */
+#define CLUSTER_HOTKEYS_TOPK 32   /* Number of hot keys tracked. */
+#define CLUSTER_HOTKEYS_DECAY_PERIOD 10000 /* Halve the counters every 10s. */
 
 /* Redirection errors returned by getNodeByQuery(). */
 #define CLUSTER_REDIR_NONE 0          /* Node can serve the request. */
@@ -44,6 +54,10 @@ typedef struct clusterLink {
     sds sndbuf;                 /* Packet send buffer */
     sds rcvbuf;                 /* Packet reception buffer */
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
+    int light_hdr;              /* The peer accepts light headers. */
+    unsigned char *sent_slots;  /* Slots bitmap of the last full header sent. */
+    unsigned char *rcvd_slots;  /* Slots bitmap of the last full header
+                                   received, to expand the light headers. */
 } clusterLink;
 
 /* Cluster node flags and macros. */
@@ -81,6 +95,7 @@ typedef struct clusterLink {
 #define CLUSTER_TODO_UPDATE_STATE (1<<1)
 #define CLUSTER_TODO_SAVE_CONFIG (1<<2)
 #define CLUSTER_TODO_FSYNC_CONFIG (1<<3)
+#define CLUSTER_TODO_SHARD_CHANNELS (1<<4)
 
 /* Message types.
  *
@@ -133,13 +148,59 @@ typedef struct clusterNode {
     mstime_t repl_offset_time;  /* Unix time we received offset for this node */
     mstime_t orphaned_time;     /* Starting time of orphaned master condition */
     long long repl_offset;      /* Last known repl offset for this node. */
+    long long load;             /* Last known commands per second. */
+    int syncing;                /* Node advertised CLUSTERMSG_FLAG0_SYNCING. */
     char ip[NET_IP_STR_LEN];  /* Latest known IP address of this node */
     int port;                   /* Latest known clients port of this node */
     int cport;                  /* Latest known cluster port of this node. */
     clusterLink *link;          /* TCP/IP link with this node */
+    struct clusterReadLink *read_link; /* Connection used to read keys from
+                                          this node, or NULL. */
     list *fail_reports;         /* List of nodes signaling this as failing */
 } clusterNode;
 
+/* In cluster mode the keys of every hash slot are linked together, using
+ * the metadata of their keyspace entries, so that the keys of a slot can be
+ * counted and enumerated without storing their names a second time. */
+typedef struct clusterDictEntryMetadata {
+    dictEntry *prev;            /* Prev entry with key in the same slot */
+    dictEntry *next;            /* Next entry with key in the same slot */
+} clusterDictEntryMetadata;
+
+typedef struct {
+    uint64_t count;             /* Number of keys in the slot. */
+    dictEntry *head;            /* The first key-value entry in the slot. */
+} slotToKeys;
+
+/* Slot to keys mapping of a database, see slotToKeyAddEntry(). */
+struct clusterSlotToKeyMapping {
+    slotToKeys by_slot[CLUSTER_SLOTS];
+};
+
+/* Load of a slot served by this node, see clusterSlotStatsAfterCall(). */
+typedef struct clusterSlotStats {
+    uint64_t ops;               /* Commands accessing the slot. */
+    uint64_t bytes_in;          /* Size of the arguments of the commands. */
+    uint64_t bytes_out;         /* Size of the replies of the commands. */
+} clusterSlotStats;
+
+/* Entry of the min-heap of the hottest keys sampled. */
+typedef struct clusterHotKey {
+    sds key;
+    uint32_t count;             /* Estimated samples of the key. */
+} clusterHotKey;
+
+/* State of the client saved before the execution of a command, in order
+ * to account its reply. */
+typedef struct clusterSlotStatsCall {
+    int slot;
+    int firstkey;               /* Position of the first key, or 0. */
+    size_t bytes_in;
+    int bufpos;
+    listNode *tail;             /* Last reply block and its used bytes. */
+    size_t tail_used;
+} clusterSlotStatsCall;
+
 typedef struct clusterState {
     clusterNode *myself;  /* This node */
     uint64_t currentEpoch;
@@ -150,8 +211,6 @@ typedef struct clusterState {
     clusterNode *migrating_slots_to[CLUSTER_SLOTS];
     clusterNode *importing_slots_from[CLUSTER_SLOTS];
     clusterNode *slots[CLUSTER_SLOTS];
-    uint64_t slots_keys_count[CLUSTER_SLOTS];
-    rax *slots_to_keys;
     /* The following fields are used to take the slave state on elections. */
     mstime_t failover_auth_time; /* Time of previous or next election. */
     int failover_auth_count;    /* Number of votes received so far. */
@@ -178,6 +237,29 @@ typedef struct clusterState {
     long long stats_bus_messages_received[CLUSTERMSG_TYPE_COUNT];
     long long stats_pfail_nodes;    /* Number of nodes in PFAIL status,
                                        excluding nodes without address. */
+    long long stats_bus_bytes_sent;
+    long long stats_bus_bytes_received;
+    long long stats_bus_light_hdr_sent; /* Messages sent without the slots. */
+    long long stats_cross_slot_reads; /* MGETs served across the slots. */
+    /* Failover timing, in milliseconds. */
+    mstime_t stats_fail_detection_time; /* Last master flagged as FAIL: time
+                                           since its last PONG. */
+    mstime_t stats_failover_election_time; /* Last failover of this node:
+                                              time since the FAIL. */
+    mstime_t stats_failover_time; /* Last failover of this node: time since
+                                     the last PONG of the old master. */
+    long long stats_failovers;    /* Failovers won by this node. */
+    long long ping_rate;        /* PING, PONG and MEET received per second. */
+    /* Load of the slots served by this node, and sketch of its hot keys. */
+    clusterSlotStats slot_stats[CLUSTER_SLOTS];
+    uint32_t hotkeys_sketch[CLUSTER_HOTKEYS_DEPTH][CLUSTER_HOTKEYS_WIDTH];
+    clusterHotKey hotkeys[CLUSTER_HOTKEYS_TOPK]; /* Min-heap by count. */
+    int hotkeys_count;
+    mstime_t hotkeys_last_decay;
+    /* Slots taken away from the shard of this node: the clients subscribed
+     * to sharded channels of such slots are unsubscribed before sleeping,
+     * unless the slot is back to our shard meanwhile (failover). */
+    unsigned char lost_slots[CLUSTER_SLOTS/8];
 } clusterState;
 
 /* Redis cluster messages header */
@@ -248,6 +330,7 @@ union clusterMsgData {
 };
 
 #define CLUSTER_PROTO_VER 1 /* Cluster bus protocol version. */
+#define CLUSTER_PROTO_VER_LIGHT 2 /* Header without the myslots field. */
 
 typedef struct {
     char sig[4];        /* Signature "RCmb" (Redis Cluster message bus). */
@@ -266,7 +349,9 @@ typedef struct {
     unsigned char myslots[CLUSTER_SLOTS/8];
     char slaveof[CLUSTER_NAMELEN];
     char myip[NET_IP_STR_LEN];    /* Sender IP, if not all zeroed. */
-    char notused1[34];  /* 34 bytes reserved for future usage. */
+    unsigned char load[4]; /* Commands per second processed by the sender,
+                              in network byte order. */
+    char notused1[30];  /* 30 bytes reserved for future usage. */
     uint16_t cport;      /* Sender TCP cluster bus port */
     uint16_t flags;      /* Sender node flags */
     unsigned char state; /* Cluster state from the POV of the sender */
@@ -276,14 +361,33 @@ typedef struct {
 
 #define CLUSTERMSG_MIN_LEN (sizeof(clusterMsg)-sizeof(union clusterMsgData))
 
+/* The slots bitmap is most of the header, and it rarely changes: to the
+ * nodes setting CLUSTERMSG_FLAG0_LIGHT_HDR we send it only when it differs
+ * from the one in the previous full header sent on the same link. The other
+ * messages are sent with the version CLUSTER_PROTO_VER_LIGHT, and the myslots
+ * field removed: the receiver puts back the bitmap of the last full header
+ * received on the link before processing them. */
+#define CLUSTERMSG_SLOTS_LEN (sizeof(((clusterMsg*)0)->myslots))
+#define CLUSTERMSG_LIGHT_MIN_LEN (CLUSTERMSG_MIN_LEN-CLUSTERMSG_SLOTS_LEN)
+
 /* Message flags better specify the packet content or are used to
  * provide some information about the node state. */
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_LIGHT_HDR (1<<2) /* Sender accepts light headers. */
+#define CLUSTERMSG_FLAG0_SYNCING (1<<3) /* Sender is loading its data, or is
+                                           a slave not in sync with its
+                                           master. */
+#define CLUSTERMSG_FLAG0_PROBE (1<<4) /* PING / PONG without the random
+                                         gossip sections. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
+int clusterCommandKeysAreDeclared(client *c);
+int clusterProcessCrossSlotRead(client *c);
+void clusterSlotStatsBeforeCall(client *c, int slot, clusterSlotStatsCall *st);
+void clusterSlotStatsAfterCall(client *c, clusterSlotStatsCall *st);
 int clusterRedirectBlockedClientIfNeeded(client *c);
 void clusterRedirectClient(client *c, clusterNode *n, int hashslot, int error_code);
 
@@ -30,6 +30,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -50,6 +51,8 @@ configEnum maxmemory_policy_enum[] = {
     {"volatile-ttl",MAXMEMORY_VOLATILE_TTL},
     {"allkeys-lru",MAXMEMORY_ALLKEYS_LRU},
     {"allkeys-lfu",MAXMEMORY_ALLKEYS_LFU},
+    {"volatile-lfu-size",MAXMEMORY_VOLATILE_LFU_SIZE},
+    {"allkeys-lfu-size",MAXMEMORY_ALLKEYS_LFU_SIZE},
     {"allkeys-random",MAXMEMORY_ALLKEYS_RANDOM},
     {"noeviction",MAXMEMORY_NO_EVICTION},
     {NULL, 0}
@@ -95,6 +98,19 @@ configEnum repl_diskless_load_enum[] = {
     {"disabled", REPL_DISKLESS_LOAD_DISABLED},
     {"on-empty-db", REPL_DISKLESS_LOAD_WHEN_DB_EMPTY},
     {"swapdb", REPL_DISKLESS_LOAD_SWAPDB},
+    {"async", REPL_DISKLESS_LOAD_ASYNC},
+    {NULL, 0}
+};
+
+configEnum rdb_compression_algorithm_enum[] = {
+    {"lzf", RDB_COMPRESSION_LZF},
+    {"lz4", RDB_COMPRESSION_LZ4},
+    {NULL, 0}
+};
+
+configEnum list_compress_codec_enum[] = {
+    {"lzf", QUICKLIST_NODE_ENCODING_LZF},
+    {"lz4", QUICKLIST_NODE_ENCODING_LZ4},
     {NULL, 0}
 };
 
@@ -121,9 +137,17 @@ configYesNo configs_yesno[] = {
     {"daemonize",NULL,&server.daemonize,0,0},
     {"io-threads-do-reads",NULL,&server.io_threads_do_reads, 0, CONFIG_DEFAULT_IO_THREADS_DO_READS},
     {"always-show-logo",NULL,&server.always_show_logo,0,CONFIG_DEFAULT_ALWAYS_SHOW_LOGO},
+    {"keyspace-open-addressing",NULL,&server.keyspace_open_addressing,0,CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING},
+    {"keyspace-ordered-index",NULL,&server.keyspace_ordered_index,0,CONFIG_DEFAULT_KEYSPACE_ORDERED_INDEX},
+    {"expire-time-index",NULL,&server.expire_time_index,0,CONFIG_DEFAULT_EXPIRE_TIME_INDEX},
+    {"tiered-storage",NULL,&server.tiered_storage,0,CONFIG_DEFAULT_TIERED_STORAGE},
+    {"rdb-lazy-load",NULL,&server.rdb_lazy_load,0,CONFIG_DEFAULT_RDB_LAZY_LOAD},
+    {"keyspace-hugepages",NULL,&server.keyspace_hugepages,0,CONFIG_DEFAULT_KEYSPACE_HUGEPAGES},
     /* Modifiable */
     {"protected-mode",NULL,&server.protected_mode,1,CONFIG_DEFAULT_PROTECTED_MODE},
+    {"io-threads-do-commands",NULL,&server.io_threads_do_commands,1,CONFIG_DEFAULT_IO_THREADS_DO_COMMANDS},
     {"rdbcompression",NULL,&server.rdb_compression,1,CONFIG_DEFAULT_RDB_COMPRESSION},
+    {"rdb-save-scripts",NULL,&server.rdb_save_scripts,1,CONFIG_DEFAULT_RDB_SAVE_SCRIPTS},
     {"activerehashing",NULL,&server.activerehashing,1,CONFIG_DEFAULT_ACTIVE_REHASHING},
     {"stop-writes-on-bgsave-error",NULL,&server.stop_writes_on_bgsave_err,1,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR},
     {"dynamic-hz",NULL,&server.dynamic_hz,1,CONFIG_DEFAULT_DYNAMIC_HZ},
@@ -132,19 +156,28 @@ configYesNo configs_yesno[] = {
     {"lazyfree-lazy-server-del",NULL,&server.lazyfree_lazy_server_del,1,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL},
     {"repl-disable-tcp-nodelay",NULL,&server.repl_disable_tcp_nodelay,1,CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY},
     {"repl-diskless-sync",NULL,&server.repl_diskless_sync,1,CONFIG_DEFAULT_REPL_DISKLESS_SYNC},
+    {"repl-compression",NULL,&server.repl_compression,1,CONFIG_DEFAULT_REPL_COMPRESSION},
+    {"replica-parallel-parse","slave-parallel-parse",&server.repl_parallel_parse,1,CONFIG_DEFAULT_REPL_PARALLEL_PARSE},
     {"gopher-enabled",NULL,&server.gopher_enabled,1,CONFIG_DEFAULT_GOPHER_ENABLED},
     {"aof-rewrite-incremental-fsync",NULL,&server.aof_rewrite_incremental_fsync,1,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC},
     {"no-appendfsync-on-rewrite",NULL,&server.aof_no_fsync_on_rewrite,1,CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE},
     {"cluster-require-full-coverage",NULL,&server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE},
     {"rdb-save-incremental-fsync",NULL,&server.rdb_save_incremental_fsync,1,CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC},
+    {"rdb-forkless-save",NULL,&server.rdb_forkless_save,1,CONFIG_DEFAULT_RDB_FORKLESS_SAVE},
+    {"rdb-delta-snapshots",NULL,&server.rdb_delta_snapshots,1,CONFIG_DEFAULT_RDB_DELTA_SNAPSHOTS},
     {"aof-load-truncated",NULL,&server.aof_load_truncated,1,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED},
     {"aof-use-rdb-preamble",NULL,&server.aof_use_rdb_preamble,1,CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE},
+    {"aof-multi-part",NULL,&server.aof_multi_part,0,CONFIG_DEFAULT_AOF_MULTI_PART},
+    {"aof-background-write",NULL,&server.aof_background_write,0,CONFIG_DEFAULT_AOF_BACKGROUND_WRITE},
     {"cluster-replica-no-failover","cluster-slave-no-failover",&server.cluster_slave_no_failover,1,CLUSTER_DEFAULT_SLAVE_NO_FAILOVER},
+    {"cluster-cross-slot-reads",NULL,&server.cluster_cross_slot_reads,1,CLUSTER_DEFAULT_CROSS_SLOT_READS},
     {"replica-lazy-flush","slave-lazy-flush",&server.repl_slave_lazy_flush,1,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH},
     {"replica-serve-stale-data","slave-serve-stale-data",&server.repl_serve_stale_data,1,CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA},
     {"replica-read-only","slave-read-only",&server.repl_slave_ro,1,CONFIG_DEFAULT_SLAVE_READ_ONLY},
     {"replica-ignore-maxmemory","slave-ignore-maxmemory",&server.repl_slave_ignore_maxmemory,1,CONFIG_DEFAULT_SLAVE_IGNORE_MAXMEMORY},
     {"jemalloc-bg-thread",NULL,&server.jemalloc_bg_thread,1,1},
+    {"lua-profiler",NULL,&server.lua_profiler,1,CONFIG_DEFAULT_LUA_PROFILER},
+    {"latency-tracking-breakdown",NULL,&server.latency_tracking_breakdown,1,CONFIG_DEFAULT_LATENCY_TRACKING_BREAKDOWN},
     {NULL, NULL, 0, 0}
 };
 
@@ -303,6 +336,30 @@ void loadServerConfigFromString(char *config) {
             server.bindaddr_count = addresses;
         } else if (!strcasecmp(argv[0],"unixsocket") && argc == 2) {
             server.unixsocket = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"shm-socket") && argc == 2) {
+#ifdef __linux__
+            server.shm_socket = zstrdup(argv[1]);
+#else
+            err = "The shared memory transport is only supported on Linux";
+            goto loaderr;
+#endif
+        } else if (!strcasecmp(argv[0],"shm-ring-size") && argc == 2) {
+            server.shm_ring_size = memtoll(argv[1],NULL);
+            if (server.shm_ring_size <= 0) {
+                err = "shm-ring-size must be positive"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"server-cpulist") && argc == 2) {
+            zfree(server.server_cpulist);
+            server.server_cpulist = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"bio-cpulist") && argc == 2) {
+            zfree(server.bio_cpulist);
+            server.bio_cpulist = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"aof-rewrite-cpulist") && argc == 2) {
+            zfree(server.aof_rewrite_cpulist);
+            server.aof_rewrite_cpulist = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"bgsave-cpulist") && argc == 2) {
+            zfree(server.bgsave_cpulist);
+            server.bgsave_cpulist = zstrdup(argv[1]);
         } else if (!strcasecmp(argv[0],"unixsocketperm") && argc == 2) {
             errno = 0;
             server.unixsocketperm = (mode_t)strtol(argv[1], NULL, 8);
@@ -376,6 +433,25 @@ void loadServerConfigFromString(char *config) {
             if (server.io_threads_num < 1 || server.io_threads_num > 512) {
                 err = "Invalid number of I/O threads"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"shards") && argc == 2) {
+            server.shards = atoi(argv[1]);
+            if (server.shards < 1 || server.shards > CONFIG_MAX_SHARDS) {
+                err = "Invalid number of shards"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"accept-threads") && argc == 2) {
+            server.accept_threads_num = atoi(argv[1]);
+            if (server.accept_threads_num < 0 ||
+                server.accept_threads_num > ACCEPT_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of accept threads"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"lazyfree-threads") && argc == 2) {
+            server.lazyfree_threads = atoi(argv[1]);
+            if (server.lazyfree_threads < 1 ||
+                server.lazyfree_threads > BIO_MAX_THREADS)
+            {
+                err = "Invalid number of lazyfree threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"include") && argc == 2) {
             loadServerConfig(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"maxclients") && argc == 2) {
@@ -385,6 +461,16 @@ void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             server.maxmemory = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"maxmemory-clients") && argc == 2) {
+            server.maxmemory_clients = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"db-maxmemory") && argc == 3) {
+            long long dbid;
+            if (string2ll(argv[1],strlen(argv[1]),&dbid) == 0 ||
+                dbid < 0 || dbid > INT_MAX)
+            {
+                err = "Invalid DB index in db-maxmemory"; goto loaderr;
+            }
+            dbSetMaxmemory(dbid,memtoll(argv[2],NULL));
         } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
             server.maxmemory_policy =
                 configEnumGetValue(maxmemory_policy_enum,argv[1]);
@@ -398,8 +484,42 @@ void loadServerConfigFromString(char *config) {
                 err = "maxmemory-samples must be 1 or greater";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"maxmemory-soft-limit") && argc == 2) {
+            server.maxmemory_soft_limit = atoi(argv[1]);
+            if (server.maxmemory_soft_limit < 0 ||
+                server.maxmemory_soft_limit > 100)
+            {
+                err = "maxmemory-soft-limit must be between 0 and 100";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"maxmemory-shadow-sampling") &&
+                   argc == 2)
+        {
+            server.maxmemory_shadow_sampling = atoi(argv[1]);
+            if (server.maxmemory_shadow_sampling < 0) {
+                err = "maxmemory-shadow-sampling must be 0 or greater";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"proto-max-bulk-len")) && argc == 2) {
             server.proto_max_bulk_len = memtoll(argv[1],NULL);
+        } else if ((!strcasecmp(argv[0],"value-interning-max-size")) && argc == 2) {
+            server.value_interning_max_size = memtoll(argv[1],NULL);
+            if (server.value_interning_max_size < 0) {
+                err = "Invalid value-interning-max-size"; goto loaderr;
+            }
+        } else if ((!strcasecmp(argv[0],"shared-integers")) && argc == 2) {
+            server.shared_integers = strtoll(argv[1],NULL,10);
+            if (server.shared_integers < 0 ||
+                server.shared_integers > 1000000000)
+            {
+                err = "Invalid shared-integers: must be between 0 and "
+                      "1000000000"; goto loaderr;
+            }
+        } else if ((!strcasecmp(argv[0],"keyspace-async-resize-threshold")) && argc == 2) {
+            server.keyspace_async_resize_threshold = memtoll(argv[1],NULL);
+            if (server.keyspace_async_resize_threshold < 0) {
+                err = "Invalid keyspace-async-resize-threshold"; goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"client-query-buffer-limit")) && argc == 2) {
             server.client_max_querybuf_len = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"lfu-log-factor") && argc == 2) {
@@ -441,12 +561,33 @@ void loadServerConfigFromString(char *config) {
                 err = "argument must be 'disabled', 'on-empty-db', 'swapdb' or 'flushdb'";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-compression-algorithm") &&
+                   argc == 2)
+        {
+            server.rdb_compression_algorithm =
+                configEnumGetValue(rdb_compression_algorithm_enum,argv[1]);
+            if (server.rdb_compression_algorithm == INT_MIN) {
+                err = "argument must be 'lzf' or 'lz4'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-diskless-sync-delay") && argc==2) {
             server.repl_diskless_sync_delay = atoi(argv[1]);
             if (server.repl_diskless_sync_delay < 0) {
                 err = "repl-diskless-sync-delay can't be negative";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"repl-diskless-sync-buffer") && argc==2) {
+            server.repl_diskless_sync_buffer = memtoll(argv[1],NULL);
+            if (server.repl_diskless_sync_buffer < 0) {
+                err = "repl-diskless-sync-buffer can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"repl-diskless-sync-max-rate") && argc==2) {
+            server.repl_diskless_sync_max_rate = memtoll(argv[1],NULL);
+            if (server.repl_diskless_sync_max_rate < 0) {
+                err = "repl-diskless-sync-max-rate can't be negative";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-size") && argc == 2) {
             long long size = memtoll(argv[1],NULL);
             if (size <= 0) {
@@ -454,6 +595,19 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             resizeReplicationBacklog(size);
+        } else if (!strcasecmp(argv[0],"repl-backlog-file") && argc == 2) {
+            if (!pathIsBaseName(argv[1])) {
+                err = "repl-backlog-file can't be a path, just a filename";
+                goto loaderr;
+            }
+            zfree(server.repl_backlog_filename);
+            server.repl_backlog_filename = argv[1][0] ? zstrdup(argv[1]) : NULL;
+        } else if (!strcasecmp(argv[0],"repl-backlog-file-size") && argc == 2) {
+            server.repl_backlog_file_size = memtoll(argv[1],NULL);
+            if (server.repl_backlog_file_size < CONFIG_REPL_BACKLOG_MIN_SIZE) {
+                err = "Invalid repl-backlog-file-size, must be 16kb or greater";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"repl-backlog-ttl") && argc == 2) {
             server.repl_backlog_time_limit = atoi(argv[1]);
             if (server.repl_backlog_time_limit < 0) {
@@ -475,6 +629,10 @@ void loadServerConfigFromString(char *config) {
                 err = "active defrag can't be enabled without proper jemalloc support"; goto loaderr;
 #endif
             }
+        } else if (!strcasecmp(argv[0],"active-defrag-thread") && argc == 2) {
+            if ((server.active_defrag_thread = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hz") && argc == 2) {
             server.config_hz = atoi(argv[1]);
             if (server.config_hz < CONFIG_MIN_HZ) server.config_hz = CONFIG_MIN_HZ;
@@ -515,6 +673,22 @@ void loadServerConfigFromString(char *config) {
                 err = "rdb-key-save-delay can't be negative";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"rdb-load-threads") && argc == 2) {
+            server.rdb_load_threads = atoi(argv[1]);
+            if (server.rdb_load_threads < 1 ||
+                server.rdb_load_threads > RDB_LOAD_MAX_THREADS)
+            {
+                err = "rdb-load-threads must be between 1 and 128";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rdb-save-threads") && argc == 2) {
+            server.rdb_save_threads = atoi(argv[1]);
+            if (server.rdb_save_threads < 1 ||
+                server.rdb_save_threads > RDB_SAVE_MAX_THREADS)
+            {
+                err = "rdb-save-threads must be between 1 and 128";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"key-load-delay") && argc==2) {
             server.key_load_delay = atoi(argv[1]);
             if (server.key_load_delay < 0) {
@@ -535,6 +709,9 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"pidfile") && argc == 2) {
             zfree(server.pidfile);
             server.pidfile = zstrdup(argv[1]);
+        } else if (!strcasecmp(argv[0],"tiered-storage-file") && argc == 2) {
+            zfree(server.tiered_storage_file);
+            server.tiered_storage_file = zstrdup(argv[1]);
         } else if (!strcasecmp(argv[0],"dbfilename") && argc == 2) {
             if (!pathIsBaseName(argv[1])) {
                 err = "dbfilename can't be a path, just a filename";
@@ -588,10 +765,12 @@ void loadServerConfigFromString(char *config) {
                 err = "active-expire-effort must be between 1 and 10";
                 goto loaderr;
             }
-        } else if (!strcasecmp(argv[0],"hash-max-ziplist-entries") && argc == 2) {
-            server.hash_max_ziplist_entries = memtoll(argv[1], NULL);
-        } else if (!strcasecmp(argv[0],"hash-max-ziplist-value") && argc == 2) {
-            server.hash_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if ((!strcasecmp(argv[0],"hash-max-listpack-entries") ||
+                    !strcasecmp(argv[0],"hash-max-ziplist-entries")) && argc == 2) {
+            server.hash_max_listpack_entries = memtoll(argv[1], NULL);
+        } else if ((!strcasecmp(argv[0],"hash-max-listpack-value") ||
+                    !strcasecmp(argv[0],"hash-max-ziplist-value")) && argc == 2) {
+            server.hash_max_listpack_value = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"stream-node-max-bytes") && argc == 2) {
             server.stream_node_max_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"stream-node-max-entries") && argc == 2) {
@@ -604,14 +783,80 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-codec") && argc == 2) {
+            server.list_compress_codec =
+                configEnumGetValue(list_compress_codec_enum,argv[1]);
+            if (server.list_compress_codec == INT_MIN) {
+                err = "argument must be 'lzf' or 'lz4'";
+                goto loaderr;
+            }
+            quicklistSetCompressCodec(server.list_compress_codec);
+        } else if (!strcasecmp(argv[0],"list-index-min-nodes") && argc == 2) {
+            server.list_index_min_nodes = strtoll(argv[1], NULL, 10);
+            if (server.list_index_min_nodes < 0) {
+                err = "list-index-min-nodes can't be negative";
+                goto loaderr;
+            }
+            quicklistSetIndexMinNodes(server.list_index_min_nodes);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
-        } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
-            server.zset_max_ziplist_entries = memtoll(argv[1], NULL);
-        } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
-            server.zset_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-max-listpack-entries") && argc == 2) {
+            server.set_max_listpack_entries = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"set-max-listpack-value") && argc == 2) {
+            server.set_max_listpack_value = memtoll(argv[1], NULL);
+        } else if ((!strcasecmp(argv[0],"zset-max-listpack-entries") ||
+                    !strcasecmp(argv[0],"zset-max-ziplist-entries")) && argc == 2) {
+            server.zset_max_listpack_entries = memtoll(argv[1], NULL);
+        } else if ((!strcasecmp(argv[0],"zset-max-listpack-value") ||
+                    !strcasecmp(argv[0],"zset-max-ziplist-value")) && argc == 2) {
+            server.zset_max_listpack_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"setops-incremental-threshold") &&
+                   argc == 2)
+        {
+            server.setops_incremental_threshold = strtoll(argv[1], NULL, 10);
+            if (server.setops_incremental_threshold < 0) {
+                err = "setops-incremental-threshold can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"replies-incremental-threshold") &&
+                   argc == 2)
+        {
+            server.replies_incremental_threshold = strtoll(argv[1], NULL, 10);
+            if (server.replies_incremental_threshold < 0) {
+                err = "replies-incremental-threshold can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"eventloop-latency-target") &&
+                   argc == 2)
+        {
+            server.eventloop_latency_target = strtoll(argv[1], NULL, 10);
+            if (server.eventloop_latency_target < 0) {
+                err = "eventloop-latency-target can't be negative";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"bitmap-roaring-min-bytes") &&
+                   argc == 2)
+        {
+            server.bitmap_roaring_min_bytes = memtoll(argv[1], NULL);
+            if (server.bitmap_roaring_min_bytes < 0) {
+                err = "bitmap-roaring-min-bytes can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"string-compression-threshold") &&
+                   argc == 2)
+        {
+            server.string_compression_threshold = memtoll(argv[1], NULL);
+            if (server.string_compression_threshold < 0) {
+                err = "string-compression-threshold can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"string-compression-dict") &&
+                   argc == 2)
+        {
+            zfree(server.string_compression_dict);
+            server.string_compression_dict = zstrdup(argv[1]);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
             struct redisCommand *cmd = lookupCommand(argv[1]);
             int retval;
@@ -667,6 +912,22 @@ void loadServerConfigFromString(char *config) {
             if (server.cluster_node_timeout <= 0) {
                 err = "cluster node timeout must be 1 or greater"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-fast-failover-timeout") &&
+                   argc == 2)
+        {
+            server.cluster_fast_failover_timeout = strtoll(argv[1],NULL,10);
+            if (server.cluster_fast_failover_timeout < 0) {
+                err = "cluster fast failover timeout must be zero or positive";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"cluster-hotkeys-sampling") &&
+                   argc == 2)
+        {
+            server.cluster_hotkeys_sampling = atoi(argv[1]);
+            if (server.cluster_hotkeys_sampling < 0) {
+                err = "cluster hotkeys sampling must be zero or positive";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"cluster-migration-barrier")
                    && argc == 2)
         {
@@ -699,24 +960,60 @@ void loadServerConfigFromString(char *config) {
         } else if (!strcasecmp(argv[0],"latency-monitor-threshold") &&
                    argc == 2)
         {
-            server.latency_monitor_threshold = strtoll(argv[1],NULL,10);
-            if (server.latency_monitor_threshold < 0) {
-                err = "The latency threshold can't be negative";
+            server.latency_monitor_threshold_us =
+                latencyParseThreshold(argv[1]);
+            if (server.latency_monitor_threshold_us < 0) {
+                err = "The latency threshold must be a positive number of "
+                      "milliseconds, or of microseconds with the 'us' unit";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"latency-monitor-history-len") &&
+                   argc == 2)
+        {
+            server.latency_history_len = strtoll(argv[1],NULL,10);
+            if (server.latency_history_len < 1 ||
+                server.latency_history_len > LATENCY_TS_MAX_LEN)
+            {
+                err = "Invalid latency history length";
                 goto loaderr;
             }
         } else if (!strcasecmp(argv[0],"slowlog-max-len") && argc == 2) {
             server.slowlog_max_len = strtoll(argv[1],NULL,10);
-        } else if (!strcasecmp(argv[0],"tracking-table-max-fill") &&
+        } else if (!strcasecmp(argv[0],"slowlog-shapes-max-len") &&
                    argc == 2)
         {
-            server.tracking_table_max_fill = strtoll(argv[1],NULL,10);
-            if (server.tracking_table_max_fill > 100 ||
-                server.tracking_table_max_fill < 0)
-            {
-                err = "The tracking table fill percentage must be an "
-                      "integer between 0 and 100";
+            server.slowlog_shapes_max_len = strtoll(argv[1],NULL,10);
+        } else if (!strcasecmp(argv[0],"slowlog-sample-ratio") && argc == 2) {
+            server.slowlog_sample_ratio = strtoll(argv[1],NULL,10);
+            if (server.slowlog_sample_ratio < 1) {
+                err = "Invalid slowlog sample ratio"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-stats-sample-ratio") &&
+                   argc == 2)
+        {
+            server.keyspace_stats_sample_ratio = strtoll(argv[1],NULL,10);
+            if (server.keyspace_stats_sample_ratio < 0) {
+                err = "Invalid keyspace stats sample ratio"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"keyspace-stats-prefixes") &&
+                   argc == 2)
+        {
+            if (keyspaceStatsSetPrefixes(argv[1]) == C_ERR) {
+                err = "Too many keyspace stats prefixes"; goto loaderr;
+            }
+            zfree(server.keyspace_stats_prefixes);
+            server.keyspace_stats_prefixes =
+                argv[1][0] ? zstrdup(argv[1]) : NULL;
+        } else if (!strcasecmp(argv[0],"tracking-table-max-keys") &&
+                   argc == 2)
+        {
+            long long maxkeys = strtoll(argv[1],NULL,10);
+            if (maxkeys < 0 || maxkeys > UINT_MAX) {
+                err = "The tracking table max keys must be a positive "
+                      "integer, or zero for no limit";
                 goto loaderr;
             }
+            server.tracking_table_max_keys = maxkeys;
         } else if (!strcasecmp(argv[0],"client-output-buffer-limit") &&
                    argc == 5)
         {
@@ -739,6 +1036,22 @@ void loadServerConfigFromString(char *config) {
             server.client_obuf_limits[class].hard_limit_bytes = hard;
             server.client_obuf_limits[class].soft_limit_bytes = soft;
             server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
+        } else if (!strcasecmp(argv[0],"client-output-buffer-spill-threshold") &&
+                   argc == 2)
+        {
+            server.client_obuf_spill_threshold = memtoll(argv[1],NULL);
+            if (server.client_obuf_spill_threshold < 0) {
+                err = "client-output-buffer-spill-threshold can't be negative";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"client-output-buffer-spill-max-size") &&
+                   argc == 2)
+        {
+            server.client_obuf_spill_max_size = memtoll(argv[1],NULL);
+            if (server.client_obuf_spill_max_size < 0) {
+                err = "client-output-buffer-spill-max-size can't be negative";
+                goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"slave-priority") ||
                     !strcasecmp(argv[0],"replica-priority")) && argc == 2)
         {
@@ -779,6 +1092,21 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             server.notify_keyspace_events = flags;
+        } else if (!strcasecmp(argv[0],"notify-keyspace-events-stream") &&
+                   argc == 2)
+        {
+            zfree(server.notify_keyspace_events_stream);
+            server.notify_keyspace_events_stream =
+                argv[1][0] ? zstrdup(argv[1]) : NULL;
+        } else if (!strcasecmp(argv[0],"notify-keyspace-events-stream-maxlen")
+                   && argc == 2)
+        {
+            server.notify_keyspace_events_stream_maxlen =
+                strtoll(argv[1],NULL,10);
+            if (server.notify_keyspace_events_stream_maxlen <= 0) {
+                err = "The notifications stream max length must be positive";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"supervised") && argc == 2) {
             server.supervised_mode =
                 configEnumGetValue(supervised_mode_enum,argv[1]);
@@ -849,6 +1177,24 @@ void loadServerConfigFromString(char *config) {
             server.tls_ctx_config.ciphersuites = zstrdup(argv[1]);
         } else if (!strcasecmp(argv[0],"tls-prefer-server-ciphers") && argc == 2) {
             server.tls_ctx_config.prefer_server_ciphers = yesnotoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"tls-ktls") && argc == 2) {
+            if ((server.tls_ctx_config.ktls = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-session-caching") && argc == 2) {
+            if ((server.tls_ctx_config.session_caching = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-session-cache-size") && argc == 2) {
+            server.tls_ctx_config.session_cache_size = atoi(argv[1]);
+            if (server.tls_ctx_config.session_cache_size < 0) {
+                err = "Invalid tls-session-cache-size"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"tls-session-cache-timeout") && argc == 2) {
+            server.tls_ctx_config.session_cache_timeout = atoi(argv[1]);
+            if (server.tls_ctx_config.session_cache_timeout < 0) {
+                err = "Invalid tls-session-cache-timeout"; goto loaderr;
+            }
 #endif  /* USE_OPENSSL */
         } else {
             err = "Bad directive or wrong number of arguments"; goto loaderr;
@@ -981,6 +1327,8 @@ void configSetCommand(client *c) {
         }
         zfree(server.rdb_filename);
         server.rdb_filename = zstrdup(o->ptr);
+        /* The base of the delta snapshots is the file with the old name. */
+        rdbDeltaInvalidate();
     } config_set_special_field("requirepass") {
         if (sdslen(o->ptr) > CONFIG_AUTHPASS_MAX_LEN) goto badfmt;
         /* The old "requirepass" directive just translates to setting
@@ -1123,11 +1471,56 @@ void configSetCommand(client *c) {
             server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
         }
         sdsfreesplitres(v,vlen);
+    } config_set_special_field("db-maxmemory") {
+        int vlen, j;
+        sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
+
+        /* We need pairs of <dbid> <bytes>: check them all before setting
+         * any limit, like for client-output-buffer-limit. */
+        if (vlen % 2) {
+            sdsfreesplitres(v,vlen);
+            goto badfmt;
+        }
+        for (j = 0; j < vlen; j++) {
+            long long val;
+
+            if ((j % 2) == 0) {
+                if (string2ll(v[j],sdslen(v[j]),&val) == 0 ||
+                    val < 0 || val >= server.dbnum)
+                {
+                    sdsfreesplitres(v,vlen);
+                    goto badfmt;
+                }
+            } else {
+                val = memtoll(v[j],&err);
+                if (err || val < 0) {
+                    sdsfreesplitres(v,vlen);
+                    goto badfmt;
+                }
+            }
+        }
+        for (j = 0; j < vlen; j += 2)
+            dbSetMaxmemory(atoi(v[j]),memtoll(v[j+1],NULL));
+        sdsfreesplitres(v,vlen);
     } config_set_special_field("notify-keyspace-events") {
         int flags = keyspaceEventsStringToFlags(o->ptr);
 
         if (flags == -1) goto badfmt;
         server.notify_keyspace_events = flags;
+    } config_set_special_field("latency-monitor-threshold") {
+        long long threshold = latencyParseThreshold(o->ptr);
+
+        if (threshold < 0) goto badfmt;
+        server.latency_monitor_threshold_us = threshold;
+    } config_set_special_field("keyspace-stats-prefixes") {
+        if (keyspaceStatsSetPrefixes(o->ptr) == C_ERR) goto badfmt;
+        zfree(server.keyspace_stats_prefixes);
+        server.keyspace_stats_prefixes =
+            ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
+    } config_set_special_field("notify-keyspace-events-stream") {
+        zfree(server.notify_keyspace_events_stream);
+        server.notify_keyspace_events_stream =
+            ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
     } config_set_special_field_with_alias("slave-announce-ip",
                                           "replica-announce-ip")
     {
@@ -1149,12 +1542,19 @@ void configSetCommand(client *c) {
             return;
         }
 #endif
+    } config_set_bool_field(
+      "active-defrag-thread",server.active_defrag_thread) {
     /* Numerical fields.
      * config_set_numerical_field(name,var,min,max) */
     } config_set_numerical_field(
       "tcp-keepalive",server.tcpkeepalive,0,INT_MAX) {
     } config_set_numerical_field(
       "maxmemory-samples",server.maxmemory_samples,1,INT_MAX) {
+    } config_set_numerical_field(
+      "maxmemory-soft-limit",server.maxmemory_soft_limit,0,100) {
+    } config_set_numerical_field(
+      "maxmemory-shadow-sampling",server.maxmemory_shadow_sampling,0,INT_MAX) {
+        evictionShadowReset();
     } config_set_numerical_field(
       "lfu-log-factor",server.lfu_log_factor,0,INT_MAX) {
     } config_set_numerical_field(
@@ -1178,9 +1578,17 @@ void configSetCommand(client *c) {
     } config_set_numerical_field(
       "auto-aof-rewrite-percentage",server.aof_rewrite_perc,0,INT_MAX){
     } config_set_numerical_field(
-      "hash-max-ziplist-entries",server.hash_max_ziplist_entries,0,LONG_MAX) {
+      "hash-max-listpack-entries",server.hash_max_listpack_entries,0,LONG_MAX) {
+        reencodeStart();
     } config_set_numerical_field(
-      "hash-max-ziplist-value",server.hash_max_ziplist_value,0,LONG_MAX) {
+      "hash-max-ziplist-entries",server.hash_max_listpack_entries,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "hash-max-listpack-value",server.hash_max_listpack_value,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "hash-max-ziplist-value",server.hash_max_listpack_value,0,LONG_MAX) {
+        reencodeStart();
     } config_set_numerical_field(
       "stream-node-max-bytes",server.stream_node_max_bytes,0,LONG_MAX) {
     } config_set_numerical_field(
@@ -1189,12 +1597,36 @@ void configSetCommand(client *c) {
       "list-max-ziplist-size",server.list_max_ziplist_size,INT_MIN,INT_MAX) {
     } config_set_numerical_field(
       "list-compress-depth",server.list_compress_depth,0,INT_MAX) {
+    } config_set_numerical_field(
+      "list-index-min-nodes",server.list_index_min_nodes,0,LLONG_MAX) {
+        quicklistSetIndexMinNodes(server.list_index_min_nodes);
     } config_set_numerical_field(
       "set-max-intset-entries",server.set_max_intset_entries,0,LONG_MAX) {
+        reencodeStart();
     } config_set_numerical_field(
-      "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LONG_MAX) {
+      "set-max-listpack-entries",server.set_max_listpack_entries,0,LONG_MAX) {
+        reencodeStart();
     } config_set_numerical_field(
-      "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LONG_MAX) {
+      "set-max-listpack-value",server.set_max_listpack_value,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "zset-max-listpack-entries",server.zset_max_listpack_entries,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "zset-max-ziplist-entries",server.zset_max_listpack_entries,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "zset-max-listpack-value",server.zset_max_listpack_value,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "zset-max-ziplist-value",server.zset_max_listpack_value,0,LONG_MAX) {
+        reencodeStart();
+    } config_set_numerical_field(
+      "setops-incremental-threshold",server.setops_incremental_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "replies-incremental-threshold",server.replies_incremental_threshold,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "eventloop-latency-target",server.eventloop_latency_target,0,LLONG_MAX/1000) {
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LONG_MAX) {
     } config_set_numerical_field(
@@ -1206,9 +1638,21 @@ void configSetCommand(client *c) {
       /* Cast to unsigned. */
         server.slowlog_max_len = (unsigned long)ll;
     } config_set_numerical_field(
-      "tracking-table-max-fill",server.tracking_table_max_fill,0,100) {
+      "slowlog-shapes-max-len",ll,0,LONG_MAX) {
+        server.slowlog_shapes_max_len = (unsigned long)ll;
+    } config_set_numerical_field(
+      "slowlog-sample-ratio",server.slowlog_sample_ratio,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "keyspace-stats-sample-ratio",server.keyspace_stats_sample_ratio,0,LLONG_MAX) {
     } config_set_numerical_field(
-      "latency-monitor-threshold",server.latency_monitor_threshold,0,LLONG_MAX){
+      "tracking-table-max-keys",server.tracking_table_max_keys,0,UINT_MAX) {
+    } config_set_numerical_field(
+      "notify-keyspace-events-stream-maxlen",
+      server.notify_keyspace_events_stream_maxlen,1,LLONG_MAX) {
+    } config_set_numerical_field(
+      "latency-monitor-history-len",server.latency_history_len,1,
+      LATENCY_TS_MAX_LEN) {
+        latencyResizeHistory();
     } config_set_numerical_field(
       "repl-ping-slave-period",server.repl_ping_slave_period,1,INT_MAX) {
     } config_set_numerical_field(
@@ -1227,6 +1671,10 @@ void configSetCommand(client *c) {
       "rdb-key-save-delay",server.rdb_key_save_delay,0,LLONG_MAX) {
     } config_set_numerical_field(
       "key-load-delay",server.key_load_delay,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "rdb-load-threads",server.rdb_load_threads,1,RDB_LOAD_MAX_THREADS) {
+    } config_set_numerical_field(
+      "rdb-save-threads",server.rdb_save_threads,1,RDB_SAVE_MAX_THREADS) {
     } config_set_numerical_field(
       "slave-announce-port",server.slave_announce_port,0,65535) {
     } config_set_numerical_field(
@@ -1245,6 +1693,10 @@ void configSetCommand(client *c) {
         refreshGoodSlavesCount();
     } config_set_numerical_field(
       "cluster-node-timeout",server.cluster_node_timeout,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "cluster-fast-failover-timeout",server.cluster_fast_failover_timeout,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "cluster-hotkeys-sampling",server.cluster_hotkeys_sampling,0,INT_MAX) {
     } config_set_numerical_field(
       "cluster-announce-port",server.cluster_announce_port,0,65535) {
     } config_set_numerical_field(
@@ -1277,14 +1729,33 @@ void configSetCommand(client *c) {
             }
             freeMemoryIfNeededAndSafe();
         }
+    } config_set_memory_field(
+      "maxmemory-clients",server.maxmemory_clients) {
+    } config_set_memory_field("shm-ring-size",server.shm_ring_size) {
     } config_set_memory_field(
       "proto-max-bulk-len",server.proto_max_bulk_len) {
+    } config_set_memory_field(
+      "value-interning-max-size",server.value_interning_max_size) {
+    } config_set_memory_field(
+      "keyspace-async-resize-threshold",server.keyspace_async_resize_threshold) {
     } config_set_memory_field(
       "client-query-buffer-limit",server.client_max_querybuf_len) {
+    } config_set_memory_field(
+      "client-output-buffer-spill-threshold",server.client_obuf_spill_threshold) {
+    } config_set_memory_field(
+      "client-output-buffer-spill-max-size",server.client_obuf_spill_max_size) {
+    } config_set_memory_field(
+      "repl-diskless-sync-buffer",server.repl_diskless_sync_buffer) {
+    } config_set_memory_field(
+      "repl-diskless-sync-max-rate",server.repl_diskless_sync_max_rate) {
     } config_set_memory_field("repl-backlog-size",ll) {
         resizeReplicationBacklog(ll);
     } config_set_memory_field("auto-aof-rewrite-min-size",ll) {
         server.aof_rewrite_min_size = ll;
+    } config_set_memory_field(
+      "bitmap-roaring-min-bytes",server.bitmap_roaring_min_bytes) {
+    } config_set_memory_field(
+      "string-compression-threshold",server.string_compression_threshold) {
 
     /* Enumeration fields.
      * config_set_enum_field(name,var,enum_var) */
@@ -1296,6 +1767,13 @@ void configSetCommand(client *c) {
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
     } config_set_enum_field(
       "repl-diskless-load",server.repl_diskless_load,repl_diskless_load_enum) {
+    } config_set_enum_field(
+      "rdb-compression-algorithm",server.rdb_compression_algorithm,
+      rdb_compression_algorithm_enum) {
+    } config_set_enum_field(
+      "list-compress-codec",server.list_compress_codec,
+      list_compress_codec_enum) {
+        quicklistSetCompressCodec(server.list_compress_codec);
 #ifdef USE_OPENSSL
     /* TLS fields. */
     } config_set_special_field("tls-cert-file") {
@@ -1389,6 +1867,42 @@ void configSetCommand(client *c) {
             return;
         }
         server.tls_ctx_config.prefer_server_ciphers = tmpctx.prefer_server_ciphers;
+    } config_set_special_field("tls-ktls") {
+        redisTLSContextConfig tmpctx = server.tls_ctx_config;
+        if ((tmpctx.ktls = yesnotoi(o->ptr)) == -1) goto badfmt;
+        if (tlsConfigure(&tmpctx) == C_ERR) {
+            addReplyError(c, "Unable to reconfigure TLS. Check server logs.");
+            return;
+        }
+        server.tls_ctx_config.ktls = tmpctx.ktls;
+    } config_set_special_field("tls-session-caching") {
+        redisTLSContextConfig tmpctx = server.tls_ctx_config;
+        if ((tmpctx.session_caching = yesnotoi(o->ptr)) == -1) goto badfmt;
+        if (tlsConfigure(&tmpctx) == C_ERR) {
+            addReplyError(c, "Unable to reconfigure TLS. Check server logs.");
+            return;
+        }
+        server.tls_ctx_config.session_caching = tmpctx.session_caching;
+    } config_set_special_field("tls-session-cache-size") {
+        redisTLSContextConfig tmpctx = server.tls_ctx_config;
+        if (getLongLongFromObject(o,&ll) == C_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        tmpctx.session_cache_size = ll;
+        if (tlsConfigure(&tmpctx) == C_ERR) {
+            addReplyError(c, "Unable to reconfigure TLS. Check server logs.");
+            return;
+        }
+        server.tls_ctx_config.session_cache_size = tmpctx.session_cache_size;
+    } config_set_special_field("tls-session-cache-timeout") {
+        redisTLSContextConfig tmpctx = server.tls_ctx_config;
+        if (getLongLongFromObject(o,&ll) == C_ERR ||
+            ll < 0 || ll > INT_MAX) goto badfmt;
+        tmpctx.session_cache_timeout = ll;
+        if (tlsConfigure(&tmpctx) == C_ERR) {
+            addReplyError(c, "Unable to reconfigure TLS. Check server logs.");
+            return;
+        }
+        server.tls_ctx_config.session_cache_timeout = tmpctx.session_cache_timeout;
 #endif  /* USE_OPENSSL */
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1457,10 +1971,23 @@ void configGetCommand(client *c) {
     config_get_string_field("masteruser",server.masteruser);
     config_get_string_field("masterauth",server.masterauth);
     config_get_string_field("cluster-announce-ip",server.cluster_announce_ip);
+    config_get_string_field("notify-keyspace-events-stream",
+                            server.notify_keyspace_events_stream);
+    config_get_string_field("keyspace-stats-prefixes",
+                            server.keyspace_stats_prefixes);
     config_get_string_field("unixsocket",server.unixsocket);
+    config_get_string_field("shm-socket",server.shm_socket);
+    config_get_string_field("server-cpulist",server.server_cpulist);
+    config_get_string_field("bio-cpulist",server.bio_cpulist);
+    config_get_string_field("aof-rewrite-cpulist",server.aof_rewrite_cpulist);
+    config_get_string_field("bgsave-cpulist",server.bgsave_cpulist);
     config_get_string_field("logfile",server.logfile);
     config_get_string_field("aclfile",server.acl_filename);
     config_get_string_field("pidfile",server.pidfile);
+    config_get_string_field("tiered-storage-file",server.tiered_storage_file);
+    config_get_string_field("string-compression-dict",
+            server.string_compression_dict);
+    config_get_string_field("repl-backlog-file",server.repl_backlog_filename);
     config_get_string_field("slave-announce-ip",server.slave_announce_ip);
     config_get_string_field("replica-announce-ip",server.slave_announce_ip);
 #ifdef USE_OPENSSL
@@ -1476,9 +2003,18 @@ void configGetCommand(client *c) {
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
+    config_get_numerical_field("maxmemory-clients",server.maxmemory_clients);
+    config_get_numerical_field("shm-ring-size",server.shm_ring_size);
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
+    config_get_numerical_field("value-interning-max-size",server.value_interning_max_size);
+    config_get_numerical_field("shared-integers",server.shared_integers);
+    config_get_numerical_field("keyspace-async-resize-threshold",server.keyspace_async_resize_threshold);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
+    config_get_numerical_field("client-output-buffer-spill-threshold",server.client_obuf_spill_threshold);
+    config_get_numerical_field("client-output-buffer-spill-max-size",server.client_obuf_spill_max_size);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
+    config_get_numerical_field("maxmemory-soft-limit",server.maxmemory_soft_limit);
+    config_get_numerical_field("maxmemory-shadow-sampling",server.maxmemory_shadow_sampling);
     config_get_numerical_field("lfu-log-factor",server.lfu_log_factor);
     config_get_numerical_field("lfu-decay-time",server.lfu_decay_time);
     config_get_numerical_field("timeout",server.maxidletime);
@@ -1493,10 +2029,14 @@ void configGetCommand(client *c) {
             server.aof_rewrite_perc);
     config_get_numerical_field("auto-aof-rewrite-min-size",
             server.aof_rewrite_min_size);
+    config_get_numerical_field("hash-max-listpack-entries",
+            server.hash_max_listpack_entries);
     config_get_numerical_field("hash-max-ziplist-entries",
-            server.hash_max_ziplist_entries);
+            server.hash_max_listpack_entries);
+    config_get_numerical_field("hash-max-listpack-value",
+            server.hash_max_listpack_value);
     config_get_numerical_field("hash-max-ziplist-value",
-            server.hash_max_ziplist_value);
+            server.hash_max_listpack_value);
     config_get_numerical_field("stream-node-max-bytes",
             server.stream_node_max_bytes);
     config_get_numerical_field("stream-node-max-entries",
@@ -1505,21 +2045,49 @@ void configGetCommand(client *c) {
             server.list_max_ziplist_size);
     config_get_numerical_field("list-compress-depth",
             server.list_compress_depth);
+    config_get_numerical_field("list-index-min-nodes",
+            server.list_index_min_nodes);
     config_get_numerical_field("set-max-intset-entries",
             server.set_max_intset_entries);
+    config_get_numerical_field("set-max-listpack-entries",
+            server.set_max_listpack_entries);
+    config_get_numerical_field("set-max-listpack-value",
+            server.set_max_listpack_value);
+    config_get_numerical_field("zset-max-listpack-entries",
+            server.zset_max_listpack_entries);
     config_get_numerical_field("zset-max-ziplist-entries",
-            server.zset_max_ziplist_entries);
+            server.zset_max_listpack_entries);
+    config_get_numerical_field("zset-max-listpack-value",
+            server.zset_max_listpack_value);
     config_get_numerical_field("zset-max-ziplist-value",
-            server.zset_max_ziplist_value);
+            server.zset_max_listpack_value);
+    config_get_numerical_field("setops-incremental-threshold",
+            server.setops_incremental_threshold);
+    config_get_numerical_field("replies-incremental-threshold",
+            server.replies_incremental_threshold);
+    config_get_numerical_field("eventloop-latency-target",
+            server.eventloop_latency_target);
     config_get_numerical_field("hll-sparse-max-bytes",
             server.hll_sparse_max_bytes);
+    config_get_numerical_field("bitmap-roaring-min-bytes",
+            server.bitmap_roaring_min_bytes);
+    config_get_numerical_field("string-compression-threshold",
+            server.string_compression_threshold);
     config_get_numerical_field("lua-time-limit",server.lua_time_limit);
     config_get_numerical_field("slowlog-log-slower-than",
             server.slowlog_log_slower_than);
-    config_get_numerical_field("latency-monitor-threshold",
-            server.latency_monitor_threshold);
+    config_get_numerical_field("latency-monitor-history-len",
+            server.latency_history_len);
     config_get_numerical_field("slowlog-max-len", server.slowlog_max_len);
-    config_get_numerical_field("tracking-table-max-fill", server.tracking_table_max_fill);
+    config_get_numerical_field("slowlog-shapes-max-len",
+            server.slowlog_shapes_max_len);
+    config_get_numerical_field("slowlog-sample-ratio",
+            server.slowlog_sample_ratio);
+    config_get_numerical_field("keyspace-stats-sample-ratio",
+            server.keyspace_stats_sample_ratio);
+    config_get_numerical_field("tracking-table-max-keys", server.tracking_table_max_keys);
+    config_get_numerical_field("notify-keyspace-events-stream-maxlen",
+                               server.notify_keyspace_events_stream_maxlen);
     config_get_numerical_field("port",server.port);
     config_get_numerical_field("tls-port",server.tls_port);
     config_get_numerical_field("cluster-announce-port",server.cluster_announce_port);
@@ -1527,9 +2095,15 @@ void configGetCommand(client *c) {
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
     config_get_numerical_field("io-threads",server.io_threads_num);
+    config_get_numerical_field("shards",server.shards);
+    config_get_numerical_field("lazyfree-threads",server.lazyfree_threads);
+    config_get_numerical_field("accept-threads",server.accept_threads_num);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-ping-replica-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
+    config_get_numerical_field("repl-diskless-sync-buffer",server.repl_diskless_sync_buffer);
+    config_get_numerical_field("repl-backlog-file-size",server.repl_backlog_file_size);
+    config_get_numerical_field("repl-diskless-sync-max-rate",server.repl_diskless_sync_max_rate);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
     config_get_numerical_field("maxclients",server.maxclients);
@@ -1544,12 +2118,16 @@ void configGetCommand(client *c) {
     config_get_numerical_field("min-replicas-max-lag",server.repl_min_slaves_max_lag);
     config_get_numerical_field("hz",server.config_hz);
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
+    config_get_numerical_field("cluster-fast-failover-timeout",server.cluster_fast_failover_timeout);
+    config_get_numerical_field("cluster-hotkeys-sampling",server.cluster_hotkeys_sampling);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("cluster-replica-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
     config_get_numerical_field("rdb-key-save-delay",server.rdb_key_save_delay);
     config_get_numerical_field("key-load-delay",server.key_load_delay);
+    config_get_numerical_field("rdb-load-threads",server.rdb_load_threads);
+    config_get_numerical_field("rdb-save-threads",server.rdb_save_threads);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
 
     /* Bool (yes/no) values */
@@ -1562,11 +2140,19 @@ void configGetCommand(client *c) {
     }
 
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
+    config_get_bool_field("active-defrag-thread", server.active_defrag_thread);
     config_get_bool_field("tls-cluster",server.tls_cluster);
     config_get_bool_field("tls-replication",server.tls_replication);
     config_get_bool_field("tls-auth-clients",server.tls_auth_clients);
     config_get_bool_field("tls-prefer-server-ciphers",
             server.tls_ctx_config.prefer_server_ciphers);
+    config_get_bool_field("tls-ktls",server.tls_ctx_config.ktls);
+    config_get_bool_field("tls-session-caching",
+            server.tls_ctx_config.session_caching);
+    config_get_numerical_field("tls-session-cache-size",
+            server.tls_ctx_config.session_cache_size);
+    config_get_numerical_field("tls-session-cache-timeout",
+            server.tls_ctx_config.session_cache_timeout);
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
             server.maxmemory_policy,maxmemory_policy_enum);
@@ -1580,6 +2166,10 @@ void configGetCommand(client *c) {
             server.syslog_facility,syslog_facility_enum);
     config_get_enum_field("repl-diskless-load",
             server.repl_diskless_load,repl_diskless_load_enum);
+    config_get_enum_field("rdb-compression-algorithm",
+            server.rdb_compression_algorithm,rdb_compression_algorithm_enum);
+    config_get_enum_field("list-compress-codec",
+            server.list_compress_codec,list_compress_codec_enum);
 
     /* Everything we can't handle with macros follows. */
 
@@ -1632,6 +2222,19 @@ void configGetCommand(client *c) {
         sdsfree(buf);
         matches++;
     }
+    if (stringmatch(pattern,"db-maxmemory",1)) {
+        sds buf = sdsempty();
+
+        for (int j = 0; j < server.db_maxmemory_len; j++) {
+            if (!server.db_maxmemory[j]) continue;
+            if (sdslen(buf)) buf = sdscatlen(buf," ",1);
+            buf = sdscatprintf(buf,"%d %llu",j,server.db_maxmemory[j]);
+        }
+        addReplyBulkCString(c,"db-maxmemory");
+        addReplyBulkCString(c,buf);
+        sdsfree(buf);
+        matches++;
+    }
     if (stringmatch(pattern,"unixsocketperm",1)) {
         char buf[32];
         snprintf(buf,sizeof(buf),"%o",server.unixsocketperm);
@@ -1655,6 +2258,14 @@ void configGetCommand(client *c) {
         addReplyBulkCString(c,buf);
         matches++;
     }
+    if (stringmatch(pattern,"latency-monitor-threshold",1)) {
+        sds threshold =
+            latencyFormatThreshold(server.latency_monitor_threshold_us);
+
+        addReplyBulkCString(c,"latency-monitor-threshold");
+        addReplyBulkSds(c,threshold);
+        matches++;
+    }
     if (stringmatch(pattern,"notify-keyspace-events",1)) {
         sds flags = keyspaceEventsFlagsToString(server.notify_keyspace_events);
 
@@ -2100,6 +2711,23 @@ void rewriteConfigClientoutputbufferlimitOption(struct rewriteConfigState *state
     }
 }
 
+/* Rewrite the db-maxmemory option, one line for every DB having a limit. */
+void rewriteConfigDbMaxmemoryOption(struct rewriteConfigState *state) {
+    char *option = "db-maxmemory";
+    int lines = 0;
+
+    for (int j = 0; j < server.db_maxmemory_len; j++) {
+        char bytes[64];
+
+        if (!server.db_maxmemory[j]) continue;
+        rewriteConfigFormatMemory(bytes,sizeof(bytes),server.db_maxmemory[j]);
+        rewriteConfigRewriteLine(state,option,
+            sdscatprintf(sdsempty(),"%s %d %s",option,j,bytes),1);
+        lines++;
+    }
+    if (lines == 0) rewriteConfigMarkAsProcessed(state,option);
+}
+
 /* Rewrite the bind option. */
 void rewriteConfigBindOption(struct rewriteConfigState *state) {
     int force = 1;
@@ -2287,6 +2915,7 @@ int rewriteConfig(char *path) {
     }
 
     rewriteConfigStringOption(state,"pidfile",server.pidfile,CONFIG_DEFAULT_PID_FILE);
+    rewriteConfigStringOption(state,"tiered-storage-file",server.tiered_storage_file,CONFIG_DEFAULT_TIERED_STORAGE_FILE);
     rewriteConfigNumericalOption(state,"tls-port",server.tls_port,CONFIG_DEFAULT_SERVER_TLS_PORT);
     rewriteConfigNumericalOption(state,"cluster-announce-port",server.cluster_announce_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT);
     rewriteConfigNumericalOption(state,"cluster-announce-bus-port",server.cluster_announce_bus_port,CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT);
@@ -2294,6 +2923,12 @@ int rewriteConfig(char *path) {
     rewriteConfigBindOption(state);
     rewriteConfigStringOption(state,"unixsocket",server.unixsocket,NULL);
     rewriteConfigOctalOption(state,"unixsocketperm",server.unixsocketperm,CONFIG_DEFAULT_UNIX_SOCKET_PERM);
+    rewriteConfigStringOption(state,"shm-socket",server.shm_socket,NULL);
+    rewriteConfigBytesOption(state,"shm-ring-size",server.shm_ring_size,CONFIG_DEFAULT_SHM_RING_SIZE);
+    rewriteConfigStringOption(state,"server-cpulist",server.server_cpulist,NULL);
+    rewriteConfigStringOption(state,"bio-cpulist",server.bio_cpulist,NULL);
+    rewriteConfigStringOption(state,"aof-rewrite-cpulist",server.aof_rewrite_cpulist,NULL);
+    rewriteConfigStringOption(state,"bgsave-cpulist",server.bgsave_cpulist,NULL);
     rewriteConfigNumericalOption(state,"timeout",server.maxidletime,CONFIG_DEFAULT_CLIENT_TIMEOUT);
     rewriteConfigNumericalOption(state,"tcp-keepalive",server.tcpkeepalive,CONFIG_DEFAULT_TCP_KEEPALIVE);
     rewriteConfigNumericalOption(state,"replica-announce-port",server.slave_announce_port,CONFIG_DEFAULT_SLAVE_ANNOUNCE_PORT);
@@ -2307,6 +2942,9 @@ int rewriteConfig(char *path) {
     rewriteConfigUserOption(state);
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
     rewriteConfigNumericalOption(state,"io-threads",server.dbnum,CONFIG_DEFAULT_IO_THREADS_NUM);
+    rewriteConfigNumericalOption(state,"shards",server.shards,CONFIG_DEFAULT_SHARDS);
+    rewriteConfigNumericalOption(state,"lazyfree-threads",server.lazyfree_threads,CONFIG_DEFAULT_LAZYFREE_THREADS);
+    rewriteConfigNumericalOption(state,"accept-threads",server.accept_threads_num,CONFIG_DEFAULT_ACCEPT_THREADS);
     rewriteConfigStringOption(state,"dbfilename",server.rdb_filename,CONFIG_DEFAULT_RDB_FILENAME);
     rewriteConfigDirOption(state);
     rewriteConfigSlaveofOption(state,"replicaof");
@@ -2316,9 +2954,14 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"cluster-announce-ip",server.cluster_announce_ip,NULL);
     rewriteConfigNumericalOption(state,"repl-ping-replica-period",server.repl_ping_slave_period,CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD);
     rewriteConfigNumericalOption(state,"repl-timeout",server.repl_timeout,CONFIG_DEFAULT_REPL_TIMEOUT);
+    rewriteConfigBytesOption(state,"repl-diskless-sync-buffer",server.repl_diskless_sync_buffer,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_BUFFER);
+    rewriteConfigBytesOption(state,"repl-diskless-sync-max-rate",server.repl_diskless_sync_max_rate,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_MAX_RATE);
     rewriteConfigBytesOption(state,"repl-backlog-size",server.repl_backlog_size,CONFIG_DEFAULT_REPL_BACKLOG_SIZE);
+    rewriteConfigStringOption(state,"repl-backlog-file",server.repl_backlog_filename,NULL);
+    rewriteConfigBytesOption(state,"repl-backlog-file-size",server.repl_backlog_file_size,CONFIG_DEFAULT_REPL_BACKLOG_FILE_SIZE);
     rewriteConfigBytesOption(state,"repl-backlog-ttl",server.repl_backlog_time_limit,CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT);
     rewriteConfigEnumOption(state,"repl-diskless-load",server.repl_diskless_load,repl_diskless_load_enum,CONFIG_DEFAULT_REPL_DISKLESS_LOAD);
+    rewriteConfigEnumOption(state,"rdb-compression-algorithm",server.rdb_compression_algorithm,rdb_compression_algorithm_enum,CONFIG_DEFAULT_RDB_COMPRESSION_ALGORITHM);
     rewriteConfigNumericalOption(state,"repl-diskless-sync-delay",server.repl_diskless_sync_delay,CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY);
     rewriteConfigNumericalOption(state,"replica-priority",server.slave_priority,CONFIG_DEFAULT_SLAVE_PRIORITY);
     rewriteConfigNumericalOption(state,"min-replicas-to-write",server.repl_min_slaves_to_write,CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE);
@@ -2326,10 +2969,17 @@ int rewriteConfig(char *path) {
     rewriteConfigRequirepassOption(state,"requirepass");
     rewriteConfigNumericalOption(state,"maxclients",server.maxclients,CONFIG_DEFAULT_MAX_CLIENTS);
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
+    rewriteConfigBytesOption(state,"maxmemory-clients",server.maxmemory_clients,CONFIG_DEFAULT_MAXMEMORY_CLIENTS);
+    rewriteConfigDbMaxmemoryOption(state);
     rewriteConfigBytesOption(state,"proto-max-bulk-len",server.proto_max_bulk_len,CONFIG_DEFAULT_PROTO_MAX_BULK_LEN);
+    rewriteConfigBytesOption(state,"value-interning-max-size",server.value_interning_max_size,CONFIG_DEFAULT_VALUE_INTERNING_MAX_SIZE);
+    rewriteConfigNumericalOption(state,"shared-integers",server.shared_integers,CONFIG_DEFAULT_SHARED_INTEGERS);
+    rewriteConfigBytesOption(state,"keyspace-async-resize-threshold",server.keyspace_async_resize_threshold,CONFIG_DEFAULT_KEYSPACE_ASYNC_RESIZE_THRESHOLD);
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
+    rewriteConfigNumericalOption(state,"maxmemory-soft-limit",server.maxmemory_soft_limit,CONFIG_DEFAULT_MAXMEMORY_SOFT_LIMIT);
+    rewriteConfigNumericalOption(state,"maxmemory-shadow-sampling",server.maxmemory_shadow_sampling,CONFIG_DEFAULT_MAXMEMORY_SHADOW_SAMPLING);
     rewriteConfigNumericalOption(state,"lfu-log-factor",server.lfu_log_factor,CONFIG_DEFAULT_LFU_LOG_FACTOR);
     rewriteConfigNumericalOption(state,"lfu-decay-time",server.lfu_decay_time,CONFIG_DEFAULT_LFU_DECAY_TIME);
     rewriteConfigNumericalOption(state,"active-defrag-threshold-lower",server.active_defrag_threshold_lower,CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER);
@@ -2348,29 +2998,60 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"cluster-enabled",server.cluster_enabled,0);
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
+    rewriteConfigNumericalOption(state,"cluster-fast-failover-timeout",server.cluster_fast_failover_timeout,CLUSTER_DEFAULT_FAST_FAILOVER_TIMEOUT);
+    rewriteConfigNumericalOption(state,"cluster-hotkeys-sampling",server.cluster_hotkeys_sampling,CLUSTER_DEFAULT_HOTKEYS_SAMPLING);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
     rewriteConfigNumericalOption(state,"cluster-replica-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
     rewriteConfigNumericalOption(state,"slowlog-log-slower-than",server.slowlog_log_slower_than,CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN);
-    rewriteConfigNumericalOption(state,"latency-monitor-threshold",server.latency_monitor_threshold,CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD);
+    sds threshold = latencyFormatThreshold(server.latency_monitor_threshold_us);
+    rewriteConfigStringOption(state,"latency-monitor-threshold",threshold,"0");
+    sdsfree(threshold);
+    rewriteConfigNumericalOption(state,"latency-monitor-history-len",server.latency_history_len,LATENCY_TS_LEN);
     rewriteConfigNumericalOption(state,"slowlog-max-len",server.slowlog_max_len,CONFIG_DEFAULT_SLOWLOG_MAX_LEN);
-    rewriteConfigNumericalOption(state,"tracking-table-max-fill",server.tracking_table_max_fill,CONFIG_DEFAULT_TRACKING_TABLE_MAX_FILL);
+    rewriteConfigNumericalOption(state,"slowlog-shapes-max-len",server.slowlog_shapes_max_len,CONFIG_DEFAULT_SLOWLOG_SHAPES_MAX_LEN);
+    rewriteConfigNumericalOption(state,"slowlog-sample-ratio",server.slowlog_sample_ratio,CONFIG_DEFAULT_SLOWLOG_SAMPLE_RATIO);
+    rewriteConfigNumericalOption(state,"keyspace-stats-sample-ratio",server.keyspace_stats_sample_ratio,CONFIG_DEFAULT_KEYSPACE_STATS_SAMPLE_RATIO);
+    rewriteConfigStringOption(state,"keyspace-stats-prefixes",server.keyspace_stats_prefixes,NULL);
+    rewriteConfigNumericalOption(state,"tracking-table-max-keys",server.tracking_table_max_keys,CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS);
     rewriteConfigNotifykeyspaceeventsOption(state);
-    rewriteConfigNumericalOption(state,"hash-max-ziplist-entries",server.hash_max_ziplist_entries,OBJ_HASH_MAX_ZIPLIST_ENTRIES);
-    rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
+    rewriteConfigStringOption(state,"notify-keyspace-events-stream",server.notify_keyspace_events_stream,NULL);
+    rewriteConfigNumericalOption(state,"notify-keyspace-events-stream-maxlen",server.notify_keyspace_events_stream_maxlen,CONFIG_DEFAULT_NOTIFY_KEYSPACE_EVENTS_STREAM_MAXLEN);
+    rewriteConfigNumericalOption(state,"hash-max-listpack-entries",server.hash_max_listpack_entries,OBJ_HASH_MAX_LISTPACK_ENTRIES);
+    rewriteConfigNumericalOption(state,"hash-max-listpack-value",server.hash_max_listpack_value,OBJ_HASH_MAX_LISTPACK_VALUE);
     rewriteConfigNumericalOption(state,"stream-node-max-bytes",server.stream_node_max_bytes,OBJ_STREAM_NODE_MAX_BYTES);
     rewriteConfigNumericalOption(state,"stream-node-max-entries",server.stream_node_max_entries,OBJ_STREAM_NODE_MAX_ENTRIES);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigNumericalOption(state,"list-index-min-nodes",server.list_index_min_nodes,OBJ_LIST_INDEX_MIN_NODES);
+    rewriteConfigEnumOption(state,"list-compress-codec",server.list_compress_codec,list_compress_codec_enum,CONFIG_DEFAULT_LIST_COMPRESS_CODEC);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
-    rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
-    rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
+    rewriteConfigNumericalOption(state,"set-max-listpack-entries",server.set_max_listpack_entries,OBJ_SET_MAX_LISTPACK_ENTRIES);
+    rewriteConfigNumericalOption(state,"set-max-listpack-value",server.set_max_listpack_value,OBJ_SET_MAX_LISTPACK_VALUE);
+    rewriteConfigNumericalOption(state,"zset-max-listpack-entries",server.zset_max_listpack_entries,OBJ_ZSET_MAX_LISTPACK_ENTRIES);
+    rewriteConfigNumericalOption(state,"zset-max-listpack-value",server.zset_max_listpack_value,OBJ_ZSET_MAX_LISTPACK_VALUE);
+    rewriteConfigNumericalOption(state,"setops-incremental-threshold",server.setops_incremental_threshold,CONFIG_DEFAULT_SETOPS_INCREMENTAL_THRESHOLD);
+    rewriteConfigNumericalOption(state,"replies-incremental-threshold",server.replies_incremental_threshold,CONFIG_DEFAULT_REPLIES_INCREMENTAL_THRESHOLD);
+    rewriteConfigNumericalOption(state,"eventloop-latency-target",server.eventloop_latency_target,CONFIG_DEFAULT_EVENTLOOP_LATENCY_TARGET);
+    /* The old ziplist names are aliases of the listpack ones: blank them. */
+    rewriteConfigMarkAsProcessed(state,"hash-max-ziplist-entries");
+    rewriteConfigMarkAsProcessed(state,"hash-max-ziplist-value");
+    rewriteConfigMarkAsProcessed(state,"zset-max-ziplist-entries");
+    rewriteConfigMarkAsProcessed(state,"zset-max-ziplist-value");
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
+    rewriteConfigBytesOption(state,"bitmap-roaring-min-bytes",server.bitmap_roaring_min_bytes,CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES);
+    rewriteConfigBytesOption(state,"string-compression-threshold",server.string_compression_threshold,CONFIG_DEFAULT_STRING_COMPRESSION_THRESHOLD);
+    rewriteConfigStringOption(state,"string-compression-dict",server.string_compression_dict,CONFIG_DEFAULT_STRING_COMPRESSION_DICT);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
+    rewriteConfigYesNoOption(state,"active-defrag-thread",server.active_defrag_thread,CONFIG_DEFAULT_ACTIVE_DEFRAG_THREAD);
     rewriteConfigClientoutputbufferlimitOption(state);
+    rewriteConfigBytesOption(state,"client-output-buffer-spill-threshold",server.client_obuf_spill_threshold,CONFIG_DEFAULT_CLIENT_OBUF_SPILL_THRESHOLD);
+    rewriteConfigBytesOption(state,"client-output-buffer-spill-max-size",server.client_obuf_spill_max_size,CONFIG_DEFAULT_CLIENT_OBUF_SPILL_MAX_SIZE);
     rewriteConfigNumericalOption(state,"hz",server.config_hz,CONFIG_DEFAULT_HZ);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
     rewriteConfigNumericalOption(state,"rdb-key-save-delay",server.rdb_key_save_delay,CONFIG_DEFAULT_RDB_KEY_SAVE_DELAY);
     rewriteConfigNumericalOption(state,"key-load-delay",server.key_load_delay,CONFIG_DEFAULT_KEY_LOAD_DELAY);
+    rewriteConfigNumericalOption(state,"rdb-load-threads",server.rdb_load_threads,CONFIG_DEFAULT_RDB_LOAD_THREADS);
+    rewriteConfigNumericalOption(state,"rdb-save-threads",server.rdb_save_threads,CONFIG_DEFAULT_RDB_SAVE_THREADS);
 #ifdef USE_OPENSSL
     rewriteConfigYesNoOption(state,"tls-cluster",server.tls_cluster,0);
     rewriteConfigYesNoOption(state,"tls-replication",server.tls_replication,0);
@@ -2384,6 +3065,10 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"tls-ciphers",server.tls_ctx_config.ciphers,NULL);
     rewriteConfigStringOption(state,"tls-ciphersuites",server.tls_ctx_config.ciphersuites,NULL);
     rewriteConfigYesNoOption(state,"tls-prefer-server-ciphers",server.tls_ctx_config.prefer_server_ciphers,0);
+    rewriteConfigYesNoOption(state,"tls-ktls",server.tls_ctx_config.ktls,0);
+    rewriteConfigYesNoOption(state,"tls-session-caching",server.tls_ctx_config.session_caching,CONFIG_DEFAULT_TLS_SESSION_CACHING);
+    rewriteConfigNumericalOption(state,"tls-session-cache-size",server.tls_ctx_config.session_cache_size,CONFIG_DEFAULT_TLS_SESSION_CACHE_SIZE);
+    rewriteConfigNumericalOption(state,"tls-session-cache-timeout",server.tls_ctx_config.session_cache_timeout,CONFIG_DEFAULT_TLS_SESSION_CACHE_TIMEOUT);
 #endif
 
     /* Rewrite Sentinel config if in Sentinel mode. */
@@ -2437,6 +3122,11 @@ NULL
             addReplyError(c,"The server is running without a config file");
             return;
         }
+        if (server.shards > 1) {
+            addReplyError(c,"The config file is shared by all the shards, "
+                            "CONFIG REWRITE is not supported with shards");
+            return;
+        }
         if (rewriteConfig(server.configfile) == -1) {
             serverLog(LL_WARNING,"CONFIG REWRITE failed: %s", strerror(errno));
             addReplyErrorFormat(c,"Rewriting config file: %s", strerror(errno));
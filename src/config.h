@@ -78,6 +78,17 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* The io_uring backend is opt-in (make USE_IOURING=yes): it requires
+ * Linux 6.1 or greater, otherwise ae_iouring.c falls back to epoll. */
+#if defined(__linux__) && defined(USE_IOURING)
+#define HAVE_IOURING 1
+#endif
+
+/* Static tracepoints are opt-in (make USE_USDT=yes), see trace.h. */
+#ifdef USE_USDT
+#define HAVE_USDT 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -226,4 +237,20 @@ void setproctitle(const char *fmt, ...);
 #define USE_ALIGNED_ACCESS
 #endif
 
+/* SIMD kernels of the bit operations, selected at runtime according to the
+ * CPU features (see bitops.c). The compiler needs to support the target
+ * function attribute and __builtin_cpu_supports(). */
+#if defined(__x86_64__) && !defined(NO_SIMD) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Binding the threads and the child processes to a list of CPUs, see
+ * setcpuaffinity.c. */
+#ifdef __linux__
+#define USE_SETCPUAFFINITY
+int setcpuaffinity(const char *cpulist);
+int cpulistnth(const char *cpulist, int n);
+#endif
+
 #endif
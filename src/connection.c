@@ -30,6 +30,10 @@
 #include "server.h"
 #include "connhelpers.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 /* The connections module provides a lean abstraction of network connections
  * to avoid direct socket and async event management across the Redis code base.
  *
@@ -170,6 +174,32 @@ static int connSocketWrite(connection *conn, const void *data, size_t data_len)
     return ret;
 }
 
+static int connSocketWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    int ret = writev(conn->fd, iov, iovcnt);
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+        conn->state = CONN_STATE_ERROR;
+    }
+
+    return ret;
+}
+
+static int connSocketSendfile(connection *conn, int fd, off_t offset, size_t count) {
+#ifdef __linux__
+    int ret = sendfile(conn->fd, fd, &offset, count);
+#else
+    char buf[PROTO_IOBUF_LEN];
+    int ret = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (ret > 0) ret = write(conn->fd, buf, ret);
+#endif
+    if (ret < 0 && errno != EAGAIN) {
+        conn->last_errno = errno;
+        conn->state = CONN_STATE_ERROR;
+    }
+
+    return ret;
+}
+
 static int connSocketRead(connection *conn, void *buf, size_t buf_len) {
     int ret = read(conn->fd, buf, buf_len);
     if (!ret) {
@@ -324,6 +354,8 @@ ConnectionType CT_Socket = {
     .ae_handler = connSocketEventHandler,
     .close = connSocketClose,
     .write = connSocketWrite,
+    .writev = connSocketWritev,
+    .sendfile = connSocketSendfile,
     .read = connSocketRead,
     .accept = connSocketAccept,
     .connect = connSocketConnect,
@@ -31,6 +31,8 @@
 #ifndef __REDIS_CONNECTION_H
 #define __REDIS_CONNECTION_H
 
+#include <sys/uio.h>
+
 #define CONN_INFO_LEN   32
 
 struct aeEventLoop;
@@ -48,6 +50,7 @@ typedef enum {
 #define CONN_FLAG_IN_HANDLER        (1<<0)      /* A handler execution is in progress */
 #define CONN_FLAG_CLOSE_SCHEDULED   (1<<1)      /* Closed scheduled by a handler */
 #define CONN_FLAG_WRITE_BARRIER     (1<<2)      /* Write barrier requested */
+#define CONN_FLAG_SOCKET_READY      (1<<3)      /* Socket options already set */
 
 typedef void (*ConnectionCallbackFunc)(struct connection *conn);
 
@@ -55,6 +58,8 @@ typedef struct ConnectionType {
     void (*ae_handler)(struct aeEventLoop *el, int fd, void *clientData, int mask);
     int (*connect)(struct connection *conn, const char *addr, int port, const char *source_addr, ConnectionCallbackFunc connect_handler);
     int (*write)(struct connection *conn, const void *data, size_t data_len);
+    int (*writev)(struct connection *conn, const struct iovec *iov, int iovcnt);
+    int (*sendfile)(struct connection *conn, int fd, off_t offset, size_t count);
     int (*read)(struct connection *conn, void *buf, size_t buf_len);
     void (*close)(struct connection *conn);
     int (*accept)(struct connection *conn, ConnectionCallbackFunc accept_handler);
@@ -129,6 +134,26 @@ static inline int connWrite(connection *conn, const void *data, size_t data_len)
     return conn->type->write(conn, data, data_len);
 }
 
+/* Gather write to connection, behaves the same as writev(2).
+ *
+ * Like connWrite(), a short write is possible and the caller should check
+ * the connection state instead of relying on errno.
+ */
+static inline int connWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    return conn->type->writev(conn, iov, iovcnt);
+}
+
+/* Write 'count' bytes of the file 'fd' starting at 'offset' to the
+ * connection, behaves like sendfile(2) without changing the file offset.
+ *
+ * Like connWrite(), a short write is possible and the caller should check
+ * the connection state instead of relying on errno. A return value of 0
+ * means the file ended before 'offset'.
+ */
+static inline int connSendfile(connection *conn, int fd, off_t offset, size_t count) {
+    return conn->type->sendfile(conn, fd, offset, count);
+}
+
 /* Read from the connection, behaves the same as read(2).
  * 
  * Like read(2), a short read is possible.  A return value of 0 will indicate the
@@ -193,6 +218,8 @@ connection *connCreateAcceptedSocket(int fd);
 connection *connCreateTLS();
 connection *connCreateAcceptedTLS(int fd, int require_auth);
 
+connection *connCreateAcceptedShm(int fd);
+
 void connSetPrivateData(connection *conn, void *data);
 void *connGetPrivateData(connection *conn);
 int connGetState(connection *conn);
@@ -216,5 +243,7 @@ const char *connGetInfo(connection *conn, char *buf, size_t buf_len);
 /* Helpers for tls special considerations */
 int tlsHasPendingData();
 void tlsProcessPendingData();
+void tlsProcessPendingHandshakes(void);
+void tlsHandshakeStep(connection *conn);
 
 #endif  /* __REDIS_CONNECTION_H */
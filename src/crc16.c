@@ -79,10 +79,43 @@ static const uint16_t crc16tab[256]= {
     0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0
 };
 
+/* Tables to process eight bytes per iteration ("slicing-by-8"): the entry
+ * 'i' of crc16tab8[k] is the CRC of the byte 'i' followed by 'k' zero bytes,
+ * so the first table is crc16tab itself. They are derived from crc16tab the
+ * first time crc16() is called. */
+static uint16_t crc16tab8[8][256];
+static int crc16tab8_ready = 0;
+
+static void crc16InitTables(void) {
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc16tab8[0][i] = crc16tab[i];
+        for (k = 1; k < 8; k++) {
+            uint16_t crc = crc16tab8[k-1][i];
+            crc16tab8[k][i] = (crc<<8) ^ crc16tab[crc>>8];
+        }
+    }
+    crc16tab8_ready = 1;
+}
+
 uint16_t crc16(const char *buf, int len) {
-    int counter;
+    const unsigned char *p = (const unsigned char*)buf;
     uint16_t crc = 0;
-    for (counter = 0; counter < len; counter++)
-            crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *buf++)&0x00FF];
+
+    if (len >= 8) {
+        if (!crc16tab8_ready) crc16InitTables();
+        while (len >= 8) {
+            crc = crc16tab8[7][p[0] ^ (crc>>8)] ^
+                  crc16tab8[6][p[1] ^ (crc&0xff)] ^
+                  crc16tab8[5][p[2]] ^ crc16tab8[4][p[3]] ^
+                  crc16tab8[3][p[4]] ^ crc16tab8[2][p[5]] ^
+                  crc16tab8[1][p[6]] ^ crc16tab8[0][p[7]];
+            p += 8;
+            len -= 8;
+        }
+    }
+    while (len--)
+        crc = (crc<<8) ^ crc16tab[((crc>>8) ^ *p++)&0x00FF];
     return crc;
 }
@@ -38,6 +38,14 @@
  * POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "crc64.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_CRC64_CLMUL 1
+#include <immintrin.h>
+#endif
 
 static const uint64_t crc64_tab[256] = {
     UINT64_C(0x0000000000000000), UINT64_C(0x7ad870c830358979),
@@ -170,7 +178,66 @@ static const uint64_t crc64_tab[256] = {
     UINT64_C(0x536fa08fdfd90e51), UINT64_C(0x29b7d047efec8728),
 };
 
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+/* The table above is the first of the tables used by crc64() to process
+ * eight bytes at a time ("slicing by 8"): crc64_slice[k][n] is the CRC
+ * update of the byte n followed by k zero bytes. On CPUs with the carry-less
+ * multiplication instruction, long inputs are instead folded 64 bytes at a
+ * time with PCLMULQDQ, and only the final 16 bytes go through the tables.
+ *
+ * All the tables and constants are computed by crc64_init(), that is called
+ * at startup. Before it is called crc64() processes a byte at a time, so
+ * that the result never depends on it. */
+#define CRC64_POLY_REV UINT64_C(0x95ac9329ac4bc9b5) /* Reflected polynomial. */
+#define CRC64_CLMUL_MIN_LEN 128     /* Shorter inputs just use the tables. */
+
+static uint64_t crc64_slice[8][256];
+static int crc64_initialized = 0;
+static int crc64_clmul = 0;
+/* Folding constants: x^(d+63) and x^(d-1) modulo the polynomial, for a
+ * distance 'd' of 128 and 512 bits. */
+static uint64_t crc64_k128[2], crc64_k512[2];
+
+/* The CRC state is a polynomial of degree lower than 64 modulo the CRC
+ * polynomial, in reflected form: bit 63 is the coefficient of x^0. Return
+ * the state multiplied by x. */
+static uint64_t crc64MulX(uint64_t a) {
+    return (a >> 1) ^ ((a & 1) ? CRC64_POLY_REV : 0);
+}
+
+/* Return a*b modulo the CRC polynomial, in reflected form. */
+static uint64_t crc64GfMul(uint64_t a, uint64_t b) {
+    uint64_t prod = 0;
+
+    for (int j = 63; j >= 0; j--) {
+        if ((a >> j) & 1) prod ^= b;
+        b = crc64MulX(b);
+    }
+    return prod;
+}
+
+/* Return x^n modulo the CRC polynomial, in reflected form. */
+static uint64_t crc64XPow(uint64_t n) {
+    uint64_t res = UINT64_C(1) << 63, base = UINT64_C(1) << 62;
+
+    while (n) {
+        if (n & 1) res = crc64GfMul(res,base);
+        base = crc64GfMul(base,base);
+        n >>= 1;
+    }
+    return res;
+}
+
+/* Return the CRC of the concatenation of two buffers, given the CRC of
+ * the first one, 'crc1', the CRC of the second one computed starting
+ * from zero, 'crc2', and the length of the second one. This allows the
+ * checksum of different parts of the data to be computed in parallel.
+ * The cost is logarithmic with 'len2'. */
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+    if (len2 == 0) return crc1;
+    return crc64GfMul(crc1,crc64XPow(len2*8)) ^ crc2;
+}
+
+static uint64_t crc64Bytes(uint64_t crc, const unsigned char *s, uint64_t l) {
     uint64_t j;
 
     for (j = 0; j < l; j++) {
@@ -180,16 +247,151 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crc;
 }
 
+static uint64_t crc64Slice8(uint64_t crc, const unsigned char *s, uint64_t l) {
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    while (l >= 8) {
+        uint64_t v;
+        memcpy(&v,s,8);
+        crc ^= v;
+        crc = crc64_slice[7][crc & 0xff] ^
+              crc64_slice[6][(crc >> 8) & 0xff] ^
+              crc64_slice[5][(crc >> 16) & 0xff] ^
+              crc64_slice[4][(crc >> 24) & 0xff] ^
+              crc64_slice[3][(crc >> 32) & 0xff] ^
+              crc64_slice[2][(crc >> 40) & 0xff] ^
+              crc64_slice[1][(crc >> 48) & 0xff] ^
+              crc64_slice[0][crc >> 56];
+        s += 8;
+        l -= 8;
+    }
+#endif
+    return crc64Bytes(crc,s,l);
+}
+
+#ifdef HAVE_CRC64_CLMUL
+#define CRC64_CLMUL_TARGET __attribute__((target("pclmul,sse2")))
+
+/* Return a block equivalent, for the CRC, to the block 'x' followed by 'd'
+ * zero bits, with 'k' the constants for the distance 'd'. */
+static inline CRC64_CLMUL_TARGET __m128i crc64Fold(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),
+                         _mm_clmulepi64_si128(x,k,0x11));
+}
+
+/* Fold the input, at least 64 bytes long, into four 16 bytes lanes, that
+ * are then folded into a single block. The final block and the remaining
+ * bytes are processed with the tables. */
+static CRC64_CLMUL_TARGET uint64_t crc64Clmul(uint64_t crc,
+    const unsigned char *s, uint64_t l)
+{
+    const __m128i k128 = _mm_set_epi64x(crc64_k128[1],crc64_k128[0]);
+    const __m128i k512 = _mm_set_epi64x(crc64_k512[1],crc64_k512[0]);
+    __m128i x0, x1, x2, x3;
+    unsigned char buf[16];
+
+    /* Starting from a non zero state is like xoring it with the first
+     * eight bytes of the input. */
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)s),
+                       _mm_set_epi64x(0,crc));
+    x1 = _mm_loadu_si128((const __m128i*)(s+16));
+    x2 = _mm_loadu_si128((const __m128i*)(s+32));
+    x3 = _mm_loadu_si128((const __m128i*)(s+48));
+    s += 64;
+    l -= 64;
+    while (l >= 64) {
+        x0 = _mm_xor_si128(crc64Fold(x0,k512),
+                           _mm_loadu_si128((const __m128i*)s));
+        x1 = _mm_xor_si128(crc64Fold(x1,k512),
+                           _mm_loadu_si128((const __m128i*)(s+16)));
+        x2 = _mm_xor_si128(crc64Fold(x2,k512),
+                           _mm_loadu_si128((const __m128i*)(s+32)));
+        x3 = _mm_xor_si128(crc64Fold(x3,k512),
+                           _mm_loadu_si128((const __m128i*)(s+48)));
+        s += 64;
+        l -= 64;
+    }
+    x1 = _mm_xor_si128(crc64Fold(x0,k128),x1);
+    x2 = _mm_xor_si128(crc64Fold(x1,k128),x2);
+    x0 = _mm_xor_si128(crc64Fold(x2,k128),x3);
+    while (l >= 16) {
+        x0 = _mm_xor_si128(crc64Fold(x0,k128),
+                           _mm_loadu_si128((const __m128i*)s));
+        s += 16;
+        l -= 16;
+    }
+    _mm_storeu_si128((__m128i*)buf,x0);
+    crc = crc64Slice8(0,buf,sizeof(buf));
+    return crc64Slice8(crc,s,l);
+}
+#endif
+
+/* Compute the tables and constants used by crc64(), and check if the CPU
+ * supports the carry-less multiplication. Should be called once at startup,
+ * before any other thread may call crc64(). */
+void crc64_init(void) {
+    if (crc64_initialized) return;
+    for (int n = 0; n < 256; n++) {
+        crc64_slice[0][n] = crc64_tab[n];
+        for (int k = 1; k < 8; k++) {
+            uint64_t c = crc64_slice[k-1][n];
+            crc64_slice[k][n] = crc64_tab[c & 0xff] ^ (c >> 8);
+        }
+    }
+    crc64_k128[0] = crc64XPow(128+63);
+    crc64_k128[1] = crc64XPow(128-1);
+    crc64_k512[0] = crc64XPow(512+63);
+    crc64_k512[1] = crc64XPow(512-1);
+#if defined(HAVE_CRC64_CLMUL) && (BYTE_ORDER == LITTLE_ENDIAN)
+    __builtin_cpu_init();
+    crc64_clmul = __builtin_cpu_supports("pclmul") &&
+                  __builtin_cpu_supports("sse2");
+#endif
+    crc64_initialized = 1;
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+    if (!crc64_initialized) return crc64Bytes(crc,s,l);
+#ifdef HAVE_CRC64_CLMUL
+    if (crc64_clmul && l >= CRC64_CLMUL_MIN_LEN) return crc64Clmul(crc,s,l);
+#endif
+    return crc64Slice8(crc,s,l);
+}
+
 /* Test main */
 #ifdef REDIS_TEST
 #include <stdio.h>
+#include <stdlib.h>
 
 #define UNUSED(x) (void)(x)
 int crc64Test(int argc, char *argv[]) {
     UNUSED(argc);
     UNUSED(argv);
+    unsigned char buf[4096+64];
+    int errors = 0;
+
     printf("e9c6d914c4b8d9ca == %016llx\n",
         (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
-    return 0;
+    crc64_init();
+    printf("e9c6d914c4b8d9ca == %016llx\n",
+        (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
+
+    /* Every implementation, starting from any state and at any alignment,
+     * must return the same CRC of the byte at a time one. */
+    for (size_t j = 0; j < sizeof(buf); j++) buf[j] = rand();
+    for (int j = 0; j < 10000; j++) {
+        uint64_t off = rand() % 64, len = rand() % 4097, split;
+        uint64_t init = j & 1 ? ((uint64_t)rand() << 32) ^ rand() : 0;
+        uint64_t expected = crc64Bytes(init,buf+off,len);
+
+        if (crc64(init,buf+off,len) != expected ||
+            crc64Slice8(init,buf+off,len) != expected) errors++;
+        split = len ? rand() % len : 0;
+        if (crc64_combine(crc64(init,buf+off,split),
+                          crc64(0,buf+off+split,len-split),
+                          len-split) != expected) errors++;
+    }
+    printf("crc64 implementations: %s (%s)\n", errors ? "FAILED" : "OK",
+        crc64_clmul ? "clmul" : "slice-by-8");
+    return errors != 0;
 }
 #endif
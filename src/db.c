@@ -30,6 +30,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "atomicvar.h"
+#include "bio.h"
 
 #include <signal.h>
 #include <ctype.h>
@@ -57,9 +58,26 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
     if (de) {
         robj *val = dictGetVal(de);
 
+        /* A fork-less save must write the key before the caller can modify
+         * it. Commands executed by I/O threads are read only. */
+        if (server.rdb_forkless && !server.io_threads_executing)
+            rdbForklessSaveEntry(db,de);
+
+        /* The values in the tiered storage are read synchronously, unless
+         * tieredBlockForValues() read them in the background before the
+         * command was executed. I/O threads never execute commands against
+         * such values, see ioThreadCanExecuteCommand(). */
+        if (val->encoding == OBJ_ENCODING_SWAPPED) val = tieredSwapIn(db,de);
+
         /* Update the access time for the ageing algorithm.
          * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
+         * a copy on write madness.
+         *
+         * Note that this is also performed by I/O threads executing read
+         * only commands: concurrent updates of the same object may race,
+         * however the other bits sharing the word with 'lru' are never
+         * modified while I/O threads run, so the worst outcome is an
+         * inaccurate access time or a missed LFU increment. */
         if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
@@ -67,6 +85,26 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
                 val->lru = LRU_CLOCK();
             }
         }
+
+        /* Only the bit commands know about roaring bitmaps: the value is
+         * converted to a plain string for the other string commands. I/O
+         * threads never execute string commands against roaring bitmaps,
+         * see ioThreadCanExecuteCommand(). */
+        if (val->encoding == OBJ_ENCODING_ROARING &&
+            !server.io_threads_executing && server.executing_cmd &&
+            server.executing_cmd->flags & CMD_CATEGORY_STRING)
+        {
+            bitmapConvertToRaw(val);
+        }
+
+        /* The same for the compressed strings and the commands that can't
+         * read them, see strcompress.c. */
+        if (val->encoding == OBJ_ENCODING_COMPRESSED &&
+            !server.io_threads_executing && server.executing_cmd &&
+            stringCompressionCommandNeedsRaw(server.executing_cmd))
+        {
+            stringDecompress(val);
+        }
         return val;
     } else {
         return NULL;
@@ -104,6 +142,11 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
          * to return NULL ASAP. */
         if (server.masterhost == NULL) {
             server.stat_keyspace_misses++;
+            if (server.keyspace_stats_sample_ratio)
+                keyspaceStatsRecord(db,key,KEYSTATS_MISS);
+            if (server.maxmemory_shadow_sampling &&
+                !server.io_threads_executing)
+                evictionShadowAccess(key->ptr,0);
             notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
             return NULL;
         }
@@ -119,13 +162,18 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
          * to clients accessign expired values in a read-only fashion, that
          * will say the key as non existing.
          *
-         * Notably this covers GETs when slaves are used to scale reads. */
-        if (server.current_client &&
-            server.current_client != server.master &&
-            server.current_client->cmd &&
-            server.current_client->cmd->flags & CMD_READONLY)
+         * Notably this covers GETs when slaves are used to scale reads.
+         * Commands executed by I/O threads are always read only commands
+         * sent by normal clients, so the same applies to them. */
+        if (server.io_threads_executing ||
+            (server.current_client &&
+             server.current_client != server.master &&
+             server.current_client->cmd &&
+             server.current_client->cmd->flags & CMD_READONLY))
         {
             server.stat_keyspace_misses++;
+            if (server.keyspace_stats_sample_ratio)
+                keyspaceStatsRecord(db,key,KEYSTATS_MISS);
             notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
             return NULL;
         }
@@ -137,6 +185,12 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
     }
     else
         server.stat_keyspace_hits++;
+    if (server.keyspace_stats_sample_ratio)
+        keyspaceStatsRecord(db,key,val ? KEYSTATS_HIT : KEYSTATS_MISS);
+    /* The simulated cache is not thread safe: accesses performed by the
+     * I/O threads are not tracked. */
+    if (server.maxmemory_shadow_sampling && !server.io_threads_executing)
+        evictionShadowAccess(key->ptr,val != NULL);
     return val;
 }
 
@@ -146,6 +200,20 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
     return lookupKeyReadWithFlags(db,key,LOOKUP_NONE);
 }
 
+/* Bring in the cache the dictionary entries and the values of the keys
+ * keys[0], keys[step], keys[step*2] ... with a batched dictFindMany(), up to
+ * LOOKUP_PREFETCH_BATCH of the 'count' keys. Commands looking up many keys
+ * call it every LOOKUP_PREFETCH_BATCH keys, so that the lookups that follow
+ * don't wait for memory. */
+void lookupKeysPrefetch(redisDb *db, robj **keys, int count, int step) {
+    const void *k[LOOKUP_PREFETCH_BATCH];
+    dictEntry *entries[LOOKUP_PREFETCH_BATCH];
+
+    if (count > LOOKUP_PREFETCH_BATCH) count = LOOKUP_PREFETCH_BATCH;
+    for (int j = 0; j < count; j++) k[j] = keys[j*step]->ptr;
+    dictFindMany(db->dict,k,entries,count);
+}
+
 /* Lookup a key for write operations, and as a side effect, if needed, expires
  * the key if its TTL is reached.
  *
@@ -153,6 +221,8 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * does not exist in the specified DB. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
     expireIfNeeded(db,key);
+    if (server.keyspace_stats_sample_ratio)
+        keyspaceStatsRecord(db,key,KEYSTATS_WRITE);
     return lookupKey(db,key,flags);
 }
 
@@ -177,14 +247,20 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    if (db->keys_reply_jobs) replyFlushJobsOfDb(db);
 
-    serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    /* The dict stores a copy of the key name in the entry itself. */
+    dictEntry *de = dictAddRaw(db->dict, key->ptr, NULL);
+
+    serverAssertWithInfo(NULL,key,de != NULL);
+    dictSetVal(db->dict, de, val);
+    /* New keys are not part of the fork-less save in progress, if any. */
+    dbKeyMeta(db,de)->snapshot_epoch = server.rdb_forkless_epoch;
     if (val->type == OBJ_LIST ||
         val->type == OBJ_ZSET)
         signalKeyAsReady(db, key);
-    if (server.cluster_enabled) slotToKeyAdd(key);
+    if (server.cluster_enabled) slotToKeyAddEntry(db,de);
+    if (db->keys_index) keysIndexAdd(db,key->ptr);
 }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -196,8 +272,12 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     dictEntry *de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
-    dictEntry auxentry = *de;
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    dictEntry auxentry;
+    auxentry.v = de->v;
     robj *old = dictGetVal(de);
+    /* The field expires belong to the old value. */
+    if (old->type == OBJ_HASH) hashFieldExpiresDelKey(db,dictGetKey(de));
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
     }
@@ -241,7 +321,7 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dictSize(db->dict) == expireIndexSize(db->expires);
 
     while(1) {
         sds key;
@@ -252,7 +332,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (dbKeyMeta(db,de)->expire_pos) {
             if (allvolatile && server.masterhost && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
@@ -275,11 +355,18 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        if (server.cluster_enabled) slotToKeyDel(key);
+    if (db->keys_reply_jobs) replyFlushJobsOfDb(db);
+
+    /* The entry is unlinked first, so that its expire, if any, can be
+     * dropped from the expire index before the entry is released. */
+    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    if (de) {
+        if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+        expireIndexRemoveEntry(db,de);
+        hashFieldExpiresDelKey(db,dictGetKey(de));
+        if (server.cluster_enabled) slotToKeyDelEntry(db,de);
+        if (db->keys_index) keysIndexDel(db,dictGetKey(de));
+        dictFreeUnlinkedEntry(db->dict,de);
         return 1;
     } else {
         return 0;
@@ -374,20 +461,23 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
     }
 
     for (int j = startdb; j <= enddb; j++) {
+        /* A fork-less save must write the keys before they go away. */
+        if (server.rdb_forkless && dbarray == server.db) rdbForklessSaveDb(j);
+        if (dbarray == server.db) {
+            migrateAbortJobs(&dbarray[j]);
+            setopResetJobs(&dbarray[j]);
+            replyFlushAllJobs();
+        }
         removed += dictSize(dbarray[j].dict);
         if (async) {
             emptyDbAsync(&dbarray[j]);
         } else {
             dictEmpty(dbarray[j].dict,callback);
-            dictEmpty(dbarray[j].expires,callback);
-        }
-    }
-    if (server.cluster_enabled) {
-        if (async) {
-            slotToKeyFlushAsync();
-        } else {
-            slotToKeyFlush();
+            expireIndexEmpty(dbarray[j].expires);
         }
+        if (dbarray[j].slots_to_keys) slotToKeyFlush(&dbarray[j]);
+        if (dbarray[j].keys_index) keysIndexFlush(&dbarray[j],async);
+        dbMemoryAccountingReset(&dbarray[j]);
     }
     if (dbnum == -1) flushSlaveKeysWithExpireList();
 
@@ -432,11 +522,174 @@ long long dbTotalServerKeyCount() {
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
     trackingInvalidateKey(key);
+    hllUnionCacheInvalidateKey(db,key);
+    rdbDeltaTrackKey(db,key);
 }
 
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
     trackingInvalidateKeysOnFlush(dbid);
+    hllUnionCacheFlush(dbid);
+    rdbDeltaInvalidate();
+}
+
+/*-----------------------------------------------------------------------------
+ * Keyspace tables allocated in background
+ *
+ * When the keys dictionary of a DB grows, the new table must be allocated
+ * and zeroed before the incremental rehashing starts: with hundreds of
+ * millions of keys this takes hundreds of milliseconds. Tables over the
+ * keyspace-async-resize-threshold bytes are allocated by a bio thread
+ * instead, while the old table keeps receiving the new keys over its
+ * nominal load: the rehashing starts once the table is ready.
+ *
+ * dbDictExpandAllowed() is the expandAllowed() callback of the keys
+ * dictionaries, see dict.h: it also delays the growth that would take
+ * the memory over maxmemory, as long as the load is acceptable.
+ *----------------------------------------------------------------------------*/
+
+/* Over this load a table grows even if it takes the memory over
+ * maxmemory. The growth can't be delayed anyway once the load is over the
+ * dict_force_resize_ratio of dict.c. */
+#define DB_DICT_MAX_LOAD_FACTOR 1.618
+
+typedef struct dbDictResize {
+    dict *d;            /* Dict that will use the table. */
+    unsigned long size; /* Slots of the table. */
+    int openaddr;       /* Open addressing table. */
+    dictht table;       /* Set by the bio thread. */
+    int ready;          /* Set by the bio thread once 'table' is allocated. */
+} dbDictResize;
+
+static list *db_dict_resizes = NULL;
+
+/* Called by the bio thread for every BIO_DICT_ALLOC job. */
+void dbDictAllocFromBioThread(dbDictResize *r) {
+    dictAllocTable(&r->table,r->size,r->openaddr);
+    atomicSetWithSync(r->ready,1);
+}
+
+/* Return the DB using 'd' as keys dictionary, or NULL. */
+static redisDb *dbDictOwner(dict *d) {
+    for (int j = 0; j < server.dbnum; j++)
+        if (server.db[j].dict == d) return server.db+j;
+    return NULL;
+}
+
+/* Start rehashing to the table allocated for 'r', if still suitable, and
+ * release it otherwise. */
+static void dbDictResizeComplete(listNode *ln) {
+    dbDictResize *r = listNodeValue(ln);
+
+    redisDb *db = dbDictOwner(r->d);
+
+    /* The table was allocated by the bio thread: account it to the DB
+     * now that it uses it. */
+    if (!db || dictExpandWithTable(r->d,&r->table) == DICT_ERR) {
+        redisDb *prev = dbMemoryAccountingSwitch(NULL);
+        dictFreeTable(&r->table);
+        dbMemoryAccountingSwitch(prev);
+    } else {
+        dbMemoryAccount(db,dictTableBytes(r->size,r->openaddr));
+        server.stat_keyspace_async_resizes++;
+    }
+    listDelNode(db_dict_resizes,ln);
+    zfree(r);
+}
+
+int dbDictExpandAllowed(dict *d, unsigned long size, double load) {
+    size_t bytes = dictTableBytes(size,d->openaddr);
+    listIter li;
+    listNode *ln;
+    int ready;
+
+    if (server.maxmemory && load < DB_DICT_MAX_LOAD_FACTOR &&
+        zmalloc_used_memory()+bytes > server.maxmemory) return 0;
+    if (!server.keyspace_async_resize_threshold ||
+        bytes < (size_t)server.keyspace_async_resize_threshold ||
+        !dbDictOwner(d)) return 1;
+
+    if (db_dict_resizes == NULL) db_dict_resizes = listCreate();
+    listRewind(db_dict_resizes,&li);
+    while((ln = listNext(&li)) != NULL) {
+        dbDictResize *r = listNodeValue(ln);
+        if (r->d != d) continue;
+        atomicGetWithSync(r->ready,ready);
+        if (!ready) return 0;
+        dbDictResizeComplete(ln);
+        /* Allocate a new table if that one was not suitable. */
+        if (dictIsRehashing(d)) return 0;
+        break;
+    }
+
+    dbDictResize *r = zcalloc(sizeof(*r));
+    r->d = d;
+    r->size = size;
+    r->openaddr = d->openaddr;
+    listAddNodeTail(db_dict_resizes,r);
+    bioCreateBackgroundJob(BIO_DICT_ALLOC,r,NULL,NULL);
+    return 0;
+}
+
+/* Called by databasesCron(): start rehashing to the tables that are ready,
+ * without waiting for the next key to be added. Tables can't be used while
+ * a child process is active, to limit the copy-on-write: they are released
+ * only if their dict went away. */
+void dbDictResizeCron(void) {
+    listIter li;
+    listNode *ln;
+    int ready;
+
+    if (db_dict_resizes == NULL) return;
+    listRewind(db_dict_resizes,&li);
+    while((ln = listNext(&li)) != NULL) {
+        dbDictResize *r = listNodeValue(ln);
+        atomicGetWithSync(r->ready,ready);
+        if (ready && (!hasActiveChildProcess() || !dbDictOwner(r->d)))
+            dbDictResizeComplete(ln);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Locked keys
+ *
+ * A MIGRATE or a set operation executed in the background (see
+ * setopStartJob()) adds the keys it is working on to db->locked_keys, so
+ * that they are not modified before the command completes: the commands
+ * writing a locked key are refused with a -TRYAGAIN error.
+ *----------------------------------------------------------------------------*/
+
+/* Return 1 if the command writes a key locked by a command in progress.
+ * The EXEC of a transaction checks all its queued commands. */
+int commandTouchesLockedKeys(client *c) {
+    if (c->cmd->proc == execCommand) {
+        redisDb *db = c->db;
+        for (int j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+            if (mc->cmd->proc == selectCommand) {
+                long long id;
+                if (getLongLongFromObject(mc->argv[1],&id) == C_OK &&
+                    id >= 0 && id < server.dbnum) db = server.db+id;
+            } else if (keysLocked(db,mc->cmd,mc->argv,mc->argc)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return keysLocked(c->db,c->cmd,c->argv,c->argc);
+}
+
+int keysLocked(redisDb *db, struct redisCommand *cmd, robj **argv, int argc) {
+    int numkeys, *keys, locked = 0;
+
+    if (dictSize(db->locked_keys) == 0) return 0;
+    if (!(cmd->flags & CMD_WRITE) && cmd->proc != evalCommand &&
+        cmd->proc != evalShaCommand) return 0;
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (int j = 0; j < numkeys && !locked; j++)
+        locked = dictFind(db->locked_keys,argv[keys[j]]) != NULL;
+    getKeysFreeResult(keys);
+    return locked;
 }
 
 /*-----------------------------------------------------------------------------
@@ -467,6 +720,7 @@ int getFlushCommandFlags(client *c, int *flags) {
 
 /* Flushes the whole server data set. */
 void flushAllDataAndResetRDB(int flags) {
+    if (server.rdb_forkless) rdbForklessSaveAbort();
     server.dirty += emptyDb(-1,flags,NULL);
     if (server.rdb_child_pid != -1) killRDBChild();
     if (server.saveparamslen > 0) {
@@ -585,16 +839,104 @@ void randomkeyCommand(client *c) {
     decrRefCount(key);
 }
 
+/* State of a streamed reply of KEYS, see keysCommand(). */
+typedef struct keysReply {
+    sds pattern;            /* NULL to match all the keys. */
+    long long now;          /* Keys expired at this time are not replied. */
+    unsigned long numkeys;  /* Keys accumulated so far. */
+    list *chunks;           /* The bulk replies of the keys, as sds. */
+} keysReply;
+
+static void keysReplyFree(replyJob *job) {
+    keysReply *kr = job->state;
+
+    sdsfree(kr->pattern);
+    listRelease(kr->chunks);
+    zfree(kr);
+}
+
+static void keysScanCallback(void *privdata, const dictEntry *de) {
+    replyJob *job = privdata;
+    keysReply *kr = job->state;
+    sds key = dictGetKey(de), chunk;
+    char hdr[LONG_STR_SIZE+3];
+    long long when;
+    int hdrlen;
+
+    if (kr->pattern &&
+        !stringmatchlen(kr->pattern,sdslen(kr->pattern),key,sdslen(key),0))
+        return;
+    when = dbEntryGetExpire(job->db,(dictEntry*)de);
+    if (when >= 0 && kr->now > when) return;
+
+    chunk = listLength(kr->chunks) ? listNodeValue(listLast(kr->chunks)) :
+                                     NULL;
+    if (chunk == NULL || sdslen(chunk) >= PROTO_REPLY_CHUNK_BYTES) {
+        chunk = sdsMakeRoomFor(sdsempty(),PROTO_REPLY_CHUNK_BYTES);
+        listAddNodeTail(kr->chunks,chunk);
+    }
+    hdr[0] = '$';
+    hdrlen = 1+ll2string(hdr+1,sizeof(hdr)-1,sdslen(key));
+    hdr[hdrlen++] = '\r';
+    hdr[hdrlen++] = '\n';
+    chunk = sdscatlen(chunk,hdr,hdrlen);
+    chunk = sdscatlen(chunk,key,sdslen(key));
+    chunk = sdscatlen(chunk,"\r\n",2);
+    listNodeValue(listLast(kr->chunks)) = chunk;
+    kr->numkeys++;
+}
+
+/* Streamed reply of KEYS, see replyStartJob(). The keys can't be added or
+ * deleted meanwhile, and the keyspace is not shrunk, so that the cursor
+ * can't return a key twice even if the rehashing is not completed. */
+static int keysJobStep(replyJob *job, long long deadline) {
+    keysReply *kr = job->state;
+    listNode *ln;
+    int j = 0;
+
+    do {
+        job->cursor = dictScan(job->db->dict,job->cursor,keysScanCallback,
+                               NULL,job);
+        if (job->cursor == 0) break;
+    } while ((++j % 16) || !replyJobShouldPause(job,deadline));
+    if (job->cursor) return 0;
+
+    addReplyArrayLen(job->c,kr->numkeys);
+    while ((ln = listFirst(kr->chunks)) != NULL) {
+        sds chunk = listNodeValue(ln);
+        addReplyProto(job->c,chunk,sdslen(chunk));
+        listDelNode(kr->chunks,ln);
+    }
+    return 1;
+}
+
 void keysCommand(client *c) {
     dictIterator *di;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
-    void *replylen = addReplyDeferredLen(c);
+    void *replylen;
 
-    di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
+
+    /* A big keyspace is replied in the background. */
+    if (replyCanBeStreamed(c,dictSize(c->db->dict))) {
+        keysReply *kr = zmalloc(sizeof(*kr));
+        kr->pattern = allkeys ? NULL : sdsdup(pattern);
+        kr->now = expireReferenceTime();
+        kr->numkeys = 0;
+        kr->chunks = listCreate();
+        listSetFreeMethod(kr->chunks,(void (*)(void*))sdsfree);
+
+        replyJob *job = replyStartJob(c,NULL,0,0,keysJobStep);
+        job->state = kr;
+        job->free = keysReplyFree;
+        return;
+    }
+
+    replylen = addReplyDeferredLen(c);
+    di = dictGetSafeIterator(c->db->dict);
     while((de = dictNext(di)) != NULL) {
         sds key = dictGetKey(de);
         robj *keyobj;
@@ -612,6 +954,25 @@ void keysCommand(client *c) {
     setDeferredArrayLen(c,replylen,numkeys);
 }
 
+/* Filters of a SCAN of the keyspace. They are applied while the keys are
+ * collected, so that the keys not matching are not copied, and COUNT bounds
+ * the keys examined rather than the keys returned. */
+typedef struct scanKeyFilter {
+    sds pat;            /* MATCH pattern, NULL to match all the keys. */
+    sds typename;       /* TYPE, NULL to match all the types. */
+    long visited;       /* Keys examined so far. */
+} scanKeyFilter;
+
+static int scanKeyFilterMatch(scanKeyFilter *f, const char *key, size_t len,
+                              robj *val)
+{
+    if (f->pat && !stringmatchlen(f->pat,sdslen(f->pat),key,len,0))
+        return 0;
+    if (f->typename && strcasecmp(f->typename,getObjectTypeName(val)))
+        return 0;
+    return 1;
+}
+
 /* This callback is used by scanGenericCommand in order to collect elements
  * returned by the dictionary iterator into a list. */
 void scanCallback(void *privdata, const dictEntry *de) {
@@ -621,7 +982,11 @@ void scanCallback(void *privdata, const dictEntry *de) {
     robj *key, *val = NULL;
 
     if (o == NULL) {
+        scanKeyFilter *f = pd[2];
         sds sdskey = dictGetKey(de);
+        f->visited++;
+        if (!scanKeyFilterMatch(f,sdskey,sdslen(sdskey),dictGetVal(de)))
+            return;
         key = createStringObject(sdskey, sdslen(sdskey));
     } else if (o->type == OBJ_SET) {
         sds keysds = dictGetKey(de);
@@ -662,6 +1027,109 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor) {
     return C_OK;
 }
 
+/* SCAN of the keys index, see keyspace-ordered-index: a pattern with a
+ * literal prefix visits only the keys starting with it. The key where an
+ * iteration continues can't be encoded in the cursor, so it is remembered
+ * here, by cursor, until the next call. Only the most recent cursors are
+ * kept: an iteration using an older one is answered with an error. */
+#define SCAN_INDEX_MAX_CURSORS 1024
+
+static rax *scan_index_cursors = NULL;  /* Cursor (big endian) -> sds key. */
+static uint64_t scan_index_next_cursor = 1;
+
+/* Return the length of the literal prefix of the glob-style pattern. */
+static size_t scanPatternPrefixLen(sds pat) {
+    size_t len = strcspn(pat,"*?[\\");
+    return len < sdslen(pat) ? len : sdslen(pat);
+}
+
+/* Remember the key where an iteration continues, returning its cursor. */
+static unsigned long scanIndexSaveCursor(unsigned char *key, size_t len) {
+    unsigned char buf[8];
+    uint64_t id = scan_index_next_cursor++;
+
+    if (scan_index_cursors == NULL) scan_index_cursors = raxNew();
+    if (raxSize(scan_index_cursors) == SCAN_INDEX_MAX_CURSORS) {
+        raxIterator ri;
+        raxStart(&ri,scan_index_cursors);
+        raxSeek(&ri,"^",NULL,0);
+        raxNext(&ri);
+        sdsfree(ri.data);
+        raxRemove(scan_index_cursors,ri.key,ri.key_len,NULL);
+        raxStop(&ri);
+    }
+    id = htonu64(id);
+    memcpy(buf,&id,sizeof(buf));
+    raxInsert(scan_index_cursors,buf,sizeof(buf),sdsnewlen(key,len),NULL);
+    return scan_index_next_cursor-1;
+}
+
+/* Return the key where the iteration of 'cursor' continues, to be released
+ * by the caller, or NULL if the cursor is unknown. */
+static sds scanIndexTakeCursor(unsigned long cursor) {
+    unsigned char buf[8];
+    uint64_t id = htonu64((uint64_t)cursor);
+    void *key = NULL;
+
+    if (scan_index_cursors == NULL) return NULL;
+    memcpy(buf,&id,sizeof(buf));
+    raxRemove(scan_index_cursors,buf,sizeof(buf),&key);
+    return key;
+}
+
+/* Collect in 'keys' the keys matching 'f' starting with the 'prefixlen'
+ * bytes of the pattern, examining at most 'count' keys, and set 'cursor' to
+ * the cursor of the next call. Returns C_ERR after replying with an error. */
+static int scanKeysIndex(client *c, unsigned long *cursor, long count,
+                         scanKeyFilter *f, size_t prefixlen, list *keys)
+{
+    redisDb *db = c->db;
+    raxIterator ri;
+    sds next = NULL;
+
+    if (*cursor) {
+        next = scanIndexTakeCursor(*cursor);
+        if (next == NULL) {
+            addReplyError(c,"invalid or expired SCAN cursor");
+            return C_ERR;
+        }
+    }
+
+    raxStart(&ri,db->keys_index);
+    if (next)
+        raxSeek(&ri,">=",(unsigned char*)next,sdslen(next));
+    else
+        raxSeek(&ri,">=",(unsigned char*)f->pat,prefixlen);
+    sdsfree(next);
+
+    *cursor = 0;
+    while (raxNext(&ri)) {
+        if (ri.key_len < prefixlen || memcmp(ri.key,f->pat,prefixlen))
+            break;
+        if (f->visited == count) {
+            *cursor = scanIndexSaveCursor(ri.key,ri.key_len);
+            break;
+        }
+        f->visited++;
+        if (f->pat && !stringmatchlen(f->pat,sdslen(f->pat),(char*)ri.key,
+                                      ri.key_len,0)) continue;
+
+        robj *key = createStringObject((char*)ri.key,ri.key_len);
+        if (f->typename) {
+            dictEntry *de = dictFind(db->dict,key->ptr);
+            if (!de || !scanKeyFilterMatch(f,key->ptr,sdslen(key->ptr),
+                                           dictGetVal(de)))
+            {
+                decrRefCount(key);
+                continue;
+            }
+        }
+        listAddNodeTail(keys,key);
+    }
+    raxStop(&ri);
+    return C_OK;
+}
+
 /* This command implements SCAN, HSCAN and SSCAN commands.
  * If object 'o' is passed, then it must be a Hash, Set or Zset object, otherwise
  * if 'o' is NULL the command will operate on the dictionary associated with
@@ -682,6 +1150,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     sds typename = NULL;
     int patlen = 0, use_pattern = 0;
     dict *ht;
+    scanKeyFilter keyfilter = {NULL,NULL,0};
+    size_t prefixlen = 0;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
      * must be Set, Sorted Set, or Hash. */
@@ -728,12 +1198,20 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
+    /* The keyspace is filtered while the keys are collected. */
+    if (o == NULL) {
+        keyfilter.pat = use_pattern ? pat : NULL;
+        keyfilter.typename = typename;
+        if (keyfilter.pat) prefixlen = scanPatternPrefixLen(keyfilter.pat);
+        use_pattern = 0;
+    }
+
     /* Handle the case of a hash table. */
     ht = NULL;
     if (o == NULL) {
@@ -749,43 +1227,51 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
-        void *privdata[2];
+    if (o == NULL && c->db->keys_index && prefixlen) {
+        /* Handle the case of the keys index. */
+        if (scanKeysIndex(c,&cursor,count,&keyfilter,prefixlen,keys) == C_ERR)
+            goto cleanup;
+    } else if (ht) {
+        void *privdata[3];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
          * sparsely populated) we avoid to block too much time at the cost
          * of returning no or very few elements. */
         long maxiterations = count*10;
 
-        /* We pass two pointers to the callback: the list to which it will
-         * add new elements, and the object containing the dictionary so that
-         * it is possible to fetch more data in a type-dependent way. */
+        /* We pass three pointers to the callback: the list to which it will
+         * add new elements, the object containing the dictionary so that
+         * it is possible to fetch more data in a type-dependent way, and
+         * the filters of the keyspace. */
         privdata[0] = keys;
         privdata[1] = o;
+        privdata[2] = &keyfilter;
         do {
             cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
         } while (cursor &&
               maxiterations-- &&
-              listLength(keys) < (unsigned long)count);
-    } else if (o->type == OBJ_SET) {
+              (o ? (long)listLength(keys) : keyfilter.visited) < count);
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_INTSET) {
         int pos = 0;
         int64_t ll;
 
         while(intsetGet(o->ptr,pos++,&ll))
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
-    } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+    } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET ||
+               o->type == OBJ_SET)
+    {
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -814,13 +1300,6 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             }
         }
 
-        /* Filter an element if it isn't the type we want. */
-        if (!filter && o == NULL && typename){
-            robj* typecheck = lookupKeyReadWithFlags(c->db, kobj, LOOKUP_NOTOUCH);
-            char* type = getObjectTypeName(typecheck);
-            if (strcasecmp((char*) typename, type)) filter = 1;
-        }
-
         /* Filter element if it is an expired key. */
         if (!filter && o == NULL && expireIfNeeded(c->db, kobj)) filter = 1;
 
@@ -869,6 +1348,73 @@ void scanCommand(client *c) {
     scanGenericCommand(c,NULL,cursor);
 }
 
+/* Return true if the key name is after the upper bound of the range. */
+static int keyrangeAfterMax(unsigned char *key, size_t len,
+                            zlexrangespec *range)
+{
+    if (range->max == shared.maxstring) return 0;
+    if (range->max == shared.minstring) return 1;
+
+    size_t maxlen = sdslen(range->max);
+    int cmp = memcmp(key,range->max,len < maxlen ? len : maxlen);
+    if (cmp == 0) cmp = (len > maxlen) - (len < maxlen);
+    return range->maxex ? cmp >= 0 : cmp > 0;
+}
+
+/* KEYRANGE min max [LIMIT count]
+ *
+ * Return the key names in the lexicographic range, in order, with the
+ * ZRANGEBYLEX syntax for the range. It walks the keys index, so it requires
+ * keyspace-ordered-index, and takes O(log(N)+M) time. */
+void keyrangeCommand(client *c) {
+    redisDb *db = c->db;
+    zlexrangespec range;
+    long limit = -1;
+    unsigned long numkeys = 0;
+    raxIterator ri;
+
+    if (db->keys_index == NULL) {
+        addReplyError(c,"KEYRANGE requires keyspace-ordered-index to be "
+                        "enabled");
+        return;
+    }
+    if (c->argc == 5 && !strcasecmp(c->argv[3]->ptr,"limit")) {
+        if (getLongFromObjectOrReply(c,c->argv[4],&limit,NULL) != C_OK)
+            return;
+    } else if (c->argc != 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (zslParseLexRange(c->argv[1],c->argv[2],&range) != C_OK) {
+        addReplyError(c,"min or max not valid string range item");
+        return;
+    }
+
+    void *replylen = addReplyDeferredLen(c);
+    raxStart(&ri,db->keys_index);
+    /* The range is empty if min is "+": the iterator is left not seeked,
+     * that is at EOF. */
+    if (range.min == shared.minstring)
+        raxSeek(&ri,"^",NULL,0);
+    else if (range.min != shared.maxstring)
+        raxSeek(&ri,range.minex ? ">" : ">=",(unsigned char*)range.min,
+                sdslen(range.min));
+
+    while ((limit < 0 || numkeys < (unsigned long)limit) && raxNext(&ri)) {
+        if (keyrangeAfterMax(ri.key,ri.key_len,&range)) break;
+
+        robj *keyobj = createStringObject((char*)ri.key,ri.key_len);
+        if (!keyIsExpired(db,keyobj)) {
+            addReplyBulk(c,keyobj);
+            numkeys++;
+        }
+        decrRefCount(keyobj);
+    }
+    raxStop(&ri);
+    zslFreeLexRange(&range);
+    setDeferredArrayLen(c,replylen,numkeys);
+}
+
 void dbsizeCommand(client *c) {
     addReplyLongLong(c,dictSize(c->db->dict));
 }
@@ -934,7 +1480,7 @@ void shutdownCommand(client *c) {
 }
 
 void renameGenericCommand(client *c, int nx) {
-    robj *o;
+    robj *o, *fexpires;
     long long expire;
     int samekey = 0;
 
@@ -964,6 +1510,8 @@ void renameGenericCommand(client *c, int nx) {
     }
     dbAdd(c->db,c->argv[2],o);
     if (expire != -1) setExpire(c,c->db,c->argv[2],expire);
+    if ((fexpires = hashFieldExpiresDetach(c->db,c->argv[1]->ptr)) != NULL)
+        hashFieldExpiresAttach(c->db,c->argv[2]->ptr,fexpires);
     dbDelete(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[1]);
     signalModifiedKey(c->db,c->argv[2]);
@@ -984,7 +1532,7 @@ void renamenxCommand(client *c) {
 }
 
 void moveCommand(client *c) {
-    robj *o;
+    robj *o, *fexpires;
     redisDb *src, *dst;
     int srcid;
     long long dbid, expire;
@@ -1028,12 +1576,24 @@ void moveCommand(client *c) {
         addReply(c,shared.czero);
         return;
     }
+    /* The value is not copied: what it uses moves to the target DB. The
+     * entries of the key are accounted as the command goes. */
+    long long size = dbObjectMemory(o);
+    dbMemoryAccount(src,-size);
+    dbMemoryAccount(dst,size);
+
+    redisDb *prev = dbMemoryAccountingSwitch(dst);
     dbAdd(dst,c->argv[1],o);
     if (expire != -1) setExpire(c,dst,c->argv[1],expire);
+    if ((fexpires = hashFieldExpiresDetach(src,c->argv[1]->ptr)) != NULL)
+        hashFieldExpiresAttach(dst,c->argv[1]->ptr,fexpires);
     incrRefCount(o);
+    dbMemoryAccountingSwitch(prev);
 
     /* OK! key moved, free the entry in the source DB */
     dbDelete(src,c->argv[1]);
+    signalModifiedKey(src,c->argv[1]);
+    signalModifiedKey(dst,c->argv[1]);
     server.dirty++;
     addReply(c,shared.cone);
 }
@@ -1068,9 +1628,27 @@ int dbSwapDatabases(long id1, long id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    rdbDeltaInvalidate();
+    /* The keys of a fork-less save in progress are written with the ID of
+     * their DB: write them before they change DB. */
+    if (server.rdb_forkless) {
+        rdbForklessSaveDb(id1);
+        rdbForklessSaveDb(id2);
+    }
+    migrateAbortJobs(&server.db[id1]);
+    migrateAbortJobs(&server.db[id2]);
+    setopResetJobs(&server.db[id1]);
+    setopResetJobs(&server.db[id2]);
+    replyFlushJobsOfDb(&server.db[id1]);
+    replyFlushJobsOfDb(&server.db[id2]);
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
+    /* The watched keys are not swapped, so the ones existing in any of the
+     * two DBs are going to change. */
+    touchAllWatchedKeysInDb(db1,db2);
+    touchAllWatchedKeysInDb(db2,db1);
+
     /* Swap hash tables. Note that we don't swap blocking_keys,
      * ready_keys and watched_keys, since we want clients to
      * remain in the same DB they were. */
@@ -1078,11 +1656,15 @@ int dbSwapDatabases(long id1, long id2) {
     db1->expires = db2->expires;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
+    db1->keys_index = db2->keys_index;
+    db1->used_memory = db2->used_memory;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
+    db2->keys_index = aux.keys_index;
+    db2->used_memory = aux.used_memory;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1131,11 +1713,200 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* The expire index is a flat array of the keys having an expire. Keys are
+ * appended at the end, and removed by moving the last entry in the slot
+ * left free, so the array is always dense and the metadata of the keyspace
+ * entries stays a valid back reference to their position. */
+#define EXPIRE_INDEX_MIN_SIZE 16
+
+expireIndex *expireIndexCreate(void) {
+    expireIndex *ei = zmalloc(sizeof(*ei));
+    ei->entries = NULL;
+    ei->len = 0;
+    ei->size = 0;
+    ei->by_time = server.expire_time_index ? raxNew() : NULL;
+    ei->buckets = server.expire_time_index ? raxNew() : NULL;
+    ei->hfields = dictCreate(&hashFieldExpiresDictType,NULL);
+    ei->hfields_by_time = raxNew();
+    return ei;
+}
+
+void expireIndexRelease(expireIndex *ei) {
+    zfree(ei->entries);
+    if (ei->by_time) {
+        raxFree(ei->by_time);
+        raxFree(ei->buckets);
+    }
+    dictRelease(ei->hfields);
+    raxFree(ei->hfields_by_time);
+    zfree(ei);
+}
+
+/* Remove every entry from the index. The keyspace entries are expected to
+ * be released as well by the caller, so their metadata is not updated. */
+void expireIndexEmpty(expireIndex *ei) {
+    zfree(ei->entries);
+    ei->entries = NULL;
+    ei->len = 0;
+    ei->size = 0;
+    if (ei->by_time) {
+        raxFree(ei->by_time);
+        raxFree(ei->buckets);
+        ei->by_time = raxNew();
+        ei->buckets = raxNew();
+    }
+    if (dictSize(ei->hfields)) {
+        dictEmpty(ei->hfields,NULL);
+        raxFree(ei->hfields_by_time);
+        ei->hfields_by_time = raxNew();
+    }
+}
+
+/* Encode a 64 bit unsigned integer big endian into 'buf', so that the
+ * radix tree elements sort numerically. Negative expire times are
+ * already due anyway and are just stored as zero. */
+void expireTimeEncode(unsigned char *buf, long long when) {
+    uint64_t v = when < 0 ? 0 : (uint64_t)when;
+    for (int j = 7; j >= 0; j--) {
+        buf[j] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+long long expireTimeDecode(unsigned char *buf) {
+    uint64_t v = 0;
+    for (int j = 0; j < 8; j++) v = (v << 8) | buf[j];
+    return v;
+}
+
+/* Add or remove, according to 'incr' being 1 or -1, the key 'key' expiring
+ * at 'when' from the time index of 'ei'. */
+static void expireTimeIndexUpdate(expireIndex *ei, sds key, long long when,
+                                  int incr)
+{
+    unsigned char buf[64], *indexed = buf, bucket[8];
+    size_t keylen = sdslen(key);
+    void *count;
+
+    if (keylen+8 > sizeof(buf)) indexed = zmalloc(keylen+8);
+    expireTimeEncode(indexed,when);
+    memcpy(indexed+8,key,keylen);
+    if (incr > 0)
+        raxInsert(ei->by_time,indexed,keylen+8,NULL,NULL);
+    else
+        raxRemove(ei->by_time,indexed,keylen+8,NULL);
+    if (indexed != buf) zfree(indexed);
+
+    expireTimeEncode(bucket,when < 0 ? 0 : when >> EXPIRE_TIME_BUCKET_SHIFT);
+    count = raxFind(ei->buckets,bucket,sizeof(bucket));
+    if (count == raxNotFound) count = NULL;
+    count = (void*)((uintptr_t)count + incr);
+    if (count)
+        raxInsert(ei->buckets,bucket,sizeof(bucket),count,NULL);
+    else
+        raxRemove(ei->buckets,bucket,sizeof(bucket),NULL);
+}
+
+/* Return the key expiring first by the time index of 'ei', storing its
+ * name, that the caller should free, in '*key' and its expire time in
+ * '*when'. If there are no keys, 0 is returned. */
+int expireIndexFirstByTime(expireIndex *ei, long long *when, sds *key) {
+    raxIterator ri;
+    int found;
+
+    raxStart(&ri,ei->by_time);
+    raxSeek(&ri,"^",NULL,0);
+    if ((found = raxNext(&ri)) != 0) {
+        *when = expireTimeDecode(ri.key);
+        *key = sdsnewlen(ri.key+8,ri.key_len-8);
+    }
+    raxStop(&ri);
+    return found;
+}
+
+/* Return the number of keys of 'ei' whose expire time bucket completely
+ * elapsed at 'now', that is, roughly the number of keys that are already
+ * logically expired. */
+unsigned long expireIndexCountDue(expireIndex *ei, long long now) {
+    unsigned long due = 0;
+    raxIterator ri;
+
+    raxStart(&ri,ei->buckets);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        long long start = expireTimeDecode(ri.key) << EXPIRE_TIME_BUCKET_SHIFT;
+        if (start+EXPIRE_TIME_BUCKET_MS > now) break;
+        due += (uintptr_t)ri.data;
+    }
+    raxStop(&ri);
+    return due;
+}
+
+/* Make room for at least 'size' entries, as dictExpand() does. */
+void expireIndexExpand(expireIndex *ei, unsigned long size) {
+    if (size <= ei->size) return;
+    ei->entries = zrealloc(ei->entries,sizeof(expireEntry)*size);
+    ei->size = size;
+}
+
+static void expireIndexAdd(redisDb *db, dictEntry *de, long long when) {
+    expireIndex *ei = db->expires;
+
+    if (ei->len == ei->size)
+        expireIndexExpand(ei,ei->size ? ei->size*2 : EXPIRE_INDEX_MIN_SIZE);
+    ei->entries[ei->len].de = de;
+    ei->entries[ei->len].when = when;
+    dbKeyMeta(db,de)->expire_pos = ++ei->len;
+    if (ei->by_time) expireTimeIndexUpdate(ei,dictGetKey(de),when,1);
+}
+
+/* Remove the expire of the keyspace entry 'de' from the index, if any. */
+void expireIndexRemoveEntry(redisDb *db, dictEntry *de) {
+    expireIndex *ei = db->expires;
+    keyMeta *meta = dbKeyMeta(db,de);
+    unsigned long pos = meta->expire_pos;
+
+    if (pos == 0) return;
+    if (ei->by_time)
+        expireTimeIndexUpdate(ei,dictGetKey(de),ei->entries[pos-1].when,-1);
+    meta->expire_pos = 0;
+    ei->len--;
+    if (pos-1 != ei->len) {
+        ei->entries[pos-1] = ei->entries[ei->len];
+        dbKeyMeta(db,ei->entries[pos-1].de)->expire_pos = pos;
+    }
+
+    /* Give memory back once the index is mostly empty. */
+    if (ei->size > EXPIRE_INDEX_MIN_SIZE && ei->len < ei->size/4) {
+        ei->size /= 2;
+        ei->entries = zrealloc(ei->entries,sizeof(expireEntry)*ei->size);
+    }
+}
+
+/* Store up to 'count' keyspace entries having an expire into 'des',
+ * starting from a random position of the index, and return the number
+ * of entries stored. Like dictGetSomeKeys() the entries are contiguous
+ * in the index, which is fine to sample for eviction. */
+unsigned int expireIndexGetSomeKeys(expireIndex *ei, dictEntry **des, unsigned int count) {
+    unsigned long start, j;
+
+    if (ei->len == 0) return 0;
+    if (count > ei->len) count = ei->len;
+    start = random() % ei->len;
+    for (j = 0; j < count; j++)
+        des[j] = ei->entries[(start+j) % ei->len].de;
+    return count;
+}
+
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (dbKeyMeta(db,de)->expire_pos == 0) return 0;
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    expireIndexRemoveEntry(db,de);
+    return 1;
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1143,13 +1914,22 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *de;
+    unsigned long pos;
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
-    serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    de = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    if ((pos = dbKeyMeta(db,de)->expire_pos) != 0) {
+        expireEntry *ee = db->expires->entries+pos-1;
+        if (db->expires->by_time && ee->when != when) {
+            expireTimeIndexUpdate(db->expires,dictGetKey(de),ee->when,-1);
+            expireTimeIndexUpdate(db->expires,dictGetKey(de),when,1);
+        }
+        ee->when = when;
+    } else {
+        expireIndexAdd(db,de,when);
+    }
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1162,13 +1942,15 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+    if (expireIndexSize(db->expires) == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
+    return dbEntryGetExpire(db,de);
+}
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+/* Like getExpire() but for an entry of the keyspace dict of 'db'. */
+long long dbEntryGetExpire(redisDb *db, dictEntry *de) {
+    unsigned long pos = dbKeyMeta(db,de)->expire_pos;
+    return pos ? db->expires->entries[pos-1].when : -1;
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -1195,23 +1977,15 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     decrRefCount(argv[1]);
 }
 
-/* Check if the key is expired. */
-int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
-    mstime_t now;
-
-    if (when < 0) return 0; /* No expire for this key */
-
-    /* Don't expire anything while loading. It will be done later. */
-    if (server.loading) return 0;
-
+/* Return the time the expires are checked against, see keyIsExpired(). */
+long long expireReferenceTime(void) {
     /* If we are in the context of a Lua script, we pretend that time is
      * blocked to when the Lua script started. This way a key can expire
      * only the first time it is accessed and not in the middle of the
      * script execution, making propagation to slaves / AOF consistent.
      * See issue #1525 on Github for more information. */
     if (server.lua_caller) {
-        now = server.lua_time_start;
+        return server.lua_time_start;
     }
     /* If we are in the middle of a command execution, we still want to use
      * a reference time that does not change: in that case we just use the
@@ -1221,12 +1995,25 @@ int keyIsExpired(redisDb *db, robj *key) {
      * open object in a next call, if the next call will see the key expired,
      * while the first did not. */
     else if (server.fixed_time_expire > 0) {
-        now = server.mstime;
+        return server.mstime;
     }
     /* For the other cases, we want to use the most fresh time we have. */
     else {
-        now = mstime();
+        return mstime();
     }
+}
+
+/* Check if the key is expired. */
+int keyIsExpired(redisDb *db, robj *key) {
+    mstime_t when = getExpire(db,key);
+    mstime_t now;
+
+    if (when < 0) return 0; /* No expire for this key */
+
+    /* Don't expire anything while loading. It will be done later. */
+    if (server.loading) return 0;
+
+    now = expireReferenceTime();
 
     /* The key expired if the current (virtual or real) time is greater
      * than the expire time of the key. */
@@ -1253,7 +2040,12 @@ int keyIsExpired(redisDb *db, robj *key) {
  * The return value of the function is 0 if the key is still valid,
  * otherwise the function returns 1 if the key is expired. */
 int expireIfNeeded(redisDb *db, robj *key) {
-    if (!keyIsExpired(db,key)) return 0;
+    /* A hash not expired may still have fields to expire, in that case
+     * the key may even go away if all its fields expired. */
+    if (!keyIsExpired(db,key)) {
+        return dictSize(db->expires->hfields) ?
+               hashExpireFieldsIfNeeded(db,key) : 0;
+    }
 
     /* If we are running in the context of a slave, instead of
      * evicting the expired key from the database, we return ASAP:
@@ -1265,6 +2057,11 @@ int expireIfNeeded(redisDb *db, robj *key) {
      * we think the key is expired at this time. */
     if (server.masterhost != NULL) return 1;
 
+    /* If I/O threads are executing read only commands the dataset can't be
+     * modified: just report the key as expired, it will be deleted later
+     * by the main thread, lazily or by the active expire cycle. */
+    if (server.io_threads_executing) return 1;
+
     /* Delete the key */
     server.stat_expiredkeys++;
     propagateExpire(db,key,server.lazyfree_lazy_expire);
@@ -1340,6 +2137,35 @@ void getKeysFreeResult(int *result) {
     zfree(result);
 }
 
+/* Like getKeysFromCommand() for the command of the client 'c', but the keys
+ * are extracted just once and cached in the client, so that the checks
+ * processCommand() performs before executing the command, like the ACL and
+ * the cluster redirection, share them. The result must not be freed: it is
+ * valid until the command vector of the client changes, see
+ * resetClientCommandKeys(). The scripts reuse the same command vector of
+ * the Lua client for all their commands, so for them the keys are always
+ * extracted again. */
+int *getClientCommandKeys(client *c, int *numkeys) {
+    if (c->cmd_keys_cmd != c->cmd || c->flags & CLIENT_LUA) {
+        getKeysFreeResult(c->cmd_keys);
+        c->cmd_keys = getKeysFromCommand(c->cmd,c->argv,c->argc,
+                                         &c->cmd_numkeys);
+        c->cmd_keys_cmd = c->cmd;
+    }
+    *numkeys = c->cmd_numkeys;
+    return c->cmd_keys;
+}
+
+/* Forget the keys cached by getClientCommandKeys(): called every time the
+ * command vector of the client changes. */
+void resetClientCommandKeys(client *c) {
+    if (c->cmd_keys_cmd == NULL) return;
+    getKeysFreeResult(c->cmd_keys);
+    c->cmd_keys = NULL;
+    c->cmd_numkeys = 0;
+    c->cmd_keys_cmd = NULL;
+}
+
 /* Helper function to extract keys from following commands:
  * ZUNIONSTORE <destkey> <num-keys> <key> <key> ... <key> <options>
  * ZINTERSTORE <destkey> <num-keys> <key> <key> ... <key> <options> */
@@ -1554,84 +2380,164 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
- * understand if we have keys for a given hash slot. */
-void slotToKeyUpdateKey(robj *key, int add) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-    unsigned char buf[64];
-    unsigned char *indexed = buf;
-    size_t keylen = sdslen(key->ptr);
-
-    server.cluster->slots_keys_count[hashslot] += add ? 1 : -1;
-    if (keylen+2 > 64) indexed = zmalloc(keylen+2);
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    memcpy(indexed+2,key->ptr,keylen);
-    if (add) {
-        raxInsert(server.cluster->slots_to_keys,indexed,keylen+2,NULL,NULL);
-    } else {
-        raxRemove(server.cluster->slots_to_keys,indexed,keylen+2,NULL);
-    }
-    if (indexed != buf) zfree(indexed);
+ * understand if we have keys for a given hash slot.
+ *
+ * The keyspace entries of every slot form a doubly linked list, whose links
+ * are stored in the entry metadata after the keyMeta, so a key is added or
+ * removed in constant time and its name is not stored twice. */
+static clusterDictEntryMetadata *slotToKeyLinks(redisDb *db, dictEntry *de) {
+    return (clusterDictEntryMetadata*)(dbKeyMeta(db,de)+1);
+}
+
+/* Return the hash slot of the key. While a command runs its keys are known
+ * to be in the slot found by the cluster redirection check, that is reused
+ * instead of hashing the key again. */
+int getKeySlot(sds key) {
+    if (server.current_client && server.current_client->slot >= 0)
+        return server.current_client->slot;
+    return keyHashSlot(key,sdslen(key));
+}
+
+static slotToKeys *slotToKeysOfEntry(redisDb *db, dictEntry *de) {
+    return &db->slots_to_keys->by_slot[getKeySlot(dictGetKey(de))];
+}
+
+void slotToKeyInit(redisDb *db) {
+    db->slots_to_keys = zcalloc(sizeof(struct clusterSlotToKeyMapping));
+}
+
+/* Link a new keyspace entry at the head of the list of its slot. */
+void slotToKeyAddEntry(redisDb *db, dictEntry *de) {
+    slotToKeys *slot = slotToKeysOfEntry(db,de);
+    clusterDictEntryMetadata *links = slotToKeyLinks(db,de);
+
+    slot->count++;
+    links->prev = NULL;
+    links->next = slot->head;
+    if (slot->head)
+        slotToKeyLinks(db,slot->head)->prev = de;
+    slot->head = de;
+}
+
+/* Unlink a keyspace entry that is going to be released. */
+void slotToKeyDelEntry(redisDb *db, dictEntry *de) {
+    slotToKeys *slot = slotToKeysOfEntry(db,de);
+    clusterDictEntryMetadata *links = slotToKeyLinks(db,de);
+
+    slot->count--;
+    if (links->next)
+        slotToKeyLinks(db,links->next)->prev = links->prev;
+    if (links->prev)
+        slotToKeyLinks(db,links->prev)->next = links->next;
+    else
+        slot->head = links->next;
+}
+
+/* Update the links pointing to a keyspace entry that was moved in memory,
+ * for example by the active defragmentation. */
+void slotToKeyReplaceEntry(redisDb *db, dictEntry *de) {
+    clusterDictEntryMetadata *links = slotToKeyLinks(db,de);
+
+    if (links->next)
+        slotToKeyLinks(db,links->next)->prev = de;
+    if (links->prev)
+        slotToKeyLinks(db,links->prev)->next = de;
+    else
+        slotToKeysOfEntry(db,de)->head = de;
 }
 
-void slotToKeyAdd(robj *key) {
-    slotToKeyUpdateKey(key,1);
+/* Forget all the keys: called when the keyspace is emptied, the entries
+ * are released by the caller. */
+void slotToKeyFlush(redisDb *db) {
+    memset(db->slots_to_keys,0,sizeof(struct clusterSlotToKeyMapping));
 }
 
-void slotToKeyDel(robj *key) {
-    slotToKeyUpdateKey(key,0);
+void slotToKeyDestroy(redisDb *db) {
+    zfree(db->slots_to_keys);
+    db->slots_to_keys = NULL;
 }
 
-void slotToKeyFlush(void) {
-    raxFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
+/* Return the first keyspace entry of the slot, then calling slotToKeyNext()
+ * with the returned entry walks all the keys of the slot, NULL is returned
+ * at the end. The keys must not be added or deleted while iterating. */
+dictEntry *slotToKeyFirst(unsigned int hashslot) {
+    return server.db[0].slots_to_keys->by_slot[hashslot].head;
+}
+
+dictEntry *slotToKeyNext(dictEntry *de) {
+    return slotToKeyLinks(&server.db[0],de)->next;
 }
 
 /* Pupulate the specified array of objects with keys in the specified slot.
  * New objects are returned to represent keys, it's up to the caller to
  * decrement the reference count to release the keys names. */
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
+    redisDb *db = &server.db[0];
+    dictEntry *de = db->slots_to_keys->by_slot[hashslot].head;
+    unsigned int j = 0;
 
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    raxSeek(&iter,">=",indexed,2);
-    while(count-- && raxNext(&iter)) {
-        if (iter.key[0] != indexed[0] || iter.key[1] != indexed[1]) break;
-        keys[j++] = createStringObject((char*)iter.key+2,iter.key_len-2);
+    while(de && j < count) {
+        sds key = dictGetKey(de);
+        keys[j++] = createStringObject(key,sdslen(key));
+        de = slotToKeyLinks(db,de)->next;
     }
-    raxStop(&iter);
     return j;
 }
 
 /* Remove all the keys in the specified hash slot.
  * The number of removed items is returned. */
 unsigned int delKeysInSlot(unsigned int hashslot) {
-    raxIterator iter;
-    int j = 0;
-    unsigned char indexed[2];
-
-    indexed[0] = (hashslot >> 8) & 0xff;
-    indexed[1] = hashslot & 0xff;
-    raxStart(&iter,server.cluster->slots_to_keys);
-    while(server.cluster->slots_keys_count[hashslot]) {
-        raxSeek(&iter,">=",indexed,2);
-        raxNext(&iter);
-
-        robj *key = createStringObject((char*)iter.key+2,iter.key_len-2);
-        dbDelete(&server.db[0],key);
+    redisDb *db = &server.db[0];
+    slotToKeys *slot = &db->slots_to_keys->by_slot[hashslot];
+    unsigned int j = 0;
+
+    while(slot->head) {
+        sds name = dictGetKey(slot->head);
+        robj *key = createStringObject(name,sdslen(name));
+        dbDelete(db,key);
         decrRefCount(key);
         j++;
     }
-    raxStop(&iter);
     return j;
 }
 
 unsigned int countKeysInSlot(unsigned int hashslot) {
-    return server.cluster->slots_keys_count[hashslot];
+    return server.db[0].slots_to_keys->by_slot[hashslot].count;
+}
+
+/* -----------------------------------------------------------------------------
+ * Keys index
+ *
+ * With keyspace-ordered-index every DB keeps its key names in a radix tree
+ * too, in lexicographic order, so that SCAN with a MATCH pattern starting
+ * with a literal prefix only visits the keys with that prefix. See
+ * scanKeysIndex().
+ * ---------------------------------------------------------------------------*/
+
+void keysIndexInit(redisDb *db) {
+    db->keys_index = server.keyspace_ordered_index ? raxNew() : NULL;
+}
+
+void keysIndexAdd(redisDb *db, sds key) {
+    raxInsert(db->keys_index,(unsigned char*)key,sdslen(key),NULL,NULL);
+}
+
+void keysIndexDel(redisDb *db, sds key) {
+    raxRemove(db->keys_index,(unsigned char*)key,sdslen(key),NULL);
+}
+
+/* Forget all the keys: called when the keyspace is emptied. */
+void keysIndexFlush(redisDb *db, int async) {
+    rax *old = db->keys_index;
+
+    db->keys_index = raxNew();
+    if (async)
+        freeKeysIndexAsync(old);
+    else
+        raxFree(old);
+}
+
+void keysIndexDestroy(redisDb *db) {
+    raxFree(db->keys_index);
+    db->keys_index = NULL;
 }
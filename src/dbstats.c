@@ -0,0 +1,174 @@
+/* Per DB resource accounting, for the servers shared by several users, each
+ * one with its own DB.
+ *
+ * The memory used by the keys of every DB is kept up to date incrementally:
+ * the code adding, modifying or deleting keys runs with the DB it works on
+ * set as the accounting DB, see dbMemoryAccountingSwitch(), and the memory
+ * the main thread allocated minus the memory it freed in the meantime is
+ * charged to it. call() does this for the DB selected by the client, and the
+ * code working on the keys outside commands, like the expire and eviction
+ * cycles, for the DB they work on. The values freed by the lazyfree thread,
+ * or moved to another DB, are accounted with an estimate of their size.
+ *
+ * The memory of a DB is limited by the db-maxmemory option, see
+ * dbFreeMemoryIfNeeded() in evict.c, and the commands executed with a
+ * DB selected and their duration are counted as well, so that INFO dbstats
+ * reports what every DB costs.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Elements sampled by objectComputeSize() to estimate the size of the
+ * aggregate values accounted without tracking their allocations. */
+#define DBSTATS_SIZE_SAMPLES 5
+
+static redisDb *accounting_db = NULL; /* DB charged for the allocations. */
+static long long accounting_mark;     /* Thread memory when last charged. */
+
+/* Add 'delta' bytes, that may be negative, to the memory used by 'db'. The
+ * estimates may take it below zero, which makes no sense. */
+void dbMemoryAccount(redisDb *db, long long delta) {
+    db->used_memory += delta;
+    if (db->used_memory < 0) db->used_memory = 0;
+}
+
+/* Charge the memory allocated by the main thread so far to the accounting
+ * DB, and make 'db' the accounting DB, or stop accounting if it is NULL.
+ * The previous accounting DB is returned, so that nested code can restore
+ * it when done:
+ *
+ *      redisDb *prev = dbMemoryAccountingSwitch(db);
+ *      ... work on the keys of db ...
+ *      dbMemoryAccountingSwitch(prev);
+ */
+redisDb *dbMemoryAccountingSwitch(redisDb *db) {
+    redisDb *prev = accounting_db;
+    long long now = zmalloc_thread_used_memory();
+
+    if (prev) dbMemoryAccount(prev,now-accounting_mark);
+    accounting_db = db;
+    accounting_mark = now;
+    return prev;
+}
+
+/* Called when 'db' is emptied: what was allocated so far by the current
+ * accounting DB is charged before forgetting the memory of 'db'. */
+void dbMemoryAccountingReset(redisDb *db) {
+    dbMemoryAccountingSwitch(accounting_db);
+    db->used_memory = 0;
+}
+
+/* Estimate the memory used by a value, for the values that are freed by the
+ * lazyfree thread or change DB. The keys are not included: their entries
+ * are accounted as they are added and removed. */
+long long dbObjectMemory(robj *val) {
+    return objectComputeSize(val,DBSTATS_SIZE_SAMPLES);
+}
+
+/* Return the memory used by the arguments of a command, or only by the ones
+ * not referenced elsewhere if 'unshared' is true. The arguments are created
+ * before the command is called, and released after it returns, so call()
+ * accounts them explicitly: in the end only the ones the command stored in
+ * the keyspace count. */
+long long dbArgvMemory(robj **argv, int argc, int unshared) {
+    long long mem = 0;
+
+    for (int j = 0; j < argc; j++) {
+        robj *o = argv[j];
+
+        if (o->refcount == OBJ_SHARED_REFCOUNT) continue;
+        if (unshared && o->refcount > 1) continue;
+        mem += zmalloc_size(o);
+        if (o->encoding == OBJ_ENCODING_RAW) mem += sdsZmallocSize(o->ptr);
+        else if (o->encoding == OBJ_ENCODING_COMPRESSED)
+            mem += zmalloc_size(o->ptr);
+    }
+    return mem;
+}
+
+/* Return the db-maxmemory limit of 'db', or 0 if it has no limit. */
+unsigned long long dbGetMaxmemory(redisDb *db) {
+    if (db->id >= server.db_maxmemory_len) return 0;
+    return server.db_maxmemory[db->id];
+}
+
+/* Set the db-maxmemory limit of the DB with ID 'dbid'. The limits are
+ * kept by ID, and not in the DBs, since they are set while loading the
+ * configuration, before the DBs are created. */
+void dbSetMaxmemory(int dbid, unsigned long long bytes) {
+    if (dbid >= server.db_maxmemory_len) {
+        server.db_maxmemory = zrealloc(server.db_maxmemory,
+            sizeof(unsigned long long)*(dbid+1));
+        memset(server.db_maxmemory+server.db_maxmemory_len,0,
+            sizeof(unsigned long long)*(dbid+1-server.db_maxmemory_len));
+        server.db_maxmemory_len = dbid+1;
+    }
+    server.db_maxmemory[dbid] = bytes;
+}
+
+/* Called by databasesCron(): the allocations not related to the keys that
+ * happen while a DB is accounted, like the growth of the output buffers of
+ * the clients receiving keyspace events, make its memory drift over time.
+ * A DB without keys uses no memory, which is a good time to start again. */
+void dbStatsCron(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        if (db->used_memory && dictSize(db->dict) == 0 && db != accounting_db)
+            db->used_memory = 0;
+    }
+}
+
+/* Reset the counters, for CONFIG RESETSTAT. */
+void resetDbStats(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        server.db[j].stat_ops = 0;
+        server.db[j].stat_cpu_usec = 0;
+        server.db[j].stat_evictedkeys = 0;
+    }
+}
+
+/* Append the fields of the INFO dbstats section to 'info': only the DBs
+ * having keys, a memory limit, or that were used are reported. */
+sds genDbStatsInfoString(sds info) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        unsigned long long maxmemory = dbGetMaxmemory(db);
+
+        if (!dictSize(db->dict) && !maxmemory && !db->stat_ops &&
+            !db->used_memory) continue;
+        info = sdscatprintf(info,
+            "db%d:used_memory=%lld,maxmemory=%llu,ops=%lld,cpu_usec=%lld,"
+            "usec_per_op=%.2f,evicted_keys=%lld\r\n",
+            j, db->used_memory, maxmemory, db->stat_ops, db->stat_cpu_usec,
+            db->stat_ops ? (float)db->stat_cpu_usec/db->stat_ops : 0,
+            db->stat_evictedkeys);
+    }
+    return info;
+}
@@ -119,6 +119,14 @@ void mixStringObjectDigest(unsigned char *digest, robj *o) {
  * will continue mixing this object digest to anything that was already
  * present. */
 void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o) {
+    if (o->encoding == OBJ_ENCODING_SWAPPED) {
+        robj *val = tieredLoadValue(o,keyobj);
+        if (val == NULL) serverPanic("Can't read the tiered storage file");
+        xorObjectDigest(db,keyobj,digest,val);
+        decrRefCount(val);
+        return;
+    }
+
     uint32_t aux = htonl(o->type);
     mixDigest(digest,&aux,sizeof(aux));
     long long expiretime = getExpire(db,keyobj);
@@ -147,7 +155,7 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
     } else if (o->type == OBJ_ZSET) {
         unsigned char eledigest[20];
 
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = o->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -155,13 +163,13 @@ void xorObjectDigest(redisDb *db, robj *keyobj, unsigned char *digest, robj *o)
             long long vll;
             double score;
 
-            eptr = ziplistIndex(zl,0);
+            eptr = lpSeek(zl,0);
             serverAssert(eptr != NULL);
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssert(sptr != NULL);
 
             while (eptr != NULL) {
-                serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+                vstr = lpGetValue(eptr,&vlen,&vll);
                 score = zzlGetScore(sptr);
 
                 memset(eledigest,0,20);
@@ -364,12 +372,16 @@ void debugCommand(client *c) {
 "OBJECT <key> -- Show low level info about key and associated value.",
 "PANIC -- Crash the server simulating a panic.",
 "POPULATE <count> [prefix] [size] -- Create <count> string keys named key:<num>. If a prefix is specified is used instead of the 'key' prefix.",
+"PROFILE START <seconds> [HZ <hz>] -- Sample the stack of the main thread <hz> times per second of CPU time (default 99), for <seconds>.",
+"PROFILE STOP|STATUS -- Stop the profiler, or return its status.",
+"PROFILE RESULT -- Return the sampled stacks in the folded format of flamegraph.pl.",
 "RELOAD -- Save the RDB on disk and reload it back in memory.",
 "RESTART -- Graceful restart: save config, db, restart.",
 "SDSLEN <key> -- Show low level SDS string info representing key and value.",
 "SEGFAULT -- Crash the server with sigsegv.",
 "SET-ACTIVE-EXPIRE <0|1> -- Setting it to 0 disables expiring keys in background when they are not accessed (otherwise the Redis behavior). Setting it to 1 reenables back the default.",
 "AOF-FLUSH-SLEEP <microsec> -- Server will sleep before flushing the AOF, this is used for testing",
+"BITOPS-BENCHMARK <bytes> <iterations> -- Time the SIMD kernels of BITCOUNT, BITOP and BITPOS against the portable code.",
 "SLEEP <seconds> -- Stop the server for <seconds>. Decimals allowed.",
 "STRUCTSIZE -- Return the size of different Redis core C structures.",
 "ZIPLIST <key> -- Show low level info about the ziplist encoding.",
@@ -381,6 +393,8 @@ void debugCommand(client *c) {
 NULL
         };
         addReplyHelp(c, help);
+    } else if (!strcasecmp(c->argv[1]->ptr,"profile")) {
+        debugProfileCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"segfault")) {
         *((char*)-1) = 'x';
     } else if (!strcasecmp(c->argv[1]->ptr,"panic")) {
@@ -429,7 +443,7 @@ NULL
         if (server.aof_state != AOF_OFF) flushAppendOnlyFile(1);
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
         protectClient(c);
-        int ret = loadAppendOnlyFile(server.aof_filename);
+        int ret = loadAppendOnlyFiles();
         unprotectClient(c);
         if (ret != C_OK) {
             addReply(c,shared.err);
@@ -505,12 +519,16 @@ NULL
         if (val->type != OBJ_STRING || !sdsEncodedObject(val)) {
             addReplyError(c,"Not an sds encoded string.");
         } else {
+            /* Key names embedded in the dict entry are not allocations on
+             * their own: report the size of the entry holding the key. */
+            size_t key_zmalloc = dictHasEmbeddedKeys(c->db->dict) ?
+                                 zmalloc_size(de) : sdsZmallocSize(key);
             addReplyStatusFormat(c,
                 "key_sds_len:%lld, key_sds_avail:%lld, key_zmalloc: %lld, "
                 "val_sds_len:%lld, val_sds_avail:%lld, val_zmalloc: %lld",
                 (long long) sdslen(key),
                 (long long) sdsavail(key),
-                (long long) sdsZmallocSize(key),
+                (long long) key_zmalloc,
                 (long long) sdslen(val->ptr),
                 (long long) sdsavail(val->ptr),
                 (long long) getStringObjectSdsUsedMemory(val));
@@ -694,9 +712,11 @@ NULL
         dictGetStats(buf,sizeof(buf),server.db[dbid].dict);
         stats = sdscat(stats,buf);
 
-        stats = sdscatprintf(stats,"[Expires HT]\n");
-        dictGetStats(buf,sizeof(buf),server.db[dbid].expires);
-        stats = sdscat(stats,buf);
+        stats = sdscatprintf(stats,"[Expires index]\n"
+            " number of keys: %lu\n"
+            " allocated entries: %lu\n",
+            server.db[dbid].expires->len,
+            server.db[dbid].expires->size);
 
         addReplyVerbatim(c,stats,sdslen(stats),"txt");
         sdsfree(stats);
@@ -728,6 +748,19 @@ NULL
             dictGetStats(buf,sizeof(buf),ht);
             addReplyVerbatim(c,buf,strlen(buf),"txt");
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"bitops-benchmark") &&
+               c->argc == 4)
+    {
+        long long bytes, iterations;
+
+        if (getLongLongFromObjectOrReply(c,c->argv[2],&bytes,NULL) != C_OK ||
+            getLongLongFromObjectOrReply(c,c->argv[3],&iterations,NULL)
+            != C_OK) return;
+        if (bytes <= 0 || bytes > 512*1024*1024 || iterations <= 0) {
+            addReplyError(c,"Invalid number of bytes or iterations");
+            return;
+        }
+        bitopsBenchmark(c,bytes,iterations);
     } else if (!strcasecmp(c->argv[1]->ptr,"change-repl-id") && c->argc == 2) {
         serverLog(LL_WARNING,"Changing replication IDs after receiving DEBUG change-repl-id");
         changeReplicationId();
@@ -795,7 +828,11 @@ void serverLogObjectDebugInfo(const robj *o) {
     serverLog(LL_WARNING,"Object type: %d", o->type);
     serverLog(LL_WARNING,"Object encoding: %d", o->encoding);
     serverLog(LL_WARNING,"Object refcount: %d", o->refcount);
-    if (o->type == OBJ_STRING && sdsEncodedObject(o)) {
+    if (o->encoding == OBJ_ENCODING_SWAPPED) {
+        serverLog(LL_WARNING,"Tiered storage offset: %lld length: %zu",
+            (long long)((const tieredValue*)o->ptr)->offset,
+            ((const tieredValue*)o->ptr)->len);
+    } else if (o->type == OBJ_STRING && sdsEncodedObject(o)) {
         serverLog(LL_WARNING,"Object raw string len: %zu", sdslen(o->ptr));
         if (sdslen(o->ptr) < 4096) {
             sds repr = sdscatrepr(sdsempty(),o->ptr,sdslen(o->ptr));
@@ -1599,3 +1636,307 @@ void disableWatchdog(void) {
     sigaction(SIGALRM, &act, NULL);
     server.watchdog_period = 0;
 }
+
+/* =========================== Sampling profiler ============================ */
+
+/* DEBUG PROFILE samples the stack of the main thread with backtrace(), from
+ * the handler of the SIGPROF signal delivered every 1/hz seconds of CPU
+ * time used by the process, and returns the stacks in the folded format
+ * used by flamegraph.pl. The samples are stored in a buffer allocated when
+ * the profiler starts, so that the handler only copies the stack there:
+ * they are only symbolized when the result is requested. */
+#define PROFILER_MAX_DEPTH 32           /* Frames kept for every sample. */
+#define PROFILER_MAX_SAMPLES 65536      /* Bounds the memory to 16MB. */
+#define PROFILER_DEFAULT_HZ 99
+#define PROFILER_MAX_HZ 1000
+#define PROFILER_MAX_SECONDS 3600
+
+typedef struct profilerSample {
+    int depth;
+    void *frames[PROFILER_MAX_DEPTH];
+} profilerSample;
+
+static struct profiler {
+    int running;
+    int hz;
+    mstime_t start_time;        /* When the profiler started. */
+    mstime_t end_time;          /* When it stops, or stopped. */
+    profilerSample *samples;    /* Buffer of max_samples samples. */
+    long max_samples;
+    volatile sig_atomic_t numsamples;
+    volatile sig_atomic_t dropped; /* Buffer full. */
+    volatile sig_atomic_t other_threads; /* Signals not on the main thread. */
+    long long handler_usec;     /* Time spent in the signal handler. */
+} prof;
+
+#ifdef HAVE_BACKTRACE
+static void profilerSignalHandler(int sig, siginfo_t *info, void *secret) {
+    int saved_errno = errno;
+    void *trace[PROFILER_MAX_DEPTH+2];
+    struct timespec start, end;
+    UNUSED(sig);
+    UNUSED(info);
+    UNUSED(secret);
+
+    /* The CPU time of the I/O and background threads delivers signals as
+     * well: only the main thread is sampled. */
+    if (!pthread_equal(pthread_self(),server.main_thread_id)) {
+        prof.other_threads++;
+    } else if (!prof.running || prof.numsamples == prof.max_samples) {
+        prof.dropped++;
+    } else {
+        profilerSample *s = prof.samples+prof.numsamples;
+        int depth;
+
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        /* Skip this handler and the signal trampoline. */
+        depth = backtrace(trace,PROFILER_MAX_DEPTH+2)-2;
+        if (depth < 0) depth = 0;
+        memcpy(s->frames,trace+2,sizeof(void*)*depth);
+        s->depth = depth;
+        prof.numsamples++;
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        prof.handler_usec += (end.tv_sec-start.tv_sec)*1000000 +
+                             (end.tv_nsec-start.tv_nsec)/1000;
+    }
+    errno = saved_errno;
+}
+
+static void profilerSetTimer(int hz) {
+    struct itimerval it;
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = hz ? 1000000/hz : 0;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_PROF,&it,NULL);
+}
+
+static void profilerStart(int hz, long long seconds) {
+    struct sigaction act;
+    void *trace[1];
+
+    /* The first call of backtrace() may allocate memory to load the
+     * unwinder, which is not safe in the signal handler. */
+    backtrace(trace,1);
+
+    zfree(prof.samples);
+    prof.max_samples = hz*seconds;
+    if (prof.max_samples > PROFILER_MAX_SAMPLES)
+        prof.max_samples = PROFILER_MAX_SAMPLES;
+    prof.samples = zmalloc(sizeof(profilerSample)*prof.max_samples);
+    prof.numsamples = 0;
+    prof.dropped = 0;
+    prof.other_threads = 0;
+    prof.handler_usec = 0;
+    prof.hz = hz;
+    prof.start_time = mstime();
+    prof.end_time = prof.start_time+seconds*1000;
+    prof.running = 1;
+
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_ONSTACK | SA_SIGINFO | SA_RESTART;
+    act.sa_sigaction = profilerSignalHandler;
+    sigaction(SIGPROF,&act,NULL);
+    profilerSetTimer(hz);
+    serverLog(LL_NOTICE,"Profiler started for %lld seconds at %d Hz",
+              seconds, hz);
+}
+#endif
+
+static void profilerStop(void) {
+    if (!prof.running) return;
+    prof.running = 0;
+#ifdef HAVE_BACKTRACE
+    struct sigaction act;
+
+    profilerSetTimer(0);
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPROF,&act,NULL);
+#endif
+    prof.end_time = mstime();
+    serverLog(LL_NOTICE,"Profiler stopped with %ld samples",
+              (long)prof.numsamples);
+}
+
+/* Called by serverCron() to stop the profiler once its time elapsed. */
+void profilerCron(void) {
+    if (prof.running && mstime() >= prof.end_time) profilerStop();
+}
+
+/* Stacks of the samples, as identical raw stacks and then as identical
+ * folded stacks, both with the number of samples. */
+static dictType profilerStacksDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static void profilerCountStack(dict *d, sds stack, uint64_t count) {
+    dictEntry *existing, *de = dictAddRaw(d,stack,&existing);
+
+    if (de) {
+        dictSetUnsignedIntegerVal(de,count);
+    } else {
+        dictSetUnsignedIntegerVal(existing,
+                                  dictGetUnsignedIntegerVal(existing)+count);
+        sdsfree(stack);
+    }
+}
+
+/* Return the frames of a raw stack as a folded stack, from the outermost
+ * function to the innermost, separated by semicolons. */
+static sds profilerFoldStack(sds raw) {
+    void **frames = (void**)raw;
+    int depth = sdslen(raw)/sizeof(void*);
+    sds folded = sdsempty();
+    Dl_info self;
+
+    if (!dladdr(&prof,&self)) self.dli_fbase = NULL;
+    for (int j = depth-1; j >= 0; j--) {
+        /* The frames but the innermost are return addresses, that may
+         * point past the end of the calling function. */
+        char *addr = (char*)frames[j] - (j != 0);
+        Dl_info info;
+
+        if (sdslen(folded)) folded = sdscatlen(folded,";",1);
+        if (!dladdr(addr,&info)) {
+            folded = sdscat(folded,"??");
+        } else if (info.dli_sname) {
+            folded = sdscat(folded,info.dli_sname);
+        } else {
+            /* Static functions are not exported: report the offset in the
+             * binary, that addr2line can resolve. The name of our own
+             * binary is the process title, that may be changed. */
+            const char *file = strrchr(info.dli_fname,'/');
+            if (info.dli_fbase == self.dli_fbase) file = "/redis-server";
+            folded = sdscatprintf(folded,"%s+%p",
+                file ? file+1 : info.dli_fname,
+                (void*)(addr-(char*)info.dli_fbase));
+        }
+    }
+    return folded;
+}
+
+static int profilerStackCompare(const void *a, const void *b) {
+    const dictEntry *da = *(dictEntry**)a, *db = *(dictEntry**)b;
+    uint64_t ca = dictGetUnsignedIntegerVal(da);
+    uint64_t cb = dictGetUnsignedIntegerVal(db);
+
+    if (ca != cb) return ca > cb ? -1 : 1;
+    return sdscmp(dictGetKey(da),dictGetKey(db));
+}
+
+/* Reply with the folded stacks of the samples taken so far, one per line
+ * followed by its number of samples, the most frequent first. */
+static void addReplyProfilerResult(client *c) {
+    dict *raw = dictCreate(&profilerStacksDictType,NULL);
+    dict *folded = dictCreate(&profilerStacksDictType,NULL);
+    long numsamples = prof.numsamples, j = 0;
+    dictIterator *di;
+    dictEntry *de, **stacks;
+    sds o = sdsempty();
+
+    /* The same stacks are symbolized only once. */
+    for (long i = 0; i < numsamples; i++) {
+        profilerSample *s = prof.samples+i;
+        profilerCountStack(raw,sdsnewlen(s->frames,sizeof(void*)*s->depth),1);
+    }
+    di = dictGetIterator(raw);
+    while((de = dictNext(di)) != NULL)
+        profilerCountStack(folded,profilerFoldStack(dictGetKey(de)),
+                           dictGetUnsignedIntegerVal(de));
+    dictReleaseIterator(di);
+    dictRelease(raw);
+
+    stacks = zmalloc(sizeof(dictEntry*)*(dictSize(folded)+1));
+    di = dictGetIterator(folded);
+    while((de = dictNext(di)) != NULL) stacks[j++] = de;
+    dictReleaseIterator(di);
+    qsort(stacks,j,sizeof(dictEntry*),profilerStackCompare);
+    for (long i = 0; i < j; i++) {
+        o = sdscatsds(o,dictGetKey(stacks[i]));
+        o = sdscatprintf(o," %llu\n",
+            (unsigned long long)dictGetUnsignedIntegerVal(stacks[i]));
+    }
+    zfree(stacks);
+    dictRelease(folded);
+    addReplyVerbatim(c,o,sdslen(o),"txt");
+    sdsfree(o);
+}
+
+/* DEBUG PROFILE START <seconds> [HZ <hz>]
+ * DEBUG PROFILE STOP
+ * DEBUG PROFILE STATUS
+ * DEBUG PROFILE RESULT */
+void debugProfileCommand(client *c) {
+    char *subcmd = c->argc > 2 ? c->argv[2]->ptr : "";
+
+    if (!strcasecmp(subcmd,"start") && (c->argc == 4 || c->argc == 6)) {
+#ifdef HAVE_BACKTRACE
+        long long seconds, hz = PROFILER_DEFAULT_HZ;
+
+        if (prof.running) {
+            addReplyError(c,"The profiler is already running");
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c,c->argv[3],&seconds,NULL) != C_OK)
+            return;
+        if (seconds <= 0 || seconds > PROFILER_MAX_SECONDS) {
+            addReplyErrorFormat(c,"The duration must be between 1 and %d "
+                                  "seconds", PROFILER_MAX_SECONDS);
+            return;
+        }
+        if (c->argc == 6) {
+            if (strcasecmp(c->argv[4]->ptr,"hz")) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            if (getLongLongFromObjectOrReply(c,c->argv[5],&hz,NULL) != C_OK)
+                return;
+            if (hz <= 0 || hz > PROFILER_MAX_HZ) {
+                addReplyErrorFormat(c,"HZ must be between 1 and %d",
+                                    PROFILER_MAX_HZ);
+                return;
+            }
+        }
+        profilerStart(hz,seconds);
+        addReply(c,shared.ok);
+#else
+        addReplyError(c,"The profiler needs backtrace() support");
+#endif
+    } else if (!strcasecmp(subcmd,"stop") && c->argc == 3) {
+        profilerStop();
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(subcmd,"status") && c->argc == 3) {
+        mstime_t end = prof.running ? mstime() : prof.end_time;
+
+        addReplyMapLen(c,7);
+        addReplyBulkCString(c,"running");
+        addReplyLongLong(c,prof.running);
+        addReplyBulkCString(c,"hz");
+        addReplyLongLong(c,prof.hz);
+        addReplyBulkCString(c,"elapsed-ms");
+        addReplyLongLong(c,prof.start_time ? end-prof.start_time : 0);
+        addReplyBulkCString(c,"samples");
+        addReplyLongLong(c,prof.numsamples);
+        addReplyBulkCString(c,"dropped-samples");
+        addReplyLongLong(c,prof.dropped);
+        addReplyBulkCString(c,"other-threads-samples");
+        addReplyLongLong(c,prof.other_threads);
+        addReplyBulkCString(c,"overhead-usec");
+        addReplyLongLong(c,prof.handler_usec);
+    } else if (!strcasecmp(subcmd,"result") && c->argc == 3) {
+        if (prof.samples == NULL) {
+            addReplyError(c,"The profiler was never started");
+            return;
+        }
+        addReplyProfilerResult(c);
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
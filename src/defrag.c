@@ -38,6 +38,7 @@
 #include <time.h>
 #include <assert.h>
 #include <stddef.h>
+#include "atomicvar.h"
 
 #ifdef HAVE_DEFRAG
 
@@ -45,16 +46,23 @@
  * pointers are worthwhile moving and which aren't */
 int je_get_defrag_hint(void* ptr, int *bin_util, int *run_util);
 
+/* Set by the main thread while it waits to take the GIL back from the
+ * defrag thread, that will then stop at the next check of the time limit. */
+static int defrag_gil_wanted = 0;
+pthread_mutex_t defrag_gil_wanted_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* forward declarations*/
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref);
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **bucketref);
 dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sds newkey, uint64_t hash, long *defragged);
 
-/* Defrag helper for generic allocations.
+/* Defrag helper for generic allocations of the allocation class 'cls' (see
+ * zmalloc_class()), the new allocation is done in the same class.
  *
  * returns NULL in case the allocatoin wasn't moved.
  * when it returns a non-null value, the old pointer was already released
  * and should NOT be accessed. */
-void* activeDefragAlloc(void *ptr) {
+void* activeDefragAllocWithClass(void *ptr, int cls) {
     int bin_util, run_util;
     size_t size;
     void *newptr;
@@ -73,12 +81,24 @@ void* activeDefragAlloc(void *ptr) {
      * make sure not to use the thread cache. so that we don't get back the same
      * pointers we try to free */
     size = zmalloc_size(ptr);
-    newptr = zmalloc_no_tcache(size);
-    memcpy(newptr, ptr, size);
-    zfree_no_tcache(ptr);
+    if (cls == ZMALLOC_CLASS_KEYSPACE) {
+        newptr = zmalloc_no_tcache(size);
+        memcpy(newptr, ptr, size);
+        zfree_no_tcache(ptr);
+    } else {
+        /* The other classes don't use the thread cache anyway. */
+        newptr = zmalloc_class(size, cls);
+        memcpy(newptr, ptr, size);
+        zfree_class(ptr, cls);
+    }
     return newptr;
 }
 
+/* Like activeDefragAllocWithClass() for keyspace allocations. */
+void* activeDefragAlloc(void *ptr) {
+    return activeDefragAllocWithClass(ptr, ZMALLOC_CLASS_KEYSPACE);
+}
+
 /*Defrag helper for sds strings
  *
  * returns NULL in case the allocatoin wasn't moved.
@@ -129,7 +149,15 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
-        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+        } else if (ob->encoding==OBJ_ENCODING_COMPRESSED) {
+            void *newptr = activeDefragAlloc(ob->ptr);
+            if (newptr) {
+                ob->ptr = newptr;
+                (*defragged)++;
+            }
+        } else if (ob->encoding!=OBJ_ENCODING_INT &&
+                   ob->encoding!=OBJ_ENCODING_ROARING &&
+                   ob->encoding!=OBJ_ENCODING_SWAPPED) {
             serverPanic("Unknown string encoding");
         }
     }
@@ -183,6 +211,12 @@ long dictDefragTables(dict* d) {
         if (newtable)
             defragged++, d->ht[1].table = newtable;
     }
+    /* handle the tags of open addressing tables */
+    for (int j = 0; j < 2; j++) {
+        uint8_t *newtags;
+        if (d->ht[j].tags && (newtags = activeDefragAlloc(d->ht[j].tags)))
+            defragged++, d->ht[j].tags = newtags;
+    }
     return defragged;
 }
 
@@ -204,25 +238,21 @@ void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnod
 }
 
 /* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
+ * Defrag the skiplist node of the element 'ele' with score 'score'. The SDS
+ * string of the element is embedded in the node, so it moves together with
+ * it. When return value is non-NULL, it is the new node, whose element and
+ * score must be updated in the dict record. */
+zskiplistNode *zslDefrag(zskiplist *zsl, double score, sds ele) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
+    size_t eleoff;
     int i;
-    sds ele = newele? newele: oldele;
 
     /* find the skiplist node referring to the object that was moved,
      * and all pointers that need to be updated if we'll end up moving the skiplist node. */
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
+            x->level[i].forward->ele != ele &&
             (x->level[i].forward->score < score ||
                 (x->level[i].forward->score == score &&
                 sdscmp(x->level[i].forward->ele,ele) < 0)))
@@ -230,17 +260,17 @@ double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
         update[i] = x;
     }
 
-    /* update the robj pointer inside the skip list record. */
     x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
+    serverAssert(x && score == x->score && x->ele==ele);
 
-    /* try to defrag the skiplist record itself */
+    /* try to defrag the skiplist record itself, we may not access the old
+     * node once it is moved. */
+    eleoff = (char*)x->ele - (char*)x;
     newx = activeDefragAlloc(x);
     if (newx) {
+        newx->ele = (char*)newx + eleoff;
         zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
+        return newx;
     }
     return NULL;
 }
@@ -248,15 +278,14 @@ double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
 /* Defrag helpler for sorted set.
  * Defrag a single dict entry key name, and corresponding skiplist struct */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
-    sds newsds;
-    double* newscore;
+    zskiplistNode *newx;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
-    if ((newsds = activeDefragSds(sdsele)))
-        defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
+
+    newx = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele);
+    if (newx) {
+        de->key = newx->ele;
+        dictSetVal(zs->dict, de, &newx->score);
         defragged++;
     }
     return defragged;
@@ -410,10 +439,15 @@ dictEntry* replaceSateliteDictKeyPtrAndOrDefragDictEntry(dict *d, sds oldkey, sd
 
 long activeDefragQuickListNodes(quicklist *ql) {
     quicklistNode *node = ql->head, *newnode;
+    quicklistCache *newcache;
     long defragged = 0;
     unsigned char *newzl;
+    if (ql->cache && (newcache = activeDefragAlloc(ql->cache)))
+        defragged++, ql->cache = newcache;
     while (node) {
-        if ((newnode = activeDefragAlloc(node))) {
+        /* Cached nodes are also referenced by ql->cache, don't move them. */
+        if (!node->cached && (newnode = activeDefragAlloc(node))) {
+            quicklistDropIndex(ql);
             if (newnode->prev)
                 newnode->prev->next = newnode;
             else
@@ -603,6 +637,14 @@ int defragRaxNode(raxNode **noderef) {
     return 0;
 }
 
+/* Return true if the defrag work should stop: the time limit was reached,
+ * or we are in the defrag thread and the main thread wants the GIL back. */
+int defragTimeIsUp(long long endtime) {
+    int wanted;
+    atomicGet(defrag_gil_wanted,wanted);
+    return wanted || ustime() > endtime;
+}
+
 /* returns 0 if no more work needs to be been done, and 1 if time is up and more work is needed. */
 int scanLaterStraemListpacks(robj *ob, unsigned long *cursor, long long endtime, long long *defragged) {
     static unsigned char last[sizeof(streamID)];
@@ -639,7 +681,7 @@ int scanLaterStraemListpacks(robj *ob, unsigned long *cursor, long long endtime,
         if (newdata)
             raxSetData(ri.node, ri.data=newdata), (*defragged)++;
         if (++iterations > 16) {
-            if (ustime() > endtime) {
+            if (defragTimeIsUp(endtime)) {
                 serverAssert(ri.key_len==sizeof(last));
                 memcpy(last,ri.key,ri.key_len);
                 raxStop(&ri);
@@ -731,6 +773,8 @@ void* defragStreamConsumerGroup(raxIterator *ri, void *privdata, long *defragged
         *defragged += defragRadixTree(&cg->consumers, 0, defragStreamConsumer, cg);
     if (cg->pel)
         *defragged += defragRadixTree(&cg->pel, 0, NULL, NULL);
+    if (cg->pel_by_time)
+        *defragged += defragRadixTree(&cg->pel_by_time, 0, NULL, NULL);
     return NULL;
 }
 
@@ -767,16 +811,12 @@ long defragKey(redisDb *db, dictEntry *de) {
     long defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
+    /* Try to defrag the key name. Keys embedded in the entry are moved
+     * together with it by defragKeyspaceBucketCallback(). */
+    if (!dictHasEmbeddedKeys(db->dict)) {
+        newsds = activeDefragSds(keysds);
+        if (newsds)
+            defragged++, de->key = newsds;
     }
 
     /* Try to defrag robj and / or string value. */
@@ -786,7 +826,15 @@ long defragKey(redisDb *db, dictEntry *de) {
         ob = newob;
     }
 
-    if (ob->type == OBJ_STRING) {
+    /* A MIGRATE in progress may be iterating the value: don't move it. */
+    if (ob->refcount > 1) return defragged;
+
+    if (ob->encoding == OBJ_ENCODING_SWAPPED) {
+        /* The value is in the tiered storage, only the stub is here. */
+        tieredValue *newtv;
+        if ((newtv = activeDefragAlloc(ob->ptr)))
+            defragged++, ob->ptr = newtv;
+    } else if (ob->type == OBJ_STRING) {
         /* Already handled in activeDefragStringOb. */
     } else if (ob->type == OBJ_LIST) {
         if (ob->encoding == OBJ_ENCODING_QUICKLIST) {
@@ -804,11 +852,14 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr)))
+                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -817,7 +868,7 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -828,8 +879,10 @@ long defragKey(redisDb *db, dictEntry *de) {
     } else if (ob->type == OBJ_STREAM) {
         defragged += defragStream(db, de);
     } else if (ob->type == OBJ_MODULE) {
-        /* Currently defragmenting modules private data types
-         * is not supported. */
+        robj keyobj;
+        initStaticStringObject(keyobj, keysds);
+        if (!moduleDefragValue(&keyobj, ob, &defragged))
+            defragLater(db, de);
     } else {
         serverPanic("Unknown object type");
     }
@@ -851,24 +904,46 @@ void defragScanCallback(void *privdata, const dictEntry *de) {
  * used in order to defrag the dictEntry allocations. */
 void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     UNUSED(privdata); /* NOTE: this function is also used by both activeDefragCycle and scanLaterHash, etc. don't use privdata */
-    while(*bucketref) {
-        dictEntry *de = *bucketref, *newde;
-        if ((newde = activeDefragAlloc(de))) {
-            *bucketref = newde;
-        }
-        bucketref = &(*bucketref)->next;
+    dictEntry *newde;
+    if ((newde = activeDefragAlloc(*bucketref))) {
+        *bucketref = newde;
     }
 }
 
+/* Defrag scan callback for the keyspace hash table buckets. Like
+ * defragDictBucketCallback(), but when the key is embedded in the entry,
+ * moving the entry moves the key too, so the key pointer stored in the
+ * entry is updated, and so are the references held by the expire index and
+ * by the neighbours of the entry in the list of keys of its hash slot. */
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **bucketref) {
+    redisDb *db = privdata;
+    dictEntry *de = *bucketref, *newde;
+    size_t keyoff = (char*)dictGetKey(de) - (char*)de;
+    unsigned long pos;
+
+    if ((newde = activeDefragAlloc(de)) == NULL) return;
+    *bucketref = newde;
+    if (dictHasEmbeddedKeys(db->dict))
+        newde->key = (char*)newde + keyoff;
+    if ((pos = dbKeyMeta(db,newde)->expire_pos) != 0)
+        db->expires->entries[pos-1].de = newde;
+    if (db->slots_to_keys) slotToKeyReplaceEntry(db,newde);
+    server.stat_active_defrag_hits++;
+}
+
 /* Utility function to get the fragmentation ratio from jemalloc.
  * It is critical to do that by comparing only heap maps that belong to
  * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
  * fragmentation ratio in order to decide if a defrag action should be taken
  * or not, a false detection can cause the defragmenter to waste a lot of CPU
- * without the possibility of getting any results. */
+ * without the possibility of getting any results. For the same reason only
+ * the keyspace arenas are considered: the client and replication buffers
+ * and the module data live in other arenas that we don't defrag. */
 float getAllocatorFragmentation(size_t *out_frag_bytes) {
     size_t resident, active, allocated;
+    /* Refresh the statistics, then take the ones of the keyspace. */
     zmalloc_get_allocator_info(&allocated, &active, &resident);
+    zmalloc_get_class_info(ZMALLOC_CLASS_KEYSPACE, &allocated, &active, &resident);
     float frag_pct = ((float)active / allocated)*100 - 100;
     size_t frag_bytes = active - allocated;
     float rss_pct = ((float)resident / allocated)*100 - 100;
@@ -899,7 +974,9 @@ long defragOtherGlobals() {
 int defragLaterItem(dictEntry *de, unsigned long *cursor, long long endtime) {
     if (de) {
         robj *ob = dictGetVal(de);
-        if (ob->type == OBJ_LIST) {
+        if (ob->refcount > 1) {
+            *cursor = 0; /* referenced by a MIGRATE in progress */
+        } else if (ob->type == OBJ_LIST) {
             server.stat_active_defrag_hits += scanLaterList(ob);
             *cursor = 0; /* list has no scan, we must finish it in one go */
         } else if (ob->type == OBJ_SET) {
@@ -910,6 +987,10 @@ int defragLaterItem(dictEntry *de, unsigned long *cursor, long long endtime) {
             server.stat_active_defrag_hits += scanLaterHash(ob, cursor);
         } else if (ob->type == OBJ_STREAM) {
             return scanLaterStraemListpacks(ob, cursor, endtime, &server.stat_active_defrag_hits);
+        } else if (ob->type == OBJ_MODULE) {
+            robj keyobj;
+            initStaticStringObject(keyobj, dictGetKey(de));
+            return moduleLateDefrag(&keyobj, ob, cursor, endtime, &server.stat_active_defrag_hits);
         } else {
             *cursor = 0; /* object type may have changed since we schedule it for later */
         }
@@ -972,7 +1053,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
             if (quit || (++iterations > 16 ||
                             server.stat_active_defrag_hits - prev_defragged > 512 ||
                             server.stat_active_defrag_scanned - prev_scanned > 64)) {
-                if (quit || ustime() > endtime) {
+                if (quit || defragTimeIsUp(endtime)) {
                     if(key_defragged != server.stat_active_defrag_hits)
                         server.stat_active_defrag_key_hits++;
                     else
@@ -1025,65 +1106,43 @@ void computeDefragCycles() {
     }
 }
 
-/* Perform incremental defragmentation work from the serverCron.
- * This works in a similar way to activeExpireCycle, in the sense that
- * we do incremental work across calls. */
-void activeDefragCycle(void) {
-    static int current_db = -1;
-    static unsigned long cursor = 0;
-    static redisDb *db = NULL;
-    static long long start_scan, start_stat;
+/* State of the keyspace scan, continued by every call to activeDefragStep(). */
+static int defrag_current_db = -1;
+static unsigned long defrag_cursor = 0;
+static redisDb *defrag_db = NULL;
+static long long defrag_start_scan, defrag_start_stat;
+
+/* Forget the scan in progress, so that the next one starts from scratch. */
+static void activeDefragResetScan(void) {
+    if (defrag_db)
+        listEmpty(defrag_db->defrag_later);
+    defrag_later_current_key = NULL;
+    defrag_later_cursor = 0;
+    defrag_current_db = -1;
+    defrag_cursor = 0;
+    defrag_db = NULL;
+}
+
+/* Do incremental defragmentation work until 'endtime', continuing the
+ * keyspace scan from where the previous call stopped. Called either by the
+ * main thread or by the defrag thread holding the GIL. */
+static void activeDefragStep(long long endtime) {
     unsigned int iterations = 0;
     unsigned long long prev_defragged = server.stat_active_defrag_hits;
     unsigned long long prev_scanned = server.stat_active_defrag_scanned;
-    long long start, timelimit, endtime;
-    mstime_t latency;
     int quit = 0;
 
-    if (!server.active_defrag_enabled) {
-        if (server.active_defrag_running) {
-            /* if active defrag was disabled mid-run, start from fresh next time. */
-            server.active_defrag_running = 0;
-            if (db)
-                listEmpty(db->defrag_later);
-            defrag_later_current_key = NULL;
-            defrag_later_cursor = 0;
-            current_db = -1;
-            cursor = 0;
-            db = NULL;
-        }
-        return;
-    }
-
-    if (hasActiveChildProcess())
-        return; /* Defragging memory while there's a fork will just do damage. */
-
-    /* Once a second, check if we the fragmentation justfies starting a scan
-     * or making it more aggressive. */
-    run_with_period(1000) {
-        computeDefragCycles();
-    }
-    if (!server.active_defrag_running)
-        return;
-
-    /* See activeExpireCycle for how timelimit is handled. */
-    start = ustime();
-    timelimit = 1000000*server.active_defrag_running/server.hz/100;
-    if (timelimit <= 0) timelimit = 1;
-    endtime = start + timelimit;
-    latencyStartMonitor(latency);
-
     do {
         /* if we're not continuing a scan from the last call or loop, start a new one */
-        if (!cursor) {
+        if (!defrag_cursor) {
             /* finish any leftovers from previous db before moving to the next one */
-            if (db && defragLaterStep(db, endtime)) {
+            if (defrag_db && defragLaterStep(defrag_db, endtime)) {
                 quit = 1; /* time is up, we didn't finish all the work */
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
             /* Move on to next database, and stop if we reached the last one. */
-            if (++current_db >= server.dbnum) {
+            if (++defrag_current_db >= server.dbnum) {
                 /* defrag other items not part of the db / keys */
                 defragOtherGlobals();
 
@@ -1092,47 +1151,47 @@ void activeDefragCycle(void) {
                 float frag_pct = getAllocatorFragmentation(&frag_bytes);
                 serverLog(LL_VERBOSE,
                     "Active defrag done in %dms, reallocated=%d, frag=%.0f%%, frag_bytes=%zu",
-                    (int)((now - start_scan)/1000), (int)(server.stat_active_defrag_hits - start_stat), frag_pct, frag_bytes);
+                    (int)((now - defrag_start_scan)/1000), (int)(server.stat_active_defrag_hits - defrag_start_stat), frag_pct, frag_bytes);
 
-                start_scan = now;
-                current_db = -1;
-                cursor = 0;
-                db = NULL;
+                defrag_start_scan = now;
+                defrag_current_db = -1;
+                defrag_cursor = 0;
+                defrag_db = NULL;
                 server.active_defrag_running = 0;
 
                 computeDefragCycles(); /* if another scan is needed, start it right away */
-                if (server.active_defrag_running != 0 && ustime() < endtime)
+                if (server.active_defrag_running != 0 && !defragTimeIsUp(endtime))
                     continue;
                 break;
             }
-            else if (current_db==0) {
+            else if (defrag_current_db==0) {
                 /* Start a scan from the first database. */
-                start_scan = ustime();
-                start_stat = server.stat_active_defrag_hits;
+                defrag_start_scan = ustime();
+                defrag_start_stat = server.stat_active_defrag_hits;
             }
 
-            db = &server.db[current_db];
-            cursor = 0;
+            defrag_db = &server.db[defrag_current_db];
+            defrag_cursor = 0;
         }
 
         do {
             /* before scanning the next bucket, see if we have big keys left from the previous bucket to scan */
-            if (defragLaterStep(db, endtime)) {
+            if (defragLaterStep(defrag_db, endtime)) {
                 quit = 1; /* time is up, we didn't finish all the work */
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            defrag_cursor = dictScan(defrag_db->dict, defrag_cursor, defragScanCallback, defragKeyspaceBucketCallback, defrag_db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
              * check if we reached the time limit.
              * But regardless, don't start a new db in this loop, this is because after
              * the last db we call defragOtherGlobals, which must be done in once cycle */
-            if (!cursor || (++iterations > 16 ||
+            if (!defrag_cursor || (++iterations > 16 ||
                             server.stat_active_defrag_hits - prev_defragged > 512 ||
                             server.stat_active_defrag_scanned - prev_scanned > 64)) {
-                if (!cursor || ustime() > endtime) {
+                if (!defrag_cursor || defragTimeIsUp(endtime)) {
                     quit = 1;
                     break;
                 }
@@ -1140,8 +1199,145 @@ void activeDefragCycle(void) {
                 prev_defragged = server.stat_active_defrag_hits;
                 prev_scanned = server.stat_active_defrag_scanned;
             }
-        } while(cursor && !quit);
+        } while(defrag_cursor && !quit);
     } while(!quit);
+}
+
+/* ----------------------------------------------------------------------------
+ * Defrag thread
+ *
+ * With active-defrag-thread enabled the defragmentation work is not done by
+ * the main thread in serverCron(), but by a dedicated thread, while the main
+ * thread sleeps waiting for events. The defrag thread takes the GIL, like
+ * the threads of the modules, and works in slices of DEFRAG_THREAD_SLICE_USEC
+ * at most: as soon as the main thread wakes up it flags that it wants the GIL
+ * back, and the defrag thread stops at its next check of the time limit, that
+ * is done every few buckets or a few hundred moved pointers. So the keyspace
+ * is only modified when nobody else touches it, while the main thread pays at
+ * most the time of a few pointer moves for each wakeup, instead of a time
+ * slice proportional to the defrag effort.
+ *
+ * The effort (active-defrag-cycle-min/max) is still honored, as the
+ * percentage of CPU time the defrag thread uses.
+ * ------------------------------------------------------------------------- */
+
+#define DEFRAG_THREAD_SLICE_USEC 1000
+
+static pthread_t defrag_thread;
+static int defrag_thread_started = 0;
+static pthread_mutex_t defrag_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_thread_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_thread_pending = 0;
+
+/* Called with the GIL held: return the current effort if the defrag thread
+ * should do some work, or 0 if it should go idle. */
+static int defragThreadEffort(void) {
+    if (!server.active_defrag_enabled || !server.active_defrag_thread ||
+        server.loading || hasActiveChildProcess()) return 0;
+    return server.active_defrag_running;
+}
+
+static void *defragThreadMain(void *arg) {
+    UNUSED(arg);
+
+    redisSetCpuAffinity(server.bio_cpulist);
+
+    while(1) {
+        pthread_mutex_lock(&defrag_thread_mutex);
+        while (!defrag_thread_pending)
+            pthread_cond_wait(&defrag_thread_cond,&defrag_thread_mutex);
+        defrag_thread_pending = 0;
+        pthread_mutex_unlock(&defrag_thread_mutex);
+
+        while(1) {
+            long long start, elapsed;
+            int effort;
+
+            moduleAcquireGIL();
+            start = ustime();
+            if ((effort = defragThreadEffort()) != 0)
+                activeDefragStep(start+DEFRAG_THREAD_SLICE_USEC);
+            elapsed = ustime()-start;
+            if (effort) effort = defragThreadEffort();
+            moduleReleaseGIL();
+            if (!effort) break;
+
+            /* Sleep so that our CPU usage matches the defrag effort. */
+            usleep(elapsed*(100-effort)/effort+1);
+        }
+    }
+    return NULL;
+}
+
+/* Wake up the defrag thread, creating it the first time. */
+static void defragThreadWakeup(void) {
+    if (!defrag_thread_started) {
+        if (pthread_create(&defrag_thread,NULL,defragThreadMain,NULL) != 0) {
+            serverLog(LL_WARNING,
+                "Can't create the defrag thread: defragging in the main thread.");
+            server.active_defrag_thread = 0;
+            return;
+        }
+        defrag_thread_started = 1;
+    }
+    pthread_mutex_lock(&defrag_thread_mutex);
+    defrag_thread_pending = 1;
+    pthread_cond_signal(&defrag_thread_cond);
+    pthread_mutex_unlock(&defrag_thread_mutex);
+}
+
+/* Return true if the main thread should release the GIL before sleeping,
+ * since the defrag thread has work to do. */
+int activeDefragThreadNeedsGIL(void) {
+    return server.active_defrag_thread && server.active_defrag_running;
+}
+
+/* Called by the main thread around taking the GIL back after sleeping. */
+void activeDefragSetGILWanted(int wanted) {
+    atomicSet(defrag_gil_wanted,wanted);
+}
+
+/* Perform incremental defragmentation work from the serverCron.
+ * This works in a similar way to activeExpireCycle, in the sense that
+ * we do incremental work across calls. */
+void activeDefragCycle(void) {
+    long long start, timelimit, endtime;
+    ustime_t latency;
+
+    if (!server.active_defrag_enabled) {
+        if (server.active_defrag_running) {
+            /* if active defrag was disabled mid-run, start from fresh next time. */
+            server.active_defrag_running = 0;
+            activeDefragResetScan();
+        }
+        return;
+    }
+
+    if (hasActiveChildProcess())
+        return; /* Defragging memory while there's a fork will just do damage. */
+
+    /* Once a second, check if we the fragmentation justfies starting a scan
+     * or making it more aggressive. */
+    run_with_period(1000) {
+        computeDefragCycles();
+    }
+    if (!server.active_defrag_running)
+        return;
+
+    /* The defrag thread will do the work while we sleep. */
+    if (server.active_defrag_thread) {
+        defragThreadWakeup();
+        if (server.active_defrag_thread) return;
+    }
+
+    /* See activeExpireCycle for how timelimit is handled. */
+    start = ustime();
+    timelimit = 1000000*server.active_defrag_running/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    endtime = start + timelimit;
+    latencyStartMonitor(latency);
+
+    activeDefragStep(endtime);
 
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("active-defrag-cycle",latency);
@@ -1153,4 +1349,34 @@ void activeDefragCycle(void) {
     /* Not implemented yet. */
 }
 
+int activeDefragThreadNeedsGIL(void) {
+    return 0;
+}
+
+void *activeDefragAllocWithClass(void *ptr, int cls) {
+    UNUSED(ptr);
+    UNUSED(cls);
+    return NULL;
+}
+
+void *activeDefragAlloc(void *ptr) {
+    UNUSED(ptr);
+    return NULL;
+}
+
+robj *activeDefragStringOb(robj *ob, long *defragged) {
+    UNUSED(ob);
+    UNUSED(defragged);
+    return NULL;
+}
+
+int defragTimeIsUp(long long endtime) {
+    UNUSED(endtime);
+    return 0;
+}
+
+void activeDefragSetGILWanted(int wanted) {
+    UNUSED(wanted);
+}
+
 #endif
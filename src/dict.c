@@ -45,12 +45,17 @@
 
 #include "dict.h"
 #include "zmalloc.h"
+#include "trace.h"
 #ifndef DICT_BENCHMARK_MAIN
 #include "redisassert.h"
 #else
 #include <assert.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
  * for Redis, as we use copy-on-write and don't want to move too much memory
@@ -62,6 +67,14 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Using dictPauseRehashing() / dictResumeRehashing() it is possible to stop
+ * lookups from performing incremental rehashing steps. While rehashing is
+ * paused a dictionary that is not modified can be safely accessed by
+ * multiple threads at the same time with read only operations, since
+ * dictFind() and similar calls no longer alter the hash table state.
+ * Calls can be nested. */
+static int dict_rehashing_paused = 0;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
@@ -82,19 +95,171 @@ uint8_t *dictGetHashFunctionSeed(void) {
 }
 
 /* The default hashing function uses SipHash implementation
- * in siphash.c. */
+ * in siphash.c. On CPUs with the AES instructions the faster function in
+ * aeshash.c, keyed with the same seed, can be used instead. */
 
 uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
 uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t aeshash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+int aeshash_supported(void);
+
+static int dict_hash_function = DICT_HASH_SIPHASH;
+
+/* Select the function used to hash the keys, one of the DICT_HASH_*
+ * types. Since the hash of the keys already stored would change, this
+ * must be called before any dictionary is created, or when none exists.
+ * Returns DICT_ERR if the function is not supported by this CPU. */
+int dictSetHashFunction(int type) {
+    if (type == DICT_HASH_AES && !aeshash_supported()) return DICT_ERR;
+    dict_hash_function = type;
+    return DICT_OK;
+}
+
+int dictGetHashFunction(void) {
+    return dict_hash_function;
+}
 
 uint64_t dictGenHashFunction(const void *key, int len) {
+    if (dict_hash_function == DICT_HASH_AES)
+        return aeshash(key,len,dict_hash_function_seed);
     return siphash(key,len,dict_hash_function_seed);
 }
 
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    if (dict_hash_function == DICT_HASH_AES)
+        return aeshash_nocase(buf,len,dict_hash_function_seed);
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* ----------------------------- Open addressing ---------------------------- */
+
+/* Dicts created with dictCreateOpenAddressing() don't chain colliding
+ * entries: every slot of the table holds at most one entry, and a key is
+ * searched probing the table starting from its slot. This saves the 'next'
+ * pointer of every entry (which is not even allocated) and, above all, the
+ * pointer chasing of long chains.
+ *
+ * The table is split into groups of DICT_OA_GROUP_SIZE slots, and probing
+ * happens in groups: the first group probed is the one of the slot the key
+ * hashes to, then the following groups in order. To avoid accessing the
+ * entries of slots that can't match, every slot has a one byte tag:
+ *
+ *  DICT_TAG_EMPTY:   the slot was never used.
+ *  DICT_TAG_DELETED: the slot was used, but the entry was deleted.
+ *  0 ... 127:        the slot is used, and the tag is 7 bits of the hash.
+ *
+ * The tags of a whole group are matched at once, using SSE2 where
+ * available. A lookup stops at the first group having an empty slot, since
+ * an insertion would have used it. For the same reason deleted slots can be
+ * marked as empty only if their group already has an empty slot, otherwise
+ * they become tombstones, that are only removed when the table is rehashed.
+ *
+ * Entries are never moved but when rehashing, so dictEntry pointers, safe
+ * iterators and the low level access to the table performed by some callers
+ * (slots are either NULL or a single entry) work like with chaining.
+ * Incremental rehashing works the same way too, the only difference is that
+ * the slots of the old table are marked as deleted while rehashing, so that
+ * probe sequences of the entries not yet moved are not broken. */
+
+#define DICT_TAG_EMPTY 0x80
+#define DICT_TAG_DELETED 0xfe
+#define dictHashTag(h) ((uint8_t)((h) >> 57))
+#define dictSlotGroup(ht,idx) ((idx) & ~(unsigned long)(DICT_OA_GROUP_SIZE-1))
+
+/* The max load, including tombstones, is 7/8 of the table. When resizing is
+ * disabled the table is allowed to grow up to 15/16 before forcing it. */
+#define dictOAOverLoad(fill,size) ((fill) >= (size)-(size)/8)
+#define dictOAOverForceLoad(fill,size) ((fill) >= (size)-(size)/16)
+
+/* Return a bitmask of the slots of the group starting at 'tags' having the
+ * tag 'tag'. */
+static inline unsigned int _dictGroupMatch(const uint8_t *tags, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i*)tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)tag)));
+#else
+    unsigned int mask = 0;
+    for (int j = 0; j < DICT_OA_GROUP_SIZE; j++)
+        if (tags[j] == tag) mask |= 1<<j;
+    return mask;
+#endif
+}
+
+/* Return a bitmask of the slots of the group starting at 'tags' that are
+ * either empty or deleted, that is, all the tags with the high bit set. */
+static inline unsigned int _dictGroupMatchFree(const uint8_t *tags) {
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)tags));
+#else
+    unsigned int mask = 0;
+    for (int j = 0; j < DICT_OA_GROUP_SIZE; j++)
+        if (tags[j] & 0x80) mask |= 1<<j;
+    return mask;
+#endif
+}
+
+/* Search the slot of the entry with the specified key (or key pointer if
+ * 'byptr' is true) in the open addressing table 'ht'. Returns the slot index
+ * or -1 if the key is not in the table. */
+static long _dictOAFind(dict *d, dictht *ht, const void *key, uint64_t hash,
+                        int byptr)
+{
+    unsigned long idx, probes;
+    uint8_t tag = dictHashTag(hash);
+
+    if (ht->size == 0) return -1;
+    idx = dictSlotGroup(ht,hash & ht->sizemask);
+    for (probes = 0; probes < ht->size; probes += DICT_OA_GROUP_SIZE) {
+        const uint8_t *tags = ht->tags+idx;
+        unsigned int match = _dictGroupMatch(tags,tag);
+        while (match) {
+            unsigned long slot = idx+__builtin_ctz(match);
+            dictEntry *he = ht->table[slot];
+            if (key == he->key ||
+                (!byptr && dictCompareKeys(d, key, he->key))) return slot;
+            match &= match-1;
+        }
+        if (_dictGroupMatch(tags,DICT_TAG_EMPTY)) break;
+        idx = (idx+DICT_OA_GROUP_SIZE) & ht->sizemask;
+    }
+    return -1;
+}
+
+/* Store the entry 'de', whose key has the specified hash, in the first free
+ * slot of its probe sequence. The key must not already be in the table. */
+static void _dictOAInsert(dictht *ht, dictEntry *de, uint64_t hash) {
+    unsigned long idx, probes;
+
+    idx = dictSlotGroup(ht,hash & ht->sizemask);
+    for (probes = 0; probes < ht->size; probes += DICT_OA_GROUP_SIZE) {
+        unsigned int free = _dictGroupMatchFree(ht->tags+idx);
+        if (free) {
+            idx += __builtin_ctz(free);
+            if (ht->tags[idx] == DICT_TAG_DELETED) ht->deleted--;
+            ht->tags[idx] = dictHashTag(hash);
+            ht->table[idx] = de;
+            ht->used++;
+            return;
+        }
+        idx = (idx+DICT_OA_GROUP_SIZE) & ht->sizemask;
+    }
+    /* The load factor guarantees there are always free slots. */
+    assert(0);
+}
+
+/* Remove the entry at slot 'idx' from the open addressing table 'ht'. */
+static void _dictOARemove(dictht *ht, unsigned long idx) {
+    if (_dictGroupMatch(ht->tags+dictSlotGroup(ht,idx),DICT_TAG_EMPTY)) {
+        ht->tags[idx] = DICT_TAG_EMPTY;
+    } else {
+        ht->tags[idx] = DICT_TAG_DELETED;
+        ht->deleted++;
+    }
+    ht->table[idx] = NULL;
+    ht->used--;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -102,9 +267,11 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
 static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->tags = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->deleted = 0;
 }
 
 /* Create a new hash table */
@@ -117,6 +284,16 @@ dict *dictCreate(dictType *type,
     return d;
 }
 
+/* Create a new hash table using open addressing instead of chaining. */
+dict *dictCreateOpenAddressing(dictType *type,
+        void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->openaddr = 1;
+    return d;
+}
+
 /* Initialize the hash table */
 int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
@@ -127,6 +304,7 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->openaddr = 0;
     return DICT_OK;
 }
 
@@ -143,6 +321,63 @@ int dictResize(dict *d)
     return dictExpand(d, minimal);
 }
 
+/* Return the size of the table dictExpand() would create to hold 'size'
+ * elements. */
+unsigned long dictExpandSize(dict *d, unsigned long size) {
+    unsigned long realsize;
+
+    /* Open addressing tables can't be fully loaded, see dictOAOverLoad(). */
+    if (d->openaddr) {
+        realsize = _dictNextPower(size+size/7+1);
+        if (realsize < DICT_OA_GROUP_SIZE) realsize = DICT_OA_GROUP_SIZE;
+    } else {
+        realsize = _dictNextPower(size);
+    }
+    return realsize;
+}
+
+/* Return the bytes allocated by a table of 'realsize' slots. */
+size_t dictTableBytes(unsigned long realsize, int openaddr) {
+    return realsize*(sizeof(dictEntry*)+(openaddr ? 1 : 0));
+}
+
+/* Allocate in 'n' an empty table of 'realsize' slots, a power of two, for
+ * a dict using open addressing or not. This does not access any dict, so
+ * it can be called by other threads, see dictExpandWithTable(). */
+void dictAllocTable(dictht *n, unsigned long realsize, int openaddr) {
+    n->size = realsize;
+    n->sizemask = realsize-1;
+    n->table = zcalloc(realsize*sizeof(dictEntry*));
+    n->tags = NULL;
+    if (openaddr) {
+        n->tags = zmalloc(realsize);
+        memset(n->tags,DICT_TAG_EMPTY,realsize);
+    }
+    n->used = 0;
+    n->deleted = 0;
+}
+
+/* Release a table allocated with dictAllocTable() and never used. */
+void dictFreeTable(dictht *n) {
+    zfree(n->table);
+    zfree(n->tags);
+}
+
+/* Start rehashing 'd' to the table 'n', allocated with dictAllocTable()
+ * maybe by another thread. Returns DICT_ERR if the table is not suitable
+ * anymore, because the dict changed meanwhile: the caller should then
+ * release it with dictFreeTable(). */
+int dictExpandWithTable(dict *d, dictht *n) {
+    if (dictIsRehashing(d) || d->ht[0].table == NULL ||
+        (n->tags != NULL) != (d->openaddr != 0) ||
+        n->size <= d->ht[0].size ||
+        dictExpandSize(d,d->ht[0].used) > n->size ||
+        dictExpandSize(d,d->ht[0].used*4) < n->size) return DICT_ERR;
+    d->ht[1] = *n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
 /* Expand or create the hash table */
 int dictExpand(dict *d, unsigned long size)
 {
@@ -152,16 +387,14 @@ int dictExpand(dict *d, unsigned long size)
         return DICT_ERR;
 
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize = dictExpandSize(d,size);
 
-    /* Rehashing to the same table size is not useful. */
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    /* Rehashing to the same table size is not useful, unless it is needed
+     * to get rid of tombstones. */
+    if (realsize == d->ht[0].size && !d->ht[0].deleted) return DICT_ERR;
 
     /* Allocate the new hash table and initialize all pointers to NULL */
-    n.size = realsize;
-    n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
-    n.used = 0;
+    dictAllocTable(&n,realsize,d->openaddr);
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -188,6 +421,7 @@ int dictExpand(dict *d, unsigned long size)
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    TRACE4(dict_rehash_step,d,n,d->rehashidx,d->ht[0].size);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -200,6 +434,15 @@ int dictRehash(dict *d, int n) {
             if (--empty_visits == 0) return 1;
         }
         de = d->ht[0].table[d->rehashidx];
+        if (d->openaddr) {
+            /* Leave a tombstone to keep probe sequences working. */
+            _dictOAInsert(&d->ht[1],de,dictHashKey(d,de->key));
+            d->ht[0].tags[d->rehashidx] = DICT_TAG_DELETED;
+            d->ht[0].table[d->rehashidx] = NULL;
+            d->ht[0].used--;
+            d->rehashidx++;
+            continue;
+        }
         /* Move all the keys in this bucket from the old to the new hash HT */
         while(de) {
             uint64_t h;
@@ -220,9 +463,11 @@ int dictRehash(dict *d, int n) {
     /* Check if we already rehashed the whole table... */
     if (d->ht[0].used == 0) {
         zfree(d->ht[0].table);
+        zfree(d->ht[0].tags);
         d->ht[0] = d->ht[1];
         _dictReset(&d->ht[1]);
         d->rehashidx = -1;
+        TRACE2(dict_rehash_end,d,d->ht[0].size);
         return 0;
     }
 
@@ -258,7 +503,10 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * dictionary so that the hash table automatically migrates from H1 to H2
  * while it is actively used. */
 static void _dictRehashStep(dict *d) {
-    if (d->iterators == 0) dictRehash(d,1);
+    /* Open addressing moves a single entry per step: move a group worth
+     * of slots in order to not fill the new table before we are done. */
+    if (d->iterators == 0 && dict_rehashing_paused == 0)
+        dictRehash(d,d->openaddr ? DICT_OA_GROUP_SIZE : 1);
 }
 
 /* Add an element to the target hash table */
@@ -294,12 +542,14 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     long index;
     dictEntry *entry;
     dictht *ht;
+    uint64_t hash;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    hash = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry.
@@ -307,13 +557,22 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
-    entry->next = ht->table[index];
-    ht->table[index] = entry;
-    ht->used++;
-
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
+    size_t entrysize = dictEntrySize(d), metasize = dictMetadataSize(d);
+    if (dictHasEmbeddedKeys(d)) {
+        entry = zmalloc(entrysize+metasize+d->type->keyEmbeddedSize(key));
+        entry->key = d->type->keyEmbed((char*)entry+entrysize+metasize,key);
+    } else {
+        entry = zmalloc(entrysize+metasize);
+        dictSetKey(d, entry, key);
+    }
+    if (metasize) memset(dictMetadata(d,entry),0,metasize);
+    if (d->openaddr) {
+        _dictOAInsert(ht,entry,hash);
+    } else {
+        entry->next = ht->table[index];
+        ht->table[index] = entry;
+        ht->used++;
+    }
     return entry;
 }
 
@@ -339,7 +598,7 @@ int dictReplace(dict *d, void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    auxentry = *existing;
+    auxentry.v = existing->v;
     dictSetVal(d, existing, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -372,6 +631,17 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     h = dictHashKey(d, key);
 
     for (table = 0; table <= 1; table++) {
+        if (d->openaddr) {
+            long slot = _dictOAFind(d,&d->ht[table],key,h,0);
+            if (slot != -1) {
+                he = d->ht[table].table[slot];
+                _dictOARemove(&d->ht[table],slot);
+                if (!nofree) dictFreeUnlinkedEntry(d,he);
+                return he;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         prevHe = NULL;
@@ -450,7 +720,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
 
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
-            nextHe = he->next;
+            nextHe = dictEntryNext(d,he);
             dictFreeKey(d, he);
             dictFreeVal(d, he);
             zfree(he);
@@ -460,6 +730,7 @@ int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     }
     /* Free the table and the allocated cache structure */
     zfree(ht->table);
+    zfree(ht->tags);
     /* Re-initialize the table */
     _dictReset(ht);
     return DICT_OK; /* never fails */
@@ -473,6 +744,42 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
+/* Release the entries stored in the slots from 'start' to 'end' (excluded)
+ * of the table 'table' of the dict, leaving the slots empty, and return the
+ * number of released entries. The counters of the dict are not updated, so
+ * that different threads can release different ranges of a dict nobody else
+ * is accessing at the same time: once all the slots were released, the
+ * dict should be freed with dictReleaseEmptied(). */
+unsigned long dictReleaseSlotRange(dict *d, int table, unsigned long start,
+                                   unsigned long end)
+{
+    dictht *ht = &d->ht[table];
+    unsigned long i, released = 0;
+
+    if (end > ht->size) end = ht->size;
+    for (i = start; i < end; i++) {
+        dictEntry *he = ht->table[i], *nextHe;
+
+        while(he) {
+            nextHe = dictEntryNext(d,he);
+            dictFreeKey(d, he);
+            dictFreeVal(d, he);
+            zfree(he);
+            released++;
+            he = nextHe;
+        }
+        ht->table[i] = NULL;
+    }
+    return released;
+}
+
+/* Free a dict after all its entries were released by dictReleaseSlotRange(). */
+void dictReleaseEmptied(dict *d) {
+    d->ht[0].used = 0;
+    d->ht[1].used = 0;
+    dictRelease(d);
+}
+
 dictEntry *dictFind(dict *d, const void *key)
 {
     dictEntry *he;
@@ -482,6 +789,12 @@ dictEntry *dictFind(dict *d, const void *key)
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
+        if (d->openaddr) {
+            long slot = _dictOAFind(d,&d->ht[table],key,h,0);
+            if (slot != -1) return d->ht[table].table[slot];
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
@@ -494,6 +807,103 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+/* Prefetch the buckets where 'key' would be, so that a dictFind() called
+ * shortly after does not wait for memory: callers looking up many keys in a
+ * row prefetch a batch of them first, so that the cache misses overlap. */
+void dictPrefetch(dict *d, const void *key) {
+    uint64_t h;
+
+    if (d->ht[0].used + d->ht[1].used == 0) return;
+    h = dictHashKey(d, key);
+    for (int table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+        if (ht->size == 0) continue;
+        __builtin_prefetch(&ht->table[h & ht->sizemask]);
+        if (ht->tags) __builtin_prefetch(&ht->tags[h & ht->sizemask]);
+        if (!dictIsRehashing(d)) break;
+    }
+}
+
+/* Like dictFind() for the 'count' keys of 'keys', storing the entries found,
+ * or NULL, in 'entries'. The lookups are performed in stages, so that the
+ * cache misses of the keys of a batch overlap instead of adding up: first
+ * all the hashes are computed and the buckets prefetched, then the entries
+ * the buckets point to are prefetched, then the keys and the values of the
+ * entries, and finally the keys are compared. */
+#define DICT_FIND_BATCH 16
+void dictFindMany(dict *d, const void **keys, dictEntry **entries,
+                  unsigned long count)
+{
+    uint64_t hashes[DICT_FIND_BATCH];
+    dictEntry *heads[DICT_FIND_BATCH];
+    dictht *ht = &d->ht[0];
+
+    /* Rehashing dicts need two lookups per key, and a rehash step. */
+    if (d->ht[0].used + d->ht[1].used == 0 || dictIsRehashing(d)) {
+        for (unsigned long j = 0; j < count; j++)
+            entries[j] = dictFind(d,keys[j]);
+        return;
+    }
+
+    for (unsigned long base = 0; base < count; base += DICT_FIND_BATCH) {
+        unsigned long n = count-base, j;
+        if (n > DICT_FIND_BATCH) n = DICT_FIND_BATCH;
+        const void **k = keys+base;
+
+        /* Stage 1: the buckets. */
+        for (j = 0; j < n; j++) {
+            unsigned long idx;
+            hashes[j] = dictHashKey(d,k[j]);
+            idx = hashes[j] & ht->sizemask;
+            if (d->openaddr) {
+                idx = dictSlotGroup(ht,idx);
+                __builtin_prefetch(&ht->tags[idx]);
+            }
+            __builtin_prefetch(&ht->table[idx]);
+        }
+
+        /* Stage 2: the first entry of the buckets, or of the probe sequence
+         * with a matching tag in open addressing dicts. */
+        for (j = 0; j < n; j++) {
+            unsigned long idx = hashes[j] & ht->sizemask;
+            if (d->openaddr) {
+                idx = dictSlotGroup(ht,idx);
+                unsigned int match =
+                    _dictGroupMatch(ht->tags+idx,dictHashTag(hashes[j]));
+                heads[j] = match ? ht->table[idx+__builtin_ctz(match)] : NULL;
+            } else {
+                heads[j] = ht->table[idx];
+            }
+            if (heads[j]) __builtin_prefetch(heads[j]);
+        }
+
+        /* Stage 3: the keys and the values of those entries. Only the
+         * values that are freed with a destructor are known to be pointers. */
+        for (j = 0; j < n; j++) {
+            if (heads[j] == NULL) continue;
+            __builtin_prefetch(heads[j]->key);
+            if (d->type->valDestructor) __builtin_prefetch(heads[j]->v.val);
+        }
+
+        /* Stage 4: resolve. */
+        for (j = 0; j < n; j++) {
+            dictEntry *he = NULL;
+            if (d->openaddr) {
+                long slot = _dictOAFind(d,ht,k[j],hashes[j],0);
+                if (slot != -1) he = ht->table[slot];
+            } else {
+                for (he = ht->table[hashes[j] & ht->sizemask]; he;
+                     he = he->next)
+                {
+                    if (k[j] == he->key || dictCompareKeys(d,k[j],he->key))
+                        break;
+                }
+            }
+            entries[base+j] = he;
+        }
+    }
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
@@ -587,7 +997,7 @@ dictEntry *dictNext(dictIterator *iter)
         if (iter->entry) {
             /* We need to save the 'next' here, the iterator user
              * may delete the entry we are returning. */
-            iter->nextEntry = iter->entry->next;
+            iter->nextEntry = dictEntryNext(iter->d,iter->entry);
             return iter->entry;
         }
     }
@@ -639,7 +1049,7 @@ dictEntry *dictGetRandomKey(dict *d)
     listlen = 0;
     orighe = he;
     while(he) {
-        he = he->next;
+        he = dictEntryNext(d,he);
         listlen++;
     }
     listele = random() % listlen;
@@ -728,7 +1138,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                      * empty while iterating. */
                     *des = he;
                     des++;
-                    he = he->next;
+                    he = dictEntryNext(d,he);
                     stored++;
                     if (stored == count) return stored;
                 }
@@ -775,6 +1185,56 @@ static unsigned long rev(unsigned long v) {
     return v;
 }
 
+/* Return the mask of the dictScan() cursor for the table 'ht'. */
+static unsigned long _dictScanMask(dict *d, dictht *ht) {
+    return d->openaddr ? ht->sizemask/DICT_OA_GROUP_SIZE : ht->sizemask;
+}
+
+/* Emit the entries of the bucket 'b' of the table 'ht' for dictScan().
+ *
+ * With open addressing the bucket 'b' is the group of slots b, and its
+ * entries are the ones whose key hashes to this group, no matter in which
+ * group of the probe sequence they are stored. Since the group of a key only
+ * depends on the hash bits covered by the mask like with chaining, the
+ * dictScan() guarantees hold across resizes. */
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long b,
+                            dictScanFunction *fn,
+                            dictScanBucketFunction *bucketfn,
+                            void *privdata)
+{
+    dictEntry **ref, *de, *next;
+
+    if (d->openaddr) {
+        unsigned long idx = b*DICT_OA_GROUP_SIZE, probes;
+        unsigned long mask = _dictScanMask(d,ht);
+
+        for (probes = 0; probes < ht->size; probes += DICT_OA_GROUP_SIZE) {
+            for (int j = 0; j < DICT_OA_GROUP_SIZE; j++) {
+                ref = &ht->table[idx+j];
+                if (*ref == NULL ||
+                    ((dictHashKey(d,(*ref)->key)/DICT_OA_GROUP_SIZE) & mask)
+                    != b) continue;
+                if (bucketfn) bucketfn(privdata, ref);
+                fn(privdata, *ref);
+            }
+            if (_dictGroupMatch(ht->tags+idx,DICT_TAG_EMPTY)) break;
+            idx = (idx+DICT_OA_GROUP_SIZE) & ht->sizemask;
+        }
+        return;
+    }
+
+    if (bucketfn) {
+        for (ref = &ht->table[b]; *ref; ref = &(*ref)->next)
+            bucketfn(privdata, ref);
+    }
+    de = ht->table[b];
+    while (de) {
+        next = de->next;
+        fn(privdata, de);
+        de = next;
+    }
+}
+
 /* dictScan() is used to iterate over the elements of a dictionary.
  *
  * Iterating works the following way:
@@ -858,6 +1318,14 @@ static unsigned long rev(unsigned long v) {
  *    we are sure we don't miss keys moving during rehashing.
  * 3) The reverse cursor is somewhat hard to understand at first, but this
  *    comment is supposed to help.
+ *
+ * OPEN ADDRESSING
+ *
+ * Open addressing tables are scanned the same way, but the cursor
+ * addresses groups of slots instead of buckets, see _dictScanBucket().
+ *
+ * The optional 'bucketfn' callback is called, before 'fn', with a reference
+ * to every entry pointer of the bucket, so that it can reallocate the entry.
  */
 unsigned long dictScan(dict *d,
                        unsigned long v,
@@ -866,23 +1334,16 @@ unsigned long dictScan(dict *d,
                        void *privdata)
 {
     dictht *t0, *t1;
-    const dictEntry *de, *next;
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
 
     if (!dictIsRehashing(d)) {
         t0 = &(d->ht[0]);
-        m0 = t0->sizemask;
+        m0 = _dictScanMask(d,t0);
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(d,t0,v & m0,fn,bucketfn,privdata);
 
         /* Set unmasked bits so incrementing the reversed cursor
          * operates on the masked bits */
@@ -903,29 +1364,17 @@ unsigned long dictScan(dict *d,
             t1 = &d->ht[0];
         }
 
-        m0 = t0->sizemask;
-        m1 = t1->sizemask;
+        m0 = _dictScanMask(d,t0);
+        m1 = _dictScanMask(d,t1);
 
         /* Emit entries at cursor */
-        if (bucketfn) bucketfn(privdata, &t0->table[v & m0]);
-        de = t0->table[v & m0];
-        while (de) {
-            next = de->next;
-            fn(privdata, de);
-            de = next;
-        }
+        _dictScanBucket(d,t0,v & m0,fn,bucketfn,privdata);
 
         /* Iterate over indices in larger table that are the expansion
          * of the index pointed to by the cursor in the smaller table */
         do {
             /* Emit entries at cursor */
-            if (bucketfn) bucketfn(privdata, &t1->table[v & m1]);
-            de = t1->table[v & m1];
-            while (de) {
-                next = de->next;
-                fn(privdata, de);
-                de = next;
-            }
+            _dictScanBucket(d,t1,v & m1,fn,bucketfn,privdata);
 
             /* Increment the reverse cursor not covered by the smaller mask.*/
             v |= ~m1;
@@ -942,22 +1391,71 @@ unsigned long dictScan(dict *d,
 
 /* ------------------------- private functions ------------------------------ */
 
+/* Ask the expandAllowed() callback of the type, if any, whether the table
+ * can grow now. Not called once the load is over the "safe" threshold. */
+static int _dictExpandAllowed(dict *d) {
+    if (d->type->expandAllowed == NULL) return 1;
+    return d->type->expandAllowed(d,dictExpandSize(d,d->ht[0].used*2),
+                                  (double)d->ht[0].used/d->ht[0].size);
+}
+
+/* While safe iterators are running the rehashing is stalled, and all the
+ * new entries go to ht[1]: unlike chains, an open addressing table can run
+ * out of slots. Once ht[1] is over the load we can't wait for anymore, the
+ * rehashing is completed at once if no iterator forbids it. Otherwise the
+ * entries of ht[1] are moved to a table twice as large, so a safe iterator
+ * already walking ht[1] may return some of them twice, or miss them. The
+ * entries of ht[0] are not affected. */
+static int _dictOAExpandWhileRehashing(dict *d) {
+    dictht *ht = &d->ht[1], n;
+    unsigned long j;
+
+    if (!dictOAOverForceLoad(ht->used+ht->deleted,ht->size)) return DICT_OK;
+    if (d->iterators == 0) {
+        while (dictRehash(d,100));
+        return _dictExpandIfNeeded(d);
+    }
+    dictAllocTable(&n,dictExpandSize(d,(d->ht[0].used+ht->used)*2),1);
+    for (j = 0; j < ht->size; j++) {
+        dictEntry *de = ht->table[j];
+        if (de) _dictOAInsert(&n,de,dictHashKey(d,de->key));
+    }
+    dictFreeTable(ht);
+    *ht = n;
+    return DICT_OK;
+}
+
 /* Expand the hash table if needed */
 static int _dictExpandIfNeeded(dict *d)
 {
     /* Incremental rehashing already in progress. Return. */
-    if (dictIsRehashing(d)) return DICT_OK;
+    if (dictIsRehashing(d))
+        return d->openaddr ? _dictOAExpandWhileRehashing(d) : DICT_OK;
 
     /* If the hash table is empty expand it to the initial size. */
     if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
 
+    /* Open addressing tables instead can't wait for a 1:1 ratio: they are
+     * resized when their load, tombstones included, is over the limit. */
+    if (d->openaddr) {
+        unsigned long fill = d->ht[0].used+d->ht[0].deleted;
+
+        if (dictOAOverLoad(fill,d->ht[0].size) &&
+            (dictOAOverForceLoad(fill,d->ht[0].size) ||
+             (dict_can_resize && _dictExpandAllowed(d))))
+        {
+            return dictExpand(d, d->ht[0].used*2);
+        }
+        return DICT_OK;
+    }
+
     /* If we reached the 1:1 ratio, and we are allowed to resize the hash
      * table (global setting) or we should avoid it but the ratio between
      * elements/buckets is over the "safe" threshold, we resize doubling
      * the number of buckets. */
     if (d->ht[0].used >= d->ht[0].size &&
-        (dict_can_resize ||
-         d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
+        (d->ht[0].used/d->ht[0].size > dict_force_resize_ratio ||
+         (dict_can_resize && _dictExpandAllowed(d))))
     {
         return dictExpand(d, d->ht[0].used*2);
     }
@@ -986,7 +1484,7 @@ static unsigned long _dictNextPower(unsigned long size)
  * index is always returned in the context of the second (new) hash table. */
 static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **existing)
 {
-    unsigned long idx, table;
+    unsigned long idx = 0, table;
     dictEntry *he;
     if (existing) *existing = NULL;
 
@@ -994,6 +1492,16 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
     for (table = 0; table <= 1; table++) {
+        if (d->openaddr) {
+            /* The slot is chosen by _dictOAInsert(), just check the key. */
+            long slot = _dictOAFind(d,&d->ht[table],key,hash,0);
+            if (slot != -1) {
+                if (existing) *existing = d->ht[table].table[slot];
+                return -1;
+            }
+            if (!dictIsRehashing(d)) break;
+            continue;
+        }
         idx = hash & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
         he = d->ht[table].table[idx];
@@ -1006,7 +1514,7 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
         }
         if (!dictIsRehashing(d)) break;
     }
-    return idx;
+    return d->openaddr ? 0 : (long)idx;
 }
 
 void dictEmpty(dict *d, void(callback)(void*)) {
@@ -1024,6 +1532,14 @@ void dictDisableResize(void) {
     dict_can_resize = 0;
 }
 
+void dictPauseRehashing(void) {
+    dict_rehashing_paused++;
+}
+
+void dictResumeRehashing(void) {
+    dict_rehashing_paused--;
+}
+
 uint64_t dictGetHash(dict *d, const void *key) {
     return dictHashKey(d, key);
 }
@@ -1039,6 +1555,12 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
 
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     for (table = 0; table <= 1; table++) {
+        if (d->openaddr) {
+            long slot = _dictOAFind(d,&d->ht[table],oldptr,hash,1);
+            if (slot != -1) return &d->ht[table].table[slot];
+            if (!dictIsRehashing(d)) return NULL;
+            continue;
+        }
         idx = hash & d->ht[table].sizemask;
         heref = &d->ht[table].table[idx];
         he = *heref;
@@ -1056,7 +1578,7 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t h
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
-size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
+size_t _dictGetStatsHt(char *buf, size_t bufsize, dict *d, dictht *ht, int tableid) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
     unsigned long totchainlen = 0;
     unsigned long clvector[DICT_STATS_VECTLEN];
@@ -1082,7 +1604,7 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
         he = ht->table[i];
         while(he) {
             chainlen++;
-            he = he->next;
+            he = dictEntryNext(d,he);
         }
         clvector[(chainlen < DICT_STATS_VECTLEN) ? chainlen : (DICT_STATS_VECTLEN-1)]++;
         if (chainlen > maxchainlen) maxchainlen = chainlen;
@@ -1097,11 +1619,16 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
         " different slots: %ld\n"
         " max chain length: %ld\n"
         " avg chain length (counted): %.02f\n"
-        " avg chain length (computed): %.02f\n"
-        " Chain length distribution:\n",
+        " avg chain length (computed): %.02f\n",
         tableid, (tableid == 0) ? "main hash table" : "rehashing target",
         ht->size, ht->used, slots, maxchainlen,
         (float)totchainlen/slots, (float)ht->used/slots);
+    if (d->openaddr && l < bufsize) {
+        l += snprintf(buf+l,bufsize-l,
+            " open addressing deleted slots: %ld\n", ht->deleted);
+    }
+    if (l < bufsize)
+        l += snprintf(buf+l,bufsize-l," Chain length distribution:\n");
 
     for (i = 0; i < DICT_STATS_VECTLEN-1; i++) {
         if (clvector[i] == 0) continue;
@@ -1122,11 +1649,11 @@ void dictGetStats(char *buf, size_t bufsize, dict *d) {
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    l = _dictGetStatsHt(buf,bufsize,d,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        _dictGetStatsHt(buf,bufsize,d,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1158,6 +1685,12 @@ void freeCallback(void *privdata, void *val) {
     sdsfree(val);
 }
 
+void scanCallback(void *privdata, const dictEntry *de) {
+    DICT_NOTUSED(de);
+
+    (*(unsigned long*)privdata)++;
+}
+
 dictType BenchmarkDictType = {
     hashCallback,
     NULL,
@@ -1173,18 +1706,26 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
+/* dict-benchmark [count] [openaddr] */
 int main(int argc, char **argv) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
+    dict *dict;
     long count = 0;
+    size_t mem;
 
-    if (argc == 2) {
+    if (argc >= 2) {
         count = strtol(argv[1],NULL,10);
     } else {
         count = 5000000;
     }
+    if (argc >= 3 && !strcmp(argv[2],"openaddr")) {
+        dict = dictCreateOpenAddressing(&BenchmarkDictType,NULL);
+        printf("Using open addressing\n");
+    } else {
+        dict = dictCreate(&BenchmarkDictType,NULL);
+    }
+    mem = zmalloc_used_memory();
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1198,6 +1739,8 @@ int main(int argc, char **argv) {
     while (dictIsRehashing(dict)) {
         dictRehashMilliseconds(dict,100);
     }
+    printf("Memory used by the dict (keys included): %zu bytes\n",
+        zmalloc_used_memory()-mem);
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1246,5 +1789,38 @@ int main(int argc, char **argv) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+
+    start_benchmark();
+    unsigned long cursor = 0, scanned = 0;
+    do {
+        cursor = dictScan(dict,cursor,scanCallback,NULL,&scanned);
+    } while (cursor);
+    assert(scanned >= (unsigned long)count);
+    end_benchmark("Scanning");
+
+    /* A safe iterator stalls the rehashing: adding many entries meanwhile
+     * must not run out of slots of the open addressing table. */
+    if (!dict->openaddr) return 0;
+    dictRelease(dict);
+    dict = dictCreateOpenAddressing(&BenchmarkDictType,NULL);
+    for (j = 0; !dictIsRehashing(dict); j++)
+        dictAdd(dict,sdsfromlonglong(j),(void*)j);
+    dictIterator *iter = dictGetSafeIterator(dict);
+    assert(dictNext(iter) != NULL);
+    start_benchmark();
+    for (; j < count; j++) {
+        int retval = dictAdd(dict,sdsfromlonglong(j),(void*)j);
+        assert(retval == DICT_OK);
+    }
+    end_benchmark("Inserting with a safe iterator");
+    while (dictNext(iter) != NULL);
+    dictReleaseIterator(iter);
+    for (j = 0; j < count; j++) {
+        sds key = sdsfromlonglong(j);
+        assert(dictFind(dict,key) != NULL);
+        sdsfree(key);
+    }
+    dictRelease(dict);
+    return 0;
 }
 #endif
@@ -34,6 +34,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef __DICT_H
 #define __DICT_H
@@ -52,9 +53,11 @@ typedef struct dictEntry {
         int64_t s64;
         double d;
     } v;
-    struct dictEntry *next;
+    struct dictEntry *next; /* Not allocated by open addressing dicts. */
 } dictEntry;
 
+struct dict;
+
 typedef struct dictType {
     uint64_t (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
@@ -62,15 +65,34 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    /* Optionally a copy of the key can be stored in the same allocation of
+     * the entry: keyEmbeddedSize() returns the bytes needed by the key, and
+     * keyEmbed() copies the key in the buffer, returning the new key. Such
+     * keys are released with the entry, so keyDestructor should be NULL. */
+    size_t (*keyEmbeddedSize)(const void *key);
+    void *(*keyEmbed)(void *buf, const void *key);
+    /* Optional number of bytes of metadata to allocate, zeroed, after every
+     * entry of the dict. They can be accessed with dictMetadata(). */
+    size_t (*entryMetadataBytes)(struct dict *d);
+    /* Optionally called before the table grows to 'size' slots, when its
+     * load is 'load': returning 0 delays the growth. Once the load is over
+     * the limit the table grows anyway. */
+    int (*expandAllowed)(struct dict *d, unsigned long size, double load);
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ *
+ * Open addressing dicts store at most one entry per slot, and use 'tags'
+ * to keep one control byte per slot: see the "Open addressing" section of
+ * dict.c for more information. */
 typedef struct dictht {
     dictEntry **table;
+    uint8_t *tags;          /* Slot tags, open addressing only. */
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    unsigned long deleted;  /* Deleted slots, open addressing only. */
 } dictht;
 
 typedef struct dict {
@@ -79,6 +101,7 @@ typedef struct dict {
     dictht ht[2];
     long rehashidx; /* rehashing not in progress if rehashidx == -1 */
     unsigned long iterators; /* number of iterators currently running */
+    int openaddr; /* Open addressing instead of chaining, see dict.c. */
 } dict;
 
 /* If safe is set to 1 this is a safe iterator, that means, you can call
@@ -97,9 +120,21 @@ typedef struct dictIterator {
 typedef void (dictScanFunction)(void *privdata, const dictEntry *de);
 typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
+/* Functions used to hash the keys, see dictSetHashFunction(). */
+#define DICT_HASH_SIPHASH 0     /* SipHash 1-2, the default. */
+#define DICT_HASH_AES 1         /* AES-NI based, when supported by the CPU. */
+
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
+/* Open addressing tables are scanned in groups of slots, so that tags can be
+ * matched many at a time. This is also their minimal size. */
+#define DICT_OA_GROUP_SIZE       16
+
+/* Open addressing dicts never link entries, so they don't allocate the
+ * 'next' field of dictEntry. */
+#define DICT_OA_ENTRY_SIZE       offsetof(dictEntry,next)
+
 /* ------------------------------- Macros ------------------------------------*/
 #define dictFreeVal(d, entry) \
     if ((d)->type->valDestructor) \
@@ -146,10 +181,24 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpenAddressing(d) ((d)->openaddr)
+#define dictEntryNext(d, he) (dictIsOpenAddressing(d) ? NULL : (he)->next)
+#define dictHasEmbeddedKeys(d) ((d)->type->keyEmbed != NULL)
+#define dictMetadataSize(d) \
+    ((d)->type->entryMetadataBytes ? (d)->type->entryMetadataBytes(d) : 0)
+#define dictMetadata(d, he) ((void*)((char*)(he)+dictEntrySize(d)))
+#define dictEntrySize(d) \
+    (dictIsOpenAddressing(d) ? DICT_OA_ENTRY_SIZE : sizeof(dictEntry))
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+dict *dictCreateOpenAddressing(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
+unsigned long dictExpandSize(dict *d, unsigned long size);
+size_t dictTableBytes(unsigned long realsize, int openaddr);
+void dictAllocTable(dictht *n, unsigned long realsize, int openaddr);
+void dictFreeTable(dictht *n);
+int dictExpandWithTable(dict *d, dictht *n);
 int dictAdd(dict *d, void *key, void *val);
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
 dictEntry *dictAddOrFind(dict *d, void *key);
@@ -158,7 +207,11 @@ int dictDelete(dict *d, const void *key);
 dictEntry *dictUnlink(dict *ht, const void *key);
 void dictFreeUnlinkedEntry(dict *d, dictEntry *he);
 void dictRelease(dict *d);
+unsigned long dictReleaseSlotRange(dict *d, int table, unsigned long start, unsigned long end);
+void dictReleaseEmptied(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
+void dictPrefetch(dict *d, const void *key);
+void dictFindMany(dict *d, const void **keys, dictEntry **entries, unsigned long count);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -174,14 +227,22 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
+void dictPauseRehashing(void);
+void dictResumeRehashing(void);
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
 void dictSetHashFunctionSeed(uint8_t *seed);
 uint8_t *dictGetHashFunctionSeed(void);
+int dictSetHashFunction(int type);
+int dictGetHashFunction(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
 uint64_t dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);
 
+#ifdef REDIS_TEST
+int aeshashTest(int argc, char *argv[]);
+#endif
+
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
 extern dictType dictTypeHeapStrings;
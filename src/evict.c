@@ -59,6 +59,7 @@ struct evictionPoolEntry {
 };
 
 static struct evictionPoolEntry *EvictionPoolLRU;
+static struct evictionPoolEntry *EvictionPoolDb; /* For db-maxmemory. */
 
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
@@ -136,7 +137,7 @@ unsigned long long estimateObjectIdleTime(robj *o) {
  * evicted in the whole database. */
 
 /* Create a new eviction pool. */
-void evictionPoolAlloc(void) {
+static struct evictionPoolEntry *evictionPoolCreate(void) {
     struct evictionPoolEntry *ep;
     int j;
 
@@ -147,7 +148,30 @@ void evictionPoolAlloc(void) {
         ep[j].cached = sdsnewlen(NULL,EVPOOL_CACHED_SDS_SIZE);
         ep[j].dbid = 0;
     }
-    EvictionPoolLRU = ep;
+    return ep;
+}
+
+/* Create the pool used by freeMemoryIfNeeded(), and the one used when
+ * evicting the keys of a single DB, that may be populated with keys of
+ * other DBs as well: they are just ignored. */
+void evictionPoolAlloc(void) {
+    EvictionPoolLRU = evictionPoolCreate();
+    EvictionPoolDb = evictionPoolCreate();
+}
+
+/* Elements sampled by objectComputeSize() to estimate the size of aggregate
+ * values for the size aware policies. */
+#define EVICTION_SIZE_SAMPLES 5
+
+/* With tiered storage, populating the pool is attempted this many times
+ * when the sampled values are all on disk already. */
+#define EVICTION_TIERED_MAX_EMPTY 16
+
+/* Return 1 if the pool has no candidate left. */
+static int evictionPoolIsEmpty(struct evictionPoolEntry *pool) {
+    for (int k = 0; k < EVPOOL_SIZE; k++)
+        if (pool[k].key) return 0;
+    return 1;
 }
 
 /* This is an helper function for freeMemoryIfNeeded(), it is used in order
@@ -159,11 +183,17 @@ void evictionPoolAlloc(void) {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    /* The volatile policies sample the expire index, that references the
+     * keyspace entries directly, so no further lookup is needed. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS)
+        count = dictGetSomeKeys(db->dict,samples,server.maxmemory_samples);
+    else
+        count = expireIndexGetSomeKeys(db->expires,samples,
+                                       server.maxmemory_samples);
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -172,20 +202,25 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
 
         de = samples[j];
         key = dictGetKey(de);
+        o = dictGetVal(de);
 
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
+        /* With tiered storage the candidates are the values that can be
+         * moved on disk, see performEvictions(). */
+        if (server.tiered_storage && !tieredCanSwapOut(db,de)) continue;
 
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
          * just a score where an higher score means better candidate. */
         if (server.maxmemory_policy & MAXMEMORY_FLAG_LRU) {
             idle = estimateObjectIdleTime(o);
+        } else if (server.maxmemory_policy & MAXMEMORY_FLAG_SIZE) {
+            /* Size aware LFU, in the spirit of GreedyDual-Size: the inverted
+             * frequency is weighted by the memory used by the key, so that
+             * freeing a large cold value is preferred to evicting many small
+             * keys accessed as rarely. */
+            size_t size = sdslen(key) +
+                          objectComputeSize(o,EVICTION_SIZE_SAMPLES);
+            idle = (unsigned long long)(256-LFUDecrAndReturn(o))*size;
         } else if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
             /* When we use an LRU policy, we sort the keys by idle time
              * so that we expire keys starting from greater idle time.
@@ -197,7 +232,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - dbEntryGetExpire(db,de);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -341,6 +376,186 @@ unsigned long LFUDecrAndReturn(robj *o) {
     return counter;
 }
 
+/* ----------------------------------------------------------------------------
+ * Eviction statistics.
+ *
+ * In order to tune the maxmemory policy from production data, we keep
+ * an histogram of the idle time of the keys we evict, and we are able to
+ * compare the current policy with a simulated exact LRU cache.
+ *
+ * Simulating the whole keyspace would double the memory usage, so only one
+ * key out of "maxmemory-shadow-sampling" is tracked, selecting it by hashing
+ * its name: given that a key is either always or never tracked, the hit
+ * ratio of the sampled keys in a cache sized 1/N of the real one is a good
+ * estimation of the hit ratio of the full cache. The simulated cache is
+ * sized as the real keyspace, so it is exactly what an exact LRU would
+ * keep using the memory the current policy is using.
+ * --------------------------------------------------------------------------*/
+
+/* Upper bounds, in seconds, of the idle time histogram buckets. The last
+ * bucket holds everything idle for more than one day. */
+static const unsigned long evictionIdleBuckets[] = {1,10,60,600,3600,86400};
+static const char *evictionIdleBucketNames[] = {
+    "<1s","<10s","<1m","<10m","<1h","<1d",">=1d"
+};
+#define EVICTION_IDLE_BUCKETS \
+    (sizeof(evictionIdleBuckets)/sizeof(evictionIdleBuckets[0])+1)
+
+static struct {
+    long long evicted_idle[EVICTION_IDLE_BUCKETS];
+    long long sampled_hits;     /* Real hits of the tracked keys. */
+    long long sampled_misses;   /* Real misses of the tracked keys. */
+    long long shadow_hits;      /* Hits of the simulated exact LRU. */
+    long long shadow_misses;    /* Misses of the simulated exact LRU. */
+} evictionStats;
+
+static dict *shadowKeys = NULL; /* Tracked key -> node in shadowLRU. */
+static list *shadowLRU = NULL;  /* Tracked keys, most recent at the head. */
+
+/* Account the eviction of the object 'o' in the idle time histogram.
+ * With LFU policies the access time is only known with a resolution of
+ * one minute. */
+static void evictionStatsRecord(robj *o) {
+    unsigned long long idle;
+    size_t j;
+
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+        idle = (unsigned long long) LFUTimeElapsed(o->lru >> 8) * 60;
+    else
+        idle = estimateObjectIdleTime(o) / 1000;
+    for (j = 0; j < EVICTION_IDLE_BUCKETS-1; j++)
+        if (idle < evictionIdleBuckets[j]) break;
+    evictionStats.evicted_idle[j]++;
+}
+
+/* Release the simulated cache: called when the sampling rate changes
+ * because what was tracked with a different rate is meaningless. */
+void evictionShadowReset(void) {
+    if (shadowKeys) {
+        dictRelease(shadowKeys);
+        listRelease(shadowLRU);
+        shadowKeys = NULL;
+        shadowLRU = NULL;
+    }
+    evictionStats.sampled_hits = evictionStats.sampled_misses = 0;
+    evictionStats.shadow_hits = evictionStats.shadow_misses = 0;
+}
+
+/* Reset the counters, but not the content of the simulated cache, in
+ * order to compare the policies starting from a warm cache. */
+void evictionStatsReset(void) {
+    memset(&evictionStats,0,sizeof(evictionStats));
+}
+
+/* Number of keys of the simulated cache: the tracked share of the real
+ * keyspace. */
+static unsigned long evictionShadowCapacity(void) {
+    unsigned long keys = 0;
+
+    for (int j = 0; j < server.dbnum; j++)
+        keys += dictSize(server.db[j].dict);
+    keys /= server.maxmemory_shadow_sampling;
+    return keys ? keys : 1;
+}
+
+/* Called by lookupKeyRead*() for every read access to 'key', that was
+ * found in the keyspace if 'hit' is true. If the key is tracked, the access
+ * is replayed against the simulated exact LRU: in case of miss the key is
+ * added to the cache, like a client populating it after a failed read. */
+void evictionShadowAccess(sds key, int hit) {
+    uint64_t hash = dictGenHashFunction(key,sdslen(key));
+    if (hash % server.maxmemory_shadow_sampling) return;
+
+    if (hit) evictionStats.sampled_hits++;
+    else evictionStats.sampled_misses++;
+
+    if (shadowKeys == NULL) {
+        shadowKeys = dictCreate(&setDictType,NULL);
+        shadowLRU = listCreate();
+    }
+
+    dictEntry *de = dictFind(shadowKeys,key);
+    if (de) {
+        listNode *ln = dictGetVal(de);
+        listUnlinkNode(shadowLRU,ln);
+        listLinkNodeHead(shadowLRU,ln);
+        evictionStats.shadow_hits++;
+        return;
+    }
+
+    evictionStats.shadow_misses++;
+    sds copy = sdsdup(key);
+    listAddNodeHead(shadowLRU,copy);
+    dictAdd(shadowKeys,copy,listFirst(shadowLRU));
+
+    unsigned long capacity = evictionShadowCapacity();
+    while (listLength(shadowLRU) > capacity) {
+        listNode *ln = listLast(shadowLRU);
+        sds victim = listNodeValue(ln);
+        listDelNode(shadowLRU,ln);
+        dictDelete(shadowKeys,victim); /* Frees the key name. */
+    }
+}
+
+static void addReplyHitRatio(client *c, long long hits, long long misses) {
+    addReplyDouble(c,(hits+misses) ? (double)hits/(hits+misses) : 0);
+}
+
+/* MEMORY EVICTION-STATS reply. */
+void addReplyEvictionStats(client *c) {
+    int shadow = server.maxmemory_shadow_sampling != 0;
+
+    addReplyMapLen(c,shadow ? 13 : 6);
+
+    addReplyBulkCString(c,"policy");
+    addReplyBulkCString(c,evictPolicyToString());
+
+    addReplyBulkCString(c,"keyspace.hits");
+    addReplyLongLong(c,server.stat_keyspace_hits);
+
+    addReplyBulkCString(c,"keyspace.misses");
+    addReplyLongLong(c,server.stat_keyspace_misses);
+
+    addReplyBulkCString(c,"keyspace.hit-ratio");
+    addReplyHitRatio(c,server.stat_keyspace_hits,server.stat_keyspace_misses);
+
+    addReplyBulkCString(c,"evicted.keys");
+    addReplyLongLong(c,server.stat_evictedkeys);
+
+    addReplyBulkCString(c,"evicted.idle-time");
+    addReplyMapLen(c,EVICTION_IDLE_BUCKETS);
+    for (size_t j = 0; j < EVICTION_IDLE_BUCKETS; j++) {
+        addReplyBulkCString(c,evictionIdleBucketNames[j]);
+        addReplyLongLong(c,evictionStats.evicted_idle[j]);
+    }
+
+    if (!shadow) return;
+
+    addReplyBulkCString(c,"shadow.policy");
+    addReplyBulkCString(c,"exact-lru");
+
+    addReplyBulkCString(c,"shadow.sampling");
+    addReplyLongLong(c,server.maxmemory_shadow_sampling);
+
+    addReplyBulkCString(c,"shadow.keys");
+    addReplyLongLong(c,shadowLRU ? listLength(shadowLRU) : 0);
+
+    addReplyBulkCString(c,"sampled.hit-ratio");
+    addReplyHitRatio(c,evictionStats.sampled_hits,
+                       evictionStats.sampled_misses);
+
+    addReplyBulkCString(c,"sampled.accesses");
+    addReplyLongLong(c,evictionStats.sampled_hits+
+                       evictionStats.sampled_misses);
+
+    addReplyBulkCString(c,"shadow.hit-ratio");
+    addReplyHitRatio(c,evictionStats.shadow_hits,
+                       evictionStats.shadow_misses);
+
+    addReplyBulkCString(c,"shadow.misses");
+    addReplyLongLong(c,evictionStats.shadow_misses);
+}
+
 /* ----------------------------------------------------------------------------
  * The external API for eviction: freeMemroyIfNeeded() is called by the
  * server when there is data to add in order to make space if needed.
@@ -351,17 +566,18 @@ unsigned long LFUDecrAndReturn(robj *o) {
  * returns the sum of AOF and slaves buffer. */
 size_t freeMemoryGetNotCountedMemory(void) {
     size_t overhead = 0;
-    int slaves = listLength(server.slaves);
 
-    if (slaves) {
-        listIter li;
-        listNode *ln;
-
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = listNodeValue(ln);
-            overhead += getClientOutputBufferMemoryUsage(slave);
-        }
+    /* The slaves output buffers are the replication buffer shared with the
+     * backlog, that is counted: only the part exceeding the backlog size,
+     * with the approximate overhead of its blocks, is used by the slaves
+     * on their own. */
+    if ((long long)server.repl_buffer_mem > server.repl_backlog_size) {
+        size_t extra_approx_size =
+            (server.repl_backlog_size/PROTO_REPLY_CHUNK_BYTES + 1) *
+            (sizeof(replBufBlock)+sizeof(listNode));
+        size_t counted_mem = server.repl_backlog_size + extra_approx_size;
+        if (server.repl_buffer_mem > counted_mem)
+            overhead += server.repl_buffer_mem - counted_mem;
     }
     if (server.aof_state != AOF_OFF) {
         overhead += sdsalloc(server.aof_buf)+aofRewriteBufferSize();
@@ -369,31 +585,11 @@ size_t freeMemoryGetNotCountedMemory(void) {
     return overhead;
 }
 
-/* Get the memory status from the point of view of the maxmemory directive:
- * if the memory used is under the maxmemory setting then C_OK is returned.
- * Otherwise, if we are over the memory limit, the function returns
- * C_ERR.
- *
- * The function may return additional info via reference, only if the
- * pointers to the respective arguments is not NULL. Certain fields are
- * populated only when C_ERR is returned:
- *
- *  'total'     total amount of bytes used.
- *              (Populated both for C_ERR and C_OK)
- *
- *  'logical'   the amount of memory used minus the slaves/AOF buffers.
- *              (Populated when C_ERR is returned)
- *
- *  'tofree'    the amount of memory that should be released
- *              in order to return back into the memory limits.
- *              (Populated when C_ERR is returned)
- *
- *  'level'     this usually ranges from 0 to 1, and reports the amount of
- *              memory currently used. May be > 1 if we are over the memory
- *              limit.
- *              (Populated both for C_ERR and C_OK)
- */
-int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level) {
+/* Like getMaxmemoryState() but checking the memory usage against 'limit'
+ * instead of the "maxmemory" setting. */
+static int getMemoryStateForLimit(size_t limit, size_t *total, size_t *logical,
+                                  size_t *tofree, float *level)
+{
     size_t mem_reported, mem_used, mem_tofree;
 
     /* Check if we are over the memory usage limit. If we are not, no need
@@ -402,7 +598,7 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     if (total) *total = mem_reported;
 
     /* We may return ASAP if there is no need to compute the level. */
-    int return_ok_asap = !server.maxmemory || mem_reported <= server.maxmemory;
+    int return_ok_asap = !limit || mem_reported <= limit;
     if (return_ok_asap && !level) return C_OK;
 
     /* Remove the size of slaves output buffers and AOF buffer from the
@@ -413,20 +609,20 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 
     /* Compute the ratio of memory usage. */
     if (level) {
-        if (!server.maxmemory) {
+        if (!limit) {
             *level = 0;
         } else {
-            *level = (float)mem_used / (float)server.maxmemory;
+            *level = (float)mem_used / (float)limit;
         }
     }
 
     if (return_ok_asap) return C_OK;
 
     /* Check if we are still over the memory limit. */
-    if (mem_used <= server.maxmemory) return C_OK;
+    if (mem_used <= limit) return C_OK;
 
     /* Compute how much memory we need to free. */
-    mem_tofree = mem_used - server.maxmemory;
+    mem_tofree = mem_used - limit;
 
     if (logical) *logical = mem_used;
     if (tofree) *tofree = mem_tofree;
@@ -434,23 +630,76 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
     return C_ERR;
 }
 
-/* This function is periodically called to see if there is memory to free
- * according to the current "maxmemory" settings. In case we are over the
- * memory limit, the function will try to free some memory to return back
- * under the limit.
+/* Get the memory status from the point of view of the maxmemory directive:
+ * if the memory used is under the maxmemory setting then C_OK is returned.
+ * Otherwise, if we are over the memory limit, the function returns
+ * C_ERR.
  *
- * The function returns C_OK if we are under the memory limit or if we
- * were over the limit, but the attempt to free memory was successful.
- * Otehrwise if we are over the memory limit, but not enough memory
- * was freed to return back under the limit, the function returns C_ERR. */
-int freeMemoryIfNeeded(void) {
+ * The function may return additional info via reference, only if the
+ * pointers to the respective arguments is not NULL. Certain fields are
+ * populated only when C_ERR is returned:
+ *
+ *  'total'     total amount of bytes used.
+ *              (Populated both for C_ERR and C_OK)
+ *
+ *  'logical'   the amount of memory used minus the slaves/AOF buffers.
+ *              (Populated when C_ERR is returned)
+ *
+ *  'tofree'    the amount of memory that should be released
+ *              in order to return back into the memory limits.
+ *              (Populated when C_ERR is returned)
+ *
+ *  'level'     this usually ranges from 0 to 1, and reports the amount of
+ *              memory currently used. May be > 1 if we are over the memory
+ *              limit.
+ *              (Populated both for C_ERR and C_OK)
+ */
+int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *level) {
+    return getMemoryStateForLimit(server.maxmemory,total,logical,tofree,level);
+}
+
+/* The memory performEvictions() checks against the limit: the memory used
+ * by the keys of 'dbonly' when evicting from a single DB, or the memory used
+ * by the server otherwise. */
+static size_t evictionMemoryUsed(redisDb *dbonly) {
+    return dbonly ? (size_t)dbonly->used_memory : zmalloc_used_memory();
+}
+
+/* Like getMemoryStateForLimit() but for the memory of 'dbonly', if not
+ * NULL. The memory used by the keys of a DB excludes the buffers already. */
+static int evictionMemoryState(redisDb *dbonly, size_t limit,
+                               size_t *total, size_t *tofree)
+{
+    if (!dbonly)
+        return getMemoryStateForLimit(limit,total,NULL,tofree,NULL);
+
+    size_t used = evictionMemoryUsed(dbonly);
+    if (total) *total = used;
+    if (used <= limit) return C_OK;
+    if (tofree) *tofree = used - limit;
+    return C_ERR;
+}
+
+/* Evict keys till the memory used is under 'limit'. If 'timelimit' is not
+ * zero the function returns after about 'timelimit' microseconds even if
+ * the memory is still over the limit, and never waits for the lazyfree
+ * thread: this is how the background eviction cycle uses it.
+ *
+ * If 'dbonly' is not NULL, only its keys are evicted, till the memory they
+ * use is under 'limit', see dbFreeMemoryIfNeeded().
+ *
+ * The return value has the same meaning as in freeMemoryIfNeeded(). */
+static int performEvictions(redisDb *dbonly, size_t limit,
+                            long long timelimit)
+{
     int keys_freed = 0;
+    long long start = timelimit ? ustime() : 0;
     /* By default replicas should ignore maxmemory
      * and just be masters exact copies. */
     if (server.masterhost && server.repl_slave_ignore_maxmemory) return C_OK;
 
     size_t mem_reported, mem_tofree, mem_freed;
-    mstime_t latency, eviction_latency;
+    ustime_t latency, eviction_latency;
     long long delta;
     int slaves = listLength(server.slaves);
 
@@ -458,7 +707,7 @@ int freeMemoryIfNeeded(void) {
      * POV of clients not being able to write, but also from the POV of
      * expires and evictions of keys not being performed. */
     if (clientsArePaused()) return C_OK;
-    if (getMaxmemoryState(&mem_reported,NULL,&mem_tofree,NULL) == C_OK)
+    if (evictionMemoryState(dbonly,limit,&mem_reported,&mem_tofree) == C_OK)
         return C_OK;
 
     mem_freed = 0;
@@ -467,19 +716,21 @@ int freeMemoryIfNeeded(void) {
         goto cant_free; /* We need to free memory, but policy forbids. */
 
     latencyStartMonitor(latency);
+    TRACE2(evict_start,mem_tofree,timelimit);
     while (mem_freed < mem_tofree) {
         int j, k, i;
         static unsigned int next_db = 0;
         sds bestkey = NULL;
         int bestdbid;
         redisDb *db;
-        dict *dict;
         dictEntry *de;
 
         if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
             server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
         {
-            struct evictionPoolEntry *pool = EvictionPoolLRU;
+            struct evictionPoolEntry *pool =
+                dbonly ? EvictionPoolDb : EvictionPoolLRU;
+            int empty_pools = 0;
 
             while(bestkey == NULL) {
                 unsigned long total_keys = 0, keys;
@@ -489,27 +740,35 @@ int freeMemoryIfNeeded(void) {
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    if (dbonly && db != dbonly) continue;
+                    keys = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                            dictSize(db->dict) : expireIndexSize(db->expires);
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, db, pool);
                         total_keys += keys;
                     }
                 }
                 if (!total_keys) break; /* No keys to evict. */
 
+                /* With tiered storage the sampled values may all be on
+                 * disk already: give up after a few attempts. */
+                if (server.tiered_storage && evictionPoolIsEmpty(pool) &&
+                    ++empty_pools == EVICTION_TIERED_MAX_EMPTY) break;
+
                 /* Go backward from best to worst element to evict. */
                 for (k = EVPOOL_SIZE-1; k >= 0; k--) {
                     if (pool[k].key == NULL) continue;
                     bestdbid = pool[k].dbid;
 
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
-                    }
+                    db = server.db+pool[k].dbid;
+                    de = (dbonly && db != dbonly) ? NULL :
+                         dictFind(db->dict,pool[k].key);
+                    /* Volatile policies only pick keys still having an
+                     * expire set. */
+                    if (de && !(server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS)
+                        && dbKeyMeta(db,de)->expire_pos == 0) de = NULL;
+                    if (de && server.tiered_storage &&
+                        !tieredCanSwapOut(db,de)) de = NULL;
 
                     /* Remove the entry from the pool. */
                     if (pool[k].key != pool[k].cached)
@@ -537,12 +796,18 @@ int freeMemoryIfNeeded(void) {
              * each DB, so we use the static 'next_db' variable to
              * incrementally visit all DBs. */
             for (i = 0; i < server.dbnum; i++) {
-                j = (++next_db) % server.dbnum;
+                j = dbonly ? dbonly->id : (int)((++next_db) % server.dbnum);
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
+                de = NULL;
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) {
+                    if (dictSize(db->dict) != 0)
+                        de = dictGetRandomKey(db->dict);
+                } else {
+                    expireIndexGetSomeKeys(db->expires,&de,1);
+                }
+                if (de && server.tiered_storage && !tieredCanSwapOut(db,de))
+                    de = NULL;
+                if (de) {
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
@@ -550,9 +815,40 @@ int freeMemoryIfNeeded(void) {
             }
         }
 
+        /* With tiered storage the value of the selected key is moved on
+         * disk, while the key stays in memory. */
+        if (bestkey && server.tiered_storage) {
+            db = server.db+bestdbid;
+            delta = (long long) evictionMemoryUsed(dbonly);
+            latencyStartMonitor(eviction_latency);
+            redisDb *prev = dbMemoryAccountingSwitch(db);
+            int retval = tieredSwapOut(db,de);
+            dbMemoryAccountingSwitch(prev);
+            latencyEndMonitor(eviction_latency);
+            latencyAddSampleIfNeeded("eviction-swap",eviction_latency);
+            latencyRemoveNestedEvent(latency,eviction_latency);
+            if (retval == C_ERR) {
+                latencyEndMonitor(latency);
+                latencyAddSampleIfNeeded("eviction-cycle",latency);
+                TRACE3(evict_end,keys_freed,mem_freed,latency);
+                goto cant_free;
+            }
+            delta -= (long long) evictionMemoryUsed(dbonly);
+            mem_freed += delta;
+            keys_freed++;
+            if (timelimit && !(keys_freed % 16) &&
+                ustime()-start > timelimit) break;
+            if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
+                lazyfreeFlushBatch();
+                if (evictionMemoryState(dbonly,limit,NULL,NULL) == C_OK)
+                    mem_freed = mem_tofree;
+            }
+        }
+
         /* Finally remove the selected key. */
-        if (bestkey) {
+        else if (bestkey) {
             db = server.db+bestdbid;
+            evictionStatsRecord(dictGetVal(de));
             robj *keyobj = createStringObject(bestkey,sdslen(bestkey));
             propagateExpire(db,keyobj,server.lazyfree_lazy_eviction);
             /* We compute the amount of memory freed by db*Delete() alone.
@@ -563,23 +859,34 @@ int freeMemoryIfNeeded(void) {
              *
              * AOF and Output buffer memory will be freed eventually so
              * we only care about memory used by the key space. */
-            delta = (long long) zmalloc_used_memory();
+            delta = (long long) evictionMemoryUsed(dbonly);
             latencyStartMonitor(eviction_latency);
+            redisDb *prev = dbMemoryAccountingSwitch(db);
             if (server.lazyfree_lazy_eviction)
                 dbAsyncDelete(db,keyobj);
             else
                 dbSyncDelete(db,keyobj);
+            dbMemoryAccountingSwitch(prev);
+            rdbDeltaTrackKey(db,keyobj);
             latencyEndMonitor(eviction_latency);
             latencyAddSampleIfNeeded("eviction-del",eviction_latency);
             latencyRemoveNestedEvent(latency,eviction_latency);
-            delta -= (long long) zmalloc_used_memory();
+            delta -= (long long) evictionMemoryUsed(dbonly);
             mem_freed += delta;
+            TRACE3(evict_key,db->id,(char*)keyobj->ptr,delta);
             server.stat_evictedkeys++;
+            db->stat_evictedkeys++;
+            if (timelimit) server.stat_background_evictedkeys++;
             notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
                 keyobj, db->id);
             decrRefCount(keyobj);
             keys_freed++;
 
+            /* The background cycle checks its time limit from time to
+             * time: what is left to free is handled by the next call. */
+            if (timelimit && !(keys_freed % 16) &&
+                ustime()-start > timelimit) break;
+
             /* When the memory to free starts to be big enough, we may
              * start spending so much time here that is impossible to
              * deliver data to the slaves fast enough, so we force the
@@ -594,7 +901,8 @@ int freeMemoryIfNeeded(void) {
              * across the dbAsyncDelete() call, while the thread can
              * release the memory all the time. */
             if (server.lazyfree_lazy_eviction && !(keys_freed % 16)) {
-                if (getMaxmemoryState(NULL,NULL,NULL,NULL) == C_OK) {
+                lazyfreeFlushBatch();
+                if (evictionMemoryState(dbonly,limit,NULL,NULL) == C_OK) {
                     /* Let's satisfy our stop condition. */
                     mem_freed = mem_tofree;
                 }
@@ -602,25 +910,80 @@ int freeMemoryIfNeeded(void) {
         } else {
             latencyEndMonitor(latency);
             latencyAddSampleIfNeeded("eviction-cycle",latency);
+            TRACE3(evict_end,keys_freed,mem_freed,latency);
             goto cant_free; /* nothing to free... */
         }
     }
     latencyEndMonitor(latency);
     latencyAddSampleIfNeeded("eviction-cycle",latency);
+    TRACE3(evict_end,keys_freed,mem_freed,latency);
+    lazyfreeFlushBatch();
     return C_OK;
 
 cant_free:
+    lazyfreeFlushBatch();
+    /* The memory of a DB already accounts the values the lazyfree thread
+     * is going to free. */
+    if (timelimit || dbonly) return C_ERR;
     /* We are here if we are not able to reclaim memory. There is only one
      * last thing we can try: check if the lazyfree thread has jobs in queue
      * and wait... */
+    latencyStartMonitor(latency);
     while(bioPendingJobsOfType(BIO_LAZY_FREE)) {
         if (((mem_reported - zmalloc_used_memory()) + mem_freed) >= mem_tofree)
             break;
         usleep(1000);
     }
+    latencyEndMonitor(latency);
+    latencyAddSampleIfNeeded("lazyfree-wait",latency);
     return C_ERR;
 }
 
+/* This function is periodically called to see if there is memory to free
+ * according to the current "maxmemory" settings. In case we are over the
+ * memory limit, the function will try to free some memory to return back
+ * under the limit.
+ *
+ * The function returns C_OK if we are under the memory limit or if we
+ * were over the limit, but the attempt to free memory was successful.
+ * Otehrwise if we are over the memory limit, but not enough memory
+ * was freed to return back under the limit, the function returns C_ERR. */
+int freeMemoryIfNeeded(void) {
+    return performEvictions(NULL,server.maxmemory,0);
+}
+
+/* Like freeMemoryIfNeeded() but for the db-maxmemory limit of 'db': only
+ * its keys are evicted, according to the maxmemory-policy, till the memory
+ * they use is under the limit, so that the users of a DB can't make the
+ * keys of the other DBs go. */
+int dbFreeMemoryIfNeeded(redisDb *db) {
+    unsigned long long limit = dbGetMaxmemory(db);
+
+    if (!limit || server.lua_timedout || server.loading) return C_OK;
+    return performEvictions(db,limit,0);
+}
+
+/* Background eviction cycle, called before returning to the event loop.
+ * When "maxmemory-soft-limit" is set, keys are evicted incrementally, in
+ * time bounded steps, as soon as the memory used crosses that percentage
+ * of "maxmemory", so that the clients writing seldom have to wait for
+ * freeMemoryIfNeeded() to evict many keys synchronously at the hard limit.
+ * Like the fast expire cycle, a step is not repeated more often than every
+ * twice its own duration. */
+#define BACKGROUND_EVICTION_CYCLE_DURATION 1000 /* Microseconds. */
+void backgroundEvictionCycle(void) {
+    static long long last_cycle = 0;
+    long long now;
+
+    if (!server.maxmemory || !server.maxmemory_soft_limit) return;
+    if (server.lua_timedout || server.loading) return;
+    now = ustime();
+    if (now < last_cycle + BACKGROUND_EVICTION_CYCLE_DURATION*2) return;
+    last_cycle = now;
+    performEvictions(NULL,server.maxmemory/100*server.maxmemory_soft_limit,
+                     BACKGROUND_EVICTION_CYCLE_DURATION);
+}
+
 /* This is a wrapper for freeMemoryIfNeeded() that only really calls the
  * function if right now there are the conditions to do so safely:
  *
@@ -42,7 +42,8 @@
 
 /* Helper function for the activeExpireCycle() function.
  * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+ * entry 'de' of the keyspace of a Redis database, having as expire time
+ * 'when', as found in the expire index.
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -51,17 +52,19 @@
  *
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
-int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
-    if (now > t) {
+int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long when,
+                               long long now) {
+    if (now > when) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
 
         propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
+        redisDb *prev = dbMemoryAccountingSwitch(db);
         if (server.lazyfree_lazy_expire)
             dbAsyncDelete(db,keyobj);
         else
             dbSyncDelete(db,keyobj);
+        dbMemoryAccountingSwitch(prev);
         notifyKeyspaceEvent(NOTIFY_EXPIRED,
             "expired",keyobj,db->id);
         trackingInvalidateKey(keyobj);
@@ -73,6 +76,34 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
     }
 }
 
+/* Helper function for the activeExpireCycle() function, used when keys are
+ * indexed by expire time. Reclaim up to 'max' keys of 'db' that are due at
+ * 'now', the ones expiring first first. The number of keys examined, that
+ * is the expired ones plus the first one found not yet expired, if any, is
+ * stored in '*sampled', and the number of expired keys is returned. */
+static unsigned long activeExpireCycleReclaimDue(redisDb *db, long long now,
+                                                 unsigned long max,
+                                                 unsigned long *sampled)
+{
+    unsigned long expired = 0;
+    long long when;
+    sds key;
+
+    *sampled = 0;
+    while (*sampled < max &&
+           expireIndexFirstByTime(db->expires,&when,&key))
+    {
+        dictEntry *de = dictFind(db->dict,key);
+
+        sdsfree(key);
+        (*sampled)++;
+        serverAssert(de != NULL);
+        if (!activeExpireCycleTryExpire(db,de,when,now)) break;
+        expired++;
+    }
+    return expired;
+}
+
 /* Try to expire a few timed out keys. The algorithm used is adaptive and
  * will use few CPU cycles if there are few expiring keys, otherwise
  * it will get more aggressive to avoid that too much memory is used by
@@ -192,6 +223,7 @@ void activeExpireCycle(int type) {
     long total_sampled = 0;
     long total_expired = 0;
 
+    TRACE2(expire_cycle_start,type,timelimit);
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
         /* Expired and checked in a single loop. */
         unsigned long expired, sampled;
@@ -203,28 +235,36 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* Reclaim the hash fields already expired. The hashes are indexed
+         * by the expire time of their first field to expire, so only the
+         * fields that are due are visited. */
+        while (dictSize(db->expires->hfields) &&
+               hashActiveExpireFields(db,mstime(),config_keys_per_loop) ==
+               config_keys_per_loop)
+        {
+            if ((++iteration & 0xf) == 0 && ustime()-start > timelimit) {
+                timelimit_exit = 1;
+                server.stat_expired_time_cap_reached_count++;
+                break;
+            }
+        }
+        if (timelimit_exit) break;
+
         /* Continue to expire if at the end of the cycle more than 25%
          * of the keys were expired. */
         do {
-            unsigned long num, slots;
+            unsigned long num;
             long long now, ttl_sum;
             int ttl_samples;
             iteration++;
 
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if ((num = expireIndexSize(db->expires)) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = mstime();
 
-            /* When there are less than 1% filled slots, sampling the key
-             * space is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
             /* The main collection cycle. Sample random keys among keys
              * with an expire set, checking for expired ones. */
             expired = 0;
@@ -235,48 +275,51 @@ void activeExpireCycle(int type) {
             if (num > config_keys_per_loop)
                 num = config_keys_per_loop;
 
-            /* Here we access the low level representation of the hash table
-             * for speed concerns: this makes this code coupled with dict.c,
-             * but it hardly changed in ten years.
-             *
-             * Note that certain places of the hash table may be empty,
-             * so we want also a stop condition about the number of
-             * buckets that we scanned. However scanning for free buckets
-             * is very fast: we are in the cache line scanning a sequential
-             * array of NULL pointers, so we can scan a lot more buckets
-             * than keys in the same time. */
-            long max_buckets = num*20;
-            long checked_buckets = 0;
-
-            while (sampled < num && checked_buckets < max_buckets) {
-                for (int table = 0; table < 2; table++) {
-                    if (table == 1 && !dictIsRehashing(db->expires)) break;
-
-                    unsigned long idx = db->expires_cursor;
-                    idx &= db->expires->ht[table].sizemask;
-                    dictEntry *de = db->expires->ht[table].table[idx];
+            if (db->expires->by_time) {
+                /* Reclaim the due keys in expire time order. The TTL stats
+                 * are still computed sampling the expire index, as the
+                 * keys expiring first are not representative. */
+                expired = activeExpireCycleReclaimDue(db,now,num,&sampled);
+                for (unsigned long k = 0; k < num; k++) {
+                    long long ttl;
+
+                    if (expireIndexSize(db->expires) == 0) break;
+                    if (db->expires_cursor >= expireIndexSize(db->expires))
+                        db->expires_cursor = 0;
+                    ttl = db->expires->entries[db->expires_cursor++].when-now;
+                    if (ttl > 0) {
+                        ttl_sum += ttl;
+                        ttl_samples++;
+                    }
+                }
+            } else {
+                /* The expire index is a dense array, so unlike sampling a
+                 * hash table there are no empty buckets to skip, and the
+                 * keyspace entries of the keys not yet expired are never
+                 * touched. */
+                while (sampled < num && expireIndexSize(db->expires)) {
+                    expireEntry *ee;
                     long long ttl;
 
-                    /* Scan the current bucket of the current table. */
-                    checked_buckets++;
-                    while(de) {
-                        /* Get the next entry now since this entry may get
-                         * deleted. */
-                        dictEntry *e = de;
-                        de = de->next;
-
-                        ttl = dictGetSignedIntegerVal(e)-now;
-                        if (activeExpireCycleTryExpire(db,e,now)) expired++;
-                        if (ttl > 0) {
-                            /* We want the average TTL of keys yet
-                             * not expired. */
-                            ttl_sum += ttl;
-                            ttl_samples++;
-                        }
-                        sampled++;
+                    if (db->expires_cursor >= expireIndexSize(db->expires))
+                        db->expires_cursor = 0;
+                    ee = db->expires->entries+db->expires_cursor;
+                    ttl = ee->when-now;
+                    if (activeExpireCycleTryExpire(db,ee->de,ee->when,now)) {
+                        /* The last entry of the index was moved in the slot
+                         * of the expired key: don't advance the cursor so
+                         * that it is checked next. */
+                        expired++;
+                    } else {
+                        db->expires_cursor++;
                     }
+                    if (ttl > 0) {
+                        /* We want the average TTL of keys yet not expired. */
+                        ttl_sum += ttl;
+                        ttl_samples++;
+                    }
+                    sampled++;
                 }
-                db->expires_cursor++;
             }
             total_expired += expired;
             total_sampled += sampled;
@@ -309,9 +352,11 @@ void activeExpireCycle(int type) {
         } while ((expired*100/sampled) > config_cycle_acceptable_stale);
     }
 
+    lazyfreeFlushBatch();
     elapsed = ustime()-start;
     server.stat_expire_cycle_time_used += elapsed;
-    latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
+    latencyAddSampleIfNeeded("expire-cycle",elapsed);
+    TRACE4(expire_cycle_end,type,total_sampled,total_expired,elapsed);
 
     /* Update our estimate of keys existing but yet to be expired.
      * Running average with this sample accounting for 5%. */
@@ -324,6 +369,33 @@ void activeExpireCycle(int type) {
                                      (server.stat_expired_stale_perc*0.95);
 }
 
+/* Return the number of keys that are logically expired but not yet
+ * reclaimed, and store in '*lag' how many milliseconds ago the oldest
+ * of them expired. With expire-time-index both figures come from the
+ * index, otherwise the number of keys is estimated from the stale keys
+ * percentage of the expire cycle and the lag is unknown, reported as 0. */
+unsigned long long getExpiredBacklog(long long *lag) {
+    unsigned long long backlog = 0;
+    long long now = mstime(), when;
+    sds key;
+
+    *lag = 0;
+    for (int j = 0; j < server.dbnum; j++) {
+        expireIndex *ei = server.db[j].expires;
+
+        if (ei->by_time == NULL) {
+            backlog += expireIndexSize(ei)*server.stat_expired_stale_perc;
+            continue;
+        }
+        backlog += expireIndexCountDue(ei,now);
+        if (expireIndexFirstByTime(ei,&when,&key)) {
+            if (now-when > *lag) *lag = now-when;
+            sdsfree(key);
+        }
+    }
+    return backlog;
+}
+
 /*-----------------------------------------------------------------------------
  * Expires of keys created in writable slaves
  *
@@ -381,11 +453,12 @@ void expireSlaveKeys(void) {
         while(dbids && dbid < server.dbnum) {
             if ((dbids & 1) != 0) {
                 redisDb *db = server.db+dbid;
-                dictEntry *expire = dictFind(db->expires,keyname);
-                int expired = 0;
+                dictEntry *kde = dictFind(db->dict,keyname);
+                long long when = kde ? dbEntryGetExpire(db,kde) : -1;
+                int expire = when != -1, expired = 0;
 
                 if (expire &&
-                    activeExpireCycleTryExpire(server.db+dbid,expire,start))
+                    activeExpireCycleTryExpire(server.db+dbid,kde,when,start))
                 {
                     expired = 1;
                 }
@@ -587,6 +660,7 @@ void pttlCommand(client *c) {
 void persistCommand(client *c) {
     if (lookupKeyWrite(c->db,c->argv[1])) {
         if (removeExpire(c->db,c->argv[1])) {
+            signalModifiedKey(c->db,c->argv[1]);
             addReply(c,shared.cone);
             server.dirty++;
         } else {
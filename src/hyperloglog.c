@@ -34,6 +34,10 @@
 #include <stdint.h>
 #include <math.h>
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* The Redis HyperLogLog implementation is based on the following ideas:
  *
  * * The use of a 64 bit hash function as proposed in [1], in order to don't
@@ -515,10 +519,130 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* ============================== SIMD kernels ============================== */
+
+/* Merging a dense HLL into an array of uint8_t registers is the inner loop
+ * of PFMERGE and of PFCOUNT with multiple keys, and unpacking the registers
+ * is most of the cost of computing the histogram of a dense HLL. On x86_64
+ * an AVX2 version of the merge, compiled with the target attribute like the
+ * bit operations kernels, is selected at startup by hllSelectKernels() when
+ * the CPU supports it. When the kernel is NULL the portable code is used. */
+static struct {
+    const char *name;   /* Instruction set of the selected kernel. */
+    /* Set max[i] to MAX(max[i],registers[i]) for all the HLL_REGISTERS
+     * registers of the dense representation 'registers'. */
+    void (*densemerge)(uint8_t *max, uint8_t *registers);
+} hllKernels = {"none",NULL};
+
+void hllRawRegHisto(uint8_t *registers, int* reghisto);
+
+#ifdef HAVE_X86_SIMD
+/* Every group of 3 bytes in the dense representation holds 4 registers:
+ * PSHUFB spreads 12 bytes into 4 little endian 32 bit words per lane, then
+ * every register is shifted to the start of its own byte. The 32 bytes
+ * loaded start 4 bytes before the 12 bytes needed by the low lane, so that
+ * the high lane finds its 12 bytes at the start: the first 8 and the last 24
+ * registers are handled by the scalar code so that loads never cross the
+ * end of the registers. Only valid with 16384 registers of 6 bits. */
+__attribute__((target("avx2")))
+static void hllDenseMergeAVX2(uint8_t *max, uint8_t *registers) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        4,5,6,-1,7,8,9,-1,10,11,12,-1,13,14,15,-1,
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+    const __m256i mask0 = _mm256_set1_epi32(0x3f);
+    const __m256i mask1 = _mm256_set1_epi32(0x3f00);
+    const __m256i mask2 = _mm256_set1_epi32(0x3f0000);
+    const __m256i mask3 = _mm256_set1_epi32(0x3f000000);
+    uint8_t *r = registers+2, val;
+    int j;
+
+    for (j = 0; j < 8; j++) {
+        HLL_DENSE_GET_REGISTER(val,registers,j);
+        if (val > max[j]) max[j] = val;
+    }
+    for (; j < HLL_REGISTERS-24; j += 32) {
+        __m256i w = _mm256_shuffle_epi8(
+            _mm256_loadu_si256((const __m256i*)r),shuffle);
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(w,mask0),
+                _mm256_and_si256(_mm256_slli_epi32(w,2),mask1)),
+            _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(w,4),mask2),
+                _mm256_and_si256(_mm256_slli_epi32(w,6),mask3)));
+        __m256i m = _mm256_loadu_si256((const __m256i*)(max+j));
+        _mm256_storeu_si256((__m256i*)(max+j),_mm256_max_epu8(m,v));
+        r += 24;
+    }
+    for (; j < HLL_REGISTERS; j++) {
+        HLL_DENSE_GET_REGISTER(val,registers,j);
+        if (val > max[j]) max[j] = val;
+    }
+}
+#endif
+
+/* Select the SIMD kernel supported by the CPU. Called at startup. */
+void hllSelectKernels(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (HLL_REGISTERS == 16384 && HLL_BITS == 6 &&
+        __builtin_cpu_supports("avx2"))
+    {
+        hllKernels.name = "avx2";
+        hllKernels.densemerge = hllDenseMergeAVX2;
+    }
+#endif
+}
+
+/* Return the name of the instruction set used by the HLL kernels. */
+const char *hllKernelsName(void) {
+    return hllKernels.name;
+}
+
+/* Merge the dense registers 'registers' into the array of HLL_REGISTERS
+ * uint8_t registers 'max', setting max[i] to MAX(max[i],registers[i]). */
+void hllDenseMerge(uint8_t *max, uint8_t *registers) {
+    int j;
+
+    if (hllKernels.densemerge) {
+        hllKernels.densemerge(max,registers);
+    } else if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+        /* Handle 4 registers, that is 3 bytes, per iteration. */
+        uint8_t *r = registers, *m = max, r0, r1, r2, r3;
+        for (j = 0; j < HLL_REGISTERS/4; j++) {
+            r0 = r[0] & 63;
+            r1 = (r[0] >> 6 | r[1] << 2) & 63;
+            r2 = (r[1] >> 4 | r[2] << 4) & 63;
+            r3 = (r[2] >> 2) & 63;
+            if (r0 > m[0]) m[0] = r0;
+            if (r1 > m[1]) m[1] = r1;
+            if (r2 > m[2]) m[2] = r2;
+            if (r3 > m[3]) m[3] = r3;
+            r += 3;
+            m += 4;
+        }
+    } else {
+        uint8_t val;
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            HLL_DENSE_GET_REGISTER(val,registers,j);
+            if (val > max[j]) max[j] = val;
+        }
+    }
+}
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+    /* With a SIMD kernel it is faster to unpack the registers in bytes, and
+     * compute the histogram of the unpacked registers. */
+    if (hllKernels.densemerge) {
+        uint64_t raw[HLL_REGISTERS/8];
+
+        memset(raw,0,sizeof(raw));
+        hllKernels.densemerge((uint8_t*)raw,registers);
+        hllRawRegHisto((uint8_t*)raw,reghisto);
+        return;
+    }
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -1070,12 +1194,7 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        hllDenseMerge(max,hdr->registers);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1143,6 +1262,153 @@ robj *createHLLObject(void) {
     return o;
 }
 
+/* ======================== Multi-key PFCOUNT cache ========================= */
+
+/* PFCOUNT called with multiple keys merges all the HLLs every time, since
+ * the cardinality cached in the header of the single HLLs is of no help for
+ * the union. Applications computing again and again the union of the same
+ * keys, like a dashboard counting the unique visitors of the last 30 days
+ * with an HLL per day, find the result of the last HLL_UNION_CACHE_LEN
+ * unions here.
+ *
+ * Every write to an HLL calls signalModifiedKey() along with
+ * HLL_INVALIDATE_CACHE(), and so does every command overwriting or deleting
+ * the key, so signalModifiedKey() drops the entries using the key when the
+ * cardinality cached in the HLL is invalidated. Every entry also remembers
+ * the objects it was computed from: if the lookup of a key returns a
+ * different object, for instance because the key expired or the DB was
+ * swapped, the entry is dropped as well. */
+#define HLL_UNION_CACHE_LEN 64
+#define HLL_UNION_CACHE_MAX_KEYS 1024
+
+typedef struct hllUnionEntry {
+    int dbid;
+    int numkeys;
+    uint64_t card;
+    sds *keys;
+    robj **vals;        /* Values of the keys, NULL for missing keys. */
+} hllUnionEntry;
+
+/* Entries from the oldest to the most recent. */
+static hllUnionEntry *hllUnionCache[HLL_UNION_CACHE_LEN];
+static int hllUnionCacheCount = 0;
+
+/* Names of the keys of the cached entries, mapped to the number of entries
+ * using them, so that most of the modified keys are skipped with a lookup. */
+static dict *hllUnionCacheKeys = NULL;
+
+/* Remove the entry at index 'idx' of the cache. */
+static void hllUnionCacheDelete(int idx) {
+    hllUnionEntry *e = hllUnionCache[idx];
+
+    for (int j = 0; j < e->numkeys; j++) {
+        dictEntry *de = dictFind(hllUnionCacheKeys,e->keys[j]);
+        uint64_t refs = dictGetUnsignedIntegerVal(de);
+
+        if (refs == 1)
+            dictDelete(hllUnionCacheKeys,e->keys[j]);
+        else
+            dictSetUnsignedIntegerVal(de,refs-1);
+        sdsfree(e->keys[j]);
+    }
+    zfree(e->keys);
+    zfree(e->vals);
+    zfree(e);
+    memmove(hllUnionCache+idx,hllUnionCache+idx+1,
+            sizeof(hllUnionEntry*)*(hllUnionCacheCount-idx-1));
+    hllUnionCacheCount--;
+}
+
+/* Search the cardinality of the union of the 'numkeys' keys 'keys' having
+ * the values 'vals' in the DB 'dbid'. Return 1 and store it at 'card' if
+ * found, otherwise 0 is returned. */
+static int hllUnionCacheGet(int dbid, robj **keys, robj **vals, int numkeys,
+                            uint64_t *card)
+{
+    int i, j;
+
+    for (i = hllUnionCacheCount-1; i >= 0; i--) {
+        hllUnionEntry *e = hllUnionCache[i];
+
+        if (e->dbid != dbid || e->numkeys != numkeys) continue;
+        for (j = 0; j < numkeys; j++)
+            if (sdscmp(e->keys[j],keys[j]->ptr)) break;
+        if (j != numkeys) continue;
+
+        if (memcmp(e->vals,vals,sizeof(robj*)*numkeys)) {
+            hllUnionCacheDelete(i);
+            return 0;
+        }
+        *card = e->card;
+        return 1;
+    }
+    return 0;
+}
+
+/* Add the cardinality of an union to the cache, removing the oldest entry
+ * if the cache is full. */
+static void hllUnionCacheAdd(int dbid, robj **keys, robj **vals, int numkeys,
+                             uint64_t card)
+{
+    hllUnionEntry *e;
+
+    if (numkeys > HLL_UNION_CACHE_MAX_KEYS) return;
+    if (hllUnionCacheKeys == NULL)
+        hllUnionCacheKeys = dictCreate(&setDictType,NULL);
+    if (hllUnionCacheCount == HLL_UNION_CACHE_LEN) hllUnionCacheDelete(0);
+
+    e = zmalloc(sizeof(*e));
+    e->dbid = dbid;
+    e->numkeys = numkeys;
+    e->card = card;
+    e->keys = zmalloc(sizeof(sds)*numkeys);
+    e->vals = zmalloc(sizeof(robj*)*numkeys);
+    memcpy(e->vals,vals,sizeof(robj*)*numkeys);
+    for (int j = 0; j < numkeys; j++) {
+        sds name = sdsdup(keys[j]->ptr);
+        dictEntry *existing, *de;
+
+        e->keys[j] = sdsdup(name);
+        de = dictAddRaw(hllUnionCacheKeys,name,&existing);
+        if (de) {
+            dictSetUnsignedIntegerVal(de,1);
+        } else {
+            sdsfree(name);
+            dictSetUnsignedIntegerVal(existing,
+                dictGetUnsignedIntegerVal(existing)+1);
+        }
+    }
+    hllUnionCache[hllUnionCacheCount++] = e;
+}
+
+/* Drop the cached unions using the key 'key' of the DB 'db'. Called by
+ * signalModifiedKey(). */
+void hllUnionCacheInvalidateKey(redisDb *db, robj *key) {
+    if (hllUnionCacheCount == 0 ||
+        dictFind(hllUnionCacheKeys,key->ptr) == NULL) return;
+
+    for (int i = hllUnionCacheCount-1; i >= 0; i--) {
+        hllUnionEntry *e = hllUnionCache[i];
+
+        if (e->dbid != db->id) continue;
+        for (int j = 0; j < e->numkeys; j++) {
+            if (sdscmp(e->keys[j],key->ptr) == 0) {
+                hllUnionCacheDelete(i);
+                break;
+            }
+        }
+    }
+}
+
+/* Drop the cached unions of the DB 'dbid', or of all the DBs if 'dbid' is
+ * -1. Called by signalFlushedDb(). */
+void hllUnionCacheFlush(int dbid) {
+    for (int i = hllUnionCacheCount-1; i >= 0; i--) {
+        if (dbid == -1 || hllUnionCache[i]->dbid == dbid)
+            hllUnionCacheDelete(i);
+    }
+}
+
 /* Check if the object is a String with a valid HLL representation.
  * Return C_OK if this is true, otherwise reply to the client
  * with an error and return C_ERR. */
@@ -1229,29 +1495,44 @@ void pfcountCommand(client *c) {
      * the cardinality of the merge of the N HLLs specified. */
     if (c->argc > 2) {
         uint8_t max[HLL_HDR_SIZE+HLL_REGISTERS], *registers;
-        int j;
+        int j, numkeys = c->argc-1;
+        robj **vals = zmalloc(sizeof(robj*)*numkeys);
+
+        /* Check type and size. */
+        for (j = 0; j < numkeys; j++) {
+            vals[j] = lookupKeyRead(c->db,c->argv[j+1]);
+            if (vals[j] && isHLLObjectOrReply(c,vals[j]) != C_OK) goto cleanup;
+        }
+
+        /* Unions of keys not modified since the last call are cached. */
+        if (hllUnionCacheGet(c->db->id,c->argv+1,vals,numkeys,&card)) {
+            addReplyLongLong(c,card);
+            goto cleanup;
+        }
 
         /* Compute an HLL with M[i] = MAX(M[i]_j). */
         memset(max,0,sizeof(max));
         hdr = (struct hllhdr*) max;
         hdr->encoding = HLL_RAW; /* Special internal-only encoding. */
         registers = max + HLL_HDR_SIZE;
-        for (j = 1; j < c->argc; j++) {
-            /* Check type and size. */
-            robj *o = lookupKeyRead(c->db,c->argv[j]);
-            if (o == NULL) continue; /* Assume empty HLL for non existing var.*/
-            if (isHLLObjectOrReply(c,o) != C_OK) return;
+        for (j = 0; j < numkeys; j++) {
+            /* Assume empty HLL for non existing var. */
+            if (vals[j] == NULL) continue;
 
             /* Merge with this HLL with our 'max' HLL by setting max[i]
              * to MAX(max[i],hll[i]). */
-            if (hllMerge(registers,o) == C_ERR) {
+            if (hllMerge(registers,vals[j]) == C_ERR) {
                 addReplySds(c,sdsnew(invalid_hll_err));
-                return;
+                goto cleanup;
             }
         }
 
         /* Compute cardinality of the resulting set. */
-        addReplyLongLong(c,hllCount(hdr,NULL));
+        card = hllCount(hdr,NULL);
+        hllUnionCacheAdd(c->db->id,c->argv+1,vals,numkeys,card);
+        addReplyLongLong(c,card);
+cleanup:
+        zfree(vals);
         return;
     }
 
@@ -1393,6 +1674,7 @@ void pfselftestCommand(client *c) {
     struct hllhdr *hdr = (struct hllhdr*) bitcounters, *hdr2;
     robj *o = NULL;
     uint8_t bytecounters[HLL_REGISTERS];
+    uint8_t merged[HLL_REGISTERS], expected[HLL_REGISTERS];
 
     /* Test 1: access registers.
      * The test is conceived to test that the different counters of our data
@@ -1419,6 +1701,23 @@ void pfselftestCommand(client *c) {
                 goto cleanup;
             }
         }
+
+        /* Check that merging the registers into an array of bytes with
+         * random values retains the maximum of every register. */
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            merged[i] = rand() & HLL_REGISTER_MAX;
+            expected[i] = merged[i] > bytecounters[i] ? merged[i] :
+                                                        bytecounters[i];
+        }
+        hllDenseMerge(merged,hdr->registers);
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            if (merged[i] != expected[i]) {
+                addReplyErrorFormat(c,
+                    "TESTFAILED Merged register %d should be %d but is %d",
+                    i, (int) expected[i], (int) merged[i]);
+                goto cleanup;
+            }
+        }
     }
 
     /* Test 2: approximation error.
@@ -35,6 +35,17 @@
 #include "zmalloc.h"
 #include "endianconv.h"
 
+/* The linear scans of intsetSearch() compare several elements at a time
+ * when SSE2 is available. The elements are stored in little endian. */
+#if defined(__SSE2__) && (BYTE_ORDER == LITTLE_ENDIAN)
+#include <emmintrin.h>
+#define INTSET_SIMD 1
+#endif
+
+/* Number of elements under which the binary search of intsetSearch() is
+ * completed with a linear scan, that is more cache and SIMD friendly. */
+#define INTSET_SCAN_LEN 16
+
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 #define INTSET_ENC_INT16 (sizeof(int16_t))
@@ -108,49 +119,113 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Return the position of the first element not smaller than "value" among
+ * the elements in the range [min,max), or max if there is no such element,
+ * scanning them linearly. */
+static uint32_t intsetScan(intset *is, int64_t value, uint32_t min, uint32_t max) {
+    uint8_t enc = intrev32ifbe(is->encoding);
+
+    /* Values that don't fit the encoding are smaller or greater than all the
+     * elements. */
+    if (_intsetValueEncoding(value) > enc) return value < 0 ? min : max;
+
+#ifdef INTSET_SIMD
+    /* The elements are sorted, so the ones smaller than "value" are a prefix
+     * of every group of elements. */
+    if (enc == INTSET_ENC_INT16) {
+        const int16_t *v = (const int16_t*)is->contents;
+        __m128i needle = _mm_set1_epi16((int16_t)value);
+
+        for (; min+8 <= max; min += 8) {
+            __m128i group = _mm_loadu_si128((const __m128i*)(v+min));
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi16(group,needle));
+            if (mask != 0xffff) return min+__builtin_popcount(mask)/2;
+        }
+    } else if (enc == INTSET_ENC_INT32) {
+        const int32_t *v = (const int32_t*)is->contents;
+        __m128i needle = _mm_set1_epi32((int32_t)value);
+
+        for (; min+4 <= max; min += 4) {
+            __m128i group = _mm_loadu_si128((const __m128i*)(v+min));
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi32(group,needle));
+            if (mask != 0xffff) return min+__builtin_popcount(mask)/4;
+        }
+    }
+#endif
+    while (min < max && _intsetGetEncoded(is,min,enc) < value) min++;
+    return min;
+}
+
+/* Search for the position of "value" among the elements in the range
+ * [min,max). Return 1 when the value was found and sets "pos" to the
+ * position of the value within the intset. Return 0 when the value is not
+ * present in the range and sets "pos" to the position where "value" can be
+ * inserted. */
+static uint8_t intsetSearchRange(intset *is, int64_t value, uint32_t min,
+                                 uint32_t max, uint32_t *pos)
+{
+    uint32_t mid;
+    int64_t cur;
+
+    /* Binary search until the range is small enough to be scanned. */
+    while (max-min > INTSET_SCAN_LEN) {
+        mid = min+(max-min)/2;
+        cur = _intsetGet(is,mid);
+        if (value > cur) {
+            min = mid+1;
+        } else if (value < cur) {
+            max = mid;
+        } else {
+            if (pos) *pos = mid;
+            return 1;
+        }
+    }
+
+    min = intsetScan(is,value,min,max);
+    if (pos) *pos = min;
+    return min < max && _intsetGet(is,min) == value;
+}
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
  * where "value" can be inserted. */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length);
 
     /* The value can never be found when the set is empty */
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
-        if (value > _intsetGet(is,max)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         } else if (value < _intsetGet(is,0)) {
             if (pos) *pos = 0;
             return 0;
         }
     }
+    return intsetSearchRange(is,value,0,len,pos);
+}
 
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
-            min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
-
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-    } else {
-        if (pos) *pos = min;
-        return 0;
+/* Like intsetSearch(), but only the elements starting at position "from"
+ * are searched, with an exponential search. This is faster when searching
+ * increasing values, starting every search from the position returned by
+ * the previous one. */
+static uint8_t intsetSearchFrom(intset *is, int64_t value, uint32_t from,
+                                uint32_t *pos)
+{
+    uint32_t len = intrev32ifbe(is->length), bound = 1;
+
+    while (from+bound < len && _intsetGet(is,from+bound) < value) {
+        from += bound;
+        bound *= 2;
     }
+    return intsetSearchRange(is,value,from,
+        (from+bound < len) ? from+bound+1 : len,pos);
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -276,6 +351,80 @@ uint32_t intsetLen(const intset *is) {
     return intrev32ifbe(is->length);
 }
 
+/* Create an intset able to hold "len" elements of encoding "enc". The
+ * length must be set by the caller once the elements are written. */
+static intset *intsetNewEncoded(uint8_t enc, uint32_t len) {
+    intset *is = zmalloc(sizeof(intset)+len*enc);
+    is->encoding = intrev32ifbe(enc);
+    is->length = 0;
+    return is;
+}
+
+/* Set the length of an intset created by intsetNewEncoded(), freeing the
+ * memory left unused. */
+static intset *intsetSetLength(intset *is, uint32_t len) {
+    is = intsetResize(is,len);
+    is->length = intrev32ifbe(len);
+    return is;
+}
+
+/* Return a new intset with the elements of "a" that are also in "b". The
+ * elements are merged with exponential searches, so that the intersection
+ * of a small intset with a big one costs O(N*log(M/N)). */
+intset *intsetIntersection(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t enc = intrev32ifbe(a->encoding) < intrev32ifbe(b->encoding) ?
+                  intrev32ifbe(a->encoding) : intrev32ifbe(b->encoding);
+    intset *is = intsetNewEncoded(enc,alen < blen ? alen : blen);
+    uint32_t i, from = 0, len = 0;
+
+    for (i = 0; i < alen && from < blen; i++) {
+        int64_t value = _intsetGet(a,i);
+        if (intsetSearchFrom(b,value,from,&from)) _intsetSet(is,len++,value);
+    }
+    return intsetSetLength(is,len);
+}
+
+/* Return a new intset with the elements of "a" that are not in "b". */
+intset *intsetDifference(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    intset *is = intsetNewEncoded(intrev32ifbe(a->encoding),alen);
+    uint32_t i, from = 0, len = 0;
+
+    for (i = 0; i < alen; i++) {
+        int64_t value = _intsetGet(a,i);
+        if (from >= blen || !intsetSearchFrom(b,value,from,&from))
+            _intsetSet(is,len++,value);
+    }
+    return intsetSetLength(is,len);
+}
+
+/* Return a new intset with the elements of both "a" and "b", merging the
+ * two sorted arrays. */
+intset *intsetUnion(intset *a, intset *b) {
+    uint32_t alen = intrev32ifbe(a->length), blen = intrev32ifbe(b->length);
+    uint8_t enc = intrev32ifbe(a->encoding) > intrev32ifbe(b->encoding) ?
+                  intrev32ifbe(a->encoding) : intrev32ifbe(b->encoding);
+    intset *is = intsetNewEncoded(enc,alen+blen);
+    uint32_t i = 0, j = 0, len = 0;
+
+    while (i < alen && j < blen) {
+        int64_t va = _intsetGet(a,i), vb = _intsetGet(b,j);
+        if (va <= vb) i++;
+        if (vb <= va) j++;
+        _intsetSet(is,len++,va < vb ? va : vb);
+    }
+    while (i < alen) _intsetSet(is,len++,_intsetGet(a,i++));
+    while (j < blen) _intsetSet(is,len++,_intsetGet(b,j++));
+    return intsetSetLength(is,len);
+}
+
+/* Return a copy of the intset. */
+intset *intsetDup(intset *is) {
+    size_t size = intsetBlobLen(is);
+    return memcpy(zmalloc(size),is,size);
+}
+
 /* Return intset blob size in bytes. */
 size_t intsetBlobLen(intset *is) {
     return sizeof(intset)+intrev32ifbe(is->length)*intrev32ifbe(is->encoding);
@@ -471,6 +620,65 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Search across encodings: "); {
+        int64_t values[] = {-4294967296LL,-65536,-100,-1,0,7,100,65536,
+                            4294967296LL};
+        int enc;
+        for (enc = 0; enc < 3; enc++) {
+            int64_t base = enc == 0 ? 0 : (enc == 1 ? 100000 : 10000000000LL);
+            is = intsetNew();
+            for (i = 0; i < 100; i++) is = intsetAdd(is,base+i*2,NULL);
+            if (enc) is = intsetAdd(is,0,NULL);
+            checkConsistency(is);
+            for (i = 0; i < 100; i++) {
+                assert(intsetFind(is,base+i*2));
+                assert(!intsetFind(is,base+i*2+1));
+            }
+            for (i = 0; i < (int)(sizeof(values)/sizeof(values[0])); i++) {
+                int64_t v = values[i];
+                int expected = (v == 0) ||
+                    (v >= base && v < base+200 && (v-base)%2 == 0);
+                assert(intsetFind(is,v) == expected);
+            }
+        }
+        ok();
+    }
+
+    printf("Intersection, union and difference: "); {
+        for (i = 0; i < 100; i++) {
+            intset *a = createSet(10,rand()%200);
+            intset *b = createSet(rand()%2 ? 10 : 20,rand()%2000);
+            /* Upgrade some of the intsets to bigger encodings. */
+            if (rand()%2) a = intsetAdd(a,(rand()%2 ? 1 : -1)*65536LL,NULL);
+            if (rand()%2) b = intsetAdd(b,(rand()%2 ? 1 : -1)*4294967296LL,NULL);
+            intset *inter = intsetIntersection(a,b);
+            intset *uni = intsetUnion(a,b);
+            intset *diff = intsetDifference(a,b);
+            uint32_t j, expected_inter = 0;
+            int64_t v;
+
+            for (j = 0; intsetGet(a,j,&v); j++) {
+                if (intsetFind(b,v)) {
+                    expected_inter++;
+                    assert(intsetFind(inter,v) && intsetFind(uni,v) &&
+                           !intsetFind(diff,v));
+                } else {
+                    assert(!intsetFind(inter,v) && intsetFind(uni,v) &&
+                           intsetFind(diff,v));
+                }
+            }
+            for (j = 0; intsetGet(b,j,&v); j++) assert(intsetFind(uni,v));
+            assert(intsetLen(inter) == expected_inter);
+            assert(intsetLen(diff) == intsetLen(a)-expected_inter);
+            assert(intsetLen(uni) == intsetLen(a)+intsetLen(b)-expected_inter);
+            if (intsetLen(inter) > 1) checkConsistency(inter);
+            if (intsetLen(diff) > 1) checkConsistency(diff);
+            if (intsetLen(uni) > 1) checkConsistency(uni);
+            zfree(a); zfree(b); zfree(inter); zfree(uni); zfree(diff);
+        }
+        ok();
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
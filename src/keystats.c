@@ -0,0 +1,189 @@
+/* Keyspace access statistics, see the keyspace-stats-* options.
+ *
+ * When enabled, 1 out of keyspace-stats-sample-ratio key lookups is
+ * accounted, as a hit or a miss for the read lookups, or as a write, both
+ * in the DB of the key and in the longest configured prefix of its name,
+ * so that the users of a shared server can see the hit ratio and the
+ * traffic of their own keys in INFO keystats. The sampled lookups count
+ * for the whole ratio, so the counters are estimates of the real ones.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#define KEYSTATS_MAX_PREFIXES 1024
+
+/* Counters of the keys having a given prefix. */
+typedef struct keyspacePrefixStats {
+    long long hits;
+    long long misses;
+    long long writes;
+} keyspacePrefixStats;
+
+static void keyspaceStatsFreePrefix(void *stats) {
+    zfree(stats);
+}
+
+/* Set the prefixes to account, a space separated list as given to the
+ * keyspace-stats-prefixes option. The counters of the prefixes that are
+ * still configured are retained. Returns C_ERR without changing anything
+ * if there are too many prefixes. */
+int keyspaceStatsSetPrefixes(const char *prefixes) {
+    int count, j;
+    sds *argv = sdssplitlen(prefixes,strlen(prefixes)," ",1,&count);
+    rax *newstats;
+
+    if (count > KEYSTATS_MAX_PREFIXES) {
+        sdsfreesplitres(argv,count);
+        return C_ERR;
+    }
+    newstats = raxNew();
+    for (j = 0; j < count; j++) {
+        keyspacePrefixStats *stats = NULL;
+
+        if (sdslen(argv[j]) == 0) continue; /* Repeated spaces. */
+        if (server.keyspace_stats)
+            raxRemove(server.keyspace_stats,(unsigned char*)argv[j],
+                      sdslen(argv[j]),(void**)&stats);
+        if (stats == NULL) stats = zcalloc(sizeof(*stats));
+        if (!raxTryInsert(newstats,(unsigned char*)argv[j],sdslen(argv[j]),
+                          stats,NULL)) zfree(stats);
+    }
+    sdsfreesplitres(argv,count);
+    if (server.keyspace_stats)
+        raxFreeWithCallback(server.keyspace_stats,keyspaceStatsFreePrefix);
+    server.keyspace_stats = newstats;
+    return C_OK;
+}
+
+/* Return the counters of the longest configured prefix of 'key', or NULL
+ * if none is a prefix of it.
+ *
+ * The greatest prefix <= key is the one we look for, unless it is not a
+ * prefix of the key: in that case the prefix we look for can only be a
+ * prefix of the part the two have in common, so we search again for it. */
+static keyspacePrefixStats *keyspaceStatsLookupPrefix(sds key) {
+    keyspacePrefixStats *stats = NULL;
+    size_t len = sdslen(key);
+    raxIterator ri;
+
+    raxStart(&ri,server.keyspace_stats);
+    while (len && raxSeek(&ri,"<=",(unsigned char*)key,len) && raxNext(&ri)) {
+        size_t common = 0;
+
+        while (common < ri.key_len && common < len &&
+               ri.key[common] == (unsigned char)key[common]) common++;
+        if (common == ri.key_len) {
+            stats = ri.data;
+            break;
+        }
+        len = common;
+    }
+    raxStop(&ri);
+    return stats;
+}
+
+/* Account a lookup of 'key' in 'db', of type KEYSTATS_HIT, KEYSTATS_MISS or
+ * KEYSTATS_WRITE. Called by the lookup functions when the statistics are
+ * enabled. The lookups performed by I/O threads are not accounted, since
+ * the counters are not thread safe. */
+void keyspaceStatsRecord(redisDb *db, robj *key, int type) {
+    long long ratio = server.keyspace_stats_sample_ratio;
+    keyspacePrefixStats *stats = NULL;
+
+    if (server.io_threads_executing) return;
+    if (server.keyspace_stats_counter++ % ratio) return;
+
+    if (raxSize(server.keyspace_stats))
+        stats = keyspaceStatsLookupPrefix(key->ptr);
+    switch(type) {
+    case KEYSTATS_HIT:
+        db->stat_keyspace_hits += ratio;
+        if (stats) stats->hits += ratio;
+        break;
+    case KEYSTATS_MISS:
+        db->stat_keyspace_misses += ratio;
+        if (stats) stats->misses += ratio;
+        break;
+    case KEYSTATS_WRITE:
+        db->stat_keyspace_writes += ratio;
+        if (stats) stats->writes += ratio;
+        break;
+    }
+}
+
+/* Reset all the counters, for CONFIG RESETSTAT. */
+void resetKeyspaceStats(void) {
+    raxIterator ri;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        server.db[j].stat_keyspace_hits = 0;
+        server.db[j].stat_keyspace_misses = 0;
+        server.db[j].stat_keyspace_writes = 0;
+    }
+    raxStart(&ri,server.keyspace_stats);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) memset(ri.data,0,sizeof(keyspacePrefixStats));
+    raxStop(&ri);
+}
+
+/* Append the fields of the INFO keystats section to 'info'. The prefixes
+ * are reported last on their line, since they may contain any character
+ * but spaces. */
+sds genKeyspaceStatsInfoString(sds info) {
+    raxIterator ri;
+    int j = 0;
+
+    info = sdscatprintf(info,"keystats_sample_ratio:%lld\r\n",
+                        server.keyspace_stats_sample_ratio);
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (!db->stat_keyspace_hits && !db->stat_keyspace_misses &&
+            !db->stat_keyspace_writes) continue;
+        info = sdscatprintf(info,"db%d:hits=%lld,misses=%lld,writes=%lld\r\n",
+                            j, db->stat_keyspace_hits,
+                            db->stat_keyspace_misses,
+                            db->stat_keyspace_writes);
+    }
+    j = 0;
+    raxStart(&ri,server.keyspace_stats);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        keyspacePrefixStats *stats = ri.data;
+
+        info = sdscatprintf(info,
+            "prefix%d:hits=%lld,misses=%lld,writes=%lld,prefix=",
+            j++, stats->hits, stats->misses, stats->writes);
+        info = sdscatlen(info,ri.key,ri.key_len);
+        info = sdscatlen(info,"\r\n",2);
+    }
+    raxStop(&ri);
+    return info;
+}
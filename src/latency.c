@@ -34,6 +34,8 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
+#include <math.h>
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -91,40 +93,110 @@ void latencyMonitorInit(void) {
     server.latency_events = dictCreate(&latencyTimeSeriesDictType,NULL);
 }
 
-/* Add the specified sample to the specified time series "event".
- * This function is usually called via latencyAddSampleIfNeeded(), that
- * is a macro that only adds the sample if the latency is higher than
- * server.latency_monitor_threshold. */
-void latencyAddSample(const char *event, mstime_t latency) {
+/* Create a time series able to hold 'len' samples. */
+static struct latencyTimeSeries *latencyCreateTimeSeries(int len) {
+    struct latencyTimeSeries *ts =
+        zcalloc(sizeof(*ts)+sizeof(struct latencySample)*len);
+    ts->len = len;
+    return ts;
+}
+
+/* Add the specified sample, in microseconds, to the specified time series
+ * "event". This function is usually called via latencyAddSampleIfNeeded(),
+ * that is a macro that only adds the sample if the latency is higher than
+ * server.latency_monitor_threshold_us. */
+void latencyAddSample(const char *event, ustime_t latency) {
     struct latencyTimeSeries *ts = dictFetchValue(server.latency_events,event);
     time_t now = time(NULL);
     int prev;
 
     /* Create the time series if it does not exist. */
     if (ts == NULL) {
-        ts = zmalloc(sizeof(*ts));
-        ts->idx = 0;
-        ts->max = 0;
-        memset(ts->samples,0,sizeof(ts->samples));
+        ts = latencyCreateTimeSeries(server.latency_history_len);
         dictAdd(server.latency_events,zstrdup(event),ts);
     }
 
+    if (latency > UINT32_MAX) latency = UINT32_MAX;
     if (latency > ts->max) ts->max = latency;
 
     /* If the previous sample is in the same second, we update our old sample
      * if this latency is > of the old one, or just return. */
-    prev = (ts->idx + LATENCY_TS_LEN - 1) % LATENCY_TS_LEN;
+    prev = (ts->idx + ts->len - 1) % ts->len;
     if (ts->samples[prev].time == now) {
         if (latency > ts->samples[prev].latency)
             ts->samples[prev].latency = latency;
         return;
     }
 
-    ts->samples[ts->idx].time = time(NULL);
+    ts->samples[ts->idx].time = now;
     ts->samples[ts->idx].latency = latency;
 
     ts->idx++;
-    if (ts->idx == LATENCY_TS_LEN) ts->idx = 0;
+    if (ts->idx == ts->len) ts->idx = 0;
+}
+
+/* Resize the time series of all the events to server.latency_history_len
+ * samples, keeping the most recent ones. Called when the option
+ * latency-monitor-history-len is changed at runtime. */
+void latencyResizeHistory(void) {
+    dictIterator *di = dictGetIterator(server.latency_events);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        struct latencyTimeSeries *ts = dictGetVal(de);
+        struct latencyTimeSeries *nts;
+        int j, keep;
+
+        if (ts->len == server.latency_history_len) continue;
+        nts = latencyCreateTimeSeries(server.latency_history_len);
+        nts->max = ts->max;
+        keep = ts->len < nts->len ? ts->len : nts->len;
+        for (j = ts->len-keep; j < ts->len; j++) {
+            struct latencySample *s = ts->samples+((ts->idx+j) % ts->len);
+            if (s->time == 0) continue;
+            nts->samples[nts->idx++] = *s;
+        }
+        if (nts->idx == nts->len) nts->idx = 0;
+        zfree(ts);
+        dictSetVal(server.latency_events,de,nts);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Parse the latency-monitor-threshold option: a number of milliseconds,
+ * optionally followed by the "ms" or "us" unit, so that thresholds below
+ * one millisecond can be set. The threshold is returned in microseconds,
+ * or -1 on error. */
+long long latencyParseThreshold(const char *s) {
+    char *end;
+    long long val, mul = 1000;
+
+    errno = 0;
+    val = strtoll(s,&end,10);
+    if (errno || end == s || val < 0) return -1;
+    if (!strcasecmp(end,"us")) mul = 1;
+    else if (*end != '\0' && strcasecmp(end,"ms")) return -1;
+    if (val > LLONG_MAX/mul) return -1;
+    return val*mul;
+}
+
+/* Format the latency threshold 'threshold', in microseconds, as accepted by
+ * latencyParseThreshold(): thresholds of whole milliseconds are formatted
+ * without unit, like in the past. */
+sds latencyFormatThreshold(long long threshold) {
+    if (threshold % 1000 == 0)
+        return sdsfromlonglong(threshold/1000);
+    return sdscatprintf(sdsempty(),"%lldus",threshold);
+}
+
+/* Format the latency 'us' in the buffer 'buf', in milliseconds, or in
+ * microseconds when below one millisecond. */
+static char *latencyFormat(char *buf, size_t len, uint64_t us) {
+    if (us < 1000)
+        snprintf(buf,len,"%lluus",(unsigned long long)us);
+    else
+        snprintf(buf,len,"%llums",(unsigned long long)us/1000);
+    return buf;
 }
 
 /* Reset data for the specified event, or all the events data if 'event' is
@@ -173,7 +245,7 @@ void analyzeLatencyForEvent(char *event, struct latencyStats *ls) {
 
     /* First pass, populate everything but the MAD. */
     sum = 0;
-    for (j = 0; j < LATENCY_TS_LEN; j++) {
+    for (j = 0; j < ts->len; j++) {
         if (ts->samples[j].time == 0) continue;
         ls->samples++;
         if (ls->samples == 1) {
@@ -202,7 +274,7 @@ void analyzeLatencyForEvent(char *event, struct latencyStats *ls) {
 
     /* Second pass, compute MAD. */
     sum = 0;
-    for (j = 0; j < LATENCY_TS_LEN; j++) {
+    for (j = 0; j < ts->len; j++) {
         int64_t delta;
 
         if (ts->samples[j].time == 0) continue;
@@ -237,7 +309,7 @@ sds createLatencyReport(void) {
     /* Return ASAP if the latency engine is disabled and it looks like it
      * was never enabled so far. */
     if (dictSize(server.latency_events) == 0 &&
-        server.latency_monitor_threshold == 0)
+        server.latency_monitor_threshold_us == 0)
     {
         report = sdscat(report,"I'm sorry, Dave, I can't do that. Latency monitoring is disabled in this Redis instance. You may use \"CONFIG SET latency-monitor-threshold <milliseconds>.\" in order to enable it. If we weren't in a deep space mission I'd suggest to take a look at http://redis.io/topics/latency-monitor.\n");
         return report;
@@ -262,14 +334,15 @@ sds createLatencyReport(void) {
         }
         analyzeLatencyForEvent(event,&ls);
 
+        char avg[32], mad[32], max[32];
         report = sdscatprintf(report,
-            "%d. %s: %d latency spikes (average %lums, mean deviation %lums, period %.2f sec). Worst all time event %lums.",
+            "%d. %s: %d latency spikes (average %s, mean deviation %s, period %.2f sec). Worst all time event %s.",
             eventnum, event,
             ls.samples,
-            (unsigned long) ls.avg,
-            (unsigned long) ls.mad,
+            latencyFormat(avg,sizeof(avg),ls.avg),
+            latencyFormat(mad,sizeof(mad),ls.mad),
             (double) ls.period/ls.samples,
-            (unsigned long) ts->max);
+            latencyFormat(max,sizeof(max),ts->max));
 
         /* Fork */
         if (!strcasecmp(event,"fork")) {
@@ -297,8 +370,8 @@ sds createLatencyReport(void) {
             if (server.slowlog_log_slower_than < 0) {
                 advise_slowlog_enabled = 1;
                 advices++;
-            } else if (server.slowlog_log_slower_than/1000 >
-                       server.latency_monitor_threshold)
+            } else if (server.slowlog_log_slower_than >
+                       server.latency_monitor_threshold_us)
             {
                 advise_slowlog_tuning = 1;
                 advices++;
@@ -371,7 +444,9 @@ sds createLatencyReport(void) {
             advices++;
         }
 
-        if (!strcasecmp(event,"eviction-cycle")) {
+        if (!strcasecmp(event,"eviction-cycle") ||
+            !strcasecmp(event,"lazyfree-wait"))
+        {
             advise_mass_eviction = 1;
             advices++;
         }
@@ -401,11 +476,11 @@ sds createLatencyReport(void) {
 
         /* Slow log. */
         if (advise_slowlog_enabled) {
-            report = sdscatprintf(report,"- There are latency issues with potentially slow commands you are using. Try to enable the Slow Log Redis feature using the command 'CONFIG SET slowlog-log-slower-than %llu'. If the Slow log is disabled Redis is not able to log slow commands execution for you.\n", (unsigned long long)server.latency_monitor_threshold*1000);
+            report = sdscatprintf(report,"- There are latency issues with potentially slow commands you are using. Try to enable the Slow Log Redis feature using the command 'CONFIG SET slowlog-log-slower-than %llu'. If the Slow log is disabled Redis is not able to log slow commands execution for you.\n", (unsigned long long)server.latency_monitor_threshold_us);
         }
 
         if (advise_slowlog_tuning) {
-            report = sdscatprintf(report,"- Your current Slow Log configuration only logs events that are slower than your configured latency monitor threshold. Please use 'CONFIG SET slowlog-log-slower-than %llu'.\n", (unsigned long long)server.latency_monitor_threshold*1000);
+            report = sdscatprintf(report,"- Your current Slow Log configuration only logs events that are slower than your configured latency monitor threshold. Please use 'CONFIG SET slowlog-log-slower-than %llu'.\n", (unsigned long long)server.latency_monitor_threshold_us);
         }
 
         if (advise_slowlog_inspect) {
@@ -474,41 +549,47 @@ sds createLatencyReport(void) {
 /* ---------------------- Latency command implementation -------------------- */
 
 /* latencyCommand() helper to produce a time-delay reply for all the samples
- * in memory for the specified time series. */
-void latencyCommandReplyWithSamples(client *c, struct latencyTimeSeries *ts) {
+ * in memory for the specified time series. The latencies are reported in
+ * milliseconds, or in microseconds if 'usec' is true. */
+void latencyCommandReplyWithSamples(client *c, struct latencyTimeSeries *ts,
+                                    int usec)
+{
     void *replylen = addReplyDeferredLen(c);
-    int samples = 0, j;
+    int samples = 0, j, div = usec ? 1 : 1000;
 
-    for (j = 0; j < LATENCY_TS_LEN; j++) {
-        int i = (ts->idx + j) % LATENCY_TS_LEN;
+    for (j = 0; j < ts->len; j++) {
+        int i = (ts->idx + j) % ts->len;
 
         if (ts->samples[i].time == 0) continue;
         addReplyArrayLen(c,2);
         addReplyLongLong(c,ts->samples[i].time);
-        addReplyLongLong(c,ts->samples[i].latency);
+        addReplyLongLong(c,ts->samples[i].latency/div);
         samples++;
     }
     setDeferredArrayLen(c,replylen,samples);
 }
 
 /* latencyCommand() helper to produce the reply for the LATEST subcommand,
- * listing the last latency sample for every event type registered so far. */
-void latencyCommandReplyWithLatestEvents(client *c) {
+ * listing the last latency sample for every event type registered so far.
+ * The latencies are reported in milliseconds, or in microseconds if 'usec'
+ * is true. */
+void latencyCommandReplyWithLatestEvents(client *c, int usec) {
     dictIterator *di;
     dictEntry *de;
+    int div = usec ? 1 : 1000;
 
     addReplyArrayLen(c,dictSize(server.latency_events));
     di = dictGetIterator(server.latency_events);
     while((de = dictNext(di)) != NULL) {
         char *event = dictGetKey(de);
         struct latencyTimeSeries *ts = dictGetVal(de);
-        int last = (ts->idx + LATENCY_TS_LEN - 1) % LATENCY_TS_LEN;
+        int last = (ts->idx + ts->len - 1) % ts->len;
 
         addReplyArrayLen(c,4);
         addReplyBulkCString(c,event);
         addReplyLongLong(c,ts->samples[last].time);
-        addReplyLongLong(c,ts->samples[last].latency);
-        addReplyLongLong(c,ts->max);
+        addReplyLongLong(c,ts->samples[last].latency/div);
+        addReplyLongLong(c,ts->max/div);
     }
     dictReleaseIterator(di);
 }
@@ -520,8 +601,8 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
     sds graph = sdsempty();
     uint32_t min = 0, max = 0;
 
-    for (j = 0; j < LATENCY_TS_LEN; j++) {
-        int i = (ts->idx + j) % LATENCY_TS_LEN;
+    for (j = 0; j < ts->len; j++) {
+        int i = (ts->idx + j) % ts->len;
         int elapsed;
         char buf[64];
 
@@ -547,9 +628,12 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
         sparklineSequenceAddSample(seq,ts->samples[i].latency,buf);
     }
 
+    char high[32], low[32], alltime[32];
     graph = sdscatprintf(graph,
-        "%s - high %lu ms, low %lu ms (all time high %lu ms)\n", event,
-        (unsigned long) max, (unsigned long) min, (unsigned long) ts->max);
+        "%s - high %s, low %s (all time high %s)\n", event,
+        latencyFormat(high,sizeof(high),max),
+        latencyFormat(low,sizeof(low),min),
+        latencyFormat(alltime,sizeof(alltime),ts->max));
     for (j = 0; j < LATENCY_GRAPH_COLS; j++)
         graph = sdscatlen(graph,"-",1);
     graph = sdscatlen(graph,"\n",1);
@@ -558,6 +642,144 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
     return graph;
 }
 
+/* --------------------------- Event loop profiler --------------------------- */
+
+static const char *eventLoopPhaseNames[EL_PHASE_NUM] = {
+    "events", "cron", "reads", "expire", "evict", "blocked", "replication",
+    "modules", "unblocked", "tracking", "aof", "writes", "beforesleep"
+};
+
+/* Account the execution of the event loop phase 'phase', started at the
+ * time 'start' in microseconds, and ended now. The phase is also reported
+ * to the latency monitor as the "eventloop-<phase>" event. The current time
+ * is returned, so that it can be used as start time of the next phase. */
+long long eventLoopPhaseEnd(int phase, long long start) {
+    struct eventLoopPhaseStats *ps = server.el_phases+phase;
+    long long now = ustime(), duration = now-start;
+
+    ps->calls++;
+    ps->usec += duration;
+    if (duration > ps->max_usec) ps->max_usec = duration;
+    if (server.latency_monitor_threshold_us &&
+        duration >= server.latency_monitor_threshold_us)
+    {
+        char event[64];
+        snprintf(event,sizeof(event),"eventloop-%s",
+                 eventLoopPhaseNames[phase]);
+        latencyAddSample(event,duration);
+    }
+    return now;
+}
+
+void eventLoopPhaseStatsReset(void) {
+    memset(server.el_phases,0,sizeof(server.el_phases));
+}
+
+/* Generate the INFO eventloop section. */
+sds genEventLoopInfoString(sds info) {
+    for (int j = 0; j < EL_PHASE_NUM; j++) {
+        struct eventLoopPhaseStats *ps = server.el_phases+j;
+        info = sdscatprintf(info,
+            "eventloop_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,"
+            "max_usec=%lld\r\n",
+            eventLoopPhaseNames[j], ps->calls, ps->usec,
+            ps->calls ? (double)ps->usec/ps->calls : 0, ps->max_usec);
+    }
+    return info;
+}
+
+/* ---------------------------- Latency histograms --------------------------- */
+
+/* Return the bucket of the histogram for the value 'us'. Values smaller than
+ * 2^LATENCY_HIST_SUB_BITS have their own bucket, the other ones are
+ * identified by the position of the most significant bit and by the
+ * LATENCY_HIST_SUB_BITS bits that follow it. */
+static int latencyHistogramBucket(uint64_t us) {
+    if (us < (1 << LATENCY_HIST_SUB_BITS)) return us;
+    int msb = 63 - __builtin_clzll(us);
+    if (msb >= LATENCY_HIST_MAX_BITS) return LATENCY_HIST_BUCKETS-1;
+    int shift = msb - LATENCY_HIST_SUB_BITS;
+    return ((shift+1) << LATENCY_HIST_SUB_BITS) +
+           ((us >> shift) & ((1 << LATENCY_HIST_SUB_BITS)-1));
+}
+
+/* Return the highest value counted in the specified bucket. */
+static uint64_t latencyHistogramBucketMax(int bucket) {
+    if (bucket < (1 << LATENCY_HIST_SUB_BITS)) return bucket;
+    int shift = (bucket >> LATENCY_HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << LATENCY_HIST_SUB_BITS) +
+                   (bucket & ((1 << LATENCY_HIST_SUB_BITS)-1))) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+/* Return a new empty histogram. */
+uint64_t *latencyHistogramCreate(void) {
+    return zcalloc(sizeof(uint64_t)*LATENCY_HIST_BUCKETS);
+}
+
+/* Count the value 'us' in the histogram '*hist', that is allocated the
+ * first time a value is added, so that the commands never called don't
+ * use memory. */
+void latencyHistogramAdd(uint64_t **hist, long long us) {
+    if (*hist == NULL) *hist = latencyHistogramCreate();
+    (*hist)[latencyHistogramBucket(us < 0 ? 0 : us)]++;
+}
+
+/* Like latencyHistogramAdd() but for an already allocated histogram that
+ * I/O threads may update concurrently. */
+void latencyHistogramAddAtomic(uint64_t *hist, long long us) {
+    atomicIncr(hist[latencyHistogramBucket(us < 0 ? 0 : us)],1);
+}
+
+/* Return the value below which 'perc' percent of the values added to the
+ * histogram fall, as the upper bound of the bucket containing it, or 0 if
+ * the histogram is empty. */
+long long latencyHistogramPercentile(uint64_t *hist, double perc) {
+    uint64_t total = 0, seen = 0;
+    int j;
+
+    if (hist == NULL) return 0;
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) total += hist[j];
+    if (total == 0) return 0;
+
+    uint64_t rank = (uint64_t)ceil(total*perc/100);
+    if (rank == 0) rank = 1;
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += hist[j];
+        if (seen >= rank) break;
+    }
+    return latencyHistogramBucketMax(j);
+}
+
+/* Reply with the histogram of the command 'cmd', see LATENCY HISTOGRAM. */
+static void latencyCommandReplyWithHistogram(client *c,
+                                             struct redisCommand *cmd)
+{
+    addReplyBulkCString(c,cmd->name);
+    addReplyMapLen(c,5);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,cmd->calls);
+    addReplyBulkCString(c,"p50");
+    addReplyLongLong(c,latencyHistogramPercentile(cmd->latency_histogram,50));
+    addReplyBulkCString(c,"p99");
+    addReplyLongLong(c,latencyHistogramPercentile(cmd->latency_histogram,99));
+    addReplyBulkCString(c,"p999");
+    addReplyLongLong(c,latencyHistogramPercentile(cmd->latency_histogram,99.9));
+
+    /* Only the buckets with a non zero count, as upper bound and count. */
+    addReplyBulkCString(c,"histogram_usec");
+    void *replylen = addReplyDeferredLen(c);
+    long buckets = 0;
+    for (int j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        if (cmd->latency_histogram == NULL) break;
+        if (cmd->latency_histogram[j] == 0) continue;
+        addReplyLongLong(c,latencyHistogramBucketMax(j));
+        addReplyLongLong(c,cmd->latency_histogram[j]);
+        buckets++;
+    }
+    setDeferredMapLen(c,replylen,buckets);
+}
+
 /* LATENCY command implementations.
  *
  * LATENCY HISTORY: return time-latency samples for the specified event.
@@ -565,27 +787,38 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
  * LATENCY DOCTOR: returns a human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
  * LATENCY RESET: reset data of a specified event or all the data if no event provided.
+ * LATENCY HISTOGRAM: reply with the latency histograms of the commands.
+ *
+ * LATENCY HISTORY and LATEST report the latencies in milliseconds, unless
+ * the USEC option is given.
  */
 void latencyCommand(client *c) {
     const char *help[] = {
 "DOCTOR              -- Returns a human readable latency analysis report.",
 "GRAPH   <event>     -- Returns an ASCII latency graph for the event class.",
-"HISTORY <event>     -- Returns time-latency samples for the event class.",
-"LATEST              -- Returns the latest latency samples for all events.",
+"HISTORY <event> [USEC] -- Returns time-latency samples for the event class.",
+"LATEST [USEC]       -- Returns the latest latency samples for all events.",
+"                       (USEC: report microseconds instead of milliseconds)",
 "RESET   [event ...] -- Resets latency data of one or more event classes.",
 "                       (default: reset all data for all event classes)",
+"HISTOGRAM [cmd ...] -- Returns the calls, p50, p99 and p999 latency and the",
+"                       latency histogram of the commands (default: all the",
+"                       commands called since the last CONFIG RESETSTAT).",
 "HELP                -- Prints this help.",
 NULL
     };
     struct latencyTimeSeries *ts;
 
-    if (!strcasecmp(c->argv[1]->ptr,"history") && c->argc == 3) {
-        /* LATENCY HISTORY <event> */
+    if (!strcasecmp(c->argv[1]->ptr,"history") &&
+        (c->argc == 3 ||
+         (c->argc == 4 && !strcasecmp(c->argv[3]->ptr,"usec"))))
+    {
+        /* LATENCY HISTORY <event> [USEC] */
         ts = dictFetchValue(server.latency_events,c->argv[2]->ptr);
         if (ts == NULL) {
             addReplyArrayLen(c,0);
         } else {
-            latencyCommandReplyWithSamples(c,ts);
+            latencyCommandReplyWithSamples(c,ts,c->argc == 4);
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"graph") && c->argc == 3) {
         /* LATENCY GRAPH <event> */
@@ -601,15 +834,47 @@ NULL
         graph = latencyCommandGenSparkeline(event,ts);
         addReplyVerbatim(c,graph,sdslen(graph),"txt");
         sdsfree(graph);
-    } else if (!strcasecmp(c->argv[1]->ptr,"latest") && c->argc == 2) {
-        /* LATENCY LATEST */
-        latencyCommandReplyWithLatestEvents(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"latest") &&
+               (c->argc == 2 ||
+                (c->argc == 3 && !strcasecmp(c->argv[2]->ptr,"usec"))))
+    {
+        /* LATENCY LATEST [USEC] */
+        latencyCommandReplyWithLatestEvents(c,c->argc == 3);
     } else if (!strcasecmp(c->argv[1]->ptr,"doctor") && c->argc == 2) {
         /* LATENCY DOCTOR */
         sds report = createLatencyReport();
 
         addReplyVerbatim(c,report,sdslen(report),"txt");
         sdsfree(report);
+    } else if (!strcasecmp(c->argv[1]->ptr,"histogram") && c->argc >= 2) {
+        /* LATENCY HISTOGRAM [command ...] */
+        struct redisCommand *cmd;
+
+        if (c->argc == 2) {
+            dictIterator *di = dictGetIterator(server.commands);
+            dictEntry *de;
+            long count = 0;
+            void *replylen = addReplyDeferredLen(c);
+
+            while((de = dictNext(di)) != NULL) {
+                cmd = dictGetVal(de);
+                if (!cmd->calls) continue;
+                latencyCommandReplyWithHistogram(c,cmd);
+                count++;
+            }
+            dictReleaseIterator(di);
+            setDeferredMapLen(c,replylen,count);
+        } else {
+            int j, count = 0;
+
+            for (j = 2; j < c->argc; j++)
+                if (lookupCommand(c->argv[j]->ptr)) count++;
+            addReplyMapLen(c,count);
+            for (j = 2; j < c->argc; j++) {
+                if ((cmd = lookupCommand(c->argv[j]->ptr)) != NULL)
+                    latencyCommandReplyWithHistogram(c,cmd);
+            }
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"reset") && c->argc >= 2) {
         /* LATENCY RESET */
         if (c->argc == 2) {
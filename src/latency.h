@@ -34,25 +34,31 @@
 #ifndef __LATENCY_H
 #define __LATENCY_H
 
-#define LATENCY_TS_LEN 160 /* History length for every monitored event. */
+/* Default and max history length for every monitored event, see the
+ * latency-monitor-history-len option. */
+#define LATENCY_TS_LEN 160
+#define LATENCY_TS_MAX_LEN 100000
 
 /* Representation of a latency sample: the sampling time and the latency
- * observed in milliseconds. */
+ * observed in microseconds. */
 struct latencySample {
     int32_t time; /* We don't use time_t to force 4 bytes usage everywhere. */
-    uint32_t latency; /* Latency in milliseconds. */
+    uint32_t latency; /* Latency in microseconds. */
 };
 
-/* The latency time series for a given event. */
+/* The latency time series for a given event: a ring of 'len' samples, at
+ * most one per second, allocated together with the header. */
 struct latencyTimeSeries {
     int idx; /* Index of the next sample to store. */
+    int len; /* Number of samples of the ring. */
     uint32_t max; /* Max latency observed for this event. */
-    struct latencySample samples[LATENCY_TS_LEN]; /* Latest history. */
+    struct latencySample samples[]; /* Latest history. */
 };
 
 /* Latency statistics structure. */
 struct latencyStats {
     uint32_t all_time_high; /* Absolute max observed since latest reset. */
+                            /* All the latencies are in microseconds. */
     uint32_t avg;           /* Average of current samples. */
     uint32_t min;           /* Min of current samples. */
     uint32_t max;           /* Max of current samples. */
@@ -61,29 +67,75 @@ struct latencyStats {
     time_t period;          /* Number of seconds since first event and now. */
 };
 
+/* Log-linear latency histograms, in microseconds: every power of two is
+ * split in 2^LATENCY_HIST_SUB_BITS buckets of the same size, so the error is
+ * below 1/2^LATENCY_HIST_SUB_BITS of the value. The layout is fixed, so the
+ * histograms of different instances can be merged adding the counts of the
+ * buckets with the same bounds. Values of 2^LATENCY_HIST_MAX_BITS or more
+ * (above one hour) go in the last bucket. With these values an histogram
+ * uses less than 2k of memory. */
+#define LATENCY_HIST_SUB_BITS 3
+#define LATENCY_HIST_MAX_BITS 32
+#define LATENCY_HIST_BUCKETS \
+    ((LATENCY_HIST_MAX_BITS-LATENCY_HIST_SUB_BITS+1) << LATENCY_HIST_SUB_BITS)
+
+/* Phases of the event loop timed by the event loop profiler, see
+ * eventLoopPhaseEnd(). The names are in eventLoopPhaseNames in latency.c. */
+#define EL_PHASE_EVENTS 0       /* File events processed by ae. */
+#define EL_PHASE_CRON 1         /* serverCron(). */
+#define EL_PHASE_READS 2        /* Threaded reads in afterSleep(). */
+#define EL_PHASE_EXPIRE 3       /* beforeSleep(): fast expire cycle. */
+#define EL_PHASE_EVICT 4        /* beforeSleep(): background eviction. */
+#define EL_PHASE_BLOCKED 5      /* beforeSleep(): ready keys and timeouts. */
+#define EL_PHASE_REPLICATION 6  /* beforeSleep(): ACKs and WAIT. */
+#define EL_PHASE_MODULES 7      /* beforeSleep(): module blocked clients. */
+#define EL_PHASE_UNBLOCKED 8    /* beforeSleep(): unblocked clients. */
+#define EL_PHASE_TRACKING 9     /* beforeSleep(): client side caching. */
+#define EL_PHASE_AOF 10         /* beforeSleep(): AOF write and WAITAOF. */
+#define EL_PHASE_WRITES 11      /* beforeSleep(): pending client writes. */
+#define EL_PHASE_BEFORESLEEP 12 /* beforeSleep() as a whole. */
+#define EL_PHASE_NUM 13
+
+/* Cumulative statistics of an event loop phase. */
+struct eventLoopPhaseStats {
+    long long calls;        /* Times the phase was executed. */
+    long long usec;         /* Total time spent in the phase. */
+    long long max_usec;     /* Longest execution of the phase. */
+};
+
 void latencyMonitorInit(void);
-void latencyAddSample(const char *event, mstime_t latency);
+void latencyAddSample(const char *event, ustime_t latency);
+void latencyResizeHistory(void);
+long long latencyParseThreshold(const char *s);
+sds latencyFormatThreshold(long long threshold);
 int THPIsEnabled(void);
+uint64_t *latencyHistogramCreate(void);
+void latencyHistogramAdd(uint64_t **hist, long long us);
+void latencyHistogramAddAtomic(uint64_t *hist, long long us);
+long long latencyHistogramPercentile(uint64_t *hist, double perc);
+long long eventLoopPhaseEnd(int phase, long long start);
+void eventLoopPhaseStatsReset(void);
+sds genEventLoopInfoString(sds info);
 
 /* Latency monitoring macros. */
 
 /* Start monitoring an event. We just set the current time. */
-#define latencyStartMonitor(var) if (server.latency_monitor_threshold) { \
-    var = mstime(); \
+#define latencyStartMonitor(var) if (server.latency_monitor_threshold_us) { \
+    var = ustime(); \
 } else { \
     var = 0; \
 }
 
 /* End monitoring an event, compute the difference with the current time
- * to check the amount of time elapsed. */
-#define latencyEndMonitor(var) if (server.latency_monitor_threshold) { \
-    var = mstime() - var; \
+ * to check the amount of time elapsed, in microseconds. */
+#define latencyEndMonitor(var) if (server.latency_monitor_threshold_us) { \
+    var = ustime() - var; \
 }
 
 /* Add the sample only if the elapsed time is >= to the configured threshold. */
 #define latencyAddSampleIfNeeded(event,var) \
-    if (server.latency_monitor_threshold && \
-        (var) >= server.latency_monitor_threshold) \
+    if (server.latency_monitor_threshold_us && \
+        (var) >= server.latency_monitor_threshold_us) \
           latencyAddSample((event),(var));
 
 /* Remove time from a nested event. */
@@ -6,6 +6,21 @@
 static size_t lazyfree_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Objects to free in the background are not submitted one per job: they are
+ * accumulated into a batch that is passed to the lazyfree thread as a single
+ * job once full, or by lazyfreeFlushBatch(), called at the end of the
+ * eviction and expire cycles and before returning to the event loop. This
+ * way the bio.c mutex and condition variable are used once every
+ * LAZYFREE_BATCH_SIZE objects when many keys are deleted in a row. */
+#define LAZYFREE_BATCH_SIZE 64
+
+typedef struct lazyfreeBatch {
+    int len;
+    robj *objs[LAZYFREE_BATCH_SIZE];
+} lazyfreeBatch;
+
+static lazyfreeBatch *lazyfree_batch = NULL;
+
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
     size_t aux;
@@ -29,7 +44,9 @@ size_t lazyfreeGetPendingObjectsCount(void) {
  * For lists the function returns the number of elements in the quicklist
  * representing the list. */
 size_t lazyfreeGetFreeEffort(robj *obj) {
-    if (obj->type == OBJ_LIST) {
+    if (obj->encoding == OBJ_ENCODING_SWAPPED) {
+        return 1; /* Just the stub, see tiered.c. */
+    } else if (obj->type == OBJ_LIST) {
         quicklist *ql = obj->ptr;
         return ql->len;
     } else if (obj->type == OBJ_SET && obj->encoding == OBJ_ENCODING_HT) {
@@ -41,20 +58,40 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
+    } else if (obj->type == OBJ_STRING &&
+               obj->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = obj->ptr;
+        return r->count;
     } else {
         return 1; /* Everything else is a single allocation. */
     }
 }
 
+/* Submit the objects accumulated so far to the lazyfree thread. */
+void lazyfreeFlushBatch(void) {
+    if (lazyfree_batch == NULL) return;
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,lazyfree_batch,NULL);
+    lazyfree_batch = NULL;
+}
+
+/* Add an object to release in the background to the current batch. */
+static void lazyfreeBatchAdd(robj *o) {
+    if (lazyfree_batch == NULL) {
+        lazyfree_batch = zmalloc(sizeof(*lazyfree_batch));
+        lazyfree_batch->len = 0;
+    }
+    atomicIncr(lazyfree_objects,1);
+    lazyfree_batch->objs[lazyfree_batch->len++] = o;
+    if (lazyfree_batch->len == LAZYFREE_BATCH_SIZE) lazyfreeFlushBatch();
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB.
  * If there are enough allocations to free the value object may be put into
  * a lazy free list instead of being freed synchronously. The lazy free list
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
+    if (db->keys_reply_jobs) replyFlushJobsOfDb(db);
 
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
@@ -62,7 +99,14 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
-        size_t free_effort = lazyfreeGetFreeEffort(val);
+        size_t free_effort;
+
+        if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+
+        /* Drop the expire, if any, while the entry is still valid. */
+        expireIndexRemoveEntry(db,de);
+        hashFieldExpiresDelKey(db,dictGetKey(de));
+        free_effort = lazyfreeGetFreeEffort(val);
 
         /* If releasing the object is too much work, do it in the background
          * by adding the object to the lazy free list.
@@ -73,8 +117,10 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * through and reach the dictFreeUnlinkedEntry() call, that will be
          * equivalent to just calling decrRefCount(). */
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
+            /* The value is freed by the lazyfree thread: the memory of the
+             * DB is updated now with an estimate of what it uses. */
+            dbMemoryAccount(db,-dbObjectMemory(val));
+            lazyfreeBatchAdd(val);
             dictSetVal(db->dict,de,NULL);
         }
     }
@@ -82,8 +128,9 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     /* Release the key-val pair, or just the key if we set the val
      * field to NULL in order to lazy free it later. */
     if (de) {
+        if (server.cluster_enabled) slotToKeyDelEntry(db,de);
+        if (db->keys_index) keysIndexDel(db,dictGetKey(de));
         dictFreeUnlinkedEntry(db->dict,de);
-        if (server.cluster_enabled) slotToKeyDel(key);
         return 1;
     } else {
         return 0;
@@ -94,8 +141,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        lazyfreeBatchAdd(o);
     } else {
         decrRefCount(o);
     }
@@ -103,50 +149,161 @@ void freeObjAsync(robj *o) {
 
 /* Empty a Redis DB asynchronously. What the function does actually is to
  * create a new empty set of hash tables and scheduling the old ones for
- * lazy freeing. */
+ * lazy freeing. Empty databases, as most of the ones FLUSHALL ASYNC visits
+ * usually are, are not worth a job and are just left untouched. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType,NULL);
-    db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    dict *oldht = db->dict;
+    expireIndex *oldexpires = db->expires;
+    if (dictSize(oldht) == 0) return;
+    db->dict = createDbDict(&dbDictType);
+    db->expires = expireIndexCreate();
+    atomicIncr(lazyfree_objects,dictSize(oldht));
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht,oldexpires);
 }
 
-/* Empty the slots-keys map of Redis CLuster by creating a new empty one
- * and scheduiling the old for lazy freeing. */
-void slotToKeyFlushAsync(void) {
-    rax *old = server.cluster->slots_to_keys;
+/* Free the keys index of a DB emptied with FLUSHALL ASYNC or FLUSHDB ASYNC,
+ * in the lazyfree thread unless it is small. */
+void freeKeysIndexAsync(rax *rt) {
+    if (raxSize(rt) > LAZYFREE_THRESHOLD) {
+        atomicIncr(lazyfree_objects,raxSize(rt));
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,rt);
+    } else {
+        raxFree(rt);
+    }
+}
+
+/* When there are multiple lazyfree threads, large dictionaries are not
+ * released by a single thread: their tables are split in chunks of slots
+ * that are queued as further lazyfree jobs, so that every thread of the pool
+ * picks some. There are more chunks than threads so that a thread busy with
+ * a slow chunk doesn't delay the others much: the idle ones take the chunks
+ * left in the queue. The last chunk released frees the dict itself. */
+#define LAZYFREE_SPLIT_MIN_SLOTS (1<<16)
+#define LAZYFREE_CHUNKS_PER_THREAD 4
+
+typedef struct lazyfreeSplit {
+    dict *d;
+    pthread_mutex_t lock;
+    int pending;            /* Chunks not yet released. */
+    int count_entries;      /* If true every released entry is accounted
+                               in lazyfree_objects, otherwise the whole dict
+                               counts as a single object. */
+} lazyfreeSplit;
+
+typedef struct lazyfreeChunk {
+    lazyfreeSplit *split;
+    int table;
+    unsigned long start, end;
+} lazyfreeChunk;
+
+/* Release the dict 'd' from a lazyfree thread, in parallel with the other
+ * lazyfree threads if it is large enough. See lazyfreeSplit for the meaning
+ * of 'count_entries'. */
+static void lazyfreeReleaseDict(dict *d, int count_entries) {
+    unsigned long step[2] = {0,0};
+    int chunks = 0;
+    int per_table = server.lazyfree_threads*LAZYFREE_CHUNKS_PER_THREAD;
+
+    if (server.lazyfree_threads == 1 ||
+        dictSlots(d) < LAZYFREE_SPLIT_MIN_SLOTS)
+    {
+        size_t numkeys = dictSize(d);
+        dictRelease(d);
+        atomicDecr(lazyfree_objects,count_entries ? numkeys : 1);
+        return;
+    }
 
-    server.cluster->slots_to_keys = raxNew();
-    memset(server.cluster->slots_keys_count,0,
-           sizeof(server.cluster->slots_keys_count));
-    atomicIncr(lazyfree_objects,old->numele);
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
+    lazyfreeSplit *split = zmalloc(sizeof(*split));
+    split->d = d;
+    split->count_entries = count_entries;
+    pthread_mutex_init(&split->lock,NULL);
+    for (int table = 0; table < 2; table++) {
+        unsigned long size = d->ht[table].size;
+        if (size == 0) continue;
+        step[table] = (size+per_table-1)/per_table;
+        chunks += (size+step[table]-1)/step[table];
+    }
+    /* All the chunks must be accounted before queueing the first one. */
+    split->pending = chunks;
+    for (int table = 0; table < 2; table++) {
+        if (step[table] == 0) continue;
+        for (unsigned long start = 0; start < d->ht[table].size;
+             start += step[table])
+        {
+            lazyfreeChunk *chunk = zmalloc(sizeof(*chunk));
+            chunk->split = split;
+            chunk->table = table;
+            chunk->start = start;
+            chunk->end = start+step[table];
+            bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,chunk,chunk);
+        }
+    }
+}
+
+/* Release a chunk of a dict split by lazyfreeReleaseDict(). */
+void lazyfreeFreeChunkFromBioThread(lazyfreeChunk *chunk) {
+    lazyfreeSplit *split = chunk->split;
+    unsigned long released;
+    int pending;
+
+    released = dictReleaseSlotRange(split->d,chunk->table,chunk->start,
+                                    chunk->end);
+    if (split->count_entries) atomicDecr(lazyfree_objects,released);
+    zfree(chunk);
+
+    pthread_mutex_lock(&split->lock);
+    pending = --split->pending;
+    pthread_mutex_unlock(&split->lock);
+    if (pending) return;
+
+    dictReleaseEmptied(split->d);
+    if (!split->count_entries) atomicDecr(lazyfree_objects,1);
+    pthread_mutex_destroy(&split->lock);
+    zfree(split);
+}
+
+/* Release an object from a lazyfree thread. Sets and hashes encoded as
+ * large hash tables get their dict released in parallel when there are
+ * multiple lazyfree threads. */
+static void lazyfreeReleaseObject(robj *o) {
+    if (server.lazyfree_threads > 1 && o->encoding == OBJ_ENCODING_HT &&
+        (o->type == OBJ_SET || o->type == OBJ_HASH) &&
+        dictSlots((dict*)o->ptr) >= LAZYFREE_SPLIT_MIN_SLOTS)
+    {
+        dict *d = o->ptr;
+        o->ptr = dictCreate(d->type,NULL);
+        decrRefCount(o);
+        lazyfreeReleaseDict(d,0);
+        return;
+    }
+    decrRefCount(o);
+    atomicDecr(lazyfree_objects,1);
 }
 
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
 void lazyfreeFreeObjectFromBioThread(robj *o) {
-    decrRefCount(o);
-    atomicDecr(lazyfree_objects,1);
+    lazyfreeReleaseObject(o);
+}
+
+/* Release a batch of objects from the lazyfree thread. */
+void lazyfreeFreeBatchFromBioThread(lazyfreeBatch *batch) {
+    for (int j = 0; j < batch->len; j++) lazyfreeReleaseObject(batch->objs[j]);
+    zfree(batch);
 }
 
 /* Release a database from the lazyfree thread. The 'db' pointer is the
  * database which was substitutied with a fresh one in the main thread
- * when the database was logically deleted. 'sl' is a skiplist used by
- * Redis Cluster in order to take the hash slots -> keys mapping. This
- * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
-    atomicDecr(lazyfree_objects,numkeys);
+ * when the database was logically deleted. */
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *expires) {
+    expireIndexRelease(expires);
+    lazyfreeReleaseDict(ht,1);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
-void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
-    size_t len = rt->numele;
+/* Release the keys index of a DB from the lazyfree thread, see
+ * freeKeysIndexAsync(). */
+void lazyfreeFreeKeysIndexFromBioThread(rax *rt) {
+    size_t len = raxSize(rt);
     raxFree(rt);
     atomicDecr(lazyfree_objects,len);
 }
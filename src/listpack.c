@@ -217,6 +217,60 @@ void lpFree(unsigned char *lp) {
     lp_free(lp);
 }
 
+/* Store the integer encoded representation of 'v' in the 'intenc' buffer,
+ * and its length in '*enclen'. Used by lpEncodeGetType() once the element
+ * is known to be an integer. */
+void lpEncodeIntegerGetType(int64_t v, unsigned char *intenc, uint64_t *enclen) {
+    if (v >= 0 && v <= 127) {
+        /* Single byte 0-127 integer. */
+        intenc[0] = v;
+        *enclen = 1;
+    } else if (v >= -4096 && v <= 4095) {
+        /* 13 bit integer. */
+        if (v < 0) v = ((int64_t)1<<13)+v;
+        intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
+        intenc[1] = v&0xff;
+        *enclen = 2;
+    } else if (v >= -32768 && v <= 32767) {
+        /* 16 bit integer. */
+        if (v < 0) v = ((int64_t)1<<16)+v;
+        intenc[0] = LP_ENCODING_16BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = v>>8;
+        *enclen = 3;
+    } else if (v >= -8388608 && v <= 8388607) {
+        /* 24 bit integer. */
+        if (v < 0) v = ((int64_t)1<<24)+v;
+        intenc[0] = LP_ENCODING_24BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = v>>16;
+        *enclen = 4;
+    } else if (v >= -2147483648 && v <= 2147483647) {
+        /* 32 bit integer. */
+        if (v < 0) v = ((int64_t)1<<32)+v;
+        intenc[0] = LP_ENCODING_32BIT_INT;
+        intenc[1] = v&0xff;
+        intenc[2] = (v>>8)&0xff;
+        intenc[3] = (v>>16)&0xff;
+        intenc[4] = v>>24;
+        *enclen = 5;
+    } else {
+        /* 64 bit integer. */
+        uint64_t uv = v;
+        intenc[0] = LP_ENCODING_64BIT_INT;
+        intenc[1] = uv&0xff;
+        intenc[2] = (uv>>8)&0xff;
+        intenc[3] = (uv>>16)&0xff;
+        intenc[4] = (uv>>24)&0xff;
+        intenc[5] = (uv>>32)&0xff;
+        intenc[6] = (uv>>40)&0xff;
+        intenc[7] = (uv>>48)&0xff;
+        intenc[8] = uv>>56;
+        *enclen = 9;
+    }
+}
+
 /* Given an element 'ele' of size 'size', determine if the element can be
  * represented inside the listpack encoded as integer, and returns
  * LP_ENCODING_INT if so. Otherwise returns LP_ENCODING_STR if no integer
@@ -231,54 +285,7 @@ void lpFree(unsigned char *lp) {
 int lpEncodeGetType(unsigned char *ele, uint32_t size, unsigned char *intenc, uint64_t *enclen) {
     int64_t v;
     if (lpStringToInt64((const char*)ele, size, &v)) {
-        if (v >= 0 && v <= 127) {
-            /* Single byte 0-127 integer. */
-            intenc[0] = v;
-            *enclen = 1;
-        } else if (v >= -4096 && v <= 4095) {
-            /* 13 bit integer. */
-            if (v < 0) v = ((int64_t)1<<13)+v;
-            intenc[0] = (v>>8)|LP_ENCODING_13BIT_INT;
-            intenc[1] = v&0xff;
-            *enclen = 2;
-        } else if (v >= -32768 && v <= 32767) {
-            /* 16 bit integer. */
-            if (v < 0) v = ((int64_t)1<<16)+v;
-            intenc[0] = LP_ENCODING_16BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = v>>8;
-            *enclen = 3;
-        } else if (v >= -8388608 && v <= 8388607) {
-            /* 24 bit integer. */
-            if (v < 0) v = ((int64_t)1<<24)+v;
-            intenc[0] = LP_ENCODING_24BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = (v>>8)&0xff;
-            intenc[3] = v>>16;
-            *enclen = 4;
-        } else if (v >= -2147483648 && v <= 2147483647) {
-            /* 32 bit integer. */
-            if (v < 0) v = ((int64_t)1<<32)+v;
-            intenc[0] = LP_ENCODING_32BIT_INT;
-            intenc[1] = v&0xff;
-            intenc[2] = (v>>8)&0xff;
-            intenc[3] = (v>>16)&0xff;
-            intenc[4] = v>>24;
-            *enclen = 5;
-        } else {
-            /* 64 bit integer. */
-            uint64_t uv = v;
-            intenc[0] = LP_ENCODING_64BIT_INT;
-            intenc[1] = uv&0xff;
-            intenc[2] = (uv>>8)&0xff;
-            intenc[3] = (uv>>16)&0xff;
-            intenc[4] = (uv>>24)&0xff;
-            intenc[5] = (uv>>32)&0xff;
-            intenc[6] = (uv>>40)&0xff;
-            intenc[7] = (uv>>48)&0xff;
-            intenc[8] = uv>>56;
-            *enclen = 9;
-        }
+        lpEncodeIntegerGetType(v,intenc,enclen);
         return LP_ENCODING_INT;
     } else {
         if (size < 64) *enclen = 1+size;
@@ -739,6 +746,68 @@ unsigned char *lpAppend(unsigned char *lp, unsigned char *ele, uint32_t size) {
     return lpInsert(lp,ele,size,eofptr,LP_BEFORE,NULL);
 }
 
+/* Return the number of bytes the element 'e' takes once appended to a
+ * listpack, backlen included. */
+uint64_t lpEntryEncodedSize(listpackEntry *e) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    uint64_t enclen;
+
+    if (e->sval)
+        lpEncodeGetType(e->sval,e->slen,intenc,&enclen);
+    else
+        lpEncodeIntegerGetType(e->lval,intenc,&enclen);
+    return enclen+lpEncodeBacklen(NULL,enclen);
+}
+
+/* Append the 'count' elements of the 'entries' array at the end of the
+ * listpack. Elements with a NULL 'sval' are the integer 'lval'. Unlike
+ * calling lpAppend() for each element, the listpack is reallocated once.
+ * Returns NULL if the listpack would exceed the maximum size. */
+unsigned char *lpBatchAppend(unsigned char *lp, listpackEntry *entries, unsigned long count) {
+    unsigned char intenc[LP_MAX_INT_ENCODING_LEN];
+    uint64_t old_listpack_bytes = lpGetTotalBytes(lp);
+    uint64_t new_listpack_bytes = old_listpack_bytes;
+    unsigned long j;
+
+    for (j = 0; j < count; j++)
+        new_listpack_bytes += lpEntryEncodedSize(&entries[j]);
+    if (new_listpack_bytes > UINT32_MAX) return NULL;
+    if ((lp = lp_realloc(lp,new_listpack_bytes)) == NULL) return NULL;
+
+    /* Encode the elements where the EOF byte was, then terminate again. */
+    unsigned char *dst = lp + old_listpack_bytes - 1;
+    for (j = 0; j < count; j++) {
+        listpackEntry *e = &entries[j];
+        uint64_t enclen;
+        int enctype;
+
+        if (e->sval) {
+            enctype = lpEncodeGetType(e->sval,e->slen,intenc,&enclen);
+        } else {
+            lpEncodeIntegerGetType(e->lval,intenc,&enclen);
+            enctype = LP_ENCODING_INT;
+        }
+        if (enctype == LP_ENCODING_INT)
+            memcpy(dst,intenc,enclen);
+        else
+            lpEncodeString(dst,e->sval,e->slen);
+        dst += enclen;
+        dst += lpEncodeBacklen(dst,enclen);
+    }
+    *dst = LP_EOF;
+
+    /* Update header. */
+    uint32_t num_elements = lpGetNumElements(lp);
+    if (num_elements != LP_HDR_NUMELE_UNKNOWN) {
+        if (num_elements+count < LP_HDR_NUMELE_UNKNOWN)
+            lpSetNumElements(lp,num_elements+count);
+        else
+            lpSetNumElements(lp,LP_HDR_NUMELE_UNKNOWN);
+    }
+    lpSetTotalBytes(lp,new_listpack_bytes);
+    return lp;
+}
+
 /* Remove the element pointed by 'p', and return the resulting listpack.
  * If 'newp' is not NULL, the next element pointer (to the right of the
  * deleted one) is returned by reference. If the deleted element was the
@@ -801,3 +870,117 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+/* Prepend the specified element 'ele' of length 'size' at the head of the
+ * listpack. The return value is the same as lpInsert(). */
+unsigned char *lpPrepend(unsigned char *lp, unsigned char *ele, uint32_t size) {
+    unsigned char *p = lpFirst(lp);
+    if (!p) return lpAppend(lp,ele,size);
+    return lpInsert(lp,ele,size,p,LP_BEFORE,NULL);
+}
+
+/* Return the value of the element pointed by 'p'. If the element is a
+ * string, a pointer to its content is returned and its length is stored in
+ * '*slen'. If the element is an integer NULL is returned and the integer is
+ * stored in '*lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    int64_t v;
+    unsigned char *vstr = lpGet(p,&v,NULL);
+
+    if (vstr) *slen = v;
+    else *lval = v;
+    return vstr;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0. Strings that represent integers match the
+ * integer elements with the same value, since lpInsert() stores them as
+ * integers. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    int64_t v, sval;
+    unsigned char *vstr = lpGet(p,&v,NULL);
+
+    if (vstr) return (uint64_t)v == slen && memcmp(vstr,s,slen) == 0;
+    return lpStringToInt64((const char*)s,slen,&sval) && sval == v;
+}
+
+/* Like lpSkip(), with the common small elements handled inline: a 7 bit
+ * integer or a string of up to 63 bytes takes a single byte of backlen. */
+static inline unsigned char *lpSkipFast(unsigned char *p) {
+    if (LP_ENCODING_IS_7BIT_UINT(p[0])) return p+2;
+    if (LP_ENCODING_IS_6BIT_STR(p[0])) return p+2+LP_ENCODING_6BIT_STR_LEN(p);
+    return lpSkip(p);
+}
+
+/* Find the element equal to the string 's' of length 'slen', starting from
+ * the element 'p' and skipping 'skip' elements after every comparison, so
+ * that for instance only the fields of a listpack of field-value pairs are
+ * compared. Returns the element found, or NULL.
+ *
+ * This is the lookup of the small hashes and sorted sets, so the scan
+ * avoids decoding the elements: the short strings, like most fields, are
+ * filtered by their first byte, that encodes both the type and the length,
+ * and then by their first character, and the skipped elements are just
+ * stepped over. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned int skipcnt = 0;
+    int sisint = -1; /* -1: not checked yet, 0: not an integer, 1: integer.*/
+    int64_t sval = 0;
+    unsigned char hdr = slen < 64 ? LP_ENCODING_6BIT_STR|slen : 0;
+    ((void) lp);
+
+    if (p == NULL) return NULL;
+    while (p[0] != LP_EOF) {
+        if (skipcnt == 0) {
+            if (LP_ENCODING_IS_6BIT_STR(p[0])) {
+                if (p[0] == hdr && (slen == 0 ||
+                    (p[1] == s[0] && memcmp(p+1,s,slen) == 0))) return p;
+            } else if (LP_ENCODING_IS_7BIT_UINT(p[0])) {
+                if (sisint == -1)
+                    sisint = lpStringToInt64((const char*)s,slen,&sval);
+                if (sisint && sval == p[0]) return p;
+            } else {
+                int64_t v;
+                unsigned char *vstr = lpGet(p,&v,NULL);
+
+                if (vstr) {
+                    if ((uint64_t)v == slen && memcmp(vstr,s,slen) == 0)
+                        return p;
+                } else {
+                    /* Convert the string at most once, and only if there
+                     * are integer elements to compare with. */
+                    if (sisint == -1)
+                        sisint = lpStringToInt64((const char*)s,slen,&sval);
+                    if (sisint && sval == v) return p;
+                }
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        p = lpSkipFast(p);
+    }
+    return NULL;
+}
+
+/* Delete 'num' elements starting at the element with the specified
+ * zero-based 'index' (negative indexes count from the tail). The elements
+ * are removed with a single memmove() and reallocation. Returns the new
+ * listpack pointer. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *tail;
+    uint32_t bytes = lpGetTotalBytes(lp), numele = lpGetNumElements(lp);
+    unsigned long deleted = 0;
+
+    if (num == 0 || (first = lpSeek(lp,index)) == NULL) return lp;
+    tail = first;
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+    /* Move the remaining elements and the EOF byte. */
+    memmove(first,tail,lp+bytes-tail);
+    bytes -= tail-first;
+    lpSetTotalBytes(lp,bytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN) lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,bytes);
+}
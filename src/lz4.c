@@ -0,0 +1,292 @@
+/* LZ4 block format compression.
+ *
+ * Compressed data is a sequence of tokens, every one made of a run of
+ * literals followed by a match: a back reference to data already produced,
+ * at a distance of at most 64k. The first byte of a token stores the length
+ * of the literals in the 4 high bits and the length of the match, minus 4,
+ * in the 4 low bits. A length of 15 means that more length bytes follow,
+ * each added to the length, until a byte different from 255. Then the
+ * literals follow, and the 2 bytes little endian match distance. The last
+ * token only has literals, and the format requires the last 5 bytes to be
+ * literals, and the last match to start at least 12 bytes before the end.
+ *
+ * The compressor is the simple greedy one: the positions of the 4 bytes
+ * sequences are remembered in an hash table, and the first match found is
+ * used. It compresses a bit less than LZF but it is faster, especially in
+ * decompression, since literals and matches are copied in bulk.
+ *
+ * Copyright (c) 2020, Redis Labs, Inc
+ * All rights reserved.
+ *
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+#include "config.h"
+
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5      /* Last bytes that are always literals. */
+#define LZ4_MFLIMIT 12          /* Last match can't start after end-12. */
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 13
+#define LZ4_RUN_MASK 15
+#define LZ4_SKIP_TRIGGER 6      /* Search faster in incompressible data. */
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4Hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32-LZ4_HASH_LOG);
+}
+
+/* Return the number of bytes equal at 'p' and 'ref', stopping at 'limit'. */
+static inline unsigned int lz4MatchLength(const unsigned char *p,
+                                          const unsigned char *ref,
+                                          const unsigned char *limit)
+{
+    const unsigned char *start = p;
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    while (p+sizeof(uint64_t) <= limit) {
+        uint64_t a, b;
+        memcpy(&a,p,sizeof(a));
+        memcpy(&b,ref,sizeof(b));
+        if (a != b) return p-start+(__builtin_ctzll(a^b)>>3);
+        p += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+#endif
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p-start;
+}
+
+/* Write a length exceeding the 4 bits of the token. */
+static inline unsigned char *lz4WriteLength(unsigned char *op,
+                                            unsigned int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Compress 'in_len' bytes at 'in_data', that are preceded by 'dict_len'
+ * bytes of dictionary the matches can refer to. Without a dictionary the
+ * function is inlined with the positions of the input starting at zero, as
+ * in the original code. */
+static inline unsigned int lz4CompressGeneric(const unsigned char *in,
+    unsigned int in_len, unsigned int dict_len, void *out_data,
+    unsigned int out_len)
+{
+    const unsigned char *base = in-dict_len;
+    const unsigned char *ip = in, *anchor = in;
+    const unsigned char *iend = in+in_len;
+    unsigned char *op = out_data, *oend = op+out_len;
+    uint32_t htab[1<<LZ4_HASH_LOG];
+
+    if (in_len > LZ4_MFLIMIT) {
+        const unsigned char *mflimit = iend-LZ4_MFLIMIT;
+        const unsigned char *matchlimit = iend-LZ4_LASTLITERALS;
+
+        memset(htab,0,sizeof(htab));
+        if (dict_len == 0) {
+            ip++; /* The first byte can't be a match. */
+        } else {
+            /* Index the dictionary, a position every 2 bytes is enough to
+             * find most of the matches with half of the work. */
+            const unsigned char *p = in > base+LZ4_MAX_DISTANCE ?
+                                     in-LZ4_MAX_DISTANCE : base;
+            for (; p+sizeof(uint32_t) <= in; p += 2)
+                htab[lz4Hash(lz4Read32(p))] = p-base;
+        }
+        unsigned int searches = 1 << LZ4_SKIP_TRIGGER;
+
+        while (ip < mflimit) {
+            uint32_t seq = lz4Read32(ip);
+            uint32_t h = lz4Hash(seq);
+            const unsigned char *ref = base+htab[h];
+
+            htab[h] = ip-base;
+            if (ref >= ip || ip-ref > LZ4_MAX_DISTANCE ||
+                lz4Read32(ref) != seq)
+            {
+                ip += searches++ >> LZ4_SKIP_TRIGGER;
+                continue;
+            }
+            searches = 1 << LZ4_SKIP_TRIGGER;
+
+            /* Extend the match backward, into the pending literals. */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            unsigned int litlen = ip-anchor;
+            unsigned int matchlen = lz4MatchLength(ip+LZ4_MINMATCH,
+                ref+LZ4_MINMATCH,matchlimit);
+
+            /* Token, literals, distance and the lengths bytes. */
+            if ((size_t)(oend-op) <
+                1+litlen+litlen/255+1+2+matchlen/255+1) return 0;
+
+            unsigned char *token = op++;
+            if (litlen >= LZ4_RUN_MASK) {
+                *token = LZ4_RUN_MASK << 4;
+                op = lz4WriteLength(op,litlen-LZ4_RUN_MASK);
+            } else {
+                *token = litlen << 4;
+            }
+            memcpy(op,anchor,litlen);
+            op += litlen;
+
+            unsigned int distance = ip-ref;
+            *op++ = distance & 0xff;
+            *op++ = distance >> 8;
+            if (matchlen >= LZ4_RUN_MASK) {
+                *token |= LZ4_RUN_MASK;
+                op = lz4WriteLength(op,matchlen-LZ4_RUN_MASK);
+            } else {
+                *token |= matchlen;
+            }
+
+            ip += LZ4_MINMATCH+matchlen;
+            anchor = ip;
+
+            /* Remember a position inside the match, so that repeated
+             * patterns are found again quickly. */
+            if (ip < mflimit)
+                htab[lz4Hash(lz4Read32(ip-2))] = ip-2-base;
+        }
+    }
+
+    /* Last literals. */
+    unsigned int litlen = iend-anchor;
+    if ((size_t)(oend-op) < 1+litlen+litlen/255+1) return 0;
+    if (litlen >= LZ4_RUN_MASK) {
+        *op++ = LZ4_RUN_MASK << 4;
+        op = lz4WriteLength(op,litlen-LZ4_RUN_MASK);
+    } else {
+        *op++ = litlen << 4;
+    }
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    return op-(unsigned char*)out_data;
+}
+
+unsigned int lz4_compress(const void *const in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len)
+{
+    return lz4CompressGeneric(in_data,in_len,0,out_data,out_len);
+}
+
+unsigned int lz4_compress_dict(const void *const in_data, unsigned int in_len,
+                               unsigned int dict_len, void *out_data,
+                               unsigned int out_len)
+{
+    return lz4CompressGeneric(in_data,in_len,dict_len,out_data,out_len);
+}
+
+/* Read a length exceeding the 4 bits of the token. Returns 0 if the input
+ * ends before the length. */
+static inline int lz4ReadLength(const unsigned char **ipptr,
+                                const unsigned char *iend, size_t *len)
+{
+    const unsigned char *ip = *ipptr;
+    unsigned char byte;
+
+    do {
+        if (ip == iend) return 0;
+        byte = *ip++;
+        *len += byte;
+    } while (byte == 255);
+    *ipptr = ip;
+    return 1;
+}
+
+/* Decompress into 'out_data', that is preceded by 'dict_len' bytes of
+ * dictionary the matches can refer to. */
+static inline unsigned int lz4DecompressGeneric(const void *const in_data,
+    unsigned int in_len, unsigned int dict_len, void *out_data,
+    unsigned int out_len)
+{
+    const unsigned char *ip = in_data, *iend = ip+in_len;
+    unsigned char *out = out_data, *op = out, *oend = op+out_len;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t litlen = token >> 4, matchlen = token & LZ4_RUN_MASK;
+
+        if (litlen == LZ4_RUN_MASK && !lz4ReadLength(&ip,iend,&litlen))
+            return 0;
+        if (litlen > (size_t)(iend-ip) || litlen > (size_t)(oend-op))
+            return 0;
+        memcpy(op,ip,litlen);
+        op += litlen;
+        ip += litlen;
+        if (ip == iend) break; /* The last token has no match. */
+
+        if (iend-ip < 2) return 0;
+        size_t distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (distance == 0 || distance > (size_t)(op-out)+dict_len) return 0;
+        if (matchlen == LZ4_RUN_MASK && !lz4ReadLength(&ip,iend,&matchlen))
+            return 0;
+        matchlen += LZ4_MINMATCH;
+        if (matchlen > (size_t)(oend-op)) return 0;
+
+        const unsigned char *ref = op-distance;
+        if (distance >= matchlen) {
+            memcpy(op,ref,matchlen);
+            op += matchlen;
+        } else {
+            /* Overlapping copy, repeating the last 'distance' bytes. */
+            while (matchlen--) *op++ = *ref++;
+        }
+    }
+    return op-out;
+}
+
+unsigned int lz4_decompress(const void *const in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len)
+{
+    return lz4DecompressGeneric(in_data,in_len,0,out_data,out_len);
+}
+
+unsigned int lz4_decompress_dict(const void *const in_data,
+                                 unsigned int in_len, unsigned int dict_len,
+                                 void *out_data, unsigned int out_len)
+{
+    return lz4DecompressGeneric(in_data,in_len,dict_len,out_data,out_len);
+}
@@ -0,0 +1,59 @@
+/* LZ4 block format compression.
+ *
+ * Copyright (c) 2020, Redis Labs, Inc
+ * All rights reserved.
+ *
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+/* Compress 'in_len' bytes at 'in_data' in the LZ4 block format, writing at
+ * most 'out_len' bytes at 'out_data'. Returns the compressed length, or 0
+ * if the output doesn't fit in 'out_len' bytes. */
+unsigned int lz4_compress(const void *const in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len);
+
+/* Decompress the LZ4 block of 'in_len' bytes at 'in_data' into 'out_data',
+ * that has room for 'out_len' bytes. Returns the decompressed length, or
+ * 0 if the input is corrupted or the output doesn't fit. */
+unsigned int lz4_decompress(const void *const in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len);
+
+/* Like lz4_compress() and lz4_decompress(), but the 'dict_len' bytes just
+ * before 'in_data' (when compressing) or 'out_data' (when decompressing)
+ * are a dictionary: the same dictionary must precede the input and the
+ * output, that is, the data is compressed as the continuation of the
+ * dictionary. Only the last 64k of the dictionary are used. */
+unsigned int lz4_compress_dict(const void *const in_data, unsigned int in_len,
+                               unsigned int dict_len, void *out_data,
+                               unsigned int out_len);
+unsigned int lz4_decompress_dict(const void *const in_data,
+                                 unsigned int in_len, unsigned int dict_len,
+                                 void *out_data, unsigned int out_len);
+
+#endif
@@ -0,0 +1,391 @@
+/* Background memory analysis of the keyspace, see MEMORY ANALYZE.
+ *
+ * The keyspace is walked incrementally with dictScan(), in short time
+ * slices of the event loop, measuring every key like MEMORY USAGE does.
+ * The memory is grouped by key prefix and type, and the biggest keys are
+ * remembered, so that finding which key patterns use memory no longer needs
+ * a MEMORY USAGE round trip per key.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#define MEMANALYSIS_PERIOD_MS 10    /* Time left to clients between slices.*/
+#define MEMANALYSIS_SLICE_US 1000   /* Max duration of a slice. */
+#define MEMANALYSIS_DEF_SEPARATOR ":"
+#define MEMANALYSIS_DEF_TOP 10      /* Biggest keys remembered by default. */
+#define MEMANALYSIS_MAX_TOP 1000
+#define MEMANALYSIS_MAX_GROUPS 10000 /* Prefixes tracked, then 'other'. */
+#define MEMANALYSIS_DEF_COUNT 10    /* Prefixes returned by default. */
+
+/* Memory used by the keys having the same prefix and type. */
+typedef struct memAnalysisGroup {
+    sds prefix;
+    const char *type;
+    unsigned long long keys;
+    unsigned long long bytes;
+} memAnalysisGroup;
+
+/* One of the biggest keys. */
+typedef struct memAnalysisKey {
+    sds key;
+    int dbid;
+    const char *type;
+    size_t bytes;
+} memAnalysisKey;
+
+static struct memAnalysis {
+    int running;                /* Scan in progress. */
+    long long timer_id;         /* Time event of the scan in progress. */
+    sds separator;              /* Chars ending the prefix of a key. */
+    long long samples;          /* Samples of nested values per key. */
+    int top;                    /* Number of biggest keys to remember. */
+    int dbid;                   /* DB being scanned. */
+    unsigned long cursor;       /* dictScan() cursor inside the DB. */
+    mstime_t start_time;        /* When the analysis started. */
+    mstime_t end_time;          /* When the analysis completed, or -1. */
+    unsigned long long keys;    /* Keys measured so far. */
+    unsigned long long bytes;   /* Memory used by such keys. */
+    unsigned long long other_keys;  /* Keys not in 'groups', too many... */
+    unsigned long long other_bytes; /* ... prefixes were already seen. */
+    dict *groups;               /* type + prefix -> memAnalysisGroup. */
+    memAnalysisKey *topkeys;    /* Biggest keys, from the biggest. */
+    int numtop;                 /* Number of keys in 'topkeys'. */
+} ma;
+
+static void memAnalysisGroupDestructor(void *privdata, void *val) {
+    memAnalysisGroup *g = val;
+    UNUSED(privdata);
+
+    sdsfree(g->prefix);
+    zfree(g);
+}
+
+/* Group lookup table: the keys are the type names followed by the prefixes,
+ * the values the groups. */
+static dictType memAnalysisGroupsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    memAnalysisGroupDestructor  /* val destructor */
+};
+
+/* Release the results of the last analysis. */
+static void memAnalysisReset(void) {
+    if (ma.groups) dictRelease(ma.groups);
+    for (int j = 0; j < ma.numtop; j++) sdsfree(ma.topkeys[j].key);
+    zfree(ma.topkeys);
+    sdsfree(ma.separator);
+    memset(&ma,0,sizeof(ma));
+    ma.timer_id = -1;
+}
+
+/* Return the length of the prefix of 'key', up to the first separator
+ * included, or zero if the key has no separator. */
+static size_t memAnalysisPrefixLen(sds key) {
+    size_t len = sdslen(key), seplen = sdslen(ma.separator);
+
+    for (size_t j = 0; j < len; j++) {
+        if (memchr(ma.separator,key[j],seplen)) return j+1;
+    }
+    return 0;
+}
+
+/* Account 'bytes' to the group of 'key'. */
+static void memAnalysisAddToGroup(sds key, const char *type, size_t bytes) {
+    size_t prefixlen = memAnalysisPrefixLen(key);
+    sds groupkey = sdscatlen(sdsnew(type),"\0",1);
+    memAnalysisGroup *g;
+    dictEntry *de;
+
+    groupkey = sdscatlen(groupkey,key,prefixlen);
+    if ((de = dictFind(ma.groups,groupkey)) != NULL) {
+        g = dictGetVal(de);
+        sdsfree(groupkey);
+    } else if (dictSize(ma.groups) < MEMANALYSIS_MAX_GROUPS) {
+        g = zmalloc(sizeof(*g));
+        g->prefix = sdsnewlen(key,prefixlen);
+        g->type = type;
+        g->keys = g->bytes = 0;
+        dictAdd(ma.groups,groupkey,g);
+    } else {
+        ma.other_keys++;
+        ma.other_bytes += bytes;
+        sdsfree(groupkey);
+        return;
+    }
+    g->keys++;
+    g->bytes += bytes;
+}
+
+/* Remember 'key' if it is one of the biggest keys seen so far. */
+static void memAnalysisAddToTop(sds key, int dbid, const char *type,
+                                size_t bytes)
+{
+    int pos = ma.numtop;
+
+    if (ma.top == 0) return;
+    if (ma.numtop == ma.top) {
+        if (ma.topkeys[ma.numtop-1].bytes >= bytes) return;
+        sdsfree(ma.topkeys[--ma.numtop].key);
+        pos = ma.numtop;
+    }
+    /* Insertion sort: the array is small and rarely updated. */
+    while (pos > 0 && ma.topkeys[pos-1].bytes < bytes) {
+        ma.topkeys[pos] = ma.topkeys[pos-1];
+        pos--;
+    }
+    ma.topkeys[pos].key = sdsdup(key);
+    ma.topkeys[pos].dbid = dbid;
+    ma.topkeys[pos].type = type;
+    ma.topkeys[pos].bytes = bytes;
+    ma.numtop++;
+}
+
+/* dictScan() callback: measure a key like MEMORY USAGE does. */
+static void memAnalysisScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    sds key = dictGetKey(de);
+    robj *val = dictGetVal(de);
+    const char *type = getObjectTypeName(val);
+    size_t bytes;
+
+    bytes = objectComputeSize(val,ma.samples);
+    bytes += sdsAllocSize(key);
+    bytes += sizeof(dictEntry);
+    ma.keys++;
+    ma.bytes += bytes;
+    memAnalysisAddToGroup(key,type,bytes);
+    memAnalysisAddToTop(key,db->id,type,bytes);
+}
+
+/* Scan the keyspace till 'endtime' (in microseconds), returning 1 once all
+ * the DBs were scanned, otherwise 0. */
+static int memAnalysisStep(long long endtime) {
+    long iterations = 0;
+
+    while (ma.dbid < server.dbnum) {
+        redisDb *db = server.db+ma.dbid;
+
+        ma.cursor = dictScan(db->dict,ma.cursor,memAnalysisScanCallback,
+                             NULL,db);
+        if (ma.cursor == 0) ma.dbid++;
+        /* Check the time every few buckets. */
+        if ((++iterations & 15) == 0 && ustime() > endtime) break;
+    }
+    return ma.dbid == server.dbnum;
+}
+
+static int memAnalysisTimeProc(struct aeEventLoop *eventLoop, long long id,
+                               void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (!memAnalysisStep(ustime()+MEMANALYSIS_SLICE_US))
+        return MEMANALYSIS_PERIOD_MS;
+
+    ma.running = 0;
+    ma.timer_id = -1;
+    ma.end_time = mstime();
+    serverLog(LL_NOTICE,
+        "Memory analysis completed: %llu keys using %llu bytes "
+        "in %lld milliseconds", ma.keys, ma.bytes,
+        (long long)(ma.end_time-ma.start_time));
+    return AE_NOMORE;
+}
+
+/* Stop the analysis in progress, keeping the partial results. */
+static void memAnalysisStop(void) {
+    if (!ma.running) return;
+    aeDeleteTimeEvent(server.el,ma.timer_id);
+    ma.running = 0;
+    ma.timer_id = -1;
+    ma.end_time = mstime();
+}
+
+static int memAnalysisGroupCompare(const void *a, const void *b) {
+    const memAnalysisGroup *ga = *(memAnalysisGroup**)a;
+    const memAnalysisGroup *gb = *(memAnalysisGroup**)b;
+
+    if (ga->bytes != gb->bytes) return ga->bytes > gb->bytes ? -1 : 1;
+    return sdscmp(ga->prefix,gb->prefix);
+}
+
+static void addReplyMemAnalysisStatus(client *c) {
+    mstime_t end = ma.running ? mstime() : ma.end_time;
+
+    addReplyBulkCString(c,"running");
+    addReplyLongLong(c,ma.running);
+    addReplyBulkCString(c,"elapsed-ms");
+    addReplyLongLong(c,ma.start_time ? end-ma.start_time : 0);
+    addReplyBulkCString(c,"keys");
+    addReplyLongLong(c,ma.keys);
+    addReplyBulkCString(c,"bytes");
+    addReplyLongLong(c,ma.bytes);
+}
+
+/* MEMORY ANALYZE START [SEPARATOR <chars>] [SAMPLES <count>] [TOP <count>]
+ * MEMORY ANALYZE STOP
+ * MEMORY ANALYZE STATUS
+ * MEMORY ANALYZE RESULT [COUNT <count>] */
+void memoryAnalyzeCommand(client *c) {
+    char *subcmd = c->argc > 2 ? c->argv[2]->ptr : "";
+    int j;
+
+    if (!strcasecmp(subcmd,"start")) {
+        char *separator = MEMANALYSIS_DEF_SEPARATOR;
+        long long samples = OBJ_COMPUTE_SIZE_DEF_SAMPLES;
+        long long top = MEMANALYSIS_DEF_TOP;
+
+        if (ma.running) {
+            addReplyError(c,"A memory analysis is already in progress");
+            return;
+        }
+        for (j = 3; j < c->argc; j++) {
+            char *opt = c->argv[j]->ptr;
+            if (!strcasecmp(opt,"separator") && j+1 < c->argc) {
+                separator = c->argv[++j]->ptr;
+                if (separator[0] == '\0') {
+                    addReplyError(c,"The separator can't be empty");
+                    return;
+                }
+            } else if (!strcasecmp(opt,"samples") && j+1 < c->argc) {
+                if (getLongLongFromObjectOrReply(c,c->argv[++j],&samples,NULL)
+                    != C_OK) return;
+                if (samples < 0) {
+                    addReply(c,shared.syntaxerr);
+                    return;
+                }
+                if (samples == 0) samples = LLONG_MAX;
+            } else if (!strcasecmp(opt,"top") && j+1 < c->argc) {
+                if (getLongLongFromObjectOrReply(c,c->argv[++j],&top,NULL)
+                    != C_OK) return;
+                if (top < 0 || top > MEMANALYSIS_MAX_TOP) {
+                    addReplyErrorFormat(c,"TOP must be between 0 and %d",
+                                        MEMANALYSIS_MAX_TOP);
+                    return;
+                }
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+
+        memAnalysisReset();
+        ma.separator = sdsnew(separator);
+        ma.samples = samples;
+        ma.top = top;
+        ma.topkeys = zmalloc(sizeof(memAnalysisKey)*(top ? top : 1));
+        ma.groups = dictCreate(&memAnalysisGroupsDictType,NULL);
+        ma.start_time = mstime();
+        ma.end_time = -1;
+        ma.timer_id = aeCreateTimeEvent(server.el,MEMANALYSIS_PERIOD_MS,
+                                        memAnalysisTimeProc,NULL,NULL);
+        ma.running = 1;
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(subcmd,"stop") && c->argc == 3) {
+        memAnalysisStop();
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(subcmd,"status") && c->argc == 3) {
+        addReplyMapLen(c,4);
+        addReplyMemAnalysisStatus(c);
+    } else if (!strcasecmp(subcmd,"result") &&
+               (c->argc == 3 || c->argc == 5))
+    {
+        long long count = MEMANALYSIS_DEF_COUNT;
+        memAnalysisGroup **groups;
+        unsigned long numgroups = 0;
+
+        if (c->argc == 5) {
+            if (strcasecmp(c->argv[3]->ptr,"count")) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            if (getLongLongFromObjectOrReply(c,c->argv[4],&count,NULL)
+                != C_OK) return;
+            if (count <= 0) {
+                addReplyError(c,"The count must be positive");
+                return;
+            }
+        }
+        if (ma.groups == NULL) {
+            addReplyError(c,"No memory analysis was started");
+            return;
+        }
+
+        groups = zmalloc(sizeof(*groups)*(dictSize(ma.groups)+1));
+        dictIterator *di = dictGetIterator(ma.groups);
+        dictEntry *de;
+        while((de = dictNext(di)) != NULL) groups[numgroups++] = dictGetVal(de);
+        dictReleaseIterator(di);
+        qsort(groups,numgroups,sizeof(*groups),memAnalysisGroupCompare);
+        if ((unsigned long long)count > numgroups) count = numgroups;
+
+        addReplyMapLen(c,8);
+        addReplyMemAnalysisStatus(c);
+        addReplyBulkCString(c,"prefixes");
+        addReplyArrayLen(c,count);
+        for (j = 0; j < count; j++) {
+            addReplyMapLen(c,4);
+            addReplyBulkCString(c,"prefix");
+            addReplyBulkCBuffer(c,groups[j]->prefix,sdslen(groups[j]->prefix));
+            addReplyBulkCString(c,"type");
+            addReplyBulkCString(c,groups[j]->type);
+            addReplyBulkCString(c,"keys");
+            addReplyLongLong(c,groups[j]->keys);
+            addReplyBulkCString(c,"bytes");
+            addReplyLongLong(c,groups[j]->bytes);
+        }
+        zfree(groups);
+        addReplyBulkCString(c,"other-keys");
+        addReplyLongLong(c,ma.other_keys);
+        addReplyBulkCString(c,"other-bytes");
+        addReplyLongLong(c,ma.other_bytes);
+        addReplyBulkCString(c,"top-keys");
+        addReplyArrayLen(c,ma.numtop);
+        for (j = 0; j < ma.numtop; j++) {
+            memAnalysisKey *k = ma.topkeys+j;
+            addReplyMapLen(c,4);
+            addReplyBulkCString(c,"db");
+            addReplyLongLong(c,k->dbid);
+            addReplyBulkCString(c,"key");
+            addReplyBulkCBuffer(c,k->key,sdslen(k->key));
+            addReplyBulkCString(c,"type");
+            addReplyBulkCString(c,k->type);
+            addReplyBulkCString(c,"bytes");
+            addReplyLongLong(c,k->bytes);
+        }
+    } else {
+        addReplySubcommandSyntaxError(c);
+    }
+}
@@ -0,0 +1,591 @@
+/* Micro benchmarks of the core data structures.
+ *
+ * Running "redis-server microbench [name ...]", or "make benchmark", times
+ * a fixed set of operations on the data structures the server is built on
+ * (dict, ziplist, listpack, quicklist, intset, skiplist, sds), on the
+ * hash functions of the dict, on CRC64 and on the RESP request parser, and
+ * outputs the results as CSV, one line per benchmark, so that they can be
+ * compared across releases. Only the benchmarks whose name starts with one
+ * of the given names are run.
+ *
+ * Every benchmark uses the same pseudo random sequence at every run, and is
+ * repeated MICROBENCH_RUNS times, reporting the median run, so that the
+ * results are reproducible on the same machine.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "rand.h"
+#include <time.h>
+
+#define MICROBENCH_RUNS 5
+
+/* Only the time between microbenchStart() and microbenchStop() is
+ * accounted, so that every benchmark can prepare its data and release it
+ * without affecting the result. */
+static long long microbench_start, microbench_elapsed;
+
+static long long microbenchTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static void microbenchStart(void) {
+    microbench_start = microbenchTime();
+}
+
+static void microbenchStop(void) {
+    microbench_elapsed += microbenchTime()-microbench_start;
+}
+
+/* Return an array of 'n' distinct keys "key:<number>", in random order. */
+static sds *microbenchKeys(long n) {
+    sds *keys = zmalloc(sizeof(sds)*n);
+    for (long j = 0; j < n; j++)
+        keys[j] = sdscatfmt(sdsempty(),"key:%I",(long long)j);
+    for (long j = n-1; j > 0; j--) {
+        long k = redisLrand48()%(j+1);
+        sds tmp = keys[j];
+        keys[j] = keys[k];
+        keys[k] = tmp;
+    }
+    return keys;
+}
+
+static void microbenchFreeKeys(sds *keys, long n) {
+    for (long j = 0; j < n; j++) sdsfree(keys[j]);
+    zfree(keys);
+}
+
+/* Return a dict of the 'n' keys, that are owned by the dict. */
+static dict *microbenchDict(sds *keys, long n) {
+    dict *d = dictCreate(&setDictType,NULL);
+    for (long j = 0; j < n; j++) dictAdd(d,keys[j],NULL);
+    return d;
+}
+
+static void benchDictAdd(long n) {
+    sds *keys = microbenchKeys(n);
+    dict *d = dictCreate(&setDictType,NULL);
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) dictAdd(d,keys[j],NULL);
+    microbenchStop();
+    dictRelease(d);
+    zfree(keys);
+}
+
+static void benchDictFind(long n) {
+    sds *keys = microbenchKeys(n);
+    dict *d = microbenchDict(keys,n);
+    long found = 0;
+
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        found += dictFind(d,keys[redisLrand48()%n]) != NULL;
+    microbenchStop();
+    serverAssert(found == n);
+    dictRelease(d);
+    zfree(keys);
+}
+
+static void benchDictFindMiss(long n) {
+    sds *keys = microbenchKeys(n), *missing = microbenchKeys(n);
+    dict *d = microbenchDict(keys,n);
+    long found = 0;
+
+    for (long j = 0; j < n; j++) missing[j][0] = 'K';
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        found += dictFind(d,missing[j]) != NULL;
+    microbenchStop();
+    serverAssert(found == 0);
+    dictRelease(d);
+    zfree(keys);
+    microbenchFreeKeys(missing,n);
+}
+
+/* Return an array of 'n' distinct keys with the mix of lengths usually
+ * found in a keyspace: mostly short keys like "key:<number>", then keys
+ * with a longer prefix, and a few long ones embedding some identifier. */
+static sds *microbenchMixedKeys(long n) {
+    sds *keys = microbenchKeys(n);
+    for (long j = 0; j < n; j++) {
+        long kind = redisLrand48()%10;
+        if (kind >= 6 && kind < 9) {
+            keys[j] = sdscatfmt(keys[j],":session:%I",
+                                (long long)redisLrand48());
+        } else if (kind == 9) {
+            keys[j] = sdscat(keys[j],":object:");
+            while (sdslen(keys[j]) < 48)
+                keys[j] = sdscatfmt(keys[j],"%I",(long long)redisLrand48());
+        }
+    }
+    return keys;
+}
+
+/* Hash 'n' keys with the given dictionary hash function. Nothing is timed
+ * if the CPU does not support it. */
+static void microbenchHash(long n, int type) {
+    sds *keys = microbenchMixedKeys(n);
+    uint64_t sum = 0;
+    int orig = dictGetHashFunction();
+
+    if (dictSetHashFunction(type) == DICT_OK) {
+        microbenchStart();
+        for (long j = 0; j < n; j++)
+            sum += dictGenHashFunction(keys[j],sdslen(keys[j]));
+        microbenchStop();
+    }
+    dictSetHashFunction(orig);
+    serverAssert(sum != 1); /* Don't let the compiler drop the loop. */
+    microbenchFreeKeys(keys,n);
+}
+
+static void benchHashSiphash(long n) {
+    microbenchHash(n,DICT_HASH_SIPHASH);
+}
+
+static void benchHashAes(long n) {
+    microbenchHash(n,DICT_HASH_AES);
+}
+
+/* Like benchDictFind() with the mixed keys and the given hash function. */
+static void microbenchDictFindHash(long n, int type) {
+    int orig = dictGetHashFunction();
+    if (dictSetHashFunction(type) == DICT_ERR) return;
+
+    sds *keys = microbenchMixedKeys(n);
+    dict *d = microbenchDict(keys,n);
+    long found = 0;
+
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        found += dictFind(d,keys[redisLrand48()%n]) != NULL;
+    microbenchStop();
+    serverAssert(found == n);
+    dictRelease(d);
+    zfree(keys);
+    dictSetHashFunction(orig);
+}
+
+static void benchDictFindSiphash(long n) {
+    microbenchDictFindHash(n,DICT_HASH_SIPHASH);
+}
+
+static void benchDictFindAes(long n) {
+    microbenchDictFindHash(n,DICT_HASH_AES);
+}
+
+/* Time the incremental rehashing of 'n' entries to a table twice as big. */
+static void benchDictRehash(long n) {
+    sds *keys = microbenchKeys(n);
+    dict *d = microbenchDict(keys,n);
+
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    dictExpand(d,dictSlots(d)*2);
+    microbenchStart();
+    while (dictRehash(d,100));
+    microbenchStop();
+    dictRelease(d);
+    zfree(keys);
+}
+
+/* Look up 'n' random elements of a rax of 'n' elements, 'len' bytes each,
+ * where 'elements' are stored one after the other. */
+static void microbenchRaxFind(unsigned char *elements, size_t len, long n) {
+    rax *r = raxNew();
+    long found = 0;
+
+    for (long j = 0; j < n; j++) raxInsert(r,elements+j*len,len,NULL,NULL);
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        unsigned char *e = elements+(redisLrand48()%n)*len;
+        found += raxFind(r,e,len) != raxNotFound;
+    }
+    microbenchStop();
+    serverAssert(found == n);
+    raxFree(r);
+    zfree(elements);
+}
+
+/* Stream IDs, big endian milliseconds and sequence, of entries added a few
+ * per millisecond. */
+static void benchRaxFindStreamID(long n) {
+    unsigned char *ids = zmalloc(n*sizeof(streamID));
+    streamID id = {1600000000000ULL, 0};
+
+    for (long j = 0; j < n; j++) {
+        if (redisLrand48()%4 == 0) {
+            id.ms++;
+            id.seq = 0;
+        } else {
+            id.seq++;
+        }
+        streamEncodeID(ids+j*sizeof(streamID),&id);
+    }
+    microbenchRaxFind(ids,sizeof(streamID),n);
+}
+
+/* Key names, as in the keys index of the cluster: the two bytes of the
+ * slot followed by the key. */
+static void benchRaxFindSlotKeys(long n) {
+    sds *keys = microbenchKeys(n);
+    size_t len = 2+16;
+    unsigned char *elements = zcalloc(n*len);
+
+    for (long j = 0; j < n; j++) {
+        unsigned int slot = keyHashSlot(keys[j],sdslen(keys[j]));
+        unsigned char *e = elements+j*len;
+        e[0] = slot >> 8;
+        e[1] = slot & 0xff;
+        memcpy(e+2,keys[j],sdslen(keys[j]));
+    }
+    microbenchFreeKeys(keys,n);
+    microbenchRaxFind(elements,len,n);
+}
+
+/* Push small strings and integers to ziplists of 128 entries, as the
+ * ones of small lists, hashes and sorted sets. */
+static void benchZiplistPush(long n) {
+    unsigned char *zl = ziplistNew();
+    char buf[32];
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        int len = (j & 1) ? snprintf(buf,sizeof(buf),"%ld",j) :
+                            snprintf(buf,sizeof(buf),"value:%ld",j);
+        zl = ziplistPush(zl,(unsigned char*)buf,len,ZIPLIST_TAIL);
+        if (j % 128 == 127) {
+            zfree(zl);
+            zl = ziplistNew();
+        }
+    }
+    microbenchStop();
+    zfree(zl);
+}
+
+static void benchListpackAppend(long n) {
+    unsigned char *lp = lpNew();
+    char buf[32];
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        int len = (j & 1) ? snprintf(buf,sizeof(buf),"%ld",j) :
+                            snprintf(buf,sizeof(buf),"value:%ld",j);
+        lp = lpAppend(lp,(unsigned char*)buf,len);
+        if (j % 128 == 127) {
+            lpFree(lp);
+            lp = lpNew();
+        }
+    }
+    microbenchStop();
+    lpFree(lp);
+}
+
+/* Return a quicklist of 'n' entries, with the default list options. */
+static quicklist *microbenchQuicklist(long n) {
+    quicklist *ql = quicklistNew(-2,0);
+    char buf[32];
+
+    for (long j = 0; j < n; j++) {
+        int len = snprintf(buf,sizeof(buf),"value:%ld",j);
+        quicklistPushTail(ql,buf,len);
+    }
+    return ql;
+}
+
+static void benchQuicklistPush(long n) {
+    quicklist *ql = quicklistNew(-2,0);
+    char buf[32];
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        int len = snprintf(buf,sizeof(buf),"value:%ld",j);
+        quicklistPushTail(ql,buf,len);
+    }
+    microbenchStop();
+    quicklistRelease(ql);
+}
+
+static void benchQuicklistIndex(long n) {
+    quicklist *ql = microbenchQuicklist(1000000);
+    quicklistEntry entry;
+    long found = 0;
+
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        found += quicklistIndex(ql,redisLrand48()%1000000,&entry);
+    microbenchStop();
+    serverAssert(found == n);
+    quicklistRelease(ql);
+}
+
+/* Search random values in an intset of 512 entries, the default size limit
+ * of the intset encoding. */
+static void benchIntsetFind(long n) {
+    intset *is = intsetNew();
+    long found = 0;
+
+    for (int j = 0; j < 512; j++) is = intsetAdd(is,j*3,NULL);
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        found += intsetFind(is,redisLrand48()%1536);
+    microbenchStop();
+    serverAssert(found > 0);
+    zfree(is);
+}
+
+static void benchSkiplistInsert(long n) {
+    sds *keys = microbenchKeys(n);
+    zskiplist *zsl = zslCreate();
+
+    microbenchStart();
+    for (long j = 0; j < n; j++)
+        zslInsert(zsl,(double)redisLrand48(),keys[j]);
+    microbenchStop();
+    zslFree(zsl);
+    zfree(keys);
+}
+
+static void benchSkiplistRank(long n) {
+    sds *keys = microbenchKeys(n);
+    double *scores = zmalloc(sizeof(double)*n);
+    zskiplist *zsl = zslCreate();
+    long found = 0;
+
+    for (long j = 0; j < n; j++) {
+        scores[j] = (double)redisLrand48();
+        zslInsert(zsl,scores[j],keys[j]);
+    }
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        long k = redisLrand48()%n;
+        found += zslGetRank(zsl,scores[k],keys[k]) != 0;
+    }
+    microbenchStop();
+    serverAssert(found == n);
+    zslFree(zsl);
+    zfree(scores);
+    zfree(keys);
+}
+
+/* Append 8 bytes at a time to strings growing up to 1024 bytes. */
+static void benchSdsCatlen(long n) {
+    sds s = sdsempty();
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        s = sdscatlen(s,"01234567",8);
+        if (j % 128 == 127) {
+            sdsfree(s);
+            s = sdsempty();
+        }
+    }
+    microbenchStop();
+    sdsfree(s);
+}
+
+static void benchSdsFromLongLong(long n) {
+    microbenchStart();
+    for (long j = 0; j < n; j++) sdsfree(sdsfromlonglong(j*1000003));
+    microbenchStop();
+}
+
+/* Checksum buffers of 16k, as rio does while saving and loading RDB files,
+ * and the CRC64 of small buffers like DUMP payloads. */
+static void benchCrc64(long n, size_t len) {
+    unsigned char *buf = zmalloc(len);
+    uint64_t crc = 0;
+
+    for (size_t j = 0; j < len; j++) buf[j] = redisLrand48();
+    microbenchStart();
+    for (long j = 0; j < n; j++) crc = crc64(crc,buf,len);
+    microbenchStop();
+    serverAssert(crc != 1); /* Don't let the compiler drop the loop. */
+    zfree(buf);
+}
+
+static void benchCrc64Large(long n) {
+    benchCrc64(n,16384);
+}
+
+static void benchCrc64Small(long n) {
+    benchCrc64(n,100);
+}
+
+/* Parse SET requests as received from the network, 1000 per query buffer,
+ * creating and releasing the argument objects as the server does. */
+static void benchRespParse(long n) {
+    client *c = zcalloc(sizeof(*c));
+    sds req = sdsempty();
+    long parsed = 0;
+
+    for (int j = 0; j < 1000; j++) {
+        sds key = sdscatfmt(sdsempty(),"key:%I",(long long)redisLrand48());
+        req = sdscatfmt(req,"*3\r\n$3\r\nSET\r\n$%u\r\n%S\r\n$16\r\n"
+                            "value-0123456789\r\n",
+                        (unsigned int)sdslen(key),key);
+        sdsfree(key);
+    }
+    c->querybuf = req;
+    c->reqtype = PROTO_REQ_MULTIBULK;
+    c->bulklen = -1;
+
+    microbenchStart();
+    while (parsed < n) {
+        if (c->qb_pos == sdslen(c->querybuf)) c->qb_pos = 0;
+        serverAssert(processMultibulkBuffer(c) == C_OK);
+        for (int j = 0; j < c->argc; j++)
+            freeClientArgObject(c,c->argv[j]);
+        c->argc = 0;
+        parsed++;
+    }
+    microbenchStop();
+    freeClientArgvPool(c);
+    sdsfree(c->querybuf);
+    zfree(c->argv);
+    zfree(c);
+}
+
+/* Emit the reply of ZRANGE ... WITHSCORES for 100 elements, with integer
+ * and fractional scores, to a client without connection. The output buffer
+ * is discarded every 100 replies. */
+static void benchReplyEncode(long n, int resp) {
+    client *c = zcalloc(sizeof(*c));
+    sds *members = microbenchKeys(100);
+    double scores[100];
+
+    for (int j = 0; j < 100; j++)
+        scores[j] = j % 2 ? j*1000003 : j/8.0+(double)redisLrand48()/7;
+    c->flags = CLIENT_MODULE;
+    c->resp = resp;
+    c->reply = listCreate();
+    listSetFreeMethod(c->reply,freeClientReplyValue);
+
+    microbenchStart();
+    for (long j = 0; j < n; j++) {
+        addReplyArrayLen(c,resp == 2 ? 200 : 100);
+        for (int i = 0; i < 100; i++) {
+            if (resp == 3) addReplyArrayLen(c,2);
+            addReplyBulkCBuffer(c,members[i],sdslen(members[i]));
+            addReplyDouble(c,scores[i]);
+        }
+        if (j % 100 == 99) {
+            listEmpty(c->reply);
+            c->reply_bytes = 0;
+            c->bufpos = 0;
+        }
+    }
+    microbenchStop();
+    listRelease(c->reply);
+    zfree(c->buf);
+    microbenchFreeKeys(members,100);
+    zfree(c);
+}
+
+static void benchReplyEncodeResp2(long n) {
+    benchReplyEncode(n,2);
+}
+
+static void benchReplyEncodeResp3(long n) {
+    benchReplyEncode(n,3);
+}
+
+struct microbench {
+    const char *name;
+    void (*proc)(long n);
+    long ops;       /* Operations performed by every run. */
+} microbenchTable[] = {
+    {"dict-add",benchDictAdd,1000000},
+    {"dict-find",benchDictFind,1000000},
+    {"dict-find-miss",benchDictFindMiss,1000000},
+    {"dict-rehash",benchDictRehash,1000000},
+    {"dict-find-siphash",benchDictFindSiphash,1000000},
+    {"dict-find-aes",benchDictFindAes,1000000},
+    {"hash-siphash",benchHashSiphash,1000000},
+    {"hash-aes",benchHashAes,1000000},
+    {"rax-find-streamid",benchRaxFindStreamID,1000000},
+    {"rax-find-slotkeys",benchRaxFindSlotKeys,1000000},
+    {"ziplist-push",benchZiplistPush,1000000},
+    {"listpack-append",benchListpackAppend,1000000},
+    {"quicklist-push",benchQuicklistPush,1000000},
+    {"quicklist-index",benchQuicklistIndex,100000},
+    {"intset-find",benchIntsetFind,1000000},
+    {"skiplist-insert",benchSkiplistInsert,200000},
+    {"skiplist-rank",benchSkiplistRank,200000},
+    {"sds-catlen",benchSdsCatlen,1000000},
+    {"sds-fromlonglong",benchSdsFromLongLong,1000000},
+    {"crc64-16k",benchCrc64Large,100000},
+    {"crc64-100",benchCrc64Small,1000000},
+    {"resp-parse",benchRespParse,1000000},
+    {"reply-encode-resp2",benchReplyEncodeResp2,10000},
+    {"reply-encode-resp3",benchReplyEncodeResp3,10000},
+    {NULL,NULL,0}
+};
+
+static int compareMicrobenchRuns(const void *a, const void *b) {
+    long long ta = *(long long*)a, tb = *(long long*)b;
+    return (ta > tb) - (ta < tb);
+}
+
+/* redis-server microbench [name ...] */
+int microbenchMain(int argc, char **argv) {
+    long long runs[MICROBENCH_RUNS];
+    uint8_t seed[16] = {0};
+
+    dictSetHashFunctionSeed(seed);
+    dictSetHashFunction(DICT_HASH_AES); /* Like the server, if supported. */
+    server.proto_max_bulk_len = CONFIG_DEFAULT_PROTO_MAX_BULK_LEN;
+    printf("\"benchmark\",\"ops\",\"ns_per_op\",\"ops_per_sec\"\n");
+    for (struct microbench *mb = microbenchTable; mb->name; mb++) {
+        int selected = argc <= 2;
+
+        for (int j = 2; j < argc; j++)
+            if (!strncasecmp(mb->name,argv[j],strlen(argv[j]))) selected = 1;
+        if (!selected) continue;
+
+        for (int j = 0; j < MICROBENCH_RUNS; j++) {
+            redisSrand48(0);
+            microbench_elapsed = 0;
+            mb->proc(mb->ops);
+            runs[j] = microbench_elapsed;
+        }
+        qsort(runs,MICROBENCH_RUNS,sizeof(long long),compareMicrobenchRuns);
+        double ns = (double)runs[MICROBENCH_RUNS/2]/mb->ops;
+        printf("\"%s\",\"%ld\",\"%.2f\",\"%.0f\"\n",
+               mb->name, mb->ops, ns, ns > 0 ? 1e9/ns : 0);
+        fflush(stdout);
+    }
+    return 0;
+}
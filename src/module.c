@@ -287,6 +287,11 @@ static list *moduleKeyspaceSubscribers;
  * notifications, timers and cluster messages callbacks. */
 static client *moduleFreeContextReusedClient;
 
+/* Recycled clients for RM_Call(), see moduleAllocTempClient(). */
+static client **moduleTempClients;
+static size_t moduleTempClientCap = 0;
+static size_t moduleTempClientCount = 0;
+
 /* Data structures related to the exported dictionary data structure. */
 typedef struct RedisModuleDict {
     rax *rax;                       /* The radix tree. */
@@ -332,6 +337,13 @@ typedef struct RedisModuleServerInfoData {
 #define REDISMODULE_ARGV_NO_AOF (1<<1)
 #define REDISMODULE_ARGV_NO_REPLICAS (1<<2)
 
+/* RM_CallArgv() flags are passed unchanged as REDISMODULE_ARGV_* flags. */
+#if REDISMODULE_CALL_REPLICATE != REDISMODULE_ARGV_REPLICATE || \
+    REDISMODULE_CALL_NO_AOF != REDISMODULE_ARGV_NO_AOF || \
+    REDISMODULE_CALL_NO_REPLICAS != REDISMODULE_ARGV_NO_REPLICAS
+#error "RM_CallArgv() flags must match the REDISMODULE_ARGV_* flags"
+#endif
+
 /* Determine whether Redis should signalModifiedKey implicitly.
  * In case 'ctx' has no 'module' member (and therefore no module->options),
  * we assume default behavior, that is, Redis signals.
@@ -377,7 +389,7 @@ void RM_FreeServerInfo(RedisModuleCtx *ctx, RedisModuleServerInfoData *data);
  * and in general is taken into account as memory allocated by Redis.
  * You should avoid using malloc(). */
 void *RM_Alloc(size_t bytes) {
-    return zmalloc(bytes);
+    return zmalloc_class(bytes,ZMALLOC_CLASS_MODULE);
 }
 
 /* Use like calloc(). Memory allocated with this function is reported in
@@ -385,24 +397,28 @@ void *RM_Alloc(size_t bytes) {
  * and in general is taken into account as memory allocated by Redis.
  * You should avoid using calloc() directly. */
 void *RM_Calloc(size_t nmemb, size_t size) {
-    return zcalloc(nmemb*size);
+    return zcalloc_class(nmemb*size,ZMALLOC_CLASS_MODULE);
 }
 
 /* Use like realloc() for memory obtained with RedisModule_Alloc(). */
 void* RM_Realloc(void *ptr, size_t bytes) {
-    return zrealloc(ptr,bytes);
+    return zrealloc_class(ptr,bytes,ZMALLOC_CLASS_MODULE);
 }
 
 /* Use like free() for memory obtained by RedisModule_Alloc() and
  * RedisModule_Realloc(). However you should never try to free with
  * RedisModule_Free() memory allocated with malloc() inside your module. */
 void RM_Free(void *ptr) {
-    zfree(ptr);
+    zfree_class(ptr,ZMALLOC_CLASS_MODULE);
 }
 
 /* Like strdup() but returns memory allocated with RedisModule_Alloc(). */
 char *RM_Strdup(const char *str) {
-    return zstrdup(str);
+    size_t len = strlen(str)+1;
+    char *p = zmalloc_class(len,ZMALLOC_CLASS_MODULE);
+
+    memcpy(p,str,len);
+    return p;
 }
 
 /* --------------------------------------------------------------------------
@@ -493,7 +509,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -817,6 +833,7 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->keystep = keystep;
     cp->rediscmd->microseconds = 0;
     cp->rediscmd->calls = 0;
+    cp->rediscmd->latency_histogram = NULL;
     dictAdd(server.commands,sdsdup(cmdname),cp->rediscmd);
     dictAdd(server.orig_commands,sdsdup(cmdname),cp->rediscmd);
     cp->rediscmd->id = ACLGetCommandID(cmdname); /* ID used for ACL. */
@@ -1414,6 +1431,25 @@ int RM_ReplyWithString(RedisModuleCtx *ctx, RedisModuleString *str) {
     return REDISMODULE_OK;
 }
 
+/* Like RM_ReplyWithString(), but large strings are not copied into the
+ * client output buffer: the string is referenced, and written to the socket
+ * directly from the RedisModuleString, through the same connection layer
+ * used for every reply, so this works with TLS connections as well. This
+ * avoids copying big values the module already holds as strings.
+ *
+ * The module can release its reference to the string as usual, however it
+ * must not modify the string in place after this call. Small strings, and
+ * replies that are not sent directly to a socket (for instance to blocked
+ * clients), are copied as RM_ReplyWithString() does.
+ *
+ * The function always returns REDISMODULE_OK. */
+int RM_ReplyWithStringNoCopy(RedisModuleCtx *ctx, RedisModuleString *str) {
+    client *c = moduleGetReplyClient(ctx);
+    if (c == NULL) return REDISMODULE_OK;
+    addReplyBulkNoCopy(c,str);
+    return REDISMODULE_OK;
+}
+
 /* Reply with an empty string.
  *
  * The function always returns REDISMODULE_OK. */
@@ -1928,6 +1964,7 @@ void *RM_OpenKey(RedisModuleCtx *ctx, robj *keyname, int mode) {
 
     if (mode & REDISMODULE_WRITE) {
         value = lookupKeyWriteWithFlags(ctx->client->db,keyname, flags);
+        if (value) replyFlushJobsOfValue(value);
     } else {
         value = lookupKeyReadWithFlags(ctx->client->db,keyname, flags);
         if (value == NULL) {
@@ -2411,7 +2448,7 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                 zzlLastInRange(key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2475,7 +2512,7 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                 zzlLastInLexRange(key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -2520,12 +2557,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
@@ -2546,12 +2583,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -2561,7 +2598,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -2609,12 +2646,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2624,7 +2661,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -2756,7 +2793,10 @@ int RM_HashSet(RedisModuleKey *key, int flags, ...) {
 
         /* Handle deletion if value is REDISMODULE_HASH_DELETE. */
         if (value == REDISMODULE_HASH_DELETE) {
-            updated += hashTypeDelete(key->value, field->ptr);
+            if (hashTypeDelete(key->value, field->ptr)) {
+                hashFieldRemoveExpire(key->db, key->key->ptr, field->ptr);
+                updated++;
+            }
             if (flags & REDISMODULE_HASH_CFIELDS) decrRefCount(field);
             continue;
         }
@@ -2770,6 +2810,8 @@ int RM_HashSet(RedisModuleKey *key, int flags, ...) {
 
         robj *argv[2] = {field,value};
         hashTypeTryConversion(key->value,argv,0,1);
+        /* Like HSET, setting a field makes it persistent. */
+        hashFieldRemoveExpire(key->db, key->key->ptr, field->ptr);
         updated += hashTypeSet(key->value, field->ptr, value->ptr, low_flags);
 
         /* If CFIELDS is active, SDS string ownership is now of hashTypeSet(),
@@ -3165,48 +3207,59 @@ fmterr:
     return NULL;
 }
 
-/* Exported API to call any Redis command from modules.
- * On success a RedisModuleCallReply object is returned, otherwise
- * NULL is returned and errno is set to the following values:
- *
- * EBADF: wrong format specifier.
- * EINVAL: wrong command arity.
- * ENOENT: command does not exist.
- * EPERM:  operation in Cluster instance with key in non local slot.
- *
- * This API is documented here: https://redis.io/topics/modules-intro
- */
-RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const char *fmt, ...) {
+/* Return a fake client to execute a command on behalf of a module. Calling
+ * a fast command like HGET from a module in a tight loop used to spend most
+ * of its time creating and releasing the client, so clients are recycled in
+ * a small pool: its size only grows with the RM_Call() nesting level. */
+static client *moduleAllocTempClient(RedisModuleCtx *ctx) {
+    client *c;
+    if (moduleTempClientCount) {
+        c = moduleTempClients[--moduleTempClientCount];
+    } else {
+        c = createClient(NULL);
+        c->flags |= CLIENT_MODULE;
+        c->user = NULL; /* Root user. */
+    }
+    c->db = ctx->client->db;
+    return c;
+}
+
+/* Put a client obtained with moduleAllocTempClient() back in the pool. The
+ * command may have left some state in the client (a MULTI, subscriptions,
+ * a name, ...): in that case the client is just freed, so that recycled
+ * clients are always indistinguishable from new ones. */
+static void moduleReleaseTempClient(client *c) {
+    if ((c->flags & ~(CLIENT_MODULE|CLIENT_READONLY|CLIENT_ASKING)) ||
+        listLength(c->watched_keys) || c->name || c->resp != 2)
+    {
+        freeClient(c);
+        return;
+    }
+    resetClient(c);
+    listEmpty(c->reply);
+    c->reply_bytes = 0;
+    c->bufpos = 0;
+    c->flags = CLIENT_MODULE;
+    c->cmd = c->lastcmd = NULL;
+    if (moduleTempClientCount == moduleTempClientCap) {
+        moduleTempClientCap = moduleTempClientCap ? moduleTempClientCap*2 : 4;
+        moduleTempClients = zrealloc(moduleTempClients,
+                                     sizeof(client*)*moduleTempClientCap);
+    }
+    moduleTempClients[moduleTempClientCount++] = c;
+}
+
+/* Execute the command already set up in the argv of the module client 'c'
+ * and return the reply, or NULL setting errno on error. This is the common
+ * implementation of RM_Call() and RM_CallArgv(). The 'flags' are the
+ * REDISMODULE_ARGV_* flags. */
+static RedisModuleCallReply *moduleCallWithClient(RedisModuleCtx *ctx, client *c, int flags) {
     struct redisCommand *cmd;
-    client *c = NULL;
-    robj **argv = NULL;
-    int argc = 0, flags = 0;
-    va_list ap;
     RedisModuleCallReply *reply = NULL;
-    int replicate = 0; /* Replicate this command? */
-
-    /* Create the client and dispatch the command. */
-    va_start(ap, fmt);
-    c = createClient(NULL);
-    c->user = NULL; /* Root user. */
-    argv = moduleCreateArgvFromUserFormat(cmdname,fmt,&argc,&flags,ap);
-    replicate = flags & REDISMODULE_ARGV_REPLICATE;
-    va_end(ap);
+    int replicate = flags & REDISMODULE_ARGV_REPLICATE;
 
-    /* Setup our fake client for command execution. */
-    c->flags |= CLIENT_MODULE;
-    c->db = ctx->client->db;
-    c->argv = argv;
-    c->argc = argc;
     if (ctx->module) ctx->module->in_call++;
 
-    /* We handle the above format error only when the client is setup so that
-     * we can free it normally. */
-    if (argv == NULL) {
-        errno = EBADF;
-        goto cleanup;
-    }
-
     /* Call command filters */
     moduleCallCommandFilters(c);
 
@@ -3221,7 +3274,7 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
     c->cmd = c->lastcmd = cmd;
 
     /* Basic arity checks. */
-    if ((cmd->arity > 0 && cmd->arity != argc) || (argc < -cmd->arity)) {
+    if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity)) {
         errno = EINVAL;
         goto cleanup;
     }
@@ -3272,10 +3325,76 @@ RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const ch
 
 cleanup:
     if (ctx->module) ctx->module->in_call--;
-    freeClient(c);
+    moduleReleaseTempClient(c);
     return reply;
 }
 
+/* Exported API to call any Redis command from modules.
+ * On success a RedisModuleCallReply object is returned, otherwise
+ * NULL is returned and errno is set to the following values:
+ *
+ * EBADF: wrong format specifier.
+ * EINVAL: wrong command arity.
+ * ENOENT: command does not exist.
+ * EPERM:  operation in Cluster instance with key in non local slot.
+ *
+ * This API is documented here: https://redis.io/topics/modules-intro
+ */
+RedisModuleCallReply *RM_Call(RedisModuleCtx *ctx, const char *cmdname, const char *fmt, ...) {
+    client *c;
+    robj **argv = NULL;
+    int argc = 0, flags = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    argv = moduleCreateArgvFromUserFormat(cmdname,fmt,&argc,&flags,ap);
+    va_end(ap);
+    if (argv == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    /* Setup our fake client for command execution. */
+    c = moduleAllocTempClient(ctx);
+    zfree(c->argv);
+    c->argv = argv;
+    c->argc = argc;
+    c->argv_len = argc;
+    resetClientCommandKeys(c);
+    return moduleCallWithClient(ctx,c,flags);
+}
+
+/* Like RM_Call(), but the command is given as an already built vector of
+ * 'argc' strings, where argv[0] is the command name, so no format specifier
+ * needs to be parsed and no argument object needs to be created. This is
+ * the fastest way to call a command many times, for instance HGET against
+ * many fields, reusing the same argument vector and only replacing the
+ * strings that change. The strings are not retained after the call.
+ *
+ * The 'flags' argument replaces the modifiers of the RM_Call() format:
+ *
+ *     REDISMODULE_CALL_REPLICATE:   like "!", replicate the command.
+ *     REDISMODULE_CALL_NO_AOF:      like "A", don't propagate to the AOF.
+ *     REDISMODULE_CALL_NO_REPLICAS: like "R", don't propagate to replicas.
+ *
+ * The return value and errno are the same as RM_Call(), with EINVAL also
+ * returned when 'argc' is zero. */
+RedisModuleCallReply *RM_CallArgv(RedisModuleCtx *ctx, int flags, RedisModuleString **argv, int argc) {
+    if (argc <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    client *c = moduleAllocTempClient(ctx);
+    clientEnsureArgvLen(c,argc);
+    for (int j = 0; j < argc; j++) {
+        c->argv[j] = argv[j];
+        incrRefCount(argv[j]);
+    }
+    c->argc = argc;
+    return moduleCallWithClient(ctx,c,flags);
+}
+
 /* Return a pointer, and a length, to the protocol returned by the command
  * that returned the reply object. */
 const char *RM_CallReplyProto(RedisModuleCallReply *reply, size_t *len) {
@@ -3469,6 +3588,11 @@ void moduleTypeNameByID(char *name, uint64_t moduleid) {
  * * **aof_rewrite**: A callback function pointer that rewrites data as commands.
  * * **digest**: A callback function pointer that is used for `DEBUG DIGEST`.
  * * **free**: A callback function pointer that can free a type value.
+ * * **defrag**: A callback function pointer that moves the allocations of a
+ *   value during the active defragmentation, see RedisModule_DefragAlloc().
+ *   It receives a pointer to the value, to update it if the value itself is
+ *   moved, and returns 0 if done, or non zero to be called again, like in
+ *   the example of RedisModule_DefragCursorSet().
  *
  * The **digest* and **mem_usage** methods should currently be omitted since
  * they are not yet implemented inside the Redis modules core.
@@ -3512,6 +3636,9 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
             moduleTypeAuxSaveFunc aux_save;
             int aux_save_triggers;
         } v2;
+        struct {
+            moduleTypeDefragFunc defrag;
+        } v3;
     } *tms = (struct typemethods*) typemethods_ptr;
 
     moduleType *mt = zcalloc(sizeof(*mt));
@@ -3528,6 +3655,9 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
         mt->aux_save = tms->v2.aux_save;
         mt->aux_save_triggers = tms->v2.aux_save_triggers;
     }
+    if (tms->version >= 3) {
+        mt->defrag = tms->v3.defrag;
+    }
     memcpy(mt->name,name,sizeof(mt->name));
     listAddNodeTail(ctx->module->types,mt);
     return mt;
@@ -4155,11 +4285,11 @@ void RM__Assert(const char *estr, const char *file, int line) {
 }
 
 /* Allows adding event to the latency monitor to be observed by the LATENCY
- * command. The call is skipped if the latency is smaller than the configured
- * latency-monitor-threshold. */
+ * command. The call is skipped if the latency, in milliseconds, is smaller
+ * than the configured latency-monitor-threshold. */
 void RM_LatencyAddSample(const char *event, mstime_t latency) {
-    if (latency >= server.latency_monitor_threshold)
-        latencyAddSample(event, latency);
+    if (latency*1000 >= server.latency_monitor_threshold_us)
+        latencyAddSample(event, latency*1000);
 }
 
 /* --------------------------------------------------------------------------
@@ -4688,6 +4818,227 @@ void moduleReleaseGIL(void) {
     pthread_mutex_unlock(&moduleGIL);
 }
 
+/* --------------------------------------------------------------------------
+ * Thread safe keys snapshots
+ * -------------------------------------------------------------------------- */
+
+/* A snapshot is a private copy of the value of a key, taken by the main
+ * thread between two iterations of the event loop. Module threads access it
+ * without any lock, since nobody else references it. */
+typedef struct RedisModuleKeySnapshot {
+    int type;           /* REDISMODULE_KEYTYPE_* */
+    sds *elements;      /* Copy of the value, see RM_KeySnapshotElement(). */
+    size_t numelements;
+    size_t alloc;       /* Number of slots allocated in 'elements'. */
+} RedisModuleKeySnapshot;
+
+/* A snapshot requested by a module thread, waiting for the main thread to
+ * serve it in moduleHandleKeySnapshotRequests(). */
+typedef struct moduleSnapshotRequest {
+    int dbid;
+    robj *keyname;
+    RedisModuleKeySnapshot *snapshot;   /* NULL if the key does not exist. */
+    int done;
+} moduleSnapshotRequest;
+
+static pthread_mutex_t moduleSnapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t moduleSnapshotCond = PTHREAD_COND_INITIALIZER;
+static list *moduleSnapshotRequests;    /* Pending moduleSnapshotRequest. */
+static pthread_t moduleMainThread;
+
+static void moduleSnapshotAppend(RedisModuleKeySnapshot *s, sds ele) {
+    if (s->numelements == s->alloc) {
+        s->alloc = s->alloc ? s->alloc*2 : 8;
+        s->elements = zrealloc(s->elements,sizeof(sds)*s->alloc);
+    }
+    s->elements[s->numelements++] = ele;
+}
+
+static sds moduleSnapshotObjectSds(robj *o) {
+    sds ele;
+
+    o = getDecodedObject(o);
+    ele = sdsdup(o->ptr);
+    decrRefCount(o);
+    return ele;
+}
+
+/* Copy the value of the key into a new snapshot, in the main thread. */
+static RedisModuleKeySnapshot *moduleCreateKeySnapshot(int dbid, robj *keyname) {
+    robj *o = lookupKeyReadWithFlags(server.db+dbid,keyname,LOOKUP_NOTOUCH);
+    RedisModuleKeySnapshot *s;
+
+    if (o == NULL) return NULL;
+    s = zcalloc(sizeof(*s));
+    switch(o->type) {
+    case OBJ_STRING:
+        s->type = REDISMODULE_KEYTYPE_STRING;
+        if (o->encoding == OBJ_ENCODING_ROARING) bitmapConvertToRaw(o);
+        moduleSnapshotAppend(s,moduleSnapshotObjectSds(o));
+        break;
+    case OBJ_LIST: {
+        listTypeIterator *li = listTypeInitIterator(o,0,LIST_TAIL);
+        listTypeEntry entry;
+
+        s->type = REDISMODULE_KEYTYPE_LIST;
+        while(listTypeNext(li,&entry)) {
+            robj *ele = listTypeGet(&entry);
+            moduleSnapshotAppend(s,moduleSnapshotObjectSds(ele));
+            decrRefCount(ele);
+        }
+        listTypeReleaseIterator(li);
+        break;
+    }
+    case OBJ_SET: {
+        setTypeIterator *si = setTypeInitIterator(o);
+        sds ele;
+
+        s->type = REDISMODULE_KEYTYPE_SET;
+        while((ele = setTypeNextObject(si)) != NULL)
+            moduleSnapshotAppend(s,ele);
+        setTypeReleaseIterator(si);
+        break;
+    }
+    case OBJ_HASH: {
+        hashTypeIterator *hi = hashTypeInitIterator(o);
+
+        s->type = REDISMODULE_KEYTYPE_HASH;
+        while(hashTypeNext(hi) != C_ERR) {
+            moduleSnapshotAppend(s,hashTypeCurrentObjectNewSds(hi,OBJ_HASH_KEY));
+            moduleSnapshotAppend(s,hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE));
+        }
+        hashTypeReleaseIterator(hi);
+        break;
+    }
+    case OBJ_ZSET:
+        s->type = REDISMODULE_KEYTYPE_ZSET;
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            /* Members and scores are stored as alternating entries. */
+            unsigned char *p = lpSeek(o->ptr,0);
+
+            while(p) {
+                moduleSnapshotAppend(s,lpGetObject(p));
+                p = lpNext(o->ptr,p);
+            }
+        } else {
+            zskiplistNode *ln = ((zset*)o->ptr)->zsl->header->level[0].forward;
+
+            while(ln) {
+                moduleSnapshotAppend(s,sdsdup(ln->ele));
+                moduleSnapshotAppend(s,sdscatprintf(sdsempty(),"%.17g",
+                                                    ln->score));
+                ln = ln->level[0].forward;
+            }
+        }
+        break;
+    case OBJ_MODULE:
+        s->type = REDISMODULE_KEYTYPE_MODULE;
+        break;
+    case OBJ_STREAM:
+        s->type = REDISMODULE_KEYTYPE_STREAM;
+        break;
+    }
+    return s;
+}
+
+/* Serve the snapshots requested by module threads. Called by the main thread
+ * in beforeSleep(), the threads waiting for the requests are woken up by the
+ * module_blocked_pipe like for the clients unblocked by threads. */
+void moduleHandleKeySnapshotRequests(void) {
+    listNode *ln;
+
+    pthread_mutex_lock(&moduleSnapshotMutex);
+    if (listLength(moduleSnapshotRequests) == 0) {
+        pthread_mutex_unlock(&moduleSnapshotMutex);
+        return;
+    }
+    while((ln = listFirst(moduleSnapshotRequests)) != NULL) {
+        moduleSnapshotRequest *req = ln->value;
+
+        req->snapshot = moduleCreateKeySnapshot(req->dbid,req->keyname);
+        req->done = 1;
+        listDelNode(moduleSnapshotRequests,ln);
+    }
+    pthread_cond_broadcast(&moduleSnapshotCond);
+    pthread_mutex_unlock(&moduleSnapshotMutex);
+}
+
+/* Return a snapshot of the value of the key 'keyname', in the database
+ * selected in the context, or NULL if the key does not exist.
+ *
+ * This function is meant to be called by module threads *without* holding
+ * the GIL (calling it while holding the GIL would deadlock): the calling
+ * thread waits for the main thread to copy the value between two
+ * iterations of the event loop, but the server is not stopped while the
+ * thread uses the snapshot, that is not affected by later changes to the
+ * key. This way background jobs that need to read a lot of keys don't need
+ * to hold the GIL, adding latency to all the clients, for the whole time
+ * they process the data. When called by the main thread, the snapshot is
+ * taken synchronously.
+ *
+ * The content of the snapshot is accessed with RedisModule_KeySnapshotType(),
+ * RedisModule_KeySnapshotLength() and RedisModule_KeySnapshotElement(), and
+ * it must be released with RedisModule_FreeKeySnapshot(). */
+RedisModuleKeySnapshot *RM_ThreadSafeKeySnapshot(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    moduleSnapshotRequest req;
+
+    req.dbid = ctx->client->db->id;
+    req.keyname = createStringObject(keyname->ptr,sdslen(keyname->ptr));
+    req.snapshot = NULL;
+    req.done = 0;
+
+    if (pthread_equal(pthread_self(),moduleMainThread)) {
+        req.snapshot = moduleCreateKeySnapshot(req.dbid,req.keyname);
+    } else {
+        pthread_mutex_lock(&moduleSnapshotMutex);
+        listAddNodeTail(moduleSnapshotRequests,&req);
+        if (write(server.module_blocked_pipe[1],"A",1) != 1) {
+            /* Ignore the error, this is best-effort. */
+        }
+        while(!req.done) pthread_cond_wait(&moduleSnapshotCond,&moduleSnapshotMutex);
+        pthread_mutex_unlock(&moduleSnapshotMutex);
+    }
+    decrRefCount(req.keyname);
+    return req.snapshot;
+}
+
+/* Return the type of the key of the snapshot, one of REDISMODULE_KEYTYPE_*. */
+int RM_KeySnapshotType(RedisModuleKeySnapshot *snapshot) {
+    return snapshot->type;
+}
+
+/* Return the number of elements of the snapshot, that depend on the type
+ * of the key:
+ *
+ * * Strings: a single element, the string itself.
+ * * Lists: the elements of the list, from the head to the tail.
+ * * Sets: the members of the set, in no particular order.
+ * * Hashes: the fields and the values, alternated: field, value, field, ...
+ * * Sorted sets: the members and the scores, alternated, ordered by score.
+ * * Module types and streams: no element, only the type is reported. */
+size_t RM_KeySnapshotLength(RedisModuleKeySnapshot *snapshot) {
+    return snapshot->numelements;
+}
+
+/* Return the element at position 'idx' of the snapshot, setting '*len' to its
+ * length if 'len' is not NULL, or NULL if 'idx' is out of range. The returned
+ * buffer is valid until the snapshot is freed. */
+const char *RM_KeySnapshotElement(RedisModuleKeySnapshot *snapshot, size_t idx, size_t *len) {
+    if (idx >= snapshot->numelements) return NULL;
+    if (len) *len = sdslen(snapshot->elements[idx]);
+    return snapshot->elements[idx];
+}
+
+/* Release a snapshot returned by RedisModule_ThreadSafeKeySnapshot(). It can
+ * be called by any thread. */
+void RM_FreeKeySnapshot(RedisModuleKeySnapshot *snapshot) {
+    size_t j;
+
+    for (j = 0; j < snapshot->numelements; j++) sdsfree(snapshot->elements[j]);
+    zfree(snapshot->elements);
+    zfree(snapshot);
+}
+
 
 /* --------------------------------------------------------------------------
  * Module Keyspace Notifications API
@@ -5222,6 +5573,137 @@ int RM_GetTimerInfo(RedisModuleCtx *ctx, RedisModuleTimerID id, uint64_t *remain
     return REDISMODULE_OK;
 }
 
+/* --------------------------------------------------------------------------
+ * Modules event loop API
+ *
+ * Modules implementing their own network services, like proxies or servers
+ * for custom protocols, can register their file descriptors in the Redis
+ * event loop, so that their callbacks are called by the main thread when
+ * the descriptors are readable or writable, exactly like it happens for the
+ * Redis clients connections. This API must be used from the main thread, or
+ * from a thread holding the GIL.
+ * -------------------------------------------------------------------------- */
+
+typedef void (*RedisModuleEventLoopFunc)(int fd, void *user_data, int mask);
+
+/* Callbacks of a file descriptor registered by a module. A single structure
+ * is used for both the events, since the event loop has a single private
+ * data pointer per file descriptor. */
+typedef struct EventLoopData {
+    RedisModuleEventLoopFunc rfunc;
+    RedisModuleEventLoopFunc wfunc;
+    void *user_data;
+} EventLoopData;
+
+static void eventLoopCbReadable(struct aeEventLoop *el, int fd, void *user_data, int mask) {
+    UNUSED(el);
+    UNUSED(mask);
+    EventLoopData *data = user_data;
+    data->rfunc(fd,data->user_data,REDISMODULE_EVENTLOOP_READABLE);
+}
+
+static void eventLoopCbWritable(struct aeEventLoop *el, int fd, void *user_data, int mask) {
+    UNUSED(el);
+    UNUSED(mask);
+    EventLoopData *data = user_data;
+    data->wfunc(fd,data->user_data,REDISMODULE_EVENTLOOP_WRITABLE);
+}
+
+/* Return the callbacks registered by modules for 'fd', or NULL if no module
+ * event is registered for it. */
+static EventLoopData *eventLoopGetData(int fd) {
+    aeFileEvent *fe = &server.el->events[fd];
+    if (fe->mask == AE_NONE) return NULL;
+    if (fe->rfileProc != eventLoopCbReadable &&
+        fe->wfileProc != eventLoopCbWritable) return NULL;
+    return fe->clientData;
+}
+
+static int eventLoopToAeMask(int mask) {
+    int aemask = AE_NONE;
+    if (mask & REDISMODULE_EVENTLOOP_READABLE) aemask |= AE_READABLE;
+    if (mask & REDISMODULE_EVENTLOOP_WRITABLE) aemask |= AE_WRITABLE;
+    return aemask;
+}
+
+/* Add a pipe / socket event to the event loop. The callback 'func' is called
+ * with 'fd', 'user_data' and the event that fired, REDISMODULE_EVENTLOOP_READABLE
+ * or REDISMODULE_EVENTLOOP_WRITABLE, when 'fd' is ready, until the event is
+ * removed with RM_EventLoopDel(). 'mask' can be one or both of the two flags.
+ * Registering the same event again replaces its callback, and the
+ * 'user_data' is shared by the two events of a file descriptor.
+ *
+ * On success REDISMODULE_OK is returned, otherwise REDISMODULE_ERR is
+ * returned and errno is set to the following values:
+ *
+ * ERANGE: 'fd' is negative or higher than the 'maxclients' limit.
+ * EINVAL: 'func' is NULL or 'mask' is invalid.
+ * EBUSY:  'fd' is used by Redis itself, for instance by a client.
+ *
+ * Note that 'fd' must be a file descriptor owned by the module: the
+ * descriptors of the Redis clients can't be registered. */
+int RM_EventLoopAdd(int fd, int mask, RedisModuleEventLoopFunc func, void *user_data) {
+    if (fd < 0 || fd >= aeGetSetSize(server.el)) {
+        errno = ERANGE;
+        return REDISMODULE_ERR;
+    }
+    if (!func || !mask || mask & ~(REDISMODULE_EVENTLOOP_READABLE|
+                                   REDISMODULE_EVENTLOOP_WRITABLE))
+    {
+        errno = EINVAL;
+        return REDISMODULE_ERR;
+    }
+
+    EventLoopData *data = eventLoopGetData(fd);
+    if (!data) {
+        if (aeGetFileEvents(server.el,fd) != AE_NONE) {
+            errno = EBUSY;
+            return REDISMODULE_ERR;
+        }
+        data = zcalloc(sizeof(*data));
+    }
+
+    int aemask = eventLoopToAeMask(mask);
+    if ((aemask & AE_READABLE &&
+         aeCreateFileEvent(server.el,fd,AE_READABLE,eventLoopCbReadable,data) == AE_ERR) ||
+        (aemask & AE_WRITABLE &&
+         aeCreateFileEvent(server.el,fd,AE_WRITABLE,eventLoopCbWritable,data) == AE_ERR))
+    {
+        if (aeGetFileEvents(server.el,fd) == AE_NONE) zfree(data);
+        return REDISMODULE_ERR;
+    }
+    if (aemask & AE_READABLE) data->rfunc = func;
+    if (aemask & AE_WRITABLE) data->wfunc = func;
+    data->user_data = user_data;
+    return REDISMODULE_OK;
+}
+
+/* Remove the events in 'mask' from the events registered for 'fd' with
+ * RM_EventLoopAdd(). It is valid to call this function from the callback
+ * of the event itself. Removing events that were not registered is not an
+ * error.
+ *
+ * On success REDISMODULE_OK is returned, otherwise REDISMODULE_ERR is
+ * returned and errno is set to ERANGE or EINVAL, like RM_EventLoopAdd(). */
+int RM_EventLoopDel(int fd, int mask) {
+    if (fd < 0 || fd >= aeGetSetSize(server.el)) {
+        errno = ERANGE;
+        return REDISMODULE_ERR;
+    }
+    if (!mask || mask & ~(REDISMODULE_EVENTLOOP_READABLE|
+                          REDISMODULE_EVENTLOOP_WRITABLE))
+    {
+        errno = EINVAL;
+        return REDISMODULE_ERR;
+    }
+
+    EventLoopData *data = eventLoopGetData(fd);
+    if (!data) return REDISMODULE_OK;
+    aeDeleteFileEvent(server.el,fd,eventLoopToAeMask(mask));
+    if (aeGetFileEvents(server.el,fd) == AE_NONE) zfree(data);
+    return REDISMODULE_OK;
+}
+
 /* --------------------------------------------------------------------------
  * Modules Dictionary API
  *
@@ -6025,6 +6507,15 @@ int RM_UnregisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilter *fi
     return REDISMODULE_OK;
 }
 
+/* Return 1 if modules registered command filters or keyspace events
+ * subscribers, that is, modules that may need to be called as a side effect
+ * of executing a command. This is used in order to know if commands can be
+ * executed outside the main thread, see ioThreadCanExecuteCommand(). */
+int moduleHasCommandHooks(void) {
+    return listLength(moduleCommandFilters) != 0 ||
+           listLength(moduleKeyspaceSubscribers) != 0;
+}
+
 void moduleCallCommandFilters(client *c) {
     if (listLength(moduleCommandFilters) == 0) return;
 
@@ -6051,6 +6542,9 @@ void moduleCallCommandFilters(client *c) {
 
     c->argv = filter.argv;
     c->argc = filter.argc;
+    /* Filters may have reallocated argv to just fit the arguments. */
+    c->argv_len = c->argc;
+    resetClientCommandKeys(c);
 }
 
 /* Return the number of arguments a filtered command has.  The number of
@@ -6171,6 +6665,10 @@ static void moduleScanCallback(void *privdata, const dictEntry *de) {
     robj* val = dictGetVal(de);
     RedisModuleString *keyname = createObject(OBJ_STRING,sdsdup(key));
 
+    /* The value may be in the tiered storage. */
+    if (val->encoding == OBJ_ENCODING_SWAPPED)
+        val = tieredSwapIn(data->ctx->client->db,(dictEntry*)de);
+
     /* Setup the key handle. */
     RedisModuleKey kp = {0};
     moduleInitKey(&kp, data->ctx, keyname, val, REDISMODULE_READ);
@@ -6353,23 +6851,40 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         cursor->cursor = 1;
         cursor->done = 1;
         ret = 0;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpSeek(o->ptr,0);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+        while(p) {
+            vstr = lpGetValue(p,&vlen,&vll);
+            robj *field = (vstr != NULL) ?
+                createStringObject((char*)vstr,vlen) :
+                createStringObjectFromLongLong(vll);
+            fn(key, field, NULL, privdata);
+            p = lpNext(o->ptr,p);
+            decrRefCount(field);
+        }
+        cursor->cursor = 1;
+        cursor->done = 1;
+        ret = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *field = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createStringObjectFromLongLong(vll);
-            p = ziplistNext(o->ptr,p);
-            ziplistGet(p,&vstr,&vlen,&vll);
+            p = lpNext(o->ptr,p);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *value = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createStringObjectFromLongLong(vll);
             fn(key, field, value, privdata);
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
             decrRefCount(field);
             decrRefCount(value);
         }
@@ -6381,6 +6896,131 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
     return ret;
 }
 
+/* --------------------------------------------------------------------------
+ * Module data types defragmentation API
+ * -------------------------------------------------------------------------- */
+
+/* Context passed to the 'defrag' callback of the module types. */
+typedef struct RedisModuleDefragCtx {
+    long long endtime;      /* Time limit of a late defrag, 0 for none. */
+    unsigned long *cursor;  /* Cursor of a late defrag, NULL otherwise. */
+    long defragged;         /* Number of allocations moved. */
+} RedisModuleDefragCtx;
+
+/* Called by the active defrag for each value of a module type found while
+ * scanning the keyspace. The moduleValue structure is moved if needed, then
+ * the 'defrag' callback of the type, if any, is called without time limit
+ * to move the allocations of the value.
+ *
+ * Returns 1 if the value was fully defragged, or 0 if the callback asked to
+ * be called again later, incrementally, by moduleLateDefrag(). */
+int moduleDefragValue(robj *key, robj *value, long *defragged) {
+    moduleValue *mv = value->ptr, *newmv;
+    moduleType *mt = mv->type;
+    RedisModuleDefragCtx ctx = {0, NULL, 0};
+    int ret;
+
+    if ((newmv = activeDefragAlloc(mv))) {
+        (*defragged)++;
+        value->ptr = mv = newmv;
+    }
+    if (!mt->defrag) return 1;
+    ret = mt->defrag(&ctx,key,&mv->value);
+    *defragged += ctx.defragged;
+    return ret == 0;
+}
+
+/* Incremental defrag of a value for which the 'defrag' callback returned
+ * non zero in moduleDefragValue(). The callback gets the time limit and a
+ * cursor, set to 0 at the first call, to remember where to continue.
+ *
+ * Returns 0 if the value is done, or 1 if the time is up and the callback
+ * must be called again. */
+int moduleLateDefrag(robj *key, robj *value, unsigned long *cursor, long long endtime, long long *defragged) {
+    moduleValue *mv = value->ptr;
+    moduleType *mt = mv->type;
+    RedisModuleDefragCtx ctx = {endtime, cursor, 0};
+    int ret = 0;
+
+    if (mt->defrag) ret = mt->defrag(&ctx,key,&mv->value);
+    *defragged += ctx.defragged;
+    if (!ret) {
+        *cursor = 0;
+        return 0;
+    }
+    /* A zero cursor means the value is done for the defrag code. */
+    if (!*cursor) *cursor = 1;
+    return 1;
+}
+
+/* Try to move the allocation 'ptr', obtained with RedisModule_Alloc() and
+ * friends, to reduce the fragmentation: returns the new pointer, and the
+ * old one must not be accessed anymore, or NULL if the allocation was not
+ * moved, in which case the old pointer is still valid.
+ *
+ * Moving an allocation is only safe if the module updates all the
+ * references to it with the new pointer. */
+void *RM_DefragAlloc(RedisModuleDefragCtx *ctx, void *ptr) {
+    void *newptr = activeDefragAllocWithClass(ptr,ZMALLOC_CLASS_MODULE);
+    if (newptr) ctx->defragged++;
+    return newptr;
+}
+
+/* Like RedisModule_DefragAlloc() for a RedisModuleString held by the value.
+ * Strings also referenced elsewhere, for instance retained with
+ * RedisModule_RetainString(), are never moved, so NULL is returned. */
+RedisModuleString *RM_DefragRedisModuleString(RedisModuleDefragCtx *ctx, RedisModuleString *str) {
+    return activeDefragStringOb(str,&ctx->defragged);
+}
+
+/* Return true if the 'defrag' callback should stop and return a non zero
+ * value, since the time limit was reached: the position should be saved
+ * with RedisModule_DefragCursorSet() so that the next call can continue
+ * from there. Always false when the callback is called without a time
+ * limit, that is, the first time for a given value. */
+int RM_DefragShouldStop(RedisModuleDefragCtx *ctx) {
+    return ctx->endtime != 0 && defragTimeIsUp(ctx->endtime);
+}
+
+/* Store the position reached by an incremental defrag of a value, that
+ * RedisModule_DefragCursorGet() returns at the next call. Returns
+ * REDISMODULE_ERR if the defrag is not incremental: a callback that can't
+ * do all the work in one call must return non zero to be called again with
+ * a cursor.
+ *
+ * A typical 'defrag' callback of a big value looks like this:
+ *
+ *     int myTypeDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key,
+ *                      void **value)
+ *     {
+ *         unsigned long i = 0;
+ *         // Ask to be called incrementally for big values.
+ *         if (RedisModule_DefragCursorGet(ctx,&i) == REDISMODULE_ERR)
+ *             return 1;
+ *         for (; i < len; i++) {
+ *             if (RedisModule_DefragShouldStop(ctx)) {
+ *                 RedisModule_DefragCursorSet(ctx,i);
+ *                 return 1;
+ *             }
+ *             ... defrag element i ...
+ *         }
+ *         return 0;
+ *     }
+ */
+int RM_DefragCursorSet(RedisModuleDefragCtx *ctx, unsigned long cursor) {
+    if (!ctx->cursor) return REDISMODULE_ERR;
+    *ctx->cursor = cursor;
+    return REDISMODULE_OK;
+}
+
+/* Get the position stored with RedisModule_DefragCursorSet(), which is 0
+ * at the first call of an incremental defrag. Returns REDISMODULE_ERR if
+ * the defrag is not incremental. */
+int RM_DefragCursorGet(RedisModuleDefragCtx *ctx, unsigned long *cursor) {
+    if (!ctx->cursor) return REDISMODULE_ERR;
+    *cursor = *ctx->cursor;
+    return REDISMODULE_OK;
+}
 
 /* --------------------------------------------------------------------------
  * Module fork API
@@ -6902,6 +7542,10 @@ void moduleInitModulesSystem(void) {
     /* Setup the event listeners data structures. */
     RedisModule_EventListeners = listCreate();
 
+    /* Snapshots requested by module threads. */
+    moduleSnapshotRequests = listCreate();
+    moduleMainThread = pthread_self();
+
     /* Our thread-safe contexts GIL must start with already locked:
      * it is just unlocked when it's safe. */
     pthread_mutex_lock(&moduleGIL);
@@ -6957,6 +7601,7 @@ void moduleUnregisterCommands(struct RedisModule *module) {
                 dictDelete(server.commands,cmdname);
                 dictDelete(server.orig_commands,cmdname);
                 sdsfree(cmdname);
+                zfree(cp->rediscmd->latency_histogram);
                 zfree(cp->rediscmd);
                 zfree(cp);
             }
@@ -7325,6 +7970,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(ReplyWithEmptyArray);
     REGISTER_API(ReplySetArrayLength);
     REGISTER_API(ReplyWithString);
+    REGISTER_API(ReplyWithStringNoCopy);
     REGISTER_API(ReplyWithEmptyString);
     REGISTER_API(ReplyWithVerbatimString);
     REGISTER_API(ReplyWithStringBuffer);
@@ -7345,6 +7991,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(StringToDouble);
     REGISTER_API(StringToLongDouble);
     REGISTER_API(Call);
+    REGISTER_API(CallArgv);
     REGISTER_API(CallReplyProto);
     REGISTER_API(FreeCallReply);
     REGISTER_API(CallReplyInteger);
@@ -7439,6 +8086,11 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(FreeThreadSafeContext);
     REGISTER_API(ThreadSafeContextLock);
     REGISTER_API(ThreadSafeContextUnlock);
+    REGISTER_API(ThreadSafeKeySnapshot);
+    REGISTER_API(KeySnapshotType);
+    REGISTER_API(KeySnapshotLength);
+    REGISTER_API(KeySnapshotElement);
+    REGISTER_API(FreeKeySnapshot);
     REGISTER_API(DigestAddStringBuffer);
     REGISTER_API(DigestAddLongLong);
     REGISTER_API(DigestEndSequence);
@@ -7453,6 +8105,8 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(CreateTimer);
     REGISTER_API(StopTimer);
     REGISTER_API(GetTimerInfo);
+    REGISTER_API(EventLoopAdd);
+    REGISTER_API(EventLoopDel);
     REGISTER_API(GetMyClusterID);
     REGISTER_API(GetClusterSize);
     REGISTER_API(GetRandomBytes);
@@ -7528,4 +8182,9 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(ScanCursorRestart);
     REGISTER_API(Scan);
     REGISTER_API(ScanKey);
+    REGISTER_API(DefragAlloc);
+    REGISTER_API(DefragRedisModuleString);
+    REGISTER_API(DefragShouldStop);
+    REGISTER_API(DefragCursorSet);
+    REGISTER_API(DefragCursorGet);
 }
@@ -35,6 +35,7 @@
 void initClientMultiState(client *c) {
     c->mstate.commands = NULL;
     c->mstate.count = 0;
+    c->mstate.alloc_count = 0;
     c->mstate.cmd_flags = 0;
 }
 
@@ -53,22 +54,35 @@ void freeClientMultiState(client *c) {
     zfree(c->mstate.commands);
 }
 
-/* Add a new command into the MULTI commands queue */
+/* Add a new command into the MULTI commands queue. The queue takes the
+ * ownership of the client argv, instead of copying it, so the client will
+ * allocate a new argv for the next command. */
 void queueMultiCommand(client *c) {
     multiCmd *mc;
-    int j;
 
-    c->mstate.commands = zrealloc(c->mstate.commands,
-            sizeof(multiCmd)*(c->mstate.count+1));
+    /* The queued commands are released by EXEC or DISCARD, with the DB
+     * of the client as accounting DB: account what they use to it as well,
+     * see dbstats.c. */
+    redisDb *prev = dbMemoryAccountingSwitch(c->db);
+    dbMemoryAccount(c->db,dbArgvMemory(c->argv,c->argc,0)+
+                          zmalloc_size(c->argv));
+    if (c->mstate.count == c->mstate.alloc_count) {
+        c->mstate.alloc_count = c->mstate.alloc_count ?
+                                c->mstate.alloc_count*2 : 2;
+        c->mstate.commands = zrealloc(c->mstate.commands,
+                sizeof(multiCmd)*c->mstate.alloc_count);
+    }
     mc = c->mstate.commands+c->mstate.count;
     mc->cmd = c->cmd;
     mc->argc = c->argc;
-    mc->argv = zmalloc(sizeof(robj*)*c->argc);
-    memcpy(mc->argv,c->argv,sizeof(robj*)*c->argc);
-    for (j = 0; j < c->argc; j++)
-        incrRefCount(mc->argv[j]);
+    mc->argv = c->argv;
+    mc->argv_len = c->argv_len;
+    c->argv = NULL;
+    c->argc = 0;
+    c->argv_len = 0;
     c->mstate.count++;
     c->mstate.cmd_flags |= c->cmd->flags;
+    dbMemoryAccountingSwitch(prev);
 }
 
 void discardTransaction(client *c) {
@@ -116,7 +130,7 @@ void execCommandPropagateMulti(client *c) {
 void execCommand(client *c) {
     int j;
     robj **orig_argv;
-    int orig_argc;
+    int orig_argc, orig_argv_len;
     struct redisCommand *orig_cmd;
     int must_propagate = 0; /* Need to propagate MULTI/EXEC to AOF / slaves? */
     int was_master = server.masterhost == NULL;
@@ -132,6 +146,7 @@ void execCommand(client *c) {
      * A failed EXEC in the first case returns a multi bulk nil object
      * (technically it is not an error but a special behavior), while
      * in the second an EXECABORT error is returned. */
+    if (watchedKeysTouched(c)) c->flags |= CLIENT_DIRTY_CAS;
     if (c->flags & (CLIENT_DIRTY_CAS|CLIENT_DIRTY_EXEC)) {
         addReply(c, c->flags & CLIENT_DIRTY_EXEC ? shared.execaborterr :
                                                    shared.nullarray[c->resp]);
@@ -158,12 +173,23 @@ void execCommand(client *c) {
     unwatchAllKeys(c); /* Unwatch ASAP otherwise we'll waste CPU cycles */
     orig_argv = c->argv;
     orig_argc = c->argc;
+    orig_argv_len = c->argv_len;
     orig_cmd = c->cmd;
     addReplyArrayLen(c,c->mstate.count);
+    /* The replication stream of the transaction is added to the replication
+     * buffer as a single block. EXEC may be nested if called by a module. */
+    int batch = !server.loading && server.repl_batch == NULL;
+    if (batch) replicationBeginBatch();
     for (j = 0; j < c->mstate.count; j++) {
         c->argc = c->mstate.commands[j].argc;
         c->argv = c->mstate.commands[j].argv;
+        c->argv_len = c->mstate.commands[j].argv_len;
         c->cmd = c->mstate.commands[j].cmd;
+        resetClientCommandKeys(c);
+
+        /* Administrative commands may change the replication state, for
+         * instance with REPLICAOF: what they see must be up to date. */
+        if (c->cmd->flags & CMD_ADMIN) replicationFlushBatch();
 
         /* Propagate a MULTI request once we encounter the first command which
          * is not readonly nor an administrative one.
@@ -192,11 +218,15 @@ void execCommand(client *c) {
         /* Commands may alter argc/argv, restore mstate. */
         c->mstate.commands[j].argc = c->argc;
         c->mstate.commands[j].argv = c->argv;
+        c->mstate.commands[j].argv_len = c->argv_len;
         c->mstate.commands[j].cmd = c->cmd;
     }
+    if (batch) replicationEndBatch();
     c->argv = orig_argv;
     c->argc = orig_argc;
+    c->argv_len = orig_argv_len;
     c->cmd = orig_cmd;
+    resetClientCommandKeys(c);
     discardTransaction(c);
 
     /* Make sure the EXEC command will be propagated as well if MULTI
@@ -211,7 +241,7 @@ void execCommand(client *c) {
          * backlog with the final EXEC. */
         if (server.repl_backlog && was_master && !is_master) {
             char *execcmd = "*1\r\n$4\r\nEXEC\r\n";
-            feedReplicationBacklog(execcmd,strlen(execcmd));
+            feedReplicationBuffer(execcmd,strlen(execcmd));
         }
     }
 
@@ -227,24 +257,36 @@ handle_monitor:
 
 /* ===================== WATCH (CAS alike for MULTI/EXEC) ===================
  *
- * The implementation uses a per-DB hash table mapping keys to list of clients
- * WATCHing those keys, so that given a key that is going to be modified
- * we can mark all the associated clients as dirty.
+ * The implementation uses a per-DB hash table mapping the watched keys to
+ * a version number, that is incremented every time the key is modified.
+ * Every client remembers the version of the keys it is watching at the time
+ * of WATCH, so that EXEC can check if some key was modified in the meantime
+ * just comparing the versions. This way touching a key costs the same no
+ * matter how many clients are watching it. The versions are created lazily
+ * on WATCH, and removed when the last client watching the key unwatches it.
  *
  * Also every client contains a list of WATCHed keys so that's possible to
  * un-watch such keys when the client is freed or when UNWATCH is called. */
 
+/* Value of the db->watched_keys hash table. */
+typedef struct watchedKeyVersion {
+    unsigned long long version; /* Incremented every time the key is touched. */
+    long watchers;              /* Number of clients watching the key. */
+} watchedKeyVersion;
+
 /* In the client->watched_keys list we need to use watchedKey structures
  * as in order to identify a key in Redis we need both the key name and the
  * DB */
 typedef struct watchedKey {
     robj *key;
     redisDb *db;
+    watchedKeyVersion *kv;      /* Version of the key in db->watched_keys. */
+    unsigned long long version; /* Version of the key at WATCH time. */
 } watchedKey;
 
 /* Watch for the specified key */
 void watchForKey(client *c, robj *key) {
-    list *clients = NULL;
+    watchedKeyVersion *kv;
     listIter li;
     listNode *ln;
     watchedKey *wk;
@@ -257,17 +299,21 @@ void watchForKey(client *c, robj *key) {
             return; /* Key already watched */
     }
     /* This key is not already watched in this DB. Let's add it */
-    clients = dictFetchValue(c->db->watched_keys,key);
-    if (!clients) {
-        clients = listCreate();
-        dictAdd(c->db->watched_keys,key,clients);
+    kv = dictFetchValue(c->db->watched_keys,key);
+    if (!kv) {
+        kv = zmalloc(sizeof(*kv));
+        kv->version = 0;
+        kv->watchers = 0;
+        dictAdd(c->db->watched_keys,key,kv);
         incrRefCount(key);
     }
-    listAddNodeTail(clients,c);
+    kv->watchers++;
     /* Add the new key to the list of keys watched by this client */
     wk = zmalloc(sizeof(*wk));
     wk->key = key;
     wk->db = c->db;
+    wk->kv = kv;
+    wk->version = kv->version;
     incrRefCount(key);
     listAddNodeTail(c->watched_keys,wk);
 }
@@ -281,17 +327,13 @@ void unwatchAllKeys(client *c) {
     if (listLength(c->watched_keys) == 0) return;
     listRewind(c->watched_keys,&li);
     while((ln = listNext(&li))) {
-        list *clients;
         watchedKey *wk;
 
-        /* Lookup the watched key -> clients list and remove the client
-         * from the list */
+        /* Kill the version of the key at all if this was the only client
+         * watching it. */
         wk = listNodeValue(ln);
-        clients = dictFetchValue(wk->db->watched_keys, wk->key);
-        serverAssertWithInfo(c,NULL,clients != NULL);
-        listDelNode(clients,listSearchKey(clients,c));
-        /* Kill the entry at all if this was the only client */
-        if (listLength(clients) == 0)
+        serverAssertWithInfo(c,NULL,wk->kv->watchers > 0);
+        if (--wk->kv->watchers == 0)
             dictDelete(wk->db->watched_keys, wk->key);
         /* Remove this watched key from the client->watched list */
         listDelNode(c->watched_keys,ln);
@@ -300,25 +342,51 @@ void unwatchAllKeys(client *c) {
     }
 }
 
+/* Return true if some of the keys watched by the client was touched after
+ * the client started watching it, so that EXEC must fail. */
+int watchedKeysTouched(client *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(c->watched_keys,&li);
+    while((ln = listNext(&li))) {
+        watchedKey *wk = listNodeValue(ln);
+        if (wk->kv->version != wk->version) return 1;
+    }
+    return 0;
+}
+
 /* "Touch" a key, so that if this key is being WATCHed by some client the
  * next EXEC will fail. */
 void touchWatchedKey(redisDb *db, robj *key) {
-    list *clients;
-    listIter li;
-    listNode *ln;
+    watchedKeyVersion *kv;
 
     if (dictSize(db->watched_keys) == 0) return;
-    clients = dictFetchValue(db->watched_keys, key);
-    if (!clients) return;
-
-    /* Mark all the clients watching this key as CLIENT_DIRTY_CAS */
-    /* Check if we are already watching for this key */
-    listRewind(clients,&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
+    kv = dictFetchValue(db->watched_keys, key);
+    if (kv) kv->version++;
+}
 
-        c->flags |= CLIENT_DIRTY_CAS;
+/* Touch all the watched keys of the DB 'emptied' that exist in it, since
+ * they are going to be removed. If 'replaced_with' is not NULL the DB is
+ * going to be replaced by it, for instance by SWAPDB, so the keys that will
+ * appear when the DBs are swapped are touched as well. */
+void touchAllWatchedKeysInDb(redisDb *emptied, redisDb *replaced_with) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (dictSize(emptied->watched_keys) == 0) return;
+    di = dictGetIterator(emptied->watched_keys);
+    while((de = dictNext(di)) != NULL) {
+        robj *key = dictGetKey(de);
+        watchedKeyVersion *kv = dictGetVal(de);
+
+        if (dictFind(emptied->dict, key->ptr) != NULL ||
+            (replaced_with && dictFind(replaced_with->dict, key->ptr) != NULL))
+        {
+            kv->version++;
+        }
     }
+    dictReleaseIterator(di);
 }
 
 /* On FLUSHDB or FLUSHALL all the watched keys that are present before the
@@ -326,25 +394,11 @@ void touchWatchedKey(redisDb *db, robj *key) {
  * be touched. "dbid" is the DB that's getting the flush. -1 if it is
  * a FLUSHALL operation (all the DBs flushed). */
 void touchWatchedKeysOnFlush(int dbid) {
-    listIter li1, li2;
-    listNode *ln;
+    int j;
 
-    /* For every client, check all the waited keys */
-    listRewind(server.clients,&li1);
-    while((ln = listNext(&li1))) {
-        client *c = listNodeValue(ln);
-        listRewind(c->watched_keys,&li2);
-        while((ln = listNext(&li2))) {
-            watchedKey *wk = listNodeValue(ln);
-
-            /* For every watched key matching the specified DB, if the
-             * key exists, mark the client as dirty, as the key will be
-             * removed. */
-            if (dbid == -1 || wk->db->id == dbid) {
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
-                    c->flags |= CLIENT_DIRTY_CAS;
-            }
-        }
+    for (j = 0; j < server.dbnum; j++) {
+        if (dbid == -1 || j == dbid)
+            touchAllWatchedKeysInDb(server.db+j,NULL);
     }
 }
 
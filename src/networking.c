@@ -29,13 +29,21 @@
 
 #include "server.h"
 #include "atomicvar.h"
+#include "slowlog.h"
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <poll.h>
 #include <math.h>
 #include <ctype.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 static void setProtocolError(const char *errstr, client *c);
 int postponeClientRead(client *c);
+int throttleClientRead(client *c);
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -56,16 +64,45 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Return the bytes a reply block accounts for in c->reply_bytes: a block
+ * referencing an object counts the object as it was copied. */
+static size_t clientReplyBlockBytes(clientReplyBlock *o) {
+    if (o->obj) return o->size + sdslen(o->obj->ptr) + 2;
+    return o->size;
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    clientReplyBlock *buf = zmalloc_class(sizeof(clientReplyBlock) + old->size,
+                                         ZMALLOC_CLASS_TRANSIENT);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    buf->spilled = 0;
+    if (buf->obj) incrRefCount(buf->obj);
     return buf;
 }
 
+/* Reply blocks are released by writeToClient(), that may run in I/O threads
+ * concurrently with other threads releasing the same object, think of many
+ * clients fetching the same large key. The I/O threads only run while the
+ * main thread is waiting for them, so it is enough to drop the reference
+ * atomically here. */
 void freeClientReplyValue(void *o) {
-    zfree(o);
+    clientReplyBlock *block = o;
+
+    if (block && block->obj) {
+        int refcount;
+
+        atomicGetIncr(block->obj->refcount,refcount,-1);
+        if (refcount == 1) {
+            block->obj->refcount = 1;
+            decrRefCount(block->obj);
+        }
+    }
+    if (block && block->spilled)
+        spillRelease(block);
+    else
+        zfree_class(o,ZMALLOC_CLASS_TRANSIENT);
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -92,10 +129,12 @@ client *createClient(connection *conn) {
      * in the context of a client. When commands are executed in other
      * contexts (for instance a Lua script) we need a non connected client. */
     if (conn) {
-        connNonBlock(conn);
-        connEnableTcpNoDelay(conn);
-        if (server.tcpkeepalive)
-            connKeepAlive(conn,server.tcpkeepalive);
+        if (!(conn->flags & CONN_FLAG_SOCKET_READY)) {
+            connNonBlock(conn);
+            connEnableTcpNoDelay(conn);
+            if (server.tcpkeepalive)
+                connKeepAlive(conn,server.tcpkeepalive);
+        }
         connSetReadHandler(conn, readQueryFromClient);
         connSetPrivateData(conn, c);
     }
@@ -107,6 +146,7 @@ client *createClient(connection *conn) {
     c->conn = conn;
     c->name = NULL;
     c->bufpos = 0;
+    c->buf = NULL;
     c->qb_pos = 0;
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
@@ -114,13 +154,34 @@ client *createClient(connection *conn) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
+    memset(c->argv_pool,0,sizeof(c->argv_pool));
+    c->argv_pool_len = 0;
+    c->parsed_cmds = NULL;
+    c->parsed_cmds_count = 0;
+    c->parsed_cmds_pos = 0;
     c->cmd = c->lastcmd = NULL;
+    c->slot = -1;
+    c->io_thread_cmd_duration = 0;
+    c->read_ustime = 0;
+    c->queue_usec = 0;
+    c->reply_ustime = 0;
+    c->slowlog_id = -1;
     c->user = DefaultUser;
+    c->acl_key = NULL;
+    c->acl_key_version = 0;
+    c->cmd_keys = NULL;
+    c->cmd_numkeys = 0;
+    c->cmd_keys_cmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
     c->flags = 0;
     c->ctime = c->lastinteraction = server.unixtime;
+    c->stat_net_input_bytes = 0;
+    c->stat_net_output_bytes = 0;
+    c->stat_commands = 0;
+    c->stat_cmd_usec = 0;
     /* If the default user does not require authentication, the user is
      * directly authenticated. */
     c->authenticated = (c->user->flags & USER_FLAG_NOPASS) != 0;
@@ -133,8 +194,17 @@ client *createClient(connection *conn) {
     c->slave_listening_port = 0;
     c->slave_ip[0] = '\0';
     c->slave_capa = SLAVE_CAPA_NONE;
+    c->ref_repl_buf_node = NULL;
+    c->ref_block_pos = 0;
+    c->repl_compress = 0;
+    c->repl_compress_buf = NULL;
+    c->repl_cdc = NULL;
+    c->repl_compress_len = 0;
+    c->repl_compress_sent = 0;
     c->reply = listCreate();
     c->reply_bytes = 0;
+    c->reply_spilled_bytes = 0;
+    c->reply_spill_last = NULL;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
     listSetDupMethod(c->reply,dupClientReplyValue);
@@ -147,16 +217,30 @@ client *createClient(connection *conn) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.wait_node = NULL;
+    c->bpop.tiered_pending = 0;
     c->woff = 0;
+    c->aof_woff = 0;
+    c->write_reploff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
+    c->pubsubshard_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;
     c->client_list_node = NULL;
+    c->throttled_node = NULL;
+    c->last_memory_usage = 0;
+    c->last_memory_slave = 0;
+    c->mem_usage_bucket = -1;
+    c->mem_usage_bucket_node = NULL;
     c->client_tracking_redirection = 0;
+    c->client_tracking_prefixes = NULL;
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
-    if (conn) linkClient(c);
+    if (conn) {
+        linkClient(c);
+        updateClientMemUsage(c);
+    }
     initClientMultiState(c);
     return c;
 }
@@ -182,8 +266,14 @@ void clientInstallWriteHandler(client *c) {
          * loop, we can try to directly write to the client sockets avoiding
          * a system call. We'll only really install the write handler if
          * we'll not be able to write the whole reply at once. */
+        redisDb *prev = dbMemoryAccountingSwitch(NULL);
         c->flags |= CLIENT_PENDING_WRITE;
-        listAddNodeHead(server.clients_pending_write,c);
+        /* The replicas and the CLIENT PRIORITY clients are served first. */
+        if (c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PRIORITY))
+            listAddNodeHead(server.clients_pending_write,c);
+        else
+            listAddNodeTail(server.clients_pending_write,c);
+        dbMemoryAccountingSwitch(prev);
     }
 }
 
@@ -224,20 +314,175 @@ int prepareClientToWrite(client *c) {
 
     if (!c->conn) return C_ERR; /* Fake client for AOF loading. */
 
+    /* Slaves only send the replication stream, from the shared replication
+     * buffer: see feedReplicationBuffer(). Nothing else can be queued. */
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) return C_ERR;
+
     /* Schedule the client to write the output buffers to the socket, unless
-     * it should already be setup to do so (it has already pending data). */
-    if (!clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+     * it should already be setup to do so (it has already pending data).
+     * If an I/O thread is executing a command on behalf of this client we
+     * can't touch the global list of clients with pending writes: the
+     * main thread will do it later, see handleClientsWithPendingReadsUsingThreads(). */
+    if (!clientHasPendingReplies(c) && !(c->flags & CLIENT_IO_THREAD_CMD))
+        clientInstallWriteHandler(c);
 
     /* Authorize the caller to queue in the output buffer of this client. */
     return C_OK;
 }
 
+/* -----------------------------------------------------------------------------
+ * Pools of client buffers.
+ *
+ * The reply buffer and the query buffer of a client are only allocated when
+ * there is something to store in them, and are released by clientsCron()
+ * once empty, so that the many idle clients of a server with a lot of
+ * connections only cost their client structure. The released buffers are
+ * kept in a pool for the next clients needing one, up to
+ * CLIENT_BUF_POOL_SIZE buffers. The query buffers are also taken by the
+ * I/O threads, so the pools are protected by a mutex.
+ * -------------------------------------------------------------------------- */
+
+typedef struct clientBufPool {
+    pthread_mutex_t mutex;
+    int count;
+    void *bufs[CLIENT_BUF_POOL_SIZE];
+} clientBufPool;
+
+static clientBufPool replyBufPool = {PTHREAD_MUTEX_INITIALIZER,0,{NULL}};
+static clientBufPool queryBufPool = {PTHREAD_MUTEX_INITIALIZER,0,{NULL}};
+
+/* Take a buffer from the pool, or return NULL if it is empty. */
+static void *clientBufPoolGet(clientBufPool *pool) {
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->count) buf = pool->bufs[--pool->count];
+    pthread_mutex_unlock(&pool->mutex);
+    return buf;
+}
+
+/* Give a buffer back to the pool. Returns 0 if the pool is full, and the
+ * buffer should be freed instead. */
+static int clientBufPoolPut(clientBufPool *pool, void *buf) {
+    int added = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->count < CLIENT_BUF_POOL_SIZE) {
+        pool->bufs[pool->count++] = buf;
+        added = 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return added;
+}
+
+static char *getReplyBuffer(void) {
+    char *buf = clientBufPoolGet(&replyBufPool);
+    if (!buf) {
+        /* The output buffers are not part of the memory of the DB the
+         * command works on: the same is done for every allocation of the
+         * reply list below. */
+        redisDb *prev = dbMemoryAccountingSwitch(NULL);
+        buf = zmalloc_class(PROTO_REPLY_CHUNK_BYTES,ZMALLOC_CLASS_TRANSIENT);
+        dbMemoryAccountingSwitch(prev);
+    }
+    return buf;
+}
+
+static void putReplyBuffer(char *buf) {
+    if (buf && !clientBufPoolPut(&replyBufPool,buf)) zfree(buf);
+}
+
+/* Return an empty query buffer with room for PROTO_IOBUF_LEN bytes. */
+static sds getQueryBuffer(void) {
+    sds buf = clientBufPoolGet(&queryBufPool);
+    if (!buf) {
+        buf = sdsnewlen(SDS_NOINIT,PROTO_IOBUF_LEN);
+        sdsclear(buf);
+    }
+    return buf;
+}
+
+/* Free a query buffer, or give it back to the pool if it is one of the
+ * buffers returned by getQueryBuffer(). */
+static void putQueryBuffer(sds buf) {
+    if (sdsalloc(buf) == PROTO_IOBUF_LEN) {
+        sdsclear(buf);
+        if (clientBufPoolPut(&queryBufPool,buf)) return;
+    }
+    sdsfree(buf);
+}
+
+/* Most reads carry only complete commands, that are executed before the
+ * read returns: so the clients with an empty query buffer read into a
+ * buffer shared by all the clients served by the same thread, and a client
+ * gets a buffer of its own only when a command is received partially. See
+ * readQueryFromClient() and unshareQueryBuffer(). The buffer is never
+ * reallocated, so that it can be recognized by its address.
+ *
+ * Not used for masters, that keep the query buffer until the commands are
+ * propagated to the sub-replicas. */
+static __thread sds thread_shared_qb = NULL;
+
+static sds getSharedQueryBuffer(void) {
+    if (thread_shared_qb == NULL) {
+        thread_shared_qb = sdsnewlen(SDS_NOINIT,PROTO_IOBUF_LEN);
+        sdsclear(thread_shared_qb);
+    }
+    return thread_shared_qb;
+}
+
+/* Called once the commands in the shared query buffer were processed: give
+ * the client a private copy of the data not yet processed, if any, and
+ * leave the shared buffer empty for the next read. */
+static void unshareQueryBuffer(client *c) {
+    size_t remaining = sdslen(c->querybuf)-c->qb_pos;
+
+    if (remaining) {
+        sds qb = getQueryBuffer();
+        qb = sdscatlen(qb,c->querybuf+c->qb_pos,remaining);
+        c->querybuf = qb;
+    } else {
+        c->querybuf = sdsempty();
+    }
+    c->qb_pos = 0;
+    sdsclear(thread_shared_qb);
+}
+
+/* Called by clientsCron(): release the buffers of the client that are
+ * empty. A query buffer holding a partial command, or a reply buffer not
+ * yet sent, are retained. */
+void releaseClientIdleBuffers(client *c) {
+    if (c->buf && c->bufpos == 0) {
+        putReplyBuffer(c->buf);
+        c->buf = NULL;
+    }
+    if (sdslen(c->querybuf) == 0 && c->qb_pos == 0 &&
+        sdsalloc(c->querybuf) != 0)
+    {
+        putQueryBuffer(c->querybuf);
+        c->querybuf = sdsempty();
+    }
+}
+
+/* Memory used by the buffers waiting in the pools. */
+size_t clientBufPoolMemory(void) {
+    size_t mem = 0;
+
+    pthread_mutex_lock(&replyBufPool.mutex);
+    mem += (size_t)replyBufPool.count*PROTO_REPLY_CHUNK_BYTES;
+    pthread_mutex_unlock(&replyBufPool.mutex);
+    pthread_mutex_lock(&queryBufPool.mutex);
+    mem += (size_t)queryBufPool.count*PROTO_IOBUF_LEN;
+    pthread_mutex_unlock(&queryBufPool.mutex);
+    return mem;
+}
+
 /* -----------------------------------------------------------------------------
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
 int _addReplyToBuffer(client *c, const char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->bufpos;
+    size_t available = PROTO_REPLY_CHUNK_BYTES-c->bufpos;
 
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
@@ -248,6 +493,7 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     /* Check that the buffer has enough space available for this string. */
     if (len > available) return C_ERR;
 
+    if (c->buf == NULL) c->buf = getReplyBuffer();
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
     return C_OK;
@@ -263,8 +509,9 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
      * addDeferredMultiBulkLength() is used, it sets a dummy node to NULL just
      * fo fill it later, when the size of the bulk length is set. */
 
-    /* Append to tail string when possible. */
-    if (tail) {
+    /* Append to tail string when possible. Blocks referencing an object
+     * can't be extended, the object is sent after their buffer. */
+    if (tail && !tail->obj) {
         /* Copy the part we can fit into the tail, and leave the rest for a
          * new node */
         size_t avail = tail->size - tail->used;
@@ -278,15 +525,114 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* Create a new node, make sure it is allocated to at
          * least PROTO_REPLY_CHUNK_BYTES */
         size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
-        tail = zmalloc(size + sizeof(clientReplyBlock));
+        redisDb *prev = dbMemoryAccountingSwitch(NULL);
+        tail = zmalloc_class(size + sizeof(clientReplyBlock),ZMALLOC_CLASS_TRANSIENT);
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
+        tail->spilled = 0;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
+        asyncCloseClientOnOutputBufferLimitReached(c);
+        dbMemoryAccountingSwitch(prev);
+        return;
+    }
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+/* Reserve 'len' contiguous bytes at the end of the client output buffer and
+ * return a pointer to them, so that the caller can format the reply in
+ * place instead of building it in a temporary buffer to copy it. The
+ * caller must write exactly 'len' bytes. The static buffer is used if
+ * possible, then the tail block of the reply list, then a new block.
+ *
+ * NULL is returned if nothing should be added to the output buffer,
+ * because the client is going to be closed after the current reply. */
+static char *_addReplyReserve(client *c, size_t len) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return NULL;
+
+    if (listLength(c->reply) == 0 &&
+        len <= (size_t)(PROTO_REPLY_CHUNK_BYTES-c->bufpos))
+    {
+        if (c->buf == NULL) c->buf = getReplyBuffer();
+        char *p = c->buf+c->bufpos;
+        c->bufpos += len;
+        return p;
+    }
+
+    listNode *ln = listLast(c->reply);
+    clientReplyBlock *tail = ln? listNodeValue(ln): NULL;
+    char *p;
+
+    if (tail && !tail->obj && tail->size - tail->used >= len) {
+        p = tail->buf + tail->used;
+        tail->used += len;
+    } else {
+        size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
+        redisDb *prev = dbMemoryAccountingSwitch(NULL);
+        tail = zmalloc_class(size + sizeof(clientReplyBlock),ZMALLOC_CLASS_TRANSIENT);
+        tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
+        tail->used = len;
+        tail->obj = NULL;
+        tail->spilled = 0;
+        listAddNodeTail(c->reply, tail);
+        c->reply_bytes += tail->size;
+        dbMemoryAccountingSwitch(prev);
+        p = tail->buf;
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
+    return p;
+}
+
+/* Write <prefix><ll><crlf> at 'p', where 'len' is the length of the
+ * number as returned by sdigits10(). Returns the pointer past the CRLF. */
+static char *_writeReplyLongLongWithPrefix(char *p, char prefix,
+                                           long long ll, uint32_t len)
+{
+    *p++ = prefix;
+    if (ll < 0) {
+        *p++ = '-';
+        len--;
+        ull2digits(p,len,ll == LLONG_MIN ? (unsigned long long)LLONG_MAX+1 :
+                                           (unsigned long long)-ll);
+    } else {
+        ull2digits(p,len,ll);
+    }
+    p += len;
+    *p++ = '\r';
+    *p++ = '\n';
+    return p;
+}
+
+/* Add the bulk reply of the 'len' bytes at 'p' to the output buffer, with
+ * the header, the payload and the final CRLF written at once. Used by the
+ * addReplyBulk...() functions when the client is ready to write. */
+static void _addReplyBulkCBuffer(client *c, const void *p, size_t len) {
+    uint32_t hdrlen = digits10(len);
+    size_t total = 1+hdrlen+2+len+2;
+
+    /* Large payloads are appended in pieces instead, filling the free
+     * space of the tail block before allocating a new one. */
+    if (total > PROTO_REPLY_CHUNK_BYTES) {
+        char hdr[LONG_STR_SIZE+3];
+        size_t l = _writeReplyLongLongWithPrefix(hdr,'$',len,hdrlen)-hdr;
+        if (_addReplyToBuffer(c,hdr,l) != C_OK)
+            _addReplyProtoToList(c,hdr,l);
+        if (_addReplyToBuffer(c,p,len) != C_OK)
+            _addReplyProtoToList(c,p,len);
+        if (_addReplyToBuffer(c,"\r\n",2) != C_OK)
+            _addReplyProtoToList(c,"\r\n",2);
+        return;
+    }
+
+    char *dst = _addReplyReserve(c,total);
+    if (dst == NULL) return;
+    dst = _writeReplyLongLongWithPrefix(dst,'$',len,hdrlen);
+    memcpy(dst,p,len);
+    dst[len] = '\r';
+    dst[len+1] = '\n';
 }
 
 /* -----------------------------------------------------------------------------
@@ -309,6 +655,17 @@ void addReply(client *c, robj *obj) {
         size_t len = ll2string(buf,sizeof(buf),(long)obj->ptr);
         if (_addReplyToBuffer(c,buf,len) != C_OK)
             _addReplyProtoToList(c,buf,len);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Roaring bitmaps not converted by lookupKey(), for instance
+         * the ones read by Gopher requests. */
+        robj *dec = getDecodedObject(obj);
+        addReply(c,dec);
+        decrRefCount(dec);
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        size_t len;
+        char *buf = stringDecompressToScratch(obj,&len);
+        if (_addReplyToBuffer(c,buf,len) != C_OK)
+            _addReplyProtoToList(c,buf,len);
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
@@ -350,6 +707,11 @@ void addReplyProto(client *c, const char *s, size_t len) {
  * code provided is used, otherwise the string "-ERR " for the generic
  * error code is automatically added. */
 void addReplyErrorLength(client *c, const char *s, size_t len) {
+    if (luaNativeReply(c)) {
+        luaReplyPushStatus(c,s,len,'-');
+        return;
+    }
+
     /* If the string already starts with "-..." then the error code
      * is provided by the caller. Otherwise we use "-ERR". */
     if (!len || s[0] != '-') addReplyProto(c,"-ERR ",5);
@@ -397,6 +759,10 @@ void addReplyErrorFormat(client *c, const char *fmt, ...) {
 }
 
 void addReplyStatusLength(client *c, const char *s, size_t len) {
+    if (luaNativeReply(c)) {
+        luaReplyPushStatus(c,s,len,'+');
+        return;
+    }
     addReplyProto(c,"+",1);
     addReplyProto(c,s,len);
     addReplyProto(c,"\r\n",2);
@@ -418,25 +784,43 @@ void addReplyStatusFormat(client *c, const char *fmt, ...) {
 /* Adds an empty object to the reply list that will contain the multi bulk
  * length, which is not known when this function is called. */
 void *addReplyDeferredLen(client *c) {
+    if (luaNativeReply(c)) return luaReplyPushDeferredLen(c);
+
     /* Note that we install the write event here even if the object is not
      * ready to be sent, since we are sure that before returning to the
      * event loop setDeferredAggregateLen() will be called. */
     if (prepareClientToWrite(c) != C_OK) return NULL;
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
     listAddNodeTail(c->reply,NULL); /* NULL is our placeholder. */
+    dbMemoryAccountingSwitch(prev);
     return listLast(c->reply);
 }
 
-/* Populate the length object and try gluing it to the next chunk. */
-void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
+/* Return the shared "<prefix><length>\r\n" protocol header, or NULL if
+ * there is none for this prefix and length. */
+static robj *sharedLengthHeader(char prefix, long long length) {
+    if (length < 0 || length >= OBJ_SHARED_BULKHDR_LEN) return NULL;
+    switch(prefix) {
+    case '*': return shared.mbulkhdr[length];
+    case '$': return shared.bulkhdr[length];
+    case '%': return shared.maphdr[length];
+    case '~': return shared.sethdr[length];
+    default: return NULL;
+    }
+}
+
+/* Populate the node added by addReplyDeferredLen() with the protocol 's'
+ * of 'length' bytes, trying to glue it to the next chunk. When 'length' is
+ * zero the node is just removed. */
+void setDeferredReply(client *c, void *node, const char *s, size_t length) {
     listNode *ln = (listNode*)node;
     clientReplyBlock *next;
-    char lenstr[128];
-    size_t lenstr_len = sprintf(lenstr, "%c%ld\r\n", prefix, length);
 
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addReplyDeferredLen() */
     if (node == NULL) return;
     serverAssert(!listNodeValue(ln));
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
 
     /* Normally we fill this dummy NULL node, added by addReplyDeferredLen(),
      * with a new buffer structure containing the protocol needed to specify
@@ -448,24 +832,51 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
      * - The next node is non-NULL,
      * - It has enough room already allocated
      * - And not too large (avoid large memmove) */
-    if (ln->next != NULL && (next = listNodeValue(ln->next)) &&
-        next->size - next->used >= lenstr_len &&
+    if (length == 0) {
+        listDelNode(c->reply,ln);
+    } else if (ln->next != NULL && (next = listNodeValue(ln->next)) &&
+        next->size - next->used >= length &&
         next->used < PROTO_REPLY_CHUNK_BYTES * 4) {
-        memmove(next->buf + lenstr_len, next->buf, next->used);
-        memcpy(next->buf, lenstr, lenstr_len);
-        next->used += lenstr_len;
+        memmove(next->buf + length, next->buf, next->used);
+        memcpy(next->buf, s, length);
+        next->used += length;
         listDelNode(c->reply,ln);
     } else {
         /* Create a new node */
-        clientReplyBlock *buf = zmalloc(lenstr_len + sizeof(clientReplyBlock));
+        clientReplyBlock *buf = zmalloc_class(length + sizeof(clientReplyBlock),
+                                              ZMALLOC_CLASS_TRANSIENT);
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
-        buf->used = lenstr_len;
-        memcpy(buf->buf, lenstr, lenstr_len);
+        buf->used = length;
+        buf->obj = NULL;
+        buf->spilled = 0;
+        memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
+    dbMemoryAccountingSwitch(prev);
+}
+
+/* Populate the length object and try gluing it to the next chunk. */
+void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
+    char lenstr[128];
+    robj *hdr = sharedLengthHeader(prefix,length);
+    size_t lenstr_len;
+
+    if (hdr) {
+        lenstr_len = sdslen(hdr->ptr);
+        memcpy(lenstr,hdr->ptr,lenstr_len);
+    } else {
+        lenstr_len = sprintf(lenstr, "%c%ld\r\n", prefix, length);
+    }
+
+    if (node == NULL) return;
+    if (luaNativeReply(c)) {
+        luaReplySetDeferredLen(c,node,length,prefix);
+        return;
+    }
+    setDeferredReply(c,node,lenstr,lenstr_len);
 }
 
 void setDeferredArrayLen(client *c, void *node, long length) {
@@ -505,17 +916,29 @@ void addReplyDouble(client *c, double d) {
             addReplyProto(c, d > 0 ? ",inf\r\n" : ",-inf\r\n",
                               d > 0 ? 6 : 7);
         }
+    } else if (d >= 0 && d < OBJ_SHARED_DOUBLES && d == (long)d &&
+               !signbit(d) && !luaNativeReply(c))
+    {
+        /* Small integer values, like the scores of many sorted sets, have
+         * their reply ready. */
+        addReply(c,c->resp == 2 ? shared.bulkdouble[(long)d] :
+                                  shared.resp3double[(long)d]);
     } else {
-        char dbuf[MAX_LONG_DOUBLE_CHARS+3],
-             sbuf[MAX_LONG_DOUBLE_CHARS+32];
-        int dlen, slen;
+        /* d2string() formats like "%.17g", but integers and values with
+         * short binary fractions don't need snprintf(). */
+        char dbuf[MAX_D2STRING_CHARS+3];
+        int dlen;
         if (c->resp == 2) {
-            dlen = snprintf(dbuf,sizeof(dbuf),"%.17g",d);
-            slen = snprintf(sbuf,sizeof(sbuf),"$%d\r\n%s\r\n",dlen,dbuf);
-            addReplyProto(c,sbuf,slen);
+            dlen = d2string(dbuf,sizeof(dbuf),d);
+            addReplyBulkCBuffer(c,dbuf,dlen);
         } else {
-            dlen = snprintf(dbuf,sizeof(dbuf),",%.17g\r\n",d);
-            addReplyProto(c,dbuf,dlen);
+            if (prepareClientToWrite(c) != C_OK) return;
+            dlen = d2string(dbuf+1,sizeof(dbuf)-3,d);
+            dbuf[0] = ',';
+            dbuf[dlen+1] = '\r';
+            dbuf[dlen+2] = '\n';
+            if (_addReplyToBuffer(c,dbuf,dlen+3) != C_OK)
+                _addReplyProtoToList(c,dbuf,dlen+3);
         }
     }
 }
@@ -538,31 +961,30 @@ void addReplyHumanLongDouble(client *c, long double d) {
 }
 
 /* Add a long long as integer reply or bulk len / multi bulk count.
- * Basically this is used to output <prefix><long long><crlf>. */
+ * Basically this is used to output <prefix><long long><crlf>.
+ * Since these headers are emitted very often by the protocol, they are
+ * written directly into the output buffer. */
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
-    char buf[128];
-    int len;
+    if (prepareClientToWrite(c) != C_OK) return;
 
-    /* Things like $3\r\n or *2\r\n are emitted very often by the protocol
-     * so we have a few shared objects to use if the integer is small
-     * like it is most of the times. */
-    if (prefix == '*' && ll < OBJ_SHARED_BULKHDR_LEN && ll >= 0) {
-        addReply(c,shared.mbulkhdr[ll]);
-        return;
-    } else if (prefix == '$' && ll < OBJ_SHARED_BULKHDR_LEN && ll >= 0) {
-        addReply(c,shared.bulkhdr[ll]);
+    /* Small aggregate and bulk lengths are copied from shared headers. */
+    robj *hdr = sharedLengthHeader(prefix,ll);
+    if (hdr) {
+        size_t hdrlen = sdslen(hdr->ptr);
+        char *p = _addReplyReserve(c,hdrlen);
+        if (p) memcpy(p,hdr->ptr,hdrlen);
         return;
     }
 
-    buf[0] = prefix;
-    len = ll2string(buf+1,sizeof(buf)-1,ll);
-    buf[len+1] = '\r';
-    buf[len+2] = '\n';
-    addReplyProto(c,buf,len+3);
+    uint32_t len = sdigits10(ll);
+    char *p = _addReplyReserve(c,len+3);
+    if (p) _writeReplyLongLongWithPrefix(p,prefix,ll,len);
 }
 
 void addReplyLongLong(client *c, long long ll) {
-    if (ll == 0)
+    if (luaNativeReply(c))
+        luaReplyPushLongLong(c,ll);
+    else if (ll == 0)
         addReply(c,shared.czero);
     else if (ll == 1)
         addReply(c,shared.cone);
@@ -571,8 +993,8 @@ void addReplyLongLong(client *c, long long ll) {
 }
 
 void addReplyAggregateLen(client *c, long length, int prefix) {
-    if (prefix == '*' && length < OBJ_SHARED_BULKHDR_LEN)
-        addReply(c,shared.mbulkhdr[length]);
+    if (luaNativeReply(c))
+        luaReplyPushAggregateLen(c,length,prefix);
     else
         addReplyLongLongWithPrefix(c,length,prefix);
 }
@@ -604,7 +1026,9 @@ void addReplyPushLen(client *c, long length) {
 }
 
 void addReplyNull(client *c) {
-    if (c->resp == 2) {
+    if (luaNativeReply(c)) {
+        luaReplyPushNull(c);
+    } else if (c->resp == 2) {
         addReplyProto(c,"$-1\r\n",5);
     } else {
         addReplyProto(c,"_\r\n",3);
@@ -612,7 +1036,9 @@ void addReplyNull(client *c) {
 }
 
 void addReplyBool(client *c, int b) {
-    if (c->resp == 2) {
+    if (luaNativeReply(c)) {
+        luaReplyPushBool(c,b);
+    } else if (c->resp == 2) {
         addReply(c, b ? shared.cone : shared.czero);
     } else {
         addReplyProto(c, b ? "#t\r\n" : "#f\r\n",4);
@@ -624,7 +1050,9 @@ void addReplyBool(client *c, int b) {
  * RESP2 protocol, however for RESP3 the reply will always be just the
  * Null type "_\r\n". */
 void addReplyNullArray(client *c) {
-    if (c->resp == 2) {
+    if (luaNativeReply(c)) {
+        luaReplyPushNull(c);
+    } else if (c->resp == 2) {
         addReplyProto(c,"*-1\r\n",5);
     } else {
         addReplyProto(c,"_\r\n",3);
@@ -633,33 +1061,158 @@ void addReplyNullArray(client *c) {
 
 /* Create the length prefix of a bulk reply, example: $2234 */
 void addReplyBulkLen(client *c, robj *obj) {
-    size_t len = stringObjectLen(obj);
+    addReplyLongLongWithPrefix(c,stringObjectLen(obj),'$');
+}
 
-    if (len < OBJ_SHARED_BULKHDR_LEN)
-        addReply(c,shared.bulkhdr[len]);
-    else
-        addReplyLongLongWithPrefix(c,len,'$');
+/* Return true if the replies of the client can reference objects instead
+ * of copying them. This is possible only when the reply is sent to a socket:
+ * fake clients (Lua, modules) read the reply blocks directly. I/O threads
+ * executing commands can't retain objects concurrently: see
+ * ioThreadExecuteCommand(). */
+static int clientConnCanReferenceObjects(client *c) {
+    return c->conn &&
+           !(c->flags & (CLIENT_IO_THREAD_CMD|CLIENT_CLOSE_AFTER_REPLY));
+}
+
+/* Like clientConnCanReferenceObjects(), but module commands are excluded as
+ * well, since modules may modify the strings they reply with, unless they
+ * use addReplyBulkNoCopy(). */
+static int clientReplyCanReferenceObjects(client *c) {
+    return clientConnCanReferenceObjects(c) &&
+           !(c->cmd && c->cmd->flags & CMD_MODULE);
+}
+
+/* Return true if the bulk reply of 'obj' is worth queuing as a reference to
+ * the object instead of a copy. This is the case only for large strings. */
+static int replyObjectIsReferenceable(robj *obj) {
+    return obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_RAW &&
+           obj->refcount != OBJ_SHARED_REFCOUNT &&
+           sdslen(obj->ptr) >= PROTO_REPLY_OBJ_MIN_BYTES;
+}
+
+/* Return true if the bulk reply of 'obj' can be queued as a reference to
+ * the object instead of a copy. */
+static int clientReplyCanReferenceObject(client *c, robj *obj) {
+    return clientReplyCanReferenceObjects(c) && replyObjectIsReferenceable(obj);
+}
+
+/* Queue a block sending the 'hdr' protocol followed by the string 'obj',
+ * referenced instead of copied, and a final CRLF. The string will be sent
+ * directly from the object by writeToClient(). */
+static void _addReplyObjectToList(client *c, const char *hdr, size_t hdrlen,
+                                  robj *obj)
+{
+    clientReplyBlock *block;
+    size_t size = hdrlen > LONG_STR_SIZE+3 ? hdrlen : LONG_STR_SIZE+3;
+
+    /* Leave some room so that setDeferredAggregateLen() can prefix the
+     * aggregate length to this block. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
+    block = zmalloc_class(sizeof(clientReplyBlock) + size + 16,ZMALLOC_CLASS_TRANSIENT);
+    block->size = zmalloc_usable(block) - sizeof(clientReplyBlock);
+    block->used = hdrlen;
+    block->obj = obj;
+    block->spilled = 0;
+    incrRefCount(obj);
+    memcpy(block->buf, hdr, hdrlen);
+    listAddNodeTail(c->reply, block);
+    c->reply_bytes += clientReplyBlockBytes(block);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+    dbMemoryAccountingSwitch(prev);
+}
+
+/* Queue the bulk reply of 'obj' as a block referencing the object. */
+void _addReplyBulkObjectToList(client *c, robj *obj) {
+    char buf[LONG_STR_SIZE+3];
+    size_t len;
+
+    buf[0] = '$';
+    len = 1+ll2string(buf+1,sizeof(buf)-1,sdslen(obj->ptr));
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    _addReplyObjectToList(c,buf,len,obj);
+}
+
+/* Add to the client reply the 'hdr' protocol, followed by the protocol
+ * already serialized in the raw string object 'obj' and by a final CRLF.
+ * The object is referenced, not copied, so that the same serialized reply
+ * can be shared by the output buffers of many clients: see PUBLISH. 'hdr'
+ * must be at least one byte.
+ *
+ * Returns C_ERR, adding nothing, if the client can't reference objects in
+ * its replies: the caller should then use the normal reply functions. */
+int addReplyProtoWithObject(client *c, const char *hdr, size_t hdrlen,
+                            robj *obj)
+{
+    serverAssert(hdrlen > 0 && obj->type == OBJ_STRING &&
+                 obj->encoding == OBJ_ENCODING_RAW);
+    if (!clientReplyCanReferenceObjects(c)) return C_ERR;
+    if (prepareClientToWrite(c) != C_OK) return C_OK;
+    _addReplyObjectToList(c,hdr,hdrlen,obj);
+    return C_OK;
 }
 
 /* Add a Redis Object as a bulk reply */
 void addReplyBulk(client *c, robj *obj) {
-    addReplyBulkLen(c,obj);
-    addReply(c,obj);
-    addReply(c,shared.crlf);
+    if (luaNativeReply(c)) {
+        if (sdsEncodedObject(obj)) {
+            luaReplyPushBulk(c,obj->ptr,sdslen(obj->ptr));
+        } else {
+            robj *dec = getDecodedObject(obj);
+            luaReplyPushBulk(c,dec->ptr,sdslen(dec->ptr));
+            decrRefCount(dec);
+        }
+        return;
+    }
+    if (clientReplyCanReferenceObject(c,obj)) {
+        if (prepareClientToWrite(c) != C_OK) return;
+        _addReplyBulkObjectToList(c,obj);
+        return;
+    }
+    if (sdsEncodedObject(obj)) {
+        if (prepareClientToWrite(c) != C_OK) return;
+        _addReplyBulkCBuffer(c,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_INT) {
+        addReplyBulkLongLong(c,(long)obj->ptr);
+    } else {
+        addReplyBulkLen(c,obj);
+        addReply(c,obj);
+        addReply(c,shared.crlf);
+    }
+}
+
+/* Like addReplyBulk(), but 'obj' is referenced instead of copied, when
+ * large enough, even by module commands: the caller guarantees that the
+ * string will not be modified in place while the reply is pending. */
+void addReplyBulkNoCopy(client *c, robj *obj) {
+    if (clientConnCanReferenceObjects(c) && replyObjectIsReferenceable(obj)) {
+        if (prepareClientToWrite(c) != C_OK) return;
+        _addReplyBulkObjectToList(c,obj);
+        return;
+    }
+    addReplyBulk(c,obj);
 }
 
 /* Add a C buffer as bulk reply */
 void addReplyBulkCBuffer(client *c, const void *p, size_t len) {
-    addReplyLongLongWithPrefix(c,len,'$');
-    addReplyProto(c,p,len);
-    addReply(c,shared.crlf);
+    if (luaNativeReply(c)) {
+        luaReplyPushBulk(c,p,len);
+        return;
+    }
+    if (prepareClientToWrite(c) != C_OK) return;
+    _addReplyBulkCBuffer(c,p,len);
 }
 
 /* Add sds to reply (takes ownership of sds and frees it) */
 void addReplyBulkSds(client *c, sds s)  {
-    addReplyLongLongWithPrefix(c,sdslen(s),'$');
-    addReplySds(c,s);
-    addReply(c,shared.crlf);
+    if (luaNativeReply(c)) {
+        luaReplyPushBulk(c,s,sdslen(s));
+        sdsfree(s);
+        return;
+    }
+    if (prepareClientToWrite(c) == C_OK)
+        _addReplyBulkCBuffer(c,s,sdslen(s));
+    sdsfree(s);
 }
 
 /* Add a C null term string as bulk reply */
@@ -746,7 +1299,7 @@ void addReplySubcommandSyntaxError(client *c) {
 void AddReplyFromClient(client *dst, client *src) {
     if (prepareClientToWrite(dst) != C_OK)
         return;
-    addReplyProto(dst,src->buf, src->bufpos);
+    if (src->bufpos) addReplyProto(dst,src->buf, src->bufpos);
     if (listLength(src->reply))
         listJoin(dst->reply,src->reply);
     dst->reply_bytes += src->reply_bytes;
@@ -754,21 +1307,30 @@ void AddReplyFromClient(client *dst, client *src) {
     src->bufpos = 0;
 }
 
-/* Copy 'src' client output buffers into 'dst' client output buffers.
- * The function takes care of freeing the old output buffers of the
- * destination client. */
-void copyClientOutputBuffer(client *dst, client *src) {
-    listRelease(dst->reply);
-    dst->sentlen = 0;
-    dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
-    dst->bufpos = src->bufpos;
-    dst->reply_bytes = src->reply_bytes;
+/* Make the slave 'dst' send the same replication stream 'src' has still to
+ * send: since both use the shared replication buffer, we just need to copy
+ * the reference 'src' holds. */
+void copyReplicaOutputBuffer(client *dst, client *src) {
+    serverAssert(dst->ref_repl_buf_node == NULL);
+    if (src->ref_repl_buf_node == NULL) return;
+    dst->ref_repl_buf_node = src->ref_repl_buf_node;
+    dst->ref_block_pos = src->ref_block_pos;
+    ((replBufBlock *)listNodeValue(dst->ref_repl_buf_node))->refcount++;
 }
 
 /* Return true if the specified client has pending reply buffers to write to
  * the socket. */
 int clientHasPendingReplies(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* Slaves are fed from the shared replication buffer: they have
+         * nothing to send once the last block was fully sent. */
+        if (c->repl_compress_sent < c->repl_compress_len) return 1;
+        if (replicationCdcHasPendingOutput(c)) return 1;
+        if (c->ref_repl_buf_node == NULL) return 0;
+        listNode *ln = listLast(server.repl_buffer_blocks);
+        replBufBlock *tail = listNodeValue(ln);
+        return !(ln == c->ref_repl_buf_node && c->ref_block_pos == tail->used);
+    }
     return c->bufpos || listLength(c->reply);
 }
 
@@ -833,7 +1395,7 @@ void clientAcceptHandler(connection *conn) {
 }
 
 #define MAX_ACCEPTS_PER_CALL 1000
-static void acceptCommonHandler(connection *conn, int flags, char *ip) {
+static void acceptCommonHandler(connection *conn, uint64_t flags, char *ip) {
     client *c;
     UNUSED(ip);
 
@@ -947,12 +1509,239 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+void acceptShmHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cfd, max = MAX_ACCEPTS_PER_CALL;
+    connection *conn;
+    UNUSED(el);
+    UNUSED(mask);
+    UNUSED(privdata);
+
+    while(max--) {
+        cfd = anetUnixAccept(server.neterr, fd);
+        if (cfd == ANET_ERR) {
+            if (errno != EWOULDBLOCK)
+                serverLog(LL_WARNING,
+                    "Accepting client connection: %s", server.neterr);
+            return;
+        }
+        conn = connCreateAcceptedShm(cfd);
+        if (conn == NULL) {
+            serverLog(LL_WARNING,
+                "Creating the shared memory transport: %s", strerror(errno));
+            close(cfd);
+            continue;
+        }
+        serverLog(LL_VERBOSE,"Accepted connection to %s", server.shm_socket);
+        acceptCommonHandler(conn,CLIENT_UNIX_SOCKET|CLIENT_SHM,NULL);
+    }
+}
+
+/* With accept-threads, the TCP connections are accepted by dedicated
+ * threads instead of the main thread. Every thread polls its own listening
+ * sockets, bound with SO_REUSEPORT so that the kernel balances the incoming
+ * connections among them, sets up the accepted sockets, and queues them.
+ * A pipe then wakes up the main thread, that only creates the clients. */
+typedef struct acceptedConn {
+    int fd;
+    int port;
+    char ip[NET_IP_STR_LEN];
+} acceptedConn;
+
+static int accept_threads_fds[ACCEPT_THREADS_MAX_NUM][CONFIG_BINDADDR_MAX];
+static int accept_threads_fds_count[ACCEPT_THREADS_MAX_NUM];
+static int accept_threads_pipe[2];
+static pthread_mutex_t accept_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static list *accept_threads_queue;  /* acceptedConn structures. */
+
+void *acceptThreadMain(void *myid) {
+    long id = (unsigned long)myid;
+    int numfds = accept_threads_fds_count[id];
+    struct pollfd pfd[CONFIG_BINDADDR_MAX];
+    char err[ANET_ERR_LEN];
+
+    redisSetCpuAffinity(server.server_cpulist);
+
+    for (int j = 0; j < numfds; j++) {
+        pfd[j].fd = accept_threads_fds[id][j];
+        pfd[j].events = POLLIN;
+    }
+
+    while(1) {
+        if (poll(pfd,numfds,-1) == -1) continue;
+        for (int j = 0; j < numfds; j++) {
+            if (!(pfd[j].revents & POLLIN)) continue;
+
+            int max = MAX_ACCEPTS_PER_CALL;
+            while(max--) {
+                acceptedConn *ac = zmalloc(sizeof(*ac));
+                ac->fd = anetTcpAccept(err,pfd[j].fd,ac->ip,sizeof(ac->ip),
+                                       &ac->port);
+                if (ac->fd == ANET_ERR) {
+                    if (errno != EWOULDBLOCK)
+                        serverLog(LL_WARNING,
+                            "Accepting client connection: %s", err);
+                    zfree(ac);
+                    break;
+                }
+                anetNonBlock(NULL,ac->fd);
+                anetEnableTcpNoDelay(NULL,ac->fd);
+                if (server.tcpkeepalive)
+                    anetKeepAlive(NULL,ac->fd,server.tcpkeepalive);
+
+                /* Wake up the main thread only if the queue was empty:
+                 * otherwise it was already signaled. */
+                pthread_mutex_lock(&accept_threads_mutex);
+                listAddNodeTail(accept_threads_queue,ac);
+                int wakeup = listLength(accept_threads_queue) == 1;
+                pthread_mutex_unlock(&accept_threads_mutex);
+                if (wakeup && write(accept_threads_pipe[1],"A",1) != 1) {
+                    /* Pipe full: the main thread has a wakeup pending. */
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Create the clients of the connections queued by the accept threads. */
+void acceptThreadsPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    list *queue;
+    listIter li;
+    listNode *ln;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&accept_threads_mutex);
+    queue = accept_threads_queue;
+    accept_threads_queue = listCreate();
+    pthread_mutex_unlock(&accept_threads_mutex);
+
+    listRewind(queue,&li);
+    while((ln = listNext(&li))) {
+        acceptedConn *ac = listNodeValue(ln);
+        connection *conn = connCreateAcceptedSocket(ac->fd);
+
+        serverLog(LL_VERBOSE,"Accepted %s:%d", ac->ip, ac->port);
+        conn->flags |= CONN_FLAG_SOCKET_READY;
+        acceptCommonHandler(conn,0,ac->ip);
+        zfree(ac);
+    }
+    listRelease(queue);
+}
+
+/* Start the accept threads, if configured. The first thread uses the
+ * listening sockets of the server, the others open new ones for the same
+ * addresses. */
+void initAcceptThreads(void) {
+    if (server.accept_threads_num == 0 || server.ipfd_count == 0) return;
+
+    accept_threads_queue = listCreate();
+    if (pipe(accept_threads_pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for the accept threads: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,accept_threads_pipe[0]);
+    anetNonBlock(NULL,accept_threads_pipe[1]);
+    if (aeCreateFileEvent(server.el,accept_threads_pipe[0],AE_READABLE,
+        acceptThreadsPipeReadable,NULL) == AE_ERR)
+    {
+        serverPanic("Unrecoverable error creating the accept threads event.");
+    }
+
+    for (int i = 0; i < server.accept_threads_num; i++) {
+        pthread_t tid;
+
+        if (i == 0) {
+            memcpy(accept_threads_fds[0],server.ipfd,
+                   sizeof(int)*server.ipfd_count);
+            accept_threads_fds_count[0] = server.ipfd_count;
+        } else if (listenToPort(server.port,accept_threads_fds[i],
+                   &accept_threads_fds_count[i],ANET_REUSEPORT) == C_ERR)
+        {
+            serverLog(LL_WARNING,"Fatal: Can't listen for accept thread.");
+            exit(1);
+        }
+        if (pthread_create(&tid,NULL,acceptThreadMain,(void*)(long)i) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize accept thread.");
+            exit(1);
+        }
+    }
+}
+
+/* Argument objects of the most common commands are small EMBSTR strings
+ * that are freed as soon as the command returns, so instead of going back
+ * to the allocator for every argument, no longer referenced EMBSTR objects
+ * are kept in a small per client pool and reused to parse the next
+ * commands. Objects are pooled by size class, matching the jemalloc bins
+ * an EMBSTR object can use, so that using a recycled object for an argument
+ * never wastes more memory than allocating a new one: this matters since
+ * commands like SET take ownership of the argument object. */
+static const size_t argvPoolClassBin[PROTO_ARGV_POOL_CLASSES] = {
+    24, 32, 40, 48, 56, 64 /* jemalloc is built with an 8 bytes quantum. */
+};
+#define argvPoolClassCap(j) embeddedStringMaxLen(argvPoolClassBin[j])
+
+/* Create a string object for a client argument of 'len' bytes, using a
+ * pooled object if possible. */
+robj *createClientArgObject(client *c, const char *ptr, size_t len) {
+    if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT && c->argv_pool_len) {
+        int j = 0;
+        while (argvPoolClassCap(j) < len) j++;
+        robj *o = c->argv_pool[j];
+        if (o) {
+            c->argv_pool[j] = o->ptr;
+            c->argv_pool_len--;
+            return initEmbeddedStringObject(o,ptr,len);
+        }
+    }
+    return createStringObject(ptr,len);
+}
+
+/* Release a client argument object, recycling it into the argv pool if
+ * it was the last reference to an EMBSTR object. Pooled objects are linked
+ * together using their 'ptr' field. */
+void freeClientArgObject(client *c, robj *o) {
+    if (o->refcount == 1 && o->encoding == OBJ_ENCODING_EMBSTR &&
+        c->argv_pool_len < PROTO_ARGV_POOL_MAX)
+    {
+        size_t cap = embeddedStringMaxLen(zmalloc_size(o));
+        int j = PROTO_ARGV_POOL_CLASSES-1;
+        while (j >= 0 && argvPoolClassCap(j) > cap) j--;
+        if (j >= 0) {
+            o->ptr = c->argv_pool[j];
+            c->argv_pool[j] = o;
+            c->argv_pool_len++;
+            return;
+        }
+    }
+    decrRefCount(o);
+}
+
+/* Free all the objects in the client argv pool. */
+void freeClientArgvPool(client *c) {
+    for (int j = 0; j < PROTO_ARGV_POOL_CLASSES; j++) {
+        while (c->argv_pool[j]) {
+            robj *o = c->argv_pool[j];
+            c->argv_pool[j] = o->ptr;
+            zfree(o);
+        }
+    }
+    c->argv_pool_len = 0;
+}
+
 static void freeClientArgv(client *c) {
     int j;
     for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+        freeClientArgObject(c,c->argv[j]);
     c->argc = 0;
     c->cmd = NULL;
+    resetClientCommandKeys(c);
 }
 
 /* Close all the slaves connections. This is useful in chained replication
@@ -984,6 +1773,7 @@ void unlinkClient(client *c) {
             raxRemove(server.clients_index,(unsigned char*)&id,sizeof(id),NULL);
             listDelNode(server.clients,c->client_list_node);
             c->client_list_node = NULL;
+            updateClientMemUsage(c);
         }
 
         /* Check if this is a replica waiting for diskless replication (rdb pipe),
@@ -1021,6 +1811,13 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_READ;
     }
 
+    /* Remove from the list of delayed reads if needed. */
+    if (c->flags & CLIENT_THROTTLED) {
+        listDelNode(server.clients_throttled,c->throttled_node);
+        c->throttled_node = NULL;
+        c->flags &= ~CLIENT_THROTTLED;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -1073,10 +1870,18 @@ void freeClient(client *c) {
             replicationGetSlaveName(c));
     }
 
-    /* Free the query buffer */
-    sdsfree(c->querybuf);
+    /* Free the query and reply buffers. The client may be freed while
+     * executing a command read in the shared query buffer. */
+    if (c->querybuf == thread_shared_qb)
+        sdsclear(thread_shared_qb);
+    else
+        putQueryBuffer(c->querybuf);
+    putReplyBuffer(c->buf);
     sdsfree(c->pending_querybuf);
+    zfree(c->repl_compress_buf);
+    replicationCdcFree(c);
     c->querybuf = NULL;
+    c->buf = NULL;
 
     /* Deallocate structures used to block on blocking ops. */
     if (c->flags & CLIENT_BLOCKED) unblockClient(c);
@@ -1086,15 +1891,25 @@ void freeClient(client *c) {
     unwatchAllKeys(c);
     listRelease(c->watched_keys);
 
+    /* A slot migration streamed by this client that was not committed
+     * is aborted. */
+    if (c->flags & CLIENT_SLOT_IMPORT) clusterAbortSlotImport(c);
+
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(c,0);
+    pubsubUnsubscribeShardAllChannels(c,0);
     pubsubUnsubscribeAllPatterns(c,0);
     dictRelease(c->pubsub_channels);
+    dictRelease(c->pubsubshard_channels);
     listRelease(c->pubsub_patterns);
 
     /* Free data structures. */
     listRelease(c->reply);
     freeClientArgv(c);
+    freeClientArgvPool(c);
+    freeClientParsedCommands(c);
+    getKeysFreeResult(c->cmd_keys);
+    sdsfree(c->acl_key);
 
     /* Unlink the client: this will close the socket, remove the I/O
      * handlers, and remove references of the client from different
@@ -1117,6 +1932,7 @@ void freeClient(client *c) {
          * backlog. */
         if (c->flags & CLIENT_SLAVE && listLength(server.slaves) == 0)
             server.repl_no_slaves_since = server.unixtime;
+        freeReplicaReferencedReplBuffer(c);
         refreshGoodSlavesCount();
         /* Fire the replica change modules event. */
         if (c->replstate == SLAVE_STATE_ONLINE)
@@ -1143,6 +1959,7 @@ void freeClient(client *c) {
     zfree(c->argv);
     freeClientMultiState(c);
     sdsfree(c->peerid);
+    zfree(c->mem_usage_bucket_node);
     zfree(c);
 }
 
@@ -1184,57 +2001,168 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
-/* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed because of some
- * error.  If handler_installed is set, it will attempt to clear the
- * write event.
- *
- * This function is called by threads, but always with handler_installed
- * set to 0. So when handler_installed is set to 0 the function must be
- * thread safe. */
-int writeToClient(client *c, int handler_installed) {
-    ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    clientReplyBlock *o;
+/* Release the first block of the reply list, once sent. */
+static void releaseClientReplyHead(client *c) {
+    listNode *ln = listFirst(c->reply);
+    clientReplyBlock *o = listNodeValue(ln);
 
-    while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
-            nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+    c->reply_bytes -= clientReplyBlockBytes(o);
+    if (o->spilled) c->reply_spilled_bytes -= o->size;
+    if (c->reply_spill_last == ln) c->reply_spill_last = NULL;
+    listDelNode(c->reply,ln);
+}
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
+/* Bytes of the reply stored in the block 'o'. */
+static size_t clientReplyBlockLen(clientReplyBlock *o) {
+    return o->obj ? o->used+sdslen(o->obj->ptr)+2 : o->used;
+}
 
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
+/* Append to 'iov' the 'len' bytes at 'p', skipping the first '*skip' of
+ * the bytes appended, that were already sent. */
+static void addIovec(struct iovec *iov, int *iovcnt, size_t *iovbytes,
+                     size_t *skip, char *p, size_t len)
+{
+    if (*skip >= len) {
+        *skip -= len;
+        return;
+    }
+    iov[*iovcnt].iov_base = p+*skip;
+    iov[*iovcnt].iov_len = len-*skip;
+    *iovbytes += len-*skip;
+    (*iovcnt)++;
+    *skip = 0;
+}
+
+/* Write the static buffer and the reply list of a client that is not a
+ * replica with a single writev(), gathering up to IOV_MAX buffers or
+ * NET_MAX_WRITES_PER_EVENT bytes, and release what was sent. Returns the
+ * bytes written, or the result of connWritev() on error. */
+static ssize_t _writevToClient(client *c) {
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+    size_t iovbytes = 0, skip = c->sentlen, remaining;
+    ssize_t nwritten = 0;
+    listIter li;
+    listNode *ln;
+
+    if (c->bufpos > 0)
+        addIovec(iov,&iovcnt,&iovbytes,&skip,c->buf,c->bufpos);
+    listRewind(c->reply,&li);
+    while ((ln = listNext(&li)) != NULL && iovcnt <= IOV_MAX-3 &&
+           iovbytes < NET_MAX_WRITES_PER_EVENT)
+    {
+        clientReplyBlock *o = listNodeValue(ln);
+
+        addIovec(iov,&iovcnt,&iovbytes,&skip,o->buf,o->used);
+        if (o->obj) {
+            /* The header, the string and the final CRLF. */
+            addIovec(iov,&iovcnt,&iovbytes,&skip,o->obj->ptr,
+                     sdslen(o->obj->ptr));
+            addIovec(iov,&iovcnt,&iovbytes,&skip,"\r\n",2);
+        }
+    }
+
+    /* With only empty blocks left there is nothing to write, but they are
+     * released below anyway. */
+    if (iovcnt) {
+        nwritten = connWritev(c->conn,iov,iovcnt);
+        if (nwritten < 0) return nwritten;
+    }
+
+    remaining = nwritten;
+    if (c->bufpos > 0) {
+        size_t len = c->bufpos-c->sentlen;
+
+        if (remaining < len) {
+            c->sentlen += remaining;
+            return nwritten;
+        }
+        remaining -= len;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+    while (listLength(c->reply)) {
+        clientReplyBlock *o = listNodeValue(listFirst(c->reply));
+        size_t len = clientReplyBlockLen(o)-c->sentlen;
+
+        if (remaining < len) {
+            c->sentlen += remaining;
+            break;
+        }
+        remaining -= len;
+        releaseClientReplyHead(c);
+        c->sentlen = 0;
+        /* If there are no longer objects in the list, we expect
+         * the count of reply bytes to be exactly zero. */
+        if (listLength(c->reply) == 0)
+            serverAssert(c->reply_bytes == 0);
+    }
+    return nwritten;
+}
+
+/* Write data in output buffers to client. Return C_OK if the client
+ * is still valid after the call, C_ERR if it was freed because of some
+ * error.  If handler_installed is set, it will attempt to clear the
+ * write event.
+ *
+ * This function is called by threads, but always with handler_installed
+ * set to 0. So when handler_installed is set to 0 the function must be
+ * thread safe. */
+int writeToClient(client *c, int handler_installed) {
+    ssize_t nwritten = 0, totwritten = 0;
+
+    while(clientHasPendingReplies(c)) {
+        if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+            replBufBlock *o = listNodeValue(c->ref_repl_buf_node);
+
+            if (c->repl_cdc) {
+                /* Change data capture consumers filter the stream. */
+                if (c->ref_block_pos < o->used ||
+                    replicationCdcHasPendingOutput(c))
+                {
+                    nwritten = replicationCdcWrite(c,o);
+                    if (nwritten < 0) break;
+                    totwritten += nwritten;
+                }
+            } else if (c->repl_compress) {
+                /* Compress the next chunk once the previous frame was
+                 * fully sent: the stream is consumed a frame at a time. */
+                if (c->repl_compress_sent == c->repl_compress_len &&
+                    c->ref_block_pos < o->used)
+                {
+                    c->ref_block_pos += replicationCompressFrame(c,
+                        o->buf+c->ref_block_pos,o->used-c->ref_block_pos);
+                }
+                if (c->repl_compress_sent < c->repl_compress_len) {
+                    nwritten = connWrite(c->conn,
+                        c->repl_compress_buf+c->repl_compress_sent,
+                        c->repl_compress_len-c->repl_compress_sent);
+                    if (nwritten <= 0) break;
+                    c->repl_compress_sent += nwritten;
+                    totwritten += nwritten;
+                }
+            } else if (c->ref_block_pos < o->used) {
+                nwritten = connWrite(c->conn,o->buf+c->ref_block_pos,
+                                     o->used-c->ref_block_pos);
+                if (nwritten <= 0) break;
+                c->ref_block_pos += nwritten;
+                totwritten += nwritten;
             }
 
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
+            /* If we fully sent the block go to the next one, so that this
+             * one may be released. */
+            listNode *next = listNextNode(c->ref_repl_buf_node);
+            if (next && c->ref_block_pos == o->used) {
+                o->refcount--;
+                ((replBufBlock *)listNodeValue(next))->refcount++;
+                c->ref_repl_buf_node = next;
+                c->ref_block_pos = 0;
+                incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+            }
+        } else {
+            nwritten = _writevToClient(c);
             if (nwritten <= 0) break;
-            c->sentlen += nwritten;
             totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
         }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
@@ -1254,6 +2182,7 @@ int writeToClient(client *c, int handler_installed) {
             !(c->flags & CLIENT_SLAVE)) break;
     }
     server.stat_net_output_bytes += totwritten;
+    c->stat_net_output_bytes += totwritten;
     if (nwritten == -1) {
         if (connGetState(c->conn) == CONN_STATE_CONNECTED) {
             nwritten = 0;
@@ -1273,6 +2202,7 @@ int writeToClient(client *c, int handler_installed) {
     }
     if (!clientHasPendingReplies(c)) {
         c->sentlen = 0;
+        if (c->reply_ustime) trackReplyWriteTime(c);
         /* Note that writeToClient() is called in a threaded way, but
          * adDeleteFileEvent() is not thread safe: however writeToClient()
          * is always called with handler_installed set to 0 from threads
@@ -1288,10 +2218,23 @@ int writeToClient(client *c, int handler_installed) {
     return C_OK;
 }
 
+/* Account the time elapsed since the command of 'c' ended its execution
+ * and produced the replies, now that they are all written to the socket,
+ * see latency-tracking-breakdown. This may be called by I/O threads, that
+ * run while the main thread waits, each one with its own clients. */
+void trackReplyWriteTime(client *c) {
+    ustime_t write_usec = ustime()-c->reply_ustime;
+
+    latencyHistogramAddAtomic(server.latency_write_histogram,write_usec);
+    if (c->slowlog_id != -1) slowlogSetWriteTime(c->slowlog_id,write_usec);
+    c->reply_ustime = 0;
+    c->slowlog_id = -1;
+}
+
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
-    writeToClient(c,1);
+    if (writeToClient(c,1) == C_OK) updateClientMemUsage(c);
 }
 
 /* This function is called just before entering the event loop, in the hope
@@ -1315,6 +2258,7 @@ int handleClientsWithPendingWrites(void) {
 
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
+        updateClientMemUsage(c);
 
         /* If after the synchronous writes above we still have data to
          * output to the client, we need to install the writable handler. */
@@ -1346,6 +2290,7 @@ void resetClient(client *c) {
     c->reqtype = 0;
     c->multibulklen = 0;
     c->bulklen = -1;
+    c->queue_usec = 0;
 
     /* We clear the ASKING flag as well if we are not inside a MULTI, and
      * if what we just executed is not the ASKING command itself. */
@@ -1390,6 +2335,81 @@ void unprotectClient(client *c) {
     }
 }
 
+/* Make sure the client argv array can hold 'argc' arguments. With deep
+ * pipelines allocating a new array for every command shows in profiles, so
+ * the array is reused across commands, unless it became much bigger than
+ * what the command needs, to avoid retaining memory after a huge command. */
+void clientEnsureArgvLen(client *c, int argc) {
+    if (c->argv && c->argv_len >= argc &&
+        (c->argv_len <= PROTO_ARGV_REUSE_MAX || c->argv_len <= argc*2)) return;
+    zfree(c->argv);
+    c->argv_len = argc < PROTO_ARGV_MIN_LEN ? PROTO_ARGV_MIN_LEN : argc;
+    c->argv = zmalloc(sizeof(robj*)*c->argv_len);
+}
+
+/* Account in the pipeline batches histogram the number of commands
+ * processed by a single processInputBuffer() call, that is, how many
+ * commands were found in the query buffer after a read. */
+static void trackPipelineBatch(int processed) {
+    static const int limits[STATS_PIPELINE_BUCKETS-1] = {2,8,32,128,512};
+    int j;
+
+    if (processed == 0) return;
+    for (j = 0; j < STATS_PIPELINE_BUCKETS-1; j++)
+        if (processed < limits[j]) break;
+    server.stat_pipeline_batches[j]++;
+}
+
+/* Prefetch the keys of the command about to be executed and of the next
+ * commands of the pipeline already in the query buffer, up to
+ * LOOKUP_PREFETCH_BATCH commands, so that their lookups don't wait for
+ * memory one after the other. The pending commands are not parsed yet: the
+ * multi bulk requests are just scanned, and their first argument is assumed
+ * to be the key, as it is for most commands. Prefetching something else is
+ * harmless. */
+static void prefetchPipelineKeys(client *c) {
+    const void *keys[LOOKUP_PREFETCH_BATCH];
+    dictEntry *entries[LOOKUP_PREFETCH_BATCH];
+    char *p = c->querybuf+c->qb_pos, *end = c->querybuf+sdslen(c->querybuf);
+    int count = 0, first = 0;
+
+    if (c->argc > 1 && sdsEncodedObject(c->argv[1])) {
+        keys[count++] = c->argv[1]->ptr;
+        first = 1;
+    }
+    while (count < LOOKUP_PREFETCH_BATCH && p < end && *p == '*') {
+        long long argc, len;
+        char *nl = memchr(p,'\r',end-p);
+        if (nl == NULL || !string2ll(p+1,nl-(p+1),&argc)) break;
+        p = nl+2;
+        for (long long j = 0; j < argc; j++) {
+            if (p >= end || *p != '$' ||
+                (nl = memchr(p,'\r',end-p)) == NULL ||
+                !string2ll(p+1,nl-(p+1),&len) || len < 0 ||
+                end-(nl+2) < len+2)
+            {
+                p = end; /* Incomplete or invalid: stop here. */
+                break;
+            }
+            p = nl+2;
+            if (j == 1) keys[count++] = sdsnewlen(p,len);
+            p += len+2;
+        }
+    }
+
+    if (count > 1) dictFindMany(c->db->dict,keys,entries,count);
+    for (int j = first; j < count; j++) sdsfree((sds)keys[j]);
+}
+
+/* Append the pipeline batches histogram to the INFO output 'info'. */
+sds genPipelineInfoString(sds info) {
+    long long *b = server.stat_pipeline_batches;
+    return sdscatprintf(info,
+        "pipeline_batches:1=%lld,2-7=%lld,8-31=%lld,32-127=%lld,"
+        "128-511=%lld,512+=%lld\r\n",
+        b[0],b[1],b[2],b[3],b[4],b[5]);
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1404,7 +2424,7 @@ int processInlineBuffer(client *c) {
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->querybuf+c->qb_pos,'\n');
+    newline = memchr(c->querybuf+c->qb_pos,'\n',sdslen(c->querybuf)-c->qb_pos);
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
@@ -1440,10 +2460,7 @@ int processInlineBuffer(client *c) {
     c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*argc);
-    }
+    if (argc) clientEnsureArgvLen(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1509,7 +2526,8 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = memchr(c->querybuf+c->qb_pos,'\r',
+                         sdslen(c->querybuf)-c->qb_pos);
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1539,15 +2557,15 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
+        clientEnsureArgvLen(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = memchr(c->querybuf+c->qb_pos,'\r',
+                             sdslen(c->querybuf)-c->qb_pos);
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1592,8 +2610,11 @@ int processMultibulkBuffer(client *c) {
                     sdsrange(c->querybuf,c->qb_pos,-1);
                     c->qb_pos = 0;
                     /* Hint the sds library about the amount of bytes this string is
-                     * going to contain. */
-                    c->querybuf = sdsMakeRoomFor(c->querybuf,ll+2);
+                     * going to contain. The shared query buffer can't grow:
+                     * the data is moved to a private buffer, that grows on
+                     * the next read, once the command is processed. */
+                    if (c->querybuf != thread_shared_qb)
+                        c->querybuf = sdsMakeRoomFor(c->querybuf,ll+2);
                 }
             }
             c->bulklen = ll;
@@ -1608,6 +2629,7 @@ int processMultibulkBuffer(client *c) {
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
             if (c->qb_pos == 0 &&
+                c->querybuf != thread_shared_qb &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
                 sdslen(c->querybuf) == (size_t)(c->bulklen+2))
             {
@@ -1619,7 +2641,7 @@ int processMultibulkBuffer(client *c) {
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createClientArgObject(c,c->querybuf+c->qb_pos,c->bulklen);
                 c->qb_pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1634,6 +2656,15 @@ int processMultibulkBuffer(client *c) {
     return C_ERR;
 }
 
+/* Account the time the command of 'c' waited to be dispatched, from the
+ * time its request was read to 'now', see latency-tracking-breakdown. This
+ * is also called by the I/O threads executing commands. */
+void trackCommandQueueTime(client *c, ustime_t now) {
+    if (!server.latency_tracking_breakdown) return;
+    c->queue_usec = c->read_ustime ? now-c->read_ustime : 0;
+    latencyHistogramAddAtomic(server.latency_queue_histogram,c->queue_usec);
+}
+
 /* This function calls processCommand(), but also performs a few sub tasks
  * that are useful in that context:
  *
@@ -1646,6 +2677,7 @@ int processMultibulkBuffer(client *c) {
 int processCommandAndResetClient(client *c) {
     int deadclient = 0;
     server.current_client = c;
+    trackCommandQueueTime(c,ustime());
     if (processCommand(c) == C_OK) {
         if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
             /* Update the applied replication offset of our master. */
@@ -1655,9 +2687,11 @@ int processCommandAndResetClient(client *c) {
         /* Don't reset the client structure for clients blocked in a
          * module blocking command, so that the reply callback will
          * still be able to access the client argv and argc field.
-         * The client will be reset in unblockClientFromModule(). */
+         * The client will be reset in unblockClientFromModule(). The
+         * clients waiting for the tiered storage execute the command
+         * again later, see tieredBlockForValues(). */
         if (!(c->flags & CLIENT_BLOCKED) ||
-            c->btype != BLOCKED_MODULE)
+            (c->btype != BLOCKED_MODULE && c->btype != BLOCKED_TIERED))
         {
             resetClient(c);
         }
@@ -1670,11 +2704,55 @@ int processCommandAndResetClient(client *c) {
     return deadclient ? C_ERR : C_OK;
 }
 
+/* A command of the query buffer parsed in advance by an I/O thread. */
+typedef struct parsedCommand {
+    int argc;
+    robj **argv;
+    size_t len;             /* Bytes of the command in the query buffer. */
+} parsedCommand;
+
+/* Release the commands of the client 'c' parsed in advance and not yet
+ * executed. */
+void freeClientParsedCommands(client *c) {
+    if (c->parsed_cmds == NULL) return;
+    for (int j = c->parsed_cmds_pos; j < c->parsed_cmds_count; j++) {
+        parsedCommand *pc = c->parsed_cmds+j;
+        for (int i = 0; i < pc->argc; i++) decrRefCount(pc->argv[i]);
+        zfree(pc->argv);
+    }
+    zfree(c->parsed_cmds);
+    c->parsed_cmds = NULL;
+    c->parsed_cmds_count = c->parsed_cmds_pos = 0;
+}
+
+/* Make the next command parsed in advance the current command of the
+ * client, consuming its bytes from the query buffer as if it was parsed
+ * by processMultibulkBuffer(). */
+static void popParsedCommand(client *c) {
+    parsedCommand *pc = c->parsed_cmds+c->parsed_cmds_pos++;
+
+    clientEnsureArgvLen(c,pc->argc);
+    memcpy(c->argv,pc->argv,sizeof(robj*)*pc->argc);
+    c->argc = pc->argc;
+    c->qb_pos += pc->len;
+    zfree(pc->argv);
+    if (c->parsed_cmds_pos == c->parsed_cmds_count) {
+        zfree(c->parsed_cmds);
+        c->parsed_cmds = NULL;
+        c->parsed_cmds_count = c->parsed_cmds_pos = 0;
+    }
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process. */
 void processInputBuffer(client *c) {
+    int processed = 0;
+
+    if (c->flags & CLIENT_MASTER && server.repl_parallel_parse)
+        parseMasterStreamUsingThreads(c);
+
     /* Keep processing while there is something in the input buffer */
     while(c->qb_pos < sdslen(c->querybuf)) {
         /* Return if clients are paused. */
@@ -1701,7 +2779,7 @@ void processInputBuffer(client *c) {
         if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
 
         /* Determine request type when unknown. */
-        if (!c->reqtype) {
+        if (!c->reqtype && !c->parsed_cmds) {
             if (c->querybuf[c->qb_pos] == '*') {
                 c->reqtype = PROTO_REQ_MULTIBULK;
             } else {
@@ -1709,7 +2787,10 @@ void processInputBuffer(client *c) {
             }
         }
 
-        if (c->reqtype == PROTO_REQ_INLINE) {
+        if (c->parsed_cmds) {
+            /* The next command was already parsed by an I/O thread. */
+            popParsedCommand(c);
+        } else if (c->reqtype == PROTO_REQ_INLINE) {
             if (processInlineBuffer(c) != C_OK) break;
             /* If the Gopher mode and we got zero or one argument, process
              * the request in Gopher mode. */
@@ -1733,28 +2814,47 @@ void processInputBuffer(client *c) {
             resetClient(c);
         } else {
             /* If we are in the context of an I/O thread, we can't really
-             * execute the command here. All we can do is to flag the client
-             * as one that needs to process the command. */
+             * execute the command here, unless it is a read only command
+             * the I/O thread is allowed to run. All we can do is to flag the
+             * client as one that needs to process the command. */
             if (c->flags & CLIENT_PENDING_READ) {
+                if (ioThreadCanExecuteCommand(c)) ioThreadExecuteCommand(c);
                 c->flags |= CLIENT_PENDING_COMMAND;
                 break;
             }
 
+            /* Pipelined commands: prefetch the keys of the next batch. */
+            if (processed % LOOKUP_PREFETCH_BATCH == 0 &&
+                c->qb_pos < sdslen(c->querybuf))
+                prefetchPipelineKeys(c);
+
             /* We are finally ready to execute the command. */
+            processed++;
             if (processCommandAndResetClient(c) == C_ERR) {
                 /* If the client is no longer valid, we avoid exiting this
                  * loop and trimming the client buffer later. So we return
                  * ASAP in that case. */
+                trackPipelineBatch(processed);
                 return;
             }
         }
     }
+    trackPipelineBatch(processed);
+
+    /* The commands parsed in advance that we could not execute now will be
+     * parsed again from the query buffer. */
+    freeClientParsedCommands(c);
 
     /* Trim to pos */
-    if (c->qb_pos) {
+    if (c->querybuf == thread_shared_qb) {
+        unshareQueryBuffer(c);
+    } else if (c->qb_pos) {
         sdsrange(c->querybuf,c->qb_pos,-1);
         c->qb_pos = 0;
     }
+
+    /* I/O threads leave the accounting to the main thread. */
+    if (!(c->flags & CLIENT_PENDING_READ)) updateClientMemUsage(c);
 }
 
 /* This is a wrapper for processInputBuffer that also cares about handling
@@ -1787,11 +2887,20 @@ void readQueryFromClient(connection *conn) {
     int nread, readlen;
     size_t qblen;
 
+    /* The event loop is already late: let the clients with priority be
+     * served first. */
+    if (throttleClientRead(c)) return;
+
     /* Check if we want to read from the client later when exiting from
      * the event loop. This is the case if threaded I/O is enabled. */
     if (postponeClientRead(c)) return;
 
     readlen = PROTO_IOBUF_LEN;
+    /* With replica-parallel-parse the master stream is read in big chunks,
+     * so that when we are behind there are enough commands to parse them
+     * in parallel, see parseMasterStreamUsingThreads(). */
+    if (c->flags & CLIENT_MASTER && server.repl_parallel_parse &&
+        server.io_threads_num > 1) readlen = REPL_PARALLEL_PARSE_READ_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
      * buffer contains exactly the SDS string representing the object, even
@@ -1810,8 +2919,28 @@ void readQueryFromClient(connection *conn) {
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
-    c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
-    nread = connRead(c->conn, c->querybuf+qblen, readlen);
+    if (qblen == 0 && readlen == PROTO_IOBUF_LEN &&
+        !(c->flags & CLIENT_MASTER) && sdslen(getSharedQueryBuffer()) == 0)
+    {
+        /* Read into the shared query buffer, giving the buffer of the
+         * client, if any, back to the pool. The shared buffer is not empty
+         * when the command read in it processes events while blocked, see
+         * processEventsWhileBlocked(). */
+        putQueryBuffer(c->querybuf);
+        c->querybuf = getSharedQueryBuffer();
+    } else if (qblen == 0 && sdsavail(c->querybuf) < (size_t)readlen) {
+        /* An empty buffer is replaced by one from the pool, already large
+         * enough for the read. */
+        sdsfree(c->querybuf);
+        c->querybuf = getQueryBuffer();
+    }
+    if (c->querybuf != thread_shared_qb)
+        c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+    if (c->flags & CLIENT_MASTER && c->repl_compress)
+        nread = replicationReadCompressedStream(c);
+    else
+        nread = connRead(c->conn, c->querybuf+qblen, readlen);
+    if (nread <= 0 && c->querybuf == thread_shared_qb) unshareQueryBuffer(c);
     if (nread == -1) {
         if (connGetState(conn) == CONN_STATE_CONNECTED) {
             return;
@@ -1834,8 +2963,14 @@ void readQueryFromClient(connection *conn) {
 
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
+    /* A read into an empty query buffer starts a new request. */
+    if (qblen == 0)
+        c->read_ustime = server.latency_tracking_breakdown ? ustime() : 0;
     if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
-    server.stat_net_input_bytes += nread;
+    c->stat_net_input_bytes += nread;
+    /* The compressed stream counts the bytes actually read by itself. */
+    if (!(c->flags & CLIENT_MASTER && c->repl_compress))
+        server.stat_net_input_bytes += nread;
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1843,6 +2978,7 @@ void readQueryFromClient(connection *conn) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
+        if (c->querybuf == thread_shared_qb) unshareQueryBuffer(c);
         freeClientAsync(c);
         return;
     }
@@ -1883,7 +3019,10 @@ void getClientsMaxBuffers(unsigned long *longest_output_list,
  * anyway (see anetPeerToString implementation for more info). */
 void genClientPeerId(client *client, char *peerid,
                             size_t peerid_len) {
-    if (client->flags & CLIENT_UNIX_SOCKET) {
+    if (client->flags & CLIENT_SHM) {
+        /* Shared memory transport client. */
+        snprintf(peerid,peerid_len,"%s:0",server.shm_socket);
+    } else if (client->flags & CLIENT_UNIX_SOCKET) {
         /* Unix socket client. */
         snprintf(peerid,peerid_len,"%s:0",server.unixsocket);
     } else {
@@ -1909,7 +3048,7 @@ char *getClientPeerId(client *c) {
 /* Concatenate a string representing the state of a client in an human
  * readable format, into the sds string 's'. */
 sds catClientInfoString(sds s, client *client) {
-    char flags[16], events[3], conninfo[CONN_INFO_LEN], *p;
+    char flags[24], events[3], conninfo[CONN_INFO_LEN], *p;
 
     p = flags;
     if (client->flags & CLIENT_SLAVE) {
@@ -1924,12 +3063,17 @@ sds catClientInfoString(sds s, client *client) {
     if (client->flags & CLIENT_BLOCKED) *p++ = 'b';
     if (client->flags & CLIENT_TRACKING) *p++ = 't';
     if (client->flags & CLIENT_TRACKING_BROKEN_REDIR) *p++ = 'R';
-    if (client->flags & CLIENT_DIRTY_CAS) *p++ = 'd';
+    if (client->flags & CLIENT_TRACKING_BCAST) *p++ = 'B';
+    if (client->flags & CLIENT_DIRTY_CAS || watchedKeysTouched(client)) *p++ = 'd';
     if (client->flags & CLIENT_CLOSE_AFTER_REPLY) *p++ = 'c';
     if (client->flags & CLIENT_UNBLOCKED) *p++ = 'u';
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (client->flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
+    if (client->flags & CLIENT_SHM) *p++ = 'm';
     if (client->flags & CLIENT_READONLY) *p++ = 'r';
+    if (client->flags & CLIENT_NO_EVICT) *p++ = 'e';
+    if (client->flags & CLIENT_PRIORITY) *p++ = 'p';
+    if (client->flags & CLIENT_WRITE_OFFSET) *p++ = 'o';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -1940,7 +3084,7 @@ sds catClientInfoString(sds s, client *client) {
     }
     *p = '\0';
     return sdscatfmt(s,
-        "id=%U addr=%s %s name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s user=%s",
+        "id=%U addr=%s %s name=%s age=%I idle=%I flags=%s db=%i sub=%i psub=%i multi=%i qbuf=%U qbuf-free=%U obl=%U oll=%U omem=%U events=%s cmd=%s user=%s tot-net-in=%U tot-net-out=%U tot-cmds=%U tot-usec=%U",
         (unsigned long long) client->id,
         getClientPeerId(client),
         connGetInfo(client->conn, conninfo, sizeof(conninfo)),
@@ -1959,7 +3103,11 @@ sds catClientInfoString(sds s, client *client) {
         (unsigned long long) getClientOutputBufferMemoryUsage(client),
         events,
         client->lastcmd ? client->lastcmd->name : "NULL",
-        client->user ? client->user->name : "(superuser)");
+        client->user ? client->user->name : "(superuser)",
+        client->stat_net_input_bytes,
+        client->stat_net_output_bytes,
+        client->stat_commands,
+        client->stat_cmd_usec);
 }
 
 sds getAllClientsInfoString(int type) {
@@ -1978,6 +3126,83 @@ sds getAllClientsInfoString(int type) {
     return o;
 }
 
+/* Client of CLIENT TOP, with the value it is sorted by. */
+typedef struct clientTopEntry {
+    client *c;
+    unsigned long long value;
+} clientTopEntry;
+
+static int clientTopCompare(const void *a, const void *b) {
+    const clientTopEntry *ea = a, *eb = b;
+
+    if (ea->value == eb->value) return ea->c->id < eb->c->id ? -1 : 1;
+    return ea->value > eb->value ? -1 : 1;
+}
+
+/* CLIENT TOP [CPU|NET-IN|NET-OUT|CMDS] [COUNT <count>]
+ *
+ * Like CLIENT LIST, but only for the clients that used the most CPU time
+ * executing commands (the default), that sent or received the most bytes,
+ * or that executed the most commands, from the biggest. */
+static void clientTopCommand(client *c) {
+    int by = 0, j;
+    long count = 10, numclients = 0;
+    clientTopEntry *entries;
+    listNode *ln;
+    listIter li;
+
+    for (j = 2; j < c->argc; j++) {
+        char *opt = c->argv[j]->ptr;
+        if (!strcasecmp(opt,"cpu")) {
+            by = 0;
+        } else if (!strcasecmp(opt,"net-in")) {
+            by = 1;
+        } else if (!strcasecmp(opt,"net-out")) {
+            by = 2;
+        } else if (!strcasecmp(opt,"cmds")) {
+            by = 3;
+        } else if (!strcasecmp(opt,"count") && j+1 < c->argc) {
+            if (getLongFromObjectOrReply(c,c->argv[++j],&count,NULL)
+                != C_OK) return;
+            if (count <= 0) {
+                addReplyError(c,"The count must be positive");
+                return;
+            }
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    entries = zmalloc(sizeof(*entries)*(listLength(server.clients)+1));
+    listRewind(server.clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *cl = listNodeValue(ln);
+        unsigned long long value;
+
+        switch(by) {
+        case 1: value = cl->stat_net_input_bytes; break;
+        case 2: value = cl->stat_net_output_bytes; break;
+        case 3: value = cl->stat_commands; break;
+        default: value = cl->stat_cmd_usec; break;
+        }
+        entries[numclients].c = cl;
+        entries[numclients].value = value;
+        numclients++;
+    }
+    qsort(entries,numclients,sizeof(*entries),clientTopCompare);
+    if (count > numclients) count = numclients;
+
+    sds o = sdsempty();
+    for (j = 0; j < count; j++) {
+        o = catClientInfoString(o,entries[j].c);
+        o = sdscatlen(o,"\n",1);
+    }
+    addReplyVerbatim(c,o,sdslen(o),"txt");
+    sdsfree(o);
+    zfree(entries);
+}
+
 /* This function implements CLIENT SETNAME, including replying to the
  * user with an error if the charset is wrong (in that case C_ERR is
  * returned). If the function succeeeded C_OK is returned, and it's up
@@ -2033,11 +3258,19 @@ void clientCommand(client *c) {
 "     SKIPME (yes|no)   -- Skip killing current connection (default: yes).",
 "LIST [options ...]     -- Return information about client connections. Options:",
 "     TYPE (normal|master|replica|pubsub) -- Return clients of specified type.",
+"INFO                   -- Return information about the current connection.",
+"TOP [CPU|NET-IN|NET-OUT|CMDS] [COUNT <count>] -- Return information about the",
+"     <count> (default 10) clients that used the most CPU time, network or",
+"     commands so far.",
 "PAUSE <timeout>        -- Suspend all Redis clients for <timout> milliseconds.",
 "REPLY (on|off|skip)    -- Control the replies sent to the current connection.",
+"NO-EVICT (on|off)      -- Protect the current connection from maxmemory-clients.",
+"PRIORITY (on|off)      -- Serve the current connection before the other ones.",
+"WRITEOFFSET [on|off]   -- Return the replication offset of the last write of the",
+"     current connection, or add it to the replies to writes (RESP3 only).",
 "SETNAME <name>         -- Assign the name <name> to the current connection.",
 "UNBLOCK <clientid> [TIMEOUT|ERROR] -- Unblock the specified blocked client.",
-"TRACKING (on|off) [REDIRECT <id>] -- Enable client keys tracking for client side caching.",
+"TRACKING (on|off) [REDIRECT <id>] [BCAST] [PREFIX <prefix> ...] -- Enable client keys tracking for client side caching.",
 "GETREDIR               -- Return the client ID we are redirecting to when tracking is enabled.",
 NULL
         };
@@ -2062,6 +3295,15 @@ NULL
         sds o = getAllClientsInfoString(type);
         addReplyVerbatim(c,o,sdslen(o),"txt");
         sdsfree(o);
+    } else if (!strcasecmp(c->argv[1]->ptr,"info") && c->argc == 2) {
+        /* CLIENT INFO */
+        sds o = catClientInfoString(sdsempty(),c);
+        o = sdscatlen(o,"\n",1);
+        addReplyVerbatim(c,o,sdslen(o),"txt");
+        sdsfree(o);
+    } else if (!strcasecmp(c->argv[1]->ptr,"top")) {
+        /* CLIENT TOP [CPU|NET-IN|NET-OUT|CMDS] [COUNT <count>] */
+        clientTopCommand(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"reply") && c->argc == 3) {
         /* CLIENT REPLY ON|OFF|SKIP */
         if (!strcasecmp(c->argv[2]->ptr,"on")) {
@@ -2076,6 +3318,48 @@ NULL
             addReply(c,shared.syntaxerr);
             return;
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"no-evict") && c->argc == 3) {
+        /* CLIENT NO-EVICT ON|OFF */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            c->flags |= CLIENT_NO_EVICT;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_NO_EVICT;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        updateClientMemUsage(c);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"priority") && c->argc == 3) {
+        /* CLIENT PRIORITY ON|OFF */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            c->flags |= CLIENT_PRIORITY;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_PRIORITY;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"writeoffset") && c->argc == 2) {
+        /* CLIENT WRITEOFFSET */
+        addReplyLongLong(c,c->write_reploff);
+    } else if (!strcasecmp(c->argv[1]->ptr,"writeoffset") && c->argc == 3) {
+        /* CLIENT WRITEOFFSET ON|OFF */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            if (c->resp < 3) {
+                addReplyError(c,"CLIENT WRITEOFFSET ON requires the RESP3 "
+                                "protocol, see HELLO");
+                return;
+            }
+            c->flags |= CLIENT_WRITE_OFFSET;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->flags &= ~CLIENT_WRITE_OFFSET;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"kill")) {
         /* CLIENT KILL <ip:port>
          * CLIENT KILL <option> [value] ... <option> [value] */
@@ -2183,7 +3467,13 @@ NULL
         if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL)
             != C_OK) return;
         struct client *target = lookupClientByID(id);
-        if (target && target->flags & CLIENT_BLOCKED) {
+        /* A streamed reply can't be interrupted: the client is
+         * not considered blocked in a command. The same for the
+         * short wait of the values read from the tiered storage. */
+        if (target && target->flags & CLIENT_BLOCKED &&
+            target->btype != BLOCKED_REPLY &&
+            target->btype != BLOCKED_TIERED)
+        {
             if (unblock_error)
                 addReplyError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
@@ -2212,38 +3502,87 @@ NULL
                 UNIT_MILLISECONDS) != C_OK) return;
         pauseClients(duration);
         addReply(c,shared.ok);
-    } else if (!strcasecmp(c->argv[1]->ptr,"tracking") &&
-               (c->argc == 3 || c->argc == 5))
-    {
-        /* CLIENT TRACKING (on|off) [REDIRECT <id>] */
+    } else if (!strcasecmp(c->argv[1]->ptr,"tracking") && c->argc >= 3) {
+        /* CLIENT TRACKING (on|off) [REDIRECT <id>] [BCAST] [PREFIX first]
+         *                          [PREFIX second] ... */
         long long redir = 0;
-
-        /* Parse the redirection option: we'll require the client with
-         * the specified ID to exist right now, even if it is possible
-         * it will get disconnected later. */
-        if (c->argc == 5) {
-            if (strcasecmp(c->argv[3]->ptr,"redirect") != 0) {
-                addReply(c,shared.syntaxerr);
-                return;
-            } else {
-                if (getLongLongFromObjectOrReply(c,c->argv[4],&redir,NULL) !=
-                    C_OK) return;
+        int bcast = 0;
+        robj **prefix = NULL;
+        size_t numprefix = 0;
+
+        /* Parse the options. */
+        for (int j = 3; j < c->argc; j++) {
+            int moreargs = (c->argc-1) - j;
+
+            if (!strcasecmp(c->argv[j]->ptr,"redirect") && moreargs) {
+                j++;
+                if (getLongLongFromObjectOrReply(c,c->argv[j],&redir,NULL) !=
+                    C_OK)
+                {
+                    zfree(prefix);
+                    return;
+                }
+                /* We will require the client with the specified ID to exist
+                 * right now, even if it is possible that it gets disconnected
+                 * later. Still a valid sanity check. */
                 if (lookupClientByID(redir) == NULL) {
                     addReplyError(c,"The client ID you want redirect to "
                                     "does not exist");
+                    zfree(prefix);
                     return;
                 }
+            } else if (!strcasecmp(c->argv[j]->ptr,"bcast")) {
+                bcast = 1;
+            } else if (!strcasecmp(c->argv[j]->ptr,"prefix") && moreargs) {
+                j++;
+                prefix = zrealloc(prefix,sizeof(robj*)*(numprefix+1));
+                prefix[numprefix++] = c->argv[j];
+            } else {
+                zfree(prefix);
+                addReply(c,shared.syntaxerr);
+                return;
             }
         }
 
+        /* Options are ok: enable or disable the tracking for this client. */
         if (!strcasecmp(c->argv[2]->ptr,"on")) {
-            enableTracking(c,redir);
+            /* Before enabling tracking, make sure options are compatible
+             * among each other and with the current state of the client. */
+            if (!bcast && numprefix) {
+                addReplyError(c,
+                    "PREFIX option requires BCAST mode to be enabled");
+                zfree(prefix);
+                return;
+            }
+
+            if (c->flags & CLIENT_TRACKING) {
+                int oldbcast = !!(c->flags & CLIENT_TRACKING_BCAST);
+                if (oldbcast != bcast) {
+                    addReplyError(c,
+                        "You can't switch BCAST mode on/off before disabling "
+                        "tracking for this client, and then re-enabling it "
+                        "with a different mode.");
+                    zfree(prefix);
+                    return;
+                }
+            }
+
+            if (bcast &&
+                checkPrefixCollisionsOrReply(c,prefix,numprefix) != C_OK)
+            {
+                zfree(prefix);
+                return;
+            }
+
+            enableTracking(c,redir,bcast,prefix,numprefix);
         } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
             disableTracking(c);
         } else {
+            zfree(prefix);
             addReply(c,shared.syntaxerr);
             return;
         }
+        zfree(prefix);
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"getredir") && c->argc == 2) {
         /* CLIENT GETREDIR */
@@ -2370,8 +3709,10 @@ void rewriteClientCommandVector(client *c, int argc, ...) {
     /* Replace argv and argc with our new versions. */
     c->argv = argv;
     c->argc = argc;
+    c->argv_len = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
+    resetClientCommandKeys(c);
     va_end(ap);
 }
 
@@ -2381,6 +3722,7 @@ void replaceClientCommandVector(client *c, int argc, robj **argv) {
     zfree(c->argv);
     c->argv = argv;
     c->argc = argc;
+    c->argv_len = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
 }
@@ -2400,7 +3742,10 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
     robj *oldval;
 
     if (i >= c->argc) {
-        c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
+        if (i >= c->argv_len) {
+            c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
+            c->argv_len = i+1;
+        }
         c->argc = i+1;
         c->argv[i] = NULL;
     }
@@ -2408,6 +3753,7 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
     c->argv[i] = newval;
     incrRefCount(newval);
     if (oldval) decrRefCount(oldval);
+    resetClientCommandKeys(c);
 
     /* If this is the command name make sure to fix c->cmd. */
     if (i == 0) {
@@ -2423,8 +3769,159 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
  * the caller wishes. The main usage of this function currently is
  * enforcing the client output length limits. */
 unsigned long getClientOutputBufferMemoryUsage(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        /* A slave uses the part of the shared replication buffer from the
+         * block it references to the end, except the blocks spilled to
+         * disk. */
+        if (c->ref_repl_buf_node == NULL) return 0;
+        unsigned long block_item_size = sizeof(listNode) + sizeof(replBufBlock);
+        replBufBlock *last = listNodeValue(listLast(server.repl_buffer_blocks));
+        replBufBlock *cur = listNodeValue(c->ref_repl_buf_node);
+        listNode *spilled = server.repl_buffer_spill_last;
+        if (spilled &&
+            ((replBufBlock*)listNodeValue(spilled))->id >= cur->id)
+        {
+            cur = listNodeValue(listNextNode(spilled));
+        }
+        return (last->repl_offset + last->size - cur->repl_offset) +
+               block_item_size*(last->id - cur->id + 1);
+    }
     unsigned long list_item_size = sizeof(listNode) + sizeof(clientReplyBlock);
-    return c->reply_bytes + (list_item_size*listLength(c->reply));
+    return c->reply_bytes - c->reply_spilled_bytes +
+           (list_item_size*listLength(c->reply));
+}
+
+/* Return the bytes of the output buffer of the client that are spilled to
+ * disk, see spillClientOutputBuffer(). */
+unsigned long getClientOutputBufferSpilledBytes(client *c) {
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        if (c->ref_repl_buf_node == NULL) return 0;
+        replBufBlock *cur = listNodeValue(c->ref_repl_buf_node);
+        listNode *spilled = server.repl_buffer_spill_last;
+        if (spilled == NULL) return 0;
+        replBufBlock *last = listNodeValue(spilled);
+        if (last->id < cur->id) return 0;
+        return last->repl_offset + last->used - cur->repl_offset;
+    }
+    return c->reply_spilled_bytes;
+}
+
+/* Return the index of the bucket of server.client_mem_usage_buckets for
+ * a client using 'mem' bytes. */
+static int clientMemUsageBucket(size_t mem) {
+    int log = mem ? (int)(sizeof(mem)*8) - __builtin_clzl(mem) : 0;
+
+    if (log < CLIENT_MEM_USAGE_BUCKET_MIN_LOG)
+        log = CLIENT_MEM_USAGE_BUCKET_MIN_LOG;
+    else if (log > CLIENT_MEM_USAGE_BUCKET_MAX_LOG)
+        log = CLIENT_MEM_USAGE_BUCKET_MAX_LOG;
+    return log - CLIENT_MEM_USAGE_BUCKET_MIN_LOG;
+}
+
+/* Move the client to the bucket matching the memory it was last accounted
+ * for, or remove it from the buckets if it can't be evicted: masters,
+ * slaves and MONITORs, the clients with CLIENT NO-EVICT, and the clients
+ * no longer linked. */
+static void updateClientMemUsageBucket(client *c) {
+    int type = getClientType(c);
+    int bucket = -1;
+
+    if (c->client_list_node && !(c->flags & CLIENT_NO_EVICT) &&
+        (type == CLIENT_TYPE_NORMAL || type == CLIENT_TYPE_PUBSUB))
+    {
+        bucket = clientMemUsageBucket(c->last_memory_usage);
+    }
+    if (bucket == c->mem_usage_bucket) return;
+
+    if (c->mem_usage_bucket != -1) {
+        listUnlinkNode(server.client_mem_usage_buckets[c->mem_usage_bucket],
+                       c->mem_usage_bucket_node);
+    }
+    if (bucket != -1) {
+        if (c->mem_usage_bucket_node == NULL) {
+            c->mem_usage_bucket_node = zmalloc(sizeof(listNode));
+            c->mem_usage_bucket_node->value = c;
+        }
+        listLinkNodeHead(server.client_mem_usage_buckets[bucket],
+                         c->mem_usage_bucket_node);
+    }
+    c->mem_usage_bucket = bucket;
+}
+
+/* Update the memory the client 'c' is accounted for in the totals that
+ * INFO and MEMORY report as mem_clients_normal and mem_clients_slaves, so
+ * that they don't need to walk all the clients. This is called after the
+ * client buffers change, from the main thread only, and by clientsCron()
+ * for the changes made elsewhere. Unlinked clients are accounted as 0.
+ *
+ * The output buffers of the slaves are part of the shared replication
+ * buffer, accounted on their own, so only their own buffers are counted. */
+void updateClientMemUsage(client *c) {
+    size_t mem = 0;
+    int slave = getClientType(c) == CLIENT_TYPE_SLAVE;
+
+    if (c->client_list_node) {
+        mem += sizeof(client);
+        mem += sdsAllocSize(c->querybuf);
+        if (c->buf) mem += zmalloc_size(c->buf);
+        if (!slave) mem += getClientOutputBufferMemoryUsage(c);
+    }
+    if (c->last_memory_slave)
+        server.stat_clients_slaves_memory -= c->last_memory_usage;
+    else
+        server.stat_clients_normal_memory -= c->last_memory_usage;
+    if (slave)
+        server.stat_clients_slaves_memory += mem;
+    else
+        server.stat_clients_normal_memory += mem;
+    c->last_memory_usage = mem;
+    c->last_memory_slave = slave;
+    updateClientMemUsageBucket(c);
+}
+
+/* Disconnect the clients using the most memory, until the memory of the
+ * normal and Pub/Sub clients is within maxmemory-clients. This is called
+ * before sleeping and before executing commands, so it may free the
+ * current client as well. The clients are found in the buckets of
+ * server.client_mem_usage_buckets, largest first, without walking all of
+ * them: the clients in the same bucket are within a factor of two of each
+ * other, and are evicted in no particular order. */
+void evictClients(void) {
+    size_t closing = 0; /* Memory of the clients that will be freed later. */
+    int bucket = CLIENT_MEM_USAGE_BUCKETS-1;
+    listIter li;
+    listNode *ln;
+
+    if (!server.maxmemory_clients) return;
+    while (bucket >= 0 &&
+           server.stat_clients_normal_memory - closing >
+           server.maxmemory_clients)
+    {
+        listRewind(server.client_mem_usage_buckets[bucket],&li);
+        while ((ln = listNext(&li)) != NULL &&
+               server.stat_clients_normal_memory - closing >
+               server.maxmemory_clients)
+        {
+            client *c = listNodeValue(ln);
+
+            if (c->flags & CLIENT_CLOSE_ASAP) {
+                closing += c->last_memory_usage;
+                continue;
+            }
+
+            sds ci = catClientInfoString(sdsempty(),c);
+            serverLog(LL_NOTICE,"Evicting client: %s",ci);
+            sdsfree(ci);
+            server.stat_evictedclients++;
+            if (c->flags & CLIENT_PROTECTED) {
+                closing += c->last_memory_usage;
+                freeClientAsync(c);
+            } else {
+                freeClient(c);
+            }
+        }
+        if (ln == NULL) bucket--;
+    }
 }
 
 /* Get the class of a client, used in order to enforce limits to different
@@ -2485,6 +3982,13 @@ int checkClientOutputBufferLimits(client *c) {
         used_mem >= server.client_obuf_limits[class].soft_limit_bytes)
         soft = 1;
 
+    /* The output buffer spilled to disk is not accounted in the limits
+     * above, but it can't grow past client-output-buffer-spill-max-size. */
+    if (server.client_obuf_spill_threshold &&
+        getClientOutputBufferSpilledBytes(c) >
+            (unsigned long long)server.client_obuf_spill_max_size)
+        hard = 1;
+
     /* We need to check if the soft limit is reached continuously for the
      * specified amount of seconds. */
     if (soft) {
@@ -2507,6 +4011,41 @@ int checkClientOutputBufferLimits(client *c) {
     return soft || hard;
 }
 
+/* When client-output-buffer-spill-threshold is set, move to the spill file
+ * the oldest blocks of the output buffer of a Pub/Sub client using more
+ * memory than the threshold, see spill.c. The blocks of the replicas are
+ * spilled by spillReplicationBuffer() instead, since they are shared.
+ *
+ * The tail block is kept in memory since the next replies are appended to
+ * it, and so are the blocks referencing objects, that are usually shared
+ * with other subscribers. We stop at the placeholder of a deferred length,
+ * the blocks following it are still being built. */
+void spillClientOutputBuffer(client *c) {
+    if (getClientType(c) != CLIENT_TYPE_PUBSUB ||
+        !pthread_equal(pthread_self(),server.main_thread_id)) return;
+
+    listNode *ln = c->reply_spill_last ? listNextNode(c->reply_spill_last) :
+                                         listFirst(c->reply);
+    while (ln && ln != listLast(c->reply) &&
+           c->reply_bytes - c->reply_spilled_bytes >
+               (unsigned long long)server.client_obuf_spill_threshold)
+    {
+        clientReplyBlock *o = listNodeValue(ln), *copy;
+
+        if (o == NULL) break;
+        if (!o->obj && !o->spilled) {
+            copy = spillStore(o,sizeof(*o)+o->size);
+            if (copy == NULL) break;
+            copy->spilled = 1;
+            listNodeValue(ln) = copy;
+            zfree_class(o,ZMALLOC_CLASS_TRANSIENT);
+            c->reply_spilled_bytes += copy->size;
+        }
+        c->reply_spill_last = ln;
+        ln = listNextNode(ln);
+    }
+}
+
 /* Asynchronously close a client if soft or hard limit is reached on the
  * output buffer size. The caller can check if the client will be closed
  * checking if the client CLIENT_CLOSE_ASAP flag is set.
@@ -2516,8 +4055,17 @@ int checkClientOutputBufferLimits(client *c) {
  * lower level functions pushing data inside the client output buffers. */
 void asyncCloseClientOnOutputBufferLimitReached(client *c) {
     if (!c->conn) return; /* It is unsafe to free fake clients. */
+    if (server.client_obuf_spill_threshold) spillClientOutputBuffer(c);
+    /* Keep the memory of the clients receiving data they don't read, for
+     * instance Pub/Sub messages, up to date for evictClients(). */
+    if (server.maxmemory_clients &&
+        pthread_equal(pthread_self(),server.main_thread_id))
+    {
+        updateClientMemUsage(c);
+    }
     serverAssert(c->reply_bytes < SIZE_MAX-(1024*64));
-    if (c->reply_bytes == 0 || c->flags & CLIENT_CLOSE_ASAP) return;
+    if ((c->reply_bytes == 0 && getClientType(c) != CLIENT_TYPE_SLAVE) ||
+        c->flags & CLIENT_CLOSE_ASAP) return;
     if (checkClientOutputBufferLimits(c)) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -2632,6 +4180,7 @@ int processEventsWhileBlocked(void) {
     int count = 0;
     while (iterations--) {
         int events = 0;
+        server.el_cycle_start = ustime();
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
         events += handleClientsWithPendingWrites();
         if (!events) break;
@@ -2640,6 +4189,251 @@ int processEventsWhileBlocked(void) {
     return count;
 }
 
+/* ==========================================================================
+ * Streamed replies
+ * --------------------------------------------------------------------------
+ * HGETALL, HKEYS, HVALS, SMEMBERS and ZRANGE over collections with millions
+ * of elements would block the server till the whole reply is created, and
+ * would accumulate it in the output buffer of the client at once. Instead
+ * the reply is created in 1 millisecond slices of the event loop, and the
+ * job pauses while the output buffer of the client is above a given size,
+ * so that it is produced just as fast as the client reads it.
+ *
+ * The client is blocked till the reply is complete, so its pipelined
+ * commands are executed later. The job references the value, and starts
+ * rehashing it completely if needed, so that a dictScan() cursor can't
+ * return an element twice. Every command writing the value completes the
+ * reply first: so the reply is exactly the one the command would produce
+ * if executed atomically, and the job doesn't need to check for changes.
+ *
+ * KEYS over a big keyspace runs in slices the same way, but the number of
+ * keys matching is only known at the end, so the reply is accumulated by
+ * the job and added to the client at once. The keys can't be added or
+ * deleted before the reply is complete, and the keyspace is not shrunk
+ * meanwhile, so that the cursor can't return a key twice.
+ * ========================================================================== */
+
+#define REPLY_SLICE_US 1000  /* Time spent replying every period. */
+#define REPLY_PERIOD_MS 1    /* Time left to clients between slices. */
+#define REPLY_MAX_PENDING (PROTO_REPLY_CHUNK_BYTES*16) /* Output buffer
+                                                           size pausing jobs */
+
+/* Return 1 if the reply of the command called by 'c', with 'numele'
+ * elements, should be produced in the background. */
+int replyCanBeStreamed(client *c, unsigned long numele) {
+    return server.replies_incremental_threshold &&
+           numele >= (unsigned long long)server.replies_incremental_threshold &&
+           !server.io_threads_executing && c->conn &&
+           !(c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE|CLIENT_MASTER|
+                         CLIENT_CLOSE_ASAP));
+}
+
+/* Called by the 'step' callbacks every few elements: return 1 if the job
+ * should stop for now, because the slice is over or the client has too
+ * much output still to read. */
+int replyJobShouldPause(replyJob *job, long long deadline) {
+    if (deadline == LLONG_MAX) return 0;
+    return getClientOutputBufferMemoryUsage(job->c) > REPLY_MAX_PENDING ||
+           ustime() >= deadline;
+}
+
+static void replyJobFinish(replyJob *job) {
+    if (job->c) unblockClient(job->c);
+    listDelNode(server.reply_jobs,job->node);
+    if (job->free) job->free(job);
+    if (job->val) decrRefCount(job->val);
+    if (job->db) job->db->keys_reply_jobs--;
+    zfree(job);
+}
+
+/* Reply till 'deadline', LLONG_MAX to complete the reply. */
+static void replyJobRun(replyJob *job, long long deadline) {
+    /* Drop the jobs of freed clients, and of the clients going to be
+     * closed because of their output buffer limits. */
+    if (job->c == NULL || job->c->flags & CLIENT_CLOSE_ASAP ||
+        job->step(job,deadline))
+    {
+        replyJobFinish(job);
+    }
+}
+
+static int replyTimeProc(struct aeEventLoop *eventLoop, long long id,
+                         void *clientData)
+{
+    long long deadline = ustime()+REPLY_SLICE_US;
+    listIter li;
+    listNode *ln;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    listRewind(server.reply_jobs,&li);
+    while((ln = listNext(&li)) && ustime() < deadline) {
+        replyJob *job = ln->value;
+        if (job->c && !(job->c->flags & CLIENT_CLOSE_ASAP) &&
+            getClientOutputBufferMemoryUsage(job->c) > REPLY_MAX_PENDING)
+            continue;
+        replyJobRun(job,deadline);
+    }
+
+    if (listLength(server.reply_jobs)) return REPLY_PERIOD_MS;
+    server.reply_timer_id = -1;
+    return AE_NOMORE;
+}
+
+/* Block the client and reply the 'numele' elements of 'val' in the
+ * background. The caller already replied the header of the aggregate
+ * reply, and may set the cursor and the state of the returned job. The
+ * 'step' callback and the 'flags' are described in server.h.
+ *
+ * When 'val' is NULL the job replies the keys of the DB of the client, see
+ * keysCommand(): every key added or deleted in the DB completes the reply
+ * first, like the writes to 'val' do. */
+replyJob *replyStartJob(client *c, robj *val, unsigned long numele,
+                        int flags,
+                        int (*step)(replyJob *job, long long deadline))
+{
+    replyJob *job = zcalloc(sizeof(*job));
+
+    job->c = c;
+    job->val = val;
+    if (val) {
+        incrRefCount(val);
+    } else {
+        job->db = c->db;
+        job->db->keys_reply_jobs++;
+    }
+    job->remaining = numele;
+    job->flags = flags;
+    job->step = step;
+
+    listAddNodeTail(server.reply_jobs,job);
+    job->node = listLast(server.reply_jobs);
+    if (server.reply_timer_id == -1)
+        server.reply_timer_id = aeCreateTimeEvent(server.el,REPLY_PERIOD_MS,
+                                                  replyTimeProc,NULL,NULL);
+
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_REPLY);
+    return job;
+}
+
+/* Complete the replies of the jobs iterating 'val', that is going to be
+ * modified. */
+void replyFlushJobsOfValue(robj *val) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.reply_jobs,&li);
+    while((ln = listNext(&li))) {
+        replyJob *job = ln->value;
+        if (job->val == val) replyJobRun(job,LLONG_MAX);
+    }
+}
+
+/* Complete the replies of the jobs iterating the keyspace of 'db', that is
+ * going to be modified. */
+void replyFlushJobsOfDb(redisDb *db) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.reply_jobs,&li);
+    while((ln = listNext(&li))) {
+        replyJob *job = ln->value;
+        if (job->db == db) replyJobRun(job,LLONG_MAX);
+    }
+}
+
+/* Called before executing a command: complete the replies of the jobs
+ * iterating the values of the keys the command writes. */
+void replyFlushJobsOfKeys(redisDb *db, struct redisCommand *cmd,
+                          robj **argv, int argc)
+{
+    int numkeys, *keys;
+
+    if (listLength(server.reply_jobs) == 0 || !(cmd->flags & CMD_WRITE))
+        return;
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (int j = 0; j < numkeys; j++) {
+        dictEntry *de = dictFind(db->dict,argv[keys[j]]->ptr);
+        if (de) replyFlushJobsOfValue(dictGetVal(de));
+    }
+    getKeysFreeResult(keys);
+}
+
+/* Called when the DB is flushed: the values may be released in a
+ * background thread, so the jobs complete their replies first. */
+void replyFlushAllJobs(void) {
+    while (listLength(server.reply_jobs))
+        replyJobRun(listNodeValue(listFirst(server.reply_jobs)),LLONG_MAX);
+}
+
+/* The client receiving the reply is freed: the job is dropped. */
+void unblockClientWaitingReply(client *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.reply_jobs,&li);
+    while((ln = listNext(&li))) {
+        replyJob *job = ln->value;
+        if (job->c == c) job->c = NULL;
+    }
+}
+
+/* ==========================================================================
+ * Event loop latency target
+ * --------------------------------------------------------------------------
+ * When the main thread is overloaded, the replication links and the
+ * connections of Sentinel or of the administrators would wait behind the
+ * traffic of the other clients, and Sentinel could see timeouts and start
+ * a failover. Once an iteration of the event loop lasted more than
+ * eventloop-latency-target milliseconds, the reads of the normal clients
+ * are delayed to the next iteration, where they are served first, in
+ * order, while the masters, the replicas and the clients that called
+ * CLIENT PRIORITY ON are always served.
+ * ========================================================================== */
+
+/* Return 1 if the read of the client 'c' must be delayed because the event
+ * loop is over its latency target. As a side effect the client is queued
+ * in server.clients_throttled, served by handleThrottledClients(). */
+int throttleClientRead(client *c) {
+    if (!server.eventloop_latency_target ||
+        c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PRIORITY)) return 0;
+
+    if (ustime()-server.el_cycle_start <
+        server.eventloop_latency_target*1000)
+    {
+        /* Served before its turn came in handleThrottledClients(). */
+        if (c->flags & CLIENT_THROTTLED) {
+            listDelNode(server.clients_throttled,c->throttled_node);
+            c->throttled_node = NULL;
+            c->flags &= ~CLIENT_THROTTLED;
+        }
+        return 0;
+    }
+    if (!(c->flags & CLIENT_THROTTLED)) {
+        c->flags |= CLIENT_THROTTLED;
+        listAddNodeTail(server.clients_throttled,c);
+        c->throttled_node = listLast(server.clients_throttled);
+        server.stat_throttled_reads++;
+    }
+    return 1;
+}
+
+/* Called by afterSleep(): serve the clients whose read was delayed by the
+ * previous iterations, in the order they were delayed, while the event
+ * loop is within its latency target. */
+void handleThrottledClients(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.clients_throttled)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (throttleClientRead(c)) break;
+        /* Protected clients don't read till their handler is restored. */
+        if (connHasReadHandler(c->conn)) readQueryFromClient(c->conn);
+    }
+}
+
 /* ==========================================================================
  * Threaded I/O
  * ========================================================================== */
@@ -2649,30 +4443,62 @@ int tio_debug = 0;
 #define IO_THREADS_MAX_NUM 128
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
+#define IO_THREADS_OP_TLS_HANDSHAKE 2
+#define IO_THREADS_OP_PARSE 3
+
+struct parseJob;
+static void parseCommandsJob(struct parseJob *job);
+
+/* Number of iterations an idle I/O thread spins waiting for work before
+ * parking itself on its condition variable. Under load the next batch of
+ * clients usually arrives while the thread is still spinning, so that we
+ * avoid paying a wakeup, while idle threads don't burn CPU. */
+#define IO_THREADS_SPIN_ITERATIONS 10000
+
+/* Minimum number of clients each active I/O thread should handle: with less
+ * work than that, waking up another thread costs more than what we gain
+ * serving the clients in parallel. */
+#define IO_THREADS_MIN_CLIENTS_PER_THREAD 2
 
 pthread_t io_threads[IO_THREADS_MAX_NUM];
 pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+pthread_cond_t io_threads_cond[IO_THREADS_MAX_NUM];
 _Atomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+_Atomic int io_threads_parked[IO_THREADS_MAX_NUM]; /* Waiting on the cond? */
 int io_threads_active;  /* Are the threads currently spinning waiting I/O? */
-int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
+int io_threads_op;      /* One of the IO_THREADS_OP_* operations. */
 list *io_threads_list[IO_THREADS_MAX_NUM];
 
+/* Per thread statistics, only updated by the owning thread. The utilization
+ * is sampled by the main thread in trackIOThreadsUtilization(). */
+_Atomic long long io_threads_busy_usec[IO_THREADS_MAX_NUM];
+_Atomic long long io_threads_processed[IO_THREADS_MAX_NUM];
+long long io_threads_busy_usec_prev[IO_THREADS_MAX_NUM];
+double io_threads_utilization[IO_THREADS_MAX_NUM];
+long long io_threads_last_sample_time;
+
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
      * used by the thread to just manipulate a single sub-array of clients. */
     long id = (unsigned long)myid;
 
+    redisSetCpuAffinity(server.server_cpulist);
     while(1) {
         /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
+        for (int j = 0; j < IO_THREADS_SPIN_ITERATIONS; j++) {
             if (io_threads_pending[id] != 0) break;
         }
 
-        /* Give the main thread a chance to stop this thread. */
+        /* Nothing to do: park the thread until the main thread signals us.
+         * Note that this is also how the main thread stops us, by holding
+         * our mutex, see stopThreadedIO(). */
         if (io_threads_pending[id] == 0) {
             pthread_mutex_lock(&io_threads_mutex[id]);
+            io_threads_parked[id] = 1;
+            while (io_threads_pending[id] == 0)
+                pthread_cond_wait(&io_threads_cond[id],&io_threads_mutex[id]);
+            io_threads_parked[id] = 0;
             pthread_mutex_unlock(&io_threads_mutex[id]);
-            continue;
         }
 
         serverAssert(io_threads_pending[id] != 0);
@@ -2681,6 +4507,7 @@ void *IOThreadMain(void *myid) {
 
         /* Process: note that the main thread will never touch our list
          * before we drop the pending count to 0. */
+        long long start = ustime();
         listIter li;
         listNode *ln;
         listRewind(io_threads_list[id],&li);
@@ -2690,10 +4517,18 @@ void *IOThreadMain(void *myid) {
                 writeToClient(c,0);
             } else if (io_threads_op == IO_THREADS_OP_READ) {
                 readQueryFromClient(c->conn);
+            } else if (io_threads_op == IO_THREADS_OP_TLS_HANDSHAKE) {
+                /* The list holds connections not having a client yet. */
+                tlsHandshakeStep(listNodeValue(ln));
+            } else if (io_threads_op == IO_THREADS_OP_PARSE) {
+                /* The list holds parts of the master query buffer. */
+                parseCommandsJob(listNodeValue(ln));
             } else {
                 serverPanic("io_threads_op value is unknown");
             }
         }
+        io_threads_processed[id] += listLength(io_threads_list[id]);
+        io_threads_busy_usec[id] += ustime()-start;
         listEmpty(io_threads_list[id]);
         io_threads_pending[id] = 0;
 
@@ -2704,6 +4539,7 @@ void *IOThreadMain(void *myid) {
 /* Initialize the data structures needed for threaded I/O. */
 void initThreadedIO(void) {
     io_threads_active = 0; /* We start with threads not active. */
+    io_threads_last_sample_time = ustime();
 
     /* Don't spawn any thread if the user selected a single thread:
      * we'll handle I/O directly from the main thread. */
@@ -2719,7 +4555,13 @@ void initThreadedIO(void) {
     for (int i = 0; i < server.io_threads_num; i++) {
         pthread_t tid;
         pthread_mutex_init(&io_threads_mutex[i],NULL);
+        pthread_cond_init(&io_threads_cond[i],NULL);
         io_threads_pending[i] = 0;
+        io_threads_parked[i] = 0;
+        io_threads_busy_usec[i] = 0;
+        io_threads_processed[i] = 0;
+        io_threads_busy_usec_prev[i] = 0;
+        io_threads_utilization[i] = 0;
         io_threads_list[i] = listCreate();
         pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
         if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
@@ -2753,22 +4595,78 @@ void stopThreadedIO(void) {
     io_threads_active = 0;
 }
 
+/* Return the number of I/O threads worth using in order to serve 'pending'
+ * clients, according to IO_THREADS_MIN_CLIENTS_PER_THREAD. At least one
+ * thread (the main thread) is always used. */
+int ioThreadsNeeded(int pending) {
+    int needed = pending / IO_THREADS_MIN_CLIENTS_PER_THREAD;
+    if (needed > server.io_threads_num) needed = server.io_threads_num;
+    if (needed < 1) needed = 1;
+    return needed;
+}
+
+/* Assign the clients in the list 'clients' to the first 'numthreads' I/O
+ * threads, set the operation to perform, and give the start condition to
+ * the threads, waking up the ones that are parked. Then wait for all the
+ * threads to end their work. */
+void ioThreadsDispatchAndWait(list *clients, int numthreads, int op) {
+    listIter li;
+    listNode *ln;
+
+    /* Distribute the clients across N different lists. */
+    listRewind(clients,&li);
+    int item_id = 0;
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        int target_id = item_id % numthreads;
+        listAddNodeTail(io_threads_list[target_id],c);
+        item_id++;
+    }
+
+    /* Give the start condition to the waiting threads, by setting the
+     * start condition atomic var. Threads that already parked themselves
+     * need to be signaled as well: since both 'pending' and 'parked' are
+     * sequentially consistent atomic vars, a thread either sees the new
+     * pending count before parking, or we see it parked here. */
+    io_threads_op = op;
+    for (int j = 0; j < numthreads; j++) {
+        int count = listLength(io_threads_list[j]);
+        if (count == 0) continue;
+        io_threads_pending[j] = count;
+        if (io_threads_parked[j]) {
+            pthread_mutex_lock(&io_threads_mutex[j]);
+            pthread_cond_signal(&io_threads_cond[j]);
+            pthread_mutex_unlock(&io_threads_mutex[j]);
+        }
+    }
+
+    /* Wait for all threads to end their work. */
+    while(1) {
+        unsigned long pending = 0;
+        for (int j = 0; j < numthreads; j++)
+            pending += io_threads_pending[j];
+        if (pending == 0) break;
+    }
+}
+
 /* This function checks if there are not enough pending clients to justify
  * taking the I/O threads active: in that case I/O threads are stopped if
- * currently active. We track the pending writes as a measure of clients
- * we need to handle in parallel, however the I/O threading is disabled
- * globally for reads as well if we have too little pending clients.
+ * currently active. We track both the pending reads and writes as a measure
+ * of clients we need to handle in parallel: the number of threads actually
+ * used to serve them is then adapted to the backlog by ioThreadsNeeded(),
+ * while unused threads remain parked without consuming CPU.
  *
  * The function returns 0 if the I/O threading should be used becuase there
  * are enough active threads, otherwise 1 is returned and the I/O threads
  * could be possibly stopped (if already active) as a side effect. */
 int stopThreadedIOIfNeeded(void) {
-    int pending = listLength(server.clients_pending_write);
+    int pending = listLength(server.clients_pending_write) +
+                  listLength(server.clients_pending_read);
 
     /* Return ASAP if IO threads are disabled (single threaded mode). */
     if (server.io_threads_num == 1) return 1;
 
-    if (pending < (server.io_threads_num*2)) {
+    if (ioThreadsNeeded(pending) < 2) {
         if (io_threads_active) stopThreadedIO();
         return 1;
     } else {
@@ -2791,34 +4689,28 @@ int handleClientsWithPendingWritesUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL WRITE pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_write,&li);
-    int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
-    }
-
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_WRITE;
-    for (int j = 0; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
 
-    /* Wait for all threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 0; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
+        /* Slaves send from the shared replication buffer, and may release
+         * blocks of it while advancing: this is only safe in the main
+         * thread, so they are served here. */
+        if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+            listDelNode(server.clients_pending_write,ln);
+            if (writeToClient(c,0) == C_ERR) continue;
+            if (clientHasPendingReplies(c) &&
+                connSetWriteHandler(c->conn, sendReplyToClient) == AE_ERR)
+            {
+                freeClientAsync(c);
+            }
+        }
     }
+    ioThreadsDispatchAndWait(server.clients_pending_write,
+                             ioThreadsNeeded(processed),IO_THREADS_OP_WRITE);
     if (tio_debug) printf("I/O WRITE All threads finshed\n");
 
     /* Run the list of clients again to install the write handler where
@@ -2826,6 +4718,7 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     listRewind(server.clients_pending_write,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
+        updateClientMemUsage(c);
 
         /* Install the write handler if there are pending writes in some
          * of the clients. */
@@ -2839,6 +4732,112 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     return processed;
 }
 
+/* Sample the utilization of every I/O thread, as the fraction of the time
+ * elapsed since the previous sample the thread spent serving clients. This
+ * is called by serverCron() once per second, and reported by INFO. */
+void trackIOThreadsUtilization(void) {
+    long long now = ustime();
+    long long elapsed = now - io_threads_last_sample_time;
+
+    if (server.io_threads_num == 1 || elapsed <= 0) return;
+    for (int j = 0; j < server.io_threads_num; j++) {
+        long long busy = io_threads_busy_usec[j];
+        io_threads_utilization[j] =
+            (double)(busy - io_threads_busy_usec_prev[j]) / elapsed;
+        io_threads_busy_usec_prev[j] = busy;
+    }
+    io_threads_last_sample_time = now;
+}
+
+/* Append the I/O threads information to the INFO output 'info'. */
+sds genIOThreadsInfoString(sds info) {
+    info = sdscatprintf(info,"io_threads_active:%d\r\n",io_threads_active);
+    if (server.io_threads_num == 1) return info;
+    for (int j = 0; j < server.io_threads_num; j++) {
+        info = sdscatprintf(info,
+            "io_thread_%d:clients=%lld,busy_usec=%lld,utilization=%.2f\r\n",
+            j, (long long)io_threads_processed[j],
+            (long long)io_threads_busy_usec[j],
+            io_threads_utilization[j]*100);
+    }
+    return info;
+}
+
+/* Return 1 if the command just parsed by an I/O thread for the client 'c'
+ * can be executed directly by the same I/O thread, instead of being handed
+ * back to the main thread. This is the case only for read only and fast
+ * commands sent by normal clients, that have no side effect other than
+ * producing a reply. Every command that would fail or need special handling
+ * (errors, ACL denials, MULTI, client side caching, ...) is just left to the
+ * main thread, that will process it normally.
+ *
+ * The function is only called by I/O threads while the main thread is
+ * waiting for them in handleClientsWithPendingReadsUsingThreads(), so the
+ * global state can be accessed safely, as long as it is only read. */
+int ioThreadCanExecuteCommand(client *c) {
+    if (!server.io_threads_executing) return 0;
+    if (c->flags & (CLIENT_MULTI|CLIENT_TRACKING|CLIENT_PUBSUB|
+                    CLIENT_MONITOR|CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP))
+        return 0;
+
+    struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL ||
+        (cmd->flags & (CMD_READONLY|CMD_FAST)) != (CMD_READONLY|CMD_FAST) ||
+        cmd->flags & (CMD_RANDOM|CMD_ADMIN|CMD_MODULE|CMD_PUBSUB))
+        return 0;
+    if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity))
+        return 0;
+
+    /* Roaring bitmaps are converted to plain strings by the string commands,
+     * compressed strings by the ones of stringCompressionCommandNeedsRaw(),
+     * and the values in the tiered storage, or still in the RDB file loaded
+     * lazily, are read back, see lookupKey(): only the main thread can do
+     * it. */
+    if (cmd->firstkey &&
+        (cmd->flags & (CMD_CATEGORY_STRING|CMD_CATEGORY_BITMAP|
+                       CMD_CATEGORY_HYPERLOGLOG|CMD_CATEGORY_BLOOM) ||
+         server.tiered_storage || server.rdb_lazy_load))
+    {
+        int last = cmd->lastkey < 0 ? c->argc+cmd->lastkey : cmd->lastkey;
+        int j;
+
+        for (j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+            dictEntry *de = dictFind(c->db->dict,c->argv[j]->ptr);
+            if (de == NULL) continue;
+            robj *o = dictGetVal(de);
+            if (o->encoding == OBJ_ENCODING_SWAPPED ||
+                (o->encoding == OBJ_ENCODING_ROARING &&
+                 cmd->flags & CMD_CATEGORY_STRING) ||
+                (o->encoding == OBJ_ENCODING_COMPRESSED &&
+                 stringCompressionCommandNeedsRaw(cmd))) return 0;
+        }
+    }
+
+    /* Authentication and ACLs: see processCommand(). */
+    int auth_required = (!(DefaultUser->flags & USER_FLAG_NOPASS) ||
+                           DefaultUser->flags & USER_FLAG_DISABLED) &&
+                        !c->authenticated;
+    if (auth_required) return 0;
+    c->cmd = cmd;
+    if (ACLCheckCommandPerm(c) != ACL_OK) return 0;
+    return 1;
+}
+
+/* Execute the command for the client 'c' in the context of an I/O thread.
+ * This is a minimal version of call(): the rest of the work, that touches
+ * global state such as the commands statistics and the slow log, is
+ * performed later by the main thread calling callIOThreadEpilogue(). */
+void ioThreadExecuteCommand(client *c) {
+    ustime_t start;
+
+    c->lastcmd = c->cmd;
+    c->flags |= CLIENT_IO_THREAD_CMD;
+    start = ustime();
+    trackCommandQueueTime(c,start);
+    c->cmd->proc(c);
+    c->io_thread_cmd_duration = ustime()-start;
+}
+
 /* Return 1 if we want to handle the client read later using threaded I/O.
  * This is called by the readable handler of the event loop.
  * As a side effect of calling this function the client is put in the
@@ -2846,7 +4845,8 @@ int handleClientsWithPendingWritesUsingThreads(void) {
 int postponeClientRead(client *c) {
     if (io_threads_active &&
         server.io_threads_do_reads &&
-        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ)))
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PRIORITY|
+                      CLIENT_PENDING_READ)))
     {
         c->flags |= CLIENT_PENDING_READ;
         listAddNodeHead(server.clients_pending_read,c);
@@ -2869,46 +4869,202 @@ int handleClientsWithPendingReadsUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL READ pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
-    listIter li;
-    listNode *ln;
-    listRewind(server.clients_pending_read,&li);
-    int item_id = 0;
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
+    /* If enabled, let the I/O threads also execute the read only commands
+     * they parse. While they run, the main thread just waits for them to
+     * finish, so the dataset can't change: we only need to make sure that
+     * nothing is modified as a side effect of lookups (no rehashing steps,
+     * no expired keys deletion, see expireIfNeeded()), and that there is
+     * no server state requiring the commands to be seen by the main
+     * thread. */
+    int exec_commands = server.io_threads_do_commands &&
+                        !server.cluster_enabled &&
+                        !server.loading &&
+                        !server.lua_caller &&
+                        listLength(server.monitors) == 0 &&
+                        !(server.notify_keyspace_events & NOTIFY_KEY_MISS) &&
+                        !moduleHasCommandHooks() &&
+                        !(server.masterhost &&
+                          server.repl_state != REPL_STATE_CONNECTED &&
+                          !server.repl_serve_stale_data);
+    if (exec_commands) {
+        updateCachedTime(0);
+        dictPauseRehashing();
+        server.io_threads_executing = 1;
     }
 
-    /* Give the start condition to the waiting threads, by setting the
-     * start condition atomic var. */
-    io_threads_op = IO_THREADS_OP_READ;
-    for (int j = 0; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
+    ioThreadsDispatchAndWait(server.clients_pending_read,
+                             ioThreadsNeeded(processed),IO_THREADS_OP_READ);
+    if (tio_debug) printf("I/O READ All threads finshed\n");
 
-    /* Wait for all threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 0; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
+    if (exec_commands) {
+        server.io_threads_executing = 0;
+        dictResumeRehashing();
     }
-    if (tio_debug) printf("I/O READ All threads finshed\n");
 
     /* Run the list of clients again to process the new buffers. */
+    listIter li;
+    listNode *ln;
     listRewind(server.clients_pending_read,&li);
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_READ;
         if (c->flags & CLIENT_PENDING_COMMAND) {
             c->flags &= ~ CLIENT_PENDING_COMMAND;
-            processCommandAndResetClient(c);
+            if (c->flags & CLIENT_IO_THREAD_CMD) {
+                /* The command was already executed by the I/O thread. */
+                c->flags &= ~CLIENT_IO_THREAD_CMD;
+                callIOThreadEpilogue(c);
+                resetClient(c);
+                if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+            } else {
+                processCommandAndResetClient(c);
+            }
         }
         processInputBufferAndReplicate(c);
     }
     listEmpty(server.clients_pending_read);
     return processed;
 }
+
+/* Return the length of the multi bulk command at 'p', if it is complete in
+ * the 'avail' bytes, setting '*argc' to the number of arguments. Zero is
+ * returned if the command is incomplete, not a multi bulk command, or
+ * anything processMultibulkBuffer() should handle itself, like protocol
+ * errors and empty commands. */
+static size_t scanMultibulkCommand(const char *p, size_t avail, int *argc) {
+    const char *start = p, *end = p+avail, *nl;
+    long long ll, len;
+
+    if (avail == 0 || *p != '*' || (nl = memchr(p,'\r',avail)) == NULL ||
+        end-nl < 2 || !string2ll(p+1,nl-(p+1),&ll) || ll <= 0 ||
+        ll > 1024*1024) return 0;
+    p = nl+2;
+    for (long long j = 0; j < ll; j++) {
+        if (p >= end || *p != '$' || (nl = memchr(p,'\r',end-p)) == NULL ||
+            !string2ll(p+1,nl-(p+1),&len) || len < 0 ||
+            len > server.proto_max_bulk_len || end-(nl+2) < len+2) return 0;
+        p = nl+2+len+2;
+    }
+    *argc = ll;
+    return p-start;
+}
+
+/* Parse 'count' commands, already scanned by scanMultibulkCommand(), that
+ * are stored one after the other at 'buf'. */
+typedef struct parseJob {
+    const char *buf;
+    parsedCommand *cmds;
+    int count;
+} parseJob;
+
+static void parseCommandsJob(parseJob *job) {
+    const char *p = job->buf;
+
+    for (int j = 0; j < job->count; j++) {
+        parsedCommand *pc = job->cmds+j;
+
+        pc->argv = zmalloc(sizeof(robj*)*pc->argc);
+        p = strchr(p,'\n')+1;
+        for (int i = 0; i < pc->argc; i++) {
+            const char *nl = strchr(p,'\r');
+            long long len;
+
+            string2ll(p+1,nl-(p+1),&len);
+            p = nl+2;
+            pc->argv[i] = createStringObject(p,len);
+            p += len+2;
+        }
+    }
+}
+
+/* When replica-parallel-parse is enabled, and the replica is behind so
+ * that the query buffer of the master 'c' accumulates many commands, split
+ * the complete commands in as many parts as the I/O threads, that parse
+ * them in parallel into the arguments objects. The main thread then just
+ * executes them in order, see processInputBuffer(): the commands are still
+ * consumed from the query buffer one after the other, so that the
+ * replication offset is updated as usual.
+ *
+ * Executing the commands themselves in parallel is not possible, since
+ * the keyspace and most of the server state are not thread safe, but the
+ * parsing and the allocation of the arguments are a big part of the time
+ * needed to apply simple commands. */
+void parseMasterStreamUsingThreads(client *c) {
+    size_t pos = c->qb_pos, qblen = sdslen(c->querybuf);
+    int count = 0, alloc = 0;
+    parsedCommand *cmds = NULL;
+
+    if (server.io_threads_num == 1 || c->parsed_cmds ||
+        c->flags & CLIENT_PENDING_READ || c->reqtype || c->argc ||
+        qblen-pos < REPL_PARALLEL_PARSE_MIN_BYTES) return;
+
+    /* Find the complete commands. */
+    while (count < REPL_PARALLEL_PARSE_MAX_CMDS) {
+        int argc;
+        size_t len = scanMultibulkCommand(c->querybuf+pos,qblen-pos,&argc);
+        if (len == 0) break;
+        if (count == alloc) {
+            alloc = alloc ? alloc*2 : 1024;
+            cmds = zrealloc(cmds,sizeof(*cmds)*alloc);
+        }
+        cmds[count].argc = argc;
+        cmds[count].argv = NULL;
+        cmds[count].len = len;
+        count++;
+        pos += len;
+    }
+    if (pos-c->qb_pos < REPL_PARALLEL_PARSE_MIN_BYTES) {
+        zfree(cmds);
+        return;
+    }
+
+    /* Split them in parts of about the same size. */
+    int numthreads = server.io_threads_num;
+    size_t target = (pos-c->qb_pos)/numthreads+1, acc = 0;
+    parseJob *jobs = zcalloc(sizeof(*jobs)*numthreads);
+    list *todo = listCreate();
+    const char *p = c->querybuf+c->qb_pos;
+    int job = 0;
+
+    jobs[0].buf = p;
+    jobs[0].cmds = cmds;
+    for (int j = 0; j < count; j++) {
+        if (acc >= target && job < numthreads-1) {
+            jobs[++job].buf = p;
+            jobs[job].cmds = cmds+j;
+            acc = 0;
+        }
+        jobs[job].count++;
+        acc += cmds[j].len;
+        p += cmds[j].len;
+    }
+    for (int j = 0; j <= job; j++) listAddNodeTail(todo,jobs+j);
+
+    if (!io_threads_active) startThreadedIO();
+    ioThreadsDispatchAndWait(todo,job+1,IO_THREADS_OP_PARSE);
+    listRelease(todo);
+    zfree(jobs);
+
+    c->parsed_cmds = cmds;
+    c->parsed_cmds_count = count;
+    c->parsed_cmds_pos = 0;
+    server.stat_repl_parallel_parsed += count;
+}
+
+/* Run the TLS handshakes of the accepted connections in the list 'conns'
+ * using the I/O threads, starting them if needed: the handshake is CPU
+ * bound, and after a failover many clients may reconnect at the same time.
+ * Returns the number of handshakes processed, or 0 if there are not enough
+ * connections to use the threads, and the caller should do them. */
+int handleTLSHandshakesUsingThreads(list *conns) {
+    int processed = listLength(conns);
+    if (server.io_threads_num == 1 || ioThreadsNeeded(processed) < 2)
+        return 0;
+
+    if (tio_debug) printf("%d TOTAL TLS handshakes pending\n", processed);
+
+    if (!io_threads_active) startThreadedIO();
+    ioThreadsDispatchAndWait(conns,ioThreadsNeeded(processed),
+                             IO_THREADS_OP_TLS_HANDSHAKE);
+    return processed;
+}
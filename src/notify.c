@@ -89,6 +89,161 @@ sds keyspaceEventsFlagsToString(int flags) {
     return res;
 }
 
+/* -----------------------------------------------------------------------------
+ * Notifications stream
+ *
+ * When notify-keyspace-events-stream is set, the events of the enabled
+ * classes are also appended to a stream of DB 0, so that the consumers can
+ * read them with XREADGROUP: unlike Pub/Sub an event is not lost if the
+ * consumer is disconnected, and the memory used is bounded by the capped
+ * length of the stream instead of the output buffer of slow subscribers.
+ *
+ * The events are queued while the commands are executed, and appended in a
+ * single batch per event loop iteration by beforeSleep(). Every entry has
+ * the fields "db", "event" and "key".
+ * -------------------------------------------------------------------------- */
+
+/* Events waiting to be appended to the stream: every node value is an array
+ * of the 6 objects of an entry. */
+static list *StreamPendingEvents = NULL;
+static robj *StreamFieldNames[3];
+
+static void freeStreamPendingEvent(void *ptr) {
+    robj **fields = ptr;
+    for (int j = 1; j < 6; j += 2) decrRefCount(fields[j]);
+    zfree(fields);
+}
+
+/* Queue the event for the notifications stream, if enabled. */
+static void queueKeyspaceEventForStream(char *event, robj *key, int dbid) {
+    char *name = server.notify_keyspace_events_stream;
+
+    /* Replicas get the stream from their master, and the events of the
+     * data being loaded were already appended when it was written. */
+    if (name == NULL || server.masterhost || server.loading) return;
+    /* Don't notify the changes of the stream into the stream itself. */
+    if (dbid == 0 && sdsEncodedObject(key) && !strcmp(key->ptr,name)) return;
+
+    if (StreamPendingEvents == NULL) {
+        StreamPendingEvents = listCreate();
+        listSetFreeMethod(StreamPendingEvents,freeStreamPendingEvent);
+        StreamFieldNames[0] = createStringObject("db",2);
+        StreamFieldNames[1] = createStringObject("event",5);
+        StreamFieldNames[2] = createStringObject("key",3);
+    }
+
+    /* The older events would be trimmed anyway: keep the queue bounded. */
+    while ((long long)listLength(StreamPendingEvents) >=
+           server.notify_keyspace_events_stream_maxlen)
+        listDelNode(StreamPendingEvents,listFirst(StreamPendingEvents));
+
+    char buf[24];
+    int len = ll2string(buf,sizeof(buf),dbid);
+    robj *keyname = getDecodedObject(key);
+    robj **fields = zmalloc(sizeof(robj*)*6);
+    fields[0] = StreamFieldNames[0];
+    fields[1] = createStringObject(buf,len);
+    fields[2] = StreamFieldNames[1];
+    fields[3] = createStringObject(event,strlen(event));
+    fields[4] = StreamFieldNames[2];
+    /* Copy the key: callers may pass objects allocated on the stack. */
+    fields[5] = createStringObject(keyname->ptr,sdslen(keyname->ptr));
+    decrRefCount(keyname);
+    listAddNodeTail(StreamPendingEvents,fields);
+}
+
+/* Append the queued events to the notifications stream, trimming it, and
+ * propagate the whole batch as a single XADD ... ENTRIES command. Called by
+ * beforeSleep(). */
+void notifyFlushKeyspaceEventsStream(void) {
+    if (StreamPendingEvents == NULL || listLength(StreamPendingEvents) == 0)
+        return;
+
+    char *name = server.notify_keyspace_events_stream;
+    if (name == NULL || server.masterhost) {
+        listEmpty(StreamPendingEvents);
+        return;
+    }
+
+    redisDb *db = server.db;
+    robj *keyobj = createStringObject(name,strlen(name));
+    robj *o = lookupKeyWrite(db,keyobj);
+    if (o && o->type != OBJ_STREAM) {
+        static time_t lastlog = 0;
+        if (server.unixtime - lastlog > 60) {
+            serverLog(LL_WARNING,"The key '%s' set as "
+                "notify-keyspace-events-stream is not a stream: dropping "
+                "the keyspace events.", name);
+            lastlog = server.unixtime;
+        }
+        listEmpty(StreamPendingEvents);
+        decrRefCount(keyobj);
+        return;
+    }
+    if (o == NULL) {
+        o = createStreamObject();
+        dbAdd(db,keyobj,o);
+    }
+    stream *s = o->ptr;
+
+    long count = listLength(StreamPendingEvents);
+    robj ***argv = zmalloc(sizeof(robj**)*count);
+    int64_t *numfields = zmalloc(sizeof(int64_t)*count);
+    streamID *ids = zmalloc(sizeof(streamID)*count);
+    streamID last = s->last_id;
+    listIter li;
+    listNode *ln;
+    long k = 0;
+
+    listRewind(StreamPendingEvents,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        argv[k] = ln->value;
+        numfields[k] = 3;
+        streamNextID(&last,&ids[k]);
+        last = ids[k];
+        k++;
+    }
+    streamAppendItems(s,argv,numfields,ids,count);
+    streamTrimByLength(s,server.notify_keyspace_events_stream_maxlen,1);
+
+    /* XADD <key> MAXLEN = <len> ENTRIES <count> [<id> 3 db .. event .. key ..]
+     * Approximated trimming is propagated as exact trimming to the resulting
+     * length, like XADD itself does. */
+    int pargc = 7+count*8;
+    robj **pargv = zmalloc(sizeof(robj*)*pargc);
+    int j = 0;
+    pargv[j++] = createStringObject("XADD",4);
+    pargv[j++] = keyobj;
+    incrRefCount(keyobj);
+    pargv[j++] = createStringObject("MAXLEN",6);
+    pargv[j++] = createStringObject("=",1);
+    pargv[j++] = createStringObjectFromLongLong(s->length);
+    pargv[j++] = createStringObject("ENTRIES",7);
+    pargv[j++] = createStringObjectFromLongLong(count);
+    for (k = 0; k < count; k++) {
+        pargv[j++] = createObjectFromStreamID(&ids[k]);
+        pargv[j++] = createStringObjectFromLongLong(3);
+        for (int f = 0; f < 6; f++) {
+            pargv[j] = argv[k][f];
+            incrRefCount(pargv[j++]);
+        }
+    }
+    propagate(server.xaddCommand,0,pargv,pargc,PROPAGATE_AOF|PROPAGATE_REPL);
+    for (j = 0; j < pargc; j++) decrRefCount(pargv[j]);
+    zfree(pargv);
+
+    signalModifiedKey(db,keyobj);
+    if (server.blocked_clients_by_type[BLOCKED_STREAM])
+        signalKeyAsReady(db,keyobj);
+    server.dirty += count;
+
+    decrRefCount(keyobj);
+    zfree(argv);
+    zfree(numfields);
+    zfree(ids);
+    listEmpty(StreamPendingEvents);
+}
+
 /* The API provided to the rest of the Redis core is a simple function:
  *
  * notifyKeyspaceEvent(char *event, robj *key, int dbid);
@@ -97,8 +252,9 @@ sds keyspaceEventsFlagsToString(int flags) {
  * 'key' is a Redis object representing the key name.
  * 'dbid' is the database ID where the key lives.  */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
-    sds chan;
-    robj *chanobj, *eventobj;
+    /* The channel names are built into buffers reused across calls. */
+    static sds chan = NULL;
+    robj *chanobj, *eventobj = NULL;
     int len = -1;
     char buf[24];
 
@@ -111,30 +267,53 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     /* If notifications for this class of events are off, return ASAP. */
     if (!(server.notify_keyspace_events & type)) return;
 
-    eventobj = createStringObject(event,strlen(event));
+    queueKeyspaceEventForStream(event,key,dbid);
+
+    /* Return ASAP as well if nobody at all is listening. */
+    if (dictSize(server.pubsub_channels) == 0 &&
+        dictSize(server.pubsub_patterns) == 0) return;
+
+    /* The messages queued to the subscribers are not part of the memory
+     * of the DB of the key. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
+    if (chan == NULL) chan = sdsempty();
 
     /* __keyspace@<db>__:<key> <event> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYSPACE) {
-        chan = sdsnewlen("__keyspace@",11);
         len = ll2string(buf,sizeof(buf),dbid);
+        sdsclear(chan);
+        chan = sdscatlen(chan, "__keyspace@", 11);
         chan = sdscatlen(chan, buf, len);
         chan = sdscatlen(chan, "__:", 3);
         chan = sdscatsds(chan, key->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
-        pubsubPublishMessage(chanobj, eventobj);
-        decrRefCount(chanobj);
+        if (pubsubHasSubscribers(chan)) {
+            eventobj = createStringObject(event,strlen(event));
+            chanobj = createStringObject(chan,sdslen(chan));
+            pubsubPublishMessage(chanobj, eventobj);
+            decrRefCount(chanobj);
+        }
     }
 
     /* __keyevent@<db>__:<event> <key> notifications. */
     if (server.notify_keyspace_events & NOTIFY_KEYEVENT) {
-        chan = sdsnewlen("__keyevent@",11);
         if (len == -1) len = ll2string(buf,sizeof(buf),dbid);
+        sdsclear(chan);
+        chan = sdscatlen(chan, "__keyevent@", 11);
         chan = sdscatlen(chan, buf, len);
         chan = sdscatlen(chan, "__:", 3);
-        chan = sdscatsds(chan, eventobj->ptr);
-        chanobj = createObject(OBJ_STRING, chan);
-        pubsubPublishMessage(chanobj, key);
-        decrRefCount(chanobj);
+        chan = sdscat(chan, event);
+        if (pubsubHasSubscribers(chan)) {
+            chanobj = createStringObject(chan,sdslen(chan));
+            pubsubPublishMessage(chanobj, key);
+            decrRefCount(chanobj);
+        }
+    }
+    if (eventobj) decrRefCount(eventobj);
+
+    /* Don't retain a large buffer after a notification about a huge key. */
+    if (sdsalloc(chan) > PROTO_REPLY_CHUNK_BYTES) {
+        sdsfree(chan);
+        chan = NULL;
     }
-    decrRefCount(eventobj);
+    dbMemoryAccountingSwitch(prev);
 }
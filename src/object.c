@@ -29,6 +29,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <math.h>
 #include <ctype.h>
 
@@ -78,16 +79,45 @@ robj *createRawStringObject(const char *ptr, size_t len) {
     return createObject(OBJ_STRING, sdsnewlen(ptr,len));
 }
 
+/* Return the size of the sds header of an EMBSTR object holding 'len'
+ * bytes. Strings shorter than 32 bytes use the single byte SDS_TYPE_5 header,
+ * two bytes less than sdshdr8: this way strings up to 14 bytes fit in the 32
+ * bytes jemalloc bin, and up to 30 bytes in the 48 bytes one. The lack of
+ * free space tracking of SDS_TYPE_5 is not an issue since EMBSTR strings are
+ * never modified in place. */
+static inline size_t embeddedStringHdrSize(size_t len) {
+    return len < 1<<5 ? sizeof(struct sdshdr5) : sizeof(struct sdshdr8);
+}
+
+/* Return the length of the longest string an EMBSTR object allocation of
+ * 'size' bytes can hold. */
+size_t embeddedStringMaxLen(size_t size) {
+    size_t len = size-sizeof(robj)-sizeof(struct sdshdr5)-1;
+
+    if (embeddedStringHdrSize(len) == sizeof(struct sdshdr5)) return len;
+    /* Too long for SDS_TYPE_5: the larger header may leave room only for
+     * strings that would use SDS_TYPE_5 anyway. */
+    len = size-sizeof(robj)-sizeof(struct sdshdr8)-1;
+    return len < 1<<5 ? (1<<5)-1 : len;
+}
+
 /* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
-    struct sdshdr8 *sh = (void*)(o+1);
+    robj *o = zmalloc(sizeof(robj)+embeddedStringHdrSize(len)+len+1);
+    return initEmbeddedStringObject(o,ptr,len);
+}
+
+/* Initialize 'o' as a fresh EMBSTR object holding 'ptr'. The allocation
+ * must be large enough, see embeddedStringMaxLen(): this is used to recycle
+ * the allocation of a no longer referenced EMBSTR object, see
+ * createClientArgObject(). */
+robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len) {
+    char *buf;
 
     o->type = OBJ_STRING;
     o->encoding = OBJ_ENCODING_EMBSTR;
-    o->ptr = sh+1;
     o->refcount = 1;
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
@@ -95,27 +125,34 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
         o->lru = LRU_CLOCK();
     }
 
-    sh->len = len;
-    sh->alloc = len;
-    sh->flags = SDS_TYPE_8;
+    if (embeddedStringHdrSize(len) == sizeof(struct sdshdr5)) {
+        struct sdshdr5 *sh = (void*)(o+1);
+
+        sh->flags = SDS_TYPE_5 | (len << SDS_TYPE_BITS);
+        buf = sh->buf;
+    } else {
+        struct sdshdr8 *sh = (void*)(o+1);
+
+        sh->len = len;
+        sh->alloc = len;
+        sh->flags = SDS_TYPE_8;
+        buf = sh->buf;
+    }
+    o->ptr = buf;
     if (ptr == SDS_NOINIT)
-        sh->buf[len] = '\0';
+        buf[len] = '\0';
     else if (ptr) {
-        memcpy(sh->buf,ptr,len);
-        sh->buf[len] = '\0';
+        memcpy(buf,ptr,len);
+        buf[len] = '\0';
     } else {
-        memset(sh->buf,0,len+1);
+        memset(buf,0,len+1);
     }
     return o;
 }
 
 /* Create a string object with EMBSTR encoding if it is smaller than
  * OBJ_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
- * used.
- *
- * The current limit of 44 is chosen so that the biggest string object
- * we allocate as EMBSTR will still fit into the 64 byte arena of jemalloc. */
-#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44
+ * used. */
 robj *createStringObject(const char *ptr, size_t len) {
     if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT)
         return createEmbeddedStringObject(ptr,len);
@@ -123,6 +160,33 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Return the shared object representing 'value', or NULL if the value is
+ * not in the shared integers range. The range is set by the shared-integers
+ * option and the objects are created the first time they are needed, by
+ * chunks of OBJ_SHARED_INTEGERS_CHUNK pointers, so a large range only costs
+ * memory for the integers actually used. Other threads than the main one
+ * just use the objects already created. */
+robj *getSharedInteger(long long value) {
+    if (value < 0 || value >= server.shared_integers) return NULL;
+
+    long long idx = value / OBJ_SHARED_INTEGERS_CHUNK;
+    robj **chunk = shared.integers[idx];
+    robj *o = chunk ? chunk[value % OBJ_SHARED_INTEGERS_CHUNK] : NULL;
+    if (o || !pthread_equal(pthread_self(),server.main_thread_id)) return o;
+
+    /* Shared objects don't belong to any DB. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
+    if (chunk == NULL) {
+        chunk = zcalloc(sizeof(robj*)*OBJ_SHARED_INTEGERS_CHUNK);
+        shared.integers[idx] = chunk;
+    }
+    o = makeObjectShared(createObject(OBJ_STRING,(void*)(long)value));
+    o->encoding = OBJ_ENCODING_INT;
+    chunk[value % OBJ_SHARED_INTEGERS_CHUNK] = o;
+    dbMemoryAccountingSwitch(prev);
+    return o;
+}
+
 /* Create a string object from a long long value. When possible returns a
  * shared integer object, or at least an integer encoded one.
  *
@@ -141,9 +205,8 @@ robj *createStringObjectFromLongLongWithOptions(long long value, int valueobj) {
         valueobj = 0;
     }
 
-    if (value >= 0 && value < OBJ_SHARED_INTEGERS && valueobj == 0) {
-        incrRefCount(shared.integers[value]);
-        o = shared.integers[value];
+    if (valueobj == 0 && (o = getSharedInteger(value)) != NULL) {
+        incrRefCount(o);
     } else {
         if (value >= LONG_MIN && value <= LONG_MAX) {
             o = createObject(OBJ_STRING, NULL);
@@ -205,6 +268,18 @@ robj *dupStringObject(const robj *o) {
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_ROARING:
+        d = createObject(OBJ_STRING,roaringDup(o->ptr));
+        d->encoding = OBJ_ENCODING_ROARING;
+        return d;
+    case OBJ_ENCODING_COMPRESSED: {
+        compressedString *cs = o->ptr;
+        size_t size = sizeof(*cs)+cs->clen;
+        d = createObject(OBJ_STRING,zmalloc(size));
+        d->encoding = OBJ_ENCODING_COMPRESSED;
+        memcpy(d->ptr,cs,size);
+        return d;
+    }
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -239,10 +314,26 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+/* Create a string object holding a roaring bitmap equivalent to a string of
+ * 'len' zero bytes. */
+robj *createRoaringObject(size_t len) {
+    roaring *r = roaringNew(len);
+    robj *o = createObject(OBJ_STRING,r);
+    o->encoding = OBJ_ENCODING_ROARING;
+    return o;
+}
+
+robj *createSetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_SET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_HASH, lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -257,10 +348,10 @@ robj *createZsetObject(void) {
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -281,6 +372,10 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaringFree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        zfree(o->ptr);
     }
 }
 
@@ -298,6 +393,7 @@ void freeSetObject(robj *o) {
         dictRelease((dict*) o->ptr);
         break;
     case OBJ_ENCODING_INTSET:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -314,7 +410,7 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -327,7 +423,7 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
+    case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
     default:
@@ -346,12 +442,24 @@ void freeStreamObject(robj *o) {
     freeStream(o->ptr);
 }
 
+/* The refcount of interned values is updated atomically, since their
+ * references may be dropped by the lazy free thread while the main thread
+ * shares the same objects with new keys. */
 void incrRefCount(robj *o) {
-    if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
+    if (o->refcount < OBJ_INTERNED_REFCOUNT) {
+        o->refcount++;
+    } else if (o->refcount != OBJ_SHARED_REFCOUNT) {
+        atomicIncr(o->refcount,1);
+    }
 }
 
 void decrRefCount(robj *o) {
     if (o->refcount == 1) {
+        if (o->encoding == OBJ_ENCODING_SWAPPED) {
+            tieredFreeValue(o->ptr);
+            zfree(o);
+            return;
+        }
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_LIST: freeListObject(o); break;
@@ -365,7 +473,12 @@ void decrRefCount(robj *o) {
         zfree(o);
     } else {
         if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
-        if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount--;
+        if (o->refcount < OBJ_INTERNED_REFCOUNT) {
+            o->refcount--;
+        } else if (o->refcount != OBJ_SHARED_REFCOUNT) {
+            /* Interned values are only released by internedValuesCron(). */
+            atomicDecr(o->refcount,1);
+        }
     }
 }
 
@@ -429,6 +542,12 @@ void trimStringObjectIfNeeded(robj *o) {
 
 /* Try to encode a string object in order to save space */
 robj *tryObjectEncoding(robj *o) {
+    return tryObjectEncodingEx(o,1);
+}
+
+/* Like tryObjectEncoding(), but large strings are compressed, according to
+ * 'string-compression-threshold', only if 'try_compress' is true. */
+robj *tryObjectEncodingEx(robj *o, int try_compress) {
     long value;
     sds s = o->ptr;
     size_t len;
@@ -458,14 +577,14 @@ robj *tryObjectEncoding(robj *o) {
          * Note that we avoid using shared integers when maxmemory is used
          * because every object needs to have a private LRU field for the LRU
          * algorithm to work well. */
+        robj *shared_int = NULL;
         if ((server.maxmemory == 0 ||
             !(server.maxmemory_policy & MAXMEMORY_FLAG_NO_SHARED_INTEGERS)) &&
-            value >= 0 &&
-            value < OBJ_SHARED_INTEGERS)
+            (shared_int = getSharedInteger(value)) != NULL)
         {
             decrRefCount(o);
-            incrRefCount(shared.integers[value]);
-            return shared.integers[value];
+            incrRefCount(shared_int);
+            return shared_int;
         } else {
             if (o->encoding == OBJ_ENCODING_RAW) {
                 sdsfree(o->ptr);
@@ -486,12 +605,15 @@ robj *tryObjectEncoding(robj *o) {
     if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT) {
         robj *emb;
 
-        if (o->encoding == OBJ_ENCODING_EMBSTR) return o;
+        if (o->encoding == OBJ_ENCODING_EMBSTR) return tryObjectInterning(o);
         emb = createEmbeddedStringObject(s,sdslen(s));
         decrRefCount(o);
-        return emb;
+        return tryObjectInterning(emb);
     }
 
+    /* Compress large strings, see strcompress.c. */
+    if (try_compress && stringTryCompress(o)) return o;
+
     /* We can't encode the object...
      *
      * Do the last try, and at least optimize the SDS string inside
@@ -503,12 +625,105 @@ robj *tryObjectEncoding(robj *o) {
      * OBJ_ENCODING_EMBSTR_SIZE_LIMIT. */
     trimStringObjectIfNeeded(o);
 
-    /* Return the original object. */
+    /* Return the original object, or the interned one. */
+    return tryObjectInterning(o);
+}
+
+/* ============================ Values interning ============================
+ *
+ * When value-interning-max-size is set, the string values up to that size
+ * are looked up into server.interned_values, so that all the keys holding
+ * the same value share a single object. Interned objects are owned by the
+ * table: their refcount is OBJ_INTERNED_REFCOUNT plus the references held by
+ * keys and clients, so that they are never released by decrRefCount(), but
+ * by internedValuesCron() once nothing but the table references them. */
+
+/* Don't share an object beyond this number of references, to stay far from
+ * OBJ_SHARED_REFCOUNT. */
+#define OBJ_INTERNED_MAX_REFS (OBJ_INTERNED_REFCOUNT/2)
+
+/* Buckets of server.interned_values scanned by internedValuesCron() per
+ * call. */
+#define INTERNED_VALUES_CRON_BUCKETS 100
+
+/* Given the string value 'o', owned by the caller, return the interned object
+ * with the same content, releasing 'o', or intern 'o' itself if there is none
+ * yet. The object is returned as it is if interning is disabled or not
+ * possible. Like shared integers, interned values are not used when
+ * maxmemory is set with a LRU or LFU policy, since every value needs its own
+ * LRU field, and only by the main thread, since the RDB loading threads
+ * decode values as well. */
+robj *tryObjectInterning(robj *o) {
+    dictEntry *de;
+
+    if (server.value_interning_max_size == 0 ||
+        !sdsEncodedObject(o) || o->refcount != 1 ||
+        sdslen(o->ptr) > (size_t)server.value_interning_max_size ||
+        (server.maxmemory &&
+         (server.maxmemory_policy & MAXMEMORY_FLAG_NO_SHARED_INTEGERS)) ||
+        !pthread_equal(pthread_self(),server.main_thread_id))
+    {
+        return o;
+    }
+
+    if ((de = dictFind(server.interned_values,o->ptr)) != NULL) {
+        robj *interned = dictGetVal(de);
+        int refcount;
+
+        atomicGet(interned->refcount,refcount);
+        if (refcount - OBJ_INTERNED_REFCOUNT >= OBJ_INTERNED_MAX_REFS)
+            return o;
+        decrRefCount(o);
+        incrRefCount(interned);
+        return interned;
+    }
+    o->refcount = OBJ_INTERNED_REFCOUNT+1;
+    dictAdd(server.interned_values,o->ptr,o);
     return o;
 }
 
+/* dictScan() callback of internedValuesCron(): collect the interned values
+ * referenced only by the table, that can't be deleted while scanning. */
+static void internedValuesScanCallback(void *privdata, const dictEntry *de) {
+    list *unused = privdata;
+    robj *o = dictGetVal(de);
+    int refcount;
+
+    atomicGet(o->refcount,refcount);
+    if (refcount == OBJ_INTERNED_REFCOUNT) listAddNodeTail(unused,o);
+}
+
+/* Incrementally scan the interned values, releasing the ones no key or client
+ * references anymore. Nothing but the main thread can take new references to
+ * such objects, so it is safe to free them. */
+void internedValuesCron(void) {
+    static unsigned long cursor = 0;
+    list *unused;
+    listIter li;
+    listNode *ln;
+    int buckets = INTERNED_VALUES_CRON_BUCKETS;
+
+    if (dictSize(server.interned_values) == 0) return;
+    unused = listCreate();
+    do {
+        cursor = dictScan(server.interned_values,cursor,
+                          internedValuesScanCallback,NULL,unused);
+    } while(cursor && --buckets);
+
+    listRewind(unused,&li);
+    while((ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+
+        dictDelete(server.interned_values,o->ptr);
+        o->refcount = 1;
+        decrRefCount(o);
+    }
+    listRelease(unused);
+}
+
 /* Get a decoded version of an encoded object (returned as a new object).
- * If the object is already raw-encoded just increment the ref count. */
+ * If the object is already raw-encoded just increment the ref count.
+ * Roaring bitmaps are decoded into a copy of the equivalent string. */
 robj *getDecodedObject(robj *o) {
     robj *dec;
 
@@ -522,6 +737,17 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = o->ptr;
+        sds s = sdsnewlen(NULL,r->len);
+
+        roaringGetBytes(r,0,r->len,(unsigned char*)s);
+        return createObject(OBJ_STRING,s);
+    } else if (o->type == OBJ_STRING &&
+               o->encoding == OBJ_ENCODING_COMPRESSED) {
+        size_t len;
+        char *buf = stringDecompressToScratch(o,&len);
+        return createStringObject(buf,len);
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -599,6 +825,10 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return ((roaring*)o->ptr)->len;
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        return stringCompressedLen(o);
     } else {
         return sdigits10((long)o->ptr);
     }
@@ -739,6 +969,10 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
+    case OBJ_ENCODING_ROARING: return "roaring";
+    case OBJ_ENCODING_SWAPPED: return "swapped";
+    case OBJ_ENCODING_COMPRESSED: return "compressed";
     default: return "unknown";
     }
 }
@@ -773,7 +1007,6 @@ size_t streamRadixTreeMemoryUsage(rax *rax) {
  * Note that the returned value is just an approximation, especially in the
  * case of aggregated data types where only "sample_size" elements
  * are checked and averaged to estimate the total size. */
-#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
 size_t objectComputeSize(robj *o, size_t sample_size) {
     sds ele, ele2;
     dict *d;
@@ -781,13 +1014,21 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     struct dictEntry *de;
     size_t asize = 0, elesize = 0, samples = 0;
 
+    /* Only the stub of a value in the tiered storage is in memory. */
+    if (o->encoding == OBJ_ENCODING_SWAPPED)
+        return sizeof(*o)+sizeof(tieredValue);
+
     if (o->type == OBJ_STRING) {
         if(o->encoding == OBJ_ENCODING_INT) {
             asize = sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_RAW) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
-            asize = sdslen(o->ptr)+2+sizeof(*o);
+            asize = sdsAllocSize(o->ptr)+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_ROARING) {
+            asize = roaringMemUsage(o->ptr)+sizeof(*o);
+        } else if(o->encoding == OBJ_ENCODING_COMPRESSED) {
+            asize = zmalloc_size(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -821,12 +1062,14 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+lpBytes(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -835,7 +1078,6 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                     (sizeof(struct dictEntry*)*dictSlots(d))+
                     zmalloc_size(zsl->header);
             while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
                 elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
                 samples++;
                 znode = znode->level[0].forward;
@@ -845,8 +1087,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -905,6 +1147,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 streamCG *cg = ri.data;
                 asize += sizeof(*cg);
                 asize += streamRadixTreeMemoryUsage(cg->pel);
+                asize += streamRadixTreeMemoryUsage(cg->pel_by_time);
                 asize += sizeof(streamNACK)*raxSize(cg->pel);
 
                 /* For each consumer we also need to add the basic data
@@ -973,46 +1216,39 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         (float)server.cron_malloc_stats.process_rss / server.cron_malloc_stats.allocator_resident;
     mh->rss_extra_bytes =
         server.cron_malloc_stats.process_rss - server.cron_malloc_stats.allocator_resident;
+    for (j = 0; j < ZMALLOC_CLASS_COUNT; j++) {
+        size_t allocated = server.cron_malloc_stats.class_allocated[j];
+        size_t active = server.cron_malloc_stats.class_active[j];
+        mh->class_frag[j] = allocated ? (float)active / allocated : 1;
+        mh->class_frag_bytes[j] = active - allocated;
+    }
 
     mem_total += server.initial_memory_usage;
 
+    /* The replication buffer is shared by the backlog and the slaves, so
+     * we count it only once: the part exceeding the backlog size is what
+     * the slaves use on their own. */
     mem = 0;
-    if (server.repl_backlog)
-        mem += zmalloc_size(server.repl_backlog);
-    mh->repl_backlog = mem;
-    mem_total += mem;
-
-    mem = 0;
-    if (listLength(server.slaves)) {
-        listIter li;
-        listNode *ln;
-
-        listRewind(server.slaves,&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            mem += getClientOutputBufferMemoryUsage(c);
-            mem += sdsAllocSize(c->querybuf);
-            mem += sizeof(client);
-        }
+    if (listLength(server.slaves) &&
+        (long long)server.repl_buffer_mem > server.repl_backlog_size)
+    {
+        mh->clients_slaves = server.repl_buffer_mem - server.repl_backlog_size;
+        mh->repl_backlog = server.repl_backlog_size;
+    } else {
+        mh->clients_slaves = 0;
+        mh->repl_backlog = server.repl_buffer_mem;
     }
-    mh->clients_slaves = mem;
-    mem_total+=mem;
+    if (server.repl_backlog) mh->repl_backlog += zmalloc_size(server.repl_backlog);
+    mem_total += mh->repl_backlog;
 
-    mem = 0;
-    if (listLength(server.clients)) {
-        listIter li;
-        listNode *ln;
-
-        listRewind(server.clients,&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (c->flags & CLIENT_SLAVE && !(c->flags & CLIENT_MONITOR))
-                continue;
-            mem += getClientOutputBufferMemoryUsage(c);
-            mem += sdsAllocSize(c->querybuf);
-            mem += sizeof(client);
-        }
-    }
+    /* The memory of the clients is kept updated as their buffers change,
+     * see updateClientMemUsage(), rather than walking all of them. */
+    mh->clients_slaves += server.stat_clients_slaves_memory;
+    mem_total += mh->clients_slaves;
+
+    mem = server.stat_clients_normal_memory;
+    /* The pooled buffers are ready for the next clients. */
+    mem += clientBufPoolMemory();
     mh->clients_normal = mem;
     mem_total+=mem;
 
@@ -1045,14 +1281,14 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) +
+        mem = dictSize(db->dict) * dictEntrySize(db->dict) +
               dictSlots(db->dict) * sizeof(dictEntry*) +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        mem = dictSize(db->dict) * dictMetadataSize(db->dict) +
+              db->expires->size * sizeof(expireEntry);
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1264,7 +1500,12 @@ NULL
     } else if (!strcasecmp(c->argv[1]->ptr,"refcount") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.null[c->resp]))
                 == NULL) return;
-        addReplyLongLong(c,o->refcount);
+        /* Report the references to interned values, not the table's one. */
+        if (o->refcount >= OBJ_INTERNED_REFCOUNT &&
+            o->refcount != OBJ_SHARED_REFCOUNT)
+            addReplyLongLong(c,o->refcount-OBJ_INTERNED_REFCOUNT);
+        else
+            addReplyLongLong(c,o->refcount);
     } else if (!strcasecmp(c->argv[1]->ptr,"encoding") && c->argc == 3) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.null[c->resp]))
                 == NULL) return;
@@ -1301,7 +1542,12 @@ NULL
 void memoryCommand(client *c) {
     if (!strcasecmp(c->argv[1]->ptr,"help") && c->argc == 2) {
         const char *help[] = {
+"ANALYZE START [SEPARATOR <chars>] [SAMPLES <count>] [TOP <count>] -- Start measuring all the keys in the background, grouping them by type and prefix up to the first separator (default: ':'), and remembering the <count> biggest ones (default: 10).",
+"ANALYZE STOP -- Stop the memory analysis in progress.",
+"ANALYZE STATUS -- Return the progress of the memory analysis.",
+"ANALYZE RESULT [COUNT <count>] -- Return the <count> prefixes using most memory (default: 10) and the biggest keys.",
 "DOCTOR - Return memory problems reports.",
+"EVICTION-STATS -- Return statistics about the keys evicted by the maxmemory policy.",
 "MALLOC-STATS -- Return internal statistics report from the memory allocator.",
 "PURGE -- Attempt to purge dirty pages for reclamation by the allocator.",
 "STATS -- Return information about the memory usage of the server.",
@@ -1337,10 +1583,19 @@ NULL
         usage += sdsAllocSize(dictGetKey(de));
         usage += sizeof(dictEntry);
         addReplyLongLong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"analyze") && c->argc >= 3) {
+        memoryAnalyzeCommand(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"eviction-stats") && c->argc == 2) {
+        addReplyEvictionStats(c);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMapLen(c,25+mh->num_dbs);
+        static const char *class_names[ZMALLOC_CLASS_COUNT] = {
+            "keyspace", "transient", "module"
+        };
+        char field[64];
+
+        addReplyMapLen(c,25+ZMALLOC_CLASS_COUNT*2+mh->num_dbs);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1412,6 +1667,17 @@ NULL
         addReplyBulkCString(c,"allocator-fragmentation.bytes");
         addReplyLongLong(c,mh->allocator_frag_bytes);
 
+        for (int j = 0; j < ZMALLOC_CLASS_COUNT; j++) {
+            snprintf(field,sizeof(field),"allocator-fragmentation.%s.ratio",
+                     class_names[j]);
+            addReplyBulkCString(c,field);
+            addReplyDouble(c,mh->class_frag[j]);
+            snprintf(field,sizeof(field),"allocator-fragmentation.%s.bytes",
+                     class_names[j]);
+            addReplyBulkCString(c,field);
+            addReplyLongLong(c,mh->class_frag_bytes[j]);
+        }
+
         addReplyBulkCString(c,"allocator-rss.ratio");
         addReplyDouble(c,mh->allocator_rss);
 
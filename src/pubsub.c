@@ -30,22 +30,70 @@
 #include "server.h"
 
 int clientSubscriptionsCount(client *c);
+int clientShardSubscriptionsCount(client *c);
+dict *getClientPubSubChannels(client *c);
+dict *getClientPubSubShardChannels(client *c);
+
+/* The classic channels (SUBSCRIBE, PUBLISH) and the sharded channels
+ * (SSUBSCRIBE, SPUBLISH) are handled by the same code, parametrized by
+ * the following structure. In cluster mode the sharded channels belong
+ * to the hash slot of their name, like keys: they are only served by the
+ * nodes of the shard owning the slot, and their messages are only
+ * propagated to the replicas of such shard instead of being broadcast to
+ * the whole cluster. So the Pub/Sub traffic scales with the shards. */
+typedef struct pubsubtype {
+    int shard;
+    dict *(*clientPubSubChannels)(client*);
+    int (*subscriptionCount)(client*);
+    dict **serverPubSubChannels;
+    robj **subscribeMsg;
+    robj **unsubscribeMsg;
+    robj **messageBulk;
+} pubsubtype;
+
+pubsubtype pubSubType = {
+    .shard = 0,
+    .clientPubSubChannels = getClientPubSubChannels,
+    .subscriptionCount = clientSubscriptionsCount,
+    .serverPubSubChannels = &server.pubsub_channels,
+    .subscribeMsg = &shared.subscribebulk,
+    .unsubscribeMsg = &shared.unsubscribebulk,
+    .messageBulk = &shared.messagebulk,
+};
+
+pubsubtype pubSubShardType = {
+    .shard = 1,
+    .clientPubSubChannels = getClientPubSubShardChannels,
+    .subscriptionCount = clientShardSubscriptionsCount,
+    .serverPubSubChannels = &server.pubsubshard_channels,
+    .subscribeMsg = &shared.ssubscribebulk,
+    .unsubscribeMsg = &shared.sunsubscribebulk,
+    .messageBulk = &shared.smessagebulk,
+};
 
 /*-----------------------------------------------------------------------------
  * Pubsub client replies API
  *----------------------------------------------------------------------------*/
 
-/* Send a pubsub message of type "message" to the client. */
-void addReplyPubsubMessage(client *c, robj *channel, robj *msg) {
+/* Send a pubsub message of type "message" (or "smessage" for sharded
+ * channels, according to 'msgbulk') to the client. */
+static void addReplyPubsubTypeMessage(client *c, robj *channel, robj *msg,
+                                      robj *msgbulk)
+{
     if (c->resp == 2)
         addReply(c,shared.mbulkhdr[3]);
     else
         addReplyPushLen(c,3);
-    addReply(c,shared.messagebulk);
+    addReply(c,msgbulk);
     addReplyBulk(c,channel);
     addReplyBulk(c,msg);
 }
 
+/* Send a pubsub message of type "message" to the client. */
+void addReplyPubsubMessage(client *c, robj *channel, robj *msg) {
+    addReplyPubsubTypeMessage(c,channel,msg,shared.messagebulk);
+}
+
 /* Send a pubsub message of type "pmessage" to the client. The difference
  * with the "message" type delivered by addReplyPubsubMessage() is that
  * this message format also includes the pattern that matched the message. */
@@ -60,32 +108,87 @@ void addReplyPubsubPatMessage(client *c, robj *pat, robj *channel, robj *msg) {
     addReplyBulk(c,msg);
 }
 
+/* Messages sent to many subscribers are serialized once: the protocol
+ * of the message, after the aggregate header that depends on the protocol
+ * version of each client, and without the final CRLF, is stored in a string
+ * object referenced by the output buffer of every subscriber. Returns NULL
+ * if the message is too small to be worth it. 'pat' is NULL for the message
+ * types of the channels ('msgbulk'), otherwise the message is of type
+ * "pmessage". */
+static robj *createPubsubSharedMessage(robj *msgbulk, robj *pat,
+                                       robj *channel, robj *msg)
+{
+    if (stringObjectLen(msg) < PROTO_PUBSUB_SHARED_MIN_BYTES) return NULL;
+
+    channel = getDecodedObject(channel);
+    msg = getDecodedObject(msg);
+    size_t chanlen = sdslen(channel->ptr), msglen = sdslen(msg->ptr);
+    sds s = sdsMakeRoomFor(sdsempty(),chanlen+msglen+128+
+                           (pat ? sdslen(pat->ptr) : 0));
+
+    if (pat) {
+        s = sdscatlen(s,shared.pmessagebulk->ptr,
+                      sdslen(shared.pmessagebulk->ptr));
+        s = sdscatfmt(s,"$%U\r\n",(unsigned long long)sdslen(pat->ptr));
+        s = sdscatsds(s,pat->ptr);
+        s = sdscatlen(s,"\r\n",2);
+    } else {
+        s = sdscatlen(s,msgbulk->ptr,sdslen(msgbulk->ptr));
+    }
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)chanlen);
+    s = sdscatsds(s,channel->ptr);
+    s = sdscatfmt(s,"\r\n$%U\r\n",(unsigned long long)msglen);
+    s = sdscatsds(s,msg->ptr);
+    decrRefCount(channel);
+    decrRefCount(msg);
+    return createObject(OBJ_STRING,s);
+}
+
+/* Send to the client the message serialized by createPubsubSharedMessage(),
+ * falling back to the normal replies if the client can't reference it. */
+static void addReplyPubsubSharedMessage(client *c, robj *shmsg,
+                                        robj *msgbulk, robj *pat,
+                                        robj *channel, robj *msg)
+{
+    const char *hdr;
+    if (pat)
+        hdr = c->resp == 2 ? "*4\r\n" : ">4\r\n";
+    else
+        hdr = c->resp == 2 ? "*3\r\n" : ">3\r\n";
+    if (addReplyProtoWithObject(c,hdr,4,shmsg) == C_OK) return;
+
+    if (pat)
+        addReplyPubsubPatMessage(c,pat,channel,msg);
+    else
+        addReplyPubsubTypeMessage(c,channel,msg,msgbulk);
+}
+
 /* Send the pubsub subscription notification to the client. */
-void addReplyPubsubSubscribed(client *c, robj *channel) {
+void addReplyPubsubSubscribed(client *c, robj *channel, pubsubtype type) {
     if (c->resp == 2)
         addReply(c,shared.mbulkhdr[3]);
     else
         addReplyPushLen(c,3);
-    addReply(c,shared.subscribebulk);
+    addReply(c,*type.subscribeMsg);
     addReplyBulk(c,channel);
-    addReplyLongLong(c,clientSubscriptionsCount(c));
+    addReplyLongLong(c,type.subscriptionCount(c));
 }
 
 /* Send the pubsub unsubscription notification to the client.
  * Channel can be NULL: this is useful when the client sends a mass
  * unsubscribe command but there are no channels to unsubscribe from: we
  * still send a notification. */
-void addReplyPubsubUnsubscribed(client *c, robj *channel) {
+void addReplyPubsubUnsubscribed(client *c, robj *channel, pubsubtype type) {
     if (c->resp == 2)
         addReply(c,shared.mbulkhdr[3]);
     else
         addReplyPushLen(c,3);
-    addReply(c,shared.unsubscribebulk);
+    addReply(c,*type.unsubscribeMsg);
     if (channel)
         addReplyBulk(c,channel);
     else
         addReplyNull(c);
-    addReplyLongLong(c,clientSubscriptionsCount(c));
+    addReplyLongLong(c,type.subscriptionCount(c));
 }
 
 /* Send the pubsub pattern subscription notification to the client. */
@@ -120,18 +223,56 @@ void addReplyPubsubPatUnsubscribed(client *c, robj *pattern) {
  * Pubsub low level API
  *----------------------------------------------------------------------------*/
 
-void freePubsubPattern(void *p) {
-    pubsubPattern *pat = p;
-
-    decrRefCount(pat->pattern);
-    zfree(pat);
+/* Patterns are indexed by their literal prefix, that is the part of the
+ * pattern before the first glob-style special character: a channel can only
+ * match the patterns whose literal prefix is a prefix of the channel name,
+ * so PUBLISH only needs to look up the prefixes of the channel, up to the
+ * longest literal prefix indexed, and to match the patterns found there.
+ * Every distinct pattern is indexed and matched once, regardless of the
+ * number of clients subscribed to it. */
+static size_t pubsubPatternLiteralPrefixLen(sds pattern) {
+    size_t len = sdslen(pattern);
+    for (size_t j = 0; j < len; j++) {
+        char ch = pattern[j];
+        if (ch == '*' || ch == '?' || ch == '[' || ch == '\\') return j;
+    }
+    return len;
 }
 
-int listMatchPubsubPattern(void *a, void *b) {
-    pubsubPattern *pa = a, *pb = b;
+/* Add the pattern to the index of the literal prefixes. */
+static void pubsubIndexPattern(robj *pattern) {
+    size_t len = pubsubPatternLiteralPrefixLen(pattern->ptr);
+    list *patterns = raxFind(server.pubsub_patterns_prefixes,
+                             (unsigned char*)pattern->ptr,len);
+    if (patterns == raxNotFound) {
+        patterns = listCreate();
+        listSetFreeMethod(patterns,decrRefCountVoid);
+        listSetMatchMethod(patterns,listMatchObjects);
+        raxInsert(server.pubsub_patterns_prefixes,
+                  (unsigned char*)pattern->ptr,len,patterns,NULL);
+        if (len > server.pubsub_patterns_maxprefix)
+            server.pubsub_patterns_maxprefix = len;
+    }
+    listAddNodeTail(patterns,pattern);
+    incrRefCount(pattern);
+}
 
-    return (pa->client == pb->client) &&
-           (equalStringObjects(pa->pattern,pb->pattern));
+/* Remove the pattern from the index of the literal prefixes. */
+static void pubsubUnindexPattern(robj *pattern) {
+    size_t len = pubsubPatternLiteralPrefixLen(pattern->ptr);
+    list *patterns = raxFind(server.pubsub_patterns_prefixes,
+                             (unsigned char*)pattern->ptr,len);
+    serverAssert(patterns != raxNotFound);
+    listNode *ln = listSearchKey(patterns,pattern);
+    serverAssert(ln != NULL);
+    listDelNode(patterns,ln);
+    if (listLength(patterns) == 0) {
+        listRelease(patterns);
+        raxRemove(server.pubsub_patterns_prefixes,
+                  (unsigned char*)pattern->ptr,len,NULL);
+        if (raxSize(server.pubsub_patterns_prefixes) == 0)
+            server.pubsub_patterns_maxprefix = 0;
+    }
 }
 
 /* Return the number of channels + patterns a client is subscribed to. */
@@ -140,22 +281,42 @@ int clientSubscriptionsCount(client *c) {
            listLength(c->pubsub_patterns);
 }
 
+/* Return the number of sharded channels a client is subscribed to. */
+int clientShardSubscriptionsCount(client *c) {
+    return dictSize(c->pubsubshard_channels);
+}
+
+dict *getClientPubSubChannels(client *c) {
+    return c->pubsub_channels;
+}
+
+dict *getClientPubSubShardChannels(client *c) {
+    return c->pubsubshard_channels;
+}
+
+/* Clear the Pub/Sub flag of the client if it has no subscriptions left. */
+static void pubsubUpdateClientFlag(client *c) {
+    if (clientSubscriptionsCount(c) == 0 &&
+        clientShardSubscriptionsCount(c) == 0)
+        c->flags &= ~CLIENT_PUBSUB;
+}
+
 /* Subscribe a client to a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was already subscribed to that channel. */
-int pubsubSubscribeChannel(client *c, robj *channel) {
+int pubsubSubscribeChannel(client *c, robj *channel, pubsubtype type) {
     dictEntry *de;
     list *clients = NULL;
     int retval = 0;
 
     /* Add the channel to the client -> channels hash table */
-    if (dictAdd(c->pubsub_channels,channel,NULL) == DICT_OK) {
+    if (dictAdd(type.clientPubSubChannels(c),channel,NULL) == DICT_OK) {
         retval = 1;
         incrRefCount(channel);
         /* Add the client to the channel -> list of clients hash table */
-        de = dictFind(server.pubsub_channels,channel);
+        de = dictFind(*type.serverPubSubChannels,channel);
         if (de == NULL) {
             clients = listCreate();
-            dictAdd(server.pubsub_channels,channel,clients);
+            dictAdd(*type.serverPubSubChannels,channel,clients);
             incrRefCount(channel);
         } else {
             clients = dictGetVal(de);
@@ -163,13 +324,15 @@ int pubsubSubscribeChannel(client *c, robj *channel) {
         listAddNodeTail(clients,c);
     }
     /* Notify the client */
-    addReplyPubsubSubscribed(c,channel);
+    addReplyPubsubSubscribed(c,channel,type);
     return retval;
 }
 
 /* Unsubscribe a client from a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was not subscribed to the specified channel. */
-int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
+int pubsubUnsubscribeChannel(client *c, robj *channel, int notify,
+                             pubsubtype type)
+{
     dictEntry *de;
     list *clients;
     listNode *ln;
@@ -178,10 +341,10 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
     /* Remove the channel from the client -> channels hash table */
     incrRefCount(channel); /* channel may be just a pointer to the same object
                             we have in the hash tables. Protect it... */
-    if (dictDelete(c->pubsub_channels,channel) == DICT_OK) {
+    if (dictDelete(type.clientPubSubChannels(c),channel) == DICT_OK) {
         retval = 1;
         /* Remove the client from the channel -> clients list hash table */
-        de = dictFind(server.pubsub_channels,channel);
+        de = dictFind(*type.serverPubSubChannels,channel);
         serverAssertWithInfo(c,NULL,de != NULL);
         clients = dictGetVal(de);
         ln = listSearchKey(clients,c);
@@ -191,28 +354,37 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
             /* Free the list and associated hash entry at all if this was
              * the latest client, so that it will be possible to abuse
              * Redis PUBSUB creating millions of channels. */
-            dictDelete(server.pubsub_channels,channel);
+            dictDelete(*type.serverPubSubChannels,channel);
         }
     }
     /* Notify the client */
-    if (notify) addReplyPubsubUnsubscribed(c,channel);
+    if (notify) addReplyPubsubUnsubscribed(c,channel,type);
     decrRefCount(channel); /* it is finally safe to release it */
     return retval;
 }
 
 /* Subscribe a client to a pattern. Returns 1 if the operation succeeded, or 0 if the client was already subscribed to that pattern. */
 int pubsubSubscribePattern(client *c, robj *pattern) {
+    dictEntry *de;
+    list *clients;
     int retval = 0;
 
     if (listSearchKey(c->pubsub_patterns,pattern) == NULL) {
         retval = 1;
-        pubsubPattern *pat;
         listAddNodeTail(c->pubsub_patterns,pattern);
         incrRefCount(pattern);
-        pat = zmalloc(sizeof(*pat));
-        pat->pattern = getDecodedObject(pattern);
-        pat->client = c;
-        listAddNodeTail(server.pubsub_patterns,pat);
+        /* Add the client to the pattern -> list of clients hash table */
+        de = dictFind(server.pubsub_patterns,pattern);
+        if (de == NULL) {
+            clients = listCreate();
+            dictAdd(server.pubsub_patterns,pattern,clients);
+            incrRefCount(pattern);
+            pubsubIndexPattern(pattern);
+        } else {
+            clients = dictGetVal(de);
+        }
+        listAddNodeTail(clients,c);
+        server.pubsub_patterns_subscriptions++;
     }
     /* Notify the client */
     addReplyPubsubPatSubscribed(c,pattern);
@@ -222,18 +394,29 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
 /* Unsubscribe a client from a channel. Returns 1 if the operation succeeded, or
  * 0 if the client was not subscribed to the specified channel. */
 int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
+    dictEntry *de;
+    list *clients;
     listNode *ln;
-    pubsubPattern pat;
     int retval = 0;
 
     incrRefCount(pattern); /* Protect the object. May be the same we remove */
     if ((ln = listSearchKey(c->pubsub_patterns,pattern)) != NULL) {
         retval = 1;
         listDelNode(c->pubsub_patterns,ln);
-        pat.client = c;
-        pat.pattern = pattern;
-        ln = listSearchKey(server.pubsub_patterns,&pat);
-        listDelNode(server.pubsub_patterns,ln);
+        /* Remove the client from the pattern -> clients list hash table */
+        de = dictFind(server.pubsub_patterns,pattern);
+        serverAssertWithInfo(c,NULL,de != NULL);
+        clients = dictGetVal(de);
+        ln = listSearchKey(clients,c);
+        serverAssertWithInfo(c,NULL,ln != NULL);
+        listDelNode(clients,ln);
+        if (listLength(clients) == 0) {
+            /* Free the list, the hash entry and the index entry if this
+             * was the latest client. */
+            pubsubUnindexPattern(pattern);
+            dictDelete(server.pubsub_patterns,pattern);
+        }
+        server.pubsub_patterns_subscriptions--;
     }
     /* Notify the client */
     if (notify) addReplyPubsubPatUnsubscribed(c,pattern);
@@ -241,24 +424,68 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
     return retval;
 }
 
-/* Unsubscribe from all the channels. Return the number of channels the
- * client was subscribed to. */
-int pubsubUnsubscribeAllChannels(client *c, int notify) {
-    dictIterator *di = dictGetSafeIterator(c->pubsub_channels);
+/* Unsubscribe from all the channels of the specified type. Return the
+ * number of channels the client was subscribed to. */
+static int pubsubUnsubscribeAllChannelsInternal(client *c, int notify,
+                                                pubsubtype type)
+{
+    dictIterator *di = dictGetSafeIterator(type.clientPubSubChannels(c));
     dictEntry *de;
     int count = 0;
 
     while((de = dictNext(di)) != NULL) {
         robj *channel = dictGetKey(de);
 
-        count += pubsubUnsubscribeChannel(c,channel,notify);
+        count += pubsubUnsubscribeChannel(c,channel,notify,type);
     }
     /* We were subscribed to nothing? Still reply to the client. */
-    if (notify && count == 0) addReplyPubsubUnsubscribed(c,NULL);
+    if (notify && count == 0) addReplyPubsubUnsubscribed(c,NULL,type);
     dictReleaseIterator(di);
     return count;
 }
 
+/* Unsubscribe from all the channels. */
+int pubsubUnsubscribeAllChannels(client *c, int notify) {
+    return pubsubUnsubscribeAllChannelsInternal(c,notify,pubSubType);
+}
+
+/* Unsubscribe from all the sharded channels. */
+int pubsubUnsubscribeShardAllChannels(client *c, int notify) {
+    return pubsubUnsubscribeAllChannelsInternal(c,notify,pubSubShardType);
+}
+
+/* Unsubscribe all the clients from the sharded channels belonging to the
+ * hash slots set in the 'slots' bitmap: this is called when the shard of
+ * this node no longer serves such slots, so that the clients can subscribe
+ * again to the new owner. The clients are notified with an "sunsubscribe"
+ * message. */
+void pubsubShardUnsubscribeChannelsInSlots(unsigned char *slots) {
+    dictIterator *di = dictGetSafeIterator(server.pubsubshard_channels);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) {
+        robj *channel = dictGetKey(de);
+        int slot = keyHashSlot(channel->ptr,sdslen(channel->ptr));
+        if (!(slots[slot/8] & (1<<(slot&7)))) continue;
+
+        /* Unsubscribing the last client releases the channel entry, so
+         * protect the channel and iterate a copy of the clients. */
+        incrRefCount(channel);
+        list *clients = listDup(dictGetVal(de));
+        listIter li;
+        listNode *ln;
+        listRewind(clients,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            client *c = ln->value;
+            pubsubUnsubscribeChannel(c,channel,1,pubSubShardType);
+            pubsubUpdateClientFlag(c);
+        }
+        listRelease(clients);
+        decrRefCount(channel);
+    }
+    dictReleaseIterator(di);
+}
+
 /* Unsubscribe from all the patterns. Return the number of patterns the
  * client was subscribed from. */
 int pubsubUnsubscribeAllPatterns(client *c, int notify) {
@@ -276,42 +503,111 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
     return count;
 }
 
-/* Publish a message */
-int pubsubPublishMessage(robj *channel, robj *message) {
+/* Return true if a message published to the classic channel 'chan' would
+ * be received by some client, subscribed either to the channel or to one of
+ * the patterns matching it. Nothing is allocated, so that this can be used
+ * to skip building messages nobody is going to receive. */
+int pubsubHasSubscribers(sds chan) {
+    robj channel;
+
+    initStaticStringObject(channel,chan);
+    if (dictFind(server.pubsub_channels,&channel) != NULL) return 1;
+    if (dictSize(server.pubsub_patterns) == 0) return 0;
+
+    size_t maxlen = sdslen(chan);
+    if (maxlen > server.pubsub_patterns_maxprefix)
+        maxlen = server.pubsub_patterns_maxprefix;
+    for (size_t len = 0; len <= maxlen; len++) {
+        list *patterns = raxFind(server.pubsub_patterns_prefixes,
+                                 (unsigned char*)chan,len);
+        if (patterns == raxNotFound) continue;
+
+        listIter li;
+        listNode *ln;
+        listRewind(patterns,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            robj *pattern = ln->value;
+            if (stringmatchlen((char*)pattern->ptr,sdslen(pattern->ptr),
+                               chan,sdslen(chan),0)) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Publish a message to the channels of the specified type. */
+static int pubsubPublishMessageInternal(robj *channel, robj *message,
+                                        pubsubtype type)
+{
     int receivers = 0;
     dictEntry *de;
     listNode *ln;
     listIter li;
+    robj *msgbulk = *type.messageBulk;
 
     /* Send to clients listening for that channel */
-    de = dictFind(server.pubsub_channels,channel);
+    de = dictFind(*type.serverPubSubChannels,channel);
     if (de) {
         list *list = dictGetVal(de);
         listNode *ln;
         listIter li;
+        robj *shmsg = listLength(list) > 1 ?
+            createPubsubSharedMessage(msgbulk,NULL,channel,message) : NULL;
 
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
-            addReplyPubsubMessage(c,channel,message);
+            if (shmsg)
+                addReplyPubsubSharedMessage(c,shmsg,msgbulk,NULL,channel,
+                                            message);
+            else
+                addReplyPubsubTypeMessage(c,channel,message,msgbulk);
             receivers++;
         }
+        if (shmsg) decrRefCount(shmsg);
     }
-    /* Send to clients listening to matching channels */
-    if (listLength(server.pubsub_patterns)) {
-        listRewind(server.pubsub_patterns,&li);
+
+    /* Patterns don't match the sharded channels. */
+    if (type.shard) return receivers;
+
+    /* Send to clients listening to matching channels: only the patterns
+     * having as literal prefix a prefix of the channel can match. */
+    if (dictSize(server.pubsub_patterns)) {
         channel = getDecodedObject(channel);
-        while ((ln = listNext(&li)) != NULL) {
-            pubsubPattern *pat = ln->value;
-
-            if (stringmatchlen((char*)pat->pattern->ptr,
-                                sdslen(pat->pattern->ptr),
-                                (char*)channel->ptr,
-                                sdslen(channel->ptr),0))
-            {
-                addReplyPubsubPatMessage(pat->client,
-                    pat->pattern,channel,message);
-                receivers++;
+        sds chan = channel->ptr;
+        size_t maxlen = sdslen(chan);
+        if (maxlen > server.pubsub_patterns_maxprefix)
+            maxlen = server.pubsub_patterns_maxprefix;
+
+        for (size_t len = 0; len <= maxlen; len++) {
+            list *patterns = raxFind(server.pubsub_patterns_prefixes,
+                                     (unsigned char*)chan,len);
+            if (patterns == raxNotFound) continue;
+
+            listRewind(patterns,&li);
+            while ((ln = listNext(&li)) != NULL) {
+                robj *pattern = ln->value;
+
+                if (!stringmatchlen((char*)pattern->ptr,
+                                    sdslen(pattern->ptr),
+                                    chan,sdslen(chan),0)) continue;
+
+                list *clients = dictFetchValue(server.pubsub_patterns,pattern);
+                robj *shmsg = listLength(clients) > 1 ?
+                    createPubsubSharedMessage(NULL,pattern,channel,message) :
+                    NULL;
+                listIter cli;
+                listNode *cln;
+                listRewind(clients,&cli);
+                while ((cln = listNext(&cli)) != NULL) {
+                    client *c = cln->value;
+                    if (shmsg)
+                        addReplyPubsubSharedMessage(c,shmsg,NULL,pattern,
+                                                    channel,message);
+                    else
+                        addReplyPubsubPatMessage(c,pattern,channel,message);
+                    receivers++;
+                }
+                if (shmsg) decrRefCount(shmsg);
             }
         }
         decrRefCount(channel);
@@ -319,6 +615,11 @@ int pubsubPublishMessage(robj *channel, robj *message) {
     return receivers;
 }
 
+/* Publish a message to the classic channels and patterns. */
+int pubsubPublishMessage(robj *channel, robj *message) {
+    return pubsubPublishMessageInternal(channel,message,pubSubType);
+}
+
 /*-----------------------------------------------------------------------------
  * Pubsub commands implementation
  *----------------------------------------------------------------------------*/
@@ -327,7 +628,7 @@ void subscribeCommand(client *c) {
     int j;
 
     for (j = 1; j < c->argc; j++)
-        pubsubSubscribeChannel(c,c->argv[j]);
+        pubsubSubscribeChannel(c,c->argv[j],pubSubType);
     c->flags |= CLIENT_PUBSUB;
 }
 
@@ -338,9 +639,9 @@ void unsubscribeCommand(client *c) {
         int j;
 
         for (j = 1; j < c->argc; j++)
-            pubsubUnsubscribeChannel(c,c->argv[j],1);
+            pubsubUnsubscribeChannel(c,c->argv[j],1,pubSubType);
     }
-    if (clientSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
+    pubsubUpdateClientFlag(c);
 }
 
 void psubscribeCommand(client *c) {
@@ -360,7 +661,7 @@ void punsubscribeCommand(client *c) {
         for (j = 1; j < c->argc; j++)
             pubsubUnsubscribePattern(c,c->argv[j],1);
     }
-    if (clientSubscriptionsCount(c) == 0) c->flags &= ~CLIENT_PUBSUB;
+    pubsubUpdateClientFlag(c);
 }
 
 void publishCommand(client *c) {
@@ -372,6 +673,72 @@ void publishCommand(client *c) {
     addReplyLongLong(c,receivers);
 }
 
+/* SSUBSCRIBE shardchannel [shardchannel ...] */
+void ssubscribeCommand(client *c) {
+    for (int j = 1; j < c->argc; j++)
+        pubsubSubscribeChannel(c,c->argv[j],pubSubShardType);
+    c->flags |= CLIENT_PUBSUB;
+}
+
+/* SUNSUBSCRIBE [shardchannel [shardchannel ...]] */
+void sunsubscribeCommand(client *c) {
+    if (c->argc == 1) {
+        pubsubUnsubscribeShardAllChannels(c,1);
+    } else {
+        for (int j = 1; j < c->argc; j++)
+            pubsubUnsubscribeChannel(c,c->argv[j],1,pubSubShardType);
+    }
+    pubsubUpdateClientFlag(c);
+}
+
+/* SPUBLISH shardchannel message
+ *
+ * In cluster mode the command is redirected to the master owning the slot
+ * of the channel, and propagated only to its replicas with the replication
+ * stream, not to the whole cluster. */
+void spublishCommand(client *c) {
+    int receivers = pubsubPublishMessageInternal(c->argv[1],c->argv[2],
+                                                 pubSubShardType);
+    forceCommandPropagation(c,PROPAGATE_REPL);
+    addReplyLongLong(c,receivers);
+}
+
+/* Reply with the channels of 'd' matching the pattern 'pat', or all the
+ * channels if 'pat' is NULL. */
+static void addReplyChannelsMatching(client *c, dict *d, sds pat) {
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+    long mblen = 0;
+    void *replylen;
+
+    replylen = addReplyDeferredLen(c);
+    while((de = dictNext(di)) != NULL) {
+        robj *cobj = dictGetKey(de);
+        sds channel = cobj->ptr;
+
+        if (!pat || stringmatchlen(pat, sdslen(pat),
+                                   channel, sdslen(channel),0))
+        {
+            addReplyBulk(c,cobj);
+            mblen++;
+        }
+    }
+    dictReleaseIterator(di);
+    setDeferredArrayLen(c,replylen,mblen);
+}
+
+/* Reply with the number of subscribers of each channel in c->argv[2...]
+ * according to the channels dict 'd'. */
+static void addReplyChannelsNumSub(client *c, dict *d) {
+    addReplyArrayLen(c,(c->argc-2)*2);
+    for (int j = 2; j < c->argc; j++) {
+        list *l = dictFetchValue(d,c->argv[j]);
+
+        addReplyBulk(c,c->argv[j]);
+        addReplyLongLong(c,l ? listLength(l) : 0);
+    }
+}
+
 /* PUBSUB command for Pub/Sub introspection. */
 void pubsubCommand(client *c) {
     if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
@@ -379,6 +746,8 @@ void pubsubCommand(client *c) {
 "CHANNELS [<pattern>] -- Return the currently active channels matching a pattern (default: all).",
 "NUMPAT -- Return number of subscriptions to patterns.",
 "NUMSUB [channel-1 .. channel-N] -- Returns the number of subscribers for the specified channels (excluding patterns, default: none).",
+"SHARDCHANNELS [<pattern>] -- Return the currently active shard level channels matching a pattern (default: all).",
+"SHARDNUMSUB [shardchannel-1 .. shardchannel-N] -- Returns the number of subscribers for the specified shard level channels (default: none).",
 NULL
         };
         addReplyHelp(c, help);
@@ -387,39 +756,22 @@ NULL
     {
         /* PUBSUB CHANNELS [<pattern>] */
         sds pat = (c->argc == 2) ? NULL : c->argv[2]->ptr;
-        dictIterator *di = dictGetIterator(server.pubsub_channels);
-        dictEntry *de;
-        long mblen = 0;
-        void *replylen;
-
-        replylen = addReplyDeferredLen(c);
-        while((de = dictNext(di)) != NULL) {
-            robj *cobj = dictGetKey(de);
-            sds channel = cobj->ptr;
-
-            if (!pat || stringmatchlen(pat, sdslen(pat),
-                                       channel, sdslen(channel),0))
-            {
-                addReplyBulk(c,cobj);
-                mblen++;
-            }
-        }
-        dictReleaseIterator(di);
-        setDeferredArrayLen(c,replylen,mblen);
+        addReplyChannelsMatching(c,server.pubsub_channels,pat);
     } else if (!strcasecmp(c->argv[1]->ptr,"numsub") && c->argc >= 2) {
         /* PUBSUB NUMSUB [Channel_1 ... Channel_N] */
-        int j;
-
-        addReplyArrayLen(c,(c->argc-2)*2);
-        for (j = 2; j < c->argc; j++) {
-            list *l = dictFetchValue(server.pubsub_channels,c->argv[j]);
-
-            addReplyBulk(c,c->argv[j]);
-            addReplyLongLong(c,l ? listLength(l) : 0);
-        }
+        addReplyChannelsNumSub(c,server.pubsub_channels);
+    } else if (!strcasecmp(c->argv[1]->ptr,"shardchannels") &&
+        (c->argc == 2 || c->argc == 3))
+    {
+        /* PUBSUB SHARDCHANNELS [<pattern>] */
+        sds pat = (c->argc == 2) ? NULL : c->argv[2]->ptr;
+        addReplyChannelsMatching(c,server.pubsubshard_channels,pat);
+    } else if (!strcasecmp(c->argv[1]->ptr,"shardnumsub") && c->argc >= 2) {
+        /* PUBSUB SHARDNUMSUB [ShardChannel_1 ... ShardChannel_N] */
+        addReplyChannelsNumSub(c,server.pubsubshard_channels);
     } else if (!strcasecmp(c->argv[1]->ptr,"numpat") && c->argc == 2) {
         /* PUBSUB NUMPAT */
-        addReplyLongLong(c,listLength(server.pubsub_patterns));
+        addReplyLongLong(c,server.pubsub_patterns_subscriptions);
     } else {
         addReplySubcommandSyntaxError(c);
     }
@@ -34,6 +34,7 @@
 #include "ziplist.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "lz4.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -58,6 +59,15 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* Codec used to compress the nodes, QUICKLIST_NODE_ENCODING_LZF or
+ * QUICKLIST_NODE_ENCODING_LZ4. Every node remembers the codec it was
+ * compressed with, so it can be changed at any time. */
+static int compress_codec = QUICKLIST_NODE_ENCODING_LZF;
+
+/* Quicklists with at least this number of nodes build the nodes index on
+ * the first access by position. Zero disables the index. */
+static unsigned long index_min_nodes = QUICKLIST_INDEX_MIN_NODES;
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -100,6 +110,8 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    quicklist->cache = NULL;
+    quicklist->index = NULL;
     return quicklist;
 }
 
@@ -111,6 +123,8 @@ void quicklistSetCompressDepth(quicklist *quicklist, int compress) {
         compress = 0;
     }
     quicklist->compress = compress;
+    if (compress && !quicklist->cache)
+        quicklist->cache = zcalloc(sizeof(*quicklist->cache));
 }
 
 #define FILL_MAX (1 << 15)
@@ -128,6 +142,18 @@ void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
     quicklistSetCompressDepth(quicklist, depth);
 }
 
+/* Set the codec used to compress the nodes of all the quicklists from now
+ * on: QUICKLIST_NODE_ENCODING_LZF or QUICKLIST_NODE_ENCODING_LZ4. */
+void quicklistSetCompressCodec(int encoding) {
+    compress_codec = encoding;
+}
+
+/* Set the minimum number of nodes for quicklists to build the nodes index,
+ * zero to disable it. Indexes already built are kept. */
+void quicklistSetIndexMinNodes(unsigned long nodes) {
+    index_min_nodes = nodes;
+}
+
 /* Create a new quicklist with some default parameters. */
 quicklist *quicklistNew(int fill, int compress) {
     quicklist *quicklist = quicklistCreate();
@@ -145,6 +171,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
     node->recompress = 0;
+    node->cached = 0;
     return node;
 }
 
@@ -169,6 +196,8 @@ void quicklistRelease(quicklist *quicklist) {
         quicklist->len--;
         current = next;
     }
+    zfree(quicklist->cache);
+    quicklistDropIndex(quicklist);
     zfree(quicklist);
 }
 
@@ -186,18 +215,21 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
 
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
+    if (compress_codec == QUICKLIST_NODE_ENCODING_LZ4)
+        lzf->sz = lz4_compress(node->zl, node->sz, lzf->compressed, node->sz);
+    else
+        lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed, node->sz);
+
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
-        lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+    if (lzf->sz == 0 || lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
+        /* Both codecs abort/reject compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = compress_codec;
     node->recompress = 0;
     return 1;
 }
@@ -219,7 +251,12 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    unsigned int len;
+    if (node->encoding == QUICKLIST_NODE_ENCODING_LZ4)
+        len = lz4_decompress(lzf->compressed, lzf->sz, decompressed, node->sz);
+    else
+        len = lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz);
+    if (len == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -233,7 +270,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Decompress only compressed nodes. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
@@ -241,15 +278,16 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Force node to not be immediately re-compresable */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+/* Extract the raw compressed data from this quicklistNode, that is LZF or
+ * LZ4 data according to node->encoding.
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
     *data = lzf->compressed;
@@ -258,6 +296,62 @@ size_t quicklistGetLzf(const quicklistNode *node, void **data) {
 
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
+/* Remove 'node' from the cache of decompressed nodes, if it is there. */
+REDIS_STATIC void quicklistCacheRemove(const quicklist *quicklist,
+                                       quicklistNode *node) {
+    quicklistCache *cache = quicklist->cache;
+
+    if (!node->cached)
+        return;
+    for (int j = 0; j < cache->len; j++) {
+        if (cache->nodes[j] == node) {
+            memmove(cache->nodes + j, cache->nodes + j + 1,
+                    sizeof(node) * (cache->len - j - 1));
+            cache->len--;
+            break;
+        }
+    }
+    node->cached = 0;
+}
+
+/* Called instead of recompressing a node decompressed with
+ * quicklistDecompressNodeForUse() once we are done with it: the node is
+ * kept decompressed at the head of the cache, and the least recently used
+ * node of a full cache is compressed again to make room for it. */
+REDIS_STATIC void quicklistCacheAdd(const quicklist *quicklist,
+                                    quicklistNode *node) {
+    quicklistCache *cache = quicklist->cache;
+
+    if (!cache) {
+        quicklistCompressNode(node);
+        return;
+    }
+
+    if (node->cached) {
+        quicklistCacheRemove(quicklist, node);
+    } else if (cache->len == QUICKLIST_CACHE_NODES) {
+        quicklistNode *lru = cache->nodes[--cache->len];
+        lru->cached = 0;
+        if (lru->recompress)
+            quicklistCompressNode(lru);
+    }
+    memmove(cache->nodes + 1, cache->nodes, sizeof(node) * cache->len);
+    cache->nodes[0] = node;
+    cache->len++;
+    node->cached = 1;
+}
+
+/* Nodes within the compress depth must stay decompressed, so they are no
+ * longer subject to the cache eviction. */
+#define quicklistDecompressEndNode(_ql, _node)                                 \
+    do {                                                                       \
+        quicklistDecompressNode((_node));                                      \
+        if ((_node)->cached) {                                                 \
+            quicklistCacheRemove((_ql), (_node));                              \
+            (_node)->recompress = 0;                                           \
+        }                                                                      \
+    } while (0)
+
 /* Force 'quicklist' to meet compression guidelines set by compress depth.
  * The only way to guarantee interior nodes get compressed is to iterate
  * to our "interior" compress depth then compress the next node we find.
@@ -307,8 +401,8 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     int depth = 0;
     int in_depth = 0;
     while (depth++ < quicklist->compress) {
-        quicklistDecompressNode(forward);
-        quicklistDecompressNode(reverse);
+        quicklistDecompressEndNode(quicklist, forward);
+        quicklistDecompressEndNode(quicklist, reverse);
 
         if (forward == node || reverse == node)
             in_depth = 1;
@@ -333,18 +427,137 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCacheAdd((_ql), (_node));                                 \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
 
-/* If we previously used quicklistDecompressNodeForUse(), just recompress. */
+/* If we previously used quicklistDecompressNodeForUse(), just recompress
+ * (or rather cache the node, that will be recompressed when evicted). */
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            quicklistCacheAdd((_ql), (_node));                                 \
+    } while (0)
+
+/* Free the nodes index. It is built again on the next access by position.
+ * Must be called after any change to the nodes not handled incrementally,
+ * including the nodes being reallocated. */
+void quicklistDropIndex(quicklist *quicklist) {
+    if (!quicklist->index)
+        return;
+    zfree(quicklist->index->slots);
+    zfree(quicklist->index);
+    quicklist->index = NULL;
+}
+
+/* The count of interior nodes is stored in the index, so changing it
+ * invalidates the index. Head and tail counts are always read from the
+ * nodes themselves. */
+#define quicklistIndexNodeChanged(_ql, _node)                                  \
+    do {                                                                       \
+        if ((_ql)->index && (_node) != (_ql)->head && (_node) != (_ql)->tail)  \
+            quicklistDropIndex((_ql));                                         \
     } while (0)
 
+/* Build the nodes index with room to add as many nodes at each end as the
+ * list currently has. */
+REDIS_STATIC void quicklistBuildIndex(quicklist *quicklist) {
+    quicklistNodeIndex *index = zmalloc(sizeof(*index));
+    long long start = 0;
+
+    index->size = quicklist->len * 3;
+    index->slots = zmalloc(sizeof(quicklistIndexSlot) * index->size);
+    index->lo = index->hi = quicklist->len;
+    for (quicklistNode *node = quicklist->head; node; node = node->next) {
+        index->slots[index->hi].node = node;
+        index->slots[index->hi].start = start;
+        if (node != quicklist->head)
+            start += node->count;
+        index->hi++;
+    }
+    quicklist->index = index;
+}
+
+/* Update the index after 'new_node' was linked to the list: a new head
+ * or tail just turns the old one into an interior node, while nodes added
+ * in the middle drop the index. */
+REDIS_STATIC void quicklistIndexNodeAdded(quicklist *quicklist,
+                                          quicklistNode *new_node) {
+    quicklistNodeIndex *index = quicklist->index;
+
+    if (!index)
+        return;
+    if (new_node == quicklist->head && index->lo > 0 &&
+        index->slots[index->lo].node == new_node->next) {
+        /* The old head is the new first interior node. */
+        quicklistIndexSlot *old = index->slots + index->lo;
+        old->start = old[1].start - old->node->count;
+        index->lo--;
+        index->slots[index->lo].node = new_node;
+    } else if (new_node == quicklist->tail && index->hi < index->size &&
+               index->slots[index->hi - 1].node == new_node->prev) {
+        /* The start of the old tail is already right, the new tail
+         * follows it. */
+        quicklistIndexSlot *old = index->slots + index->hi - 1;
+        old[1].node = new_node;
+        old[1].start = old->start + old->node->count;
+        index->hi++;
+    } else {
+        quicklistDropIndex(quicklist);
+    }
+}
+
+/* Update the index before 'node' is unlinked from the list. */
+REDIS_STATIC void quicklistIndexNodeRemoved(quicklist *quicklist,
+                                            quicklistNode *node) {
+    quicklistNodeIndex *index = quicklist->index;
+
+    if (!index)
+        return;
+    if (quicklist->len <= 3) {
+        /* Not enough nodes to have an interior. */
+        quicklistDropIndex(quicklist);
+    } else if (node == quicklist->head) {
+        index->lo++;
+    } else if (node == quicklist->tail) {
+        index->hi--;
+    } else {
+        quicklistDropIndex(quicklist);
+    }
+}
+
+/* Find with the nodes index the node holding the element at 'pos' (from
+ * the head, zero based), setting '*offset' to the offset of the element
+ * inside the node. */
+REDIS_STATIC quicklistNode *quicklistIndexLookup(const quicklist *quicklist,
+                                                 unsigned long long pos,
+                                                 unsigned long long *offset) {
+    quicklistNodeIndex *index = quicklist->index;
+    quicklistNode *head = quicklist->head, *tail = quicklist->tail;
+
+    if (pos < head->count) {
+        *offset = pos;
+        return head;
+    } else if (pos >= quicklist->count - tail->count) {
+        *offset = pos - (quicklist->count - tail->count);
+        return tail;
+    }
+
+    /* Binary search the last interior node starting at or before 'pos'. */
+    long long start = index->slots[index->lo + 1].start + pos - head->count;
+    long lo = index->lo + 1, hi = index->hi - 2;
+    while (lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (index->slots[mid].start <= start)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *offset = start - index->slots[lo].start;
+    return index->slots[lo].node;
+}
+
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
  * Insert 'new_node' before 'old_node' if 'after' is 0.
  * Note: 'new_node' is *always* uncompressed, so if we assign it to
@@ -382,6 +595,7 @@ REDIS_STATIC void __quicklistInsertNode(quicklist *quicklist,
         quicklistCompress(quicklist, old_node);
 
     quicklist->len++;
+    quicklistIndexNodeAdded(quicklist, new_node);
 }
 
 /* Wrappers for node inserting around existing node. */
@@ -578,6 +792,8 @@ quicklist *quicklistCreateFromZiplist(int fill, int compress,
 
 REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
                                      quicklistNode *node) {
+    quicklistIndexNodeRemoved(quicklist, node);
+
     if (node->next)
         node->next->prev = node->prev;
     if (node->prev)
@@ -597,6 +813,7 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
 
     quicklist->count -= node->count;
 
+    quicklistCacheRemove(quicklist, node);
     zfree(node->zl);
     zfree(node);
     quicklist->len--;
@@ -616,6 +833,7 @@ REDIS_STATIC int quicklistDelIndex(quicklist *quicklist, quicklistNode *node,
 
     node->zl = ziplistDelete(node->zl, p);
     node->count--;
+    quicklistIndexNodeChanged(quicklist, node);
     if (node->count == 0) {
         gone = 1;
         __quicklistDelNode(quicklist, node);
@@ -711,6 +929,7 @@ REDIS_STATIC quicklistNode *_quicklistZiplistMerge(quicklist *quicklist,
         }
         keep->count = ziplistLen(keep->zl);
         quicklistNodeUpdateSz(keep);
+        quicklistIndexNodeChanged(quicklist, keep);
 
         nokeep->count = 0;
         __quicklistDelNode(quicklist, nokeep);
@@ -884,6 +1103,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         }
         node->count++;
         quicklistNodeUpdateSz(node);
+        quicklistIndexNodeChanged(quicklist, node);
         quicklistRecompressOnly(quicklist, node);
     } else if (!full && !after) {
         D("Not full, inserting before current position.");
@@ -891,6 +1111,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         node->zl = ziplistInsert(node->zl, entry->zi, value, sz);
         node->count++;
         quicklistNodeUpdateSz(node);
+        quicklistIndexNodeChanged(quicklist, node);
         quicklistRecompressOnly(quicklist, node);
     } else if (full && at_tail && node->next && !full_next && after) {
         /* If we are: at tail, next has free space, and inserting after:
@@ -901,6 +1122,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_HEAD);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
+        quicklistIndexNodeChanged(quicklist, new_node);
         quicklistRecompressOnly(quicklist, new_node);
     } else if (full && at_head && node->prev && !full_prev && !after) {
         /* If we are: at head, previous has free space, and inserting before:
@@ -911,6 +1133,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         new_node->zl = ziplistPush(new_node->zl, value, sz, ZIPLIST_TAIL);
         new_node->count++;
         quicklistNodeUpdateSz(new_node);
+        quicklistIndexNodeChanged(quicklist, new_node);
         quicklistRecompressOnly(quicklist, new_node);
     } else if (full && ((at_tail && node->next && full_next && after) ||
                         (at_head && node->prev && full_prev && !after))) {
@@ -928,6 +1151,7 @@ REDIS_STATIC void _quicklistInsert(quicklist *quicklist, quicklistEntry *entry,
         D("\tsplitting node...");
         quicklistDecompressNodeForUse(node);
         new_node = _quicklistSplitNode(node, entry->offset, after);
+        quicklistIndexNodeChanged(quicklist, node);
         new_node->zl = ziplistPush(new_node->zl, value, sz,
                                    after ? ZIPLIST_HEAD : ZIPLIST_TAIL);
         new_node->count++;
@@ -1024,6 +1248,7 @@ int quicklistDelRange(quicklist *quicklist, const long start,
             quicklistNodeUpdateSz(node);
             node->count -= del;
             quicklist->count -= del;
+            quicklistIndexNodeChanged(quicklist, node);
             quicklistDeleteIfEmpty(quicklist, node);
             if (node)
                 quicklistRecompressOnly(quicklist, node);
@@ -1192,7 +1417,7 @@ quicklist *quicklistDup(quicklist *orig) {
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (current->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        if (quicklistNodeIsCompressed(current)) {
             quicklistLZF *lzf = (quicklistLZF *)current->zl;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
             node->zl = zmalloc(lzf_sz);
@@ -1206,6 +1431,8 @@ quicklist *quicklistDup(quicklist *orig) {
         copy->count += node->count;
         node->sz = current->sz;
         node->encoding = current->encoding;
+        /* Cached nodes are copied decompressed, compress them on next use. */
+        node->recompress = current->cached;
 
         _quicklistInsertNodeAfter(copy, copy->tail, node);
     }
@@ -1243,6 +1470,21 @@ int quicklistIndex(const quicklist *quicklist, const long long idx,
     if (index >= quicklist->count)
         return 0;
 
+    /* The index is built lazily: it doesn't change the content of the
+     * list, just like the iterators decompressing nodes. */
+    if (!quicklist->index && index_min_nodes &&
+        quicklist->len >= index_min_nodes && quicklist->len >= 3)
+        quicklistBuildIndex((struct quicklist *)quicklist);
+
+    if (quicklist->index) {
+        unsigned long long pos, offset;
+        pos = forward ? index : quicklist->count - 1 - index;
+        n = quicklistIndexLookup(quicklist, pos, &offset);
+        /* Elements skipped to reach 'n', so that the walk below stops at
+         * once computing the same offset. */
+        accum = index - (forward ? offset : n->count - 1 - offset);
+    }
+
     while (likely(n)) {
         if ((accum + n->count) > index) {
             break;
@@ -1546,6 +1788,32 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
         errors++;
     }
 
+    if (ql->index) {
+        quicklistNodeIndex *index = ql->index;
+        quicklistNode *node = ql->head;
+        for (long j = index->lo; j < index->hi && node;
+             j++, node = node->next) {
+            if (index->slots[j].node != node) {
+                yell("quicklist index slot %ld doesn't match node", j);
+                errors++;
+                break;
+            }
+            if (j > index->lo + 1 &&
+                index->slots[j].start != index->slots[j - 1].start +
+                                             index->slots[j - 1].node->count) {
+                yell("quicklist index slot %ld has wrong start %lld", j,
+                     index->slots[j].start);
+                errors++;
+                break;
+            }
+        }
+        if (index->hi - index->lo != (long)ql->len) {
+            yell("quicklist index has %ld slots for %lu nodes",
+                 index->hi - index->lo, ql->len);
+            errors++;
+        }
+    }
+
     if (ql->len == 0 && !errors) {
         OK;
         return errors;
@@ -1583,8 +1851,8 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
-                    !node->attempted_compress) {
+                if (!quicklistNodeIsCompressed(node) &&
+                    !node->attempted_compress && !node->cached) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
                          "nodes: %u; size: %u; recompress: %d; attempted: %d)",
@@ -2618,7 +2886,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -2634,6 +2902,106 @@ int quicklistTest(int argc, char *argv[]) {
     }
     long long stop = mstime();
 
+    TEST("access by position through the nodes index") {
+        quicklist *ql = quicklistNew(4, 0);
+        long long first = 0, last = 0;
+        /* Use the list as a ring buffer, checking every access by
+         * position and the index itself. */
+        for (int i = 0; i < 4000; i++)
+            quicklistPushTail(ql, genstr("e", last++), 32);
+        for (int round = 0; round < 2000; round++) {
+            quicklistEntry entry;
+            unsigned char *data;
+            unsigned int sz;
+            long long lv;
+            long long idx = rand() % (last - first);
+            if (!quicklistIndex(ql, idx, &entry) ||
+                strncmp((char *)entry.value, genstr("e", first + idx),
+                        entry.sz))
+                ERR("Wrong element at index %lld", idx);
+            if (!quicklistIndex(ql, -idx - 1, &entry) ||
+                strncmp((char *)entry.value, genstr("e", last - idx - 1),
+                        entry.sz))
+                ERR("Wrong element at index %lld", -idx - 1);
+            for (int j = 0; j < 3; j++) {
+                quicklistPushTail(ql, genstr("e", last++), 32);
+                quicklistPop(ql, QUICKLIST_HEAD, &data, &sz, &lv);
+                zfree(data);
+                first++;
+            }
+            if (round % 100 == 0) {
+                if (!ql->index)
+                    ERR("Index dropped pushing and popping: %d", round);
+                ql_verify(ql, ql->len, 4000, ql->head->count,
+                          ql->tail->count);
+            }
+        }
+        /* Changes in the middle drop the index. */
+        quicklistReplaceAtIndex(ql, 2000, "replaced", 8);
+        quicklistDelRange(ql, 3000, 5);
+        if (ql->index)
+            ERR("Index kept deleting from the middle: %ld", ql->index->lo);
+        quicklistEntry entry;
+        quicklistIndex(ql, 2000, &entry);
+        if (strncmp((char *)entry.value, "replaced", entry.sz))
+            ERR("Wrong replaced element: %.*s", entry.sz, entry.value);
+        ql_verify(ql, ql->len, 3995, ql->head->count, ql->tail->count);
+        quicklistRelease(ql);
+    }
+
+    TEST("lz4 compression of interior nodes") {
+        quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZ4);
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 500; i++)
+            quicklistPushTail(ql, genstr("hello", i), 64);
+        quicklistSetCompressCodec(QUICKLIST_NODE_ENCODING_LZF);
+        if (ql->head->next->encoding != QUICKLIST_NODE_ENCODING_LZ4)
+            ERR("Interior node not compressed with LZ4: %d",
+                ql->head->next->encoding);
+        quicklistEntry entry;
+        quicklistIndex(ql, 250, &entry);
+        if (strncmp((char *)entry.value, genstr("hello", 250), entry.sz))
+            ERR("Wrong value decompressing LZ4: %.*s", entry.sz,
+                entry.value);
+        quicklist *copy = quicklistDup(ql);
+        ql_verify(copy, ql->len, 500, ql->head->count, ql->tail->count);
+        quicklistRelease(copy);
+        ql_verify(ql, ql->len, 500, ql->head->count, ql->tail->count);
+        quicklistRelease(ql);
+    }
+
+    TEST("recently used interior nodes are cached decompressed") {
+        quicklist *ql = quicklistNew(-2, 1);
+        for (int i = 0; i < 2000; i++)
+            quicklistPushTail(ql, genstr("hello", i), 64);
+        quicklistEntry entry;
+        long nodes = ql->len;
+        for (int i = 0; i < nodes; i++) {
+            quicklistIndex(ql, (long long)i * 2000 / nodes, &entry);
+            quicklistIter *iter = quicklistGetIteratorAtIdx(
+                ql, AL_START_HEAD, (long long)i * 2000 / nodes);
+            quicklistNext(iter, &entry);
+            quicklistReleaseIterator(iter);
+        }
+        if (ql->cache->len != QUICKLIST_CACHE_NODES)
+            ERR("Cache has %d nodes", ql->cache->len);
+        int cached = 0;
+        for (quicklistNode *n = ql->head; n; n = n->next) {
+            if (n->cached) {
+                cached++;
+                if (quicklistNodeIsCompressed(n))
+                    ERR("Cached node is compressed: %d", n->encoding);
+            }
+        }
+        if (cached != QUICKLIST_CACHE_NODES)
+            ERR("%d nodes flagged as cached", cached);
+        /* Deleting the cached nodes must remove them from the cache. */
+        quicklistDelRange(ql, 0, 2000);
+        if (ql->cache->len != 0)
+            ERR("Cache has %d nodes after deletion", ql->cache->len);
+        quicklistRelease(ql);
+    }
+
     printf("\n");
     for (size_t i = 0; i < option_count; i++)
         printf("Test Loop %02d: %0.2f seconds.\n", options[i],
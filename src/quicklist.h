@@ -36,27 +36,30 @@
 /* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
  * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
+ * encoding: 2 bits, RAW=1, LZF=2, LZ4=3.
  * container: 2 bits, NONE=1, ZIPLIST=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 10 bits, free for future use; pads out the remainder of 32 bits */
+ * cached: 1 bit, bool, true if node is in the quicklist decompressed cache.
+ * extra: 9 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     struct quicklistNode *prev;
     struct quicklistNode *next;
     unsigned char *zl;
     unsigned int sz;             /* ziplist size in bytes */
     unsigned int count : 16;     /* count of items in ziplist */
-    unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
+    unsigned int encoding : 2;   /* RAW==1, LZF==2 or LZ4==3 */
     unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+    unsigned int cached : 1;     /* is this node in quicklist->cache? */
+    unsigned int extra : 9; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF or LZ4 data (according to quicklistNode->encoding)
+ * with total (compressed) length 'sz'
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
 typedef struct quicklistLZF {
@@ -64,12 +67,53 @@ typedef struct quicklistLZF {
     char compressed[];
 } quicklistLZF;
 
-/* quicklist is a 40 byte struct (on 64-bit systems) describing a quicklist.
+/* Number of recently accessed nodes a compressed quicklist keeps
+ * decompressed, so that accessing them again (as it happens when the list
+ * is used as a queue or a timeline) doesn't need to decompress them and
+ * compress them back every time. */
+#define QUICKLIST_CACHE_NODES 4
+
+/* quicklistCache holds the interior nodes kept decompressed after their
+ * use, the most recently used first. When a node is added to a full cache
+ * the least recently used one is compressed again. */
+typedef struct quicklistCache {
+    quicklistNode *nodes[QUICKLIST_CACHE_NODES];
+    int len;
+} quicklistCache;
+
+/* Minimum number of nodes for a quicklist to build the nodes index on the
+ * first access by position. */
+#define QUICKLIST_INDEX_MIN_NODES 64
+
+/* quicklistNodeIndex maps positions to nodes in O(log N), so that accessing
+ * elements by index doesn't need to walk the list. Slots from 'lo' to 'hi'
+ * (excluded) map all the nodes from head to tail. Each interior node has
+ * the position of its first element in 'start', relative to an arbitrary
+ * origin, while the head and the tail are accessed using their current
+ * count. This way pushing and popping elements, and adding and removing
+ * nodes at the ends (as it happens using the list as a queue) only needs
+ * to update the index at the extremes. Any other change to the nodes
+ * drops the index, that is built again on the next access by position. */
+typedef struct quicklistIndexSlot {
+    quicklistNode *node;
+    long long start;
+} quicklistIndexSlot;
+
+typedef struct quicklistNodeIndex {
+    quicklistIndexSlot *slots;
+    long lo, hi;  /* used slots */
+    long size;    /* allocated slots */
+} quicklistNodeIndex;
+
+/* quicklist is a 56 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'fill' is the user-requested (or default) fill factor. */
+ * 'fill' is the user-requested (or default) fill factor.
+ * 'cache' is the cache of decompressed nodes, only allocated when the
+ *         quicklist is compressed.
+ * 'index' is the nodes index, NULL if not built. */
 typedef struct quicklist {
     quicklistNode *head;
     quicklistNode *tail;
@@ -77,6 +121,8 @@ typedef struct quicklist {
     unsigned long len;          /* number of quicklistNodes */
     int fill : 16;              /* fill factor for individual nodes */
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
+    quicklistCache *cache;      /* recently used decompressed nodes */
+    quicklistNodeIndex *index;  /* position to node index */
 } quicklist;
 
 typedef struct quicklistIter {
@@ -103,6 +149,7 @@ typedef struct quicklistEntry {
 /* quicklist node encodings */
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
+#define QUICKLIST_NODE_ENCODING_LZ4 3
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
@@ -112,7 +159,7 @@ typedef struct quicklistEntry {
 #define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
 
 #define quicklistNodeIsCompressed(node)                                        \
-    ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+    ((node)->encoding != QUICKLIST_NODE_ENCODING_RAW)
 
 /* Prototypes */
 quicklist *quicklistCreate(void);
@@ -120,6 +167,9 @@ quicklist *quicklistNew(int fill, int compress);
 void quicklistSetCompressDepth(quicklist *quicklist, int depth);
 void quicklistSetFill(quicklist *quicklist, int fill);
 void quicklistSetOptions(quicklist *quicklist, int fill, int depth);
+void quicklistSetCompressCodec(int encoding);
+void quicklistSetIndexMinNodes(unsigned long nodes);
+void quicklistDropIndex(quicklist *quicklist);
 void quicklistRelease(quicklist *quicklist);
 int quicklistPushHead(quicklist *quicklist, void *value, const size_t sz);
 int quicklistPushTail(quicklist *quicklist, void *value, const size_t sz);
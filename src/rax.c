@@ -36,6 +36,10 @@
 #include <math.h>
 #include "rax.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifndef RAX_MALLOC_INCLUDE
 #define RAX_MALLOC_INCLUDE "rax_malloc.h"
 #endif
@@ -425,6 +429,36 @@ raxNode *raxCompressNode(raxNode *n, unsigned char *s, size_t len, raxNode **chi
     return n;
 }
 
+/* Return the index of the child of the not compressed node 'n' for the
+ * byte 'c', or n->size if there is no such child.
+ *
+ * Most nodes have a few children, and a linear scan is the fastest way to
+ * find the one we need. Nodes with many children, like the first levels
+ * of keys sharing a prefix followed by a random part, are instead scanned
+ * 16 children at a time with SSE2 when available. The children are sorted,
+ * so the scan stops at the first child greater than 'c'. */
+static inline int raxFindChild(raxNode *n, unsigned char c) {
+    unsigned char *v = n->data;
+    int size = n->size, j = 0;
+
+#ifdef __SSE2__
+    if (size >= 16) {
+        const __m128i needle = _mm_set1_epi8((char)c);
+        for (; j+16 <= size; j += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*)(v+j));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block,needle));
+            if (mask) return j+__builtin_ctz(mask);
+            if (v[j+15] > c) return size;
+        }
+    }
+#endif
+    for (; j < size; j++) {
+        if (v[j] == c) return j;
+        if (v[j] > c) break;
+    }
+    return size;
+}
+
 /* Low level function that walks the tree looking for the string
  * 's' of 'len' bytes. The function returns the number of characters
  * of the key that was possible to process: if the returned integer
@@ -470,12 +504,7 @@ static inline size_t raxLowWalk(rax *rax, unsigned char *s, size_t len, raxNode
             }
             if (j != h->size) break;
         } else {
-            /* Even when h->size is large, linear scan provides good
-             * performances compared to other approaches that are in theory
-             * more sounding, like performing a binary search. */
-            for (j = 0; j < h->size; j++) {
-                if (v[j] == s[i]) break;
-            }
+            j = raxFindChild(h,s[i]);
             if (j == h->size) break;
             i++;
         }
@@ -29,9 +29,11 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#include "lz4.h"    /* LZ4 compression library */
 #include "zipmap.h"
 #include "endianconv.h"
 #include "stream.h"
+#include "bio.h"
 
 #include <math.h>
 #include <sys/types.h>
@@ -318,13 +320,20 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     return rdbEncodeInteger(value,enc);
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+/* Algorithm used by rdbSaveRawString() to compress strings. It is set by
+ * rdbSaveRio() for the duration of the save, so that DUMP payloads and
+ * anything else serialized outside of a full RDB file always use LZF. */
+static int rdbSaveCompression = RDB_COMPRESSION_LZF;
+
+/* Save an already compressed blob with the RDB_ENC_* encoding 'enctype'. */
+static ssize_t rdbSaveCompressedBlob(rio *rdb, int enctype, void *data,
+                                     size_t compress_len, size_t original_len)
+{
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enctype;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -343,6 +352,12 @@ writeerr:
     return -1;
 }
 
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,
+                                 original_len);
+}
+
 ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
     void *out;
@@ -361,10 +376,33 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+/* Like rdbSaveLzfStringObject() but compressing with LZ4. The layout on
+ * disk is the same, only the encoding type changes. */
+ssize_t rdbSaveLz4StringObject(rio *rdb, unsigned char *s, size_t len) {
+    size_t comprlen, outlen;
+    void *out;
+
+    /* We require at least four bytes compression for this to be worth it */
+    if (len <= 4 || len > UINT_MAX) return 0;
+    outlen = len-4;
+    if ((out = zmalloc(outlen+1)) == NULL) return 0;
+    comprlen = lz4_compress(s, len, out, outlen);
+    if (comprlen == 0) {
+        zfree(out);
+        return 0;
+    }
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, RDB_ENC_LZ4, out,
+                                             comprlen, len);
+    zfree(out);
+    return nwritten;
+}
+
+/* Load an LZF or LZ4 compressed string in RDB format, according to
+ * 'enctype'. The returned value changes according to 'flags'. For more info
+ * check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enctype, int flags,
+                                    size_t *lenptr)
+{
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
@@ -385,7 +423,13 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) {
+    if (enctype == RDB_ENC_LZ4) {
+        if (len > UINT_MAX || clen > UINT_MAX ||
+            lz4_decompress(c,clen,val,len) != len)
+        {
+            rdbExitReportCorruptRDB("Invalid LZ4 compressed string");
+        }
+    } else if (lzf_decompress(c,clen,val,len) == 0) {
         rdbExitReportCorruptRDB("Invalid LZF compressed string");
     }
     zfree(c);
@@ -419,10 +463,13 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
-     * aaaaaaaaaaaaaaaaaa so skip it */
+    /* Try LZF (or LZ4) compression - under 20 bytes it's unable to compress
+     * even aaaaaaaaaaaaaaaaaa so skip it */
     if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+        if (rdbSaveCompression == RDB_COMPRESSION_LZ4)
+            n = rdbSaveLz4StringObject(rdb,s,len);
+        else
+            n = rdbSaveLzfStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -463,6 +510,11 @@ ssize_t rdbSaveStringObject(rio *rdb, robj *obj) {
      * object is already integer encoded. */
     if (obj->encoding == OBJ_ENCODING_INT) {
         return rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_COMPRESSED) {
+        /* Saved as a plain string, compressed again by the loader. */
+        size_t len;
+        char *buf = stringDecompressToScratch(obj,&len);
+        return rdbSaveRawString(rdb,(unsigned char*)buf,len);
     } else {
         serverAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
         return rdbSaveRawString(rdb,obj->ptr,sdslen(obj->ptr));
@@ -497,7 +549,8 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_LZ4:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",len);
             return NULL; /* Never reached. */
@@ -628,9 +681,14 @@ int rdbLoadBinaryFloatValue(rio *rdb, float *val) {
 
 /* Save the object type of object "o". */
 int rdbSaveObjectType(rio *rdb, robj *o) {
+    if (o->encoding == OBJ_ENCODING_SWAPPED)
+        return rdbSaveType(rdb,((tieredValue*)o->ptr)->rdbtype);
     switch (o->type) {
     case OBJ_STRING:
-        return rdbSaveType(rdb,RDB_TYPE_STRING);
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            return rdbSaveType(rdb,RDB_TYPE_STRING_ROARING);
+        else
+            return rdbSaveType(rdb,RDB_TYPE_STRING);
     case OBJ_LIST:
         if (o->encoding == OBJ_ENCODING_QUICKLIST)
             return rdbSaveType(rdb,RDB_TYPE_LIST_QUICKLIST);
@@ -639,26 +697,28 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_SET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_SKIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
             serverPanic("Unknown hash encoding");
     case OBJ_STREAM:
-        return rdbSaveType(rdb,RDB_TYPE_STREAM_LISTPACKS);
+        return rdbSaveType(rdb,RDB_TYPE_STREAM_LISTPACKS_3);
     case OBJ_MODULE:
         return rdbSaveType(rdb,RDB_TYPE_MODULE_2);
     default:
@@ -759,7 +819,44 @@ size_t rdbSaveStreamConsumers(rio *rdb, streamCG *cg) {
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
     ssize_t n = 0, nwritten = 0;
 
-    if (o->type == OBJ_STRING) {
+    if (o->encoding == OBJ_ENCODING_SWAPPED) {
+        /* The value in the tiered storage is already serialized. */
+        return tieredSaveValue(rdb,o);
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Save a roaring bitmap: the length of the string, then every
+         * container as key, cardinality, and data. */
+        roaring *r = o->ptr;
+        uint32_t j;
+
+        if ((n = rdbSaveLen(rdb,r->len)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,r->count)) == -1) return -1;
+        nwritten += n;
+        for (j = 0; j < r->count; j++) {
+            roaringContainer *rc = r->containers+j;
+            size_t datalen = roaringContainerIsArray(rc) ?
+                             rc->card*sizeof(uint16_t) : ROARING_CHUNK_BYTES;
+            unsigned char *data = rc->data;
+
+            if ((n = rdbSaveLen(rdb,rc->key)) == -1) return -1;
+            nwritten += n;
+            if ((n = rdbSaveLen(rdb,rc->card)) == -1) return -1;
+            nwritten += n;
+#if (BYTE_ORDER == BIG_ENDIAN)
+            /* Arrays are stored little endian. */
+            if (roaringContainerIsArray(rc)) {
+                uint32_t k;
+                data = zmalloc(datalen);
+                memcpy(data,rc->data,datalen);
+                for (k = 0; k < rc->card; k++) memrev16(data+k*2);
+            }
+#endif
+            n = rdbSaveRawString(rdb,data,datalen);
+            if (data != rc->data) zfree(data);
+            if (n == -1) return -1;
+            nwritten += n;
+        }
+    } else if (o->type == OBJ_STRING) {
         /* Save a string value */
         if ((n = rdbSaveStringObject(rdb,o)) == -1) return -1;
         nwritten += n;
@@ -773,11 +870,31 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
             nwritten += n;
 
             while(node) {
-                if (quicklistNodeIsCompressed(node)) {
+                if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
+                } else if (node->encoding == QUICKLIST_NODE_ENCODING_LZ4) {
+                    void *data;
+                    size_t compress_len = quicklistGetLzf(node, &data);
+                    if (rdbSaveCompression == RDB_COMPRESSION_LZ4) {
+                        n = rdbSaveCompressedBlob(rdb,RDB_ENC_LZ4,data,
+                                compress_len,node->sz);
+                    } else {
+                        /* The receiver may not understand LZ4 strings:
+                         * decompress the node and save it the usual way. */
+                        void *zl = zmalloc(node->sz);
+                        if (lz4_decompress(data,compress_len,zl,node->sz) !=
+                            node->sz)
+                        {
+                            serverPanic("Corrupted LZ4 quicklist node");
+                        }
+                        n = rdbSaveRawString(rdb,zl,node->sz);
+                        zfree(zl);
+                    }
+                    if (n == -1) return -1;
+                    nwritten += n;
                 } else {
                     if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
                     nwritten += n;
@@ -814,6 +931,11 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
+
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
         } else {
@@ -821,8 +943,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -857,8 +979,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -929,6 +1051,18 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         nwritten += n;
         if ((n = rdbSaveLen(rdb,s->last_id.seq)) == -1) return -1;
         nwritten += n;
+        /* Save the first entry ID, the max deleted entry ID and the counter
+         * of the entries ever added, used to compute the groups lag. */
+        if ((n = rdbSaveLen(rdb,s->first_id.ms)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,s->first_id.seq)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,s->max_deleted_entry_id.ms)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,s->max_deleted_entry_id.seq)) == -1) return -1;
+        nwritten += n;
+        if ((n = rdbSaveLen(rdb,s->entries_added)) == -1) return -1;
+        nwritten += n;
 
         /* The consumer groups and their clients are part of the stream
          * type, so serialize every consumer group. */
@@ -956,6 +1090,10 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 if ((n = rdbSaveLen(rdb,cg->last_id.seq)) == -1) return -1;
                 nwritten += n;
 
+                /* Save the group's logical reads counter. */
+                if ((n = rdbSaveLen(rdb,cg->entries_read)) == -1) return -1;
+                nwritten += n;
+
                 /* Save the global PEL. */
                 if ((n = rdbSaveStreamPEL(rdb,cg->pel,1)) == -1) return -1;
                 nwritten += n;
@@ -1008,11 +1146,77 @@ size_t rdbSavedObjectLen(robj *o) {
     return len;
 }
 
-/* Save a key-value pair, with expire time, type, key, value.
+/* Save the field expires 'zobj' of an hash, see t_hash.c, as the opcode
+ * RDB_OPCODE_HASH_FIELD_EXPIRES followed by the number of fields, and the
+ * name and the expire time in milliseconds of every field.
+ * On error -1 is returned, otherwise 0. */
+int rdbSaveHashFieldExpires(rio *rdb, robj *zobj) {
+    if (rdbSaveType(rdb,RDB_OPCODE_HASH_FIELD_EXPIRES) == -1) return -1;
+    if (rdbSaveLen(rdb,zsetLength(zobj)) == -1) return -1;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *zl = zobj->ptr, *eptr = lpSeek(zl,0), *sptr;
+
+        while (eptr != NULL) {
+            sds field = lpGetObject(eptr);
+            ssize_t n = rdbSaveRawString(rdb,(unsigned char*)field,
+                                         sdslen(field));
+
+            sdsfree(field);
+            if (n == -1) return -1;
+            sptr = lpNext(zl,eptr);
+            if (rdbSaveMillisecondTime(rdb,zzlGetScore(sptr)) == -1)
+                return -1;
+            eptr = lpNext(zl,sptr);
+        }
+    } else {
+        zskiplistNode *ln = ((zset*)zobj->ptr)->zsl->header->level[0].forward;
+
+        for (; ln != NULL; ln = ln->level[0].forward) {
+            if (rdbSaveRawString(rdb,(unsigned char*)ln->ele,
+                                 sdslen(ln->ele)) == -1) return -1;
+            if (rdbSaveMillisecondTime(rdb,ln->score) == -1) return -1;
+        }
+    }
+    return 0;
+}
+
+/* Load the field expires saved by rdbSaveHashFieldExpires(), after the
+ * opcode. Returns the sorted set of the fields, or NULL on error. */
+robj *rdbLoadHashFieldExpires(rio *rdb, int rdbver) {
+    robj *zobj = createZsetListpackObject();
+    uint64_t len;
+
+    if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto err;
+    while (len--) {
+        int flags = ZADD_NONE;
+        long long when;
+        sds field;
+
+        if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
+            goto err;
+        when = rdbLoadMillisecondTime(rdb,rdbver);
+        if (rioGetReadError(rdb)) {
+            sdsfree(field);
+            goto err;
+        }
+        zsetAdd(zobj,(double)when,field,&flags,NULL);
+        sdsfree(field);
+    }
+    return zobj;
+
+err:
+    decrRefCount(zobj);
+    return NULL;
+}
+
+/* Save a key-value pair, with expire time, type, key, value, and the field
+ * expires 'fexpires' of an hash if not NULL.
  * On error -1 is returned.
  * On success if the key was actually saved 1 is returned, otherwise 0
  * is returned (the key was already expired). */
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
+int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime,
+                        robj *fexpires)
+{
     int savelru = server.maxmemory_policy & MAXMEMORY_FLAG_LRU;
     int savelfu = server.maxmemory_policy & MAXMEMORY_FLAG_LFU;
 
@@ -1022,6 +1226,9 @@ int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime) {
         if (rdbSaveMillisecondTime(rdb,expiretime) == -1) return -1;
     }
 
+    /* Save the field expires. */
+    if (fexpires && rdbSaveHashFieldExpires(rdb,fexpires) == -1) return -1;
+
     /* Save the LRU info. */
     if (savelru) {
         uint64_t idletime = estimateObjectIdleTime(val);
@@ -1142,6 +1349,217 @@ ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt) {
     return io.bytes;
 }
 
+/* ----------------------------------------------------------------------------
+ * Threads pool used to serialize values while saving, and to decode them
+ * while loading.
+ *
+ * The thread calling rdbSaveRio() or rdbLoadRio() submits batches of work,
+ * that the threads process with the 'process' callback of the pool. The
+ * processed batches are returned by rdbThreadPoolNext() in the same order
+ * they were submitted, so that the caller can write or add them to the
+ * keyspace as if they were processed sequentially.
+ * --------------------------------------------------------------------------*/
+
+typedef struct rdbThreadPool {
+    int num;                    /* Number of threads, 0 if not started. */
+    pthread_t *tids;
+    pthread_mutex_t lock;
+    pthread_cond_t todo_cond;   /* Signaled when a batch is submitted. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is processed. */
+    list *todo;                 /* Tasks waiting for a thread. */
+    list *inflight;             /* Tasks not yet returned, in submit order. */
+    int shutdown;
+    void (*process)(void *batch);
+} rdbThreadPool;
+
+typedef struct rdbThreadTask {
+    void *batch;
+    int done;                   /* Set by the thread once processed. */
+} rdbThreadTask;
+
+static void *rdbThreadPoolMain(void *arg) {
+    rdbThreadPool *pool = arg;
+    sigset_t sigset;
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while (listLength(pool->todo) == 0 && !pool->shutdown)
+            pthread_cond_wait(&pool->todo_cond,&pool->lock);
+        if (listLength(pool->todo) == 0) break;
+
+        listNode *ln = listFirst(pool->todo);
+        rdbThreadTask *task = listNodeValue(ln);
+        listDelNode(pool->todo,ln);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->process(task->batch);
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = 1;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void rdbThreadPoolStart(rdbThreadPool *pool, int num,
+                               void (*process)(void *batch))
+{
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->todo_cond,NULL);
+    pthread_cond_init(&pool->done_cond,NULL);
+    pool->todo = listCreate();
+    pool->inflight = listCreate();
+    pool->shutdown = 0;
+    pool->process = process;
+    pool->num = num;
+    pool->tids = zmalloc(sizeof(pthread_t)*num);
+    for (int j = 0; j < num; j++) {
+        if (pthread_create(&pool->tids[j],NULL,rdbThreadPoolMain,pool) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize RDB thread.");
+            exit(1);
+        }
+    }
+}
+
+/* Stop the threads. All the submitted batches must be already returned. */
+static void rdbThreadPoolStop(rdbThreadPool *pool) {
+    if (pool->num == 0) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int j = 0; j < pool->num; j++)
+        pthread_join(pool->tids[j],NULL);
+
+    zfree(pool->tids);
+    listRelease(pool->todo);
+    listRelease(pool->inflight);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->todo_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pool->num = 0;
+}
+
+static void rdbThreadPoolSubmit(rdbThreadPool *pool, void *batch) {
+    rdbThreadTask *task = zmalloc(sizeof(*task));
+
+    task->batch = batch;
+    task->done = 0;
+    pthread_mutex_lock(&pool->lock);
+    listAddNodeTail(pool->todo,task);
+    listAddNodeTail(pool->inflight,task);
+    pthread_cond_signal(&pool->todo_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Return the oldest submitted batch if it was already processed, waiting
+ * for it while more than 'maxinflight' batches are in flight. NULL is
+ * returned if there are no batches to return without waiting. */
+static void *rdbThreadPoolNext(rdbThreadPool *pool, unsigned long maxinflight) {
+    void *batch = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while (listLength(pool->inflight)) {
+        listNode *ln = listFirst(pool->inflight);
+        rdbThreadTask *task = listNodeValue(ln);
+
+        if (task->done) {
+            batch = task->batch;
+            listDelNode(pool->inflight,ln);
+            zfree(task);
+            break;
+        }
+        if (listLength(pool->inflight) <= maxinflight) break;
+        pthread_cond_wait(&pool->done_cond,&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return batch;
+}
+
+/* When "rdb-save-threads" is greater than one, the keys are not serialized
+ * by the thread iterating the keyspace: it collects them in batches, that
+ * the threads pool serializes and compresses into a buffer. The buffers are
+ * written in the same order, so the output is a normal RDB file, that any
+ * Redis version is able to load. Module values are serialized directly by
+ * the iterating thread, since the module API is not thread safe: this only
+ * changes their position in the file, that is not relevant. */
+#define RDB_SAVE_BATCH_KEYS 128          /* Max keys per batch. */
+#define RDB_SAVE_BATCHES_PER_THREAD 4    /* Max batches in flight per thread. */
+
+typedef struct rdbSaveEntry {
+    sds key;
+    robj *val;
+    long long expire;
+    robj *fexpires;
+} rdbSaveEntry;
+
+typedef struct rdbSaveBatch {
+    rdbSaveEntry entries[RDB_SAVE_BATCH_KEYS];
+    int len;
+    int checksum;           /* True to compute the checksum of the payload. */
+    sds payload;            /* Serialized entries. */
+    uint64_t cksum;         /* CRC64 of the payload, starting from zero. */
+} rdbSaveBatch;
+
+static rdbThreadPool rdbSavePool;
+
+/* Threads pool callback: serialize the entries of the batch. */
+static void rdbSaveProcessBatch(void *ptr) {
+    rdbSaveBatch *batch = ptr;
+    rio payload;
+
+    rioInitWithBuffer(&payload,sdsempty());
+    for (int j = 0; j < batch->len; j++) {
+        rdbSaveEntry *e = batch->entries+j;
+        robj key;
+
+        initStaticStringObject(key,e->key);
+        rdbSaveKeyValuePair(&payload,&key,e->val,e->expire,e->fexpires);
+    }
+    batch->payload = payload.io.buffer.ptr;
+    if (batch->checksum)
+        batch->cksum = crc64(0,(unsigned char*)batch->payload,
+                             sdslen(batch->payload));
+}
+
+/* Write to 'rdb' the batches already serialized, in submit order, waiting
+ * for them while more than 'maxinflight' batches are in flight. All the
+ * returned batches are released even after a write error, that is
+ * reported returning -1.
+ *
+ * The checksum of the payloads is computed by the threads too, the one of
+ * the file is just combined with it, instead of being updated by rio. */
+static int rdbSaveWriteBatches(rio *rdb, unsigned long maxinflight) {
+    rdbSaveBatch *batch;
+    int retval = 0;
+
+    while ((batch = rdbThreadPoolNext(&rdbSavePool,maxinflight)) != NULL) {
+        size_t len = sdslen(batch->payload);
+
+        if (retval == 0) {
+            void (*update_cksum)(struct _rio *, const void *, size_t) =
+                rdb->update_cksum;
+
+            if (batch->checksum) rdb->update_cksum = NULL;
+            if (rdbWriteRaw(rdb,batch->payload,len) == -1) retval = -1;
+            rdb->update_cksum = update_cksum;
+            if (batch->checksum)
+                rdb->cksum = crc64_combine(rdb->cksum,batch->cksum,len);
+        }
+        sdsfree(batch->payload);
+        zfree(batch);
+    }
+    return retval;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1157,7 +1575,15 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     int j;
     uint64_t cksum;
     size_t processed = 0;
-
+    rdbSaveBatch *batch = NULL;
+    unsigned long maxinflight =
+        (unsigned long) server.rdb_save_threads*RDB_SAVE_BATCHES_PER_THREAD;
+
+    rdbSaveCompression = (rsi && rsi->rdb_compression != -1) ?
+        rsi->rdb_compression : server.rdb_compression_algorithm;
+    if (server.rdb_save_threads > 1)
+        rdbThreadPoolStart(&rdbSavePool,server.rdb_save_threads,
+                           rdbSaveProcessBatch);
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
     snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
@@ -1181,7 +1607,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
          * these sizes are just hints to resize the hash tables. */
         uint64_t db_size, expires_size;
         db_size = dictSize(db->dict);
-        expires_size = dictSize(db->expires);
+        expires_size = expireIndexSize(db->expires);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
@@ -1189,12 +1615,34 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         /* Iterate this DB writing every entry */
         while((de = dictNext(di)) != NULL) {
             sds keystr = dictGetKey(de);
-            robj key, *o = dictGetVal(de);
+            robj key, *o = dictGetVal(de), *fexpires;
             long long expire;
 
-            initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
-            if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
+            expire = dbEntryGetExpire(db,de);
+            fexpires = o->type == OBJ_HASH ?
+                       hashFieldExpiresGet(db,keystr) : NULL;
+            if (rdbSavePool.num && o->type != OBJ_MODULE) {
+                if (batch == NULL) {
+                    batch = zmalloc(sizeof(*batch));
+                    batch->len = 0;
+                    batch->checksum =
+                        rdb->update_cksum == rioGenericUpdateChecksum;
+                }
+                batch->entries[batch->len].key = keystr;
+                batch->entries[batch->len].val = o;
+                batch->entries[batch->len].expire = expire;
+                batch->entries[batch->len].fexpires = fexpires;
+                if (++batch->len == RDB_SAVE_BATCH_KEYS) {
+                    rdbThreadPoolSubmit(&rdbSavePool,batch);
+                    batch = NULL;
+                    if (rdbSaveWriteBatches(rdb,maxinflight) == -1)
+                        goto werr;
+                }
+            } else {
+                initStaticStringObject(key,keystr);
+                if (rdbSaveKeyValuePair(rdb,&key,o,expire,fexpires) == -1)
+                    goto werr;
+            }
 
             /* When this RDB is produced as part of an AOF rewrite, move
              * accumulated diff from parent to child while rewriting in
@@ -1208,13 +1656,24 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         }
         dictReleaseIterator(di);
         di = NULL; /* So that we don't release it again on error. */
+
+        /* The keys of this DB must be written before selecting the next
+         * one. */
+        if (batch) {
+            rdbThreadPoolSubmit(&rdbSavePool,batch);
+            batch = NULL;
+        }
+        if (rdbSavePool.num && rdbSaveWriteBatches(rdb,0) == -1) goto werr;
     }
+    rdbThreadPoolStop(&rdbSavePool);
 
     /* If we are storing the replication information on disk, persist
      * the script cache as well: on successful PSYNC after a restart, we need
      * to be able to process any EVALSHA inside the replication backlog the
-     * master will send us. */
-    if (rsi && dictSize(server.lua_scripts)) {
+     * master will send us. Unless rdb-save-scripts is disabled the cache is
+     * saved in every case, so that clients can keep using EVALSHA after a
+     * restart without having to load all their scripts again. */
+    if ((rsi || server.rdb_save_scripts) && dictSize(server.lua_scripts)) {
         di = dictGetIterator(server.lua_scripts);
         while((de = dictNext(di)) != NULL) {
             robj *body = dictGetVal(de);
@@ -1235,11 +1694,18 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     cksum = rdb->cksum;
     memrev64ifbe(&cksum);
     if (rioWrite(rdb,&cksum,8) == 0) goto werr;
+    rdbSaveCompression = RDB_COMPRESSION_LZF;
     return C_OK;
 
 werr:
     if (error) *error = errno;
     if (di) dictReleaseIterator(di);
+    if (rdbSavePool.num) {
+        if (batch) rdbThreadPoolSubmit(&rdbSavePool,batch);
+        rdbSaveWriteBatches(NULL,0);
+        rdbThreadPoolStop(&rdbSavePool);
+    }
+    rdbSaveCompression = RDB_COMPRESSION_LZF;
     return C_ERR;
 }
 
@@ -1279,6 +1745,9 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     FILE *fp;
     rio rdb;
     int error = 0;
+    /* Called by the saving child too: the parent tracks the base of the
+     * delta snapshots when the child terminates. */
+    int parent = getpid() == server.pid;
 
     snprintf(tmpfile,256,"temp-%d.rdb", (int) getpid());
     fp = fopen(tmpfile,"w");
@@ -1295,6 +1764,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
 
     rioInitWithFile(&rdb,fp);
     startSaving(RDBFLAGS_NONE);
+    if (parent) rdbDeltaFullSaveStart();
 
     if (server.rdb_save_incremental_fsync)
         rioSetAutoSync(&rdb,REDIS_AUTOSYNC_BYTES);
@@ -1322,6 +1792,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
             strerror(errno));
         unlink(tmpfile);
         stopSaving(0);
+        if (parent) rdbDeltaFullSaveDone(0);
         return C_ERR;
     }
 
@@ -1330,6 +1801,7 @@ int rdbSave(char *filename, rdbSaveInfo *rsi) {
     server.lastsave = time(NULL);
     server.lastbgsave_status = C_OK;
     stopSaving(1);
+    if (parent) rdbDeltaFullSaveDone(1);
     return C_OK;
 
 werr:
@@ -1337,13 +1809,14 @@ werr:
     fclose(fp);
     unlink(tmpfile);
     stopSaving(0);
+    if (parent) rdbDeltaFullSaveDone(0);
     return C_ERR;
 }
 
 int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     pid_t childpid;
 
-    if (hasActiveChildProcess()) return C_ERR;
+    if (hasActiveChildProcess() || server.rdb_forkless) return C_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
@@ -1354,6 +1827,7 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
 
         /* Child */
         redisSetProcTitle("redis-rdb-bgsave");
+        redisSetCpuAffinity(server.bgsave_cpulist);
         retval = rdbSave(filename,rsi);
         if (retval == C_OK) {
             sendChildCOWInfo(CHILD_INFO_TYPE_RDB, "RDB");
@@ -1372,16 +1846,354 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
         server.rdb_save_time_start = time(NULL);
         server.rdb_child_pid = childpid;
         server.rdb_child_type = RDB_CHILD_TYPE_DISK;
+        rdbDeltaFullSaveStart();
         return C_OK;
     }
     return C_OK; /* unreached */
 }
 
-void rdbRemoveTempFile(pid_t childpid) {
+/* Remove the temp file of the child 'childpid'. The file may be big, so it
+ * is released in background, unless we are called from a signal handler. */
+void rdbRemoveTempFile(pid_t childpid, int from_signal) {
     char tmpfile[256];
 
     snprintf(tmpfile,sizeof(tmpfile),"temp-%d.rdb", (int) childpid);
-    unlink(tmpfile);
+    if (from_signal)
+        unlink(tmpfile);
+    else
+        bioUnlinkFile(tmpfile);
+}
+
+/* Start a background save for persistence, that is, a BGSAVE or a save
+ * point: without forking if rdb-forkless-save is enabled, otherwise like
+ * rdbSaveBackground(). Saves for replication always fork, since replicas
+ * are served the output of the saving child. */
+int rdbSaveBackgroundForPersistence(char *filename, rdbSaveInfo *rsi) {
+    if (server.rdb_forkless_save) return rdbForklessSaveStart(filename,rsi);
+    return rdbSaveBackground(filename,rsi);
+}
+
+/* -----------------------------------------------------------------------------
+ * Fork-less saving
+ *
+ * With rdb-forkless-save enabled BGSAVE doesn't fork: the main thread scans
+ * the keyspace incrementally, from a timer event, writing every key to the
+ * temp file a slice of time at a time. The result is still a snapshot of the
+ * data set at the time the save started, because keys are written before
+ * they can change:
+ *
+ * - The keyMeta of every key holds the epoch of the last save that wrote
+ *   it. Starting a save increments server.rdb_forkless_epoch, and keys
+ *   with a different epoch are pending.
+ * - Pending keys are written, and their epoch updated, as soon as they are
+ *   accessed, overwritten, deleted or their expire is changed: this is the
+ *   only copy on write left. New keys get the current epoch, so they are
+ *   not part of the snapshot.
+ * - Before a DB is flushed or swapped all its pending keys are written.
+ *
+ * The scan uses dictScan(), that returns at least once every entry that
+ * exists for the whole scan: entries returned more than once are skipped
+ * since they already have the current epoch, and the deleted ones were
+ * written before the deletion. Keys written on access belong to any DB,
+ * so a SELECTDB opcode is emitted every time the DB changes.
+ *
+ * Keys store 16 bits of the epoch. A successful save leaves all the keys
+ * with its epoch, so it can't be confused with the next ones, however
+ * after RDB_FORKLESS_MAX_ABORTED aborted saves in a row the epochs of the
+ * keys are reset before starting a new save. */
+
+#define RDB_FORKLESS_EPOCH_MASK 0xffff
+#define RDB_FORKLESS_MAX_ABORTED RDB_FORKLESS_EPOCH_MASK
+#define RDB_FORKLESS_SLICE_US 1000  /* Time spent scanning every period. */
+#define RDB_FORKLESS_PERIOD_MS 1    /* Time left to clients between slices.*/
+
+typedef struct rdbForkless {
+    FILE *fp;
+    rio rdb;
+    char tmpfile[256];
+    sds filename;               /* Final name of the RDB file. */
+    int has_rsi;                /* Was a rdbSaveInfo provided? */
+    int compression;            /* RDB_COMPRESSION_* of this save. */
+    int dbid;                   /* DB being scanned. */
+    unsigned long cursor;       /* dictScan() cursor inside 'dbid'. */
+    int selected;               /* DB of the last SELECTDB opcode, or -1. */
+    int failed;                 /* A write failed. */
+    long long timer_id;
+    unsigned long long copied;  /* Keys written on access. */
+} rdbForkless;
+
+/* Write the key at 'de' in 'db', if still pending. */
+static void rdbForklessWriteEntry(rdbForkless *fl, redisDb *db,
+                                  dictEntry *de)
+{
+    keyMeta *meta = dbKeyMeta(db,de);
+    robj key;
+    int oldcompression = rdbSaveCompression;
+
+    if (meta->snapshot_epoch == server.rdb_forkless_epoch) return;
+    meta->snapshot_epoch = server.rdb_forkless_epoch;
+    if (fl->failed) return;
+
+    rdbSaveCompression = fl->compression;
+    if (fl->selected != db->id) {
+        if (rdbSaveType(&fl->rdb,RDB_OPCODE_SELECTDB) == -1 ||
+            rdbSaveLen(&fl->rdb,db->id) == -1) fl->failed = 1;
+        fl->selected = db->id;
+    }
+    initStaticStringObject(key,dictGetKey(de));
+    if (!fl->failed &&
+        rdbSaveKeyValuePair(&fl->rdb,&key,dictGetVal(de),
+                            dbEntryGetExpire(db,de),
+                            hashFieldExpiresGet(db,key.ptr)) == -1)
+        fl->failed = 1;
+    rdbSaveCompression = oldcompression;
+}
+
+/* Called before the key at 'de' is accessed or modified while a fork-less
+ * save is in progress: writes the key if it was not written yet. */
+void rdbForklessSaveEntry(redisDb *db, dictEntry *de) {
+    rdbForkless *fl = server.rdb_forkless;
+
+    if (dbKeyMeta(db,de)->snapshot_epoch == server.rdb_forkless_epoch)
+        return;
+    rdbForklessWriteEntry(fl,db,de);
+    fl->copied++;
+}
+
+static void rdbForklessScanCallback(void *privdata, const dictEntry *de) {
+    rdbForklessWriteEntry(server.rdb_forkless,privdata,(dictEntry*)de);
+}
+
+/* Write all the pending keys of the DB 'dbid'. */
+void rdbForklessSaveDb(int dbid) {
+    redisDb *db = server.db+dbid;
+    unsigned long cursor = 0;
+
+    do {
+        cursor = dictScan(db->dict,cursor,rdbForklessScanCallback,NULL,db);
+    } while (cursor);
+}
+
+/* Scan the keyspace for at most 'us' microseconds. Returns 1 once all the
+ * keys were scanned, otherwise 0. */
+static int rdbForklessSaveStep(rdbForkless *fl, long long us) {
+    long long start = ustime();
+
+    while (fl->dbid < server.dbnum && !fl->failed) {
+        redisDb *db = server.db+fl->dbid;
+
+        if (fl->cursor == 0 && dictSize(db->dict) != 0) {
+            /* As in rdbSaveRio(), start every DB with a resize hint. */
+            if (rdbSaveType(&fl->rdb,RDB_OPCODE_SELECTDB) == -1 ||
+                rdbSaveLen(&fl->rdb,fl->dbid) == -1 ||
+                rdbSaveType(&fl->rdb,RDB_OPCODE_RESIZEDB) == -1 ||
+                rdbSaveLen(&fl->rdb,dictSize(db->dict)) == -1 ||
+                rdbSaveLen(&fl->rdb,expireIndexSize(db->expires)) == -1)
+            {
+                fl->failed = 1;
+                break;
+            }
+            fl->selected = fl->dbid;
+        }
+        if (dictSize(db->dict) != 0)
+            fl->cursor = dictScan(db->dict,fl->cursor,
+                                  rdbForklessScanCallback,NULL,db);
+        if (fl->cursor == 0) fl->dbid++;
+        if (ustime()-start >= us) break;
+    }
+    return fl->dbid == server.dbnum || fl->failed;
+}
+
+/* Release the fork-less save state, removing the temp file if 'unlinktmp'
+ * is true. */
+static void rdbForklessFree(rdbForkless *fl, int unlinktmp) {
+    if (fl->fp) fclose(fl->fp);
+    if (unlinktmp) bioUnlinkFile(fl->tmpfile);
+    sdsfree(fl->filename);
+    zfree(fl);
+    server.rdb_forkless = NULL;
+}
+
+/* Write what follows the keys, and move the file in place. */
+static int rdbForklessSaveEnd(rdbForkless *fl) {
+    rio *rdb = &fl->rdb;
+    uint64_t cksum;
+    int oldcompression = rdbSaveCompression;
+
+    if (fl->failed) goto werr;
+    rdbSaveCompression = fl->compression;
+    if ((fl->has_rsi || server.rdb_save_scripts) &&
+        dictSize(server.lua_scripts))
+    {
+        dictIterator *di = dictGetIterator(server.lua_scripts);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr)) == -1)
+                break;
+        }
+        dictReleaseIterator(di);
+        if (de) goto werr;
+    }
+    if (rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) goto werr;
+    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) goto werr;
+    rdbSaveCompression = oldcompression;
+
+    if (fflush(fl->fp) == EOF) goto werr;
+    if (fsync(fileno(fl->fp)) == -1) goto werr;
+    if (fclose(fl->fp) == EOF) {
+        fl->fp = NULL;
+        goto werr;
+    }
+    fl->fp = NULL;
+    if (bioRenameFile(fl->tmpfile,fl->filename) == -1) goto werr;
+    return C_OK;
+
+werr:
+    rdbSaveCompression = oldcompression;
+    return C_ERR;
+}
+
+static int rdbForklessTimeProc(struct aeEventLoop *eventLoop, long long id,
+                               void *clientData)
+{
+    rdbForkless *fl = server.rdb_forkless;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    if (!rdbForklessSaveStep(fl,RDB_FORKLESS_SLICE_US))
+        return RDB_FORKLESS_PERIOD_MS;
+
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+
+    if (rdbForklessSaveEnd(fl) == C_OK) {
+        serverLog(LL_NOTICE,
+            "Fork-less background saving terminated with success "
+            "(%llu keys written on access)", fl->copied);
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+        server.rdb_forkless_aborted = 0;
+        server.stat_rdb_forkless_copied = fl->copied;
+        rdbForklessFree(fl,0);
+        stopSaving(1);
+        rdbDeltaFullSaveDone(1);
+    } else {
+        serverLog(LL_WARNING,"Fork-less background saving error: %s",
+            strerror(errno));
+        server.lastbgsave_status = C_ERR;
+        server.rdb_forkless_aborted++;
+        rdbForklessFree(fl,1);
+        stopSaving(0);
+        rdbDeltaFullSaveDone(0);
+    }
+    return AE_NOMORE;
+}
+
+/* Set the epoch of all the keys to the current one. */
+static void rdbForklessResetEpochs(void) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dictIterator *di = dictGetIterator(db->dict);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL)
+            dbKeyMeta(db,de)->snapshot_epoch = server.rdb_forkless_epoch;
+        dictReleaseIterator(di);
+    }
+    server.rdb_forkless_aborted = 0;
+}
+
+/* Start a fork-less background save to 'filename'. */
+int rdbForklessSaveStart(char *filename, rdbSaveInfo *rsi) {
+    char cwd[MAXPATHLEN];
+    rdbForkless *fl;
+    char magic[10];
+
+    if (hasActiveChildProcess() || server.rdb_forkless) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    fl = zcalloc(sizeof(*fl));
+    snprintf(fl->tmpfile,sizeof(fl->tmpfile),"temp-forkless-%d.rdb",
+        (int) getpid());
+    fl->fp = fopen(fl->tmpfile,"w");
+    if (!fl->fp) {
+        char *cwdp = getcwd(cwd,MAXPATHLEN);
+        serverLog(LL_WARNING,
+            "Failed opening the RDB file %s (in server root dir %s) "
+            "for saving: %s",
+            filename,
+            cwdp ? cwdp : "unknown",
+            strerror(errno));
+        zfree(fl);
+        server.lastbgsave_status = C_ERR;
+        return C_ERR;
+    }
+    fl->filename = sdsnew(filename);
+    fl->has_rsi = rsi != NULL;
+    fl->compression = (rsi && rsi->rdb_compression != -1) ?
+        rsi->rdb_compression : server.rdb_compression_algorithm;
+    fl->selected = -1;
+    rioInitWithFile(&fl->rdb,fl->fp);
+    /* The data is written by the main thread: never fsync it all at once. */
+    rioSetAutoSync(&fl->rdb,REDIS_AUTOSYNC_BYTES);
+    if (server.rdb_checksum)
+        fl->rdb.update_cksum = rioGenericUpdateChecksum;
+
+    if (server.rdb_forkless_aborted >= RDB_FORKLESS_MAX_ABORTED)
+        rdbForklessResetEpochs();
+    server.rdb_forkless_epoch =
+        (server.rdb_forkless_epoch+1) & RDB_FORKLESS_EPOCH_MASK;
+    server.rdb_forkless = fl;
+
+    moduleFireServerEvent(REDISMODULE_EVENT_PERSISTENCE,
+                          REDISMODULE_SUBEVENT_PERSISTENCE_RDB_START,
+                          NULL);
+    rdbSaveCompression = fl->compression;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(&fl->rdb,magic,9) == -1 ||
+        rdbSaveInfoAuxFields(&fl->rdb,RDBFLAGS_NONE,rsi) == -1 ||
+        rdbSaveModulesAux(&fl->rdb,REDISMODULE_AUX_BEFORE_RDB) == -1)
+    {
+        rdbSaveCompression = RDB_COMPRESSION_LZF;
+        serverLog(LL_WARNING,"Write error saving DB on disk: %s",
+            strerror(errno));
+        server.lastbgsave_status = C_ERR;
+        server.rdb_forkless_aborted++;
+        rdbForklessFree(fl,1);
+        stopSaving(0);
+        return C_ERR;
+    }
+    rdbSaveCompression = RDB_COMPRESSION_LZF;
+
+    fl->timer_id = aeCreateTimeEvent(server.el,RDB_FORKLESS_PERIOD_MS,
+                                     rdbForklessTimeProc,NULL,NULL);
+    server.rdb_save_time_start = time(NULL);
+    rdbDeltaFullSaveStart();
+    serverLog(LL_NOTICE,"Fork-less background saving started");
+    return C_OK;
+}
+
+/* Stop the fork-less save in progress removing its temp file, like
+ * killRDBChild() does for the saving child. */
+void rdbForklessSaveAbort(void) {
+    rdbForkless *fl = server.rdb_forkless;
+
+    aeDeleteTimeEvent(server.el,fl->timer_id);
+    server.rdb_forkless_aborted++;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+    rdbForklessFree(fl,1);
+    stopSaving(0);
+    rdbDeltaFullSaveDone(0);
 }
 
 /* This function is called by rdbLoadObject() when the code is in RDB-check
@@ -1423,6 +2235,28 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Convert the ziplist 'zl' of a small hash or sorted set saved by an older
+ * version into a listpack with the same elements. The ziplist is freed. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew(), *p = ziplistIndex(zl,0);
+    unsigned char *vstr, buf[LONG_STR_SIZE];
+    unsigned int vlen;
+    long long vll;
+
+    while (p) {
+        if (!ziplistGet(p,&vstr,&vlen,&vll))
+            rdbExitReportCorruptRDB("Ziplist corruption detected");
+        if (vstr == NULL) {
+            vlen = ll2string((char*)buf,sizeof(buf),vll);
+            vstr = buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
@@ -1434,6 +2268,41 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         /* Read string value */
         if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
         o = tryObjectEncoding(o);
+    } else if (rdbtype == RDB_TYPE_STRING_ROARING) {
+        /* Read roaring bitmap value */
+        uint64_t count, key, card;
+        roaring *r;
+
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if ((count = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
+        if (len > 512*1024*1024 || count > len/ROARING_CHUNK_BYTES+1)
+            rdbExitReportCorruptRDB("Roaring bitmap of invalid size");
+        r = roaringNew(len);
+        o = createObject(OBJ_STRING,r);
+        o->encoding = OBJ_ENCODING_ROARING;
+        while (count--) {
+            unsigned char *data;
+            size_t datalen;
+
+            if ((key = rdbLoadLen(rdb,NULL)) == RDB_LENERR ||
+                (card = rdbLoadLen(rdb,NULL)) == RDB_LENERR ||
+                (data = rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,
+                                                   &datalen)) == NULL)
+            {
+                decrRefCount(o);
+                return NULL;
+            }
+#if (BYTE_ORDER == BIG_ENDIAN)
+            if (card <= ROARING_ARRAY_MAX && datalen == card*2) {
+                uint64_t k;
+                for (k = 0; k < card; k++) memrev16(data+k*2);
+            }
+#endif
+            if (key > UINT32_MAX || card > UINT32_MAX ||
+                !roaringAppendContainer(r,key,card,data,datalen))
+                rdbExitReportCorruptRDB("Roaring bitmap container corruption "
+                                        "detected");
+        }
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1478,15 +2347,25 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
                     o->ptr = intsetAdd(o->ptr,llval,NULL);
+                } else if (len <= server.set_max_listpack_entries &&
+                           sdslen(sdsele) <= server.set_max_listpack_value)
+                {
+                    setTypeConvert(o,OBJ_ENCODING_LISTPACK);
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
                 }
             }
 
+            /* Small sets of strings are loaded as listpacks, that get
+             * converted to hash tables by setTypeAdd() as needed. */
+            if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                setTypeAdd(o,sdsele);
+                if (o->encoding == OBJ_ENCODING_HT) dictExpand(o->ptr,len);
+                sdsfree(sdsele);
             /* This will also be called when the set was just converted
              * to a regular hash table encoded set. */
-            if (o->encoding == OBJ_ENCODING_HT) {
+            } else if (o->encoding == OBJ_ENCODING_HT) {
                 dictAdd((dict*)o->ptr,sdsele,NULL);
             } else {
                 sdsfree(sdsele);
@@ -1524,13 +2403,14 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
             znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            dictAdd(zs->dict,znode->ele,&znode->score);
+            sdsfree(sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+        if (zsetLength(o) <= server.zset_max_listpack_entries &&
+            maxelelen <= server.zset_max_listpack_value)
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1542,11 +2422,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         o = createHashObject();
 
         /* Too many entries? Use a hash table. */
-        if (len > server.hash_max_ziplist_entries)
+        if (len > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
@@ -1554,15 +2434,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
             if ((value = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
-            if (sdslen(field) > server.hash_max_ziplist_value ||
-                sdslen(value) > server.hash_max_ziplist_value)
+            if (sdslen(field) > server.hash_max_listpack_value ||
+                sdslen(value) > server.hash_max_listpack_value)
             {
                 sdsfree(field);
                 sdsfree(value);
@@ -1610,7 +2488,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK ||
+               rdbtype == RDB_TYPE_SET_LISTPACK)
     {
         unsigned char *encoded =
             rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
@@ -1625,10 +2506,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1637,17 +2518,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
-                    if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
-                        maxlen > server.hash_max_ziplist_value)
+                    if (hashTypeLength(o) > server.hash_max_listpack_entries ||
+                        maxlen > server.hash_max_listpack_value)
                     {
                         hashTypeConvert(o, OBJ_ENCODING_HT);
                     }
@@ -1664,16 +2545,30 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
+            case RDB_TYPE_SET_LISTPACK:
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (setTypeSize(o) > server.set_max_listpack_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                /* Sorted sets saved by older versions are ziplists. */
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (zsetLength(o) > server.zset_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (zsetLength(o) > server.zset_max_listpack_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                /* Hashes saved by older versions are ziplists. */
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (hashTypeLength(o) > server.hash_max_listpack_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
             default:
@@ -1681,7 +2576,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
                 break;
         }
-    } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS) {
+    } else if (rdbtype == RDB_TYPE_STREAM_LISTPACKS ||
+               rdbtype == RDB_TYPE_STREAM_LISTPACKS_2 ||
+               rdbtype == RDB_TYPE_STREAM_LISTPACKS_3)
+    {
+        /* The listpacks of the first version just have no entry with
+         * coded values. */
         o = createStreamObject();
         stream *s = o->ptr;
         uint64_t listpacks = rdbLoadLen(rdb,NULL);
@@ -1737,6 +2637,30 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
         s->last_id.ms = rdbLoadLen(rdb,NULL);
         s->last_id.seq = rdbLoadLen(rdb,NULL);
 
+        if (rdbtype == RDB_TYPE_STREAM_LISTPACKS_3) {
+            /* Load the first entry ID. */
+            s->first_id.ms = rdbLoadLen(rdb,NULL);
+            s->first_id.seq = rdbLoadLen(rdb,NULL);
+
+            /* Load the maximal deleted entry ID. */
+            s->max_deleted_entry_id.ms = rdbLoadLen(rdb,NULL);
+            s->max_deleted_entry_id.seq = rdbLoadLen(rdb,NULL);
+
+            /* Load the offset. */
+            s->entries_added = rdbLoadLen(rdb,NULL);
+        } else {
+            /* During migration the offset can be initialized to the stream's
+             * length. At this point, we also don't care about tombstones
+             * because CG offsets will be later initialized as well. */
+            s->max_deleted_entry_id.ms = 0;
+            s->max_deleted_entry_id.seq = 0;
+            s->entries_added = s->length;
+
+            /* Since the rax is already loaded, we can find the first entry's
+             * ID. */
+            streamGetEdgeID(s,1,&s->first_id);
+        }
+
         if (rioGetReadError(rdb)) {
             rdbReportReadError("Stream object metadata loading failed.");
             decrRefCount(o);
@@ -1772,7 +2696,22 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 return NULL;
             }
 
-            streamCG *cgroup = streamCreateCG(s,cgname,sdslen(cgname),&cg_id);
+            /* Load group offset. */
+            long long cg_offset;
+            if (rdbtype == RDB_TYPE_STREAM_LISTPACKS_3) {
+                cg_offset = rdbLoadLen(rdb,NULL);
+                if (rioGetReadError(rdb)) {
+                    rdbReportReadError("Stream cgroup offset loading failed.");
+                    sdsfree(cgname);
+                    decrRefCount(o);
+                    return NULL;
+                }
+            } else {
+                cg_offset = streamEstimateDistanceFromFirstEverEntry(s,&cg_id);
+            }
+
+            streamCG *cgroup = streamCreateCG(s,cgname,sdslen(cgname),&cg_id,
+                                              cg_offset);
             if (cgroup == NULL)
                 rdbExitReportCorruptRDB("Duplicated consumer group name %s",
                                          cgname);
@@ -1808,6 +2747,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
                 if (!raxInsert(cgroup->pel,rawid,sizeof(rawid),nack,NULL))
                     rdbExitReportCorruptRDB("Duplicated gobal PEL entry "
                                             "loading stream consumer group");
+                streamIndexNACK(cgroup,rawid,nack);
             }
 
             /* Now that we loaded our global PEL, we need to load the
@@ -1924,10 +2864,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, robj *key) {
 }
 
 /* Mark that we are loading in the global state and setup the fields
- * needed to provide loading stats. */
-void startLoading(size_t size, int rdbflags) {
+ * needed to provide loading stats. When 'async' is true the data set is
+ * loaded in the background while the current one is still served, so
+ * we don't enter the loading state, see REPL_DISKLESS_LOAD_ASYNC. */
+void startLoading(size_t size, int rdbflags, int async) {
     /* Load the DB */
-    server.loading = 1;
+    if (async)
+        server.async_loading = 1;
+    else
+        server.loading = 1;
     server.loading_start_time = time(NULL);
     server.loading_loaded_bytes = 0;
     server.loading_total_bytes = size;
@@ -1951,7 +2896,7 @@ void startLoadingFile(FILE *fp, char* filename, int rdbflags) {
     if (fstat(fileno(fp), &sb) == -1)
         sb.st_size = 0;
     rdbFileBeingLoaded = filename;
-    startLoading(sb.st_size, rdbflags);
+    startLoading(sb.st_size, rdbflags, 0);
 }
 
 /* Refresh the loading progress info */
@@ -1964,6 +2909,7 @@ void loadingProgress(off_t pos) {
 /* Loading finished */
 void stopLoading(int success) {
     server.loading = 0;
+    server.async_loading = 0;
     rdbFileBeingLoaded = NULL;
 
     /* Fire the loading modules end event. */
@@ -2015,13 +2961,326 @@ void rdbLoadProgressCallback(rio *r, const void *buf, size_t len) {
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * Parallel loading.
+ *
+ * Decoding the values (decompressing the strings, creating the aggregate
+ * data types and converting their encodings) is where most of the loading
+ * time is spent, so when "rdb-load-threads" is greater than one this work is
+ * moved to a pool of threads:
+ *
+ * 1. The main thread keeps reading the stream, since this is where the
+ *    checksum is computed and the events are processed while loading, but
+ *    only skims the values: it just follows their lengths, collecting the
+ *    serialized bytes of every value into a buffer.
+ * 2. The buffers are grouped in batches that the threads decode with
+ *    rdbLoadObject(), reading from the buffer instead of the stream.
+ * 3. The decoded batches are added to the keyspace by the main thread, in
+ *    the same order they were read.
+ *
+ * Streams and module values are decoded by the main thread as usual: the
+ * module API is not thread safe, and the stream format is not worth to
+ * be skimmed.
+ * --------------------------------------------------------------------------*/
+
+#define RDB_LOAD_BATCH_KEYS 256          /* Max keys per batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024) /* Max serialized bytes per batch. */
+#define RDB_LOAD_BATCHES_PER_THREAD 4    /* Max batches in flight per thread. */
+
+typedef struct rdbLoadJob {
+    int type;               /* RDB type of the value. */
+    redisDb *db;
+    robj *key;
+    int skimmed;            /* Value to decode from the batch payload. */
+    robj *val;              /* Decoded value. */
+    long long expiretime, lfu_freq, lru_idle;
+    robj *fexpires;         /* Field expires of an hash, or NULL. */
+} rdbLoadJob;
+
+typedef struct rdbLoadBatch {
+    rdbLoadJob jobs[RDB_LOAD_BATCH_KEYS];
+    int len;
+    sds payload;            /* Serialized skimmed values, in jobs order. */
+    int failed;             /* Some value could not be decoded. */
+} rdbLoadBatch;
+
+static rdbThreadPool rdbLoadPool;
+static rdbLoadBatch *rdbLoadCurrent; /* Batch the main thread is filling. */
+static sds *rdbSkimPayload; /* Where the value being skimmed is appended. */
+
+/* Threads pool callback: decode the skimmed values of the batch. */
+static void rdbLoadProcessBatch(void *ptr) {
+    rdbLoadBatch *batch = ptr;
+    rio payload;
+
+    rioInitWithBuffer(&payload,batch->payload);
+    for (int j = 0; j < batch->len; j++) {
+        rdbLoadJob *job = batch->jobs+j;
+
+        if (!job->skimmed) continue; /* Decoded while reading. */
+        job->val = rdbLoadObject(job->type,&payload,job->key);
+        if (job->val == NULL) {
+            /* We can't tell where the next values start. */
+            batch->failed = 1;
+            break;
+        }
+    }
+    sdsfree(batch->payload);
+    batch->payload = NULL;
+}
+
+/* Used as update_cksum callback while skimming a value: in addition to
+ * the usual work, the bytes read are appended to the payload. */
+static void rdbLoadCaptureCallback(rio *r, const void *buf, size_t len) {
+    rdbLoadProgressCallback(r,buf,len);
+    *rdbSkimPayload = sdscatlen(*rdbSkimPayload,buf,len);
+}
+
+/* Read 'len' bytes of the value directly into the payload. */
+static int rdbSkimBytes(rio *rdb, size_t len) {
+    sds payload = sdsMakeRoomFor(*rdbSkimPayload,len);
+    int retval;
+
+    *rdbSkimPayload = payload;
+    rdb->update_cksum = rdbLoadProgressCallback;
+    retval = rioRead(rdb,payload+sdslen(payload),len);
+    rdb->update_cksum = rdbLoadCaptureCallback;
+    if (retval == 0) return -1;
+    sdsIncrLen(payload,len);
+    return 0;
+}
+
+/* Skim a string as saved by rdbSaveRawString(). */
+static int rdbSkimString(rio *rdb) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if ((len = rdbLoadLen(rdb,&isencoded)) == RDB_LENERR) return -1;
+    if (!isencoded) return rdbSkimBytes(rdb,len);
+    switch(len) {
+    case RDB_ENC_INT8: return rdbSkimBytes(rdb,1);
+    case RDB_ENC_INT16: return rdbSkimBytes(rdb,2);
+    case RDB_ENC_INT32: return rdbSkimBytes(rdb,4);
+    case RDB_ENC_LZF:
+    case RDB_ENC_LZ4:
+        if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return -1;
+        if (rdbLoadLen(rdb,NULL) == RDB_LENERR) return -1;
+        return rdbSkimBytes(rdb,clen);
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB string encoding type %d",
+            (int)len);
+        return -1; /* Never reached. */
+    }
+}
+
+/* Return true if the values of type 'rdbtype' can be skimmed, and are
+ * decoded by the threads. */
+static int rdbCanSkimObject(int rdbtype) {
+    return rdbtype != RDB_TYPE_STREAM_LISTPACKS &&
+           rdbtype != RDB_TYPE_STREAM_LISTPACKS_2 &&
+           rdbtype != RDB_TYPE_STREAM_LISTPACKS_3 &&
+           rdbtype != RDB_TYPE_STRING_ROARING &&
+           rdbtype != RDB_TYPE_MODULE &&
+           rdbtype != RDB_TYPE_MODULE_2;
+}
+
+/* Return the object type of the values of type 'rdbtype' that can be
+ * skimmed. */
+static int rdbSkimObjectType(int rdbtype) {
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+        return OBJ_STRING;
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST:
+        return OBJ_LIST;
+    case RDB_TYPE_SET:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_SET_LISTPACK:
+        return OBJ_SET;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+        return OBJ_ZSET;
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_HASH_LISTPACK:
+        return OBJ_HASH;
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
+        return -1; /* Never reached. */
+    }
+}
+
+/* Append the serialized value of type 'rdbtype' to '*payload', following
+ * the format rdbLoadObject() expects. Returns -1 on read error. */
+static int rdbSkimObject(int rdbtype, rio *rdb, sds *payload) {
+    uint64_t len, j;
+
+    rdbSkimPayload = payload;
+    rdb->update_cksum = rdbLoadCaptureCallback;
+    switch(rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_HASH_LISTPACK:
+    case RDB_TYPE_SET_LISTPACK:
+        if (rdbSkimString(rdb) == -1) goto err;
+        break;
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_LIST_QUICKLIST:
+    case RDB_TYPE_HASH:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto err;
+        if (rdbtype == RDB_TYPE_HASH) len *= 2;
+        for (j = 0; j < len; j++)
+            if (rdbSkimString(rdb) == -1) goto err;
+        break;
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_ZSET_2:
+        if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto err;
+        for (j = 0; j < len; j++) {
+            if (rdbSkimString(rdb) == -1) goto err;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbSkimBytes(rdb,sizeof(double)) == -1) goto err;
+            } else {
+                /* See rdbLoadDoubleValue(). */
+                unsigned char buflen;
+                if (rioRead(rdb,&buflen,1) == 0) goto err;
+                if (buflen < 253 && rdbSkimBytes(rdb,buflen) == -1)
+                    goto err;
+            }
+        }
+        break;
+    default:
+        rdbExitReportCorruptRDB("Unknown RDB encoding type %d",rdbtype);
+    }
+    rdb->update_cksum = rdbLoadProgressCallback;
+    return 0;
+
+err:
+    rdb->update_cksum = rdbLoadProgressCallback;
+    return -1;
+}
+
+/* Add to the keyspace the key and value of 'job', or release them if the
+ * key is already expired, or the value could not be decoded. */
+static void rdbLoadAddJob(rdbLoadJob *job, int rdbflags, long long now,
+                          long long lru_clock)
+{
+    /* The key of a delta replaces the one of the base, if any, even if it
+     * is not loaded because it already expired. */
+    if (rdbflags & RDBFLAGS_DELTA) rdbDeltaLoadRemoveKey(job->db,job->key);
+
+    /* Check if the key already expired. This function is used when loading
+     * an RDB file from disk, either at startup, or when an RDB was
+     * received from the master. In the latter case, the master is
+     * responsible for key expiry. If we would expire keys here, the
+     * snapshot taken by the master may not be reflected on the slave. */
+    if (job->val == NULL ||
+        (server.masterhost == NULL && !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+         job->expiretime != -1 && job->expiretime < now))
+    {
+        decrRefCount(job->key);
+        if (job->val) decrRefCount(job->val);
+        if (job->fexpires) decrRefCount(job->fexpires);
+    } else {
+        /* The value may be decoded by another thread: its memory is
+         * estimated, while the entries of the key are accounted as they
+         * are added. */
+        redisDb *prev = dbMemoryAccountingSwitch(job->db);
+        dbMemoryAccount(job->db,dbObjectMemory(job->val));
+
+        /* Add the new object in the hash table */
+        dbAdd(job->db,job->key,job->val);
+
+        /* Set the expire time if needed */
+        if (job->expiretime != -1)
+            setExpire(NULL,job->db,job->key,job->expiretime);
+
+        /* Set the field expires of an hash. */
+        if (job->fexpires) {
+            if (job->val->type == OBJ_HASH)
+                hashFieldExpiresAttach(job->db,job->key->ptr,job->fexpires);
+            else
+                decrRefCount(job->fexpires);
+        }
+
+        dbMemoryAccountingSwitch(prev);
+
+        /* Set usage information (for eviction). */
+        objectSetLRUOrLFU(job->val,job->lfu_freq,job->lru_idle,lru_clock,1000);
+
+        /* Decrement the key refcount since dbAdd() will take its
+         * own reference. */
+        decrRefCount(job->key);
+    }
+}
+
+/* Return a new job in the batch the main thread is filling. */
+static rdbLoadJob *rdbLoadNewJob(void) {
+    if (rdbLoadCurrent == NULL) {
+        rdbLoadCurrent = zcalloc(sizeof(rdbLoadBatch));
+        rdbLoadCurrent->payload = sdsempty();
+    }
+    return rdbLoadCurrent->jobs+rdbLoadCurrent->len++;
+}
+
+/* Submit the batch the main thread is filling, if any, then add to the
+ * keyspace the batches already decoded, in reading order. If 'wait' is
+ * true all the batches are waited for, otherwise we only wait while there
+ * are too many batches in flight.
+ *
+ * Returns C_ERR if some value could not be decoded. */
+static int rdbLoadFlushBatches(int wait, int rdbflags, long long now,
+                               long long lru_clock)
+{
+    unsigned long maxinflight = wait ? 0 :
+        (unsigned long) rdbLoadPool.num*RDB_LOAD_BATCHES_PER_THREAD;
+    rdbLoadBatch *batch;
+    int retval = C_OK;
+
+    if (rdbLoadCurrent) {
+        rdbThreadPoolSubmit(&rdbLoadPool,rdbLoadCurrent);
+        rdbLoadCurrent = NULL;
+    }
+    while ((batch = rdbThreadPoolNext(&rdbLoadPool,maxinflight)) != NULL) {
+        if (batch->failed) retval = C_ERR;
+        for (int j = 0; j < batch->len; j++)
+            rdbLoadAddJob(batch->jobs+j,rdbflags,now,lru_clock);
+        zfree(batch);
+    }
+    return retval;
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
+    return rdbLoadRioIntoDbs(rdb,rdbflags,rsi,server.db);
+}
+
+/* Like rdbLoadRio() but loads the keys into the databases of 'dbarray'
+ * instead of server.db. */
+int rdbLoadRioIntoDbs(rio *rdb, int rdbflags, rdbSaveInfo *rsi, redisDb *dbarray) {
     uint64_t dbid;
     int type, rdbver;
-    redisDb *db = server.db+0;
+    redisDb *db = dbarray+0;
     char buf[1024];
+    /* Key-specific attributes, set by opcodes before the key type. */
+    long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
+    long long lru_clock = LRU_CLOCK();
+    robj *fexpires = NULL;
+    sds lazybuf = NULL; /* Values skimmed just to reach the next key. */
+    int delta_base_ok = 0; /* The delta applies to the data set loaded. */
+    /* The keys are accounted to their DB as they are added, whatever the
+     * DB of the command loading them, see rdbLoadAddJob(). */
+    redisDb *prev_accounting_db = dbMemoryAccountingSwitch(NULL);
 
     rdb->update_cksum = rdbLoadProgressCallback;
     rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -2030,21 +3289,24 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
     if (memcmp(buf,"REDIS",5) != 0) {
         serverLog(LL_WARNING,"Wrong signature trying to load DB from file");
         errno = EINVAL;
+        dbMemoryAccountingSwitch(prev_accounting_db);
         return C_ERR;
     }
     rdbver = atoi(buf+5);
     if (rdbver < 1 || rdbver > RDB_VERSION) {
         serverLog(LL_WARNING,"Can't handle RDB format version %d",rdbver);
         errno = EINVAL;
+        dbMemoryAccountingSwitch(prev_accounting_db);
         return C_ERR;
     }
 
-    /* Key-specific attributes, set by opcodes before the key type. */
-    long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
-    long long lru_clock = LRU_CLOCK();
-
+    if (server.rdb_load_threads > 1)
+        rdbThreadPoolStart(&rdbLoadPool,server.rdb_load_threads,
+                           rdbLoadProcessBatch);
+    if (rdbflags & RDBFLAGS_LAZY) lazybuf = sdsempty();
     while(1) {
-        robj *key, *val;
+        robj *key;
+        rdbLoadJob *job, serialjob;
 
         /* Read type. */
         if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
@@ -2064,6 +3326,13 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             expiretime = rdbLoadMillisecondTime(rdb,rdbver);
             if (rioGetReadError(rdb)) goto eoferr;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+            /* HASH_FIELD_EXPIRES: the expires of the fields of the next
+             * key, that is an hash. */
+            if (fexpires) decrRefCount(fexpires);
+            if ((fexpires = rdbLoadHashFieldExpires(rdb,rdbver)) == NULL)
+                goto eoferr;
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_FREQ) {
             /* FREQ: LFU frequency. */
             uint8_t byte;
@@ -2079,6 +3348,14 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
+        } else if (type == RDB_OPCODE_DELKEY) {
+            /* DELKEY: a key deleted since the base of a delta snapshot. */
+            robj *delkey;
+            if ((rdbflags & RDBFLAGS_DELTA) && !delta_base_ok) goto stale;
+            if ((delkey = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
+            rdbDeltaLoadRemoveKey(db,delkey);
+            decrRefCount(delkey);
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
             if ((dbid = rdbLoadLen(rdb,NULL)) == RDB_LENERR) goto eoferr;
@@ -2089,7 +3366,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                     "databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            db = server.db+dbid;
+            db = dbarray+dbid;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: Hint about the size of the keys in the currently
@@ -2100,7 +3377,7 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->dict,db_size);
-            dictExpand(db->expires,expires_size);
+            expireIndexExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
@@ -2119,6 +3396,13 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
                 serverLog(LL_NOTICE,"RDB '%s': %s",
                     (char*)auxkey->ptr,
                     (char*)auxval->ptr);
+            } else if (!strcasecmp(auxkey->ptr,"delta-base")) {
+                /* The checksum of the base of a delta snapshot. */
+                if ((rdbflags & RDBFLAGS_DELTA) &&
+                    strtoull(auxval->ptr,NULL,16) == server.rdb_delta_load_cksum)
+                {
+                    delta_base_ok = 1;
+                }
             } else if (!strcasecmp(auxkey->ptr,"repl-stream-db")) {
                 if (rsi) rsi->repl_stream_db = atoi(auxval->ptr);
             } else if (!strcasecmp(auxkey->ptr,"repl-id")) {
@@ -2216,34 +3500,50 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         }
 
         /* Read key */
+        if ((rdbflags & RDBFLAGS_DELTA) && !delta_base_ok) goto stale;
         if ((key = rdbLoadStringObject(rdb)) == NULL) goto eoferr;
-        /* Read value */
-        if ((val = rdbLoadObject(type,rdb,key)) == NULL) {
-            decrRefCount(key);
+        job = rdbLoadPool.num ? rdbLoadNewJob() : &serialjob;
+        job->type = type;
+        job->db = db;
+        job->key = key;
+        job->skimmed = 0;
+        job->val = NULL;
+        job->expiretime = expiretime;
+        job->lfu_freq = lfu_freq;
+        job->lru_idle = lru_idle;
+        job->fexpires = fexpires;
+        fexpires = NULL;
+
+        /* Read value, or just skim it if a thread will decode it, or if it
+         * stays in the file to be read on access, see tiered.c. The hashes
+         * with field expires are always loaded, like tieredCanSwapOut()
+         * never moves them to the tiered storage. */
+        if (lazybuf && job->fexpires == NULL && rdbCanSkimObject(type)) {
+            off_t offset = rioTell(rdb);
+
+            if (rdbSkimObject(type,rdb,&lazybuf) == -1) {
+                if (!rdbLoadPool.num) decrRefCount(key);
+                goto eoferr;
+            }
+            job->val = tieredCreateLazyValue(rdbSkimObjectType(type),type,
+                offset,sdslen(lazybuf));
+            sdsclear(lazybuf);
+        } else if (rdbLoadPool.num && rdbCanSkimObject(type)) {
+            if (rdbSkimObject(type,rdb,&rdbLoadCurrent->payload) == -1)
+                goto eoferr;
+            job->skimmed = 1;
+        } else if ((job->val = rdbLoadObject(type,rdb,key)) == NULL) {
+            if (!rdbLoadPool.num) decrRefCount(key);
             goto eoferr;
         }
 
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave. */
-        if (server.masterhost == NULL && !(rdbflags&RDBFLAGS_AOF_PREAMBLE) && expiretime != -1 && expiretime < now) {
-            decrRefCount(key);
-            decrRefCount(val);
-        } else {
-            /* Add the new object in the hash table */
-            dbAdd(db,key,val);
-
-            /* Set the expire time if needed */
-            if (expiretime != -1) setExpire(NULL,db,key,expiretime);
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* Decrement the key refcount since dbAdd() will take its
-             * own reference. */
-            decrRefCount(key);
+        if (!rdbLoadPool.num) {
+            rdbLoadAddJob(job,rdbflags,now,lru_clock);
+        } else if (rdbLoadCurrent->len == RDB_LOAD_BATCH_KEYS ||
+                   sdslen(rdbLoadCurrent->payload) >= RDB_LOAD_BATCH_BYTES)
+        {
+            if (rdbLoadFlushBatches(0,rdbflags,now,lru_clock) == C_ERR)
+                goto eoferr;
         }
         if (server.key_load_delay)
             usleep(server.key_load_delay);
@@ -2254,6 +3554,12 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
         lfu_freq = -1;
         lru_idle = -1;
     }
+    if (rdbLoadPool.num) {
+        if (rdbLoadFlushBatches(1,rdbflags,now,lru_clock) == C_ERR)
+            goto eoferr;
+        rdbThreadPoolStop(&rdbLoadPool);
+    }
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
         uint64_t cksum, expected = rdb->cksum;
@@ -2269,16 +3575,37 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             }
         }
     }
+    sdsfree(lazybuf);
+    dbMemoryAccountingSwitch(prev_accounting_db);
     return C_OK;
 
+    /* A delta snapshot that was not created for the base just loaded: we
+     * find it out before any key, so nothing was applied. */
+stale:
+    if (fexpires) decrRefCount(fexpires);
+    if (rdbLoadPool.num) rdbThreadPoolStop(&rdbLoadPool);
+    sdsfree(lazybuf);
+    dbMemoryAccountingSwitch(prev_accounting_db);
+    errno = ESTALE;
+    return C_ERR;
+
     /* Unexpected end of file is handled here calling rdbReportReadError():
      * this will in turn either abort Redis in most cases, or if we are loading
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    if (fexpires) decrRefCount(fexpires);
+    if (rdbLoadPool.num) {
+        /* The key being read when the error happened has no value, so
+         * it is just released together with the rest of its batch. */
+        rdbLoadFlushBatches(1,rdbflags,now,lru_clock);
+        rdbThreadPoolStop(&rdbLoadPool);
+    }
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
+    sdsfree(lazybuf);
+    dbMemoryAccountingSwitch(prev_accounting_db);
     return C_ERR;
 }
 
@@ -2295,6 +3622,8 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     int retval;
 
     if ((fp = fopen(filename,"r")) == NULL) return C_ERR;
+    if (rdbflags & RDBFLAGS_LAZY && tieredLazyLoadStart(fileno(fp)) == C_ERR)
+        rdbflags &= ~RDBFLAGS_LAZY;
     startLoadingFile(fp, filename,rdbflags);
     rioInitWithFile(&rdb,fp);
     retval = rdbLoadRio(&rdb,rdbflags,rsi);
@@ -2316,12 +3645,12 @@ void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
         serverLog(LL_WARNING, "Background saving error");
         server.lastbgsave_status = C_ERR;
     } else {
-        mstime_t latency;
+        ustime_t latency;
 
         serverLog(LL_WARNING,
             "Background saving terminated by signal %d", bysignal);
         latencyStartMonitor(latency);
-        rdbRemoveTempFile(server.rdb_child_pid);
+        rdbRemoveTempFile(server.rdb_child_pid,0);
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("rdb-unlink-temp-file",latency);
         /* SIGUSR1 is whitelisted, so we have a way to kill a child without
@@ -2333,6 +3662,10 @@ void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
     server.rdb_save_time_start = -1;
+    if (server.rdb_delta_child)
+        server.rdb_delta_child = 0;
+    else
+        rdbDeltaFullSaveDone(!bysignal && exitcode == 0);
     /* Possibly there are slaves waiting for a BGSAVE in order to be served
      * (the first stage of SYNC is a bulk transfer of dump.rdb) */
     updateSlavesWaitingBgsave((!bysignal && exitcode == 0) ? C_OK : C_ERR, RDB_CHILD_TYPE_DISK);
@@ -2378,7 +3711,7 @@ void backgroundSaveDoneHandler(int exitcode, int bysignal) {
  * the cleanup needed. */
 void killRDBChild(void) {
     kill(server.rdb_child_pid,SIGUSR1);
-    rdbRemoveTempFile(server.rdb_child_pid);
+    rdbRemoveTempFile(server.rdb_child_pid,0);
     closeChildInfoPipe();
     updateDictResizePolicy();
 }
@@ -2391,7 +3724,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     pid_t childpid;
     int pipefds[2];
 
-    if (hasActiveChildProcess()) return C_ERR;
+    if (hasActiveChildProcess() || server.rdb_forkless) return C_ERR;
 
     /* Even if the previous fork child exited, don't start a new one until we
      * drained the pipe. */
@@ -2430,6 +3763,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         rioInitWithFd(&rdb,server.rdb_pipe_write);
 
         redisSetProcTitle("redis-rdb-to-slaves");
+        redisSetCpuAffinity(server.bgsave_cpulist);
 
         retval = rdbSaveRioWithEOFMark(&rdb,NULL,rsi);
         if (retval == C_OK && rioFlush(&rdb) == 0)
@@ -2472,7 +3806,9 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             server.rdb_child_pid = childpid;
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
             close(server.rdb_pipe_write); /* close write in parent so that it can detect the close on the child. */
-            if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
+            if (server.repl_diskless_sync_buffer) {
+                rdbPipeRingInit();
+            } else if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeReadHandler,NULL) == AE_ERR) {
                 serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
             }
         }
@@ -2482,7 +3818,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_forkless) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2497,13 +3833,17 @@ void saveCommand(client *c) {
 
 /* BGSAVE [SCHEDULE] */
 void bgsaveCommand(client *c) {
-    int schedule = 0;
+    int schedule = 0, delta = 0;
 
     /* The SCHEDULE option changes the behavior of BGSAVE when an AOF rewrite
-     * is in progress. Instead of returning an error a BGSAVE gets scheduled. */
+     * is in progress. Instead of returning an error a BGSAVE gets scheduled.
+     * The DELTA option writes just the changes since the last full save,
+     * see rdbdelta.c. */
     if (c->argc > 1) {
         if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"schedule")) {
             schedule = 1;
+        } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"delta")) {
+            delta = 1;
         } else {
             addReply(c,shared.syntaxerr);
             return;
@@ -2513,8 +3853,23 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_forkless) {
         addReplyError(c,"Background save already in progress");
+    } else if (delta && !server.rdb_delta_snapshots) {
+        addReplyError(c,"BGSAVE DELTA needs rdb-delta-snapshots enabled");
+    } else if (delta && !server.rdb_checksum) {
+        addReplyError(c,"BGSAVE DELTA needs rdbchecksum enabled");
+    } else if (delta && !server.rdb_delta_base_valid) {
+        addReplyError(c,"No full RDB file to write the delta of, "
+                        "use BGSAVE first");
+    } else if (delta) {
+        if (rdbSaveDeltaBackground(rsiptr) == C_OK)
+            addReplyStatus(c,"Background delta saving started");
+        else if (hasActiveChildProcess())
+            addReplyError(c,"Another child process is active (AOF?): "
+                            "can't BGSAVE DELTA right now.");
+        else
+            addReply(c,shared.err);
     } else if (hasActiveChildProcess()) {
         if (schedule) {
             server.rdb_bgsave_scheduled = 1;
@@ -2525,13 +3880,179 @@ void bgsaveCommand(client *c) {
             "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
             "possible.");
         }
-    } else if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK) {
+    } else if (rdbSaveBackgroundForPersistence(server.rdb_filename,rsiptr) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
         addReply(c,shared.err);
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * BGLOAD: replace the data set with the content of an RDB file.
+ *
+ * The file is loaded into temporary DBs, like the async diskless load of the
+ * replicas does, while the current data set keeps serving read commands.
+ * Once the file was loaded with success the current data set is atomically
+ * replaced with the new one, and freed in the background by the lazyfree
+ * threads. If the loading fails the current data set is not touched at all.
+ *
+ * The replacement is not propagated as commands: the replicas are
+ * disconnected in order to force a full resynchronization, and the AOF is
+ * rewritten.
+ * ------------------------------------------------------------------------- */
+
+/* Check the CRC64 trailer of the RDB file 'fp' before loading it: a
+ * corruption detected while loading would terminate the server. The file
+ * position is restored to the start. Files without a checksum are accepted
+ * as they are. */
+static int rdbCheckFileChecksum(FILE *fp, off_t size) {
+    unsigned char buf[PROTO_IOBUF_LEN];
+    uint64_t cksum, expected;
+    off_t left, processed = 0;
+
+    if (size < 9+8 || fread(buf,9,1,fp) != 1) return C_ERR;
+    if (memcmp(buf,"REDIS",5) != 0) return C_ERR;
+    buf[9] = '\0';
+    if (atoi((char*)buf+5) < 5) goto ok; /* No checksum before version 5. */
+
+    if (fseeko(fp,size-8,SEEK_SET) == -1 ||
+        fread(&expected,8,1,fp) != 1) return C_ERR;
+    memrev64ifbe(&expected);
+    if (expected == 0) goto ok;
+
+    rewind(fp);
+    cksum = 0;
+    left = size-8;
+    while (left > 0) {
+        size_t len = left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf);
+        if (fread(buf,len,1,fp) != 1) return C_ERR;
+        cksum = crc64(cksum,buf,len);
+        left -= len;
+        processed += len;
+        if (server.loading_process_events_interval_bytes &&
+            processed >= server.loading_process_events_interval_bytes)
+        {
+            processed = 0;
+            processEventsWhileBlocked();
+        }
+    }
+    if (cksum != expected) return C_ERR;
+
+ok:
+    rewind(fp);
+    return C_OK;
+}
+
+/* Load server.bgload_filename into temporary DBs and swap them with the
+ * current ones. Called from the event loop as a one-shot timer, so that the
+ * loading can process the events of the other clients. */
+static int bgloadTimeProc(struct aeEventLoop *eventLoop, long long id,
+                          void *clientData)
+{
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+    rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
+    redisDb *tempDb = NULL;
+    struct stat sb;
+    FILE *fp;
+    rio rdb;
+    int retval = C_ERR;
+
+    if ((fp = fopen(server.bgload_filename,"r")) == NULL ||
+        fstat(fileno(fp),&sb) == -1)
+    {
+        serverLog(LL_WARNING,"BGLOAD: can't open %s: %s",
+            server.bgload_filename, strerror(errno));
+        goto done;
+    }
+
+    startLoading(sb.st_size,RDBFLAGS_NONE,1);
+    if (rdbCheckFileChecksum(fp,sb.st_size) == C_ERR) {
+        stopLoading(0);
+        serverLog(LL_WARNING,"BGLOAD: %s is not a valid RDB file or its "
+                             "checksum doesn't match",
+            server.bgload_filename);
+        goto done;
+    }
+    tempDb = disklessLoadCreateTempDbs();
+    rioInitWithFile(&rdb,fp);
+    retval = rdbLoadRioIntoDbs(&rdb,RDBFLAGS_NONE,&rsi,tempDb);
+    stopLoading(retval == C_OK);
+    if (retval != C_OK) {
+        serverLog(LL_WARNING,"BGLOAD: failed loading %s",
+            server.bgload_filename);
+        disklessLoadDiscardTempDbs(tempDb,EMPTYDB_ASYNC);
+        goto done;
+    }
+
+    /* The snapshots and the rewrites in progress refer to the data set that
+     * is going away. */
+    if (server.rdb_forkless) rdbForklessSaveAbort();
+    if (server.rdb_child_pid != -1) killRDBChild();
+    if (server.aof_child_pid != -1) killAppendOnlyChild();
+    for (int j = 0; j < server.dbnum; j++) {
+        migrateAbortJobs(&server.db[j]);
+        setopResetJobs(&server.db[j]);
+    }
+    replyFlushAllJobs();
+    disklessLoadSwapTempDbs(tempDb,EMPTYDB_ASYNC);
+    for (int j = 0; j < server.dbnum; j++)
+        scanDatabaseForReadyLists(&server.db[j]);
+    server.dirty++;
+
+    if (listLength(server.slaves)) {
+        changeReplicationId();
+        clearReplicationId2();
+        disconnectSlaves();
+    }
+    if (server.aof_state == AOF_ON) {
+        if (hasActiveChildProcess())
+            server.aof_rewrite_scheduled = 1;
+        else
+            rewriteAppendOnlyFileBackground();
+    }
+    serverLog(LL_NOTICE,"BGLOAD: data set replaced with %s",
+        server.bgload_filename);
+
+done:
+    if (fp) fclose(fp);
+    server.lastbgload_status = retval;
+    sdsfree(server.bgload_filename);
+    server.bgload_filename = NULL;
+    return AE_NOMORE;
+}
+
+/* BGLOAD <filename> */
+void bgloadCommand(client *c) {
+    char *filename = c->argv[1]->ptr;
+
+    if (server.cluster_enabled) {
+        addReplyError(c,"BGLOAD is not allowed in cluster mode");
+        return;
+    } else if (server.masterhost) {
+        addReplyError(c,"BGLOAD is not allowed on a replica");
+        return;
+    } else if (server.bgload_filename) {
+        addReplyError(c,"Background loading already in progress");
+        return;
+    } else if (server.loading || server.async_loading) {
+        addReplyError(c,"The data set is being loaded");
+        return;
+    } else if (access(filename,R_OK) == -1) {
+        addReplyErrorFormat(c,"Can't open %s: %s",filename,strerror(errno));
+        return;
+    }
+
+    if (aeCreateTimeEvent(server.el,0,bgloadTimeProc,NULL,NULL) == AE_ERR) {
+        addReplyError(c,"Can't start the background loading");
+        return;
+    }
+    server.bgload_filename = sdsnew(filename);
+    serverLog(LL_NOTICE,"Background loading of %s requested", filename);
+    addReplyStatus(c,"Background loading started");
+}
+
 /* Populate the rdbSaveInfo structure used to persist the replication
  * information inside the RDB file. Currently the structure explicitly
  * contains just the currently selected DB from the master stream, however
@@ -38,7 +38,7 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 9
+#define RDB_VERSION 10
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +68,7 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_LZ4 4         /* string compressed with LZ4 */
 
 /* Map object types to RDB object types. Macros starting with OBJ_ are for
  * memory storage and may change. Instead RDB types must be fixed because
@@ -91,12 +92,20 @@
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
 #define RDB_TYPE_STREAM_LISTPACKS 15
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
+#define RDB_TYPE_SET_LISTPACK  18
+#define RDB_TYPE_STREAM_LISTPACKS_2 19 /* Stream with coded values. */
+#define RDB_TYPE_STRING_ROARING 20 /* Bitmap as roaring containers. */
+#define RDB_TYPE_STREAM_LISTPACKS_3 21 /* Stream with groups lag counters. */
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 21))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define RDB_OPCODE_DELKEY     245   /* Key deleted, in delta snapshots. */
+#define RDB_OPCODE_HASH_FIELD_EXPIRES 246 /* Field expires of the next key. */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
 #define RDB_OPCODE_IDLE       248   /* LRU idle time. */
 #define RDB_OPCODE_FREQ       249   /* LFU frequency. */
@@ -125,6 +134,8 @@
 #define RDBFLAGS_NONE 0
 #define RDBFLAGS_AOF_PREAMBLE (1<<0)
 #define RDBFLAGS_REPLICATION (1<<1)
+#define RDBFLAGS_LAZY (1<<2) /* Leave the values in the file, see tiered.c. */
+#define RDBFLAGS_DELTA (1<<3) /* Apply a delta snapshot, see rdbdelta.c. */
 
 int rdbSaveType(rio *rdb, unsigned char type);
 int rdbLoadType(rio *rdb);
@@ -139,14 +150,21 @@ int rdbSaveObjectType(rio *rdb, robj *o);
 int rdbLoadObjectType(rio *rdb);
 int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags);
 int rdbSaveBackground(char *filename, rdbSaveInfo *rsi);
+int rdbSaveBackgroundForPersistence(char *filename, rdbSaveInfo *rsi);
+int rdbForklessSaveStart(char *filename, rdbSaveInfo *rsi);
+void rdbForklessSaveAbort(void);
+void rdbForklessSaveEntry(redisDb *db, dictEntry *de);
+void rdbForklessSaveDb(int dbid);
 int rdbSaveToSlavesSockets(rdbSaveInfo *rsi);
-void rdbRemoveTempFile(pid_t childpid);
+void rdbRemoveTempFile(pid_t childpid, int from_signal);
 int rdbSave(char *filename, rdbSaveInfo *rsi);
 ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key);
 size_t rdbSavedObjectLen(robj *o);
 robj *rdbLoadObject(int type, rio *rdb, robj *key);
 void backgroundSaveDoneHandler(int exitcode, int bysignal);
-int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime);
+int rdbSaveKeyValuePair(rio *rdb, robj *key, robj *val, long long expiretime, robj *fexpires);
+int rdbSaveHashFieldExpires(rio *rdb, robj *zobj);
+robj *rdbLoadHashFieldExpires(rio *rdb, int rdbver);
 ssize_t rdbSaveSingleModuleAux(rio *rdb, int when, moduleType *mt);
 robj *rdbLoadStringObject(rio *rdb);
 ssize_t rdbSaveStringObject(rio *rdb, robj *obj);
@@ -157,7 +175,22 @@ int rdbLoadBinaryDoubleValue(rio *rdb, double *val);
 int rdbSaveBinaryFloatValue(rio *rdb, float val);
 int rdbLoadBinaryFloatValue(rio *rdb, float *val);
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
+int rdbLoadRioIntoDbs(rio *rdb, int rdbflags, rdbSaveInfo *rsi, redisDb *dbarray);
 int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
+ssize_t rdbSaveAuxField(rio *rdb, void *key, size_t keylen, void *val, size_t vallen);
+ssize_t rdbSaveAuxFieldStrStr(rio *rdb, char *key, char *val);
+int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
+
+/* Differential RDB snapshots, see rdbdelta.c. */
+char *rdbDeltaFilename(void);
+unsigned long long rdbDeltaKeysCount(void);
+void rdbDeltaInvalidate(void);
+void rdbDeltaTrackKey(redisDb *db, robj *key);
+void rdbDeltaFullSaveStart(void);
+void rdbDeltaFullSaveDone(int success);
+int rdbSaveDeltaBackground(rdbSaveInfo *rsi);
+void rdbDeltaLoadRemoveKey(redisDb *db, robj *key);
+void rdbDeltaLoad(rdbSaveInfo *rsi);
 
 #endif
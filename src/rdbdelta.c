@@ -0,0 +1,383 @@
+/* Differential RDB snapshots, see the rdb-delta-snapshots option.
+ *
+ * When a small part of a big data set changes between two saves, writing
+ * the whole data set again wastes disk bandwidth and backup storage. With
+ * rdb-delta-snapshots enabled the server remembers the keys modified since
+ * the last full RDB file was written, the base, so that BGSAVE DELTA can
+ * write just those keys, or a tombstone for the ones that no longer exist,
+ * to a delta file named after the base, "dump.rdb.delta" by default.
+ *
+ * The deltas are cumulative: every delta contains all the changes since
+ * the base, so there is at most one delta to apply, and writing it again
+ * replaces the previous one. A full save (BGSAVE, SAVE, the save points,
+ * the saves for replication) starts a new base: the keys modified since
+ * then are tracked from scratch, and the old delta is removed once the new
+ * base is on disk. At startup the delta is applied after the base it was
+ * created for, that is recognized by the checksum of the base written in
+ * the delta, so a stale delta is never applied to another base.
+ *
+ * The keys are tracked from signalModifiedKey() and from the eviction of
+ * the keys. Keys that expire don't need to be tracked: the base has their
+ * expire time, so they are not loaded. Flushing or swapping the DBs, or
+ * modifying keys while the option is disabled, invalidates the base, and
+ * BGSAVE DELTA is refused until the next full save.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+
+#include <sys/param.h>
+
+/* Return the name of the delta file of the current base. */
+char *rdbDeltaFilename(void) {
+    static char filename[MAXPATHLEN];
+
+    snprintf(filename,sizeof(filename),"%s.delta",server.rdb_filename);
+    return filename;
+}
+
+static dict **rdbDeltaCreateKeys(void) {
+    dict **keys = zmalloc(sizeof(dict*)*server.dbnum);
+
+    for (int j = 0; j < server.dbnum; j++)
+        keys[j] = dictCreate(&setDictType,NULL);
+    return keys;
+}
+
+static void rdbDeltaFreeKeys(dict **keys) {
+    if (keys == NULL) return;
+    for (int j = 0; j < server.dbnum; j++) dictRelease(keys[j]);
+    zfree(keys);
+}
+
+/* Return the number of keys the next delta would contain. */
+unsigned long long rdbDeltaKeysCount(void) {
+    unsigned long long count = 0;
+
+    if (server.rdb_delta_keys == NULL) return 0;
+    for (int j = 0; j < server.dbnum; j++)
+        count += dictSize(server.rdb_delta_keys[j]);
+    return count;
+}
+
+/* Forget the base: BGSAVE DELTA is refused until the next full save. */
+void rdbDeltaInvalidate(void) {
+    rdbDeltaFreeKeys(server.rdb_delta_keys);
+    rdbDeltaFreeKeys(server.rdb_delta_saving_keys);
+    server.rdb_delta_keys = NULL;
+    server.rdb_delta_saving_keys = NULL;
+    server.rdb_delta_base_valid = 0;
+}
+
+/* Remember that 'key' was modified since the base, called every time a key
+ * is modified, see signalModifiedKey(). */
+void rdbDeltaTrackKey(redisDb *db, robj *key) {
+    if (!server.rdb_delta_snapshots) {
+        /* The change would be missing from the next delta. */
+        if (server.rdb_delta_base_valid || server.rdb_delta_saving_keys)
+            rdbDeltaInvalidate();
+        return;
+    }
+    /* Nothing to track if there is no base, and none is being saved. */
+    if (!server.rdb_delta_base_valid && !server.rdb_delta_saving_keys) return;
+    if (server.rdb_delta_keys == NULL)
+        server.rdb_delta_keys = rdbDeltaCreateKeys();
+
+    dict *d = server.rdb_delta_keys[db->id];
+    robj *decoded = getDecodedObject(key);
+    if (dictFind(d,decoded->ptr) == NULL)
+        dictAdd(d,sdsdup(decoded->ptr),NULL);
+    decrRefCount(decoded);
+}
+
+/* A full save of the data set to server.rdb_filename is starting: the keys
+ * modified from now on are the ones the deltas of the new base will have.
+ * The keys tracked so far are kept aside in case the save fails. */
+void rdbDeltaFullSaveStart(void) {
+    if (!server.rdb_delta_snapshots) return;
+    rdbDeltaFreeKeys(server.rdb_delta_saving_keys);
+    server.rdb_delta_saving_keys = server.rdb_delta_keys ?
+                                   server.rdb_delta_keys :
+                                   rdbDeltaCreateKeys();
+    server.rdb_delta_keys = NULL;
+}
+
+/* The full save started with rdbDeltaFullSaveStart() terminated. */
+void rdbDeltaFullSaveDone(int success) {
+    dict **saving = server.rdb_delta_saving_keys;
+
+    /* Not enabled, or the base was invalidated in the meantime. */
+    if (saving == NULL) return;
+    server.rdb_delta_saving_keys = NULL;
+
+    if (success) {
+        /* The delta of the old base is useless now. */
+        if (access(rdbDeltaFilename(),F_OK) == 0)
+            bioUnlinkFile(rdbDeltaFilename());
+        server.rdb_delta_base_valid = 1;
+    } else if (server.rdb_delta_base_valid) {
+        /* The old base is still the one on disk: its delta must include
+         * the keys modified before the save started too. */
+        if (server.rdb_delta_keys == NULL)
+            server.rdb_delta_keys = rdbDeltaCreateKeys();
+        for (int j = 0; j < server.dbnum; j++) {
+            dictIterator *di = dictGetIterator(saving[j]);
+            dictEntry *de;
+
+            while((de = dictNext(di)) != NULL) {
+                sds key = dictGetKey(de);
+                if (dictFind(server.rdb_delta_keys[j],key) == NULL)
+                    dictAdd(server.rdb_delta_keys[j],sdsdup(key),NULL);
+            }
+            dictReleaseIterator(di);
+        }
+    } else {
+        rdbDeltaFreeKeys(server.rdb_delta_keys);
+        server.rdb_delta_keys = NULL;
+    }
+    rdbDeltaFreeKeys(saving);
+}
+
+/* Read the checksum at the end of the base file. Returns C_ERR if it can't
+ * be read or the base was saved without checksum. */
+static int rdbDeltaBaseChecksum(uint64_t *cksum) {
+    FILE *fp = fopen(server.rdb_filename,"r");
+    int retval = C_ERR;
+
+    if (fp == NULL) return C_ERR;
+    if (fseeko(fp,-8,SEEK_END) == 0 && fread(cksum,8,1,fp) == 1) {
+        memrev64ifbe(cksum);
+        if (*cksum != 0) retval = C_OK;
+    }
+    fclose(fp);
+    return retval;
+}
+
+/* Write the delta of the keys in server.rdb_delta_keys to 'rdb', like
+ * rdbSaveRio() does for the full data set. The keys that no longer exist
+ * are written as RDB_OPCODE_DELKEY tombstones. */
+static int rdbSaveDeltaRio(rio *rdb, uint64_t basecksum, rdbSaveInfo *rsi) {
+    char magic[10], hexcksum[17];
+    dictIterator *di;
+    dictEntry *de;
+    uint64_t cksum;
+
+    if (server.rdb_checksum)
+        rdb->update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    snprintf(hexcksum,sizeof(hexcksum),"%016llx",
+        (unsigned long long)basecksum);
+    if (rioWrite(rdb,magic,9) == 0) return C_ERR;
+    /* The base comes first, so that a stale delta is recognized before
+     * anything is loaded from it. */
+    if (rdbSaveAuxFieldStrStr(rdb,"delta-base",hexcksum) == -1) return C_ERR;
+    if (rdbSaveInfoAuxFields(rdb,RDBFLAGS_NONE,rsi) == -1) return C_ERR;
+
+    for (int j = 0; server.rdb_delta_keys && j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        dict *keys = server.rdb_delta_keys[j];
+
+        if (dictSize(keys) == 0) continue;
+        if (rdbSaveType(rdb,RDB_OPCODE_SELECTDB) == -1) return C_ERR;
+        if (rdbSaveLen(rdb,j) == -1) return C_ERR;
+
+        di = dictGetIterator(keys);
+        while((de = dictNext(di)) != NULL) {
+            sds keystr = dictGetKey(de);
+            dictEntry *kde = dictFind(db->dict,keystr);
+            int retval;
+
+            if (kde) {
+                robj key, *o = dictGetVal(kde);
+                robj *fexpires = o->type == OBJ_HASH ?
+                                 hashFieldExpiresGet(db,keystr) : NULL;
+
+                initStaticStringObject(key,keystr);
+                retval = rdbSaveKeyValuePair(rdb,&key,o,
+                    dbEntryGetExpire(db,kde),fexpires);
+            } else {
+                retval = rdbSaveType(rdb,RDB_OPCODE_DELKEY);
+                if (retval != -1)
+                    retval = rdbSaveRawString(rdb,(unsigned char*)keystr,
+                                              sdslen(keystr));
+            }
+            if (retval == -1) {
+                dictReleaseIterator(di);
+                return C_ERR;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
+    /* The scripts created since the base, see rdbSaveRio(). */
+    if (dictSize(server.lua_scripts)) {
+        di = dictGetIterator(server.lua_scripts);
+        while((de = dictNext(di)) != NULL) {
+            robj *body = dictGetVal(de);
+            if (rdbSaveAuxField(rdb,"lua",3,body->ptr,sdslen(body->ptr))
+                == -1)
+            {
+                dictReleaseIterator(di);
+                return C_ERR;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
+    if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) return C_ERR;
+    cksum = rdb->cksum;
+    memrev64ifbe(&cksum);
+    if (rioWrite(rdb,&cksum,8) == 0) return C_ERR;
+    return C_OK;
+}
+
+/* Write the delta file, called in the saving child. */
+static int rdbSaveDelta(rdbSaveInfo *rsi) {
+    char tmpfile[256];
+    uint64_t basecksum;
+    FILE *fp;
+    rio rdb;
+
+    if (rdbDeltaBaseChecksum(&basecksum) == C_ERR) {
+        serverLog(LL_WARNING,"Can't read the checksum of the base RDB file "
+            "%s: can't write its delta", server.rdb_filename);
+        return C_ERR;
+    }
+    snprintf(tmpfile,256,"temp-%d.rdb",(int) getpid());
+    if ((fp = fopen(tmpfile,"w")) == NULL) {
+        serverLog(LL_WARNING,"Failed opening the delta RDB file %s: %s",
+            tmpfile, strerror(errno));
+        return C_ERR;
+    }
+    rioInitWithFile(&rdb,fp);
+    if (server.rdb_save_incremental_fsync)
+        rioSetAutoSync(&rdb,REDIS_AUTOSYNC_BYTES);
+    if (rdbSaveDeltaRio(&rdb,basecksum,rsi) == C_ERR ||
+        fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+    {
+        serverLog(LL_WARNING,"Write error saving the delta on disk: %s",
+            strerror(errno));
+        fclose(fp);
+        unlink(tmpfile);
+        return C_ERR;
+    }
+    if (fclose(fp) == EOF || rename(tmpfile,rdbDeltaFilename()) == -1) {
+        serverLog(LL_WARNING,"Error moving the delta RDB file %s to %s: %s",
+            tmpfile, rdbDeltaFilename(), strerror(errno));
+        unlink(tmpfile);
+        return C_ERR;
+    }
+    serverLog(LL_NOTICE,"Delta of %llu keys saved on disk",
+        rdbDeltaKeysCount());
+    return C_OK;
+}
+
+/* BGSAVE DELTA: write the delta of the current base in background. The
+ * child is handled like the one of a BGSAVE, see
+ * backgroundSaveDoneHandlerDisk(). */
+int rdbSaveDeltaBackground(rdbSaveInfo *rsi) {
+    pid_t childpid;
+
+    if (hasActiveChildProcess() || server.rdb_forkless) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+    openChildInfoPipe();
+
+    if ((childpid = redisFork()) == 0) {
+        int retval;
+
+        /* Child */
+        redisSetProcTitle("redis-rdb-delta");
+        redisSetCpuAffinity(server.bgsave_cpulist);
+        retval = rdbSaveDelta(rsi);
+        if (retval == C_OK) {
+            sendChildCOWInfo(CHILD_INFO_TYPE_RDB, "RDB delta");
+        }
+        exitFromChild((retval == C_OK) ? 0 : 1);
+    } else {
+        /* Parent */
+        if (childpid == -1) {
+            closeChildInfoPipe();
+            server.lastbgsave_status = C_ERR;
+            serverLog(LL_WARNING,"Can't save the delta in background: "
+                "fork: %s", strerror(errno));
+            return C_ERR;
+        }
+        serverLog(LL_NOTICE,"Background delta saving started by pid %d",
+            childpid);
+        server.rdb_save_time_start = time(NULL);
+        server.rdb_child_pid = childpid;
+        server.rdb_child_type = RDB_CHILD_TYPE_DISK;
+        server.rdb_delta_child = 1;
+        return C_OK;
+    }
+    return C_OK; /* unreached */
+}
+
+/* Called by the RDB loading code for every key found in a delta, before it
+ * is added, and for every tombstone: the version of the base goes away. */
+void rdbDeltaLoadRemoveKey(redisDb *db, robj *key) {
+    redisDb *prev = dbMemoryAccountingSwitch(db);
+
+    dbSyncDelete(db,key);
+    dbMemoryAccountingSwitch(prev);
+    rdbDeltaTrackKey(db,key);
+}
+
+/* Apply the delta of server.rdb_filename, if any, after the base was loaded
+ * at startup. The replication info of the delta, that is more recent,
+ * replaces the one of the base in 'rsi'. */
+void rdbDeltaLoad(rdbSaveInfo *rsi) {
+    char *filename = rdbDeltaFilename();
+    long long start = ustime();
+
+    /* The data set is the base: track the keys for its next delta, that
+     * must include the ones of the delta we are going to load. */
+    server.rdb_delta_base_valid = server.rdb_delta_snapshots;
+    if (access(filename,F_OK) == -1) return;
+
+    if (rdbDeltaBaseChecksum(&server.rdb_delta_load_cksum) == C_ERR) {
+        serverLog(LL_WARNING,"The base RDB file was saved without checksum, "
+            "ignoring the delta %s", filename);
+        return;
+    }
+    if (rdbLoad(filename,rsi,RDBFLAGS_DELTA) == C_OK) {
+        serverLog(LL_NOTICE,"Delta loaded from %s: %.3f seconds", filename,
+            (float)(ustime()-start)/1000000);
+    } else if (errno == ESTALE) {
+        serverLog(LL_WARNING,"The delta %s was not created for the base RDB "
+            "file %s, ignoring it", filename, server.rdb_filename);
+    } else {
+        serverLog(LL_WARNING,"Fatal error loading the delta %s: %s. "
+            "Exiting.", filename, strerror(errno));
+        exit(1);
+    }
+}
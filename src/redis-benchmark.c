@@ -56,6 +56,10 @@
 #define MAX_LATENCY_PRECISION 3
 #define MAX_THREADS 500
 #define CLUSTER_SLOTS 16384
+#define WORKLOAD_UNIFORM 0
+#define WORKLOAD_ZIPF 1
+#define WORKLOAD_HOTSPOT 2
+#define WORKLOAD_MAX_COMMANDS 256
 
 #define CLIENT_GET_EVENTLOOP(c) \
     (c->thread_id >= 0 ? config.threads[c->thread_id]->el : config.el)
@@ -63,6 +67,7 @@
 struct benchmarkThread;
 struct clusterNode;
 struct redisConfig;
+struct workload;
 
 static struct config {
     aeEventLoop *el;
@@ -82,6 +87,7 @@ static struct config {
     int pipeline;
     int showerrors;
     long long start;
+    long long start_us;     /* Start of the run in microseconds (--rps) */
     long long totlatency;
     long long *latency;
     const char *title;
@@ -105,6 +111,18 @@ static struct config {
     int is_updating_slots;
     int slots_last_update;
     int enable_tracking;
+    int slot_batch;         /* Pipelines sent to a slot before changing it */
+    int hot_slot_perc;      /* % of the pipelines sent to the hot slots */
+    int top_slots;          /* Slots shown in the per slot report */
+    int reshard_interval;   /* Milliseconds between two simulated reshards */
+    int reshard_stop;
+    int slots_resharded;
+    int rps;                /* Target requests per second, 0 = closed loop */
+    const char *workload_file;
+    struct workload *workload;  /* Workload loaded with --workload, or NULL */
+    short *latency_cmd;     /* Workload command of every request */
+    short *latency_slot;    /* Slot of every request (cluster mode only) */
+    short *latency_node;    /* Node of every request (cluster mode only) */
     /* Thread mutexes to be used as fallbacks by atomicvar.h */
     pthread_mutex_t requests_issued_mutex;
     pthread_mutex_t requests_finished_mutex;
@@ -113,6 +131,8 @@ static struct config {
     pthread_mutex_t is_updating_slots_mutex;
     pthread_mutex_t updating_slots_mutex;
     pthread_mutex_t slots_last_update_mutex;
+    pthread_mutex_t reshard_stop_mutex;
+    pthread_mutex_t slots_resharded_mutex;
 } config;
 
 typedef struct _client {
@@ -127,6 +147,9 @@ typedef struct _client {
     size_t written;         /* Bytes of 'obuf' already written */
     long long start;        /* Start time of a request */
     long long latency;      /* Request latency */
+    int scheduled;          /* Request initialized, waiting its send time */
+    long long send_timer;   /* Timer of the scheduled send, or -1 */
+    int *workload_cmds;     /* Workload command of every pipelined request */
     int pending;            /* Number of pending requests (replies to consume) */
     int prefix_pending;     /* If non-zero, number of pending prefix commands. Commands
                                such as auth and select are prefixed to the pipeline of
@@ -135,18 +158,31 @@ typedef struct _client {
     int thread_id;
     struct clusterNode *cluster_node;
     int slots_last_update;
+    int slot;               /* Slot of the current pipeline, or -1 */
+    int slot_batch_left;    /* Pipelines left to send to 'slot' */
 } *client;
 
 /* Threads. */
 
+/* Every thread performs its own share of the requests with its own clients
+ * and counters, so that the threads never contend for shared state while
+ * running. The latencies are stored in the thread slice of config.latency,
+ * so the report finds all of them merged. */
 typedef struct benchmarkThread {
     int index;
     pthread_t thread;
     aeEventLoop *el;
+    list *clients;
+    int requests;           /* Requests assigned to the thread */
+    int first_request;      /* Index of its first latency in config.latency */
+    int requests_issued;    /* Only accessed by the thread itself */
+    int requests_finished;  /* Also read by the other threads */
+    pthread_mutex_t requests_finished_mutex;    /* Used by atomicvar.h */
 } benchmarkThread;
 
 /* Cluster. */
 typedef struct clusterNode {
+    int index;  /* Index in config.cluster_nodes */
     char *ip;
     int port;
     sds name;
@@ -154,7 +190,6 @@ typedef struct clusterNode {
     sds replicate;  /* Master ID if node is a slave */
     int *slots;
     int slots_count;
-    int current_slot_index;
     int *updated_slots;         /* Used by updateClusterSlotsConfiguration */
     int updated_slots_count;    /* Used by updateClusterSlotsConfiguration */
     int replicas_count;
@@ -172,13 +207,48 @@ typedef struct redisConfig {
     sds appendonly;
 } redisConfig;
 
+/* Workload. */
+typedef struct workloadCommand {
+    sds *argv;
+    int argc;
+    sds line;       /* The command line as written, for the report. */
+    int weight;
+} workloadCommand;
+
+typedef struct workloadValueSize {
+    int weight;
+    int min;
+    int max;
+} workloadValueSize;
+
+typedef struct workload {
+    sds name;
+    workloadCommand commands[WORKLOAD_MAX_COMMANDS];
+    int numcommands;
+    long long commands_weight;  /* Sum of the weights of the commands. */
+    workloadValueSize sizes[WORKLOAD_MAX_COMMANDS];
+    int numsizes;
+    long long sizes_weight;     /* Sum of the weights of the value sizes. */
+    long long keyspace;
+    int distribution;           /* WORKLOAD_UNIFORM, _ZIPF or _HOTSPOT. */
+    double zipf_theta;          /* Zipf skew, and the constants derived from */
+    double zipf_zetan;          /* it and the keyspace length to generate */
+    double zipf_eta;            /* the distribution, see workloadPickKey(). */
+    double zipf_alpha;
+    double hot_keys;            /* Fraction of the keyspace that is hot. */
+    double hot_ops;             /* Fraction of the accesses to the hot keys. */
+    char *data;                 /* 'x' bytes, as many as the biggest value. */
+} workload;
+
 /* Prototypes */
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+static client createClient(char *cmd, size_t len, client from, int thread_id);
 static void createMissingClients(client c);
 static benchmarkThread *createBenchmarkThread(int index);
 static void freeBenchmarkThread(benchmarkThread *thread);
 static void freeBenchmarkThreads();
 static void *execBenchmarkThread(void *ptr);
+static void *execReshardThread(void *ptr);
 static clusterNode *createClusterNode(char *ip, int port);
 static redisConfig *getRedisConfig(const char *ip, int port,
                                    const char *hostsocket);
@@ -187,6 +257,7 @@ static int fetchClusterSlotsConfiguration(client c);
 static void updateClusterSlotsConfiguration();
 int showThroughput(struct aeEventLoop *eventLoop, long long id,
                    void *clientData);
+static int getRequestsFinished(void);
 
 /* Dict callbacks */
 static uint64_t dictSdsHash(const void *key);
@@ -313,28 +384,29 @@ static void freeClient(client c) {
     listNode *ln;
     aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
     aeDeleteFileEvent(el,c->context->fd,AE_READABLE);
+    if (c->send_timer != -1) aeDeleteTimeEvent(el,c->send_timer);
     if (c->thread_id >= 0) {
+        benchmarkThread *thread = config.threads[c->thread_id];
         int requests_finished = 0;
-        atomicGet(config.requests_finished, requests_finished);
-        if (requests_finished >= config.requests) {
-            aeStop(el);
-        }
+        atomicGet(thread->requests_finished, requests_finished);
+        if (requests_finished >= thread->requests) aeStop(el);
     }
+    list *clients = c->thread_id >= 0 ?
+                    config.threads[c->thread_id]->clients : config.clients;
     redisFree(c->context);
     sdsfree(c->obuf);
     zfree(c->randptr);
     zfree(c->stagptr);
+    zfree(c->workload_cmds);
     zfree(c);
-    if (config.num_threads) pthread_mutex_lock(&(config.liveclients_mutex));
-    config.liveclients--;
-    ln = listSearchKey(config.clients,c);
+    atomicDecr(config.liveclients, 1);
+    ln = listSearchKey(clients,c);
     assert(ln != NULL);
-    listDelNode(config.clients,ln);
-    if (config.num_threads) pthread_mutex_unlock(&(config.liveclients_mutex));
+    listDelNode(clients,ln);
 }
 
-static void freeAllClients(void) {
-    listNode *ln = config.clients->head, *next;
+static void freeClientsList(list *clients) {
+    listNode *ln = clients->head, *next;
 
     while(ln) {
         next = ln->next;
@@ -343,13 +415,24 @@ static void freeAllClients(void) {
     }
 }
 
+static void freeAllClients(void) {
+    int i;
+
+    freeClientsList(config.clients);
+    for (i = 0; config.threads && i < config.num_threads; i++)
+        freeClientsList(config.threads[i]->clients);
+}
+
 static void resetClient(client c) {
     aeEventLoop *el = CLIENT_GET_EVENTLOOP(c);
-    aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
-    aeDeleteFileEvent(el,c->context->fd,AE_READABLE);
-    aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
     c->written = 0;
     c->pending = config.pipeline;
+    /* The socket is almost always writable after a reply was read: write the
+     * next request right away, staying registered for reads, instead of
+     * switching the client to a write event for the next loop iteration.
+     * The write event is only used when the request is not written at once.
+     * Note that the client may be freed by writeHandler(). */
+    writeHandler(el,c->context->fd,c,AE_NONE);
 }
 
 static void randomizeClientKey(client c) {
@@ -370,12 +453,15 @@ static void randomizeClientKey(client c) {
     }
 }
 
+/* Set the hash tag of the keys of the next pipeline. The client keeps
+ * sending to the same slot of its node for --slot-batch pipelines, then
+ * picks another one at random, or the first slot of the node, that is the
+ * hot slot, for --hot-slot percent of the pipelines. */
 static void setClusterKeyHashTag(client c) {
     assert(c->thread_id >= 0);
     clusterNode *node = c->cluster_node;
     assert(node);
-    assert(node->current_slot_index < node->slots_count);
-    int is_updating_slots = 0;
+    int is_updating_slots = 0, last_update = 0;
     atomicGet(config.is_updating_slots, is_updating_slots);
     /* If updateClusterSlotsConfiguration is updating the slots array,
      * call updateClusterSlotsConfiguration is order to block the thread
@@ -384,7 +470,21 @@ static void setClusterKeyHashTag(client c) {
      * updateClusterSlotsConfiguration won't actually do anything, since
      * the updated_slots_count array will be already NULL. */
     if (is_updating_slots) updateClusterSlotsConfiguration();
-    int slot = node->slots[node->current_slot_index];
+    /* Don't keep sending to a slot that may have moved elsewhere. */
+    atomicGet(config.slots_last_update, last_update);
+    if (c->slot != -1 && c->slot_batch_left > 0 &&
+        c->slots_last_update == last_update)
+    {
+        c->slot_batch_left--;
+        return;
+    }
+    if (node->slots_count == 0) return;
+    int idx = 0;
+    if (config.hot_slot_perc == 0 || random() % 100 >= config.hot_slot_perc)
+        idx = random() % node->slots_count;
+    int slot = node->slots[idx];
+    c->slot = slot;
+    c->slot_batch_left = config.slot_batch-1;
     const char *tag = crc16_slot_table[slot];
     int taglen = strlen(tag);
     size_t i;
@@ -396,10 +496,265 @@ static void setClusterKeyHashTag(client c) {
     }
 }
 
+/* Return a random number between 0 and n-1, also for n > RAND_MAX. */
+static long long workloadRandom(long long n) {
+    unsigned long long r = ((unsigned long long)random() << 31) | random();
+    return r % n;
+}
+
+/* Return a random number in the [0,1) interval. */
+static double workloadRandomDouble(void) {
+    return (double)random()/((double)RAND_MAX+1);
+}
+
+/* Pick a key of the workload keyspace following its distribution.
+ *
+ * The Zipfian keys are generated with the method described in "Quickly
+ * Generating Billion-Record Synthetic Databases" by Gray et al., where the
+ * key N has a probability proportional to 1/(N+1)^theta: key 0 is the most
+ * accessed one, then key 1, and so forth. */
+static long long workloadPickKey(void) {
+    workload *w = config.workload;
+
+    if (w->distribution == WORKLOAD_ZIPF) {
+        double u = workloadRandomDouble();
+        double uz = u*w->zipf_zetan;
+        long long key;
+
+        if (uz < 1) return 0;
+        if (uz < 1+pow(0.5,w->zipf_theta)) return w->keyspace > 1;
+        key = (long long)(w->keyspace*pow(w->zipf_eta*u-w->zipf_eta+1,
+                                          w->zipf_alpha));
+        return key < w->keyspace ? key : w->keyspace-1;
+    } else if (w->distribution == WORKLOAD_HOTSPOT) {
+        long long hot = (long long)(w->keyspace*w->hot_keys);
+
+        if (hot < 1) hot = 1;
+        if (hot >= w->keyspace || workloadRandomDouble() < w->hot_ops)
+            return workloadRandom(hot);
+        return hot+workloadRandom(w->keyspace-hot);
+    }
+    return workloadRandom(w->keyspace);
+}
+
+/* Pick the size of a value following the weights of the value sizes. */
+static int workloadPickValueSize(void) {
+    workload *w = config.workload;
+    long long r = workloadRandom(w->sizes_weight);
+    int j;
+
+    for (j = 0; j < w->numsizes-1; j++) {
+        if (r < w->sizes[j].weight) break;
+        r -= w->sizes[j].weight;
+    }
+    return w->sizes[j].min+workloadRandom(w->sizes[j].max-w->sizes[j].min+1);
+}
+
+/* Pick the index of a command following the weights of the commands. */
+static int workloadPickCommand(void) {
+    workload *w = config.workload;
+    long long r = workloadRandom(w->commands_weight);
+    int j;
+
+    for (j = 0; j < w->numcommands-1; j++) {
+        if (r < w->commands[j].weight) break;
+        r -= w->commands[j].weight;
+    }
+    return j;
+}
+
+/* Append to 'buf' the argument 'arg' with every __rand_int__ replaced by a
+ * key picked with the workload distribution, and every __data__ replaced by
+ * a value of random size. */
+static sds workloadExpandArg(sds buf, const char *arg) {
+    const char *p;
+
+    while ((p = strstr(arg,"__")) != NULL) {
+        buf = sdscatlen(buf,arg,p-arg);
+        if (!strncmp(p,"__rand_int__",12)) {
+            char key[32];
+            int keylen = snprintf(key,sizeof(key),"%012lld",
+                                  workloadPickKey());
+            buf = sdscatlen(buf,key,keylen);
+            arg = p+12;
+        } else if (!strncmp(p,"__data__",8)) {
+            buf = sdscatlen(buf,config.workload->data,
+                            workloadPickValueSize());
+            arg = p+8;
+        } else {
+            buf = sdscatlen(buf,p,2);
+            arg = p+2;
+        }
+    }
+    return sdscat(buf,arg);
+}
+
+/* Generate the next pipeline of requests of the client, picking every
+ * command, key and value with the workload ratios and distributions. The
+ * prefix commands not sent yet are retained. */
+static void fillWorkloadRequests(client c) {
+    workload *w = config.workload;
+    sds arg = sdsempty();
+    int j, i;
+
+    sdssetlen(c->obuf,c->prefixlen);
+    c->obuf[c->prefixlen] = '\0';
+    for (j = 0; j < config.pipeline; j++) {
+        int idx = workloadPickCommand();
+        workloadCommand *wc = w->commands+idx;
+
+        c->workload_cmds[j] = idx;
+        c->obuf = sdscatfmt(c->obuf,"*%i\r\n",wc->argc);
+        for (i = 0; i < wc->argc; i++) {
+            sdsclear(arg);
+            arg = workloadExpandArg(arg,wc->argv[i]);
+            c->obuf = sdscatfmt(c->obuf,"$%u\r\n",
+                                (unsigned int)sdslen(arg));
+            c->obuf = sdscatsds(c->obuf,arg);
+            c->obuf = sdscatlen(c->obuf,"\r\n",2);
+        }
+    }
+    sdsfree(arg);
+}
+
+static void workloadError(const char *filename, int linenum, const char *err) {
+    fprintf(stderr,"Error in workload file %s, line %d: %s\n",
+            filename,linenum,err);
+    exit(1);
+}
+
+/* Load the workload file 'filename'. See the usage for its format. */
+static workload *loadWorkload(const char *filename) {
+    workload *w = zcalloc(sizeof(*w));
+    FILE *fp = fopen(filename,"r");
+    char buf[16384];
+    int linenum = 0, maxsize = 0, j;
+
+    if (fp == NULL) {
+        fprintf(stderr,"Can't open the workload file %s: %s\n",
+                filename,strerror(errno));
+        exit(1);
+    }
+    w->name = sdscatfmt(sdsempty(),"WORKLOAD %s",filename);
+    w->keyspace = config.randomkeys_keyspacelen ?
+                  config.randomkeys_keyspacelen : 100000;
+    w->distribution = WORKLOAD_UNIFORM;
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        int argc;
+        sds *argv;
+
+        linenum++;
+        argv = sdssplitargs(buf,&argc);
+        if (argv == NULL) workloadError(filename,linenum,"Unbalanced quotes");
+        if (argc == 0 || argv[0][0] == '#') {
+            sdsfreesplitres(argv,argc);
+            continue;
+        }
+        sdstolower(argv[0]);
+        if (!strcmp(argv[0],"name") && argc == 2) {
+            sdsfree(w->name);
+            w->name = sdsdup(argv[1]);
+        } else if (!strcmp(argv[0],"keyspace") && argc == 2) {
+            w->keyspace = strtoll(argv[1],NULL,10);
+            if (w->keyspace <= 0)
+                workloadError(filename,linenum,"Invalid keyspace length");
+        } else if (!strcmp(argv[0],"pipeline") && argc == 2) {
+            config.pipeline = atoi(argv[1]);
+            if (config.pipeline <= 0)
+                workloadError(filename,linenum,"Invalid pipeline length");
+        } else if (!strcmp(argv[0],"distribution") && argc >= 2) {
+            if (!strcasecmp(argv[1],"uniform") && argc == 2) {
+                w->distribution = WORKLOAD_UNIFORM;
+            } else if (!strcasecmp(argv[1],"zipf") && argc == 3) {
+                w->distribution = WORKLOAD_ZIPF;
+                w->zipf_theta = strtod(argv[2],NULL);
+                if (w->zipf_theta <= 0 || w->zipf_theta >= 1)
+                    workloadError(filename,linenum,
+                        "The zipf skew must be between 0 and 1 excluded");
+            } else if (!strcasecmp(argv[1],"hotspot") && argc == 4) {
+                w->distribution = WORKLOAD_HOTSPOT;
+                w->hot_keys = strtod(argv[2],NULL);
+                w->hot_ops = strtod(argv[3],NULL);
+                if (w->hot_keys <= 0 || w->hot_keys > 1 ||
+                    w->hot_ops < 0 || w->hot_ops > 1)
+                    workloadError(filename,linenum,
+                        "The hotspot fractions must be between 0 and 1");
+            } else {
+                workloadError(filename,linenum,"Invalid distribution");
+            }
+        } else if (!strcmp(argv[0],"valuesize") && (argc == 3 || argc == 4)) {
+            workloadValueSize *vs = w->sizes+w->numsizes;
+
+            if (w->numsizes == WORKLOAD_MAX_COMMANDS)
+                workloadError(filename,linenum,"Too many value sizes");
+            vs->weight = atoi(argv[1]);
+            vs->min = atoi(argv[2]);
+            vs->max = argc == 4 ? atoi(argv[3]) : vs->min;
+            if (vs->weight <= 0 || vs->min < 0 || vs->max < vs->min ||
+                vs->max > 512*1024*1024)
+                workloadError(filename,linenum,"Invalid value size");
+            if (vs->max > maxsize) maxsize = vs->max;
+            w->sizes_weight += vs->weight;
+            w->numsizes++;
+        } else if (!strcmp(argv[0],"command") && argc >= 3) {
+            workloadCommand *wc = w->commands+w->numcommands;
+
+            if (w->numcommands == WORKLOAD_MAX_COMMANDS)
+                workloadError(filename,linenum,"Too many commands");
+            wc->weight = atoi(argv[1]);
+            if (wc->weight <= 0)
+                workloadError(filename,linenum,"Invalid command weight");
+            wc->argc = argc-2;
+            wc->argv = zmalloc(sizeof(sds)*wc->argc);
+            wc->line = sdsempty();
+            for (j = 2; j < argc; j++) {
+                wc->argv[j-2] = sdsdup(argv[j]);
+                if (j > 2) wc->line = sdscatlen(wc->line," ",1);
+                wc->line = sdscatsds(wc->line,argv[j]);
+            }
+            w->commands_weight += wc->weight;
+            w->numcommands++;
+        } else {
+            workloadError(filename,linenum,
+                "Bad directive or wrong number of arguments");
+        }
+        sdsfreesplitres(argv,argc);
+    }
+    fclose(fp);
+    if (w->numcommands == 0)
+        workloadError(filename,linenum,"No commands in the workload");
+    if (w->numsizes == 0) {
+        w->sizes[0].weight = 1;
+        w->sizes[0].min = w->sizes[0].max = config.datasize;
+        w->sizes_weight = 1;
+        w->numsizes = 1;
+        maxsize = config.datasize;
+    }
+    w->data = zmalloc(maxsize+1);
+    memset(w->data,'x',maxsize);
+    if (w->distribution == WORKLOAD_ZIPF) {
+        double zeta2 = 1+pow(0.5,w->zipf_theta);
+        long long i;
+
+        for (i = 1; i <= w->keyspace; i++)
+            w->zipf_zetan += 1/pow(i,w->zipf_theta);
+        w->zipf_alpha = 1/(1-w->zipf_theta);
+        w->zipf_eta = (1-pow(2.0/w->keyspace,1-w->zipf_theta))/
+                      (1-zeta2/w->zipf_zetan);
+    }
+    return w;
+}
+
 static void clientDone(client c) {
-    int requests_finished = 0;
-    atomicGet(config.requests_finished, requests_finished);
-    if (requests_finished >= config.requests) {
+    int requests_finished = 0, requests = config.requests;
+    if (c->thread_id >= 0) {
+        benchmarkThread *thread = config.threads[c->thread_id];
+        atomicGet(thread->requests_finished, requests_finished);
+        requests = thread->requests;
+    } else {
+        atomicGet(config.requests_finished, requests_finished);
+    }
+    if (requests_finished >= requests) {
         freeClient(c);
         if (!config.num_threads && config.el) aeStop(config.el);
         return;
@@ -407,12 +762,8 @@ static void clientDone(client c) {
     if (config.keepalive) {
         resetClient(c);
     } else {
-        if (config.num_threads) pthread_mutex_lock(&(config.liveclients_mutex));
-        config.liveclients--;
-        createMissingClients(c);
-        config.liveclients++;
-        if (config.num_threads)
-            pthread_mutex_unlock(&(config.liveclients_mutex));
+        /* Replace the client with a new one in the same thread. */
+        createClient(NULL,0,c,c->thread_id);
         freeClient(c);
     }
 }
@@ -501,10 +852,33 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                     }
                     continue;
                 }
-                int requests_finished = 0;
-                atomicGetIncr(config.requests_finished, requests_finished, 1);
-                if (requests_finished < config.requests)
-                    config.latency[requests_finished] = c->latency;
+                /* Store the latency in the slot of the request, unless
+                 * it exceeds the requests to perform. */
+                int requests_finished = 0, idx = -1;
+                if (c->thread_id >= 0) {
+                    benchmarkThread *thread = config.threads[c->thread_id];
+                    atomicGetIncr(thread->requests_finished,
+                                  requests_finished, 1);
+                    if (requests_finished < thread->requests)
+                        idx = thread->first_request+requests_finished;
+                } else {
+                    atomicGetIncr(config.requests_finished,
+                                  requests_finished, 1);
+                    if (requests_finished < config.requests)
+                        idx = requests_finished;
+                }
+                if (idx != -1) {
+                    config.latency[idx] = c->latency;
+                    if (config.workload) {
+                        config.latency_cmd[idx] =
+                            c->workload_cmds[config.pipeline-c->pending];
+                    }
+                    if (c->cluster_node) {
+                        config.latency_slot[idx] = c->slot;
+                        config.latency_node[idx] =
+                            c->cluster_node->index;
+                    }
+                }
                 c->pending--;
                 if (c->pending == 0) {
                     clientDone(c);
@@ -517,29 +891,73 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* Timer handler of the open loop mode: the send time of the request of the
+ * client arrived, so we can start writing it. */
+static int scheduledSendHandler(aeEventLoop *el, long long id, void *privdata) {
+    client c = privdata;
+    UNUSED(id);
+
+    c->send_timer = -1;
+    aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
+    return AE_NOMORE;
+}
+
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     client c = privdata;
     UNUSED(el);
     UNUSED(fd);
-    UNUSED(mask);
 
     /* Initialize request when nothing was written. */
-    if (c->written == 0) {
+    if (c->written == 0 && !c->scheduled) {
         /* Enforce upper bound to number of requests. */
-        int requests_issued = 0;
-        atomicGetIncr(config.requests_issued, requests_issued, 1);
-        if (requests_issued >= config.requests) {
+        int requests_issued = 0, requests = config.requests;
+        if (c->thread_id >= 0) {
+            benchmarkThread *thread = config.threads[c->thread_id];
+            requests_issued = thread->requests_issued++;
+            requests = thread->requests;
+        } else {
+            atomicGetIncr(config.requests_issued, requests_issued, 1);
+        }
+        if (requests_issued >= requests) {
             freeClient(c);
             return;
         }
 
         /* Really initialize: randomize keys and set start time. */
-        if (config.randomkeys) randomizeClientKey(c);
+        if (config.workload) fillWorkloadRequests(c);
+        else if (config.randomkeys) randomizeClientKey(c);
         if (config.cluster_mode && c->staglen > 0) setClusterKeyHashTag(c);
         atomicGet(config.slots_last_update, c->slots_last_update);
-        c->start = ustime();
+        /* In the open loop mode the requests are sent at a fixed rate, and
+         * the latency is measured from the time the request should have
+         * been sent, not from the time a client was free to send it: this
+         * way the time a request waits because the previous ones are slow
+         * is accounted, instead of being hidden by the benchmark itself
+         * (coordinated omission). Every thread sends its share of the
+         * requests at the same share of the rate. */
+        if (config.rps) {
+            double rps = (double)config.rps*requests/config.requests;
+            c->start = config.start_us +
+                (long long)((double)requests_issued*config.pipeline*1e6/rps);
+            c->scheduled = 1;
+        } else {
+            c->start = ustime();
+        }
         c->latency = -1;
     }
+    if (c->scheduled) {
+        long long wait = c->start-ustime();
+        if (wait > 0) {
+            /* Too early: wait the send time with a timer. Timers have a
+             * millisecond resolution, so the last fraction of millisecond
+             * is waited polling with zero delay timers. */
+            aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
+            c->send_timer = aeCreateTimeEvent(el,wait/1000,
+                scheduledSendHandler,c,NULL);
+            return;
+        }
+        c->scheduled = 0;
+    }
     if (sdslen(c->obuf) > c->written) {
         void *ptr = c->obuf+c->written;
         ssize_t nwritten = write(c->context->fd,ptr,sdslen(c->obuf)-c->written);
@@ -551,8 +969,12 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
         c->written += nwritten;
         if (sdslen(c->obuf) == c->written) {
-            aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
-            aeCreateFileEvent(el,c->context->fd,AE_READABLE,readHandler,c);
+            if (mask & AE_WRITABLE) {
+                aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
+                aeCreateFileEvent(el,c->context->fd,AE_READABLE,readHandler,c);
+            }
+        } else if (!(mask & AE_WRITABLE)) {
+            aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
         }
     }
 }
@@ -615,6 +1037,13 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
         exit(1);
     }
     c->thread_id = thread_id;
+    c->scheduled = 0;
+    c->send_timer = -1;
+    c->workload_cmds = NULL;
+    if (config.workload)
+        c->workload_cmds = zcalloc(sizeof(int)*config.pipeline);
+    c->slot = -1;
+    c->slot_batch_left = 0;
     /* Suppress hiredis cleanup of unused buffers for max speed. */
     c->context->reader->maxbuf = 0;
 
@@ -669,8 +1098,9 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
     c->stagptr = NULL;
     c->staglen = 0;
 
-    /* Find substrings in the output buffer that need to be randomized. */
-    if (config.randomkeys) {
+    /* Find substrings in the output buffer that need to be randomized.
+     * Workload requests are instead generated from scratch every time. */
+    if (config.randomkeys && !config.workload) {
         if (from) {
             c->randlen = from->randlen;
             c->randfree = 0;
@@ -736,7 +1166,8 @@ static client createClient(char *cmd, size_t len, client from, int thread_id) {
     }
     if (config.idlemode == 0)
         aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
-    listAddNodeTail(config.clients,c);
+    listAddNodeTail(thread_id >= 0 ? config.threads[thread_id]->clients :
+                                     config.clients, c);
     atomicIncr(config.liveclients, 1);
     atomicGet(config.slots_last_update, c->slots_last_update);
     return c;
@@ -772,6 +1203,128 @@ static int ipow(int base, int exp) {
     return result;
 }
 
+/* Return the latency in milliseconds at the percentile 'perc' of the 'count'
+ * sorted latencies. */
+static double latencyPercentile(long long *latency, int count, double perc) {
+    return latency[(int)((count-1)*perc/100)]/1000.0;
+}
+
+/* Show the requests, throughput and latency of every master, and the
+ * slots that received the most requests. */
+static void showClusterReport(void) {
+    int requests = config.requests_finished;
+    if (requests > config.requests) requests = config.requests;
+    if (requests == 0) return;
+    float secs = (float)config.totlatency/1000;
+    long long *latency = zmalloc(sizeof(long long)*requests);
+    int i, m;
+
+    printf("  requests per node:\n");
+    for (m = 0; m < config.cluster_node_count; m++) {
+        clusterNode *node = config.cluster_nodes[m];
+        int count = 0;
+        for (i = 0; i < requests; i++) {
+            if (config.latency_node[i] == m)
+                latency[count++] = config.latency[i];
+        }
+        printf("    node [%d] %s:%d: ", m, node->ip, node->port);
+        if (count == 0) {
+            printf("no requests\n");
+            continue;
+        }
+        qsort(latency,count,sizeof(long long),compareLatency);
+        printf("%d requests (%.2f%%), %.2f requests per second, "
+               "latency p50 %.3f p99 %.3f max %.3f ms\n",
+               count, (float)count*100/requests, (float)count/secs,
+               latencyPercentile(latency,count,50),
+               latencyPercentile(latency,count,99),
+               latencyPercentile(latency,count,100));
+    }
+    zfree(latency);
+
+    if (config.top_slots > 0) {
+        long long *slot_requests = zcalloc(sizeof(long long)*CLUSTER_SLOTS);
+        long long *slot_latency = zcalloc(sizeof(long long)*CLUSTER_SLOTS);
+        short *slot_node = zmalloc(sizeof(short)*CLUSTER_SLOTS);
+        int slots = 0, top;
+        for (i = 0; i < requests; i++) {
+            int slot = config.latency_slot[i];
+            if (slot < 0) continue;
+            if (slot_requests[slot]++ == 0) slots++;
+            slot_latency[slot] += config.latency[i];
+            slot_node[slot] = config.latency_node[i];
+        }
+        printf("  requests per slot (%d slots used, top %d):\n",
+               slots, config.top_slots);
+        for (top = 0; top < config.top_slots; top++) {
+            int max = -1;
+            for (i = 0; i < CLUSTER_SLOTS; i++) {
+                if (slot_requests[i] &&
+                    (max == -1 || slot_requests[i] > slot_requests[max]))
+                    max = i;
+            }
+            if (max == -1) break;
+            printf("    slot %d (node [%d]): %lld requests (%.2f%%), "
+                   "%.2f requests per second, avg latency %.3f ms\n",
+                   max, slot_node[max], slot_requests[max],
+                   (float)slot_requests[max]*100/requests,
+                   (float)slot_requests[max]/secs,
+                   (double)slot_latency[max]/slot_requests[max]/1000);
+            slot_requests[max] = 0;
+        }
+        zfree(slot_requests);
+        zfree(slot_latency);
+        zfree(slot_node);
+    }
+    if (config.reshard_interval)
+        printf("  slots resharded during the run: %d\n",
+               config.slots_resharded);
+}
+
+/* Show the requests, throughput and latency of every command of the
+ * workload. In CSV mode every command gets its own line. */
+static void showWorkloadReport(void) {
+    workload *w = config.workload;
+    float secs = (float)config.totlatency/1000;
+    long long *latency = zmalloc(sizeof(long long)*config.requests);
+    int i, j;
+
+    if (!config.csv) printf("  requests per command:\n");
+    for (j = 0; j < w->numcommands; j++) {
+        workloadCommand *wc = w->commands+j;
+        int count = 0;
+
+        for (i = 0; i < config.requests; i++) {
+            if (config.latency_cmd[i] == j)
+                latency[count++] = config.latency[i];
+        }
+        if (count == 0) {
+            if (!config.csv)
+                printf("    [%d] %s: no requests\n", j, wc->line);
+            continue;
+        }
+        qsort(latency,count,sizeof(long long),compareLatency);
+        if (config.csv) {
+            printf("\"%s: %s\",\"%.2f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\"\n",
+                   w->name, wc->line, (float)count/secs,
+                   latencyPercentile(latency,count,50),
+                   latencyPercentile(latency,count,99),
+                   latencyPercentile(latency,count,99.9),
+                   latencyPercentile(latency,count,100));
+            continue;
+        }
+        printf("    [%d] %s: %d requests (%.2f%%), %.2f requests per second, "
+               "latency p50 %.3f p99 %.3f p99.9 %.3f max %.3f ms\n",
+               j, wc->line, count, (float)count*100/config.requests,
+               (float)count/secs,
+               latencyPercentile(latency,count,50),
+               latencyPercentile(latency,count,99),
+               latencyPercentile(latency,count,99.9),
+               latencyPercentile(latency,count,100));
+    }
+    zfree(latency);
+}
+
 static void showLatencyReport(void) {
     int i, curlat = 0;
     int usbetweenlat = ipow(10, MAX_LATENCY_PRECISION-config.precision);
@@ -785,6 +1338,8 @@ static void showLatencyReport(void) {
         printf("  %d parallel clients\n", config.numclients);
         printf("  %d bytes payload\n", config.datasize);
         printf("  keep alive: %d\n", config.keepalive);
+        if (config.rps)
+            printf("  open loop: %d requests per second\n", config.rps);
         if (config.cluster_mode) {
             printf("  cluster mode: yes (%d masters)\n",
                    config.cluster_node_count);
@@ -809,6 +1364,8 @@ static void showLatencyReport(void) {
         printf("  multi-thread: %s\n", (config.num_threads ? "yes" : "no"));
         if (config.num_threads)
             printf("  threads: %d\n", config.num_threads);
+        if (config.cluster_mode) showClusterReport();
+        if (config.workload) showWorkloadReport();
 
         printf("\n");
 
@@ -831,9 +1388,22 @@ static void showLatencyReport(void) {
                     curlat/pow(10.0, config.precision));
             }
         }
-        printf("%.2f requests per second\n\n", reqpersec);
+        printf("%.2f requests per second\n", reqpersec);
+        printf("latency percentiles: p50 %.3f p99 %.3f p99.9 %.3f "
+               "max %.3f milliseconds\n\n",
+               latencyPercentile(config.latency,config.requests,50),
+               latencyPercentile(config.latency,config.requests,99),
+               latencyPercentile(config.latency,config.requests,99.9),
+               latencyPercentile(config.latency,config.requests,100));
     } else if (config.csv) {
-        printf("\"%s\",\"%.2f\"\n", config.title, reqpersec);
+        qsort(config.latency,config.requests,sizeof(long long),compareLatency);
+        printf("\"%s\",\"%.2f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\"\n",
+               config.title, reqpersec,
+               latencyPercentile(config.latency,config.requests,50),
+               latencyPercentile(config.latency,config.requests,99),
+               latencyPercentile(config.latency,config.requests,99.9),
+               latencyPercentile(config.latency,config.requests,100));
+        if (config.workload) showWorkloadReport();
     } else {
         printf("%s: %.2f requests per second\n", config.title, reqpersec);
     }
@@ -875,10 +1445,27 @@ static void benchmark(char *title, char *cmd, int len) {
     c = createClient(cmd,len,NULL,thread_id);
     createMissingClients(c);
 
+    pthread_t reshard_thread;
+    config.slots_resharded = 0;
+    if (config.reshard_interval) {
+        config.reshard_stop = 0;
+        if (pthread_create(&reshard_thread,NULL,execReshardThread,NULL)) {
+            fprintf(stderr, "FATAL: Failed to start the reshard thread.\n");
+            exit(1);
+        }
+    }
+
     config.start = mstime();
+    config.start_us = ustime();
     if (!config.num_threads) aeMain(config.el);
     else startBenchmarkThreads();
     config.totlatency = mstime()-config.start;
+    if (config.num_threads) config.requests_finished = getRequestsFinished();
+
+    if (config.reshard_interval) {
+        atomicSet(config.reshard_stop, 1);
+        pthread_join(reshard_thread, NULL);
+    }
 
     showLatencyReport();
     freeAllClients();
@@ -887,17 +1474,36 @@ static void benchmark(char *title, char *cmd, int len) {
 
 /* Thread functions. */
 
+/* Return the index of the first request of the thread 'index'. The clients
+ * are assigned to the threads round robin, and every thread performs a
+ * share of the requests proportional to its clients. */
+static int threadFirstRequest(int index) {
+    int per_thread = config.numclients/config.num_threads;
+    int extra = config.numclients%config.num_threads;
+    long long clients = (long long)index*per_thread +
+                        (index < extra ? index : extra);
+    return (int)(clients*config.requests/config.numclients);
+}
+
 static benchmarkThread *createBenchmarkThread(int index) {
     benchmarkThread *thread = zmalloc(sizeof(*thread));
     if (thread == NULL) return NULL;
     thread->index = index;
     thread->el = aeCreateEventLoop(1024*10);
-    aeCreateTimeEvent(thread->el,1,showThroughput,NULL,NULL);
+    thread->clients = listCreate();
+    thread->first_request = threadFirstRequest(index);
+    thread->requests = threadFirstRequest(index+1)-thread->first_request;
+    thread->requests_issued = 0;
+    thread->requests_finished = 0;
+    pthread_mutex_init(&(thread->requests_finished_mutex), NULL);
+    aeCreateTimeEvent(thread->el,1,showThroughput,thread,NULL);
     return thread;
 }
 
 static void freeBenchmarkThread(benchmarkThread *thread) {
     if (thread->el) aeDeleteEventLoop(thread->el);
+    listRelease(thread->clients);
+    pthread_mutex_destroy(&(thread->requests_finished_mutex));
     zfree(thread);
 }
 
@@ -930,7 +1536,6 @@ static clusterNode *createClusterNode(char *ip, int port) {
     node->replicas_count = 0;
     node->slots = zmalloc(CLUSTER_SLOTS * sizeof(int));
     node->slots_count = 0;
-    node->current_slot_index = 0;
     node->updated_slots = NULL;
     node->updated_slots_count = 0;
     node->migrating = NULL;
@@ -977,6 +1582,7 @@ static clusterNode **addClusterNode(clusterNode *node) {
     config.cluster_nodes = zrealloc(config.cluster_nodes,
                                     count * sizeof(*node));
     if (!config.cluster_nodes) return NULL;
+    node->index = config.cluster_node_count;
     config.cluster_nodes[config.cluster_node_count++] = node;
     return config.cluster_nodes;
 }
@@ -1258,7 +1864,6 @@ static void updateClusterSlotsConfiguration() {
             int *oldslots = node->slots;
             node->slots = node->updated_slots;
             node->slots_count = node->updated_slots_count;
-            node->current_slot_index = 0;
             node->updated_slots = NULL;
             node->updated_slots_count = 0;
             zfree(oldslots);
@@ -1269,6 +1874,155 @@ static void updateClusterSlotsConfiguration() {
     pthread_mutex_unlock(&config.is_updating_slots_mutex);
 }
 
+/* Connect to a cluster node used to simulate the resharding, and
+ * authenticate if needed. Returns NULL on error. */
+static redisContext *connectToClusterNode(clusterNode *node) {
+    redisContext *ctx = redisConnect(node->ip, node->port);
+    if (ctx == NULL || ctx->err) {
+        fprintf(stderr, "Could not connect to Redis at %s:%d: %s\n",
+                node->ip, node->port, ctx ? ctx->errstr : "");
+        redisFree(ctx);
+        return NULL;
+    }
+    if (config.auth) {
+        redisReply *reply = redisCommand(ctx, "AUTH %s", config.auth);
+        int ok = (reply != NULL && reply->type != REDIS_REPLY_ERROR);
+        freeReplyObject(reply);
+        if (!ok) {
+            fprintf(stderr, "Could not authenticate to %s:%d\n",
+                    node->ip, node->port);
+            redisFree(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+/* Return the reply, or NULL after logging the error if the command failed. */
+static redisReply *reshardCheckReply(clusterNode *node, redisReply *reply) {
+    if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+        if (config.showerrors) {
+            printf("Reshard error from server %s:%d: %s\n",
+                   node->ip, node->port, reply ? reply->str : "I/O error");
+        }
+        freeReplyObject(reply);
+        return NULL;
+    }
+    return reply;
+}
+
+/* Move a random slot from a random master to another one while the
+ * benchmark is running, with the same steps redis-cli uses: the slot is set
+ * as importing in the target and migrating in the source, its keys are
+ * moved with MIGRATE, and finally the new owner is set in all the masters.
+ * The clients receive -ASK and -MOVED errors and fetch the new slots
+ * configuration in the meantime. Returns 1 if the slot was moved. */
+static int reshardRandomSlot(void) {
+    int count = config.cluster_node_count, slot = -1, moved = 0, i;
+    int src_idx = random() % count;
+    int dst_idx = (src_idx + 1 + random() % (count-1)) % count;
+    clusterNode *src = config.cluster_nodes[src_idx];
+    clusterNode *dst = config.cluster_nodes[dst_idx];
+    redisContext *srcctx = NULL, *dstctx = NULL;
+    redisReply *reply;
+
+    /* Never leave a master without slots. */
+    pthread_mutex_lock(&config.is_updating_slots_mutex);
+    if (src->slots_count > 1) slot = src->slots[random() % src->slots_count];
+    pthread_mutex_unlock(&config.is_updating_slots_mutex);
+    if (slot == -1 || src->name == NULL || dst->name == NULL) return 0;
+
+    if ((srcctx = connectToClusterNode(src)) == NULL) goto cleanup;
+    if ((dstctx = connectToClusterNode(dst)) == NULL) goto cleanup;
+    reply = redisCommand(dstctx, "CLUSTER SETSLOT %d IMPORTING %s",
+                         slot, src->name);
+    if ((reply = reshardCheckReply(dst, reply)) == NULL) goto cleanup;
+    freeReplyObject(reply);
+    reply = redisCommand(srcctx, "CLUSTER SETSLOT %d MIGRATING %s",
+                         slot, dst->name);
+    if ((reply = reshardCheckReply(src, reply)) == NULL) goto abort;
+    freeReplyObject(reply);
+
+    while (1) {
+        reply = redisCommand(srcctx, "CLUSTER GETKEYSINSLOT %d 100", slot);
+        if ((reply = reshardCheckReply(src, reply)) == NULL) goto abort;
+        if (reply->elements == 0) {
+            freeReplyObject(reply);
+            break;
+        }
+        int argc = 0, maxargc = 10 + reply->elements;
+        const char **argv = zmalloc(sizeof(char*)*maxargc);
+        char portstr[16];
+        snprintf(portstr, sizeof(portstr), "%d", dst->port);
+        argv[argc++] = "MIGRATE";
+        argv[argc++] = dst->ip;
+        argv[argc++] = portstr;
+        argv[argc++] = "";
+        argv[argc++] = "0";
+        argv[argc++] = "5000";
+        argv[argc++] = "REPLACE";
+        if (config.auth) {
+            argv[argc++] = "AUTH";
+            argv[argc++] = config.auth;
+        }
+        argv[argc++] = "KEYS";
+        for (i = 0; i < (int)reply->elements; i++)
+            argv[argc++] = reply->element[i]->str;
+        redisReply *migrate_reply = redisCommandArgv(srcctx, argc, argv, NULL);
+        zfree(argv);
+        freeReplyObject(reply);
+        if ((migrate_reply = reshardCheckReply(src, migrate_reply)) == NULL)
+            goto abort;
+        freeReplyObject(migrate_reply);
+    }
+
+    /* Set the new owner in the target first, so that the slot can't be
+     * left without owner. */
+    reply = redisCommand(dstctx, "CLUSTER SETSLOT %d NODE %s", slot, dst->name);
+    if ((reply = reshardCheckReply(dst, reply)) == NULL) goto abort;
+    freeReplyObject(reply);
+    moved = 1;
+    for (i = 0; i < count; i++) {
+        clusterNode *node = config.cluster_nodes[i];
+        if (node == dst) continue;
+        redisContext *ctx = (node == src) ? srcctx :
+                                            connectToClusterNode(node);
+        if (ctx == NULL) continue;
+        reply = redisCommand(ctx, "CLUSTER SETSLOT %d NODE %s",
+                             slot, dst->name);
+        freeReplyObject(reshardCheckReply(node, reply));
+        if (ctx != srcctx) redisFree(ctx);
+    }
+    goto cleanup;
+
+abort:
+    /* Leave the slot in the source if it was not possible to move it. */
+    reply = redisCommand(dstctx, "CLUSTER SETSLOT %d STABLE", slot);
+    freeReplyObject(reply);
+    reply = redisCommand(srcctx, "CLUSTER SETSLOT %d STABLE", slot);
+    freeReplyObject(reply);
+cleanup:
+    if (srcctx) redisFree(srcctx);
+    if (dstctx) redisFree(dstctx);
+    return moved;
+}
+
+/* Reshard a slot every --reshard milliseconds until the benchmark ends. */
+static void *execReshardThread(void *ptr) {
+    UNUSED(ptr);
+    int stop = 0;
+    while (1) {
+        long long start = mstime();
+        while (mstime()-start < config.reshard_interval) {
+            atomicGet(config.reshard_stop, stop);
+            if (stop) return NULL;
+            usleep(10000);
+        }
+        if (reshardRandomSlot()) atomicIncr(config.slots_resharded, 1);
+    }
+    return NULL;
+}
+
 /* Returns number of consumed options. */
 int parseOptions(int argc, const char **argv) {
     int i;
@@ -1361,6 +2115,30 @@ int parseOptions(int argc, const char **argv) {
             config.cluster_mode = 1;
         } else if (!strcmp(argv[i],"--enable-tracking")) {
             config.enable_tracking = 1;
+        } else if (!strcmp(argv[i],"--slot-batch")) {
+            if (lastarg) goto invalid;
+            config.slot_batch = atoi(argv[++i]);
+            if (config.slot_batch <= 0) config.slot_batch = 1;
+        } else if (!strcmp(argv[i],"--hot-slot")) {
+            if (lastarg) goto invalid;
+            config.hot_slot_perc = atoi(argv[++i]);
+            if (config.hot_slot_perc < 0) config.hot_slot_perc = 0;
+            if (config.hot_slot_perc > 100) config.hot_slot_perc = 100;
+        } else if (!strcmp(argv[i],"--top-slots")) {
+            if (lastarg) goto invalid;
+            config.top_slots = atoi(argv[++i]);
+            if (config.top_slots < 0) config.top_slots = 0;
+        } else if (!strcmp(argv[i],"--reshard")) {
+            if (lastarg) goto invalid;
+            config.reshard_interval = atoi(argv[++i]);
+            if (config.reshard_interval < 0) config.reshard_interval = 0;
+        } else if (!strcmp(argv[i],"--rps")) {
+            if (lastarg) goto invalid;
+            config.rps = atoi(argv[++i]);
+            if (config.rps < 0) config.rps = 0;
+        } else if (!strcmp(argv[i],"--workload")) {
+            if (lastarg) goto invalid;
+            config.workload_file = argv[++i];
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -1392,6 +2170,14 @@ usage:
 " --threads <num>    Enable multi-thread mode.\n"
 " --cluster          Enable cluster mode.\n"
 " --enable-tracking  Send CLIENT TRACKING on before starting benchmark.\n"
+" --slot-batch <num> In cluster mode, send <num> pipelines to the same slot\n"
+"                    before picking another slot of the node (default 1).\n"
+" --hot-slot <perc>  In cluster mode, send <perc> percent of the pipelines to\n"
+"                    the first slot of every node (default 0).\n"
+" --top-slots <num>  In cluster mode, show the <num> slots that received more\n"
+"                    requests (default 0).\n"
+" --reshard <ms>     In cluster mode, move a random slot with its keys to\n"
+"                    another master every <ms> milliseconds (default 0).\n"
 " -k <boolean>       1=keep alive 0=reconnect (default 1)\n"
 " -r <keyspacelen>   Use random keys for SET/GET/INCR, random values for SADD\n"
 "  Using this option the benchmark will expand the string __rand_int__\n"
@@ -1403,6 +2189,12 @@ usage:
 " -e                 If server replies with errors, show them on stdout.\n"
 "                    (no more than 1 error per second is displayed)\n"
 " -q                 Quiet. Just show query/sec values\n"
+" --workload <file>  Run the workload described in <file>, one directive per\n"
+"                    line (see the workload file format below).\n"
+" --rps <num>        Open loop: send <num> requests per second at a fixed\n"
+"                    rate, whatever the replies latency, and measure the\n"
+"                    latency from the time each request should have been\n"
+"                    sent (default 0, send a new request after each reply).\n"
 " --precision        Number of decimal places to display in latency output (default 0)\n"
 " --csv              Output in CSV format\n"
 " -l                 Loop. Run the tests forever\n"
@@ -1423,27 +2215,76 @@ usage:
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist __rand_int__\n\n"
 " On user specified command lines __rand_int__ is replaced with a random integer\n"
-" with a range of values selected by the -r option.\n"
+" with a range of values selected by the -r option.\n\n"
+    );
+    printf(
+"Workload file format:\n\n"
+" command <weight> <arg> ...     A command of the mix, sent <weight> times out\n"
+"                                of the sum of the weights of all the commands.\n"
+"                                __rand_int__ is replaced with a key and\n"
+"                                __data__ with a value.\n"
+" keyspace <len>                 Number of keys (default -r, or 100000).\n"
+" distribution uniform           Access every key with the same probability.\n"
+" distribution zipf <skew>       Zipfian accesses, skew between 0 and 1.\n"
+" distribution hotspot <k> <o>   Send the <o> fraction of the accesses to the\n"
+"                                <k> fraction of the keys.\n"
+" valuesize <weight> <min> [max] Values of <min> to <max> bytes, used <weight>\n"
+"                                times out of the sum of the weights of all the\n"
+"                                sizes (default -d).\n"
+" pipeline <num>                 Same as -P.\n"
+" name <name>                    Name of the workload in the report.\n\n"
+" For example:\n\n"
+"   name sessions\n"
+"   keyspace 1000000\n"
+"   distribution zipf 0.99\n"
+"   valuesize 90 100 500\n"
+"   valuesize 10 4096 16384\n"
+"   command 80 GET session:__rand_int__\n"
+"   command 15 SET session:__rand_int__ __data__\n"
+"   command 5 EXPIRE session:__rand_int__ 3600\n"
     );
     exit(exit_status);
 }
 
+/* Return the requests finished so far, by all the threads. */
+static int getRequestsFinished(void) {
+    int requests_finished = 0, i;
+
+    if (!config.num_threads) {
+        atomicGet(config.requests_finished, requests_finished);
+        return requests_finished;
+    }
+    for (i = 0; i < config.num_threads; i++) {
+        benchmarkThread *thread = config.threads[i];
+        int thread_finished = 0;
+        atomicGet(thread->requests_finished, thread_finished);
+        if (thread_finished > thread->requests)
+            thread_finished = thread->requests;
+        requests_finished += thread_finished;
+    }
+    return requests_finished;
+}
+
 int showThroughput(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    benchmarkThread *thread = clientData;
     UNUSED(eventLoop);
     UNUSED(id);
-    UNUSED(clientData);
     int liveclients = 0;
     int requests_finished = 0;
     atomicGet(config.liveclients, liveclients);
-    atomicGet(config.requests_finished, requests_finished);
+    requests_finished = getRequestsFinished();
 
-    if (liveclients == 0 && requests_finished != config.requests) {
+    if (liveclients == 0 && requests_finished < config.requests) {
         fprintf(stderr,"All clients disconnected... aborting.\n");
         exit(1);
     }
-    if (config.num_threads && requests_finished >= config.requests) {
-        aeStop(eventLoop);
-        return AE_NOMORE;
+    if (thread) {
+        int thread_finished = 0;
+        atomicGet(thread->requests_finished, thread_finished);
+        if (thread_finished >= thread->requests) {
+            aeStop(eventLoop);
+            return AE_NOMORE;
+        }
     }
     if (config.csv) return 250;
     if (config.idlemode == 1) {
@@ -1517,12 +2358,38 @@ int main(int argc, const char **argv) {
     config.is_updating_slots = 0;
     config.slots_last_update = 0;
     config.enable_tracking = 0;
+    config.slot_batch = 1;
+    config.hot_slot_perc = 0;
+    config.top_slots = 0;
+    config.reshard_interval = 0;
+    config.reshard_stop = 0;
+    config.slots_resharded = 0;
+    config.rps = 0;
+    config.workload_file = NULL;
+    config.workload = NULL;
+    config.latency_cmd = NULL;
+    config.latency_slot = NULL;
+    config.latency_node = NULL;
 
     i = parseOptions(argc,argv);
     argc -= i;
     argv += i;
 
+    if (config.workload_file) {
+        if (config.cluster_mode) {
+            fprintf(stderr, "Workloads are not supported in cluster mode.\n");
+            exit(1);
+        }
+        config.workload = loadWorkload(config.workload_file);
+        config.latency_cmd = zmalloc(sizeof(short)*config.requests);
+    }
     config.latency = zmalloc(sizeof(long long)*config.requests);
+    if (config.cluster_mode) {
+        config.latency_slot = zmalloc(sizeof(short)*config.requests);
+        config.latency_node = zmalloc(sizeof(short)*config.requests);
+    } else {
+        config.reshard_interval = 0;
+    }
 
     if (config.cluster_mode) {
         /* Fetch cluster configuration. */
@@ -1578,6 +2445,8 @@ int main(int argc, const char **argv) {
         pthread_mutex_init(&(config.is_updating_slots_mutex), NULL);
         pthread_mutex_init(&(config.updating_slots_mutex), NULL);
         pthread_mutex_init(&(config.slots_last_update_mutex), NULL);
+        pthread_mutex_init(&(config.reshard_stop_mutex), NULL);
+        pthread_mutex_init(&(config.slots_resharded_mutex), NULL);
     }
 
     if (config.keepalive == 0) {
@@ -1598,6 +2467,16 @@ int main(int argc, const char **argv) {
         /* and will wait for every */
     }
 
+    /* Run the workload loaded from file. */
+    if (config.workload) {
+        do {
+            benchmark(config.workload->name,"",0);
+        } while(config.loop);
+
+        if (config.redis_config != NULL) freeRedisConfig(config.redis_config);
+        return 0;
+    }
+
     /* Run benchmark with command in the remainder of the arguments. */
     if (argc) {
         sds title = sdsnew(argv[0]);
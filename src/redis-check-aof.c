@@ -30,115 +30,282 @@
 
 #include "server.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
-#define ERROR(...) { \
+/* The AOF is memory mapped and split in chunks validated in parallel, one
+ * per thread. A thread can't know where the first command of its chunk
+ * starts, so it guesses it (the first "*" after a "\r\n"), then validates
+ * all the commands starting inside its chunk. The chunks are then joined in
+ * order: when a chunk did not start from where the previous one ended, the
+ * guess was wrong, and the chunk is validated again from the right place.
+ * MULTI and EXEC are just collected by the threads, and checked in order
+ * at the end. */
+#define AOF_CHECK_MIN_CHUNK (16*1024*1024)
+/* The tests set this environment variable to a tiny chunk size, so that the
+ * chunks are used with small AOF files, on any number of CPUs. */
+#define AOF_CHECK_MIN_CHUNK_ENV "REDIS_CHECK_AOF_MIN_CHUNK"
+#define AOF_CHECK_MAX_THREADS 16
+
+/* A MULTI or EXEC command found in the AOF. */
+typedef struct aofTxCommand {
+    off_t pos;
+    int exec;
+} aofTxCommand;
+
+typedef struct aofChunk {
+    const char *aof;            /* The whole mapped AOF... */
+    off_t size;                 /* ... and its size. */
+    off_t start;                /* Commands starting from 'start' to 'end'. */
+    off_t end;                  /* are validated by this chunk. */
+    off_t first;                /* Where the validation started. */
+    off_t last;                 /* Where it stopped: the first command after
+                                   'end', or the position of an error. */
+    int err;                    /* Stopped because of an error. */
+    char error[1044];
+    aofTxCommand *tx;           /* MULTI and EXEC commands found. */
+    size_t numtx;
+    pthread_t thread;
+} aofChunk;
+
+#define ERROR(chunk, pos, ...) { \
     char __buf[1024]; \
     snprintf(__buf, sizeof(__buf), __VA_ARGS__); \
-    snprintf(error, sizeof(error), "0x%16llx: %s", (long long)epos, __buf); \
+    snprintf((chunk)->error, sizeof((chunk)->error), "0x%16llx: %s", \
+        (long long)(pos), __buf); \
 }
 
-static char error[1044];
-static off_t epos;
+/* Read the "<prefix><number>\r\n" line at *pos, advancing *pos. Returns 0
+ * on errors. Running out of data is an error without a message. */
+static int readLong(aofChunk *chunk, off_t *pos, char prefix, long *target) {
+    const char *p = chunk->aof+*pos, *end = chunk->aof+chunk->size;
 
-int consumeNewline(char *buf) {
-    if (strncmp(buf,"\r\n",2) != 0) {
-        ERROR("Expected \\r\\n, got: %02x%02x",buf[0],buf[1]);
+    if (p >= end) return 0;
+    if (*p != prefix) {
+        ERROR(chunk,*pos,"Expected prefix '%c', got: '%c'",prefix,*p);
         return 0;
     }
-    return 1;
-}
-
-int readLong(FILE *fp, char prefix, long *target) {
-    char buf[128], *eptr;
-    epos = ftello(fp);
-    if (fgets(buf,sizeof(buf),fp) == NULL) {
+    /* The line must end before the end of the mapping. */
+    const char *nl = memchr(p,'\n',end-p < 128 ? end-p : 128);
+    if (nl == NULL) {
+        if (end-p >= 128) ERROR(chunk,*pos,"Line too long");
         return 0;
     }
-    if (buf[0] != prefix) {
-        ERROR("Expected prefix '%c', got: '%c'",prefix,buf[0]);
+    /* The mapping is not NUL terminated: parse just the digits before the
+     * newline. */
+    const char *q = p+1;
+    int neg = 0;
+    long v = 0;
+    if (*q == '-') {
+        neg = 1;
+        q++;
+    }
+    if (q == nl || *q < '0' || *q > '9') {
+        ERROR(chunk,*pos,"Expected a number, got: %02x",(unsigned char)*q);
         return 0;
     }
-    *target = strtol(buf+1,&eptr,10);
-    return consumeNewline(eptr);
-}
-
-int readBytes(FILE *fp, char *target, long length) {
-    long real;
-    epos = ftello(fp);
-    real = fread(target,1,length,fp);
-    if (real != length) {
-        ERROR("Expected to read %ld bytes, got %ld bytes",length,real);
+    while (q < nl && *q >= '0' && *q <= '9') {
+        if (v > (LONG_MAX-(*q-'0'))/10) {
+            ERROR(chunk,*pos,"Number out of range");
+            return 0;
+        }
+        v = v*10+(*q-'0');
+        q++;
+    }
+    if (q+1 != nl || q[0] != '\r') {
+        ERROR(chunk,*pos,"Expected \\r\\n, got: %02x%02x",
+            (unsigned char)q[0],q+1 < end ? (unsigned char)q[1] : 0);
         return 0;
     }
+    *target = neg ? -v : v;
+    *pos = nl+1-chunk->aof;
     return 1;
 }
 
-int readString(FILE *fp, char** target) {
-    long len;
-    *target = NULL;
-    if (!readLong(fp,'$',&len)) {
-        return 0;
-    }
+/* Validate the command at 'pos'. Returns the position of the next one, or
+ * -1 on errors. MULTI and EXEC are added to the chunk. */
+static off_t checkCommand(aofChunk *chunk, off_t pos) {
+    off_t cmdpos = pos;
+    long argc, len, i;
 
-    /* Increase length to also consume \r\n */
-    len += 2;
-    *target = (char*)zmalloc(len);
-    if (!readBytes(fp,*target,len)) {
-        return 0;
+    if (!readLong(chunk,&pos,'*',&argc)) return -1;
+    for (i = 0; i < argc; i++) {
+        off_t strpos = pos;
+
+        if (!readLong(chunk,&pos,'$',&len)) return -1;
+        if (len < 0 || chunk->size-pos < len+2) {
+            ERROR(chunk,pos,"Expected to read %ld bytes, got %ld bytes",
+                len+2,(long)(chunk->size-pos));
+            return -1;
+        }
+        if (chunk->aof[pos+len] != '\r' || chunk->aof[pos+len+1] != '\n') {
+            ERROR(chunk,strpos,"Expected \\r\\n, got: %02x%02x",
+                (unsigned char)chunk->aof[pos+len],
+                (unsigned char)chunk->aof[pos+len+1]);
+            return -1;
+        }
+        if (i == 0 && (len == 4 || len == 5)) {
+            int multi = len == 5 && !strncasecmp(chunk->aof+pos,"multi",5);
+            int exec = len == 4 && !strncasecmp(chunk->aof+pos,"exec",4);
+
+            if (multi || exec) {
+                chunk->tx = zrealloc(chunk->tx,
+                                     sizeof(aofTxCommand)*(chunk->numtx+1));
+                chunk->tx[chunk->numtx].pos = cmdpos;
+                chunk->tx[chunk->numtx].exec = exec;
+                chunk->numtx++;
+            }
+        }
+        pos += len+2;
     }
-    if (!consumeNewline(*target+len-2)) {
-        return 0;
+    return pos;
+}
+
+/* Validate the commands starting from 'from' till the end of the chunk. */
+static void checkChunkFrom(aofChunk *chunk, off_t from) {
+    off_t pos = from;
+
+    chunk->first = from;
+    chunk->err = 0;
+    chunk->error[0] = '\0';
+    chunk->numtx = 0;
+    while (pos < chunk->end) {
+        off_t next = checkCommand(chunk,pos);
+        if (next == -1) {
+            chunk->err = 1;
+            break;
+        }
+        pos = next;
     }
-    (*target)[len-2] = '\0';
-    return 1;
+    chunk->last = pos;
 }
 
-int readArgc(FILE *fp, long *target) {
-    return readLong(fp,'*',target);
+static void *checkChunkThread(void *arg) {
+    aofChunk *chunk = arg;
+    const char *p = chunk->aof+chunk->start;
+    const char *end = chunk->aof+chunk->end;
+
+    /* Guess where the first command starts. */
+    while (p < end && !(p[0] == '*' && p[-1] == '\n' && p[-2] == '\r')) {
+        p = memchr(p+1,'*',end-p-1);
+        if (p == NULL) p = end;
+    }
+    checkChunkFrom(chunk,p-chunk->aof);
+    return NULL;
 }
 
-off_t process(FILE *fp) {
-    long argc;
-    off_t pos = 0;
-    int i, multi = 0;
-    char *str;
-
-    while(1) {
-        if (!multi) pos = ftello(fp);
-        if (!readArgc(fp, &argc)) break;
-
-        for (i = 0; i < argc; i++) {
-            if (!readString(fp,&str)) break;
-            if (i == 0) {
-                if (strcasecmp(str, "multi") == 0) {
-                    if (multi++) {
-                        ERROR("Unexpected MULTI");
-                        break;
-                    }
-                } else if (strcasecmp(str, "exec") == 0) {
-                    if (--multi) {
-                        ERROR("Unexpected EXEC");
-                        break;
-                    }
-                }
-            }
-            zfree(str);
+/* Validate the AOF commands from 'start' on. Returns the position the AOF
+ * is valid up to: the end of the last valid command not inside a MULTI. */
+off_t process(FILE *fp, off_t start, off_t size) {
+    int numchunks, j, multi = 0;
+    off_t pos, multipos = 0, okpos;
+    aofChunk *chunks, *failed = NULL;
+    char *aof;
+
+    aof = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+    if (aof == MAP_FAILED) {
+        printf("Cannot map the AOF file: %s\n", strerror(errno));
+        exit(1);
+    }
+    madvise(aof,size,MADV_SEQUENTIAL);
+
+    const char *minchunkenv = getenv(AOF_CHECK_MIN_CHUNK_ENV);
+    long long minchunk = AOF_CHECK_MIN_CHUNK;
+    if (minchunkenv) {
+        minchunk = strtoll(minchunkenv,NULL,10);
+        if (minchunk < 1) minchunk = 1;
+        numchunks = AOF_CHECK_MAX_THREADS;
+    } else {
+        numchunks = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numchunks > AOF_CHECK_MAX_THREADS)
+            numchunks = AOF_CHECK_MAX_THREADS;
+    }
+    if (numchunks > (size-start)/minchunk)
+        numchunks = (size-start)/minchunk;
+    if (numchunks < 1) numchunks = 1;
+    if (numchunks > 1)
+        printf("Checking the AOF commands in %d chunks\n", numchunks);
+
+    chunks = zcalloc(sizeof(aofChunk)*numchunks);
+    for (j = 0; j < numchunks; j++) {
+        aofChunk *chunk = chunks+j;
+
+        chunk->aof = aof;
+        chunk->size = size;
+        chunk->start = start+(size-start)/numchunks*j;
+        chunk->end = (j == numchunks-1) ? size :
+                     start+(size-start)/numchunks*(j+1);
+        if (j == 0) {
+            checkChunkFrom(chunk,start);
+        } else if (pthread_create(&chunk->thread,NULL,checkChunkThread,
+                                  chunk) != 0)
+        {
+            printf("Cannot create a thread\n");
+            exit(1);
         }
+    }
+    for (j = 1; j < numchunks; j++) pthread_join(chunks[j].thread,NULL);
+
+    /* Join the chunks in order. */
+    pos = start;
+    for (j = 0; j < numchunks; j++) {
+        aofChunk *chunk = chunks+j;
 
-        /* Stop if the loop did not finish */
-        if (i < argc) {
-            if (str) zfree(str);
+        if (pos >= chunk->end) {
+            /* Covered by a command of a previous chunk. */
+            chunk->numtx = 0;
+            continue;
+        }
+        if (chunk->first != pos) checkChunkFrom(chunk,pos);
+        pos = chunk->last;
+        if (chunk->err) {
+            failed = chunk;
             break;
         }
     }
 
-    if (feof(fp) && multi && strlen(error) == 0) {
-        ERROR("Reached EOF before reading EXEC for MULTI");
+    /* Check MULTI and EXEC, up to the first invalid command. */
+    okpos = pos;
+    for (j = 0; j < numchunks; j++) {
+        aofChunk *chunk = chunks+j;
+
+        for (size_t i = 0; i < chunk->numtx; i++) {
+            aofTxCommand *tx = chunk->tx+i;
+
+            if (tx->pos >= okpos) break;
+            if (!tx->exec && multi++) {
+                failed = chunk;
+                ERROR(chunk,tx->pos,"Unexpected MULTI");
+                okpos = multipos;
+                multi = 0;
+                break;
+            } else if (!tx->exec) {
+                multipos = tx->pos;
+            } else if (--multi) {
+                failed = chunk;
+                ERROR(chunk,tx->pos,"Unexpected EXEC");
+                okpos = tx->pos;
+                multi = 0;
+                break;
+            }
+        }
+    }
+    if (multi) {
+        /* A transaction was not terminated. */
+        okpos = multipos;
+        if (failed == NULL) {
+            failed = chunks;
+            ERROR(failed,size,"Reached EOF before reading EXEC for MULTI");
+        }
     }
-    if (strlen(error) > 0) {
-        printf("%s\n", error);
+    if (failed && strlen(failed->error) > 0) {
+        printf("%s\n", failed->error);
     }
-    return pos;
+
+    for (j = 0; j < numchunks; j++) zfree(chunks[j].tx);
+    zfree(chunks);
+    munmap(aof,size);
+    return okpos;
 }
 
 int redis_check_aof_main(int argc, char **argv) {
@@ -199,7 +366,7 @@ int redis_check_aof_main(int argc, char **argv) {
         }
     }
 
-    off_t pos = process(fp);
+    off_t pos = process(fp,ftello(fp),size);
     off_t diff = size-pos;
     printf("AOF analyzed: size=%lld, ok_up_to=%lld, diff=%lld\n",
         (long long) size, (long long) pos, (long long) diff);
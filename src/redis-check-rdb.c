@@ -34,6 +34,7 @@
 
 void createSharedObjects(void);
 void rdbLoadProgressCallback(rio *r, const void *buf, size_t len);
+void rdbCheckInfo(const char *fmt, ...);
 int rdbCheckMode = 0;
 
 struct {
@@ -85,9 +86,380 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "set-listpack",
+    "stream-v2",
+    "string-roaring",
+    "stream-v3"
 };
 
+/* Offline analysis of the RDB, enabled by --analyze or --export: the memory
+ * every key would use once loaded is estimated like MEMORY USAGE does, and
+ * accounted by type and encoding, by TTL and by key prefix. With --export
+ * every key is also written to a columnar file, see rdbExportFlush(). */
+#define RDB_ANALYZE_DEF_SEPARATOR ":"
+#define RDB_ANALYZE_DEF_TOP 10
+#define RDB_ANALYZE_MAX_GROUPS 10000    /* Prefixes tracked, then 'other'. */
+#define RDB_EXPORT_BLOCK_ROWS 65536
+
+/* Keys and memory of a group of keys. */
+typedef struct rdbAnalyzeGroup {
+    sds name;
+    unsigned long long keys;
+    unsigned long long bytes;
+} rdbAnalyzeGroup;
+
+/* One of the biggest keys. */
+typedef struct rdbAnalyzeBigKey {
+    sds key;
+    int dbid;
+    const char *type;
+    unsigned long long bytes;
+    unsigned long long elements;
+} rdbAnalyzeBigKey;
+
+/* TTL buckets: the upper bound of every bucket, in seconds. */
+static long long rdbAnalyzeTTLBounds[] = {3600, 86400, 86400*7, 86400*30};
+static char *rdbAnalyzeTTLNames[] = {
+    "no expire", "already expired", "< 1 hour", "< 1 day", "< 7 days",
+    "< 30 days", ">= 30 days"
+};
+#define RDB_ANALYZE_TTL_BUCKETS 7
+
+struct {
+    int enabled;
+    sds separator;                  /* Chars ending the prefix of a key. */
+    int top;                        /* Number of biggest keys to report. */
+    unsigned long long keys;
+    unsigned long long bytes;
+    dict *encodings;                /* "type encoding" -> rdbAnalyzeGroup. */
+    dict *prefixes;                 /* "type\0prefix" -> rdbAnalyzeGroup. */
+    unsigned long long other_keys;  /* Keys not in 'prefixes', too many... */
+    unsigned long long other_bytes; /* ... prefixes were already seen. */
+    rdbAnalyzeGroup ttl[RDB_ANALYZE_TTL_BUCKETS];
+    rdbAnalyzeBigKey *topkeys;         /* Biggest keys, from the biggest. */
+    int numtop;
+
+    /* Columnar export. */
+    FILE *export_fp;
+    char *export_filename;
+    uint32_t rows;                  /* Rows of the block being built. */
+    uint16_t *col_db;
+    uint8_t *col_type;
+    uint8_t *col_encoding;
+    uint64_t *col_bytes;
+    uint64_t *col_elements;
+    int64_t *col_expire;
+    uint32_t *col_keylen;
+    sds col_keys;
+} rdbanalysis;
+
+static void rdbAnalyzeGroupDestructor(void *privdata, void *val) {
+    rdbAnalyzeGroup *g = val;
+    UNUSED(privdata);
+
+    sdsfree(g->name);
+    zfree(g);
+}
+
+static dictType rdbAnalyzeGroupsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    rdbAnalyzeGroupDestructor   /* val destructor */
+};
+
+/* Account 'bytes' to the group 'name' (of 'namelen' bytes) of 'groups',
+ * with 'label' as its printable name, that is taken or freed. Returns 0 if
+ * the group did not exist and there are already too many groups. */
+static int rdbAnalyzeAddToGroup(dict *groups, char *name, size_t namelen,
+                                sds label, unsigned long long bytes)
+{
+    sds groupname = sdsnewlen(name,namelen);
+    rdbAnalyzeGroup *g;
+    dictEntry *de;
+
+    if ((de = dictFind(groups,groupname)) != NULL) {
+        g = dictGetVal(de);
+        sdsfree(groupname);
+        sdsfree(label);
+    } else if (dictSize(groups) < RDB_ANALYZE_MAX_GROUPS) {
+        g = zcalloc(sizeof(*g));
+        g->name = label;
+        dictAdd(groups,groupname,g);
+    } else {
+        sdsfree(groupname);
+        sdsfree(label);
+        return 0;
+    }
+    g->keys++;
+    g->bytes += bytes;
+    return 1;
+}
+
+static unsigned long long rdbAnalyzeElements(robj *o) {
+    switch(o->type) {
+    case OBJ_STRING: return stringObjectLen(o);
+    case OBJ_LIST: return listTypeLength(o);
+    case OBJ_SET: return setTypeSize(o);
+    case OBJ_ZSET: return zsetLength(o);
+    case OBJ_HASH: return hashTypeLength(o);
+    case OBJ_STREAM: return ((stream*)o->ptr)->length;
+    default: return 0;
+    }
+}
+
+/* Write the block of rows built so far to the export file. The file is the
+ * signature "REDISCOLS1" followed by blocks, the last one with zero rows.
+ * Every block is the number of rows followed by the columns, with a value
+ * for every row in little endian: db (uint16), type (uint8, the OBJ_*
+ * type), encoding (uint8, the OBJ_ENCODING_* encoding), estimated memory
+ * (uint64), elements (uint64), expire in unix time milliseconds or -1
+ * (int64), key length (uint32), and finally the keys one after the other. */
+static void rdbExportFlush(void) {
+    uint32_t rows = rdbanalysis.rows, j;
+    FILE *fp = rdbanalysis.export_fp;
+
+    for (j = 0; j < rows; j++) {
+        memrev16ifbe(rdbanalysis.col_db+j);
+        memrev64ifbe(rdbanalysis.col_bytes+j);
+        memrev64ifbe(rdbanalysis.col_elements+j);
+        memrev64ifbe(rdbanalysis.col_expire+j);
+        memrev32ifbe(rdbanalysis.col_keylen+j);
+    }
+    memrev32ifbe(&rows);
+    if (fwrite(&rows,sizeof(rows),1,fp) != 1 ||
+        fwrite(rdbanalysis.col_db,sizeof(uint16_t),rdbanalysis.rows,fp) !=
+            rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_type,1,rdbanalysis.rows,fp) !=
+            rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_encoding,1,rdbanalysis.rows,fp) !=
+            rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_bytes,sizeof(uint64_t),rdbanalysis.rows,fp) !=
+            rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_elements,sizeof(uint64_t),rdbanalysis.rows,fp)
+            != rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_expire,sizeof(int64_t),rdbanalysis.rows,fp) !=
+            rdbanalysis.rows ||
+        fwrite(rdbanalysis.col_keylen,sizeof(uint32_t),rdbanalysis.rows,fp)
+            != rdbanalysis.rows ||
+        (sdslen(rdbanalysis.col_keys) &&
+         fwrite(rdbanalysis.col_keys,sdslen(rdbanalysis.col_keys),1,fp) != 1))
+    {
+        fprintf(stderr,"Error writing %s: %s\n",
+            rdbanalysis.export_filename, strerror(errno));
+        exit(1);
+    }
+    rdbanalysis.rows = 0;
+    sdsclear(rdbanalysis.col_keys);
+}
+
+static void rdbExportKey(int dbid, robj *key, robj *val,
+                         unsigned long long bytes,
+                         unsigned long long elements, long long expiretime)
+{
+    uint32_t row = rdbanalysis.rows++;
+
+    rdbanalysis.col_db[row] = dbid;
+    rdbanalysis.col_type[row] = val->type;
+    rdbanalysis.col_encoding[row] = val->encoding;
+    rdbanalysis.col_bytes[row] = bytes;
+    rdbanalysis.col_elements[row] = elements;
+    rdbanalysis.col_expire[row] = expiretime;
+    rdbanalysis.col_keylen[row] = sdslen(key->ptr);
+    rdbanalysis.col_keys = sdscatsds(rdbanalysis.col_keys,key->ptr);
+    if (rdbanalysis.rows == RDB_EXPORT_BLOCK_ROWS) rdbExportFlush();
+}
+
+static void rdbAnalyzeInit(void) {
+    if (rdbanalysis.separator == NULL)
+        rdbanalysis.separator = sdsnew(RDB_ANALYZE_DEF_SEPARATOR);
+    rdbanalysis.encodings = dictCreate(&rdbAnalyzeGroupsDictType,NULL);
+    rdbanalysis.prefixes = dictCreate(&rdbAnalyzeGroupsDictType,NULL);
+    rdbanalysis.topkeys = zmalloc(sizeof(rdbAnalyzeBigKey)*
+                                  (rdbanalysis.top ? rdbanalysis.top : 1));
+    if (rdbanalysis.export_filename) {
+        rdbanalysis.export_fp = fopen(rdbanalysis.export_filename,"w");
+        if (rdbanalysis.export_fp == NULL) {
+            fprintf(stderr,"Can't open %s: %s\n",
+                rdbanalysis.export_filename, strerror(errno));
+            exit(1);
+        }
+        if (fwrite("REDISCOLS1",10,1,rdbanalysis.export_fp) != 1) {
+            fprintf(stderr,"Error writing %s: %s\n",
+                rdbanalysis.export_filename, strerror(errno));
+            exit(1);
+        }
+        rdbanalysis.col_db = zmalloc(sizeof(uint16_t)*RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_type = zmalloc(RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_encoding = zmalloc(RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_bytes = zmalloc(sizeof(uint64_t)*RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_elements =
+            zmalloc(sizeof(uint64_t)*RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_expire = zmalloc(sizeof(int64_t)*RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_keylen =
+            zmalloc(sizeof(uint32_t)*RDB_EXPORT_BLOCK_ROWS);
+        rdbanalysis.col_keys = sdsempty();
+    }
+}
+
+/* Account a key read from the RDB. */
+static void rdbAnalyzeKey(int dbid, robj *key, robj *val,
+                          long long expiretime, long long now)
+{
+    const char *type = getObjectTypeName(val);
+    const char *encoding = strEncoding(val->encoding);
+    unsigned long long bytes, elements = rdbAnalyzeElements(val);
+    sds name, label, keystr = key->ptr;
+    size_t prefixlen = 0, keylen = sdslen(keystr);
+    int bucket, pos;
+
+    bytes = objectComputeSize(val,OBJ_COMPUTE_SIZE_DEF_SAMPLES);
+    bytes += sdsAllocSize(keystr);
+    bytes += sizeof(dictEntry);
+    if (expiretime != -1) bytes += sizeof(dictEntry);
+    rdbanalysis.keys++;
+    rdbanalysis.bytes += bytes;
+
+    /* Type and encoding. */
+    name = sdscatfmt(sdsempty(),"%s %s",type,encoding);
+    rdbAnalyzeAddToGroup(rdbanalysis.encodings,name,sdslen(name),
+                         sdsdup(name),bytes);
+    sdsfree(name);
+
+    /* TTL. */
+    if (expiretime == -1) {
+        bucket = 0;
+    } else if (expiretime < now) {
+        bucket = 1;
+    } else {
+        long long ttl = (expiretime-now)/1000;
+        for (bucket = 2; bucket < RDB_ANALYZE_TTL_BUCKETS-1; bucket++)
+            if (ttl < rdbAnalyzeTTLBounds[bucket-2]) break;
+    }
+    rdbanalysis.ttl[bucket].keys++;
+    rdbanalysis.ttl[bucket].bytes += bytes;
+
+    /* Prefix, up to the first separator included. */
+    for (size_t j = 0; j < keylen; j++) {
+        if (strchr(rdbanalysis.separator,keystr[j])) {
+            prefixlen = j+1;
+            break;
+        }
+    }
+    name = sdscatlen(sdsnew(type),"\0",1);
+    name = sdscatlen(name,keystr,prefixlen);
+    label = sdscatfmt(sdsempty(),"%s ",type);
+    label = sdscatrepr(label,keystr,prefixlen);
+    if (!rdbAnalyzeAddToGroup(rdbanalysis.prefixes,name,sdslen(name),
+                              label,bytes))
+    {
+        rdbanalysis.other_keys++;
+        rdbanalysis.other_bytes += bytes;
+    }
+    sdsfree(name);
+
+    /* Biggest keys, kept sorted with an insertion sort since the array is
+     * small and rarely updated. */
+    if (rdbanalysis.top &&
+        (rdbanalysis.numtop < rdbanalysis.top ||
+         rdbanalysis.topkeys[rdbanalysis.numtop-1].bytes < bytes))
+    {
+        if (rdbanalysis.numtop == rdbanalysis.top)
+            sdsfree(rdbanalysis.topkeys[--rdbanalysis.numtop].key);
+        pos = rdbanalysis.numtop++;
+        while (pos > 0 && rdbanalysis.topkeys[pos-1].bytes < bytes) {
+            rdbanalysis.topkeys[pos] = rdbanalysis.topkeys[pos-1];
+            pos--;
+        }
+        rdbanalysis.topkeys[pos].key = sdsdup(keystr);
+        rdbanalysis.topkeys[pos].dbid = dbid;
+        rdbanalysis.topkeys[pos].type = type;
+        rdbanalysis.topkeys[pos].bytes = bytes;
+        rdbanalysis.topkeys[pos].elements = elements;
+    }
+
+    if (rdbanalysis.export_fp)
+        rdbExportKey(dbid,key,val,bytes,elements,expiretime);
+}
+
+static int rdbAnalyzeGroupCompare(const void *a, const void *b) {
+    const rdbAnalyzeGroup *ga = *(rdbAnalyzeGroup**)a;
+    const rdbAnalyzeGroup *gb = *(rdbAnalyzeGroup**)b;
+
+    if (ga->bytes != gb->bytes) return ga->bytes > gb->bytes ? -1 : 1;
+    return sdscmp(ga->name,gb->name);
+}
+
+static void rdbAnalyzeShowGroup(const char *name, rdbAnalyzeGroup *g) {
+    printf("  %-24s %llu keys, %llu bytes (%.2f%%)\n", name, g->keys,
+        g->bytes, rdbanalysis.bytes ? g->bytes*100.0/rdbanalysis.bytes : 0);
+}
+
+/* Show the groups of 'groups', from the one using more memory, up to
+ * 'count' of them. */
+static void rdbAnalyzeShowGroups(dict *groups, unsigned long count) {
+    rdbAnalyzeGroup **sorted = zmalloc(sizeof(*sorted)*(dictSize(groups)+1));
+    unsigned long numgroups = 0, j;
+    dictIterator *di = dictGetIterator(groups);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) sorted[numgroups++] = dictGetVal(de);
+    dictReleaseIterator(di);
+    qsort(sorted,numgroups,sizeof(*sorted),rdbAnalyzeGroupCompare);
+    if (count > numgroups) count = numgroups;
+    for (j = 0; j < count; j++)
+        rdbAnalyzeShowGroup(sorted[j]->name,sorted[j]);
+    zfree(sorted);
+}
+
+/* Show the results of the analysis, and complete the export. */
+static void rdbAnalyzeShowReport(void) {
+    int j;
+
+    if (rdbanalysis.export_fp) {
+        if (rdbanalysis.rows) rdbExportFlush();
+        rdbExportFlush(); /* Empty block: end of the file. */
+        if (fclose(rdbanalysis.export_fp) == EOF) {
+            fprintf(stderr,"Error writing %s: %s\n",
+                rdbanalysis.export_filename, strerror(errno));
+            exit(1);
+        }
+        rdbanalysis.export_fp = NULL;
+        rdbCheckInfo("%llu keys exported to %s", rdbanalysis.keys,
+            rdbanalysis.export_filename);
+    }
+    if (!rdbanalysis.enabled) return;
+
+    printf("--- RDB ANALYSIS ---\n");
+    printf("Estimated memory of %llu keys once loaded: %llu bytes\n",
+        rdbanalysis.keys, rdbanalysis.bytes);
+    printf("\nBy type and encoding:\n");
+    rdbAnalyzeShowGroups(rdbanalysis.encodings,ULONG_MAX);
+    printf("\nBy TTL:\n");
+    for (j = 0; j < RDB_ANALYZE_TTL_BUCKETS; j++)
+        rdbAnalyzeShowGroup(rdbAnalyzeTTLNames[j],rdbanalysis.ttl+j);
+    printf("\nBy type and key prefix (separator %s), top %d:\n",
+        rdbanalysis.separator, rdbanalysis.top);
+    rdbAnalyzeShowGroups(rdbanalysis.prefixes,rdbanalysis.top);
+    if (rdbanalysis.other_keys)
+        printf("  %llu more keys, %llu bytes, with other prefixes\n",
+            rdbanalysis.other_keys, rdbanalysis.other_bytes);
+    printf("\nBiggest keys:\n");
+    for (j = 0; j < rdbanalysis.numtop; j++) {
+        rdbAnalyzeBigKey *k = rdbanalysis.topkeys+j;
+        sds key = sdscatrepr(sdsempty(),k->key,sdslen(k->key));
+
+        printf("  db %d %-6s %s: %llu bytes, %llu elements\n",
+            k->dbid, k->type, key, k->bytes, k->elements);
+        sdsfree(key);
+    }
+}
+
 /* Show a few stats collected into 'rdbstate' */
 void rdbShowGenericInfo(void) {
     printf("[info] %lu keys read\n", rdbstate.keys);
@@ -177,7 +549,7 @@ void rdbCheckSetupSignals(void) {
  * The file is specified as a filename in 'rdbfilename' if 'fp' is not NULL,
  * otherwise the already open file 'fp' is checked. */
 int redis_check_rdb(char *rdbfilename, FILE *fp) {
-    uint64_t dbid;
+    uint64_t dbid = 0;
     int type, rdbver;
     char buf[1024];
     long long expiretime, now = mstime();
@@ -227,6 +599,14 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             expiretime = rdbLoadMillisecondTime(&rdb, rdbver);
             if (rioGetReadError(&rdb)) goto eoferr;
             continue; /* Read next opcode. */
+        } else if (type == RDB_OPCODE_HASH_FIELD_EXPIRES) {
+            /* HASH_FIELD_EXPIRES: field expires of the next key. */
+            robj *fexpires;
+            rdbstate.doing = RDB_CHECK_DOING_READ_EXPIRE;
+            if ((fexpires = rdbLoadHashFieldExpires(&rdb,rdbver)) == NULL)
+                goto eoferr;
+            decrRefCount(fexpires);
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_FREQ) {
             /* FREQ: LFU frequency. */
             uint8_t byte;
@@ -239,6 +619,12 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
             break;
+        } else if (type == RDB_OPCODE_DELKEY) {
+            /* DELKEY: key deleted, found in delta snapshots. */
+            rdbstate.doing = RDB_CHECK_DOING_READ_KEY;
+            if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
+            decrRefCount(key);
+            continue; /* Read type again. */
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
             rdbstate.doing = RDB_CHECK_DOING_READ_LEN;
@@ -292,6 +678,8 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         if (expiretime != -1 && expiretime < now)
             rdbstate.already_expired++;
         if (expiretime != -1) rdbstate.expires++;
+        if (rdbanalysis.enabled || rdbanalysis.export_fp)
+            rdbAnalyzeKey(dbid,key,val,expiretime,now);
         rdbstate.key = NULL;
         decrRefCount(key);
         decrRefCount(val);
@@ -342,26 +730,54 @@ err:
  * When called with fp = NULL, the function never returns, but exits with the
  * status code according to success (RDB is sane) or error (RDB is corrupted).
  * Otherwise if called with a non NULL fp, the function returns C_OK or
- * C_ERR depending on the success or failure. */
+ * C_ERR depending on the success or failure.
+ *
+ * As a standalone executable, the RDB can also be analyzed (--analyze) or
+ * exported (--export) while it is checked, see rdbAnalyzeKey(). */
 int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
-    if (argc != 2 && fp == NULL) {
-        fprintf(stderr, "Usage: %s <rdb-file-name>\n", argv[0]);
-        exit(1);
+    if (argc < 2 && fp == NULL) goto usage;
+    rdbanalysis.top = RDB_ANALYZE_DEF_TOP;
+    /* Options of the offline analysis, only when checking an RDB file. */
+    for (int j = 2; j < argc && fp == NULL; j++) {
+        int moreargs = j+1 < argc;
+
+        if (!strcmp(argv[j],"--analyze")) {
+            rdbanalysis.enabled = 1;
+        } else if (!strcmp(argv[j],"--separator") && moreargs &&
+                   argv[j+1][0] != '\0')
+        {
+            rdbanalysis.separator = sdsnew(argv[++j]);
+        } else if (!strcmp(argv[j],"--top") && moreargs) {
+            rdbanalysis.top = atoi(argv[++j]);
+            if (rdbanalysis.top < 0) goto usage;
+        } else if (!strcmp(argv[j],"--export") && moreargs) {
+            rdbanalysis.export_filename = argv[++j];
+        } else {
+            goto usage;
+        }
     }
     /* In order to call the loading functions we need to create the shared
      * integer objects, however since this function may be called from
      * an already initialized Redis instance, check if we really need to. */
-    if (shared.integers[0] == NULL)
+    if (shared.integers == NULL)
         createSharedObjects();
     server.loading_process_events_interval_bytes = 0;
     rdbCheckMode = 1;
     rdbCheckInfo("Checking RDB file %s", argv[1]);
     rdbCheckSetupSignals();
+    if (fp == NULL && (rdbanalysis.enabled || rdbanalysis.export_filename))
+        rdbAnalyzeInit();
     int retval = redis_check_rdb(argv[1],fp);
     if (retval == 0) {
         rdbCheckInfo("\\o/ RDB looks OK! \\o/");
         rdbShowGenericInfo();
+        if (fp == NULL) rdbAnalyzeShowReport();
     }
     if (fp) return (retval == 0) ? C_OK : C_ERR;
     exit(retval);
+
+usage:
+    fprintf(stderr, "Usage: %s <rdb-file-name> [--analyze] [--separator <chars>] "
+                    "[--top <count>] [--export <file>]\n", argv[0]);
+    exit(1);
 }
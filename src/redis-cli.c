@@ -45,6 +45,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 
 #include <hiredis.h>
 #ifdef USE_OPENSSL
@@ -59,6 +60,7 @@
 #include "help.h"
 #include "anet.h"
 #include "ae.h"
+#include "shmclient.h"
 
 #define UNUSED(V) ((void) V)
 
@@ -192,6 +194,7 @@ static struct config {
     char *hostip;
     int hostport;
     char *hostsocket;
+    int shm;
     int tls;
     char *sni;
     char *cacert;
@@ -215,6 +218,10 @@ static struct config {
     int slave_mode;
     int pipe_mode;
     int pipe_timeout;
+    int pipe_connections;
+    char *bulk_type;
+    char *bulk_key;
+    long long bulk_size;
     int getrdb_mode;
     int stat_mode;
     int scan_mode;
@@ -225,6 +232,7 @@ static struct config {
     int bigkeys;
     int memkeys;
     unsigned memkeys_samples;
+    int scan_count;
     int hotkeys;
     int stdinarg; /* get last arg from stdin. (-x option) */
     char *auth;
@@ -862,6 +870,7 @@ static int cliConnect(int flags) {
             context = redisConnect(config.hostip,config.hostport);
         } else {
             context = redisConnectUnix(config.hostsocket);
+            if (!context->err && config.shm) redisInitiateShm(context);
         }
 
         if (!context->err && config.tls) {
@@ -1440,6 +1449,9 @@ static int parseOptions(int argc, char **argv) {
             config.hostport = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"-s") && !lastarg) {
             config.hostsocket = argv[++i];
+        } else if (!strcmp(argv[i],"--shm") && !lastarg) {
+            config.hostsocket = argv[++i];
+            config.shm = 1;
         } else if (!strcmp(argv[i],"-r") && !lastarg) {
             config.repeat = strtoll(argv[++i],NULL,10);
         } else if (!strcmp(argv[i],"-i") && !lastarg) {
@@ -1496,11 +1508,21 @@ static int parseOptions(int argc, char **argv) {
             config.pipe_mode = 1;
         } else if (!strcmp(argv[i],"--pipe-timeout") && !lastarg) {
             config.pipe_timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--pipe-connections") && !lastarg) {
+            config.pipe_connections = atoi(argv[++i]);
+            if (config.pipe_connections < 1) config.pipe_connections = 1;
+        } else if (!strcmp(argv[i],"--bulk-build") && i+2 < argc) {
+            config.bulk_type = argv[++i];
+            config.bulk_key = argv[++i];
+        } else if (!strcmp(argv[i],"--bulk-size") && !lastarg) {
+            config.bulk_size = strtoll(argv[++i],NULL,10);
         } else if (!strcmp(argv[i],"--bigkeys")) {
             config.bigkeys = 1;
         } else if (!strcmp(argv[i],"--memkeys")) {
             config.memkeys = 1;
             config.memkeys_samples = 0; /* use redis default */
+        } else if (!strcmp(argv[i],"--count") && !lastarg) {
+            config.scan_count = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--memkeys-samples")) {
             config.memkeys = 1;
             config.memkeys_samples = atoi(argv[++i]);
@@ -1634,6 +1656,16 @@ static int parseOptions(int argc, char **argv) {
         }
     }
 
+    /* The modes talking directly to the socket need a socket transport. */
+    if (config.shm && (config.pipe_mode || config.slave_mode ||
+                       config.getrdb_mode || config.cluster_mode ||
+                       CLUSTER_MANAGER_MODE()))
+    {
+        fprintf(stderr,"Option --shm can't be used with --pipe, --replica, "
+                       "--rdb, -c or --cluster.\n");
+        exit(1);
+    }
+
     /* --ldb requires --eval. */
     if (config.eval_ldb && config.eval == NULL) {
         fprintf(stderr,"Options --ldb and --ldb-sync-mode require --eval.\n");
@@ -1683,6 +1715,8 @@ static void usage(void) {
 "  -h <hostname>      Server hostname (default: 127.0.0.1).\n"
 "  -p <port>          Server port (default: 6379).\n"
 "  -s <socket>        Server socket (overrides hostname and port).\n"
+"  --shm <socket>     Server shm-socket: use the shared memory transport\n"
+"                     (overrides hostname and port).\n"
 "  -a <password>      Password to use when connecting to the server.\n"
 "                     You can also use the " REDIS_CLI_AUTH_ENV " environment\n"
 "                     variable to pass this password more safely\n"
@@ -1731,7 +1765,14 @@ static void usage(void) {
 "  --pipe             Transfer raw Redis protocol from stdin to server.\n"
 "  --pipe-timeout <n> In --pipe mode, abort with error if after sending all data.\n"
 "                     no reply is received within <n> seconds.\n"
-"                     Default timeout: %d. Use 0 to wait forever.\n",
+"                     Default timeout: %d. Use 0 to wait forever.\n"
+"  --pipe-connections <n> In --pipe mode, send the commands over <n> connections\n"
+"                     (to every master with -c), routing every command by\n"
+"                     the hash slot of its first argument.\n"
+"  --bulk-build <type> <key> Build the hash, set or zset <key> from stdin, one\n"
+"                     element per line: <field> <value>, <member>, or\n"
+"                     <score> <member>.\n"
+"  --bulk-size <n>    In --bulk-build mode, the expected number of elements.\n",
     REDIS_CLI_DEFAULT_PIPE_TIMEOUT);
     fprintf(stderr,
 "  --bigkeys          Sample Redis keys looking for keys with many elements (complexity).\n"
@@ -1740,6 +1781,10 @@ static void usage(void) {
 "                     And define number of key elements to sample\n"
 "  --hotkeys          Sample Redis keys looking for hot keys.\n"
 "                     only works when maxmemory-policy is *lfu.\n"
+"  --count <count>    The COUNT of the SCAN commands sent by --bigkeys, --memkeys\n"
+"                     and --hotkeys: the keys of every SCAN are analyzed with a\n"
+"                     single pipeline. With -c, --bigkeys and --memkeys scan\n"
+"                     all the masters of the cluster in parallel.\n"
 "  --scan             List all keys using the SCAN command.\n"
 "  --pattern <pat>    Useful with --scan to specify a SCAN pattern.\n"
 "  --intrinsic-latency <sec> Run a test to measure intrinsic system latency.\n"
@@ -7056,12 +7101,505 @@ static void pipeMode(void) {
         exit(0);
 }
 
+/* Parallel pipe mode.
+ *
+ * The commands read from stdin are distributed among many connections, to
+ * every master node of the cluster in cluster mode, so that the server
+ * side I/O, and all the masters of a cluster, are used to load the data.
+ * Every command goes to a connection selected by the hash slot of its first
+ * argument, that is the key of most commands: this way the commands about
+ * the same key are executed in the same order they were read, and in
+ * cluster mode they reach the node serving the key. Commands without
+ * arguments go to the connection of slot 0. Since the order of commands
+ * about different keys is not retained, the input should not contain
+ * commands like SELECT or MULTI. */
+
+#define PIPEMODE_MAX_PENDING_BYTES (1024*1024*4) /* Per connection. */
+
+typedef struct pipeConnection {
+    int fd;
+    redisContext *context;
+    redisReader *reader;
+    sds obuf;               /* Protocol not sent yet, from obuf_pos. */
+    size_t obuf_pos;
+    long long replies;
+    int done;               /* Final ECHO reply received. */
+} pipeConnection;
+
+/* Return the length of the RESP command at the start of 'buf', 0 if it is
+ * not complete yet, or -1 if the protocol is invalid. The first argument
+ * after the command name is returned by reference, if any. */
+static long long pipeParseCommand(char *buf, size_t len, char **arg,
+                                  size_t *arglen)
+{
+    char *p = buf, *end = buf+len, *nl;
+    long long argc, j;
+
+    *arg = NULL;
+    *arglen = 0;
+    if (len == 0) return 0;
+    if (*p != '*') return -1;
+    if ((nl = memchr(p,'\r',end-p)) == NULL || nl+1 >= end) return 0;
+    argc = strtoll(p+1,NULL,10);
+    if (argc <= 0) return -1;
+    p = nl+2;
+    for (j = 0; j < argc; j++) {
+        long long bulklen;
+
+        if (p >= end) return 0;
+        if (*p != '$') return -1;
+        if ((nl = memchr(p,'\r',end-p)) == NULL || nl+1 >= end) return 0;
+        bulklen = strtoll(p+1,NULL,10);
+        if (bulklen < 0) return -1;
+        p = nl+2;
+        if (end-p < bulklen+2) return 0;
+        if (j == 1) {
+            *arg = p;
+            *arglen = bulklen;
+        }
+        p += bulklen+2;
+    }
+    return p-buf;
+}
+
+/* Open a non blocking connection to ip:port for the parallel pipe mode,
+ * authenticated and with the right DB selected. */
+static void pipeConnect(pipeConnection *pc, char *ip, int port) {
+    char aneterr[ANET_ERR_LEN];
+
+    if (config.cluster_mode) {
+        clusterManagerNode *node = clusterManagerNewNode(ip,port);
+        if (!clusterManagerNodeConnect(node)) exit(1);
+        pc->context = node->context;
+        node->context = NULL;
+        freeClusterManagerNode(node);
+    } else {
+        if (cliConnect(CC_FORCE) == REDIS_ERR) exit(1);
+        pc->context = context;
+        context = NULL;
+    }
+    pc->fd = pc->context->fd;
+    if (anetNonBlock(aneterr,pc->fd) == ANET_ERR) {
+        fprintf(stderr, "Can't set the socket in non blocking mode: %s\n",
+            aneterr);
+        exit(1);
+    }
+    pc->reader = redisReaderCreate();
+    pc->obuf = sdsempty();
+    pc->obuf_pos = 0;
+    pc->replies = 0;
+    pc->done = 0;
+}
+
+static void pipeModeParallel(void) {
+    int conns_per_node = config.pipe_connections, numconns, j;
+    int *slot_conn = zmalloc(sizeof(int)*CLUSTER_MANAGER_SLOTS);
+    pipeConnection *conns;
+    struct pollfd *pfds;
+    sds ibuf = sdsempty();
+    size_t ibuf_pos = 0;
+    long long errors = 0, replies = 0, commands = 0;
+    long long start = mstime(), last_report = start;
+    long long last_report_replies = 0;
+    int eof = 0, done = 0;
+    char magic[20];
+    time_t last_read_time = time(NULL);
+
+    srand(time(NULL));
+    for (j = 0; j < 20; j++) magic[j] = rand() & 0xff;
+
+    /* Open the connections, and map every slot to a connection of the
+     * node serving it. */
+    if (config.cluster_mode) {
+        clusterManagerNode *entry =
+            clusterManagerNewNode((char*)config.hostip,config.hostport);
+        listIter li;
+        listNode *ln;
+        int nodes = 0;
+
+        if (!clusterManagerLoadInfoFromNode(entry,0)) exit(1);
+        listRewind(cluster_manager.nodes,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            clusterManagerNode *n = ln->value;
+            if (n->slots_count) nodes++;
+        }
+        numconns = nodes*conns_per_node;
+        conns = zcalloc(sizeof(pipeConnection)*numconns);
+        for (j = 0; j < CLUSTER_MANAGER_SLOTS; j++) slot_conn[j] = -1;
+        nodes = 0;
+        listRewind(cluster_manager.nodes,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            clusterManagerNode *n = ln->value;
+            int i;
+
+            if (!n->slots_count) continue;
+            for (i = 0; i < conns_per_node; i++)
+                pipeConnect(conns+nodes*conns_per_node+i,n->ip,n->port);
+            for (i = 0; i < CLUSTER_MANAGER_SLOTS; i++) {
+                if (n->slots[i])
+                    slot_conn[i] = nodes*conns_per_node+i%conns_per_node;
+            }
+            nodes++;
+        }
+        for (j = 0; j < CLUSTER_MANAGER_SLOTS; j++) {
+            if (slot_conn[j] == -1) {
+                fprintf(stderr,"Slot %d is not served by any node.\n",j);
+                exit(1);
+            }
+        }
+        printf("Sending the data to %d masters, using %d connections.\n",
+            nodes, numconns);
+    } else {
+        numconns = conns_per_node;
+        conns = zcalloc(sizeof(pipeConnection)*numconns);
+        for (j = 0; j < numconns; j++)
+            pipeConnect(conns+j,(char*)config.hostip,config.hostport);
+        for (j = 0; j < CLUSTER_MANAGER_SLOTS; j++)
+            slot_conn[j] = j%numconns;
+        printf("Sending the data using %d connections.\n", numconns);
+    }
+    pfds = zmalloc(sizeof(struct pollfd)*(numconns+1));
+
+    while(!done) {
+        int pending = 0, nfds = 0;
+
+        /* Read more commands from stdin only when no connection has too
+         * much data still to send. */
+        for (j = 0; j < numconns; j++) {
+            pipeConnection *pc = conns+j;
+            size_t len = sdslen(pc->obuf)-pc->obuf_pos;
+
+            if (len > PIPEMODE_MAX_PENDING_BYTES) pending = 1;
+            pfds[nfds].fd = pc->fd;
+            pfds[nfds].events = POLLIN | (len ? POLLOUT : 0);
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+        if (!eof && !pending) {
+            pfds[nfds].fd = STDIN_FILENO;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            nfds++;
+        }
+        if (poll(pfds,nfds,1000) == -1 && errno != EINTR) {
+            fprintf(stderr,"poll(): %s\n", strerror(errno));
+            exit(1);
+        }
+
+        /* Route the complete commands read from stdin. */
+        if (nfds > numconns && pfds[numconns].revents) {
+            char buf[1024*64];
+            ssize_t nread = read(STDIN_FILENO,buf,sizeof(buf));
+
+            if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "Error reading from stdin: %s\n",
+                    strerror(errno));
+                exit(1);
+            }
+            if (nread > 0) {
+                ibuf = sdscatlen(ibuf,buf,nread);
+                while (1) {
+                    char *arg;
+                    size_t arglen;
+                    long long cmdlen;
+
+                    /* Skip the CRLF that may separate the commands. */
+                    while (ibuf_pos < sdslen(ibuf) &&
+                           (ibuf[ibuf_pos] == '\r' || ibuf[ibuf_pos] == '\n'))
+                        ibuf_pos++;
+                    cmdlen = pipeParseCommand(ibuf+ibuf_pos,
+                        sdslen(ibuf)-ibuf_pos,&arg,&arglen);
+                    if (cmdlen == -1) {
+                        fprintf(stderr,"Invalid protocol after %lld commands: "
+                                       "only RESP arrays of bulk strings are "
+                                       "supported with --pipe-connections.\n",
+                                       commands);
+                        exit(1);
+                    }
+                    if (cmdlen == 0) break;
+                    int slot = arg ? clusterManagerKeyHashSlot(arg,arglen) : 0;
+                    pipeConnection *pc = conns+slot_conn[slot];
+                    pc->obuf = sdscatlen(pc->obuf,ibuf+ibuf_pos,cmdlen);
+                    ibuf_pos += cmdlen;
+                    commands++;
+                }
+                sdsrange(ibuf,ibuf_pos,-1);
+                ibuf_pos = 0;
+            } else if (nread == 0) {
+                /* Everything read: queue the ECHO we recognize in the
+                 * replies of every connection, see pipeMode(). */
+                char echo[] =
+                "\r\n*2\r\n$4\r\nECHO\r\n$20\r\n01234567890123456789\r\n";
+
+                if (sdslen(ibuf)) {
+                    fprintf(stderr,"Truncated command at the end of the "
+                                   "input, after %lld commands.\n", commands);
+                    exit(1);
+                }
+                eof = 1;
+                memcpy(echo+21,magic,20);
+                for (j = 0; j < numconns; j++)
+                    conns[j].obuf = sdscatlen(conns[j].obuf,echo,
+                                              sizeof(echo)-1);
+                printf("All data transferred. Waiting for the last reply...\n");
+            }
+        }
+
+        for (j = 0; j < numconns; j++) {
+            pipeConnection *pc = conns+j;
+            redisReply *reply;
+
+            /* Send the pending protocol. */
+            if (pfds[j].revents & POLLOUT) {
+                ssize_t nwritten = write(pc->fd,pc->obuf+pc->obuf_pos,
+                                         sdslen(pc->obuf)-pc->obuf_pos);
+                if (nwritten == -1 && errno != EAGAIN && errno != EINTR) {
+                    fprintf(stderr, "Error writing to the server: %s\n",
+                        strerror(errno));
+                    exit(1);
+                }
+                if (nwritten > 0) pc->obuf_pos += nwritten;
+                if (pc->obuf_pos == sdslen(pc->obuf)) {
+                    sdsclear(pc->obuf);
+                    pc->obuf_pos = 0;
+                } else if (pc->obuf_pos > PIPEMODE_MAX_PENDING_BYTES) {
+                    sdsrange(pc->obuf,pc->obuf_pos,-1);
+                    pc->obuf_pos = 0;
+                }
+            }
+
+            /* Read and consume the replies. */
+            if (!(pfds[j].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+            while (1) {
+                char buf[1024*16];
+                ssize_t nread = read(pc->fd,buf,sizeof(buf));
+
+                if (nread == 0 || (nread == -1 && errno != EAGAIN &&
+                                   errno != EINTR))
+                {
+                    fprintf(stderr, "Error reading from the server: %s\n",
+                        nread == 0 ? "connection closed" : strerror(errno));
+                    exit(1);
+                }
+                if (nread <= 0) break;
+                redisReaderFeed(pc->reader,buf,nread);
+                last_read_time = time(NULL);
+            }
+            do {
+                if (redisReaderGetReply(pc->reader,(void**)&reply) ==
+                    REDIS_ERR)
+                {
+                    fprintf(stderr, "Error reading replies from server\n");
+                    exit(1);
+                }
+                if (reply == NULL) break;
+                if (reply->type == REDIS_REPLY_ERROR) {
+                    fprintf(stderr,"%s\n", reply->str);
+                    errors++;
+                } else if (eof && reply->type == REDIS_REPLY_STRING &&
+                           reply->len == 20 &&
+                           memcmp(reply->str,magic,20) == 0)
+                {
+                    pc->done = 1;
+                    pc->replies--;
+                    replies--;
+                }
+                pc->replies++;
+                replies++;
+                freeReplyObject(reply);
+            } while(1);
+        }
+
+        done = eof;
+        for (j = 0; j < numconns; j++)
+            if (!conns[j].done) done = 0;
+
+        /* Report the progress every second. */
+        long long now = mstime();
+        if (now-last_report >= 1000) {
+            printf("sent: %lld, replies: %lld, %.0f replies/sec\n",
+                commands, replies,
+                (double)(replies-last_report_replies)*1000/(now-last_report));
+            fflush(stdout);
+            last_report = now;
+            last_report_replies = replies;
+        }
+
+        /* Handle the timeout, as pipeMode() does. */
+        if (eof && !done && config.pipe_timeout > 0 &&
+            time(NULL)-last_read_time > config.pipe_timeout)
+        {
+            fprintf(stderr,"No replies for %d seconds: exiting.\n",
+                config.pipe_timeout);
+            errors++;
+            break;
+        }
+    }
+    if (done) printf("Last reply received from server.\n");
+
+    long long elapsed = mstime()-start;
+    for (j = 0; j < numconns; j++) {
+        redisReaderFree(conns[j].reader);
+        redisFree(conns[j].context);
+        sdsfree(conns[j].obuf);
+    }
+    zfree(conns);
+    zfree(pfds);
+    zfree(slot_conn);
+    sdsfree(ibuf);
+    printf("errors: %lld, replies: %lld, %.0f replies/sec\n", errors, replies,
+        elapsed ? (double)replies*1000/elapsed : 0);
+    if (errors)
+        exit(1);
+    else
+        exit(0);
+}
+
+/*------------------------------------------------------------------------------
+ * Bulk build mode
+ *--------------------------------------------------------------------------- */
+
+#define BULKBUILD_BATCH 1000 /* Elements sent with every command. */
+
+/* Read the reply to a batch sent by bulkBuildMode(), exiting on errors.
+ * Returns the number of elements added. */
+static long long bulkBuildReadReply(void) {
+    redisReply *reply;
+    long long added;
+
+    if (redisGetReply(context,(void**)&reply) != REDIS_OK) {
+        fprintf(stderr,"I/O error\n");
+        exit(1);
+    }
+    if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr,"ERROR: %s\n",reply->str);
+        exit(1);
+    }
+    added = reply->integer;
+    freeReplyObject(reply);
+    return added;
+}
+
+/* Build a collection from the elements read from stdin, one per line. The
+ * elements are sent in batches with HBUILD, SBUILD or ZBUILD, that receive
+ * the --bulk-size cardinality, and a batch is sent while the server is
+ * still processing the previous one. */
+static void bulkBuildMode(void) {
+    char *cmd, *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    int pairs, argc = 3, pending = 0, eof = 0;
+    long long lineno = 0, elements = 0, added = 0;
+    sds size = sdsfromlonglong(config.bulk_size);
+    char **argv;
+    size_t *argvlen;
+    sds *lines;
+
+    if (!strcasecmp(config.bulk_type,"hash")) {
+        cmd = "HBUILD";
+        pairs = 1;
+    } else if (!strcasecmp(config.bulk_type,"set")) {
+        cmd = "SBUILD";
+        pairs = 0;
+    } else if (!strcasecmp(config.bulk_type,"zset")) {
+        cmd = "ZBUILD";
+        pairs = 1;
+    } else {
+        fprintf(stderr,"Unknown type '%s', use hash, set or zset.\n",
+            config.bulk_type);
+        exit(1);
+    }
+
+    argv = zmalloc(sizeof(char*)*(3+BULKBUILD_BATCH*2));
+    argvlen = zmalloc(sizeof(size_t)*(3+BULKBUILD_BATCH*2));
+    lines = zmalloc(sizeof(sds)*BULKBUILD_BATCH);
+    argv[0] = cmd;
+    argvlen[0] = strlen(cmd);
+    argv[1] = config.bulk_key;
+    argvlen[1] = strlen(config.bulk_key);
+    argv[2] = size;
+    argvlen[2] = sdslen(size);
+
+    while (!eof) {
+        int batch = 0, j;
+
+        while (batch < BULKBUILD_BATCH) {
+            if ((len = getline(&line,&linecap,stdin)) == -1) {
+                eof = 1;
+                break;
+            }
+            lineno++;
+            while (len && (line[len-1] == '\n' || line[len-1] == '\r'))
+                len--;
+            if (len == 0) continue;
+            lines[batch] = sdsnewlen(line,len);
+            if (pairs) {
+                /* The first space separates the two parts of the element. */
+                char *sep = memchr(lines[batch],' ',len);
+                if (sep == NULL) {
+                    fprintf(stderr,"Line %lld: two space separated fields "
+                                   "expected.\n", lineno);
+                    exit(1);
+                }
+                argv[argc] = lines[batch];
+                argvlen[argc++] = sep-lines[batch];
+                argv[argc] = sep+1;
+                argvlen[argc++] = len-(sep-lines[batch])-1;
+            } else {
+                argv[argc] = lines[batch];
+                argvlen[argc++] = len;
+            }
+            batch++;
+        }
+        if (batch) {
+            redisAppendCommandArgv(context,argc,(const char**)argv,argvlen);
+            for (j = 0; j < batch; j++) sdsfree(lines[j]);
+            elements += batch;
+            argc = 3;
+            /* Read the reply to the previous batch. */
+            if (pending) added += bulkBuildReadReply();
+            pending = 1;
+        }
+    }
+    if (pending) added += bulkBuildReadReply();
+
+    printf("elements: %lld, added: %lld\n", elements, added);
+    free(line);
+    zfree(argv);
+    zfree(argvlen);
+    zfree(lines);
+    sdsfree(size);
+    exit(0);
+}
+
 /*------------------------------------------------------------------------------
  * Find big keys
  *--------------------------------------------------------------------------- */
 
-static redisReply *sendScan(unsigned long long *it) {
-    redisReply *reply = redisCommand(context, "SCAN %llu", *it);
+/* Write the commands pipelined in 'c' to the server without waiting for
+ * the replies, so that all the nodes we are scanning work in parallel. */
+static void flushPipeline(redisContext *c) {
+    int done = 0;
+
+    while (!done) {
+        if (redisBufferWrite(c,&done) == REDIS_ERR) {
+            fprintf(stderr, "\nI/O error\n");
+            exit(1);
+        }
+    }
+}
+
+static void appendScan(redisContext *c, unsigned long long it) {
+    if (config.scan_count)
+        redisAppendCommand(c, "SCAN %llu COUNT %d", it, config.scan_count);
+    else
+        redisAppendCommand(c, "SCAN %llu", it);
+}
+
+static redisReply *readScan(redisContext *c, unsigned long long *it) {
+    redisReply *reply = NULL;
+
+    if (redisGetReply(c, (void**)&reply) != REDIS_OK) reply = NULL;
 
     /* Handle any error conditions */
     if(reply == NULL) {
@@ -7088,11 +7626,16 @@ static redisReply *sendScan(unsigned long long *it) {
     return reply;
 }
 
-static int getDbSize(void) {
+static redisReply *sendScan(unsigned long long *it) {
+    appendScan(context, *it);
+    return readScan(context, it);
+}
+
+static long long getDbSize(redisContext *c) {
     redisReply *reply;
-    int size;
+    long long size;
 
-    reply = redisCommand(context, "DBSIZE");
+    reply = redisCommand(c, "DBSIZE");
 
     if(reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
         fprintf(stderr, "Couldn't determine DBSIZE!\n");
@@ -7150,20 +7693,28 @@ static dictType typeinfoDictType = {
     type_free                  /* val destructor */
 };
 
-static void getKeyTypes(dict *types_dict, redisReply *keys, typeinfo **types) {
-    redisReply *reply;
+static void sendKeyTypes(redisContext *c, redisReply *keys) {
     unsigned int i;
 
     /* Pipeline TYPE commands */
     for(i=0;i<keys->elements;i++) {
-        redisAppendCommand(context, "TYPE %s", keys->element[i]->str);
+        redisAppendCommand(c, "TYPE %b", keys->element[i]->str,
+                           keys->element[i]->len);
     }
+    flushPipeline(c);
+}
+
+static void getKeyTypes(redisContext *c, dict *types_dict, redisReply *keys,
+                        typeinfo **types)
+{
+    redisReply *reply;
+    unsigned int i;
 
     /* Retrieve types */
     for(i=0;i<keys->elements;i++) {
-        if(redisGetReply(context, (void**)&reply)!=REDIS_OK) {
+        if(redisGetReply(c, (void**)&reply)!=REDIS_OK) {
             fprintf(stderr, "Error getting type for key '%s' (%d: %s)\n",
-                keys->element[i]->str, context->err, context->errstr);
+                keys->element[i]->str, c->err, c->errstr);
             exit(1);
         } else if(reply->type != REDIS_REPLY_STATUS) {
             if(reply->type == REDIS_REPLY_ERROR) {
@@ -7189,11 +7740,9 @@ static void getKeyTypes(dict *types_dict, redisReply *keys, typeinfo **types) {
     }
 }
 
-static void getKeySizes(redisReply *keys, typeinfo **types,
-                        unsigned long long *sizes, int memkeys,
-                        unsigned memkeys_samples)
+static void sendKeySizes(redisContext *c, redisReply *keys, typeinfo **types,
+                         int memkeys, unsigned memkeys_samples)
 {
-    redisReply *reply;
     unsigned int i;
 
     /* Pipeline size commands */
@@ -7203,15 +7752,26 @@ static void getKeySizes(redisReply *keys, typeinfo **types,
             continue;
 
         if (!memkeys)
-            redisAppendCommand(context, "%s %s",
-                types[i]->sizecmd, keys->element[i]->str);
+            redisAppendCommand(c, "%s %b",
+                types[i]->sizecmd, keys->element[i]->str,
+                keys->element[i]->len);
         else if (memkeys_samples==0)
-            redisAppendCommand(context, "%s %s %s",
-                "MEMORY", "USAGE", keys->element[i]->str);
+            redisAppendCommand(c, "%s %s %b",
+                "MEMORY", "USAGE", keys->element[i]->str,
+                keys->element[i]->len);
         else
-            redisAppendCommand(context, "%s %s %s SAMPLES %u",
-                "MEMORY", "USAGE", keys->element[i]->str, memkeys_samples);
+            redisAppendCommand(c, "%s %s %b SAMPLES %u",
+                "MEMORY", "USAGE", keys->element[i]->str,
+                keys->element[i]->len, memkeys_samples);
     }
+    flushPipeline(c);
+}
+
+static void getKeySizes(redisContext *c, redisReply *keys, typeinfo **types,
+                        unsigned long long *sizes, int memkeys)
+{
+    redisReply *reply;
+    unsigned int i;
 
     /* Retrieve sizes */
     for(i=0;i<keys->elements;i++) {
@@ -7222,9 +7782,9 @@ static void getKeySizes(redisReply *keys, typeinfo **types,
         }
 
         /* Retrieve size */
-        if(redisGetReply(context, (void**)&reply)!=REDIS_OK) {
+        if(redisGetReply(c, (void**)&reply)!=REDIS_OK) {
             fprintf(stderr, "Error getting size for key '%s' (%d: %s)\n",
-                keys->element[i]->str, context->err, context->errstr);
+                keys->element[i]->str, c->err, c->errstr);
             exit(1);
         } else if(reply->type != REDIS_REPLY_INTEGER) {
             /* Theoretically the key could have been removed and
@@ -7242,13 +7802,53 @@ static void getKeySizes(redisReply *keys, typeinfo **types,
     }
 }
 
+/* A node scanned by findBigKeys(): every master in cluster mode, otherwise
+ * just the server we are connected to. */
+typedef struct bigKeysNode {
+    redisContext *context;
+    unsigned long long it;      /* SCAN cursor. */
+    redisReply *reply;          /* Reply of the last SCAN. */
+    typeinfo **types;           /* Type and size of the keys of 'reply'. */
+    unsigned long long *sizes;
+    unsigned int arrsize;
+    int done;                   /* SCAN iteration completed. */
+} bigKeysNode;
+
+static bigKeysNode *getBigKeysNodes(int *numnodes) {
+    bigKeysNode *nodes;
+    clusterManagerNode *entry;
+    listIter li;
+    listNode *ln;
+
+    if (!config.cluster_mode) {
+        nodes = zcalloc(sizeof(*nodes));
+        nodes[0].context = context;
+        *numnodes = 1;
+        return nodes;
+    }
+
+    entry = clusterManagerNewNode((char*)config.hostip,config.hostport);
+    if (!clusterManagerLoadInfoFromNode(entry,0)) exit(1);
+    nodes = zcalloc(sizeof(*nodes)*listLength(cluster_manager.nodes));
+    *numnodes = 0;
+    listRewind(cluster_manager.nodes,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        clusterManagerNode *n = ln->value;
+
+        if (n->flags & CLUSTER_MANAGER_FLAG_SLAVE) continue;
+        nodes[(*numnodes)++].context = n->context;
+    }
+    return nodes;
+}
+
 static void findBigKeys(int memkeys, unsigned memkeys_samples) {
-    unsigned long long sampled = 0, total_keys, totlen=0, *sizes=NULL, it=0;
-    redisReply *reply, *keys;
-    unsigned int arrsize=0, i;
+    unsigned long long sampled = 0, total_keys = 0, totlen=0;
+    redisReply *keys;
+    unsigned int i;
     dictIterator *di;
     dictEntry *de;
-    typeinfo **types = NULL;
+    bigKeysNode *nodes;
+    int numnodes, active, j;
     double pct;
 
     dict *types_dict = dictCreate(&typeinfoDictType, NULL);
@@ -7260,86 +7860,129 @@ static void findBigKeys(int memkeys, unsigned memkeys_samples) {
     typeinfo_add(types_dict, "stream", &type_stream);
 
     /* Total keys pre scanning */
-    total_keys = getDbSize();
+    nodes = getBigKeysNodes(&numnodes);
+    for (j = 0; j < numnodes; j++) total_keys += getDbSize(nodes[j].context);
 
     /* Status message */
     printf("\n# Scanning the entire keyspace to find biggest keys as well as\n");
     printf("# average sizes per key type.  You can use -i 0.1 to sleep 0.1 sec\n");
     printf("# per 100 SCAN commands (not usually needed).\n\n");
+    if (config.cluster_mode)
+        printf("# Scanning %d masters in parallel.\n\n", numnodes);
 
-    /* SCAN loop */
+    /* SCAN loop. Every step is sent to all the nodes before reading the
+     * replies of any of them, so that the nodes work in parallel. */
     do {
         /* Calculate approximate percentage completion */
-        pct = 100 * (double)sampled/total_keys;
-
-        /* Grab some keys and point to the keys array */
-        reply = sendScan(&it);
-        keys  = reply->element[1];
-
-        /* Reallocate our type and size array if we need to */
-        if(keys->elements > arrsize) {
-            types = zrealloc(types, sizeof(typeinfo*)*keys->elements);
-            sizes = zrealloc(sizes, sizeof(unsigned long long)*keys->elements);
-
-            if(!types || !sizes) {
-                fprintf(stderr, "Failed to allocate storage for keys!\n");
-                exit(1);
+        pct = total_keys ? 100 * (double)sampled/total_keys : 0;
+
+        /* Grab some keys from every node */
+        for (j = 0; j < numnodes; j++) {
+            if (nodes[j].done) continue;
+            appendScan(nodes[j].context, nodes[j].it);
+            flushPipeline(nodes[j].context);
+        }
+        for (j = 0; j < numnodes; j++) {
+            bigKeysNode *node = nodes+j;
+
+            if (node->done) continue;
+            node->reply = readScan(node->context, &node->it);
+            keys = node->reply->element[1];
+
+            /* Reallocate our type and size array if we need to */
+            if(keys->elements > node->arrsize) {
+                node->types = zrealloc(node->types,
+                    sizeof(typeinfo*)*keys->elements);
+                node->sizes = zrealloc(node->sizes,
+                    sizeof(unsigned long long)*keys->elements);
+                node->arrsize = keys->elements;
             }
-
-            arrsize = keys->elements;
         }
 
         /* Retrieve types and then sizes */
-        getKeyTypes(types_dict, keys, types);
-        getKeySizes(keys, types, sizes, memkeys, memkeys_samples);
+        for (j = 0; j < numnodes; j++) {
+            if (nodes[j].done) continue;
+            sendKeyTypes(nodes[j].context, nodes[j].reply->element[1]);
+        }
+        for (j = 0; j < numnodes; j++) {
+            if (nodes[j].done) continue;
+            getKeyTypes(nodes[j].context, types_dict,
+                        nodes[j].reply->element[1], nodes[j].types);
+        }
+        for (j = 0; j < numnodes; j++) {
+            if (nodes[j].done) continue;
+            sendKeySizes(nodes[j].context, nodes[j].reply->element[1],
+                         nodes[j].types, memkeys, memkeys_samples);
+        }
+        for (j = 0; j < numnodes; j++) {
+            if (nodes[j].done) continue;
+            getKeySizes(nodes[j].context, nodes[j].reply->element[1],
+                        nodes[j].types, nodes[j].sizes, memkeys);
+        }
 
         /* Now update our stats */
-        for(i=0;i<keys->elements;i++) {
-            typeinfo *type = types[i];
-            /* Skip keys that disappeared between SCAN and TYPE */
-            if(!type)
-                continue;
+        active = 0;
+        for (j = 0; j < numnodes; j++) {
+            bigKeysNode *node = nodes+j;
+            typeinfo **types = node->types;
+            unsigned long long *sizes = node->sizes;
+
+            if (node->done) continue;
+            keys = node->reply->element[1];
+            for(i=0;i<keys->elements;i++) {
+                typeinfo *type = types[i];
+                /* Skip keys that disappeared between SCAN and TYPE */
+                if(!type)
+                    continue;
 
-            type->totalsize += sizes[i];
-            type->count++;
-            totlen += keys->element[i]->len;
-            sampled++;
+                type->totalsize += sizes[i];
+                type->count++;
+                totlen += keys->element[i]->len;
+                sampled++;
+
+                if(type->biggest<sizes[i]) {
+                    printf(
+                       "[%05.2f%%] Biggest %-6s found so far '%s' with %llu %s\n",
+                       pct, type->name, keys->element[i]->str, sizes[i],
+                       !memkeys? type->sizeunit: "bytes");
+
+                    /* Keep track of biggest key name for this type */
+                    if (type->biggest_key)
+                        sdsfree(type->biggest_key);
+                    type->biggest_key = sdsnew(keys->element[i]->str);
+                    if(!type->biggest_key) {
+                        fprintf(stderr, "Failed to allocate memory for key!\n");
+                        exit(1);
+                    }
 
-            if(type->biggest<sizes[i]) {
-                printf(
-                   "[%05.2f%%] Biggest %-6s found so far '%s' with %llu %s\n",
-                   pct, type->name, keys->element[i]->str, sizes[i],
-                   !memkeys? type->sizeunit: "bytes");
-
-                /* Keep track of biggest key name for this type */
-                if (type->biggest_key)
-                    sdsfree(type->biggest_key);
-                type->biggest_key = sdsnew(keys->element[i]->str);
-                if(!type->biggest_key) {
-                    fprintf(stderr, "Failed to allocate memory for key!\n");
-                    exit(1);
+                    /* Keep track of the biggest size for this type */
+                    type->biggest = sizes[i];
                 }
 
-                /* Keep track of the biggest size for this type */
-                type->biggest = sizes[i];
-            }
-
-            /* Update overall progress */
-            if(sampled % 1000000 == 0) {
-                printf("[%05.2f%%] Sampled %llu keys so far\n", pct, sampled);
+                /* Update overall progress */
+                if(sampled % 1000000 == 0) {
+                    printf("[%05.2f%%] Sampled %llu keys so far\n", pct, sampled);
+                }
             }
+            freeReplyObject(node->reply);
+            node->reply = NULL;
+            if (node->it == 0)
+                node->done = 1;
+            else
+                active++;
         }
 
         /* Sleep if we've been directed to do so */
         if(sampled && (sampled %100) == 0 && config.interval) {
             usleep(config.interval);
         }
+    } while(active);
 
-        freeReplyObject(reply);
-    } while(it != 0);
-
-    if(types) zfree(types);
-    if(sizes) zfree(sizes);
+    for (j = 0; j < numnodes; j++) {
+        zfree(nodes[j].types);
+        zfree(nodes[j].sizes);
+    }
+    zfree(nodes);
 
     /* We're done */
     printf("\n-------- summary -------\n\n");
@@ -7417,7 +8060,7 @@ static void findHotKeys(void) {
     double pct;
 
     /* Total keys pre scanning */
-    total_keys = getDbSize();
+    total_keys = getDbSize(context);
 
     /* Status message */
     printf("\n# Scanning the entire keyspace to find hot keys as well as\n");
@@ -7854,6 +8497,7 @@ int main(int argc, char **argv) {
     config.hostip = sdsnew("127.0.0.1");
     config.hostport = 6379;
     config.hostsocket = NULL;
+    config.shm = 0;
     config.repeat = 1;
     config.interval = 0;
     config.dbnum = 0;
@@ -7876,7 +8520,12 @@ int main(int argc, char **argv) {
     config.rdb_filename = NULL;
     config.pipe_mode = 0;
     config.pipe_timeout = REDIS_CLI_DEFAULT_PIPE_TIMEOUT;
+    config.pipe_connections = 1;
+    config.bulk_type = NULL;
+    config.bulk_key = NULL;
+    config.bulk_size = 0;
     config.bigkeys = 0;
+    config.scan_count = 0;
     config.hotkeys = 0;
     config.stdinarg = 0;
     config.auth = NULL;
@@ -7960,8 +8609,18 @@ int main(int argc, char **argv) {
 
     /* Pipe mode */
     if (config.pipe_mode) {
+        if (config.pipe_connections > 1 || config.cluster_mode) {
+            pipeModeParallel();
+        } else {
+            if (cliConnect(0) == REDIS_ERR) exit(1);
+            pipeMode();
+        }
+    }
+
+    /* Bulk build mode */
+    if (config.bulk_type) {
         if (cliConnect(0) == REDIS_ERR) exit(1);
-        pipeMode();
+        bulkBuildMode();
     }
 
     /* Find big keys */
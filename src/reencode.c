@@ -0,0 +1,134 @@
+/* Re-encoding of the keyspace after the encoding limits change.
+ *
+ * The small hashes, sets and sorted sets use a compact encoding, as long as
+ * they are within the limits set by options like hash-max-listpack-entries.
+ * When these limits are changed with CONFIG SET, the values already in the
+ * keyspace keep their encoding until they are written again: raising the
+ * limits doesn't save any memory, and lowering them doesn't make the
+ * operations on the larger values faster. So a job is started, that scans
+ * the keyspace incrementally in serverCron(), using a bounded share of the
+ * CPU time, and converts the values to the encoding matching the new
+ * limits. Its progress is reported by INFO stats.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#define REENCODE_TIME_PERC 10 /* Percentage of the CPU time used. */
+
+static struct {
+    int active;              /* Is the keyspace being scanned? */
+    int db;                  /* DB being scanned. */
+    unsigned long cursor;    /* dictScan() cursor in the DB. */
+    long long scanned;       /* Keys scanned so far. */
+    long long converted;     /* Values converted so far. */
+    long long total;         /* Keys in the keyspace when started. */
+} reencode;
+
+static void reencodeScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    robj *o = dictGetVal(de);
+    int converted = 0;
+
+    reencode.scanned++;
+
+    /* Skip the values referenced by jobs in progress, that may be iterating
+     * them, like the ones of the replies created in the background, and the
+     * keys locked by the commands executed in the background. */
+    if (o->refcount != 1 || o->encoding == OBJ_ENCODING_SWAPPED) return;
+    if (dictSize(db->locked_keys)) {
+        robj keyobj;
+        initStaticStringObject(keyobj,dictGetKey(de));
+        if (dictFind(db->locked_keys,&keyobj)) return;
+    }
+
+    switch(o->type) {
+    case OBJ_HASH: converted = hashTypeReencode(o); break;
+    case OBJ_SET: converted = setTypeReencode(o); break;
+    case OBJ_ZSET: converted = zsetReencode(o); break;
+    }
+    reencode.converted += converted;
+}
+
+/* Start scanning the keyspace, or start again if already in progress. Called
+ * when the encoding limits are changed with CONFIG SET. */
+void reencodeStart(void) {
+    reencode.active = 1;
+    reencode.db = 0;
+    reencode.cursor = 0;
+    reencode.scanned = 0;
+    reencode.converted = 0;
+    reencode.total = 0;
+    for (int j = 0; j < server.dbnum; j++)
+        reencode.total += dictSize(server.db[j].dict);
+}
+
+/* Called by serverCron(): scan the keyspace for a bounded amount of time.
+ * Nothing is done while a child process is active, since converting the
+ * values would copy the memory pages they use. */
+void reencodeCron(void) {
+    long long start = ustime(), timelimit;
+    int iterations = 0;
+
+    if (!reencode.active || hasActiveChildProcess()) return;
+
+    timelimit = 1000000*REENCODE_TIME_PERC/server.hz/100;
+    do {
+        redisDb *db = server.db+reencode.db;
+        redisDb *prev = dbMemoryAccountingSwitch(db);
+
+        reencode.cursor = dictScan(db->dict,reencode.cursor,
+            reencodeScanCallback,NULL,db);
+        dbMemoryAccountingSwitch(prev);
+        if (reencode.cursor == 0 && ++reencode.db == server.dbnum) {
+            reencode.active = 0;
+            serverLog(LL_NOTICE,
+                "Keyspace re-encoding done: %lld values converted.",
+                reencode.converted);
+            return;
+        }
+    } while ((++iterations & 15) || ustime()-start < timelimit);
+}
+
+/* Append the re-encoding fields of INFO stats to 'info'. */
+sds genReencodeInfoString(sds info) {
+    double progress = reencode.scanned ? 100 : 0;
+
+    if (reencode.active && reencode.total) {
+        progress = (double)reencode.scanned*100/reencode.total;
+        if (progress > 100) progress = 100;
+    }
+    return sdscatprintf(info,
+        "reencode_in_progress:%d\r\n"
+        "reencode_progress_perc:%.2f\r\n"
+        "reencode_scanned_keys:%lld\r\n"
+        "reencode_converted_keys:%lld\r\n",
+        reencode.active, progress,
+        reencode.scanned, reencode.converted);
+}
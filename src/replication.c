@@ -31,18 +31,24 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
+#include "lz4.h"
 
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 void replicationDiscardCachedMaster(void);
 void replicationResurrectCachedMaster(connection *conn);
 void replicationSendAck(void);
 void putSlaveOnline(client *slave);
 int cancelReplicationHandshake(void);
+static void replBacklogFileAttach(void);
+static void replBacklogFileWrite(const char *s, size_t len);
+static void replBacklogFileLoad(long long offset);
 
 /* --------------------------- Utility functions ---------------------------- */
 
@@ -77,81 +83,305 @@ char *replicationGetSlaveName(client *c) {
 
 void createReplicationBacklog(void) {
     serverAssert(server.repl_backlog == NULL);
-    server.repl_backlog = zmalloc(server.repl_backlog_size);
-    server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
+    server.repl_backlog = zmalloc(sizeof(replBacklog));
+    server.repl_backlog->ref_repl_buf_node = NULL;
+    server.repl_backlog->histlen = 0;
 
     /* We don't have any data inside our buffer, but virtually the first
      * byte we have is the next byte that will be generated for the
      * replication stream. */
-    server.repl_backlog_off = server.master_repl_offset+1;
+    server.repl_backlog->offset = server.master_repl_offset+1;
+
+    /* Continue the history stored in the persistent backlog if possible. */
+    if (server.repl_backlog_map) replBacklogFileAttach();
 }
 
 /* This function is called when the user modifies the replication backlog
- * size at runtime. It is up to the function to both update the
- * server.repl_backlog_size and to resize the buffer and setup it so that
- * it contains the same data as the previous one (possibly less data, but
- * the most recent bytes, or the same data and more free space in case the
- * buffer is enlarged). */
+ * size at runtime. Since the backlog is just a reference into the shared
+ * replication buffer there is nothing to reallocate: if the size is reduced
+ * the oldest blocks are released incrementally, otherwise the backlog will
+ * just retain more of the data that is going to be generated. */
 void resizeReplicationBacklog(long long newsize) {
     if (newsize < CONFIG_REPL_BACKLOG_MIN_SIZE)
         newsize = CONFIG_REPL_BACKLOG_MIN_SIZE;
     if (server.repl_backlog_size == newsize) return;
 
     server.repl_backlog_size = newsize;
-    if (server.repl_backlog != NULL) {
-        /* What we actually do is to flush the old buffer and realloc a new
-         * empty one. It will refill with new data incrementally.
-         * The reason is that copying a few gigabytes adds latency and even
-         * worse often we need to alloc additional space before freeing the
-         * old buffer. */
-        zfree(server.repl_backlog);
-        server.repl_backlog = zmalloc(server.repl_backlog_size);
-        server.repl_backlog_histlen = 0;
-        server.repl_backlog_idx = 0;
-        /* Next byte we have is... the next since the buffer is empty. */
-        server.repl_backlog_off = server.master_repl_offset+1;
-    }
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* Free method of the server.repl_buffer_blocks list. */
+void freeReplBufBlock(void *o) {
+    if (((replBufBlock*)o)->spilled)
+        spillRelease(o);
+    else
+        zfree_class(o,ZMALLOC_CLASS_TRANSIENT);
+}
+
+/* Memory used by a block of the replication buffer and its list node. */
+static size_t replBufBlockMem(replBufBlock *o) {
+    return (o->spilled ? 0 : zmalloc_size(o)) + sizeof(listNode);
 }
 
 void freeReplicationBacklog(void) {
     serverAssert(listLength(server.slaves) == 0);
+    if (server.repl_backlog == NULL) return;
+
+    /* Without slaves the backlog is the only user of the replication
+     * buffer, so we can release all its blocks. */
+    listEmpty(server.repl_buffer_blocks);
+    server.repl_buffer_mem = 0;
+    server.repl_buffer_spill_last = NULL;
     zfree(server.repl_backlog);
     server.repl_backlog = NULL;
 }
 
-/* Add data to the replication backlog.
+/* Release the first blocks of the replication buffer while the backlog is
+ * bigger than its configured size, up to 'max_blocks' blocks per call, so
+ * that releasing a lot of memory does not block the server for too long.
+ *
+ * Blocks are only released when the backlog is the last one referencing
+ * them: slaves lagging behind keep the blocks they still have to send, so
+ * in that case the backlog may hold more data than configured, and PSYNC
+ * is accepted for all of it. */
+void incrementalTrimReplicationBacklog(size_t max_blocks) {
+    size_t trimmed = 0;
+
+    if (server.repl_backlog == NULL) return;
+    while (server.repl_backlog->histlen > server.repl_backlog_size &&
+           trimmed < max_blocks)
+    {
+        listNode *first = listFirst(server.repl_buffer_blocks);
+        listNode *next;
+
+        /* We never trim the backlog to less than one block. */
+        if (first == NULL || (next = listNextNode(first)) == NULL) break;
+        serverAssert(first == server.repl_backlog->ref_repl_buf_node);
+
+        replBufBlock *fo = listNodeValue(first);
+        if (fo->refcount != 1) break;
+
+        /* Don't release the block if the backlog would be left with less
+         * data than configured. */
+        if (server.repl_backlog->histlen - (long long)fo->used <
+            server.repl_backlog_size) break;
+
+        ((replBufBlock*)listNodeValue(next))->refcount++;
+        server.repl_backlog->ref_repl_buf_node = next;
+        server.repl_backlog->histlen -= fo->used;
+        server.repl_buffer_mem -= replBufBlockMem(fo);
+        if (server.repl_buffer_spill_last == first)
+            server.repl_buffer_spill_last = NULL;
+        listDelNode(server.repl_buffer_blocks,first);
+        trimmed++;
+    }
+
+    /* Set the offset of the first byte we have in the backlog. */
+    server.repl_backlog->offset = server.master_repl_offset -
+                                  server.repl_backlog->histlen + 1;
+}
+
+/* Slaves waiting for a BGSAVE to start don't accumulate the replication
+ * stream: they'll start from the offset of the RDB they'll receive. */
+static int canFeedReplicaReplBuffer(client *slave) {
+    return slave->replstate != SLAVE_STATE_WAIT_BGSAVE_START;
+}
+
+/* Schedule the write of the slaves that had nothing left to send, since we
+ * are going to add more data to the replication buffer. This must be called
+ * before feedReplicationBuffer(), after that they have pending data. */
+static void prepareReplicasToWrite(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+        if (!clientHasPendingReplies(slave)) clientInstallWriteHandler(slave);
+    }
+}
+
+/* When client-output-buffer-spill-threshold is set, move to the spill file
+ * the blocks of the replication buffer that the slowest replica still has
+ * to send, while more than the threshold of them is in memory, see spill.c.
+ * The spilled blocks stay mapped, so they are sent to the replicas and
+ * served to PSYNC as usual.
+ *
+ * The blocks are considered in order, up to server.repl_buffer_spill_last:
+ * the ones before the slowest replica, that are only retained by the
+ * backlog, are left in memory. The tail block is never spilled since the
+ * stream is appended to it. */
+static void spillReplicationBuffer(void) {
+    long long oldest = LLONG_MAX;
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (slave->ref_repl_buf_node == NULL) continue;
+        replBufBlock *o = listNodeValue(slave->ref_repl_buf_node);
+        if (o->id < oldest) oldest = o->id;
+    }
+    if (oldest == LLONG_MAX) return;
+
+    listNode *last = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = listNodeValue(last);
+    ln = server.repl_buffer_spill_last ?
+         listNextNode(server.repl_buffer_spill_last) :
+         listFirst(server.repl_buffer_blocks);
+    while (ln != last) {
+        replBufBlock *o = listNodeValue(ln), *copy;
+
+        if (tail->repl_offset + (long long)tail->used - o->repl_offset <=
+            server.client_obuf_spill_threshold) break;
+        if (o->id >= oldest) {
+            copy = spillStore(o,sizeof(*o)+o->size);
+            if (copy == NULL) break;
+            copy->spilled = 1;
+            server.repl_buffer_mem -= zmalloc_size(o);
+            listNodeValue(ln) = copy;
+            zfree_class(o,ZMALLOC_CLASS_TRANSIENT);
+        }
+        server.repl_buffer_spill_last = ln;
+        ln = listNextNode(ln);
+    }
+}
+
+/* Unique incremental number of the replication buffer blocks. */
+static long long repl_block_id = 0;
+
+/* Add data to the replication buffer, that is both the replication backlog
+ * and the output buffer of all the slaves: the data is stored only once,
+ * and the slaves that did not reference the buffer yet start from the
+ * first byte added here.
  * This function also increments the global replication offset stored at
  * server.master_repl_offset, because there is no case where we want to feed
  * the backlog without incrementing the offset. */
-void feedReplicationBacklog(void *ptr, size_t len) {
-    unsigned char *p = ptr;
+void feedReplicationBuffer(char *s, size_t len) {
+    listNode *start_node = NULL; /* Block where the new data starts. */
+    size_t start_pos = 0;        /* Position of the new data in start_node. */
+    int add_new_block = 0;
+    listIter li;
+    listNode *ln;
 
+    if (server.repl_backlog == NULL) return;
+    if (server.repl_batch) {
+        server.repl_batch = sdscatlen(server.repl_batch,s,len);
+        return;
+    }
+    if (server.repl_backlog_map) replBacklogFileWrite(s,len);
     server.master_repl_offset += len;
+    server.repl_backlog->histlen += len;
+
+    /* Append to the tail block when possible. */
+    ln = listLast(server.repl_buffer_blocks);
+    replBufBlock *tail = ln ? listNodeValue(ln) : NULL;
+    if (tail && tail->size > tail->used) {
+        size_t avail = tail->size - tail->used;
+        size_t copy = avail >= len ? len : avail;
+
+        start_node = ln;
+        start_pos = tail->used;
+        memcpy(tail->buf + tail->used, s, copy);
+        tail->used += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (len) {
+        /* Create a new block, of at least PROTO_REPLY_CHUNK_BYTES, taking
+         * over the internal fragmentation of the allocation. */
+        size_t size = len < PROTO_REPLY_CHUNK_BYTES ? PROTO_REPLY_CHUNK_BYTES : len;
+        tail = zmalloc_class(size + sizeof(replBufBlock),ZMALLOC_CLASS_TRANSIENT);
+        tail->size = zmalloc_usable(tail) - sizeof(replBufBlock);
+        tail->used = len;
+        tail->refcount = 0;
+        tail->spilled = 0;
+        tail->repl_offset = server.master_repl_offset - len + 1;
+        tail->id = repl_block_id++;
+        memcpy(tail->buf, s, len);
+        listAddNodeTail(server.repl_buffer_blocks, tail);
+        server.repl_buffer_mem += replBufBlockMem(tail);
+        TRACE3(repl_buffer_new_block,tail->id,tail->size,
+               server.repl_buffer_mem);
+        add_new_block = 1;
+        if (start_node == NULL) {
+            start_node = listLast(server.repl_buffer_blocks);
+            start_pos = 0;
+        }
+    }
 
-    /* This is a circular buffer, so write as much data we can at every
-     * iteration and rewind the "idx" index if we reach the limit. */
-    while(len) {
-        size_t thislen = server.repl_backlog_size - server.repl_backlog_idx;
-        if (thislen > len) thislen = len;
-        memcpy(server.repl_backlog+server.repl_backlog_idx,p,thislen);
-        server.repl_backlog_idx += thislen;
-        if (server.repl_backlog_idx == server.repl_backlog_size)
-            server.repl_backlog_idx = 0;
-        len -= thislen;
-        p += thislen;
-        server.repl_backlog_histlen += thislen;
-    }
-    if (server.repl_backlog_histlen > server.repl_backlog_size)
-        server.repl_backlog_histlen = server.repl_backlog_size;
-    /* Set the offset of the first byte we have in the backlog. */
-    server.repl_backlog_off = server.master_repl_offset -
-                              server.repl_backlog_histlen + 1;
+    /* Spill the buffer before checking the output buffer limits of the
+     * slaves, that don't account the spilled blocks. */
+    if (add_new_block && server.client_obuf_spill_threshold)
+        spillReplicationBuffer();
+
+    listRewind(server.slaves,&li);
+    while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (!canFeedReplicaReplBuffer(slave)) continue;
+
+        /* Slaves that are waiting for the initial SYNC (so these commands
+         * are accumulated until the initial SYNC completes), or that are
+         * already in sync, start referencing the buffer from here. */
+        if (slave->ref_repl_buf_node == NULL) {
+            slave->ref_repl_buf_node = start_node;
+            slave->ref_block_pos = start_pos;
+            ((replBufBlock*)listNodeValue(start_node))->refcount++;
+        }
+
+        /* The memory used by a slave only grows with new blocks. */
+        if (add_new_block) asyncCloseClientOnOutputBufferLimitReached(slave);
+    }
+
+    /* The backlog starts referencing the buffer when the first data is
+     * added, so it is always the owner of the first block. */
+    if (server.repl_backlog->ref_repl_buf_node == NULL) {
+        serverAssert(add_new_block && start_pos == 0);
+        server.repl_backlog->ref_repl_buf_node = start_node;
+        ((replBufBlock*)listNodeValue(start_node))->refcount++;
+    }
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+}
+
+/* Start accumulating the replication stream into server.repl_batch instead
+ * of adding it to the replication buffer: every feedReplicationBuffer() call
+ * updates the replication buffer, the offsets and the slaves references, so
+ * EXEC uses a batch to add the stream of the whole transaction at once, with
+ * replicationEndBatch(). Batches can't be nested. */
+void replicationBeginBatch(void) {
+    serverAssert(server.repl_batch == NULL);
+    server.repl_batch = sdsempty();
+}
+
+/* Add the replication stream accumulated so far by the current batch, if
+ * any, to the replication buffer. Must be called before anything depending
+ * on the replication offset or on the backlog, like turning the instance
+ * into a replica, can happen during the batch. */
+void replicationFlushBatch(void) {
+    sds batch = server.repl_batch;
+
+    if (batch == NULL || sdslen(batch) == 0) return;
+    server.repl_batch = NULL;
+    feedReplicationBuffer(batch,sdslen(batch));
+    sdsclear(batch);
+    server.repl_batch = batch;
 }
 
-/* Wrapper for feedReplicationBacklog() that takes Redis string objects
+/* Flush and terminate the batch started with replicationBeginBatch(). */
+void replicationEndBatch(void) {
+    replicationFlushBatch();
+    sdsfree(server.repl_batch);
+    server.repl_batch = NULL;
+}
+
+/* Wrapper for feedReplicationBuffer() that takes Redis string objects
  * as input. */
-void feedReplicationBacklogWithObject(robj *o) {
+void feedReplicationBufferWithObject(robj *o) {
     char llstr[LONG_STR_SIZE];
     void *p;
     size_t len;
@@ -159,11 +389,236 @@ void feedReplicationBacklogWithObject(robj *o) {
     if (o->encoding == OBJ_ENCODING_INT) {
         len = ll2string(llstr,sizeof(llstr),(long)o->ptr);
         p = llstr;
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        p = stringDecompressToScratch(o,&len);
     } else {
         len = sdslen(o->ptr);
         p = o->ptr;
     }
-    feedReplicationBacklog(p,len);
+    feedReplicationBuffer(p,len);
+}
+
+/* Release the reference the slave holds to the replication buffer, so that
+ * the blocks it was still going to send can be trimmed. */
+void freeReplicaReferencedReplBuffer(client *slave) {
+    if (slave->ref_repl_buf_node != NULL) {
+        replBufBlock *o = listNodeValue(slave->ref_repl_buf_node);
+        serverAssert(o->refcount > 0);
+        o->refcount--;
+        incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL);
+    }
+    slave->ref_repl_buf_node = NULL;
+    slave->ref_block_pos = 0;
+}
+
+/* --------------------------- PERSISTENT BACKLOG --------------------------- */
+
+/* When repl-backlog-file is set, the replication stream is also written
+ * into a memory mapped ring on disk, that can be made much bigger than the
+ * in memory backlog since it just costs page cache. When the backlog is
+ * created again after a restart, it continues the history stored in the
+ * file, so that the replicas of a restarted master, or of a restarted
+ * replica in a chain, can still partially resync. Only the last
+ * repl-backlog-size bytes are loaded in memory, the older parts of the file
+ * are loaded when a replica asks for them.
+ *
+ * The file is trusted only when it ends exactly at the replication offset
+ * of the dataset, with the same replication ID: after a crash the RDB file
+ * is older than the stream stored in the file, and a new history is started
+ * as usual. The header uses the native byte order, the file is not meant to
+ * be moved to another host. */
+
+#define REPL_BACKLOG_FILE_MAGIC "REDISBKL"
+#define REPL_BACKLOG_FILE_VERSION 1
+#define REPL_BACKLOG_FILE_HDR_LEN 4096
+#define REPL_BACKLOG_FILE_BLOCK_LEN (1024*1024)
+
+static char *replBacklogFileData(void) {
+    return (char*)server.repl_backlog_map + REPL_BACKLOG_FILE_HDR_LEN;
+}
+
+/* Open and map the backlog file. This is called at startup, before loading
+ * the dataset. A file created with a different size is discarded. */
+void replBacklogFileOpen(void) {
+    replBacklogFileHeader *hdr;
+    off_t len = REPL_BACKLOG_FILE_HDR_LEN + server.repl_backlog_file_size;
+    struct stat sb;
+    int fd;
+
+    if (server.repl_backlog_filename == NULL) return;
+    fd = open(server.repl_backlog_filename,O_RDWR|O_CREAT,0644);
+    if (fd == -1 || fstat(fd,&sb) == -1) goto error;
+    if (sb.st_size != len) {
+        if (ftruncate(fd,len) == -1) goto error;
+#ifdef __linux__
+        /* Reserve the space now: running out of disk while writing a
+         * memory mapped file kills the process with SIGBUS. */
+        if ((errno = posix_fallocate(fd,0,len)) != 0) goto error;
+#endif
+    }
+    hdr = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (hdr == MAP_FAILED) goto error;
+
+    if (memcmp(hdr->magic,REPL_BACKLOG_FILE_MAGIC,sizeof(hdr->magic)) ||
+        hdr->version != REPL_BACKLOG_FILE_VERSION ||
+        hdr->size != server.repl_backlog_file_size)
+    {
+        memset(hdr,0,sizeof(*hdr));
+        memcpy(hdr->magic,REPL_BACKLOG_FILE_MAGIC,sizeof(hdr->magic));
+        hdr->version = REPL_BACKLOG_FILE_VERSION;
+        hdr->size = server.repl_backlog_file_size;
+        hdr->offset = 1;
+        hdr->end_offset = 0;
+    }
+    server.repl_backlog_file_fd = fd;
+    server.repl_backlog_map = hdr;
+    return;
+
+error:
+    serverLog(LL_WARNING,"Can't open the replication backlog file %s: %s",
+        server.repl_backlog_filename, strerror(errno));
+    exit(1);
+}
+
+/* Store the current replication IDs in the header and flush the file,
+ * waiting for the data to reach the disk if 'sync' is true. Called every
+ * second by replicationCron() and at shutdown. Without a backlog the file
+ * no longer follows our history, and the IDs are left untouched. */
+void replBacklogFileSync(int sync) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+
+    if (hdr == NULL) return;
+    if (server.repl_backlog) {
+        memcpy(hdr->replid,server.replid,sizeof(hdr->replid));
+        memcpy(hdr->replid2,server.replid2,sizeof(hdr->replid2));
+        hdr->second_replid_offset = server.second_replid_offset;
+    }
+    msync(hdr,REPL_BACKLOG_FILE_HDR_LEN+hdr->size,sync ? MS_SYNC : MS_ASYNC);
+}
+
+/* Append the data added to the replication buffer to the file. */
+static void replBacklogFileWrite(const char *s, size_t len) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+    char *data = replBacklogFileData();
+
+    /* Only the last 'size' bytes fit in the ring. */
+    if ((long long)len > hdr->size) {
+        hdr->end_offset += len - hdr->size;
+        s += len - hdr->size;
+        len = hdr->size;
+    }
+    while(len) {
+        long long pos = (hdr->end_offset+1) % hdr->size;
+        size_t copy = hdr->size - pos;
+
+        if (copy > len) copy = len;
+        memcpy(data+pos,s,copy);
+        hdr->end_offset += copy;
+        s += copy;
+        len -= copy;
+    }
+    if (hdr->end_offset - hdr->offset + 1 > hdr->size)
+        hdr->offset = hdr->end_offset - hdr->size + 1;
+}
+
+/* Copy 'len' bytes of the stream starting at 'offset' from the file. */
+static void replBacklogFileRead(long long offset, char *buf, size_t len) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+    char *data = replBacklogFileData();
+
+    while(len) {
+        long long pos = offset % hdr->size;
+        size_t copy = hdr->size - pos;
+
+        if (copy > len) copy = len;
+        memcpy(buf,data+pos,copy);
+        offset += copy;
+        buf += copy;
+        len -= copy;
+    }
+}
+
+/* Called when the backlog is created: if the file stores the history of our
+ * current replication ID up to our offset, load its last part in memory,
+ * otherwise start storing the new history. */
+static void replBacklogFileAttach(void) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+
+    if (!memcmp(hdr->replid,server.replid,CONFIG_RUN_ID_SIZE) &&
+        hdr->end_offset == server.master_repl_offset)
+    {
+        long long offset = server.master_repl_offset+1 -
+                           server.repl_backlog_size;
+        if (offset < hdr->offset) offset = hdr->offset;
+        replBacklogFileLoad(offset);
+        return;
+    }
+    memcpy(hdr->replid,server.replid,sizeof(hdr->replid));
+    memcpy(hdr->replid2,server.replid2,sizeof(hdr->replid2));
+    hdr->second_replid_offset = server.second_replid_offset;
+    hdr->offset = server.master_repl_offset+1;
+    hdr->end_offset = server.master_repl_offset;
+}
+
+/* Add to the head of the replication buffer the part of the stream stored
+ * in the file from 'offset' up to the first byte of the backlog, so that it
+ * can be served like the rest of the backlog. The blocks loaded this way are
+ * trimmed as usual when no replica needs them. Nothing is done if the file
+ * doesn't have the data. */
+static void replBacklogFileLoad(long long offset) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+    replBacklog *bl = server.repl_backlog;
+    listNode *first = listFirst(server.repl_buffer_blocks);
+    long long id = first ? ((replBufBlock*)listNodeValue(first))->id :
+                           repl_block_id;
+    long long end = bl->offset;
+    replBufBlock *o;
+
+    if (hdr == NULL || offset < hdr->offset || offset >= bl->offset ||
+        hdr->end_offset != server.master_repl_offset) return;
+
+    while(end > offset) {
+        size_t len = end - offset;
+
+        if (len > REPL_BACKLOG_FILE_BLOCK_LEN) len = REPL_BACKLOG_FILE_BLOCK_LEN;
+        o = zmalloc_class(len + sizeof(replBufBlock),ZMALLOC_CLASS_TRANSIENT);
+        o->size = o->used = len;
+        o->refcount = 0;
+        o->spilled = 0;
+        o->repl_offset = end - len;
+        o->id = --id;
+        replBacklogFileRead(o->repl_offset,o->buf,len);
+        listAddNodeHead(server.repl_buffer_blocks,o);
+        server.repl_buffer_mem += replBufBlockMem(o);
+        end -= len;
+    }
+
+    /* The backlog is always the owner of the first block. */
+    if (bl->ref_repl_buf_node)
+        ((replBufBlock*)listNodeValue(bl->ref_repl_buf_node))->refcount--;
+    bl->ref_repl_buf_node = listFirst(server.repl_buffer_blocks);
+    ((replBufBlock*)listNodeValue(bl->ref_repl_buf_node))->refcount++;
+    bl->histlen += bl->offset - offset;
+    bl->offset = offset;
+}
+
+/* Restore the replication history of a restarted master from the file, if
+ * it was written up to the replication offset of the RDB file we loaded.
+ * Returns 1 if the backlog was restored, otherwise 0. */
+int replBacklogFileRestoreMaster(rdbSaveInfo *rsi) {
+    replBacklogFileHeader *hdr = server.repl_backlog_map;
+
+    if (hdr == NULL ||
+        memcmp(hdr->replid,rsi->repl_id,CONFIG_RUN_ID_SIZE) ||
+        hdr->end_offset != rsi->repl_offset) return 0;
+
+    memcpy(server.replid,rsi->repl_id,CONFIG_RUN_ID_SIZE);
+    server.replid[CONFIG_RUN_ID_SIZE] = '\0';
+    memcpy(server.replid2,hdr->replid2,sizeof(server.replid2));
+    server.second_replid_offset = hdr->second_replid_offset;
+    server.master_repl_offset = rsi->repl_offset;
+    createReplicationBacklog();
+    return 1;
 }
 
 /* Propagate write commands to slaves, and populate the replication backlog
@@ -172,8 +627,6 @@ void feedReplicationBacklogWithObject(robj *o) {
  * stream. Instead if the instance is a slave and has sub-slaves attached,
  * we use replicationFeedSlavesFromMaster() */
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
-    listNode *ln;
-    listIter li;
     int j, len;
     char llstr[LONG_STR_SIZE];
 
@@ -184,6 +637,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
      * master replication history and has the same backlog and offsets). */
     if (server.masterhost != NULL) return;
 
+    /* The writes to a slot that is being migrated are also streamed to the
+     * node the slot is moving to. */
+    if (server.cluster_enabled) clusterFeedSlotMigration(argv,argc);
+
     /* If there aren't slaves, and there is no backlog buffer to populate,
      * we can return ASAP. */
     if (server.repl_backlog == NULL && listLength(slaves) == 0) return;
@@ -191,6 +648,10 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* The command is written once into the replication buffer, where every
+     * slave will send it from. */
+    prepareReplicasToWrite();
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -208,68 +669,37 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
                 dictid_len, llstr));
         }
 
-        /* Add the SELECT command into the backlog. */
-        if (server.repl_backlog) feedReplicationBacklogWithObject(selectcmd);
-
-        /* Send it to slaves. */
-        listRewind(slaves,&li);
-        while((ln = listNext(&li))) {
-            client *slave = ln->value;
-            if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-            addReply(slave,selectcmd);
-        }
+        /* Add the SELECT command into the replication buffer. */
+        feedReplicationBufferWithObject(selectcmd);
 
         if (dictid < 0 || dictid >= PROTO_SHARED_SELECT_CMDS)
             decrRefCount(selectcmd);
     }
     server.slaveseldb = dictid;
 
-    /* Write the command to the replication backlog if any. */
-    if (server.repl_backlog) {
-        char aux[LONG_STR_SIZE+3];
-
-        /* Add the multi bulk reply length. */
-        aux[0] = '*';
-        len = ll2string(aux+1,sizeof(aux)-1,argc);
-        aux[len+1] = '\r';
-        aux[len+2] = '\n';
-        feedReplicationBacklog(aux,len+3);
-
-        for (j = 0; j < argc; j++) {
-            long objlen = stringObjectLen(argv[j]);
-
-            /* We need to feed the buffer with the object as a bulk reply
-             * not just as a plain string, so create the $..CRLF payload len
-             * and add the final CRLF */
-            aux[0] = '$';
-            len = ll2string(aux+1,sizeof(aux)-1,objlen);
-            aux[len+1] = '\r';
-            aux[len+2] = '\n';
-            feedReplicationBacklog(aux,len+3);
-            feedReplicationBacklogWithObject(argv[j]);
-            feedReplicationBacklog(aux+len+1,2);
-        }
-    }
-
-    /* Write the command to every slave. */
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
+    /* Write the command to the replication buffer. */
+    char aux[LONG_STR_SIZE+3];
 
-        /* Don't feed slaves that are still waiting for BGSAVE to start. */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
+    /* Add the multi bulk reply length. */
+    aux[0] = '*';
+    len = ll2string(aux+1,sizeof(aux)-1,argc);
+    aux[len+1] = '\r';
+    aux[len+2] = '\n';
+    feedReplicationBuffer(aux,len+3);
 
-        /* Feed slaves that are waiting for the initial SYNC (so these commands
-         * are queued in the output buffer until the initial SYNC completes),
-         * or are already in sync with the master. */
-
-        /* Add the multi bulk length. */
-        addReplyArrayLen(slave,argc);
+    for (j = 0; j < argc; j++) {
+        long objlen = stringObjectLen(argv[j]);
 
-        /* Finally any additional argument that was not stored inside the
-         * static buffer if any (from j to argc). */
-        for (j = 0; j < argc; j++)
-            addReplyBulk(slave,argv[j]);
+        /* We need to feed the buffer with the object as a bulk reply
+         * not just as a plain string, so create the $..CRLF payload len
+         * and add the final CRLF */
+        aux[0] = '$';
+        len = ll2string(aux+1,sizeof(aux)-1,objlen);
+        aux[len+1] = '\r';
+        aux[len+2] = '\n';
+        feedReplicationBuffer(aux,len+3);
+        feedReplicationBufferWithObject(argv[j]);
+        feedReplicationBuffer(aux+len+1,2);
     }
 }
 
@@ -277,8 +707,7 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
  * to our sub-slaves. */
 #include <ctype.h>
 void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t buflen) {
-    listNode *ln;
-    listIter li;
+    UNUSED(slaves);
 
     /* Debugging: this is handy to see the stream sent from master
      * to slaves. Disabled with if(0). */
@@ -290,15 +719,11 @@ void replicationFeedSlavesFromMasterStream(list *slaves, char *buf, size_t bufle
         printf("\n");
     }
 
-    if (server.repl_backlog) feedReplicationBacklog(buf,buflen);
-    listRewind(slaves,&li);
-    while((ln = listNext(&li))) {
-        client *slave = ln->value;
-
-        /* Don't feed slaves that are still waiting for BGSAVE to start. */
-        if (slave->replstate == SLAVE_STATE_WAIT_BGSAVE_START) continue;
-        addReplyProto(slave,buf,buflen);
-    }
+    /* There are no slaves without a backlog, and the stream is written
+     * only once into the replication buffer shared with them. */
+    if (server.repl_backlog == NULL) return;
+    prepareReplicasToWrite();
+    feedReplicationBuffer(buf,buflen);
 }
 
 void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv, int argc) {
@@ -322,6 +747,10 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
     for (j = 0; j < argc; j++) {
         if (argv[j]->encoding == OBJ_ENCODING_INT) {
             cmdrepr = sdscatprintf(cmdrepr, "\"%ld\"", (long)argv[j]->ptr);
+        } else if (argv[j]->encoding == OBJ_ENCODING_COMPRESSED) {
+            size_t len;
+            char *buf = stringDecompressToScratch(argv[j],&len);
+            cmdrepr = sdscatrepr(cmdrepr,buf,len);
         } else {
             cmdrepr = sdscatrepr(cmdrepr,(char*)argv[j]->ptr,
                         sdslen(argv[j]->ptr));
@@ -341,13 +770,17 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
 }
 
 /* Feed the slave 'c' with the replication backlog starting from the
- * specified 'offset' up to the end of the backlog. */
+ * specified 'offset' up to the end of the backlog. Nothing is copied: the
+ * slave just starts referencing the block of the replication buffer where
+ * the byte at 'offset' is stored. */
 long long addReplyReplicationBacklog(client *c, long long offset) {
-    long long j, skip, len;
+    long long skip;
+    listNode *node;
+    replBufBlock *o;
 
     serverLog(LL_DEBUG, "[PSYNC] Replica request offset: %lld", offset);
 
-    if (server.repl_backlog_histlen == 0) {
+    if (server.repl_backlog->histlen == 0) {
         serverLog(LL_DEBUG, "[PSYNC] Backlog history len is zero");
         return 0;
     }
@@ -355,41 +788,32 @@ long long addReplyReplicationBacklog(client *c, long long offset) {
     serverLog(LL_DEBUG, "[PSYNC] Backlog size: %lld",
              server.repl_backlog_size);
     serverLog(LL_DEBUG, "[PSYNC] First byte: %lld",
-             server.repl_backlog_off);
+             server.repl_backlog->offset);
     serverLog(LL_DEBUG, "[PSYNC] History len: %lld",
-             server.repl_backlog_histlen);
-    serverLog(LL_DEBUG, "[PSYNC] Current index: %lld",
-             server.repl_backlog_idx);
+             server.repl_backlog->histlen);
 
     /* Compute the amount of bytes we need to discard. */
-    skip = offset - server.repl_backlog_off;
+    skip = offset - server.repl_backlog->offset;
     serverLog(LL_DEBUG, "[PSYNC] Skipping: %lld", skip);
 
-    /* Point j to the oldest byte, that is actually our
-     * server.repl_backlog_off byte. */
-    j = (server.repl_backlog_idx +
-        (server.repl_backlog_size-server.repl_backlog_histlen)) %
-        server.repl_backlog_size;
-    serverLog(LL_DEBUG, "[PSYNC] Index of first byte: %lld", j);
-
-    /* Discard the amount of data to seek to the specified 'offset'. */
-    j = (j + skip) % server.repl_backlog_size;
-
-    /* Feed slave with data. Since it is a circular buffer we have to
-     * split the reply in two parts if we are cross-boundary. */
-    len = server.repl_backlog_histlen - skip;
-    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld", len);
-    while(len) {
-        long long thislen =
-            ((server.repl_backlog_size - j) < len) ?
-            (server.repl_backlog_size - j) : len;
-
-        serverLog(LL_DEBUG, "[PSYNC] addReply() length: %lld", thislen);
-        addReplySds(c,sdsnewlen(server.repl_backlog + j, thislen));
-        len -= thislen;
-        j = 0;
+    /* Seek the block holding the byte at 'offset'. PSYNC is rare enough
+     * that a linear scan of the blocks is fine. */
+    node = server.repl_backlog->ref_repl_buf_node;
+    while(node) {
+        o = listNodeValue(node);
+        if (o->repl_offset + (long long)o->used >= offset) break;
+        node = listNextNode(node);
     }
-    return server.repl_backlog_histlen - skip;
+    serverAssert(node != NULL);
+
+    if (!clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+    o = listNodeValue(node);
+    o->refcount++;
+    c->ref_repl_buf_node = node;
+    c->ref_block_pos = offset - o->repl_offset;
+    serverLog(LL_DEBUG, "[PSYNC] Reply total length: %lld",
+             server.repl_backlog->histlen - skip);
+    return server.repl_backlog->histlen - skip;
 }
 
 /* Return the offset to provide as reply to the PSYNC command received
@@ -488,10 +912,14 @@ int masterTryPartialResynchronization(client *c) {
         goto need_full_resync;
     }
 
+    /* Older parts of the stream may still be in the backlog file. */
+    if (server.repl_backlog && psync_offset < server.repl_backlog->offset)
+        replBacklogFileLoad(psync_offset);
+
     /* We still have the data our slave is asking for? */
     if (!server.repl_backlog ||
-        psync_offset < server.repl_backlog_off ||
-        psync_offset > (server.repl_backlog_off + server.repl_backlog_histlen))
+        psync_offset < server.repl_backlog->offset ||
+        psync_offset > (server.repl_backlog->offset + server.repl_backlog->histlen))
     {
         serverLog(LL_NOTICE,
             "Unable to partial resync with replica %s for lack of backlog (Replica request was: %lld).", replicationGetSlaveName(c), psync_offset);
@@ -581,6 +1009,11 @@ int startBgsaveForReplication(int mincapa) {
     /* Only do rdbSave* when rsiptr is not NULL,
      * otherwise slave will miss repl-stream-db. */
     if (rsiptr) {
+        /* Use LZ4 only if all the slaves are able to load it. Slaves
+         * attaching later to this BGSAVE must have the same capabilities,
+         * so they can load it as well. */
+        if (!(mincapa & SLAVE_CAPA_LZ4))
+            rsiptr->rdb_compression = RDB_COMPRESSION_LZF;
         if (socket_target)
             retval = rdbSaveToSlavesSockets(rsiptr);
         else
@@ -684,6 +1117,9 @@ void syncCommand(client *c) {
         c->flags |= CLIENT_PRE_PSYNC;
     }
 
+    /* Change data capture consumers may not want the RDB at all. */
+    if (replicationCdcFullResyncWithoutRdb(c) == C_OK) return;
+
     /* Full resynchronization. */
     server.stat_sync_full++;
 
@@ -727,7 +1163,7 @@ void syncCommand(client *c) {
         if (ln && ((c->slave_capa & slave->slave_capa) == slave->slave_capa)) {
             /* Perfect, the server is already registering differences for
              * another slave. Set the right state, and copy the buffer. */
-            copyClientOutputBuffer(c,slave);
+            copyReplicaOutputBuffer(c,slave);
             replicationSetupSlaveForFullResync(c,slave->psync_initial_offset);
             serverLog(LL_NOTICE,"Waiting for end of BGSAVE for SYNC");
         } else {
@@ -757,7 +1193,7 @@ void syncCommand(client *c) {
             /* Target is disk (or the slave is not capable of supporting
              * diskless replication) and we don't have a BGSAVE in progress,
              * let's start one. */
-            if (!hasActiveChildProcess()) {
+            if (!hasActiveChildProcess() && !server.rdb_forkless) {
                 startBgsaveForReplication(c->slave_capa);
             } else {
                 serverLog(LL_NOTICE,
@@ -793,7 +1229,11 @@ void replconfCommand(client *c) {
 
     /* Process every option-value pair. */
     for (j = 1; j < c->argc; j+=2) {
-        if (!strcasecmp(c->argv[j]->ptr,"listening-port")) {
+        int err;
+
+        if (replicationCdcConfig(c,c->argv[j]->ptr,c->argv[j+1],&err)) {
+            if (err == C_ERR) return;
+        } else if (!strcasecmp(c->argv[j]->ptr,"listening-port")) {
             long port;
 
             if ((getLongFromObjectOrReply(c,c->argv[j+1],
@@ -815,6 +1255,21 @@ void replconfCommand(client *c) {
                 c->slave_capa |= SLAVE_CAPA_EOF;
             else if (!strcasecmp(c->argv[j+1]->ptr,"psync2"))
                 c->slave_capa |= SLAVE_CAPA_PSYNC2;
+            else if (!strcasecmp(c->argv[j+1]->ptr,"lz4"))
+                c->slave_capa |= SLAVE_CAPA_LZ4;
+        } else if (!strcasecmp(c->argv[j]->ptr,"compress")) {
+            /* The slave asks to get the replication stream compressed. */
+            if (strcasecmp(c->argv[j+1]->ptr,"lz4")) {
+                addReplyErrorFormat(c,"Unsupported replication stream "
+                    "compression: %s", (char*)c->argv[j+1]->ptr);
+                return;
+            }
+            if (c->repl_cdc) {
+                addReplyError(c,"Change data capture can't be used with a "
+                                "compressed stream");
+                return;
+            }
+            c->repl_compress = 1;
         } else if (!strcasecmp(c->argv[j]->ptr,"ack")) {
             /* REPLCONF ACK is used by slave to inform the master the amount
              * of replication stream that it processed so far. It is an
@@ -838,8 +1293,9 @@ void replconfCommand(client *c) {
             return;
         } else if (!strcasecmp(c->argv[j]->ptr,"getack")) {
             /* REPLCONF GETACK is used in order to request an ACK ASAP
-             * to the slave. */
-            if (server.masterhost && server.master) replicationSendAck();
+             * to the slave: the GETACK itself moves our offset forward, so
+             * replicationSendAckIfNeeded() will send it in beforeSleep(),
+             * together with the rest of the stream we are processing. */
             return;
         } else {
             addReplyErrorFormat(c,"Unrecognized REPLCONF option: %s",
@@ -884,8 +1340,7 @@ void putSlaveOnline(client *slave) {
 
 void sendBulkToSlave(connection *conn) {
     client *slave = connGetPrivateData(conn);
-    char buf[PROTO_IOBUF_LEN];
-    ssize_t nwritten, buflen;
+    ssize_t nwritten;
 
     /* Before sending the RDB file, we send the preamble as configured by the
      * replication process. Currently the preamble is just the bulk count of
@@ -910,15 +1365,13 @@ void sendBulkToSlave(connection *conn) {
     }
 
     /* If the preamble was already transferred, send the RDB bulk data. */
-    lseek(slave->repldbfd,slave->repldboff,SEEK_SET);
-    buflen = read(slave->repldbfd,buf,PROTO_IOBUF_LEN);
-    if (buflen <= 0) {
-        serverLog(LL_WARNING,"Read error sending DB to replica: %s",
-            (buflen == 0) ? "premature EOF" : strerror(errno));
+    nwritten = connSendfile(conn,slave->repldbfd,slave->repldboff,
+                            slave->repldbsize-slave->repldboff);
+    if (nwritten == 0) {
+        serverLog(LL_WARNING,"Read error sending DB to replica: premature EOF");
         freeClient(slave);
         return;
-    }
-    if ((nwritten = connWrite(conn,buf,buflen)) == -1) {
+    } else if (nwritten == -1) {
         if (connGetState(conn) != CONN_STATE_CONNECTED) {
             serverLog(LL_WARNING,"Write error sending DB to replica: %s",
                 connGetLastError(conn));
@@ -942,6 +1395,9 @@ void rdbPipeWriteHandlerConnRemoved(struct connection *conn) {
     if (!connHasWriteHandler(conn))
         return;
     connSetWriteHandler(conn, NULL);
+    /* In a decoupled transfer the pipe reading does not depend on the
+     * replicas writes: rdbPipeRingTimerProc() handles the removal. */
+    if (server.rdb_pipe_ring) return;
     server.rdb_pipe_numconns_writing--;
     /* if there are no more writes for now for this conn, or write error: */
     if (server.rdb_pipe_numconns_writing == 0) {
@@ -987,6 +1443,16 @@ void RdbPipeCleanup() {
     zfree(server.rdb_pipe_buff);
     server.rdb_pipe_buff = NULL;
     server.rdb_pipe_bufflen = 0;
+    zfree(server.rdb_pipe_ring);
+    server.rdb_pipe_ring = NULL;
+    if (server.rdb_pipe_spool_fd != -1) {
+        close(server.rdb_pipe_spool_fd);
+        server.rdb_pipe_spool_fd = -1;
+    }
+    if (server.rdb_pipe_timer_id != -1) {
+        aeDeleteTimeEvent(server.el,server.rdb_pipe_timer_id);
+        server.rdb_pipe_timer_id = -1;
+    }
 
     /* Since we're avoiding to detect the child exited as long as the pipe is
      * not drained, so now is the time to check. */
@@ -1082,6 +1548,334 @@ void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData,
     }
 }
 
+/* ----------------------- Decoupled diskless transfer -----------------------
+ * When repl-diskless-sync-buffer is not zero, the RDB the child writes into
+ * the pipe is read into a ring buffer of that size, and every replica is
+ * sent the stream from its own offset (slave->repldboff), at its own pace,
+ * up to repl-diskless-sync-max-rate bytes per second if set. The ring only
+ * retains the data starting at the offset of the slowest replica: when it
+ * gets full, the replicas holding back the others are switched to a spool
+ * file on disk, where from that point the whole stream is also written, so
+ * that the other replicas and the child can continue. Only if all the
+ * replicas are equally behind we stop reading, like the lockstep transfer
+ * does when some replica can't accept more data.
+ *
+ * The transfer completes when all the replicas were sent the whole stream:
+ * until then server.rdb_pipe_conns is set, so the termination of the child
+ * is not handled yet, exactly like in the lockstep transfer. */
+
+#define RDB_PIPE_TIMER_PERIOD 10 /* Milliseconds */
+
+static void rdbPipeRingReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
+
+/* Return the slave receiving the transfer on the connection 'j', or NULL if
+ * it was dropped. */
+static client *rdbPipeSlave(int j) {
+    connection *conn = server.rdb_pipe_conns[j];
+    return conn ? connGetPrivateData(conn) : NULL;
+}
+
+/* Return the offset of the oldest byte the slaves sending from memory still
+ * need, that is the end of the stream if there are none. */
+static long long rdbPipeRingMinOffset(void) {
+    long long min = server.rdb_pipe_ring_end;
+
+    for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave == NULL || slave->repl_rdb_spooled) continue;
+        if (slave->repldboff < min) min = slave->repldboff;
+    }
+    return min;
+}
+
+/* Return how many bytes the slave can be sent right now without exceeding
+ * repl-diskless-sync-max-rate. A small burst is allowed so that the slave
+ * is not woken up for tiny writes. */
+static long long rdbPipeSlaveAllowance(client *slave) {
+    if (server.repl_diskless_sync_max_rate == 0) return LLONG_MAX;
+    long long elapsed = mstime() - server.rdb_pipe_start_ms;
+    return server.repl_diskless_sync_max_rate * elapsed / 1000 +
+           PROTO_IOBUF_LEN - slave->repldboff;
+}
+
+/* Recompute the start of the ring after the slaves advanced or were
+ * dropped, and resume reading from the pipe if there is room again. */
+static void rdbPipeRingUpdate(void) {
+    server.rdb_pipe_ring_start = rdbPipeRingMinOffset();
+    if (server.rdb_pipe_read_paused && !server.rdb_pipe_eof &&
+        server.rdb_pipe_ring_end - server.rdb_pipe_ring_start <
+        server.rdb_pipe_ring_size)
+    {
+        if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE,
+                              rdbPipeRingReadHandler,NULL) == AE_ERR)
+        {
+            serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+        }
+        server.rdb_pipe_read_paused = 0;
+    }
+}
+
+/* Write to the spool file 'len' bytes of the ring starting at the stream
+ * offset 'off'. Returns C_ERR on write errors. */
+static int rdbPipeRingSpoolWrite(long long off, long long len) {
+    while(len) {
+        long long pos = off % server.rdb_pipe_ring_size;
+        long long thislen = server.rdb_pipe_ring_size - pos;
+        if (thislen > len) thislen = len;
+        ssize_t nwritten = write(server.rdb_pipe_spool_fd,
+                                 server.rdb_pipe_ring+pos,thislen);
+        if (nwritten <= 0) return C_ERR;
+        off += nwritten;
+        len -= nwritten;
+    }
+    return C_OK;
+}
+
+/* Drop the slaves sending from the spool file after a write error on it:
+ * they would miss part of the stream. */
+static void rdbPipeRingSpoolFailed(void) {
+    serverLog(LL_WARNING,"Diskless rdb transfer, can't write the spool file "
+                         "of the lagging replicas: %s", strerror(errno));
+    for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave && slave->repl_rdb_spooled) freeClient(slave);
+    }
+    close(server.rdb_pipe_spool_fd);
+    server.rdb_pipe_spool_fd = -1;
+}
+
+/* Called when the ring is full: switch to the spool file the slaves that
+ * are holding back the others. Returns 0 if no slave was switched, because
+ * they are all equally behind or the spool file can't be created. */
+static int rdbPipeRingSpoolLaggards(void) {
+    long long min = server.rdb_pipe_ring_start;
+    int ahead = 0, j;
+
+    for (j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave && !slave->repl_rdb_spooled && slave->repldboff > min)
+            ahead = 1;
+    }
+    if (!ahead) return 0;
+
+    if (server.rdb_pipe_spool_fd == -1) {
+        char tmpfile[256];
+
+        /* The file is unlinked ASAP, so it's never left behind. */
+        snprintf(tmpfile,sizeof(tmpfile),"temp-repl-spool-%d.rdb",
+            (int) getpid());
+        server.rdb_pipe_spool_fd = open(tmpfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+        if (server.rdb_pipe_spool_fd == -1) {
+            serverLog(LL_WARNING,"Diskless rdb transfer, can't create the "
+                "spool file of the lagging replicas: %s", strerror(errno));
+            return 0;
+        }
+        unlink(tmpfile);
+        server.rdb_pipe_spool_base = min;
+        if (rdbPipeRingSpoolWrite(min,server.rdb_pipe_ring_end-min) == C_ERR) {
+            rdbPipeRingSpoolFailed();
+            return 0;
+        }
+    }
+
+    for (j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave == NULL || slave->repl_rdb_spooled ||
+            slave->repldboff != min) continue;
+        slave->repl_rdb_spooled = 1;
+        server.stat_sync_diskless_spooled++;
+        serverLog(LL_NOTICE,"Diskless rdb transfer, replica %s is lagging "
+            "behind: sending it the rest of the RDB from disk",
+            replicationGetSlaveName(slave));
+    }
+    server.rdb_pipe_ring_start = rdbPipeRingMinOffset();
+    return 1;
+}
+
+/* Write handler of the slaves during a decoupled transfer. */
+static void rdbPipeRingWriteHandler(connection *conn) {
+    client *slave = connGetPrivateData(conn);
+    char buf[PROTO_IOBUF_LEN];
+    long long len = server.rdb_pipe_ring_end - slave->repldboff;
+    long long allowed = rdbPipeSlaveAllowance(slave);
+    ssize_t nwritten;
+    char *p;
+
+    if (allowed <= 0) {
+        /* Over the max rate: rdbPipeRingTimerProc() will resume it. */
+        slave->repl_rdb_throttled = 1;
+        connSetWriteHandler(conn,NULL);
+        return;
+    }
+    if (len > allowed) len = allowed;
+    if (len == 0) {
+        /* Nothing more to send for now. */
+        connSetWriteHandler(conn,NULL);
+        return;
+    }
+
+    if (slave->repl_rdb_spooled) {
+        if (len > (long long)sizeof(buf)) len = sizeof(buf);
+        len = pread(server.rdb_pipe_spool_fd,buf,len,
+                    slave->repldboff - server.rdb_pipe_spool_base);
+        if (len <= 0) {
+            serverLog(LL_WARNING,"Diskless rdb transfer, read error sending "
+                "DB to replica from the spool file: %s",
+                (len == 0) ? "premature EOF" : strerror(errno));
+            freeClient(slave);
+            return;
+        }
+        p = buf;
+    } else {
+        long long pos = slave->repldboff % server.rdb_pipe_ring_size;
+        if (len > server.rdb_pipe_ring_size - pos)
+            len = server.rdb_pipe_ring_size - pos;
+        p = server.rdb_pipe_ring + pos;
+    }
+
+    if ((nwritten = connWrite(conn,p,len)) == -1) {
+        if (connGetState(conn) == CONN_STATE_CONNECTED)
+            return; /* equivalent to EAGAIN */
+        serverLog(LL_WARNING,"Diskless rdb transfer, write error sending DB "
+            "to replica: %s", connGetLastError(conn));
+        freeClient(slave);
+        return;
+    }
+    slave->repldboff += nwritten;
+    server.stat_net_output_bytes += nwritten;
+    if (!slave->repl_rdb_spooled) rdbPipeRingUpdate();
+}
+
+/* Install the write handler of the slaves that have new data to send. */
+static void rdbPipeRingWakeSlaves(void) {
+    for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave == NULL || slave->repl_rdb_throttled ||
+            connHasWriteHandler(slave->conn) ||
+            slave->repldboff == server.rdb_pipe_ring_end) continue;
+        if (connSetWriteHandler(slave->conn,rdbPipeRingWriteHandler) == C_ERR)
+            freeClient(slave);
+    }
+}
+
+/* Read handler of the pipe during a decoupled transfer. */
+static void rdbPipeRingReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    UNUSED(mask);
+    UNUSED(clientData);
+    UNUSED(eventLoop);
+
+    while(1) {
+        long long used = server.rdb_pipe_ring_end - server.rdb_pipe_ring_start;
+        if (used == server.rdb_pipe_ring_size) {
+            if (rdbPipeRingSpoolLaggards()) continue;
+            /* All the replicas are behind: wait for them. */
+            aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+            server.rdb_pipe_read_paused = 1;
+            break;
+        }
+
+        long long pos = server.rdb_pipe_ring_end % server.rdb_pipe_ring_size;
+        long long room = server.rdb_pipe_ring_size - used;
+        if (room > server.rdb_pipe_ring_size - pos)
+            room = server.rdb_pipe_ring_size - pos;
+        ssize_t nread = read(fd, server.rdb_pipe_ring+pos, room);
+        if (nread < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            serverLog(LL_WARNING,"Diskless rdb transfer, read error sending DB to replicas: %s", strerror(errno));
+            for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+                client *slave = rdbPipeSlave(j);
+                if (slave) freeClient(slave);
+                server.rdb_pipe_conns[j] = NULL;
+            }
+            killRDBChild();
+            return;
+        }
+        if (nread == 0) {
+            /* EOF - write end was closed. The transfer completes when the
+             * replicas were sent all the data, see rdbPipeRingTimerProc(). */
+            aeDeleteFileEvent(server.el, server.rdb_pipe_read, AE_READABLE);
+            server.rdb_pipe_eof = 1;
+            serverLog(LL_NOTICE,"Diskless rdb transfer, done reading from pipe, %lld bytes.",
+                server.rdb_pipe_ring_end);
+            break;
+        }
+        if (server.rdb_pipe_spool_fd != -1 &&
+            rdbPipeRingSpoolWrite(server.rdb_pipe_ring_end,nread) == C_ERR)
+        {
+            rdbPipeRingSpoolFailed();
+        }
+        server.rdb_pipe_ring_end += nread;
+        server.rdb_pipe_ring_start = rdbPipeRingMinOffset();
+    }
+    rdbPipeRingWakeSlaves();
+}
+
+/* Called every RDB_PIPE_TIMER_PERIOD milliseconds during a decoupled
+ * transfer: resume the slaves that are no longer over the max rate, and
+ * complete the transfer once all the slaves received the whole stream. */
+static int rdbPipeRingTimerProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    int alive = 0, pending = 0;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        if (slave == NULL) continue;
+        alive++;
+        if (slave->repldboff < server.rdb_pipe_ring_end) pending++;
+        if (slave->repl_rdb_throttled && rdbPipeSlaveAllowance(slave) > 0)
+            slave->repl_rdb_throttled = 0;
+    }
+
+    if (alive == 0 && !server.rdb_pipe_eof) {
+        serverLog(LL_WARNING,"Diskless rdb transfer, last replica dropped, killing fork child.");
+        server.rdb_pipe_timer_id = -1;
+        killRDBChild();
+        RdbPipeCleanup();
+        return AE_NOMORE;
+    }
+    if (server.rdb_pipe_eof && pending == 0) {
+        serverLog(LL_NOTICE,"Diskless rdb transfer, done sending to %d replicas.", alive);
+        server.rdb_pipe_timer_id = -1;
+        RdbPipeCleanup();
+        return AE_NOMORE;
+    }
+    rdbPipeRingUpdate();
+    rdbPipeRingWakeSlaves();
+    return RDB_PIPE_TIMER_PERIOD;
+}
+
+/* Setup the decoupled transfer of the RDB the child just started to write
+ * into the pipe, to the slaves in server.rdb_pipe_conns. */
+void rdbPipeRingInit(void) {
+    server.rdb_pipe_ring_size = server.repl_diskless_sync_buffer;
+    if (server.rdb_pipe_ring_size < PROTO_IOBUF_LEN)
+        server.rdb_pipe_ring_size = PROTO_IOBUF_LEN;
+    server.rdb_pipe_ring = zmalloc(server.rdb_pipe_ring_size);
+    server.rdb_pipe_ring_start = 0;
+    server.rdb_pipe_ring_end = 0;
+    server.rdb_pipe_read_paused = 0;
+    server.rdb_pipe_eof = 0;
+    server.rdb_pipe_spool_fd = -1;
+    server.rdb_pipe_start_ms = mstime();
+    for (int j = 0; j < server.rdb_pipe_numconns; j++) {
+        client *slave = rdbPipeSlave(j);
+        slave->repldboff = 0;
+        slave->repl_rdb_spooled = 0;
+        slave->repl_rdb_throttled = 0;
+    }
+
+    if (aeCreateFileEvent(server.el, server.rdb_pipe_read, AE_READABLE, rdbPipeRingReadHandler,NULL) == AE_ERR) {
+        serverPanic("Unrecoverable error creating server.rdb_pipe_read file event.");
+    }
+    server.rdb_pipe_timer_id = aeCreateTimeEvent(server.el,
+        RDB_PIPE_TIMER_PERIOD,rdbPipeRingTimerProc,NULL,NULL);
+    if (server.rdb_pipe_timer_id == AE_ERR) {
+        serverPanic("Unrecoverable error creating the diskless transfer timer.");
+    }
+}
+
 /* This function is called at the end of every background saving,
  * or when the replication RDB transfer strategy is modified from
  * disk to socket or the other way around.
@@ -1261,6 +2055,7 @@ void replicationCreateMasterClient(connection *conn, int dbid) {
     server.master->reploff = server.master_initial_offset;
     server.master->read_reploff = server.master->reploff;
     server.master->user = NULL; /* This client can do everything. */
+    if (conn) server.master->repl_compress = server.repl_compression_link;
     memcpy(server.master->replid, server.master_replid,
         sizeof(server.master_replid));
     /* If master offset is set to -1, this master is old and is not
@@ -1294,6 +2089,7 @@ void restartAOFAfterSYNC() {
 static int useDisklessLoad() {
     /* compute boolean decision to use diskless load */
     int enabled = server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB ||
+           server.repl_diskless_load == REPL_DISKLESS_LOAD_ASYNC ||
            (server.repl_diskless_load == REPL_DISKLESS_LOAD_WHEN_DB_EMPTY && dbTotalServerKeyCount()==0);
     /* Check all modules handle read errors, otherwise it's not safe to use diskless load. */
     if (enabled && !moduleAllDatatypesHandleErrors()) {
@@ -1309,14 +2105,85 @@ static int useDisklessLoad() {
  * or freed by disklessLoadRestoreBackups(). */
 redisDb *disklessLoadMakeBackups(void) {
     redisDb *backups = zmalloc(sizeof(redisDb)*server.dbnum);
+    replyFlushAllJobs();
     for (int i=0; i<server.dbnum; i++) {
         backups[i] = server.db[i];
-        server.db[i].dict = dictCreate(&dbDictType,NULL);
-        server.db[i].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[i].dict = createDbDict(&dbDictType);
+        server.db[i].expires = expireIndexCreate();
+        server.db[i].used_memory = 0;
+        if (server.cluster_enabled) slotToKeyInit(&server.db[i]);
+        keysIndexInit(&server.db[i]);
     }
     return backups;
 }
 
+/* Helper function for readSyncBulkPayload() when the async diskless load is
+ * used: create the temporary DBs the new data set is loaded into, while the
+ * current DBs keep serving read commands. Only the keyspace is separated:
+ * blocked and watched keys are tracked in the current DBs, which will get
+ * the new keyspace with disklessLoadSwapTempDbs(). */
+redisDb *disklessLoadCreateTempDbs(void) {
+    redisDb *tempDb = zmalloc(sizeof(redisDb)*server.dbnum);
+    for (int i=0; i<server.dbnum; i++) {
+        tempDb[i] = server.db[i];
+        tempDb[i].dict = createDbDict(&dbDictType);
+        tempDb[i].expires = expireIndexCreate();
+        tempDb[i].blocking_keys = dictCreate(&keylistDictType,NULL);
+        tempDb[i].blocking_streams = dictCreate(&streamBlockedDictType,NULL);
+        tempDb[i].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
+        tempDb[i].watched_keys = dictCreate(&watchedKeysDictType,NULL);
+        tempDb[i].avg_ttl = 0;
+        tempDb[i].expires_cursor = 0;
+        tempDb[i].used_memory = 0;
+        tempDb[i].keys_reply_jobs = 0;
+        keysIndexInit(&tempDb[i]);
+    }
+    return tempDb;
+}
+
+/* Free the temporary DBs created by disklessLoadCreateTempDbs() and the
+ * keys they contain. */
+void disklessLoadDiscardTempDbs(redisDb *tempDb, int empty_db_flags) {
+    emptyDbGeneric(tempDb,-1,empty_db_flags,replicationEmptyDbCallback);
+    for (int i=0; i<server.dbnum; i++) {
+        dictRelease(tempDb[i].dict);
+        expireIndexRelease(tempDb[i].expires);
+        dictRelease(tempDb[i].blocking_keys);
+        dictRelease(tempDb[i].blocking_streams);
+        dictRelease(tempDb[i].ready_keys);
+        dictRelease(tempDb[i].watched_keys);
+        if (tempDb[i].keys_index) keysIndexDestroy(&tempDb[i]);
+    }
+    zfree(tempDb);
+}
+
+/* Once the new data set was loaded with success into the temporary DBs,
+ * atomically replace the current keyspace with it, and free the old one. */
+void disklessLoadSwapTempDbs(redisDb *tempDb, int empty_db_flags) {
+    /* The keys of the old data set go away, touch them while they are still
+     * there. The keys of the new one are touched when the old data set is
+     * freed, since it is going to be in the temporary DBs. */
+    signalFlushedDb(-1);
+    replyFlushAllJobs();
+    for (int i=0; i<server.dbnum; i++) {
+        dict *dict = server.db[i].dict;
+        expireIndex *expires = server.db[i].expires;
+        rax *keys_index = server.db[i].keys_index;
+        long long used_memory = server.db[i].used_memory;
+        server.db[i].dict = tempDb[i].dict;
+        server.db[i].expires = tempDb[i].expires;
+        server.db[i].avg_ttl = tempDb[i].avg_ttl;
+        server.db[i].expires_cursor = 0;
+        server.db[i].keys_index = tempDb[i].keys_index;
+        server.db[i].used_memory = tempDb[i].used_memory;
+        tempDb[i].dict = dict;
+        tempDb[i].expires = expires;
+        tempDb[i].keys_index = keys_index;
+        tempDb[i].used_memory = used_memory;
+    }
+    disklessLoadDiscardTempDbs(tempDb,empty_db_flags);
+}
+
 /* Helper function for readSyncBulkPayload(): when replica-side diskless
  * database loading is used, Redis makes a backup of the existing databases
  * before loading the new ones from the socket.
@@ -1334,7 +2201,9 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         emptyDbGeneric(server.db,-1,empty_db_flags,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(server.db[i].dict);
-            dictRelease(server.db[i].expires);
+            expireIndexRelease(server.db[i].expires);
+            if (server.db[i].slots_to_keys) slotToKeyDestroy(&server.db[i]);
+            if (server.db[i].keys_index) keysIndexDestroy(&server.db[i]);
             server.db[i] = backup[i];
         }
     } else {
@@ -1342,7 +2211,9 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         emptyDbGeneric(backup,-1,empty_db_flags,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(backup[i].dict);
-            dictRelease(backup[i].expires);
+            expireIndexRelease(backup[i].expires);
+            if (backup[i].slots_to_keys) slotToKeyDestroy(&backup[i]);
+            if (backup[i].keys_index) keysIndexDestroy(&backup[i]);
         }
     }
     zfree(backup);
@@ -1353,8 +2224,8 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
 void readSyncBulkPayload(connection *conn) {
     char buf[4096];
     ssize_t nread, readlen, nwritten;
-    int use_diskless_load;
-    redisDb *diskless_load_backup = NULL;
+    int use_diskless_load, async_load;
+    redisDb *diskless_load_backup = NULL, *diskless_load_tempdb = NULL;
     int empty_db_flags = server.repl_slave_lazy_flush ? EMPTYDB_ASYNC :
                                                         EMPTYDB_NO_FLAGS;
     off_t left;
@@ -1524,13 +2395,25 @@ void readSyncBulkPayload(connection *conn) {
     /* We need to stop any AOF rewriting child before flusing and parsing
      * the RDB, otherwise we'll create a copy-on-write disaster. */
     if (server.aof_state != AOF_OFF) stopAppendOnly();
+    /* A fork-less save would otherwise snapshot the new data set partially. */
+    if (server.rdb_forkless) rdbForklessSaveAbort();
     signalFlushedDb(-1);
 
     /* When diskless RDB loading is used by replicas, it may be configured
      * in order to save the current DB instead of throwing it away,
      * so that we can restore it in case of failed transfer. */
-    if (use_diskless_load &&
-        server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB)
+    /* With the async diskless load the current DB is not touched at all, and
+     * keeps serving read commands while the new one is loaded. This is not
+     * possible in cluster mode, where the keys of both data sets would be
+     * tracked in the same slots: the current DB is just backed up then. */
+    async_load = use_diskless_load &&
+                 server.repl_diskless_load == REPL_DISKLESS_LOAD_ASYNC &&
+                 !server.cluster_enabled;
+    if (async_load) {
+        diskless_load_tempdb = disklessLoadCreateTempDbs();
+    } else if (use_diskless_load &&
+        (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB ||
+         server.repl_diskless_load == REPL_DISKLESS_LOAD_ASYNC))
     {
         diskless_load_backup = disklessLoadMakeBackups();
     } else {
@@ -1552,9 +2435,12 @@ void readSyncBulkPayload(connection *conn) {
          * We'll restore it when the RDB is received. */
         connBlock(conn);
         connRecvTimeout(conn, server.repl_timeout*1000);
-        startLoading(server.repl_transfer_size, RDBFLAGS_REPLICATION);
+        startLoading(server.repl_transfer_size, RDBFLAGS_REPLICATION,
+                     async_load);
 
-        if (rdbLoadRio(&rdb,RDBFLAGS_REPLICATION,&rsi) != C_OK) {
+        if (rdbLoadRioIntoDbs(&rdb,RDBFLAGS_REPLICATION,&rsi,
+                async_load ? diskless_load_tempdb : server.db) != C_OK)
+        {
             /* RDB loading failed. */
             stopLoading(0);
             serverLog(LL_WARNING,
@@ -1562,7 +2448,11 @@ void readSyncBulkPayload(connection *conn) {
                 "from socket");
             cancelReplicationHandshake();
             rioFreeConn(&rdb, NULL);
-            if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) {
+            if (async_load) {
+                /* The current databases were never touched. */
+                disklessLoadDiscardTempDbs(diskless_load_tempdb,
+                                           empty_db_flags);
+            } else if (diskless_load_backup) {
                 /* Restore the backed up databases. */
                 disklessLoadRestoreBackups(diskless_load_backup,1,
                                            empty_db_flags);
@@ -1580,7 +2470,10 @@ void readSyncBulkPayload(connection *conn) {
         stopLoading(1);
 
         /* RDB loading succeeded if we reach this point. */
-        if (server.repl_diskless_load == REPL_DISKLESS_LOAD_SWAPDB) {
+        if (async_load) {
+            /* Replace the current databases with the loaded ones. */
+            disklessLoadSwapTempDbs(diskless_load_tempdb,empty_db_flags);
+        } else if (diskless_load_backup) {
             /* Delete the backup databases we created before starting to load
              * the new RDB. Now the RDB was loaded with success so the old
              * data is useless. */
@@ -1616,7 +2509,8 @@ void readSyncBulkPayload(connection *conn) {
             killRDBChild();
         }
 
-        if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
+        /* The old RDB file is released in background. */
+        if (bioRenameFile(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
             serverLog(LL_WARNING,
                 "Failed trying to rename the temp DB into %s in "
                 "MASTER <-> REPLICA synchronization: %s",
@@ -2107,11 +3001,21 @@ void syncWithMaster(connection *conn) {
      *
      * EOF: supports EOF-style RDB transfer for diskless replication.
      * PSYNC2: supports PSYNC v2, so understands +CONTINUE <new repl ID>.
+     * LZ4: can load RDB strings compressed with LZ4.
      *
-     * The master will ignore capabilities it does not understand. */
+     * The master will ignore capabilities it does not understand. The
+     * compression of the stream is requested with the same command instead,
+     * since we must know if the master will do it: masters not supporting
+     * it reply with an error. */
     if (server.repl_state == REPL_STATE_SEND_CAPA) {
-        err = sendSynchronousCommand(SYNC_CMD_WRITE,conn,"REPLCONF",
-                "capa","eof","capa","psync2",NULL);
+        server.repl_compression_link = 0;
+        if (server.repl_compression)
+            err = sendSynchronousCommand(SYNC_CMD_WRITE,conn,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","lz4",
+                    "compress","lz4",NULL);
+        else
+            err = sendSynchronousCommand(SYNC_CMD_WRITE,conn,"REPLCONF",
+                    "capa","eof","capa","psync2","capa","lz4",NULL);
         if (err) goto write_error;
         sdsfree(err);
         server.repl_state = REPL_STATE_RECEIVE_CAPA;
@@ -2126,6 +3030,8 @@ void syncWithMaster(connection *conn) {
         if (err[0] == '-') {
             serverLog(LL_NOTICE,"(Non critical) Master does not understand "
                                   "REPLCONF capa: %s", err);
+        } else if (server.repl_compression) {
+            server.repl_compression_link = 1;
         }
         sdsfree(err);
         server.repl_state = REPL_STATE_SEND_PSYNC;
@@ -2277,7 +3183,7 @@ void replicationAbortSyncTransfer(void) {
     undoConnectWithMaster();
     if (server.repl_transfer_fd!=-1) {
         close(server.repl_transfer_fd);
-        unlink(server.repl_transfer_tmpfile);
+        bioUnlinkFile(server.repl_transfer_tmpfile);
         zfree(server.repl_transfer_tmpfile);
         server.repl_transfer_tmpfile = NULL;
         server.repl_transfer_fd = -1;
@@ -2533,9 +3439,22 @@ void replicationSendAck(void) {
         addReplyBulkCString(c,"ACK");
         addReplyBulkLongLong(c,c->reploff);
         c->flags &= ~CLIENT_MASTER_FORCE_REPLY;
+        c->repl_ack_off = c->reploff;
     }
 }
 
+/* Called in beforeSleep(): if we applied more of the replication stream
+ * since our last ACK, send a new one, so that the master can unblock the
+ * clients in WAIT without waiting for replicationCron(). All the data read
+ * from the master in a given event loop iteration is acknowledged with a
+ * single ACK, that also serves the GETACK requests found in the stream. */
+void replicationSendAckIfNeeded(void) {
+    client *c = server.master;
+
+    if (c == NULL || c->flags & CLIENT_PRE_PSYNC) return;
+    if (c->reploff != c->repl_ack_off) replicationSendAck();
+}
+
 /* ---------------------- MASTER CACHING FOR PSYNC -------------------------- */
 
 /* In order to implement partial synchronization we need to be able to cache
@@ -2569,6 +3488,7 @@ void replicationCacheMaster(client *c) {
      * pending outputs to the master. */
     sdsclear(server.master->querybuf);
     sdsclear(server.master->pending_querybuf);
+    freeClientParsedCommands(c);
     server.master->read_reploff = server.master->reploff;
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
     listEmpty(c->reply);
@@ -2643,6 +3563,10 @@ void replicationResurrectCachedMaster(connection *conn) {
     server.master->flags &= ~(CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP);
     server.master->authenticated = 1;
     server.master->lastinteraction = server.unixtime;
+    /* The stream after +CONTINUE is compressed as negotiated on this link,
+     * the partial frame of the old link, if any, is useless. */
+    server.master->repl_compress = server.repl_compression_link;
+    server.master->repl_compress_len = 0;
     server.repl_state = REPL_STATE_CONNECTED;
     server.repl_down_since = 0;
 
@@ -2822,6 +3746,27 @@ int replicationCountAcksByOffset(long long offset) {
     return count;
 }
 
+/* Add the client to the list 'l' of clients waiting for an offset, like
+ * server.clients_waiting_acks, that is sorted by offset. The client usually
+ * waits for the latest offset, so we search its position starting from the
+ * tail. */
+static void addClientWaitingOffset(list *l, client *c) {
+    listNode *ln = listLast(l);
+
+    while(ln && ((client*)listNodeValue(ln))->bpop.reploffset >
+                c->bpop.reploffset)
+    {
+        ln = listPrevNode(ln);
+    }
+    if (ln) {
+        listInsertNode(l,ln,c,1);
+        c->bpop.wait_node = listNextNode(ln);
+    } else {
+        listAddNodeHead(l,c);
+        c->bpop.wait_node = listFirst(l);
+    }
+}
+
 /* WAIT for N replicas to acknowledge the processing of our latest
  * write command (and all the previous commands). */
 void waitCommand(client *c) {
@@ -2852,7 +3797,7 @@ void waitCommand(client *c) {
     c->bpop.timeout = timeout;
     c->bpop.reploffset = offset;
     c->bpop.numreplicas = numreplicas;
-    listAddNodeTail(server.clients_waiting_acks,c);
+    addClientWaitingOffset(server.clients_waiting_acks,c);
     blockClient(c,BLOCKED_WAIT);
 
     /* Make sure that the server will send an ACK request to all the slaves
@@ -2865,44 +3810,127 @@ void waitCommand(client *c) {
  * waiting for replica acks. Never call it directly, call unblockClient()
  * instead. */
 void unblockClientWaitingReplicas(client *c) {
-    listNode *ln = listSearchKey(server.clients_waiting_acks,c);
-    serverAssert(ln != NULL);
-    listDelNode(server.clients_waiting_acks,ln);
+    serverAssert(c->bpop.wait_node != NULL);
+    listDelNode(server.clients_waiting_acks,c->bpop.wait_node);
+    c->bpop.wait_node = NULL;
+}
+
+static int replicationAckOffsetCompare(const void *a, const void *b) {
+    long long oa = *(long long*)a, ob = *(long long*)b;
+    return (oa < ob) ? 1 : ((oa > ob) ? -1 : 0);
 }
 
 /* Check if there are clients blocked in WAIT that can be unblocked since
- * we received enough ACKs from slaves. */
+ * we received enough ACKs from slaves.
+ *
+ * The ACK offsets of the slaves are sorted once in descending order, so
+ * that the number of slaves that acknowledged a given offset is found with
+ * a binary search. Since the clients are sorted by offset, we can stop at
+ * the first client waiting for an offset that no slave reached yet. */
 void processClientsWaitingReplicas(void) {
-    long long last_offset = 0;
-    int last_numreplicas = 0;
-
+    long long *acks, static_acks[16];
+    int numacks = 0;
     listIter li;
     listNode *ln;
 
-    listRewind(server.clients_waiting_acks,&li);
+    acks = listLength(server.slaves) <= 16 ? static_acks :
+           zmalloc(sizeof(long long)*listLength(server.slaves));
+    listRewind(server.slaves,&li);
     while((ln = listNext(&li))) {
+        client *slave = ln->value;
+
+        if (slave->replstate != SLAVE_STATE_ONLINE) continue;
+        acks[numacks++] = slave->repl_ack_off;
+    }
+    qsort(acks,numacks,sizeof(long long),replicationAckOffsetCompare);
+
+    listRewind(server.clients_waiting_acks,&li);
+    while(numacks && (ln = listNext(&li))) {
         client *c = ln->value;
+        long long offset = c->bpop.reploffset;
+        int lo = 0, hi = numacks;
 
-        /* Every time we find a client that is satisfied for a given
-         * offset and number of replicas, we remember it so the next client
-         * may be unblocked without calling replicationCountAcksByOffset()
-         * if the requested offset / replicas were equal or less. */
-        if (last_offset && last_offset > c->bpop.reploffset &&
-                           last_numreplicas > c->bpop.numreplicas)
-        {
-            unblockClient(c);
-            addReplyLongLong(c,last_numreplicas);
-        } else {
-            int numreplicas = replicationCountAcksByOffset(c->bpop.reploffset);
+        if (offset > acks[0]) break;
 
-            if (numreplicas >= c->bpop.numreplicas) {
-                last_offset = c->bpop.reploffset;
-                last_numreplicas = numreplicas;
-                unblockClient(c);
-                addReplyLongLong(c,numreplicas);
-            }
+        /* Find the number of slaves with an ACK offset >= offset. */
+        while(lo < hi) {
+            int mid = lo+(hi-lo)/2;
+            if (acks[mid] >= offset) lo = mid+1;
+            else hi = mid;
+        }
+        if (lo >= c->bpop.numreplicas) {
+            unblockClient(c);
+            addReplyLongLong(c,lo);
         }
     }
+    if (acks != static_acks) zfree(acks);
+}
+
+/* Return the replication offset of the dataset of this instance: the
+ * offset of the master replication stream processed so far for replicas,
+ * or the offset of the latest write for masters. */
+static long long replicationGetProcessedOffset(void) {
+    return server.masterhost ? replicationGetSlaveOffset() :
+                               server.master_repl_offset;
+}
+
+/* WAITOFFSET <offset> <milliseconds_timeout>
+ *
+ * Reply with 1 once this instance processed the replication stream up to
+ * the specified offset, or with 0 if the timeout is reached first. The
+ * offset is the one returned by CLIENT WRITEOFFSET on the master, so that
+ * a client sending "WAITOFFSET <offset> <timeout>" before its reads to a
+ * replica is guaranteed to read its own writes, waiting only when the
+ * replica is lagging behind. */
+void waitoffsetCommand(client *c) {
+    mstime_t timeout;
+    long long offset, processed;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[1],&offset,NULL) != C_OK)
+        return;
+    if (getTimeoutFromObjectOrReply(c,c->argv[2],&timeout,UNIT_MILLISECONDS)
+        != C_OK) return;
+
+    /* First try without blocking at all. A master has all the writes it
+     * performed, so there is nothing to wait for. */
+    processed = replicationGetProcessedOffset();
+    if (processed >= offset || !server.masterhost ||
+        c->flags & CLIENT_MULTI)
+    {
+        addReplyLongLong(c,processed >= offset);
+        return;
+    }
+
+    /* Otherwise block the client until the replication stream is applied
+     * up to the offset, see processClientsWaitingOffset(). */
+    c->bpop.timeout = timeout;
+    c->bpop.reploffset = offset;
+    addClientWaitingOffset(server.clients_waiting_offset,c);
+    blockClient(c,BLOCKED_OFFSET);
+}
+
+/* This is called by unblockClient() to perform the blocking op type
+ * specific cleanup. Never call it directly, call unblockClient() instead. */
+void unblockClientWaitingOffset(client *c) {
+    serverAssert(c->bpop.wait_node != NULL);
+    listDelNode(server.clients_waiting_offset,c->bpop.wait_node);
+    c->bpop.wait_node = NULL;
+}
+
+/* Called in beforeSleep() when there are clients blocked in WAITOFFSET:
+ * since the clients are sorted by offset, we unblock them in order and
+ * stop at the first one waiting for an offset not processed yet. */
+void processClientsWaitingOffset(void) {
+    long long processed = replicationGetProcessedOffset();
+    listNode *ln;
+
+    while((ln = listFirst(server.clients_waiting_offset))) {
+        client *c = ln->value;
+
+        if (c->bpop.reploffset > processed) break;
+        unblockClient(c);
+        addReplyLongLong(c,1);
+    }
 }
 
 /* Return the slave replication offset for this instance, that is
@@ -2925,6 +3953,443 @@ long long replicationGetSlaveOffset(void) {
     return offset;
 }
 
+/* ----------------------- COMPRESSED REPLICATION STREAM ----------------------
+ * A replica with repl-compression enabled asks the master, during the
+ * handshake, to compress the replication stream (REPLCONF compress lz4).
+ * Once the replica is online the stream is then sent as a sequence of
+ * frames, every one holding a chunk of the stream compressed with LZ4:
+ *
+ *   <raw length> <compressed length> <compressed chunk>
+ *
+ * The two lengths are 32 bit little endian integers. A compressed length of
+ * zero means that the chunk could not be compressed, and is stored as it is.
+ * The frames only exist on the link: the backlog, the offsets and the
+ * replication buffer of the replica are all about the stream itself, so the
+ * PSYNC logic is not affected at all.
+ *
+ * The RDB payload of a full sync is not compressed by the link, since its
+ * strings are already compressed by rdbcompression. */
+
+#define REPL_COMPRESS_HDR_LEN 8
+#define REPL_COMPRESS_CHUNK_LEN (64*1024) /* Max raw bytes per frame. */
+
+/* Compress into the frame buffer of the slave 'c' what can fit in a frame
+ * of the 'len' bytes of stream at 'buf'. Returns the number of bytes of the
+ * stream consumed: the frame is then sent by writeToClient(). */
+size_t replicationCompressFrame(client *c, const char *buf, size_t len) {
+    uint32_t rawlen, comprlen;
+
+    if (c->repl_compress_buf == NULL)
+        c->repl_compress_buf = zmalloc(REPL_COMPRESS_HDR_LEN+
+                                       REPL_COMPRESS_CHUNK_LEN);
+    if (len > REPL_COMPRESS_CHUNK_LEN) len = REPL_COMPRESS_CHUNK_LEN;
+
+    /* Don't bother if we can't save at least a few bytes. */
+    comprlen = (len > REPL_COMPRESS_HDR_LEN) ?
+        lz4_compress(buf,len,c->repl_compress_buf+REPL_COMPRESS_HDR_LEN,
+                     len-1) : 0;
+    if (comprlen == 0)
+        memcpy(c->repl_compress_buf+REPL_COMPRESS_HDR_LEN,buf,len);
+    rawlen = len;
+    c->repl_compress_len = REPL_COMPRESS_HDR_LEN+(comprlen ? comprlen : len);
+    c->repl_compress_sent = 0;
+    memrev32ifbe(&rawlen);
+    memrev32ifbe(&comprlen);
+    memcpy(c->repl_compress_buf,&rawlen,4);
+    memcpy(c->repl_compress_buf+4,&comprlen,4);
+
+    server.stat_repl_compress_in += len;
+    server.stat_repl_compress_out += c->repl_compress_len;
+    return len;
+}
+
+/* Read from the master 'c' the compressed stream, and append the chunks of
+ * the frames fully received to its query buffer, without updating its
+ * length, like connRead() would do. Returns the number of bytes appended,
+ * 0 if the connection was closed, or -1 if there is nothing to append yet
+ * or on errors, in which case the caller must check the connection state
+ * like for connRead(). */
+int replicationReadCompressedStream(client *c) {
+    size_t qblen = sdslen(c->querybuf), produced = 0, pos = 0, end = 0;
+    size_t cap = REPL_COMPRESS_HDR_LEN+REPL_COMPRESS_CHUNK_LEN;
+    int nread;
+
+    if (c->repl_compress_buf == NULL) c->repl_compress_buf = zmalloc(cap);
+    nread = connRead(c->conn,c->repl_compress_buf+c->repl_compress_len,
+                     cap-c->repl_compress_len);
+    if (nread <= 0) return nread;
+    c->repl_compress_len += nread;
+    server.stat_net_input_bytes += nread;
+
+    /* Validate the headers of the frames fully received, so that we can
+     * make room for all their chunks at once: the bytes past the length of
+     * the query buffer would not survive another sdsMakeRoomFor(). */
+    while (c->repl_compress_len-end >= REPL_COMPRESS_HDR_LEN) {
+        uint32_t rawlen, comprlen;
+
+        memcpy(&rawlen,c->repl_compress_buf+end,4);
+        memcpy(&comprlen,c->repl_compress_buf+end+4,4);
+        memrev32ifbe(&rawlen);
+        memrev32ifbe(&comprlen);
+        if (rawlen == 0 || rawlen > REPL_COMPRESS_CHUNK_LEN ||
+            comprlen >= rawlen)
+        {
+            serverLog(LL_WARNING,"Invalid frame in the compressed "
+                                 "replication stream");
+            freeClientAsync(c);
+            return -1;
+        }
+        size_t framelen = REPL_COMPRESS_HDR_LEN+(comprlen ? comprlen : rawlen);
+        if (c->repl_compress_len-end < framelen) break;
+        end += framelen;
+        produced += rawlen;
+    }
+    if (produced == 0) return -1;
+    c->querybuf = sdsMakeRoomFor(c->querybuf,produced);
+
+    char *dst = c->querybuf+qblen;
+    while (pos < end) {
+        char *frame = c->repl_compress_buf+pos;
+        uint32_t rawlen, comprlen;
+
+        memcpy(&rawlen,frame,4);
+        memcpy(&comprlen,frame+4,4);
+        memrev32ifbe(&rawlen);
+        memrev32ifbe(&comprlen);
+        if (comprlen == 0) {
+            memcpy(dst,frame+REPL_COMPRESS_HDR_LEN,rawlen);
+            pos += REPL_COMPRESS_HDR_LEN+rawlen;
+        } else if (lz4_decompress(frame+REPL_COMPRESS_HDR_LEN,comprlen,
+                                  dst,rawlen) != rawlen)
+        {
+            serverLog(LL_WARNING,"Corrupted frame in the compressed "
+                                 "replication stream");
+            freeClientAsync(c);
+            return -1;
+        } else {
+            pos += REPL_COMPRESS_HDR_LEN+comprlen;
+        }
+        dst += rawlen;
+    }
+
+    /* Keep the start of the next frame at the start of the buffer. */
+    memmove(c->repl_compress_buf,c->repl_compress_buf+end,
+            c->repl_compress_len-end);
+    c->repl_compress_len -= end;
+    return produced;
+}
+
+/* ------------------------- CHANGE DATA CAPTURE ------------------------------
+ * A replication client can be a change data capture consumer: before PSYNC
+ * it sends one or more of these options, and then consumes the stream
+ * without being a Redis replica.
+ *
+ *   REPLCONF cdc-db <dbid>       Only the commands executed in this DB.
+ *   REPLCONF cdc-prefix <prefix> Only the commands about keys starting with
+ *                                one of the prefixes (can be repeated).
+ *   REPLCONF cdc-rdb no          When a partial resync is not possible,
+ *                                don't send the RDB: the +FULLRESYNC reply
+ *                                is followed by the commands executed from
+ *                                its offset on.
+ *
+ * The PSYNC offsets are the consumer cursor, as for a replica. The consumer
+ * is fed from the shared replication buffer like the other replicas: the
+ * stream is parsed while it is sent, and the arguments of the commands that
+ * match the filter are written straight from the buffer. Only the headers
+ * of the commands are copied, to decide if they match. SELECT, MULTI, EXEC,
+ * PING, REPLCONF and FLUSHALL are always sent (SELECT only for the DB of
+ * cdc-db, if set), and the commands without a key as first argument are
+ * only filtered by DB. Commands about many keys are filtered by the first.
+ *
+ * Since the commands filtered out are not sent, when something was skipped
+ * the next command sent is preceded by:
+ *
+ *   REPLCONF OFFSET <offset>
+ *
+ * that is the offset of the stream at the start of the next command: the
+ * offset of the consumer is this one plus the bytes received after the
+ * REPLCONF OFFSET command. The RDB payload is never filtered. */
+
+#define REPL_CDC_LINE 0     /* Reading a "*<count>" or "$<len>" line. */
+#define REPL_CDC_BODY 1     /* Reading the body of an argument. */
+
+typedef struct replCdc {
+    int dbid;               /* DB to stream, or -1 for all the DBs. */
+    sds *prefixes;          /* Key prefixes to stream, all if none. */
+    int numprefixes;
+    int skip_rdb;           /* Don't send the RDB on full resync. */
+
+    /* State of the parser of the stream, at the position the slave
+     * references in the replication buffer. */
+    int state;              /* REPL_CDC_LINE or REPL_CDC_BODY. */
+    long long args;         /* Arguments left of the command, 0 between
+                               commands. */
+    long long argi;         /* Index of the current argument. */
+    long long bulk;         /* Bytes of the current body still to read,
+                               final CRLF included. */
+    int curdb;              /* DB selected by the stream. */
+    int deciding;           /* Reading the first two arguments. */
+    int skip;               /* The current command is filtered out. */
+    int skipped;            /* Bytes were skipped since the last sent. */
+    long long cmd_offset;   /* Offset of the stream before the command. */
+    sds line;               /* Line being read. */
+    sds head;               /* Bytes of the command read while deciding. */
+    sds argv[2];            /* First two arguments of the command. */
+    sds out;                /* Bytes to send before the stream. */
+    size_t outpos;
+} replCdc;
+
+static replCdc *replicationCdcGet(client *c) {
+    replCdc *cdc = c->repl_cdc;
+
+    if (cdc) return cdc;
+    cdc = zcalloc(sizeof(*cdc));
+    cdc->dbid = -1;
+    cdc->curdb = -1;
+    cdc->line = sdsempty();
+    cdc->head = sdsempty();
+    cdc->argv[0] = sdsempty();
+    cdc->argv[1] = sdsempty();
+    cdc->out = sdsempty();
+    c->repl_cdc = cdc;
+    return cdc;
+}
+
+void replicationCdcFree(client *c) {
+    replCdc *cdc = c->repl_cdc;
+
+    if (cdc == NULL) return;
+    for (int j = 0; j < cdc->numprefixes; j++) sdsfree(cdc->prefixes[j]);
+    zfree(cdc->prefixes);
+    sdsfree(cdc->line);
+    sdsfree(cdc->head);
+    sdsfree(cdc->argv[0]);
+    sdsfree(cdc->argv[1]);
+    sdsfree(cdc->out);
+    zfree(cdc);
+    c->repl_cdc = NULL;
+}
+
+/* Handle the REPLCONF option 'opt' if it is one of the cdc-* options.
+ * Returns 0 if it is not, otherwise 1, after replying with an error if
+ * 'val' is not valid (and C_ERR is stored in *err). */
+int replicationCdcConfig(client *c, char *opt, robj *val, int *err) {
+    *err = C_OK;
+    if (!strcasecmp(opt,"cdc-db")) {
+        long long dbid;
+
+        if (getLongLongFromObjectOrReply(c,val,&dbid,NULL) != C_OK) {
+            *err = C_ERR;
+        } else if (dbid < 0 || dbid >= server.dbnum) {
+            addReplyError(c,"DB index is out of range");
+            *err = C_ERR;
+        } else {
+            replicationCdcGet(c)->dbid = dbid;
+        }
+    } else if (!strcasecmp(opt,"cdc-prefix")) {
+        replCdc *cdc = replicationCdcGet(c);
+
+        cdc->prefixes = zrealloc(cdc->prefixes,
+                                 sizeof(sds)*(cdc->numprefixes+1));
+        cdc->prefixes[cdc->numprefixes++] = sdsdup(val->ptr);
+    } else if (!strcasecmp(opt,"cdc-rdb")) {
+        if (!strcasecmp(val->ptr,"yes")) {
+            replicationCdcGet(c)->skip_rdb = 0;
+        } else if (!strcasecmp(val->ptr,"no")) {
+            replicationCdcGet(c)->skip_rdb = 1;
+        } else {
+            addReply(c,shared.syntaxerr);
+            *err = C_ERR;
+        }
+    } else {
+        return 0;
+    }
+    if (*err == C_OK && c->repl_compress) {
+        addReplyError(c,"Change data capture can't be used with a "
+                        "compressed stream");
+        *err = C_ERR;
+    }
+    return 1;
+}
+
+/* Full resync of a consumer that asked not to get the RDB: it just starts
+ * receiving the stream from the current offset. */
+int replicationCdcFullResyncWithoutRdb(client *c) {
+    char buf[128];
+    int buflen;
+
+    if (c->repl_cdc == NULL || !c->repl_cdc->skip_rdb) return C_ERR;
+    if (server.repl_backlog == NULL) {
+        changeReplicationId();
+        clearReplicationId2();
+        createReplicationBacklog();
+    }
+    c->flags |= CLIENT_SLAVE;
+    c->replstate = SLAVE_STATE_ONLINE;
+    c->repl_ack_time = server.unixtime;
+    c->repl_put_online_on_ack = 0;
+    listAddNodeTail(server.slaves,c);
+    /* Start the stream with a SELECT. */
+    server.slaveseldb = -1;
+    buflen = snprintf(buf,sizeof(buf),"+FULLRESYNC %s %lld\r\n",
+                      server.replid,server.master_repl_offset);
+    if (connWrite(c->conn,buf,buflen) != buflen) {
+        freeClientAsync(c);
+        return C_OK;
+    }
+    serverLog(LL_NOTICE,"Change data capture consumer %s starts at offset "
+        "%lld without RDB", replicationGetSlaveName(c),
+        server.master_repl_offset);
+    refreshGoodSlavesCount();
+    return C_OK;
+}
+
+int replicationCdcHasPendingOutput(client *c) {
+    return c->repl_cdc && c->repl_cdc->outpos < sdslen(c->repl_cdc->out);
+}
+
+/* Decide if the command whose first arguments were just read is sent. */
+static int replicationCdcMatch(replCdc *cdc) {
+    struct redisCommand *cmd = lookupCommand(cdc->argv[0]);
+    int has_key = cdc->argi > 1;
+    sds key = cdc->argv[1];
+
+    if (cmd == NULL) return 1;
+    if (cmd->proc == selectCommand) {
+        if (has_key) cdc->curdb = atoi(key);
+        return cdc->dbid == -1 || cdc->curdb == cdc->dbid;
+    }
+    if (cmd->proc == pingCommand || cmd->proc == replconfCommand ||
+        cmd->proc == multiCommand || cmd->proc == execCommand ||
+        cmd->proc == flushallCommand) return 1;
+    if (cdc->dbid != -1 && cdc->curdb != cdc->dbid) return 0;
+    if (cdc->numprefixes == 0 || cmd->firstkey != 1 || !has_key) return 1;
+    for (int j = 0; j < cdc->numprefixes; j++) {
+        size_t len = sdslen(cdc->prefixes[j]);
+        if (sdslen(key) >= len && !memcmp(key,cdc->prefixes[j],len))
+            return 1;
+    }
+    return 0;
+}
+
+static void replicationCdcDecide(replCdc *cdc) {
+    cdc->deciding = 0;
+    cdc->skip = !replicationCdcMatch(cdc);
+    if (cdc->skip) {
+        cdc->skipped = 1;
+    } else {
+        if (cdc->skipped) {
+            char offset[LONG_STR_SIZE];
+            int len = ll2string(offset,sizeof(offset),cdc->cmd_offset);
+
+            cdc->out = sdscatfmt(cdc->out,
+                "*3\r\n$8\r\nREPLCONF\r\n$6\r\nOFFSET\r\n$%i\r\n%s\r\n",
+                len,offset);
+            cdc->skipped = 0;
+        }
+        cdc->out = sdscatsds(cdc->out,cdc->head);
+    }
+    sdsclear(cdc->head);
+}
+
+/* Called at the end of every argument. */
+static void replicationCdcEndArg(replCdc *cdc) {
+    cdc->argi++;
+    cdc->args--;
+    if (cdc->deciding && (cdc->argi == 2 || cdc->args == 0))
+        replicationCdcDecide(cdc);
+    cdc->state = REPL_CDC_LINE;
+}
+
+/* Send to the consumer 'c' what it can receive of the stream in the block
+ * 'o', from the position it references, skipping the commands filtered out.
+ * Returns the bytes written to the socket, or -1 if nothing could be
+ * written nor skipped, like connWrite(). */
+ssize_t replicationCdcWrite(client *c, replBufBlock *o) {
+    replCdc *cdc = c->repl_cdc;
+    ssize_t nwritten, totwritten = 0;
+    int progress = 0;
+
+    while(1) {
+        char *p = o->buf+c->ref_block_pos;
+        size_t avail = o->used-c->ref_block_pos, len;
+
+        /* What was queued from the previous blocks goes first. */
+        if (cdc->outpos < sdslen(cdc->out)) {
+            nwritten = connWrite(c->conn,cdc->out+cdc->outpos,
+                                 sdslen(cdc->out)-cdc->outpos);
+            if (nwritten <= 0) break;
+            cdc->outpos += nwritten;
+            totwritten += nwritten;
+            if (cdc->outpos < sdslen(cdc->out)) break;
+            sdsclear(cdc->out);
+            cdc->outpos = 0;
+        }
+        if (avail == 0) break;
+
+        if (cdc->state == REPL_CDC_LINE) {
+            char *nl = memchr(p,'\n',avail);
+
+            len = nl ? (size_t)(nl-p)+1 : avail;
+            if (cdc->args == 0 && sdslen(cdc->line) == 0)
+                cdc->cmd_offset = o->repl_offset+c->ref_block_pos-1;
+            cdc->line = sdscatlen(cdc->line,p,len);
+            c->ref_block_pos += len;
+            progress = 1;
+            if (!nl) continue;
+
+            long long count = strtoll(cdc->line+1,NULL,10);
+            if (cdc->args == 0) {
+                if (cdc->line[0] != '*' || count <= 0) goto protoerr;
+                cdc->args = count;
+                cdc->argi = 0;
+                cdc->deciding = 1;
+                cdc->skip = 0;
+                sdsclear(cdc->argv[0]);
+                sdsclear(cdc->argv[1]);
+                cdc->head = sdscatsds(cdc->head,cdc->line);
+            } else {
+                if (cdc->line[0] != '$' || count < 0) goto protoerr;
+                cdc->bulk = count+2;
+                cdc->state = REPL_CDC_BODY;
+                if (cdc->deciding)
+                    cdc->head = sdscatsds(cdc->head,cdc->line);
+                else if (!cdc->skip)
+                    cdc->out = sdscatsds(cdc->out,cdc->line);
+            }
+            sdsclear(cdc->line);
+        } else {
+            len = avail < (size_t)cdc->bulk ? avail : (size_t)cdc->bulk;
+            if (cdc->deciding) {
+                /* The final CRLF is not part of the argument. */
+                size_t arglen = (size_t)cdc->bulk > 2 ?
+                                (size_t)cdc->bulk-2 : 0;
+                if (arglen > len) arglen = len;
+                cdc->argv[cdc->argi] = sdscatlen(cdc->argv[cdc->argi],p,
+                                                 arglen);
+                cdc->head = sdscatlen(cdc->head,p,len);
+            } else if (!cdc->skip) {
+                nwritten = connWrite(c->conn,p,len);
+                if (nwritten <= 0) break;
+                len = nwritten;
+                totwritten += nwritten;
+            }
+            c->ref_block_pos += len;
+            cdc->bulk -= len;
+            progress = 1;
+            if (cdc->bulk == 0) replicationCdcEndArg(cdc);
+        }
+    }
+    return (totwritten || progress) ? totwritten : -1;
+
+protoerr:
+    serverLog(LL_WARNING,"Unexpected replication stream for change data "
+        "capture consumer %s, closing the connection",
+        replicationGetSlaveName(c));
+    freeClientAsync(c);
+    return -1;
+}
+
 /* --------------------------- REPLICATION CRON  ---------------------------- */
 
 /* Replication cron function, called 1 time per second. */
@@ -3050,6 +4515,11 @@ void replicationCron(void) {
         }
     }
 
+    /* Release the blocks of the replication buffer that are no longer used,
+     * for instance because a lagging slave was dropped, even when no new
+     * data is added to it. */
+    incrementalTrimReplicationBacklog(REPL_BACKLOG_TRIM_BLOCKS_PER_CALL*16);
+
     /* If this is a master without attached slaves and there is a replication
      * backlog active, in order to reclaim memory we can free it after some
      * (configured) time. Note that this cannot be done for slaves: slaves
@@ -3103,7 +4573,7 @@ void replicationCron(void) {
      * In case of diskless replication, we make sure to wait the specified
      * number of seconds (according to configuration) so that other slaves
      * have the time to arrive before we start streaming. */
-    if (!hasActiveChildProcess()) {
+    if (!hasActiveChildProcess() && !server.rdb_forkless) {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         int mincapa = -1;
@@ -3135,5 +4605,8 @@ void replicationCron(void) {
 
     /* Refresh the number of slaves with lag <= min-slaves-max-lag. */
     refreshGoodSlavesCount();
+
+    /* Let the kernel write the persistent backlog in the background. */
+    replBacklogFileSync(0);
     replication_cron_loops++; /* Incremented with frequency 1 HZ. */
 }
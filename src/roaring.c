@@ -0,0 +1,507 @@
+/* Roaring bitmaps -- compressed representation of sparse bitmaps.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+/* Number of bits set in the 'len' bytes at 'p'. */
+static uint32_t roaringPopcount(const unsigned char *p, size_t len) {
+    uint32_t bits = 0;
+    uint64_t word;
+
+    while (len >= sizeof(word)) {
+        memcpy(&word,p,sizeof(word));
+        bits += __builtin_popcountll(word);
+        p += sizeof(word);
+        len -= sizeof(word);
+    }
+    while (len--) bits += __builtin_popcount(*p++);
+    return bits;
+}
+
+/* Return the index of the first container with a key >= 'key', that is
+ * r->count if there is no such container. */
+uint32_t roaringFind(roaring *r, uint32_t key) {
+    uint32_t min = 0, max = r->count;
+
+    while (min < max) {
+        uint32_t mid = min+(max-min)/2;
+        if (r->containers[mid].key < key)
+            min = mid+1;
+        else
+            max = mid;
+    }
+    return min;
+}
+
+/* Return the position of 'low' in the array container 'c', or the position
+ * where it should be inserted, setting 'found' accordingly. */
+static uint32_t roaringArraySearch(roaringContainer *c, uint16_t low,
+                                   int *found)
+{
+    uint16_t *a = c->data;
+    uint32_t min = 0, max = c->card;
+
+    while (min < max) {
+        uint32_t mid = min+(max-min)/2;
+        if (a[mid] < low)
+            min = mid+1;
+        else
+            max = mid;
+    }
+    *found = min < c->card && a[min] == low;
+    return min;
+}
+
+/* Size of the data of a container with 'card' bits set. */
+static size_t roaringDataSize(uint32_t card) {
+    return card <= ROARING_ARRAY_MAX ? card*sizeof(uint16_t) :
+                                       ROARING_CHUNK_BYTES;
+}
+
+/* Insert an empty container with the specified key at position 'idx'. */
+static roaringContainer *roaringInsert(roaring *r, uint32_t idx,
+                                       uint32_t key)
+{
+    r->containers = zrealloc(r->containers,
+                             sizeof(roaringContainer)*(r->count+1));
+    memmove(r->containers+idx+1,r->containers+idx,
+            sizeof(roaringContainer)*(r->count-idx));
+    r->count++;
+    r->containers[idx].key = key;
+    r->containers[idx].card = 0;
+    r->containers[idx].data = NULL;
+    return r->containers+idx;
+}
+
+/* Release and remove the container at position 'idx'. */
+static void roaringDelete(roaring *r, uint32_t idx) {
+    r->bytes -= roaringDataSize(r->containers[idx].card);
+    zfree(r->containers[idx].data);
+    memmove(r->containers+idx,r->containers+idx+1,
+            sizeof(roaringContainer)*(r->count-idx-1));
+    r->count--;
+    if (r->count == 0) {
+        zfree(r->containers);
+        r->containers = NULL;
+    }
+}
+
+/* Create an empty roaring bitmap equivalent to a string of 'len' zero
+ * bytes. */
+roaring *roaringNew(size_t len) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->containers = NULL;
+    r->count = 0;
+    r->len = len;
+    r->bytes = 0;
+    return r;
+}
+
+void roaringFree(roaring *r) {
+    uint32_t j;
+
+    for (j = 0; j < r->count; j++) zfree(r->containers[j].data);
+    zfree(r->containers);
+    zfree(r);
+}
+
+roaring *roaringDup(roaring *r) {
+    roaring *d = roaringNew(r->len);
+    uint32_t j;
+
+    if (r->count) {
+        d->containers = zmalloc(sizeof(roaringContainer)*r->count);
+        for (j = 0; j < r->count; j++) {
+            roaringContainer *c = r->containers+j;
+            size_t size = roaringDataSize(c->card);
+
+            d->containers[j] = *c;
+            d->containers[j].data = zmalloc(size);
+            memcpy(d->containers[j].data,c->data,size);
+        }
+    }
+    d->count = r->count;
+    d->bytes = r->bytes;
+    return d;
+}
+
+/* Set the container 'c' to represent the ROARING_CHUNK_BYTES bytes at
+ * 'chunk', having 'card' bits set. The previous data, if any, must be
+ * already released. */
+static void roaringFillContainer(roaring *r, roaringContainer *c,
+                                 const unsigned char *chunk, uint32_t card)
+{
+    c->card = card;
+    if (roaringContainerIsArray(c)) {
+        uint16_t *a = zmalloc(card*sizeof(uint16_t));
+        uint32_t byte, n = 0;
+
+        for (byte = 0; byte < ROARING_CHUNK_BYTES; byte++) {
+            unsigned char b = chunk[byte];
+            while (b) {
+                int bit = __builtin_clz(b)-24;
+                a[n++] = byte*8+bit;
+                b &= ~(0x80 >> bit);
+            }
+        }
+        c->data = a;
+    } else {
+        c->data = zmalloc(ROARING_CHUNK_BYTES);
+        memcpy(c->data,chunk,ROARING_CHUNK_BYTES);
+    }
+    r->bytes += roaringDataSize(card);
+}
+
+/* Create a roaring bitmap with the same content of the 'len' bytes
+ * at 'p'. */
+roaring *roaringFromBuffer(const unsigned char *p, size_t len) {
+    roaring *r = roaringNew(len);
+    unsigned char chunk[ROARING_CHUNK_BYTES];
+    size_t start;
+
+    for (start = 0; start < len; start += ROARING_CHUNK_BYTES) {
+        size_t n = len-start;
+        if (n > ROARING_CHUNK_BYTES) n = ROARING_CHUNK_BYTES;
+        uint32_t card = roaringPopcount(p+start,n);
+        if (card == 0) continue;
+
+        memcpy(chunk,p+start,n);
+        memset(chunk+n,0,ROARING_CHUNK_BYTES-n);
+        roaringContainer *c = roaringInsert(r,r->count,
+                                            start/ROARING_CHUNK_BYTES);
+        roaringFillContainer(r,c,chunk,card);
+    }
+    return r;
+}
+
+/* Store at 'dst' the 'count' bytes starting at byte 'start' of the string
+ * equivalent to the bitmap. Bytes after the end of the string are zero. */
+void roaringGetBytes(roaring *r, size_t start, size_t count,
+                     unsigned char *dst)
+{
+    size_t end = start+count;
+    uint32_t j;
+
+    memset(dst,0,count);
+    for (j = roaringFind(r,start/ROARING_CHUNK_BYTES); j < r->count; j++) {
+        roaringContainer *c = r->containers+j;
+        size_t base = (size_t)c->key*ROARING_CHUNK_BYTES;
+        if (base >= end) break;
+
+        if (roaringContainerIsArray(c)) {
+            uint16_t *a = c->data;
+            uint32_t k;
+
+            for (k = 0; k < c->card; k++) {
+                size_t byte = base+(a[k]>>3);
+                if (byte < start) continue;
+                if (byte >= end) break;
+                dst[byte-start] |= 0x80 >> (a[k]&7);
+            }
+        } else {
+            size_t from = base > start ? base : start;
+            size_t to = base+ROARING_CHUNK_BYTES < end ?
+                        base+ROARING_CHUNK_BYTES : end;
+            memcpy(dst+(from-start),(unsigned char*)c->data+(from-base),
+                   to-from);
+        }
+    }
+}
+
+/* Return the value of the bit at offset 'bit'. */
+int roaringGetBit(roaring *r, uint64_t bit) {
+    uint32_t key = bit/ROARING_CHUNK_BITS;
+    uint16_t low = bit%ROARING_CHUNK_BITS;
+    uint32_t idx = roaringFind(r,key);
+    int found;
+
+    if (idx == r->count || r->containers[idx].key != key) return 0;
+    roaringContainer *c = r->containers+idx;
+    if (roaringContainerIsArray(c)) {
+        roaringArraySearch(c,low,&found);
+        return found;
+    }
+    return (((unsigned char*)c->data)[low>>3] & (0x80 >> (low&7))) != 0;
+}
+
+/* Set the bit at offset 'bit' to 'on', extending the equivalent string
+ * length if needed, and return the previous value of the bit. Containers
+ * are converted between the array and bitmap representations when their
+ * cardinality crosses ROARING_ARRAY_MAX. */
+int roaringSetBit(roaring *r, uint64_t bit, int on) {
+    uint32_t key = bit/ROARING_CHUNK_BITS;
+    uint16_t low = bit%ROARING_CHUNK_BITS;
+    uint32_t idx = roaringFind(r,key);
+    roaringContainer *c;
+    int found;
+
+    if (bit/8 >= r->len) r->len = bit/8+1;
+    if (idx == r->count || r->containers[idx].key != key) {
+        if (!on) return 0;
+        c = roaringInsert(r,idx,key);
+    } else {
+        c = r->containers+idx;
+    }
+
+    if (!roaringContainerIsArray(c)) {
+        unsigned char *bitmap = c->data;
+        unsigned char mask = 0x80 >> (low&7);
+
+        found = (bitmap[low>>3] & mask) != 0;
+        if (found == on) return found;
+        if (on) {
+            bitmap[low>>3] |= mask;
+            c->card++;
+        } else {
+            bitmap[low>>3] &= ~mask;
+            if (c->card-1 == ROARING_ARRAY_MAX) {
+                /* Back to the array representation. */
+                r->bytes -= ROARING_CHUNK_BYTES;
+                roaringFillContainer(r,c,bitmap,c->card-1);
+                zfree(bitmap);
+            } else {
+                c->card--;
+            }
+        }
+        return found;
+    }
+
+    uint32_t pos = roaringArraySearch(c,low,&found);
+    uint16_t *a = c->data;
+    if (found == on) return found;
+    if (on && c->card == ROARING_ARRAY_MAX) {
+        /* Switch to the bitmap representation. */
+        unsigned char *bitmap = zcalloc(ROARING_CHUNK_BYTES);
+        uint32_t k;
+
+        for (k = 0; k < c->card; k++)
+            bitmap[a[k]>>3] |= 0x80 >> (a[k]&7);
+        bitmap[low>>3] |= 0x80 >> (low&7);
+        zfree(a);
+        r->bytes += ROARING_CHUNK_BYTES-ROARING_ARRAY_MAX*sizeof(uint16_t);
+        c->data = bitmap;
+        c->card++;
+    } else if (on) {
+        a = zrealloc(a,(c->card+1)*sizeof(uint16_t));
+        memmove(a+pos+1,a+pos,(c->card-pos)*sizeof(uint16_t));
+        a[pos] = low;
+        c->data = a;
+        c->card++;
+        r->bytes += sizeof(uint16_t);
+    } else if (c->card == 1) {
+        roaringDelete(r,idx);
+    } else {
+        memmove(a+pos,a+pos+1,(c->card-pos-1)*sizeof(uint16_t));
+        c->data = zrealloc(a,(c->card-1)*sizeof(uint16_t));
+        c->card--;
+        r->bytes -= sizeof(uint16_t);
+    }
+    return found;
+}
+
+/* Replace the content of the chunk 'key' with the ROARING_CHUNK_BYTES bytes
+ * at 'chunk'. The length of the equivalent string is not changed, so the
+ * chunk should not have bits set after it. */
+void roaringSetChunk(roaring *r, uint32_t key, const unsigned char *chunk) {
+    uint32_t idx = roaringFind(r,key);
+    uint32_t card = roaringPopcount(chunk,ROARING_CHUNK_BYTES);
+
+    if (idx < r->count && r->containers[idx].key == key) {
+        if (card == 0) {
+            roaringDelete(r,idx);
+            return;
+        }
+        r->bytes -= roaringDataSize(r->containers[idx].card);
+        zfree(r->containers[idx].data);
+    } else {
+        if (card == 0) return;
+        roaringInsert(r,idx,key);
+    }
+    roaringFillContainer(r,r->containers+idx,chunk,card);
+}
+
+/* Append to 'r' a container with the specified key and cardinality, with
+ * the serialized data at 'data' of 'datalen' bytes, taking ownership of it.
+ * Array containers must be already converted to the host byte order.
+ * This is used to load bitmaps from RDB files, so the container is
+ * validated: 0 is returned if it is not valid, and in this case the data
+ * is not owned by the bitmap. On success 1 is returned. */
+int roaringAppendContainer(roaring *r, uint32_t key, uint32_t card,
+                           void *data, size_t datalen)
+{
+    if (r->count && r->containers[r->count-1].key >= key) return 0;
+    if (card == 0 || card > ROARING_CHUNK_BITS) return 0;
+    if (datalen != roaringDataSize(card)) return 0;
+    if (key >= ((uint64_t)r->len*8+ROARING_CHUNK_BITS-1)/ROARING_CHUNK_BITS)
+        return 0;
+
+    uint64_t last;  /* Highest offset set in the container. */
+    if (card <= ROARING_ARRAY_MAX) {
+        uint16_t *a = data;
+        uint32_t k;
+
+        for (k = 1; k < card; k++)
+            if (a[k] <= a[k-1]) return 0;
+        last = a[card-1];
+    } else {
+        unsigned char *bitmap = data;
+        int byte = ROARING_CHUNK_BYTES-1;
+
+        if (roaringPopcount(bitmap,ROARING_CHUNK_BYTES) != card) return 0;
+        while (bitmap[byte] == 0) byte--;
+        last = byte*8+7-__builtin_ctz(bitmap[byte]);
+    }
+    if (((uint64_t)key*ROARING_CHUNK_BITS+last)/8 >= r->len) return 0;
+
+    roaringContainer *c = roaringInsert(r,r->count,key);
+    c->card = card;
+    c->data = data;
+    r->bytes += datalen;
+    return 1;
+}
+
+/* Approximated number of bytes used by the bitmap. */
+size_t roaringMemUsage(roaring *r) {
+    return sizeof(*r)+sizeof(roaringContainer)*r->count+r->bytes;
+}
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define UNUSED(x) (void)(x)
+
+/* Check that 'r' has the same content of the 'len' bytes at 'p'. */
+static void roaringAssertEqual(roaring *r, unsigned char *p, size_t len) {
+    unsigned char *buf = zmalloc(len);
+    uint32_t j;
+
+    assert(r->len == len);
+    roaringGetBytes(r,0,len,buf);
+    assert(memcmp(buf,p,len) == 0);
+    zfree(buf);
+    for (j = 0; j < r->count; j++) {
+        roaringContainer *c = r->containers+j;
+        unsigned char chunk[ROARING_CHUNK_BYTES];
+
+        roaringGetBytes(r,(size_t)c->key*ROARING_CHUNK_BYTES,
+                        ROARING_CHUNK_BYTES,chunk);
+        assert(c->card == roaringPopcount(chunk,ROARING_CHUNK_BYTES));
+    }
+}
+
+int roaringTest(int argc, char **argv) {
+    size_t len = ROARING_CHUNK_BYTES*5+100;
+    unsigned char *dense = zcalloc(len);
+    roaring *r = roaringNew(len);
+    int j;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(1234);
+
+    printf("Random SETBIT against a plain bitmap: ");
+    {
+        for (j = 0; j < 200000; j++) {
+            uint64_t bit;
+            /* Crowd the second chunk to move it across representations. */
+            if (rand() % 2)
+                bit = ROARING_CHUNK_BITS+rand()%(ROARING_CHUNK_BITS/8);
+            else
+                bit = rand()%(len*8);
+            int on = (j/50000)%2 == 0 ? rand()%4 != 0 : rand()%4 == 0;
+            int old = (dense[bit/8] & (0x80>>(bit%8))) != 0;
+
+            if (on)
+                dense[bit/8] |= 0x80>>(bit%8);
+            else
+                dense[bit/8] &= ~(0x80>>(bit%8));
+            assert(roaringSetBit(r,bit,on) == old);
+            assert(roaringGetBit(r,bit) == on);
+        }
+        roaringAssertEqual(r,dense,len);
+        printf("ok\n");
+    }
+
+    printf("Conversion from a plain bitmap and duplication: ");
+    {
+        roaring *copy = roaringFromBuffer(dense,len);
+        roaringAssertEqual(copy,dense,len);
+        assert(copy->bytes == r->bytes);
+        roaringFree(copy);
+        copy = roaringDup(r);
+        roaringAssertEqual(copy,dense,len);
+        roaringFree(copy);
+        printf("ok\n");
+    }
+
+    printf("Partial reads and chunk updates: ");
+    {
+        unsigned char buf[300], chunk[ROARING_CHUNK_BYTES];
+        size_t start = ROARING_CHUNK_BYTES*2-150;
+
+        roaringGetBytes(r,start,sizeof(buf),buf);
+        assert(memcmp(buf,dense+start,sizeof(buf)) == 0);
+
+        memset(chunk,0,sizeof(chunk));
+        chunk[10] = 0x81;
+        roaringSetChunk(r,3,chunk);
+        memcpy(dense+ROARING_CHUNK_BYTES*3,chunk,sizeof(chunk));
+        memset(chunk,0,sizeof(chunk));
+        roaringSetChunk(r,1,chunk);
+        memset(dense+ROARING_CHUNK_BYTES,0,sizeof(chunk));
+        roaringAssertEqual(r,dense,len);
+        printf("ok\n");
+    }
+
+    printf("Validation of loaded containers: ");
+    {
+        roaring *l = roaringNew(100);
+        uint16_t *a = zmalloc(sizeof(uint16_t)*2);
+
+        a[0] = 10; a[1] = 5;
+        assert(roaringAppendContainer(l,0,2,a,4) == 0);
+        a[1] = 800;
+        assert(roaringAppendContainer(l,0,2,a,4) == 0); /* Beyond len. */
+        a[1] = 799;
+        assert(roaringAppendContainer(l,0,2,a,4) == 1);
+        assert(roaringGetBit(l,799) == 1 && roaringGetBit(l,11) == 0);
+        roaringFree(l);
+        printf("ok\n");
+    }
+
+    roaringFree(r);
+    zfree(dense);
+    return 0;
+}
+#endif
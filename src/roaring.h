@@ -0,0 +1,81 @@
+/* Roaring bitmaps -- compressed representation of sparse bitmaps.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A roaring bitmap represents the same bits of a string used as a bitmap,
+ * split in chunks of ROARING_CHUNK_BITS bits, so that the high 16 bits of an
+ * offset select the chunk and the low 16 bits the bit inside it. Only the
+ * chunks having at least a bit set have a container: a container with up to
+ * ROARING_ARRAY_MAX bits set is a sorted array of uint16_t offsets, a more
+ * populated one is a ROARING_CHUNK_BYTES bitmap with the same layout of the
+ * string (bit 0 is the most significant bit of the first byte). */
+#define ROARING_CHUNK_BITS 65536
+#define ROARING_CHUNK_BYTES (ROARING_CHUNK_BITS/8)
+#define ROARING_ARRAY_MAX 4096
+
+typedef struct roaringContainer {
+    uint32_t key;       /* Chunk index, that is, the offsets >> 16. */
+    uint32_t card;      /* Number of bits set, always > 0. */
+    void *data;         /* Array if card <= ROARING_ARRAY_MAX, else bitmap. */
+} roaringContainer;
+
+typedef struct roaring {
+    roaringContainer *containers;   /* Sorted by key. */
+    uint32_t count;     /* Number of containers. */
+    size_t len;         /* Length of the equivalent string in bytes. */
+    size_t bytes;       /* Bytes used by the containers data. */
+} roaring;
+
+#define roaringContainerIsArray(c) ((c)->card <= ROARING_ARRAY_MAX)
+
+roaring *roaringNew(size_t len);
+void roaringFree(roaring *r);
+roaring *roaringDup(roaring *r);
+roaring *roaringFromBuffer(const unsigned char *p, size_t len);
+void roaringGetBytes(roaring *r, size_t start, size_t count,
+                     unsigned char *dst);
+int roaringGetBit(roaring *r, uint64_t bit);
+int roaringSetBit(roaring *r, uint64_t bit, int on);
+void roaringSetChunk(roaring *r, uint32_t key, const unsigned char *chunk);
+uint32_t roaringFind(roaring *r, uint32_t key);
+int roaringAppendContainer(roaring *r, uint32_t key, uint32_t card,
+                           void *data, size_t datalen);
+size_t roaringMemUsage(roaring *r);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[]);
+#endif
+
+#endif
@@ -35,6 +35,9 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#ifdef USE_LUAJIT
+#include <luajit.h>
+#endif
 #include <ctype.h>
 #include <math.h>
 
@@ -53,6 +56,7 @@ void ldbDisable(client *c);
 void ldbEnable(client *c);
 void evalGenericCommandWithDebugging(client *c, int evalsha);
 void luaLdbLineHook(lua_State *lua, lua_Debug *ar);
+void luaMaskCountHook(lua_State *lua, lua_Debug *ar);
 void ldbLog(sds entry);
 void ldbLogRedisReply(char *reply);
 sds ldbCatStackValue(sds s, lua_State *lua, int idx);
@@ -466,6 +470,484 @@ void luaReplyToRedisReply(client *c, lua_State *lua) {
     lua_pop(lua,1);
 }
 
+/* ---------------------------------------------------------------------------
+ * Native conversion of the replies of the commands called by scripts.
+ *
+ * While a command called via redis.call() runs, the addReply*() functions
+ * for the typed values (bulk strings, integers, aggregates, ...) don't emit
+ * the protocol into the buffers of the Lua client, to be parsed back by
+ * redisProtocolToLuaType() later: they directly push the value on the Lua
+ * stack, calling the functions below. The (rare) replies emitted as raw
+ * protocol, like the shared objects, are still accumulated in the client
+ * buffers, and converted with redisProtocolToLuaType() as soon as a typed
+ * value follows, or when the command returns. So the raw protocol emitted
+ * to the Lua client must always be made of complete values.
+ *
+ * The aggregates being filled are tracked in a stack of frames: every value
+ * pushed is stored in the table of the innermost frame, and when an
+ * aggregate is complete its table is stored in turn into the outer one.
+ * ------------------------------------------------------------------------- */
+
+typedef struct luaReplyFrame {
+    long len;       /* Number of elements, or -1 if deferred. */
+    long count;     /* Elements stored so far. */
+    int prefix;     /* RESP type of the aggregate. */
+    int wrapped;    /* RESP3 map or set: the stack holds the table with the
+                       "map" or "set" field, the field name and the table
+                       of the elements. */
+    int haskey;     /* A map key is on the stack, waiting for its value. */
+} luaReplyFrame;
+
+static struct {
+    lua_State *lua;
+    int base;               /* Top of the Lua stack before the reply. */
+    int type;               /* RESP type of the top level reply. */
+    luaReplyFrame *frames;
+    int numframes, maxframes;
+} luaReply;
+
+static void luaReplyFlushProto(client *c);
+
+/* Store the value on top of the Lua stack, of RESP type 'type', into the
+ * aggregate being filled, or as the top level reply. */
+static void luaReplyAddValue(int type) {
+    lua_State *lua = luaReply.lua;
+
+    while (luaReply.numframes) {
+        luaReplyFrame *f = luaReply.frames+luaReply.numframes-1;
+
+        if (f->wrapped && f->prefix == '%') {
+            if (!f->haskey) {
+                f->haskey = 1;
+                return;
+            }
+            lua_settable(lua,-3);
+            f->haskey = 0;
+        } else if (f->wrapped) {
+            lua_pushboolean(lua,1);
+            lua_settable(lua,-3);
+        } else {
+            lua_rawseti(lua,-2,f->count+1);
+        }
+        f->count++;
+        if (f->count != f->len) return;
+
+        /* The aggregate is complete: store it into the outer one. */
+        if (f->wrapped) lua_settable(lua,-3);
+        type = f->prefix;
+        luaReply.numframes--;
+    }
+
+    /* Top level reply: like the protocol parser, keep just the first. */
+    if (lua_gettop(lua) > luaReply.base+1)
+        lua_pop(lua,1);
+    else
+        luaReply.type = type;
+}
+
+/* Start filling an aggregate of 'len' elements, or of an unknown number of
+ * elements if 'len' is -1. Returns the frame, used as handle for the
+ * deferred length. */
+static void *luaReplyOpenAggregate(long len, int prefix) {
+    lua_State *lua = luaReply.lua;
+
+    if (luaReply.numframes == luaReply.maxframes) {
+        luaReply.maxframes = luaReply.maxframes ? luaReply.maxframes*2 : 16;
+        luaReply.frames = zrealloc(luaReply.frames,
+            sizeof(luaReplyFrame)*luaReply.maxframes);
+    }
+    lua_checkstack(lua,4);
+
+    luaReplyFrame *f = luaReply.frames+luaReply.numframes++;
+    f->len = len;
+    f->count = 0;
+    f->prefix = prefix;
+    f->haskey = 0;
+    f->wrapped = len != -1 && (prefix == '%' || prefix == '~');
+    if (f->wrapped) {
+        lua_newtable(lua);
+        lua_pushstring(lua,prefix == '%' ? "map" : "set");
+    }
+    lua_newtable(lua);
+    if (len == 0) {
+        /* Handles of empty deferred aggregates are never used. */
+        if (f->wrapped) lua_settable(lua,-3);
+        luaReply.numframes--;
+        luaReplyAddValue(prefix);
+    }
+    return (void*)(long)luaReply.numframes;
+}
+
+void luaReplyPushBulk(client *c, const char *s, size_t len) {
+    luaReplyFlushProto(c);
+    lua_pushlstring(luaReply.lua,s,len);
+    luaReplyAddValue('$');
+}
+
+void luaReplyPushLongLong(client *c, long long ll) {
+    luaReplyFlushProto(c);
+    lua_pushnumber(luaReply.lua,(lua_Number)ll);
+    luaReplyAddValue(':');
+}
+
+/* Push a status reply, or an error when 'prefix' is '-'. */
+void luaReplyPushStatus(client *c, const char *s, size_t len, int prefix) {
+    lua_State *lua = luaReply.lua;
+
+    luaReplyFlushProto(c);
+    lua_newtable(lua);
+    lua_pushstring(lua,prefix == '-' ? "err" : "ok");
+    if (prefix == '-' && (!len || s[0] != '-')) {
+        sds err = sdscatlen(sdsnewlen("ERR ",4),s,len);
+        lua_pushlstring(lua,err,sdslen(err));
+        sdsfree(err);
+    } else if (prefix == '-') {
+        lua_pushlstring(lua,s+1,len-1);
+    } else {
+        lua_pushlstring(lua,s,len);
+    }
+    lua_settable(lua,-3);
+    luaReplyAddValue(prefix);
+}
+
+/* Push a null reply: false in RESP2, nil in RESP3. */
+void luaReplyPushNull(client *c) {
+    luaReplyFlushProto(c);
+    if (c->resp == 2)
+        lua_pushboolean(luaReply.lua,0);
+    else
+        lua_pushnil(luaReply.lua);
+    luaReplyAddValue('_');
+}
+
+void luaReplyPushBool(client *c, int b) {
+    luaReplyFlushProto(c);
+    if (c->resp == 2)
+        lua_pushnumber(luaReply.lua,b ? 1 : 0);
+    else
+        lua_pushboolean(luaReply.lua,b);
+    luaReplyAddValue('#');
+}
+
+void luaReplyPushAggregateLen(client *c, long len, int prefix) {
+    luaReplyFlushProto(c);
+    luaReplyOpenAggregate(len,prefix);
+}
+
+void *luaReplyPushDeferredLen(client *c) {
+    luaReplyFlushProto(c);
+    return luaReplyOpenAggregate(-1,'*');
+}
+
+/* Set the length of the aggregate opened by luaReplyPushDeferredLen(),
+ * storing it into the outer one. The elements were stored as an array:
+ * RESP3 maps and sets are converted now that their type is known. */
+void luaReplySetDeferredLen(client *c, void *handle, long len, int prefix) {
+    lua_State *lua = luaReply.lua;
+
+    luaReplyFlushProto(c);
+    serverAssert((long)handle == luaReply.numframes);
+    luaReplyFrame *f = luaReply.frames+luaReply.numframes-1;
+    UNUSED(len);
+
+    if (c->resp == 3 && (prefix == '%' || prefix == '~')) {
+        long count = f->count, j;
+
+        lua_checkstack(lua,4);
+        lua_newtable(lua);                      /* Stack: items, wrap */
+        lua_pushstring(lua,prefix == '%' ? "map" : "set");
+        lua_newtable(lua);                      /* Stack: items, wrap, k, t */
+        for (j = 1; j <= count; j++) {
+            lua_rawgeti(lua,-4,j);
+            if (prefix == '%') lua_rawgeti(lua,-5,++j);
+            else lua_pushboolean(lua,1);
+            lua_settable(lua,-3);
+        }
+        lua_settable(lua,-3);                   /* Stack: items, wrap */
+        lua_remove(lua,-2);                     /* Stack: wrap */
+    }
+    luaReply.numframes--;
+    luaReplyAddValue(prefix);
+}
+
+/* Convert the raw protocol accumulated in the buffers of the Lua client into
+ * Lua values. */
+static void luaReplyFlushProto(client *c) {
+    char *reply, *p;
+    size_t len;
+
+    if (c->bufpos == 0 && listLength(c->reply) == 0) return;
+    if (listLength(c->reply) == 0 && c->buf &&
+        c->bufpos < PROTO_REPLY_CHUNK_BYTES)
+    {
+        c->buf[c->bufpos] = '\0';
+        reply = c->buf;
+        len = c->bufpos;
+    } else {
+        reply = sdsnewlen(c->buf,c->bufpos);
+        while(listLength(c->reply)) {
+            clientReplyBlock *o = listNodeValue(listFirst(c->reply));
+
+            reply = sdscatlen(reply,o->buf,o->used);
+            listDelNode(c->reply,listFirst(c->reply));
+        }
+        len = sdslen(reply);
+    }
+    c->bufpos = 0;
+
+    p = reply;
+    while (p < reply+len) {
+        char *next = redisProtocolToLuaType(luaReply.lua,p);
+        if (next == p) break; /* Type not converted to Lua. */
+        luaReplyAddValue(*p);
+        p = next;
+    }
+    if (reply != c->buf) sdsfree(reply);
+}
+
+/* ---------------------------------------------------------------------------
+ * Scripts profiler.
+ *
+ * When lua-profiler is enabled every script runs with a line hook that
+ * charges the time elapsed since the previous line event to the line that
+ * was executing, and the redis.call() / redis.pcall() calls are timed as
+ * well. The statistics are aggregated per script SHA1 and reported by
+ * SCRIPT PROFILE. When the profiler is off the only cost is a NULL check
+ * around the commands called by scripts.
+ * ------------------------------------------------------------------------- */
+
+typedef struct luaProfileLine {
+    long long hits;     /* Times the line was entered. */
+    long long usec;     /* Time spent executing the line. */
+} luaProfileLine;
+
+typedef struct luaProfileCmd {
+    long long calls;
+    long long usec;
+} luaProfileCmd;
+
+typedef struct luaProfile {
+    long long calls;        /* Number of executions of the script. */
+    long long usec;         /* Total execution time. */
+    luaProfileLine *lines;  /* Per line stats, lines[0] is line 1. */
+    int numlines;           /* Number of entries allocated in 'lines'. */
+    dict *commands;         /* Command name -> luaProfileCmd. */
+} luaProfile;
+
+void luaProfileDictDestructor(void *privdata, void *val) {
+    luaProfile *p = val;
+    UNUSED(privdata);
+
+    zfree(p->lines);
+    dictRelease(p->commands);
+    zfree(p);
+}
+
+/* Script SHA1 -> luaProfile. */
+dictType luaProfilesDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    luaProfileDictDestructor    /* val destructor */
+};
+
+/* Command name -> luaProfileCmd. */
+dictType luaProfileCmdsDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictVanillaFree             /* val destructor */
+};
+
+static dict *luaProfiles = NULL;
+
+/* State of the script being profiled. 'profile' is NULL when the running
+ * script is not profiled. */
+static struct {
+    luaProfile *profile;
+    int line;               /* Line being executed, 0 if none yet. */
+    long long start;        /* Script start time. */
+    long long linestart;    /* Time the current line was entered. */
+} luaProfileCur;
+
+/* Return the stats of the specified line, growing the array if needed. */
+static luaProfileLine *luaProfileGetLine(luaProfile *p, int line) {
+    if (line > p->numlines) {
+        int numlines = line < 16 ? 16 : line*2;
+        p->lines = zrealloc(p->lines,sizeof(luaProfileLine)*numlines);
+        memset(p->lines+p->numlines,0,
+            sizeof(luaProfileLine)*(numlines-p->numlines));
+        p->numlines = numlines;
+    }
+    return p->lines+line-1;
+}
+
+/* Charge the time elapsed since the current line was entered to it. */
+static void luaProfileChargeLine(long long now) {
+    if (luaProfileCur.line > 0) {
+        luaProfileLine *pl = luaProfileGetLine(luaProfileCur.profile,
+                                               luaProfileCur.line);
+        pl->usec += now-luaProfileCur.linestart;
+    }
+    luaProfileCur.linestart = now;
+}
+
+/* Start profiling an execution of the script with the specified SHA1. */
+void luaProfileStart(char *sha) {
+    sds key = sdsnewlen(sha,40);
+    luaProfile *p;
+    dictEntry *de;
+
+    if (luaProfiles == NULL)
+        luaProfiles = dictCreate(&luaProfilesDictType,NULL);
+    if ((de = dictFind(luaProfiles,key)) != NULL) {
+        p = dictGetVal(de);
+        sdsfree(key);
+    } else {
+        p = zcalloc(sizeof(*p));
+        p->commands = dictCreate(&luaProfileCmdsDictType,NULL);
+        dictAdd(luaProfiles,key,p);
+    }
+    luaProfileCur.profile = p;
+    luaProfileCur.line = 0;
+    luaProfileCur.start = luaProfileCur.linestart = ustime();
+}
+
+/* Called when the profiled script returns, successfully or not. */
+void luaProfileEnd(void) {
+    long long now = ustime();
+    luaProfile *p = luaProfileCur.profile;
+
+    luaProfileChargeLine(now);
+    p->calls++;
+    p->usec += now-luaProfileCur.start;
+    luaProfileCur.profile = NULL;
+}
+
+/* Account a command called by the profiled script. */
+static void luaProfileCommand(struct redisCommand *cmd, long long usec) {
+    dict *commands = luaProfileCur.profile->commands;
+    luaProfileCmd *pc;
+    dictEntry *de;
+    sds name = sdsnew(cmd->name);
+
+    if ((de = dictFind(commands,name)) != NULL) {
+        pc = dictGetVal(de);
+        sdsfree(name);
+    } else {
+        pc = zcalloc(sizeof(*pc));
+        dictAdd(commands,name,pc);
+    }
+    pc->calls++;
+    pc->usec += usec;
+}
+
+/* The hook used for profiled scripts. It also takes care of the timeout
+ * detection, since a single hook can be set at a time. */
+void luaProfileHook(lua_State *lua, lua_Debug *ar) {
+    if (ar->event == LUA_HOOKCOUNT) {
+        if (server.lua_time_limit > 0) luaMaskCountHook(lua,ar);
+        return;
+    }
+
+    /* Lines of other chunks, like the globals protection functions, are
+     * charged to the line of the script that called them. */
+    lua_getinfo(lua,"S",ar);
+    if (strcmp(ar->source,"@user_script")) return;
+
+    luaProfileChargeLine(ustime());
+    luaProfileCur.line = ar->currentline;
+    if (ar->currentline > 0)
+        luaProfileGetLine(luaProfileCur.profile,ar->currentline)->hits++;
+}
+
+/* Release all the collected statistics. */
+void luaProfileReset(void) {
+    if (luaProfiles) dictEmpty(luaProfiles,NULL);
+}
+
+/* Reply with the statistics of a script. */
+static void luaProfileReply(client *c, sds sha, luaProfile *p) {
+    dictIterator *di;
+    dictEntry *de;
+    void *replylen;
+    long count = 0;
+    int j;
+
+    addReplyMapLen(c,5);
+    addReplyBulkCString(c,"sha");
+    addReplyBulkCBuffer(c,sha,40);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,p->calls);
+    addReplyBulkCString(c,"usec");
+    addReplyLongLong(c,p->usec);
+
+    addReplyBulkCString(c,"lines");
+    replylen = addReplyDeferredLen(c);
+    for (j = 0; j < p->numlines; j++) {
+        if (p->lines[j].hits == 0) continue;
+        addReplyArrayLen(c,3);
+        addReplyLongLong(c,j+1);
+        addReplyLongLong(c,p->lines[j].hits);
+        addReplyLongLong(c,p->lines[j].usec);
+        count++;
+    }
+    setDeferredArrayLen(c,replylen,count);
+
+    addReplyBulkCString(c,"commands");
+    addReplyArrayLen(c,dictSize(p->commands));
+    di = dictGetIterator(p->commands);
+    while((de = dictNext(di)) != NULL) {
+        sds name = dictGetKey(de);
+        luaProfileCmd *pc = dictGetVal(de);
+
+        addReplyArrayLen(c,3);
+        addReplyBulkCBuffer(c,name,sdslen(name));
+        addReplyLongLong(c,pc->calls);
+        addReplyLongLong(c,pc->usec);
+    }
+    dictReleaseIterator(di);
+}
+
+/* SCRIPT PROFILE [<sha1> ...]: with no arguments report all the profiled
+ * scripts, otherwise the specified ones (a null for the scripts that were
+ * never profiled). */
+void luaProfileCommandReply(client *c, robj **shas, int numshas) {
+    dictIterator *di;
+    dictEntry *de;
+    int j;
+
+    if (numshas == 0) {
+        if (luaProfiles == NULL) {
+            addReplyArrayLen(c,0);
+            return;
+        }
+        addReplyArrayLen(c,dictSize(luaProfiles));
+        di = dictGetIterator(luaProfiles);
+        while((de = dictNext(di)) != NULL)
+            luaProfileReply(c,dictGetKey(de),dictGetVal(de));
+        dictReleaseIterator(di);
+        return;
+    }
+
+    addReplyArrayLen(c,numshas);
+    for (j = 0; j < numshas; j++) {
+        sds sha = sdsdup(shas[j]->ptr);
+
+        sdstolower(sha);
+        de = luaProfiles ? dictFind(luaProfiles,sha) : NULL;
+        if (de)
+            luaProfileReply(c,dictGetKey(de),dictGetVal(de));
+        else
+            addReplyNull(c);
+        sdsfree(sha);
+    }
+}
+
 /* ---------------------------------------------------------------------------
  * Lua redis.* functions implementations.
  * ------------------------------------------------------------------------- */
@@ -569,6 +1051,7 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
     /* Setup our fake client for command execution */
     c->argv = argv;
     c->argc = argc;
+    c->argv_len = argc;
     c->user = server.lua_caller->user;
 
     /* Process module hooks */
@@ -630,7 +1113,12 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
      * of this script. */
     if (cmd->flags & CMD_WRITE) {
         int deny_write_type = writeCommandsDeniedByDiskError();
-        if (server.lua_random_dirty && !server.lua_replicate_commands) {
+        if (server.lua_caller->cmd->flags & CMD_READONLY) {
+            /* EVAL_RO / EVALSHA_RO. */
+            luaPushError(lua,
+                "Write commands are not allowed from read-only scripts");
+            goto cleanup;
+        } else if (server.lua_random_dirty && !server.lua_replicate_commands) {
             luaPushError(lua,
                 "Write commands not allowed after non deterministic commands. Call redis.replicate_commands() at the start of your script in order to switch to single commands replication mode.");
             goto cleanup;
@@ -670,6 +1158,17 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         }
     }
 
+    /* Keys not declared by the script may be locked by a MIGRATE or by a
+     * set operation in progress. */
+    if ((listLength(server.migrate_jobs) || listLength(server.setop_jobs)) &&
+        keysLocked(c->db,cmd,c->argv,c->argc))
+    {
+        luaPushError(lua,
+            "TRYAGAIN Keys are locked by a command in progress, "
+            "try again later");
+        goto cleanup;
+    }
+
     if (cmd->flags & CMD_RANDOM) server.lua_random_dirty = 1;
     if (cmd->flags & CMD_WRITE) server.lua_write_dirty = 1;
 
@@ -714,12 +1213,41 @@ int luaRedisGenericCommand(lua_State *lua, int raise_error) {
         if (server.lua_repl & PROPAGATE_REPL)
             call_flags |= CMD_CALL_PROPAGATE_REPL;
     }
+    /* The reply is converted into Lua values while the command runs,
+     * unless the debugger needs to log the protocol. */
+    int native = !ldb.active;
+    if (native) {
+        luaReply.lua = lua;
+        luaReply.base = lua_gettop(lua);
+        luaReply.type = 0;
+        luaReply.numframes = 0;
+        server.lua_native_reply = 1;
+    }
+    long long start = luaProfileCur.profile ? ustime() : 0;
     call(c,call_flags);
+    if (luaProfileCur.profile) luaProfileCommand(cmd,ustime()-start);
+
+    if (native) {
+        luaReplyFlushProto(c);
+        server.lua_native_reply = 0;
+        serverAssert(luaReply.numframes == 0);
+        if (raise_error && luaReply.type != '-') raise_error = 0;
+        if ((cmd->flags & CMD_SORT_FOR_SCRIPT) &&
+            (server.lua_replicate_commands == 0) &&
+            luaReply.type == '*' && lua_istable(lua,-1))
+        {
+            luaSortArray(lua);
+        }
+        c->reply_bytes = 0;
+        goto cleanup;
+    }
 
     /* Convert the result of the Redis command into a suitable Lua type.
      * The first thing we need is to create a single string from the client
      * output buffers. */
-    if (listLength(c->reply) == 0 && c->bufpos < PROTO_REPLY_CHUNK_BYTES) {
+    if (listLength(c->reply) == 0 && c->buf &&
+        c->bufpos < PROTO_REPLY_CHUNK_BYTES)
+    {
         /* This is a fast path for the common case of a reply inside the
          * client static buffer. Don't create an SDS string but just use
          * the client buffer directly. */
@@ -1012,6 +1540,12 @@ void luaLoadLibraries(lua_State *lua) {
     luaLoadLib(lua, "struct", luaopen_struct);
     luaLoadLib(lua, "cmsgpack", luaopen_cmsgpack);
     luaLoadLib(lua, "bit", luaopen_bit);
+#ifdef USE_LUAJIT
+    /* Loading the "jit" library is what turns the JIT compiler on. The
+     * library itself is removed from the globals later, scripts should not
+     * be able to change the settings of the compiler. */
+    luaLoadLib(lua, LUA_JITLIBNAME, luaopen_jit);
+#endif
 
 #if 0 /* Stuff that we don't load currently, for sandboxing concerns. */
     luaLoadLib(lua, LUA_LOADLIBNAME, luaopen_package);
@@ -1026,6 +1560,10 @@ void luaRemoveUnsupportedFunctions(lua_State *lua) {
     lua_setglobal(lua,"loadfile");
     lua_pushnil(lua);
     lua_setglobal(lua,"dofile");
+#ifdef USE_LUAJIT
+    lua_pushnil(lua);
+    lua_setglobal(lua,"jit");
+#endif
 }
 
 /* This function installs metamethods in the global table _G that prevent
@@ -1532,12 +2070,16 @@ void evalGenericCommand(client *c, int evalsha) {
     server.lua_cur_script = funcname + 2;
     server.lua_time_start = mstime();
     server.lua_kill = 0;
-    if (server.lua_time_limit > 0 && ldb.active == 0) {
-        lua_sethook(lua,luaMaskCountHook,LUA_MASKCOUNT,100000);
-        delhook = 1;
-    } else if (ldb.active) {
+    if (ldb.active) {
         lua_sethook(server.lua,luaLdbLineHook,LUA_MASKLINE|LUA_MASKCOUNT,100000);
         delhook = 1;
+    } else if (server.lua_profiler) {
+        luaProfileStart(funcname+2);
+        lua_sethook(lua,luaProfileHook,LUA_MASKLINE|LUA_MASKCOUNT,100000);
+        delhook = 1;
+    } else if (server.lua_time_limit > 0) {
+        lua_sethook(lua,luaMaskCountHook,LUA_MASKCOUNT,100000);
+        delhook = 1;
     }
 
     /* At this point whether this script was never seen before or if it was
@@ -1547,6 +2089,7 @@ void evalGenericCommand(client *c, int evalsha) {
 
     /* Perform some cleanup that we need to do both on error and success. */
     if (delhook) lua_sethook(lua,NULL,0,0); /* Disable hook */
+    if (luaProfileCur.profile) luaProfileEnd();
     if (server.lua_timedout) {
         server.lua_timedout = 0;
         /* Restore the client that was protected when the script timeout
@@ -1662,6 +2205,14 @@ void evalShaCommand(client *c) {
     }
 }
 
+void evalRoCommand(client *c) {
+    evalCommand(c);
+}
+
+void evalShaRoCommand(client *c) {
+    evalShaCommand(c);
+}
+
 void scriptCommand(client *c) {
     if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"help")) {
         const char *help[] = {
@@ -1670,11 +2221,21 @@ void scriptCommand(client *c) {
 "FLUSH -- Flush the Lua scripts cache. Very dangerous on replicas.",
 "KILL -- Kill the currently executing Lua script.",
 "LOAD <script> -- Load a script into the scripts cache, without executing it.",
+"PROFILE [<sha1> ...] -- Return the statistics collected by lua-profiler for all or the specified scripts.",
+"PROFILE RESET -- Reset the statistics collected by lua-profiler.",
 NULL
         };
         addReplyHelp(c, help);
+    } else if (c->argc == 3 && !strcasecmp(c->argv[1]->ptr,"profile") &&
+               !strcasecmp(c->argv[2]->ptr,"reset"))
+    {
+        luaProfileReset();
+        addReply(c,shared.ok);
+    } else if (c->argc >= 2 && !strcasecmp(c->argv[1]->ptr,"profile")) {
+        luaProfileCommandReply(c,c->argv+2,c->argc-2);
     } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"flush")) {
         scriptingReset();
+        luaProfileReset();
         addReply(c,shared.ok);
         replicationScriptCacheFlush();
         server.dirty++; /* Propagating this command is a good idea. */
@@ -1689,9 +2250,13 @@ NULL
                 addReply(c,shared.czero);
         }
     } else if (c->argc == 3 && !strcasecmp(c->argv[1]->ptr,"load")) {
+        unsigned long numscripts = dictSize(server.lua_scripts);
         sds sha = luaCreateFunction(c,server.lua,c->argv[2]);
         if (sha == NULL) return; /* The error was sent by luaCreateFunction(). */
         addReplyBulkCBuffer(c,sha,40);
+        /* The scripts cache is part of the RDB file: make sure the save
+         * points will take the new script into account. */
+        if (dictSize(server.lua_scripts) != numscripts) server.dirty++;
         forceCommandPropagation(c,PROPAGATE_REPL|PROPAGATE_AOF);
     } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"kill")) {
         if (server.lua_caller == NULL) {
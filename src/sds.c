@@ -73,6 +73,8 @@ static inline char sdsReqType(size_t string_size) {
 #endif
 }
 
+static sds sdsinit(void *sh, char type, const void *init, size_t initlen);
+
 /* Create a new sds string with the content specified by the 'init' pointer
  * and 'initlen'.
  * If NULL is used for 'init' the string is initialized with zero bytes.
@@ -88,20 +90,28 @@ static inline char sdsReqType(size_t string_size) {
  * \0 characters in the middle, as the length is stored in the sds header. */
 sds sdsnewlen(const void *init, size_t initlen) {
     void *sh;
-    sds s;
     char type = sdsReqType(initlen);
     /* Empty strings are usually created in order to append. Use type 8
      * since type 5 is not good at this. */
     if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
     int hdrlen = sdsHdrSize(type);
-    unsigned char *fp; /* flags pointer. */
 
     sh = s_malloc(hdrlen+initlen+1);
+    if (sh == NULL) return NULL;
+    return sdsinit(sh, type, init, initlen);
+}
+
+/* Initialize a string of type 'type' in the buffer 'sh', that must be big
+ * enough for the header and initlen+1 bytes. */
+static sds sdsinit(void *sh, char type, const void *init, size_t initlen) {
+    int hdrlen = sdsHdrSize(type);
+    unsigned char *fp; /* flags pointer. */
+    sds s;
+
     if (init==SDS_NOINIT)
         init = NULL;
     else if (!init)
         memset(sh, 0, hdrlen+initlen+1);
-    if (sh == NULL) return NULL;
     s = (char*)sh+hdrlen;
     fp = ((unsigned char*)s)-1;
     switch(type) {
@@ -144,6 +154,24 @@ sds sdsnewlen(const void *init, size_t initlen) {
     return s;
 }
 
+/* Return the number of bytes sdsnewembedded() needs to create a string of
+ * 'initlen' bytes. */
+size_t sdsEmbeddedSize(size_t initlen) {
+    char type = sdsReqType(initlen);
+    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+    return sdsHdrSize(type)+initlen+1;
+}
+
+/* Like sdsnewlen(), but the string is created inside 'buf', that must be at
+ * least sdsEmbeddedSize(initlen) bytes, so that it can be allocated together
+ * with some other structure. The returned string must not be resized nor
+ * freed with sdsfree(), since its memory belongs to 'buf'. */
+sds sdsnewembedded(void *buf, const void *init, size_t initlen) {
+    char type = sdsReqType(initlen);
+    if (type == SDS_TYPE_5 && initlen == 0) type = SDS_TYPE_8;
+    return sdsinit(buf, type, init, initlen);
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -77,6 +77,7 @@ typedef struct sentinelAddr {
 
 /* Note: times are in milliseconds. */
 #define SENTINEL_INFO_PERIOD 10000
+#define SENTINEL_INFO_FULL_PERIOD 60000
 #define SENTINEL_PING_PERIOD 1000
 #define SENTINEL_ASK_PERIOD 1000
 #define SENTINEL_PUBLISH_PERIOD 2000
@@ -186,6 +187,11 @@ typedef struct sentinelRedisInstance {
     mstime_t o_down_since_time; /* Objectively down since time. */
     mstime_t down_after_period; /* Consider it down after that period. */
     mstime_t info_refresh;  /* Time at which we received INFO output from it. */
+    mstime_t info_full_refresh; /* Time at which we received the full INFO
+                                   output, and not just the replication
+                                   section. */
+    mstime_t info_period;   /* INFO refresh period. Only used by masters, the
+                               slaves use the one of their master. */
     dict *renamed_commands;     /* Commands renamed in this instance:
                                    Sentinel will use the alternative commands
                                    mapped on this table to send things like
@@ -382,6 +388,9 @@ void sentinelEvent(int level, char *type, sentinelRedisInstance *ri, const char
 sentinelRedisInstance *sentinelSelectSlave(sentinelRedisInstance *master);
 void sentinelScheduleScriptExecution(char *path, ...);
 void sentinelStartFailover(sentinelRedisInstance *master);
+int sentinelSendInfo(sentinelRedisInstance *ri);
+void sentinelFailoverStateMachine(sentinelRedisInstance *ri);
+void sentinelFailoverReconfNextSlave(sentinelRedisInstance *master);
 void sentinelDiscardReplyCallback(redisAsyncContext *c, void *reply, void *privdata);
 int sentinelSendSlaveOf(sentinelRedisInstance *ri, char *host, int port);
 char *sentinelVoteLeader(sentinelRedisInstance *master, uint64_t req_epoch, char *req_runid, uint64_t *leader_epoch);
@@ -1229,6 +1238,7 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->o_down_since_time = 0;
     ri->down_after_period = master ? master->down_after_period :
                             SENTINEL_DEFAULT_DOWN_AFTER;
+    ri->info_period = SENTINEL_INFO_PERIOD;
     ri->master_link_down_time = 0;
     ri->auth_pass = NULL;
     ri->slave_priority = SENTINEL_DEFAULT_SLAVE_PRIORITY;
@@ -1243,6 +1253,7 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->master = master;
     ri->slaves = dictCreate(&instancesDictType,NULL);
     ri->info_refresh = 0;
+    ri->info_full_refresh = 0;
     ri->renamed_commands = dictCreate(&renamedCommandsDictType,NULL);
 
     /* Failover state. */
@@ -1647,6 +1658,13 @@ char *sentinelHandleConfiguration(char **argv, int argc) {
         if (ri->down_after_period <= 0)
             return "negative or zero time parameter.";
         sentinelPropagateDownAfterPeriod(ri);
+    } else if (!strcasecmp(argv[0],"info-period") && argc == 3) {
+        /* info-period <name> <milliseconds> */
+        ri = sentinelGetMasterByName(argv[1]);
+        if (!ri) return "No such master with specified name.";
+        ri->info_period = atoi(argv[2]);
+        if (ri->info_period <= 0)
+            return "negative or zero time parameter.";
     } else if (!strcasecmp(argv[0],"failover-timeout") && argc == 3) {
         /* failover-timeout <name> <milliseconds> */
         ri = sentinelGetMasterByName(argv[1]);
@@ -1804,6 +1822,14 @@ void rewriteConfigSentinelOption(struct rewriteConfigState *state) {
             rewriteConfigRewriteLine(state,"sentinel",line,1);
         }
 
+        /* sentinel info-period */
+        if (master->info_period != SENTINEL_INFO_PERIOD) {
+            line = sdscatprintf(sdsempty(),
+                "sentinel info-period %s %ld",
+                master->name, (long) master->info_period);
+            rewriteConfigRewriteLine(state,"sentinel",line,1);
+        }
+
         /* sentinel failover-timeout */
         if (master->failover_timeout != SENTINEL_DEFAULT_FAILOVER_TIMEOUT) {
             line = sdscatprintf(sdsempty(),
@@ -1989,7 +2015,11 @@ void sentinelSendAuthIfNeeded(sentinelRedisInstance *ri, redisAsyncContext *c) {
  * The connection type is "cmd" or "pubsub" as specified by 'type'.
  *
  * This makes it possible to list all the sentinel instances connected
- * to a Redis servewr with CLIENT LIST, grepping for a specific name format. */
+ * to a Redis servewr with CLIENT LIST, grepping for a specific name format.
+ *
+ * The connection also asks to be served before the other clients when the
+ * instance is overloaded, see CLIENT PRIORITY, so that the PINGs don't time
+ * out just because of the load. Older instances reply with an error. */
 void sentinelSetClientName(sentinelRedisInstance *ri, redisAsyncContext *c, char *type) {
     char name[64];
 
@@ -2001,6 +2031,12 @@ void sentinelSetClientName(sentinelRedisInstance *ri, redisAsyncContext *c, char
     {
         ri->link->pending_commands++;
     }
+    if (redisAsyncCommand(c, sentinelDiscardReplyCallback, ri,
+        "%s PRIORITY on",
+        sentinelInstanceMapCommand(ri,"CLIENT")) == C_OK)
+    {
+        ri->link->pending_commands++;
+    }
 }
 
 static int instanceLinkNegotiateTLS(redisAsyncContext *context) {
@@ -2042,8 +2078,12 @@ void sentinelReconnectInstance(sentinelRedisInstance *ri) {
         } else {
             link->pending_commands = 0;
             link->cc_conn_time = mstime();
+            /* The instance may have been restarted: get the full INFO
+             * output again, to check its run ID. */
+            ri->info_full_refresh = 0;
             link->cc->data = link;
             redisAeAttach(server.el,link->cc);
+            redisAsyncSetDeferWrite(link->cc,1);
             redisAsyncSetConnectCallback(link->cc,
                     sentinelLinkEstablishedCallback);
             redisAsyncSetDisconnectCallback(link->cc,
@@ -2071,6 +2111,7 @@ void sentinelReconnectInstance(sentinelRedisInstance *ri) {
             link->pc_conn_time = mstime();
             link->pc->data = link;
             redisAeAttach(server.el,link->pc);
+            redisAsyncSetDeferWrite(link->pc,1);
             redisAsyncSetConnectCallback(link->pc,
                     sentinelLinkEstablishedCallback);
             redisAsyncSetDisconnectCallback(link->pc,
@@ -2108,7 +2149,14 @@ int sentinelMasterLooksSane(sentinelRedisInstance *master) {
         master->flags & SRI_MASTER &&
         master->role_reported == SRI_MASTER &&
         (master->flags & (SRI_S_DOWN|SRI_O_DOWN)) == 0 &&
-        (mstime() - master->info_refresh) < SENTINEL_INFO_PERIOD*2;
+        (mstime() - master->info_refresh) < master->info_period*2;
+}
+
+/* Return the INFO refresh period of a master or slave instance: the
+ * slaves use the one configured for their master. */
+mstime_t sentinelInfoPeriod(sentinelRedisInstance *ri) {
+    return (ri->flags & SRI_MASTER) ? ri->info_period :
+                                      ri->master->info_period;
 }
 
 /* Process the INFO output from masters. */
@@ -2117,9 +2165,14 @@ void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
     int numlines, j;
     int role = 0;
 
-    /* cache full INFO output for instance */
-    sdsfree(ri->info);
-    ri->info = sdsnew(info);
+    /* Cache the full INFO output for the instance. Most of the times only
+     * the replication section is requested, that has all we need except
+     * the run ID, see sentinelSendPeriodicCommands(). */
+    if (!strncmp(info,"# Server",8)) {
+        sdsfree(ri->info);
+        ri->info = sdsnew(info);
+        ri->info_full_refresh = mstime();
+    }
 
     /* The following fields must be reset to a given value in the case they
      * are not found at all in the INFO output. */
@@ -2294,6 +2347,9 @@ void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
             sentinelCallClientReconfScript(ri->master,SENTINEL_LEADER,
                 "start",ri->master->addr,ri->addr);
             sentinelForceHelloUpdateForMaster(ri->master);
+            /* Reconfigure the other slaves right away, without waiting
+             * for the next timer tick. */
+            sentinelFailoverReconfNextSlave(ri->master);
         } else {
             /* A slave turned into a master. We want to force our view and
              * reconfigure as slave. Wait some time after the change before
@@ -2689,12 +2745,32 @@ int sentinelSendPing(sentinelRedisInstance *ri) {
     }
 }
 
+/* Send INFO to the specified master or slave instance. Parsing the whole
+ * INFO output of hundreds of instances is costly, so just the replication
+ * section is requested, and the full output only from time to time, or
+ * after reconnecting, to detect restarts. */
+int sentinelSendInfo(sentinelRedisInstance *ri) {
+    const char *fmt = "%s replication";
+    int retval;
+
+    if (ri->runid == NULL || ri->info_full_refresh == 0 ||
+        (mstime() - ri->info_full_refresh) > SENTINEL_INFO_FULL_PERIOD)
+    {
+        fmt = "%s";
+    }
+    retval = redisAsyncCommand(ri->link->cc,
+        sentinelInfoReplyCallback, ri, fmt,
+        sentinelInstanceMapCommand(ri,"INFO"));
+    if (retval == C_ERR) return C_ERR;
+    ri->link->pending_commands++;
+    return C_OK;
+}
+
 /* Send periodic PING, INFO, and PUBLISH to the Hello channel to
  * the specified master or slave instance. */
 void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
     mstime_t now = mstime();
     mstime_t info_period, ping_period;
-    int retval;
 
     /* Return ASAP if we have already a PING or INFO already pending, or
      * in the case the instance is not properly connected. */
@@ -2710,8 +2786,8 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
         SENTINEL_MAX_PENDING_COMMANDS * ri->link->refcount) return;
 
     /* If this is a slave of a master in O_DOWN condition we start sending
-     * it INFO every second, instead of the usual SENTINEL_INFO_PERIOD
-     * period. In this state we want to closely monitor slaves in case they
+     * it INFO every second, instead of the usual INFO period configured
+     * for the master. In this state we want to closely monitor slaves in case they
      * are turned into masters by another Sentinel, or by the sysadmin.
      *
      * Similarly we monitor the INFO output more often if the slave reports
@@ -2723,7 +2799,7 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
     {
         info_period = 1000;
     } else {
-        info_period = SENTINEL_INFO_PERIOD;
+        info_period = sentinelInfoPeriod(ri);
     }
 
     /* We ping instances every time the last received pong is older than
@@ -2737,10 +2813,7 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
         (ri->info_refresh == 0 ||
         (now - ri->info_refresh) > info_period))
     {
-        retval = redisAsyncCommand(ri->link->cc,
-            sentinelInfoReplyCallback, ri, "%s",
-            sentinelInstanceMapCommand(ri,"INFO"));
-        if (retval == C_OK) ri->link->pending_commands++;
+        sentinelSendInfo(ri);
     }
 
     /* Send PING to all the three kinds of instances. */
@@ -2863,6 +2936,10 @@ void addReplySentinelRedisInstance(client *c, sentinelRedisInstance *ri) {
         addReplyBulkLongLong(c,mstime() - ri->info_refresh);
         fields++;
 
+        addReplyBulkCString(c,"info-period");
+        addReplyBulkLongLong(c,sentinelInfoPeriod(ri));
+        fields++;
+
         addReplyBulkCString(c,"role-reported");
         addReplyBulkCString(c, (ri->role_reported == SRI_MASTER) ? "master" :
                                                                    "slave");
@@ -3457,6 +3534,15 @@ void sentinelSetCommand(client *c) {
             ri->down_after_period = ll;
             sentinelPropagateDownAfterPeriod(ri);
             changes++;
+        } else if (!strcasecmp(option,"info-period") && moreargs > 0) {
+            /* info-period <milliseconds> */
+            robj *o = c->argv[++j];
+            if (getLongLongFromObject(o,&ll) == C_ERR || ll <= 0) {
+                badarg = j;
+                goto badfmt;
+            }
+            ri->info_period = ll;
+            changes++;
         } else if (!strcasecmp(option,"failover-timeout") && moreargs > 0) {
             /* failover-timeout <milliseconds> */
             robj *o = c->argv[++j];
@@ -3654,7 +3740,7 @@ void sentinelCheckSubjectivelyDown(sentinelRedisInstance *ri) {
         (ri->flags & SRI_MASTER &&
          ri->role_reported == SRI_SLAVE &&
          mstime() - ri->role_reported_time >
-          (ri->down_after_period+SENTINEL_INFO_PERIOD*2)))
+          (ri->down_after_period+ri->info_period*2)))
     {
         /* Is subjectively down */
         if ((ri->flags & SRI_S_DOWN) == 0) {
@@ -3748,6 +3834,15 @@ void sentinelReceiveIsMasterDownReply(redisAsyncContext *c, void *reply, void *p
                     (unsigned long long) r->element[2]->integer);
             ri->leader = sdsnew(r->element[1]->str);
             ri->leader_epoch = r->element[2]->integer;
+
+            /* This vote may give us the majority: don't wait for the next
+             * timer tick to go forward with the failover. */
+            if (!sentinel.tilt &&
+                ri->master->failover_state ==
+                    SENTINEL_FAILOVER_STATE_WAIT_START)
+            {
+                sentinelFailoverStateMachine(ri->master);
+            }
         }
     }
 }
@@ -4155,7 +4250,7 @@ sentinelRedisInstance *sentinelSelectSlave(sentinelRedisInstance *master) {
         if (master->flags & SRI_S_DOWN)
             info_validity_time = SENTINEL_PING_PERIOD*5;
         else
-            info_validity_time = SENTINEL_INFO_PERIOD*3;
+            info_validity_time = master->info_period*3;
         if (mstime() - slave->info_refresh > info_validity_time) continue;
         if (slave->master_link_down_time > max_master_down_time) continue;
         instance[instances++] = slave;
@@ -4243,6 +4338,10 @@ void sentinelFailoverSendSlaveOfNoOne(sentinelRedisInstance *ri) {
      * if INFO returns a different role (master instead of slave). */
     retval = sentinelSendSlaveOf(ri->promoted_slave,NULL,0);
     if (retval != C_OK) return;
+    /* The INFO reply comes after the one of the SLAVEOF NO ONE transaction,
+     * so it should already report the new role: the promotion is detected
+     * without waiting for the next INFO period. */
+    sentinelSendInfo(ri->promoted_slave);
     sentinelEvent(LL_NOTICE, "+failover-state-wait-promotion",
         ri->promoted_slave,"%@");
     ri->failover_state = SENTINEL_FAILOVER_STATE_WAIT_PROMOTION;
@@ -4375,6 +4474,9 @@ void sentinelFailoverReconfNextSlave(sentinelRedisInstance *master) {
             slave->flags |= SRI_RECONF_SENT;
             slave->slave_reconf_sent_time = mstime();
             sentinelEvent(LL_NOTICE,"+slave-reconf-sent",slave,"%@");
+            /* Like for the promoted slave, get the new configuration of
+             * the slave as soon as it is applied. */
+            sentinelSendInfo(slave);
             in_progress++;
         }
     }
@@ -4399,27 +4501,36 @@ void sentinelFailoverSwitchToPromotedSlave(sentinelRedisInstance *master) {
 }
 
 void sentinelFailoverStateMachine(sentinelRedisInstance *ri) {
+    int prev_state;
+
     serverAssert(ri->flags & SRI_MASTER);
 
-    if (!(ri->flags & SRI_FAILOVER_IN_PROGRESS)) return;
+    /* The states up to sending SLAVEOF NO ONE to the selected slave don't
+     * wait for anything once we are elected: they are executed one after
+     * the other, instead of one per timer tick. */
+    do {
+        if (!(ri->flags & SRI_FAILOVER_IN_PROGRESS)) return;
+        prev_state = ri->failover_state;
 
-    switch(ri->failover_state) {
-        case SENTINEL_FAILOVER_STATE_WAIT_START:
-            sentinelFailoverWaitStart(ri);
-            break;
-        case SENTINEL_FAILOVER_STATE_SELECT_SLAVE:
-            sentinelFailoverSelectSlave(ri);
-            break;
-        case SENTINEL_FAILOVER_STATE_SEND_SLAVEOF_NOONE:
-            sentinelFailoverSendSlaveOfNoOne(ri);
-            break;
-        case SENTINEL_FAILOVER_STATE_WAIT_PROMOTION:
-            sentinelFailoverWaitPromotion(ri);
-            break;
-        case SENTINEL_FAILOVER_STATE_RECONF_SLAVES:
-            sentinelFailoverReconfNextSlave(ri);
-            break;
-    }
+        switch(ri->failover_state) {
+            case SENTINEL_FAILOVER_STATE_WAIT_START:
+                sentinelFailoverWaitStart(ri);
+                break;
+            case SENTINEL_FAILOVER_STATE_SELECT_SLAVE:
+                sentinelFailoverSelectSlave(ri);
+                break;
+            case SENTINEL_FAILOVER_STATE_SEND_SLAVEOF_NOONE:
+                sentinelFailoverSendSlaveOfNoOne(ri);
+                break;
+            case SENTINEL_FAILOVER_STATE_WAIT_PROMOTION:
+                sentinelFailoverWaitPromotion(ri);
+                break;
+            case SENTINEL_FAILOVER_STATE_RECONF_SLAVES:
+                sentinelFailoverReconfNextSlave(ri);
+                break;
+        }
+    } while (ri->failover_state != prev_state &&
+             ri->failover_state <= SENTINEL_FAILOVER_STATE_SEND_SLAVEOF_NOONE);
 }
 
 /* Abort a failover in progress:
@@ -4506,6 +4617,34 @@ void sentinelHandleDictOfRedisInstances(dict *instances) {
     dictReleaseIterator(di);
 }
 
+/* Write the commands queued on the links of the instances in the dictionary,
+ * recursively for the slaves and Sentinels of masters. The links defer their
+ * writes, so that all the commands sent to an instance while handling the
+ * events of an event loop iteration go out with a single write. */
+void sentinelFlushDictOfLinks(dict *instances) {
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetIterator(instances);
+    while((de = dictNext(di)) != NULL) {
+        sentinelRedisInstance *ri = dictGetVal(de);
+
+        /* A write error disconnects the link, clearing its pointer. */
+        if (ri->link->cc) redisAsyncFlush(ri->link->cc);
+        if (ri->link->pc) redisAsyncFlush(ri->link->pc);
+        if (ri->flags & SRI_MASTER) {
+            sentinelFlushDictOfLinks(ri->slaves);
+            sentinelFlushDictOfLinks(ri->sentinels);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
+/* Called before the event loop sleeps. */
+void sentinelBeforeSleep(void) {
+    sentinelFlushDictOfLinks(sentinel.masters);
+}
+
 /* This function checks if we need to enter the TITL mode.
  *
  * The TILT mode is entered if we detect that between two invocations of the
@@ -163,7 +163,7 @@ volatile unsigned long lru_clock; /* Server global current LRU time. */
  *
  * @keyspace, @read, @write, @set, @sortedset, @list, @hash, @string, @bitmap,
  * @hyperloglog, @stream, @admin, @fast, @slow, @pubsub, @blocking, @dangerous,
- * @connection, @transaction, @scripting, @geo.
+ * @connection, @transaction, @scripting, @geo, @bloom.
  *
  * Note that:
  *
@@ -334,6 +334,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @set",
      0,NULL,1,1,1,0,0,0},
 
+    {"sbuild",sbuildCommand,-4,
+     "write use-memory @set",
+     0,NULL,1,1,1,0,0,0},
+
     {"srem",sremCommand,-3,
      "write fast @set",
      0,NULL,1,1,1,0,0,0},
@@ -394,6 +398,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @sortedset",
      0,NULL,1,1,1,0,0,0},
 
+    {"zbuild",zbuildCommand,-5,
+     "write use-memory @sortedset",
+     0,NULL,1,1,1,0,0,0},
+
     {"zincrby",zincrbyCommand,4,
      "write use-memory fast @sortedset",
      0,NULL,1,1,1,0,0,0},
@@ -494,6 +502,10 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory fast @hash",
      0,NULL,1,1,1,0,0,0},
 
+    {"hbuild",hbuildCommand,-5,
+     "write use-memory @hash",
+     0,NULL,1,1,1,0,0,0},
+
     {"hsetnx",hsetnxCommand,4,
      "write use-memory fast @hash",
      0,NULL,1,1,1,0,0,0},
@@ -522,6 +534,34 @@ struct redisCommand redisCommandTable[] = {
      "write fast @hash",
      0,NULL,1,1,1,0,0,0},
 
+    {"hexpire",hexpireCommand,-4,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpire",hpexpireCommand,-4,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hexpireat",hexpireatCommand,-4,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpexpireat",hpexpireatCommand,-4,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"httl",httlCommand,-3,
+     "read-only fast random @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpttl",hpttlCommand,-3,
+     "read-only fast random @hash",
+     0,NULL,1,1,1,0,0,0},
+
+    {"hpersist",hpersistCommand,-3,
+     "write fast @hash",
+     0,NULL,1,1,1,0,0,0},
+
     {"hlen",hlenCommand,2,
      "read-only fast @hash",
      0,NULL,1,1,1,0,0,0},
@@ -624,6 +664,10 @@ struct redisCommand redisCommandTable[] = {
      "read-only random @keyspace",
      0,NULL,0,0,0,0,0,0},
 
+    {"keyrange",keyrangeCommand,-3,
+     "read-only @keyspace",
+     0,NULL,0,0,0,0,0,0},
+
     {"dbsize",dbsizeCommand,1,
      "read-only fast @keyspace",
      0,NULL,0,0,0,0,0,0},
@@ -651,6 +695,10 @@ struct redisCommand redisCommandTable[] = {
      "admin no-script",
      0,NULL,0,0,0,0,0,0},
 
+    {"bgload",bgloadCommand,2,
+     "admin no-script",
+     0,NULL,0,0,0,0,0,0},
+
     {"bgrewriteaof",bgrewriteaofCommand,1,
      "admin no-script",
      0,NULL,0,0,0,0,0,0},
@@ -767,6 +815,18 @@ struct redisCommand redisCommandTable[] = {
      "pub-sub ok-loading ok-stale fast",
      0,NULL,0,0,0,0,0,0},
 
+    {"ssubscribe",ssubscribeCommand,-2,
+     "pub-sub no-script ok-loading ok-stale",
+     0,NULL,1,-1,1,0,0,0},
+
+    {"sunsubscribe",sunsubscribeCommand,-1,
+     "pub-sub no-script ok-loading ok-stale",
+     0,NULL,1,-1,1,0,0,0},
+
+    {"spublish",spublishCommand,3,
+     "pub-sub ok-loading ok-stale fast",
+     0,NULL,1,1,1,0,0,0},
+
     {"pubsub",pubsubCommand,-2,
      "pub-sub ok-loading ok-stale random",
      0,NULL,0,0,0,0,0,0},
@@ -807,7 +867,7 @@ struct redisCommand redisCommandTable[] = {
      "fast @keyspace",
      0,NULL,0,0,0,0,0,0},
 
-    {"dump",dumpCommand,2,
+    {"dump",dumpCommand,-2,
      "read-only random @keyspace",
      0,NULL,1,1,1,0,0,0},
 
@@ -837,6 +897,17 @@ struct redisCommand redisCommandTable[] = {
      "no-script @scripting",
      0,evalGetKeys,0,0,0,0,0,0},
 
+    /* The read only variants of EVAL and EVALSHA refuse to run write
+     * commands, so they can be flagged as read only and served by replicas
+     * like every other read command. */
+    {"eval_ro",evalRoCommand,-3,
+     "read-only no-script @scripting",
+     0,evalGetKeys,0,0,0,0,0,0},
+
+    {"evalsha_ro",evalShaRoCommand,-3,
+     "read-only no-script @scripting",
+     0,evalGetKeys,0,0,0,0,0,0},
+
     {"slowlog",slowlogCommand,-2,
      "admin random",
      0,NULL,0,0,0,0,0,0},
@@ -865,6 +936,14 @@ struct redisCommand redisCommandTable[] = {
      "no-script @keyspace",
      0,NULL,0,0,0,0,0,0},
 
+    {"waitaof",waitaofCommand,2,
+     "no-script @keyspace",
+     0,NULL,0,0,0,0,0,0},
+
+    {"waitoffset",waitoffsetCommand,3,
+     "no-script ok-stale @keyspace",
+     0,NULL,0,0,0,0,0,0},
+
     {"command",commandCommand,-1,
      "ok-loading ok-stale random @connection",
      0,NULL,0,0,0,0,0,0},
@@ -890,6 +969,14 @@ struct redisCommand redisCommandTable[] = {
      "read-only @geo",
      0,georadiusGetKeys,1,1,1,0,0,0},
 
+    {"geosearch",geosearchCommand,-7,
+     "read-only @geo",
+     0,NULL,1,1,1,0,0,0},
+
+    {"geosearchstore",geosearchstoreCommand,-8,
+     "write use-memory @geo",
+     0,NULL,1,2,1,0,0,0},
+
     {"geohash",geohashCommand,-2,
      "read-only @geo",
      0,NULL,1,1,1,0,0,0},
@@ -926,6 +1013,30 @@ struct redisCommand redisCommandTable[] = {
      "admin write",
      0,NULL,0,0,0,0,0,0},
 
+    {"bfreserve",bfreserveCommand,-4,
+     "write use-memory @bloom",
+     0,NULL,1,1,1,0,0,0},
+
+    {"bfadd",bfaddCommand,3,
+     "write use-memory fast @bloom",
+     0,NULL,1,1,1,0,0,0},
+
+    {"bfmadd",bfmaddCommand,-3,
+     "write use-memory @bloom",
+     0,NULL,1,1,1,0,0,0},
+
+    {"bfexists",bfexistsCommand,3,
+     "read-only fast @bloom",
+     0,NULL,1,1,1,0,0,0},
+
+    {"bfmexists",bfmexistsCommand,-3,
+     "read-only @bloom",
+     0,NULL,1,1,1,0,0,0},
+
+    {"bfinfo",bfinfoCommand,2,
+     "read-only @bloom",
+     0,NULL,1,1,1,0,0,0},
+
     {"xadd",xaddCommand,-5,
      "write use-memory fast random @stream",
      0,NULL,1,1,1,0,0,0},
@@ -954,7 +1065,7 @@ struct redisCommand redisCommandTable[] = {
      "write use-memory @stream",
      0,NULL,2,2,1,0,0,0},
 
-    {"xsetid",xsetidCommand,3,
+    {"xsetid",xsetidCommand,-3,
      "write use-memory fast @stream",
      0,NULL,1,1,1,0,0,0},
 
@@ -970,6 +1081,10 @@ struct redisCommand redisCommandTable[] = {
      "write random fast @stream",
      0,NULL,1,1,1,0,0,0},
 
+    {"xautoclaim",xautoclaimCommand,-5,
+     "write random fast @stream",
+     0,NULL,1,1,1,0,0,0},
+
     {"xinfo",xinfoCommand,-2,
      "read-only random @stream",
      0,NULL,2,2,1,0,0,0},
@@ -1181,6 +1296,22 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+size_t dictSdsEmbeddedSize(const void *key) {
+    return sdsEmbeddedSize(sdslen((sds)key));
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsnewembedded(buf,key,sdslen((sds)key));
+}
+
+size_t dictKeyMetaBytes(dict *d) {
+    UNUSED(d);
+    /* In cluster mode the entry is also linked to the other keys of its
+     * hash slot, see slotToKeyAddEntry(). */
+    return sizeof(keyMeta) +
+           (server.cluster_enabled ? sizeof(clusterDictEntryMetadata) : 0);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -1280,7 +1411,7 @@ dictType zsetDictType = {
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
-    NULL,                      /* Note: SDS string shared & freed by skiplist */
+    NULL,                      /* Note: SDS string embedded in skiplist node */
     NULL                       /* val destructor */
 };
 
@@ -1290,8 +1421,12 @@ dictType dbDictType = {
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+    dictSdsEmbeddedSize,        /* key embedded size */
+    dictSdsEmbed,               /* key embed */
+    dictKeyMetaBytes,           /* entry metadata bytes */
+    dbDictExpandAllowed         /* expand allowed */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1304,16 +1439,6 @@ dictType shaScriptObjectDictType = {
     dictObjectDestructor        /* val destructor */
 };
 
-/* Db->expires */
-dictType keyptrDictType = {
-    dictSdsHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictSdsKeyCompare,          /* key compare */
-    NULL,                       /* key destructor */
-    NULL                        /* val destructor */
-};
-
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -1324,7 +1449,7 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -1334,6 +1459,28 @@ dictType hashDictType = {
     dictSdsDestructor           /* val destructor */
 };
 
+/* Field expires of the hashes, keys are the hash names and values the
+ * sorted sets of their fields, see t_hash.c. */
+dictType hashFieldExpiresDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictObjectDestructor        /* val destructor */
+};
+
+/* Interned string values: the keys are the sds strings of the objects, that
+ * are the values. Both are owned by the object, see tryObjectInterning(). */
+dictType internedValuesDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /* Keylist hash table type has unencoded redis objects as keys and
  * lists as values. It's used for blocking operations (BLPOP) and to
  * map swapped keys to a list of clients waiting for this keys to be loaded. */
@@ -1346,6 +1493,28 @@ dictType keylistDictType = {
     dictListDestructor          /* val destructor */
 };
 
+/* Watched keys hash table type has unencoded redis objects as keys and
+ * heap allocated versions of the keys as values: see multi.c. */
+dictType watchedKeysDictType = {
+    dictObjHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictObjKeyCompare,          /* key compare */
+    dictObjectDestructor,       /* key destructor */
+    dictVanillaFree             /* val destructor */
+};
+
+/* Stream keys with blocked clients, indexed by consumer group: see
+ * blocked.c. */
+dictType streamBlockedDictType = {
+    dictObjHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictObjKeyCompare,          /* key compare */
+    dictObjectDestructor,       /* key destructor */
+    freeStreamBlockedClients    /* val destructor */
+};
+
 /* Cluster nodes hash table, mapping nodes addresses 1.2.3.4:6379 to
  * clusterNode structures. */
 dictType clusterNodesDictType = {
@@ -1413,12 +1582,15 @@ int htNeedsResize(dict *dict) {
 }
 
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
- * we resize the hash table to save memory */
+ * we resize the hash table to save memory. Not while KEYS is replied in
+ * the background, since its cursor could return some keys twice. */
 void tryResizeHashTables(int dbid) {
-    if (htNeedsResize(server.db[dbid].dict))
+    if (server.db[dbid].keys_reply_jobs) return;
+    if (htNeedsResize(server.db[dbid].dict)) {
+        redisDb *prev = dbMemoryAccountingSwitch(server.db+dbid);
         dictResize(server.db[dbid].dict);
-    if (htNeedsResize(server.db[dbid].expires))
-        dictResize(server.db[dbid].expires);
+        dbMemoryAccountingSwitch(prev);
+    }
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -1431,12 +1603,14 @@ void tryResizeHashTables(int dbid) {
 int incrementallyRehash(int dbid) {
     /* Keys dictionary */
     if (dictIsRehashing(server.db[dbid].dict)) {
+        ustime_t latency;
+
+        latencyStartMonitor(latency);
+        redisDb *prev = dbMemoryAccountingSwitch(server.db+dbid);
         dictRehashMilliseconds(server.db[dbid].dict,1);
-        return 1; /* already used our millisecond for this loop... */
-    }
-    /* Expires */
-    if (dictIsRehashing(server.db[dbid].expires)) {
-        dictRehashMilliseconds(server.db[dbid].expires,1);
+        dbMemoryAccountingSwitch(prev);
+        latencyEndMonitor(latency);
+        latencyAddSampleIfNeeded("rehash-cycle",latency);
         return 1; /* already used our millisecond for this loop... */
     }
     return 0;
@@ -1458,7 +1632,8 @@ void updateDictResizePolicy(void) {
 int hasActiveChildProcess() {
     return server.rdb_child_pid != -1 ||
            server.aof_child_pid != -1 ||
-           server.module_child_pid != -1;
+           server.module_child_pid != -1 ||
+           server.cluster_slot_migration_child_pid != -1;
 }
 
 /* ======================= Cron: called every 100 ms ======================== */
@@ -1508,15 +1683,9 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms) {
         freeClient(c);
         return 1;
     } else if (c->flags & CLIENT_BLOCKED) {
-        /* Blocked OPS timeout is handled with milliseconds resolution.
-         * However note that the actual resolution is limited by
-         * server.hz. */
-
-        if (c->bpop.timeout != 0 && c->bpop.timeout < now_ms) {
-            /* Handle blocking operation specific timeout. */
-            replyToBlockedClientTimedOut(c);
-            unblockClient(c);
-        } else if (server.cluster_enabled) {
+        /* Blocked OPS timeouts are handled with milliseconds resolution
+         * by handleBlockedClientsTimeout() in beforeSleep(). */
+        if (server.cluster_enabled) {
             /* Cluster: handle unblock & redirect of clients blocked
              * into keys no longer served by this server. */
             if (clusterRedirectBlockedClientIfNeeded(c))
@@ -1673,6 +1842,8 @@ void clientsCron(void) {
         if (clientsCronHandleTimeout(c,now)) continue;
         if (clientsCronResizeQueryBuffer(c)) continue;
         if (clientsCronTrackExpansiveClients(c)) continue;
+        releaseClientIdleBuffers(c);
+        updateClientMemUsage(c);
     }
 }
 
@@ -1693,6 +1864,15 @@ void databasesCron(void) {
     /* Defrag keys gradually. */
     activeDefragCycle();
 
+    /* Release the interned values no longer referenced. */
+    internedValuesCron();
+
+    /* Start rehashing to the keyspace tables allocated in background. */
+    dbDictResizeCron();
+
+    /* Forget the memory drift of the empty DBs. */
+    dbStatsCron();
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
@@ -1804,6 +1984,8 @@ void checkChildrenDone(void) {
         } else if (pid == server.module_child_pid) {
             ModuleForkDoneHandler(exitcode,bysignal);
             if (!bysignal && exitcode == 0) receiveChildInfo();
+        } else if (pid == server.cluster_slot_migration_child_pid) {
+            clusterSlotMigrationChildDone(exitcode,bysignal);
         } else {
             if (!ldbRemoveChild(pid)) {
                 serverLog(LL_WARNING,
@@ -1837,6 +2019,7 @@ void checkChildrenDone(void) {
 
 int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     int j;
+    long long cron_start = ustime();
     UNUSED(eventLoop);
     UNUSED(id);
     UNUSED(clientData);
@@ -1845,6 +2028,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * handler if we don't return here fast enough. */
     if (server.watchdog_period) watchdogScheduleSignal(server.watchdog_period);
 
+    /* Stop the DEBUG PROFILE sampling profiler once its time elapsed. */
+    profilerCron();
+
     /* Update the time cache. */
     updateCachedTime(1);
 
@@ -1914,6 +2100,20 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             server.cron_malloc_stats.allocator_active = server.cron_malloc_stats.allocator_resident;
         if (!server.cron_malloc_stats.allocator_allocated)
             server.cron_malloc_stats.allocator_allocated = server.cron_malloc_stats.zmalloc_used;
+        /* The statistics were just refreshed by zmalloc_get_allocator_info(). */
+        for (int j = 0; j < ZMALLOC_CLASS_COUNT; j++) {
+            size_t resident;
+            zmalloc_get_class_info(j,&server.cron_malloc_stats.class_allocated[j],
+                                     &server.cron_malloc_stats.class_active[j],
+                                     &resident);
+        }
+        /* Without per class stats all the memory is keyspace memory. */
+        if (!server.cron_malloc_stats.class_active[ZMALLOC_CLASS_KEYSPACE]) {
+            server.cron_malloc_stats.class_allocated[ZMALLOC_CLASS_KEYSPACE] =
+                server.cron_malloc_stats.allocator_allocated;
+            server.cron_malloc_stats.class_active[ZMALLOC_CLASS_KEYSPACE] =
+                server.cron_malloc_stats.allocator_active;
+        }
     }
 
     /* We received a SIGTERM, shutting down here in a safe way, as it is
@@ -1931,7 +2131,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
             size = dictSlots(server.db[j].dict);
             used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
@@ -1971,7 +2171,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     } else {
         /* If there is not a background saving/rewrite in progress check if
          * we have to save/rewrite now. */
-        for (j = 0; j < server.saveparamslen; j++) {
+        for (j = 0; j < server.saveparamslen && !server.rdb_forkless; j++) {
             struct saveparam *sp = server.saveparams+j;
 
             /* Save if we reached the given amount of changes,
@@ -1988,7 +2188,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                     sp->changes, (int)sp->seconds);
                 rdbSaveInfo rsi, *rsiptr;
                 rsiptr = rdbPopulateSaveInfo(&rsi);
-                rdbSaveBackground(server.rdb_filename,rsiptr);
+                rdbSaveBackgroundForPersistence(server.rdb_filename,rsiptr);
                 break;
             }
         }
@@ -2038,13 +2238,33 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Run the Sentinel timer if we are in sentinel mode. */
     if (server.sentinel_mode) sentinelTimer();
 
+    /* Abort the MIGRATE commands not making progress. */
+    if (listLength(server.migrate_jobs)) migrateJobsCron();
+
     /* Cleanup expired MIGRATE cached sockets. */
     run_with_period(1000) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Reclaim the tiered storage file space once it is unused. */
+    run_with_period(1000) {
+        if (server.tiered_storage) tieredCron();
+    }
+
+    /* Read back the values left in the RDB file loaded lazily. */
+    if (server.rdb_lazy_load) tieredLazyLoadCron();
+
+    /* Convert the values to the encoding matching the current limits. */
+    reencodeCron();
+
+    /* Truncate the output buffers spill file once it is unused. */
+    run_with_period(1000) {
+        spillCron();
+    }
+
     /* Stop the I/O threads if we don't have enough pending work. */
     stopThreadedIOIfNeeded();
+    run_with_period(1000) trackIOThreadsUtilization();
 
     /* Start a scheduled BGSAVE if the corresponding flag is set. This is
      * useful when we are forced to postpone a BGSAVE because an AOF
@@ -2053,14 +2273,14 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * Note: this code must be after the replicationCron() call above so
      * make sure when refactoring this file to keep this order. This is useful
      * because we want to give priority to RDB savings for replication. */
-    if (!hasActiveChildProcess() &&
+    if (!hasActiveChildProcess() && !server.rdb_forkless &&
         server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
     {
         rdbSaveInfo rsi, *rsiptr;
         rsiptr = rdbPopulateSaveInfo(&rsi);
-        if (rdbSaveBackground(server.rdb_filename,rsiptr) == C_OK)
+        if (rdbSaveBackgroundForPersistence(server.rdb_filename,rsiptr) == C_OK)
             server.rdb_bgsave_scheduled = 0;
     }
 
@@ -2071,19 +2291,39 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
                           &ei);
 
     server.cronloops++;
+    server.el_events_excluded_usec +=
+        eventLoopPhaseEnd(EL_PHASE_CRON,cron_start) - cron_start;
     return 1000/server.hz;
 }
 
+/* True if beforeSleep() released the GIL, that afterSleep() takes back. */
+static int gil_released = 0;
+
 /* This function gets called every time Redis is entering the
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
 void beforeSleep(struct aeEventLoop *eventLoop) {
+    long long start, t;
     UNUSED(eventLoop);
 
-    /* Handle TLS pending data. (must be done before flushAppendOnlyFile) */
+    /* Account the events processed since afterSleep(), but the time spent
+     * in serverCron() and executing commands, that have their own stats and
+     * latency events. Every phase of this function is accounted as well,
+     * see INFO eventloop. */
+    if (server.el_events_start)
+        start = eventLoopPhaseEnd(EL_PHASE_EVENTS,
+                    server.el_events_start+server.el_events_excluded_usec);
+    else
+        start = ustime();
+
+    /* Handle TLS pending handshakes and data. (must be done before
+     * flushAppendOnlyFile) */
+    tlsProcessPendingHandshakes();
     tlsProcessPendingData();
-    /* If tls still has pending unread data don't sleep at all. */
-    aeSetDontWait(server.el, tlsHasPendingData());
+    /* If tls still has pending unread data don't sleep at all, and the
+     * same for the clients whose read was delayed. */
+    aeSetDontWait(server.el, tlsHasPendingData() ||
+                             listLength(server.clients_throttled));
 
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
@@ -2091,10 +2331,28 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * later in this function. */
     if (server.cluster_enabled) clusterBeforeSleep();
 
+    /* Send the commands Sentinel queued to the monitored instances. */
+    if (server.sentinel_mode) sentinelBeforeSleep();
+
     /* Run a fast expire cycle (the called function will return
      * ASAP if a fast cycle is not needed). */
+    t = ustime();
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
+    t = eventLoopPhaseEnd(EL_PHASE_EXPIRE,t);
+
+    /* Evict keys incrementally if we are over the maxmemory soft limit. */
+    backgroundEvictionCycle();
+    t = eventLoopPhaseEnd(EL_PHASE_EVICT,t);
+
+    /* Append the keyspace events of this iteration to the notifications
+     * stream, and serve the clients blocked reading it. */
+    notifyFlushKeyspaceEventsStream();
+    if (listLength(server.ready_keys)) handleClientsBlockedOnKeys();
+
+    /* Handle precise timeouts of blocked clients. */
+    handleBlockedClientsTimeout();
+    t = eventLoopPhaseEnd(EL_PHASE_BLOCKED,t);
 
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
@@ -2111,24 +2369,63 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
         server.get_ack_from_slaves = 0;
     }
 
+    /* Acknowledge to our master the replication stream we applied in this
+     * event loop iteration. */
+    if (server.masterhost) replicationSendAckIfNeeded();
+
     /* Unblock all the clients blocked for synchronous replication
      * in WAIT. */
     if (listLength(server.clients_waiting_acks))
         processClientsWaitingReplicas();
 
+    /* Unblock the clients in WAITOFFSET whose offset was reached by the
+     * replication stream applied in this event loop iteration. */
+    if (listLength(server.clients_waiting_offset))
+        processClientsWaitingOffset();
+    t = eventLoopPhaseEnd(EL_PHASE_REPLICATION,t);
+
     /* Check if there are clients unblocked by modules that implement
      * blocking commands. */
-    if (moduleCount()) moduleHandleBlockedClients();
+    if (moduleCount()) {
+        moduleHandleBlockedClients();
+        moduleHandleKeySnapshotRequests();
+    }
+    t = eventLoopPhaseEnd(EL_PHASE_MODULES,t);
 
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
+    t = eventLoopPhaseEnd(EL_PHASE_UNBLOCKED,t);
+
+    /* Submit the objects deleted in this iteration to the lazyfree
+     * thread, if they didn't fill a batch already. */
+    lazyfreeFlushBatch();
+
+    /* Send the invalidation messages to clients participating to the
+     * client side caching protocol, batched per client: the keys modified
+     * in this event loop cycle, and the ones matching the prefixes of the
+     * broadcasting (BCAST) mode. */
+    t = ustime();
+    trackingHandlePendingKeyInvalidations();
+    trackingBroadcastInvalidationMessages();
+    t = eventLoopPhaseEnd(EL_PHASE_TRACKING,t);
 
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* Unblock the clients in WAITAOF whose writes reached the disk, and
+     * start a new fsync for the ones still waiting. */
+    if (listLength(server.clients_waiting_aof))
+        processClientsWaitingAofFsync();
+    t = eventLoopPhaseEnd(EL_PHASE_AOF,t);
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();
+    eventLoopPhaseEnd(EL_PHASE_WRITES,t);
+
+    /* Disconnect the clients using the most memory if the clients are over
+     * maxmemory-clients, now that the pending replies were written. */
+    evictClients();
 
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue();
@@ -2136,7 +2433,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
-    if (moduleCount()) moduleReleaseGIL();
+    gil_released = moduleCount() || activeDefragThreadNeedsGIL();
+    if (gil_released) moduleReleaseGIL();
+    eventLoopPhaseEnd(EL_PHASE_BEFORESLEEP,start);
 }
 
 /* This function is called immadiately after the event loop multiplexing
@@ -2144,8 +2443,19 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
  * the different events callbacks. */
 void afterSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
-    if (moduleCount()) moduleAcquireGIL();
+    if (gil_released) {
+        /* Ask the defrag thread, if running, to give the GIL back ASAP. */
+        activeDefragSetGILWanted(1);
+        moduleAcquireGIL();
+        activeDefragSetGILWanted(0);
+        gil_released = 0;
+    }
+    long long t = ustime();
+    server.el_cycle_start = t;
+    handleThrottledClients();
     handleClientsWithPendingReadsUsingThreads();
+    server.el_events_start = eventLoopPhaseEnd(EL_PHASE_READS,t);
+    server.el_events_excluded_usec = 0;
 }
 
 /* =========================== Server initialization ======================== */
@@ -2189,6 +2499,8 @@ void createSharedObjects(void) {
         "-NOAUTH Authentication required.\r\n"));
     shared.oomerr = createObject(OBJ_STRING,sdsnew(
         "-OOM command not allowed when used memory > 'maxmemory'.\r\n"));
+    shared.dboomerr = createObject(OBJ_STRING,sdsnew(
+        "-OOM command not allowed when used memory of the DB > 'db-maxmemory'.\r\n"));
     shared.execaborterr = createObject(OBJ_STRING,sdsnew(
         "-EXECABORT Transaction discarded because of previous errors.\r\n"));
     shared.noreplicaserr = createObject(OBJ_STRING,sdsnew(
@@ -2236,6 +2548,9 @@ void createSharedObjects(void) {
     shared.unsubscribebulk = createStringObject("$11\r\nunsubscribe\r\n",18);
     shared.psubscribebulk = createStringObject("$10\r\npsubscribe\r\n",17);
     shared.punsubscribebulk = createStringObject("$12\r\npunsubscribe\r\n",19);
+    shared.smessagebulk = createStringObject("$8\r\nsmessage\r\n",14);
+    shared.ssubscribebulk = createStringObject("$10\r\nssubscribe\r\n",17);
+    shared.sunsubscribebulk = createStringObject("$12\r\nsunsubscribe\r\n",19);
     shared.del = createStringObject("DEL",3);
     shared.unlink = createStringObject("UNLINK",6);
     shared.rpop = createStringObject("RPOP",4);
@@ -2244,16 +2559,25 @@ void createSharedObjects(void) {
     shared.rpoplpush = createStringObject("RPOPLPUSH",9);
     shared.zpopmin = createStringObject("ZPOPMIN",7);
     shared.zpopmax = createStringObject("ZPOPMAX",7);
-    for (j = 0; j < OBJ_SHARED_INTEGERS; j++) {
-        shared.integers[j] =
-            makeObjectShared(createObject(OBJ_STRING,(void*)(long)j));
-        shared.integers[j]->encoding = OBJ_ENCODING_INT;
-    }
+    /* The shared integers are created on demand by getSharedInteger(). */
+    shared.integers = zcalloc(sizeof(robj**)*
+        ((server.shared_integers+OBJ_SHARED_INTEGERS_CHUNK-1)/
+         OBJ_SHARED_INTEGERS_CHUNK));
     for (j = 0; j < OBJ_SHARED_BULKHDR_LEN; j++) {
         shared.mbulkhdr[j] = createObject(OBJ_STRING,
             sdscatprintf(sdsempty(),"*%d\r\n",j));
         shared.bulkhdr[j] = createObject(OBJ_STRING,
             sdscatprintf(sdsempty(),"$%d\r\n",j));
+        shared.maphdr[j] = createObject(OBJ_STRING,
+            sdscatprintf(sdsempty(),"%%%d\r\n",j));
+        shared.sethdr[j] = createObject(OBJ_STRING,
+            sdscatprintf(sdsempty(),"~%d\r\n",j));
+    }
+    for (j = 0; j < OBJ_SHARED_DOUBLES; j++) {
+        shared.bulkdouble[j] = createObject(OBJ_STRING,
+            sdscatprintf(sdsempty(),"$%d\r\n%d\r\n",sdigits10(j),j));
+        shared.resp3double[j] = createObject(OBJ_STRING,
+            sdscatprintf(sdsempty(),",%d\r\n",j));
     }
     /* The following two shared objects, minstring and maxstrings, are not
      * actually used for their value but as a special object meaning
@@ -2279,6 +2603,9 @@ void initServerConfig(void) {
     server.arch_bits = (sizeof(long) == 8) ? 64 : 32;
     server.port = CONFIG_DEFAULT_SERVER_PORT;
     server.tls_port = CONFIG_DEFAULT_SERVER_TLS_PORT;
+    server.tls_ctx_config.session_caching = CONFIG_DEFAULT_TLS_SESSION_CACHING;
+    server.tls_ctx_config.session_cache_size = CONFIG_DEFAULT_TLS_SESSION_CACHE_SIZE;
+    server.tls_ctx_config.session_cache_timeout = CONFIG_DEFAULT_TLS_SESSION_CACHE_TIMEOUT;
     server.tcp_backlog = CONFIG_DEFAULT_TCP_BACKLOG;
     server.bindaddr_count = 0;
     server.unixsocket = NULL;
@@ -2286,6 +2613,13 @@ void initServerConfig(void) {
     server.ipfd_count = 0;
     server.tlsfd_count = 0;
     server.sofd = -1;
+    server.shm_socket = NULL;
+    server.server_cpulist = NULL;
+    server.bio_cpulist = NULL;
+    server.aof_rewrite_cpulist = NULL;
+    server.bgsave_cpulist = NULL;
+    server.shm_ring_size = CONFIG_DEFAULT_SHM_RING_SIZE;
+    server.shmfd = -1;
     server.protected_mode = CONFIG_DEFAULT_PROTECTED_MODE;
     server.gopher_enabled = CONFIG_DEFAULT_GOPHER_ENABLED;
     server.dbnum = CONFIG_DEFAULT_DBNUM;
@@ -2296,6 +2630,7 @@ void initServerConfig(void) {
     server.active_expire_effort = CONFIG_DEFAULT_ACTIVE_EXPIRE_EFFORT;
     server.jemalloc_bg_thread = 1;
     server.active_defrag_enabled = CONFIG_DEFAULT_ACTIVE_DEFRAG;
+    server.active_defrag_thread = CONFIG_DEFAULT_ACTIVE_DEFRAG_THREAD;
     server.active_defrag_ignore_bytes = CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES;
     server.active_defrag_threshold_lower = CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER;
     server.active_defrag_threshold_upper = CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER;
@@ -2303,9 +2638,13 @@ void initServerConfig(void) {
     server.active_defrag_cycle_max = CONFIG_DEFAULT_DEFRAG_CYCLE_MAX;
     server.active_defrag_max_scan_fields = CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS;
     server.proto_max_bulk_len = CONFIG_DEFAULT_PROTO_MAX_BULK_LEN;
+    server.value_interning_max_size = CONFIG_DEFAULT_VALUE_INTERNING_MAX_SIZE;
+    server.shared_integers = CONFIG_DEFAULT_SHARED_INTEGERS;
+    server.keyspace_async_resize_threshold = CONFIG_DEFAULT_KEYSPACE_ASYNC_RESIZE_THRESHOLD;
     server.client_max_querybuf_len = PROTO_MAX_QUERYBUF_LEN;
     server.saveparams = NULL;
     server.loading = 0;
+    server.async_loading = 0;
     server.logfile = zstrdup(CONFIG_DEFAULT_LOGFILE);
     server.syslog_enabled = CONFIG_DEFAULT_SYSLOG_ENABLED;
     server.syslog_ident = zstrdup(CONFIG_DEFAULT_SYSLOG_IDENT);
@@ -2327,56 +2666,102 @@ void initServerConfig(void) {
     server.aof_lastbgrewrite_status = C_OK;
     server.aof_delayed_fsync = 0;
     server.aof_fd = -1;
+    server.aof_written_offset = 0;
+    server.aof_fsync_pending_offset = 0;
+    server.aof_fsynced_offset = 0;
     server.aof_selected_db = -1; /* Make sure the first time will not match */
     server.aof_flush_postponed_start = 0;
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.rdb_save_incremental_fsync = CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC;
     server.rdb_key_save_delay = CONFIG_DEFAULT_RDB_KEY_SAVE_DELAY;
     server.key_load_delay = CONFIG_DEFAULT_KEY_LOAD_DELAY;
+    server.rdb_load_threads = CONFIG_DEFAULT_RDB_LOAD_THREADS;
+    server.rdb_save_threads = CONFIG_DEFAULT_RDB_SAVE_THREADS;
+    server.rdb_forkless_save = CONFIG_DEFAULT_RDB_FORKLESS_SAVE;
+    server.rdb_delta_snapshots = CONFIG_DEFAULT_RDB_DELTA_SNAPSHOTS;
+    server.rdb_delta_keys = NULL;
+    server.rdb_delta_saving_keys = NULL;
+    server.rdb_delta_base_valid = 0;
+    server.rdb_delta_child = 0;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
     server.aof_use_rdb_preamble = CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE;
+    server.aof_multi_part = CONFIG_DEFAULT_AOF_MULTI_PART;
+    server.aof_background_write = CONFIG_DEFAULT_AOF_BACKGROUND_WRITE;
+    server.aof_base_name = NULL;
+    server.aof_seq = 0;
+    server.aof_incr_first = 0;
+    server.aof_rewrite_seq = 0;
     server.pidfile = NULL;
     server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
+    server.tiered_storage_file = zstrdup(CONFIG_DEFAULT_TIERED_STORAGE_FILE);
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
     server.acl_filename = zstrdup(CONFIG_DEFAULT_ACL_FILENAME);
     server.rdb_compression = CONFIG_DEFAULT_RDB_COMPRESSION;
+    server.rdb_compression_algorithm = CONFIG_DEFAULT_RDB_COMPRESSION_ALGORITHM;
     server.rdb_checksum = CONFIG_DEFAULT_RDB_CHECKSUM;
+    server.rdb_save_scripts = CONFIG_DEFAULT_RDB_SAVE_SCRIPTS;
     server.stop_writes_on_bgsave_err = CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR;
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
+    server.notify_keyspace_events_stream = NULL;
+    server.notify_keyspace_events_stream_maxlen =
+        CONFIG_DEFAULT_NOTIFY_KEYSPACE_EVENTS_STREAM_MAXLEN;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     server.blocked_clients = 0;
     memset(server.blocked_clients_by_type,0,
            sizeof(server.blocked_clients_by_type));
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
+    server.maxmemory_clients = CONFIG_DEFAULT_MAXMEMORY_CLIENTS;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
+    server.maxmemory_soft_limit = CONFIG_DEFAULT_MAXMEMORY_SOFT_LIMIT;
+    server.maxmemory_shadow_sampling = CONFIG_DEFAULT_MAXMEMORY_SHADOW_SAMPLING;
+    server.db_maxmemory = NULL;
+    server.db_maxmemory_len = 0;
     server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
     server.lfu_decay_time = CONFIG_DEFAULT_LFU_DECAY_TIME;
-    server.hash_max_ziplist_entries = OBJ_HASH_MAX_ZIPLIST_ENTRIES;
-    server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
+    server.hash_max_listpack_entries = OBJ_HASH_MAX_LISTPACK_ENTRIES;
+    server.hash_max_listpack_value = OBJ_HASH_MAX_LISTPACK_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_compress_codec = CONFIG_DEFAULT_LIST_COMPRESS_CODEC;
+    server.list_index_min_nodes = OBJ_LIST_INDEX_MIN_NODES;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
-    server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
-    server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
+    server.set_max_listpack_entries = OBJ_SET_MAX_LISTPACK_ENTRIES;
+    server.set_max_listpack_value = OBJ_SET_MAX_LISTPACK_VALUE;
+    server.zset_max_listpack_entries = OBJ_ZSET_MAX_LISTPACK_ENTRIES;
+    server.zset_max_listpack_value = OBJ_ZSET_MAX_LISTPACK_VALUE;
+    server.setops_incremental_threshold = CONFIG_DEFAULT_SETOPS_INCREMENTAL_THRESHOLD;
+    server.replies_incremental_threshold = CONFIG_DEFAULT_REPLIES_INCREMENTAL_THRESHOLD;
+    server.eventloop_latency_target = CONFIG_DEFAULT_EVENTLOOP_LATENCY_TARGET;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
+    server.bitmap_roaring_min_bytes = CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES;
+    server.string_compression_threshold = CONFIG_DEFAULT_STRING_COMPRESSION_THRESHOLD;
+    server.string_compression_dict = zstrdup(CONFIG_DEFAULT_STRING_COMPRESSION_DICT);
     server.stream_node_max_bytes = OBJ_STREAM_NODE_MAX_BYTES;
     server.stream_node_max_entries = OBJ_STREAM_NODE_MAX_ENTRIES;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
     server.cluster_node_timeout = CLUSTER_DEFAULT_NODE_TIMEOUT;
+    server.cluster_fast_failover_timeout = CLUSTER_DEFAULT_FAST_FAILOVER_TIMEOUT;
+    server.cluster_hotkeys_sampling = CLUSTER_DEFAULT_HOTKEYS_SAMPLING;
     server.cluster_migration_barrier = CLUSTER_DEFAULT_MIGRATION_BARRIER;
     server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
     server.cluster_require_full_coverage = CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
     server.cluster_slave_no_failover = CLUSTER_DEFAULT_SLAVE_NO_FAILOVER;
+    server.cluster_cross_slot_reads = CLUSTER_DEFAULT_CROSS_SLOT_READS;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
     server.cluster_announce_bus_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT;
     server.cluster_module_flags = CLUSTER_MODULE_FLAG_NONE;
     server.migrate_cached_sockets = dictCreate(&migrateCacheDictType,NULL);
+    server.migrate_jobs = listCreate();
+    server.setop_jobs = listCreate();
+    server.reply_jobs = listCreate();
+    server.setop_timer_id = -1;
+    server.reply_timer_id = -1;
     server.next_client_id = 1; /* Client IDs, start from 1 .*/
     server.loading_process_events_interval_bytes = (1024*1024*2);
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
@@ -2385,7 +2770,13 @@ void initServerConfig(void) {
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
     server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
+    server.shards = CONFIG_DEFAULT_SHARDS;
+    server.shard_id = 0;
+    server.lazyfree_threads = CONFIG_DEFAULT_LAZYFREE_THREADS;
+    server.accept_threads_num = CONFIG_DEFAULT_ACCEPT_THREADS;
     server.io_threads_do_reads = CONFIG_DEFAULT_IO_THREADS_DO_READS;
+    server.io_threads_do_commands = CONFIG_DEFAULT_IO_THREADS_DO_COMMANDS;
+    server.io_threads_executing = 0;
 
     server.lruclock = getLRUClock();
     resetServerSaveParams();
@@ -2413,8 +2804,13 @@ void initServerConfig(void) {
     server.repl_down_since = 0; /* Never connected, repl is down since EVER. */
     server.repl_disable_tcp_nodelay = CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY;
     server.repl_diskless_sync = CONFIG_DEFAULT_REPL_DISKLESS_SYNC;
+    server.repl_compression = CONFIG_DEFAULT_REPL_COMPRESSION;
+    server.repl_parallel_parse = CONFIG_DEFAULT_REPL_PARALLEL_PARSE;
+    server.repl_compression_link = 0;
     server.repl_diskless_load = CONFIG_DEFAULT_REPL_DISKLESS_LOAD;
     server.repl_diskless_sync_delay = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY;
+    server.repl_diskless_sync_buffer = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_BUFFER;
+    server.repl_diskless_sync_max_rate = CONFIG_DEFAULT_REPL_DISKLESS_SYNC_MAX_RATE;
     server.repl_ping_slave_period = CONFIG_DEFAULT_REPL_PING_SLAVE_PERIOD;
     server.repl_timeout = CONFIG_DEFAULT_REPL_TIMEOUT;
     server.repl_min_slaves_to_write = CONFIG_DEFAULT_MIN_SLAVES_TO_WRITE;
@@ -2426,16 +2822,22 @@ void initServerConfig(void) {
 
     /* Replication partial resync backlog */
     server.repl_backlog = NULL;
+    server.repl_batch = NULL;
     server.repl_backlog_size = CONFIG_DEFAULT_REPL_BACKLOG_SIZE;
-    server.repl_backlog_histlen = 0;
-    server.repl_backlog_idx = 0;
-    server.repl_backlog_off = 0;
+    server.repl_backlog_filename = NULL;
+    server.repl_backlog_file_size = CONFIG_DEFAULT_REPL_BACKLOG_FILE_SIZE;
+    server.repl_backlog_file_fd = -1;
+    server.repl_backlog_map = NULL;
+    server.repl_buffer_mem = 0;
+    server.repl_buffer_spill_last = NULL;
     server.repl_backlog_time_limit = CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT;
     server.repl_no_slaves_since = time(NULL);
 
     /* Client output buffer limits */
     for (j = 0; j < CLIENT_TYPE_OBUF_COUNT; j++)
         server.client_obuf_limits[j] = clientBufferLimitsDefaults[j];
+    server.client_obuf_spill_threshold = CONFIG_DEFAULT_CLIENT_OBUF_SPILL_THRESHOLD;
+    server.client_obuf_spill_max_size = CONFIG_DEFAULT_CLIENT_OBUF_SPILL_MAX_SIZE;
 
     /* Double constants initialization */
     R_Zero = 0.0;
@@ -2450,6 +2852,7 @@ void initServerConfig(void) {
     server.orig_commands = dictCreate(&commandTableDictType,NULL);
     populateCommandTable();
     server.delCommand = lookupCommandByCString("del");
+    server.hdelCommand = lookupCommandByCString("hdel");
     server.multiCommand = lookupCommandByCString("multi");
     server.lpushCommand = lookupCommandByCString("lpush");
     server.lpopCommand = lookupCommandByCString("lpop");
@@ -2461,17 +2864,28 @@ void initServerConfig(void) {
     server.expireCommand = lookupCommandByCString("expire");
     server.pexpireCommand = lookupCommandByCString("pexpire");
     server.xclaimCommand = lookupCommandByCString("xclaim");
+    server.xaddCommand = lookupCommandByCString("xadd");
     server.xgroupCommand = lookupCommandByCString("xgroup");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
     server.slowlog_max_len = CONFIG_DEFAULT_SLOWLOG_MAX_LEN;
+    server.slowlog_shapes_max_len = CONFIG_DEFAULT_SLOWLOG_SHAPES_MAX_LEN;
+    server.slowlog_sample_ratio = CONFIG_DEFAULT_SLOWLOG_SAMPLE_RATIO;
+    server.keyspace_stats_sample_ratio =
+        CONFIG_DEFAULT_KEYSPACE_STATS_SAMPLE_RATIO;
+    server.keyspace_stats_prefixes = NULL;
+    server.keyspace_stats = raxNew();
+    server.keyspace_stats_counter = 0;
 
     /* Latency monitor */
-    server.latency_monitor_threshold = CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD;
+    server.latency_monitor_threshold_us =
+        CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD*1000;
+    server.latency_history_len = LATENCY_TS_LEN;
+    server.latency_tracking_breakdown = CONFIG_DEFAULT_LATENCY_TRACKING_BREAKDOWN;
 
     /* Tracking. */
-    server.tracking_table_max_fill = CONFIG_DEFAULT_TRACKING_TABLE_MAX_FILL;
+    server.tracking_table_max_keys = CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS;
 
     /* Debugging */
     server.assert_failed = "<no assertion failed>";
@@ -2485,6 +2899,7 @@ void initServerConfig(void) {
      * script to the slave / AOF. This is the new way starting from
      * Redis 5. However it is possible to revert it via redis.conf. */
     server.lua_always_replicate_commands = 1;
+    server.lua_profiler = CONFIG_DEFAULT_LUA_PROFILER;
 }
 
 extern char **environ;
@@ -2664,6 +3079,8 @@ void checkTcpBacklogSettings(void) {
  * contains no specific addresses to bind, this function will try to
  * bind * (all addresses) for both the IPv4 and IPv6 protocols.
  *
+ * 'flags' are passed to anetTcpServerWithFlags(), for instance ANET_REUSEPORT.
+ *
  * On success the function returns C_OK.
  *
  * On error the function returns C_ERR. For the function to be on
@@ -2671,7 +3088,7 @@ void checkTcpBacklogSettings(void) {
  * impossible to bind, or no bind addresses were specified in the server
  * configuration but the function is not able to bind * for at least
  * one of the IPv4 or IPv6 protocols. */
-int listenToPort(int port, int *fds, int *count) {
+int listenToPort(int port, int *fds, int *count, int flags) {
     int j;
 
     /* Force binding of 0.0.0.0 if no bind address is specified, always
@@ -2682,8 +3099,8 @@ int listenToPort(int port, int *fds, int *count) {
             int unsupported = 0;
             /* Bind * for both IPv6 and IPv4, we enter here only if
              * server.bindaddr_count == 0. */
-            fds[*count] = anetTcp6Server(server.neterr,port,NULL,
-                server.tcp_backlog);
+            fds[*count] = anetTcp6ServerWithFlags(server.neterr,port,NULL,
+                server.tcp_backlog,flags);
             if (fds[*count] != ANET_ERR) {
                 anetNonBlock(NULL,fds[*count]);
                 (*count)++;
@@ -2694,8 +3111,8 @@ int listenToPort(int port, int *fds, int *count) {
 
             if (*count == 1 || unsupported) {
                 /* Bind the IPv4 address as well. */
-                fds[*count] = anetTcpServer(server.neterr,port,NULL,
-                    server.tcp_backlog);
+                fds[*count] = anetTcpServerWithFlags(server.neterr,port,NULL,
+                    server.tcp_backlog,flags);
                 if (fds[*count] != ANET_ERR) {
                     anetNonBlock(NULL,fds[*count]);
                     (*count)++;
@@ -2710,12 +3127,12 @@ int listenToPort(int port, int *fds, int *count) {
             if (*count + unsupported == 2) break;
         } else if (strchr(server.bindaddr[j],':')) {
             /* Bind IPv6 address. */
-            fds[*count] = anetTcp6Server(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = anetTcp6ServerWithFlags(server.neterr,port,server.bindaddr[j],
+                server.tcp_backlog,flags);
         } else {
             /* Bind IPv4 address. */
-            fds[*count] = anetTcpServer(server.neterr,port,server.bindaddr[j],
-                server.tcp_backlog);
+            fds[*count] = anetTcpServerWithFlags(server.neterr,port,server.bindaddr[j],
+                server.tcp_backlog,flags);
         }
         if (fds[*count] == ANET_ERR) {
             serverLog(LL_WARNING,
@@ -2734,6 +3151,14 @@ int listenToPort(int port, int *fds, int *count) {
     return C_OK;
 }
 
+/* Create the keys dictionary of a database, using the hash table
+ * engine selected by the keyspace-open-addressing option. */
+dict *createDbDict(dictType *type) {
+    if (server.keyspace_open_addressing)
+        return dictCreateOpenAddressing(type,NULL);
+    return dictCreate(type,NULL);
+}
+
 /* Resets the stats that we expose via INFO or other means that we want
  * to reset via CONFIG RESETSTAT. The function is also used in order to
  * initialize these fields in initServer() at server startup. */
@@ -2743,16 +3168,39 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
+    server.stat_expired_hash_fields = 0;
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
+    server.stat_evictedclients = 0;
+    server.stat_background_evictedkeys = 0;
+    server.stat_tiered_swap_outs = 0;
+    server.stat_tiered_swap_ins = 0;
+    server.stat_tiered_async_reads = 0;
+    server.stat_keyspace_async_resizes = 0;
+    evictionStatsReset();
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
+    server.stat_io_threaded_commands = 0;
+    server.stat_string_compressions = 0;
+    server.stat_string_decompressions = 0;
+    server.stat_throttled_reads = 0;
+    server.stat_repl_parallel_parsed = 0;
+    server.stat_auth_usec = 0;
+    server.stat_auth_cache_hits = 0;
+    server.stat_auth_cache_misses = 0;
+    memset(server.stat_pipeline_batches,0,sizeof(server.stat_pipeline_batches));
+    memset(server.latency_queue_histogram,0,
+           sizeof(server.latency_queue_histogram));
+    memset(server.latency_write_histogram,0,
+           sizeof(server.latency_write_histogram));
+    eventLoopPhaseStatsReset();
     server.stat_active_defrag_hits = 0;
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
+    server.stat_tracking_evicted_keys = 0;
     server.stat_active_defrag_scanned = 0;
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
@@ -2760,6 +3208,9 @@ void resetServerStats(void) {
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
+    server.stat_sync_diskless_spooled = 0;
+    server.stat_repl_compress_in = 0;
+    server.stat_repl_compress_out = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -2770,6 +3221,8 @@ void resetServerStats(void) {
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
     server.aof_delayed_fsync = 0;
+    resetKeyspaceStats();
+    resetDbStats();
 }
 
 void initServer(void) {
@@ -2784,24 +3237,46 @@ void initServer(void) {
             server.syslog_facility);
     }
 
+    /* As early as possible: only the memory allocated from now on is
+     * backed by huge pages. */
+    if (server.keyspace_hugepages &&
+        zmalloc_enable_keyspace_hugepages() == -1)
+    {
+        serverLog(LL_WARNING,"Huge pages for the keyspace are not supported "
+                             "by the allocator, keyspace-hugepages ignored.");
+        server.keyspace_hugepages = 0;
+    }
+
     server.hz = server.config_hz;
     server.pid = getpid();
+    server.main_thread_id = pthread_self();
     server.current_client = NULL;
     server.fixed_time_expire = 0;
     server.clients = listCreate();
     server.clients_index = raxNew();
     server.clients_to_close = listCreate();
+    for (j = 0; j < CLIENT_MEM_USAGE_BUCKETS; j++)
+        server.client_mem_usage_buckets[j] = listCreate();
     server.slaves = listCreate();
+    server.repl_buffer_blocks = listCreate();
+    listSetFreeMethod(server.repl_buffer_blocks,freeReplBufBlock);
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
     server.clients_pending_read = listCreate();
+    server.clients_throttled = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
+    server.clients_timeout_table = raxNew();
+    server.clients_timeout_timer_id = AE_ERR;
+    server.clients_timeout_timer_when = 0;
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_aof = listCreate();
+    server.clients_waiting_offset = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
     server.system_memory_size = zmalloc_get_memory_size();
+    server.interned_values = dictCreate(&internedValuesDictType,NULL);
 
     if (server.tls_port && tlsConfigure(&server.tls_ctx_config) == C_ERR) {
         serverLog(LL_WARNING, "Failed to configure TLS. Check logs for more info.");
@@ -2821,10 +3296,12 @@ void initServer(void) {
 
     /* Open the TCP listening socket for the user commands. */
     if (server.port != 0 &&
-        listenToPort(server.port,server.ipfd,&server.ipfd_count) == C_ERR)
+        listenToPort(server.port,server.ipfd,&server.ipfd_count,
+            server.accept_threads_num ? ANET_REUSEPORT : ANET_NONE) == C_ERR)
         exit(1);
     if (server.tls_port != 0 &&
-        listenToPort(server.tls_port,server.tlsfd,&server.tlsfd_count) == C_ERR)
+        listenToPort(server.tls_port,server.tlsfd,&server.tlsfd_count,
+            ANET_NONE) == C_ERR)
         exit(1);
 
     /* Open the listening Unix domain socket. */
@@ -2839,40 +3316,77 @@ void initServer(void) {
         anetNonBlock(NULL,server.sofd);
     }
 
+    /* Open the listening socket of the shared memory transport. */
+    if (server.shm_socket != NULL) {
+        unlink(server.shm_socket); /* don't care if this fails */
+        server.shmfd = anetUnixServer(server.neterr,server.shm_socket,
+            server.unixsocketperm, server.tcp_backlog);
+        if (server.shmfd == ANET_ERR) {
+            serverLog(LL_WARNING, "Opening shm socket: %s", server.neterr);
+            exit(1);
+        }
+        anetNonBlock(NULL,server.shmfd);
+    }
+
     /* Abort if there are no listening sockets at all. */
-    if (server.ipfd_count == 0 && server.tlsfd_count == 0 && server.sofd < 0) {
+    if (server.ipfd_count == 0 && server.tlsfd_count == 0 && server.sofd < 0 &&
+        server.shmfd < 0)
+    {
         serverLog(LL_WARNING, "Configured to not listen anywhere, exiting.");
         exit(1);
     }
 
     /* Create the Redis databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
-        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[j].dict = createDbDict(&dbDictType);
+        server.db[j].expires = expireIndexCreate();
         server.db[j].expires_cursor = 0;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].blocking_streams = dictCreate(&streamBlockedDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
-        server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].watched_keys = dictCreate(&watchedKeysDictType,NULL);
+        server.db[j].locked_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
+        server.db[j].used_memory = 0;
+        server.db[j].stat_ops = 0;
+        server.db[j].stat_cpu_usec = 0;
+        server.db[j].stat_evictedkeys = 0;
+        server.db[j].keys_reply_jobs = 0;
         server.db[j].defrag_later = listCreate();
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
+        server.db[j].slots_to_keys = NULL;
+        keysIndexInit(&server.db[j]);
+        if (server.cluster_enabled) slotToKeyInit(&server.db[j]);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
-    server.pubsub_patterns = listCreate();
-    listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
-    listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
+    server.pubsubshard_channels = dictCreate(&keylistDictType,NULL);
+    server.pubsub_patterns = dictCreate(&keylistDictType,NULL);
+    server.pubsub_patterns_prefixes = raxNew();
+    server.pubsub_patterns_maxprefix = 0;
+    server.pubsub_patterns_subscriptions = 0;
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
     server.module_child_pid = -1;
+    server.cluster_slot_migration_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
+    server.rdb_forkless = NULL;
+    server.rdb_forkless_epoch = 0;
+    server.rdb_forkless_aborted = 0;
+    server.stat_rdb_forkless_copied = 0;
+    server.bgload_filename = NULL;
+    server.lastbgload_status = C_OK;
+    server.stat_aof_writer_ring_full = 0;
     server.rdb_pipe_conns = NULL;
     server.rdb_pipe_numconns = 0;
     server.rdb_pipe_numconns_writing = 0;
     server.rdb_pipe_buff = NULL;
     server.rdb_pipe_bufflen = 0;
+    server.rdb_pipe_ring = NULL;
+    server.rdb_pipe_spool_fd = -1;
+    server.rdb_pipe_timer_id = -1;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
     server.child_info_pipe[1] = -1;
@@ -2896,10 +3410,16 @@ void initServer(void) {
     server.cron_malloc_stats.allocator_allocated = 0;
     server.cron_malloc_stats.allocator_active = 0;
     server.cron_malloc_stats.allocator_resident = 0;
+    memset(server.cron_malloc_stats.class_allocated,0,
+           sizeof(server.cron_malloc_stats.class_allocated));
+    memset(server.cron_malloc_stats.class_active,0,
+           sizeof(server.cron_malloc_stats.class_active));
     server.lastbgsave_status = C_OK;
     server.aof_last_write_status = C_OK;
     server.aof_last_write_errno = 0;
     server.repl_good_slaves_count = 0;
+    bitopsSelectKernels();
+    hllSelectKernels();
 
     /* Create the timer callback, this is our way to process many background
      * operations incrementally, like clients timeout, eviction of unaccessed
@@ -2910,8 +3430,9 @@ void initServer(void) {
     }
 
     /* Create an event handler for accepting new connections in TCP and Unix
-     * domain sockets. */
-    for (j = 0; j < server.ipfd_count; j++) {
+     * domain sockets. With accept threads, the TCP connections are accepted
+     * by them instead, see initAcceptThreads(). */
+    for (j = 0; j < server.ipfd_count && !server.accept_threads_num; j++) {
         if (aeCreateFileEvent(server.el, server.ipfd[j], AE_READABLE,
             acceptTcpHandler,NULL) == AE_ERR)
             {
@@ -2929,6 +3450,8 @@ void initServer(void) {
     }
     if (server.sofd > 0 && aeCreateFileEvent(server.el,server.sofd,AE_READABLE,
         acceptUnixHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.sofd file event.");
+    if (server.shmfd > 0 && aeCreateFileEvent(server.el,server.shmfd,AE_READABLE,
+        acceptShmHandler,NULL) == AE_ERR) serverPanic("Unrecoverable error creating server.shmfd file event.");
 
 
     /* Register a readable event for the pipe used to awake the event loop
@@ -2941,7 +3464,9 @@ void initServer(void) {
     }
 
     /* Open the AOF file if needed. */
-    if (server.aof_state == AOF_ON) {
+    if (server.aof_multi_part) {
+        aofInitMultiPart();
+    } else if (server.aof_state == AOF_ON) {
         server.aof_fd = open(server.aof_filename,
                                O_WRONLY|O_APPEND|O_CREAT,0644);
         if (server.aof_fd == -1) {
@@ -2951,6 +3476,12 @@ void initServer(void) {
         }
     }
 
+    /* Open the tiered storage file if needed. */
+    if (server.tiered_storage || server.rdb_lazy_load) tieredInit();
+
+    /* Load the dictionary of the compressed strings before the data. */
+    stringCompressionInit();
+
     /* 32 bit instances are limited to 4GB of address space, so if there is
      * no explicit limit in the user provided configuration we set a limit
      * at 3 GB using maxmemory with 'noeviction' policy'. This avoids
@@ -2975,7 +3506,9 @@ void initServer(void) {
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {
     bioInit();
+    aofWriterInit();
     initThreadedIO();
+    initAcceptThreads();
     set_jemalloc_bg_thread(server.jemalloc_bg_thread);
     server.initial_memory_usage = zmalloc_used_memory();
 }
@@ -3075,6 +3608,8 @@ void resetCommandTableStats(void) {
         c = (struct redisCommand *) dictGetVal(de);
         c->microseconds = 0;
         c->calls = 0;
+        zfree(c->latency_histogram);
+        c->latency_histogram = NULL;
     }
     dictReleaseIterator(di);
 
@@ -3160,10 +3695,15 @@ struct redisCommand *lookupCommandOrOriginal(sds name) {
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
                int flags)
 {
+    /* The AOF and replication buffers are not part of the memory of the
+     * DB the command works on. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
+
     if (server.aof_state != AOF_OFF && flags & PROPAGATE_AOF)
         feedAppendOnlyFile(cmd,dbid,argv,argc);
     if (flags & PROPAGATE_REPL)
         replicationFeedSlaves(server.slaves,dbid,argv,argc);
+    dbMemoryAccountingSwitch(prev);
 }
 
 /* Used inside commands to schedule the propagation of additional commands
@@ -3186,12 +3726,14 @@ void alsoPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc,
 
     if (server.loading) return; /* No propagation during loading. */
 
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
     argvcopy = zmalloc(sizeof(robj*)*argc);
     for (j = 0; j < argc; j++) {
         argvcopy[j] = argv[j];
         incrRefCount(argv[j]);
     }
     redisOpArrayAppend(&server.also_propagate,cmd,dbid,argvcopy,argc,target);
+    dbMemoryAccountingSwitch(prev);
 }
 
 /* It is possible to call the function forceCommandPropagation() inside a
@@ -3258,9 +3800,14 @@ void preventCommandReplication(client *c) {
  */
 void call(client *c, int flags) {
     long long dirty;
-    ustime_t start, duration;
+    ustime_t start, duration, queue = -1;
+    long long slowlog_id = -1;
     int client_old_flags = c->flags;
     struct redisCommand *real_cmd = c->cmd;
+    struct redisCommand *prev_executing_cmd = server.executing_cmd;
+    redisDb *db = c->db, *prev_accounting_db;
+    int account_argv = prev_executing_cmd == NULL &&
+                       !(c->cmd->flags & CMD_PUBSUB);
 
     server.fixed_time_expire++;
 
@@ -3279,12 +3826,35 @@ void call(client *c, int flags) {
     redisOpArray prev_also_propagate = server.also_propagate;
     redisOpArrayInit(&server.also_propagate);
 
+    /* Complete the streamed replies of the values the command writes. */
+    replyFlushJobsOfKeys(c->db,c->cmd,c->argv,c->argc);
+
+    /* Allocate the latency histogram of the command the first time it is
+     * called before running it, so that commands reporting the memory usage,
+     * like INFO, already account for it. */
+    if (flags & CMD_CALL_STATS && real_cmd->latency_histogram == NULL)
+        real_cmd->latency_histogram = latencyHistogramCreate();
+
     /* Call the command. */
     dirty = server.dirty;
     updateCachedTime(0);
     start = server.ustime;
+    server.executing_cmd = c->cmd;
+    TRACE3(command_start,c->cmd->name,c->argc,c->id);
+    /* The memory the command allocates is charged to the selected DB, but
+     * for the Pub/Sub commands, that only fill the output buffers of other
+     * clients. The arguments are charged as well, and the ones not stored
+     * in the keyspace are discounted again when the command is done, see
+     * the end of this function. */
+    if (account_argv) dbMemoryAccount(db,dbArgvMemory(c->argv,c->argc,0));
+    prev_accounting_db = dbMemoryAccountingSwitch(
+        (c->cmd->flags & CMD_PUBSUB) ? NULL : db);
     c->cmd->proc(c);
+    dbMemoryAccountingSwitch(prev_accounting_db);
+    server.executing_cmd = prev_executing_cmd;
     duration = ustime()-start;
+    TRACE3(command_end,c->cmd->name,duration,server.dirty-dirty);
+    if (prev_executing_cmd == NULL) server.el_events_excluded_usec += duration;
     dirty = server.dirty-dirty;
     if (dirty < 0) dirty = 0;
 
@@ -3303,13 +3873,31 @@ void call(client *c, int flags) {
             server.lua_caller->flags |= CLIENT_FORCE_AOF;
     }
 
+    /* With latency-tracking-breakdown the time the request waited to be
+     * dispatched counts as well, but only for the commands called by the
+     * clients, not the ones called by MULTI/EXEC or scripts. */
+    if (server.latency_tracking_breakdown && prev_executing_cmd == NULL)
+        queue = c->queue_usec;
+
     /* Log the command into the Slow log if needed, and populate the
      * per-command statistics that we show in INFO commandstats. */
     if (flags & CMD_CALL_SLOWLOG && !(c->cmd->flags & CMD_SKIP_SLOWLOG)) {
         char *latency_event = (c->cmd->flags & CMD_FAST) ?
                               "fast-command" : "command";
-        latencyAddSampleIfNeeded(latency_event,duration/1000);
-        slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration);
+        latencyAddSampleIfNeeded(latency_event,duration);
+        slowlog_id = slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration,
+                                              queue);
+    }
+    if (queue != -1) trackReplyStart(c,start+duration,slowlog_id);
+
+    /* Account the command to the client that sent it, see CLIENT LIST.
+     * The commands called by MULTI/EXEC and scripts are already accounted
+     * as part of the EXEC or EVAL that called them. */
+    if (prev_executing_cmd == NULL) {
+        c->stat_commands++;
+        c->stat_cmd_usec += duration;
+        db->stat_ops++;
+        db->stat_cpu_usec += duration;
     }
 
     if (flags & CMD_CALL_STATS) {
@@ -3318,6 +3906,7 @@ void call(client *c, int flags) {
          * EXPIRE, GEOADD, etc. */
         real_cmd->microseconds += duration;
         real_cmd->calls++;
+        latencyHistogramAdd(&real_cmd->latency_histogram,duration);
     }
 
     /* Propagate the command into the AOF and replication link */
@@ -3385,14 +3974,59 @@ void call(client *c, int flags) {
     if (c->cmd->flags & CMD_READONLY) {
         client *caller = (c->flags & CLIENT_LUA && server.lua_caller) ?
                             server.lua_caller : c;
-        if (caller->flags & CLIENT_TRACKING)
+        if (caller->flags & CLIENT_TRACKING &&
+            !(caller->flags & CLIENT_TRACKING_BCAST))
+        {
             trackingRememberKeys(caller);
+        }
     }
 
+    /* Now that the propagation released its references, the arguments
+     * still shared are the ones stored in the keyspace. */
+    if (account_argv) dbMemoryAccount(db,-dbArgvMemory(c->argv,c->argc,1));
+
     server.fixed_time_expire--;
     server.stat_numcommands++;
 }
 
+/* Remember that the replies of 'c' were produced at 'now', so that the time
+ * needed to write them can be tracked, see trackReplyWriteTime(). If the
+ * command was logged in the SLOWLOG, 'slowlog_id' is the ID of the entry
+ * that will report the write time as well. */
+void trackReplyStart(client *c, ustime_t now, long long slowlog_id) {
+    if (getClientType(c) != CLIENT_TYPE_NORMAL || !clientHasPendingReplies(c))
+        return;
+    if (!c->reply_ustime) c->reply_ustime = now;
+    if (slowlog_id != -1) c->slowlog_id = slowlog_id;
+}
+
+/* This is the part of call() that must run in the main thread, for commands
+ * an I/O thread already executed on behalf of the client: see
+ * ioThreadExecuteCommand() in networking.c. Only read only commands that
+ * don't need to be propagated nor tracked are executed by I/O threads, so
+ * all we need to do here is to update the statistics. */
+void callIOThreadEpilogue(client *c) {
+    ustime_t duration = c->io_thread_cmd_duration;
+    ustime_t queue = server.latency_tracking_breakdown ? c->queue_usec : -1;
+    long long slowlog_id = -1;
+
+    if (!(c->cmd->flags & CMD_SKIP_SLOWLOG)) {
+        latencyAddSampleIfNeeded("fast-command",duration);
+        slowlog_id = slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration,
+                                              queue);
+    }
+    if (queue != -1) trackReplyStart(c,ustime(),slowlog_id);
+    c->cmd->microseconds += duration;
+    c->cmd->calls++;
+    latencyHistogramAdd(&c->cmd->latency_histogram,duration);
+    c->stat_commands++;
+    c->stat_cmd_usec += duration;
+    c->db->stat_ops++;
+    c->db->stat_cpu_usec += duration;
+    server.stat_numcommands++;
+    server.stat_io_threaded_commands++;
+}
+
 /* If this function gets called we already read a whole
  * command, arguments are in the client argv/argc fields.
  * processCommand() execute the command or prepare the
@@ -3402,6 +4036,8 @@ void call(client *c, int flags) {
  * other operations can be performed by the caller. Otherwise
  * if C_ERR is returned the client was destroyed (i.e. after QUIT). */
 int processCommand(client *c) {
+    int hashslot = -1, stats_slot = -1;
+
     moduleCallCommandFilters(c);
 
     /* The QUIT command is handled separately. Normal command procs will
@@ -3476,11 +4112,12 @@ int processCommand(client *c) {
         !(c->cmd->getkeys_proc == NULL && c->cmd->firstkey == 0 &&
           c->cmd->proc != execCommand))
     {
-        int hashslot;
         int error_code;
         clusterNode *n = getNodeByQuery(c,c->cmd,c->argv,c->argc,
                                         &hashslot,&error_code);
         if (n == NULL || n != server.cluster->myself) {
+            if (error_code == CLUSTER_REDIR_CROSS_SLOT &&
+                clusterProcessCrossSlotRead(c)) return C_OK;
             if (c->cmd->proc == execCommand) {
                 discardTransaction(c);
             } else {
@@ -3489,6 +4126,17 @@ int processCommand(client *c) {
             clusterRedirectClient(c,n,hashslot,error_code);
             return C_OK;
         }
+        stats_slot = hashslot;
+        if (!clusterCommandKeysAreDeclared(c)) hashslot = -1;
+    }
+
+    /* Disconnect some clients if the clients are over maxmemory-clients,
+     * before evicting keys. This client may be evicted too, since its query
+     * buffer was not accounted yet. */
+    if (server.maxmemory_clients) {
+        updateClientMemUsage(c);
+        evictClients();
+        if (server.current_client == NULL) return C_ERR;
     }
 
     /* Handle the maxmemory directive.
@@ -3518,9 +4166,26 @@ int processCommand(client *c) {
         }
     }
 
+    /* Same for the db-maxmemory limit of the selected DB. */
+    if (server.db_maxmemory_len && dbGetMaxmemory(c->db)) {
+        int out_of_memory = dbFreeMemoryIfNeeded(c->db) == C_ERR;
+        if (server.current_client == NULL) return C_ERR;
+
+        if (out_of_memory &&
+            (c->cmd->flags & CMD_DENYOOM ||
+             (c->flags & CLIENT_MULTI &&
+              c->cmd->proc != execCommand &&
+              c->cmd->proc != discardCommand)))
+        {
+            flagTransaction(c);
+            addReply(c, shared.dboomerr);
+            return C_OK;
+        }
+    }
+
     /* Make sure to use a reasonable amount of memory for client side
      * caching metadata. */
-    if (server.tracking_clients) trackingLimitUsedSlots();
+    if (server.tracking_clients) trackingLimitUsedKeys();
 
     /* Don't accept write commands if there are problems persisting on disk
      * and if this is a master instance. */
@@ -3571,8 +4236,10 @@ int processCommand(client *c) {
         c->cmd->proc != subscribeCommand &&
         c->cmd->proc != unsubscribeCommand &&
         c->cmd->proc != psubscribeCommand &&
-        c->cmd->proc != punsubscribeCommand) {
-        addReplyError(c,"only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING / QUIT allowed in this context");
+        c->cmd->proc != punsubscribeCommand &&
+        c->cmd->proc != ssubscribeCommand &&
+        c->cmd->proc != sunsubscribeCommand) {
+        addReplyError(c,"only (P|S)SUBSCRIBE / (P|S)UNSUBSCRIBE / PING / QUIT allowed in this context");
         return C_OK;
     }
 
@@ -3595,6 +4262,15 @@ int processCommand(client *c) {
         return C_OK;
     }
 
+    /* Loading a new data set in the background? The current one can only
+     * be read, since it is going to be replaced. */
+    if (server.async_loading &&
+        !(c->cmd->flags & (CMD_LOADING|CMD_READONLY)))
+    {
+        addReply(c, shared.loadingerr);
+        return C_OK;
+    }
+
     /* Lua script too slow? Only allow a limited number of commands. */
     if (server.lua_timedout &&
           c->cmd->proc != authCommand &&
@@ -3612,6 +4288,22 @@ int processCommand(client *c) {
         return C_OK;
     }
 
+    /* Don't write the keys a MIGRATE or a set operation in progress is
+     * working on. */
+    if ((listLength(server.migrate_jobs) || listLength(server.setop_jobs)) &&
+        !(c->flags & CLIENT_MULTI && c->cmd->proc != execCommand) &&
+        commandTouchesLockedKeys(c))
+    {
+        if (c->cmd->proc == execCommand) discardTransaction(c);
+        addReplyError(c,
+            "-TRYAGAIN Keys are locked by a command in progress, "
+            "try again later");
+        return C_OK;
+    }
+
+    /* Wait for the values in the tiered storage to be read back. */
+    if (tieredBlockForValues(c)) return C_OK;
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand && c->cmd->proc != discardCommand &&
@@ -3620,8 +4312,38 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        /* The keys were already hashed by the cluster redirection check
+         * above: the keyspace reuses their slot while the command runs. */
+        clusterSlotStatsCall slot_stats;
+        long long reploff = server.master_repl_offset;
+        void *offset_attr = NULL;
+        if (stats_slot != -1)
+            clusterSlotStatsBeforeCall(c,stats_slot,&slot_stats);
+        /* With CLIENT WRITEOFFSET ON the reply to a write is preceded by
+         * an attribute with the replication offset reached, that the client
+         * can pass to WAITOFFSET in order to read its writes from a
+         * replica. */
+        if (c->flags & CLIENT_WRITE_OFFSET && c->resp >= 3)
+            offset_attr = addReplyDeferredLen(c);
+        c->slot = hashslot;
         call(c,CMD_CALL_FULL);
+        c->slot = -1;
+        if (stats_slot != -1) clusterSlotStatsAfterCall(c,&slot_stats);
+        if (server.master_repl_offset != reploff)
+            c->write_reploff = server.master_repl_offset;
+        if (offset_attr) {
+            if (server.master_repl_offset != reploff) {
+                char buf[64];
+                int len = snprintf(buf,sizeof(buf),
+                    "|1\r\n$6\r\noffset\r\n:%lld\r\n",
+                    server.master_repl_offset);
+                setDeferredReply(c,offset_attr,buf,len);
+            } else {
+                setDeferredReply(c,offset_attr,NULL,0);
+            }
+        }
         c->woff = server.master_repl_offset;
+        c->aof_woff = server.aof_written_offset+sdslen(server.aof_buf);
         if (listLength(server.ready_keys))
             handleClientsBlockedOnKeys();
     }
@@ -3638,12 +4360,15 @@ void closeListeningSockets(int unlink_unix_socket) {
     for (j = 0; j < server.ipfd_count; j++) close(server.ipfd[j]);
     for (j = 0; j < server.tlsfd_count; j++) close(server.tlsfd[j]);
     if (server.sofd != -1) close(server.sofd);
+    if (server.shmfd != -1) close(server.shmfd);
     if (server.cluster_enabled)
         for (j = 0; j < server.cfd_count; j++) close(server.cfd[j]);
     if (unlink_unix_socket && server.unixsocket) {
         serverLog(LL_NOTICE,"Removing the unix socket file.");
         unlink(server.unixsocket); /* don't care if this fails */
     }
+    if (unlink_unix_socket && server.shm_socket)
+        unlink(server.shm_socket); /* don't care if this fails */
 }
 
 int prepareForShutdown(int flags) {
@@ -3662,6 +4387,10 @@ int prepareForShutdown(int flags) {
         serverLog(LL_WARNING,"There is a child saving an .rdb. Killing it!");
         killRDBChild();
     }
+    if (server.rdb_forkless) {
+        serverLog(LL_WARNING,"There is a fork-less save in progress. Aborting it!");
+        rdbForklessSaveAbort();
+    }
 
     /* Kill module child if there is one. */
     if (server.module_child_pid != -1) {
@@ -3706,6 +4435,10 @@ int prepareForShutdown(int flags) {
         }
     }
 
+    /* Flush the persistent replication backlog, that now ends at the
+     * offset of the RDB file we just saved. */
+    replBacklogFileSync(1);
+
     /* Fire the shutdown modules event. */
     moduleFireServerEvent(REDISMODULE_EVENT_SHUTDOWN,0,NULL);
 
@@ -3983,10 +4716,12 @@ sds genRedisInfoString(const char *section) {
             "arch_bits:%i\r\n"
             "multiplexing_api:%s\r\n"
             "atomicvar_api:%s\r\n"
+            "hash_function:%s\r\n"
             "gcc_version:%i.%i.%i\r\n"
             "process_id:%I\r\n"
             "run_id:%s\r\n"
             "tcp_port:%i\r\n"
+            "shard_id:%i\r\n"
             "uptime_in_seconds:%I\r\n"
             "uptime_in_days:%I\r\n"
             "hz:%i\r\n"
@@ -4003,6 +4738,7 @@ sds genRedisInfoString(const char *section) {
             server.arch_bits,
             aeGetApiName(),
             REDIS_ATOMIC_API,
+            dictGetHashFunction() == DICT_HASH_AES ? "aes" : "siphash",
 #ifdef __GNUC__
             __GNUC__,__GNUC_MINOR__,__GNUC_PATCHLEVEL__,
 #else
@@ -4011,6 +4747,7 @@ sds genRedisInfoString(const char *section) {
             (int64_t) getpid(),
             server.runid,
             server.port ? server.port : server.tls_port,
+            server.shard_id,
             (int64_t)uptime,
             (int64_t)(uptime/(3600*24)),
             server.hz,
@@ -4107,10 +4844,13 @@ sds genRedisInfoString(const char *section) {
             "mem_replication_backlog:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
+            "mem_clients_spilled:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
+            "mem_keyspace_hugepages:%zu\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "interned_values:%lu\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -4150,20 +4890,35 @@ sds genRedisInfoString(const char *section) {
             mh->repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
+            spillUsedBytes(),
             mh->aof_buffer,
             ZMALLOC_LIB,
+            zmalloc_get_keyspace_hugepages(),
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            dictSize(server.interned_values)
         );
         freeMemoryOverheadData(mh);
     }
 
+    /* Tiered storage */
+    if (((server.tiered_storage || server.rdb_lazy_load) &&
+         (allsections || defsections)) || !strcasecmp(section,"tiered"))
+    {
+        if (sections++) info = sdscat(info,"\r\n");
+        if (server.tiered_storage || server.rdb_lazy_load)
+            info = genTieredInfoString(info);
+        else
+            info = sdscatprintf(info,"# Tiered\r\n");
+    }
+
     /* Persistence */
     if (allsections || defsections || !strcasecmp(section,"persistence")) {
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Persistence\r\n"
             "loading:%d\r\n"
+            "async_loading:%d\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
             "rdb_last_save_time:%jd\r\n"
@@ -4171,6 +4926,12 @@ sds genRedisInfoString(const char *section) {
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
             "rdb_last_cow_size:%zu\r\n"
+            "rdb_forkless_in_progress:%d\r\n"
+            "rdb_forkless_copied_keys:%llu\r\n"
+            "rdb_delta_base_valid:%d\r\n"
+            "rdb_delta_keys:%llu\r\n"
+            "bgload_in_progress:%d\r\n"
+            "last_bgload_status:%s\r\n"
             "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
             "aof_rewrite_scheduled:%d\r\n"
@@ -4182,14 +4943,21 @@ sds genRedisInfoString(const char *section) {
             "module_fork_in_progress:%d\r\n"
             "module_fork_last_cow_size:%zu\r\n",
             server.loading,
+            server.async_loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_forkless != NULL,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_child_pid == -1 && !server.rdb_forkless) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
+            server.rdb_forkless != NULL,
+            server.stat_rdb_forkless_copied,
+            server.rdb_delta_base_valid,
+            rdbDeltaKeysCount(),
+            server.bgload_filename != NULL,
+            (server.lastbgload_status == C_OK) ? "ok" : "err",
             server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
             server.aof_rewrite_scheduled,
@@ -4218,9 +4986,10 @@ sds genRedisInfoString(const char *section) {
                 aofRewriteBufferSize(),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
                 server.aof_delayed_fsync);
+            info = genAofWriterInfoString(info);
         }
 
-        if (server.loading) {
+        if (server.loading || server.async_loading) {
             double perc;
             time_t eta, elapsed;
             off_t remaining_bytes = server.loading_total_bytes-
@@ -4242,18 +5011,26 @@ sds genRedisInfoString(const char *section) {
                 "loading_total_bytes:%llu\r\n"
                 "loading_loaded_bytes:%llu\r\n"
                 "loading_loaded_perc:%.2f\r\n"
-                "loading_eta_seconds:%jd\r\n",
+                "loading_eta_seconds:%jd\r\n"
+                "loading_loaded_bytes_per_sec:%llu\r\n",
                 (intmax_t) server.loading_start_time,
                 (unsigned long long) server.loading_total_bytes,
                 (unsigned long long) server.loading_loaded_bytes,
                 perc,
-                (intmax_t)eta
+                (intmax_t)eta,
+                (unsigned long long) (elapsed ?
+                    server.loading_loaded_bytes/elapsed :
+                    server.loading_loaded_bytes)
             );
         }
     }
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        long long expired_backlog_lag;
+        unsigned long long expired_backlog =
+            getExpiredBacklog(&expired_backlog_lag);
+
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -4268,15 +5045,24 @@ sds genRedisInfoString(const char *section) {
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
+            "sync_diskless_spooled:%lld\r\n"
+            "repl_compress_input_bytes:%lld\r\n"
+            "repl_compress_output_bytes:%lld\r\n"
             "expired_keys:%lld\r\n"
+            "expired_hash_fields:%lld\r\n"
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
+            "expired_backlog_keys:%llu\r\n"
+            "expired_backlog_lag_ms:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "background_evicted_keys:%lld\r\n"
+            "evicted_clients:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
             "pubsub_patterns:%lu\r\n"
+            "pubsubshard_channels:%ld\r\n"
             "latest_fork_usec:%lld\r\n"
             "migrate_cached_sockets:%ld\r\n"
             "slave_expires_tracked_keys:%zu\r\n"
@@ -4284,7 +5070,19 @@ sds genRedisInfoString(const char *section) {
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
             "active_defrag_key_misses:%lld\r\n"
-            "tracking_used_slots:%lld\r\n",
+            "tracking_total_keys:%lld\r\n"
+            "tracking_total_items:%lld\r\n"
+            "tracking_prefixes:%lld\r\n"
+            "tracking_evicted_keys:%lld\r\n"
+            "keyspace_async_resizes:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
+            "throttled_reads:%lld\r\n"
+            "repl_parallel_parsed_cmds:%lld\r\n"
+            "string_compressions:%lld\r\n"
+            "string_decompressions:%lld\r\n"
+            "acl_auth_usec:%lld\r\n"
+            "acl_auth_cache_hits:%lld\r\n"
+            "acl_auth_cache_misses:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -4296,15 +5094,24 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_full,
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
+            server.stat_sync_diskless_spooled,
+            server.stat_repl_compress_in,
+            server.stat_repl_compress_out,
             server.stat_expiredkeys,
+            server.stat_expired_hash_fields,
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
+            expired_backlog,
+            expired_backlog_lag,
             server.stat_expire_cycle_time_used/1000,
             server.stat_evictedkeys,
+            server.stat_background_evictedkeys,
+            server.stat_evictedclients,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
-            listLength(server.pubsub_patterns),
+            server.pubsub_patterns_subscriptions,
+            dictSize(server.pubsubshard_channels),
             server.stat_fork_time,
             dictSize(server.migrate_cached_sockets),
             getSlaveKeyWithExpireCount(),
@@ -4312,7 +5119,35 @@ sds genRedisInfoString(const char *section) {
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
             server.stat_active_defrag_key_misses,
-            trackingGetUsedSlots());
+            trackingGetTotalKeys(),
+            trackingGetTotalItems(),
+            trackingGetTotalPrefixes(),
+            server.stat_tracking_evicted_keys,
+            server.stat_keyspace_async_resizes,
+            server.stat_io_threaded_commands,
+            server.stat_throttled_reads,
+            server.stat_repl_parallel_parsed,
+            (long long)server.stat_string_compressions,
+            server.stat_string_decompressions,
+            server.stat_auth_usec,
+            server.stat_auth_cache_hits,
+            server.stat_auth_cache_misses);
+        info = genIOThreadsInfoString(info);
+        info = genPipelineInfoString(info);
+        info = genReencodeInfoString(info);
+        if (server.latency_tracking_breakdown) {
+            uint64_t *qh = server.latency_queue_histogram;
+            uint64_t *wh = server.latency_write_histogram;
+            info = sdscatprintf(info,
+                "latency_queue_usec:p50=%lld,p99=%lld,p999=%lld\r\n"
+                "latency_write_usec:p50=%lld,p99=%lld,p999=%lld\r\n",
+                latencyHistogramPercentile(qh,50),
+                latencyHistogramPercentile(qh,99),
+                latencyHistogramPercentile(qh,99.9),
+                latencyHistogramPercentile(wh,50),
+                latencyHistogramPercentile(wh,99),
+                latencyHistogramPercentile(wh,99.9));
+        }
     }
 
     /* Replication */
@@ -4439,8 +5274,15 @@ sds genRedisInfoString(const char *section) {
             server.second_replid_offset,
             server.repl_backlog != NULL,
             server.repl_backlog_size,
-            server.repl_backlog_off,
-            server.repl_backlog_histlen);
+            server.repl_backlog ? server.repl_backlog->offset : 0,
+            server.repl_backlog ? server.repl_backlog->histlen : 0);
+        if (server.repl_backlog_map) {
+            replBacklogFileHeader *hdr = server.repl_backlog_map;
+            info = sdscatprintf(info,
+                "repl_backlog_file_first_byte_offset:%lld\r\n"
+                "repl_backlog_file_histlen:%lld\r\n",
+                hdr->offset, hdr->end_offset - hdr->offset + 1);
+        }
     }
 
     /* CPU */
@@ -4478,13 +5320,24 @@ sds genRedisInfoString(const char *section) {
             c = (struct redisCommand *) dictGetVal(de);
             if (!c->calls) continue;
             info = sdscatprintf(info,
-                "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f\r\n",
+                "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,"
+                "p50=%lld,p99=%lld,p999=%lld\r\n",
                 c->name, c->calls, c->microseconds,
-                (c->calls == 0) ? 0 : ((float)c->microseconds/c->calls));
+                (c->calls == 0) ? 0 : ((float)c->microseconds/c->calls),
+                latencyHistogramPercentile(c->latency_histogram,50),
+                latencyHistogramPercentile(c->latency_histogram,99),
+                latencyHistogramPercentile(c->latency_histogram,99.9));
         }
         dictReleaseIterator(di);
     }
 
+    /* Event loop */
+    if (allsections || !strcasecmp(section,"eventloop")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Eventloop\r\n");
+        info = genEventLoopInfoString(info);
+    }
+
     /* Cluster */
     if (allsections || defsections || !strcasecmp(section,"cluster")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -4502,7 +5355,7 @@ sds genRedisInfoString(const char *section) {
             long long keys, vkeys;
 
             keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
@@ -4511,6 +5364,22 @@ sds genRedisInfoString(const char *section) {
         }
     }
 
+    /* Keyspace access statistics */
+    if ((server.keyspace_stats_sample_ratio && (allsections || defsections)) ||
+        !strcasecmp(section,"keystats"))
+    {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Keystats\r\n");
+        info = genKeyspaceStatsInfoString(info);
+    }
+
+    /* Per DB resource accounting */
+    if (allsections || !strcasecmp(section,"dbstats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Dbstats\r\n");
+        info = genDbStatsInfoString(info);
+    }
+
     /* Get info from modules.
      * if user asked for "everything" or "modules", or a specific section
      * that's not found yet. */
@@ -4524,15 +5393,54 @@ sds genRedisInfoString(const char *section) {
     return info;
 }
 
+/* Reply with the INFO string 'info' as a map of the sections, each one a
+ * map of its fields to their values, for the clients asking for INFO MAP
+ * so that they don't need to parse the text. */
+static void addReplyInfoMap(client *c, sds info) {
+    int count, j;
+    long sections = 0, fields = 0;
+    void *fieldslen = NULL;
+    void *sectionslen = addReplyDeferredLen(c);
+    sds *lines = sdssplitlen(info,sdslen(info),"\r\n",2,&count);
+
+    for (j = 0; j < count; j++) {
+        sds line = lines[j];
+        char *sep;
+
+        if (line[0] == '#') {
+            if (fieldslen) setDeferredMapLen(c,fieldslen,fields);
+            sdsrange(line,1,-1);
+            sdstrim(line," ");
+            addReplyBulkSds(c,line);
+            lines[j] = NULL;
+            fieldslen = addReplyDeferredLen(c);
+            fields = 0;
+            sections++;
+        } else if (fieldslen && (sep = strchr(line,':')) != NULL) {
+            addReplyBulkCBuffer(c,line,sep-line);
+            addReplyBulkCBuffer(c,sep+1,sdslen(line)-(sep-line)-1);
+            fields++;
+        }
+    }
+    if (fieldslen) setDeferredMapLen(c,fieldslen,fields);
+    setDeferredMapLen(c,sectionslen,sections);
+    sdsfreesplitres(lines,count);
+}
+
 void infoCommand(client *c) {
-    char *section = c->argc == 2 ? c->argv[1]->ptr : "default";
+    int map = c->argc > 1 && !strcasecmp(c->argv[c->argc-1]->ptr,"map");
+    int argc = c->argc - map;
+    char *section = argc == 2 ? c->argv[1]->ptr : "default";
 
-    if (c->argc > 2) {
+    if (argc > 2) {
         addReply(c,shared.syntaxerr);
         return;
     }
     sds info = genRedisInfoString(section);
-    addReplyVerbatim(c,info,sdslen(info),"txt");
+    if (map)
+        addReplyInfoMap(c,info);
+    else
+        addReplyVerbatim(c,info,sdslen(info),"txt");
     sdsfree(info);
 }
 
@@ -4566,7 +5474,15 @@ void linuxMemoryWarnings(void) {
     if (linuxOvercommitMemoryValue() == 0) {
         serverLog(LL_WARNING,"WARNING overcommit_memory is set to 0! Background save may fail under low memory condition. To fix this issue add 'vm.overcommit_memory = 1' to /etc/sysctl.conf and then reboot or run the command 'sysctl vm.overcommit_memory=1' for this to take effect.");
     }
-    if (THPIsEnabled()) {
+    if (server.keyspace_hugepages) {
+        /* Huge pages are wanted: what matters is the copy on write cost
+         * when forking, that fork-less snapshots avoid. */
+        if (!THPIsEnabled()) {
+            serverLog(LL_WARNING,"WARNING keyspace-hugepages is enabled but Transparent Huge Pages support is disabled in your kernel, so the keyspace will use regular pages. To fix this issue run the command 'echo madvise > /sys/kernel/mm/transparent_hugepage/enabled' as root.");
+        } else if (!server.rdb_forkless_save) {
+            serverLog(LL_WARNING,"WARNING keyspace-hugepages is enabled without rdb-forkless-save: every write during a BGSAVE will copy a whole huge page. Consider enabling rdb-forkless-save.");
+        }
+    } else if (THPIsEnabled()) {
         serverLog(LL_WARNING,"WARNING you have Transparent Huge Pages (THP) support enabled in your kernel. This will create latency and memory usage issues with Redis. To fix this issue run the command 'echo never > /sys/kernel/mm/transparent_hugepage/enabled' as root, and add it to your /etc/rc.local in order to retain the setting after a reboot. Redis must be restarted after THP is disabled.");
     }
 }
@@ -4686,7 +5602,7 @@ static void sigShutdownHandler(int sig) {
      * on disk. */
     if (server.shutdown_asap && sig == SIGINT) {
         serverLogFromHandler(LL_WARNING, "You insist... exiting now.");
-        rdbRemoveTempFile(getpid());
+        rdbRemoveTempFile(getpid(),1);
         exit(1); /* Exit with an error since this was not a clean shutdown. */
     } else if (server.loading) {
         serverLogFromHandler(LL_WARNING, "Received shutdown signal during loading, exiting now.");
@@ -4745,6 +5661,7 @@ void setupChildSignalHandlers(void) {
 int redisFork() {
     int childpid;
     long long start = ustime();
+    TRACE(fork_start);
     if ((childpid = fork()) == 0) {
         /* Child */
         closeListeningSockets(0);
@@ -4752,8 +5669,9 @@ int redisFork() {
     } else {
         /* Parent */
         server.stat_fork_time = ustime()-start;
+        TRACE2(fork_end,childpid,server.stat_fork_time);
         server.stat_fork_rate = (double) zmalloc_used_memory() * 1000000 / server.stat_fork_time / (1024*1024*1024); /* GB per second. */
-        latencyAddSampleIfNeeded("fork",server.stat_fork_time/1000);
+        latencyAddSampleIfNeeded("fork",server.stat_fork_time);
         if (childpid == -1) {
             return -1;
         }
@@ -4792,13 +5710,16 @@ int checkForSentinelMode(int argc, char **argv) {
 void loadDataFromDisk(void) {
     long long start = ustime();
     if (server.aof_state == AOF_ON) {
-        if (loadAppendOnlyFile(server.aof_filename) == C_OK)
+        if (loadAppendOnlyFiles() == C_OK)
             serverLog(LL_NOTICE,"DB loaded from append only file: %.3f seconds",(float)(ustime()-start)/1000000);
     } else {
         rdbSaveInfo rsi = RDB_SAVE_INFO_INIT;
-        if (rdbLoad(server.rdb_filename,&rsi,RDBFLAGS_NONE) == C_OK) {
+        if (rdbLoad(server.rdb_filename,&rsi,
+                    server.rdb_lazy_load ? RDBFLAGS_LAZY : RDBFLAGS_NONE) == C_OK)
+        {
             serverLog(LL_NOTICE,"DB loaded from disk: %.3f seconds",
                 (float)(ustime()-start)/1000000);
+            rdbDeltaLoad(&rsi);
 
             /* Restore the replication ID / offset from the RDB file. */
             if ((server.masterhost ||
@@ -4819,6 +5740,17 @@ void loadDataFromDisk(void) {
                 replicationCacheMasterUsingMyself();
                 selectDb(server.cached_master,rsi.repl_stream_db);
             }
+            /* A master can continue its replication history if the
+             * persistent backlog was written up to the offset of the
+             * RDB file. */
+            else if (!server.masterhost && rsi.repl_id_is_set &&
+                     rsi.repl_offset != -1 && replBacklogFileRestoreMaster(&rsi))
+            {
+                serverLog(LL_NOTICE,"Replication backlog restored from %s, "
+                    "replicas can partially resync from offset %lld",
+                    server.repl_backlog_filename,
+                    server.repl_backlog->offset);
+            }
         } else if (errno != ENOENT) {
             serverLog(LL_WARNING,"Fatal error loading the DB: %s. Exiting.",strerror(errno));
             exit(1);
@@ -4848,6 +5780,19 @@ void redisSetProcTitle(char *title) {
 #endif
 }
 
+/* Bind the calling thread to the CPUs of 'cpulist', see setcpuaffinity.c.
+ * Nothing is done if the list is NULL. */
+void redisSetCpuAffinity(const char *cpulist) {
+#ifdef USE_SETCPUAFFINITY
+    if (cpulist && setcpuaffinity(cpulist) == -1) {
+        serverLog(LL_WARNING,"Can't set the CPU affinity to '%s': %s",
+            cpulist, strerror(errno));
+    }
+#else
+    UNUSED(cpulist);
+#endif
+}
+
 /*
  * Check whether systemd or upstart have been used to start redis.
  */
@@ -4956,6 +5901,8 @@ int main(int argc, char **argv) {
             quicklistTest(argc, argv);
         } else if (!strcasecmp(argv[2], "intset")) {
             return intsetTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "roaring")) {
+            return roaringTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zipmap")) {
             return zipmapTest(argc, argv);
         } else if (!strcasecmp(argv[2], "sha1test")) {
@@ -4966,14 +5913,24 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "aeshash")) {
+            return aeshashTest(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
+        } else if (!strcasecmp(argv[2], "ae")) {
+            return aeTest(argc, argv);
         }
 
         return -1; /* test not found */
     }
 #endif
 
+    crc64_init();
+
+    /* Run the micro benchmarks of the data structures, see microbench.c. */
+    if (argc >= 2 && !strcasecmp(argv[1],"microbench"))
+        return microbenchMain(argc,argv);
+
     /* We need to initialize our libraries, and the server configuration. */
 #ifdef INIT_SETPROCTITLE_REPLACEMENT
     spt_init(argc, argv);
@@ -4987,6 +5944,9 @@ int main(int argc, char **argv) {
     uint8_t hashseed[16];
     getRandomBytes(hashseed,sizeof(hashseed));
     dictSetHashFunctionSeed(hashseed);
+    /* Use the AES based hash function when the CPU supports it, SipHash
+     * otherwise. This must happen before any dictionary is created. */
+    dictSetHashFunction(DICT_HASH_AES);
     server.sentinel_mode = checkForSentinelMode(argc,argv);
     initServerConfig();
     ACLInit(); /* The ACL subsystem must be initialized ASAP because the
@@ -5101,9 +6061,11 @@ int main(int argc, char **argv) {
     server.supervised = redisIsSupervised(server.supervised_mode);
     int background = server.daemonize && !server.supervised;
     if (background) daemonize();
+    if (server.shards > 1 && !server.sentinel_mode)
+        shardsStart(background || server.pidfile != NULL);
 
     initServer();
-    if (background || server.pidfile) createPidFile();
+    if (server.shards == 1 && (background || server.pidfile)) createPidFile();
     redisSetProcTitle(argv[0]);
     redisAsciiArt();
     checkTcpBacklogSettings();
@@ -5117,6 +6079,7 @@ int main(int argc, char **argv) {
         moduleLoadFromQueue();
         ACLLoadUsersAtStartup();
         InitServerLast();
+        replBacklogFileOpen();
         loadDataFromDisk();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
@@ -5130,6 +6093,8 @@ int main(int argc, char **argv) {
             serverLog(LL_NOTICE,"Ready to accept connections");
         if (server.sofd > 0)
             serverLog(LL_NOTICE,"The server is now ready to accept connections at %s", server.unixsocket);
+        if (server.shmfd > 0)
+            serverLog(LL_NOTICE,"The server is now ready to accept shared memory connections at %s", server.shm_socket);
     } else {
         InitServerLast();
         sentinelIsRunning();
@@ -5140,6 +6105,7 @@ int main(int argc, char **argv) {
         serverLog(LL_WARNING,"WARNING: You specified a maxmemory value that is less than 1MB (current value is %llu bytes). Are you sure this is what you really want?", server.maxmemory);
     }
 
+    redisSetCpuAffinity(server.server_cpulist);
     aeSetBeforeSleepProc(server.el,beforeSleep);
     aeSetAfterSleepProc(server.el,afterSleep);
     aeMain(server.el);
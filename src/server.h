@@ -59,10 +59,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list of strings and integers */
 #include "intset.h"  /* Compact integer set structure */
+#include "roaring.h" /* Compressed sparse bitmaps */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
 #include "latency.h" /* Latency monitor API */
+#include "trace.h"   /* Static tracepoints */
 #include "sparkline.h" /* ASCII graphs API */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
@@ -90,16 +93,26 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAX_CLIENTS_PER_CLOCK_TICK 200          /* HZ is adapted based on that. */
 #define CONFIG_DEFAULT_SERVER_PORT        6379  /* TCP port. */
 #define CONFIG_DEFAULT_SERVER_TLS_PORT    0     /* TCP port. */
+#define CONFIG_DEFAULT_TLS_SESSION_CACHING 1
+#define CONFIG_DEFAULT_TLS_SESSION_CACHE_SIZE (20*1024)
+#define CONFIG_DEFAULT_TLS_SESSION_CACHE_TIMEOUT 300    /* Seconds. */
 #define CONFIG_DEFAULT_TCP_BACKLOG       511    /* TCP listen backlog. */
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT       0   /* Default client timeout: infinite */
 #define CONFIG_DEFAULT_DBNUM     16
 #define CONFIG_DEFAULT_IO_THREADS_NUM 1         /* Single threaded by default */
+#define CONFIG_DEFAULT_SHARDS 1                 /* Single shard by default */
+#define CONFIG_MAX_SHARDS 1024
+#define CONFIG_DEFAULT_LAZYFREE_THREADS 1
+#define CONFIG_DEFAULT_ACCEPT_THREADS 0         /* Accept in the main thread. */
+#define ACCEPT_THREADS_MAX_NUM 16
 #define CONFIG_DEFAULT_IO_THREADS_DO_READS 0    /* Read + parse from threads? */
+#define CONFIG_DEFAULT_IO_THREADS_DO_COMMANDS 0 /* Exec read only cmds too? */
 #define CONFIG_MAX_LINE    1024
 #define CRON_DBS_PER_CALL 16
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
 #define PROTO_SHARED_SELECT_CMDS 10
-#define OBJ_SHARED_INTEGERS 10000
+#define OBJ_SHARED_INTEGERS_CHUNK 1024 /* Shared integers are created in chunks. */
+#define OBJ_SHARED_DOUBLES 128
 #define OBJ_SHARED_BULKHDR_LEN 32
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_PERC  100
@@ -108,6 +121,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
 #define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
 #define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
+#define CONFIG_DEFAULT_SLOWLOG_SHAPES_MAX_LEN 64
+#define CONFIG_DEFAULT_SLOWLOG_SAMPLE_RATIO 1
+#define CONFIG_DEFAULT_KEYSPACE_STATS_SAMPLE_RATIO 0
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
 #define CONFIG_AUTHPASS_MAX_LEN 512
 #define CONFIG_DEFAULT_SLAVE_PRIORITY 100
@@ -116,8 +132,12 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_RUN_ID_SIZE 40
 #define RDB_EOF_MARK_SIZE 40
 #define CONFIG_DEFAULT_REPL_BACKLOG_SIZE (1024*1024)    /* 1mb */
+#define CONFIG_DEFAULT_CLIENT_OBUF_SPILL_THRESHOLD 0    /* Don't spill. */
+#define CONFIG_DEFAULT_CLIENT_OBUF_SPILL_MAX_SIZE (1024LL*1024*1024) /* 1gb */
+#define CONFIG_DEFAULT_REPL_BACKLOG_FILE_SIZE (1024LL*1024*1024) /* 1gb */
 #define CONFIG_DEFAULT_REPL_BACKLOG_TIME_LIMIT (60*60)  /* 1 hour */
 #define CONFIG_REPL_BACKLOG_MIN_SIZE (1024*16)          /* 16k */
+#define REPL_BACKLOG_TRIM_BLOCKS_PER_CALL 64 /* Blocks freed at most per trim. */
 #define CONFIG_BGSAVE_RETRY_DELAY 5 /* Wait a few secs before trying again. */
 #define CONFIG_DEFAULT_PID_FILE "/var/run/redis.pid"
 #define CONFIG_DEFAULT_SYSLOG_IDENT "redis"
@@ -127,6 +147,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_CLUSTER_ANNOUNCE_BUS_PORT 0      /* Use +10000 offset. */
 #define CONFIG_DEFAULT_DAEMONIZE 0
 #define CONFIG_DEFAULT_UNIX_SOCKET_PERM 0
+#define CONFIG_DEFAULT_SHM_RING_SIZE (256*1024)
 #define CONFIG_DEFAULT_TCP_KEEPALIVE 300
 #define CONFIG_DEFAULT_PROTECTED_MODE 1
 #define CONFIG_DEFAULT_GOPHER_ENABLED 0
@@ -134,12 +155,25 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 0
 #define CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR 1
 #define CONFIG_DEFAULT_RDB_COMPRESSION 1
+#define CONFIG_DEFAULT_RDB_SAVE_SCRIPTS 1
+#define CONFIG_DEFAULT_LUA_PROFILER 0
 #define CONFIG_DEFAULT_RDB_CHECKSUM 1
 #define CONFIG_DEFAULT_RDB_FILENAME "dump.rdb"
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC 0
+#define CONFIG_DEFAULT_REPL_COMPRESSION 0
+#define CONFIG_DEFAULT_REPL_PARALLEL_PARSE 0
 #define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_DELAY 5
+#define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_BUFFER 0
+#define CONFIG_DEFAULT_REPL_DISKLESS_SYNC_MAX_RATE 0
 #define CONFIG_DEFAULT_RDB_KEY_SAVE_DELAY 0
 #define CONFIG_DEFAULT_KEY_LOAD_DELAY 0
+#define CONFIG_DEFAULT_RDB_LOAD_THREADS 1
+#define CONFIG_DEFAULT_RDB_LAZY_LOAD 0
+#define RDB_LOAD_MAX_THREADS 128
+#define CONFIG_DEFAULT_RDB_SAVE_THREADS 1
+#define RDB_SAVE_MAX_THREADS 128
+#define CONFIG_DEFAULT_RDB_FORKLESS_SAVE 0
+#define CONFIG_DEFAULT_RDB_DELTA_SNAPSHOTS 0
 #define CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA 1
 #define CONFIG_DEFAULT_SLAVE_READ_ONLY 1
 #define CONFIG_DEFAULT_SLAVE_IGNORE_MAXMEMORY 1
@@ -147,13 +181,18 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_SLAVE_ANNOUNCE_PORT 0
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CONFIG_DEFAULT_MAXMEMORY 0
+#define CONFIG_DEFAULT_MAXMEMORY_CLIENTS 0
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
+#define CONFIG_DEFAULT_MAXMEMORY_SOFT_LIMIT 0
+#define CONFIG_DEFAULT_MAXMEMORY_SHADOW_SAMPLING 0
 #define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
 #define CONFIG_DEFAULT_LFU_DECAY_TIME 1
 #define CONFIG_DEFAULT_AOF_FILENAME "appendonly.aof"
 #define CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE 0
 #define CONFIG_DEFAULT_AOF_LOAD_TRUNCATED 1
 #define CONFIG_DEFAULT_AOF_USE_RDB_PREAMBLE 1
+#define CONFIG_DEFAULT_AOF_MULTI_PART 0
+#define CONFIG_DEFAULT_AOF_BACKGROUND_WRITE 0
 #define CONFIG_DEFAULT_ACTIVE_REHASHING 1
 #define CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC 1
 #define CONFIG_DEFAULT_RDB_SAVE_INCREMENTAL_FSYNC 1
@@ -165,12 +204,18 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_BINDADDR_MAX 16
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
+#define CONFIG_DEFAULT_LATENCY_TRACKING_BREAKDOWN 0
 #define CONFIG_DEFAULT_SLAVE_LAZY_FLUSH 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
+#define CONFIG_DEFAULT_KEYSPACE_OPEN_ADDRESSING 0
+#define CONFIG_DEFAULT_KEYSPACE_ORDERED_INDEX 0
+#define CONFIG_DEFAULT_EXPIRE_TIME_INDEX 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
+#define CONFIG_DEFAULT_KEYSPACE_HUGEPAGES 0
+#define CONFIG_DEFAULT_ACTIVE_DEFRAG_THREAD 0
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_UPPER 100 /* maximum defrag force at 100% fragmentation */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
@@ -178,7 +223,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 25 /* 25% CPU max (at upper threshold) */
 #define CONFIG_DEFAULT_DEFRAG_MAX_SCAN_FIELDS 1000 /* keys with more than 1000 fields will be processed separately */
 #define CONFIG_DEFAULT_PROTO_MAX_BULK_LEN (512ll*1024*1024) /* Bulk request max size */
-#define CONFIG_DEFAULT_TRACKING_TABLE_MAX_FILL 10 /* 10% tracking table max fill. */
+#define CONFIG_DEFAULT_VALUE_INTERNING_MAX_SIZE 0 /* Values interning disabled. */
+#define CONFIG_DEFAULT_SHARED_INTEGERS 10000
+#define CONFIG_DEFAULT_KEYSPACE_ASYNC_RESIZE_THRESHOLD (16*1024*1024)
+#define CONFIG_DEFAULT_TIERED_STORAGE 0
+#define CONFIG_DEFAULT_TIERED_STORAGE_FILE "tiered-storage.dat"
+#define CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS 1000000 /* Keys in tracking table. */
+#define CONFIG_DEFAULT_NOTIFY_KEYSPACE_EVENTS_STREAM_MAXLEN 10000 /* Entries. */
 #define CONFIG_DEFAULT_ACTIVE_EXPIRE_EFFORT 1 /* From 1 to 10. */
 
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
@@ -199,12 +250,27 @@ typedef long long ustime_t; /* microsecond time type. */
 #define STATS_METRIC_NET_OUTPUT 2   /* Bytes written to network. */
 #define STATS_METRIC_COUNT 3
 
+/* Buckets of the pipeline batches histogram, see trackPipelineBatch(). */
+#define STATS_PIPELINE_BUCKETS 6
+
 /* Protocol and I/O related defines */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_OBJ_MIN_BYTES (16*1024) /* Min bulk sent without copy */
+#define PROTO_PUBSUB_SHARED_MIN_BYTES 1024 /* Min message shared by many
+                                              subscribers without copy. */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
+#define CLIENT_BUF_POOL_SIZE    128  /* Released client buffers kept for
+                                        reuse, for each kind of buffer. */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define REPL_PARALLEL_PARSE_READ_LEN (1024*1024) /* Master reads size. */
+#define REPL_PARALLEL_PARSE_MIN_BYTES (1024*64) /* Min stream to split. */
+#define REPL_PARALLEL_PARSE_MAX_CMDS 65536 /* Max commands parsed at once. */
+#define PROTO_ARGV_MIN_LEN      8         /* Min client argv array size */
+#define PROTO_ARGV_REUSE_MAX    1024      /* Max argv size always reused */
+#define PROTO_ARGV_POOL_CLASSES 6         /* Size classes of the argv pool */
+#define PROTO_ARGV_POOL_MAX     32        /* Max argv objects in the pool */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -263,6 +329,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CMD_CATEGORY_CONNECTION (1ULL<<35)
 #define CMD_CATEGORY_TRANSACTION (1ULL<<36)
 #define CMD_CATEGORY_SCRIPTING (1ULL<<37)
+#define CMD_CATEGORY_BLOOM (1ULL<<38)
 
 /* AOF states */
 #define AOF_OFF 0             /* AOF is off */
@@ -309,9 +376,24 @@ typedef long long ustime_t; /* microsecond time type. */
                                           we return single threaded that the
                                           client has already pending commands
                                           to be executed. */
-#define CLIENT_TRACKING (1<<31) /* Client enabled keys tracking in order to
+#define CLIENT_TRACKING (1ULL<<31) /* Client enabled keys tracking in order to
                                    perform client side caching. */
 #define CLIENT_TRACKING_BROKEN_REDIR (1ULL<<32) /* Target client is invalid. */
+#define CLIENT_IO_THREAD_CMD (1ULL<<33) /* The pending command was already
+                                           executed by an I/O thread. */
+#define CLIENT_SLOT_IMPORT (1ULL<<34) /* Client streaming a hash slot that
+                                         is migrated to this node. */
+#define CLIENT_IN_TO_TABLE (1ULL<<35) /* This client is in the timeout table. */
+#define CLIENT_TRACKING_BCAST (1ULL<<36) /* Tracking in BCAST mode. */
+#define CLIENT_NO_EVICT (1ULL<<37) /* Not evicted by maxmemory-clients. */
+#define CLIENT_SHM (1ULL<<38) /* Client connected via the shm-socket. */
+#define CLIENT_PRIORITY (1ULL<<39) /* Served first, see CLIENT PRIORITY. */
+#define CLIENT_THROTTLED (1ULL<<40) /* Read delayed by the event loop
+                                       latency target, see
+                                       throttleClientRead(). */
+#define CLIENT_WRITE_OFFSET (1ULL<<41) /* Replies to writes carry the
+                                          replication offset, see
+                                          CLIENT WRITEOFFSET. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -321,7 +403,14 @@ typedef long long ustime_t; /* microsecond time type. */
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_WAITAOF 6 /* WAITAOF for the AOF fsync. */
+#define BLOCKED_MIGRATE 7 /* MIGRATE transferring the keys. */
+#define BLOCKED_CLUSTER_READ 8 /* MGET reading keys from other nodes. */
+#define BLOCKED_SETOP 9   /* SUNIONSTORE & co. executed in the background. */
+#define BLOCKED_REPLY 10  /* HGETALL & co. replied in the background. */
+#define BLOCKED_TIERED 11 /* Values read back from the tiered storage. */
+#define BLOCKED_OFFSET 12 /* WAITOFFSET for the replication stream. */
+#define BLOCKED_NUM 13    /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -337,6 +426,12 @@ typedef long long ustime_t; /* microsecond time type. */
                                     buffer configuration. Just the first
                                     three: normal, slave, pubsub. */
 
+/* The clients that can be evicted by maxmemory-clients are grouped by their
+ * memory usage in buckets of power of two sizes, see evictClients(). */
+#define CLIENT_MEM_USAGE_BUCKET_MIN_LOG 15 /* First bucket: up to 32k. */
+#define CLIENT_MEM_USAGE_BUCKET_MAX_LOG 33 /* Last bucket: 4GB and more. */
+#define CLIENT_MEM_USAGE_BUCKETS (1+CLIENT_MEM_USAGE_BUCKET_MAX_LOG-CLIENT_MEM_USAGE_BUCKET_MIN_LOG)
+
 /* Slave replication state. Used in server.repl_state for slaves to remember
  * what to do next. */
 #define REPL_STATE_NONE 0 /* No active replication */
@@ -371,6 +466,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define SLAVE_CAPA_NONE 0
 #define SLAVE_CAPA_EOF (1<<0)    /* Can parse the RDB EOF streaming format. */
 #define SLAVE_CAPA_PSYNC2 (1<<1) /* Supports PSYNC2 protocol. */
+#define SLAVE_CAPA_LZ4 (1<<2)    /* Can load LZ4 compressed RDB strings. */
 
 /* Synchronous read timeout - slave side */
 #define CONFIG_REPL_SYNCIO_TIMEOUT 5
@@ -414,28 +510,44 @@ typedef long long ustime_t; /* microsecond time type. */
 #define REPL_DISKLESS_LOAD_DISABLED 0
 #define REPL_DISKLESS_LOAD_WHEN_DB_EMPTY 1
 #define REPL_DISKLESS_LOAD_SWAPDB 2
+#define REPL_DISKLESS_LOAD_ASYNC 3
 #define CONFIG_DEFAULT_REPL_DISKLESS_LOAD REPL_DISKLESS_LOAD_DISABLED
 
+/* RDB strings compression algorithms. */
+#define RDB_COMPRESSION_LZF 0
+#define RDB_COMPRESSION_LZ4 1
+#define CONFIG_DEFAULT_RDB_COMPRESSION_ALGORITHM RDB_COMPRESSION_LZF
+
 /* Zipped structures related defaults */
-#define OBJ_HASH_MAX_ZIPLIST_ENTRIES 512
-#define OBJ_HASH_MAX_ZIPLIST_VALUE 64
+#define OBJ_HASH_MAX_LISTPACK_ENTRIES 512
+#define OBJ_HASH_MAX_LISTPACK_VALUE 64
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
-#define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
-#define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
+#define OBJ_SET_MAX_LISTPACK_ENTRIES 128
+#define OBJ_SET_MAX_LISTPACK_VALUE 64
+#define OBJ_ZSET_MAX_LISTPACK_ENTRIES 128
+#define OBJ_ZSET_MAX_LISTPACK_VALUE 64
 #define OBJ_STREAM_NODE_MAX_BYTES 4096
 #define OBJ_STREAM_NODE_MAX_ENTRIES 100
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define CONFIG_DEFAULT_LIST_COMPRESS_CODEC QUICKLIST_NODE_ENCODING_LZF
+#define OBJ_LIST_INDEX_MIN_NODES QUICKLIST_INDEX_MIN_NODES
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
+#define CONFIG_DEFAULT_BITMAP_ROARING_MIN_BYTES (1024*1024)
+#define CONFIG_DEFAULT_STRING_COMPRESSION_THRESHOLD 0
+#define CONFIG_DEFAULT_STRING_COMPRESSION_DICT ""
 
 /* Sets operations codes */
 #define SET_OP_UNION 0
 #define SET_OP_DIFF 1
 #define SET_OP_INTER 2
+#define CONFIG_DEFAULT_SETOPS_INCREMENTAL_THRESHOLD 1000000
+#define CONFIG_DEFAULT_REPLIES_INCREMENTAL_THRESHOLD 100000
+#define CONFIG_DEFAULT_EVENTLOOP_LATENCY_TARGET 0
 
 /* Redis maxmemory strategies. Instead of using just incremental number
  * for this defines, we use a set of flags so that testing for certain
@@ -443,6 +555,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAXMEMORY_FLAG_LRU (1<<0)
 #define MAXMEMORY_FLAG_LFU (1<<1)
 #define MAXMEMORY_FLAG_ALLKEYS (1<<2)
+#define MAXMEMORY_FLAG_SIZE (1<<3)
 #define MAXMEMORY_FLAG_NO_SHARED_INTEGERS \
     (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU)
 
@@ -454,6 +567,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define MAXMEMORY_ALLKEYS_LFU ((5<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_ALLKEYS_RANDOM ((6<<8)|MAXMEMORY_FLAG_ALLKEYS)
 #define MAXMEMORY_NO_EVICTION (7<<8)
+#define MAXMEMORY_VOLATILE_LFU_SIZE ((8<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE)
+#define MAXMEMORY_ALLKEYS_LFU_SIZE \
+    ((9<<8)|MAXMEMORY_FLAG_LFU|MAXMEMORY_FLAG_SIZE|MAXMEMORY_FLAG_ALLKEYS)
 
 #define CONFIG_DEFAULT_MAXMEMORY_POLICY MAXMEMORY_NO_EVICTION
 
@@ -559,6 +675,7 @@ struct RedisModule;
 struct RedisModuleIO;
 struct RedisModuleDigest;
 struct RedisModuleCtx;
+struct RedisModuleDefragCtx;
 struct redisObject;
 
 /* Each module type implementation should export a set of methods in order
@@ -573,6 +690,7 @@ typedef void (*moduleTypeRewriteFunc)(struct RedisModuleIO *io, struct redisObje
 typedef void (*moduleTypeDigestFunc)(struct RedisModuleDigest *digest, void *value);
 typedef size_t (*moduleTypeMemUsageFunc)(const void *value);
 typedef void (*moduleTypeFreeFunc)(void *value);
+typedef int (*moduleTypeDefragFunc)(struct RedisModuleDefragCtx *ctx, struct redisObject *key, void **value);
 
 /* The module type, which is referenced in each value of a given type, defines
  * the methods and links to the module exporting the type. */
@@ -588,6 +706,7 @@ typedef struct RedisModuleType {
     moduleTypeAuxLoadFunc aux_load;
     moduleTypeAuxSaveFunc aux_save;
     int aux_save_triggers;
+    moduleTypeDefragFunc defrag;
     char name[10]; /* 9 bytes name + null term. Charset: A-Z a-z 0-9 _- */
 } moduleType;
 
@@ -667,12 +786,23 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
+#define OBJ_ENCODING_ROARING 12 /* Bitmap encoded as roaring containers */
+#define OBJ_ENCODING_SWAPPED 13 /* Value moved to the tiered storage */
+#define OBJ_ENCODING_COMPRESSED 14 /* String compressed with LZ4 */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
 
 #define OBJ_SHARED_REFCOUNT INT_MAX
+/* Interned string values (see tryObjectInterning()) have a refcount of
+ * OBJ_INTERNED_REFCOUNT plus the references held by keys and clients. */
+#define OBJ_INTERNED_REFCOUNT (1<<30)
+
+/* The biggest string object allocated as EMBSTR. The current limit of 44 is
+ * chosen so that it will still fit into the 64 byte arena of jemalloc. */
+#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
@@ -699,40 +829,169 @@ char *getObjectTypeName(robj*);
     _var.ptr = _ptr; \
 } while(0)
 
+/* The 'ptr' of an object with the OBJ_ENCODING_SWAPPED encoding: the value
+ * was serialized in the tiered storage file, or was left in the RDB file
+ * loaded with rdb-lazy-load, see tiered.c. */
+typedef struct tieredValue {
+    off_t offset;           /* Offset of the value in the file. */
+    size_t len;             /* Length of the serialized value. */
+    unsigned char rdbtype;  /* RDB type of the value. */
+    unsigned char lazy;     /* The value is in the RDB file. */
+} tieredValue;
+
+/* The 'ptr' of a string object with the OBJ_ENCODING_COMPRESSED encoding,
+ * see strcompress.c. */
+typedef struct compressedString {
+    uint32_t len;           /* Length of the original string. */
+    uint32_t clen;          /* Length of the compressed data. */
+    unsigned char data[];   /* LZ4 compressed data. */
+} compressedString;
+
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * When 'obj' is not NULL the block is a bulk reply referencing a large
+ * string object instead of copying it: it is sent as the 'buf' content
+ * (the bulk length header), followed by the string and a final CRLF. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;
+    int spilled;            /* Mapped from the spill file, see spill.c. */
     char buf[];
 } clientReplyBlock;
 
+/* The replication stream is stored once into a list of blocks that is shared
+ * by the replication backlog and by all the replicas: each of them just holds
+ * a reference to the first block it still needs, and the position inside it
+ * for replicas. The refcount of a block only counts the references pointing
+ * directly to it, since the blocks following a referenced one are implicitly
+ * needed as well. This way a block is released only when it is the first
+ * block of the list, and the backlog is the only one still referencing it,
+ * see incrementalTrimReplicationBacklog(). */
+typedef struct replBufBlock {
+    int refcount;           /* Number of replicas or backlog pointing here. */
+    int spilled;            /* Mapped from the spill file, see spill.c. */
+    long long id;           /* Unique incremental number of the block. */
+    long long repl_offset;  /* Replication offset of the first byte. */
+    size_t size, used;
+    char buf[];
+} replBufBlock;
+
+/* The replication backlog is just a reference to the first block of the
+ * shared replication buffer that we keep for partial resynchronizations. */
+typedef struct replBacklog {
+    listNode *ref_repl_buf_node; /* First block of the backlog. */
+    long long histlen;           /* Backlog actual data length */
+    long long offset;            /* Replication "master offset" of first
+                                    byte in the replication backlog buffer.*/
+} replBacklog;
+
+/* Header of the persistent backlog file, see repl-backlog-file. The data
+ * follows the header page, as a ring where the byte at offset N of the
+ * replication stream is stored at position N % size. */
+typedef struct replBacklogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    long long size;                 /* Size of the data ring. */
+    char replid[CONFIG_RUN_ID_SIZE+1];  /* IDs of the stored history. */
+    char replid2[CONFIG_RUN_ID_SIZE+1];
+    long long second_replid_offset;
+    long long offset;               /* Offset of the first byte stored. */
+    long long end_offset;           /* Offset of the last byte stored. */
+} replBacklogFileHeader;
+
+/* Keys with a timeout set are tracked by an expire index: a flat array of
+ * (keyspace entry, unix time in milliseconds) pairs that the active expire
+ * cycle and the volatile eviction policies can sample sequentially without
+ * touching the keyspace entries of keys that are not yet expired.
+ *
+ * Every keyspace entry carries a keyMeta as dict entry metadata, pointing
+ * back to its position inside the index, so that the expire of a key is
+ * found with the same lookup that finds its value. The metadata also holds
+ * the epoch of the last fork-less save that wrote the key, see rdb.c. */
+typedef struct keyMeta {
+    uint64_t expire_pos:48;     /* Position in the expire index + 1, or 0
+                                   if the key has no expire. */
+    uint64_t snapshot_epoch:16; /* Epoch of the last fork-less save. */
+} keyMeta;
+
+typedef struct expireEntry {
+    dictEntry *de;              /* Entry of the key in the keyspace dict. */
+    long long when;             /* Unix time in milliseconds of the expire. */
+} expireEntry;
+
+/* When expire-time-index is enabled the index also keeps the keys sorted by
+ * expire time, so that the active expire cycle reclaims exactly the keys
+ * that are due, in order: 'by_time' has as elements the big endian expire
+ * time followed by the key name, and 'buckets' counts the keys expiring
+ * in every EXPIRE_TIME_BUCKET_MS interval, to report the backlog of keys
+ * already expired but not yet reclaimed cheaply. */
+#define EXPIRE_TIME_BUCKET_SHIFT 10
+#define EXPIRE_TIME_BUCKET_MS (1<<EXPIRE_TIME_BUCKET_SHIFT)
+
+/* The hashes having fields with an expire are tracked by 'hfields', mapping
+ * the key name to a sorted set of the fields scored by their expire time,
+ * and by 'hfields_by_time', having as elements the big endian expire time
+ * of the first field to expire followed by the key name, so that the due
+ * fields are found without scanning the hashes. See t_hash.c. */
+typedef struct expireIndex {
+    expireEntry *entries;
+    unsigned long len;          /* Number of keys with an expire. */
+    unsigned long size;         /* Number of allocated entries. */
+    rax *by_time;               /* Keys by expire time, or NULL. */
+    rax *buckets;               /* Keys count by expire time bucket. */
+    dict *hfields;              /* Field expires of the hashes. */
+    rax *hfields_by_time;       /* Hashes by first field expire time. */
+} expireIndex;
+
+#define expireIndexSize(ei) ((ei)->len)
+#define dbKeyMeta(db,de) ((keyMeta*)dictMetadata((db)->dict,(de)))
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
-    dict *expires;              /* Timeout of keys with a timeout set */
+    expireIndex *expires;       /* Timeout of keys with a timeout set */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
+    dict *blocking_streams;     /* Clients of blocking_keys waiting for stream
+                                   keys, indexed by consumer group. */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    dict *locked_keys;          /* Keys locked by a command in progress */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
     unsigned long expires_cursor; /* Cursor of the active expire cycle. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
+    long long stat_keyspace_hits;   /* Lookups accounted by keyspace-stats, */
+    long long stat_keyspace_misses; /* see keystats.c. */
+    long long stat_keyspace_writes;
+    long long used_memory;      /* Memory used by the keys, see dbstats.c. */
+    long long stat_ops;         /* Commands executed with this DB selected. */
+    long long stat_cpu_usec;    /* Time spent executing them. */
+    long long stat_evictedkeys; /* Keys evicted from this DB. */
+    struct clusterSlotToKeyMapping *slots_to_keys; /* Keys by hash slot, only
+                                                      in cluster mode. */
+    rax *keys_index;            /* Key names in lexicographic order, only with
+                                   keyspace-ordered-index. */
+    unsigned long keys_reply_jobs; /* Streamed KEYS replies in progress. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
 typedef struct multiCmd {
     robj **argv;
     int argc;
+    int argv_len;           /* Size of argv, see client->argv_len. */
     struct redisCommand *cmd;
 } multiCmd;
 
 typedef struct multiState {
     multiCmd *commands;     /* Array of MULTI commands */
     int count;              /* Total number of MULTI commands */
+    int alloc_count;        /* Number of commands the array can hold. */
     int cmd_flags;          /* The accumulated command flags OR-ed together.
                                So if at least a command has a given flag, it
                                will be set in this field. */
@@ -760,9 +1019,17 @@ typedef struct blockingState {
     mstime_t xread_retry_time, xread_retry_ttl;
     int xread_group_noack;
 
-    /* BLOCKED_WAIT */
+    /* BLOCKED_WAIT, BLOCKED_WAITAOF and BLOCKED_OFFSET */
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
-    long long reploffset;   /* Replication offset to reach. */
+    long long reploffset;   /* Replication (or AOF) offset to reach. */
+    listNode *wait_node;    /* Node in server.clients_waiting_acks or
+                               server.clients_waiting_offset. */
+
+    /* BLOCKED_CLUSTER_READ */
+    struct clusterCrossSlotRead *cross_slot_read; /* See cluster.c. */
+
+    /* BLOCKED_TIERED */
+    int tiered_pending;     /* Values still to read from the tiered storage. */
 
     /* BLOCKED_MODULE */
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
@@ -803,6 +1070,8 @@ typedef struct readyList {
                                            no AUTH is needed, and every
                                            connection is immediately
                                            authenticated. */
+#define USER_AUTH_CACHE_SIZE 8 /* Passwords remembered per user, see
+                                  ACLCheckUserCredentials(). */
 typedef struct user {
     sds name;       /* The username as an SDS string. */
     uint64_t flags; /* See USER_FLAG_* */
@@ -826,6 +1095,14 @@ typedef struct user {
     list *patterns;  /* A list of allowed key patterns. If this field is NULL
                         the user cannot mention any key in a command, unless
                         the flag ALLKEYS is set in the user. */
+    struct aclKeyMatcher *keymatcher; /* The patterns compiled for matching,
+                                         see ACLCompileKeyPatterns(). */
+    /* Keyed hashes of the last passwords that authenticated the user, so
+     * that reconnecting clients skip the SHA256 hashing, see
+     * ACLCheckUserCredentials(). Cleared whenever the user is modified. */
+    uint64_t authcache[USER_AUTH_CACHE_SIZE];
+    int authcache_len;  /* Number of valid entries in authcache. */
+    int authcache_next; /* Next entry to replace when authcache is full. */
 } user;
 
 /* With multiplexing we need to take per-client state.
@@ -850,35 +1127,83 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    int argv_len;           /* Size of argv, reused across commands. */
+    robj *argv_pool[PROTO_ARGV_POOL_CLASSES]; /* Recycled argv objects. */
+    int argv_pool_len;      /* Number of objects in argv_pool. */
+    struct parsedCommand *parsed_cmds; /* Commands of the query buffer already
+                                          parsed by the I/O threads, see
+                                          parseMasterStreamUsingThreads(). */
+    int parsed_cmds_count;  /* Number of commands in parsed_cmds. */
+    int parsed_cmds_pos;    /* Next command of parsed_cmds to execute. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
+    int slot;               /* Hash slot of the keys of the command being
+                               executed, or -1, see getKeySlot(). */
+    long long io_thread_cmd_duration; /* Execution time of the command run by
+                                         an I/O thread, if CLIENT_IO_THREAD_CMD
+                                         is set. */
+    /* Latency breakdown, only tracked if latency-tracking-breakdown is on. */
+    ustime_t read_ustime;   /* Time the pending request was read, or 0. */
+    ustime_t queue_usec;    /* Time the current command waited to be
+                               dispatched after it was read. */
+    ustime_t reply_ustime;  /* Time the pending replies were produced, or 0. */
+    long long slowlog_id;   /* SLOWLOG entry of the pending replies, or -1. */
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
                                anything (admin). */
+    sds acl_key;            /* Last key the ACL of the user allowed. */
+    unsigned long long acl_key_version; /* Version of the key patterns that
+                                           allowed acl_key, or 0. */
+    int *cmd_keys;          /* Keys of the command, see getClientCommandKeys(). */
+    int cmd_numkeys;
+    struct redisCommand *cmd_keys_cmd; /* Command of cmd_keys, or NULL. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    unsigned long long reply_spilled_bytes; /* Part of reply_bytes spilled
+                                               to disk. */
+    listNode *reply_spill_last; /* Last block of the reply list considered
+                                   for spilling to disk, NULL if none. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
+    /* Resources used by the client so far, see CLIENT LIST. */
+    unsigned long long stat_net_input_bytes;  /* Bytes of the queries. */
+    unsigned long long stat_net_output_bytes; /* Bytes of the replies. */
+    unsigned long long stat_commands; /* Commands executed. */
+    unsigned long long stat_cmd_usec; /* Time spent executing them. */
     time_t lastinteraction; /* Time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
     uint64_t flags;         /* Client flags: CLIENT_* macros. */
     int authenticated;      /* Needed when the default user requires auth. */
     int replstate;          /* Replication state if this is a slave. */
     int repl_put_online_on_ack; /* Install slave write handler on first ACK. */
+    int repl_rdb_spooled;   /* Diskless RDB sent from the spool file. */
+    int repl_rdb_throttled; /* Diskless RDB transfer over the max rate. */
     int repldbfd;           /* Replication DB file descriptor. */
     off_t repldboff;        /* Replication DB file offset. */
     off_t repldbsize;       /* Replication DB file size. */
     sds replpreamble;       /* Replication DB preamble. */
     long long read_reploff; /* Read replication offset if this is a master. */
     long long reploff;      /* Applied replication offset if this is a master. */
-    long long repl_ack_off; /* Replication ack offset, if this is a slave. */
+    long long repl_ack_off; /* Replication ack offset, if this is a slave,
+                               or the last one we sent to our master. */
     long long repl_ack_time;/* Replication ack time, if this is a slave. */
     long long psync_initial_offset; /* FULLRESYNC reply offset other slaves
                                        copying this slave output buffer
                                        should use. */
+    listNode *ref_repl_buf_node; /* Block of the shared replication buffer
+                                    this slave is sending, or NULL. */
+    size_t ref_block_pos;   /* Bytes of the referenced block already sent. */
+    int repl_compress;      /* Compressed replication stream, see
+                               replicationWriteCompressedStream(). */
+    char *repl_compress_buf; /* Frame being sent (slave), or frames being
+                                received (master). */
+    size_t repl_compress_len;  /* Bytes of repl_compress_buf in use. */
+    size_t repl_compress_sent; /* Slave: bytes of the frame already sent. */
+    struct replCdc *repl_cdc; /* Filter of a change data capture slave, see
+                                 REPLCONF cdc-db and cdc-prefix. */
     char replid[CONFIG_RUN_ID_SIZE+1]; /* Master replication ID (if master). */
     int slave_listening_port; /* As configured with: SLAVECONF listening-port */
     char slave_ip[NET_IP_STR_LEN]; /* Optionally given by REPLCONF ip-address */
@@ -887,20 +1212,39 @@ typedef struct client {
     int btype;              /* Type of blocking op if CLIENT_BLOCKED. */
     blockingState bpop;     /* blocking state */
     long long woff;         /* Last write global replication offset. */
+    long long aof_woff;     /* Last write AOF offset, see WAITAOF. */
+    long long write_reploff; /* Replication offset after the last command
+                                that modified the dataset, see
+                                CLIENT WRITEOFFSET. */
     list *watched_keys;     /* Keys WATCHED for MULTI/EXEC CAS */
     dict *pubsub_channels;  /* channels a client is interested in (SUBSCRIBE) */
+    dict *pubsubshard_channels; /* sharded channels a client is interested
+                                   in (SSUBSCRIBE) */
     list *pubsub_patterns;  /* patterns a client is interested in (SUBSCRIBE) */
     sds peerid;             /* Cached peer ID. */
     listNode *client_list_node; /* list node in client list */
+    listNode *throttled_node; /* Node in server.clients_throttled, valid
+                                 while CLIENT_THROTTLED is set. */
+    size_t last_memory_usage; /* Memory of the client as last accounted in
+                                 server.stat_clients_*_memory, see
+                                 updateClientMemUsage(). */
+    int last_memory_slave;  /* Accounted as a slave, not a normal client. */
+    int mem_usage_bucket;   /* Index in server.client_mem_usage_buckets, or
+                               -1 if the client can't be evicted. */
+    listNode *mem_usage_bucket_node; /* Node of the client in its bucket. */
 
     /* If this client is in tracking mode and this field is non zero,
      * invalidation messages for keys fetched by this client will be send to
      * the specified client ID. */
     uint64_t client_tracking_redirection;
+    rax *client_tracking_prefixes; /* A dictionary of prefixes we are already
+                                      subscribed to in BCAST mode, in the
+                                      context of client side caching. */
 
-    /* Response buffer */
+    /* Response buffer of PROTO_REPLY_CHUNK_BYTES, taken from a pool on
+     * demand and given back once empty, see releaseClientIdleBuffers(). */
     int bufpos;
-    char buf[PROTO_REPLY_CHUNK_BYTES];
+    char *buf;
 } client;
 
 struct saveparam {
@@ -920,13 +1264,18 @@ struct sharedObjectsStruct {
     *emptyarray, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *noscripterr, *loadingerr, *slowscripterr, *bgsaveerr,
     *masterdownerr, *roslaveerr, *execaborterr, *noautherr, *noreplicaserr,
-    *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
-    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *unlink,
+    *busykeyerr, *oomerr, *dboomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
+    *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *smessagebulk,
+    *ssubscribebulk, *sunsubscribebulk, *del, *unlink,
     *rpop, *lpop, *lpush, *rpoplpush, *zpopmin, *zpopmax, *emptyscan,
     *select[PROTO_SHARED_SELECT_CMDS],
-    *integers[OBJ_SHARED_INTEGERS],
     *mbulkhdr[OBJ_SHARED_BULKHDR_LEN], /* "*<value>\r\n" */
-    *bulkhdr[OBJ_SHARED_BULKHDR_LEN];  /* "$<value>\r\n" */
+    *bulkhdr[OBJ_SHARED_BULKHDR_LEN],  /* "$<value>\r\n" */
+    *maphdr[OBJ_SHARED_BULKHDR_LEN],   /* "%<value>\r\n" */
+    *sethdr[OBJ_SHARED_BULKHDR_LEN],   /* "~<value>\r\n" */
+    *bulkdouble[OBJ_SHARED_DOUBLES],   /* "$<len>\r\n<value>\r\n" */
+    *resp3double[OBJ_SHARED_DOUBLES];  /* ",<value>\r\n" */
+    robj ***integers; /* Chunks of shared integers, see getSharedInteger(). */
     sds minstring, maxstring;
 };
 
@@ -1009,6 +1358,8 @@ struct redisMemOverhead {
     ssize_t allocator_rss_bytes;
     float rss_extra;
     size_t rss_extra_bytes;
+    float class_frag[ZMALLOC_CLASS_COUNT];
+    ssize_t class_frag_bytes[ZMALLOC_CLASS_COUNT];
     size_t num_dbs;
     struct {
         size_t dbid;
@@ -1033,9 +1384,12 @@ typedef struct rdbSaveInfo {
     int repl_id_is_set;  /* True if repl_id field is set. */
     char repl_id[CONFIG_RUN_ID_SIZE+1];     /* Replication ID. */
     long long repl_offset;                  /* Replication offset. */
+
+    /* Used only saving. */
+    int rdb_compression;    /* RDB_COMPRESSION_*, -1 for the configured one. */
 } rdbSaveInfo;
 
-#define RDB_SAVE_INFO_INIT {-1,0,"000000000000000000000000000000",-1}
+#define RDB_SAVE_INFO_INIT {-1,0,"000000000000000000000000000000",-1,-1}
 
 struct malloc_stats {
     size_t zmalloc_used;
@@ -1043,6 +1397,9 @@ struct malloc_stats {
     size_t allocator_allocated;
     size_t allocator_active;
     size_t allocator_resident;
+    /* Per allocation class, see zmalloc_class(). */
+    size_t class_allocated[ZMALLOC_CLASS_COUNT];
+    size_t class_active[ZMALLOC_CLASS_COUNT];
 };
 
 /*-----------------------------------------------------------------------------
@@ -1059,6 +1416,10 @@ typedef struct redisTLSContextConfig {
     char *ciphers;
     char *ciphersuites;
     int prefer_server_ciphers;
+    int ktls;
+    int session_caching;
+    int session_cache_size;
+    int session_cache_timeout;
 } redisTLSContextConfig;
 
 /*-----------------------------------------------------------------------------
@@ -1081,6 +1442,7 @@ struct clusterState;
 struct redisServer {
     /* General */
     pid_t pid;                  /* Main process pid. */
+    pthread_t main_thread_id;   /* Thread running the event loop. */
     char *configfile;           /* Absolute config file path, or NULL */
     char *executable;           /* Absolute executable file path. */
     char **exec_argv;           /* Executable argv vector (copy). */
@@ -1104,6 +1466,9 @@ struct redisServer {
     int sentinel_mode;          /* True if this instance is a Sentinel. */
     size_t initial_memory_usage; /* Bytes used after initialization. */
     int always_show_logo;       /* Show logo even for non-stdout logging. */
+    int keyspace_open_addressing; /* Use open addressing for DB dicts. */
+    int keyspace_ordered_index; /* Keep the key names in order, see SCAN. */
+    int expire_time_index;      /* Index keys by expire time. */
     /* Modules */
     dict *moduleapi;            /* Exported core APIs dictionary for modules. */
     dict *sharedapi;            /* Like moduleapi but containing the APIs that
@@ -1116,76 +1481,138 @@ struct redisServer {
     /* Networking */
     int port;                   /* TCP listening port */
     int tls_port;               /* TLS listening port */
+    int shards;                 /* Number of shard processes to start. */
+    int shard_id;               /* Index of this shard, 0 if not sharded. */
     int tcp_backlog;            /* TCP listen() backlog */
     char *bindaddr[CONFIG_BINDADDR_MAX]; /* Addresses we should bind to */
     int bindaddr_count;         /* Number of addresses in server.bindaddr[] */
     char *unixsocket;           /* UNIX socket path */
     mode_t unixsocketperm;      /* UNIX socket permission */
+    char *shm_socket;           /* Shared memory transport socket path */
+    long long shm_ring_size;    /* Size of the shared memory rings */
     int ipfd[CONFIG_BINDADDR_MAX]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
     int tlsfd[CONFIG_BINDADDR_MAX]; /* TLS socket file descriptors */
     int tlsfd_count;            /* Used slots in tlsfd[] */
     int sofd;                   /* Unix socket file descriptor */
+    int shmfd;                  /* Shared memory transport socket fd */
     int cfd[CONFIG_BINDADDR_MAX];/* Cluster bus listening socket */
     int cfd_count;              /* Used slots in cfd[] */
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
     list *clients_pending_read;  /* Client has pending read socket buffers. */
+    list *clients_throttled;    /* Clients whose read was delayed. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* Current client executing the command. */
+    struct redisCommand *executing_cmd; /* Command being executed by call(),
+                                           also from Lua and modules. */
     long fixed_time_expire;     /* If > 0, expire keys against server.mstime. */
     rax *clients_index;         /* Active clients dictionary by client ID. */
     int clients_paused;         /* True if clients are currently paused */
     mstime_t clients_pause_end_time; /* Time when we undo clients_paused */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
+    list *migrate_jobs;         /* MIGRATE commands in progress */
+    list *setop_jobs;           /* Background set operations in progress */
+    long long setop_timer_id;   /* Timer running the set operations. */
+    list *reply_jobs;           /* Replies streamed in the background */
+    long long reply_timer_id;   /* Timer producing the replies. */
     _Atomic uint64_t next_client_id; /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
     int gopher_enabled;         /* If true the server will reply to gopher
                                    queries. Will still serve RESP2 queries. */
     int io_threads_num;         /* Number of IO threads to use. */
+    int lazyfree_threads;       /* Number of lazyfree threads to use. */
+    int accept_threads_num;     /* Number of threads accepting TCP clients. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_do_commands; /* Execute read only commands in IO threads? */
+    char *server_cpulist;       /* CPUs of the main and the I/O threads. */
+    char *bio_cpulist;          /* CPUs of the background threads. */
+    char *aof_rewrite_cpulist;  /* CPUs of the AOF rewrite child. */
+    char *bgsave_cpulist;       /* CPUs of the RDB children. */
+    int io_threads_executing;   /* True while IO threads may execute commands:
+                                   the main thread is waiting and the dataset
+                                   must be accessed in a read only way. */
 
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
+    int async_loading;          /* Loading a new data set in the background
+                                   while serving reads from the current one,
+                                   see REPL_DISKLESS_LOAD_ASYNC. */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
-    struct redisCommand *delCommand, *multiCommand, *lpushCommand,
+    struct redisCommand *delCommand, *hdelCommand, *multiCommand, *lpushCommand,
                         *lpopCommand, *rpopCommand, *zpopminCommand,
                         *zpopmaxCommand, *sremCommand, *execCommand,
                         *expireCommand, *pexpireCommand, *xclaimCommand,
-                        *xgroupCommand;
+                        *xgroupCommand, *xaddCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
+    long long stat_expired_hash_fields; /* Number of expired hash fields */
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
-    long long stat_keyspace_hits;   /* Number of successful lookups of keys */
-    long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    long long stat_evictedclients;  /* Clients evicted (maxmemory-clients) */
+    long long stat_background_evictedkeys; /* Evicted by the background cycle */
+    long long stat_tiered_swap_outs; /* Values moved to the tiered storage. */
+    long long stat_tiered_swap_ins; /* Values read back from the tiered storage. */
+    long long stat_tiered_async_reads; /* Reads performed by the bio thread. */
+    long long stat_keyspace_async_resizes; /* Keyspace tables allocated by
+                                              the bio thread. */
+    _Atomic long long stat_keyspace_hits;   /* Number of successful lookups of keys */
+    _Atomic long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    long long stat_io_threaded_commands; /* Commands executed by IO threads. */
+    long long stat_throttled_reads; /* Reads delayed by eventloop-latency-target */
+    long long stat_repl_parallel_parsed; /* Master commands parsed by threads. */
+    _Atomic long long stat_string_compressions; /* Strings compressed. */
+    long long stat_string_decompressions; /* Compressed strings made RAW. */
+    long long stat_auth_usec;       /* Time spent checking AUTH credentials. */
+    long long stat_auth_cache_hits; /* Credentials found in the users cache. */
+    long long stat_auth_cache_misses; /* Credentials that had to be hashed. */
+    long long stat_pipeline_batches[STATS_PIPELINE_BUCKETS]; /* Histogram of
+                                        commands processed per query buffer. */
     long long stat_active_defrag_hits;      /* number of allocations moved */
     long long stat_active_defrag_misses;    /* number of allocations scanned but not moved */
     long long stat_active_defrag_key_hits;  /* number of keys with moved allocations */
     long long stat_active_defrag_key_misses;/* number of keys scanned and not moved */
+    long long stat_tracking_evicted_keys; /* Keys evicted from the tracking
+                                             table because of its limit. */
     long long stat_active_defrag_scanned;   /* number of dictEntries scanned */
     size_t stat_peak_memory;        /* Max used memory record */
+    size_t stat_clients_normal_memory; /* Memory of the normal clients, */
+    size_t stat_clients_slaves_memory; /* and of the slaves, kept updated
+                                          by updateClientMemUsage(). */
+    list *client_mem_usage_buckets[CLIENT_MEM_USAGE_BUCKETS]; /* Clients
+                                          that can be evicted, by memory. */
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
+    long long stat_sync_diskless_spooled; /* Replicas switched to the spool file. */
+    long long stat_repl_compress_in;  /* Replication stream bytes compressed. */
+    long long stat_repl_compress_out; /* The same bytes after compression. */
     list *slowlog;                  /* SLOWLOG list of commands */
     long long slowlog_entry_id;     /* SLOWLOG current entry ID */
     long long slowlog_log_slower_than; /* SLOWLOG time limit (to get logged) */
     unsigned long slowlog_max_len;     /* SLOWLOG max number of items logged */
+    dict *slowlog_shapes;           /* SLOWLOG SHAPES statistics, by shape */
+    unsigned long slowlog_shapes_max_len; /* Max number of shapes, 0 = off */
+    long long slowlog_sample_ratio; /* Log 1 slow command out of N */
+    long long keyspace_stats_sample_ratio; /* Account 1 lookup out of N in
+                                              INFO keystats, 0 = off. */
+    char *keyspace_stats_prefixes;  /* Prefixes of keyspace-stats, as set. */
+    rax *keyspace_stats;            /* Counters of the prefixes. */
+    unsigned long long keyspace_stats_counter; /* Lookups, for sampling. */
     struct malloc_stats cron_malloc_stats; /* sampled in serverCron(). */
     _Atomic long long stat_net_input_bytes; /* Bytes read from network. */
     _Atomic long long stat_net_output_bytes; /* Bytes written to network. */
@@ -1207,7 +1634,9 @@ struct redisServer {
     int active_expire_enabled;      /* Can be disabled for testing purposes. */
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */
     int active_defrag_enabled;
+    int active_defrag_thread;          /* Defrag in a thread while the main thread sleeps */
     int jemalloc_bg_thread;         /* Enable jemalloc background thread */
+    int keyspace_hugepages;         /* Back the keyspace with huge pages. */
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */
     int active_defrag_threshold_lower; /* minimum percentage of fragmentation to start active defrag */
     int active_defrag_threshold_upper; /* maximum percentage of fragmentation at which we use maximum effort */
@@ -1220,6 +1649,9 @@ struct redisServer {
     int supervised_mode;            /* See SUPERVISED_* */
     int daemonize;                  /* True if running as a daemon */
     clientBufferLimitsConfig client_obuf_limits[CLIENT_TYPE_OBUF_COUNT];
+    long long client_obuf_spill_threshold; /* Spill output buffers bigger
+                                              than this to disk. */
+    long long client_obuf_spill_max_size;  /* Max bytes spilled per client. */
     /* AOF persistence */
     int aof_enabled;                /* AOF configuration */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
@@ -1237,6 +1669,11 @@ struct redisServer {
     list *aof_rewrite_buf_blocks;   /* Hold changes during an AOF rewrite. */
     sds aof_buf;      /* AOF buffer, written before entering the event loop */
     int aof_fd;       /* File descriptor of currently selected AOF file */
+    long long aof_written_offset;  /* Bytes written to the AOF since startup. */
+    long long aof_fsync_pending_offset; /* Written offset when the latest
+                                           background fsync started. */
+    long long aof_fsynced_offset;  /* Written offset known to be on disk. */
+    list *clients_waiting_aof;     /* Clients blocked in WAITAOF. */
     int aof_selected_db; /* Currently selected DB in AOF */
     time_t aof_flush_postponed_start; /* UNIX time of postponed AOF flush */
     time_t aof_last_fsync;            /* UNIX time of last fsync() */
@@ -1250,6 +1687,15 @@ struct redisServer {
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     int aof_use_rdb_preamble;       /* Use RDB preamble on AOF rewrites. */
+    int aof_multi_part;             /* Split the AOF in a base and increments. */
+    int aof_background_write;       /* Write the AOF buffer in a thread. */
+    unsigned long long stat_aof_writer_ring_full; /* Flushes delayed because
+                                                     the writer ring was full. */
+    sds aof_base_name;              /* Multi part AOF: base file, or NULL. */
+    long long aof_seq;              /* Multi part AOF: last sequence used. */
+    long long aof_incr_first;       /* Multi part AOF: first increment, from
+                                       here to aof_seq. 0 means no increment. */
+    long long aof_rewrite_seq;      /* Multi part AOF: base being rewritten. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -1268,7 +1714,9 @@ struct redisServer {
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
     int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression_algorithm;  /* RDB_COMPRESSION_* used by RDB saves. */
     int rdb_checksum;               /* Use RDB checksum? */
+    int rdb_save_scripts;           /* Persist the Lua scripts cache? */
     time_t lastsave;                /* Unix time of last successful save */
     time_t lastbgsave_try;          /* Unix time of last attempted bgsave */
     time_t rdb_save_time_last;      /* Time used by last RDB save run. */
@@ -1284,10 +1732,43 @@ struct redisServer {
     int rdb_pipe_numconns_writing;  /* Number of rdb conns with pending writes. */
     char *rdb_pipe_buff;            /* In diskless replication, this buffer holds data */
     int rdb_pipe_bufflen;           /* that was read from the the rdb pipe. */
+    /* Decoupled diskless transfer, see rdbPipeRingInit(). */
+    char *rdb_pipe_ring;            /* Ring buffer of the data read from the pipe. */
+    long long rdb_pipe_ring_size;   /* Size of rdb_pipe_ring. */
+    long long rdb_pipe_ring_start;  /* Stream offset of the oldest byte kept. */
+    long long rdb_pipe_ring_end;    /* Stream offset of the next byte read. */
+    int rdb_pipe_read_paused;       /* Ring full: the pipe is not read. */
+    int rdb_pipe_eof;               /* The child closed the pipe. */
+    int rdb_pipe_spool_fd;          /* Spool file of the lagging replicas. */
+    long long rdb_pipe_spool_base;  /* Stream offset of the first spooled byte. */
+    long long rdb_pipe_start_ms;    /* Transfer start time, for the max rate. */
+    long long rdb_pipe_timer_id;    /* Timer of the decoupled transfer. */
     int rdb_key_save_delay;         /* Delay in microseconds between keys while
                                      * writing the RDB. (for testings) */
     int key_load_delay;             /* Delay in microseconds between keys while
                                      * loading aof or rdb. (for testings) */
+    int rdb_load_threads;           /* Threads decoding values while loading. */
+    int rdb_lazy_load;              /* Leave the values in the RDB file at startup. */
+    int rdb_save_threads;           /* Threads serializing values while saving. */
+    int rdb_forkless_save;          /* BGSAVE without forking a child. */
+    struct rdbForkless *rdb_forkless; /* Fork-less save in progress or NULL. */
+    unsigned int rdb_forkless_epoch; /* Epoch of the current or last
+                                        fork-less save. */
+    unsigned int rdb_forkless_aborted; /* Fork-less saves aborted since the
+                                          last successful one. */
+    unsigned long long stat_rdb_forkless_copied; /* Keys written on access
+                                                    by the last save. */
+    /* Differential RDB snapshots, see rdbdelta.c. */
+    int rdb_delta_snapshots;        /* Track the keys for BGSAVE DELTA. */
+    dict **rdb_delta_keys;          /* Keys modified since the base, by DB. */
+    dict **rdb_delta_saving_keys;   /* Keys of the old base while a full save
+                                       is in progress, or NULL. */
+    int rdb_delta_base_valid;       /* The RDB file plus the keys tracked are
+                                       the data set. */
+    int rdb_delta_child;            /* The RDB child is writing a delta. */
+    uint64_t rdb_delta_load_cksum;  /* Base of the delta being loaded. */
+    sds bgload_filename;            /* File BGLOAD is loading, or NULL. */
+    int lastbgload_status;          /* C_OK or C_ERR */
     /* Pipe and data structures for child -> parent info sharing. */
     int child_info_pipe[2];         /* Pipe used to write the child_info_data. */
     struct {
@@ -1309,15 +1790,23 @@ struct redisServer {
     long long second_replid_offset; /* Accept offsets up to this for replid2. */
     int slaveseldb;                 /* Last SELECTed DB in replication output */
     int repl_ping_slave_period;     /* Master pings the slave every N seconds */
-    char *repl_backlog;             /* Replication backlog for partial syncs */
-    long long repl_backlog_size;    /* Backlog circular buffer size */
-    long long repl_backlog_histlen; /* Backlog actual data length */
-    long long repl_backlog_idx;     /* Backlog circular buffer current offset,
-                                       that is the next byte will'll write to.*/
-    long long repl_backlog_off;     /* Replication "master offset" of first
-                                       byte in the replication backlog buffer.*/
+    replBacklog *repl_backlog;      /* Replication backlog for partial syncs */
+    long long repl_backlog_size;    /* Backlog size */
+    list *repl_buffer_blocks;       /* Replication buffer blocks shared by
+                                       the backlog and the slaves. */
+    size_t repl_buffer_mem;         /* Memory used by repl_buffer_blocks. */
+    listNode *repl_buffer_spill_last; /* Last block of repl_buffer_blocks
+                                         considered for spilling to disk,
+                                         NULL if none. */
+    sds repl_batch;                 /* Replication stream accumulated while
+                                       executing a transaction, see
+                                       replicationBeginBatch(). */
     time_t repl_backlog_time_limit; /* Time without slaves after the backlog
                                        gets released. */
+    char *repl_backlog_filename;    /* Persistent backlog file, or NULL. */
+    long long repl_backlog_file_size; /* Data size of the backlog file. */
+    int repl_backlog_file_fd;       /* Backlog file descriptor, or -1. */
+    struct replBacklogFileHeader *repl_backlog_map; /* Mapped backlog file. */
     time_t repl_no_slaves_since;    /* We have no slaves since that time.
                                        Only valid if server.slaves len is 0. */
     int repl_min_slaves_to_write;   /* Min number of slaves to write. */
@@ -1327,6 +1816,13 @@ struct redisServer {
     int repl_diskless_load;         /* Slave parse RDB directly from the socket.
                                      * see REPL_DISKLESS_LOAD_* enum */
     int repl_diskless_sync_delay;   /* Delay to start a diskless repl BGSAVE. */
+    long long repl_diskless_sync_buffer; /* Decoupled diskless transfer buffer. */
+    long long repl_diskless_sync_max_rate; /* Diskless transfer bytes/sec per replica. */
+    int repl_compression;           /* Ask the master a compressed stream. */
+    int repl_compression_link;      /* The master accepted to compress the
+                                       stream of the current handshake. */
+    int repl_parallel_parse;        /* Parse the master stream using the I/O
+                                       threads when it accumulates. */
     /* Replication (slave) */
     char *masteruser;               /* AUTH with this user and masterauth with master */
     char *masterauth;               /* AUTH with this password with master */
@@ -1363,24 +1859,47 @@ struct redisServer {
     list *repl_scriptcache_fifo;        /* First in, first out LRU eviction. */
     unsigned int repl_scriptcache_size; /* Max number of elements. */
     /* Synchronous replication. */
-    list *clients_waiting_acks;         /* Clients waiting in WAIT command. */
+    list *clients_waiting_acks;         /* Clients waiting in WAIT command,
+                                           by ascending offset. */
+    list *clients_waiting_offset;       /* Clients waiting in WAITOFFSET,
+                                           by ascending offset. */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
+    unsigned long long maxmemory_clients; /* Max memory of the clients. */
     int maxmemory_policy;           /* Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
+    int maxmemory_soft_limit;       /* % of maxmemory for background eviction */
+    int maxmemory_shadow_sampling;  /* Shadow LRU tracks 1 key out of N. */
+    unsigned long long *db_maxmemory; /* db-maxmemory of the DBs, by ID. */
+    int db_maxmemory_len;           /* Entries of the db_maxmemory array. */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
     int lfu_decay_time;             /* LFU counter decay factor. */
     long long proto_max_bulk_len;   /* Protocol bulk length maximum size. */
+    long long value_interning_max_size; /* Intern string values up to this
+                                           size, 0 to disable. */
+    dict *interned_values;          /* Interned string values, sds -> robj. */
+    long long shared_integers;      /* Integers in [0,shared_integers) are
+                                       shared objects, created lazily. */
+    long long keyspace_async_resize_threshold; /* Keyspace tables of this
+                                           size are allocated by a bio
+                                           thread, 0 to disable. */
+    /* Tiered storage */
+    int tiered_storage;             /* Move cold values to disk on eviction. */
+    char *tiered_storage_file;      /* Name of the tiered storage file. */
     /* Blocked clients */
     unsigned int blocked_clients;   /* # of clients executing a blocking cmd.*/
     unsigned int blocked_clients_by_type[BLOCKED_NUM];
     list *unblocked_clients; /* list of clients to unblock before next loop */
+    rax *clients_timeout_table; /* Blocked clients ordered by timeout. */
+    long long clients_timeout_timer_id; /* Timer of the nearest timeout. */
+    uint64_t clients_timeout_timer_when; /* When the timer fires. */
     list *ready_keys;        /* List of readyList structures for BLPOP & co */
     /* Client side caching. */
     unsigned int tracking_clients;  /* # of clients with tracking enabled.*/
-    int tracking_table_max_fill;    /* Max fill percentage. */
+    unsigned int tracking_table_max_keys; /* Max number of keys in tracking
+                                             table. */
     /* Sort parameters - qsort_r() is only available under BSD so we
      * have to take this state global, in order to pass it to sortCompare() */
     int sort_desc;
@@ -1388,17 +1907,32 @@ struct redisServer {
     int sort_bypattern;
     int sort_store;
     /* Zip structure config, see redis.conf for more information  */
-    size_t hash_max_ziplist_entries;
-    size_t hash_max_ziplist_value;
+    size_t hash_max_listpack_entries;
+    size_t hash_max_listpack_value;
     size_t set_max_intset_entries;
-    size_t zset_max_ziplist_entries;
-    size_t zset_max_ziplist_value;
+    size_t set_max_listpack_entries;
+    size_t set_max_listpack_value;
+    size_t zset_max_listpack_entries;
+    size_t zset_max_listpack_value;
+    long long setops_incremental_threshold; /* Min input size of background
+                                               set operations, 0 = never. */
+    long long replies_incremental_threshold; /* Min number of elements of
+                                                streamed replies, 0 = never. */
+    long long eventloop_latency_target; /* Milliseconds of the event loop
+                                           after which the reads of normal
+                                           clients wait, 0 = never. */
     size_t hll_sparse_max_bytes;
+    long long bitmap_roaring_min_bytes; /* Min size of roaring bitmaps. */
+    long long string_compression_threshold; /* Min size of the strings to
+                                               compress, 0 = never. */
+    char *string_compression_dict;  /* File with the compression dictionary. */
     size_t stream_node_max_bytes;
     int64_t stream_node_max_entries;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;
+    long long list_index_min_nodes;
     /* time cache */
     _Atomic time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */
@@ -1407,20 +1941,37 @@ struct redisServer {
     ustime_t ustime;            /* 'unixtime' in microseconds. */
     /* Pubsub */
     dict *pubsub_channels;  /* Map channels to list of subscribed clients */
-    list *pubsub_patterns;  /* A list of pubsub_patterns */
+    dict *pubsubshard_channels; /* Map sharded channels to list of
+                                   subscribed clients */
+    dict *pubsub_patterns;  /* Map patterns to list of subscribed clients */
+    rax *pubsub_patterns_prefixes; /* Literal prefix -> list of patterns. */
+    size_t pubsub_patterns_maxprefix; /* Longest prefix in the rax above. */
+    unsigned long pubsub_patterns_subscriptions; /* Clients x patterns. */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
+    char *notify_keyspace_events_stream; /* Stream of DB 0 where the events
+                                            are also appended, or NULL. */
+    long long notify_keyspace_events_stream_maxlen; /* Approx. max entries of
+                                                       the stream above. */
     /* Cluster */
     int cluster_enabled;      /* Is cluster enabled? */
     mstime_t cluster_node_timeout; /* Cluster node timeout. */
+    mstime_t cluster_fast_failover_timeout; /* Timeout to flag the masters
+                                               as failing, or 0. */
+    int cluster_hotkeys_sampling; /* Sample 1 command every N for the hot
+                                     keys, or 0. */
     char *cluster_configfile; /* Cluster auto-generated config file name. */
     struct clusterState *cluster;  /* State of the cluster */
+    pid_t cluster_slot_migration_child_pid; /* PID of the child streaming
+                                               a migrated slot, or -1. */
     int cluster_migration_barrier; /* Cluster replicas migration barrier. */
     int cluster_slave_validity_factor; /* Slave max data age for failover. */
     int cluster_require_full_coverage; /* If true, put the cluster down if
                                           there is at least an uncovered slot.*/
     int cluster_slave_no_failover;  /* Prevent slave from starting a failover
                                        if the master is in failure state. */
+    int cluster_cross_slot_reads;   /* Serve MGET of keys in different slots,
+                                       reading them from the other nodes. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1444,17 +1995,31 @@ struct redisServer {
     int lua_replicate_commands; /* True if we are doing single commands repl. */
     int lua_multi_emitted;/* True if we already proagated MULTI. */
     int lua_repl;         /* Script replication flags for redis.set_repl(). */
+    int lua_native_reply; /* True if the replies to the Lua client are
+                             pushed directly on the Lua stack. */
     int lua_timedout;     /* True if we reached the time limit for script
                              execution. */
     int lua_kill;         /* Kill the script if true. */
     int lua_always_replicate_commands; /* Default replication type. */
+    int lua_profiler;     /* Collect per line / per command script stats. */
     /* Lazy free */
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
     /* Latency monitor */
-    long long latency_monitor_threshold;
+    long long latency_monitor_threshold_us; /* Microseconds, 0 if disabled */
+    long long latency_history_len; /* Samples kept for every event. */
     dict *latency_events;
+    int latency_tracking_breakdown; /* Track queue and reply write times. */
+    /* Read to dispatch, and execution end to reply flush times. */
+    uint64_t latency_queue_histogram[LATENCY_HIST_BUCKETS];
+    uint64_t latency_write_histogram[LATENCY_HIST_BUCKETS];
+    struct eventLoopPhaseStats el_phases[EL_PHASE_NUM]; /* See INFO eventloop */
+    long long el_cycle_start;  /* Time the event loop woke up. */
+    long long el_events_start; /* Time ae started processing the events. */
+    long long el_events_excluded_usec; /* Time of serverCron() and of the
+                                          commands in this iteration, that
+                                          are accounted on their own. */
     /* ACLs */
     char *acl_filename;     /* ACL Users file. NULL if not configured. */
     /* Assert & bug reporting */
@@ -1472,11 +2037,6 @@ struct redisServer {
     redisTLSContextConfig tls_ctx_config;
 };
 
-typedef struct pubsubPattern {
-    client *client;
-    robj *pattern;
-} pubsubPattern;
-
 typedef void redisCommandProc(client *c);
 typedef int *redisGetKeysProc(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 struct redisCommand {
@@ -1498,6 +2058,8 @@ struct redisCommand {
                    ACLs. A connection is able to execute a given command if
                    the user associated to the connection has this command
                    bit set in the bitmap of allowed commands. */
+    uint64_t *latency_histogram; /* Latency of the calls, see latency.h.
+                                    Allocated on the first call. */
 };
 
 struct redisFunctionSym {
@@ -1537,9 +2099,55 @@ typedef struct {
     robj *subject;
     int encoding;
     int ii; /* intset iterator */
+    unsigned char *lpi; /* listpack iterator */
+    sds lpele; /* Last string element returned for listpacks. */
     dictIterator *di;
 } setTypeIterator;
 
+/* A set operation executed in the background, in time slices of the event
+ * loop, see setopStartJob() in t_set.c. The 'init', 'step' and 'free'
+ * callbacks implement the operation for a given data type. */
+typedef struct setopJob {
+    client *c;              /* Client blocked in the command, or NULL. */
+    redisDb *db;
+    struct redisCommand *cmd; /* Command propagated when the job is done. */
+    robj **argv;
+    int argc;
+    robj *dstkey;           /* Key receiving the result. */
+    robj **keys;            /* Input keys... */
+    robj **vals;            /* ...and their values, when 'state' is set. */
+    int numkeys;
+    char *event;            /* Keyspace event of the stored result. */
+    void *privdata;         /* Command options, released with zfree(). */
+    void *state;            /* Progress of the operation, NULL to start. */
+    robj *dst;              /* The result, once the operation is done. */
+    /* Create the state from the inputs, C_ERR if they have a wrong type. */
+    int (*init)(struct setopJob *job);
+    /* Run till 'deadline' (in microseconds), return 1 once 'dst' is set. */
+    int (*step)(struct setopJob *job, long long deadline);
+    /* Release the state and the partial result, if any. */
+    void (*free)(struct setopJob *job);
+    listNode *node;         /* Node in server.setop_jobs. */
+} setopJob;
+
+/* The reply of a read command over a big collection, produced in time
+ * slices of the event loop, see replyStartJob() in networking.c. The
+ * 'step' callback implements the reply for a given data type. */
+typedef struct replyJob {
+    client *c;              /* Client receiving the reply, or NULL. */
+    robj *val;              /* The collection, referenced by the job. */
+    redisDb *db;            /* The keyspace replied by KEYS, if 'val' is
+                               NULL. */
+    unsigned long cursor;   /* Position of the next element to reply. */
+    unsigned long remaining; /* Number of elements still to reply. */
+    int flags;              /* Options of the command, used by 'step'. */
+    /* Reply till 'deadline' (in microseconds), return 1 once done. */
+    int (*step)(struct replyJob *job, long long deadline);
+    void *state;            /* Private state of 'step', if any. */
+    void (*free)(struct replyJob *job); /* Release 'state', if set. */
+    listNode *node;         /* Node in server.reply_jobs. */
+} replyJob;
+
 /* Structure to hold hash iteration abstraction. Note that iteration over
  * hashes involves both fields and values. Because it is possible that
  * not both are required, store pointers in the iterator to avoid
@@ -1565,6 +2173,9 @@ typedef struct {
 
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
+extern dictType keylistDictType;
+extern dictType watchedKeysDictType;
+extern dictType streamBlockedDictType;
 extern dictType objectKeyPointerValueDictType;
 extern dictType objectKeyHeapPointerValueDictType;
 extern dictType setDictType;
@@ -1575,8 +2186,9 @@ extern dictType dbDictType;
 extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
+extern dictType hashFieldExpiresDictType;
+extern dictType internedValuesDictType;
 extern dictType replScriptCacheDictType;
-extern dictType keyptrDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1593,6 +2205,7 @@ void moduleTypeNameByID(char *name, uint64_t moduleid);
 void moduleFreeContext(struct RedisModuleCtx *ctx);
 void unblockClientFromModule(client *c);
 void moduleHandleBlockedClients(void);
+void moduleHandleKeySnapshotRequests(void);
 void moduleBlockedClientTimedOut(client *c);
 void moduleBlockedClientPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask);
 size_t moduleCount(void);
@@ -1600,6 +2213,7 @@ void moduleAcquireGIL(void);
 void moduleReleaseGIL(void);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
 void moduleCallCommandFilters(client *c);
+int moduleHasCommandHooks(void);
 void ModuleForkDoneHandler(int exitcode, int bysignal);
 int TerminateModuleForkChild(int child_pid, int wait);
 ssize_t rdbSaveModulesAux(rio *rdb, int when);
@@ -1608,6 +2222,8 @@ sds modulesCollectInfo(sds info, const char *section, int for_crash_report, int
 void moduleFireServerEvent(uint64_t eid, int subid, void *data);
 void processModuleLoadingProgressEvent(int is_aof);
 int moduleTryServeClientBlockedOnKey(client *c, robj *key);
+int moduleDefragValue(robj *key, robj *value, long *defragged);
+int moduleLateDefrag(robj *key, robj *value, unsigned long *cursor, long long endtime, long long *defragged);
 void moduleUnblockClient(client *c);
 int moduleClientIsBlockedOnKeys(client *c);
 
@@ -1617,9 +2233,23 @@ long long mstime(void);
 void getRandomHexChars(char *p, size_t len);
 void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+uint64_t MurmurHash64A(const void *key, int len, unsigned int seed);
 void exitFromChild(int retcode);
 size_t redisPopcount(void *s, long count);
+void bitopsSelectKernels(void);
+const char *bitopsKernelsName(void);
+void bitopsBenchmark(client *c, long long bytes, long long iterations);
+void bitmapConvertToRaw(robj *o);
+void hllSelectKernels(void);
+const char *hllKernelsName(void);
+void hllUnionCacheInvalidateKey(redisDb *db, robj *key);
+void hllUnionCacheFlush(int dbid);
 void redisSetProcTitle(char *title);
+void redisSetCpuAffinity(const char *cpulist);
+void createPidFile(void);
+
+/* Shards */
+void shardsStart(int pidfile);
 
 /* networking.c -- Networking and Client related operations */
 client *createClient(connection *conn);
@@ -1627,6 +2257,11 @@ void closeTimedoutClients(void);
 void freeClient(client *c);
 void freeClientAsync(client *c);
 void resetClient(client *c);
+robj *createClientArgObject(client *c, const char *ptr, size_t len);
+void freeClientArgObject(client *c, robj *o);
+void freeClientArgvPool(client *c);
+void clientEnsureArgvLen(client *c, int argc);
+int processMultibulkBuffer(client *c);
 void sendReplyToClient(connection *conn);
 void *addReplyDeferredLen(client *c);
 void setDeferredArrayLen(client *c, void *node, long length);
@@ -1634,13 +2269,18 @@ void setDeferredMapLen(client *c, void *node, long length);
 void setDeferredSetLen(client *c, void *node, long length);
 void setDeferredAttributeLen(client *c, void *node, long length);
 void setDeferredPushLen(client *c, void *node, long length);
+void setDeferredReply(client *c, void *node, const char *s, size_t length);
 void processInputBuffer(client *c);
 void processInputBufferAndReplicate(client *c);
+int processCommandAndResetClient(client *c);
+void trackCommandQueueTime(client *c, ustime_t now);
+void trackReplyWriteTime(client *c);
 void processGopherRequest(client *c);
 void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptTLSHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void acceptShmHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(connection *conn);
 void addReplyNull(client *c);
 void addReplyNullArray(client *c);
@@ -1649,6 +2289,7 @@ void addReplyVerbatim(client *c, const char *s, size_t len, const char *ext);
 void addReplyProto(client *c, const char *s, size_t len);
 void AddReplyFromClient(client *c, client *src);
 void addReplyBulk(client *c, robj *obj);
+void addReplyBulkNoCopy(client *c, robj *obj);
 void addReplyBulkCString(client *c, const char *s);
 void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
@@ -1668,11 +2309,15 @@ void addReplyPushLen(client *c, long length);
 void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
-void copyClientOutputBuffer(client *dst, client *src);
+void copyReplicaOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
+void releaseClientIdleBuffers(client *c);
+size_t clientBufPoolMemory(void);
 void *dupClientReplyValue(void *o);
+int listMatchObjects(void *a, void *b);
+int addReplyProtoWithObject(client *c, const char *hdr, size_t hdrlen, robj *obj);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
 char *getClientPeerId(client *client);
@@ -1682,21 +2327,32 @@ void rewriteClientCommandVector(client *c, int argc, ...);
 void rewriteClientCommandArgument(client *c, int i, robj *newval);
 void replaceClientCommandVector(client *c, int argc, robj **argv);
 unsigned long getClientOutputBufferMemoryUsage(client *c);
+unsigned long getClientOutputBufferSpilledBytes(client *c);
+void updateClientMemUsage(client *c);
+void evictClients(void);
 void freeClientsInAsyncFreeQueue(void);
 void asyncCloseClientOnOutputBufferLimitReached(client *c);
+void clientInstallWriteHandler(client *c);
 int getClientType(client *c);
 int getClientTypeByName(char *name);
 char *getClientTypeName(int class);
 void flushSlavesOutputBuffers(void);
 void disconnectSlaves(void);
-int listenToPort(int port, int *fds, int *count);
+int listenToPort(int port, int *fds, int *count, int flags);
 void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
+void handleThrottledClients(void);
+int handleTLSHandshakesUsingThreads(list *conns);
+void parseMasterStreamUsingThreads(client *c);
+void freeClientParsedCommands(client *c);
+void initAcceptThreads(void);
 int stopThreadedIOIfNeeded(void);
+int ioThreadCanExecuteCommand(client *c);
+void ioThreadExecuteCommand(client *c);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
@@ -1704,7 +2360,21 @@ void linkClient(client *c);
 void protectClient(client *c);
 void unprotectClient(client *c);
 void initThreadedIO(void);
+void trackIOThreadsUtilization(void);
+sds genPipelineInfoString(sds info);
+sds genIOThreadsInfoString(sds info);
 client *lookupClientByID(uint64_t id);
+int replyCanBeStreamed(client *c, unsigned long numele);
+replyJob *replyStartJob(client *c, robj *val, unsigned long numele,
+                        int flags,
+                        int (*step)(replyJob *job, long long deadline));
+int replyJobShouldPause(replyJob *job, long long deadline);
+void replyFlushJobsOfValue(robj *val);
+void replyFlushJobsOfDb(redisDb *db);
+void replyFlushJobsOfKeys(redisDb *db, struct redisCommand *cmd,
+                          robj **argv, int argc);
+void replyFlushAllJobs(void);
+void unblockClientWaitingReply(client *c);
 
 #ifdef __GNUC__
 void addReplyErrorFormat(client *c, const char *fmt, ...)
@@ -1717,13 +2387,18 @@ void addReplyStatusFormat(client *c, const char *fmt, ...);
 #endif
 
 /* Client side caching (tracking mode) */
-void enableTracking(client *c, uint64_t redirect_to);
+void enableTracking(client *c, uint64_t redirect_to, int bcast, robj **prefixes, size_t numprefix);
 void disableTracking(client *c);
 void trackingRememberKeys(client *c);
 void trackingInvalidateKey(robj *keyobj);
 void trackingInvalidateKeysOnFlush(int dbid);
-void trackingLimitUsedSlots(void);
-unsigned long long trackingGetUsedSlots(void);
+void trackingLimitUsedKeys(void);
+unsigned long long trackingGetTotalKeys(void);
+unsigned long long trackingGetTotalItems(void);
+unsigned long long trackingGetTotalPrefixes(void);
+void trackingBroadcastInvalidationMessages(void);
+void trackingHandlePendingKeyInvalidations(void);
+int checkPrefixCollisionsOrReply(client *c, robj **prefixes, size_t numprefix);
 
 /* List data type */
 void listTypeTryConversion(robj *subject, robj *value);
@@ -1748,6 +2423,8 @@ void freeClientMultiState(client *c);
 void queueMultiCommand(client *c);
 void touchWatchedKey(redisDb *db, robj *key);
 void touchWatchedKeysOnFlush(int dbid);
+void touchAllWatchedKeysInDb(redisDb *emptied, redisDb *replaced_with);
+int watchedKeysTouched(client *c);
 void discardTransaction(client *c);
 void flagTransaction(client *c);
 void execCommandPropagateMulti(client *c);
@@ -1767,12 +2444,20 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len);
+size_t embeddedStringMaxLen(size_t size);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
+robj *tryObjectEncodingEx(robj *o, int try_compress);
+robj *tryObjectInterning(robj *o);
+void internedValuesCron(void);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+size_t objectComputeSize(robj *o, size_t sample_size);
+robj *getSharedInteger(long long value);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongLongForValue(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
@@ -1780,9 +2465,11 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSetListpackObject(void);
+robj *createRoaringObject(size_t len);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1823,7 +2510,10 @@ void replicationScriptCacheFlush(void);
 void replicationScriptCacheAdd(sds sha1);
 int replicationScriptCacheExists(sds sha1);
 void processClientsWaitingReplicas(void);
+void replicationSendAckIfNeeded(void);
 void unblockClientWaitingReplicas(client *c);
+void processClientsWaitingOffset(void);
+void unblockClientWaitingOffset(client *c);
 int replicationCountAcksByOffset(long long offset);
 void replicationSendNewlineToMaster(void);
 long long replicationGetSlaveOffset(void);
@@ -1832,15 +2522,35 @@ long long getPsyncInitialOffset(void);
 int replicationSetupSlaveForFullResync(client *slave, long long offset);
 void changeReplicationId(void);
 void clearReplicationId2(void);
+redisDb *disklessLoadCreateTempDbs(void);
+void disklessLoadDiscardTempDbs(redisDb *tempDb, int empty_db_flags);
+void disklessLoadSwapTempDbs(redisDb *tempDb, int empty_db_flags);
 void chopReplicationBacklog(void);
 void replicationCacheMasterUsingMyself(void);
-void feedReplicationBacklog(void *ptr, size_t len);
+void feedReplicationBuffer(char *buf, size_t len);
+void freeReplBufBlock(void *o);
+void replicationBeginBatch(void);
+void replicationFlushBatch(void);
+void replicationEndBatch(void);
+void incrementalTrimReplicationBacklog(size_t max_blocks);
+void freeReplicaReferencedReplBuffer(client *slave);
+void replBacklogFileOpen(void);
+void replBacklogFileSync(int sync);
+int replBacklogFileRestoreMaster(rdbSaveInfo *rsi);
+size_t replicationCompressFrame(client *c, const char *buf, size_t len);
+int replicationReadCompressedStream(client *c);
+int replicationCdcConfig(client *c, char *opt, robj *val, int *err);
+int replicationCdcFullResyncWithoutRdb(client *c);
+int replicationCdcHasPendingOutput(client *c);
+ssize_t replicationCdcWrite(client *c, replBufBlock *o);
+void replicationCdcFree(client *c);
 void rdbPipeReadHandler(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 void rdbPipeWriteHandlerConnRemoved(struct connection *conn);
+void rdbPipeRingInit(void);
 
 /* Generic persistence functions */
 void startLoadingFile(FILE* fp, char* filename, int rdbflags);
-void startLoading(size_t size, int rdbflags);
+void startLoading(size_t size, int rdbflags, int async);
 void loadingProgress(off_t pos);
 void stopLoading(int success);
 void startSaving(int rdbflags);
@@ -1861,6 +2571,8 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
+int loadAppendOnlyFiles(void);
+void aofInitMultiPart(void);
 void stopAppendOnly(void);
 int startAppendOnly(void);
 void backgroundRewriteDoneHandler(int exitcode, int bysignal);
@@ -1868,6 +2580,10 @@ void aofRewriteBufferReset(void);
 unsigned long aofRewriteBufferSize(void);
 ssize_t aofReadDiffFromParent(void);
 void killAppendOnlyChild(void);
+void processClientsWaitingAofFsync(void);
+void aofWriterInit(void);
+sds genAofWriterInfoString(sds info);
+void unblockClientWaitingAofFsync(client *c);
 void restartAOFAfterSYNC();
 
 /* Child info */
@@ -1947,14 +2663,17 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetReserve(robj *zobj, unsigned long size);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
+int zsetReencode(robj *zobj);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
+zskiplistNode *zslGetElementByRank(zskiplist *zsl, unsigned long rank);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
@@ -1973,12 +2692,20 @@ int getMaxmemoryState(size_t *total, size_t *logical, size_t *tofree, float *lev
 size_t freeMemoryGetNotCountedMemory();
 int freeMemoryIfNeeded(void);
 int freeMemoryIfNeededAndSafe(void);
+int dbFreeMemoryIfNeeded(redisDb *db);
+void backgroundEvictionCycle(void);
+void evictionShadowAccess(sds key, int hit);
+void evictionShadowReset(void);
+void evictionStatsReset(void);
+void addReplyEvictionStats(client *c);
 int processCommand(client *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
 struct redisCommand *lookupCommandOrOriginal(sds name);
 void call(client *c, int flags);
+void callIOThreadEpilogue(client *c);
+void trackReplyStart(client *c, ustime_t now, long long slowlog_id);
 void propagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int flags);
 void alsoPropagate(struct redisCommand *cmd, int dbid, robj **argv, int argc, int target);
 void redisOpArrayInit(redisOpArray *oa);
@@ -1999,13 +2726,21 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+dict *createDbDict(dictType *type);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
+long long getInstantaneousMetric(int metric);
 void adjustOpenFilesLimit(void);
 void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(int update_daylight_info);
 void resetServerStats(void);
 void activeDefragCycle(void);
+int activeDefragThreadNeedsGIL(void);
+void *activeDefragAlloc(void *ptr);
+void *activeDefragAllocWithClass(void *ptr, int cls);
+robj *activeDefragStringOb(robj* ob, long *defragged);
+int defragTimeIsUp(long long endtime);
+void activeDefragSetGILWanted(int wanted);
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -2031,6 +2766,17 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele);
 unsigned long setTypeRandomElements(robj *set, unsigned long count, robj *aux_set);
 unsigned long setTypeSize(const robj *subject);
 void setTypeConvert(robj *subject, int enc);
+void setTypeConvertAndExpand(robj *setobj, int enc, unsigned long cap);
+int setTypeReencode(robj *setobj);
+void setTypeReserve(robj *setobj, unsigned long size);
+int setopCanRunInBackground(client *c, unsigned long long numele);
+void setopStartJob(client *c, robj *dstkey, robj **keys, robj **vals,
+                   int numkeys, char *event, void *privdata,
+                   int (*init)(setopJob *job),
+                   int (*step)(setopJob *job, long long deadline),
+                   void (*free)(setopJob *job));
+void setopResetJobs(redisDb *db);
+void unblockClientWaitingSetop(client *c);
 
 /* Hash data type */
 #define HASH_SET_TAKE_FIELD (1<<0)
@@ -2038,6 +2784,8 @@ void setTypeConvert(robj *subject, int enc);
 #define HASH_SET_COPY 0
 
 void hashTypeConvert(robj *o, int enc);
+int hashTypeReencode(robj *o);
+void hashTypeReserve(robj *o, unsigned long size);
 void hashTypeTryConversion(robj *subject, robj **argv, int start, int end);
 int hashTypeExists(robj *o, sds key);
 int hashTypeDelete(robj *o, sds key);
@@ -2045,27 +2793,38 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll);
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll);
 sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what);
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll);
 sds hashTypeCurrentObjectNewSds(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(client *c, robj *key);
 robj *hashTypeGetValueObject(robj *o, sds field);
 int hashTypeSet(robj *o, sds field, sds value, int flags);
+robj *hashFieldExpiresGet(redisDb *db, sds key);
+long long hashFieldGetExpire(redisDb *db, sds key, sds field);
+void hashFieldSetExpire(redisDb *db, sds key, sds field, long long when);
+int hashFieldRemoveExpire(redisDb *db, sds key, sds field);
+void hashFieldExpiresDelKey(redisDb *db, sds key);
+robj *hashFieldExpiresDetach(redisDb *db, sds key);
+void hashFieldExpiresAttach(redisDb *db, sds key, robj *zobj);
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key);
+unsigned long hashActiveExpireFields(redisDb *db, long long now, unsigned long max);
 
 /* Pub / Sub */
 int pubsubUnsubscribeAllChannels(client *c, int notify);
 int pubsubUnsubscribeAllPatterns(client *c, int notify);
-void freePubsubPattern(void *p);
-int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
+int pubsubHasSubscribers(sds chan);
+int pubsubUnsubscribeShardAllChannels(client *c, int notify);
+void pubsubShardUnsubscribeChannelsInSlots(unsigned char *slots);
 void addReplyPubsubMessage(client *c, robj *channel, robj *msg);
 
 /* Keyspace events notification */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
+void notifyFlushKeyspaceEventsStream(void);
 int keyspaceEventsStringToFlags(char *classes);
 sds keyspaceEventsFlagsToString(int flags);
 
@@ -2081,10 +2840,25 @@ int rewriteConfig(char *path);
 int removeExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
+long long expireReferenceTime(void);
 long long getExpire(redisDb *db, robj *key);
+long long dbEntryGetExpire(redisDb *db, dictEntry *de);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
+expireIndex *expireIndexCreate(void);
+void expireIndexRelease(expireIndex *ei);
+void expireIndexEmpty(expireIndex *ei);
+void expireIndexExpand(expireIndex *ei, unsigned long size);
+void expireIndexRemoveEntry(redisDb *db, dictEntry *de);
+unsigned int expireIndexGetSomeKeys(expireIndex *ei, dictEntry **des, unsigned int count);
+int expireIndexFirstByTime(expireIndex *ei, long long *when, sds *key);
+unsigned long expireIndexCountDue(expireIndex *ei, long long now);
+void expireTimeEncode(unsigned char *buf, long long when);
+long long expireTimeDecode(unsigned char *buf);
 robj *lookupKey(redisDb *db, robj *key, int flags);
+void updateLFU(robj *val);
+int keyIsExpired(redisDb *db, robj *key);
 robj *lookupKeyRead(redisDb *db, robj *key);
+void lookupKeysPrefetch(redisDb *db, robj **keys, int count, int step);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
@@ -2096,6 +2870,7 @@ int objectSetLRUOrLFU(robj *val, long long lfu_freq, long long lru_idle,
                        long long lru_clock, int lru_multiplier);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
+#define LOOKUP_PREFETCH_BATCH 16 /* Keys per lookupKeysPrefetch() batch. */
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
@@ -2115,24 +2890,104 @@ long long dbTotalServerKeyCount();
 int selectDb(client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
+void scanDatabaseForReadyLists(redisDb *db);
+int commandTouchesLockedKeys(client *c);
+int keysLocked(redisDb *db, struct redisCommand *cmd, robj **argv, int argc);
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
 unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
-void slotToKeyAdd(robj *key);
-void slotToKeyDel(robj *key);
-void slotToKeyFlush(void);
+void slotToKeyInit(redisDb *db);
+void slotToKeyAddEntry(redisDb *db, dictEntry *de);
+void slotToKeyDelEntry(redisDb *db, dictEntry *de);
+void slotToKeyReplaceEntry(redisDb *db, dictEntry *de);
+void slotToKeyFlush(redisDb *db);
+void slotToKeyDestroy(redisDb *db);
+dictEntry *slotToKeyFirst(unsigned int hashslot);
+dictEntry *slotToKeyNext(dictEntry *de);
+void keysIndexInit(redisDb *db);
+void keysIndexAdd(redisDb *db, sds key);
+void keysIndexDel(redisDb *db, sds key);
+void keysIndexFlush(redisDb *db, int async);
+void keysIndexDestroy(redisDb *db);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
-void slotToKeyFlushAsync(void);
+void freeKeysIndexAsync(rax *rt);
+int dbDictExpandAllowed(dict *d, unsigned long size, double load);
+void dbDictResizeCron(void);
 size_t lazyfreeGetPendingObjectsCount(void);
 void freeObjAsync(robj *o);
+void lazyfreeFlushBatch(void);
+
+/* Background memory analysis */
+void memoryAnalyzeCommand(client *c);
+
+/* Keyspace access statistics */
+#define KEYSTATS_HIT 0
+#define KEYSTATS_MISS 1
+#define KEYSTATS_WRITE 2
+int keyspaceStatsSetPrefixes(const char *prefixes);
+void keyspaceStatsRecord(redisDb *db, robj *key, int type);
+void resetKeyspaceStats(void);
+sds genKeyspaceStatsInfoString(sds info);
+
+/* Per DB resource accounting */
+redisDb *dbMemoryAccountingSwitch(redisDb *db);
+void dbMemoryAccount(redisDb *db, long long delta);
+void dbMemoryAccountingReset(redisDb *db);
+long long dbObjectMemory(robj *val);
+long long dbArgvMemory(robj **argv, int argc, int unshared);
+unsigned long long dbGetMaxmemory(redisDb *db);
+void dbSetMaxmemory(int dbid, unsigned long long bytes);
+void dbStatsCron(void);
+
+/* Keyspace re-encoding */
+void reencodeStart(void);
+void reencodeCron(void);
+sds genReencodeInfoString(sds info);
+void resetDbStats(void);
+sds genDbStatsInfoString(sds info);
+
+/* Micro benchmarks */
+int microbenchMain(int argc, char **argv);
+
+/* Output buffers spilled to disk */
+void *spillStore(const void *p, size_t len);
+void spillRelease(void *p);
+void spillCron(void);
+size_t spillUsedBytes(void);
+
+/* Compressed strings */
+void stringCompressionInit(void);
+int stringTryCompress(robj *o);
+size_t stringCompressedLen(const robj *o);
+char *stringDecompressToScratch(const robj *o, size_t *len);
+void stringDecompress(robj *o);
+int stringCompressionCommandNeedsRaw(struct redisCommand *cmd);
+
+/* Tiered storage */
+void tieredInit(void);
+int tieredCanSwapOut(redisDb *db, dictEntry *de);
+int tieredSwapOut(redisDb *db, dictEntry *de);
+robj *tieredSwapIn(redisDb *db, dictEntry *de);
+robj *tieredLoadValue(robj *o, robj *key);
+ssize_t tieredSaveValue(rio *rdb, robj *o);
+void tieredFreeValue(tieredValue *tv);
+int tieredBlockForValues(client *c);
+void unblockClientWaitingTiered(client *c);
+void tieredCron(void);
+int tieredLazyLoadStart(int fd);
+robj *tieredCreateLazyValue(int type, int rdbtype, off_t offset, size_t len);
+void tieredLazyLoadCron(void);
+sds genTieredInfoString(sds info);
 
 /* API to get key arguments from commands */
 int *getKeysFromCommand(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 void getKeysFreeResult(int *result);
+int *getClientCommandKeys(client *c, int *numkeys);
+void resetClientCommandKeys(client *c);
 int *zunionInterGetKeys(struct redisCommand *cmd,robj **argv, int argc, int *numkeys);
 int *evalGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *sortGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
@@ -2144,16 +2999,25 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
 void clusterInit(void);
 unsigned short crc16(const char *buf, int len);
 unsigned int keyHashSlot(char *key, int keylen);
+int getKeySlot(sds key);
 void clusterCron(void);
 void clusterPropagatePublish(robj *channel, robj *message);
 void migrateCloseTimedoutSockets(void);
+void migrateJobsCron(void);
+void migrateAbortJobs(redisDb *db);
+void unblockClientWaitingMigrate(client *c);
+void unblockClientWaitingCrossSlotRead(client *c);
 void clusterBeforeSleep(void);
 int clusterSendModuleMessageToTarget(const char *target, uint64_t module_id, uint8_t type, unsigned char *payload, uint32_t len);
+void clusterFeedSlotMigration(robj **argv, int argc);
+void clusterSlotMigrationChildDone(int exitcode, int bysignal);
+void clusterAbortSlotImport(client *c);
 
 /* Sentinel */
 void initSentinelConfig(void);
 void initSentinel(void);
 void sentinelTimer(void);
+void sentinelBeforeSleep(void);
 char *sentinelHandleConfiguration(char **argv, int argc);
 void sentinelIsRunning(void);
 
@@ -2168,6 +3032,18 @@ int ldbRemoveChild(pid_t pid);
 void ldbKillForkedSessions(void);
 int ldbPendingChildren(void);
 sds luaCreateFunction(client *c, lua_State *lua, robj *body);
+void luaReplyPushBulk(client *c, const char *s, size_t len);
+void luaReplyPushLongLong(client *c, long long ll);
+void luaReplyPushStatus(client *c, const char *s, size_t len, int prefix);
+void luaReplyPushNull(client *c);
+void luaReplyPushBool(client *c, int b);
+void luaReplyPushAggregateLen(client *c, long len, int prefix);
+void *luaReplyPushDeferredLen(client *c);
+void luaReplySetDeferredLen(client *c, void *handle, long len, int prefix);
+
+/* True if the replies to 'c' must be pushed on the Lua stack by the
+ * luaReplyPush...() functions instead of being emitted as protocol. */
+#define luaNativeReply(c) ((c)->flags & CLIENT_LUA && server.lua_native_reply)
 
 /* Blocked clients */
 void processUnblockedClients(void);
@@ -2175,11 +3051,15 @@ void blockClient(client *c, int btype);
 void unblockClient(client *c);
 void queueClientForReprocessing(client *c);
 void replyToBlockedClientTimedOut(client *c);
+void addClientToTimeoutTable(client *c);
+void removeClientFromTimeoutTable(client *c);
+void handleBlockedClientsTimeout(void);
 int getTimeoutFromObjectOrReply(client *c, robj *object, mstime_t *timeout, int unit);
 void disconnectAllBlockedClients(void);
 void handleClientsBlockedOnKeys(void);
 void signalKeyAsReady(redisDb *db, robj *key);
 void blockForKeys(client *c, int btype, robj **keys, int numkeys, mstime_t timeout, robj *target, streamID *ids);
+void freeStreamBlockedClients(void *privdata, void *val);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
@@ -2187,6 +3067,7 @@ void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
 size_t getSlaveKeyWithExpireCount(void);
+unsigned long long getExpiredBacklog(long long *lag);
 
 /* evict.c -- maxmemory handling and LRU eviction. */
 void evictionPoolAlloc(void);
@@ -2199,6 +3080,10 @@ unsigned long LFUDecrAndReturn(robj *o);
 uint64_t dictSdsHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
+void dictVanillaFree(void *privdata, void *val);
+size_t dictSdsEmbeddedSize(const void *key);
+void *dictSdsEmbed(void *buf, const void *key);
+size_t dictKeyMetaBytes(dict *d);
 
 /* Git SHA1 */
 char *redisGitSHA1(void);
@@ -2234,10 +3119,12 @@ void swapdbCommand(client *c);
 void randomkeyCommand(client *c);
 void keysCommand(client *c);
 void scanCommand(client *c);
+void keyrangeCommand(client *c);
 void dbsizeCommand(client *c);
 void lastsaveCommand(client *c);
 void saveCommand(client *c);
 void bgsaveCommand(client *c);
+void bgloadCommand(client *c);
 void bgrewriteaofCommand(client *c);
 void shutdownCommand(client *c);
 void moveCommand(client *c);
@@ -2257,6 +3144,7 @@ void ltrimCommand(client *c);
 void typeCommand(client *c);
 void lsetCommand(client *c);
 void saddCommand(client *c);
+void sbuildCommand(client *c);
 void sremCommand(client *c);
 void smoveCommand(client *c);
 void sismemberCommand(client *c);
@@ -2294,6 +3182,7 @@ void debugCommand(client *c);
 void msetCommand(client *c);
 void msetnxCommand(client *c);
 void zaddCommand(client *c);
+void zbuildCommand(client *c);
 void zincrbyCommand(client *c);
 void zrangeCommand(client *c);
 void zrangebyscoreCommand(client *c);
@@ -2323,6 +3212,7 @@ void strlenCommand(client *c);
 void zrankCommand(client *c);
 void zrevrankCommand(client *c);
 void hsetCommand(client *c);
+void hbuildCommand(client *c);
 void hsetnxCommand(client *c);
 void hgetCommand(client *c);
 void hmsetCommand(client *c);
@@ -2339,6 +3229,13 @@ void hvalsCommand(client *c);
 void hgetallCommand(client *c);
 void hexistsCommand(client *c);
 void hscanCommand(client *c);
+void hexpireCommand(client *c);
+void hpexpireCommand(client *c);
+void hexpireatCommand(client *c);
+void hpexpireatCommand(client *c);
+void httlCommand(client *c);
+void hpttlCommand(client *c);
+void hpersistCommand(client *c);
 void configCommand(client *c);
 void hincrbyCommand(client *c);
 void hincrbyfloatCommand(client *c);
@@ -2347,6 +3244,9 @@ void unsubscribeCommand(client *c);
 void psubscribeCommand(client *c);
 void punsubscribeCommand(client *c);
 void publishCommand(client *c);
+void ssubscribeCommand(client *c);
+void sunsubscribeCommand(client *c);
+void spublishCommand(client *c);
 void pubsubCommand(client *c);
 void watchCommand(client *c);
 void unwatchCommand(client *c);
@@ -2363,6 +3263,8 @@ void clientCommand(client *c);
 void helloCommand(client *c);
 void evalCommand(client *c);
 void evalShaCommand(client *c);
+void evalRoCommand(client *c);
+void evalShaRoCommand(client *c);
 void scriptCommand(client *c);
 void timeCommand(client *c);
 void bitopCommand(client *c);
@@ -2370,10 +3272,14 @@ void bitcountCommand(client *c);
 void bitposCommand(client *c);
 void replconfCommand(client *c);
 void waitCommand(client *c);
+void waitaofCommand(client *c);
+void waitoffsetCommand(client *c);
 void geoencodeCommand(client *c);
 void geodecodeCommand(client *c);
 void georadiusbymemberCommand(client *c);
 void georadiusbymemberroCommand(client *c);
+void geosearchCommand(client *c);
+void geosearchstoreCommand(client *c);
 void georadiusCommand(client *c);
 void georadiusroCommand(client *c);
 void geoaddCommand(client *c);
@@ -2382,6 +3288,12 @@ void geoposCommand(client *c);
 void geodistCommand(client *c);
 void pfselftestCommand(client *c);
 void pfaddCommand(client *c);
+void bfreserveCommand(client *c);
+void bfaddCommand(client *c);
+void bfmaddCommand(client *c);
+void bfexistsCommand(client *c);
+void bfmexistsCommand(client *c);
+void bfinfoCommand(client *c);
 void pfcountCommand(client *c);
 void pfmergeCommand(client *c);
 void pfdebugCommand(client *c);
@@ -2398,6 +3310,7 @@ void xsetidCommand(client *c);
 void xackCommand(client *c);
 void xpendingCommand(client *c);
 void xclaimCommand(client *c);
+void xautoclaimCommand(client *c);
 void xinfoCommand(client *c);
 void xdelCommand(client *c);
 void xtrimCommand(client *c);
@@ -2423,6 +3336,8 @@ sds genModulesInfoString(sds info);
 void enableWatchdog(int period);
 void disableWatchdog(void);
 void watchdogScheduleSignal(int period);
+void debugProfileCommand(client *c);
+void profilerCron(void);
 void serverLogHexDump(int level, char *descr, void *value, size_t len);
 int memtest_preserving_test(unsigned long *m, size_t bytes, int passes);
 void mixDigest(unsigned char *digest, void *ptr, size_t len);
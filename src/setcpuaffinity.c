@@ -0,0 +1,116 @@
+/* CPU affinity of the threads and of the child processes.
+ *
+ * setcpuaffinity() binds the calling thread to the CPUs of a list like
+ * "0-3,8,10-14:2", where every item is a CPU, or a range of CPUs with an
+ * optional stride. It is used for the server-cpulist, bio-cpulist,
+ * aof-rewrite-cpulist and bgsave-cpulist configuration directives.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include "config.h"
+
+#ifdef USE_SETCPUAFFINITY
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parse a decimal number at *p, advancing it. Returns -1 if there is
+ * none. */
+static long parseCpu(const char **p) {
+    char *end;
+    long n;
+
+    if (**p < '0' || **p > '9') return -1;
+    n = strtol(*p,&end,10);
+    *p = end;
+    return n;
+}
+
+/* Parse 'cpulist' into 'set'. Returns -1 if it is not valid. */
+static int parseCpuList(const char *cpulist, cpu_set_t *set) {
+    const char *p = cpulist;
+    long a, b, stride, cpu;
+
+    CPU_ZERO(set);
+    while (*p) {
+        if ((a = parseCpu(&p)) == -1) return -1;
+        b = a;
+        stride = 1;
+        if (*p == '-') {
+            p++;
+            if ((b = parseCpu(&p)) == -1 || b < a) return -1;
+            if (*p == ':') {
+                p++;
+                if ((stride = parseCpu(&p)) <= 0) return -1;
+            }
+        }
+        if (b >= CPU_SETSIZE) return -1;
+        for (cpu = a; cpu <= b; cpu += stride) CPU_SET(cpu,set);
+        if (*p == ',') {
+            p++;
+            if (*p == '\0') return -1;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* Set the CPU affinity of the calling thread to 'cpulist'. Returns 0 on
+ * success, -1 with errno set if the list is not valid or can't be applied:
+ * the affinity is unchanged then. */
+int setcpuaffinity(const char *cpulist) {
+    cpu_set_t set;
+
+    if (parseCpuList(cpulist,&set) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return sched_setaffinity(0,sizeof(set),&set);
+}
+
+/* Return the CPU at position 'n' of 'cpulist', wrapping around when the
+ * list has fewer CPUs, or -1 if the list is not valid. */
+int cpulistnth(const char *cpulist, int n) {
+    cpu_set_t set;
+    int cpu;
+
+    if (parseCpuList(cpulist,&set) == -1) return -1;
+    n %= CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu,&set) && n-- == 0) return cpu;
+    }
+    return -1;
+}
+
+#endif
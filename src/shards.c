@@ -0,0 +1,220 @@
+/* Running many shards from a single server invocation, see the 'shards'
+ * option.
+ *
+ * The keyspace and most of the server state are global and can be used
+ * only by the main thread, so the shards can't be threads of the same
+ * process. Instead the process started by the user becomes a small
+ * supervisor that forks one shard per CPU core it is given: every shard
+ * is a regular server with its own event loop, keyspace, persistence files
+ * and listening ports, bound to its own CPU when 'server-cpulist' is set.
+ * The shards share the pages of the executable and of the configuration
+ * with the supervisor, and are started, restarted and shut down together,
+ * so N shards on the same host are managed like a single instance.
+ *
+ * Shard 0 uses the configuration as it is, so that going from a single
+ * instance to many shards keeps the existing data in the first one. Shard
+ * N listens on the configured ports plus N (in cluster mode the bus port
+ * follows, since it is derived from the port), and the names of its unix
+ * sockets and of its RDB, AOF and cluster config files get a "-N" suffix.
+ *
+ * A shard terminated by a signal or exiting with an error, for instance
+ * because of a crash, is started again after a second. A shard exiting
+ * cleanly, because of SHUTDOWN, is not. The supervisor forwards SIGTERM
+ * and SIGINT to the shards, and exits when all of them are gone. Since the
+ * config file is shared, CONFIG REWRITE is refused by the shards.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#define SHARD_RESTART_DELAY 1000 /* Milliseconds before restarting a shard. */
+
+static volatile sig_atomic_t shardsShutdownSignal = 0;
+
+static void shardsSignalHandler(int sig) {
+    shardsShutdownSignal = sig;
+}
+
+/* Return the name of the file 'name' for the shard 'id': a "-<id>" suffix
+ * is added before the extension, so "dump.rdb" becomes "dump-1.rdb". */
+static char *shardFileName(const char *name, int id) {
+    const char *dot = strrchr(name,'.');
+    const char *slash = strrchr(name,'/');
+    sds s;
+    char *retval;
+
+    if (dot == NULL || (slash && slash > dot) || dot == name) {
+        s = sdscatprintf(sdsempty(),"%s-%d",name,id);
+    } else {
+        s = sdscatprintf(sdsempty(),"%.*s-%d%s",(int)(dot-name),name,id,dot);
+    }
+    retval = zstrdup(s);
+    sdsfree(s);
+    return retval;
+}
+
+static void shardRenameFile(char **name, int id) {
+    char *newname;
+
+    if (*name == NULL) return;
+    newname = shardFileName(*name,id);
+    zfree(*name);
+    *name = newname;
+}
+
+/* Called in the shard process right after the fork, turns the configuration
+ * of the server into the one of the shard 'id'. */
+static void shardSetup(int id) {
+    server.shard_id = id;
+    /* The supervisor owns the pid file, the shards must not remove it. */
+    zfree(server.pidfile);
+    server.pidfile = NULL;
+    server.daemonize = 0;
+#ifdef __linux__
+    /* Don't outlive the supervisor, even if it is killed with SIGKILL. */
+    prctl(PR_SET_PDEATHSIG,SIGTERM);
+#endif
+
+    if (server.server_cpulist) {
+        int cpu = cpulistnth(server.server_cpulist,id);
+        if (cpu != -1) {
+            zfree(server.server_cpulist);
+            server.server_cpulist = zmalloc(16);
+            snprintf(server.server_cpulist,16,"%d",cpu);
+        }
+    }
+
+    if (id == 0) return;
+    if (server.port) server.port += id;
+    if (server.tls_port) server.tls_port += id;
+    shardRenameFile(&server.unixsocket,id);
+    shardRenameFile(&server.shm_socket,id);
+    shardRenameFile(&server.rdb_filename,id);
+    shardRenameFile(&server.aof_filename,id);
+    shardRenameFile(&server.cluster_configfile,id);
+}
+
+/* Fork the shard 'id'. Returns its pid in the supervisor, 0 in the shard,
+ * or -1 on error. */
+static pid_t shardFork(int id) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        shardSetup(id);
+    } else if (pid == -1) {
+        serverLog(LL_WARNING,"Can't fork shard %d: %s", id, strerror(errno));
+    } else {
+        serverLog(LL_NOTICE,"Shard %d started with pid %ld", id, (long)pid);
+    }
+    return pid;
+}
+
+/* Start the server.shards shards. This function returns only in the shards,
+ * with the configuration of the shard already applied: the process that
+ * calls it supervises them, writing the pid file if 'pidfile' is true, and
+ * exits once all the shards terminated. */
+void shardsStart(int pidfile) {
+    pid_t *pids = zcalloc(sizeof(pid_t)*server.shards);
+    int live = 0, j;
+    struct sigaction act;
+
+    for (j = 0; j < server.shards; j++) {
+        if ((pids[j] = shardFork(j)) == 0) {
+            zfree(pids);
+            return;
+        }
+        if (pids[j] == -1) {
+            while (j--) kill(pids[j],SIGKILL);
+            exit(1);
+        }
+        live++;
+    }
+
+    if (pidfile) createPidFile();
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = shardsSignalHandler;
+    sigaction(SIGTERM,&act,NULL);
+    sigaction(SIGINT,&act,NULL);
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGHUP,&act,NULL);
+
+    int shutdown = 0;
+    while (live) {
+        int status;
+        pid_t pid;
+
+        if (shardsShutdownSignal && !shutdown) {
+            serverLog(LL_WARNING,"Received %s, shutting down the shards",
+                shardsShutdownSignal == SIGINT ? "SIGINT" : "SIGTERM");
+            for (j = 0; j < server.shards; j++)
+                if (pids[j] > 0) kill(pids[j],shardsShutdownSignal);
+            shutdown = 1;
+        }
+
+        pid = waitpid(-1,&status,WNOHANG);
+        if (pid <= 0) {
+            usleep(100000);
+            continue;
+        }
+        for (j = 0; j < server.shards; j++) if (pids[j] == pid) break;
+        if (j == server.shards) continue;
+        pids[j] = 0;
+        live--;
+
+        if (shutdown || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            serverLog(LL_NOTICE,"Shard %d terminated", j);
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            serverLog(LL_WARNING,"Shard %d terminated by signal %d, restarting it",
+                j, WTERMSIG(status));
+        } else {
+            serverLog(LL_WARNING,"Shard %d exited with code %d, restarting it",
+                j, WEXITSTATUS(status));
+        }
+        usleep(SHARD_RESTART_DELAY*1000);
+        if (shardsShutdownSignal) continue;
+        if ((pids[j] = shardFork(j)) == 0) {
+            /* initServer() sets up the signal handlers of the shard. */
+            zfree(pids);
+            return;
+        }
+        if (pids[j] > 0) live++;
+    }
+    if (pidfile && server.pidfile) unlink(server.pidfile);
+    serverLog(LL_WARNING,"All the shards terminated, bye bye...");
+    exit(0);
+}
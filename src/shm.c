@@ -0,0 +1,424 @@
+/* Shared memory transport for the clients running on the same host.
+ *
+ * The clients connect to the 'shm-socket' Unix socket, and exchange the
+ * requests and the replies through two rings in a memory file the server
+ * creates for every connection, see shmring.h for the layout and the
+ * protocol. This file implements the connection type used for them, so
+ * the rest of the server handles these clients like any other.
+ *
+ * The event loop still drives the connection through the Unix socket:
+ * it is readable when the client wakes the server up, or when it goes
+ * away. When a handler has something to do without waiting for the client,
+ * because there is data in the requests ring or space in the replies ring,
+ * the connection also waits for the socket to be writable, that fires on
+ * the next iteration of the event loop.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "connhelpers.h"
+#include "shmring.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+typedef struct shm_connection {
+    connection c;
+    shmTransport *shm;
+    size_t map_size;
+    /* Private copies of what the client can't change, see shmring.h. */
+    uint64_t size;          /* Size of every ring. */
+    char *requests;         /* Data of the requests ring. */
+    char *replies;          /* Data of the replies ring. */
+    uint64_t requests_head; /* Bytes of requests read so far. */
+    uint64_t replies_tail;  /* Bytes of replies written so far. */
+} shm_connection;
+
+ConnectionType CT_Shm;
+
+static void shmWakeClient(uint32_t *futex) {
+    __atomic_add_fetch(futex,1,__ATOMIC_RELEASE);
+    syscall(SYS_futex,futex,FUTEX_WAKE,INT_MAX,NULL,NULL,0);
+}
+
+/* Create the shared memory transport for the client accepted on the
+ * 'shm-socket' with the socket 'fd', and send it to the client. Returns
+ * NULL with errno set on error: the caller should close the socket. */
+connection *connCreateAcceptedShm(int fd) {
+    uint64_t size = 4096;
+    size_t hdrlen = (sizeof(shmTransport)+4095) & ~(size_t)4095;
+    size_t map_size;
+    shmTransport *shm;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    int mfd, err;
+
+    while (size < (uint64_t)server.shm_ring_size) size *= 2;
+    map_size = hdrlen+size*2;
+
+    mfd = memfd_create("redis-shm",MFD_CLOEXEC);
+    if (mfd == -1) return NULL;
+    if (ftruncate(mfd,map_size) == -1) goto error;
+    shm = mmap(NULL,map_size,PROT_READ|PROT_WRITE,MAP_SHARED,mfd,0);
+    if (shm == MAP_FAILED) goto error;
+    shm->magic = SHM_TRANSPORT_MAGIC;
+    shm->version = SHM_TRANSPORT_VERSION;
+    shm->requests.size = shm->replies.size = size;
+    shm->requests.offset = hdrlen;
+    shm->replies.offset = hdrlen+size;
+
+    /* The socket was just accepted, so the message can't block. */
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = "+";
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg),&mfd,sizeof(int));
+    if (sendmsg(fd,&msg,MSG_NOSIGNAL) != 1) {
+        err = errno;
+        munmap(shm,map_size);
+        errno = err;
+        goto error;
+    }
+    close(mfd);
+
+    shm_connection *sc = zcalloc(sizeof(*sc));
+    sc->c.type = &CT_Shm;
+    sc->c.fd = fd;
+    sc->c.state = CONN_STATE_ACCEPTING;
+    sc->shm = shm;
+    sc->map_size = map_size;
+    sc->size = size;
+    sc->requests = (char*)shm+hdrlen;
+    sc->replies = (char*)shm+hdrlen+size;
+    return (connection*)sc;
+
+error:
+    err = errno;
+    close(mfd);
+    errno = err;
+    return NULL;
+}
+
+/* Register the events the connection waits for: the socket is readable
+ * when the client wakes the server up or goes away, and the writable event
+ * is only used to call the handlers on the next iteration of the event loop
+ * when they can make progress right away. Before waiting, the flags telling
+ * the client to wake the server up are set, see shmring.h. */
+static void connShmUpdateEvents(connection *conn) {
+    shm_connection *sc = (shm_connection*)conn;
+    int mask = 0, registered;
+
+    if (conn->fd == -1) return;
+    if (conn->read_handler || conn->write_handler) mask |= AE_READABLE;
+    if (conn->state != CONN_STATE_CONNECTED) {
+        if (mask) mask |= AE_WRITABLE;
+    } else {
+        if (conn->read_handler) {
+            shmRingSetWaiting(&sc->shm->requests.data_waiting);
+            if (shmRingLoad(&sc->shm->requests.tail) != sc->requests_head)
+                mask |= AE_WRITABLE;
+        }
+        if (conn->write_handler) {
+            shmRingSetWaiting(&sc->shm->replies.space_waiting);
+            if (sc->replies_tail-shmRingLoad(&sc->shm->replies.head) <
+                sc->size) mask |= AE_WRITABLE;
+        }
+    }
+
+    registered = aeGetFileEvents(server.el,conn->fd);
+    if (registered & ~mask)
+        aeDeleteFileEvent(server.el,conn->fd,registered & ~mask);
+    if (mask & ~registered)
+        aeCreateFileEvent(server.el,conn->fd,mask & ~registered,
+                          conn->type->ae_handler,conn);
+}
+
+static void connShmClose(connection *conn) {
+    shm_connection *sc = (shm_connection*)conn;
+
+    if (conn->fd != -1) {
+        aeDeleteFileEvent(server.el,conn->fd,AE_READABLE|AE_WRITABLE);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    if (sc->shm) {
+        __atomic_store_n(&sc->shm->closed,1,__ATOMIC_RELEASE);
+        shmWakeClient(&sc->shm->requests.futex);
+        shmWakeClient(&sc->shm->replies.futex);
+        munmap(sc->shm,sc->map_size);
+        sc->shm = NULL;
+        conn->state = CONN_STATE_CLOSED;
+    }
+
+    /* If called from within a handler, schedule the close but
+     * keep the connection until the handler returns. */
+    if (conn->flags & CONN_FLAG_IN_HANDLER) {
+        conn->flags |= CONN_FLAG_CLOSE_SCHEDULED;
+        return;
+    }
+    zfree(conn);
+}
+
+/* Mark the connection as failed because the client corrupted the
+ * positions in the rings. */
+static int connShmProtocolError(connection *conn) {
+    conn->last_errno = EPROTO;
+    conn->state = CONN_STATE_ERROR;
+    return -1;
+}
+
+static int connShmWritev(connection *conn, const struct iovec *iov, int iovcnt) {
+    shm_connection *sc = (shm_connection*)conn;
+    size_t used, avail, written = 0;
+    uint64_t head;
+    int j;
+
+    if (conn->state != CONN_STATE_CONNECTED) {
+        if (conn->state == CONN_STATE_CLOSED) {
+            conn->last_errno = EPIPE;
+            conn->state = CONN_STATE_ERROR;
+        }
+        return -1;
+    }
+    head = shmRingLoad(&sc->shm->replies.head);
+    used = shmRingUsed(sc->size,head,sc->replies_tail);
+    if (used == (size_t)-1) return connShmProtocolError(conn);
+    avail = sc->size-used;
+
+    for (j = 0; j < iovcnt && written < avail; j++) {
+        written += shmRingCopyIn(sc->replies,sc->size,
+            sc->replies_tail+written,avail-written,
+            iov[j].iov_base,iov[j].iov_len);
+    }
+    if (written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    sc->replies_tail += written;
+    if (shmRingPublish(&sc->shm->replies.tail,sc->replies_tail,
+                       &sc->shm->replies.data_waiting))
+    {
+        shmWakeClient(&sc->shm->replies.futex);
+    }
+    return written;
+}
+
+static int connShmWrite(connection *conn, const void *data, size_t data_len) {
+    struct iovec iov = {(void*)data,data_len};
+    return connShmWritev(conn,&iov,1);
+}
+
+static int connShmSendfile(connection *conn, int fd, off_t offset, size_t count) {
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nread;
+
+    nread = pread(fd,buf,count < sizeof(buf) ? count : sizeof(buf),offset);
+    if (nread <= 0) {
+        if (nread == -1) {
+            conn->last_errno = errno;
+            conn->state = CONN_STATE_ERROR;
+        }
+        return nread;
+    }
+    /* Only the bytes written count: the rest is read again next time. */
+    return connShmWrite(conn,buf,nread);
+}
+
+/* Like read(2), the data the client sent before going away is returned
+ * before reporting the connection as closed. */
+static int connShmRead(connection *conn, void *buf, size_t buf_len) {
+    shm_connection *sc = (shm_connection*)conn;
+    size_t used, nread;
+    uint64_t tail;
+
+    if (sc->shm == NULL || conn->state == CONN_STATE_ERROR) return -1;
+    tail = shmRingLoad(&sc->shm->requests.tail);
+    used = shmRingUsed(sc->size,sc->requests_head,tail);
+    if (used == (size_t)-1) return connShmProtocolError(conn);
+    if (used == 0) {
+        if (conn->state == CONN_STATE_CLOSED) return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    nread = shmRingCopyOut(sc->requests,sc->size,sc->requests_head,used,
+                           buf,buf_len);
+    sc->requests_head += nread;
+    if (shmRingPublish(&sc->shm->requests.head,sc->requests_head,
+                       &sc->shm->requests.space_waiting))
+    {
+        shmWakeClient(&sc->shm->requests.futex);
+    }
+    return nread;
+}
+
+static int connShmAccept(connection *conn, ConnectionCallbackFunc accept_handler) {
+    if (conn->state != CONN_STATE_ACCEPTING) return C_ERR;
+    conn->state = CONN_STATE_CONNECTED;
+    if (!callHandler(conn, accept_handler)) return C_ERR;
+    return C_OK;
+}
+
+static int connShmSetWriteHandler(connection *conn, ConnectionCallbackFunc func, int barrier) {
+    conn->write_handler = func;
+    if (barrier)
+        conn->flags |= CONN_FLAG_WRITE_BARRIER;
+    else
+        conn->flags &= ~CONN_FLAG_WRITE_BARRIER;
+    connShmUpdateEvents(conn);
+    return C_OK;
+}
+
+static int connShmSetReadHandler(connection *conn, ConnectionCallbackFunc func) {
+    conn->read_handler = func;
+    connShmUpdateEvents(conn);
+    return C_OK;
+}
+
+static const char *connShmGetLastError(connection *conn) {
+    return strerror(conn->last_errno);
+}
+
+/* Consume the bytes the client writes to the socket to wake the server
+ * up, noticing if it went away. */
+static void connShmDrainSocket(connection *conn) {
+    char buf[64];
+    ssize_t nread;
+
+    while ((nread = read(conn->fd,buf,sizeof(buf))) > 0);
+    if (conn->state != CONN_STATE_CONNECTED) return;
+    if (nread == 0) {
+        conn->state = CONN_STATE_CLOSED;
+    } else if (errno != EAGAIN && errno != EINTR) {
+        conn->last_errno = errno;
+        conn->state = CONN_STATE_ERROR;
+    }
+}
+
+static void connShmEventHandler(struct aeEventLoop *el, int fd, void *clientData, int mask) {
+    UNUSED(el);
+    UNUSED(fd);
+    connection *conn = clientData;
+    shm_connection *sc = clientData;
+    int call_read = 0, call_write = 0;
+
+    if (mask & AE_READABLE) connShmDrainSocket(conn);
+
+    /* The handlers are called when they can make progress, or to let them
+     * notice that the connection is no longer usable. */
+    if (conn->state != CONN_STATE_CONNECTED) {
+        call_read = conn->read_handler != NULL;
+        call_write = conn->write_handler != NULL;
+    } else {
+        call_read = conn->read_handler &&
+            shmRingLoad(&sc->shm->requests.tail) != sc->requests_head;
+        call_write = conn->write_handler &&
+            sc->replies_tail-shmRingLoad(&sc->shm->replies.head) < sc->size;
+    }
+
+    /* See connSocketEventHandler() about the write barrier. */
+    int invert = conn->flags & CONN_FLAG_WRITE_BARRIER;
+    if (!invert && call_read) {
+        if (!callHandler(conn, conn->read_handler)) return;
+    }
+    if (call_write && conn->write_handler) {
+        if (!callHandler(conn, conn->write_handler)) return;
+    }
+    if (invert && call_read && conn->read_handler) {
+        if (!callHandler(conn, conn->read_handler)) return;
+    }
+    connShmUpdateEvents(conn);
+}
+
+/* The shared memory transport is only used by the clients to connect to
+ * the server, never the other way around. */
+static int connShmConnect(connection *conn, const char *addr, int port, const char *src_addr,
+        ConnectionCallbackFunc connect_handler) {
+    UNUSED(addr);
+    UNUSED(port);
+    UNUSED(src_addr);
+    UNUSED(connect_handler);
+    conn->state = CONN_STATE_ERROR;
+    conn->last_errno = ENOTSUP;
+    return C_ERR;
+}
+
+static int connShmBlockingConnect(connection *conn, const char *addr, int port, long long timeout) {
+    UNUSED(timeout);
+    return connShmConnect(conn,addr,port,NULL,NULL);
+}
+
+static ssize_t connShmSyncIO(connection *conn, char *ptr, ssize_t size, long long timeout) {
+    UNUSED(ptr);
+    UNUSED(size);
+    UNUSED(timeout);
+    conn->last_errno = ENOTSUP;
+    return -1;
+}
+
+ConnectionType CT_Shm = {
+    .ae_handler = connShmEventHandler,
+    .close = connShmClose,
+    .write = connShmWrite,
+    .writev = connShmWritev,
+    .sendfile = connShmSendfile,
+    .read = connShmRead,
+    .accept = connShmAccept,
+    .connect = connShmConnect,
+    .set_write_handler = connShmSetWriteHandler,
+    .set_read_handler = connShmSetReadHandler,
+    .get_last_error = connShmGetLastError,
+    .blocking_connect = connShmBlockingConnect,
+    .sync_write = connShmSyncIO,
+    .sync_read = connShmSyncIO,
+    .sync_readline = connShmSyncIO
+};
+
+#else /* __linux__ */
+
+connection *connCreateAcceptedShm(int fd) {
+    UNUSED(fd);
+    errno = ENOTSUP;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,317 @@
+/* Shared memory transport, client side.
+ *
+ * redisInitiateShm() switches a blocking hiredis context connected to the
+ * 'shm-socket' of the server to the shared memory transport described in
+ * shmring.h: the requests and the replies go through the rings, while the
+ * socket is only used to wake the server up and to notice when it goes away.
+ * Only the blocking API of hiredis is supported.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <hiredis.h>
+#include "shmclient.h"
+#include "shmring.h"
+
+void __redisSetError(redisContext *c, int type, const char *str);
+
+#ifdef __linux__
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+typedef struct shmClient {
+    shmTransport *shm;
+    size_t map_size;
+    uint64_t size;          /* Size of every ring. */
+    char *requests;         /* Data of the requests ring. */
+    char *replies;          /* Data of the replies ring. */
+    uint64_t requests_tail; /* Bytes of requests written so far. */
+    uint64_t replies_head;  /* Bytes of replies read so far. */
+} shmClient;
+
+static void shmClientFree(void *privdata) {
+    shmClient *sc = privdata;
+
+    if (sc->shm) {
+        __atomic_store_n(&sc->shm->closed,1,__ATOMIC_RELEASE);
+        munmap(sc->shm,sc->map_size);
+    }
+    free(sc);
+}
+
+static void shmCpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Wake the server up, writing a byte to the socket. If the socket buffer
+ * is full the server has yet to consume the previous ones, so it will
+ * see the ring anyway. */
+static void shmWakeServer(redisContext *c) {
+    ssize_t nwritten;
+
+    do {
+        nwritten = send(c->fd,"",1,MSG_NOSIGNAL|MSG_DONTWAIT);
+    } while (nwritten == -1 && errno == EINTR);
+}
+
+/* Return 1 if the server closed the connection, setting the error. */
+static int shmServerGone(redisContext *c, shmClient *sc) {
+    char byte;
+
+    if (!__atomic_load_n(&sc->shm->closed,__ATOMIC_ACQUIRE) &&
+        recv(c->fd,&byte,1,MSG_PEEK|MSG_DONTWAIT) != 0) return 0;
+    __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
+    return 1;
+}
+
+/* Sleep until the server bumps 'futex' after clearing 'waiting', unless
+ * 'ready' reports that the ring changed meanwhile. The wait has a timeout
+ * so that a server going away is noticed. Returns -1 if it went away. */
+static int shmWait(redisContext *c, shmClient *sc, uint32_t *futex,
+                   uint32_t *waiting, int (*ready)(shmClient *sc))
+{
+    struct timespec ts = {0,100000000};
+    uint32_t val = __atomic_load_n(futex,__ATOMIC_ACQUIRE);
+
+    shmRingSetWaiting(waiting);
+    if (ready(sc)) return 0;
+    if (shmServerGone(c,sc)) return -1;
+    syscall(SYS_futex,futex,FUTEX_WAIT,val,&ts,NULL,0);
+    return 0;
+}
+
+static int shmRepliesReady(shmClient *sc) {
+    return shmRingLoad(&sc->shm->replies.tail) != sc->replies_head;
+}
+
+static int shmRequestsSpace(shmClient *sc) {
+    return sc->requests_tail-shmRingLoad(&sc->shm->requests.head) < sc->size;
+}
+
+static void shmCorrupted(redisContext *c) {
+    __redisSetError(c,REDIS_ERR_PROTOCOL,"Corrupted shared memory ring");
+}
+
+static int shmClientRead(redisContext *c, char *buf, size_t bufcap) {
+    shmClient *sc = c->privdata;
+    int spins = 0;
+
+    while(1) {
+        uint64_t tail = shmRingLoad(&sc->shm->replies.tail);
+        size_t used = shmRingUsed(sc->size,sc->replies_head,tail), nread;
+
+        if (used == (size_t)-1) {
+            shmCorrupted(c);
+            return -1;
+        }
+        if (used) {
+            nread = shmRingCopyOut(sc->replies,sc->size,sc->replies_head,
+                                   used,buf,bufcap);
+            sc->replies_head += nread;
+            if (shmRingPublish(&sc->shm->replies.head,sc->replies_head,
+                               &sc->shm->replies.space_waiting))
+            {
+                shmWakeServer(c);
+            }
+            return nread;
+        }
+        if (!(c->flags & REDIS_BLOCK)) return 0;
+        if (spins++ < SHM_SPIN_LOOPS) {
+            shmCpuRelax();
+            continue;
+        }
+        if (shmWait(c,sc,&sc->shm->replies.futex,
+                    &sc->shm->replies.data_waiting,shmRepliesReady) == -1)
+            return -1;
+    }
+}
+
+static int shmClientWrite(redisContext *c) {
+    shmClient *sc = c->privdata;
+    int spins = 0;
+
+    while(1) {
+        uint64_t head = shmRingLoad(&sc->shm->requests.head);
+        size_t used = shmRingUsed(sc->size,head,sc->requests_tail), nwritten;
+
+        if (used == (size_t)-1) {
+            shmCorrupted(c);
+            return -1;
+        }
+        if (used < sc->size) {
+            nwritten = shmRingCopyIn(sc->requests,sc->size,sc->requests_tail,
+                                     sc->size-used,c->obuf,sdslen(c->obuf));
+            sc->requests_tail += nwritten;
+            if (shmRingPublish(&sc->shm->requests.tail,sc->requests_tail,
+                               &sc->shm->requests.data_waiting))
+            {
+                shmWakeServer(c);
+            }
+            return nwritten;
+        }
+        if (!(c->flags & REDIS_BLOCK)) return 0;
+        if (spins++ < SHM_SPIN_LOOPS) {
+            shmCpuRelax();
+            continue;
+        }
+        if (shmWait(c,sc,&sc->shm->requests.futex,
+                    &sc->shm->requests.space_waiting,shmRequestsSpace) == -1)
+            return -1;
+    }
+}
+
+static redisContextFuncs redisContextShmFuncs = {
+    .free_privdata = shmClientFree,
+    .async_read = NULL,
+    .async_write = NULL,
+    .read = shmClientRead,
+    .write = shmClientWrite
+};
+
+/* Receive the memory file of the transport from the server, that sends it
+ * as soon as the connection is accepted. */
+static int shmReceiveFd(redisContext *c) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char byte, cbuf[CMSG_SPACE(sizeof(int))];
+    ssize_t nread;
+    int fd;
+
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    do {
+        nread = recvmsg(c->fd,&msg,MSG_CMSG_CLOEXEC);
+    } while (nread == -1 && errno == EINTR);
+    if (nread == -1) {
+        __redisSetError(c,REDIS_ERR_IO,NULL);
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (nread != 1 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        __redisSetError(c,REDIS_ERR_OTHER,
+            "The server didn't send a shared memory transport: "
+            "is this its shm-socket?");
+        return -1;
+    }
+    memcpy(&fd,CMSG_DATA(cmsg),sizeof(int));
+    return fd;
+}
+
+/* Switch the blocking context 'c', connected to the shm-socket of the
+ * server, to the shared memory transport. Returns REDIS_ERR setting the
+ * error of the context on failure. */
+int redisInitiateShm(redisContext *c) {
+    shmClient *sc;
+    struct stat st;
+    shmTransport *shm;
+    uint64_t size;
+    int fd;
+
+    if (c->err) return REDIS_ERR;
+    if (!(c->flags & REDIS_BLOCK) || c->privdata) {
+        __redisSetError(c,REDIS_ERR_OTHER,
+            "The shared memory transport needs a blocking plain connection");
+        return REDIS_ERR;
+    }
+    if ((fd = shmReceiveFd(c)) == -1) return REDIS_ERR;
+    if (fstat(fd,&st) == -1 || (size_t)st.st_size < sizeof(shmTransport)) {
+        close(fd);
+        __redisSetError(c,REDIS_ERR_OTHER,"Invalid shared memory file");
+        return REDIS_ERR;
+    }
+    shm = mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        __redisSetError(c,REDIS_ERR_IO,NULL);
+        return REDIS_ERR;
+    }
+
+    size = shm->requests.size;
+    if (shm->magic != SHM_TRANSPORT_MAGIC ||
+        shm->version != SHM_TRANSPORT_VERSION ||
+        size == 0 || (size & (size-1)) || shm->replies.size != size ||
+        shm->requests.offset > (uint64_t)st.st_size-size ||
+        shm->replies.offset > (uint64_t)st.st_size-size)
+    {
+        munmap(shm,st.st_size);
+        __redisSetError(c,REDIS_ERR_OTHER,
+            "Unsupported shared memory transport");
+        return REDIS_ERR;
+    }
+
+    sc = calloc(1,sizeof(*sc));
+    if (sc == NULL) {
+        munmap(shm,st.st_size);
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    sc->shm = shm;
+    sc->map_size = st.st_size;
+    sc->size = size;
+    sc->requests = (char*)shm+shm->requests.offset;
+    sc->replies = (char*)shm+shm->replies.offset;
+    c->privdata = sc;
+    c->funcs = &redisContextShmFuncs;
+    return REDIS_OK;
+}
+
+#else /* __linux__ */
+
+int redisInitiateShm(redisContext *c) {
+    __redisSetError(c,REDIS_ERR_OTHER,
+        "The shared memory transport is only supported on Linux");
+    return REDIS_ERR;
+}
+
+#endif
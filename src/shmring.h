@@ -0,0 +1,156 @@
+/* Shared memory transport: memory layout shared by the server (see shm.c)
+ * and the clients (see shmclient.c).
+ *
+ * A client connects to the 'shm-socket' Unix socket, and receives from the
+ * server, as SCM_RIGHTS ancillary data, the file descriptor of a memory
+ * file holding a shmTransport header followed by the data of two single
+ * producer, single consumer rings: the requests, written by the client, and
+ * the replies, written by the server. The stream of bytes in every ring is
+ * the usual RESP protocol.
+ *
+ * Every ring has a 'head' position advanced by the consumer and a 'tail'
+ * position advanced by the producer: they grow forever, and the data in the
+ * ring is the range [head,tail) modulo the size of the ring, that is a
+ * power of two. A side that finds the ring empty (consumer) or full
+ * (producer) and wants to sleep sets 'data_waiting' or 'space_waiting',
+ * checks the ring again, and sleeps. The other side, after moving its
+ * position, clears the flag and wakes it up:
+ *
+ * - The client sleeps on the 'futex' word of the ring, and the server bumps
+ *   it and calls FUTEX_WAKE.
+ * - The server waits in its event loop with all the other clients, so the
+ *   client writes a byte to the Unix socket to wake it up. The socket is
+ *   also how each side notices that the other one went away.
+ *
+ * The client polls the ring for a while before sleeping, and the server only
+ * sleeps when no client needs it: so with a busy client the requests and
+ * the replies are exchanged without system calls and without copies to the
+ * kernel.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __REDIS_SHMRING_H
+#define __REDIS_SHMRING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHM_TRANSPORT_MAGIC 0x3152484d53534552ULL /* "RESSMHR1" */
+#define SHM_TRANSPORT_VERSION 1
+
+/* Iterations a side polls an empty or full ring before sleeping. */
+#define SHM_SPIN_LOOPS 2000
+
+typedef struct shmRing {
+    /* Owned by the consumer. */
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t data_waiting;      /* The consumer sleeps waiting for data. */
+    /* Owned by the producer. */
+    uint64_t tail __attribute__((aligned(64)));
+    uint32_t space_waiting;     /* The producer sleeps waiting for space. */
+    /* Bumped by the server to wake the client sleeping on this ring. */
+    uint32_t futex __attribute__((aligned(64)));
+    /* Set by the server when the transport is created. */
+    uint64_t size;              /* Size of the ring, a power of two. */
+    uint64_t offset;            /* Offset of the data from the header. */
+} shmRing;
+
+typedef struct shmTransport {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t closed;            /* Set by the side closing the connection. */
+    shmRing requests;           /* Client to server. */
+    shmRing replies;            /* Server to client. */
+} shmTransport;
+
+/* Every side keeps its own copy of the size of the rings and of the
+ * positions it owns, and only trusts the shared copy of the position owned
+ * by the other side after checking it: the server can't trust the memory
+ * the client can write. Returns the bytes in a ring of 'size' bytes, or
+ * (size_t)-1 if the positions are not consistent. */
+static inline size_t shmRingUsed(uint64_t size, uint64_t head, uint64_t tail) {
+    uint64_t used = tail - head;
+    return used > size ? (size_t)-1 : (size_t)used;
+}
+
+static inline uint64_t shmRingLoad(uint64_t *pos) {
+    return __atomic_load_n(pos,__ATOMIC_ACQUIRE);
+}
+
+/* Publish the new position of this side, and return true if the other
+ * side announced in 'waiting' that it sleeps, clearing the flag: the
+ * caller must then wake it up. */
+static inline int shmRingPublish(uint64_t *pos, uint64_t value,
+                                 uint32_t *waiting)
+{
+    __atomic_store_n(pos,value,__ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(waiting,__ATOMIC_RELAXED) &&
+           __atomic_exchange_n(waiting,0,__ATOMIC_ACQ_REL);
+}
+
+/* Announce that this side is about to sleep: the caller must check the
+ * ring again before sleeping, since the other side may have moved its
+ * position before seeing the flag. */
+static inline void shmRingSetWaiting(uint32_t *waiting) {
+    __atomic_store_n(waiting,1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Copy up to 'len' bytes to the ring 'data' of 'size' bytes at position
+ * 'tail', where 'avail' bytes are free. Returns the bytes copied. */
+static inline size_t shmRingCopyIn(char *data, uint64_t size, uint64_t tail,
+                                   size_t avail, const void *buf, size_t len)
+{
+    size_t pos = tail & (size-1), first;
+
+    if (len > avail) len = avail;
+    first = size-pos;
+    if (first > len) first = len;
+    memcpy(data+pos,buf,first);
+    memcpy(data,(const char*)buf+first,len-first);
+    return len;
+}
+
+/* Copy up to 'len' bytes from the ring 'data' of 'size' bytes at position
+ * 'head', where 'used' bytes are available. Returns the bytes copied. */
+static inline size_t shmRingCopyOut(char *data, uint64_t size, uint64_t head,
+                                    size_t used, void *buf, size_t len)
+{
+    size_t pos = head & (size-1), first;
+
+    if (len > used) len = used;
+    first = size-pos;
+    if (first > len) first = len;
+    memcpy(buf,data+pos,first);
+    memcpy((char*)buf+first,data,len-first);
+    return len;
+}
+
+#endif
@@ -8,6 +8,13 @@
  * The slow queries log is actually not "logged" in the Redis log file
  * but is accessible thanks to the SLOWLOG command.
  *
+ * Under load, when many commands are slow, only one slow command out of
+ * 'slowlog-sample-ratio', at random, is logged with its arguments. Every
+ * slow command is instead counted in the statistics of its shape, that is
+ * the command name followed by the pattern of its keys, without the values,
+ * so that SLOWLOG SHAPES shows what kind of commands are slow even when the
+ * entries of the log are sampled or rotated quickly.
+ *
  * ----------------------------------------------------------------------------
  *
  * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
@@ -42,10 +49,29 @@
 #include "server.h"
 #include "slowlog.h"
 
+#include <ctype.h>
+
+/* Max number of keys in a shape, and max length of a key pattern. */
+#define SLOWLOG_SHAPE_MAX_KEYS 4
+#define SLOWLOG_SHAPE_MAX_KEYLEN 64
+
+void slowlogFreeShape(void *privdata, void *val);
+
+/* Shape -> slowlogShape. The shape is the key, and it is also referenced by
+ * the slowlogShape structure. */
+dictType slowlogShapesDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    slowlogFreeShape            /* val destructor */
+};
+
 /* Create a new slowlog entry.
  * Incrementing the ref count of all the objects retained is up to
  * this function. */
-slowlogEntry *slowlogCreateEntry(client *c, robj **argv, int argc, long long duration) {
+slowlogEntry *slowlogCreateEntry(client *c, robj **argv, int argc, long long duration, long long queue) {
     slowlogEntry *se = zmalloc(sizeof(*se));
     int j, slargc = argc;
 
@@ -87,6 +113,8 @@ slowlogEntry *slowlogCreateEntry(client *c, robj **argv, int argc, long long dur
     }
     se->time = time(NULL);
     se->duration = duration;
+    se->queue = queue;
+    se->write = -1;
     se->id = server.slowlog_entry_id++;
     se->peerid = sdsnew(getClientPeerId(c));
     se->cname = c->name ? sdsnew(c->name->ptr) : sdsempty();
@@ -115,26 +143,206 @@ void slowlogInit(void) {
     server.slowlog = listCreate();
     server.slowlog_entry_id = 0;
     listSetFreeMethod(server.slowlog,slowlogFreeEntry);
+    server.slowlog_shapes = dictCreate(&slowlogShapesDictType,NULL);
+}
+
+void slowlogFreeShape(void *privdata, void *val) {
+    slowlogShape *sh = val;
+
+    UNUSED(privdata);
+    zfree(sh->histogram);
+    zfree(sh);
+}
+
+/* Append to 's' the pattern of the key 'key': the alphanumeric parts of the
+ * key that contain a digit, usually identifiers, are replaced by a "*", so
+ * both "user:1000:posts" and "user:1001:posts" become "user:*:posts". */
+static sds slowlogCatKeyPattern(sds s, sds key) {
+    size_t len = sdslen(key), j = 0;
+
+    if (len > SLOWLOG_SHAPE_MAX_KEYLEN) len = SLOWLOG_SHAPE_MAX_KEYLEN;
+    while (j < len) {
+        if (!isalnum((unsigned char)key[j])) {
+            s = sdscatlen(s, isprint((unsigned char)key[j]) ? key+j : "?", 1);
+            j++;
+            continue;
+        }
+        size_t start = j;
+        int digits = 0;
+        while (j < len && isalnum((unsigned char)key[j])) {
+            if (isdigit((unsigned char)key[j])) digits = 1;
+            j++;
+        }
+        s = digits ? sdscatlen(s,"*",1) : sdscatlen(s,key+start,j-start);
+    }
+    if (sdslen(key) > SLOWLOG_SHAPE_MAX_KEYLEN) s = sdscatlen(s,"...",3);
+    return s;
+}
+
+/* Return the shape of the command: its name followed by the patterns of
+ * the first SLOWLOG_SHAPE_MAX_KEYS keys. The arguments that are not keys,
+ * like the values, are not part of the shape. */
+sds slowlogCommandShape(robj **argv, int argc) {
+    struct redisCommand *cmd = lookupCommandOrOriginal(argv[0]->ptr);
+    sds shape = sdsnew(cmd ? cmd->name : "unknown");
+
+    if (cmd) {
+        int numkeys, *keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+        for (int j = 0; j < numkeys; j++) {
+            if (j == SLOWLOG_SHAPE_MAX_KEYS) {
+                shape = sdscatprintf(shape," ... (%d more keys)",numkeys-j);
+                break;
+            }
+            robj *key = argv[keys[j]];
+            shape = sdscatlen(shape," ",1);
+            shape = sdsEncodedObject(key) ?
+                    slowlogCatKeyPattern(shape,key->ptr) :
+                    sdscatlen(shape,"*",1);
+        }
+        getKeysFreeResult(keys);
+    }
+    return shape;
+}
+
+/* Remove the shape with the smallest total time, to make room for a new
+ * one when there are already slowlog-shapes-max-len shapes. */
+static void slowlogEvictShape(void) {
+    dictIterator *di = dictGetIterator(server.slowlog_shapes);
+    dictEntry *de, *victim = NULL;
+
+    while((de = dictNext(di)) != NULL) {
+        slowlogShape *sh = dictGetVal(de);
+        if (victim == NULL ||
+            sh->total < ((slowlogShape*)dictGetVal(victim))->total)
+            victim = de;
+    }
+    dictReleaseIterator(di);
+    if (victim) dictDelete(server.slowlog_shapes,dictGetKey(victim));
+}
+
+/* Count a slow command, that took 'duration' microseconds, in the
+ * statistics of its shape. */
+void slowlogAddToShape(robj **argv, int argc, long long duration) {
+    sds shape = slowlogCommandShape(argv,argc);
+    dictEntry *de = dictFind(server.slowlog_shapes,shape);
+    slowlogShape *sh;
+
+    if (de) {
+        sh = dictGetVal(de);
+        sdsfree(shape);
+    } else {
+        while (dictSize(server.slowlog_shapes) >= server.slowlog_shapes_max_len)
+            slowlogEvictShape();
+        sh = zcalloc(sizeof(*sh));
+        sh->shape = shape;
+        dictAdd(server.slowlog_shapes,shape,sh);
+    }
+    sh->calls++;
+    sh->total += duration;
+    if (duration > sh->max) sh->max = duration;
+    sh->time = time(NULL);
+    latencyHistogramAdd(&sh->histogram,duration);
 }
 
 /* Push a new entry into the slow log.
  * This function will make sure to trim the slow log accordingly to the
- * configured max length. */
-void slowlogPushEntryIfNeeded(client *c, robj **argv, int argc, long long duration) {
-    if (server.slowlog_log_slower_than < 0) return; /* Slowlog disabled */
-    if (duration >= server.slowlog_log_slower_than)
-        listAddNodeHead(server.slowlog,
-                        slowlogCreateEntry(c,argv,argc,duration));
+ * configured max length. The 'queue' time, if not -1, is the time the
+ * query waited to be executed, that counts for the slow log threshold as
+ * well. The ID of the new entry is returned, or -1 if no entry was added. */
+long long slowlogPushEntryIfNeeded(client *c, robj **argv, int argc, long long duration, long long queue) {
+    long long id = -1;
+    long long latency = duration + (queue > 0 ? queue : 0);
+
+    if (server.slowlog_log_slower_than < 0) return -1; /* Slowlog disabled */
+    if (latency >= server.slowlog_log_slower_than) {
+        if (server.slowlog_shapes_max_len)
+            slowlogAddToShape(argv,argc,latency);
+        if (server.slowlog_sample_ratio == 1 ||
+            random() % server.slowlog_sample_ratio == 0)
+        {
+            slowlogEntry *se = slowlogCreateEntry(c,argv,argc,duration,queue);
+            listAddNodeHead(server.slowlog,se);
+            id = se->id;
+        }
+    }
 
     /* Remove old entries if needed. */
     while (listLength(server.slowlog) > server.slowlog_max_len)
         listDelNode(server.slowlog,listLast(server.slowlog));
+    return id;
 }
 
-/* Remove all the entries from the current slow log. */
+/* Set the time spent writing the reply of the query logged with the
+ * specified ID, if the entry is still in the slow log. Newer entries are
+ * at the head of the list, so we stop as soon as we find an older one. */
+void slowlogSetWriteTime(long long id, long long write) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.slowlog,&li);
+    while((ln = listNext(&li))) {
+        slowlogEntry *se = ln->value;
+        if (se->id < id) break;
+        if (se->id == id) {
+            se->write = write;
+            break;
+        }
+    }
+}
+
+/* Remove all the entries from the current slow log, and the statistics of
+ * the shapes. */
 void slowlogReset(void) {
     while (listLength(server.slowlog) > 0)
         listDelNode(server.slowlog,listLast(server.slowlog));
+    dictEmpty(server.slowlog_shapes,NULL);
+}
+
+/* Sort the shapes by total time, the slowest first. */
+static int slowlogShapeCompare(const void *a, const void *b) {
+    const slowlogShape *sa = *(slowlogShape**)a, *sb = *(slowlogShape**)b;
+    if (sa->total == sb->total) return 0;
+    return sa->total > sb->total ? -1 : 1;
+}
+
+/* SLOWLOG SHAPES [count] */
+void slowlogShapesCommand(client *c, long count) {
+    unsigned long len = dictSize(server.slowlog_shapes), j = 0;
+    slowlogShape **shapes = zmalloc(sizeof(slowlogShape*)*(len ? len : 1));
+    dictIterator *di = dictGetIterator(server.slowlog_shapes);
+    dictEntry *de;
+
+    while((de = dictNext(di)) != NULL) shapes[j++] = dictGetVal(de);
+    dictReleaseIterator(di);
+    qsort(shapes,len,sizeof(slowlogShape*),slowlogShapeCompare);
+
+    if (count < 0 || (unsigned long)count > len) count = len;
+    addReplyArrayLen(c,count);
+    for (j = 0; j < (unsigned long)count; j++) {
+        slowlogShape *sh = shapes[j];
+        uint64_t fingerprint = dictGenHashFunction(sh->shape,sdslen(sh->shape));
+        char buf[17];
+
+        snprintf(buf,sizeof(buf),"%016llx",(unsigned long long)fingerprint);
+        addReplyMapLen(c,8);
+        addReplyBulkCString(c,"fingerprint");
+        addReplyBulkCString(c,buf);
+        addReplyBulkCString(c,"shape");
+        addReplyBulkCBuffer(c,sh->shape,sdslen(sh->shape));
+        addReplyBulkCString(c,"calls");
+        addReplyLongLong(c,sh->calls);
+        addReplyBulkCString(c,"total_usec");
+        addReplyLongLong(c,sh->total);
+        addReplyBulkCString(c,"max_usec");
+        addReplyLongLong(c,sh->max);
+        addReplyBulkCString(c,"p50");
+        addReplyLongLong(c,latencyHistogramPercentile(sh->histogram,50));
+        addReplyBulkCString(c,"p99");
+        addReplyLongLong(c,latencyHistogramPercentile(sh->histogram,99));
+        addReplyBulkCString(c,"last_time");
+        addReplyLongLong(c,sh->time);
+    }
+    zfree(shapes);
 }
 
 /* The SLOWLOG command. Implements all the subcommands needed to handle the
@@ -145,8 +353,14 @@ void slowlogCommand(client *c) {
 "GET [count] -- Return top entries from the slowlog (default: 10)."
 "    Entries are made of:",
 "    id, timestamp, time in microseconds, arguments array, client IP and port, client name",
+"    and, if latency-tracking-breakdown was enabled, a map with the queue,",
+"    execution and reply write times in microseconds (-1 if not yet known).",
 "LEN -- Return the length of the slowlog.",
-"RESET -- Reset the slowlog.",
+"RESET -- Reset the slowlog and the shapes statistics.",
+"SHAPES [count] -- Return the shapes of the slow commands, that is the command",
+"    name and the pattern of its keys, with the slowest total time first (default: 10).",
+"    Every shape is a map with its fingerprint, calls, total_usec, max_usec,",
+"    p50, p99 and last_time.",
 NULL
         };
         addReplyHelp(c, help);
@@ -155,6 +369,15 @@ NULL
         addReply(c,shared.ok);
     } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"len")) {
         addReplyLongLong(c,listLength(server.slowlog));
+    } else if ((c->argc == 2 || c->argc == 3) &&
+               !strcasecmp(c->argv[1]->ptr,"shapes"))
+    {
+        long count = 10;
+
+        if (c->argc == 3 &&
+            getLongFromObjectOrReply(c,c->argv[2],&count,NULL) != C_OK)
+            return;
+        slowlogShapesCommand(c,count);
     } else if ((c->argc == 2 || c->argc == 3) &&
                !strcasecmp(c->argv[1]->ptr,"get"))
     {
@@ -174,7 +397,7 @@ NULL
             int j;
 
             se = ln->value;
-            addReplyArrayLen(c,6);
+            addReplyArrayLen(c,se->queue != -1 ? 7 : 6);
             addReplyLongLong(c,se->id);
             addReplyLongLong(c,se->time);
             addReplyLongLong(c,se->duration);
@@ -183,6 +406,15 @@ NULL
                 addReplyBulk(c,se->argv[j]);
             addReplyBulkCBuffer(c,se->peerid,sdslen(se->peerid));
             addReplyBulkCBuffer(c,se->cname,sdslen(se->cname));
+            if (se->queue != -1) {
+                addReplyMapLen(c,3);
+                addReplyBulkCString(c,"queue_usec");
+                addReplyLongLong(c,se->queue);
+                addReplyBulkCString(c,"execution_usec");
+                addReplyLongLong(c,se->duration);
+                addReplyBulkCString(c,"write_usec");
+                addReplyLongLong(c,se->write);
+            }
             sent++;
         }
         setDeferredArrayLen(c,totentries,sent);
@@ -36,14 +36,29 @@ typedef struct slowlogEntry {
     int argc;
     long long id;       /* Unique entry identifier. */
     long long duration; /* Time spent by the query, in microseconds. */
+    long long queue;    /* Time the query waited to be executed after it was
+                           read, or -1 if latency-tracking-breakdown was off. */
+    long long write;    /* Time spent writing the reply, or -1 if unknown. */
     time_t time;        /* Unix time at which the query was executed. */
     sds cname;          /* Client name. */
     sds peerid;         /* Client network address. */
 } slowlogEntry;
 
+/* Aggregated statistics of the slow commands with the same shape, that is
+ * the command name followed by the pattern of its keys, see SLOWLOG SHAPES. */
+typedef struct slowlogShape {
+    sds shape;          /* Shape, shared with the key of the dictionary. */
+    long long calls;    /* Number of slow commands with this shape. */
+    long long total;    /* Total time of the commands, in microseconds. */
+    long long max;      /* Slowest command, in microseconds. */
+    time_t time;        /* Unix time of the last command. */
+    uint64_t *histogram; /* Latency histogram, see latency.h. */
+} slowlogShape;
+
 /* Exported API */
 void slowlogInit(void);
-void slowlogPushEntryIfNeeded(client *c, robj **argv, int argc, long long duration);
+long long slowlogPushEntryIfNeeded(client *c, robj **argv, int argc, long long duration, long long queue);
+void slowlogSetWriteTime(long long id, long long write);
 
 /* Exported commands */
 void slowlogCommand(client *c);
@@ -42,35 +42,30 @@ redisSortOperation *createSortOperation(int type, robj *pattern) {
     return so;
 }
 
-/* Return the value associated to the key with a name obtained using
- * the following rules:
- *
- * 1) The first occurrence of '*' in 'pattern' is substituted with 'subst'.
- *
- * 2) If 'pattern' matches the "->" string, everything on the left of
- *    the arrow is treated as the name of a hash field, and the part on the
- *    left as the key name containing a hash. The value of the specified
- *    field is returned.
- *
- * 3) If 'pattern' equals "#", the function simply returns 'subst' itself so
- *    that the SORT command can be used like: SORT key GET # to retrieve
- *    the Set/List elements directly.
- *
- * The returned object will always have its refcount increased by 1
- * when it is non-NULL. */
-robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst, int writeflag) {
+/* The key name, and the hash field if any, a GET or BY pattern refers to
+ * for a given element. See lookupKeyByPattern(). */
+typedef struct sortPatternRef {
+    robj *keyobj;       /* NULL if the pattern is "#" or has no '*'. */
+    robj *fieldobj;     /* NULL unless the pattern is "...->field". */
+} sortPatternRef;
+
+/* Fill 'ref' with the key name, and hash field, obtained substituting
+ * 'subst' in 'pattern', according to the rules of lookupKeyByPattern(). */
+static void sortPatternResolve(robj *pattern, robj *subst, sortPatternRef *ref) {
     char *p, *f, *k;
     sds spat, ssub;
-    robj *keyobj, *fieldobj = NULL, *o;
     int prefixlen, sublen, postfixlen, fieldlen;
 
-    /* If the pattern is "#" return the substitution object itself in order
-     * to implement the "SORT ... GET #" feature. */
+    ref->keyobj = ref->fieldobj = NULL;
+
+    /* The pattern "#" is the element itself, see lookupKeyByPattern(). */
     spat = pattern->ptr;
-    if (spat[0] == '#' && spat[1] == '\0') {
-        incrRefCount(subst);
-        return subst;
-    }
+    if (spat[0] == '#' && spat[1] == '\0') return;
+
+    /* If we can't find '*' in the pattern there is no key, as to GET a
+     * fixed key does not make sense. */
+    p = strchr(spat,'*');
+    if (!p) return;
 
     /* The substitution object may be specially encoded. If so we create
      * a decoded object on the fly. Otherwise getDecodedObject will just
@@ -78,18 +73,10 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst, int writeflag)
     subst = getDecodedObject(subst);
     ssub = subst->ptr;
 
-    /* If we can't find '*' in the pattern we return NULL as to GET a
-     * fixed key does not make sense. */
-    p = strchr(spat,'*');
-    if (!p) {
-        decrRefCount(subst);
-        return NULL;
-    }
-
     /* Find out if we're dealing with a hash dereference. */
     if ((f = strstr(p+1, "->")) != NULL && *(f+2) != '\0') {
         fieldlen = sdslen(spat)-(f-spat)-2;
-        fieldobj = createStringObject(f+2,fieldlen);
+        ref->fieldobj = createStringObject(f+2,fieldlen);
     } else {
         fieldlen = 0;
     }
@@ -98,43 +85,118 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst, int writeflag)
     prefixlen = p-spat;
     sublen = sdslen(ssub);
     postfixlen = sdslen(spat)-(prefixlen+1)-(fieldlen ? fieldlen+2 : 0);
-    keyobj = createStringObject(NULL,prefixlen+sublen+postfixlen);
-    k = keyobj->ptr;
+    ref->keyobj = createStringObject(NULL,prefixlen+sublen+postfixlen);
+    k = ref->keyobj->ptr;
     memcpy(k,spat,prefixlen);
     memcpy(k+prefixlen,ssub,sublen);
     memcpy(k+prefixlen+sublen,p+1,postfixlen);
     decrRefCount(subst); /* Incremented by decodeObject() */
+}
+
+/* Look up the key 'ref' refers to, returning the value as
+ * lookupKeyByPattern() does, and release the objects of 'ref'. */
+static robj *sortPatternLookup(redisDb *db, sortPatternRef *ref, int writeflag) {
+    robj *o;
+
+    if (ref->keyobj == NULL) return NULL;
 
     /* Lookup substituted key */
     if (!writeflag)
-        o = lookupKeyRead(db,keyobj);
+        o = lookupKeyRead(db,ref->keyobj);
     else
-        o = lookupKeyWrite(db,keyobj);
+        o = lookupKeyWrite(db,ref->keyobj);
     if (o == NULL) goto noobj;
 
-    if (fieldobj) {
+    if (ref->fieldobj) {
         if (o->type != OBJ_HASH) goto noobj;
 
         /* Retrieve value from hash by the field name. The returend object
          * is a new object with refcount already incremented. */
-        o = hashTypeGetValueObject(o, fieldobj->ptr);
+        o = hashTypeGetValueObject(o, ref->fieldobj->ptr);
     } else {
         if (o->type != OBJ_STRING) goto noobj;
 
         /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+         * increased. sortCommand decreases it again. Roaring bitmaps and
+         * compressed strings are returned as plain strings. */
+        if (o->encoding == OBJ_ENCODING_ROARING ||
+            o->encoding == OBJ_ENCODING_COMPRESSED)
+            o = getDecodedObject(o);
+        else
+            incrRefCount(o);
     }
-    decrRefCount(keyobj);
-    if (fieldobj) decrRefCount(fieldobj);
+    decrRefCount(ref->keyobj);
+    if (ref->fieldobj) decrRefCount(ref->fieldobj);
     return o;
 
 noobj:
-    decrRefCount(keyobj);
-    if (fieldlen) decrRefCount(fieldobj);
+    decrRefCount(ref->keyobj);
+    if (ref->fieldobj) decrRefCount(ref->fieldobj);
     return NULL;
 }
 
+/* Return the value associated to the key with a name obtained using
+ * the following rules:
+ *
+ * 1) The first occurrence of '*' in 'pattern' is substituted with 'subst'.
+ *
+ * 2) If 'pattern' matches the "->" string, everything on the left of
+ *    the arrow is treated as the name of a hash field, and the part on the
+ *    left as the key name containing a hash. The value of the specified
+ *    field is returned.
+ *
+ * 3) If 'pattern' equals "#", the function simply returns 'subst' itself so
+ *    that the SORT command can be used like: SORT key GET # to retrieve
+ *    the Set/List elements directly.
+ *
+ * The returned object will always have its refcount increased by 1
+ * when it is non-NULL. */
+robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst, int writeflag) {
+    sortPatternRef ref;
+    sds spat = pattern->ptr;
+
+    /* If the pattern is "#" return the substitution object itself in order
+     * to implement the "SORT ... GET #" feature. */
+    if (spat[0] == '#' && spat[1] == '\0') {
+        incrRefCount(subst);
+        return subst;
+    }
+    sortPatternResolve(pattern,subst,&ref);
+    return sortPatternLookup(db,&ref,writeflag);
+}
+
+/* Lookups of many elements are performed in batches of this size: the key
+ * names of the whole batch are built and their buckets prefetched before
+ * the first lookup, so that the cache misses of the batch overlap instead
+ * of being paid one after the other. */
+#define SORT_LOOKUP_BATCH 16
+
+/* Like lookupKeyByPattern() for the 'count' elements of 'vector', at most
+ * SORT_LOOKUP_BATCH, storing the values in 'vals'. */
+static void lookupKeysByPattern(redisDb *db, robj *pattern,
+                                redisSortObject *vector, int count,
+                                int writeflag, robj **vals)
+{
+    sortPatternRef refs[SORT_LOOKUP_BATCH];
+    sds spat = pattern->ptr;
+    int j;
+
+    serverAssert(count <= SORT_LOOKUP_BATCH);
+    if (spat[0] == '#' && spat[1] == '\0') {
+        for (j = 0; j < count; j++) {
+            vals[j] = vector[j].obj;
+            incrRefCount(vals[j]);
+        }
+        return;
+    }
+    for (j = 0; j < count; j++) {
+        sortPatternResolve(pattern,vector[j].obj,&refs[j]);
+        if (refs[j].keyobj) dictPrefetch(db->dict,refs[j].keyobj->ptr);
+    }
+    for (j = 0; j < count; j++)
+        vals[j] = sortPatternLookup(db,&refs[j],writeflag);
+}
+
 /* sortCompare() is used by qsort in sortCommand(). Given that qsort_r with
  * the additional parameter is not standard but a BSD-specific we have to
  * pass sorting parameters via the global 'server' structure */
@@ -187,6 +249,88 @@ int sortCompare(const void *s1, const void *s2) {
     return server.sort_desc ? -cmp : cmp;
 }
 
+/* Look up the GET patterns of 'operations' for the 'count' elements of
+ * 'vector', at most SORT_LOOKUP_BATCH: the value of the element j for the
+ * operation k is stored at vals[k*SORT_LOOKUP_BATCH+j]. */
+static void lookupSortOperations(redisDb *db, list *operations,
+                                 redisSortObject *vector, int count,
+                                 int writeflag, robj **vals)
+{
+    listNode *ln;
+    listIter li;
+    int k = 0;
+
+    listRewind(operations,&li);
+    while((ln = listNext(&li))) {
+        redisSortOperation *sop = ln->value;
+
+        /* GET is the only operation. */
+        serverAssert(sop->type == SORT_OP_GET);
+        lookupKeysByPattern(db,sop->pattern,vector,count,writeflag,
+                            vals+k*SORT_LOOKUP_BATCH);
+        k++;
+    }
+}
+
+/* Numeric sorts of at least this number of elements use sortRadix(). */
+#define SORT_RADIX_MIN_LEN 512
+
+/* Map a score to an unsigned integer with the same ordering. */
+static inline uint64_t sortRadixKey(double score) {
+    uint64_t bits;
+
+    /* -0 and +0 are equal scores, ordered by element like in sortCompare(). */
+    if (score == 0) score = 0;
+    memcpy(&bits,&score,sizeof(bits));
+    return (bits & (1ULL<<63)) ? ~bits : bits | (1ULL<<63);
+}
+
+/* Sort the vector of a numeric SORT, with the same result of qsort() with
+ * sortCompare(), in linear time: a LSD radix sort over the scores, then the
+ * elements with the same score are ordered by sortCompare(). */
+static void sortRadix(redisSortObject *vector, long len) {
+    redisSortObject *tmp = zmalloc(sizeof(redisSortObject)*len);
+    redisSortObject *src = vector, *dst = tmp, *swap;
+    long j, count[256];
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        memset(count,0,sizeof(count));
+        for (j = 0; j < len; j++)
+            count[(sortRadixKey(src[j].u.score) >> shift) & 0xff]++;
+        /* Skip the digits that are the same for all the scores, like the
+         * higher bytes of small integers. */
+        if (count[(sortRadixKey(src[0].u.score) >> shift) & 0xff] == len)
+            continue;
+        for (long sum = 0, c, k = 0; k < 256; k++) {
+            c = count[k];
+            count[k] = sum;
+            sum += c;
+        }
+        for (j = 0; j < len; j++)
+            dst[count[(sortRadixKey(src[j].u.score) >> shift) & 0xff]++] = src[j];
+        swap = src; src = dst; dst = swap;
+    }
+    if (src != vector) memcpy(vector,src,sizeof(redisSortObject)*len);
+    zfree(tmp);
+
+    /* The vector is ascending: reverse it for DESC, then order the runs of
+     * elements with the same score. */
+    if (server.sort_desc) {
+        for (j = 0; j < len/2; j++) {
+            redisSortObject aux = vector[j];
+            vector[j] = vector[len-1-j];
+            vector[len-1-j] = aux;
+        }
+    }
+    for (j = 0; j < len; ) {
+        long run = j+1;
+        while (run < len && vector[run].u.score == vector[j].u.score) run++;
+        if (run-j > 1)
+            qsort(vector+j,run-j,sizeof(redisSortObject),sortCompare);
+        j = run;
+    }
+}
+
 /* The SORT command is the most complex command in Redis. Warning: this code
  * is optimized for speed and a bit less for readability */
 void sortCommand(client *c) {
@@ -455,11 +599,20 @@ void sortCommand(client *c) {
 
     /* Now it's time to load the right scores in the sorting vector */
     if (!dontsort) {
+        robj *byvals[SORT_LOOKUP_BATCH];
+
         for (j = 0; j < vectorlen; j++) {
             robj *byval;
             if (sortby) {
-                /* lookup value to sort by */
-                byval = lookupKeyByPattern(c->db,sortby,vector[j].obj,storekey!=NULL);
+                /* lookup value to sort by, a batch at a time */
+                int batch = j % SORT_LOOKUP_BATCH;
+                if (batch == 0) {
+                    int count = vectorlen-j;
+                    if (count > SORT_LOOKUP_BATCH) count = SORT_LOOKUP_BATCH;
+                    lookupKeysByPattern(c->db,sortby,vector+j,count,
+                                        storekey!=NULL,byvals);
+                }
+                byval = byvals[batch];
                 if (!byval) continue;
             } else {
                 /* use object itself to sort by */
@@ -499,10 +652,15 @@ void sortCommand(client *c) {
         server.sort_alpha = alpha;
         server.sort_bypattern = sortby ? 1 : 0;
         server.sort_store = storekey ? 1 : 0;
-        if (sortby && (start != 0 || end != vectorlen-1))
+        if (int_conversion_error || end < start) {
+            /* Nothing to sort: an error or nothing is returned. */
+        } else if (start != 0 || end != vectorlen-1) {
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
-        else
+        } else if (!alpha && vectorlen >= SORT_RADIX_MIN_LEN) {
+            sortRadix(vector,vectorlen);
+        } else {
             qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
+        }
     }
 
     /* Send command output to the output buffer, performing the specified
@@ -511,64 +669,63 @@ void sortCommand(client *c) {
     if (int_conversion_error) {
         addReplyError(c,"One or more scores can't be converted into double");
     } else if (storekey == NULL) {
+        robj **getvals = zmalloc(sizeof(robj*)*getop*SORT_LOOKUP_BATCH);
+
         /* STORE option not specified, sent the sorting result to client */
         addReplyArrayLen(c,outputlen);
         for (j = start; j <= end; j++) {
-            listNode *ln;
-            listIter li;
+            int batch = (j-start) % SORT_LOOKUP_BATCH;
 
             if (!getop) addReplyBulk(c,vector[j].obj);
-            listRewind(operations,&li);
-            while((ln = listNext(&li))) {
-                redisSortOperation *sop = ln->value;
-                robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                    vector[j].obj,storekey!=NULL);
-
-                if (sop->type == SORT_OP_GET) {
-                    if (!val) {
-                        addReplyNull(c);
-                    } else {
-                        addReplyBulk(c,val);
-                        decrRefCount(val);
-                    }
+            if (getop && batch == 0) {
+                int count = end-j+1;
+                if (count > SORT_LOOKUP_BATCH) count = SORT_LOOKUP_BATCH;
+                lookupSortOperations(c->db,operations,vector+j,count,
+                                     storekey!=NULL,getvals);
+            }
+            for (int k = 0; k < getop; k++) {
+                robj *val = getvals[k*SORT_LOOKUP_BATCH+batch];
+
+                if (!val) {
+                    addReplyNull(c);
                 } else {
-                    /* Always fails */
-                    serverAssertWithInfo(c,sortval,sop->type == SORT_OP_GET);
+                    addReplyBulk(c,val);
+                    decrRefCount(val);
                 }
             }
         }
+        zfree(getvals);
     } else {
         robj *sobj = createQuicklistObject();
+        robj **getvals = zmalloc(sizeof(robj*)*getop*SORT_LOOKUP_BATCH);
 
         /* STORE option specified, set the sorting result as a List object */
         for (j = start; j <= end; j++) {
-            listNode *ln;
-            listIter li;
+            int batch = (j-start) % SORT_LOOKUP_BATCH;
 
             if (!getop) {
                 listTypePush(sobj,vector[j].obj,LIST_TAIL);
-            } else {
-                listRewind(operations,&li);
-                while((ln = listNext(&li))) {
-                    redisSortOperation *sop = ln->value;
-                    robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                        vector[j].obj,storekey!=NULL);
-
-                    if (sop->type == SORT_OP_GET) {
-                        if (!val) val = createStringObject("",0);
-
-                        /* listTypePush does an incrRefCount, so we should take care
-                         * care of the incremented refcount caused by either
-                         * lookupKeyByPattern or createStringObject("",0) */
-                        listTypePush(sobj,val,LIST_TAIL);
-                        decrRefCount(val);
-                    } else {
-                        /* Always fails */
-                        serverAssertWithInfo(c,sortval,sop->type == SORT_OP_GET);
-                    }
-                }
+                continue;
+            }
+            if (batch == 0) {
+                int count = end-j+1;
+                if (count > SORT_LOOKUP_BATCH) count = SORT_LOOKUP_BATCH;
+                lookupSortOperations(c->db,operations,vector+j,count,
+                                     storekey!=NULL,getvals);
+            }
+            for (int k = 0; k < getop; k++) {
+                robj *val = getvals[k*SORT_LOOKUP_BATCH+batch];
+
+                if (!val) val = createStringObject("",0);
+
+                /* listTypePush does an incrRefCount, so we should take care
+                 * care of the incremented refcount caused by either
+                 * lookupKeyByPattern or createStringObject("",0) */
+                listTypePush(sobj,val,LIST_TAIL);
+                decrRefCount(val);
             }
         }
+        zfree(getvals);
         if (outputlen) {
             setKey(c->db,storekey,sobj);
             notifyKeyspaceEvent(NOTIFY_LIST,"sortstore",storekey,
@@ -0,0 +1,185 @@
+/* Output buffers spilled to disk.
+ *
+ * When 'client-output-buffer-spill-threshold' is set, the output buffer
+ * blocks of the replicas and of the Pub/Sub clients that exceed the
+ * threshold are moved to a temporary file, instead of growing the memory
+ * until the client output buffer limits disconnect them: a replica stalled
+ * for a few seconds then does not need a full resynchronization.
+ *
+ * A spilled block is copied in the file and the region of the file is
+ * memory mapped in place of the original allocation: the block keeps its
+ * layout, so writeToClient() streams it back from the page cache with no
+ * special handling, and the kernel can write the pages back to disk and
+ * drop them when memory is needed. The 'spilled' field of the block tells
+ * how it must be released.
+ *
+ * The file is append only, and it is unlinked as soon as it is created, so
+ * that it does not outlive the server. The space of the released blocks is
+ * given back to the file system where possible, and the file is truncated
+ * once no block is stored in it anymore.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+#include "atomicvar.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* Every spilled block is mapped on its own, starting at a page boundary
+ * of the file with this header, followed by the block. */
+typedef struct spillHeader {
+    off_t offset;           /* Offset of the mapping in the file. */
+    size_t len;             /* Length of the mapping. */
+} spillHeader;
+
+static struct {
+    int fd;                 /* The spill file, -1 until the first spill. */
+    off_t size;             /* Bytes appended to the file so far. */
+    size_t blocks;          /* Blocks in the file. Atomic: the blocks are
+                               released by the I/O threads as well. */
+    size_t bytes;           /* Bytes of the blocks in the file. Atomic. */
+} spill = {-1,0,0,0};
+
+static int spillOpen(void) {
+    char tmpfile[256];
+
+    snprintf(tmpfile,sizeof(tmpfile),"temp-spill-%d.tmp",(int)getpid());
+    spill.fd = open(tmpfile,O_RDWR|O_CREAT|O_TRUNC,0600);
+    if (spill.fd == -1) {
+        serverLog(LL_WARNING,"Can't create the output buffers spill file "
+            "%s: %s", tmpfile, strerror(errno));
+        return C_ERR;
+    }
+    unlink(tmpfile);
+    spill.size = 0;
+    return C_OK;
+}
+
+static int spillPwrite(const void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t nwritten = pwrite(spill.fd,buf,len,offset);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten == -1) return -1;
+        buf = (const char*)buf + nwritten;
+        len -= nwritten;
+        offset += nwritten;
+    }
+    return 0;
+}
+
+/* Copy the 'len' bytes at 'p' to the spill file and return a pointer to
+ * the mapped copy, that can be modified and must be released with
+ * spillRelease(). Returns NULL if the data can't be spilled, for instance
+ * because the disk is full: the caller should just keep it in memory.
+ *
+ * Only the main thread spills blocks. */
+void *spillStore(const void *p, size_t len) {
+    static long pagesize = 0;
+    static time_t last_error = 0;
+    spillHeader hdr;
+    void *map;
+
+    if (spill.fd == -1 && spillOpen() == C_ERR) return NULL;
+    if (pagesize == 0) pagesize = sysconf(_SC_PAGESIZE);
+
+    /* The data is written with pwrite() instead of through the mapping,
+     * so that a full disk is reported here instead of killing the process
+     * with SIGBUS later. */
+    hdr.offset = spill.size;
+    hdr.len = (sizeof(hdr)+len+pagesize-1) & ~(pagesize-1);
+    if (spillPwrite(&hdr,sizeof(hdr),hdr.offset) == -1 ||
+        spillPwrite(p,len,hdr.offset+sizeof(hdr)) == -1)
+    {
+        goto error;
+    }
+    map = mmap(NULL,hdr.len,PROT_READ|PROT_WRITE,MAP_SHARED,spill.fd,
+               hdr.offset);
+    if (map == MAP_FAILED) goto error;
+
+    spill.size += hdr.len;
+    atomicIncr(spill.blocks,1);
+    atomicIncr(spill.bytes,hdr.len);
+    return (char*)map+sizeof(hdr);
+
+error:
+    /* Log at most once per minute: this happens for every block while
+     * the disk is full. */
+    if (server.unixtime - last_error > 60) {
+        serverLog(LL_WARNING,"Can't spill output buffers to disk: %s",
+            strerror(errno));
+        last_error = server.unixtime;
+    }
+    return NULL;
+}
+
+/* Release a block returned by spillStore(). May be called by the I/O
+ * threads. */
+void spillRelease(void *p) {
+    spillHeader *hdr = (spillHeader*)((char*)p - sizeof(spillHeader));
+    off_t offset = hdr->offset;
+    size_t len = hdr->len;
+
+    munmap(hdr,len);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    /* Give the space back to the file system, the file is truncated only
+     * when it is empty. */
+    fallocate(spill.fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,offset,len);
+#else
+    UNUSED(offset);
+#endif
+    atomicDecr(spill.bytes,len);
+    atomicDecr(spill.blocks,1);
+}
+
+/* Called by serverCron(): drop the file once no block is stored in it.
+ * Blocks are only added by the main thread, so none can be added
+ * concurrently. Child processes may still map the blocks they inherited.
+ * The file is unlinked already, so closing it releases its blocks: this is
+ * done in background, as it is slow for a big file, and the next spill
+ * creates a new file. */
+void spillCron(void) {
+    size_t blocks;
+
+    atomicGet(spill.blocks,blocks);
+    if (spill.fd == -1 || spill.size == 0 || blocks ||
+        hasActiveChildProcess()) return;
+    bioCloseFile(spill.fd);
+    spill.fd = -1;
+    spill.size = 0;
+}
+
+/* Bytes of the blocks currently spilled to disk. */
+size_t spillUsedBytes(void) {
+    size_t bytes;
+
+    atomicGet(spill.bytes,bytes);
+    return bytes;
+}
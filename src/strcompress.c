@@ -0,0 +1,223 @@
+/* Transparent compression of large string values.
+ *
+ * When 'string-compression-threshold' is not zero, tryObjectEncoding()
+ * compresses with LZ4 the strings of at least that many bytes stored in
+ * the keyspace, if this saves at least 1/8 of the memory. The value gets
+ * the OBJ_ENCODING_COMPRESSED encoding and 'ptr' references a
+ * compressedString structure, holding the length of the original string
+ * and the compressed data.
+ *
+ * The commands returning the whole value, or a part of it, like GET, MGET,
+ * GETRANGE or STRLEN, work on the compressed value: the string is
+ * decompressed into a scratch buffer owned by the calling thread, that is
+ * reused by the next reads, so that I/O threads can serve such commands as
+ * well. The commands modifying the value in place, like APPEND, SETRANGE or
+ * INCR, and the ones of the bitmap, HyperLogLog and Bloom filter types,
+ * find instead a plain string, since lookupKey() converts the value back to
+ * the RAW encoding, and the value stays uncompressed until it is set again.
+ *
+ * The values are saved in RDB files, rewritten in the AOF and sent to the
+ * replicas as plain strings, so the compression is just a representation
+ * in memory. Similar JSON or text documents compress much better with a
+ * dictionary of typical content: 'string-compression-dict' can name a file
+ * whose last 64k are used as the dictionary, as if every value was the
+ * continuation of it. Since the dictionary is needed to read the values
+ * back, it can only be loaded at startup.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "lz4.h"
+
+#include <sys/stat.h>
+
+#define STRING_COMPRESSION_DICT_MAX (64*1024) /* LZ4 window size. */
+#define STRING_COMPRESSION_SCRATCH_KEEP (1024*1024) /* Scratch size kept. */
+
+static unsigned char *compressionDict = NULL;
+static size_t compressionDictLen = 0;
+
+/* The scratch buffer of every thread starts with a copy of the dictionary,
+ * followed by the decompressed string. */
+static __thread unsigned char *scratch = NULL;
+static __thread size_t scratchSize = 0;
+
+/* Load the dictionary configured with 'string-compression-dict', if any.
+ * Called at startup, before the data is loaded. */
+void stringCompressionInit(void) {
+    struct stat sb;
+    off_t offset;
+    FILE *fp;
+
+    if (server.string_compression_dict == NULL ||
+        server.string_compression_dict[0] == '\0') return;
+
+    if ((fp = fopen(server.string_compression_dict,"r")) == NULL ||
+        fstat(fileno(fp),&sb) == -1)
+    {
+        serverLog(LL_WARNING,"Can't open the string compression dictionary "
+            "%s: %s", server.string_compression_dict, strerror(errno));
+        exit(1);
+    }
+    compressionDictLen = sb.st_size > STRING_COMPRESSION_DICT_MAX ?
+                         STRING_COMPRESSION_DICT_MAX : sb.st_size;
+    offset = sb.st_size-compressionDictLen;
+    compressionDict = zmalloc(compressionDictLen);
+    if (fseeko(fp,offset,SEEK_SET) == -1 ||
+        fread(compressionDict,compressionDictLen,1,fp) != 1)
+    {
+        serverLog(LL_WARNING,"Can't read the string compression dictionary "
+            "%s", server.string_compression_dict);
+        exit(1);
+    }
+    fclose(fp);
+    serverLog(LL_NOTICE,"String compression dictionary of %zu bytes loaded",
+        compressionDictLen);
+}
+
+/* Return the scratch buffer of the calling thread, with room for 'len'
+ * bytes after the dictionary. A buffer larger than
+ * STRING_COMPRESSION_SCRATCH_KEEP is released when no longer needed, so
+ * that reading a huge value doesn't keep its size allocated. */
+static unsigned char *stringScratch(size_t len) {
+    size_t size = compressionDictLen+len;
+
+    if (size > scratchSize ||
+        (scratchSize > STRING_COMPRESSION_SCRATCH_KEEP &&
+         size <= STRING_COMPRESSION_SCRATCH_KEEP))
+    {
+        /* The scratch buffer doesn't belong to the DB of the command. */
+        int main_thread = pthread_equal(pthread_self(),server.main_thread_id);
+        redisDb *prev = main_thread ? dbMemoryAccountingSwitch(NULL) : NULL;
+
+        zfree(scratch);
+        scratch = zmalloc(size);
+        scratchSize = size;
+        memcpy(scratch,compressionDict,compressionDictLen);
+        if (main_thread) dbMemoryAccountingSwitch(prev);
+    }
+    return scratch+compressionDictLen;
+}
+
+/* Return 1 if the string 'o', of 'len' bytes, should be compressed. */
+static int stringShouldCompress(robj *o, size_t len) {
+    return server.string_compression_threshold &&
+           o->encoding == OBJ_ENCODING_RAW &&
+           len >= (unsigned long long)server.string_compression_threshold &&
+           len <= UINT32_MAX-STRING_COMPRESSION_DICT_MAX;
+}
+
+/* Compress the RAW encoded string 'o' in place if its length is above the
+ * threshold and the compressed string takes at least 1/8 less memory.
+ * Returns 1 if the string was compressed, otherwise 0. */
+int stringTryCompress(robj *o) {
+    sds s = o->ptr;
+    size_t len = sdslen(s);
+    compressedString *cs;
+    const unsigned char *in = (unsigned char*)s;
+    size_t maxlen;
+    unsigned int clen;
+
+    if (!stringShouldCompress(o,len)) return 0;
+    maxlen = len-len/8;
+    if (maxlen <= sizeof(*cs)) return 0;
+    maxlen -= sizeof(*cs);
+
+    /* With a dictionary the input must follow it in memory. */
+    if (compressionDictLen) {
+        unsigned char *buf = stringScratch(len);
+        memcpy(buf,s,len);
+        in = buf;
+    }
+    cs = zmalloc(sizeof(*cs)+maxlen);
+    clen = lz4_compress_dict(in,len,compressionDictLen,cs->data,maxlen);
+    if (clen == 0) {
+        zfree(cs);
+        return 0;
+    }
+    cs = zrealloc(cs,sizeof(*cs)+clen);
+    cs->len = len;
+    cs->clen = clen;
+    sdsfree(s);
+    o->ptr = cs;
+    o->encoding = OBJ_ENCODING_COMPRESSED;
+    server.stat_string_compressions++;
+    return 1;
+}
+
+/* Return the length of the string compressed in 'o'. */
+size_t stringCompressedLen(const robj *o) {
+    return ((compressedString*)o->ptr)->len;
+}
+
+/* Decompress the string 'o' into the scratch buffer of the calling thread,
+ * and return it, setting '*len' to its length. The buffer is valid until
+ * the next call of this function by the same thread. */
+char *stringDecompressToScratch(const robj *o, size_t *len) {
+    compressedString *cs = o->ptr;
+    unsigned char *buf = stringScratch(cs->len);
+
+    if (lz4_decompress_dict(cs->data,cs->clen,compressionDictLen,buf,
+                            cs->len) != cs->len)
+    {
+        serverPanic("Corrupted compressed string");
+    }
+    *len = cs->len;
+    return (char*)buf;
+}
+
+/* Decompress the string 'o' in place, turning it into a RAW string. */
+void stringDecompress(robj *o) {
+    size_t len;
+    char *buf;
+
+    serverAssert(o->type == OBJ_STRING &&
+                 o->encoding == OBJ_ENCODING_COMPRESSED);
+    buf = stringDecompressToScratch(o,&len);
+    zfree(o->ptr);
+    o->ptr = sdsnewlen(buf,len);
+    o->encoding = OBJ_ENCODING_RAW;
+    server.stat_string_decompressions++;
+}
+
+/* Return 1 if the command 'cmd' needs the compressed strings it reads to be
+ * converted to plain strings first, see lookupKey(). The commands of the
+ * other types don't look into the string values, or use the functions
+ * above, like DUMP, SORT or OBJECT. */
+int stringCompressionCommandNeedsRaw(struct redisCommand *cmd) {
+    if (!(cmd->flags & (CMD_CATEGORY_STRING|CMD_CATEGORY_BITMAP|
+                        CMD_CATEGORY_HYPERLOGLOG|CMD_CATEGORY_BLOOM)))
+        return 0;
+    return cmd->proc != getCommand && cmd->proc != mgetCommand &&
+           cmd->proc != getsetCommand && cmd->proc != getrangeCommand &&
+           cmd->proc != strlenCommand && cmd->proc != setCommand &&
+           cmd->proc != setnxCommand && cmd->proc != setexCommand &&
+           cmd->proc != psetexCommand && cmd->proc != msetCommand &&
+           cmd->proc != msetnxCommand;
+}
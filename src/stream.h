@@ -17,6 +17,9 @@ typedef struct stream {
     rax *rax;               /* The radix tree holding the stream. */
     uint64_t length;        /* Number of elements inside this stream. */
     streamID last_id;       /* Zero if there are yet no items. */
+    streamID first_id;      /* The first non-tombstone entry, zero if empty. */
+    streamID max_deleted_entry_id;  /* The maximal ID that was deleted. */
+    uint64_t entries_added; /* All time count of elements added. */
     rax *cgroups;           /* Consumer groups dictionary: name -> streamCG */
 } stream;
 
@@ -32,6 +35,9 @@ typedef struct streamIterator {
     uint64_t master_fields_count;       /* Master entries # of fields. */
     unsigned char *master_fields_start; /* Master entries start in listpack. */
     unsigned char *master_fields_ptr;   /* Master field to emit next. */
+    unsigned char *base_values_start;   /* Values of the first entry of the
+                                           listpack, NULL if not seeked. */
+    unsigned char *base_values_ptr;     /* Base of the value to emit next. */
     int entry_flags;                    /* Flags of entry we are emitting. */
     int rev;                /* True if iterating end to start (reverse). */
     uint64_t start_key[2];  /* Start key as 128 bit big endian. */
@@ -44,14 +50,23 @@ typedef struct streamIterator {
      * integer encoded, so that there is no string representation of the
      * element inside the listpack itself. */
     unsigned char field_buf[LP_INTBUF_SIZE];
-    unsigned char value_buf[LP_INTBUF_SIZE];
+    unsigned char value_buf[LP_INTBUF_SIZE];  /* Also used for the values
+                                                 coded as deltas. */
 } streamIterator;
 
+/* The entries_read of a consumer group that is not known. */
+#define SCG_INVALID_ENTRIES_READ -1
+
 /* Consumer group. */
 typedef struct streamCG {
     streamID last_id;       /* Last delivered (not acknowledged) ID for this
                                group. Consumers that will just ask for more
                                messages will served with IDs > than this. */
+    long long entries_read; /* In a perfect world (CG starts at 0-0, no dels, no
+                               XGROUP SETID, ...), this is the total number of
+                               group reads. In the real world, the reasoning behind
+                               this value is detailed at the top comment of
+                               streamEstimateDistanceFromFirstEverEntry(). */
     rax *pel;               /* Pending entries list. This is a radix tree that
                                has every message delivered to consumers (without
                                the NOACK option) that was yet not acknowledged
@@ -61,6 +76,11 @@ typedef struct streamCG {
     rax *consumers;         /* A radix tree representing the consumers by name
                                and their associated representation in the form
                                of streamConsumer structures. */
+    rax *pel_by_time;       /* The entries of the PEL ordered by delivery time,
+                               so that the idle ones are found without a full
+                               scan. The keys are the delivery time as a 64 bit
+                               big endian number followed by the ID, with no
+                               associated value. */
 } streamCG;
 
 /* A specific consumer in a consumer group.  */
@@ -106,10 +126,19 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
 void streamIteratorStop(streamIterator *si);
 streamCG *streamLookupCG(stream *s, sds groupname);
 streamConsumer *streamLookupConsumer(streamCG *cg, sds name, int create);
-streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id);
+streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id, long long entries_read);
 streamNACK *streamCreateNACK(streamConsumer *consumer);
+void streamIndexNACK(streamCG *cg, unsigned char *rawid, streamNACK *nack);
+void streamUnindexNACK(streamCG *cg, unsigned char *rawid, streamNACK *nack);
+void streamEncodeID(void *buf, streamID *id);
 void streamDecodeID(void *buf, streamID *id);
 int streamCompareID(streamID *a, streamID *b);
 void streamFreeNACK(streamNACK *na);
+void streamGetEdgeID(stream *s, int first, streamID *edge_id);
+long long streamEstimateDistanceFromFirstEverEntry(stream *s, streamID *id);
+void streamNextID(streamID *last_id, streamID *new_id);
+void streamAppendItems(stream *s, robj ***argv, int64_t *numfields, streamID *ids, long count);
+int64_t streamTrimByLength(stream *s, size_t maxlen, int approx);
+robj *createObjectFromStreamID(streamID *id);
 
 #endif
@@ -35,16 +35,16 @@
  *----------------------------------------------------------------------------*/
 
 /* Check the length of a number of objects to see if we need to convert a
- * ziplist to a real hash. Note that we only check string encoded objects
+ * listpack to a real hash. Note that we only check string encoded objects
  * as their string length can be queried in constant time. */
 void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     int i;
 
-    if (o->encoding != OBJ_ENCODING_ZIPLIST) return;
+    if (o->encoding != OBJ_ENCODING_LISTPACK) return;
 
     for (i = start; i <= end; i++) {
         if (sdsEncodedObject(argv[i]) &&
-            sdslen(argv[i]->ptr) > server.hash_max_ziplist_value)
+            sdslen(argv[i]->ptr) > server.hash_max_listpack_value)
         {
             hashTypeConvert(o, OBJ_ENCODING_HT);
             break;
@@ -52,32 +52,30 @@ void hashTypeTryConversion(robj *o, robj **argv, int start, int end) {
     }
 }
 
-/* Get the value from a ziplist encoded hash, identified by field.
+/* Get the value from a listpack encoded hash, identified by field.
  * Returns -1 when the field cannot be found. */
-int hashTypeGetFromZiplist(robj *o, sds field,
-                           unsigned char **vstr,
-                           unsigned int *vlen,
-                           long long *vll)
+int hashTypeGetFromListpack(robj *o, sds field,
+                            unsigned char **vstr,
+                            unsigned int *vlen,
+                            long long *vll)
 {
-    unsigned char *zl, *fptr = NULL, *vptr = NULL;
-    int ret;
+    unsigned char *lp, *fptr = NULL, *vptr = NULL;
 
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    lp = o->ptr;
+    fptr = lpFirst(lp);
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+        fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
         if (fptr != NULL) {
             /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
+            vptr = lpNext(lp, fptr);
             serverAssert(vptr != NULL);
         }
     }
 
     if (vptr != NULL) {
-        ret = ziplistGet(vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(vptr, vlen, vll);
         return 0;
     }
 
@@ -107,9 +105,9 @@ sds hashTypeGetFromHashTable(robj *o, sds field) {
  * can always check the function return by checking the return value
  * for C_OK and checking if vll (or vstr) is NULL. */
 int hashTypeGetValue(robj *o, sds field, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        if (hashTypeGetFromZiplist(o, field, vstr, vlen, vll) == 0)
+        if (hashTypeGetFromListpack(o, field, vstr, vlen, vll) == 0)
             return C_OK;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds value;
@@ -143,12 +141,12 @@ robj *hashTypeGetValueObject(robj *o, sds field) {
  * exist. */
 size_t hashTypeGetValueLength(robj *o, sds field) {
     size_t len = 0;
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0)
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0)
             len = vstr ? vlen : sdigits10(vll);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         sds aux;
@@ -164,12 +162,12 @@ size_t hashTypeGetValueLength(robj *o, sds field) {
 /* Test if the specified field exists in the given hash. Returns 1 if the field
  * exists, and 0 when it doesn't. */
 int hashTypeExists(robj *o, sds field) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        if (hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll) == 0) return 1;
+        if (hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll) == 0) return 1;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         if (hashTypeGetFromHashTable(o, field) != NULL) return 1;
     } else {
@@ -202,39 +200,34 @@ int hashTypeExists(robj *o, sds field) {
 int hashTypeSet(robj *o, sds field, sds value, int flags) {
     int update = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr, *vptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr, *vptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
                 /* Grab pointer to the value (fptr points to the field) */
-                vptr = ziplistNext(zl, fptr);
+                vptr = lpNext(lp, fptr);
                 serverAssert(vptr != NULL);
                 update = 1;
 
-                /* Delete value */
-                zl = ziplistDelete(zl, &vptr);
-
-                /* Insert new value */
-                zl = ziplistInsert(zl, vptr, (unsigned char*)value,
-                        sdslen(value));
+                /* Replace value */
+                lp = lpInsert(lp, (unsigned char*)value, sdslen(value),
+                        vptr, LP_REPLACE, NULL);
             }
         }
 
         if (!update) {
-            /* Push new field/value pair onto the tail of the ziplist */
-            zl = ziplistPush(zl, (unsigned char*)field, sdslen(field),
-                    ZIPLIST_TAIL);
-            zl = ziplistPush(zl, (unsigned char*)value, sdslen(value),
-                    ZIPLIST_TAIL);
+            /* Push new field/value pair onto the tail of the listpack */
+            lp = lpAppend(lp, (unsigned char*)field, sdslen(field));
+            lp = lpAppend(lp, (unsigned char*)value, sdslen(value));
         }
-        o->ptr = zl;
+        o->ptr = lp;
 
-        /* Check if the ziplist needs to be converted to a hash table */
-        if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+        /* Check if the listpack needs to be converted to a hash table */
+        if (hashTypeLength(o) > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictFind(o->ptr,field);
@@ -279,17 +272,17 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
 int hashTypeDelete(robj *o, sds field) {
     int deleted = 0;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl, *fptr;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp, *fptr;
 
-        zl = o->ptr;
-        fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+        lp = o->ptr;
+        fptr = lpFirst(lp);
         if (fptr != NULL) {
-            fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
+            fptr = lpFind(lp, fptr, (unsigned char*)field, sdslen(field), 1);
             if (fptr != NULL) {
-                zl = ziplistDelete(zl,&fptr); /* Delete the key. */
-                zl = ziplistDelete(zl,&fptr); /* Delete the value. */
-                o->ptr = zl;
+                lp = lpDelete(lp,fptr,&fptr); /* Delete the key. */
+                lp = lpDelete(lp,fptr,&fptr); /* Delete the value. */
+                o->ptr = lp;
                 deleted = 1;
             }
         }
@@ -311,8 +304,8 @@ int hashTypeDelete(robj *o, sds field) {
 unsigned long hashTypeLength(const robj *o) {
     unsigned long length = ULONG_MAX;
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        length = ziplistLen(o->ptr) / 2;
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        length = lpLength(o->ptr) / 2;
     } else if (o->encoding == OBJ_ENCODING_HT) {
         length = dictSize((const dict*)o->ptr);
     } else {
@@ -326,7 +319,7 @@ hashTypeIterator *hashTypeInitIterator(robj *subject) {
     hi->subject = subject;
     hi->encoding = subject->encoding;
 
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         hi->fptr = NULL;
         hi->vptr = NULL;
     } else if (hi->encoding == OBJ_ENCODING_HT) {
@@ -346,27 +339,27 @@ void hashTypeReleaseIterator(hashTypeIterator *hi) {
 /* Move to the next entry in the hash. Return C_OK when the next entry
  * could be found and C_ERR when the iterator reaches the end. */
 int hashTypeNext(hashTypeIterator *hi) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
-        unsigned char *zl;
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp;
         unsigned char *fptr, *vptr;
 
-        zl = hi->subject->ptr;
+        lp = hi->subject->ptr;
         fptr = hi->fptr;
         vptr = hi->vptr;
 
         if (fptr == NULL) {
             /* Initialize cursor */
             serverAssert(vptr == NULL);
-            fptr = ziplistIndex(zl, 0);
+            fptr = lpFirst(lp);
         } else {
             /* Advance cursor */
             serverAssert(vptr != NULL);
-            fptr = ziplistNext(zl, vptr);
+            fptr = lpNext(lp, vptr);
         }
         if (fptr == NULL) return C_ERR;
 
         /* Grab pointer to the value (fptr points to the field) */
-        vptr = ziplistNext(zl, fptr);
+        vptr = lpNext(lp, fptr);
         serverAssert(vptr != NULL);
 
         /* fptr, vptr now point to the first or next pair */
@@ -381,22 +374,18 @@ int hashTypeNext(hashTypeIterator *hi) {
 }
 
 /* Get the field or value at iterator cursor, for an iterator on a hash value
- * encoded as a ziplist. Prototype is similar to `hashTypeGetFromZiplist`. */
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
-                                unsigned char **vstr,
-                                unsigned int *vlen,
-                                long long *vll)
+ * encoded as a listpack. Prototype is similar to `hashTypeGetFromListpack`. */
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
+                                 unsigned char **vstr,
+                                 unsigned int *vlen,
+                                 long long *vll)
 {
-    int ret;
-
-    serverAssert(hi->encoding == OBJ_ENCODING_ZIPLIST);
+    serverAssert(hi->encoding == OBJ_ENCODING_LISTPACK);
 
     if (what & OBJ_HASH_KEY) {
-        ret = ziplistGet(hi->fptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->fptr, vlen, vll);
     } else {
-        ret = ziplistGet(hi->vptr, vstr, vlen, vll);
-        serverAssert(ret);
+        *vstr = lpGetValue(hi->vptr, vlen, vll);
     }
 }
 
@@ -424,9 +413,9 @@ sds hashTypeCurrentFromHashTable(hashTypeIterator *hi, int what) {
  * can always check the function return by checking the return value
  * type checking if vstr == NULL. */
 void hashTypeCurrentObject(hashTypeIterator *hi, int what, unsigned char **vstr, unsigned int *vlen, long long *vll) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         *vstr = NULL;
-        hashTypeCurrentFromZiplist(hi, what, vstr, vlen, vll);
+        hashTypeCurrentFromListpack(hi, what, vstr, vlen, vll);
     } else if (hi->encoding == OBJ_ENCODING_HT) {
         sds ele = hashTypeCurrentFromHashTable(hi, what);
         *vstr = (unsigned char*) ele;
@@ -462,10 +451,10 @@ robj *hashTypeLookupWriteOrCreate(client *c, robj *key) {
     return o;
 }
 
-void hashTypeConvertZiplist(robj *o, int enc) {
-    serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
+void hashTypeConvertListpack(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_LISTPACK);
 
-    if (enc == OBJ_ENCODING_ZIPLIST) {
+    if (enc == OBJ_ENCODING_LISTPACK) {
         /* Nothing to do... */
 
     } else if (enc == OBJ_ENCODING_HT) {
@@ -476,6 +465,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
         hi = hashTypeInitIterator(o);
         dict = dictCreate(&hashDictType, NULL);
 
+        /* Presize the dict to avoid rehashing */
+        dictExpand(dict,hashTypeLength(o));
+
         while (hashTypeNext(hi) != C_ERR) {
             sds key, value;
 
@@ -483,9 +475,9 @@ void hashTypeConvertZiplist(robj *o, int enc) {
             value = hashTypeCurrentObjectNewSds(hi,OBJ_HASH_VALUE);
             ret = dictAdd(dict, key, value);
             if (ret != DICT_OK) {
-                serverLogHexDump(LL_WARNING,"ziplist with dup elements dump",
-                    o->ptr,ziplistBlobLen(o->ptr));
-                serverPanic("Ziplist corruption detected");
+                serverLogHexDump(LL_WARNING,"listpack with dup elements dump",
+                    o->ptr,lpBytes(o->ptr));
+                serverPanic("Listpack corruption detected");
             }
         }
         hashTypeReleaseIterator(hi);
@@ -497,16 +489,345 @@ void hashTypeConvertZiplist(robj *o, int enc) {
     }
 }
 
+void hashTypeConvertHashTable(robj *o, int enc) {
+    serverAssert(o->encoding == OBJ_ENCODING_HT);
+
+    if (enc == OBJ_ENCODING_HT) {
+        /* Nothing to do... */
+
+    } else if (enc == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = lpNew();
+        dictIterator *di = dictGetIterator(o->ptr);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            sds field = dictGetKey(de), value = dictGetVal(de);
+
+            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+            lp = lpAppend(lp,(unsigned char*)value,sdslen(value));
+        }
+        dictReleaseIterator(di);
+        dictRelease(o->ptr);
+        o->encoding = OBJ_ENCODING_LISTPACK;
+        o->ptr = lp;
+    } else {
+        serverPanic("Unknown hash encoding");
+    }
+}
+
 void hashTypeConvert(robj *o, int enc) {
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-        hashTypeConvertZiplist(o, enc);
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        hashTypeConvertListpack(o, enc);
     } else if (o->encoding == OBJ_ENCODING_HT) {
-        serverPanic("Not implemented");
+        hashTypeConvertHashTable(o, enc);
     } else {
         serverPanic("Unknown hash encoding");
     }
 }
 
+/* Convert the hash to the encoding matching the listpack limits, that may
+ * have been changed since it was created, see reencode.c. Return 1 if the
+ * encoding changed. */
+int hashTypeReencode(robj *o) {
+    int fits = hashTypeLength(o) <= server.hash_max_listpack_entries;
+
+    if (fits) {
+        hashTypeIterator *hi = hashTypeInitIterator(o);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+
+        while (fits && hashTypeNext(hi) != C_ERR) {
+            for (int what = OBJ_HASH_KEY; what <= OBJ_HASH_VALUE; what++) {
+                hashTypeCurrentObject(hi,what,&vstr,&vlen,&vll);
+                if (!vstr) vlen = sdigits10(vll);
+                if (vlen > server.hash_max_listpack_value) fits = 0;
+            }
+        }
+        hashTypeReleaseIterator(hi);
+    }
+
+    if (o->encoding == OBJ_ENCODING_LISTPACK && !fits) {
+        hashTypeConvert(o,OBJ_ENCODING_HT);
+    } else if (o->encoding == OBJ_ENCODING_HT && fits) {
+        hashTypeConvert(o,OBJ_ENCODING_LISTPACK);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Prepare the hash to hold 'size' fields: it takes its final encoding, and
+ * its hash table is expanded at once instead of growing by steps. */
+void hashTypeReserve(robj *o, unsigned long size) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK &&
+        size > server.hash_max_listpack_entries)
+        hashTypeConvert(o,OBJ_ENCODING_HT);
+    if (o->encoding == OBJ_ENCODING_HT) {
+        dict *d = o->ptr;
+        if (!dictIsRehashing(d) && dictSlots(d) < size) dictExpand(d,size);
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Hash fields expires API
+ *----------------------------------------------------------------------------*/
+
+/* The expire times of the fields of a hash are not stored in the hash
+ * itself, so that the hashes without expires don't pay anything for them:
+ * every DB maps the name of the hashes having fields with an expire to a
+ * sorted set of such fields, scored by their unix time of expire in
+ * milliseconds. The sorted set uses the listpack encoding while small,
+ * exactly like user sorted sets, so a small hash with expires stays
+ * compact. In order to find the fields to expire without scanning, the
+ * hashes are also indexed by the expire time of their first field to
+ * expire, see hfields_by_time in expireIndex.
+ *
+ * The expire times are limited to HASH_FIELD_EXPIRE_MAX so that they are
+ * represented exactly by the sorted set scores. */
+#define HASH_FIELD_EXPIRE_MAX (1LL<<48)
+
+/* Return the sorted set with the field expires of the hash at 'key', or
+ * NULL if none of its fields has an expire. */
+robj *hashFieldExpiresGet(redisDb *db, sds key) {
+    if (dictSize(db->expires->hfields) == 0) return NULL;
+    dictEntry *de = dictFind(db->expires->hfields,key);
+    return de ? dictGetVal(de) : NULL;
+}
+
+/* Return the expire time of the first field to expire of 'zobj'. If 'field'
+ * is not NULL the name of the field is stored in '*field' as a new SDS
+ * string, that the caller should free. */
+static long long hashFieldExpiresFirst(robj *zobj, sds *field) {
+    double score;
+
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *eptr = lpSeek(zobj->ptr,0);
+        unsigned char *sptr = lpNext(zobj->ptr,eptr);
+
+        score = zzlGetScore(sptr);
+        if (field) *field = lpGetObject(eptr);
+    } else {
+        zskiplistNode *ln = ((zset*)zobj->ptr)->zsl->header->level[0].forward;
+
+        score = ln->score;
+        if (field) *field = sdsdup(ln->ele);
+    }
+    return (long long)score;
+}
+
+/* Add or remove the hash 'key', having its first field expiring at 'when',
+ * to the time index of the hashes with field expires. */
+static void hashFieldExpiresIndex(redisDb *db, sds key, long long when,
+                                  int add)
+{
+    unsigned char buf[64], *indexed = buf;
+    size_t keylen = sdslen(key);
+
+    if (keylen+8 > sizeof(buf)) indexed = zmalloc(keylen+8);
+    expireTimeEncode(indexed,when);
+    memcpy(indexed+8,key,keylen);
+    if (add)
+        raxInsert(db->expires->hfields_by_time,indexed,keylen+8,NULL,NULL);
+    else
+        raxRemove(db->expires->hfields_by_time,indexed,keylen+8,NULL);
+    if (indexed != buf) zfree(indexed);
+}
+
+/* Update the time index after the field expires of the hash 'key' changed.
+ * 'oldfirst' is the expire time of the first field to expire before the
+ * change, or -1 if the hash had no field expires. */
+static void hashFieldExpiresReindex(redisDb *db, sds key, long long oldfirst) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+    long long first = zobj ? hashFieldExpiresFirst(zobj,NULL) : -1;
+
+    if (first == oldfirst) return;
+    if (oldfirst != -1) hashFieldExpiresIndex(db,key,oldfirst,0);
+    if (first != -1) hashFieldExpiresIndex(db,key,first,1);
+}
+
+/* Return the expire time of 'field' of the hash at 'key', or -1 if the
+ * field has no expire. */
+long long hashFieldGetExpire(redisDb *db, sds key, sds field) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+    double score;
+
+    if (zobj == NULL || zsetScore(zobj,field,&score) == C_ERR) return -1;
+    return (long long)score;
+}
+
+/* Set the expire time of 'field' of the hash at 'key' to the unix time in
+ * milliseconds 'when'. It's up to the caller to check that the hash has
+ * such field. */
+void hashFieldSetExpire(redisDb *db, sds key, sds field, long long when) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+    long long oldfirst = -1;
+    int flags = ZADD_NONE;
+
+    /* Times in the past are just already due. */
+    if (when < 0) when = 0;
+    if (zobj == NULL) {
+        zobj = createZsetListpackObject();
+        dictAdd(db->expires->hfields,sdsdup(key),zobj);
+    } else {
+        oldfirst = hashFieldExpiresFirst(zobj,NULL);
+    }
+    zsetAdd(zobj,(double)when,field,&flags,NULL);
+    hashFieldExpiresReindex(db,key,oldfirst);
+}
+
+/* Remove the expire of 'field' of the hash at 'key'. Returns 1 if the field
+ * had an expire, otherwise 0. */
+int hashFieldRemoveExpire(redisDb *db, sds key, sds field) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+    long long oldfirst;
+
+    if (zobj == NULL) return 0;
+    oldfirst = hashFieldExpiresFirst(zobj,NULL);
+    if (!zsetDel(zobj,field)) return 0;
+    if (zsetLength(zobj) == 0) dictDelete(db->expires->hfields,key);
+    hashFieldExpiresReindex(db,key,oldfirst);
+    return 1;
+}
+
+/* Forget the field expires of the hash at 'key', called when the key is
+ * deleted or its value replaced. */
+void hashFieldExpiresDelKey(redisDb *db, sds key) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+
+    if (zobj == NULL) return;
+    hashFieldExpiresIndex(db,key,hashFieldExpiresFirst(zobj,NULL),0);
+    dictDelete(db->expires->hfields,key);
+}
+
+/* Remove and return the field expires of the hash at 'key', or NULL if
+ * it has none, in order to attach them to another key with
+ * hashFieldExpiresAttach(), as RENAME and MOVE do. */
+robj *hashFieldExpiresDetach(redisDb *db, sds key) {
+    robj *zobj = hashFieldExpiresGet(db,key);
+
+    if (zobj == NULL) return NULL;
+    incrRefCount(zobj);
+    hashFieldExpiresDelKey(db,key);
+    return zobj;
+}
+
+/* Set 'zobj', as returned by hashFieldExpiresDetach() or loaded from an
+ * RDB payload, as the field expires of the hash at 'key', that should not
+ * have any. The reference of the caller to 'zobj' is taken. */
+void hashFieldExpiresAttach(redisDb *db, sds key, robj *zobj) {
+    if (zsetLength(zobj) == 0) {
+        decrRefCount(zobj);
+        return;
+    }
+    serverAssert(dictAdd(db->expires->hfields,sdsdup(key),zobj) == DICT_OK);
+    hashFieldExpiresIndex(db,key,hashFieldExpiresFirst(zobj,NULL),1);
+}
+
+/* Delete up to 'max' fields of the hash at 'key' that expired before 'now',
+ * propagating them as HDEL to the AOF and the replicas. The key is deleted
+ * if no field is left, in that case '*keyremoved' is set to 1. Returns the
+ * number of fields deleted. */
+static unsigned long hashExpireDueFields(redisDb *db, robj *key, long long now,
+                                         unsigned long max, int *keyremoved)
+{
+    dictEntry *de = dictFind(db->dict,key->ptr);
+    unsigned long expired = 0;
+    robj *o, *zobj, *argv[3];
+
+    *keyremoved = 0;
+    if (de == NULL) {
+        /* Never reached, but make sure that the caller makes progress. */
+        hashFieldExpiresDelKey(db,key->ptr);
+        return 0;
+    }
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    o = dictGetVal(de);
+    argv[0] = createStringObject("HDEL",4);
+    argv[1] = key;
+    while (expired < max &&
+           (zobj = hashFieldExpiresGet(db,key->ptr)) != NULL)
+    {
+        sds field;
+
+        if (hashFieldExpiresFirst(zobj,&field) >= now) {
+            sdsfree(field);
+            break;
+        }
+        replyFlushJobsOfValue(o);
+        hashFieldRemoveExpire(db,key->ptr,field);
+        if (hashTypeDelete(o,field)) {
+            argv[2] = createObject(OBJ_STRING,field);
+            if (server.aof_state != AOF_OFF)
+                feedAppendOnlyFile(server.hdelCommand,db->id,argv,3);
+            replicationFeedSlaves(server.slaves,db->id,argv,3);
+            decrRefCount(argv[2]);
+            expired++;
+        } else {
+            sdsfree(field);
+        }
+    }
+    decrRefCount(argv[0]);
+
+    if (expired) {
+        server.stat_expired_hash_fields += expired;
+        signalModifiedKey(db,key);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpired",key,db->id);
+        if (hashTypeLength(o) == 0) {
+            dbDelete(db,key);
+            notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,db->id);
+            *keyremoved = 1;
+        }
+    }
+    return expired;
+}
+
+/* Called by expireIfNeeded() when a key not expired is accessed: delete the
+ * fields that expired if the key is an hash with field expires. Like for
+ * the keys, replicas wait for the HDEL of the master, and nothing is
+ * deleted while loading or by the I/O threads. Returns 1 if the key was
+ * deleted because all its fields expired, otherwise 0. */
+int hashExpireFieldsIfNeeded(redisDb *db, robj *key) {
+    robj *zobj;
+    long long now;
+    int keyremoved;
+
+    if (server.masterhost != NULL || server.loading ||
+        server.io_threads_executing) return 0;
+    if ((zobj = hashFieldExpiresGet(db,key->ptr)) == NULL) return 0;
+    now = expireReferenceTime();
+    if (hashFieldExpiresFirst(zobj,NULL) >= now) return 0;
+    hashExpireDueFields(db,key,now,ULONG_MAX,&keyremoved);
+    return keyremoved;
+}
+
+/* Called by the active expire cycle: delete up to 'max' fields of the
+ * hashes of 'db' that expired before 'now', the ones expiring first first.
+ * Returns the number of fields deleted. */
+unsigned long hashActiveExpireFields(redisDb *db, long long now,
+                                     unsigned long max)
+{
+    unsigned long expired = 0;
+    redisDb *prev = dbMemoryAccountingSwitch(db);
+
+    while (expired < max) {
+        raxIterator ri;
+        robj *key = NULL;
+        int keyremoved;
+
+        raxStart(&ri,db->expires->hfields_by_time);
+        raxSeek(&ri,"^",NULL,0);
+        if (raxNext(&ri) && expireTimeDecode(ri.key) < now)
+            key = createStringObject((char*)ri.key+8,ri.key_len-8);
+        raxStop(&ri);
+        if (key == NULL) break;
+        expired += hashExpireDueFields(db,key,now,max-expired,&keyremoved);
+        decrRefCount(key);
+    }
+    dbMemoryAccountingSwitch(prev);
+    return expired;
+}
+
 /*-----------------------------------------------------------------------------
  * Hash type commands
  *----------------------------------------------------------------------------*/
@@ -539,8 +860,11 @@ void hsetCommand(client *c) {
     if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
     hashTypeTryConversion(o,c->argv,2,c->argc-1);
 
-    for (i = 2; i < c->argc; i += 2)
+    /* Setting a field also makes it persistent. */
+    for (i = 2; i < c->argc; i += 2) {
         created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);
+        hashFieldRemoveExpire(c->db,c->argv[1]->ptr,c->argv[i]->ptr);
+    }
 
     /* HMSET (deprecated) and HSET return value is different. */
     char *cmdname = c->argv[0]->ptr;
@@ -556,6 +880,41 @@ void hsetCommand(client *c) {
     server.dirty++;
 }
 
+/* HBUILD key cardinality field value [field value ...]
+ *
+ * Like HSET, for hashes loaded with a few big batches: 'cardinality' is the
+ * number of fields the hash is expected to reach, so that it gets its final
+ * encoding and size with the first batch. */
+void hbuildCommand(client *c) {
+    long long size;
+    int i, created = 0;
+    robj *o;
+
+    if ((c->argc % 2) == 0) {
+        addReplyError(c,"wrong number of arguments for HBUILD");
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&size,NULL) != C_OK) return;
+    if (size < 0) {
+        addReplyError(c,"cardinality can't be negative");
+        return;
+    }
+
+    if ((o = hashTypeLookupWriteOrCreate(c,c->argv[1])) == NULL) return;
+    hashTypeReserve(o,size);
+    hashTypeTryConversion(o,c->argv,3,c->argc-1);
+
+    for (i = 3; i < c->argc; i += 2) {
+        created += !hashTypeSet(o,c->argv[i]->ptr,c->argv[i+1]->ptr,HASH_SET_COPY);
+        hashFieldRemoveExpire(c->db,c->argv[1]->ptr,c->argv[i]->ptr);
+    }
+
+    addReplyLongLong(c,created);
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(NOTIFY_HASH,"hset",c->argv[1],c->db->id);
+    server.dirty++;
+}
+
 void hincrbyCommand(client *c) {
     long long value, incr, oldvalue;
     robj *o;
@@ -649,12 +1008,12 @@ static void addHashFieldToReply(client *c, robj *o, sds field) {
         return;
     }
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        ret = hashTypeGetFromZiplist(o, field, &vstr, &vlen, &vll);
+        ret = hashTypeGetFromListpack(o, field, &vstr, &vlen, &vll);
         if (ret < 0) {
             addReplyNull(c);
         } else {
@@ -712,6 +1071,7 @@ void hdelCommand(client *c) {
 
     for (j = 2; j < c->argc; j++) {
         if (hashTypeDelete(o,c->argv[j]->ptr)) {
+            hashFieldRemoveExpire(c->db,c->argv[1]->ptr,c->argv[j]->ptr);
             deleted++;
             if (hashTypeLength(o) == 0) {
                 dbDelete(c->db,c->argv[1]);
@@ -749,12 +1109,12 @@ void hstrlenCommand(client *c) {
 }
 
 static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             addReplyBulkCBuffer(c, vstr, vlen);
         else
@@ -767,6 +1127,41 @@ static void addHashIteratorCursorToReply(client *c, hashTypeIterator *hi, int wh
     }
 }
 
+static void hgetallScanCallback(void *privdata, const dictEntry *de) {
+    replyJob *job = privdata;
+
+    if (job->flags & OBJ_HASH_KEY) {
+        sds field = dictGetKey(de);
+        addReplyBulkCBuffer(job->c,field,sdslen(field));
+    }
+    if (job->flags & OBJ_HASH_VALUE) {
+        sds value = dictGetVal(de);
+        addReplyBulkCBuffer(job->c,value,sdslen(value));
+    }
+    job->remaining--;
+}
+
+/* Streamed reply of HGETALL, HKEYS and HVALS, see replyStartJob(). */
+static int hgetallJobStep(replyJob *job, long long deadline) {
+    dict *d = job->val->ptr;
+    int j = 0;
+
+    /* Complete the rehashing first, so that the cursor can't return the
+     * same field twice. */
+    while (dictIsRehashing(d)) {
+        dictRehash(d,100);
+        if (replyJobShouldPause(job,deadline)) return 0;
+    }
+    do {
+        job->cursor = dictScan(d,job->cursor,hgetallScanCallback,NULL,job);
+        if (job->cursor == 0) {
+            serverAssert(job->remaining == 0);
+            return 1;
+        }
+    } while ((++j % 16) || !replyJobShouldPause(job,deadline));
+    return 0;
+}
+
 void genericHgetallCommand(client *c, int flags) {
     robj *o;
     hashTypeIterator *hi;
@@ -784,6 +1179,11 @@ void genericHgetallCommand(client *c, int flags) {
         addReplyArrayLen(c, length);
     }
 
+    if (o->encoding == OBJ_ENCODING_HT && replyCanBeStreamed(c,length)) {
+        replyStartJob(c,o,length,flags,hgetallJobStep);
+        return;
+    }
+
     hi = hashTypeInitIterator(o);
     while (hashTypeNext(hi) != C_ERR) {
         if (flags & OBJ_HASH_KEY) {
@@ -832,3 +1232,183 @@ void hscanCommand(client *c) {
         checkType(c,o,OBJ_HASH)) return;
     scanGenericCommand(c,o,cursor);
 }
+
+/*-----------------------------------------------------------------------------
+ * Hash fields expires commands
+ *----------------------------------------------------------------------------*/
+
+/* Implements HEXPIRE, HPEXPIRE, HEXPIREAT and HPEXPIREAT. The reply has an
+ * element for every field: -2 if the field does not exist, 1 if the expire
+ * was set, 2 if the field was deleted since the time is in the past.
+ *
+ * The command is propagated as HPEXPIREAT, or as HDEL for the fields
+ * deleted, so that the replicas and the AOF use the same absolute time. */
+void hexpireGenericCommand(client *c, long long basetime, int unit) {
+    robj *key = c->argv[1], *o;
+    long long when;
+    int j, numfields = c->argc-3, changed = 0, delete, keyremoved = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&when,NULL) != C_OK)
+        return;
+    if (when > HASH_FIELD_EXPIRE_MAX || when < -HASH_FIELD_EXPIRE_MAX)
+        goto invalid;
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+    if (when > HASH_FIELD_EXPIRE_MAX) goto invalid;
+
+    if ((o = lookupKeyWrite(c->db,key)) == NULL) {
+        addReplyArrayLen(c,numfields);
+        for (j = 0; j < numfields; j++) addReplyLongLong(c,-2);
+        return;
+    }
+    if (checkType(c,o,OBJ_HASH)) return;
+
+    /* Like EXPIRE a time in the past deletes the fields, but not when
+     * loading the AOF or in the context of a replica: the expire is set
+     * and the fields wait for the HDEL of the master. */
+    delete = when <= mstime() && !server.loading && !server.masterhost;
+    robj **hdelargv = delete ? zmalloc(sizeof(robj*)*(numfields+2)) : NULL;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 3; j < c->argc; j++) {
+        sds field = c->argv[j]->ptr;
+
+        if (keyremoved || !hashTypeExists(o,field)) {
+            addReplyLongLong(c,-2);
+        } else if (delete) {
+            hashTypeDelete(o,field);
+            hashFieldRemoveExpire(c->db,key->ptr,field);
+            hdelargv[2+changed++] = c->argv[j];
+            incrRefCount(c->argv[j]);
+            addReplyLongLong(c,2);
+            if (hashTypeLength(o) == 0) {
+                dbDelete(c->db,key);
+                keyremoved = 1;
+            }
+        } else {
+            hashFieldSetExpire(c->db,key->ptr,field,when);
+            changed++;
+            addReplyLongLong(c,1);
+        }
+    }
+
+    if (delete) {
+        if (changed) {
+            hdelargv[0] = createStringObject("HDEL",4);
+            hdelargv[1] = key;
+            incrRefCount(key);
+            alsoPropagate(server.hdelCommand,c->db->id,hdelargv,changed+2,
+                          PROPAGATE_AOF|PROPAGATE_REPL);
+            for (j = 0; j < changed+2; j++) decrRefCount(hdelargv[j]);
+            notifyKeyspaceEvent(NOTIFY_HASH,"hdel",key,c->db->id);
+            if (keyremoved)
+                notifyKeyspaceEvent(NOTIFY_GENERIC,"del",key,c->db->id);
+        }
+        zfree(hdelargv);
+        preventCommandPropagation(c);
+    } else if (changed) {
+        robj *aux = createStringObject("HPEXPIREAT",10);
+        rewriteClientCommandArgument(c,0,aux);
+        decrRefCount(aux);
+        aux = createStringObjectFromLongLong(when);
+        rewriteClientCommandArgument(c,2,aux);
+        decrRefCount(aux);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hexpire",key,c->db->id);
+    }
+    if (changed) {
+        signalModifiedKey(c->db,key);
+        server.dirty += changed;
+    }
+    return;
+
+invalid:
+    addReplyErrorFormat(c,"invalid expire time in %s",c->cmd->name);
+}
+
+/* HEXPIRE key seconds field [field ...] */
+void hexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_SECONDS);
+}
+
+/* HPEXPIRE key milliseconds field [field ...] */
+void hpexpireCommand(client *c) {
+    hexpireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
+}
+
+/* HEXPIREAT key time field [field ...] */
+void hexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_SECONDS);
+}
+
+/* HPEXPIREAT key ms_time field [field ...] */
+void hpexpireatCommand(client *c) {
+    hexpireGenericCommand(c,0,UNIT_MILLISECONDS);
+}
+
+/* Implements HTTL and HPTTL. The reply has an element for every field: -2
+ * if the field does not exist, -1 if it has no expire, otherwise its TTL. */
+void httlGenericCommand(client *c, int output_ms) {
+    robj *o;
+    int j, numfields = c->argc-2;
+
+    o = lookupKeyReadWithFlags(c->db,c->argv[1],LOOKUP_NOTOUCH);
+    if (o != NULL && checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 2; j < c->argc; j++) {
+        long long expire, ttl;
+
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+            continue;
+        }
+        expire = hashFieldGetExpire(c->db,c->argv[1]->ptr,c->argv[j]->ptr);
+        if (expire == -1) {
+            addReplyLongLong(c,-1);
+            continue;
+        }
+        ttl = expire-mstime();
+        if (ttl < 0) ttl = 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+/* HTTL key field [field ...] */
+void httlCommand(client *c) {
+    httlGenericCommand(c,0);
+}
+
+/* HPTTL key field [field ...] */
+void hpttlCommand(client *c) {
+    httlGenericCommand(c,1);
+}
+
+/* HPERSIST key field [field ...]
+ * The reply has an element for every field: -2 if the field does not exist,
+ * -1 if it has no expire, 1 if the expire was removed. */
+void hpersistCommand(client *c) {
+    robj *o;
+    int j, numfields = c->argc-2, removed = 0;
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o != NULL && checkType(c,o,OBJ_HASH)) return;
+
+    addReplyArrayLen(c,numfields);
+    for (j = 2; j < c->argc; j++) {
+        if (o == NULL || !hashTypeExists(o,c->argv[j]->ptr)) {
+            addReplyLongLong(c,-2);
+        } else if (hashFieldRemoveExpire(c->db,c->argv[1]->ptr,
+                                         c->argv[j]->ptr))
+        {
+            removed++;
+            addReplyLongLong(c,1);
+        } else {
+            addReplyLongLong(c,-1);
+        }
+    }
+    if (removed) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_HASH,"hpersist",c->argv[1],c->db->id);
+        server.dirty += removed;
+    }
+}
@@ -321,8 +321,13 @@ void lindexCommand(client *c) {
         return;
 
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        /* Access the element with an iterator, so that releasing it the
+         * node is compressed again (or kept in the decompressed nodes
+         * cache) instead of staying decompressed. */
+        quicklistIter *iter;
         quicklistEntry entry;
-        if (quicklistIndex(o->ptr, index, &entry)) {
+        iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_HEAD, index);
+        if (iter && quicklistNext(iter, &entry)) {
             if (entry.value) {
                 value = createStringObject((char*)entry.value,entry.sz);
             } else {
@@ -333,6 +338,7 @@ void lindexCommand(client *c) {
         } else {
             addReplyNull(c);
         }
+        if (iter) quicklistReleaseIterator(iter);
     } else {
         serverPanic("Unknown list encoding");
     }
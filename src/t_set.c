@@ -37,14 +37,24 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op);
 
 /* Factory method to return a set that *can* hold "value". When the object has
- * an integer-encodable value, an intset will be returned. Otherwise a regular
- * hash table. */
+ * an integer-encodable value, an intset will be returned. Otherwise a listpack
+ * if the value is small enough, or a regular hash table. */
 robj *setTypeCreate(sds value) {
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
+    if (server.set_max_listpack_entries &&
+        sdslen(value) <= server.set_max_listpack_value)
+        return createSetListpackObject();
     return createSetObject();
 }
 
+/* Return true if a set of 'size' elements where the longest element is
+ * 'maxelelen' bytes can be encoded as a listpack. */
+static int setTypeFitsListpack(size_t size, size_t maxelelen) {
+    return size <= server.set_max_listpack_entries &&
+           maxelelen <= server.set_max_listpack_value;
+}
+
 /* Add the specified value into a set.
  *
  * If the value was already member of the set, nothing is done and 0 is
@@ -70,6 +80,15 @@ int setTypeAdd(robj *subject, sds value) {
                     setTypeConvert(subject,OBJ_ENCODING_HT);
                 return 1;
             }
+        } else if (setTypeFitsListpack(intsetLen(subject->ptr)+1,
+                                       sdslen(value)))
+        {
+            /* Failed to get integer from object, but the set is still
+             * small: convert to a listpack. */
+            setTypeConvert(subject,OBJ_ENCODING_LISTPACK);
+            subject->ptr = lpAppend(subject->ptr,(unsigned char*)value,
+                                    sdslen(value));
+            return 1;
         } else {
             /* Failed to get integer from object, convert to regular set. */
             setTypeConvert(subject,OBJ_ENCODING_HT);
@@ -79,6 +98,20 @@ int setTypeAdd(robj *subject, sds value) {
             serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr, *p = lpFirst(lp);
+
+        if (p && lpFind(lp,p,(unsigned char*)value,sdslen(value),0))
+            return 0;
+        if (setTypeFitsListpack(lpLength(lp)+1,sdslen(value))) {
+            subject->ptr = lpAppend(lp,(unsigned char*)value,sdslen(value));
+        } else {
+            /* Convert to regular set when the listpack would grow too
+             * big. We already know the value is not a member. */
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+        }
+        return 1;
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -98,6 +131,13 @@ int setTypeRemove(robj *setobj, sds value) {
             setobj->ptr = intsetRemove(setobj->ptr,llval,&success);
             if (success) return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr, *p = lpFirst(lp);
+
+        if (p && (p = lpFind(lp,p,(unsigned char*)value,sdslen(value),0))) {
+            setobj->ptr = lpDelete(lp,p,NULL);
+            return 1;
+        }
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -112,6 +152,10 @@ int setTypeIsMember(robj *subject, sds value) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr, *p = lpFirst(lp);
+
+        return p && lpFind(lp,p,(unsigned char*)value,sdslen(value),0);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -123,9 +167,14 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
     si->subject = subject;
     si->encoding = subject->encoding;
     if (si->encoding == OBJ_ENCODING_HT) {
-        si->di = dictGetIterator(subject->ptr);
+        /* A safe iterator stops the incremental rehashing, so that the set
+         * can be looked up while a background set operation iterates it. */
+        si->di = dictGetSafeIterator(subject->ptr);
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        si->lpi = NULL;
+        si->lpele = sdsempty();
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -135,16 +184,42 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
 void setTypeReleaseIterator(setTypeIterator *si) {
     if (si->encoding == OBJ_ENCODING_HT)
         dictReleaseIterator(si->di);
+    else if (si->encoding == OBJ_ENCODING_LISTPACK)
+        sdsfree(si->lpele);
     zfree(si);
 }
 
+/* Populate (sdsele) or (llele) with the listpack element 'p', like
+ * setTypeNext() does. String elements are copied into '*buf', that is
+ * reused across calls. */
+static void setTypeGetListpackElement(unsigned char *p, sds *buf,
+                                      sds *sdsele, int64_t *llele)
+{
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+
+    vstr = lpGetValue(p,&vlen,&vll);
+    if (vstr) {
+        *buf = sdscpylen(*buf,(char*)vstr,vlen);
+        *sdsele = *buf;
+        *llele = -123456789; /* Not needed. Defensive. */
+    } else {
+        *llele = vll;
+        *sdsele = NULL;
+    }
+}
+
 /* Move to the next entry in the set. Returns the object at the current
  * position.
  *
  * Since set elements can be internally be stored as SDS strings or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * (sdsele) or (llele) accordingly. When the element is an integer, sdsele
+ * is set to NULL: listpacks hold both kinds of elements, and their string
+ * elements are returned into a buffer owned by the iterator, only valid
+ * until the next call.
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -161,6 +236,12 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = si->subject->ptr;
+
+        si->lpi = si->lpi ? lpNext(lp,si->lpi) : lpFirst(lp);
+        if (si->lpi == NULL) return -1;
+        setTypeGetListpackElement(si->lpi,&si->lpele,sdsele,llele);
     } else {
         serverPanic("Wrong set encoding in setTypeNext");
     }
@@ -186,6 +267,8 @@ sds setTypeNextObject(setTypeIterator *si) {
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
             return sdsdup(sdsele);
+        case OBJ_ENCODING_LISTPACK:
+            return sdsele ? sdsdup(sdsele) : sdsfromlonglong(intele);
         default:
             serverPanic("Unsupported encoding");
     }
@@ -204,7 +287,11 @@ sds setTypeNextObject(setTypeIterator *si) {
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
- * used field with values which are easy to trap if misused. */
+ * used field with values which are easy to trap if misused.
+ *
+ * Like in setTypeNext(), sdsele is set to NULL for integer elements, and
+ * the string elements of listpacks are returned into a buffer that is
+ * only valid until the next call. */
 int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     if (setobj->encoding == OBJ_ENCODING_HT) {
         dictEntry *de = dictGetFairRandomKey(setobj->ptr);
@@ -213,6 +300,13 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        static sds buf = NULL;
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpSeek(lp,random() % lpLength(lp));
+
+        if (buf == NULL) buf = sdsempty();
+        setTypeGetListpackElement(p,&buf,sdsele,llele);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -224,6 +318,8 @@ unsigned long setTypeSize(const robj *subject) {
         return dictSize((const dict*)subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        return lpLength((unsigned char*)subject->ptr);
     } else {
         serverPanic("Unknown set encoding");
     }
@@ -231,36 +327,185 @@ unsigned long setTypeSize(const robj *subject) {
 
 /* Convert the set to specified encoding. The resulting dict (when converting
  * to a hash table) is presized to hold the number of elements in the original
- * set. */
+ * set. Intsets can be converted to listpacks or hash tables, listpacks only
+ * to hash tables. */
 void setTypeConvert(robj *setobj, int enc) {
+    setTypeConvertAndExpand(setobj,enc,setTypeSize(setobj));
+}
+
+/* Like setTypeConvert(), but the dict is presized to hold 'cap' elements. */
+void setTypeConvertAndExpand(robj *setobj, int enc, unsigned long cap) {
     setTypeIterator *si;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             setobj->encoding != OBJ_ENCODING_HT &&
+                             setobj->encoding != enc);
 
     if (enc == OBJ_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
         sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,cap);
 
-        /* To add the elements we extract integers and create redis objects */
+        /* To add the elements we extract them as new SDS strings. */
         si = setTypeInitIterator(setobj);
-        while (setTypeNext(si,&element,&intele) != -1) {
-            element = sdsfromlonglong(intele);
+        while ((element = setTypeNextObject(si)) != NULL)
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
-        }
         setTypeReleaseIterator(si);
 
         setobj->encoding = OBJ_ENCODING_HT;
         zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = lpNew();
+        char buf[LONG_STR_SIZE];
+        int64_t intele;
+        uint32_t j = 0;
+
+        serverAssertWithInfo(NULL,setobj,
+            setobj->encoding == OBJ_ENCODING_INTSET);
+        while (intsetGet(setobj->ptr,j++,&intele)) {
+            int len = ll2string(buf,sizeof(buf),intele);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+
+        setobj->encoding = OBJ_ENCODING_LISTPACK;
+        zfree(setobj->ptr);
+        setobj->ptr = lp;
     } else {
         serverPanic("Unsupported set conversion");
     }
 }
 
+/* Convert the set to the encoding matching the intset and listpack limits,
+ * that may have been changed since it was created, see reencode.c. The hash
+ * table encoded sets that fit the limits again are converted back to an
+ * intset or a listpack. Return 1 if the encoding changed. */
+int setTypeReencode(robj *setobj) {
+    unsigned long size = setTypeSize(setobj);
+
+    if (setobj->encoding == OBJ_ENCODING_INTSET) {
+        if (size <= server.set_max_intset_entries) return 0;
+        setTypeConvert(setobj,OBJ_ENCODING_HT);
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr, *p = lpFirst(lp);
+        size_t maxelelen = 0;
+
+        while (p) {
+            unsigned int len;
+            long long vll;
+            if (!lpGetValue(p,&len,&vll)) len = sdigits10(vll);
+            if (len > maxelelen) maxelelen = len;
+            p = lpNext(lp,p);
+        }
+        if (setTypeFitsListpack(size,maxelelen)) return 0;
+        setTypeConvert(setobj,OBJ_ENCODING_HT);
+    } else if (setobj->encoding == OBJ_ENCODING_HT) {
+        int intset = size <= server.set_max_intset_entries;
+        size_t maxelelen = 0;
+        dictIterator *di;
+        dictEntry *de;
+        long long llval;
+
+        if (!intset && size > server.set_max_listpack_entries) return 0;
+        di = dictGetIterator(setobj->ptr);
+        while((de = dictNext(di)) != NULL) {
+            sds ele = dictGetKey(de);
+            if (sdslen(ele) > maxelelen) maxelelen = sdslen(ele);
+            if (intset && isSdsRepresentableAsLongLong(ele,&llval) != C_OK)
+                intset = 0;
+        }
+        dictReleaseIterator(di);
+        if (!intset && !setTypeFitsListpack(size,maxelelen)) return 0;
+
+        /* Fill the new encoding, then release the hash table. */
+        void *ptr = intset ? (void*)intsetNew() : (void*)lpNew();
+        di = dictGetIterator(setobj->ptr);
+        while((de = dictNext(di)) != NULL) {
+            sds ele = dictGetKey(de);
+            if (intset) {
+                serverAssert(isSdsRepresentableAsLongLong(ele,&llval) == C_OK);
+                ptr = intsetAdd(ptr,llval,NULL);
+            } else {
+                ptr = lpAppend(ptr,(unsigned char*)ele,sdslen(ele));
+            }
+        }
+        dictReleaseIterator(di);
+        dictRelease(setobj->ptr);
+        setobj->ptr = ptr;
+        setobj->encoding = intset ? OBJ_ENCODING_INTSET :
+                                    OBJ_ENCODING_LISTPACK;
+    } else {
+        serverPanic("Unknown set encoding");
+    }
+    return 1;
+}
+
+/* Prepare the set to hold 'size' elements: it takes its final encoding, and
+ * its hash table is expanded at once instead of growing by steps. */
+void setTypeReserve(robj *setobj, unsigned long size) {
+    if (setobj->encoding == OBJ_ENCODING_HT) {
+        dict *d = setobj->ptr;
+        if (!dictIsRehashing(d) && dictSlots(d) < size) dictExpand(d,size);
+    } else if (size > (setobj->encoding == OBJ_ENCODING_INTSET ?
+                       server.set_max_intset_entries :
+                       server.set_max_listpack_entries))
+    {
+        setTypeConvertAndExpand(setobj,OBJ_ENCODING_HT,size);
+    }
+}
+
+static int compareInt64(const void *a, const void *b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Add the 'count' elements of 'argv' to the intset encoded 'setobj' with a
+ * single merge, instead of inserting them one after the other. Return the
+ * number of elements added, or -1 without touching the set if some of them
+ * are not integers. */
+static long setTypeAddIntegers(robj *setobj, robj **argv, int count) {
+    int64_t *values = zmalloc(sizeof(int64_t)*count);
+    intset *is = intsetNew(), *merged;
+    long added;
+    int j;
+
+    for (j = 0; j < count; j++) {
+        long long llval;
+        if (isSdsRepresentableAsLongLong(argv[j]->ptr,&llval) != C_OK) {
+            zfree(values);
+            zfree(is);
+            return -1;
+        }
+        values[j] = llval;
+    }
+
+    /* Sorted values are appended at the tail of the intset. */
+    qsort(values,count,sizeof(int64_t),compareInt64);
+    for (j = 0; j < count; j++) is = intsetAdd(is,values[j],NULL);
+    zfree(values);
+    merged = intsetUnion(setobj->ptr,is);
+    zfree(is);
+    added = intsetLen(merged)-intsetLen(setobj->ptr);
+    zfree(setobj->ptr);
+    setobj->ptr = merged;
+    if (intsetLen(merged) > server.set_max_intset_entries)
+        setTypeConvert(setobj,OBJ_ENCODING_HT);
+    return added;
+}
+
+/* Remove the integer element 'llele' returned by setTypeRandomElement()
+ * or setTypeNext() from the set. */
+static void setTypeRemoveInteger(robj *setobj, int64_t llele) {
+    if (setobj->encoding == OBJ_ENCODING_INTSET) {
+        setobj->ptr = intsetRemove(setobj->ptr,llele,NULL);
+    } else {
+        sds ele = sdsfromlonglong(llele);
+        setTypeRemove(setobj,ele);
+        sdsfree(ele);
+    }
+}
+
 void saddCommand(client *c) {
     robj *set;
     int j, added = 0;
@@ -287,6 +532,50 @@ void saddCommand(client *c) {
     addReplyLongLong(c,added);
 }
 
+/* SBUILD key cardinality member [member ...]
+ *
+ * Like SADD, for sets loaded with a few big batches: 'cardinality' is the
+ * number of elements the set is expected to reach, so that it gets its final
+ * encoding and size with the first batch. Batches of integers for intsets
+ * are merged in one pass. */
+void sbuildCommand(client *c) {
+    long long size;
+    long added = -1;
+    robj *set;
+    int j;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&size,NULL) != C_OK) return;
+    if (size < 0) {
+        addReplyError(c,"cardinality can't be negative");
+        return;
+    }
+
+    set = lookupKeyWrite(c->db,c->argv[1]);
+    if (set == NULL) {
+        set = setTypeCreate(c->argv[3]->ptr);
+        dbAdd(c->db,c->argv[1],set);
+    } else if (set->type != OBJ_SET) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    setTypeReserve(set,size);
+
+    if (set->encoding == OBJ_ENCODING_INTSET)
+        added = setTypeAddIntegers(set,c->argv+3,c->argc-3);
+    if (added == -1) {
+        added = 0;
+        for (j = 3; j < c->argc; j++) {
+            if (setTypeAdd(set,c->argv[j]->ptr)) added++;
+        }
+    }
+    if (added) {
+        signalModifiedKey(c->db,c->argv[1]);
+        notifyKeyspaceEvent(NOTIFY_SET,"sadd",c->argv[1],c->db->id);
+    }
+    server.dirty += added;
+    addReplyLongLong(c,added);
+}
+
 void sremCommand(client *c) {
     robj *set;
     int j, deleted = 0, keyremoved = 0;
@@ -460,7 +749,6 @@ void spopWithCountCommand(client *c) {
     /* Common iteration vars. */
     sds sdsele;
     robj *objele;
-    int encoding;
     int64_t llele;
     unsigned long remaining = size-count; /* Elements left after SPOP. */
 
@@ -474,11 +762,11 @@ void spopWithCountCommand(client *c) {
     if (remaining*SPOP_MOVE_STRATEGY_MUL > count) {
         while(count--) {
             /* Emit and remove. */
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&sdsele,&llele);
+            if (sdsele == NULL) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
-                set->ptr = intsetRemove(set->ptr,llele,NULL);
+                setTypeRemoveInteger(set,llele);
             } else {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
@@ -504,8 +792,8 @@ void spopWithCountCommand(client *c) {
 
         /* Create a new set with just the remaining elements. */
         while(remaining--) {
-            encoding = setTypeRandomElement(set,&sdsele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&sdsele,&llele);
+            if (sdsele == NULL) {
                 sdsele = sdsfromlonglong(llele);
             } else {
                 sdsele = sdsdup(sdsele);
@@ -519,8 +807,8 @@ void spopWithCountCommand(client *c) {
         /* Transfer the old set to the client. */
         setTypeIterator *si;
         si = setTypeInitIterator(set);
-        while((encoding = setTypeNext(si,&sdsele,&llele)) != -1) {
-            if (encoding == OBJ_ENCODING_INTSET) {
+        while(setTypeNext(si,&sdsele,&llele) != -1) {
+            if (sdsele == NULL) {
                 addReplyBulkLongLong(c,llele);
                 objele = createStringObjectFromLongLong(llele);
             } else {
@@ -554,7 +842,6 @@ void spopCommand(client *c) {
     robj *set, *ele, *aux;
     sds sdsele;
     int64_t llele;
-    int encoding;
 
     if (c->argc == 3) {
         spopWithCountCommand(c);
@@ -570,12 +857,12 @@ void spopCommand(client *c) {
          == NULL || checkType(c,set,OBJ_SET)) return;
 
     /* Get a random element from the set */
-    encoding = setTypeRandomElement(set,&sdsele,&llele);
+    setTypeRandomElement(set,&sdsele,&llele);
 
     /* Remove the element from the set */
-    if (encoding == OBJ_ENCODING_INTSET) {
+    if (sdsele == NULL) {
         ele = createStringObjectFromLongLong(llele);
-        set->ptr = intsetRemove(set->ptr,llele,NULL);
+        setTypeRemoveInteger(set,llele);
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,ele->ptr);
@@ -618,7 +905,6 @@ void srandmemberWithCountCommand(client *c) {
     robj *set;
     sds ele;
     int64_t llele;
-    int encoding;
 
     dict *d;
 
@@ -649,8 +935,8 @@ void srandmemberWithCountCommand(client *c) {
     if (!uniq) {
         addReplySetLen(c,count);
         while(count--) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&ele,&llele);
+            if (ele == NULL) {
                 addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulkCBuffer(c,ele,sdslen(ele));
@@ -684,10 +970,10 @@ void srandmemberWithCountCommand(client *c) {
 
         /* Add all the elements into the temporary dictionary. */
         si = setTypeInitIterator(set);
-        while((encoding = setTypeNext(si,&ele,&llele)) != -1) {
+        while(setTypeNext(si,&ele,&llele) != -1) {
             int retval = DICT_ERR;
 
-            if (encoding == OBJ_ENCODING_INTSET) {
+            if (ele == NULL) {
                 retval = dictAdd(d,createStringObjectFromLongLong(llele),NULL);
             } else {
                 retval = dictAdd(d,createStringObject(ele,sdslen(ele)),NULL);
@@ -716,8 +1002,8 @@ void srandmemberWithCountCommand(client *c) {
         robj *objele;
 
         while(added < count) {
-            encoding = setTypeRandomElement(set,&ele,&llele);
-            if (encoding == OBJ_ENCODING_INTSET) {
+            setTypeRandomElement(set,&ele,&llele);
+            if (ele == NULL) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
@@ -750,7 +1036,6 @@ void srandmemberCommand(client *c) {
     robj *set;
     sds ele;
     int64_t llele;
-    int encoding;
 
     if (c->argc == 3) {
         srandmemberWithCountCommand(c);
@@ -763,14 +1048,33 @@ void srandmemberCommand(client *c) {
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.null[c->resp]))
         == NULL || checkType(c,set,OBJ_SET)) return;
 
-    encoding = setTypeRandomElement(set,&ele,&llele);
-    if (encoding == OBJ_ENCODING_INTSET) {
+    setTypeRandomElement(set,&ele,&llele);
+    if (ele == NULL) {
         addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulkCBuffer(c,ele,sdslen(ele));
     }
 }
 
+/* Return 1 if all the existing sets of the array are intsets. */
+static int setTypeAllIntsets(robj **sets, unsigned long setnum) {
+    unsigned long j;
+
+    for (j = 0; j < setnum; j++) {
+        if (sets[j] && sets[j]->encoding != OBJ_ENCODING_INTSET) return 0;
+    }
+    return 1;
+}
+
+/* Replace the intset of the intset encoded set 'setobj' with 'is',
+ * converting the set to a hash table if it got too big. */
+static void setTypeSetIntset(robj *setobj, intset *is) {
+    zfree(setobj->ptr);
+    setobj->ptr = is;
+    if (intsetLen(is) > server.set_max_intset_entries)
+        setTypeConvert(setobj,OBJ_ENCODING_HT);
+}
+
 int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
     if (setTypeSize(*(robj**)s1) > setTypeSize(*(robj**)s2)) return 1;
     if (setTypeSize(*(robj**)s1) < setTypeSize(*(robj**)s2)) return -1;
@@ -789,6 +1093,35 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+static void smembersScanCallback(void *privdata, const dictEntry *de) {
+    replyJob *job = privdata;
+    sds ele = dictGetKey(de);
+
+    addReplyBulkCBuffer(job->c,ele,sdslen(ele));
+    job->remaining--;
+}
+
+/* Streamed reply of SMEMBERS, see replyStartJob(). */
+static int smembersJobStep(replyJob *job, long long deadline) {
+    dict *d = job->val->ptr;
+    int j = 0;
+
+    /* Complete the rehashing first, so that the cursor can't return the
+     * same element twice. */
+    while (dictIsRehashing(d)) {
+        dictRehash(d,100);
+        if (replyJobShouldPause(job,deadline)) return 0;
+    }
+    do {
+        job->cursor = dictScan(d,job->cursor,smembersScanCallback,NULL,job);
+        if (job->cursor == 0) {
+            serverAssert(job->remaining == 0);
+            return 1;
+        }
+    } while ((++j % 16) || !replyJobShouldPause(job,deadline));
+    return 0;
+}
+
 void sinterGenericCommand(client *c, robj **setkeys,
                           unsigned long setnum, robj *dstkey) {
     robj **sets = zmalloc(sizeof(robj*)*setnum);
@@ -798,7 +1131,6 @@ void sinterGenericCommand(client *c, robj **setkeys,
     int64_t intobj;
     void *replylen = NULL;
     unsigned long j, cardinality = 0;
-    int encoding;
 
     for (j = 0; j < setnum; j++) {
         robj *setobj = dstkey ?
@@ -823,6 +1155,15 @@ void sinterGenericCommand(client *c, robj **setkeys,
         }
         sets[j] = setobj;
     }
+    /* SMEMBERS of a big set. */
+    if (setnum == 1 && !dstkey && sets[0]->encoding == OBJ_ENCODING_HT &&
+        replyCanBeStreamed(c,setTypeSize(sets[0])))
+    {
+        addReplySetLen(c,setTypeSize(sets[0]));
+        replyStartJob(c,sets[0],setTypeSize(sets[0]),0,smembersJobStep);
+        zfree(sets);
+        return;
+    }
     /* Sort sets from the smallest to largest, this will improve our
      * algorithm's performance */
     qsort(sets,setnum,sizeof(robj*),qsortCompareSetsByCardinality);
@@ -840,57 +1181,75 @@ void sinterGenericCommand(client *c, robj **setkeys,
         dstset = createIntsetObject();
     }
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
-    si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si,&elesds,&intobj)) != -1) {
-        for (j = 1; j < setnum; j++) {
-            if (sets[j] == sets[0]) continue;
-            if (encoding == OBJ_ENCODING_INTSET) {
-                /* intset with intset is simple... and fast */
-                if (sets[j]->encoding == OBJ_ENCODING_INTSET &&
-                    !intsetFind((intset*)sets[j]->ptr,intobj))
-                {
-                    break;
-                /* in order to compare an integer with an object we
-                 * have to use the generic function, creating an object
-                 * for this */
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
-                    elesds = sdsfromlonglong(intobj);
+    if (setTypeAllIntsets(sets,setnum)) {
+        /* Intsets are sorted arrays, so they can be intersected with
+         * merges, starting from the smallest one. */
+        intset *is = intsetDup(sets[0]->ptr);
+
+        for (j = 1; j < setnum && intsetLen(is); j++) {
+            intset *inter = intsetIntersection(is,sets[j]->ptr);
+            zfree(is);
+            is = inter;
+        }
+        if (!dstkey) {
+            uint32_t pos = 0;
+
+            while (intsetGet(is,pos++,&intobj)) addReplyBulkLongLong(c,intobj);
+            cardinality = intsetLen(is);
+            zfree(is);
+        } else {
+            setTypeSetIntset(dstset,is);
+        }
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        si = setTypeInitIterator(sets[0]);
+        while(setTypeNext(si,&elesds,&intobj) != -1) {
+            for (j = 1; j < setnum; j++) {
+                if (sets[j] == sets[0]) continue;
+                if (elesds == NULL) {
+                    /* intset with intset is simple... and fast */
+                    if (sets[j]->encoding == OBJ_ENCODING_INTSET) {
+                        if (!intsetFind((intset*)sets[j]->ptr,intobj)) break;
+                    /* in order to compare an integer with an object we
+                     * have to use the generic function, creating an object
+                     * for this */
+                    } else {
+                        sds tmp = sdsfromlonglong(intobj);
+                        int ismember = setTypeIsMember(sets[j],tmp);
+
+                        sdsfree(tmp);
+                        if (!ismember) break;
+                    }
+                } else {
                     if (!setTypeIsMember(sets[j],elesds)) {
-                        sdsfree(elesds);
                         break;
                     }
-                    sdsfree(elesds);
-                }
-            } else if (encoding == OBJ_ENCODING_HT) {
-                if (!setTypeIsMember(sets[j],elesds)) {
-                    break;
                 }
             }
-        }
 
-        /* Only take action when all sets contain the member */
-        if (j == setnum) {
-            if (!dstkey) {
-                if (encoding == OBJ_ENCODING_HT)
-                    addReplyBulkCBuffer(c,elesds,sdslen(elesds));
-                else
-                    addReplyBulkLongLong(c,intobj);
-                cardinality++;
-            } else {
-                if (encoding == OBJ_ENCODING_INTSET) {
-                    elesds = sdsfromlonglong(intobj);
-                    setTypeAdd(dstset,elesds);
-                    sdsfree(elesds);
+            /* Only take action when all sets contain the member */
+            if (j == setnum) {
+                if (!dstkey) {
+                    if (elesds != NULL)
+                        addReplyBulkCBuffer(c,elesds,sdslen(elesds));
+                    else
+                        addReplyBulkLongLong(c,intobj);
+                    cardinality++;
                 } else {
-                    setTypeAdd(dstset,elesds);
+                    if (elesds == NULL) {
+                        elesds = sdsfromlonglong(intobj);
+                        setTypeAdd(dstset,elesds);
+                        sdsfree(elesds);
+                    } else {
+                        setTypeAdd(dstset,elesds);
+                    }
                 }
             }
         }
+        setTypeReleaseIterator(si);
     }
-    setTypeReleaseIterator(si);
 
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
@@ -924,33 +1283,255 @@ void sinterstoreCommand(client *c) {
     sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
 }
 
-#define SET_OP_UNION 0
-#define SET_OP_DIFF 1
-#define SET_OP_INTER 2
+/*-----------------------------------------------------------------------------
+ * Background set operations
+ *
+ * SUNIONSTORE, SDIFFSTORE, ZUNIONSTORE and ZINTERSTORE with big inputs block
+ * the client and build the result in time slices of the event loop, so that
+ * the other clients are still served in the meantime.
+ *
+ * The input keys and the destination key are locked (see db->locked_keys)
+ * till the job is done, so the result is the same the command would produce
+ * if executed atomically when the job completes, that is also the moment
+ * the command is propagated to the AOF and the replicas. The inputs may
+ * still go away, because they expire, are evicted, or the DB is flushed or
+ * swapped: in this case the operation starts again from scratch.
+ *----------------------------------------------------------------------------*/
+
+#define SETOP_SLICE_US 1000  /* Time spent computing every period. */
+#define SETOP_PERIOD_MS 1    /* Time left to clients between slices. */
+
+/* Return 1 if the set operation called by 'c', with 'numele' elements in
+ * its inputs overall, should be executed in the background. */
+int setopCanRunInBackground(client *c, unsigned long long numele) {
+    return server.setops_incremental_threshold &&
+           numele >= (unsigned long long)server.setops_incremental_threshold &&
+           !server.loading && server.masterhost == NULL &&
+           !(c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MODULE|CLIENT_MASTER));
+}
+
+static void setopLockKey(setopJob *job, robj *key) {
+    if (dictAdd(job->db->locked_keys,key,job) == DICT_OK) incrRefCount(key);
+}
 
-void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
-                              robj *dstkey, int op) {
-    robj **sets = zmalloc(sizeof(robj*)*setnum);
-    setTypeIterator *si;
-    robj *dstset = NULL;
-    sds ele;
-    int j, cardinality = 0;
-    int diff_algo = 1;
+static void setopUnlockKey(setopJob *job, robj *key) {
+    if (dictFetchValue(job->db->locked_keys,key) == job)
+        dictDelete(job->db->locked_keys,key);
+}
 
-    for (j = 0; j < setnum; j++) {
-        robj *setobj = dstkey ?
-            lookupKeyWrite(c->db,setkeys[j]) :
-            lookupKeyRead(c->db,setkeys[j]);
-        if (!setobj) {
-            sets[j] = NULL;
-            continue;
+/* Release the state of the operation and the inputs it was working on. */
+static void setopJobReset(setopJob *job) {
+    job->free(job);
+    job->state = NULL;
+    for (int j = 0; j < job->numkeys; j++) {
+        if (job->vals[j]) decrRefCount(job->vals[j]);
+        job->vals[j] = NULL;
+    }
+}
+
+/* Store the result of the job and propagate the command, or reply with
+ * the 'err' error if not NULL. Then release the job. */
+static void setopJobFinish(setopJob *job, const char *err) {
+    redisDb *db = job->db;
+    int j;
+
+    if (err == NULL) {
+        robj *dst = job->dst;
+        long long size = dst->type == OBJ_SET ? setTypeSize(dst) :
+                                                zsetLength(dst);
+        int deleted = dbDelete(db,job->dstkey);
+
+        job->dst = NULL;
+        if (size > 0) {
+            dbAdd(db,job->dstkey,dst);
+            notifyKeyspaceEvent(dst->type == OBJ_SET ? NOTIFY_SET : NOTIFY_ZSET,
+                job->event,job->dstkey,db->id);
+        } else {
+            decrRefCount(dst);
+            if (deleted)
+                notifyKeyspaceEvent(NOTIFY_GENERIC,"del",job->dstkey,db->id);
         }
-        if (checkType(c,setobj,OBJ_SET)) {
-            zfree(sets);
+        signalModifiedKey(db,job->dstkey);
+        server.dirty++;
+        propagate(job->cmd,db->id,job->argv,job->argc,
+                  PROPAGATE_AOF|PROPAGATE_REPL);
+        if (job->c) addReplyLongLong(job->c,size);
+    } else if (job->c) {
+        addReplySds(job->c,sdsnew(err));
+    }
+    if (job->c) unblockClient(job->c);
+
+    listDelNode(server.setop_jobs,job->node);
+    setopJobReset(job);
+    for (j = 0; j < job->numkeys; j++) {
+        setopUnlockKey(job,job->keys[j]);
+        decrRefCount(job->keys[j]);
+    }
+    setopUnlockKey(job,job->dstkey);
+    decrRefCount(job->dstkey);
+    for (j = 0; j < job->argc; j++) decrRefCount(job->argv[j]);
+    zfree(job->argv);
+    zfree(job->keys);
+    zfree(job->vals);
+    zfree(job->privdata);
+    zfree(job);
+}
+
+/* Run the job till 'deadline', starting again if the inputs changed. */
+static void setopJobRun(setopJob *job, long long deadline) {
+    int j;
+
+    /* Don't store anything once we are a replica: the master will send us
+     * its own data set. */
+    if (server.masterhost) {
+        setopJobFinish(job,"-ERR instance turned into a replica\r\n");
+        return;
+    }
+
+    for (j = 0; j < job->numkeys && job->state; j++) {
+        robj *o = lookupKeyWriteWithFlags(job->db,job->keys[j],
+                                          LOOKUP_NOTOUCH);
+        if (o != job->vals[j]) setopJobReset(job);
+    }
+    if (job->state == NULL) {
+        for (j = 0; j < job->numkeys; j++) {
+            job->vals[j] = lookupKeyWriteWithFlags(job->db,job->keys[j],
+                                                   LOOKUP_NOTOUCH);
+            if (job->vals[j]) incrRefCount(job->vals[j]);
+        }
+        if (job->init(job) == C_ERR) {
+            setopJobFinish(job,shared.wrongtypeerr->ptr);
             return;
         }
-        sets[j] = setobj;
     }
+    if (job->step(job,deadline)) setopJobFinish(job,NULL);
+}
+
+static int setopTimeProc(struct aeEventLoop *eventLoop, long long id,
+                         void *clientData)
+{
+    long long deadline = ustime()+SETOP_SLICE_US;
+    listIter li;
+    listNode *ln;
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    listRewind(server.setop_jobs,&li);
+    while((ln = listNext(&li)) && ustime() < deadline)
+        setopJobRun(ln->value,deadline);
+
+    if (listLength(server.setop_jobs)) return SETOP_PERIOD_MS;
+    server.setop_timer_id = -1;
+    return AE_NOMORE;
+}
+
+/* Block the client and execute the set operation in the background. The
+ * types of the 'vals' of the input 'keys' were already checked by the
+ * caller, 'event' is the keyspace event of the result. The job takes the
+ * ownership of 'privdata'. The callbacks are described in server.h. */
+void setopStartJob(client *c, robj *dstkey, robj **keys, robj **vals,
+                   int numkeys, char *event, void *privdata,
+                   int (*init)(setopJob *job),
+                   int (*step)(setopJob *job, long long deadline),
+                   void (*free)(setopJob *job))
+{
+    setopJob *job = zcalloc(sizeof(*job));
+    int j;
+
+    job->c = c;
+    job->db = c->db;
+    job->cmd = c->cmd;
+    job->argc = c->argc;
+    job->argv = zmalloc(sizeof(robj*)*c->argc);
+    for (j = 0; j < c->argc; j++) {
+        job->argv[j] = c->argv[j];
+        incrRefCount(job->argv[j]);
+    }
+    job->dstkey = dstkey;
+    incrRefCount(dstkey);
+    job->numkeys = numkeys;
+    job->keys = zmalloc(sizeof(robj*)*numkeys);
+    job->vals = zmalloc(sizeof(robj*)*numkeys);
+    for (j = 0; j < numkeys; j++) {
+        job->keys[j] = keys[j];
+        job->vals[j] = vals[j];
+        incrRefCount(keys[j]);
+        if (vals[j]) incrRefCount(vals[j]);
+        setopLockKey(job,keys[j]);
+    }
+    setopLockKey(job,dstkey);
+    job->event = event;
+    job->privdata = privdata;
+    job->init = init;
+    job->step = step;
+    job->free = free;
+    serverAssert(job->init(job) == C_OK);
+
+    listAddNodeTail(server.setop_jobs,job);
+    job->node = listLast(server.setop_jobs);
+    if (server.setop_timer_id == -1)
+        server.setop_timer_id = aeCreateTimeEvent(server.el,SETOP_PERIOD_MS,
+                                                  setopTimeProc,NULL,NULL);
+
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_SETOP);
+}
+
+/* Called when the DB is flushed or swapped with another one: the jobs
+ * working on it release their inputs and start again from scratch. */
+void setopResetJobs(redisDb *db) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.setop_jobs,&li);
+    while((ln = listNext(&li))) {
+        setopJob *job = ln->value;
+        if (job->db == db && job->state) setopJobReset(job);
+    }
+}
+
+/* The client blocked in a set operation is unblocked or freed: the job
+ * goes on, and the result is stored anyway. */
+void unblockClientWaitingSetop(client *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.setop_jobs,&li);
+    while((ln = listNext(&li))) {
+        setopJob *job = ln->value;
+        if (job->c == c) job->c = NULL;
+    }
+}
+
+/* SUNION and SDIFF computed from the inputs 'sets', possibly in multiple
+ * steps, see sunionDiffStep(). */
+typedef struct {
+    int op;
+    int diff_algo;
+    robj **sets;            /* The inputs, in the order they are processed. */
+    int setnum;
+    int j;                  /* Input being iterated... */
+    setTypeIterator *si;    /* ...and its iterator, or NULL. */
+    robj *dstset;           /* The result. */
+} sunionDiffState;
+
+static sunionDiffState *sunionDiffCreate(robj **sets, int setnum, int op) {
+    sunionDiffState *st = zmalloc(sizeof(*st));
+    int j;
+
+    st->op = op;
+    st->diff_algo = 1;
+    st->sets = zmalloc(sizeof(robj*)*setnum);
+    memcpy(st->sets,sets,sizeof(robj*)*setnum);
+    st->setnum = setnum;
+    st->j = 0;
+    st->si = NULL;
+
+    /* We need a temp set object to store our union. If the dstkey
+     * is not NULL (that is, we are inside an SUNIONSTORE operation) then
+     * this set object will be the resulting object to set into the target key*/
+    st->dstset = createIntsetObject();
 
     /* Select what DIFF algorithm to use.
      *
@@ -974,94 +1555,189 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
         /* Algorithm 1 has better constant times and performs less operations
          * if there are elements in common. Give it some advantage. */
         algo_one_work /= 2;
-        diff_algo = (algo_one_work <= algo_two_work) ? 1 : 2;
+        st->diff_algo = (algo_one_work <= algo_two_work) ? 1 : 2;
 
-        if (diff_algo == 1 && setnum > 1) {
+        if (st->diff_algo == 1 && setnum > 1) {
             /* With algorithm 1 it is better to order the sets to subtract
              * by decreasing size, so that we are more likely to find
              * duplicated elements ASAP. */
-            qsort(sets+1,setnum-1,sizeof(robj*),
+            qsort(st->sets+1,setnum-1,sizeof(robj*),
                 qsortCompareSetsByRevCardinality);
         }
+    } else if (op == SET_OP_DIFF) {
+        /* The difference of a missing key is an empty set. */
+        st->setnum = 0;
     }
+    return st;
+}
 
-    /* We need a temp set object to store our union. If the dstkey
-     * is not NULL (that is, we are inside an SUNIONSTORE operation) then
-     * this set object will be the resulting object to set into the target key*/
-    dstset = createIntsetObject();
+static void sunionDiffFree(sunionDiffState *st) {
+    if (st->si) setTypeReleaseIterator(st->si);
+    if (st->dstset) decrRefCount(st->dstset);
+    zfree(st->sets);
+    zfree(st);
+}
 
-    if (op == SET_OP_UNION) {
-        /* Union is trivial, just add every element of every set to the
-         * temporary set. */
-        for (j = 0; j < setnum; j++) {
-            if (!sets[j]) continue; /* non existing keys are like empty sets */
+/* Compute the operation till 'deadline', in microseconds, and return 0 if
+ * it's not done yet. Once done 1 is returned and the result is moved
+ * to the caller in '*dstset'. */
+static int sunionDiffStep(sunionDiffState *st, long long deadline,
+                          robj **dstset)
+{
+    unsigned long count = 0;
+    sds ele;
 
-            si = setTypeInitIterator(sets[j]);
-            while((ele = setTypeNextObject(si)) != NULL) {
-                if (setTypeAdd(dstset,ele)) cardinality++;
-                sdsfree(ele);
-            }
-            setTypeReleaseIterator(si);
+    while (st->j < st->setnum) {
+        robj *set = st->sets[st->j];
+        int k;
+
+        if (set == NULL) { /* non existing keys are like empty sets */
+            st->j++;
+            continue;
         }
-    } else if (op == SET_OP_DIFF && sets[0] && diff_algo == 1) {
-        /* DIFF Algorithm 1:
-         *
-         * We perform the diff by iterating all the elements of the first set,
-         * and only adding it to the target set if the element does not exist
-         * into all the other sets.
-         *
-         * This way we perform at max N*M operations, where N is the size of
-         * the first set, and M the number of sets. */
-        si = setTypeInitIterator(sets[0]);
-        while((ele = setTypeNextObject(si)) != NULL) {
-            for (j = 1; j < setnum; j++) {
-                if (!sets[j]) continue; /* no key is an empty set. */
-                if (sets[j] == sets[0]) break; /* same set! */
-                if (setTypeIsMember(sets[j],ele)) break;
-            }
-            if (j == setnum) {
+
+        if (st->si == NULL) st->si = setTypeInitIterator(set);
+        while((ele = setTypeNextObject(st->si)) != NULL) {
+            if (st->op == SET_OP_UNION) {
+                /* Union is trivial, just add every element of every set to
+                 * the temporary set. */
+                setTypeAdd(st->dstset,ele);
+            } else if (st->diff_algo == 1) {
+                /* DIFF Algorithm 1:
+                 *
+                 * We perform the diff by iterating all the elements of the
+                 * first set, and only adding it to the target set if the
+                 * element does not exist into all the other sets.
+                 *
+                 * This way we perform at max N*M operations, where N is the
+                 * size of the first set, and M the number of sets. */
+                for (k = 1; k < st->setnum; k++) {
+                    if (!st->sets[k]) continue; /* no key is an empty set. */
+                    if (st->sets[k] == st->sets[0]) break; /* same set! */
+                    if (setTypeIsMember(st->sets[k],ele)) break;
+                }
                 /* There is no other set with this element. Add it. */
-                setTypeAdd(dstset,ele);
-                cardinality++;
+                if (k == st->setnum) setTypeAdd(st->dstset,ele);
+            } else {
+                /* DIFF Algorithm 2:
+                 *
+                 * Add all the elements of the first set to the auxiliary set.
+                 * Then remove all the elements of all the next sets from it.
+                 *
+                 * This is O(N) where N is the sum of all the elements in every
+                 * set. */
+                if (st->j == 0)
+                    setTypeAdd(st->dstset,ele);
+                else
+                    setTypeRemove(st->dstset,ele);
             }
             sdsfree(ele);
+            if (++count % 1024 == 0 && ustime() >= deadline) return 0;
         }
-        setTypeReleaseIterator(si);
-    } else if (op == SET_OP_DIFF && sets[0] && diff_algo == 2) {
-        /* DIFF Algorithm 2:
-         *
-         * Add all the elements of the first set to the auxiliary set.
-         * Then remove all the elements of all the next sets from it.
-         *
-         * This is O(N) where N is the sum of all the elements in every
-         * set. */
+        setTypeReleaseIterator(st->si);
+        st->si = NULL;
+        st->j++;
+
+        /* Algorithm 1 only iterates the first set. With algorithm 2 exit
+         * if result set is empty as any additional removal of elements will
+         * have no effect. */
+        if (st->op == SET_OP_DIFF &&
+            (st->diff_algo == 1 || setTypeSize(st->dstset) == 0)) break;
+    }
+    *dstset = st->dstset;
+    st->dstset = NULL;
+    return 1;
+}
+
+static int sunionDiffJobInit(setopJob *job) {
+    for (int j = 0; j < job->numkeys; j++) {
+        if (job->vals[j] && job->vals[j]->type != OBJ_SET) return C_ERR;
+    }
+    job->state = sunionDiffCreate(job->vals,job->numkeys,*(int*)job->privdata);
+    return C_OK;
+}
+
+static int sunionDiffJobStep(setopJob *job, long long deadline) {
+    return sunionDiffStep(job->state,deadline,&job->dst);
+}
+
+static void sunionDiffJobFree(setopJob *job) {
+    if (job->state) sunionDiffFree(job->state);
+}
+
+void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
+                              robj *dstkey, int op) {
+    robj **sets = zmalloc(sizeof(robj*)*setnum);
+    setTypeIterator *si;
+    robj *dstset = NULL;
+    sds ele;
+    unsigned long long numele = 0;
+    int j;
+
+    for (j = 0; j < setnum; j++) {
+        robj *setobj = dstkey ?
+            lookupKeyWrite(c->db,setkeys[j]) :
+            lookupKeyRead(c->db,setkeys[j]);
+        if (!setobj) {
+            sets[j] = NULL;
+            continue;
+        }
+        if (checkType(c,setobj,OBJ_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+        numele += setTypeSize(setobj);
+    }
+
+    if (setTypeAllIntsets(sets,setnum) && (op == SET_OP_UNION || sets[0])) {
+        /* Intsets are sorted arrays, so the union and the difference can
+         * be computed with merges. */
+        intset *is = intsetNew();
+
         for (j = 0; j < setnum; j++) {
-            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            intset *res;
 
-            si = setTypeInitIterator(sets[j]);
-            while((ele = setTypeNextObject(si)) != NULL) {
-                if (j == 0) {
-                    if (setTypeAdd(dstset,ele)) cardinality++;
-                } else {
-                    if (setTypeRemove(dstset,ele)) cardinality--;
-                }
-                sdsfree(ele);
-            }
-            setTypeReleaseIterator(si);
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            if (op == SET_OP_UNION || j == 0)
+                res = intsetUnion(is,sets[j]->ptr);
+            else
+                res = intsetDifference(is,sets[j]->ptr);
+            zfree(is);
+            is = res;
 
             /* Exit if result set is empty as any additional removal
              * of elements will have no effect. */
-            if (cardinality == 0) break;
+            if (op == SET_OP_DIFF && intsetLen(is) == 0) break;
         }
+        dstset = createIntsetObject();
+        setTypeSetIntset(dstset,is);
+    } else if (dstkey && setopCanRunInBackground(c,numele)) {
+        int *privdata = zmalloc(sizeof(int));
+
+        *privdata = op;
+        setopStartJob(c,dstkey,setkeys,sets,setnum,
+            op == SET_OP_UNION ? "sunionstore" : "sdiffstore",privdata,
+            sunionDiffJobInit,sunionDiffJobStep,sunionDiffJobFree);
+        zfree(sets);
+        return;
+    } else {
+        sunionDiffState *st = sunionDiffCreate(sets,setnum,op);
+        serverAssert(sunionDiffStep(st,LLONG_MAX,&dstset));
+        sunionDiffFree(st);
     }
 
     /* Output the content of the resulting set, if not in STORE mode */
     if (!dstkey) {
-        addReplySetLen(c,cardinality);
+        int64_t llele;
+
+        addReplySetLen(c,setTypeSize(dstset));
         si = setTypeInitIterator(dstset);
-        while((ele = setTypeNextObject(si)) != NULL) {
-            addReplyBulkCBuffer(c,ele,sdslen(ele));
-            sdsfree(ele);
+        while(setTypeNext(si,&ele,&llele) != -1) {
+            if (ele)
+                addReplyBulkCBuffer(c,ele,sdslen(ele));
+            else
+                addReplyBulkLongLong(c,llele);
         }
         setTypeReleaseIterator(si);
         server.lazyfree_lazy_server_del ? freeObjAsync(dstset) :
@@ -39,10 +39,13 @@
 #define STREAM_ITEM_FLAG_NONE 0             /* No special flags. */
 #define STREAM_ITEM_FLAG_DELETED (1<<0)     /* Entry is deleted. Skip it. */
 #define STREAM_ITEM_FLAG_SAMEFIELDS (1<<1)  /* Same fields as master entry. */
+#define STREAM_ITEM_FLAG_CODEDVALUES (1<<2) /* Values coded against the first
+                                               entry of the listpack. */
 
 void streamFreeCG(streamCG *cg);
 void streamFreeNACK(streamNACK *na);
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer);
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer);
+static void streamSetDeliveryTime(streamCG *cg, unsigned char *rawid, streamNACK *nack, mstime_t t);
 
 /* -----------------------------------------------------------------------
  * Low level stream encoding: a radix tree of listpacks.
@@ -55,6 +58,11 @@ stream *streamNew(void) {
     s->length = 0;
     s->last_id.ms = 0;
     s->last_id.seq = 0;
+    s->first_id.ms = 0;
+    s->first_id.seq = 0;
+    s->max_deleted_entry_id.ms = 0;
+    s->max_deleted_entry_id.seq = 0;
+    s->entries_added = 0;
     s->cgroups = NULL; /* Created on demand to save memory when not used. */
     return s;
 }
@@ -67,6 +75,30 @@ void freeStream(stream *s) {
     zfree(s);
 }
 
+/* Set 'edge_id' to the ID of the first (if 'first' is non-zero) or the last
+ * entry of the stream, or to 0-0 if the stream is empty. */
+void streamGetEdgeID(stream *s, int first, streamID *edge_id) {
+    streamIterator si;
+    int64_t numfields;
+    streamIteratorStart(&si,s,NULL,NULL,!first);
+    if (!streamIteratorGetID(&si,edge_id,&numfields)) {
+        edge_id->ms = 0;
+        edge_id->seq = 0;
+    }
+    streamIteratorStop(&si);
+}
+
+/* Refresh the recorded first entry ID after entries were removed from the
+ * head of the stream. */
+static void streamUpdateFirstID(stream *s) {
+    if (s->length == 0) {
+        s->first_id.ms = 0;
+        s->first_id.seq = 0;
+    } else {
+        streamGetEdgeID(s,1,&s->first_id);
+    }
+}
+
 /* Return the length of a stream. */
 unsigned long streamLength(const robj *subject) {
     stream *s = subject->ptr;
@@ -166,53 +198,170 @@ int streamCompareID(streamID *a, streamID *b) {
     return 0;
 }
 
-/* Adds a new item into the stream 's' having the specified number of
- * field-value pairs as specified in 'numfields' and stored into 'argv'.
- * Returns the new entry ID populating the 'added_id' structure.
+/* Return non-zero if the ID is 0-0. */
+static int streamIDIsZero(streamID *id) {
+    return id->ms == 0 && id->seq == 0;
+}
+
+/* Code the values of a stream entry having the same fields of the master
+ * entry, as stored in 'argv' (fields and values interleaved), against the
+ * values of the first entry of the listpack 'lp', starting at 'base'. The
+ * first entry of a listpack is never removed from it, and acts as the value
+ * dictionary of the following entries, that in telemetry streams often
+ * repeat the same values or have monotonic counters:
  *
- * If 'use_id' is not NULL, the ID is not auto-generated by the function,
- * but instead the passed ID is used to add the new entry. In this case
- * adding the entry may fail as specified later in this comment.
+ * - An integer value, when the base value is an integer too, is stored as
+ *   the difference with the base value (delta coding).
+ * - A string value equal to a string base value is stored as the integer 0.
+ * - Other string values are stored verbatim.
  *
- * The function returns C_OK if the item was added, this is always true
- * if the ID was generated by the function. However the function may return
- * C_ERR if an ID was given via 'use_id', but adding it failed since the
- * current top ID is greater or equal. */
-int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id) {
-    
-    /* Generate the new entry ID. */
-    streamID id;
-    if (use_id)
-        id = *use_id;
-    else
-        streamNextID(&s->last_id,&id);
-
-    /* Check that the new ID is greater than the last entry ID
-     * or return an error. Automatically generated IDs might
-     * overflow (and wrap-around) when incrementing the sequence 
-       part. */
-    if (streamCompareID(&id,&s->last_id) <= 0) return C_ERR;
+ * So a coded value stored as an integer is a delta or a reference depending
+ * on the base value, while values stored as strings are never coded. Since
+ * listpacks store as integers all the strings that represent integers, an
+ * integer value can't be stored verbatim in a coded entry: if there is such
+ * a value (with a string base value), or a delta would overflow, the entry
+ * can't be coded and 0 is returned. Otherwise 1 is returned, and 'coded[i]'
+ * tells if the value 'i' is to be stored as the integer 'deltas[i]'. */
+static int streamCodeValues(unsigned char *lp, unsigned char *base,
+                            robj **argv, int64_t numfields,
+                            int64_t *deltas, unsigned char *coded)
+{
+    int64_t numcoded = 0;
+
+    for (int64_t i = 0; i < numfields; i++, base = lpNext(lp,base)) {
+        sds value = argv[i*2+1]->ptr;
+        unsigned int blen;
+        long long bval;
+        int64_t ival;
+        unsigned char *bstr = lpGetValue(base,&blen,&bval);
+        int isint = lpStringToInt64(value,sdslen(value),&ival);
+
+        coded[i] = 0;
+        if (bstr == NULL && isint) {
+            /* Check for overflows of ival - bval. */
+            if ((bval > 0 && ival < INT64_MIN + bval) ||
+                (bval < 0 && ival > INT64_MAX + bval)) return 0;
+            deltas[i] = ival - bval;
+            coded[i] = 1;
+        } else if (isint) {
+            return 0;
+        } else if (bstr && blen == sdslen(value) &&
+                   memcmp(bstr,value,blen) == 0)
+        {
+            deltas[i] = 0;
+            coded[i] = 1;
+        }
+        numcoded += coded[i];
+    }
+    return numcoded != 0;
+}
 
-    /* Add the new entry. */
+/* State of an append to the tail node of a stream. The listpack elements of
+ * the entries are collected in 'pending' and written by streamBatchFlush()
+ * with a single listpack reallocation, so that appending many entries
+ * costs one radix tree seek, and one reallocation per node they fill. */
+#define STREAM_BATCH_STATIC_ELE 64
+typedef struct streamAppendBatch {
+    stream *s;
+    unsigned char *lp;      /* Tail node listpack, or NULL if none. */
+    unsigned char *lp_orig; /* Listpack pointer the radix tree references. */
+    uint64_t rax_key[2];    /* Key of the tail node in the radix tree. */
+    streamID master_id;     /* ID of the master entry of the tail node. */
+    int64_t count;          /* Valid entries in the node, pending included. */
+    int64_t lp_count;       /* Valid entries in the listpack header. */
+    size_t lp_bytes;        /* Bytes of the node, pending included. */
+    listpackEntry *pending; /* Elements not yet written to the listpack. */
+    unsigned long numpending, cappending;
+    listpackEntry static_pending[STREAM_BATCH_STATIC_ELE];
+} streamAppendBatch;
+
+/* Seek the tail node of the stream 's' to start appending entries. */
+static void streamBatchStart(streamAppendBatch *b, stream *s) {
     raxIterator ri;
-    raxStart(&ri,s->rax);
-    raxSeek(&ri,"$",NULL,0);
 
-    size_t lp_bytes = 0;        /* Total bytes in the tail listpack. */
-    unsigned char *lp = NULL;   /* Tail listpack pointer. */
+    b->s = s;
+    b->lp = b->lp_orig = NULL;
+    b->count = b->lp_count = 0;
+    b->lp_bytes = 0;
+    b->pending = b->static_pending;
+    b->numpending = 0;
+    b->cappending = STREAM_BATCH_STATIC_ELE;
 
     /* Get a reference to the tail node listpack. */
+    raxStart(&ri,s->rax);
+    raxSeek(&ri,"$",NULL,0);
     if (raxNext(&ri)) {
-        lp = ri.data;
-        lp_bytes = lpBytes(lp);
+        serverAssert(ri.key_len == sizeof(b->rax_key));
+        b->lp = b->lp_orig = ri.data;
+        b->lp_bytes = lpBytes(b->lp);
+        b->count = b->lp_count = lpGetInteger(lpFirst(b->lp));
+        memcpy(b->rax_key,ri.key,sizeof(b->rax_key));
+        streamDecodeID(b->rax_key,&b->master_id);
     }
     raxStop(&ri);
+}
+
+/* Queue a string element to the batch. */
+static void streamBatchPush(streamAppendBatch *b, unsigned char *sval,
+                            uint32_t slen, long long lval)
+{
+    if (b->numpending == b->cappending) {
+        b->cappending *= 2;
+        if (b->pending == b->static_pending) {
+            b->pending = zmalloc(sizeof(listpackEntry)*b->cappending);
+            memcpy(b->pending,b->static_pending,sizeof(b->static_pending));
+        } else {
+            b->pending = zrealloc(b->pending,
+                                  sizeof(listpackEntry)*b->cappending);
+        }
+    }
+    listpackEntry *e = &b->pending[b->numpending++];
+    e->sval = sval;
+    e->slen = slen;
+    e->lval = lval;
+    b->lp_bytes += lpEntryEncodedSize(e);
+}
+
+#define streamBatchPushString(b,s,len) \
+    streamBatchPush(b,(unsigned char*)(s),len,0)
+#define streamBatchPushInteger(b,v) streamBatchPush(b,NULL,0,v)
+
+/* Write the pending elements to the tail node, update its entries counter
+ * and its pointer in the radix tree. */
+static void streamBatchFlush(streamAppendBatch *b) {
+    if (b->numpending) {
+        b->lp = lpBatchAppend(b->lp,b->pending,b->numpending);
+        b->numpending = 0;
+    }
+    if (b->count != b->lp_count) {
+        unsigned char *p = lpFirst(b->lp);
+        b->lp = lpReplaceInteger(b->lp,&p,b->count);
+        b->lp_count = b->count;
+    }
+
+    /* Insert back into the tree in order to update the listpack pointer. */
+    if (b->lp && b->lp != b->lp_orig) {
+        raxInsert(b->s->rax,(unsigned char*)b->rax_key,sizeof(b->rax_key),
+                  b->lp,NULL);
+        b->lp_orig = b->lp;
+    }
+    b->lp_bytes = b->lp ? lpBytes(b->lp) : 0;
+}
+
+/* Flush the batch and release its resources. */
+static void streamBatchEnd(streamAppendBatch *b) {
+    streamBatchFlush(b);
+    if (b->pending != b->static_pending) zfree(b->pending);
+}
 
-    /* We have to add the key into the radix tree in lexicographic order,
-     * to do so we consider the ID as a single 128 bit number written in
-     * big endian, so that the most significant bytes are the first ones. */
-    uint64_t rax_key[2];    /* Key in the radix tree containing the listpack.*/
-    streamID master_id;     /* ID of the master entry in the listpack. */
+/* Append to the batch 'b' the entry with the specified ID, that the caller
+ * checked to be greater than the last ID of the stream, having the
+ * specified number of field-value pairs as specified in 'numfields' and
+ * stored into 'argv'. */
+static void streamBatchAppendEntry(streamAppendBatch *b, robj **argv,
+                                   int64_t numfields, streamID *id)
+{
+    stream *s = b->s;
 
     /* Create a new listpack and radix tree node if needed. Note that when
      * a new listpack is created, we populate it with a "master entry". This
@@ -249,46 +398,51 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
     /* First of all, check if we can append to the current macro node or
      * if we need to switch to the next one. 'lp' will be set to NULL if
      * the current node is full. */
-    if (lp != NULL) {
+    if (b->lp != NULL) {
         if (server.stream_node_max_bytes &&
-            lp_bytes >= server.stream_node_max_bytes)
+            b->lp_bytes >= server.stream_node_max_bytes)
         {
-            lp = NULL;
+            streamBatchFlush(b);
+            b->lp = NULL;
         } else if (server.stream_node_max_entries) {
-            int64_t count = lpGetInteger(lpFirst(lp));
-            if (count >= server.stream_node_max_entries) lp = NULL;
+            if (b->count >= server.stream_node_max_entries) {
+                streamBatchFlush(b);
+                b->lp = NULL;
+            }
         }
     }
 
     int flags = STREAM_ITEM_FLAG_NONE;
-    if (lp == NULL || lp_bytes >= server.stream_node_max_bytes) {
-        master_id = id;
-        streamEncodeID(rax_key,&id);
+    int newnode = 0;
+    int64_t static_deltas[16], *deltas = NULL; /* Coded values, if any. */
+    unsigned char static_coded[16], *coded = NULL;
+    if (b->lp == NULL || b->lp_bytes >= server.stream_node_max_bytes) {
+        if (b->lp) streamBatchFlush(b);
+        b->master_id = *id;
+        streamEncodeID(b->rax_key,id);
         /* Create the listpack having the master entry ID and fields. */
-        lp = lpNew();
-        lp = lpAppendInteger(lp,1); /* One item, the one we are adding. */
-        lp = lpAppendInteger(lp,0); /* Zero deleted so far. */
-        lp = lpAppendInteger(lp,numfields);
+        b->lp = lpNew();
+        b->lp_orig = NULL;
+        b->lp_bytes = lpBytes(b->lp);
+        b->count = b->lp_count = 1; /* One item, the one we are adding. */
+        streamBatchPushInteger(b,1);
+        streamBatchPushInteger(b,0); /* Zero deleted so far. */
+        streamBatchPushInteger(b,numfields);
         for (int64_t i = 0; i < numfields; i++) {
             sds field = argv[i*2]->ptr;
-            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
+            streamBatchPushString(b,field,sdslen(field));
         }
-        lp = lpAppendInteger(lp,0); /* Master entry zero terminator. */
-        raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
+        streamBatchPushInteger(b,0); /* Master entry zero terminator. */
         /* The first entry we insert, has obviously the same fields of the
          * master entry. */
         flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
+        newnode = 1;
     } else {
-        serverAssert(ri.key_len == sizeof(rax_key));
-        memcpy(rax_key,ri.key,sizeof(rax_key));
-
-        /* Read the master ID from the radix tree key. */
-        streamDecodeID(rax_key,&master_id);
+        unsigned char *lp = b->lp;
         unsigned char *lp_ele = lpFirst(lp);
 
         /* Update count and skip the deleted fields. */
-        int64_t count = lpGetInteger(lp_ele);
-        lp = lpReplaceInteger(lp,&lp_ele,count+1);
+        b->count++;
         lp_ele = lpNext(lp,lp_ele); /* seek deleted. */
         lp_ele = lpNext(lp,lp_ele); /* seek master entry num fields. */
 
@@ -312,6 +466,25 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
              * setting a single bit in the flags. */
             if (i == master_fields_count) flags |= STREAM_ITEM_FLAG_SAMEFIELDS;
         }
+
+        /* With the same fields, try to also code the values against the
+         * ones of the first entry of the listpack, that follow the master
+         * entry terminator 'lp_ele' is pointing to. */
+        if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+            if (numfields <= 16) {
+                deltas = static_deltas;
+                coded = static_coded;
+            } else {
+                deltas = zmalloc(sizeof(int64_t)*numfields);
+                coded = zmalloc(numfields);
+            }
+            unsigned char *base = lpNext(lp,lp_ele); /* Seek flags. */
+            base = lpNext(lp,base); /* Seek ID ms delta. */
+            base = lpNext(lp,base); /* Seek ID seq delta. */
+            base = lpNext(lp,base); /* Seek first value. */
+            if (streamCodeValues(lp,base,argv,numfields,deltas,coded))
+                flags |= STREAM_ITEM_FLAG_CODEDVALUES;
+        }
     }
 
     /* Populate the listpack with the new entry. We use the following
@@ -331,21 +504,32 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
      * The entry-id field is actually two separated fields: the ms
      * and seq difference compared to the master entry.
      *
+     * When the CODEDVALUES flag is also set, some of the values are stored
+     * as integers relative to the value of the same field in the first
+     * entry of the listpack, see streamCodeValues().
+     *
      * The lp-count field is a number that states the number of listpack pieces
      * that compose the entry, so that it's possible to travel the entry
      * in reverse order: we can just start from the end of the listpack, read
      * the entry, and jump back N times to seek the "flags" field to read
      * the stream full entry. */
-    lp = lpAppendInteger(lp,flags);
-    lp = lpAppendInteger(lp,id.ms - master_id.ms);
-    lp = lpAppendInteger(lp,id.seq - master_id.seq);
+    streamBatchPushInteger(b,flags);
+    streamBatchPushInteger(b,id->ms - b->master_id.ms);
+    streamBatchPushInteger(b,id->seq - b->master_id.seq);
     if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
-        lp = lpAppendInteger(lp,numfields);
+        streamBatchPushInteger(b,numfields);
     for (int64_t i = 0; i < numfields; i++) {
         sds field = argv[i*2]->ptr, value = argv[i*2+1]->ptr;
         if (!(flags & STREAM_ITEM_FLAG_SAMEFIELDS))
-            lp = lpAppend(lp,(unsigned char*)field,sdslen(field));
-        lp = lpAppend(lp,(unsigned char*)value,sdslen(value));
+            streamBatchPushString(b,field,sdslen(field));
+        if ((flags & STREAM_ITEM_FLAG_CODEDVALUES) && coded[i])
+            streamBatchPushInteger(b,deltas[i]);
+        else
+            streamBatchPushString(b,value,sdslen(value));
+    }
+    if (deltas != static_deltas) {
+        zfree(deltas);
+        zfree(coded);
     }
     /* Compute and store the lp-count field. */
     int64_t lp_count = numfields;
@@ -355,17 +539,67 @@ int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_
          * the values, and an additional num-fileds field. */
         lp_count += numfields+1;
     }
-    lp = lpAppendInteger(lp,lp_count);
+    streamBatchPushInteger(b,lp_count);
+
+    /* The values of the next entries of a new node are coded against the
+     * ones of this entry, so it must be in the listpack. */
+    if (newnode) streamBatchFlush(b);
 
-    /* Insert back into the tree in order to update the listpack pointer. */
-    if (ri.data != lp)
-        raxInsert(s->rax,(unsigned char*)&rax_key,sizeof(rax_key),lp,NULL);
     s->length++;
-    s->last_id = id;
+    s->entries_added++;
+    s->last_id = *id;
+    if (s->length == 1) s->first_id = *id;
+}
+
+/* Adds a new item into the stream 's' having the specified number of
+ * field-value pairs as specified in 'numfields' and stored into 'argv'.
+ * Returns the new entry ID populating the 'added_id' structure.
+ *
+ * If 'use_id' is not NULL, the ID is not auto-generated by the function,
+ * but instead the passed ID is used to add the new entry. In this case
+ * adding the entry may fail as specified later in this comment.
+ *
+ * The function returns C_OK if the item was added, this is always true
+ * if the ID was generated by the function. However the function may return
+ * C_ERR if an ID was given via 'use_id', but adding it failed since the
+ * current top ID is greater or equal. */
+int streamAppendItem(stream *s, robj **argv, int64_t numfields, streamID *added_id, streamID *use_id) {
+    
+    /* Generate the new entry ID. */
+    streamID id;
+    if (use_id)
+        id = *use_id;
+    else
+        streamNextID(&s->last_id,&id);
+
+    /* Check that the new ID is greater than the last entry ID
+     * or return an error. Automatically generated IDs might
+     * overflow (and wrap-around) when incrementing the sequence 
+       part. */
+    if (streamCompareID(&id,&s->last_id) <= 0) return C_ERR;
+
+    /* Add the new entry. */
+    streamAppendBatch b;
+    streamBatchStart(&b,s);
+    streamBatchAppendEntry(&b,argv,numfields,&id);
+    streamBatchEnd(&b);
     if (added_id) *added_id = id;
     return C_OK;
 }
 
+/* Like streamAppendItem() but adds 'count' entries at once: the
+ * 'numfields[j]' field-value pairs of the entry 'j' are stored at 'argv[j]'
+ * and its ID is 'ids[j]'. The caller must make sure that the IDs are
+ * increasing and greater than the last ID of the stream. The tail node of
+ * the stream is looked up once, and grown once per node filled. */
+void streamAppendItems(stream *s, robj ***argv, int64_t *numfields, streamID *ids, long count) {
+    streamAppendBatch b;
+    streamBatchStart(&b,s);
+    for (long j = 0; j < count; j++)
+        streamBatchAppendEntry(&b,argv[j],numfields[j],&ids[j]);
+    streamBatchEnd(&b);
+}
+
 /* Trim the stream 's' to have no more than maxlen elements, and return the
  * number of elements removed from the stream. The 'approx' option, if non-zero,
  * specifies that the trimming must be performed in a approximated way in
@@ -470,6 +704,132 @@ int64_t streamTrimByLength(stream *s, size_t maxlen, int approx) {
     }
 
     raxStop(&ri);
+    if (deleted) streamUpdateFirstID(s);
+    return deleted;
+}
+
+/* Trim the stream 's' removing all the elements with an ID smaller than
+ * 'minid', and return the number of elements removed from the stream. Like
+ * for streamTrimByLength(), if 'approx' is non-zero only *whole* nodes of
+ * the radix tree are removed, so the stream may still contain elements
+ * older than 'minid'.
+ *
+ * All the entries of a node are smaller than the master ID of the next
+ * node, so whole nodes are released just comparing the master IDs of the
+ * radix tree keys, without decoding their entries: retention by age costs
+ * O(nodes removed). Only when the trimming is exact the entries of the first
+ * node that survives are scanned and marked as deleted. */
+int64_t streamTrimByID(stream *s, streamID *minid, int approx) {
+    if (s->length == 0) return 0;
+
+    raxIterator ri, next;
+    raxStart(&ri,s->rax);
+    raxStart(&next,s->rax);
+    raxSeek(&ri,"^",NULL,0);
+
+    int64_t deleted = 0;
+    while(s->length && raxNext(&ri)) {
+        unsigned char *lp = ri.data, *p = lpFirst(lp);
+        int64_t entries = lpGetInteger(p);
+        streamID master_id, next_id;
+
+        /* Every entry of the node is >= its master ID. */
+        streamDecodeID(ri.key,&master_id);
+        if (streamCompareID(&master_id,minid) >= 0) break;
+
+        /* The node can be removed if all its entries are smaller than
+         * 'minid', that is, if the next node starts at or before 'minid'.
+         * For the last node we can only use the last ID of the stream. */
+        int whole;
+        raxSeek(&next,">",ri.key,ri.key_len);
+        if (raxNext(&next)) {
+            streamDecodeID(next.key,&next_id);
+            whole = streamCompareID(&next_id,minid) <= 0;
+        } else {
+            whole = streamCompareID(&s->last_id,minid) < 0;
+        }
+
+        if (whole) {
+            lpFree(lp);
+            raxRemove(s->rax,ri.key,ri.key_len,NULL);
+            raxSeek(&ri,">=",ri.key,ri.key_len);
+            s->length -= entries;
+            deleted += entries;
+            continue;
+        }
+
+        /* If we cannot remove a whole node, and approx is true,
+         * stop here. */
+        if (approx) break;
+
+        /* Otherwise mark as deleted the entries smaller than 'minid',
+         * that are all at the start of the node. */
+        p = lpNext(lp,p); /* Seek deleted field. */
+        int64_t marked_deleted = lpGetInteger(p);
+        p = lpNext(lp,p); /* Seek num-of-fields in the master entry. */
+
+        /* Skip all the master fields. */
+        int64_t master_fields_count = lpGetInteger(p);
+        p = lpNext(lp,p); /* Seek the first field. */
+        for (int64_t j = 0; j < master_fields_count; j++)
+            p = lpNext(lp,p); /* Skip all master fields. */
+        p = lpNext(lp,p); /* Skip the zero master entry terminator. */
+
+        int64_t node_deleted = 0;
+        while(p) {
+            int flags = lpGetInteger(p);
+            unsigned char *flags_p = p;
+            int to_skip;
+            streamID id;
+
+            p = lpNext(lp,p); /* Seek ID ms delta. */
+            id.ms = master_id.ms + lpGetInteger(p);
+            p = lpNext(lp,p); /* Seek ID seq delta. */
+            id.seq = master_id.seq + lpGetInteger(p);
+            if (streamCompareID(&id,minid) >= 0) break;
+
+            /* Mark the entry as deleted. Replacing the flags with a value
+             * of the same size doesn't move the rest of the listpack. */
+            if (!(flags & STREAM_ITEM_FLAG_DELETED)) {
+                flags |= STREAM_ITEM_FLAG_DELETED;
+                lp = lpReplaceInteger(lp,&flags_p,flags);
+                p = lpNext(lp,flags_p);
+                p = lpNext(lp,p);
+                node_deleted++;
+            }
+
+            p = lpNext(lp,p); /* Seek num-fields or values (if compressed). */
+            if (flags & STREAM_ITEM_FLAG_SAMEFIELDS) {
+                to_skip = master_fields_count;
+            } else {
+                to_skip = lpGetInteger(p);
+                to_skip = 1+(to_skip*2);
+            }
+
+            while(to_skip--) p = lpNext(lp,p); /* Skip the whole entry. */
+            p = lpNext(lp,p); /* Skip the final lp-count field. */
+        }
+        s->length -= node_deleted;
+        deleted += node_deleted;
+
+        if (node_deleted == entries) {
+            /* Only deleted entries remain: release the node, as XDEL
+             * does. */
+            lpFree(lp);
+            raxRemove(s->rax,ri.key,ri.key_len,NULL);
+        } else if (node_deleted) {
+            p = lpFirst(lp);
+            lp = lpReplaceInteger(lp,&p,entries-node_deleted);
+            p = lpNext(lp,p); /* Seek deleted field. */
+            lp = lpReplaceInteger(lp,&p,marked_deleted+node_deleted);
+            raxInsert(s->rax,ri.key,ri.key_len,lp,NULL);
+        }
+        break; /* The following nodes only have entries >= 'minid'. */
+    }
+
+    raxStop(&next);
+    raxStop(&ri);
+    if (deleted) streamUpdateFirstID(s);
     return deleted;
 }
 
@@ -536,6 +896,27 @@ void streamIteratorStart(streamIterator *si, stream *s, streamID *start, streamI
     si->rev = rev;  /* Direction, if non-zero reversed, from end to start. */
 }
 
+/* Setup the iterator 'si' to emit the fields of the entry with the
+ * specified flags, seeking the values of the first entry of the listpack
+ * the values may be coded against, if not already done. */
+static void streamIteratorSetEntry(streamIterator *si, int flags) {
+    si->entry_flags = flags;
+    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
+        si->master_fields_ptr = si->master_fields_start;
+    if (flags & STREAM_ITEM_FLAG_CODEDVALUES) {
+        if (si->base_values_start == NULL) {
+            unsigned char *p = si->master_fields_start;
+            for (uint64_t i = 0; i < si->master_fields_count; i++)
+                p = lpNext(si->lp,p);
+            p = lpNext(si->lp,p); /* Skip the master entry terminator. */
+            p = lpNext(si->lp,p); /* Skip flags. */
+            p = lpNext(si->lp,p); /* Skip ID ms delta. */
+            si->base_values_start = lpNext(si->lp,p); /* Skip seq delta. */
+        }
+        si->base_values_ptr = si->base_values_start;
+    }
+}
+
 /* Return 1 and store the current item ID at 'id' if there are still
  * elements within the iteration range, otherwise return 0 in order to
  * signal the iteration terminated. */
@@ -558,6 +939,7 @@ int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
             si->master_fields_count = lpGetInteger(si->lp_ele);
             si->lp_ele = lpNext(si->lp,si->lp_ele); /* Seek first field. */
             si->master_fields_start = si->lp_ele;
+            si->base_values_start = NULL;
             /* We are now pointing to the first field of the master entry.
              * We need to seek either the first or the last entry depending
              * on the direction of the iteration. */
@@ -637,9 +1019,7 @@ int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
                 {
                     if (memcmp(buf,si->end_key,sizeof(streamID)) > 0)
                         return 0; /* We are already out of range. */
-                    si->entry_flags = flags;
-                    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
-                        si->master_fields_ptr = si->master_fields_start;
+                    streamIteratorSetEntry(si,flags);
                     return 1; /* Valid item returned. */
                 }
             } else {
@@ -648,9 +1028,7 @@ int streamIteratorGetID(streamIterator *si, streamID *id, int64_t *numfields) {
                 {
                     if (memcmp(buf,si->start_key,sizeof(streamID)) < 0)
                         return 0; /* We are already out of range. */
-                    si->entry_flags = flags;
-                    if (flags & STREAM_ITEM_FLAG_SAMEFIELDS)
-                        si->master_fields_ptr = si->master_fields_start;
+                    streamIteratorSetEntry(si,flags);
                     return 1; /* Valid item returned. */
                 }
             }
@@ -692,7 +1070,29 @@ void streamIteratorGetField(streamIterator *si, unsigned char **fieldptr, unsign
         *fieldptr = lpGet(si->lp_ele,fieldlen,si->field_buf);
         si->lp_ele = lpNext(si->lp,si->lp_ele);
     }
-    *valueptr = lpGet(si->lp_ele,valuelen,si->value_buf);
+    if (si->entry_flags & STREAM_ITEM_FLAG_CODEDVALUES) {
+        /* Values stored as integers are coded against the base value, see
+         * streamCodeValues(). */
+        int64_t delta;
+        if (lpGet(si->lp_ele,&delta,NULL) != NULL) {
+            *valueptr = lpGet(si->lp_ele,valuelen,si->value_buf);
+        } else {
+            unsigned int blen;
+            long long bval;
+            unsigned char *bstr = lpGetValue(si->base_values_ptr,&blen,&bval);
+            if (bstr) {
+                *valueptr = bstr;
+                *valuelen = blen;
+            } else {
+                *valueptr = si->value_buf;
+                *valuelen = ll2string((char*)si->value_buf,
+                                      sizeof(si->value_buf),bval+delta);
+            }
+        }
+        si->base_values_ptr = lpNext(si->lp,si->base_values_ptr);
+    } else {
+        *valueptr = lpGet(si->lp_ele,valuelen,si->value_buf);
+    }
     si->lp_ele = lpNext(si->lp,si->lp_ele);
 }
 
@@ -838,22 +1238,141 @@ void streamPropagateXCLAIM(client *c, robj *key, streamCG *group, robj *groupnam
 }
 
 /* We need this when we want to propoagate the new last-id of a consumer group
- * that was consumed by XREADGROUP with the NOACK option: in that case we can't
- * propagate the last ID just using the XCLAIM LASTID option, so we emit
+ * that was consumed by XREADGROUP: the XCLAIM LASTID option can't carry the
+ * group read counter, and with NOACK no XCLAIM is emitted at all, so once per
+ * command we emit
  *
- *  XGROUP SETID <key> <groupname> <id>
+ *  XGROUP SETID <key> <groupname> <id> ENTRIESREAD <entries_read>
  */
 void streamPropagateGroupID(client *c, robj *key, streamCG *group, robj *groupname) {
-    robj *argv[5];
+    robj *argv[7];
     argv[0] = createStringObject("XGROUP",6);
     argv[1] = createStringObject("SETID",5);
     argv[2] = key;
     argv[3] = groupname;
     argv[4] = createObjectFromStreamID(&group->last_id);
-    propagate(server.xgroupCommand,c->db->id,argv,5,PROPAGATE_AOF|PROPAGATE_REPL);
+    argv[5] = createStringObject("ENTRIESREAD",11);
+    argv[6] = createStringObjectFromLongLong(group->entries_read);
+    propagate(server.xgroupCommand,c->db->id,argv,7,PROPAGATE_AOF|PROPAGATE_REPL);
     decrRefCount(argv[0]);
     decrRefCount(argv[1]);
     decrRefCount(argv[4]);
+    decrRefCount(argv[5]);
+    decrRefCount(argv[6]);
+}
+
+/* Return non-zero if the stream 's' may have deleted entries ("tombstones")
+ * between 'start' and 'end' (NULL meaning the last entry). No deletion ever
+ * happened after the max deleted entry ID, so this is a pair of ID
+ * comparisons. */
+static int streamRangeHasTombstones(stream *s, streamID *start, streamID *end) {
+    streamID start_id, end_id;
+
+    if (!s->length || streamIDIsZero(&s->max_deleted_entry_id)) {
+        /* The stream is empty or no entry was ever deleted. */
+        return 0;
+    }
+
+    if (start) {
+        start_id = *start;
+    } else {
+        start_id.ms = 0;
+        start_id.seq = 0;
+    }
+
+    if (end) {
+        end_id = *end;
+    } else {
+        end_id.ms = UINT64_MAX;
+        end_id.seq = UINT64_MAX;
+    }
+
+    if (streamCompareID(&start_id,&s->max_deleted_entry_id) <= 0 &&
+        streamCompareID(&s->max_deleted_entry_id,&end_id) <= 0)
+    {
+        /* start_id <= max_deleted_entry_id <= end_id: the range does include
+         * a tombstone. */
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Return the number of entries added to the stream before the one with
+ * the specified 'id', plus one: the value of a group read counter with
+ * 'id' as last delivered ID. SCG_INVALID_ENTRIES_READ is returned when
+ * the deletions in the stream make it impossible to tell. */
+long long streamEstimateDistanceFromFirstEverEntry(stream *s, streamID *id) {
+    /* The counter of any ID in an empty, never populated stream is 0. */
+    if (!s->entries_added) return 0;
+
+    /* In the empty stream, if the ID is smaller or equal to the last ID,
+     * it can be set to the current added_entries value. */
+    if (!s->length && streamCompareID(id,&s->last_id) < 1) {
+        return s->entries_added;
+    }
+
+    int cmp_last = streamCompareID(id,&s->last_id);
+    if (cmp_last == 0) {
+        /* Return the exact counter of the last entry in the stream. */
+        return s->entries_added;
+    } else if (cmp_last > 0) {
+        /* The counter of a future ID is unknown. */
+        return SCG_INVALID_ENTRIES_READ;
+    }
+
+    int cmp_id_first = streamCompareID(id,&s->first_id);
+    int cmp_xdel_first = streamCompareID(&s->max_deleted_entry_id,&s->first_id);
+    if (streamIDIsZero(&s->max_deleted_entry_id) || cmp_xdel_first < 0) {
+        /* There's definitely no fragmentation ahead. */
+        if (cmp_id_first < 0) {
+            /* Return the estimated counter. */
+            return s->entries_added - s->length;
+        } else if (cmp_id_first == 0) {
+            /* Return the exact counter of the first entry in the stream. */
+            return s->entries_added - s->length + 1;
+        }
+    }
+
+    /* The ID is either before an XDEL that fragments the stream or an
+     * arbitrary ID. Either case, so we can't make a prediction. */
+    return SCG_INVALID_ENTRIES_READ;
+}
+
+/* Reply with the lag of the consumer group 'cg', that is the number of
+ * entries of the stream 's' not yet delivered to the group, or with a
+ * null when it can't be told because of deletions. */
+static void streamReplyWithCGLag(client *c, stream *s, streamCG *cg) {
+    int valid = 0;
+    long long lag = 0;
+
+    if (!s->entries_added) {
+        /* The lag of a newly-initialized stream is 0. */
+        lag = 0;
+        valid = 1;
+    } else if (cg->entries_read != SCG_INVALID_ENTRIES_READ &&
+               !streamRangeHasTombstones(s,&cg->last_id,NULL))
+    {
+        /* No fragmentation ahead means that the group's logical reads
+         * counter is valid for performing the lag calculation. */
+        lag = (long long)s->entries_added - cg->entries_read;
+        valid = 1;
+    } else {
+        /* Attempt to retrieve the group's last ID logical read counter. */
+        long long entries_read =
+            streamEstimateDistanceFromFirstEverEntry(s,&cg->last_id);
+        if (entries_read != SCG_INVALID_ENTRIES_READ) {
+            /* A valid counter was obtained. */
+            lag = (long long)s->entries_added - entries_read;
+            valid = 1;
+        }
+    }
+
+    if (valid) {
+        addReplyLongLong(c,lag);
+    } else {
+        addReplyNull(c);
+    }
 }
 
 /* Send the stream items in the specified range to the client 'c'. The range
@@ -919,7 +1438,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
      * as delivered. */
     if (group && (flags & STREAM_RWR_HISTORY)) {
         return streamReplyWithRangeFromConsumerPEL(c,s,start,end,count,
-                                                   consumer);
+                                                   group,consumer);
     }
 
     if (!(flags & STREAM_RWR_RAWENTRIES))
@@ -928,6 +1447,18 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
     while(streamIteratorGetID(&si,&id,&numfields)) {
         /* Update the group last_id if needed. */
         if (group && streamCompareID(&id,&group->last_id) > 0) {
+            if (group->entries_read != SCG_INVALID_ENTRIES_READ &&
+                !streamRangeHasTombstones(s,&id,NULL))
+            {
+                /* A valid counter and no future tombstones mean we can
+                 * increment the read counter to keep tracking the group's
+                 * progress. */
+                group->entries_read++;
+            } else if (s->entries_added) {
+                /* The group's counter may be invalid, so we try to obtain it. */
+                group->entries_read =
+                    streamEstimateDistanceFromFirstEverEntry(s,&id);
+            }
             group->last_id = id;
             propagate_last_id = 1;
         }
@@ -969,6 +1500,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
                 raxTryInsert(group->pel,buf,sizeof(buf),nack,NULL);
             int consumer_inserted =
                 raxTryInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+            if (group_inserted) streamIndexNACK(group,buf,nack);
 
             /* Now we can check if the entry was already busy, and
              * in that case reassign the entry to the new consumer,
@@ -980,7 +1512,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
                 raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
                 /* Update the consumer and NACK metadata. */
                 nack->consumer = consumer;
-                nack->delivery_time = mstime();
+                streamSetDeliveryTime(group,buf,nack,mstime());
                 nack->delivery_count = 1;
                 /* Add the entry in the new consumer local PEL. */
                 raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
@@ -994,14 +1526,15 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
                 streamPropagateXCLAIM(c,spi->keyname,group,spi->groupname,idarg,nack);
                 decrRefCount(idarg);
             }
-        } else {
-            if (propagate_last_id)
-                streamPropagateGroupID(c,spi->keyname,group,spi->groupname);
         }
 
         arraylen++;
         if (count && count == arraylen) break;
     }
+
+    if (spi && propagate_last_id)
+        streamPropagateGroupID(c,spi->keyname,group,spi->groupname);
+
     streamIteratorStop(&si);
     if (arraylen_ptr) setDeferredArrayLen(c,arraylen_ptr,arraylen);
     return arraylen;
@@ -1020,7 +1553,7 @@ size_t streamReplyWithRange(client *c, stream *s, streamID *start, streamID *end
  * seek into the radix tree of the messages in order to emit the full message
  * to the client. However clients only reach this code path when they are
  * fetching the history of already retrieved messages, which is rare. */
-size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamConsumer *consumer) {
+size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start, streamID *end, size_t count, streamCG *group, streamConsumer *consumer) {
     raxIterator ri;
     unsigned char startkey[sizeof(streamID)];
     unsigned char endkey[sizeof(streamID)];
@@ -1049,7 +1582,7 @@ size_t streamReplyWithRangeFromConsumerPEL(client *c, stream *s, streamID *start
             addReplyNullArray(c);
         } else {
             streamNACK *nack = ri.data;
-            nack->delivery_time = mstime();
+            streamSetDeliveryTime(group,ri.key,nack,mstime());
             nack->delivery_count++;
         }
         arraylen++;
@@ -1153,14 +1686,238 @@ void streamRewriteApproxMaxlen(client *c, stream *s, int maxlen_arg_idx) {
     decrRefCount(maxlen_obj);
 }
 
-/* XADD key [MAXLEN [~|=] <count>] <ID or *> [field value] [field value] ... */
+/* Likewise MINID ~ <id> is propagated as MINID = <first-ID-of-the-stream>,
+ * since the nodes of the stream may not have the same boundaries on the
+ * replicas or when loading an AOF. */
+void streamRewriteApproxMinid(client *c, stream *s, int minid_arg_idx) {
+    streamIterator si;
+    streamID first;
+    int64_t numfields;
+
+    /* If the stream is now empty all its entries were smaller than the
+     * given ID, so an exact trimming with the same ID has the same effect. */
+    streamIteratorStart(&si,s,NULL,NULL,0);
+    if (streamIteratorGetID(&si,&first,&numfields)) {
+        robj *minid_obj = createObjectFromStreamID(&first);
+        rewriteClientCommandArgument(c,minid_arg_idx,minid_obj);
+        decrRefCount(minid_obj);
+    }
+    streamIteratorStop(&si);
+
+    robj *equal_obj = createStringObject("=",1);
+    rewriteClientCommandArgument(c,minid_arg_idx-1,equal_obj);
+    decrRefCount(equal_obj);
+}
+
+#define TRIM_STRATEGY_NONE 0
+#define TRIM_STRATEGY_MAXLEN 1
+#define TRIM_STRATEGY_MINID 2
+
+/* Parse the MAXLEN [~|=] <count> or MINID [~|=] <id> trimming arguments of
+ * XADD and XTRIM, where c->argv[*i] is the option name. On success '*i' is
+ * updated to the index of the count or ID and C_OK is returned, otherwise
+ * an error is sent to the client and C_ERR is returned. A MINID given as a
+ * plain unix time in milliseconds trims the entries older than that time. */
+int streamParseTrimArgsOrReply(client *c, int *i, int is_maxlen,
+                               long long *maxlen, streamID *minid,
+                               int *approx, int *trim_strategy)
+{
+    int moreargs = (c->argc-1) - *i;
+    int new_strategy = is_maxlen ? TRIM_STRATEGY_MAXLEN : TRIM_STRATEGY_MINID;
+    char *next = c->argv[*i+1]->ptr;
+
+    if (*trim_strategy != TRIM_STRATEGY_NONE &&
+        *trim_strategy != new_strategy)
+    {
+        addReplyError(c,"The MAXLEN and MINID options can't be used together.");
+        return C_ERR;
+    }
+
+    *approx = 0;
+    /* Check for the form MAXLEN ~ <count> or MINID ~ <id>. */
+    if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
+        *approx = 1;
+        (*i)++;
+    } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
+        (*i)++;
+    }
+    (*i)++;
+
+    if (is_maxlen) {
+        if (getLongLongFromObjectOrReply(c,c->argv[*i],maxlen,NULL)
+            != C_OK) return C_ERR;
+
+        if (*maxlen < 0) {
+            addReplyError(c,"The MAXLEN argument must be >= 0.");
+            return C_ERR;
+        }
+    } else {
+        if (streamParseIDOrReply(c,c->argv[*i],minid,0) != C_OK)
+            return C_ERR;
+    }
+    *trim_strategy = new_strategy;
+    return C_OK;
+}
+
+/* Trim the stream 's' after XADD added entries to it, according to the
+ * trimming options parsed by xaddCommand(). */
+static void xaddTrim(client *c, stream *s, int trim_strategy, long long maxlen,
+                     streamID *minid, int approx_trim, int trim_arg_idx)
+{
+    int64_t deleted;
+
+    if (trim_strategy == TRIM_STRATEGY_MAXLEN)
+        deleted = streamTrimByLength(s,maxlen,approx_trim);
+    else
+        deleted = streamTrimByID(s,minid,approx_trim);
+    /* Notify xtrim event if needed. */
+    if (deleted) {
+        notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->argv[1],c->db->id);
+    }
+    if (approx_trim) {
+        if (trim_strategy == TRIM_STRATEGY_MAXLEN)
+            streamRewriteApproxMaxlen(c,s,trim_arg_idx);
+        else
+            streamRewriteApproxMinid(c,s,trim_arg_idx);
+    }
+}
+
+/* XADD key [MAXLEN|MINID ...] ENTRIES <count>
+ *      <ID or *> <numfields> field value [field value ...]
+ *      [<ID or *> <numfields> field value [field value ...] ...]
+ *
+ * Multi-entry form of XADD, handled by xaddCommand() when the ENTRIES option
+ * is found at 'i'. All the IDs are computed and checked before the stream
+ * is touched, so either all the entries are added or none is. The entries
+ * are appended with a single lookup of the tail node, and the command is
+ * propagated as a whole with the generated IDs. */
+static void xaddEntriesCommand(client *c, int i, int trim_strategy,
+                               long long maxlen, streamID *minid,
+                               int approx_trim, int trim_arg_idx)
+{
+    long long count;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[i+1],&count,NULL) != C_OK)
+        return;
+    if (count <= 0) {
+        addReplyError(c,"The ENTRIES count must be a positive integer");
+        return;
+    }
+    /* Every entry has at least an ID, a count and a field-value pair. */
+    if (count > (c->argc-i-2)/4) {
+        addReplyError(c,"wrong number of arguments for XADD");
+        return;
+    }
+
+    robj ***argv = zmalloc(sizeof(robj**)*count);
+    int64_t *numfields = zmalloc(sizeof(int64_t)*count);
+    streamID *ids = zmalloc(sizeof(streamID)*count);
+    int *id_pos = zmalloc(sizeof(int)*count);
+    unsigned char *id_given = zmalloc(count);
+
+    /* Parse the entries. */
+    int j = i+2;
+    for (long k = 0; k < count; k++) {
+        long long n;
+        if (c->argc-j < 4) {
+            addReplyError(c,"wrong number of arguments for XADD");
+            goto cleanup;
+        }
+        char *opt = c->argv[j]->ptr;
+        id_pos[k] = j;
+        id_given[k] = !(opt[0] == '*' && opt[1] == '\0');
+        if (id_given[k]) {
+            if (streamParseStrictIDOrReply(c,c->argv[j],&ids[k],0) != C_OK)
+                goto cleanup;
+            if (ids[k].ms == 0 && ids[k].seq == 0) {
+                addReplyError(c,"The ID specified in XADD must be greater "
+                                "than 0-0");
+                goto cleanup;
+            }
+        }
+        if (getLongLongFromObjectOrReply(c,c->argv[j+1],&n,NULL) != C_OK)
+            goto cleanup;
+        if (n <= 0 || n > (c->argc-j-2)/2) {
+            addReplyError(c,"The number of fields of an XADD entry is out "
+                            "of range");
+            goto cleanup;
+        }
+        numfields[k] = n;
+        argv[k] = c->argv+j+2;
+        j += 2+n*2;
+    }
+    if (j != c->argc) {
+        addReplyError(c,"wrong number of arguments for XADD");
+        goto cleanup;
+    }
+
+    /* Compute the IDs the entries will get, starting from the last ID of
+     * the stream if it exists, and check they are increasing. */
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o && checkType(c,o,OBJ_STREAM)) goto cleanup;
+    streamID last = {0, 0};
+    if (o) last = ((stream*)o->ptr)->last_id;
+    for (long k = 0; k < count; k++) {
+        if (!id_given[k]) streamNextID(&last,&ids[k]);
+        if (streamCompareID(&ids[k],&last) <= 0) {
+            addReplyError(c,"The ID specified in XADD is equal or smaller "
+                            "than the target stream top item");
+            goto cleanup;
+        }
+        last = ids[k];
+    }
+
+    /* Lookup the stream at key, creating it if needed. */
+    if ((o = streamTypeLookupWriteOrCreate(c,c->argv[1])) == NULL)
+        goto cleanup;
+    stream *s = o->ptr;
+    streamAppendItems(s,argv,numfields,ids,count);
+
+    addReplyArrayLen(c,count);
+    for (long k = 0; k < count; k++) addReplyStreamID(c,&ids[k]);
+
+    signalModifiedKey(c->db,c->argv[1]);
+    notifyKeyspaceEvent(NOTIFY_STREAM,"xadd",c->argv[1],c->db->id);
+    server.dirty += count;
+
+    if (trim_strategy != TRIM_STRATEGY_NONE)
+        xaddTrim(c,s,trim_strategy,maxlen,minid,approx_trim,trim_arg_idx);
+
+    /* Rewrite the ID arguments with the ones actually generated for
+     * AOF/replication propagation. */
+    for (long k = 0; k < count; k++) {
+        if (id_given[k]) continue;
+        robj *idarg = createObjectFromStreamID(&ids[k]);
+        rewriteClientCommandArgument(c,id_pos[k],idarg);
+        decrRefCount(idarg);
+    }
+
+    /* We need to signal to blocked clients that there is new data on this
+     * stream. */
+    if (server.blocked_clients_by_type[BLOCKED_STREAM])
+        signalKeyAsReady(c->db, c->argv[1]);
+
+cleanup:
+    zfree(argv);
+    zfree(numfields);
+    zfree(ids);
+    zfree(id_pos);
+    zfree(id_given);
+}
+
+/* XADD key [MAXLEN|MINID [~|=] <count or ID>] <ID or *>
+ *      [field value] [field value] ...
+ * XADD key [MAXLEN|MINID [~|=] <count or ID>] ENTRIES <count> ... */
 void xaddCommand(client *c) {
     streamID id;
     int id_given = 0; /* Was an ID different than "*" specified? */
+    int trim_strategy = TRIM_STRATEGY_NONE;
     long long maxlen = -1;  /* If left to -1 no trimming is performed. */
-    int approx_maxlen = 0;  /* If 1 only delete whole radix tree nodes, so
-                               the maxium length is not applied verbatim. */
-    int maxlen_arg_idx = 0; /* Index of the count in MAXLEN, for rewriting. */
+    streamID minid;         /* Entries smaller than this ID are trimmed. */
+    int approx_trim = 0;    /* If 1 only delete whole radix tree nodes, so
+                               the trimming is not applied verbatim. */
+    int trim_arg_idx = 0;   /* Index of the MAXLEN/MINID argument, for
+                               rewriting. */
 
     /* Parse options. */
     int i = 2; /* This is the first argument position where we could
@@ -1172,25 +1929,17 @@ void xaddCommand(client *c) {
             /* This is just a fast path for the common case of auto-ID
              * creation. */
             break;
-        } else if (!strcasecmp(opt,"maxlen") && moreargs) {
-            approx_maxlen = 0;
-            char *next = c->argv[i+1]->ptr;
-            /* Check for the form MAXLEN ~ <count>. */
-            if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
-                approx_maxlen = 1;
-                i++;
-            } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
-                i++;
-            }
-            if (getLongLongFromObjectOrReply(c,c->argv[i+1],&maxlen,NULL)
-                != C_OK) return;
-
-            if (maxlen < 0) {
-                addReplyError(c,"The MAXLEN argument must be >= 0.");
-                return;
-            }
-            i++;
-            maxlen_arg_idx = i;
+        } else if ((!strcasecmp(opt,"maxlen") || !strcasecmp(opt,"minid")) &&
+                   moreargs)
+        {
+            int is_maxlen = !strcasecmp(opt,"maxlen");
+            if (streamParseTrimArgsOrReply(c,&i,is_maxlen,&maxlen,&minid,
+                &approx_trim,&trim_strategy) != C_OK) return;
+            trim_arg_idx = i;
+        } else if (!strcasecmp(opt,"entries") && moreargs) {
+            xaddEntriesCommand(c,i,trim_strategy,maxlen,&minid,approx_trim,
+                               trim_arg_idx);
+            return;
         } else {
             /* If we are here is a syntax error or a valid ID. */
             if (streamParseStrictIDOrReply(c,c->argv[i],&id,0) != C_OK) return;
@@ -1235,13 +1984,8 @@ void xaddCommand(client *c) {
     notifyKeyspaceEvent(NOTIFY_STREAM,"xadd",c->argv[1],c->db->id);
     server.dirty++;
 
-    if (maxlen >= 0) {
-        /* Notify xtrim event if needed. */
-        if (streamTrimByLength(s,maxlen,approx_maxlen)) {
-            notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->argv[1],c->db->id);
-        }
-        if (approx_maxlen) streamRewriteApproxMaxlen(c,s,maxlen_arg_idx);
-    }
+    if (trim_strategy != TRIM_STRATEGY_NONE)
+        xaddTrim(c,s,trim_strategy,maxlen,&minid,approx_trim,trim_arg_idx);
 
     /* Let's rewrite the ID argument with the one actually generated for
      * AOF/replication propagation. */
@@ -1546,8 +2290,6 @@ void xreadCommand(client *c) {
             addReplyNullArray(c);
             goto cleanup;
         }
-        blockForKeys(c, BLOCKED_STREAM, c->argv+streams_arg, streams_count,
-                     timeout, NULL, ids);
         /* If no COUNT is given and we block, set a relatively small count:
          * in case the ID provided is too low, we do not want the server to
          * block just to serve this client a huge stream of messages. */
@@ -1556,7 +2298,8 @@ void xreadCommand(client *c) {
         /* If this is a XREADGROUP + GROUP we need to remember for which
          * group and consumer name we are blocking, so later when one of the
          * keys receive more data, we can call streamReplyWithRange() passing
-         * the right arguments. */
+         * the right arguments. This must be done before blocking, since the
+         * blocked clients are indexed by group. */
         if (groupname) {
             incrRefCount(groupname);
             incrRefCount(consumername);
@@ -1567,6 +2310,8 @@ void xreadCommand(client *c) {
             c->bpop.xread_group = NULL;
             c->bpop.xread_consumer = NULL;
         }
+        blockForKeys(c, BLOCKED_STREAM, c->argv+streams_arg, streams_count,
+                     timeout, NULL, ids);
         goto cleanup;
     }
 
@@ -1604,6 +2349,40 @@ void streamFreeNACK(streamNACK *na) {
     zfree(na);
 }
 
+/* Encode in 'buf' the key of the NACK of the entry 'rawid' (a big endian
+ * ID) in the 'pel_by_time' index of the consumer group. */
+static void streamEncodeNACKIndexKey(unsigned char *buf, unsigned char *rawid,
+                                     streamNACK *nack)
+{
+    uint64_t t = htonu64((uint64_t)nack->delivery_time);
+    memcpy(buf,&t,sizeof(t));
+    memcpy(buf+sizeof(t),rawid,sizeof(streamID));
+}
+
+/* Add the NACK of the entry 'rawid', already in the PEL of the consumer
+ * group 'cg', to the index by delivery time. */
+void streamIndexNACK(streamCG *cg, unsigned char *rawid, streamNACK *nack) {
+    unsigned char key[sizeof(uint64_t)+sizeof(streamID)];
+    streamEncodeNACKIndexKey(key,rawid,nack);
+    raxInsert(cg->pel_by_time,key,sizeof(key),NULL,NULL);
+}
+
+/* Remove the NACK of the entry 'rawid' from the index by delivery time. */
+void streamUnindexNACK(streamCG *cg, unsigned char *rawid, streamNACK *nack) {
+    unsigned char key[sizeof(uint64_t)+sizeof(streamID)];
+    streamEncodeNACKIndexKey(key,rawid,nack);
+    raxRemove(cg->pel_by_time,key,sizeof(key),NULL);
+}
+
+/* Change the delivery time of a NACK, keeping the index updated. */
+static void streamSetDeliveryTime(streamCG *cg, unsigned char *rawid,
+                                  streamNACK *nack, mstime_t t)
+{
+    streamUnindexNACK(cg,rawid,nack);
+    nack->delivery_time = t;
+    streamIndexNACK(cg,rawid,nack);
+}
+
 /* Free a consumer and associated data structures. Note that this function
  * will not reassign the pending messages associated with this consumer
  * nor will delete them from the stream, so when this function is called
@@ -1617,18 +2396,20 @@ void streamFreeConsumer(streamConsumer *sc) {
 }
 
 /* Create a new consumer group in the context of the stream 's', having the
- * specified name and last server ID. If a consumer group with the same name
- * already existed NULL is returned, otherwise the pointer to the consumer
- * group is returned. */
-streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
+ * specified name, last server ID and reads counter. If a consumer group with
+ * the same name already existed NULL is returned, otherwise the pointer to the
+ * consumer group is returned. */
+streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id, long long entries_read) {
     if (s->cgroups == NULL) s->cgroups = raxNew();
     if (raxFind(s->cgroups,(unsigned char*)name,namelen) != raxNotFound)
         return NULL;
 
     streamCG *cg = zmalloc(sizeof(*cg));
     cg->pel = raxNew();
+    cg->pel_by_time = raxNew();
     cg->consumers = raxNew();
     cg->last_id = *id;
+    cg->entries_read = entries_read;
     raxInsert(s->cgroups,(unsigned char*)name,namelen,cg,NULL);
     return cg;
 }
@@ -1636,6 +2417,7 @@ streamCG *streamCreateCG(stream *s, char *name, size_t namelen, streamID *id) {
 /* Free a consumer group and all its associated data. */
 void streamFreeCG(streamCG *cg) {
     raxFreeWithCallback(cg->pel,(void(*)(void*))streamFreeNACK);
+    raxFree(cg->pel_by_time);
     raxFreeWithCallback(cg->consumers,(void(*)(void*))streamFreeConsumer);
     zfree(cg);
 }
@@ -1685,6 +2467,7 @@ uint64_t streamDelConsumer(streamCG *cg, sds name) {
     while(raxNext(&ri)) {
         streamNACK *nack = ri.data;
         raxRemove(cg->pel,ri.key,ri.key_len,NULL);
+        streamUnindexNACK(cg,ri.key,nack);
         streamFreeNACK(nack);
     }
     raxStop(&ri);
@@ -1699,15 +2482,16 @@ uint64_t streamDelConsumer(streamCG *cg, sds name) {
  * Consumer groups commands
  * ----------------------------------------------------------------------- */
 
-/* XGROUP CREATE <key> <groupname> <id or $> [MKSTREAM]
- * XGROUP SETID <key> <groupname> <id or $>
+/* XGROUP CREATE <key> <groupname> <id or $> [MKSTREAM] [ENTRIESREAD <n>]
+ * XGROUP SETID <key> <groupname> <id or $> [ENTRIESREAD <n>]
  * XGROUP DESTROY <key> <groupname>
  * XGROUP DELCONSUMER <key> <groupname> <consumername> */
 void xgroupCommand(client *c) {
     const char *help[] = {
 "CREATE      <key> <groupname> <id or $> [opt] -- Create a new consumer group.",
 "            option MKSTREAM: create the empty stream if it does not exist.",
-"SETID       <key> <groupname> <id or $>  -- Set the current group ID.",
+"            option ENTRIESREAD <n>: set the group entries read counter.",
+"SETID       <key> <groupname> <id or $> [ENTRIESREAD <n>] -- Set the current group ID.",
 "DESTROY     <key> <groupname>            -- Remove the specified group.",
 "DELCONSUMER <key> <groupname> <consumer> -- Remove the specified consumer.",
 "HELP                                     -- Prints this help.",
@@ -1718,16 +2502,34 @@ NULL
     streamCG *cg = NULL;
     char *opt = c->argv[1]->ptr; /* Subcommand name. */
     int mkstream = 0;
+    long long entries_read = SCG_INVALID_ENTRIES_READ;
     robj *o;
 
     /* CREATE has an MKSTREAM option that creates the stream if it
-     * does not exist. */
-    if (c->argc == 6 && !strcasecmp(opt,"CREATE")) {
-        if (strcasecmp(c->argv[5]->ptr,"MKSTREAM")) {
-            addReplySubcommandSyntaxError(c);
-            return;
+     * does not exist, CREATE and SETID an ENTRIESREAD option to set the
+     * reads counter of the group. */
+    int create = !strcasecmp(opt,"CREATE"), setid = !strcasecmp(opt,"SETID");
+    if (c->argc > 5 && (create || setid)) {
+        for (int j = 5; j < c->argc; j++) {
+            if (create && !strcasecmp(c->argv[j]->ptr,"MKSTREAM")) {
+                mkstream = 1;
+            } else if (!strcasecmp(c->argv[j]->ptr,"ENTRIESREAD") &&
+                       j+1 < c->argc)
+            {
+                if (getLongLongFromObjectOrReply(c,c->argv[++j],
+                    &entries_read,NULL) != C_OK) return;
+                if (entries_read < 0 &&
+                    entries_read != SCG_INVALID_ENTRIES_READ)
+                {
+                    addReplyError(c,"value for ENTRIESREAD must be "
+                                    "positive or -1");
+                    return;
+                }
+            } else {
+                addReplySubcommandSyntaxError(c);
+                return;
+            }
         }
-        mkstream = 1;
         grpname = c->argv[3]->ptr;
     }
 
@@ -1765,17 +2567,22 @@ NULL
     }
 
     /* Dispatch the different subcommands. */
-    if (!strcasecmp(opt,"CREATE") && (c->argc == 5 || c->argc == 6)) {
+    if (create && c->argc >= 5) {
         streamID id;
+        int explicit_entries_read = entries_read != SCG_INVALID_ENTRIES_READ;
         if (!strcmp(c->argv[4]->ptr,"$")) {
             if (s) {
                 id = s->last_id;
+                if (!explicit_entries_read) entries_read = s->entries_added;
             } else {
                 id.ms = 0;
                 id.seq = 0;
+                if (!explicit_entries_read) entries_read = 0;
             }
         } else if (streamParseStrictIDOrReply(c,c->argv[4],&id,0) != C_OK) {
             return;
+        } else if (s && !explicit_entries_read) {
+            entries_read = streamEstimateDistanceFromFirstEverEntry(s,&id);
         }
 
         /* Handle the MKSTREAM option now that the command can no longer fail. */
@@ -1786,7 +2593,8 @@ NULL
             s = o->ptr;
         }
 
-        streamCG *cg = streamCreateCG(s,grpname,sdslen(grpname),&id);
+        streamCG *cg = streamCreateCG(s,grpname,sdslen(grpname),&id,
+                                      entries_read);
         if (cg) {
             addReply(c,shared.ok);
             server.dirty++;
@@ -1796,14 +2604,19 @@ NULL
             addReplySds(c,
                 sdsnew("-BUSYGROUP Consumer Group name already exists\r\n"));
         }
-    } else if (!strcasecmp(opt,"SETID") && c->argc == 5) {
+    } else if (setid && c->argc >= 5) {
         streamID id;
+        int explicit_entries_read = entries_read != SCG_INVALID_ENTRIES_READ;
         if (!strcmp(c->argv[4]->ptr,"$")) {
             id = s->last_id;
+            if (!explicit_entries_read) entries_read = s->entries_added;
         } else if (streamParseIDOrReply(c,c->argv[4],&id,0) != C_OK) {
             return;
+        } else if (!explicit_entries_read) {
+            entries_read = streamEstimateDistanceFromFirstEverEntry(s,&id);
         }
         cg->last_id = id;
+        cg->entries_read = entries_read;
         addReply(c,shared.ok);
         server.dirty++;
         notifyKeyspaceEvent(NOTIFY_STREAM,"xgroup-setid",c->argv[2],c->db->id);
@@ -1833,10 +2646,36 @@ NULL
     }
 }
 
-/* XSETID <stream> <groupname> <id>
+/* XSETID <stream> <id> [ENTRIESADDED <entries_added>] [MAXDELETEDID <id>]
  *
- * Set the internal "last ID" of a stream. */
+ * Set the internal "last ID", and optionally the counter of the entries ever
+ * added and the maximal deleted entry ID, of a stream. The options are used
+ * by the AOF rewrite to restore the counters that drive the consumer groups
+ * lag. */
 void xsetidCommand(client *c) {
+    streamID max_xdel_id = {0, 0};
+    long long entries_added = -1;
+    int max_xdel_id_given = 0;
+
+    for (int j = 3; j < c->argc; j++) {
+        int moreargs = j+1 < c->argc;
+        if (!strcasecmp(c->argv[j]->ptr,"ENTRIESADDED") && moreargs) {
+            if (getLongLongFromObjectOrReply(c,c->argv[++j],&entries_added,
+                NULL) != C_OK) return;
+            if (entries_added < 0) {
+                addReplyError(c,"entries_added must be positive");
+                return;
+            }
+        } else if (!strcasecmp(c->argv[j]->ptr,"MAXDELETEDID") && moreargs) {
+            if (streamParseStrictIDOrReply(c,c->argv[++j],&max_xdel_id,0)
+                != C_OK) return;
+            max_xdel_id_given = 1;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
     robj *o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr);
     if (o == NULL || checkType(c,o,OBJ_STREAM)) return;
 
@@ -1844,6 +2683,17 @@ void xsetidCommand(client *c) {
     streamID id;
     if (streamParseStrictIDOrReply(c,c->argv[2],&id,0) != C_OK) return;
 
+    if (streamCompareID(&id,&max_xdel_id) < 0) {
+        addReplyError(c,"The ID specified in XSETID is smaller than the "
+                        "provided max_deleted_entry_id");
+        return;
+    }
+    if (entries_added != -1 && s->length > (uint64_t)entries_added) {
+        addReplyError(c,"The entries_added specified in XSETID is smaller "
+                        "than the target stream length");
+        return;
+    }
+
     /* If the stream has at least one item, we want to check that the user
      * is setting a last ID that is equal or greater than the current top
      * item, otherwise the fundamental ID monotonicity assumption is violated. */
@@ -1862,16 +2712,55 @@ void xsetidCommand(client *c) {
         }
     }
     s->last_id = id;
+    if (entries_added != -1) s->entries_added = entries_added;
+    if (max_xdel_id_given) s->max_deleted_entry_id = max_xdel_id;
     addReply(c,shared.ok);
     server.dirty++;
     notifyKeyspaceEvent(NOTIFY_STREAM,"xsetid",c->argv[1],c->db->id);
 }
 
+/* Remove from the PEL of the group, and of its consumer, the NACK with
+ * the encoded ID 'buf'. */
+static void streamAckNACK(streamCG *group, unsigned char *buf, streamNACK *nack) {
+    raxRemove(group->pel,buf,sizeof(streamID),NULL);
+    raxRemove(nack->consumer->pel,buf,sizeof(streamID),NULL);
+    streamUnindexNACK(group,buf,nack);
+    streamFreeNACK(nack);
+}
+
+/* Acknowledge all the entries of the group PEL with IDs between 'start'
+ * and 'end' inclusive, in a single scan of the PEL starting at 'start'.
+ * Returns the number of acknowledged entries. */
+static long long streamAckRange(streamCG *group, streamID *start, streamID *end) {
+    unsigned char startkey[sizeof(streamID)], endkey[sizeof(streamID)];
+    long long acknowledged = 0;
+    raxIterator ri;
+
+    streamEncodeID(startkey,start);
+    streamEncodeID(endkey,end);
+    raxStart(&ri,group->pel);
+    raxSeek(&ri,">=",startkey,sizeof(startkey));
+    while(raxNext(&ri) && memcmp(ri.key,endkey,ri.key_len) <= 0) {
+        unsigned char buf[sizeof(streamID)];
+        memcpy(buf,ri.key,sizeof(buf));
+        streamAckNACK(group,buf,ri.data);
+        acknowledged++;
+        /* The removal invalidates the iterator: seek again. */
+        raxSeek(&ri,">",buf,sizeof(buf));
+    }
+    raxStop(&ri);
+    return acknowledged;
+}
+
 /* XACK <key> <group> <id> <id> ... <id>
+ * XACK <key> <group> [<id> ...] RANGE <start> <end> [RANGE <start> <end> ...]
  *
  * Acknowledge a message as processed. In practical terms we just check the
  * pendine entries list (PEL) of the group, and delete the PEL entry both from
  * the group and the consumer (pending messages are referenced in both places).
+ * With RANGE all the pending entries between the two IDs are acknowledged
+ * scanning the PEL once, so that a consumer processing its entries in order
+ * can acknowledge a whole batch with a few arguments.
  *
  * Return value of the command is the number of messages successfully
  * acknowledged, that is, the IDs we were actually able to resolve in the PEL.
@@ -1890,11 +2779,37 @@ void xackCommand(client *c) {
         return;
     }
 
-    int acknowledged = 0;
+    /* Check all the arguments before acknowledging anything. */
+    streamID id, end;
+    for (int j = 3; j < c->argc; j++) {
+        if (!strcasecmp(c->argv[j]->ptr,"RANGE")) {
+            if (j+2 >= c->argc) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            if (streamParseIDOrReply(c,c->argv[j+1],&id,0) != C_OK ||
+                streamParseIDOrReply(c,c->argv[j+2],&end,UINT64_MAX) != C_OK)
+                return;
+            j += 2;
+        } else if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK) {
+            return;
+        }
+    }
+
+    long long acknowledged = 0;
     for (int j = 3; j < c->argc; j++) {
-        streamID id;
         unsigned char buf[sizeof(streamID)];
-        if (streamParseStrictIDOrReply(c,c->argv[j],&id,0) != C_OK) return;
+
+        if (!strcasecmp(c->argv[j]->ptr,"RANGE")) {
+            streamParseIDOrReply(c,c->argv[j+1],&id,0);
+            streamParseIDOrReply(c,c->argv[j+2],&end,UINT64_MAX);
+            j += 2;
+            if (streamCompareID(&id,&end) <= 0)
+                acknowledged += streamAckRange(group,&id,&end);
+            continue;
+        }
+
+        streamParseStrictIDOrReply(c,c->argv[j],&id,0); /* Already checked. */
         streamEncodeID(buf,&id);
 
         /* Lookup the ID in the group PEL: it will have a reference to the
@@ -1902,13 +2817,11 @@ void xackCommand(client *c) {
          * we are able to remove the entry from both PELs. */
         streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
         if (nack != raxNotFound) {
-            raxRemove(group->pel,buf,sizeof(buf),NULL);
-            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
-            streamFreeNACK(nack);
+            streamAckNACK(group,buf,nack);
             acknowledged++;
-            server.dirty++;
         }
     }
+    server.dirty += acknowledged;
     addReplyLongLong(c,acknowledged);
 }
 
@@ -2204,6 +3117,8 @@ void xclaimCommand(client *c) {
 
     if (streamCompareID(&last_id,&group->last_id) > 0) {
         group->last_id = last_id;
+        group->entries_read =
+            streamEstimateDistanceFromFirstEverEntry(o->ptr,&last_id);
         propagate_last_id = 1;
     }
 
@@ -2257,6 +3172,7 @@ void xclaimCommand(client *c) {
             /* Create the NACK. */
             nack = streamCreateNACK(NULL);
             raxInsert(group->pel,buf,sizeof(buf),nack,NULL);
+            streamIndexNACK(group,buf,nack);
         }
 
         if (nack != raxNotFound) {
@@ -2277,7 +3193,7 @@ void xclaimCommand(client *c) {
                 raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
             /* Update the consumer and idle time. */
             nack->consumer = consumer;
-            nack->delivery_time = deliverytime;
+            streamSetDeliveryTime(group,buf,nack,deliverytime);
             /* Set the delivery attempts counter if given, otherwise 
              * autoincrement unless JUSTID option provided */
             if (retrycount >= 0) {
@@ -2311,6 +3227,109 @@ void xclaimCommand(client *c) {
     preventCommandPropagation(c);
 }
 
+/* XAUTOCLAIM <key> <group> <consumer> <min-idle-time> [COUNT <count>]
+ *            [JUSTID]
+ *
+ * Claim for the consumer up to 'count' (100 by default) pending messages
+ * idle for at least 'min-idle-time' milliseconds, the ones idle for the
+ * longest time first, as XCLAIM would do. The messages are found using the
+ * index of the PEL by delivery time, so the cost depends on the number of
+ * messages claimed, not on the size of the PEL: a reclaimer can call the
+ * command till it returns less than 'count' messages. */
+void xautoclaimCommand(client *c) {
+    streamCG *group = NULL;
+    robj *o = lookupKeyRead(c->db,c->argv[1]);
+    long long minidle, count = 100;
+    int justid = 0, j;
+
+    if (o) {
+        if (checkType(c,o,OBJ_STREAM)) return; /* Type error. */
+        group = streamLookupCG(o->ptr,c->argv[2]->ptr);
+    }
+
+    if (o == NULL || group == NULL) {
+        addReplyErrorFormat(c,"-NOGROUP No such key '%s' or "
+                              "consumer group '%s'", (char*)c->argv[1]->ptr,
+                              (char*)c->argv[2]->ptr);
+        return;
+    }
+
+    if (getLongLongFromObjectOrReply(c,c->argv[4],&minidle,
+        "Invalid min-idle-time argument for XAUTOCLAIM")
+        != C_OK) return;
+    if (minidle < 0) minidle = 0;
+
+    for (j = 5; j < c->argc; j++) {
+        int moreargs = (c->argc-1) - j;
+        char *opt = c->argv[j]->ptr;
+        if (!strcasecmp(opt,"COUNT") && moreargs) {
+            j++;
+            if (getLongLongFromObjectOrReply(c,c->argv[j],&count,NULL)
+                != C_OK) return;
+            if (count < 1 || count > LONG_MAX/2) {
+                addReplyError(c,"COUNT must be > 0");
+                return;
+            }
+        } else if (!strcasecmp(opt,"JUSTID")) {
+            justid = 1;
+        } else {
+            addReplyErrorFormat(c,"Unrecognized XAUTOCLAIM option '%s'",opt);
+            return;
+        }
+    }
+
+    /* Collect the IDs first, since claiming them changes the index. */
+    mstime_t now = mstime();
+    streamID *ids = zmalloc(sizeof(streamID)*(count < 1024 ? count : 1024));
+    long long numids = 0, allocated = count < 1024 ? count : 1024;
+    raxIterator ri;
+    raxStart(&ri,group->pel_by_time);
+    raxSeek(&ri,"^",NULL,0);
+    while (numids < count && raxNext(&ri)) {
+        uint64_t t;
+        memcpy(&t,ri.key,sizeof(t));
+        if (now - (mstime_t)ntohu64(t) < minidle) break;
+        if (numids == allocated) {
+            allocated *= 2;
+            ids = zrealloc(ids,sizeof(streamID)*allocated);
+        }
+        streamDecodeID(ri.key+sizeof(t),&ids[numids++]);
+    }
+    raxStop(&ri);
+
+    streamConsumer *consumer = streamLookupConsumer(group,c->argv[3]->ptr,1);
+    addReplyArrayLen(c,numids);
+    for (j = 0; j < numids; j++) {
+        unsigned char buf[sizeof(streamID)];
+        streamEncodeID(buf,&ids[j]);
+        streamNACK *nack = raxFind(group->pel,buf,sizeof(buf));
+        serverAssert(nack != raxNotFound);
+
+        /* Move the entry to the new consumer, like XCLAIM does. */
+        if (nack->consumer)
+            raxRemove(nack->consumer->pel,buf,sizeof(buf),NULL);
+        nack->consumer = consumer;
+        streamSetDeliveryTime(group,buf,nack,now);
+        if (!justid) nack->delivery_count++;
+        raxInsert(consumer->pel,buf,sizeof(buf),nack,NULL);
+
+        if (justid) {
+            addReplyStreamID(c,&ids[j]);
+        } else {
+            size_t emitted = streamReplyWithRange(c,o->ptr,&ids[j],&ids[j],1,0,
+                                NULL,NULL,STREAM_RWR_RAWENTRIES,NULL);
+            if (!emitted) addReplyNull(c);
+        }
+
+        robj *idarg = createObjectFromStreamID(&ids[j]);
+        streamPropagateXCLAIM(c,c->argv[1],group,c->argv[2],idarg,nack);
+        decrRefCount(idarg);
+        server.dirty++;
+    }
+    zfree(ids);
+    preventCommandPropagation(c);
+}
+
 
 /* XDEL <key> [<ID1> <ID2> ... <IDN>]
  *
@@ -2334,11 +3353,22 @@ void xdelCommand(client *c) {
 
     /* Actually apply the command. */
     int deleted = 0;
+    int first_entry = 0;
     for (int j = 2; j < c->argc; j++) {
         streamParseStrictIDOrReply(c,c->argv[j],&id,0); /* Retval already checked. */
-        deleted += streamDeleteItem(s,&id);
+        if (streamDeleteItem(s,&id)) {
+            /* Update the stream's first ID if we deleted the first entry,
+             * and the max deleted ID the groups lag depends on. */
+            if (streamCompareID(&id,&s->first_id) == 0) first_entry = 1;
+            if (streamCompareID(&id,&s->max_deleted_entry_id) > 0)
+                s->max_deleted_entry_id = id;
+            deleted++;
+        }
     }
 
+    /* Update the stream's first ID. */
+    if (deleted && first_entry) streamUpdateFirstID(s);
+
     /* Propagate the write if needed. */
     if (deleted) {
         signalModifiedKey(c->db,c->argv[1]);
@@ -2356,10 +3386,11 @@ void xdelCommand(client *c) {
  *                             the specified length. Use ~ before the
  *                             count in order to demand approximated trimming
  *                             (like XADD MAXLEN option).
+ * MINID [~|=] <id>         -- Trim the entries with an ID smaller than the
+ *                             specified one, that may also be just an unix
+ *                             time in milliseconds. Use ~ to only release
+ *                             whole nodes of the stream.
  */
-
-#define TRIM_STRATEGY_NONE 0
-#define TRIM_STRATEGY_MAXLEN 1
 void xtrimCommand(client *c) {
     robj *o;
 
@@ -2372,35 +3403,24 @@ void xtrimCommand(client *c) {
     /* Argument parsing. */
     int trim_strategy = TRIM_STRATEGY_NONE;
     long long maxlen = -1;  /* If left to -1 no trimming is performed. */
-    int approx_maxlen = 0;  /* If 1 only delete whole radix tree nodes, so
-                               the maxium length is not applied verbatim. */
-    int maxlen_arg_idx = 0; /* Index of the count in MAXLEN, for rewriting. */
+    streamID minid;         /* Entries smaller than this ID are trimmed. */
+    int approx_trim = 0;    /* If 1 only delete whole radix tree nodes, so
+                               the trimming is not applied verbatim. */
+    int trim_arg_idx = 0;   /* Index of the MAXLEN/MINID argument, for
+                               rewriting. */
 
     /* Parse options. */
     int i = 2; /* Start of options. */
     for (; i < c->argc; i++) {
         int moreargs = (c->argc-1) - i; /* Number of additional arguments. */
         char *opt = c->argv[i]->ptr;
-        if (!strcasecmp(opt,"maxlen") && moreargs) {
-            approx_maxlen = 0;
-            trim_strategy = TRIM_STRATEGY_MAXLEN;
-            char *next = c->argv[i+1]->ptr;
-            /* Check for the form MAXLEN ~ <count>. */
-            if (moreargs >= 2 && next[0] == '~' && next[1] == '\0') {
-                approx_maxlen = 1;
-                i++;
-            } else if (moreargs >= 2 && next[0] == '=' && next[1] == '\0') {
-                i++;
-            }
-            if (getLongLongFromObjectOrReply(c,c->argv[i+1],&maxlen,NULL)
-                != C_OK) return;
-
-            if (maxlen < 0) {
-                addReplyError(c,"The MAXLEN argument must be >= 0.");
-                return;
-            }
-            i++;
-            maxlen_arg_idx = i;
+        if ((!strcasecmp(opt,"maxlen") || !strcasecmp(opt,"minid")) &&
+            moreargs)
+        {
+            int is_maxlen = !strcasecmp(opt,"maxlen");
+            if (streamParseTrimArgsOrReply(c,&i,is_maxlen,&maxlen,&minid,
+                &approx_trim,&trim_strategy) != C_OK) return;
+            trim_arg_idx = i;
         } else {
             addReply(c,shared.syntaxerr);
             return;
@@ -2410,7 +3430,9 @@ void xtrimCommand(client *c) {
     /* Perform the trimming. */
     int64_t deleted = 0;
     if (trim_strategy == TRIM_STRATEGY_MAXLEN) {
-        deleted = streamTrimByLength(s,maxlen,approx_maxlen);
+        deleted = streamTrimByLength(s,maxlen,approx_trim);
+    } else if (trim_strategy == TRIM_STRATEGY_MINID) {
+        deleted = streamTrimByID(s,&minid,approx_trim);
     } else {
         addReplyError(c,"XTRIM called without an option to trim the stream");
         return;
@@ -2421,7 +3443,12 @@ void xtrimCommand(client *c) {
         signalModifiedKey(c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STREAM,"xtrim",c->argv[1],c->db->id);
         server.dirty += deleted;
-        if (approx_maxlen) streamRewriteApproxMaxlen(c,s,maxlen_arg_idx);
+        if (approx_trim) {
+            if (trim_strategy == TRIM_STRATEGY_MAXLEN)
+                streamRewriteApproxMaxlen(c,s,trim_arg_idx);
+            else
+                streamRewriteApproxMinid(c,s,trim_arg_idx);
+        }
     }
     addReplyLongLong(c,deleted);
 }
@@ -2504,7 +3531,7 @@ NULL
         raxSeek(&ri,"^",NULL,0);
         while(raxNext(&ri)) {
             streamCG *cg = ri.data;
-            addReplyMapLen(c,4);
+            addReplyMapLen(c,6);
             addReplyBulkCString(c,"name");
             addReplyBulkCBuffer(c,ri.key,ri.key_len);
             addReplyBulkCString(c,"consumers");
@@ -2513,11 +3540,19 @@ NULL
             addReplyLongLong(c,raxSize(cg->pel));
             addReplyBulkCString(c,"last-delivered-id");
             addReplyStreamID(c,&cg->last_id);
+            addReplyBulkCString(c,"entries-read");
+            if (cg->entries_read != SCG_INVALID_ENTRIES_READ) {
+                addReplyLongLong(c,cg->entries_read);
+            } else {
+                addReplyNull(c);
+            }
+            addReplyBulkCString(c,"lag");
+            streamReplyWithCGLag(c,s,cg);
         }
         raxStop(&ri);
     } else if (!strcasecmp(opt,"STREAM") && c->argc == 3) {
         /* XINFO STREAM <key> (or the alias XINFO <key>). */
-        addReplyMapLen(c,7);
+        addReplyMapLen(c,10);
         addReplyBulkCString(c,"length");
         addReplyLongLong(c,s->length);
         addReplyBulkCString(c,"radix-tree-keys");
@@ -2528,6 +3563,12 @@ NULL
         addReplyLongLong(c,s->cgroups ? raxSize(s->cgroups) : 0);
         addReplyBulkCString(c,"last-generated-id");
         addReplyStreamID(c,&s->last_id);
+        addReplyBulkCString(c,"max-deleted-entry-id");
+        addReplyStreamID(c,&s->max_deleted_entry_id);
+        addReplyBulkCString(c,"entries-added");
+        addReplyLongLong(c,s->entries_added);
+        addReplyBulkCString(c,"recorded-first-entry-id");
+        addReplyStreamID(c,&s->first_id);
 
         /* To emit the first/last entry we us the streamReplyWithRange()
          * API. */
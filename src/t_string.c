@@ -257,6 +257,8 @@ void getrangeCommand(client *c) {
     if (o->encoding == OBJ_ENCODING_INT) {
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_COMPRESSED) {
+        str = stringDecompressToScratch(o,&strlen);
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -287,6 +289,8 @@ void mgetCommand(client *c) {
 
     addReplyArrayLen(c,c->argc-1);
     for (j = 1; j < c->argc; j++) {
+        if ((j-1) % LOOKUP_PREFETCH_BATCH == 0 && c->argc > 2)
+            lookupKeysPrefetch(c->db,c->argv+j,c->argc-j,1);
         robj *o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) {
             addReplyNull(c);
@@ -312,6 +316,8 @@ void msetGenericCommand(client *c, int nx) {
      * set anything if at least one key alerady exists. */
     if (nx) {
         for (j = 1; j < c->argc; j += 2) {
+            if ((j-1) % (LOOKUP_PREFETCH_BATCH*2) == 0 && c->argc > 3)
+                lookupKeysPrefetch(c->db,c->argv+j,(c->argc-j)/2,2);
             if (lookupKeyWrite(c->db,c->argv[j]) != NULL) {
                 addReply(c, shared.czero);
                 return;
@@ -320,6 +326,8 @@ void msetGenericCommand(client *c, int nx) {
     }
 
     for (j = 1; j < c->argc; j += 2) {
+        if (!nx && (j-1) % (LOOKUP_PREFETCH_BATCH*2) == 0 && c->argc > 3)
+            lookupKeysPrefetch(c->db,c->argv+j,(c->argc-j)/2,2);
         c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         setKey(c->db,c->argv[j],c->argv[j+1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",c->argv[j],c->db->id);
@@ -336,13 +344,32 @@ void msetnxCommand(client *c) {
     msetGenericCommand(c,1);
 }
 
+/* Return 1 if INCR and friends can modify the integer object 'o' in place
+ * to store 'value'. The values in the shared integers range are stored as
+ * shared objects when the maxmemory policy permits, like
+ * createStringObjectFromLongLongForValue() does, otherwise a counter object
+ * is never reallocated. */
+static int incrCanUpdateInPlace(robj *o, long long value) {
+    if (o == NULL || o->refcount != 1 || o->encoding != OBJ_ENCODING_INT ||
+        value < LONG_MIN || value > LONG_MAX) return 0;
+    if (value >= 0 && value < server.shared_integers &&
+        (server.maxmemory == 0 ||
+         !(server.maxmemory_policy & MAXMEMORY_FLAG_NO_SHARED_INTEGERS)))
+        return 0;
+    return 1;
+}
+
 void incrDecrCommand(client *c, long long incr) {
     long long value, oldvalue;
     robj *o, *new;
 
     o = lookupKeyWrite(c->db,c->argv[1]);
     if (o != NULL && checkType(c,o,OBJ_STRING)) return;
-    if (getLongLongFromObjectOrReply(c,o,&value,NULL) != C_OK) return;
+    if (o != NULL && o->encoding == OBJ_ENCODING_INT) {
+        value = (long)o->ptr;
+    } else if (getLongLongFromObjectOrReply(c,o,&value,NULL) != C_OK) {
+        return;
+    }
 
     oldvalue = value;
     if ((incr < 0 && oldvalue < 0 && incr < (LLONG_MIN-oldvalue)) ||
@@ -352,11 +379,7 @@ void incrDecrCommand(client *c, long long incr) {
     }
     value += incr;
 
-    if (o && o->refcount == 1 && o->encoding == OBJ_ENCODING_INT &&
-        (value < 0 || value >= OBJ_SHARED_INTEGERS) &&
-        value >= LONG_MIN && value <= LONG_MAX)
-    {
-        new = o;
+    if (incrCanUpdateInPlace(o,value)) {
         o->ptr = (void*)((long)value);
     } else {
         new = createStringObjectFromLongLongForValue(value);
@@ -369,9 +392,7 @@ void incrDecrCommand(client *c, long long incr) {
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"incrby",c->argv[1],c->db->id);
     server.dirty++;
-    addReply(c,shared.colon);
-    addReply(c,new);
-    addReply(c,shared.crlf);
+    addReplyLongLong(c,value);
 }
 
 void incrCommand(client *c) {
@@ -396,26 +417,64 @@ void decrbyCommand(client *c) {
     incrDecrCommand(c,-incr);
 }
 
+/* INCRBYFLOAT of an integer by an integer: the result is an integer, and
+ * the long double formatting would print it as it is. The results are kept
+ * within the range of the integers a double represents exactly, so that
+ * they don't depend on the precision of the long double. */
+#define INCRBYFLOAT_MAX_EXACT (1LL<<53)
+
+/* Store in '*ll' the integer value of the string object 'o', 0 if it is
+ * NULL. Returns 0 if it is not an integer. */
+static int incrbyfloatGetInteger(robj *o, long long *ll) {
+    if (o == NULL) {
+        *ll = 0;
+        return 1;
+    } else if (o->encoding == OBJ_ENCODING_INT) {
+        *ll = (long)o->ptr;
+        return 1;
+    }
+    return string2ll(o->ptr,sdslen(o->ptr),ll);
+}
+
 void incrbyfloatCommand(client *c) {
     long double incr, value;
+    long long llvalue, llincr;
     robj *o, *new, *aux;
 
     o = lookupKeyWrite(c->db,c->argv[1]);
     if (o != NULL && checkType(c,o,OBJ_STRING)) return;
-    if (getLongDoubleFromObjectOrReply(c,o,&value,NULL) != C_OK ||
-        getLongDoubleFromObjectOrReply(c,c->argv[2],&incr,NULL) != C_OK)
-        return;
+    if (incrbyfloatGetInteger(o,&llvalue) &&
+        incrbyfloatGetInteger(c->argv[2],&llincr) &&
+        llvalue > -INCRBYFLOAT_MAX_EXACT && llvalue < INCRBYFLOAT_MAX_EXACT &&
+        llincr > -INCRBYFLOAT_MAX_EXACT && llincr < INCRBYFLOAT_MAX_EXACT &&
+        llvalue+llincr > -INCRBYFLOAT_MAX_EXACT &&
+        llvalue+llincr < INCRBYFLOAT_MAX_EXACT)
+    {
+        llvalue += llincr;
+        if (incrCanUpdateInPlace(o,llvalue)) {
+            o->ptr = (void*)((long)llvalue);
+            new = o;
+        } else {
+            new = createStringObjectFromLongLongForValue(llvalue);
+        }
+    } else {
+        if (getLongDoubleFromObjectOrReply(c,o,&value,NULL) != C_OK ||
+            getLongDoubleFromObjectOrReply(c,c->argv[2],&incr,NULL) != C_OK)
+            return;
 
-    value += incr;
-    if (isnan(value) || isinf(value)) {
-        addReplyError(c,"increment would produce NaN or Infinity");
-        return;
+        value += incr;
+        if (isnan(value) || isinf(value)) {
+            addReplyError(c,"increment would produce NaN or Infinity");
+            return;
+        }
+        new = createStringObjectFromLongDouble(value,1);
+    }
+    if (new != o) {
+        if (o)
+            dbOverwrite(c->db,c->argv[1],new);
+        else
+            dbAdd(c->db,c->argv[1],new);
     }
-    new = createStringObjectFromLongDouble(value,1);
-    if (o)
-        dbOverwrite(c->db,c->argv[1],new);
-    else
-        dbAdd(c->db,c->argv[1],new);
     signalModifiedKey(c->db,c->argv[1]);
     notifyKeyspaceEvent(NOTIFY_STRING,"incrbyfloat",c->argv[1],c->db->id);
     server.dirty++;
@@ -436,8 +495,8 @@ void appendCommand(client *c) {
 
     o = lookupKeyWrite(c->db,c->argv[1]);
     if (o == NULL) {
-        /* Create the key */
-        c->argv[2] = tryObjectEncoding(c->argv[2]);
+        /* Create the key, uncompressed since it is likely to grow. */
+        c->argv[2] = tryObjectEncodingEx(c->argv[2],0);
         dbAdd(c->db,c->argv[1],c->argv[2]);
         incrRefCount(c->argv[2]);
         totlen = stringObjectLen(c->argv[2]);
@@ -41,11 +41,13 @@
  * to Redis objects (so objects are sorted by scores in this "view").
  *
  * Note that the SDS string representing the element is the same in both
- * the hash table and skiplist in order to save memory. What we do in order
- * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
- * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * the hash table and skiplist in order to save memory. The string is
+ * embedded in the skiplist node itself, so that every element takes a
+ * single allocation, and the element compares performed while walking the
+ * skiplist don't need to access another cache line. The string is released
+ * together with the node by zslFreeNode(), and the dictionary has no key
+ * free method set. So we should always remove an element from the
+ * dictionary, and later from the skiplist.
  *
  * This skiplist implementation is almost a C translation of the original
  * algorithm described by William Pugh in "Skip Lists: A Probabilistic
@@ -67,12 +69,14 @@ int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
 /* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
+ * The SDS string 'ele' is copied inside the node, the caller retains the
+ * ownership of the passed string. */
 zskiplistNode *zslCreateNode(int level, double score, sds ele) {
-    zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+    size_t nodesize = sizeof(zskiplistNode)+level*sizeof(struct zskiplistLevel);
+    size_t elesize = ele ? sdsEmbeddedSize(sdslen(ele)) : 0;
+    zskiplistNode *zn = zmalloc(nodesize+elesize);
     zn->score = score;
-    zn->ele = ele;
+    zn->ele = ele ? sdsnewembedded((char*)zn+nodesize,ele,sdslen(ele)) : NULL;
     return zn;
 }
 
@@ -94,11 +98,9 @@ zskiplist *zslCreate(void) {
     return zsl;
 }
 
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
+/* Free the specified skiplist node, together with the SDS string
+ * representation of the element embedded in it. */
 void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
     zfree(node);
 }
 
@@ -126,13 +128,16 @@ int zslRandomLevel(void) {
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
+/* Link the node 'node' of 'level' levels in the skiplist, at the position
+ * of its score and element. If 'level' is zero a random level is picked,
+ * and a new node is created with the passed 'score' and 'ele'. Returns the
+ * linked node. */
+static zskiplistNode *zslInsertNode(zskiplist *zsl, zskiplistNode *node,
+                                    int level, double score, sds ele)
+{
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
+    int i;
 
     serverAssert(!isnan(score));
     x = zsl->header;
@@ -153,7 +158,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
      * scores, reinserting the same element should never happen since the
      * caller of zslInsert() should test in the hash table if the element is
      * already inside or not. */
-    level = zslRandomLevel();
+    if (level == 0) level = zslRandomLevel();
     if (level > zsl->level) {
         for (i = zsl->level; i < level; i++) {
             rank[i] = 0;
@@ -162,7 +167,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
         }
         zsl->level = level;
     }
-    x = zslCreateNode(level,score,ele);
+    x = node ? node : zslCreateNode(level,score,ele);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
@@ -186,13 +191,23 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
     return x;
 }
 
-/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
+/* Insert a new node in the skiplist. Assumes the element does not already
+ * exist (up to the caller to enforce that). The SDS string 'ele' is copied
+ * in the new node, so the caller retains its ownership and should use the
+ * string at node->ele to reference the element from the hash table. */
+zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
+    return zslInsertNode(zsl,NULL,0,score,ele);
+}
+
+/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank.
+ * Returns the number of levels of the unlinked node. */
+int zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
+    int i, level = 0;
     for (i = 0; i < zsl->level; i++) {
         if (update[i]->level[i].forward == x) {
             update[i]->level[i].span += x->level[i].span - 1;
             update[i]->level[i].forward = x->level[i].forward;
+            level++;
         } else {
             update[i]->level[i].span -= 1;
         }
@@ -205,6 +220,7 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
     zsl->length--;
+    return level;
 }
 
 /* Delete an element with matching score/element from the skiplist.
@@ -251,10 +267,12 @@ int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
  *
  * Note that this function attempts to just update the node, in case after
  * the score update, the node would be exactly at the same position.
- * Otherwise the skiplist is modified by removing and re-adding a new
- * element, which is more costly.
+ * Otherwise the node is unlinked and linked again at its new position,
+ * which is more costly.
  *
- * The function returns the updated element skiplist node pointer. */
+ * The function returns the updated element skiplist node pointer, that is
+ * always the original node, so the element string referenced by the hash
+ * table stays valid. */
 zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     int i;
@@ -288,15 +306,11 @@ zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double n
         return x;
     }
 
-    /* No way to reuse the old node: we need to remove and insert a new
-     * one at a different place. */
-    zslDeleteNode(zsl, x, update);
-    zskiplistNode *newnode = zslInsert(zsl,newscore,x->ele);
-    /* We reused the old node x->ele SDS string, free the node now
-     * since zslInsert created a new one. */
-    x->ele = NULL;
-    zslFreeNode(x);
-    return newnode;
+    /* No way to update the node in place: we need to unlink it and link
+     * it again at a different place, with the same number of levels. */
+    int level = zslDeleteNode(zsl, x, update);
+    x->score = newscore;
+    return zslInsertNode(zsl,x,level,newscore,x->ele);
 }
 
 int zslValueGteMin(double value, zrangespec *spec) {
@@ -716,7 +730,7 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -727,7 +741,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -740,14 +754,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -764,7 +778,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(eptr,&vlen,&vlong);
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -778,7 +792,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -787,9 +801,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -806,9 +820,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -830,13 +844,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -848,14 +862,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -867,7 +881,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -876,14 +890,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -896,9 +910,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -907,14 +921,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -930,12 +944,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -946,7 +960,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -960,9 +974,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -971,7 +985,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -986,9 +1000,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -997,32 +1011,31 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
+        if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
             /* Matching element, pull out score. */
             if (score != NULL) *score = zzlGetScore(sptr);
             return eptr;
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
     return NULL;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
@@ -1030,33 +1043,28 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
-
-        /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        /* Insert the element before 'eptr', and the score after the element
+         * just inserted. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1075,7 +1083,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1094,14 +1102,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1122,13 +1130,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr to
+     * NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1145,7 +1153,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1155,7 +1163,7 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
@@ -1172,7 +1180,7 @@ void zsetConvert(robj *zobj, int encoding) {
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1186,35 +1194,42 @@ void zsetConvert(robj *zobj, int encoding) {
         zs->dict = dictCreate(&zsetDictType,NULL);
         zs->zsl = zslCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
+        /* The elements are copied in the skiplist nodes, so the same
+         * string can be reused for all of them. */
+        ele = sdsempty();
         while (eptr != NULL) {
+            char buf[LONG_STR_SIZE];
+
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
-            if (vstr == NULL)
-                ele = sdsfromlonglong(vlong);
-            else
-                ele = sdsnewlen((char*)vstr,vlen);
+            vstr = lpGetValue(eptr,&vlen,&vlong);
+            if (vstr == NULL) {
+                vlen = ll2string(buf,sizeof(buf),vlong);
+                vstr = (unsigned char*)buf;
+            }
+            ele = sdscpylen(ele,(char*)vstr,vlen);
 
             node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            serverAssert(dictAdd(zs->dict,node->ele,&node->score) == DICT_OK);
             zzlNext(zl,&eptr,&sptr);
         }
+        sdsfree(ele);
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
         zobj->encoding = OBJ_ENCODING_SKIPLIST;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
         /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+         * the same time as creating the listpack. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
@@ -1230,22 +1245,77 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already one
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
-        maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+    if (zset->zsl->length <= server.zset_max_listpack_entries &&
+        maxelelen <= server.zset_max_listpack_value)
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
+}
+
+/* Convert the sorted set to the encoding matching the listpack limits, that
+ * may have been changed since it was created, see reencode.c. Return 1 if
+ * the encoding changed. */
+int zsetReencode(robj *zobj) {
+    unsigned long length = zsetLength(zobj);
+    size_t maxelelen = 0;
+
+    if (length <= server.zset_max_listpack_entries) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *zl = zobj->ptr, *eptr = lpSeek(zl,0);
+
+            while (eptr != NULL) {
+                unsigned int len;
+                long long vll;
+                if (!lpGetValue(eptr,&len,&vll)) len = sdigits10(vll);
+                if (len > maxelelen) maxelelen = len;
+                eptr = lpNext(zl,eptr); /* Skip the score. */
+                eptr = lpNext(zl,eptr);
+            }
+        } else {
+            zskiplist *zsl = ((zset*)zobj->ptr)->zsl;
+            zskiplistNode *node = zsl->header->level[0].forward;
+
+            while (node) {
+                if (sdslen(node->ele) > maxelelen)
+                    maxelelen = sdslen(node->ele);
+                node = node->level[0].forward;
+            }
+        }
+    }
+
+    int fits = length <= server.zset_max_listpack_entries &&
+               maxelelen <= server.zset_max_listpack_value;
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK && !fits) {
+        zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST && fits) {
+        zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Prepare the sorted set to hold 'size' elements: it takes its final
+ * encoding, and its dict is expanded at once instead of growing by steps. */
+void zsetReserve(robj *zobj, unsigned long size) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK &&
+        size > server.zset_max_listpack_entries)
+        zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        dict *d = ((zset*)zobj->ptr)->dict;
+        if (!dictIsRehashing(d) && dictSlots(d) < size) dictExpand(d,size);
+    }
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1255,7 +1325,7 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
@@ -1305,7 +1375,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The commad as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+skiplist.
  *
  * Memory managemnet of 'ele':
  *
@@ -1326,7 +1396,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1357,8 +1427,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             /* Optimize: check if the element is too large or the list
              * becomes too long *before* executing zzlInsert. */
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-            if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
-                sdslen(ele) > server.zset_max_ziplist_value)
+            if (zzlLength(zobj->ptr) > server.zset_max_listpack_entries ||
+                sdslen(ele) > server.zset_max_listpack_value)
                 zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
@@ -1395,16 +1465,15 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             if (score != curscore) {
                 znode = zslUpdateScore(zs->zsl,curscore,ele,score);
                 /* Note that we did not removed the original element from
-                 * the hash table representing the sorted set, so we just
-                 * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                 * the hash table representing the sorted set, and the node
+                 * was reused, so the score pointer stays valid. */
+                serverAssert(dictGetVal(de) == &znode->score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
             znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            serverAssert(dictAdd(zs->dict,znode->ele,&znode->score) == DICT_OK);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1421,7 +1490,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1475,18 +1544,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1599,12 +1668,12 @@ void zaddGenericCommand(client *c, int flags) {
     zobj = lookupKeyWrite(c->db,key);
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
-        if (server.zset_max_ziplist_entries == 0 ||
-            server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
+        if (server.zset_max_listpack_entries == 0 ||
+            server.zset_max_listpack_value < sdslen(c->argv[scoreidx+1]->ptr))
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     } else {
@@ -1659,6 +1728,78 @@ void zincrbyCommand(client *c) {
     zaddGenericCommand(c,ZADD_INCR);
 }
 
+/* ZBUILD key cardinality score member [score member ...]
+ *
+ * Like ZADD without options, for sorted sets loaded with a few big batches:
+ * 'cardinality' is the number of elements the sorted set is expected to
+ * reach, so that it gets its final encoding and size with the first batch. */
+void zbuildCommand(client *c) {
+    robj *key = c->argv[1];
+    robj *zobj;
+    double *scores;
+    long long size;
+    int j, elements, added = 0, updated = 0;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[2],&size,NULL) != C_OK) return;
+    if (size < 0) {
+        addReplyError(c,"cardinality can't be negative");
+        return;
+    }
+    elements = c->argc-3;
+    if (elements % 2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    elements /= 2;
+
+    /* Parse all the scores first, so that the command either executes
+     * fully or nothing at all. */
+    scores = zmalloc(sizeof(double)*elements);
+    for (j = 0; j < elements; j++) {
+        if (getDoubleFromObjectOrReply(c,c->argv[3+j*2],&scores[j],NULL)
+            != C_OK)
+        {
+            zfree(scores);
+            return;
+        }
+    }
+
+    zobj = lookupKeyWrite(c->db,key);
+    if (zobj == NULL) {
+        if (server.zset_max_listpack_entries < (size_t)size ||
+            server.zset_max_listpack_entries == 0 ||
+            server.zset_max_listpack_value < sdslen(c->argv[4]->ptr))
+        {
+            zobj = createZsetObject();
+        } else {
+            zobj = createZsetListpackObject();
+        }
+        dbAdd(c->db,key,zobj);
+    } else if (zobj->type != OBJ_ZSET) {
+        addReply(c,shared.wrongtypeerr);
+        zfree(scores);
+        return;
+    }
+    zsetReserve(zobj,size);
+
+    for (j = 0; j < elements; j++) {
+        int retflags = ZADD_NONE;
+        double newscore;
+
+        /* Scores are not NaN and there is no increment: can't fail. */
+        zsetAdd(zobj,scores[j],c->argv[4+j*2]->ptr,&retflags,&newscore);
+        if (retflags & ZADD_ADDED) added++;
+        if (retflags & ZADD_UPDATED) updated++;
+    }
+    zfree(scores);
+    server.dirty += (added+updated);
+    addReplyLongLong(c,added);
+    if (added || updated) {
+        signalModifiedKey(c->db,key);
+        notifyKeyspaceEvent(NOTIFY_ZSET,"zadd",key,c->db->id);
+    }
+}
+
 void zremCommand(client *c) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -1737,7 +1878,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1815,6 +1956,10 @@ typedef struct {
                 intset *is;
                 int ii;
             } is;
+            struct {
+                unsigned char *lp;
+                unsigned char *p;
+            } lp;
             struct {
                 dict *dict;
                 dictIterator *di;
@@ -1870,20 +2015,23 @@ void zuiInitIterator(zsetopsrc *op) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             it->is.is = op->subject->ptr;
             it->is.ii = 0;
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            it->lp.lp = op->subject->ptr;
+            it->lp.p = lpFirst(it->lp.lp);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             it->ht.dict = op->subject->ptr;
-            it->ht.di = dictGetIterator(op->subject->ptr);
+            it->ht.di = dictGetSafeIterator(op->subject->ptr);
             it->ht.de = dictNext(it->ht.di);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -1903,7 +2051,8 @@ void zuiClearIterator(zsetopsrc *op) {
 
     if (op->type == OBJ_SET) {
         iterset *it = &op->iter.set;
-        if (op->encoding == OBJ_ENCODING_INTSET) {
+        if (op->encoding == OBJ_ENCODING_INTSET ||
+            op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
@@ -1912,7 +2061,7 @@ void zuiClearIterator(zsetopsrc *op) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             UNUSED(it); /* skip */
@@ -1931,6 +2080,8 @@ unsigned long zuiLength(zsetopsrc *op) {
     if (op->type == OBJ_SET) {
         if (op->encoding == OBJ_ENCODING_INTSET) {
             return intsetLen(op->subject->ptr);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            return lpLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
@@ -1938,7 +2089,7 @@ unsigned long zuiLength(zsetopsrc *op) {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
@@ -1975,6 +2126,14 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->is.ii++;
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            if (it->lp.p == NULL)
+                return 0;
+            val->estr = lpGetValue(it->lp.p,&val->elen,&val->ell);
+            val->score = 1.0;
+
+            /* Move to next element. */
+            it->lp.p = lpNext(it->lp.lp,it->lp.p);
         } else if (op->encoding == OBJ_ENCODING_HT) {
             if (it->ht.de == NULL)
                 return 0;
@@ -1988,11 +2147,11 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            val->estr = lpGetValue(it->zl.eptr,&val->elen,&val->ell);
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
@@ -2091,6 +2250,15 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            unsigned char *lp = op->subject->ptr, *p = lpFirst(lp);
+            zuiSdsFromValue(val);
+            if (p && lpFind(lp,p,(unsigned char*)val->ele,sdslen(val->ele),0)) {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             zuiSdsFromValue(val);
@@ -2106,7 +2274,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2172,17 +2340,246 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
+/* ZUNIONSTORE and ZINTERSTORE computed from the inputs 'src', possibly in
+ * multiple steps, see zunionInterStep(). */
+typedef struct {
+    int op;
+    int aggregate;
+    zsetopsrc *src;         /* The inputs, from the smallest to the largest. */
+    long setnum;
+    long i;                 /* Input being iterated. */
+    int iterating;          /* True if the iterator of src[i] is valid. */
+    zsetopval zval;
+    dict *accumulator;      /* Union elements -> aggregated scores. */
+    dictIterator *di;       /* Iterator of the accumulator, or NULL. */
+    robj *dstobj;           /* The result. */
+    size_t maxelelen;
+} zunionInterState;
+
+/* Options of ZUNIONSTORE and ZINTERSTORE executed in the background. */
+typedef struct {
+    int op;
+    int aggregate;
+    double weights[];       /* The weights of the inputs. */
+} zunionInterOptions;
+
+/* Create the state of the operation, that takes the ownership of 'src'. */
+static zunionInterState *zunionInterCreate(zsetopsrc *src, long setnum,
+                                           int op, int aggregate)
+{
+    zunionInterState *st = zcalloc(sizeof(*st));
+
+    /* sort sets from the smallest to largest, this will improve our
+     * algorithm's performance */
+    qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
+
+    st->op = op;
+    st->aggregate = aggregate;
+    st->src = src;
+    st->setnum = setnum;
+    st->dstobj = createZsetObject();
+    if (op == SET_OP_UNION) {
+        st->accumulator = dictCreate(&setAccumulatorDictType,NULL);
+        /* Our union is at least as large as the largest set.
+         * Resize the dictionary ASAP to avoid useless rehashing. */
+        dictExpand(st->accumulator,zuiLength(&src[setnum-1]));
+    }
+    return st;
+}
+
+static void zunionInterFree(zunionInterState *st) {
+    if (st->iterating) zuiClearIterator(&st->src[st->i]);
+    if (st->zval.flags & OPVAL_DIRTY_SDS) sdsfree(st->zval.ele);
+    if (st->accumulator) {
+        /* The keys already moved to the result were freed, see
+         * zunionInterStep(), release the others. */
+        dictIterator *di = st->di ? st->di : dictGetIterator(st->accumulator);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) sdsfree(dictGetKey(de));
+        dictReleaseIterator(di);
+        dictRelease(st->accumulator);
+    }
+    if (st->dstobj) decrRefCount(st->dstobj);
+    zfree(st->src);
+    zfree(st);
+}
+
+/* Compute the operation till 'deadline', in microseconds, and return 0 if
+ * it's not done yet. Once done 1 is returned and the result is moved
+ * to the caller in '*dstobj'. */
+static int zunionInterStep(zunionInterState *st, long long deadline,
+                           robj **dstobj)
+{
+    zsetopsrc *src = st->src;
+    zsetopval *zval = &st->zval;
+    zset *dstzset = st->dstobj->ptr;
+    zskiplistNode *znode;
+    unsigned long count = 0;
+    long j;
+    sds tmp;
+
+    if (st->op == SET_OP_INTER) {
+        /* Skip everything if the smallest input is empty. */
+        if (zuiLength(&src[0]) > 0) {
+            /* Precondition: as src[0] is non-empty and the inputs are ordered
+             * by size, all src[i > 0] are non-empty too. */
+            if (!st->iterating) {
+                zuiInitIterator(&src[0]);
+                st->iterating = 1;
+            }
+            while (zuiNext(&src[0],zval)) {
+                double score, value;
+
+                score = src[0].weight * zval->score;
+                if (isnan(score)) score = 0;
+
+                for (j = 1; j < st->setnum; j++) {
+                    /* It is not safe to access the zset we are
+                     * iterating, so explicitly check for equal object. */
+                    if (src[j].subject == src[0].subject) {
+                        value = zval->score*src[j].weight;
+                        zunionInterAggregate(&score,value,st->aggregate);
+                    } else if (zuiFind(&src[j],zval,&value)) {
+                        value *= src[j].weight;
+                        zunionInterAggregate(&score,value,st->aggregate);
+                    } else {
+                        break;
+                    }
+                }
+
+                /* Only continue when present in every input. */
+                if (j == st->setnum) {
+                    tmp = zuiSdsFromValue(zval);
+                    znode = zslInsert(dstzset->zsl,score,tmp);
+                    dictAdd(dstzset->dict,znode->ele,&znode->score);
+                    if (sdslen(tmp) > st->maxelelen)
+                        st->maxelelen = sdslen(tmp);
+                }
+                if (++count % 1024 == 0 && ustime() >= deadline) return 0;
+            }
+            zuiClearIterator(&src[0]);
+            st->iterating = 0;
+        }
+    } else if (st->op == SET_OP_UNION) {
+        dict *accumulator = st->accumulator;
+        dictEntry *de, *existing;
+        double score;
+
+        /* Step 1: Create a dictionary of elements -> aggregated-scores
+         * by iterating one sorted set after the other. */
+        for (; st->i < st->setnum; st->i++) {
+            zsetopsrc *op = &src[st->i];
+
+            if (zuiLength(op) == 0) continue;
+
+            if (!st->iterating) {
+                zuiInitIterator(op);
+                st->iterating = 1;
+            }
+            while (zuiNext(op,zval)) {
+                /* Initialize value */
+                score = op->weight * zval->score;
+                if (isnan(score)) score = 0;
+
+                /* Search for this element in the accumulating dictionary. */
+                de = dictAddRaw(accumulator,zuiSdsFromValue(zval),&existing);
+                /* If we don't have it, we need to create a new entry. */
+                if (!existing) {
+                    tmp = zuiNewSdsFromValue(zval);
+                    /* Remember the longest single element encountered,
+                     * to understand if it's possible to convert to listpack
+                     * at the end. */
+                    if (sdslen(tmp) > st->maxelelen)
+                        st->maxelelen = sdslen(tmp);
+                    /* Update the element with its initial score. */
+                    dictSetKey(accumulator, de, tmp);
+                    dictSetDoubleVal(de,score);
+                } else {
+                    /* Update the score with the score of the new instance
+                     * of the element found in the current sorted set.
+                     *
+                     * Here we access directly the dictEntry double
+                     * value inside the union as it is a big speedup
+                     * compared to using the getDouble/setDouble API. */
+                    zunionInterAggregate(&existing->v.d,score,st->aggregate);
+                }
+                if (++count % 1024 == 0 && ustime() >= deadline) return 0;
+            }
+            zuiClearIterator(op);
+            st->iterating = 0;
+        }
+
+        /* Step 2: convert the dictionary into the final sorted set. */
+        if (st->di == NULL) {
+            st->di = dictGetIterator(accumulator);
+
+            /* We now are aware of the final size of the resulting sorted
+             * set, let's resize the dictionary embedded inside the sorted
+             * set to the right size, in order to save rehashing time. */
+            dictExpand(dstzset->dict,dictSize(accumulator));
+        }
+
+        while((de = dictNext(st->di)) != NULL) {
+            sds ele = dictGetKey(de);
+            score = dictGetDoubleVal(de);
+            znode = zslInsert(dstzset->zsl,score,ele);
+            dictAdd(dstzset->dict,znode->ele,&znode->score);
+            sdsfree(ele);
+            if (++count % 1024 == 0 && ustime() >= deadline) return 0;
+        }
+        dictReleaseIterator(st->di);
+        dictRelease(accumulator);
+        st->di = NULL;
+        st->accumulator = NULL;
+    } else {
+        serverPanic("Unknown operator");
+    }
+
+    zsetConvertToListpackIfNeeded(st->dstobj,st->maxelelen);
+    *dstobj = st->dstobj;
+    st->dstobj = NULL;
+    return 1;
+}
+
+static int zunionInterJobInit(setopJob *job) {
+    zunionInterOptions *opts = job->privdata;
+    zsetopsrc *src = zcalloc(sizeof(zsetopsrc) * job->numkeys);
+
+    for (int i = 0; i < job->numkeys; i++) {
+        robj *obj = job->vals[i];
+
+        if (obj != NULL) {
+            if (obj->type != OBJ_ZSET && obj->type != OBJ_SET) {
+                zfree(src);
+                return C_ERR;
+            }
+            src[i].subject = obj;
+            src[i].type = obj->type;
+            src[i].encoding = obj->encoding;
+        }
+        src[i].weight = opts->weights[i];
+    }
+    job->state = zunionInterCreate(src,job->numkeys,opts->op,opts->aggregate);
+    return C_OK;
+}
+
+static int zunionInterJobStep(setopJob *job, long long deadline) {
+    return zunionInterStep(job->state,deadline,&job->dst);
+}
+
+static void zunionInterJobFree(setopJob *job) {
+    if (job->state) zunionInterFree(job->state);
+}
+
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
     int aggregate = REDIS_AGGR_SUM;
     zsetopsrc *src;
-    zsetopval zval;
-    sds tmp;
-    size_t maxelelen = 0;
-    robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
+    unsigned long long numele = 0;
+    zunionInterState *st;
+    robj *dstobj = NULL;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2264,122 +2661,33 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         }
     }
 
-    /* sort sets from the smallest to largest, this will improve our
-     * algorithm's performance */
-    qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
-
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
-    memset(&zval, 0, sizeof(zval));
-
-    if (op == SET_OP_INTER) {
-        /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
-            /* Precondition: as src[0] is non-empty and the inputs are ordered
-             * by size, all src[i > 0] are non-empty too. */
-            zuiInitIterator(&src[0]);
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else {
-                        break;
-                    }
-                }
-
-                /* Only continue when present in every input. */
-                if (j == setnum) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
-                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                }
-            }
-            zuiClearIterator(&src[0]);
-        }
-    } else if (op == SET_OP_UNION) {
-        dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
-        dictIterator *di;
-        dictEntry *de, *existing;
-        double score;
-
-        if (setnum) {
-            /* Our union is at least as large as the largest set.
-             * Resize the dictionary ASAP to avoid useless rehashing. */
-            dictExpand(accumulator,zuiLength(&src[setnum-1]));
-        }
+    for (i = 0; i < setnum; i++) numele += zuiLength(&src[i]);
+    if (setopCanRunInBackground(c,numele)) {
+        zunionInterOptions *opts =
+            zmalloc(sizeof(*opts)+sizeof(double)*setnum);
+        robj **vals = zmalloc(sizeof(robj*)*setnum);
 
-        /* Step 1: Create a dictionary of elements -> aggregated-scores
-         * by iterating one sorted set after the other. */
+        opts->op = op;
+        opts->aggregate = aggregate;
         for (i = 0; i < setnum; i++) {
-            if (zuiLength(&src[i]) == 0) continue;
-
-            zuiInitIterator(&src[i]);
-            while (zuiNext(&src[i],&zval)) {
-                /* Initialize value */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                /* Search for this element in the accumulating dictionary. */
-                de = dictAddRaw(accumulator,zuiSdsFromValue(&zval),&existing);
-                /* If we don't have it, we need to create a new entry. */
-                if (!existing) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
-                     * at the end. */
-                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                    /* Update the element with its initial score. */
-                    dictSetKey(accumulator, de, tmp);
-                    dictSetDoubleVal(de,score);
-                } else {
-                    /* Update the score with the score of the new instance
-                     * of the element found in the current sorted set.
-                     *
-                     * Here we access directly the dictEntry double
-                     * value inside the union as it is a big speedup
-                     * compared to using the getDouble/setDouble API. */
-                    zunionInterAggregate(&existing->v.d,score,aggregate);
-                }
-            }
-            zuiClearIterator(&src[i]);
-        }
-
-        /* Step 2: convert the dictionary into the final sorted set. */
-        di = dictGetIterator(accumulator);
-
-        /* We now are aware of the final size of the resulting sorted set,
-         * let's resize the dictionary embedded inside the sorted set to the
-         * right size, in order to save rehashing time. */
-        dictExpand(dstzset->dict,dictSize(accumulator));
-
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
-        }
-        dictReleaseIterator(di);
-        dictRelease(accumulator);
-    } else {
-        serverPanic("Unknown operator");
+            opts->weights[i] = src[i].weight;
+            vals[i] = src[i].subject;
+        }
+        setopStartJob(c,dstkey,c->argv+3,vals,setnum,
+            (op == SET_OP_UNION) ? "zunionstore" : "zinterstore",opts,
+            zunionInterJobInit,zunionInterJobStep,zunionInterJobFree);
+        zfree(vals);
+        zfree(src);
+        return;
     }
 
+    st = zunionInterCreate(src,setnum,op,aggregate);
+    serverAssert(zunionInterStep(st,LLONG_MAX,&dstobj));
+    zunionInterFree(st);
+
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+    if (zsetLength(dstobj)) {
         dbAdd(c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         signalModifiedKey(c->db,dstkey);
@@ -2396,7 +2704,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
             server.dirty++;
         }
     }
-    zfree(src);
 }
 
 void zunionstoreCommand(client *c) {
@@ -2407,6 +2714,35 @@ void zinterstoreCommand(client *c) {
     zunionInterGenericCommand(c,c->argv[1], SET_OP_INTER);
 }
 
+#define ZRANGE_JOB_REVERSE (1<<0)
+#define ZRANGE_JOB_WITHSCORES (1<<1)
+
+/* Streamed reply of ZRANGE and ZREVRANGE, see replyStartJob(). The cursor
+ * is the rank of the next element, in the order of the reply: the node is
+ * looked up again at every step, since the skiplist may be defragmented
+ * meanwhile. */
+static int zrangeJobStep(replyJob *job, long long deadline) {
+    zskiplist *zsl = ((zset*)job->val->ptr)->zsl;
+    int reverse = job->flags & ZRANGE_JOB_REVERSE;
+    int withscores = job->flags & ZRANGE_JOB_WITHSCORES;
+    zskiplistNode *ln;
+    int j = 0;
+
+    ln = zslGetElementByRank(zsl,reverse ? zsl->length-job->cursor :
+                                           job->cursor+1);
+    while (job->remaining) {
+        serverAssertWithInfo(job->c,job->val,ln != NULL);
+        if (withscores && job->c->resp > 2) addReplyArrayLen(job->c,2);
+        addReplyBulkCBuffer(job->c,ln->ele,sdslen(ln->ele));
+        if (withscores) addReplyDouble(job->c,ln->score);
+        ln = reverse ? ln->backward : ln->level[0].forward;
+        job->cursor++;
+        job->remaining--;
+        if ((++j % 64) == 0 && replyJobShouldPause(job,deadline)) break;
+    }
+    return job->remaining == 0;
+}
+
 void zrangeGenericCommand(client *c, int reverse) {
     robj *key = c->argv[1];
     robj *zobj;
@@ -2452,7 +2788,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     else
         addReplyArrayLen(c, rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2460,16 +2796,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             if (vstr == NULL)
@@ -2484,6 +2820,13 @@ void zrangeGenericCommand(client *c, int reverse) {
                 zzlNext(zl,&eptr,&sptr);
         }
 
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST &&
+               replyCanBeStreamed(c,rangelen))
+    {
+        int flags = (reverse ? ZRANGE_JOB_REVERSE : 0) |
+                    (withscores ? ZRANGE_JOB_WITHSCORES : 0);
+        replyJob *job = replyStartJob(c,zobj,rangelen,flags,zrangeJobStep);
+        job->cursor = start;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
@@ -2577,7 +2920,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptyarray)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2600,7 +2943,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2627,9 +2970,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
-             * succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
@@ -2732,7 +3073,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2747,7 +3088,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2813,7 +3154,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2828,7 +3169,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2926,7 +3267,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2949,7 +3290,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2974,9 +3315,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
+            /* We know the element exists, so lpGetValue should always
              * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -3172,7 +3513,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3180,16 +3521,16 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
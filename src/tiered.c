@@ -0,0 +1,675 @@
+/* Tiered storage: the values of cold keys moved to a file on disk.
+ *
+ * When 'tiered-storage' is enabled, the keys selected by the maxmemory policy
+ * are not deleted once the memory limit is reached: their value is
+ * serialized in the RDB format and appended to the tiered storage file,
+ * while the key, its expire and its LRU/LFU data stay in memory. In the
+ * keyspace the value is replaced by a stub object, with the type of the
+ * value and the OBJ_ENCODING_SWAPPED encoding, referencing a tieredValue
+ * structure with the position of the value in the file.
+ *
+ * Before the command of a normal client is executed, the values of its keys
+ * that are in the file are read by a bio.c thread, and the client is blocked
+ * with BLOCKED_TIERED in the meantime: once all the values are back in
+ * memory the command is executed again. In all the other cases (scripts,
+ * the replication stream, keys not declared by the command, ...) the value
+ * is read synchronously by lookupKey().
+ *
+ * The file is append only: the space used by the values read back or
+ * deleted is just accounted as garbage, and the file is truncated once no
+ * value is stored in it anymore.
+ *
+ * The same stubs are used by 'rdb-lazy-load': at startup the values are not
+ * decoded, only their position in the RDB file is recorded, so that the
+ * server can serve clients as soon as the file was read. The values are read
+ * back on access exactly like the ones in the tiered storage file, and in
+ * the meantime tieredLazyLoadCron() reads back the others a few at a time,
+ * so that eventually the RDB file is no longer needed and is closed. The
+ * file descriptor keeps the content of the file loaded even if it is then
+ * replaced by a new RDB.
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "bio.h"
+#include "atomicvar.h"
+
+#include <fcntl.h>
+
+#define TIERED_MIN_VALUE_SIZE 128  /* Smaller values are never moved. */
+#define TIERED_COPY_CHUNK (16*1024) /* Buffer used to copy values in a RDB. */
+#define TIERED_LAZY_LOAD_TIME_PERC 25 /* CPU max % for reading back the lazy
+                                         values, see tieredLazyLoadCron(). */
+
+/* A value read by the bio thread. Multiple clients waiting for the same
+ * value share the read, that is identified by the offset of the value. */
+typedef struct tieredRead {
+    off_t offset;
+    size_t len;
+    int lazy;           /* The value is in the RDB file. */
+    int dbid;
+    sds key;
+    sds buf;            /* Filled by the bio thread. */
+    int err;            /* errno of a failed read, or 0. */
+    list *clients;      /* Clients waiting for the value. */
+} tieredRead;
+
+static struct {
+    int fd;                 /* The tiered storage file. */
+    off_t size;             /* Bytes written in the file so far. */
+    size_t swapped;         /* Values in the file. Atomic: the stubs may be
+                               released by the lazyfree threads. */
+    size_t garbage;         /* Bytes of the values no longer referenced. */
+    rax *reads;             /* Reads in progress, by offset. */
+    list *ready;            /* Clients that can execute their command. */
+    client *resuming;       /* Client executing again its command. */
+    pthread_mutex_t done_mutex;
+    list *done;             /* Reads completed by the bio thread. */
+    int done_pipe[2];       /* Wakes up the main thread. */
+    int rdb_fd;             /* The RDB file loaded lazily, or -1. */
+    size_t lazy;            /* Values in the RDB file. Atomic as 'swapped'. */
+    int lazy_db;            /* DB and cursor of tieredLazyLoadCron(). */
+    unsigned long lazy_cursor;
+} tiered;
+
+/* ------------------------------- File I/O --------------------------------- */
+
+/* Read 'len' bytes at 'offset' of the tiered storage file, or of the RDB
+ * file if 'lazy' is true. Called both by the main thread and by the bio
+ * thread. Returns -1 with errno set on error. */
+static int tieredPread(int lazy, void *buf, size_t len, off_t offset) {
+    int fd = lazy ? tiered.rdb_fd : tiered.fd;
+
+    while (len) {
+        ssize_t nread = pread(fd,buf,len,offset);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread <= 0) {
+            if (nread == 0) errno = EIO; /* Truncated file. */
+            return -1;
+        }
+        buf = (char*)buf + nread;
+        len -= nread;
+        offset += nread;
+    }
+    return 0;
+}
+
+static int tieredPwrite(void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t nwritten = pwrite(tiered.fd,buf,len,offset);
+        if (nwritten == -1 && errno == EINTR) continue;
+        if (nwritten == -1) return -1;
+        buf = (char*)buf + nwritten;
+        len -= nwritten;
+        offset += nwritten;
+    }
+    return 0;
+}
+
+/* Deserialize the value read in 'buf'. Returns NULL if it is corrupted. */
+static robj *tieredDecodeValue(tieredValue *tv, sds buf, robj *key) {
+    rio payload;
+    rioInitWithBuffer(&payload,buf);
+    return rdbLoadObject(tv->rdbtype,&payload,key);
+}
+
+/* -------------------------- Moving values around -------------------------- */
+
+/* Return 1 if the value of the entry 'de' can be moved to the tiered storage.
+ * Shared values, and the ones referenced by commands in progress, have more
+ * than a reference. Module values can't be serialized without the module,
+ * and the field expires of hashes reference the fields in memory. */
+int tieredCanSwapOut(redisDb *db, dictEntry *de) {
+    robj *o = dictGetVal(de);
+
+    if (o->encoding == OBJ_ENCODING_SWAPPED || o->refcount != 1 ||
+        o->type == OBJ_MODULE) return 0;
+    if (o->type == OBJ_HASH && hashFieldExpiresGet(db,dictGetKey(de)))
+        return 0;
+    return objectComputeSize(o,1) >= TIERED_MIN_VALUE_SIZE;
+}
+
+/* Move the value of the entry 'de' to the tiered storage, replacing it with
+ * a stub. Returns C_ERR if the value could not be written. */
+int tieredSwapOut(redisDb *db, dictEntry *de) {
+    robj *o = dictGetVal(de), *stub, keyobj;
+    rio payload;
+
+    /* The RDB type is written first, so that the payload follows it in
+     * the buffer, but only the payload goes in the file. */
+    initStaticStringObject(keyobj,dictGetKey(de));
+    rioInitWithBuffer(&payload,sdsempty());
+    rdbSaveObjectType(&payload,o);
+    rdbSaveObject(&payload,o,&keyobj);
+    sds buf = payload.io.buffer.ptr;
+    size_t len = sdslen(buf)-1;
+
+    if (tieredPwrite(buf+1,len,tiered.size) == -1) {
+        serverLog(LL_WARNING,"Error writing the tiered storage file: %s",
+            strerror(errno));
+        sdsfree(buf);
+        return C_ERR;
+    }
+
+    tieredValue *tv = zmalloc(sizeof(*tv));
+    tv->offset = tiered.size;
+    tv->len = len;
+    tv->rdbtype = buf[0];
+    tv->lazy = 0;
+    tiered.size += len;
+    sdsfree(buf);
+
+    stub = createObject(o->type,tv);
+    stub->encoding = OBJ_ENCODING_SWAPPED;
+    stub->lru = o->lru;
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    dictSetVal(db->dict,de,stub);
+    if (server.lazyfree_lazy_eviction)
+        freeObjAsync(o);
+    else
+        decrRefCount(o);
+    atomicIncr(tiered.swapped,1);
+    server.stat_tiered_swap_outs++;
+    return C_OK;
+}
+
+/* Replace the stub of the entry 'de' with the value deserialized from 'buf',
+ * returning the value. */
+static robj *tieredInstallValue(redisDb *db, dictEntry *de, sds buf) {
+    robj *stub = dictGetVal(de), *o, keyobj;
+
+    initStaticStringObject(keyobj,dictGetKey(de));
+    if ((o = tieredDecodeValue(stub->ptr,buf,&keyobj)) == NULL)
+        serverPanic("Corrupted value in the tiered storage file");
+    o->lru = stub->lru;
+    if (server.rdb_forkless) rdbForklessSaveEntry(db,de);
+    dictSetVal(db->dict,de,o);
+    decrRefCount(stub);
+    server.stat_tiered_swap_ins++;
+    return o;
+}
+
+/* Read back synchronously the value of the entry 'de', that is in the
+ * tiered storage, and return it. */
+robj *tieredSwapIn(redisDb *db, dictEntry *de) {
+    tieredValue *tv = ((robj*)dictGetVal(de))->ptr;
+    sds buf = sdsnewlen(SDS_NOINIT,tv->len);
+
+    if (tieredPread(tv->lazy,buf,tv->len,tv->offset) == -1) {
+        serverLog(LL_WARNING,"Error reading the %s file: %s",
+            tv->lazy ? "RDB" : "tiered storage", strerror(errno));
+        exit(1);
+    }
+    robj *o = tieredInstallValue(db,de,buf);
+    sdsfree(buf);
+    return o;
+}
+
+/* Return a copy of the value of the stub 'o', leaving it in the tiered
+ * storage, or NULL on error. Used to serialize the dataset in other formats,
+ * possibly by child processes. */
+robj *tieredLoadValue(robj *o, robj *key) {
+    tieredValue *tv = o->ptr;
+    sds buf = sdsnewlen(SDS_NOINIT,tv->len);
+    robj *val = NULL;
+
+    if (tieredPread(tv->lazy,buf,tv->len,tv->offset) == 0)
+        val = tieredDecodeValue(tv,buf,key);
+    sdsfree(buf);
+    return val;
+}
+
+/* Copy the serialized value of the stub 'o' to 'rdb', see rdbSaveObject().
+ * When 'rdb' is NULL just the length is returned. */
+ssize_t tieredSaveValue(rio *rdb, robj *o) {
+    tieredValue *tv = o->ptr;
+    unsigned char buf[TIERED_COPY_CHUNK];
+    off_t offset = tv->offset;
+    size_t left = tv->len;
+
+    if (rdb == NULL) return tv->len;
+    while (left) {
+        size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+        if (tieredPread(tv->lazy,buf,chunk,offset) == -1) return -1;
+        if (rioWrite(rdb,buf,chunk) == 0) return -1;
+        offset += chunk;
+        left -= chunk;
+    }
+    return tv->len;
+}
+
+/* Free the 'ptr' of a stub. Called by decrRefCount(), also by the lazyfree
+ * threads. */
+void tieredFreeValue(tieredValue *tv) {
+    if (tv->lazy) {
+        atomicDecr(tiered.lazy,1);
+    } else {
+        atomicIncr(tiered.garbage,tv->len);
+        atomicDecr(tiered.swapped,1);
+    }
+    zfree(tv);
+}
+
+/* ---------------------------- Background reads ---------------------------- */
+
+/* Called by the bio thread for every BIO_TIERED_READ job. */
+void tieredReadFromBioThread(tieredRead *r) {
+    if (tieredPread(r->lazy,r->buf,r->len,r->offset) == -1) r->err = errno;
+    pthread_mutex_lock(&tiered.done_mutex);
+    listAddNodeTail(tiered.done,r);
+    pthread_mutex_unlock(&tiered.done_mutex);
+    /* If the pipe is full the main thread is going to wake up anyway. */
+    if (write(tiered.done_pipe[1],"R",1) != 1) {}
+}
+
+/* The reads are identified by file and offset. */
+static void tieredReadId(unsigned char *id, int lazy, off_t offset) {
+    uint64_t be = htonu64((uint64_t)offset);
+    id[0] = lazy;
+    memcpy(id+1,&be,sizeof(be));
+}
+
+/* Add the client 'c' to the clients waiting for the value 'tv' of 'key',
+ * starting a new read if it is not already in progress. */
+static void tieredStartRead(client *c, redisDb *db, sds key,
+                            tieredValue *tv)
+{
+    unsigned char id[9];
+    tieredRead *r;
+
+    tieredReadId(id,tv->lazy,tv->offset);
+    r = raxFind(tiered.reads,id,sizeof(id));
+    if (r == raxNotFound) {
+        r = zmalloc(sizeof(*r));
+        r->offset = tv->offset;
+        r->len = tv->len;
+        r->lazy = tv->lazy;
+        r->dbid = db->id;
+        r->key = sdsdup(key);
+        r->buf = sdsnewlen(SDS_NOINIT,tv->len);
+        r->err = 0;
+        r->clients = listCreate();
+        raxInsert(tiered.reads,id,sizeof(id),r,NULL);
+        bioCreateBackgroundJob(BIO_TIERED_READ,r,NULL,NULL);
+        server.stat_tiered_async_reads++;
+    } else if (listSearchKey(r->clients,c)) {
+        return; /* The same key is used twice by the command. */
+    }
+    listAddNodeTail(r->clients,c);
+    c->bpop.tiered_pending++;
+}
+
+/* Start the reads of the values of the keys of 'cmd' that are in the
+ * tiered storage, for the client 'c'. OBJECT, DEL and UNLINK don't access
+ * the values, so there is nothing to read for them. */
+static void tieredReadCommandKeys(client *c, redisDb *db,
+                                  struct redisCommand *cmd, robj **argv,
+                                  int argc)
+{
+    int numkeys, *keys, cached = cmd == c->cmd && argv == c->argv;
+
+    if (cmd->proc == objectCommand || cmd->proc == delCommand ||
+        cmd->proc == unlinkCommand) return;
+    keys = cached ? getClientCommandKeys(c,&numkeys) :
+                    getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (int j = 0; j < numkeys; j++) {
+        robj *key = argv[keys[j]];
+        dictEntry *de = dictFind(db->dict,key->ptr);
+        if (de == NULL) continue;
+        robj *o = dictGetVal(de);
+        if (o->encoding != OBJ_ENCODING_SWAPPED) continue;
+        /* Expired keys are going to be deleted, not read. */
+        if (keyIsExpired(db,key)) continue;
+        tieredStartRead(c,db,dictGetKey(de),o->ptr);
+    }
+    if (!cached) getKeysFreeResult(keys);
+}
+
+/* Called by processCommand() before executing the command of 'c': if some
+ * of the keys of the command have the value in the tiered storage, the
+ * values are read in the background and the client is blocked, to execute
+ * the command again once they are back in memory. Returns 1 if the client
+ * was blocked, otherwise 0. */
+int tieredBlockForValues(client *c) {
+    size_t swapped, lazy;
+
+    if (c == tiered.resuming) return 0;
+    atomicGet(tiered.swapped,swapped);
+    atomicGet(tiered.lazy,lazy);
+    if (swapped == 0 && lazy == 0) return 0;
+    if (c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_LUA|CLIENT_MODULE))
+        return 0;
+
+    if (c->cmd->proc == execCommand) {
+        redisDb *db = c->db;
+
+        /* A transaction that is going to fail reads nothing. */
+        if (!(c->flags & CLIENT_MULTI) ||
+            c->flags & (CLIENT_DIRTY_CAS|CLIENT_DIRTY_EXEC)) return 0;
+        for (int j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+            if (mc->cmd->proc == selectCommand) {
+                long long id;
+                if (getLongLongFromObject(mc->argv[1],&id) == C_OK &&
+                    id >= 0 && id < server.dbnum) db = server.db+id;
+            } else {
+                tieredReadCommandKeys(c,db,mc->cmd,mc->argv,mc->argc);
+            }
+        }
+    } else if (c->flags & CLIENT_MULTI) {
+        return 0; /* Just queued. */
+    } else {
+        tieredReadCommandKeys(c,c->db,c->cmd,c->argv,c->argc);
+    }
+
+    if (c->bpop.tiered_pending == 0) return 0;
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_TIERED);
+    return 1;
+}
+
+/* Install the value of a completed read, if the key still references it,
+ * and move the clients that are no longer waiting to the ready list. */
+static void tieredCompleteRead(tieredRead *r) {
+    redisDb *db = server.db+r->dbid;
+    unsigned char id[9];
+    dictEntry *de;
+    listNode *ln;
+    listIter li;
+
+    tieredReadId(id,r->lazy,r->offset);
+    raxRemove(tiered.reads,id,sizeof(id),NULL);
+
+    if (r->err) {
+        /* The waiting clients are going to read the value synchronously,
+         * see lookupKey(). */
+        serverLog(LL_WARNING,"Error reading the %s file: %s",
+            r->lazy ? "RDB" : "tiered storage", strerror(r->err));
+    } else if ((de = dictFind(db->dict,r->key)) != NULL) {
+        robj *o = dictGetVal(de);
+        if (o->encoding == OBJ_ENCODING_SWAPPED &&
+            ((tieredValue*)o->ptr)->lazy == r->lazy &&
+            ((tieredValue*)o->ptr)->offset == r->offset)
+        {
+            /* Touch the value, or the eviction performed before the
+             * command is executed again may pick it right away. */
+            o = tieredInstallValue(db,de,r->buf);
+            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU)
+                updateLFU(o);
+            else
+                o->lru = LRU_CLOCK();
+        }
+    }
+
+    listRewind(r->clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (--c->bpop.tiered_pending == 0) listAddNodeTail(tiered.ready,c);
+    }
+    listRelease(r->clients);
+    sdsfree(r->key);
+    sdsfree(r->buf);
+    zfree(r);
+}
+
+/* Execute again the command of a client whose values are back in memory. */
+static void tieredResumeClient(client *c) {
+    unblockClient(c);
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) {
+        resetClient(c);
+        return;
+    }
+    tiered.resuming = c;
+    processCommandAndResetClient(c);
+    tiered.resuming = NULL;
+}
+
+static void tieredReadsDoneHandler(aeEventLoop *el, int fd, void *privdata,
+                                   int mask)
+{
+    char buf[128];
+    list *done;
+    listNode *ln;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    pthread_mutex_lock(&tiered.done_mutex);
+    done = tiered.done;
+    tiered.done = listCreate();
+    pthread_mutex_unlock(&tiered.done_mutex);
+
+    while ((ln = listFirst(done)) != NULL) {
+        tieredRead *r = listNodeValue(ln);
+        listDelNode(done,ln);
+        tieredCompleteRead(r);
+    }
+    listRelease(done);
+
+    /* A command may free other clients: they leave the list when they are
+     * unblocked, see unblockClientWaitingTiered(). */
+    while ((ln = listFirst(tiered.ready)) != NULL) {
+        client *c = listNodeValue(ln);
+        listDelNode(tiered.ready,ln);
+        tieredResumeClient(c);
+    }
+}
+
+/* Called by unblockClient(): when the client is freed while still waiting,
+ * it is removed from the reads it was waiting for. */
+void unblockClientWaitingTiered(client *c) {
+    listNode *ln;
+
+    if (c->bpop.tiered_pending) {
+        raxIterator ri;
+        raxStart(&ri,tiered.reads);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            tieredRead *r = ri.data;
+            if ((ln = listSearchKey(r->clients,c)) != NULL)
+                listDelNode(r->clients,ln);
+        }
+        raxStop(&ri);
+        c->bpop.tiered_pending = 0;
+    }
+    if ((ln = listSearchKey(tiered.ready,c)) != NULL)
+        listDelNode(tiered.ready,ln);
+}
+
+/* ------------------------- Lazy loading of the RDB ------------------------ */
+
+/* Called by rdbLoad() before loading lazily the RDB file open as 'fd'.
+ * Returns C_ERR if the values must be loaded as usual. */
+int tieredLazyLoadStart(int fd) {
+    size_t lazy;
+
+    /* The values of a previous RDB may still be referenced. */
+    atomicGet(tiered.lazy,lazy);
+    if (lazy || raxSize(tiered.reads)) return C_ERR;
+    if (tiered.rdb_fd != -1) close(tiered.rdb_fd);
+    if ((tiered.rdb_fd = dup(fd)) == -1) {
+        serverLog(LL_WARNING,"Can't load the RDB file lazily: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    tiered.lazy_db = 0;
+    tiered.lazy_cursor = 0;
+    return C_OK;
+}
+
+/* Return the stub of the value of type 'type', serialized with the RDB type
+ * 'rdbtype' in the 'len' bytes at 'offset' of the RDB file loaded lazily. */
+robj *tieredCreateLazyValue(int type, int rdbtype, off_t offset,
+                            size_t len)
+{
+    tieredValue *tv = zmalloc(sizeof(*tv));
+    robj *stub;
+
+    tv->offset = offset;
+    tv->len = len;
+    tv->rdbtype = rdbtype;
+    tv->lazy = 1;
+    stub = createObject(type,tv);
+    stub->encoding = OBJ_ENCODING_SWAPPED;
+    atomicIncr(tiered.lazy,1);
+    return stub;
+}
+
+static void tieredLazyLoadScanCallback(void *privdata, const dictEntry *de) {
+    robj *o = dictGetVal(de);
+
+    if (o->encoding == OBJ_ENCODING_SWAPPED && ((tieredValue*)o->ptr)->lazy)
+        tieredSwapIn(privdata,(dictEntry*)de);
+}
+
+/* Called by serverCron(): read back in memory some of the values still in
+ * the RDB file, using at most TIERED_LAZY_LOAD_TIME_PERC of the CPU time,
+ * and close the file once they are all in memory. Nothing is read while
+ * the maxmemory limit is reached, the values would just be evicted. */
+void tieredLazyLoadCron(void) {
+    long long start = ustime(), timelimit;
+    int iterations = 0;
+    size_t lazy;
+
+    if (tiered.rdb_fd == -1) return;
+    atomicGet(tiered.lazy,lazy);
+    if (lazy == 0) {
+        /* Reads of values since deleted may still be in progress. */
+        if (raxSize(tiered.reads) || server.rdb_forkless) return;
+        close(tiered.rdb_fd);
+        tiered.rdb_fd = -1;
+        serverLog(LL_NOTICE,"The values loaded lazily are all in memory.");
+        return;
+    }
+    if (server.maxmemory && zmalloc_used_memory() > server.maxmemory) return;
+
+    timelimit = 1000000*TIERED_LAZY_LOAD_TIME_PERC/server.hz/100;
+    do {
+        redisDb *db = server.db+tiered.lazy_db;
+
+        tiered.lazy_cursor = dictScan(db->dict,tiered.lazy_cursor,
+            tieredLazyLoadScanCallback,NULL,db);
+        if (tiered.lazy_cursor == 0)
+            tiered.lazy_db = (tiered.lazy_db+1) % server.dbnum;
+        atomicGet(tiered.lazy,lazy);
+    } while (lazy && ((++iterations & 15) || ustime()-start < timelimit));
+}
+
+/* ------------------------------ Housekeeping ------------------------------ */
+
+/* Called at startup if the tiered storage or the lazy loading of the RDB
+ * are enabled: the latter needs everything but the tiered storage file. */
+void tieredInit(void) {
+    tiered.fd = -1;
+    if (server.tiered_storage)
+        tiered.fd = open(server.tiered_storage_file,
+                         O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (server.tiered_storage && tiered.fd == -1) {
+        serverLog(LL_WARNING,"Can't open the tiered storage file %s: %s",
+            server.tiered_storage_file, strerror(errno));
+        exit(1);
+    }
+    if (pipe(tiered.done_pipe) == -1) {
+        serverLog(LL_WARNING,"Can't create the tiered storage pipe: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,tiered.done_pipe[0]);
+    anetNonBlock(NULL,tiered.done_pipe[1]);
+    if (aeCreateFileEvent(server.el,tiered.done_pipe[0],AE_READABLE,
+        tieredReadsDoneHandler,NULL) == AE_ERR)
+    {
+        serverPanic("Can't create the tiered storage pipe file event.");
+    }
+    tiered.size = 0;
+    tiered.swapped = 0;
+    tiered.garbage = 0;
+    tiered.reads = raxNew();
+    tiered.ready = listCreate();
+    tiered.resuming = NULL;
+    pthread_mutex_init(&tiered.done_mutex,NULL);
+    tiered.done = listCreate();
+    tiered.rdb_fd = -1;
+    tiered.lazy = 0;
+    tiered.lazy_db = 0;
+    tiered.lazy_cursor = 0;
+}
+
+/* Called by serverCron(): empty the file once no value is stored in it.
+ * Child processes may still read the values they reference. Truncating a
+ * big file blocks while the filesystem releases its blocks, so the file is
+ * rather replaced with a new one, and the old one is closed in background. */
+void tieredCron(void) {
+    size_t swapped;
+    int fd = -1;
+
+    atomicGet(tiered.swapped,swapped);
+    if (tiered.size == 0 || swapped || raxSize(tiered.reads) ||
+        hasActiveChildProcess() || server.rdb_forkless) return;
+    if (unlink(server.tiered_storage_file) == 0)
+        fd = open(server.tiered_storage_file,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (fd != -1) {
+        bioCloseFile(tiered.fd);
+        tiered.fd = fd;
+    } else if (ftruncate(tiered.fd,0) == -1) {
+        serverLog(LL_WARNING,"Can't truncate the tiered storage file: %s",
+            strerror(errno));
+        return;
+    }
+    tiered.size = 0;
+    atomicSet(tiered.garbage,0);
+}
+
+/* Append the tiered storage section to the INFO output 'info'. */
+sds genTieredInfoString(sds info) {
+    size_t swapped, garbage, lazy;
+
+    atomicGet(tiered.swapped,swapped);
+    atomicGet(tiered.garbage,garbage);
+    atomicGet(tiered.lazy,lazy);
+    return sdscatprintf(info,
+        "# Tiered\r\n"
+        "tiered_swapped_values:%zu\r\n"
+        "tiered_file_size:%lld\r\n"
+        "tiered_garbage_bytes:%zu\r\n"
+        "tiered_reads_in_progress:%llu\r\n"
+        "tiered_swap_outs:%lld\r\n"
+        "tiered_swap_ins:%lld\r\n"
+        "tiered_async_reads:%lld\r\n"
+        "tiered_lazy_values:%zu\r\n",
+        swapped,
+        (long long)tiered.size,
+        garbage,
+        (unsigned long long)raxSize(tiered.reads),
+        server.stat_tiered_swap_outs,
+        server.stat_tiered_swap_ins,
+        server.stat_tiered_async_reads,
+        lazy);
+}
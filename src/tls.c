@@ -93,6 +93,10 @@ static int parseProtocolsConfig(const char *str) {
  * served to the reader yet. */
 static list *pending_list = NULL;
 
+/* Accepted connections waiting for their handshake to be processed, see
+ * tlsProcessPendingHandshakes(). */
+static list *pending_handshakes = NULL;
+
 void tlsInit(void) {
     ERR_load_crypto_strings();
     SSL_load_error_strings();
@@ -103,6 +107,7 @@ void tlsInit(void) {
     }
 
     pending_list = listCreate();
+    pending_handshakes = listCreate();
 
     /* Server configuration */
     server.tls_auth_clients = 1;    /* Secure by default */
@@ -166,6 +171,26 @@ int tlsConfigure(redisTLSContextConfig *ctx_config) {
     if (ctx_config->prefer_server_ciphers)
         SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
+    /* Let clients resume their sessions, with a session ID or a ticket,
+     * skipping the expensive part of the handshake when they reconnect. */
+    if (ctx_config->session_caching) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, ctx_config->session_cache_size);
+        SSL_CTX_set_timeout(ctx, ctx_config->session_cache_timeout);
+        SSL_CTX_set_session_id_context(ctx, (void *) "redis", 5);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+
+    if (ctx_config->ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        serverLog(LL_WARNING, "tls-ktls is enabled but OpenSSL was built without kernel TLS support.");
+#endif
+    }
+
     SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
     SSL_CTX_set_ecdh_auto(ctx, 1);
@@ -267,6 +292,7 @@ typedef enum {
 #define TLS_CONN_FLAG_READ_WANT_WRITE   (1<<0)
 #define TLS_CONN_FLAG_WRITE_WANT_READ   (1<<1)
 #define TLS_CONN_FLAG_FD_SET            (1<<2)
+#define TLS_CONN_FLAG_KTLS_SEND         (1<<3)
 
 typedef struct tls_connection {
     connection c;
@@ -274,6 +300,10 @@ typedef struct tls_connection {
     SSL *ssl;
     char *ssl_error;
     listNode *pending_list_node;
+    listNode *pending_handshake_node;
+    int accept_ret;             /* Result of the last tlsAcceptStep(). */
+    int accept_err;
+    WantIOType accept_want;
 } tls_connection;
 
 connection *connCreateTLS(void) {
@@ -303,6 +333,48 @@ connection *connCreateAcceptedTLS(int fd, int require_auth) {
 
 static void tlsEventHandler(struct aeEventLoop *el, int fd, void *clientData, int mask);
 
+/* Called once the handshake is done: if OpenSSL handed the keys of the
+ * connection to the kernel (see tls-ktls), the socket encrypts what is
+ * written to it, so writes can skip OpenSSL and use write(2), writev(2) and
+ * sendfile(2) directly. Reads still use SSL_read(), that handles the TLS
+ * control messages the kernel does not. */
+static void tlsHandshakeDone(tls_connection *conn) {
+    conn->c.state = CONN_STATE_CONNECTED;
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl)))
+        conn->flags |= TLS_CONN_FLAG_KTLS_SEND;
+#endif
+}
+
+static int handleSSLReturnCode(tls_connection *conn, int ret_value, WantIOType *want);
+void registerSSLEvent(tls_connection *conn, WantIOType want);
+
+/* Run SSL_accept() on the connection, saving the result in it. This only
+ * touches the connection, so it can be called by the I/O threads. */
+static void tlsAcceptStep(tls_connection *conn) {
+    ERR_clear_error();
+    conn->accept_want = 0;
+    conn->accept_ret = SSL_accept(conn->ssl);
+    conn->accept_err = (conn->accept_ret <= 0) ?
+        handleSSLReturnCode(conn, conn->accept_ret, &conn->accept_want) : 0;
+}
+
+/* Handle the result of tlsAcceptStep(). Returns 0 if the handshake is
+ * still in progress, otherwise 1, and the connection handler should be
+ * called. */
+static int tlsAcceptDone(tls_connection *conn) {
+    if (conn->accept_ret <= 0) {
+        if (!conn->accept_err) {
+            registerSSLEvent(conn, conn->accept_want);
+            return 0;
+        }
+        conn->c.state = CONN_STATE_ERROR;
+    } else {
+        tlsHandshakeDone(conn);
+    }
+    return 1;
+}
+
 /* Process the return code received from OpenSSL>
  * Update the want parameter with expected I/O.
  * Update the connection's error state if a real error has occured.
@@ -409,7 +481,7 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
                     /* If not handled, it's an error */
                     conn->c.state = CONN_STATE_ERROR;
                 } else {
-                    conn->c.state = CONN_STATE_CONNECTED;
+                    tlsHandshakeDone(conn);
                 }
             }
 
@@ -417,24 +489,21 @@ static void tlsHandleEvent(tls_connection *conn, int mask) {
             conn->c.conn_handler = NULL;
             break;
         case CONN_STATE_ACCEPTING:
-            ret = SSL_accept(conn->ssl);
-            if (ret <= 0) {
-                WantIOType want = 0;
-                if (!handleSSLReturnCode(conn, ret, &want)) {
-                    /* Avoid hitting UpdateSSLEvent, which knows nothing
-                     * of what SSL_connect() wants and instead looks at our
-                     * R/W handlers.
-                     */
-                    registerSSLEvent(conn, want);
-                    return;
+            /* With I/O threads the handshake is performed by them before
+             * the event loop sleeps again. */
+            if (server.io_threads_num > 1) {
+                if (!conn->pending_handshake_node) {
+                    listAddNodeTail(pending_handshakes, conn);
+                    conn->pending_handshake_node = listLast(pending_handshakes);
                 }
-
-                /* If not handled, it's an error */
-                conn->c.state = CONN_STATE_ERROR;
-            } else {
-                conn->c.state = CONN_STATE_CONNECTED;
+                return;
             }
 
+            /* Note that tlsAcceptDone() avoids hitting UpdateSSLEvent, which
+             * knows nothing of what SSL_accept() wants and instead looks at
+             * our R/W handlers. */
+            tlsAcceptStep(conn);
+            if (!tlsAcceptDone(conn)) return;
             if (!callHandler((connection *) conn, conn->c.conn_handler)) return;
             conn->c.conn_handler = NULL;
             break;
@@ -525,6 +594,11 @@ static void connTLSClose(connection *conn_) {
         conn->pending_list_node = NULL;
     }
 
+    if (conn->pending_handshake_node) {
+        listDelNode(pending_handshakes, conn->pending_handshake_node);
+        conn->pending_handshake_node = NULL;
+    }
+
     CT_Socket.close(conn_);
 }
 
@@ -537,6 +611,13 @@ static int connTLSAccept(connection *_conn, ConnectionCallbackFunc accept_handle
 
     /* Try to accept */
     conn->c.conn_handler = accept_handler;
+
+    /* With I/O threads, wait for the client hello: the handshake is done
+     * by tlsProcessPendingHandshakes(). */
+    if (server.io_threads_num > 1) {
+        registerSSLEvent(conn, WANT_READ);
+        return C_OK;
+    }
     ret = SSL_accept(conn->ssl);
 
     if (ret <= 0) {
@@ -550,7 +631,7 @@ static int connTLSAccept(connection *_conn, ConnectionCallbackFunc accept_handle
         }
     }
 
-    conn->c.state = CONN_STATE_CONNECTED;
+    tlsHandshakeDone(conn);
     if (!callHandler((connection *) conn, conn->c.conn_handler)) return C_OK;
     conn->c.conn_handler = NULL;
 
@@ -577,6 +658,8 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     int ret, ssl_err;
 
     if (conn->c.state != CONN_STATE_CONNECTED) return -1;
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND)
+        return CT_Socket.write(conn_, data, data_len);
     ERR_clear_error();
     ret = SSL_write(conn->ssl, data, data_len);
 
@@ -602,6 +685,54 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     return ret;
 }
 
+/* SSL has no gather write, and without kernel TLS every SSL_write()
+ * produces at least a record: so the buffers are coalesced into a single
+ * write. A first buffer that fills a record on its own is written directly,
+ * without copying it. */
+static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    tls_connection *conn = (tls_connection *) conn_;
+    char buf[PROTO_IOBUF_LEN];
+    size_t len = 0, copy;
+    int j;
+
+    if (conn->c.state == CONN_STATE_CONNECTED &&
+        (conn->flags & TLS_CONN_FLAG_KTLS_SEND))
+        return CT_Socket.writev(conn_, iov, iovcnt);
+
+    if (iovcnt == 1 || iov[0].iov_len >= sizeof(buf))
+        return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
+    for (j = 0; j < iovcnt && len < sizeof(buf); j++) {
+        copy = iov[j].iov_len;
+        if (copy > sizeof(buf)-len) copy = sizeof(buf)-len;
+        memcpy(buf+len, iov[j].iov_base, copy);
+        len += copy;
+    }
+    return connTLSWrite(conn_, buf, len);
+}
+
+/* Without kernel TLS the file must be encrypted by OpenSSL, so it is just
+ * read and written in chunks. */
+static int connTLSSendfile(connection *conn_, int fd, off_t offset, size_t count) {
+    tls_connection *conn = (tls_connection *) conn_;
+    char buf[PROTO_IOBUF_LEN];
+    ssize_t nread;
+
+    if (conn->c.state != CONN_STATE_CONNECTED) return -1;
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND)
+        return CT_Socket.sendfile(conn_, fd, offset, count);
+
+    nread = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (nread <= 0) {
+        if (nread == 0) return 0;
+        conn->c.last_errno = errno;
+        if (conn->ssl_error) zfree(conn->ssl_error);
+        conn->ssl_error = zstrdup(strerror(errno));
+        conn->c.state = CONN_STATE_ERROR;
+        return -1;
+    }
+    return connTLSWrite(conn_, buf, nread);
+}
+
 static int connTLSRead(connection *conn_, void *buf, size_t buf_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret;
@@ -637,6 +768,7 @@ static const char *connTLSGetLastError(connection *conn_) {
     tls_connection *conn = (tls_connection *) conn_;
 
     if (conn->ssl_error) return conn->ssl_error;
+    if (conn->c.last_errno) return strerror(conn->c.last_errno);
     return NULL;
 }
 
@@ -688,13 +820,16 @@ static int connTLSBlockingConnect(connection *conn_, const char *addr, int port,
     }
     unsetBlockingTimeout(conn);
 
-    conn->c.state = CONN_STATE_CONNECTED;
+    tlsHandshakeDone(conn);
     return C_OK;
 }
 
 static ssize_t connTLSSyncWrite(connection *conn_, char *ptr, ssize_t size, long long timeout) {
     tls_connection *conn = (tls_connection *) conn_;
 
+    if (conn->flags & TLS_CONN_FLAG_KTLS_SEND)
+        return CT_Socket.sync_write(conn_, ptr, size, timeout);
+
     setBlockingTimeout(conn, timeout);
     SSL_clear_mode(conn->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
     int ret = SSL_write(conn->ssl, ptr, size);
@@ -751,6 +886,8 @@ ConnectionType CT_TLS = {
     .blocking_connect = connTLSBlockingConnect,
     .read = connTLSRead,
     .write = connTLSWrite,
+    .writev = connTLSWritev,
+    .sendfile = connTLSSendfile,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,
@@ -777,6 +914,40 @@ void tlsProcessPendingData() {
     }
 }
 
+/* Called by the I/O threads, see handleTLSHandshakesUsingThreads(). */
+void tlsHandshakeStep(connection *conn) {
+    tlsAcceptStep((tls_connection *) conn);
+}
+
+/* Perform the pending handshakes of accepted connections, in parallel using
+ * the I/O threads when possible, so that a storm of clients reconnecting
+ * does not stall the event loop for long. */
+void tlsProcessPendingHandshakes(void) {
+    listIter li;
+    listNode *ln;
+
+    if (!pending_handshakes || !listLength(pending_handshakes)) return;
+
+    if (!handleTLSHandshakesUsingThreads(pending_handshakes)) {
+        listRewind(pending_handshakes,&li);
+        while((ln = listNext(&li)))
+            tlsAcceptStep(listNodeValue(ln));
+    }
+
+    /* Handlers may close other pending connections, removing them from the
+     * list, so always pop the first one. */
+    while((ln = listFirst(pending_handshakes))) {
+        tls_connection *conn = listNodeValue(ln);
+
+        listDelNode(pending_handshakes, ln);
+        conn->pending_handshake_node = NULL;
+        if (!tlsAcceptDone(conn)) continue;
+        if (!callHandler((connection *) conn, conn->c.conn_handler)) continue;
+        conn->c.conn_handler = NULL;
+        updateSSLEvent(conn);
+    }
+}
+
 #else   /* USE_OPENSSL */
 
 void tlsInit(void) {
@@ -805,4 +976,11 @@ int tlsHasPendingData() {
 void tlsProcessPendingData() {
 }
 
+void tlsHandshakeStep(connection *conn) {
+    UNUSED(conn);
+}
+
+void tlsProcessPendingHandshakes(void) {
+}
+
 #endif
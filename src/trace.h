@@ -0,0 +1,68 @@
+/* trace.h -- static tracepoints (USDT) placed in the hot paths of the server.
+ *
+ * The tracepoints are compiled in only when building with "make USE_USDT=yes",
+ * that requires the <sys/sdt.h> header (systemtap-sdt-dev on Debian and
+ * Ubuntu, systemtap-sdt-devel on Fedora and RHEL). An unused tracepoint is a
+ * single nop instruction, plus a note in the ELF file that tools like
+ * bpftrace, perf and systemtap use to attach to it, even to stripped
+ * binaries. When USE_USDT is not given the macros expand to nothing.
+ * The arguments are evaluated even when no tool is attached, so only values
+ * that are already at hand should be passed.
+ *
+ * All the tracepoints use the "redis" provider, for instance the
+ * command_start tracepoint is attached with usdt:./redis-server:redis:command_start
+ * in bpftrace. See utils/bpftrace for some ready to use scripts.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2020, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __REDIS_TRACE_H
+#define __REDIS_TRACE_H
+
+#include "config.h"
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define TRACE(name) DTRACE_PROBE(redis,name)
+#define TRACE1(name,a) DTRACE_PROBE1(redis,name,a)
+#define TRACE2(name,a,b) DTRACE_PROBE2(redis,name,a,b)
+#define TRACE3(name,a,b,c) DTRACE_PROBE3(redis,name,a,b,c)
+#define TRACE4(name,a,b,c,d) DTRACE_PROBE4(redis,name,a,b,c,d)
+
+#else
+#define TRACE(name)
+#define TRACE1(name,a)
+#define TRACE2(name,a,b)
+#define TRACE3(name,a,b,c)
+#define TRACE4(name,a,b,c,d)
+#endif
+
+#endif
@@ -30,49 +30,170 @@
 
 #include "server.h"
 
-/* The tracking table is constituted by 2^24 radix trees (each tree, and the
- * table itself, are allocated in a lazy way only when needed) tracking
- * clients that may have certain keys in their local, client side, cache.
- *
- * Keys are grouped into 2^24 slots, in a way similar to Redis Cluster hash
- * slots, however here the function we use is crc64, taking the least
- * significant 24 bits of the output.
+/* The tracking table is constituted by a radix tree of keys, each pointing
+ * to a radix tree of client IDs, used to track the clients that may have
+ * certain keys in their local, client side, cache.
  *
  * When a client enables tracking with "CLIENT TRACKING on", each key served to
- * the client is hashed to one of such slots, and Redis will remember what
- * client may have keys about such slot. Later, when a key in a given slot is
- * modified, all the clients that may have local copies of keys in that slot
- * will receive an invalidation message. There is no distinction of database
- * number: a single table is used.
+ * the client is remembered in the table mapping the keys to the client IDs.
+ * Later, when a key is modified, all the clients that may have local copy
+ * of such key will receive an invalidation message, so there are no false
+ * positives: a client is only invalidated about keys it really fetched. There
+ * is no distinction of database number: a single table is used.
  *
  * Clients will normally take frequently requested objects in memory, removing
  * them when invalidation messages are received. A strategy clients may use is
  * to just cache objects in a dictionary, associating to each cached object
  * some incremental epoch, or just a timestamp. When invalidation messages are
  * received clients may store, in a different table, the timestamp (or epoch)
- * of the invalidation of such given slot: later when accessing objects, the
+ * of the invalidation of such given key: later when accessing objects, the
  * eviction of stale objects may be performed in a lazy way by checking if the
  * cached object timestamp is older than the invalidation timestamp for such
  * objects.
  *
- * The output of the 24 bit hash function is very large (more than 16 million
- * possible slots), so clients that may want to use less resources may only
- * use the most significant bits instead of the full 24 bits. */
-#define TRACKING_TABLE_SIZE (1<<24)
-rax **TrackingTable = NULL;
-unsigned long TrackingTableUsedSlots = 0;
+ * The table size is bounded by the "tracking-table-max-keys" option: when
+ * there are more keys than that, keys are evicted from the table, and the
+ * clients that fetched them invalidated, the same way as if the keys were
+ * modified. */
+rax *TrackingTable = NULL;
+uint64_t TrackingTableTotalItems = 0; /* Total number of IDs stored across
+                                         the whole tracking table. This gives
+                                         an hint about the total memory we
+                                         are using server side for CSC. */
 robj *TrackingChannelName;
 
+/* The invalidations are not sent ASAP when keys are modified: they are
+ * accumulated in the following radix tree, mapping the ID of each client to
+ * invalidate to the radix tree of the keys to report, and are flushed by
+ * beforeSleep() as a single multi-key message per client. So a big MSET or
+ * a pipeline of writes doesn't produce a small reply for every key. */
+rax *TrackingPendingKeys = NULL;
+
+/* In the broadcasting mode ("CLIENT TRACKING on BCAST") clients don't get
+ * slots invalidations for the keys they read: they subscribe instead to key
+ * prefixes, and receive the names of all the keys modified matching such
+ * prefixes. So no information is remembered about the keys read, and the
+ * false positives of the caching slots are avoided.
+ *
+ * The prefixes are the keys of the PrefixTable radix tree. Every prefix
+ * references the clients subscribed to it, and the keys matching it that
+ * were modified in the current event loop cycle: the invalidation messages
+ * are sent in batches, one per prefix and client, in beforeSleep(). */
+typedef struct bcastState {
+    rax *keys;      /* Keys modified in the current event loop cycle. */
+    rax *clients;   /* Clients subscribed to the notification events for this
+                       prefix. */
+} bcastState;
+
+rax *PrefixTable = NULL;
+size_t PrefixTableMaxLen = 0; /* Length of the longest prefix in the table. */
+
 /* Remove the tracking state from the client 'c'. Note that there is not much
  * to do for us here, if not to decrement the counter of the clients in
  * tracking mode, because we just store the ID of the client in the tracking
  * table, so we'll remove the ID reference in a lazy way. Otherwise when a
  * client with many entries in the table is removed, it would cost a lot of
- * time to do the cleanup. */
+ * time to do the cleanup. The prefixes of the broadcasting mode, that are
+ * few, are instead released ASAP. */
 void disableTracking(client *c) {
-    if (c->flags & CLIENT_TRACKING) {
-        server.tracking_clients--;
-        c->flags &= ~(CLIENT_TRACKING|CLIENT_TRACKING_BROKEN_REDIR);
+    if (!(c->flags & CLIENT_TRACKING)) return;
+
+    if (c->flags & CLIENT_TRACKING_BCAST) {
+        raxIterator ri;
+        raxStart(&ri,c->client_tracking_prefixes);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            bcastState *bs = raxFind(PrefixTable,ri.key,ri.key_len);
+            serverAssert(bs != raxNotFound);
+            raxRemove(bs->clients,(unsigned char*)&c,sizeof(c),NULL);
+            /* Was it the last client? Remove the prefix from the table. */
+            if (raxSize(bs->clients) == 0) {
+                raxFree(bs->clients);
+                raxFree(bs->keys);
+                zfree(bs);
+                raxRemove(PrefixTable,ri.key,ri.key_len,NULL);
+            }
+        }
+        raxStop(&ri);
+        raxFree(c->client_tracking_prefixes);
+        c->client_tracking_prefixes = NULL;
+        if (raxSize(PrefixTable) == 0) PrefixTableMaxLen = 0;
+    }
+
+    server.tracking_clients--;
+    c->flags &= ~(CLIENT_TRACKING|CLIENT_TRACKING_BROKEN_REDIR|
+                  CLIENT_TRACKING_BCAST);
+}
+
+/* Return non-zero if one of the strings is a prefix of the other. */
+static int stringsOverlap(unsigned char *a, size_t alen,
+                          unsigned char *b, size_t blen)
+{
+    return memcmp(a,b,alen < blen ? alen : blen) == 0;
+}
+
+/* Check that the prefixes the client 'c' wants to subscribe to don't
+ * overlap, between themselves or with the prefixes it is already subscribed
+ * to: otherwise the same key would be reported to the client more than
+ * once. Returns C_OK if there are no overlaps, otherwise replies to the
+ * client with an error and returns C_ERR. */
+int checkPrefixCollisionsOrReply(client *c, robj **prefixes, size_t numprefix) {
+    for (size_t i = 0; i < numprefix; i++) {
+        sds p = prefixes[i]->ptr;
+
+        if (c->client_tracking_prefixes) {
+            raxIterator ri;
+            raxStart(&ri,c->client_tracking_prefixes);
+            raxSeek(&ri,"^",NULL,0);
+            while(raxNext(&ri)) {
+                if (ri.key_len == sdslen(p) &&
+                    memcmp(ri.key,p,ri.key_len) == 0) continue;
+                if (stringsOverlap(ri.key,ri.key_len,
+                                   (unsigned char*)p,sdslen(p)))
+                {
+                    addReplyErrorFormat(c,"Prefix '%s' overlaps with an "
+                        "existing prefix '%.*s'. Prefixes for a single "
+                        "client must not overlap.",p,(int)ri.key_len,
+                        (char*)ri.key);
+                    raxStop(&ri);
+                    return C_ERR;
+                }
+            }
+            raxStop(&ri);
+        }
+
+        for (size_t j = i+1; j < numprefix; j++) {
+            sds q = prefixes[j]->ptr;
+            if (stringsOverlap((unsigned char*)p,sdslen(p),
+                               (unsigned char*)q,sdslen(q)))
+            {
+                addReplyErrorFormat(c,"Prefix '%s' overlaps with another "
+                    "provided prefix '%s'. Prefixes for a single client "
+                    "must not overlap.",p,q);
+                return C_ERR;
+            }
+        }
+    }
+    return C_OK;
+}
+
+/* Subscribe the client 'c' to the invalidations of the keys starting
+ * with the specified prefix. */
+static void enableBcastTrackingForPrefix(client *c, unsigned char *prefix, size_t len) {
+    bcastState *bs = raxFind(PrefixTable,prefix,len);
+    /* If this is the first client subscribing to such prefix, create
+     * the prefix in the table. */
+    if (bs == raxNotFound) {
+        bs = zmalloc(sizeof(*bs));
+        bs->keys = raxNew();
+        bs->clients = raxNew();
+        raxInsert(PrefixTable,prefix,len,bs,NULL);
+        if (len > PrefixTableMaxLen) PrefixTableMaxLen = len;
+    }
+    if (raxTryInsert(bs->clients,(unsigned char*)&c,sizeof(c),NULL,NULL)) {
+        if (c->client_tracking_prefixes == NULL)
+            c->client_tracking_prefixes = raxNew();
+        raxInsert(c->client_tracking_prefixes,prefix,len,NULL,NULL);
     }
 }
 
@@ -82,24 +203,40 @@ void disableTracking(client *c) {
  * specified by the 'redirect_to' argument. Note that if such client will
  * eventually get freed, we'll send a message to the original client to
  * inform it of the condition. Multiple clients can redirect the invalidation
- * messages to the same client ID. */
-void enableTracking(client *c, uint64_t redirect_to) {
-    if (c->flags & CLIENT_TRACKING) return;
+ * messages to the same client ID.
+ *
+ * If 'bcast' is non zero the client is put in broadcasting mode, subscribed
+ * to the 'numprefix' prefixes in 'prefixes', or to all the keys if no prefix
+ * is given. Calling the function again for a client already tracking in
+ * broadcasting mode adds the new prefixes. */
+void enableTracking(client *c, uint64_t redirect_to, int bcast, robj **prefixes, size_t numprefix) {
+    if (!(c->flags & CLIENT_TRACKING)) server.tracking_clients++;
     c->flags |= CLIENT_TRACKING;
     c->flags &= ~CLIENT_TRACKING_BROKEN_REDIR;
     c->client_tracking_redirection = redirect_to;
-    server.tracking_clients++;
     if (TrackingTable == NULL) {
-        TrackingTable = zcalloc(sizeof(rax*) * TRACKING_TABLE_SIZE);
+        TrackingTable = raxNew();
+        TrackingPendingKeys = raxNew();
+        PrefixTable = raxNew();
         TrackingChannelName = createStringObject("__redis__:invalidate",20);
     }
+
+    if (bcast) {
+        c->flags |= CLIENT_TRACKING_BCAST;
+        if (numprefix == 0) enableBcastTrackingForPrefix(c,(unsigned char*)"",0);
+        for (size_t j = 0; j < numprefix; j++) {
+            sds sdsprefix = prefixes[j]->ptr;
+            enableBcastTrackingForPrefix(c,(unsigned char*)sdsprefix,
+                                         sdslen(sdsprefix));
+        }
+    }
 }
 
 /* This function is called after the excution of a readonly command in the
  * case the client 'c' has keys tracking enabled. It will populate the
  * tracking ivalidation table according to the keys the user fetched, so that
  * Redis will know what are the clients that should receive an invalidation
- * message with certain groups of keys are modified. */
+ * message when such keys are modified. */
 void trackingRememberKeys(client *c) {
     int numkeys;
     int *keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
@@ -108,19 +245,26 @@ void trackingRememberKeys(client *c) {
     for(int j = 0; j < numkeys; j++) {
         int idx = keys[j];
         sds sdskey = c->argv[idx]->ptr;
-        uint64_t hash = crc64(0,
-            (unsigned char*)sdskey,sdslen(sdskey))&(TRACKING_TABLE_SIZE-1);
-        if (TrackingTable[hash] == NULL) {
-            TrackingTable[hash] = raxNew();
-            TrackingTableUsedSlots++;
+        rax *ids = raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
+        if (ids == raxNotFound) {
+            ids = raxNew();
+            int inserted = raxTryInsert(TrackingTable,(unsigned char*)sdskey,
+                                        sdslen(sdskey),ids,NULL);
+            serverAssert(inserted == 1);
         }
-        raxTryInsert(TrackingTable[hash],
-            (unsigned char*)&c->id,sizeof(c->id),NULL,NULL);
+        if (raxTryInsert(ids,(unsigned char*)&c->id,sizeof(c->id),NULL,NULL))
+            TrackingTableTotalItems++;
     }
     getKeysFreeResult(keys);
 }
 
-void sendTrackingMessage(client *c, long long hash) {
+/* Send to the client 'c' the invalidation message for the key 'keyname',
+ * or, if 'keys' is not NULL, for all the keys in such radix tree. When both
+ * are NULL, a null is sent, that means "all the keys", as it happens when
+ * the databases are flushed. */
+void sendTrackingMessage(client *c, unsigned char *keyname, size_t keylen,
+                         rax *keys)
+{
     int using_redirection = 0;
     if (c->client_tracking_redirection) {
         client *redir = lookupClientByID(c->client_tracking_redirection);
@@ -146,66 +290,141 @@ void sendTrackingMessage(client *c, long long hash) {
     if (c->resp > 2) {
         addReplyPushLen(c,2);
         addReplyBulkCBuffer(c,"invalidate",10);
-        addReplyLongLong(c,hash);
     } else if (using_redirection && c->flags & CLIENT_PUBSUB) {
-        robj *msg = createStringObjectFromLongLong(hash);
-        addReplyPubsubMessage(c,TrackingChannelName,msg);
-        decrRefCount(msg);
+        addReply(c,shared.mbulkhdr[3]);
+        addReply(c,shared.messagebulk);
+        addReplyBulk(c,TrackingChannelName);
+    } else {
+        return;
+    }
+
+    if (keys) {
+        raxIterator ri;
+        addReplyArrayLen(c,raxSize(keys));
+        raxStart(&ri,keys);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri))
+            addReplyBulkCBuffer(c,ri.key,ri.key_len);
+        raxStop(&ri);
+    } else if (keyname) {
+        addReplyArrayLen(c,1);
+        addReplyBulkCBuffer(c,keyname,keylen);
+    } else {
+        addReplyNull(c);
     }
 }
 
-/* Invalidates a caching slot: this is actually the low level implementation
- * of the API that Redis calls externally, that is trackingInvalidateKey(). */
-void trackingInvalidateSlot(uint64_t slot) {
-    if (TrackingTable == NULL || TrackingTable[slot] == NULL) return;
+/* Remember the key modified for the prefixes it matches, so that the
+ * clients subscribed to them will receive it in the next batch of
+ * invalidations. The table is probed once per length up to the longest
+ * prefix: there is no work per prefix, nor per subscribed client. */
+static void trackingRememberKeyToBroadcast(unsigned char *key, size_t keylen) {
+    size_t maxlen = keylen < PrefixTableMaxLen ? keylen : PrefixTableMaxLen;
+    for (size_t len = 0; len <= maxlen; len++) {
+        bcastState *bs = raxFind(PrefixTable,key,len);
+        if (bs != raxNotFound) raxTryInsert(bs->keys,key,keylen,NULL,NULL);
+    }
+}
+
+/* Send the invalidation messages with the keys modified in the last event
+ * loop cycle to the clients in broadcasting mode, one message per prefix
+ * and client. Called by beforeSleep(). */
+void trackingBroadcastInvalidationMessages(void) {
+    raxIterator ri, ri2;
+
+    if (PrefixTable == NULL || raxSize(PrefixTable) == 0) return;
+
+    raxStart(&ri,PrefixTable);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        bcastState *bs = ri.data;
+        if (raxSize(bs->keys) == 0) continue;
+
+        raxStart(&ri2,bs->clients);
+        raxSeek(&ri2,"^",NULL,0);
+        while(raxNext(&ri2)) {
+            client *c;
+            memcpy(&c,ri2.key,sizeof(c));
+            sendTrackingMessage(c,NULL,0,bs->keys);
+        }
+        raxStop(&ri2);
+
+        /* Clean up: we can remove everything from this state, because we
+         * want to only track the new keys that will be accumulated starting
+         * from now. */
+        raxFree(bs->keys);
+        bs->keys = raxNew();
+    }
+    raxStop(&ri);
+}
+
+/* Remove the key from the tracking table, invalidating the clients that
+ * fetched it: the key is added to the pending invalidations of each
+ * client, that will be sent by trackingHandlePendingKeyInvalidations(). */
+static void trackingInvalidateKeyRaw(unsigned char *key, size_t keylen) {
+    rax *ids = raxFind(TrackingTable,key,keylen);
+    if (ids == raxNotFound) return;
 
     raxIterator ri;
-    raxStart(&ri,TrackingTable[slot]);
+    raxStart(&ri,ids);
     raxSeek(&ri,"^",NULL,0);
     while(raxNext(&ri)) {
         uint64_t id;
-        memcpy(&id,ri.key,ri.key_len);
+        memcpy(&id,ri.key,sizeof(id));
         client *c = lookupClientByID(id);
-        if (c == NULL || !(c->flags & CLIENT_TRACKING)) continue;
-        sendTrackingMessage(c,slot);
+        /* Note that if the client is in BCAST mode, we don't want to
+         * send invalidation messages that were pending in the case
+         * previously the client was not in BCAST mode. */
+        if (c == NULL || !(c->flags & CLIENT_TRACKING) ||
+            c->flags & CLIENT_TRACKING_BCAST) continue;
+
+        rax *keys = raxFind(TrackingPendingKeys,ri.key,ri.key_len);
+        if (keys == raxNotFound) {
+            keys = raxNew();
+            raxInsert(TrackingPendingKeys,ri.key,ri.key_len,keys,NULL);
+        }
+        raxTryInsert(keys,key,keylen,NULL,NULL);
     }
     raxStop(&ri);
 
     /* Free the tracking table: we'll create the radix tree and populate it
-     * again if more keys will be modified in this caching slot. */
-    raxFree(TrackingTable[slot]);
-    TrackingTable[slot] = NULL;
-    TrackingTableUsedSlots--;
+     * again if more keys will be fetched by clients. */
+    TrackingTableTotalItems -= raxSize(ids);
+    raxFree(ids);
+    raxRemove(TrackingTable,key,keylen,NULL);
 }
 
 /* This function is called from signalModifiedKey() or other places in Redis
  * when a key changes value. In the context of keys tracking, our task here is
- * to send a notification to every client that may have keys about such caching
- * slot. */
+ * to send a notification to every client that may have such key in its
+ * local cache. */
 void trackingInvalidateKey(robj *keyobj) {
-    if (TrackingTable == NULL || TrackingTableUsedSlots == 0) return;
+    if (TrackingTable == NULL) return;
 
     sds sdskey = keyobj->ptr;
-    uint64_t hash = crc64(0,
-        (unsigned char*)sdskey,sdslen(sdskey))&(TRACKING_TABLE_SIZE-1);
-    trackingInvalidateSlot(hash);
+    if (raxSize(PrefixTable) > 0)
+        trackingRememberKeyToBroadcast((unsigned char*)sdskey,sdslen(sdskey));
+    if (raxSize(TrackingTable) == 0) return;
+
+    /* The invalidation messages are not part of the memory of the DB. */
+    redisDb *prev = dbMemoryAccountingSwitch(NULL);
+    trackingInvalidateKeyRaw((unsigned char*)sdskey,sdslen(sdskey));
+    dbMemoryAccountingSwitch(prev);
 }
 
 /* This function is called when one or all the Redis databases are flushed
- * (dbid == -1 in case of FLUSHALL). Caching slots are not specific for
+ * (dbid == -1 in case of FLUSHALL). Tracked keys are not specific for
  * each DB but are global: currently what we do is sending a special
- * notification to clients with tracking enabled, invalidating the caching
- * slot "-1", which means, "all the keys", in order to avoid flooding clients
- * with many invalidation messages for all the keys they may hold.
+ * notification to clients with tracking enabled, sending a null
+ * invalidation message, which means, "all the keys", in order to avoid
+ * flooding clients with many invalidation messages for all the keys they
+ * may hold.
  *
- * However trying to flush the tracking table here is very costly:
- * we need scanning 16 million caching slots in the table to check
- * if they are used, this introduces a big delay. So what we do is to really
- * flush the table in the case of FLUSHALL. When a FLUSHDB is called instead
- * we just send the invalidation message to all the clients, but don't
- * flush the table: it will slowly get garbage collected as more keys
- * are modified in the used caching slots. */
+ * Since all the clients were asked to drop their whole cache, the tracking
+ * table can be released like in the case of FLUSHALL. */
 void trackingInvalidateKeysOnFlush(int dbid) {
+    UNUSED(dbid);
+
     if (server.tracking_clients) {
         listNode *ln;
         listIter li;
@@ -213,84 +432,121 @@ void trackingInvalidateKeysOnFlush(int dbid) {
         while ((ln = listNext(&li)) != NULL) {
             client *c = listNodeValue(ln);
             if (c->flags & CLIENT_TRACKING) {
-                sendTrackingMessage(c,-1);
+                sendTrackingMessage(c,NULL,0,NULL);
             }
         }
     }
 
-    /* In case of FLUSHALL, reclaim all the memory used by tracking. */
-    if (dbid == -1 && TrackingTable) {
-        for (int j = 0; j < TRACKING_TABLE_SIZE && TrackingTableUsedSlots > 0; j++) {
-            if (TrackingTable[j] != NULL) {
-                raxFree(TrackingTable[j]);
-                TrackingTable[j] = NULL;
-                TrackingTableUsedSlots--;
-            }
-        }
+    /* Reclaim all the memory used by the tracking table. The pending
+     * invalidations are useless as well since all the keys were just
+     * invalidated. */
+    if (TrackingTable) {
+        raxFreeWithCallback(TrackingTable,(void(*)(void*))raxFree);
+        raxFreeWithCallback(TrackingPendingKeys,(void(*)(void*))raxFree);
+        TrackingTableTotalItems = 0;
 
         /* If there are no clients with tracking enabled, we can even
-         * reclaim the memory used by the table itself. The code assumes
-         * the table is allocated only if there is at least one client alive
-         * with tracking enabled. */
+         * reclaim the memory used by the tables themselves. The code assumes
+         * the tables are allocated only if there is at least one client
+         * alive with tracking enabled. */
         if (server.tracking_clients == 0) {
-            zfree(TrackingTable);
             TrackingTable = NULL;
+            TrackingPendingKeys = NULL;
+            raxFree(PrefixTable);
+            PrefixTable = NULL;
+        } else {
+            TrackingTable = raxNew();
+            TrackingPendingKeys = raxNew();
         }
     }
 }
 
+/* Send the invalidation messages accumulated in the current event loop
+ * cycle by trackingInvalidateKeyRaw(), one per client with all its keys.
+ * Called by beforeSleep(). */
+void trackingHandlePendingKeyInvalidations(void) {
+    if (TrackingPendingKeys == NULL || raxSize(TrackingPendingKeys) == 0)
+        return;
+
+    raxIterator ri;
+    raxStart(&ri,TrackingPendingKeys);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        uint64_t id;
+        memcpy(&id,ri.key,sizeof(id));
+        client *c = lookupClientByID(id);
+        /* The client may have disabled tracking, or switched to BCAST
+         * mode, after the keys were modified. */
+        if (c && c->flags & CLIENT_TRACKING &&
+            !(c->flags & CLIENT_TRACKING_BCAST))
+        {
+            sendTrackingMessage(c,NULL,0,ri.data);
+        }
+    }
+    raxStop(&ri);
+    raxFreeWithCallback(TrackingPendingKeys,(void(*)(void*))raxFree);
+    TrackingPendingKeys = raxNew();
+}
+
 /* Tracking forces Redis to remember information about which client may have
- * keys about certian caching slots. In workloads where there are a lot of
- * reads, but keys are hardly modified, the amount of information we have
- * to remember server side could be a lot: for each 16 millions of caching
- * slots we may end with a radix tree containing many entries.
+ * certain keys. In workloads where there are a lot of reads, but keys are
+ * hardly modified, the amount of information we have to remember server side
+ * could be a lot, with the additional problem of being hard to estimate.
  *
- * So Redis allows the user to configure a maximum fill rate for the
+ * So Redis allows the user to configure a maximum number of keys for the
  * invalidation table. This function makes sure that we don't go over the
- * specified fill rate: if we are over, we can just evict informations about
- * random caching slots, and send invalidation messages to clients like if
- * the key was modified. */
-void trackingLimitUsedSlots(void) {
+ * specified number of keys: if we are over, we can just evict informations
+ * about random keys, and send invalidation messages to clients like if
+ * the key was modified. Like for the modified keys, the invalidations of the
+ * evicted keys are then sent in batches, a single message for each client. */
+void trackingLimitUsedKeys(void) {
     static unsigned int timeout_counter = 0;
 
-    if (server.tracking_table_max_fill == 0) return; /* No limits set. */
-    unsigned int max_slots =
-        (TRACKING_TABLE_SIZE/100) * server.tracking_table_max_fill;
-    if (TrackingTableUsedSlots <= max_slots) {
+    if (TrackingTable == NULL) return;
+    if (server.tracking_table_max_keys == 0) return; /* No limits set. */
+    size_t max_keys = server.tracking_table_max_keys;
+    if (raxSize(TrackingTable) <= max_keys) {
         timeout_counter = 0;
         return; /* Limit not reached. */
     }
 
-    /* We have to invalidate a few slots to reach the limit again. The effort
+    /* We have to invalidate a few keys to reach the limit again. The effort
      * we do here is proportional to the number of times we entered this
      * function and found that we are still over the limit. */
     int effort = 100 * (timeout_counter+1);
 
-    /* Let's start at a random position, and perform linear probing, in order
-     * to improve cache locality. However once we are able to find an used
-     * slot, jump again randomly, in order to avoid creating big holes in the
-     * table (that will make this funciton use more resourced later). */
+    /* We just remove one key after another by using a random walk. */
+    raxIterator ri;
+    raxStart(&ri,TrackingTable);
     while(effort > 0) {
-        unsigned int idx = rand() % TRACKING_TABLE_SIZE;
-        do {
-            effort--;
-            idx = (idx+1) % TRACKING_TABLE_SIZE;
-            if (TrackingTable[idx] != NULL) {
-                trackingInvalidateSlot(idx);
-                if (TrackingTableUsedSlots <= max_slots) {
-                    timeout_counter = 0;
-                    return; /* Return ASAP: we are again under the limit. */
-                } else {
-                    break; /* Jump to next random position. */
-                }
-            }
-        } while(effort > 0);
+        effort--;
+        raxSeek(&ri,"^",NULL,0);
+        raxRandomWalk(&ri,0);
+        if (raxEOF(&ri)) break;
+        trackingInvalidateKeyRaw(ri.key,ri.key_len);
+        server.stat_tracking_evicted_keys++;
+        if (raxSize(TrackingTable) <= max_keys) break;
     }
-    timeout_counter++;
+    raxStop(&ri);
+
+    if (raxSize(TrackingTable) <= max_keys)
+        timeout_counter = 0; /* We are again under the limit. */
+    else
+        timeout_counter++;
+}
+
+/* This is just used in order to access the amount of keys in the tracking
+ * table. */
+unsigned long long trackingGetTotalKeys(void) {
+    return TrackingTable ? raxSize(TrackingTable) : 0;
+}
+
+/* Return the total number of client IDs stored in the tracking table. */
+unsigned long long trackingGetTotalItems(void) {
+    return TrackingTableTotalItems;
 }
 
-/* This is just used in order to access the amount of used slots in the
- * tracking table. */
-unsigned long long trackingGetUsedSlots(void) {
-    return TrackingTableUsedSlots;
+/* Return the number of prefixes of the broadcasting mode. */
+unsigned long long trackingGetTotalPrefixes(void) {
+    return PrefixTable ? raxSize(PrefixTable) : 0;
 }
@@ -280,24 +280,62 @@ uint32_t sdigits10(int64_t v) {
     }
 }
 
-/* Convert a long long into a string. Returns the number of
- * characters needed to represent the number.
- * If the buffer is not big enough to store the string, 0 is returned.
+/* Write the 'len' digits of 'value' at 'dst', where 'len' must be
+ * digits10(value). No null term is added, so that the reply functions can
+ * write numbers directly into the client output buffer.
  *
- * Based on the following article (that apparently does not provide a
- * novel approach but only publicizes an already used technique):
+ * Digits are emitted two at a time from a table, as explained in the
+ * following article (that apparently does not provide a novel approach but
+ * only publicizes an already used technique):
  *
  * https://www.facebook.com/notes/facebook-engineering/three-optimization-tips-for-c/10151361643253920
  *
- * Modified in order to handle signed integers since the original code was
- * designed for unsigned integers. */
-int ll2string(char *dst, size_t dstlen, long long svalue) {
+ * Four digits are split at every step of the main loop, so that only one
+ * 64 bit division is needed for them, and the two pairs are independent. */
+void ull2digits(char *dst, uint32_t len, unsigned long long value) {
     static const char digits[201] =
         "0001020304050607080910111213141516171819"
         "2021222324252627282930313233343536373839"
         "4041424344454647484950515253545556575859"
         "6061626364656667686970717273747576777879"
         "8081828384858687888990919293949596979899";
+    char *p = dst+len;
+
+    while (value >= 10000) {
+        uint32_t const r = value % 10000;
+        value /= 10000;
+        uint32_t const hi = (r / 100) * 2, lo = (r % 100) * 2;
+        p -= 4;
+        p[0] = digits[hi];
+        p[1] = digits[hi + 1];
+        p[2] = digits[lo];
+        p[3] = digits[lo + 1];
+    }
+    if (value >= 100) {
+        uint32_t const i = (value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        p[0] = digits[i];
+        p[1] = digits[i + 1];
+    }
+
+    /* Handle last 1-2 digits. */
+    if (value < 10) {
+        p[-1] = '0' + (uint32_t) value;
+    } else {
+        uint32_t const i = (uint32_t) value * 2;
+        p[-2] = digits[i];
+        p[-1] = digits[i + 1];
+    }
+}
+
+/* Convert a long long into a string. Returns the number of
+ * characters needed to represent the number.
+ * If the buffer is not big enough to store the string, 0 is returned.
+ *
+ * See ull2digits() for the conversion, the original code was designed for
+ * unsigned integers so here signed integers are handled. */
+int ll2string(char *dst, size_t dstlen, long long svalue) {
     int negative;
     unsigned long long value;
 
@@ -320,25 +358,8 @@ int ll2string(char *dst, size_t dstlen, long long svalue) {
     if (length >= dstlen) return 0;
 
     /* Null term. */
-    uint32_t next = length;
-    dst[next] = '\0';
-    next--;
-    while (value >= 100) {
-        int const i = (value % 100) * 2;
-        value /= 100;
-        dst[next] = digits[i + 1];
-        dst[next - 1] = digits[i];
-        next -= 2;
-    }
-
-    /* Handle last 1-2 digits. */
-    if (value < 10) {
-        dst[next] = '0' + (uint32_t) value;
-    } else {
-        int i = (uint32_t) value * 2;
-        dst[next] = digits[i + 1];
-        dst[next - 1] = digits[i];
-    }
+    dst[length] = '\0';
+    ull2digits(dst+negative,length-negative,value);
 
     /* Add sign. */
     if (negative) dst[0] = '-';
@@ -509,6 +530,62 @@ int string2d(const char *s, size_t slen, double *dp) {
     return 1;
 }
 
+#if (DBL_MANT_DIG == 53)
+/* Format the finite, non zero double 'value' exactly like "%.17g" does, but
+ * only when it has a short binary fraction, like 1.5 or 0.125: such values
+ * have an exact decimal representation with as many fractional digits as
+ * binary ones, that is computed with integer arithmetic. Returns the length
+ * of the string, or 0 if the value can't be handled this way, so that the
+ * caller can fall back to snprintf().
+ *
+ * The value is handled only if its exact representation has at most 17
+ * significant digits, so that "%.17g" would print it without rounding, and
+ * if it is at least 1e-4, so that it would not use the exponential format. */
+static int d2stringShortFraction(char *buf, size_t len, double value) {
+    static const uint64_t pow5[] = {1,5,25,125,625,3125,15625,78125,390625,
+        1953125,9765625,48828125,244140625,1220703125,6103515625ULL,
+        30517578125ULL,152587890625ULL,762939453125ULL,3814697265625ULL,
+        19073486328125ULL};
+    static const uint64_t maxdigits = 100000000000000000ULL; /* 10^17 */
+    int negative = value < 0, exp;
+    double frac = frexp(negative ? -value : value,&exp);
+    uint64_t mantissa = (uint64_t)ldexp(frac,DBL_MANT_DIG);
+
+    if (negative ? value > -1e-4 : value < 1e-4) return 0;
+
+    /* value = mantissa * 2^(exp-53): remove the trailing zero bits from
+     * the mantissa to get the number of binary fractional digits. */
+    int tz = __builtin_ctzll(mantissa);
+    mantissa >>= tz;
+    int fracdigits = DBL_MANT_DIG-exp-tz;
+    if (fracdigits <= 0 || fracdigits >= (int)(sizeof(pow5)/sizeof(pow5[0])))
+        return 0;
+
+    /* mantissa / 2^k == (mantissa * 5^k) / 10^k */
+    if (mantissa >= maxdigits/pow5[fracdigits]) return 0;
+    uint64_t digits = mantissa*pow5[fracdigits];
+    uint64_t pow10 = 1;
+    for (int j = 0; j < fracdigits; j++) pow10 *= 10;
+    uint64_t ipart = digits/pow10, fpart = digits%pow10;
+
+    /* The mantissa is odd, so the last fractional digit is 5 and there are
+     * no trailing zeros to remove. */
+    uint32_t ilen = digits10(ipart), flen = digits10(fpart);
+    size_t total = negative+ilen+1+fracdigits;
+    if (total >= len) return 0;
+
+    char *p = buf;
+    if (negative) *p++ = '-';
+    ull2digits(p,ilen,ipart);
+    p += ilen;
+    *p++ = '.';
+    memset(p,'0',fracdigits-flen);
+    ull2digits(p+fracdigits-flen,flen,fpart);
+    buf[total] = '\0';
+    return total;
+}
+#endif
+
 /* Convert a double to a string representation. Returns the number of bytes
  * required. The representation should always be parsable by strtod(3).
  * This function does not support human-friendly formatting like ld2string
@@ -542,10 +619,13 @@ int d2string(char *buf, size_t len, double value) {
         double min = -4503599627370495; /* (2^52)-1 */
         double max = 4503599627370496; /* -(2^52) */
         if (value > min && value < max && value == ((double)((long long)value)))
-            len = ll2string(buf,len,(long long)value);
-        else
+            return ll2string(buf,len,(long long)value);
+#endif
+#if (DBL_MANT_DIG == 53)
+        int flen = d2stringShortFraction(buf,len,value);
+        if (flen) return flen;
 #endif
-            len = snprintf(buf,len,"%.17g",value);
+        len = snprintf(buf,len,"%.17g",value);
     }
 
     return len;
@@ -896,6 +976,36 @@ static void test_ll2string(void) {
     assert(!strcmp(buf, "9223372036854775807"));
 }
 
+static void test_d2string(void) {
+    char buf[128], ref[128];
+    double values[] = {0.5, -0.5, 1.5, -1.25, 0.125, 3.0, -42.0,
+        1234567.125, 0.0001220703125, 0.00006103515625, 1e-4, 0.1, -0.3,
+        1.0/3, 4503599627370495.5, 1e16+2, 1e17, 123456789012.0625,
+        6.103515625e-05, 2.2250738585072014e-308, 1.7976931348623157e308};
+    int sz;
+
+    for (size_t j = 0; j < sizeof(values)/sizeof(values[0]); j++) {
+        sz = d2string(buf, sizeof buf, values[j]);
+        snprintf(ref, sizeof ref, "%.17g", values[j]);
+        assert(sz == (int)strlen(ref));
+        assert(!strcmp(buf, ref));
+    }
+
+    sz = d2string(buf, sizeof buf, 0.0);
+    assert(sz == 1 && !strcmp(buf, "0"));
+    sz = d2string(buf, sizeof buf, -0.0);
+    assert(sz == 2 && !strcmp(buf, "-0"));
+
+    /* Random values with short binary fractions, formatted either way. */
+    for (int j = 0; j < 100000; j++) {
+        double v = ldexp((double)(rand()-RAND_MAX/2), -(rand()%24));
+        d2string(buf, sizeof buf, v);
+        snprintf(ref, sizeof ref, "%.17g", v);
+        if (v == 0) strcpy(ref, signbit(v) ? "-0" : "0");
+        assert(!strcmp(buf, ref));
+    }
+}
+
 #define UNUSED(x) (void)(x)
 int utilTest(int argc, char **argv) {
     UNUSED(argc);
@@ -904,6 +1014,7 @@ int utilTest(int argc, char **argv) {
     test_string2ll();
     test_string2l();
     test_ll2string();
+    test_d2string();
     return 0;
 }
 #endif
@@ -38,6 +38,10 @@
  * This should be the size of the buffer given to ld2string */
 #define MAX_LONG_DOUBLE_CHARS 5*1024
 
+/* The maximum number of characters needed to represent a double as a
+ * string with d2string(). */
+#define MAX_D2STRING_CHARS 128
+
 /* long double to string convertion options */
 typedef enum {
     LD_STR_AUTO,     /* %.17Lg */
@@ -51,6 +55,7 @@ int stringmatchlen_fuzz_test(void);
 long long memtoll(const char *p, int *err);
 uint32_t digits10(uint64_t v);
 uint32_t sdigits10(int64_t v);
+void ull2digits(char *dst, uint32_t len, unsigned long long value);
 int ll2string(char *s, size_t len, long long value);
 int string2ll(const char *s, size_t slen, long long *value);
 int string2ull(const char *s, unsigned long long *value);
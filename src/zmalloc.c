@@ -28,6 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -42,6 +43,8 @@ void zlibc_free(void *ptr) {
 
 #include <string.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "zmalloc.h"
 #include "atomicvar.h"
@@ -69,23 +72,69 @@ void zlibc_free(void *ptr) {
 #define free(ptr) je_free(ptr)
 #define mallocx(size,flags) je_mallocx(size,flags)
 #define dallocx(ptr,flags) je_dallocx(ptr,flags)
+#define rallocx(ptr,size,flags) je_rallocx(ptr,size,flags)
 #endif
 
+/* The used memory is accounted in per thread counters, each one in its own
+ * cache line, since with I/O threads, bio threads and module threads all
+ * allocating, a single counter bounces between the cores at every
+ * allocation. Every thread takes a slot the first time it allocates: if
+ * there are more threads than slots some threads share a slot, this is why
+ * the counters are still updated atomically, which is cheap when the cache
+ * line is not contended. Memory allocated by a thread may be freed by
+ * another one, so single counters are meaningless, and may even wrap
+ * around, but their sum, computed by zmalloc_used_memory(), is exact.
+ *
+ * The mutex is only used if atomic builtins are not available: the atomic
+ * macros in atomicvar.h refer to it as the counter name + "_mutex". */
+#define ZMALLOC_USED_MEMORY_SLOTS 16
+#define ZMALLOC_CACHE_LINE_SIZE 64
+
+typedef struct usedMemorySlot {
+    size_t used;
+    pthread_mutex_t used_mutex;
+} __attribute__((aligned(ZMALLOC_CACHE_LINE_SIZE))) usedMemorySlot;
+
+static usedMemorySlot used_memory[ZMALLOC_USED_MEMORY_SLOTS];
+static __thread int used_memory_slot = -1;
+/* Net amount allocated by the calling thread alone, not shared with the
+ * other threads of its slot: see zmalloc_thread_used_memory(). */
+static __thread long long used_memory_thread = 0;
+static unsigned int used_memory_next_slot = 0;
+pthread_mutex_t used_memory_next_slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t used_memory_once = PTHREAD_ONCE_INIT;
+
+static void zmalloc_init_used_memory(void) {
+    for (int j = 0; j < ZMALLOC_USED_MEMORY_SLOTS; j++)
+        pthread_mutex_init(&used_memory[j].used_mutex,NULL);
+}
+
+/* Return the used memory slot of the calling thread. */
+static inline int zmalloc_thread_slot(void) {
+    if (used_memory_slot == -1) {
+        unsigned int slot;
+
+        pthread_once(&used_memory_once,zmalloc_init_used_memory);
+        atomicGetIncr(used_memory_next_slot,slot,1);
+        used_memory_slot = slot % ZMALLOC_USED_MEMORY_SLOTS;
+    }
+    return used_memory_slot;
+}
+
 #define update_zmalloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_memory,__n); \
+    atomicIncr(used_memory[zmalloc_thread_slot()].used,__n); \
+    used_memory_thread += (__n); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_memory,__n); \
+    atomicDecr(used_memory[zmalloc_thread_slot()].used,__n); \
+    used_memory_thread -= (__n); \
 } while(0)
 
-static size_t used_memory = 0;
-pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -209,6 +258,111 @@ void zfree(void *ptr) {
 #endif
 }
 
+/* Allocation functions serving a given allocation class (ZMALLOC_CLASS_*).
+ * With jemalloc every class but the keyspace one gets its own arena, created
+ * the first time the class is used, so that long lived keyspace data is not
+ * interleaved with short lived buffers in the same pages. The dedicated
+ * arenas are not served by the thread caches, that would hand the memory of
+ * a class to the allocations of another one: such allocations are anyway
+ * large or not in the hot path. With other allocators the class is ignored.
+ *
+ * Memory allocated with a class can be freed or reallocated with any of
+ * the zmalloc functions, zfree_class() just returns it to its arena at
+ * once instead of passing by the thread cache. */
+#if defined(USE_JEMALLOC)
+static int zmalloc_class_flags[ZMALLOC_CLASS_COUNT];
+static unsigned zmalloc_class_arena[ZMALLOC_CLASS_COUNT];
+static pthread_once_t zmalloc_class_once = PTHREAD_ONCE_INIT;
+
+static void zmalloc_create_class_arenas(void) {
+    for (int j = 0; j < ZMALLOC_CLASS_COUNT; j++) {
+        unsigned arena;
+        size_t sz = sizeof(arena);
+
+        if (j == ZMALLOC_CLASS_KEYSPACE) continue;
+        /* On failure the class is just served by the default arenas. */
+        if (je_mallctl("arenas.create", &arena, &sz, NULL, 0) != 0) continue;
+        zmalloc_class_arena[j] = arena;
+        zmalloc_class_flags[j] = MALLOCX_ARENA(arena) | MALLOCX_TCACHE_NONE;
+    }
+}
+
+/* Return the mallocx() flags for the class, or 0 if the class is served
+ * by the default arenas. */
+static inline int zmalloc_get_class_flags(int cls) {
+    if (cls == ZMALLOC_CLASS_KEYSPACE) return 0;
+    pthread_once(&zmalloc_class_once, zmalloc_create_class_arenas);
+    return zmalloc_class_flags[cls];
+}
+
+void *zmalloc_class(size_t size, int cls) {
+    int flags = zmalloc_get_class_flags(cls);
+    if (!flags || size == 0) return zmalloc(size);
+
+    void *ptr = mallocx(size, flags);
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void *zcalloc_class(size_t size, int cls) {
+    int flags = zmalloc_get_class_flags(cls);
+    if (!flags || size == 0) return zcalloc(size);
+
+    void *ptr = mallocx(size, flags | MALLOCX_ZERO);
+    if (!ptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_alloc(zmalloc_size(ptr));
+    return ptr;
+}
+
+void *zrealloc_class(void *ptr, size_t size, int cls) {
+    int flags = zmalloc_get_class_flags(cls);
+    if (!flags) return zrealloc(ptr, size);
+    if (ptr == NULL) return zmalloc_class(size, cls);
+    if (size == 0) {
+        zfree_class(ptr, cls);
+        return NULL;
+    }
+
+    size_t oldsize = zmalloc_size(ptr);
+    void *newptr = rallocx(ptr, size, flags);
+    if (!newptr) zmalloc_oom_handler(size);
+    update_zmalloc_stat_free(oldsize);
+    update_zmalloc_stat_alloc(zmalloc_size(newptr));
+    return newptr;
+}
+
+void zfree_class(void *ptr, int cls) {
+    if (ptr == NULL) return;
+    if (!zmalloc_get_class_flags(cls)) {
+        zfree(ptr);
+        return;
+    }
+    update_zmalloc_stat_free(zmalloc_size(ptr));
+    dallocx(ptr, MALLOCX_TCACHE_NONE);
+}
+#else
+void *zmalloc_class(size_t size, int cls) {
+    ((void)(cls));
+    return zmalloc(size);
+}
+
+void *zcalloc_class(size_t size, int cls) {
+    ((void)(cls));
+    return zcalloc(size);
+}
+
+void *zrealloc_class(void *ptr, size_t size, int cls) {
+    ((void)(cls));
+    return zrealloc(ptr, size);
+}
+
+void zfree_class(void *ptr, int cls) {
+    ((void)(cls));
+    zfree(ptr);
+}
+#endif
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -218,11 +372,25 @@ char *zstrdup(const char *s) {
 }
 
 size_t zmalloc_used_memory(void) {
-    size_t um;
-    atomicGet(used_memory,um);
+    size_t um = 0;
+    for (int j = 0; j < ZMALLOC_USED_MEMORY_SLOTS; j++) {
+        size_t slot_um;
+        atomicGet(used_memory[j].used,slot_um);
+        um += slot_um;
+    }
     return um;
 }
 
+/* Return the bytes allocated minus the bytes freed by the calling thread
+ * so far. The value itself is meaningless, and may be negative, since
+ * memory is freed by threads other than the one allocating it, but the
+ * difference between two calls tells how much the memory used changed
+ * because of what the thread did in between, whatever the other threads
+ * were doing meanwhile. */
+long long zmalloc_thread_used_memory(void) {
+    return used_memory_thread;
+}
+
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t)) {
     zmalloc_oom_handler = oom_handler;
 }
@@ -349,6 +517,190 @@ int zmalloc_get_allocator_info(size_t *allocated,
     return 1;
 }
 
+/* Read the allocated, active and resident bytes of the specified arena,
+ * that can be MALLCTL_ARENAS_ALL to get the sum of all the arenas. */
+static int zmalloc_get_arena_info(unsigned arena, size_t *allocated,
+                                  size_t *active, size_t *resident) {
+    char name[64];
+    size_t small, large, pactive, page;
+    size_t sz = sizeof(size_t);
+
+    if (je_mallctl("arenas.page", &page, &sz, NULL, 0)) return 0;
+    snprintf(name, sizeof(name), "stats.arenas.%u.small.allocated", arena);
+    if (je_mallctl(name, &small, &sz, NULL, 0)) return 0;
+    snprintf(name, sizeof(name), "stats.arenas.%u.large.allocated", arena);
+    if (je_mallctl(name, &large, &sz, NULL, 0)) return 0;
+    snprintf(name, sizeof(name), "stats.arenas.%u.pactive", arena);
+    if (je_mallctl(name, &pactive, &sz, NULL, 0)) return 0;
+    snprintf(name, sizeof(name), "stats.arenas.%u.resident", arena);
+    if (je_mallctl(name, resident, &sz, NULL, 0)) return 0;
+    *allocated = small + large;
+    *active = pactive * page;
+    return 1;
+}
+
+/* Like zmalloc_get_allocator_info() but only for the arena of the specified
+ * allocation class. The keyspace class is everything not living in the
+ * arena of another class. The statistics are the ones cached by the last
+ * call to zmalloc_get_allocator_info(), that refreshes them. */
+int zmalloc_get_class_info(int cls, size_t *allocated,
+                           size_t *active, size_t *resident) {
+    *allocated = *resident = *active = 0;
+    if (cls != ZMALLOC_CLASS_KEYSPACE) {
+        /* Served by the default arenas: accounted as keyspace. */
+        if (!zmalloc_get_class_flags(cls)) return 1;
+        return zmalloc_get_arena_info(zmalloc_class_arena[cls],
+                                      allocated, active, resident);
+    }
+
+    if (!zmalloc_get_arena_info(MALLCTL_ARENAS_ALL, allocated, active, resident))
+        return 0;
+    for (int j = 0; j < ZMALLOC_CLASS_COUNT; j++) {
+        size_t a, b, r;
+
+        if (j == ZMALLOC_CLASS_KEYSPACE || !zmalloc_get_class_flags(j)) continue;
+        if (!zmalloc_get_arena_info(zmalloc_class_arena[j], &a, &b, &r)) continue;
+        *allocated -= a < *allocated ? a : *allocated;
+        *active -= b < *active ? b : *active;
+        *resident -= r < *resident ? r : *resident;
+    }
+    return 1;
+}
+
+/* Huge pages for the keyspace. The default arenas, that serve the keyspace
+ * class, get extent hooks carving their extents out of regions aligned to
+ * the huge page size and marked with MADV_HUGEPAGE, so that the kernel backs
+ * them with transparent huge pages. The other classes keep their own arenas
+ * with the default hooks: buffers written all the time stay on regular pages.
+ *
+ * Extents are never unmapped (like jemalloc does anyway with 'retain'), the
+ * hooks just report the failure so that jemalloc keeps them for reuse, while
+ * purging, splitting and merging are still performed by the default hooks. */
+#ifdef MADV_HUGEPAGE
+#define ZMALLOC_HUGEPAGE_SIZE (2*1024*1024)
+#define ZMALLOC_HUGEPAGE_REGION (32*ZMALLOC_HUGEPAGE_SIZE)
+
+static extent_hooks_t *zmalloc_default_hooks;
+static extent_hooks_t zmalloc_hugepage_hooks;
+static pthread_mutex_t zmalloc_hugepage_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *zmalloc_hugepage_next, *zmalloc_hugepage_end;
+static size_t zmalloc_hugepage_mapped = 0;
+
+/* Map a region of at least 'size' bytes aligned to the huge page size. */
+static void *zmalloc_hugepage_map(size_t size) {
+    size_t len = size + ZMALLOC_HUGEPAGE_SIZE;
+    char *p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    /* Trim the excess before and after the aligned region. */
+    char *aligned = (char*)(((uintptr_t)p + ZMALLOC_HUGEPAGE_SIZE - 1) &
+                            ~(uintptr_t)(ZMALLOC_HUGEPAGE_SIZE - 1));
+    if (aligned != p) munmap(p, aligned - p);
+    if (aligned + size != p + len)
+        munmap(aligned + size, (p + len) - (aligned + size));
+    madvise(aligned, size, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static void *zmalloc_hugepage_alloc(extent_hooks_t *hooks, void *new_addr,
+                                    size_t size, size_t alignment, bool *zero,
+                                    bool *commit, unsigned arena_ind) {
+    char *p = NULL;
+    ((void)(hooks));
+    ((void)(arena_ind));
+
+    /* Extending an existing extent in place is not supported. */
+    if (new_addr != NULL) return NULL;
+    if (alignment < 4096) alignment = 4096;
+
+    pthread_mutex_lock(&zmalloc_hugepage_mutex);
+    if (zmalloc_hugepage_next) {
+        p = (char*)(((uintptr_t)zmalloc_hugepage_next + alignment - 1) &
+                    ~(uintptr_t)(alignment - 1));
+        if (p + size > zmalloc_hugepage_end) p = NULL;
+    }
+    if (p == NULL) {
+        /* The rest of the current region is never touched, so it only
+         * costs address space. */
+        size_t len = ZMALLOC_HUGEPAGE_REGION;
+        if (size + alignment > len)
+            len = (size + alignment + ZMALLOC_HUGEPAGE_SIZE - 1) &
+                  ~((size_t)ZMALLOC_HUGEPAGE_SIZE - 1);
+        char *region = zmalloc_hugepage_map(len);
+        if (region) {
+            zmalloc_hugepage_mapped += len;
+            zmalloc_hugepage_next = region;
+            zmalloc_hugepage_end = region + len;
+            p = (char*)(((uintptr_t)region + alignment - 1) &
+                        ~(uintptr_t)(alignment - 1));
+        }
+    }
+    if (p) zmalloc_hugepage_next = p + size;
+    pthread_mutex_unlock(&zmalloc_hugepage_mutex);
+
+    if (p == NULL) return NULL;
+    /* Fresh anonymous memory: zeroed and committed. */
+    *zero = true;
+    *commit = true;
+    return p;
+}
+
+static bool zmalloc_hugepage_dalloc(extent_hooks_t *hooks, void *addr,
+                                    size_t size, bool committed,
+                                    unsigned arena_ind) {
+    ((void)(hooks));
+    ((void)(addr));
+    ((void)(size));
+    ((void)(committed));
+    ((void)(arena_ind));
+    return true; /* Opt out: jemalloc retains the extent. */
+}
+
+/* Install the huge page hooks in the default arenas. Only the extents
+ * allocated from now on are affected, so it should be called at startup.
+ * Returns 0 on success, -1 on error. */
+int zmalloc_enable_keyspace_hugepages(void) {
+    unsigned narenas;
+    size_t sz = sizeof(narenas);
+    char name[64];
+
+    if (zmalloc_default_hooks) return 0;
+    if (je_mallctl("opt.narenas", &narenas, &sz, NULL, 0)) return -1;
+    sz = sizeof(zmalloc_default_hooks);
+    if (je_mallctl("arena.0.extent_hooks", &zmalloc_default_hooks, &sz,
+                   NULL, 0)) return -1;
+    zmalloc_hugepage_hooks = *zmalloc_default_hooks;
+    zmalloc_hugepage_hooks.alloc = zmalloc_hugepage_alloc;
+    zmalloc_hugepage_hooks.dalloc = zmalloc_hugepage_dalloc;
+
+    extent_hooks_t *hooks = &zmalloc_hugepage_hooks;
+    for (unsigned j = 0; j < narenas; j++) {
+        snprintf(name, sizeof(name), "arena.%u.extent_hooks", j);
+        if (je_mallctl(name, NULL, NULL, &hooks, sizeof(hooks))) return -1;
+    }
+    return 0;
+}
+
+/* Bytes of huge page regions mapped for the keyspace arenas so far. */
+size_t zmalloc_get_keyspace_hugepages(void) {
+    size_t mapped;
+
+    pthread_mutex_lock(&zmalloc_hugepage_mutex);
+    mapped = zmalloc_hugepage_mapped;
+    pthread_mutex_unlock(&zmalloc_hugepage_mutex);
+    return mapped;
+}
+#else
+int zmalloc_enable_keyspace_hugepages(void) {
+    return -1;
+}
+
+size_t zmalloc_get_keyspace_hugepages(void) {
+    return 0;
+}
+#endif
+
 void set_jemalloc_bg_thread(int enable) {
     /* let jemalloc do purging asynchronously, required when there's no traffic 
      * after flushdb */
@@ -378,6 +730,13 @@ int zmalloc_get_allocator_info(size_t *allocated,
     return 1;
 }
 
+int zmalloc_get_class_info(int cls, size_t *allocated,
+                           size_t *active, size_t *resident) {
+    ((void)(cls));
+    *allocated = *resident = *active = 0;
+    return 1;
+}
+
 void set_jemalloc_bg_thread(int enable) {
     ((void)(enable));
 }
@@ -386,6 +745,14 @@ int jemalloc_purge() {
     return 0;
 }
 
+int zmalloc_enable_keyspace_hugepages(void) {
+    return -1;
+}
+
+size_t zmalloc_get_keyspace_hugepages(void) {
+    return 0;
+}
+
 #endif
 
 /* Get the sum of the specified field (converted form kb to bytes) in
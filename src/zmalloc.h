@@ -77,17 +77,31 @@
 #define HAVE_DEFRAG
 #endif
 
+/* Allocation classes, see zmalloc_class(). */
+#define ZMALLOC_CLASS_KEYSPACE 0    /* Data set and everything else. */
+#define ZMALLOC_CLASS_TRANSIENT 1   /* Client and replication buffers. */
+#define ZMALLOC_CLASS_MODULE 2      /* Memory allocated by modules. */
+#define ZMALLOC_CLASS_COUNT 3
+
 void *zmalloc(size_t size);
 void *zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
+void *zmalloc_class(size_t size, int cls);
+void *zcalloc_class(size_t size, int cls);
+void *zrealloc_class(void *ptr, size_t size, int cls);
+void zfree_class(void *ptr, int cls);
 char *zstrdup(const char *s);
 size_t zmalloc_used_memory(void);
+long long zmalloc_thread_used_memory(void);
 void zmalloc_set_oom_handler(void (*oom_handler)(size_t));
 size_t zmalloc_get_rss(void);
 int zmalloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+int zmalloc_get_class_info(int cls, size_t *allocated, size_t *active, size_t *resident);
 void set_jemalloc_bg_thread(int enable);
 int jemalloc_purge();
+int zmalloc_enable_keyspace_hugepages(void);
+size_t zmalloc_get_keyspace_hugepages(void);
 size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
 size_t zmalloc_get_memory_size(void);
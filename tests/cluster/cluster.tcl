@@ -57,6 +57,14 @@ proc CI {n field} {
     get_info_field [R $n cluster info] $field
 }
 
+# Return the ID of the master serving the slot according to node 'id'.
+proc slot_owner {id slot} {
+    foreach range [R $id cluster slots] {
+        lassign $range start end master
+        if {$slot >= $start && $slot <= $end} {return [lindex $master 2]}
+    }
+}
+
 # Assuming nodes are reest, this function performs slots allocation.
 # Only the first 'n' nodes are used.
 proc cluster_allocate_slots {n} {
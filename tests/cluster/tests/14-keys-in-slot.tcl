@@ -0,0 +1,102 @@
+# Check the tracking of the keys of every hash slot.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 1 node cluster with a slave" {
+    create_cluster 1 1
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set foo_slot [R 0 cluster keyslot foo]
+set bar_slot [R 0 cluster keyslot bar]
+
+test "Keys are counted in their hash slot" {
+    for {set j 0} {$j < 100} {incr j} {
+        R 0 set "{foo}:$j" $j
+    }
+    for {set j 0} {$j < 50} {incr j} {
+        R 0 lpush "{bar}:$j" $j
+    }
+    R 0 set "{foo}:0" overwritten
+    assert_equal 100 [R 0 cluster countkeysinslot $foo_slot]
+    assert_equal 50 [R 0 cluster countkeysinslot $bar_slot]
+}
+
+test "GETKEYSINSLOT returns the keys of the slot" {
+    set keys [R 0 cluster getkeysinslot $foo_slot 10]
+    assert_equal 10 [llength $keys]
+    foreach k $keys {
+        assert_equal $foo_slot [R 0 cluster keyslot $k]
+    }
+    set keys [R 0 cluster getkeysinslot $bar_slot 1000]
+    assert_equal 50 [llength [lsort -unique $keys]]
+    foreach k $keys {
+        assert_match "{bar}:*" $k
+    }
+}
+
+test "Deleted keys are removed from their hash slot" {
+    for {set j 0} {$j < 30} {incr j} {
+        R 0 del "{foo}:$j"
+    }
+    # Big values are released in the background.
+    for {set j 0} {$j < 10} {incr j} {
+        R 0 rpush "{bar}:$j" {*}[lrepeat 100 x]
+        R 0 unlink "{bar}:$j"
+    }
+    R 0 rename "{bar}:10" "{bar}:renamed"
+    assert_equal 70 [R 0 cluster countkeysinslot $foo_slot]
+    assert_equal 40 [R 0 cluster countkeysinslot $bar_slot]
+    assert_equal 70 [llength [R 0 cluster getkeysinslot $foo_slot 1000]]
+}
+
+test "The slave tracks the keys slots of the data it loaded" {
+    wait_for_condition 1000 50 {
+        [R 1 cluster countkeysinslot $foo_slot] == 70 &&
+        [R 1 cluster countkeysinslot $bar_slot] == 40
+    } else {
+        fail "The slave has different keys in the slots"
+    }
+}
+
+test "The keys slots are rebuilt after DEBUG RELOAD" {
+    R 0 debug reload
+    assert_equal 70 [R 0 cluster countkeysinslot $foo_slot]
+    assert_equal 40 [R 0 cluster countkeysinslot $bar_slot]
+    assert_equal 40 [llength [R 0 cluster getkeysinslot $bar_slot 1000]]
+}
+
+test "CLUSTER KEYSLOT hashes keys of any length" {
+    assert_equal 12182 [R 0 cluster keyslot foo]
+    assert_equal 12739 [R 0 cluster keyslot 123456789]
+    assert_equal 14261 [R 0 cluster keyslot a-longer-key-name:12345]
+    assert_equal 11326 [R 0 cluster keyslot user:{1000}:followers:list]
+    assert_equal [R 0 cluster keyslot 1000] [R 0 cluster keyslot {1000}]
+}
+
+test "Multi keys commands and transactions count their keys" {
+    R 0 mset "{foo}:a" 1 "{foo}:b" 2 "{foo}:a" 3
+    R 0 multi
+    R 0 set "{bar}:a" 1
+    R 0 rpush "{bar}:b" 1
+    R 0 del "{bar}:11"
+    R 0 exec
+    assert_equal 72 [R 0 cluster countkeysinslot $foo_slot]
+    assert_equal 41 [R 0 cluster countkeysinslot $bar_slot]
+    R 0 del "{foo}:a" "{foo}:b"
+    assert_equal 70 [R 0 cluster countkeysinslot $foo_slot]
+}
+
+test "FLUSHALL empties all the slots" {
+    R 0 flushall async
+    assert_equal 0 [R 0 cluster countkeysinslot $foo_slot]
+    assert_equal 0 [R 0 cluster countkeysinslot $bar_slot]
+    assert_equal {} [R 0 cluster getkeysinslot $foo_slot 10]
+    R 0 set "{foo}:1" 1
+    assert_equal 1 [R 0 cluster countkeysinslot $foo_slot]
+    R 0 flushall
+    assert_equal 0 [R 0 cluster countkeysinslot $foo_slot]
+}
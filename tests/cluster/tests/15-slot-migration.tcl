@@ -0,0 +1,147 @@
+# Check the migration of a whole slot with CLUSTER MIGRATESLOT.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 2 nodes cluster with slaves" {
+    create_cluster 2 2
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+proc slot_migration_done {id} {
+    expr {[CI $id cluster_slot_migration_state] eq {none}}
+}
+
+set source_id [R 0 cluster myid]
+set target_id [R 1 cluster myid]
+
+# Find an hash tag served by the first master.
+foreach tag {a b c d e f g h i j k l m n o p q r s t u v w x y z} {
+    set slot [R 0 cluster keyslot "{$tag}"]
+    if {[slot_owner 0 $slot] eq $source_id} break
+}
+
+test "Populate the slot to migrate" {
+    for {set j 0} {$j < 1000} {incr j} {
+        R 0 set "{$tag}:$j" $j
+    }
+    # The list is big enough to fill the socket buffers.
+    R 0 config set rdbcompression no
+    for {set j 0} {$j < 20} {incr j} {
+        R 0 rpush "{$tag}:list" {*}[lrepeat 1000 [string repeat x 1000]]
+    }
+    R 0 set "{$tag}:volatile" value px 100000
+    assert_equal 1002 [R 0 cluster countkeysinslot $slot]
+}
+
+test "The slot is migrated with the writes performed in the meantime" {
+    # Stop the target so that the snapshot can't be transferred while we
+    # write to the slot.
+    set target_pid [get_instance_attrib redis 1 pid]
+    R 0 cluster migrateslot $slot $target_id
+    exec kill -SIGSTOP $target_pid
+    after 100
+    assert_equal snapshot [CI 0 cluster_slot_migration_state]
+    for {set j 0} {$j < 100} {incr j} {
+        R 0 incr "{$tag}:counter"
+        R 0 rpush "{$tag}:list" $j
+    }
+    R 0 del "{$tag}:0"
+    exec kill -SIGCONT $target_pid
+    wait_for_condition 1000 50 {
+        [slot_migration_done 0]
+    } else {
+        fail "The slot migration didn't terminate"
+    }
+    assert_equal 1 [CI 0 cluster_slot_migrations_ok]
+    assert_equal 0 [CI 0 cluster_slot_migrations_failed]
+
+    assert_equal 1002 [R 1 cluster countkeysinslot $slot]
+    assert_equal 100 [R 1 get "{$tag}:counter"]
+    assert_equal 20100 [R 1 llen "{$tag}:list"]
+    assert_equal 99 [R 1 lindex "{$tag}:list" -1]
+    assert_equal {} [R 1 get "{$tag}:0"]
+    assert_equal 999 [R 1 get "{$tag}:999"]
+    set ttl [R 1 pttl "{$tag}:volatile"]
+    assert {$ttl > 0 && $ttl <= 100000}
+}
+
+test "Both the masters agree about the new owner of the slot" {
+    catch {R 0 get "{$tag}:1"} err
+    assert_match "MOVED $slot *" $err
+    foreach id {0 1 2 3} {
+        wait_for_condition 1000 50 {
+            [slot_owner $id $slot] eq $target_id
+        } else {
+            fail "Node $id didn't update the slot owner"
+        }
+    }
+    assert {[CI 1 cluster_my_epoch] > [CI 0 cluster_my_epoch]}
+}
+
+test "The source deletes its copy of the keys, also from its slave" {
+    wait_for_condition 1000 50 {
+        [R 0 cluster countkeysinslot $slot] == 0 &&
+        [R 2 cluster countkeysinslot $slot] == 0
+    } else {
+        fail "The keys were not deleted from the source"
+    }
+    assert_equal 0 [CI 0 cluster_slots_to_purge]
+}
+
+test "The slave of the target receives the slot" {
+    wait_for_condition 1000 50 {
+        [R 3 cluster countkeysinslot $slot] == 1002
+    } else {
+        fail "The slave of the target doesn't have the keys"
+    }
+}
+
+test "Only the owner of the slot can migrate it to another master" {
+    catch {R 0 cluster migrateslot $slot $target_id} err
+    assert_match "*not the owner*" $err
+    catch {R 1 cluster migrateslot $slot $target_id} err
+    assert_match "*another master*" $err
+}
+
+test "A migration failing on the target is aborted" {
+    R 0 config set maxmemory 1
+    R 0 config set maxmemory-policy noeviction
+    R 1 cluster migrateslot $slot $source_id
+    wait_for_condition 1000 50 {
+        [slot_migration_done 1]
+    } else {
+        fail "The slot migration didn't terminate"
+    }
+    R 0 config set maxmemory 0
+    assert_equal 1 [CI 1 cluster_slot_migrations_failed]
+    assert_equal $target_id [slot_owner 1 $slot]
+    assert_equal 1002 [R 1 cluster countkeysinslot $slot]
+    assert_equal 100 [R 1 get "{$tag}:counter"]
+    wait_for_condition 1000 50 {
+        [R 0 cluster countkeysinslot $slot] == 0 &&
+        [CI 0 cluster_slot_import_slot] == -1
+    } else {
+        fail "The target didn't delete the keys of the aborted import"
+    }
+}
+
+test "The slot can be migrated back" {
+    R 1 cluster migrateslot $slot $source_id
+    wait_for_condition 1000 50 {
+        [slot_migration_done 1]
+    } else {
+        fail "The slot migration didn't terminate"
+    }
+    assert_equal 1 [CI 1 cluster_slot_migrations_ok]
+    assert_equal 1002 [R 0 cluster countkeysinslot $slot]
+    assert_equal 100 [R 0 get "{$tag}:counter"]
+    wait_for_condition 1000 50 {
+        [R 1 cluster countkeysinslot $slot] == 0
+    } else {
+        fail "The keys were not deleted from the source"
+    }
+    assert_cluster_state ok
+}
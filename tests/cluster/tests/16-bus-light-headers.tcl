@@ -0,0 +1,80 @@
+# Check the cluster bus messages without the slots bitmap, and the bus
+# bandwidth stats.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "Messages are sent with light headers once the slots are known" {
+    wait_for_condition 1000 50 {
+        [CI 0 cluster_stats_bus_light_headers_sent] > 0
+    } else {
+        fail "No light header was sent"
+    }
+    foreach_redis_id id {
+        assert {[CI $id cluster_stats_bus_bytes_sent] > 0}
+        assert {[CI $id cluster_stats_bus_bytes_received] > 0}
+        assert_equal 3 [CI $id cluster_gossip_sections]
+    }
+}
+
+test "Light headers take less bandwidth" {
+    set msgs [CI 0 cluster_stats_messages_sent]
+    set bytes [CI 0 cluster_stats_bus_bytes_sent]
+    after 2000
+    set msgs [expr {[CI 0 cluster_stats_messages_sent]-$msgs}]
+    set bytes [expr {[CI 0 cluster_stats_bus_bytes_sent]-$bytes}]
+    assert {$msgs > 0}
+    # A full header alone is more than 2k.
+    assert {$bytes/$msgs < 1024}
+}
+
+test "Slots changes are still propagated" {
+    # Give one of the slots of the first master to the second one.
+    set id0 [R 0 cluster myid]
+    set id1 [R 1 cluster myid]
+    foreach range [R 0 cluster slots] {
+        if {[lindex $range 2 2] eq $id0} {
+            set slot [lindex $range 0]
+            break
+        }
+    }
+    R 1 cluster setslot $slot node $id1
+    R 1 cluster bumpepoch
+    foreach_redis_id id {
+        wait_for_condition 1000 50 {
+            [slot_owner $id $slot] eq $id1
+        } else {
+            fail "Node $id didn't learn the new owner of slot $slot"
+        }
+    }
+    assert_cluster_state ok
+}
+
+set current_epoch [CI 1 cluster_current_epoch]
+
+test "Killing one master node" {
+    kill_instance redis 0
+}
+
+test "Wait for failover" {
+    wait_for_condition 1000 50 {
+        [CI 1 cluster_current_epoch] > $current_epoch
+    } else {
+        fail "No failover detected"
+    }
+}
+
+test "Cluster should eventually be up again" {
+    assert_cluster_state ok
+}
+
+test "Restarting the previously killed master node" {
+    restart_instance redis 0
+}
@@ -0,0 +1,80 @@
+# Check MGET of keys in different slots with cluster-cross-slot-reads.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster with slaves" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set cluster [redis_cluster 127.0.0.1:[get_instance_attrib redis 0 port]]
+
+test "MGET of keys in different slots is refused by default" {
+    catch {R 0 mget a b c d e f} err
+    assert_match "*CROSSSLOT*" $err
+}
+
+test "Populate keys in all the masters" {
+    set keys {}
+    set expected {}
+    for {set j 0} {$j < 100} {incr j} {
+        lappend keys key:$j
+        if {$j % 10 == 0} {
+            lappend expected {}
+        } elseif {$j == 99} {
+            # MGET replies with a NULL to keys of the wrong type.
+            $cluster rpush key:$j a
+            lappend expected {}
+        } else {
+            $cluster set key:$j [string repeat v $j]
+            lappend expected [string repeat v $j]
+        }
+    }
+}
+
+foreach_redis_id id {
+    R $id config set cluster-cross-slot-reads yes
+}
+
+test "MGET reads the keys from all the nodes" {
+    foreach id {0 1 2} {
+        assert_equal $expected [R $id mget {*}$keys]
+    }
+    assert_equal 1 [CI 0 cluster_stats_cross_slot_reads]
+}
+
+test "Pipelined MGETs are served in order" {
+    set rd [redis 127.0.0.1 [get_instance_attrib redis 0 port] 1]
+    for {set j 0} {$j < 20} {incr j} {
+        $rd mget key:$j key:[expr {$j+1}] key:[expr {$j+2}]
+        $rd echo $j
+    }
+    for {set j 0} {$j < 20} {incr j} {
+        assert_equal [lrange $expected $j [expr {$j+2}]] [$rd read]
+        assert_equal $j [$rd read]
+    }
+    $rd close
+}
+
+test "READONLY clients of slaves read the slots of their master locally" {
+    set rd [redis 127.0.0.1 [get_instance_attrib redis 3 port]]
+    assert_equal OK [$rd readonly]
+    assert_equal $expected [$rd mget {*}$keys]
+    $rd close
+}
+
+test "MGET fails with TRYAGAIN if a node can't be reached" {
+    kill_instance redis 2
+    catch {R 0 mget {*}$keys} err
+    assert_match "TRYAGAIN*" $err
+    restart_instance redis 2
+    wait_for_condition 1000 50 {
+        [catch {R 0 mget {*}$keys} reply] == 0
+    } else {
+        fail "The MGET still fails"
+    }
+    assert_equal $expected $reply
+}
@@ -0,0 +1,86 @@
+# Check the output of CLUSTER SHARDS.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster with slaves" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the description of the node 'name' from the CLUSTER SHARDS output
+# of the node 'id'.
+proc shard_node {id name} {
+    foreach shard [R $id cluster shards] {
+        foreach node [dict get $shard nodes] {
+            if {[dict get $node id] eq $name} {return $node}
+        }
+    }
+}
+
+test "CLUSTER SHARDS lists every master with its slots and slaves" {
+    set numslots 0
+    set numshards 0
+    foreach shard [R 0 cluster shards] {
+        # The other instances are masters without slots.
+        if {[dict get $shard slots] eq {}} continue
+        incr numshards
+        foreach {start end} [dict get $shard slots] {
+            incr numslots [expr {$end-$start+1}]
+        }
+        set nodes [dict get $shard nodes]
+        assert_equal 2 [llength $nodes]
+        assert_equal master [dict get [lindex $nodes 0] role]
+        assert_equal replica [dict get [lindex $nodes 1] role]
+        foreach node $nodes {
+            assert_equal online [dict get $node health]
+            assert_equal 127.0.0.1 [dict get $node ip]
+            assert {[dict get $node port] > 0}
+        }
+    }
+    assert_equal 3 $numshards
+    assert_equal 16384 $numslots
+}
+
+test "The slaves catch up with the offset of their master" {
+    for {set j 0} {$j < 100} {incr j} {
+        catch {R 0 set key:$j $j}
+    }
+    foreach id {0 1 2 3 4 5} {
+        wait_for_condition 1000 50 {
+            [dict get [shard_node 0 [R $id cluster myid]] replication-lag] == 0 &&
+            [dict get [shard_node 0 [R $id cluster myid]] replication-offset] > 0
+        } else {
+            fail "Node $id is still lagging"
+        }
+    }
+}
+
+test "The nodes advertise their load" {
+    set myid [R 1 cluster myid]
+    wait_for_condition 1000 50 {
+        [R 1 ping] eq {PONG} &&
+        [dict get [shard_node 0 $myid] load] > 0
+    } else {
+        fail "The load of node 1 is not known"
+    }
+}
+
+test "A slave not in sync with its master is advertised as syncing" {
+    set myid [R 3 cluster myid]
+    R 3 config set masterauth wrongpassword
+    R 3 client kill type master
+    wait_for_condition 1000 50 {
+        [dict get [shard_node 0 $myid] health] eq {syncing}
+    } else {
+        fail "The slave is not advertised as syncing"
+    }
+    R 3 config set masterauth ""
+    wait_for_condition 1000 50 {
+        [dict get [shard_node 0 $myid] health] eq {online}
+    } else {
+        fail "The slave is not advertised as online again"
+    }
+}
@@ -0,0 +1,78 @@
+# Check the failover of masters with cluster-fast-failover-timeout.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 5 nodes cluster" {
+    create_cluster 5 5
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+test "Instance #5 synced with the master" {
+    wait_for_condition 1000 50 {
+        [RI 5 master_link_status] eq {up}
+    } else {
+        fail "Instance #5 master link status is not up"
+    }
+}
+
+foreach_redis_id id {
+    R $id config set cluster-fast-failover-timeout 500
+}
+
+test "Masters are probed without gossip" {
+    # Let the probes flow for a while.
+    after 2000
+    assert_cluster_state ok
+    assert_equal 0 [CI 5 cluster_stats_failovers]
+}
+
+test "Killing one master node fails it over faster than the node timeout" {
+    set current_epoch [CI 1 cluster_current_epoch]
+    set start [clock milliseconds]
+    kill_instance redis 0
+    wait_for_condition 1000 10 {
+        [RI 5 role] eq {master}
+    } else {
+        fail "No failover detected"
+    }
+    set elapsed [expr {[clock milliseconds]-$start}]
+    # The node timeout is 3 seconds here.
+    assert {$elapsed < 3000}
+    assert {[CI 1 cluster_current_epoch] > $current_epoch}
+}
+
+test "The failover timing is reported" {
+    assert_equal 1 [CI 5 cluster_stats_failovers]
+    set total [CI 5 cluster_last_failover_time]
+    set election [CI 5 cluster_last_failover_election_time]
+    assert {$total > 0 && $total < 3000}
+    assert {$election >= 0 && $election <= $total}
+    assert {[CI 1 cluster_last_fail_detection_time] > 0}
+}
+
+test "Cluster should eventually be up again" {
+    assert_cluster_state ok
+}
+
+test "Cluster is writable" {
+    cluster_write_test 1
+}
+
+test "Restarting the previously killed master node" {
+    restart_instance redis 0
+}
+
+test "Instance #0 gets converted into a slave" {
+    wait_for_condition 1000 50 {
+        [RI 0 role] eq {slave}
+    } else {
+        fail "Old master was not converted into slave"
+    }
+}
+
+foreach_redis_id id {
+    R $id config set cluster-fast-failover-timeout 0
+}
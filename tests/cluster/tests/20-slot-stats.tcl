@@ -0,0 +1,105 @@
+# Check the per slot stats and the hot keys.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 0
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the stats of the slot in a CLUSTER SLOT-STATS reply as a dict.
+proc slot_stats {reply slot} {
+    foreach entry $reply {
+        if {[lindex $entry 0] == $slot} {return [lindex $entry 1]}
+    }
+    return {}
+}
+
+set slot [R 0 cluster keyslot "{x}"]
+set owner 0
+foreach id {0 1 2} {
+    if {[slot_stats [R $id cluster slot-stats slotsrange $slot $slot] $slot] ne {}} {
+        set owner $id
+    }
+}
+
+test "Only the slots served by the node are reported" {
+    set served 0
+    foreach id {0 1 2} {
+        incr served [llength [R $id cluster slot-stats slotsrange 0 16383]]
+    }
+    assert_equal 16384 $served
+}
+
+test "The commands accessing a slot are accounted" {
+    R $owner cluster slot-stats reset
+    R $owner set "{x}a" [string repeat v 100]
+    R $owner get "{x}a"
+    R $owner mset "{x}b" 1 "{x}c" 2
+    set stats [slot_stats [R $owner cluster slot-stats slotsrange $slot $slot] $slot]
+    assert_equal 3 [dict get $stats key-count]
+    assert_equal 3 [dict get $stats ops]
+    # Arguments: SET + key + value, GET + key, MSET + keys + values.
+    assert_equal [expr {3+4+100 + 3+4 + 4+4+1+4+1}] [dict get $stats network-bytes-in]
+    # Replies: +OK, the bulk value, +OK.
+    assert_equal [expr {5 + 6+100+2 + 5}] [dict get $stats network-bytes-out]
+}
+
+test "Transactions are accounted once in their slot" {
+    set rd [redis [get_instance_attrib redis $owner host] [get_instance_attrib redis $owner port]]
+    $rd multi
+    $rd incr "{x}counter"
+    $rd incr "{x}counter"
+    $rd exec
+    $rd close
+    set stats [slot_stats [R $owner cluster slot-stats slotsrange $slot $slot] $slot]
+    assert_equal 4 [dict get $stats ops]
+}
+
+test "Slots can be ordered by load" {
+    R $owner cluster slot-stats reset
+    for {set j 0} {$j < 50} {incr j} {
+        R $owner incr "{x}counter"
+    }
+    set top [R $owner cluster slot-stats orderby ops limit 1]
+    assert_equal 1 [llength $top]
+    assert_equal $slot [lindex $top 0 0]
+    assert_equal 50 [dict get [lindex $top 0 1] ops]
+    set bottom [R $owner cluster slot-stats orderby ops limit 3 asc]
+    assert_equal 3 [llength $bottom]
+    assert_equal 0 [dict get [lindex $bottom 0 1] ops]
+    catch {R $owner cluster slot-stats orderby foo} err
+    assert_match "*Unknown metric*" $err
+}
+
+test "The hot keys are detected" {
+    R $owner config set cluster-hotkeys-sampling 1
+    R $owner cluster slot-stats reset
+    for {set j 0} {$j < 200} {incr j} {
+        R $owner incr "{x}hot"
+        if {$j % 10 == 0} {R $owner incr "{x}warm"}
+        R $owner set "{x}cold:$j" 1
+    }
+    set hotkeys [R $owner cluster hotkeys 2]
+    assert_equal 2 [llength $hotkeys]
+    assert_equal "{x}hot" [lindex $hotkeys 0 0]
+    assert {[lindex $hotkeys 0 1] >= 200}
+    assert_equal "{x}warm" [lindex $hotkeys 1 0]
+    assert {[llength [R $owner cluster hotkeys]] <= 32}
+    R $owner config set cluster-hotkeys-sampling 10
+}
+
+test "The stats of a slot are reset when it moves to another node" {
+    set other [expr {($owner+1)%3}]
+    R $owner flushall
+    R $owner get "{x}a"
+    R $owner cluster setslot $slot node [R $other cluster myid]
+    assert_equal {} [R $owner cluster slot-stats slotsrange $slot $slot]
+    R $owner cluster setslot $slot node [R $owner cluster myid]
+    set stats [slot_stats [R $owner cluster slot-stats slotsrange $slot $slot] $slot]
+    assert_equal 0 [dict get $stats ops]
+    R $other cluster setslot $slot node [R $owner cluster myid]
+}
@@ -0,0 +1,66 @@
+# Test sharded pub/sub: channels are routed like keys, and messages are
+# delivered to the subscribers of the master and of its replicas.
+
+source "../tests/includes/init-tests.tcl"
+
+test "Create a 3 nodes cluster" {
+    create_cluster 3 3
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+# Return the instance IDs of the master serving 'channel' and of its replica.
+proc channel_owners {channel} {
+    set slot [R 0 cluster keyslot $channel]
+    foreach range [R 0 cluster slots] {
+        lassign $range start end master replica
+        if {$slot >= $start && $slot <= $end} {
+            return [list \
+                [get_instance_id_by_port redis [lindex $master 1]] \
+                [get_instance_id_by_port redis [lindex $replica 1]]]
+        }
+    }
+}
+
+proc deferring_client {id} {
+    redis 127.0.0.1 [get_instance_attrib redis $id port] 1
+}
+
+test "SPUBLISH is redirected to the node serving the channel slot" {
+    lassign [channel_owners chan] master replica
+    set other [expr {$master == 0 ? 1 : 0}]
+    catch {R $other spublish chan hello} err
+    assert_match {MOVED*} $err
+    catch {R $master ssubscribe chan chan2} err
+    assert_match {CROSSSLOT*} $err
+}
+
+test "Sharded messages reach the subscribers of master and replicas" {
+    lassign [channel_owners chan] master replica
+    set rd_m [deferring_client $master]
+    set rd_r [deferring_client $replica]
+    $rd_m ssubscribe chan
+    $rd_r ssubscribe chan
+    assert_equal {ssubscribe chan 1} [$rd_m read]
+    assert_equal {ssubscribe chan 1} [$rd_r read]
+    assert_equal 1 [R $master spublish chan hello]
+    assert_equal {smessage chan hello} [$rd_m read]
+    assert_equal {smessage chan hello} [$rd_r read]
+    $rd_m close
+    $rd_r close
+}
+
+test "Subscribers are unsubscribed when the slot moves away" {
+    lassign [channel_owners chan] master replica
+    set other [expr {$master == 0 ? 1 : 0}]
+    set rd_m [deferring_client $master]
+    $rd_m ssubscribe chan
+    assert_equal {ssubscribe chan 1} [$rd_m read]
+    set slot [R $master cluster keyslot chan]
+    R $other cluster setslot $slot node [R $other cluster myid]
+    R $other cluster bumpepoch
+    assert_equal {sunsubscribe chan 0} [$rd_m read]
+    $rd_m close
+}
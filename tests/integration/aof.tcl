@@ -22,6 +22,38 @@ proc start_server_aof {overrides code} {
     kill_server $srv
 }
 
+# Run redis-check-aof with tiny chunks, so that the AOF tail is split
+# among several threads even if small. Returns the output and the position
+# the AOF is valid up to.
+proc check_aof_in_chunks {{fix 0}} {
+    upvar aof_path aof_path
+    set ::env(REDIS_CHECK_AOF_MIN_CHUNK) 64
+    if {$fix} {
+        catch {exec src/redis-check-aof --fix $aof_path << "y\n"} result
+    } else {
+        catch {exec src/redis-check-aof $aof_path} result
+    }
+    unset ::env(REDIS_CHECK_AOF_MIN_CHUNK)
+    regexp {ok_up_to=([0-9]+)} $result -> okpos
+    list $result $okpos
+}
+
+# Commands whose value looks like the start of a command, so that the
+# threads checking the chunks starting inside it guess wrong.
+proc aof_commands_with_fake_starts {} {
+    set aof ""
+    for {set j 0} {$j < 50} {incr j} {
+        append aof [formatCommand set key:$j $j]
+    }
+    append aof [formatCommand set fake [string repeat "\r\n*3\r\n\$3\r\nset\r\n" 40]]
+    append aof [formatCommand multi]
+    for {set j 0} {$j < 50} {incr j} {
+        append aof [formatCommand incr counter]
+    }
+    append aof [formatCommand exec]
+    set _ $aof
+}
+
 tags {"aof"} {
     ## Server can start when aof-load-truncated is set to yes and AOF
     ## is truncated, with an incomplete MULTI block.
@@ -288,4 +320,217 @@ tags {"aof"} {
             }
         }
     }
+
+    ## Arguments bigger than the read block, and commands across blocks.
+    create_aof {
+        append_to_aof [formatCommand set big [string repeat x 3000000]]
+        for {set j 0} {$j < 20000} {incr j} {
+            append_to_aof [formatCommand rpush list [string repeat y [expr {$j % 200}]]]
+        }
+        append_to_aof [formatCommand set last ok]
+    }
+
+    start_server_aof [list dir $server_path] {
+        test "AOF with big arguments and many commands is loaded" {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal 3000000 [$client strlen big]
+            assert_equal 20000 [$client llen list]
+            assert_equal 199 [string length [$client lindex list 199]]
+            assert_equal ok [$client get last]
+        }
+    }
+
+    ## Multi part AOF: a rewrite only writes a new base while the writes go
+    ## to a new increment, and both are loaded back at startup.
+    set mp_path [tmpdir server.aof.multipart]
+    start_server_aof [list dir $mp_path aof-multi-part yes] {
+        test {Multi part AOF: rewrite produces a new base and increment} {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            for {set j 0} {$j < 100} {incr j} {
+                $client rpush list $j
+                $client incr counter
+            }
+            $client bgrewriteaof
+            wait_for_condition 50 100 {
+                [string match {*aof_rewrite_in_progress:0*} [$client info persistence]]
+            } else {
+                fail "AOF rewrite did not finish."
+            }
+            for {set j 0} {$j < 100} {incr j} {
+                $client rpush list $j
+                $client incr counter
+            }
+            $client select 9
+            $client set foo bar
+            set fp [open $mp_path/appendonly.aof.manifest r]
+            set manifest [read $fp]
+            close $fp
+            assert_match "*appendonly.aof.2.base seq 2 type b*appendonly.aof.2.incr seq 2 type i*" $manifest
+            assert {![file exists $mp_path/appendonly.aof.1.incr]}
+            assert {[file size $mp_path/appendonly.aof.2.incr] > 0}
+            set ::mp_digest [$client debug digest]
+            $client debug loadaof
+            assert_equal $::mp_digest [$client debug digest]
+        }
+    }
+
+    start_server_aof [list dir $mp_path aof-multi-part yes] {
+        test {Multi part AOF: base and increments are loaded at startup} {
+            set client [redis [dict get $srv host] [dict get $srv port] 0 $::tls]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal $::mp_digest [$client debug digest]
+            assert_equal 201 [$client incr counter]
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} appendfsync no}} {
+        test {WAITAOF returns once the writes are fsynced} {
+            r set foo bar
+            assert_equal 1 [r waitaof 0]
+            set rd [redis_deferring_client]
+            $rd incr x
+            $rd waitaof 0
+            assert_equal 1 [$rd read]
+            assert_equal 1 [$rd read]
+            $rd close
+        }
+
+        test {WAITAOF times out while the fsync can't be performed} {
+            r config set no-appendfsync-on-rewrite yes
+            r debug populate 1000
+            r config set rdb-key-save-delay 100000
+            r bgsave
+            r set foo bar2
+            assert_equal 0 [r waitaof 100]
+            # Kill the saving child, so that the fsync can start.
+            r config set rdb-key-save-delay 0
+            r config set no-appendfsync-on-rewrite no
+            r flushall
+            assert_equal 1 [r waitaof 0]
+        }
+    }
+
+    start_server {overrides {appendonly {no}}} {
+        test {WAITAOF is refused when the AOF is disabled} {
+            assert_error "*AOF is not enabled*" {r waitaof 0}
+        }
+    }
+
+    start_server {overrides {appendonly {yes} appendfilename {appendonly.aof} aof-background-write yes}} {
+        test {AOF written by the background writer is loaded back} {
+            r config set rdb-key-save-delay 100
+            r debug populate 1000
+            r bgrewriteaof
+            for {set j 0} {$j < 1000} {incr j} {
+                r rpush list $j
+                r incr counter
+            }
+            assert_equal 1 [r waitaof 0]
+            wait_for_condition 50 100 {
+                [s aof_rewrite_in_progress] == 0
+            } else {
+                fail "AOF rewrite did not finish."
+            }
+            r set foo bar
+            wait_for_condition 50 100 {
+                [s aof_writer_pending_chunks] == 0
+            } else {
+                fail "AOF writer did not write the queued chunks."
+            }
+            assert_equal 0 [s aof_writer_pending_bytes]
+            set digest [r debug digest]
+            r debug loadaof
+            assert_equal $digest [r debug digest]
+        }
+    }
+
+    test {redis-check-aof: a valid AOF checked in chunks} {
+        set aof [aof_commands_with_fake_starts]
+        create_aof {append_to_aof $aof}
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*Checking the AOF commands in * chunks*" $result
+        assert_match "*AOF is valid*" $result
+        assert_equal [string length $aof] $okpos
+    }
+
+    test {redis-check-aof: a MULTI without EXEC spanning the chunks} {
+        set aof [aof_commands_with_fake_starts]
+        create_aof {
+            append_to_aof $aof
+            append_to_aof [formatCommand multi]
+            for {set j 0} {$j < 50} {incr j} {
+                append_to_aof [formatCommand set key:$j $j]
+            }
+        }
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*Reached EOF before reading EXEC for MULTI*" $result
+        assert_equal [string length $aof] $okpos
+    }
+
+    test {redis-check-aof: nested MULTI and unexpected EXEC in the chunks} {
+        set aof [aof_commands_with_fake_starts]
+        create_aof {
+            append_to_aof $aof
+            append_to_aof [formatCommand multi]
+            for {set j 0} {$j < 20} {incr j} {
+                append_to_aof [formatCommand set key:$j $j]
+            }
+            append_to_aof [formatCommand multi]
+            append_to_aof [formatCommand exec]
+        }
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*Unexpected MULTI*" $result
+        assert_equal [string length $aof] $okpos
+
+        create_aof {
+            append_to_aof $aof
+            append_to_aof [formatCommand exec]
+            append_to_aof [formatCommand set foo bar]
+        }
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*Unexpected EXEC*" $result
+        assert_equal [string length $aof] $okpos
+    }
+
+    test {redis-check-aof: a truncated command in the last chunk is fixed} {
+        set aof [aof_commands_with_fake_starts]
+        create_aof {
+            append_to_aof $aof
+            append_to_aof [string range [formatCommand set foo bar] 0 end-3]
+        }
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*AOF is not valid*" $result
+        assert_equal [string length $aof] $okpos
+        lassign [check_aof_in_chunks 1] result okpos
+        assert_match "*Successfully truncated AOF*" $result
+        lassign [check_aof_in_chunks] result okpos
+        assert_match "*AOF is valid*" $result
+        file size $aof_path
+    } [string length [aof_commands_with_fake_starts]]
+
+    test {redis-check-aof: numbers must be followed by CRLF} {
+        set aof [formatCommand set foo bar]
+        foreach {bad err} [list "* 1\r\n\$4\r\nping\r\n" {a number} \
+                                "*1\r\n\$ 4\r\nping\r\n" {a number} \
+                                "*\r\n" {a number} \
+                                "*1 \r\n\$4\r\nping\r\n" {\\r\\n} \
+                                "*1\r\n\$4x\r\nping\r\n" {\\r\\n}] {
+            create_aof {
+                append_to_aof $aof
+                append_to_aof $bad
+            }
+            catch {exec src/redis-check-aof $aof_path} result
+            assert_match "*Expected $err*AOF is not valid*" $result
+            assert_match "*ok_up_to=[string length $aof],*" $result
+        }
+    }
 }
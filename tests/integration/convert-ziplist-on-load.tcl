@@ -0,0 +1,46 @@
+# Copy RDB with ziplist encoded hash and sorted set to server path
+set server_path [tmpdir "server.convert-ziplist-on-load"]
+
+exec cp -f tests/assets/hash-ziplist.rdb $server_path
+start_server [list overrides [list "dir" $server_path "dbfilename" "hash-ziplist.rdb"]] {
+  test "RDB load ziplist hash: converts to listpack" {
+    r select 0
+
+    assert_encoding listpack hash
+    assert_equal 3 [r hlen hash]
+    assert_match {v1 v2 100} [r hmget hash f1 f2 f3]
+    assert_equal 101 [r hincrby hash f3 1]
+  }
+}
+
+exec cp -f tests/assets/hash-ziplist.rdb $server_path
+start_server [list overrides [list "dir" $server_path "dbfilename" "hash-ziplist.rdb" "hash-max-ziplist-entries" 1]] {
+  test "RDB load ziplist hash: converts to hash table when hash-max-ziplist-entries is exceeded" {
+    r select 0
+
+    assert_encoding hashtable hash
+    assert_equal 3 [r hlen hash]
+    assert_match {v1 v2 100} [r hmget hash f1 f2 f3]
+  }
+}
+
+exec cp -f tests/assets/zset-ziplist.rdb $server_path
+start_server [list overrides [list "dir" $server_path "dbfilename" "zset-ziplist.rdb"]] {
+  test "RDB load ziplist zset: converts to listpack" {
+    r select 0
+
+    assert_encoding listpack zset
+    assert_equal {one 1 two 2 3 3} [r zrange zset 0 -1 withscores]
+    assert_equal 3 [r zscore zset 3]
+  }
+}
+
+exec cp -f tests/assets/zset-ziplist.rdb $server_path
+start_server [list overrides [list "dir" $server_path "dbfilename" "zset-ziplist.rdb" "zset-max-ziplist-entries" 1]] {
+  test "RDB load ziplist zset: converts to skiplist when zset-max-ziplist-entries is exceeded" {
+    r select 0
+
+    assert_encoding skiplist zset
+    assert_equal {one 1 two 2 3 3} [r zrange zset 0 -1 withscores]
+  }
+}
@@ -23,6 +23,271 @@ start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rd
 }
 }
 
+set server_path [tmpdir "server.rdb-threaded-encoding-test"]
+exec cp tests/assets/encodings.rdb $server_path
+
+start_server [list overrides [list "dir" $server_path "dbfilename" "encodings.rdb" "rdb-load-threads" 4]] {
+  test "RDB encoding loading test with rdb-load-threads" {
+    r select 0
+    csvdump r
+  } {"0","compressible","string","aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+"0","hash","hash","a","1","aa","10","aaa","100","b","2","bb","20","bbb","200","c","3","cc","30","ccc","300","ddd","400","eee","5000000000",
+"0","hash_zipped","hash","a","1","b","2","c","3",
+"0","list","list","1","2","3","a","b","c","100000","6000000000","1","2","3","a","b","c","100000","6000000000","1","2","3","a","b","c","100000","6000000000",
+"0","list_zipped","list","1","2","3","a","b","c","100000","6000000000",
+"0","number","string","10"
+"0","set","set","1","100000","2","3","6000000000","a","b","c",
+"0","set_zipped_1","set","1","2","3","4",
+"0","set_zipped_2","set","100000","200000","300000","400000",
+"0","set_zipped_3","set","1000000000","2000000000","3000000000","4000000000","5000000000","6000000000",
+"0","string","string","Hello World"
+"0","zset","zset","a","1","b","2","c","3","aa","10","bb","20","cc","30","aaa","100","bbb","200","ccc","300","aaaa","1000","cccc","123456789","bbbb","5000000000",
+"0","zset_zipped","zset","a","1","b","2","c","3",
+}
+}
+
+set server_path [tmpdir "server.rdb-threads-test"]
+
+start_server [list overrides [list "dir" $server_path "rdb-load-threads" 4 "rdb-save-threads" 4]] {
+    test {RDB save and load with threads keep the dataset} {
+        createComplexDataset r 10000
+        # Big values, so that the aggregates are not ziplist or intset
+        # encoded and the strings are compressed.
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush biglist [string repeat $j 10]
+            r sadd bigset [string repeat $j 10]
+            r zadd bigzset $j [string repeat $j 10]
+            r hset bighash [string repeat $j 10] $j
+        }
+        for {set j 0} {$j < 100} {incr j} {
+            r set compressed:$j [string repeat x 1000]
+            r setex volatile:$j 1000 $j
+        }
+        r xadd stream * field value
+        r select 10
+        r set otherdb value
+        r select 9
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert {[r ttl volatile:0] > 900}
+    }
+
+    test {BGSAVE with rdb-save-threads} {
+        # Don't save again on shutdown: the next server must load the RDB
+        # produced by the child.
+        r config set save ""
+        r bgsave
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+    }
+}
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {RDB saved by BGSAVE with rdb-save-threads is loaded} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+# With maxmemory reached the values are not read back in background, so
+# they stay in the RDB file until accessed.
+start_server [list overrides [list "dir" $server_path "rdb-lazy-load" yes "maxmemory" 1]] {
+    test {RDB loaded lazily reads the values on access} {
+        assert {[s tiered_lazy_values] > 1000}
+        assert_equal $digest [r debug digest]
+        set lazy [s tiered_lazy_values]
+        assert_equal 1000 [r llen biglist]
+        assert_equal [string repeat x 1000] [r get compressed:0]
+        assert_equal [expr {$lazy-2}] [s tiered_lazy_values]
+        assert {[r ttl volatile:0] > 900}
+        r select 10
+        assert_equal value [r get otherdb]
+        r select 9
+    }
+
+    test {Values still in the RDB file loaded lazily are saved} {
+        # The RDB file is replaced while the values are read from the
+        # old one.
+        r save
+        r config set maxmemory 0
+        r debug reload
+        assert_equal 0 [s tiered_lazy_values]
+        assert_equal $digest [r debug digest]
+        r config set maxmemory 1
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "rdb-lazy-load" yes]] {
+    test {Values of the RDB loaded lazily are read back in background} {
+        wait_for_condition 50 100 {
+            [s tiered_lazy_values] == 0
+        } else {
+            fail "Values loaded lazily still in the RDB file"
+        }
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.rdb-lz4"]
+
+start_server [list overrides [list "dir" $server_path "rdb-compression-algorithm" lz4]] {
+    test {RDB save and load with LZ4 compression} {
+        createComplexDataset r 10000
+        for {set j 0} {$j < 100} {incr j} {
+            r set compressed:$j [string repeat "lz4 $j " 100]
+            r rpush biglist [string repeat $j 100]
+        }
+        set digest [r debug digest]
+        r debug reload
+        assert_equal $digest [r debug digest]
+        r save
+        set compressed_size [file size [file join $server_path dump.rdb]]
+        r config set rdbcompression no
+        r save
+        assert {[file size [file join $server_path dump.rdb]] > $compressed_size}
+        r config set rdbcompression yes
+        r config set save ""
+        r save
+    }
+}
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {RDB compressed with LZ4 is loaded with the default algorithm} {
+        list [lindex [r config get rdb-compression-algorithm] 1] \
+             [string equal $digest [r debug digest]]
+    } {lzf 1}
+}
+
+set server_path [tmpdir "server.rdb-forkless"]
+
+start_server [list overrides [list "dir" $server_path "rdb-forkless-save" yes]] {
+    test {Fork-less BGSAVE saves the data set as of its start} {
+        createComplexDataset r 2000
+        for {set j 0} {$j < 500} {incr j} {
+            r set k:$j $j
+            r rpush list:$j $j
+        }
+        r setex volatile 1000 value
+        foreach db {10 11 12} {
+            r select $db
+            for {set j 0} {$j < 100} {incr j} {
+                r set db$db:$j $j
+            }
+        }
+        r select 9
+        set digest [r debug digest]
+
+        # Make the scan slow enough to modify the data set meanwhile.
+        r config set rdb-key-save-delay 200
+        r bgsave
+        assert_equal 1 [s rdb_forkless_in_progress]
+        for {set j 0} {$j < 100} {incr j} {
+            r del k:$j
+            r set k:[expr {$j+100}] changed
+            r expire k:[expr {$j+200}] 100
+            r incr k:[expr {$j+300}]
+            r set new:$j $j
+            r rpush list:[expr {$j*5}] added
+        }
+        r persist volatile
+        r select 10
+        r flushdb
+        r swapdb 11 12
+        r select 9
+        assert_equal 1 [s rdb_forkless_in_progress]
+        r config set rdb-key-save-delay 0
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+        assert {[s rdb_forkless_copied_keys] > 0}
+        r config set save ""
+    }
+}
+
+start_server [list overrides [list "dir" $server_path]] {
+    test {Fork-less BGSAVE output is loaded} {
+        assert_equal $digest [r debug digest]
+    }
+}
+
+set server_path [tmpdir "server.rdb-delta"]
+
+start_server [list overrides [list "dir" $server_path "save" "" "rdb-delta-snapshots" yes]] {
+    test {BGSAVE DELTA needs a full RDB file first} {
+        r set x 1
+        catch {r bgsave delta} e
+        set e
+    } {*use BGSAVE first*}
+
+    test {BGSAVE DELTA writes just the keys modified since the full save} {
+        for {set j 0} {$j < 1000} {incr j} {
+            r set k:$j [string repeat x 100]
+        }
+        r setex volatile 1000 value
+        r hset h a 1
+        r bgsave
+        waitForBgsave r
+        assert_equal 1 [s rdb_delta_base_valid]
+        assert_equal 0 [s rdb_delta_keys]
+
+        r set k:1 changed
+        r del k:2
+        r incr counter
+        r persist volatile
+        r hset h b 2
+        r expire k:4 100
+        r move k:5 10
+        assert_equal 8 [s rdb_delta_keys]
+        r bgsave delta
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+        # The delta is cumulative, and a key deleted after the save is
+        # written as a tombstone.
+        r del k:6
+        r bgsave delta
+        waitForBgsave r
+        assert_equal ok [s rdb_last_bgsave_status]
+        set digest [r debug digest]
+        assert {[file size $server_path/dump.rdb.delta] <
+                [file size $server_path/dump.rdb]/10}
+    }
+
+    test {Flushing a DB invalidates the base of the deltas} {
+        r select 11
+        r flushdb
+        r select 9
+        assert_equal 0 [s rdb_delta_base_valid]
+        catch {r bgsave delta} e
+        set e
+    } {*use BGSAVE first*}
+}
+
+start_server [list overrides [list "dir" $server_path "save" ""]] {
+    test {The delta is applied to its base at startup} {
+        assert_equal $digest [r debug digest]
+        list [r get k:1] [r exists k:2 k:5 k:6] [r ttl volatile] \
+             [r select 10] [r exists k:5]
+    } {changed 0 -1 OK 1}
+}
+
+start_server [list overrides [list "dir" $server_path "save" "" "rdb-delta-snapshots" yes]] {
+    test {A full save removes the delta, a stale delta is not applied} {
+        file copy -force $server_path/dump.rdb.delta $server_path/old.delta
+        r set k:1 newbase
+        r save
+        assert {![file exists $server_path/dump.rdb.delta]}
+        assert_equal 1 [s rdb_delta_base_valid]
+        set digest [r debug digest]
+        file rename -force $server_path/old.delta $server_path/dump.rdb.delta
+    }
+}
+
+start_server [list overrides [list "dir" $server_path "save" ""]] {
+    test {A stale delta is ignored at startup} {
+        assert_equal $digest [r debug digest]
+        r get k:1
+    } {newbase}
+}
+
 set server_path [tmpdir "server.rdb-startup-test"]
 
 start_server [list overrides [list "dir" $server_path]] {
@@ -58,6 +323,66 @@ start_server [list overrides [list "dir" $server_path]] {
     }
 }
 
+start_server [list overrides [list "dir" $server_path]] {
+    test {redis-check-rdb --analyze and --export} {
+        r flushall
+        r set user:1 alice
+        r set user:2 bob
+        r set user:3 carol
+        r rpush queue:jobs a b c
+        r hset session:x field value
+        r expire session:x 7200
+        r save
+        set rdb [file join $server_path dump.rdb]
+        set export [file join $server_path dump.cols]
+        set output [exec src/redis-check-rdb $rdb --analyze --export $export]
+
+        # Per type totals of the report.
+        assert_match {*5 keys exported to*} $output
+        assert {[regexp {Estimated memory of 5 keys once loaded: (\d+) bytes} \
+                $output -> total]}
+        assert_match {*string embstr * 3 keys,*} $output
+        assert_match "*list [r object encoding queue:jobs] * 1 keys,*" $output
+        assert_match {*no expire * 4 keys,*} $output
+        assert_match {*< 1 day * 1 keys,*} $output
+        assert_match {*string "user:" * 3 keys,*} $output
+
+        # Read back the rows of the columnar file.
+        set fd [open $export r]
+        fconfigure $fd -translation binary
+        set data [read $fd]
+        close $fd
+        assert_equal REDISCOLS1 [string range $data 0 9]
+        binary scan $data @10iu rows
+        assert_equal 5 $rows
+        set fmt "@14su${rows}cu${rows}cu${rows}wu${rows}wu${rows}w${rows}iu${rows}"
+        binary scan $data $fmt dbs types encodings bytes elements expires keylens
+        set pos [expr {14+$rows*(2+1+1+8+8+8+4)}]
+        set sum 0
+        for {set j 0} {$j < $rows} {incr j} {
+            set len [lindex $keylens $j]
+            set key [string range $data $pos [expr {$pos+$len-1}]]
+            incr pos $len
+            incr sum [lindex $bytes $j]
+            set row($key) [list [lindex $dbs $j] [lindex $types $j] \
+                [lindex $elements $j] [lindex $expires $j]]
+        }
+        assert_equal $total $sum
+        assert_equal [lsort [r keys *]] [lsort [array names row]]
+        assert_equal {9 0 5 -1} $row(user:3)
+        assert_equal {9 1 3 -1} $row(queue:jobs)
+        lassign $row(session:x) db type elements expire
+        assert_equal {9 4 1} [list $db $type $elements]
+        set ttl [expr {$expire-[clock milliseconds]}]
+        assert {$ttl > 7000000 && $ttl <= 7200000}
+
+        # The file ends with an empty block.
+        binary scan $data @${pos}iu last
+        assert_equal 0 $last
+        assert_equal [expr {$pos+4}] [string length $data]
+    }
+}
+
 # Helper function to start a server and kill it, just to check the error
 # logged.
 set defaults {}
@@ -128,4 +453,78 @@ start_server {} {
         # make sure the server is still writable
         r set x xx
     }
-}
\ No newline at end of file
+}
+start_server {} {
+    set dir [lindex [r config get dir] 1]
+
+    proc wait_for_bgload {r} {
+        wait_for_condition 1000 20 {
+            [status $r bgload_in_progress] eq 0
+        } else {
+            fail "BGLOAD still in progress"
+        }
+    }
+
+    test {BGLOAD replaces the data set with the RDB file} {
+        r debug populate 1000
+        r select 10
+        r set foo bar
+        r select 9
+        r save
+        set digest [r debug digest]
+        file copy -force [file join $dir dump.rdb] [file join $dir bgload.rdb]
+
+        r flushall
+        r set other value
+        r bgload [file join $dir bgload.rdb]
+        wait_for_bgload r
+        assert_equal ok [s last_bgload_status]
+        assert_equal $digest [r debug digest]
+        assert_equal 0 [r exists other]
+    }
+
+    test {BGLOAD serves reads and refuses writes while loading} {
+        r flushall
+        r debug populate 50000 key 200
+        # Large enough for the loading to process the events meanwhile.
+        r config set rdbcompression no
+        r save
+        file copy -force [file join $dir dump.rdb] [file join $dir bgload.rdb]
+        r flushall
+        r set foo old
+        r config set key-load-delay 10
+        r bgload [file join $dir bgload.rdb]
+        wait_for_condition 50 100 {
+            [s async_loading] eq 1
+        } else {
+            fail "BGLOAD didn't start loading"
+        }
+        assert_equal old [r get foo]
+        catch {r set foo new} e
+        assert_match {*LOADING*} $e
+        assert_error {*LOADING*} {r bgload [file join $dir bgload.rdb]}
+        wait_for_bgload r
+        r config set key-load-delay 0
+        list [s last_bgload_status] [r dbsize] [r exists foo]
+    } {ok 50000 0}
+
+    test {BGLOAD of a missing file returns an error} {
+        assert_error {*Can't open*} {r bgload [file join $dir missing.rdb]}
+    }
+
+    test {BGLOAD of a corrupted RDB file leaves the data set untouched} {
+        r flushall
+        r debug populate 1000
+        set digest [r debug digest]
+        set fd [open [file join $dir bgload.rdb] r+]
+        fconfigure $fd -translation binary
+        seek $fd 1000
+        puts -nonewline $fd "corrupted"
+        close $fd
+        r bgload [file join $dir bgload.rdb]
+        wait_for_bgload r
+        assert_equal err [s last_bgload_status]
+        assert_equal $digest [r debug digest]
+        r set foo bar
+    } {OK}
+}
@@ -208,4 +208,24 @@ start_server {tags {"cli"}} {
         assert_equal "OK" [run_cli_with_input_file $tmpfile set key]
         assert_equal "from file" [r get key]
     }
+
+    test_nontty_cli "Bulk build collections from stdin" {
+        r del myhash myzset
+        set hash {}
+        set zset {}
+        for {set j 0} {$j < 2500} {incr j} {
+            append hash "field:$j value $j\n"
+            append zset "$j member $j\n"
+        }
+        set cmd [rediscli [srv port] {-n 9 --bulk-build hash myhash --bulk-size 2500}]
+        set out [exec {*}$cmd << $hash]
+        assert_equal "elements: 2500, added: 2500" $out
+        assert_equal 2500 [r hlen myhash]
+        assert_equal "value 42" [r hget myhash field:42]
+
+        set cmd [rediscli [srv port] {-n 9 --bulk-build zset myzset}]
+        set out [exec {*}$cmd << $zset]
+        assert_equal "elements: 2500, added: 2500" $out
+        assert_equal {{member 7} 7} [r zrange myzset 7 7 withscores]
+    }
 }
@@ -144,3 +144,106 @@ start_server {tags {"repl"}} {
         }
     }
 }
+
+start_server {tags {"repl"}} {
+    start_server {} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+
+        $replica config set repl-compression yes
+        $replica replicaof $master_host $master_port
+        wait_for_condition 50 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+
+        test {Replication stream is compressed when the replica asks for it} {
+            set load_handle0 [start_bg_complex_data $master_host $master_port 9 100000]
+            for {set j 0} {$j < 1000} {incr j} {
+                $master set key:$j [string repeat "value $j " 100]
+            }
+            stop_bg_complex_data $load_handle0
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+            set in [s -1 repl_compress_input_bytes]
+            set out [s -1 repl_compress_output_bytes]
+            assert {$in > 1000000}
+            assert {$out < $in/2}
+        }
+
+        test {Partial resync continues the compressed stream} {
+            set partial_ok [s -1 sync_partial_ok]
+            $master client kill type replica
+            for {set j 0} {$j < 1000} {incr j} {
+                $master incr counter
+            }
+            wait_for_condition 50 100 {
+                [s -1 sync_partial_ok] == $partial_ok+1 &&
+                [$replica get counter] == 1000
+            } else {
+                fail "Replica didn't partially resync"
+            }
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+
+        test {Replica not asking for compression gets the plain stream} {
+            $replica config set repl-compression no
+            $master client kill type replica
+            wait_for_condition 50 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica didn't reconnect"
+            }
+            set out [s -1 repl_compress_output_bytes]
+            $master set foo [string repeat x 10000]
+            wait_for_ofs_sync $master $replica
+            assert_equal $out [s -1 repl_compress_output_bytes]
+            assert_equal [$master debug digest] [$replica debug digest]
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    start_server {overrides {io-threads 4 replica-parallel-parse yes}} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+
+        $replica replicaof $master_host $master_port
+        wait_for_condition 50 100 {
+            [s 0 master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+
+        test {Replica parses the accumulated master stream in parallel} {
+            # Keep the replica busy while the master is written, so that
+            # the stream accumulates.
+            set rd [redis_deferring_client]
+            $rd debug sleep 1
+            set wr [redis_deferring_client -1]
+            for {set j 0} {$j < 20000} {incr j} {
+                $wr set key:$j [string repeat x [expr {$j % 100}]]
+                if {$j % 1000 == 0} {
+                    $wr multi
+                    $wr incr counter
+                    $wr rpush list $j
+                    $wr exec
+                }
+            }
+            for {set j 0} {$j < 20000+20*4} {incr j} {$wr read}
+            $wr close
+            $rd read
+            $rd close
+            wait_for_ofs_sync $master $replica
+            assert_equal [$master debug digest] [$replica debug digest]
+            assert_equal 20 [$replica get counter]
+            assert {[s 0 repl_parallel_parsed_cmds] > 0}
+        }
+    }
+}
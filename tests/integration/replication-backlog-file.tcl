@@ -0,0 +1,126 @@
+# The replication stream is also stored into a memory mapped file, so that
+# partial resynchronizations survive restarts and can be served from more
+# history than the in memory backlog holds.
+start_server {tags {"repl"} overrides {repl-backlog-file backlog.bin repl-backlog-file-size 4mb repl-backlog-size 16kb}} {
+    start_server {overrides {repl-backlog-file backlog.bin repl-backlog-file-size 4mb repl-backlog-size 16kb}} {
+        start_server {} {
+            set master [srv -2 client]
+            set master_host [srv -2 host]
+            set master_port [srv -2 port]
+            set replica [srv -1 client]
+            set replica_host [srv -1 host]
+            set replica_port [srv -1 port]
+            set subreplica [srv 0 client]
+
+            $replica replicaof $master_host $master_port
+            $subreplica replicaof $replica_host $replica_port
+            wait_for_condition 50 100 {
+                [status $replica master_link_status] eq {up} &&
+                [status $subreplica master_link_status] eq {up}
+            } else {
+                fail "Replication not started."
+            }
+
+            test {Partial resync is served from the backlog file} {
+                set sync_full [s -2 sync_full]
+                set partial_ok [s -2 sync_partial_ok]
+                $replica replicaof 127.0.0.1 0
+                set payload [string repeat x 1000]
+                for {set j 0} {$j < 1000} {incr j} {
+                    $master set key:$j $payload
+                }
+
+                # Only the last part of the stream is still in memory.
+                wait_for_condition 50 100 {
+                    [s -2 repl_backlog_histlen] < 100000
+                } else {
+                    fail "Replication backlog not trimmed"
+                }
+                assert {[s -2 repl_backlog_file_histlen] > 1000000}
+
+                $replica replicaof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s -2 sync_partial_ok] == $partial_ok+1
+                } else {
+                    fail "Replica didn't partially resync"
+                }
+                assert_equal $sync_full [s -2 sync_full]
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+
+            test {Replicas partially resync with a restarted master} {
+                set replid [status $master master_replid]
+                $master reconnect 1
+                catch {
+                    $master config rewrite
+                    $master debug restart
+                }
+                wait_for_condition 50 100 {
+                    [catch {$master ping}] == 0
+                } else {
+                    fail "Master didn't restart"
+                }
+                wait_for_condition 50 100 {
+                    [s -2 sync_partial_ok] == 1
+                } else {
+                    fail "Replica didn't partially resync"
+                }
+                assert_equal $replid [status $master master_replid]
+                assert_equal 0 [s -2 sync_full]
+
+                $master incr counter
+                wait_for_ofs_sync $master $replica
+                wait_for_ofs_sync $replica $subreplica
+                assert_equal [$master debug digest] [$replica debug digest]
+                assert_equal [$master debug digest] [$subreplica debug digest]
+            }
+
+            test {Chained replicas partially resync with a restarted replica} {
+                $replica reconnect 1
+                catch {
+                    $replica config rewrite
+                    $replica debug restart
+                }
+                wait_for_condition 50 100 {
+                    [catch {$replica ping}] == 0
+                } else {
+                    fail "Replica didn't restart"
+                }
+                wait_for_condition 50 100 {
+                    [s -1 sync_partial_ok] == 1
+                } else {
+                    fail "Chained replica didn't partially resync"
+                }
+                assert_equal 0 [s -1 sync_full]
+                assert_equal 0 [s -2 sync_full]
+
+                $master incr counter
+                wait_for_ofs_sync $master $replica
+                wait_for_ofs_sync $replica $subreplica
+                assert_equal [$master debug digest] [$subreplica debug digest]
+            }
+
+            test {A backlog file not matching the dataset is discarded} {
+                # Writes after the last save are lost when crashing, so the
+                # backlog file is ahead of the RDB file.
+                set replid [status $master master_replid]
+                $master set foo bar
+                catch {$master debug crash-and-recover 0}
+                wait_for_condition 50 100 {
+                    [catch {$master ping}] == 0
+                } else {
+                    fail "Master didn't restart"
+                }
+                wait_for_condition 50 100 {
+                    [s -2 sync_full] == 1
+                } else {
+                    fail "Replica didn't full resync"
+                }
+                assert {$replid ne [status $master master_replid]}
+                wait_for_ofs_sync $master $replica
+                assert_equal [$master debug digest] [$replica debug digest]
+            }
+        }
+    }
+}
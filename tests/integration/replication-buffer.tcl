@@ -0,0 +1,184 @@
+# The replication stream is stored once in a buffer that the backlog and
+# all the replicas share.
+start_server {tags {"repl"}} {
+    start_server {} {
+        start_server {} {
+            set master [srv -2 client]
+            set master_host [srv -2 host]
+            set master_port [srv -2 port]
+            set replica1 [srv -1 client]
+            set replica1_pid [srv -1 pid]
+            set replica2 [srv 0 client]
+            set replica2_pid [srv 0 pid]
+
+            $master config set repl-backlog-size 1mb
+            $master config set client-output-buffer-limit "replica 0 0 0"
+            $replica1 replicaof $master_host $master_port
+            $replica2 replicaof $master_host $master_port
+            wait_for_condition 50 100 {
+                [status $replica1 master_link_status] eq {up} &&
+                [status $replica2 master_link_status] eq {up}
+            } else {
+                fail "Replication not started."
+            }
+
+            test {Replicas share the replication buffer with the backlog} {
+                exec kill -SIGSTOP $replica1_pid
+                exec kill -SIGSTOP $replica2_pid
+                try {
+                    # Pipelined, so that the replicas are not disconnected
+                    # by repl-timeout before we are done.
+                    set rd [redis_deferring_client -2]
+                    set payload [string repeat x 10000]
+                    for {set j 0} {$j < 3000} {incr j} {
+                        $rd set key:$j $payload
+                    }
+                    for {set j 0} {$j < 3000} {incr j} {
+                        $rd read
+                    }
+                    $rd close
+
+                    # Both the replicas are lagging behind of about 30MB,
+                    # minus what the socket buffers absorbed, but the
+                    # buffer they reference is stored only once.
+                    set omems {}
+                    foreach line [split [$master client list type replica] "\n"] {
+                        if {$line eq {}} continue
+                        assert {[regexp {omem=([0-9]+)} $line - omem]}
+                        assert {$omem > 10000000}
+                        lappend omems $omem
+                    }
+                    assert_equal 2 [llength $omems]
+                    set slaves_mem [s -2 mem_clients_slaves]
+                    assert {$slaves_mem > 10000000}
+                    assert {$slaves_mem < [tcl::mathop::+ {*}$omems]*3/4}
+
+                    # The backlog retains all the data the replicas still
+                    # need.
+                    assert {[s -2 repl_backlog_histlen] > 10000000}
+                } finally {
+                    exec kill -SIGCONT $replica1_pid
+                    exec kill -SIGCONT $replica2_pid
+                }
+                wait_for_condition 50 100 {
+                    [$replica1 dbsize] == 3000 &&
+                    [$replica2 dbsize] == 3000
+                } else {
+                    fail "Replicas didn't catch up"
+                }
+                assert_equal [$master debug digest] [$replica1 debug digest]
+                assert_equal [$master debug digest] [$replica2 debug digest]
+            }
+
+            test {Replication buffer is trimmed to the backlog size} {
+                $master set foo bar
+                wait_for_condition 50 100 {
+                    [s -2 repl_backlog_histlen] < 1100000 &&
+                    [s -2 mem_clients_slaves] < 1000000
+                } else {
+                    fail "Replication buffer not trimmed"
+                }
+                assert_equal [s -2 repl_backlog_size] 1048576
+            }
+
+            test {Partial resync is served from the shared replication buffer} {
+                set partial_ok [s -2 sync_partial_ok]
+                $master client kill type replica
+                for {set j 0} {$j < 100} {incr j} {
+                    $master incr counter
+                }
+                wait_for_condition 50 100 {
+                    [s -2 sync_partial_ok] == $partial_ok+2 &&
+                    [$replica1 get counter] == 100 &&
+                    [$replica2 get counter] == 100
+                } else {
+                    fail "Replicas didn't partially resync"
+                }
+                assert_equal [$master debug digest] [$replica1 debug digest]
+                assert_equal [$master debug digest] [$replica2 debug digest]
+            }
+
+            test {Replica exceeding the output buffer limit is disconnected} {
+                $master config set client-output-buffer-limit "replica 1mb 1mb 0"
+                exec kill -SIGSTOP $replica1_pid
+                set payload [string repeat x 10000]
+                for {set j 0} {$j < 2000} {incr j} {
+                    $master set key:$j $payload
+                }
+                wait_for_condition 50 100 {
+                    [s -2 connected_slaves] == 1
+                } else {
+                    exec kill -SIGCONT $replica1_pid
+                    fail "Lagging replica not disconnected"
+                }
+                exec kill -SIGCONT $replica1_pid
+                $master config set client-output-buffer-limit "replica 0 0 0"
+                wait_for_condition 50 100 {
+                    [s -2 connected_slaves] == 2 &&
+                    [status $replica1 master_link_status] eq {up}
+                } else {
+                    fail "Replica didn't reconnect"
+                }
+                wait_for_ofs_sync $master $replica1
+                wait_for_ofs_sync $master $replica2
+                assert_equal [$master debug digest] [$replica1 debug digest]
+                assert_equal [$master debug digest] [$replica2 debug digest]
+            }
+        }
+    }
+}
+
+start_server {tags {"repl"}} {
+    start_server {} {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+        set replica_pid [srv 0 pid]
+
+        $master config set repl-backlog-size 1mb
+        $master config set client-output-buffer-limit "replica 2mb 0 0"
+        $master config set client-output-buffer-spill-threshold 1mb
+        $replica replicaof $master_host $master_port
+        wait_for_condition 50 100 {
+            [status $replica master_link_status] eq {up}
+        } else {
+            fail "Replication not started."
+        }
+
+        test {Replication buffer beyond the spill threshold is spilled to disk} {
+            set sync_full [s -1 sync_full]
+            exec kill -SIGSTOP $replica_pid
+            set payload [string repeat x 100000]
+            for {set j 0} {$j < 200} {incr j} {
+                $master set key:$j $payload
+            }
+
+            # The replica is lagging behind of about 20MB, more than the
+            # hard limit, but most of it is on disk.
+            assert_equal 1 [s -1 connected_slaves]
+            assert {[s -1 mem_clients_spilled] > 10000000}
+            set line [$master client list type replica]
+            assert {[regexp {omem=([0-9]+)} $line - omem]}
+            assert {$omem < 2000000}
+
+            exec kill -SIGCONT $replica_pid
+            wait_for_condition 50 100 {
+                [$replica dbsize] == 200
+            } else {
+                fail "Replica didn't catch up"
+            }
+            assert_equal $sync_full [s -1 sync_full]
+            assert_equal [$master debug digest] [$replica debug digest]
+
+            # Once sent, the spilled blocks are released, except the ones
+            # still in the backlog.
+            $master set foo bar
+            wait_for_condition 50 100 {
+                [s -1 mem_clients_spilled] < 2000000
+            } else {
+                fail "Spilled replication buffer not released"
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+# Change data capture consumers get the replication stream filtered by DB
+# and key prefix, with REPLCONF OFFSET telling where the stream continues
+# after the commands filtered out.
+proc cdc_attach {args} {
+    set s [socket [srv 0 "host"] [srv 0 "port"]]
+    fconfigure $s -translation binary
+    foreach {option value} $args {
+        puts -nonewline $s "REPLCONF $option $value\r\n"
+        flush $s
+        assert_equal {+OK} [string trim [gets $s]]
+    }
+    return $s
+}
+
+proc cdc_psync {s replid offset} {
+    puts -nonewline $s "PSYNC $replid $offset\r\n"
+    flush $s
+    string trim [gets $s]
+}
+
+start_server {tags {"repl"}} {
+    test {CDC consumer can skip the RDB} {
+        r set before 1
+        set s [cdc_attach cdc-rdb no]
+        set reply [cdc_psync $s ? -1]
+        assert_match {+FULLRESYNC * *} $reply
+        r set after 1
+        assert_replication_stream $s {
+            {select *}
+            {set after 1}
+        }
+        close $s
+    }
+
+    test {CDC consumer filters by DB and key prefix} {
+        set s [cdc_attach cdc-rdb no cdc-db 9 cdc-prefix user: cdc-prefix item:]
+        cdc_psync $s ? -1
+        r set user:1 a
+        r set other b
+        r set item:1 c
+        r select 10
+        r set user:2 d
+        r select 9
+        r incr user:3
+        assert_replication_stream $s {
+            {select 9}
+            {set user:1 a}
+            {replconf OFFSET *}
+            {set item:1 c}
+            {replconf OFFSET *}
+            {select 9}
+            {incr user:3}
+        }
+        close $s
+    }
+
+    test {CDC consumer resumes from its offset} {
+        set s [cdc_attach cdc-rdb no cdc-prefix user:]
+        set reply [cdc_psync $s ? -1]
+        lassign [split $reply] _ replid offset
+        r set other 1
+        r set user:4 2
+        assert_replication_stream $s {
+            {select *}
+            {replconf OFFSET *}
+            {set user:4 2}
+        }
+        close $s
+
+        # The offset of REPLCONF OFFSET plus the bytes received after it is
+        # the cursor: resuming from the offset of the SET gets it again.
+        set s [cdc_attach cdc-prefix user:]
+        set resume [expr {[status r master_repl_offset]-
+                          [string length "*3\r\n\$3\r\nset\r\n\$6\r\nuser:4\r\n\$1\r\n2\r\n"]+1}]
+        assert_equal {+CONTINUE} [cdc_psync $s $replid $resume]
+        r set user:5 3
+        assert_replication_stream $s {
+            {set user:4 2}
+            {set user:5 3}
+        }
+        close $s
+    }
+}
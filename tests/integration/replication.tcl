@@ -386,6 +386,71 @@ test {slave fails full sync and diskless load swapdb recovers it} {
     }
 }
 
+# diskless load async serves the current data set while loading
+start_server {tags {"repl"}} {
+    set replica [srv 0 client]
+    start_server {} {
+        set master [srv 0 client]
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+
+        # Put different data sets on the master and the replica, with
+        # large keys on the master since the replica serves clients only
+        # once in 2mb
+        $replica debug populate 2000 replica 10
+        $master debug populate 200 master 100000
+        $master config set rdbcompression no
+        $master config set repl-diskless-sync yes
+        $master config set repl-diskless-sync-delay 0
+        $replica config set repl-diskless-load async
+        $replica config set replica-read-only no
+
+        foreach outcome {fail success} {
+            # 10ms per key, with 200 keys is 2 seconds
+            $master config set rdb-key-save-delay 10000
+            $replica replicaof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s -1 async_loading] eq 1
+            } else {
+                fail "Replica didn't start the async loading"
+            }
+            $master config set rdb-key-save-delay 0
+
+            test "Replica keeps serving reads during the async load ($outcome)" {
+                assert_equal 0 [s -1 loading]
+                assert_equal 2000 [$replica dbsize]
+                assert_equal {value:0} [string range [$replica get replica:0] 0 6]
+                catch {$replica set foo bar} err
+                assert_match {LOADING*} $err
+            }
+
+            if {$outcome eq {fail}} {
+                test {Failed async load leaves the current data set as is} {
+                    $master client kill type replica
+                    wait_for_condition 50 100 {
+                        [s -1 async_loading] eq 0
+                    } else {
+                        fail "Replica didn't stop loading"
+                    }
+                    assert_equal 2000 [$replica dbsize]
+                    $replica replicaof no one
+                }
+            } else {
+                test {Successful async load replaces the data set} {
+                    wait_for_condition 100 100 {
+                        [s -1 master_link_status] eq {up}
+                    } else {
+                        fail "Replica didn't complete the sync"
+                    }
+                    assert_equal 0 [s -1 async_loading]
+                    assert_equal 200 [$replica dbsize]
+                    assert_equal [$master debug digest] [$replica debug digest]
+                }
+            }
+        }
+    }
+}
+
 test {diskless loading short read} {
     start_server {tags {"repl"}} {
         set replica [srv 0 client]
@@ -630,3 +695,102 @@ start_server {tags {"repl"}} {
         }
     }
 }
+
+foreach mdl {no yes} {
+    start_server {tags {"repl"}} {
+        set master [srv 0 client]
+        $master config set rdb-compression-algorithm lz4
+        $master config set repl-diskless-sync $mdl
+        $master config set repl-diskless-sync-delay 0
+        set master_host [srv 0 host]
+        set master_port [srv 0 port]
+        for {set j 0} {$j < 1000} {incr j} {
+            $master set key:$j [string repeat "value $j " 20]
+        }
+        start_server {} {
+            set replica [srv 0 client]
+            test "Replica loads the LZ4 compressed RDB, diskless: $mdl" {
+                $replica replicaof $master_host $master_port
+                wait_for_condition 50 100 {
+                    [s 0 master_link_status] eq {up}
+                } else {
+                    fail "Replication not started."
+                }
+                wait_for_condition 50 100 {
+                    [$master debug digest] eq [$replica debug digest]
+                } else {
+                    fail "Different datasets between master and replica"
+                }
+            }
+        }
+    }
+}
+
+# test the decoupled diskless transfer, where a slow replica doesn't hold back
+# the others but is sent the rest of the rdb from disk
+start_server {tags {"repl"}} {
+    set master [srv 0 client]
+    $master config set repl-diskless-sync yes
+    $master config set repl-diskless-sync-delay 1
+    $master config set repl-diskless-sync-buffer 1mb
+    $master config set rdbcompression no
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+    $master debug populate 10000 test 1000
+    start_server {} {
+        set slow [srv 0 client]
+        start_server {} {
+            set fast [srv 0 client]
+
+            test {Decoupled diskless transfer, a lagging replica is spooled to disk} {
+                $slow config set repl-diskless-load swapdb
+                $slow config set key-load-delay 500
+                $slow replicaof $master_host $master_port
+                $fast replicaof $master_host $master_port
+
+                # The fast replica completes the sync while the slow one is
+                # still receiving the rdb.
+                wait_for_condition 100 100 {
+                    [status $fast master_link_status] eq {up}
+                } else {
+                    fail "Fast replica held back by the slow one"
+                }
+                assert_equal 1 [s -2 rdb_bgsave_in_progress]
+                wait_for_log_message -2 "*is lagging behind: sending it the rest of the RDB from disk*" 50 100 100
+                assert {[s -2 sync_diskless_spooled] >= 1}
+
+                wait_for_condition 200 100 {
+                    [status $slow master_link_status] eq {up}
+                } else {
+                    fail "Slow replica didn't complete the sync"
+                }
+                $master incr counter
+                wait_for_ofs_sync $master $fast
+                wait_for_ofs_sync $master $slow
+                assert_equal [$master debug digest] [$fast debug digest]
+                assert_equal [$master debug digest] [$slow debug digest]
+            }
+
+            test {Decoupled diskless transfer, the rate is limited per replica} {
+                $master config set repl-diskless-sync-max-rate 4mb
+                $slow config set key-load-delay 0
+                $slow replicaof no one
+                $fast replicaof no one
+                set start [clock milliseconds]
+                $slow replicaof $master_host $master_port
+                $fast replicaof $master_host $master_port
+                wait_for_condition 100 100 {
+                    [status $fast master_link_status] eq {up} &&
+                    [status $slow master_link_status] eq {up}
+                } else {
+                    fail "Replicas didn't complete the sync"
+                }
+                # About 10MB at 4MB per second.
+                assert {[clock milliseconds] - $start > 1500}
+                $master config set repl-diskless-sync-max-rate 0
+                assert_equal [$master debug digest] [$fast debug digest]
+                assert_equal [$master debug digest] [$slow debug digest]
+            }
+        }
+    }
+}
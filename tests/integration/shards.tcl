@@ -0,0 +1,42 @@
+start_server {tags {"shards"} overrides {shards 2}} {
+    set shard1 [redis [srv 0 host] [expr [srv 0 port]+1] 0 $::tls]
+
+    test {Every shard serves its own port and keyspace} {
+        r set foo bar
+        wait_for_condition 50 100 {
+            [catch {$shard1 ping}] == 0
+        } else {
+            fail "Shard 1 did not start"
+        }
+        list [status r shard_id] [status $shard1 shard_id] \
+             [r dbsize] [$shard1 dbsize] [$shard1 get foo]
+    } {0 1 1 0 {}}
+
+    test {The files of the shards have different names} {
+        list [lindex [r config get dbfilename] 1] \
+             [lindex [$shard1 config get dbfilename] 1]
+    } {dump.rdb dump-1.rdb}
+
+    test {CONFIG REWRITE is refused when running shards} {
+        catch {$shard1 config rewrite} e
+        set e
+    } {*not supported with shards*}
+
+    test {A crashed shard is restarted by the supervisor} {
+        set pid [status $shard1 process_id]
+        catch {$shard1 debug segfault}
+        $shard1 close
+        wait_for_condition 50 100 {
+            [catch {
+                set shard1 [redis [srv 0 host] [expr [srv 0 port]+1] 0 $::tls]
+                $shard1 ping
+            }] == 0
+        } else {
+            fail "Shard 1 was not restarted"
+        }
+        list [expr {[status $shard1 process_id] != $pid}] \
+             [status $shard1 shard_id] [r get foo]
+    } {1 1 bar}
+
+    $shard1 close
+}
@@ -0,0 +1,173 @@
+/* A module type with a 'defrag' callback, to test the defrag of the values
+ * of module types: small values are defragged in one go, while the ones
+ * with more than 'maxstep' elements are defragged incrementally. */
+
+#include "redismodule.h"
+
+static RedisModuleType *FragType;
+
+typedef struct {
+    unsigned long len;
+    void **items;
+} FragObject;
+
+/* Stats, reset by FRAG.RESETSTATS. */
+static unsigned long long datatype_attempts = 0;
+static unsigned long long datatype_defragged = 0;
+static unsigned long long datatype_resumes = 0;
+static unsigned long long datatype_wrong_cursor = 0;
+static unsigned long maxstep = 1000;
+
+static void FragFree(void *value) {
+    FragObject *o = value;
+    for (unsigned long i = 0; i < o->len; i++)
+        RedisModule_Free(o->items[i]);
+    RedisModule_Free(o->items);
+    RedisModule_Free(o);
+}
+
+static int FragDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value) {
+    REDISMODULE_NOT_USED(key);
+    unsigned long i = 0;
+    int steps = 0;
+
+    datatype_attempts++;
+    FragObject *o = *value, *newo;
+    if (RedisModule_DefragCursorGet(ctx, &i) == REDISMODULE_OK) {
+        if (i > 0) datatype_resumes++;
+        /* The cursor is only ever set past the end by a bug. */
+        if (i > o->len) datatype_wrong_cursor++;
+    } else if (o->len > maxstep) {
+        /* Big value: ask to be called again, incrementally. */
+        return 1;
+    }
+
+    if (i == 0) {
+        if ((newo = RedisModule_DefragAlloc(ctx, o))) {
+            *value = o = newo;
+            datatype_defragged++;
+        }
+        void **newitems = RedisModule_DefragAlloc(ctx, o->items);
+        if (newitems) {
+            o->items = newitems;
+            datatype_defragged++;
+        }
+    }
+
+    for (; i < o->len; i++) {
+        void *newptr = RedisModule_DefragAlloc(ctx, o->items[i]);
+        if (newptr) {
+            o->items[i] = newptr;
+            datatype_defragged++;
+        }
+        /* Check the time limit every few elements. */
+        if ((++steps % 64) == 0 && RedisModule_DefragShouldStop(ctx)) {
+            RedisModule_DefragCursorSet(ctx, i+1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* FRAG.CREATE key len size: create a value with 'len' allocations of 'size'
+ * bytes, interleaved with as many allocations that are freed right away, to
+ * leave holes in the allocator pages. */
+static int fragCreateCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    long long len, size;
+
+    if (argc != 4) return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[2], &len) != REDISMODULE_OK ||
+        RedisModule_StringToLongLong(argv[3], &size) != REDISMODULE_OK ||
+        len < 0 || size < (long long)sizeof(unsigned long))
+    {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid len or size");
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, "ERR key exists");
+    }
+
+    FragObject *o = RedisModule_Alloc(sizeof(*o));
+    o->len = len;
+    o->items = RedisModule_Alloc(sizeof(void*) * (len ? len : 1));
+    for (long long i = 0; i < len; i++) {
+        void *hole = RedisModule_Alloc(size);
+        o->items[i] = RedisModule_Alloc(size);
+        *(unsigned long*)o->items[i] = i;
+        RedisModule_Free(hole);
+    }
+    RedisModule_ModuleTypeSetValue(key, FragType, o);
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+static int fragResetStatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    datatype_attempts = datatype_defragged = 0;
+    datatype_resumes = datatype_wrong_cursor = 0;
+    return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+static int fragStatsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    RedisModule_ReplyWithArray(ctx, 8);
+    RedisModule_ReplyWithSimpleString(ctx, "datatype_attempts");
+    RedisModule_ReplyWithLongLong(ctx, datatype_attempts);
+    RedisModule_ReplyWithSimpleString(ctx, "datatype_defragged");
+    RedisModule_ReplyWithLongLong(ctx, datatype_defragged);
+    RedisModule_ReplyWithSimpleString(ctx, "datatype_resumes");
+    RedisModule_ReplyWithLongLong(ctx, datatype_resumes);
+    RedisModule_ReplyWithSimpleString(ctx, "datatype_wrong_cursor");
+    RedisModule_ReplyWithLongLong(ctx, datatype_wrong_cursor);
+    return REDISMODULE_OK;
+}
+
+/* FRAG.CHECK key: return the number of elements still holding their index,
+ * to check that the moved allocations were copied and updated. */
+static int fragCheckCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (RedisModule_ModuleTypeGetType(key) != FragType) {
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx, "WRONGTYPE");
+    }
+    FragObject *o = RedisModule_ModuleTypeGetValue(key);
+    long long ok = 0;
+    for (unsigned long i = 0; i < o->len; i++) {
+        if (*(unsigned long*)o->items[i] == i) ok++;
+    }
+    RedisModule_CloseKey(key);
+    return RedisModule_ReplyWithLongLong(ctx, ok);
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (RedisModule_Init(ctx, "defragtest", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (argc > 0) {
+        long long v;
+        if (RedisModule_StringToLongLong(argv[0], &v) == REDISMODULE_ERR)
+            return REDISMODULE_ERR;
+        maxstep = v;
+    }
+
+    RedisModuleTypeMethods tm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .free = FragFree,
+        .defrag = FragDefrag
+    };
+    FragType = RedisModule_CreateDataType(ctx, "frag_type", 0, &tm);
+    if (FragType == NULL) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx, "frag.create", fragCreateCommand, "write deny-oom", 1, 1, 1) == REDISMODULE_ERR ||
+        RedisModule_CreateCommand(ctx, "frag.resetstats", fragResetStatsCommand, "write deny-oom", 0, 0, 0) == REDISMODULE_ERR ||
+        RedisModule_CreateCommand(ctx, "frag.stats", fragStatsCommand, "readonly", 0, 0, 0) == REDISMODULE_ERR ||
+        RedisModule_CreateCommand(ctx, "frag.check", fragCheckCommand, "readonly", 1, 1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    return REDISMODULE_OK;
+}
@@ -0,0 +1,109 @@
+/* This module is used to test the event loop API: eventloop.pipe creates a
+ * pipe and registers both its ends in the Redis event loop. The writable
+ * callback writes a few bytes, the readable callback counts them and
+ * unregisters the pipe once everything was read. */
+
+#define REDISMODULE_EXPERIMENTAL_API
+#include "redismodule.h"
+#include <unistd.h>
+#include <errno.h>
+
+#define PIPE_MSG "hello"
+#define PIPE_MSG_LEN 5
+
+static int fds[2] = {-1,-1};
+static long long bytesRead = 0;
+static long long writes = 0;
+
+void pipeWritable(int fd, void *user_data, int mask) {
+    REDISMODULE_NOT_USED(user_data);
+    if (mask != REDISMODULE_EVENTLOOP_WRITABLE) return;
+    if (write(fd,PIPE_MSG,PIPE_MSG_LEN) == PIPE_MSG_LEN) writes++;
+    RedisModule_EventLoopDel(fd,REDISMODULE_EVENTLOOP_WRITABLE);
+}
+
+void pipeReadable(int fd, void *user_data, int mask) {
+    REDISMODULE_NOT_USED(user_data);
+    char buf[64];
+    if (mask != REDISMODULE_EVENTLOOP_READABLE) return;
+    ssize_t nread = read(fd,buf,sizeof(buf));
+    if (nread > 0) bytesRead += nread;
+    if (bytesRead == PIPE_MSG_LEN) {
+        RedisModule_EventLoopDel(fds[0],REDISMODULE_EVENTLOOP_READABLE);
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+}
+
+int eventloopPipe(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    if (fds[0] != -1) return RedisModule_ReplyWithError(ctx,"ERR busy");
+    if (pipe(fds) == -1) return RedisModule_ReplyWithError(ctx,"ERR pipe");
+    bytesRead = 0;
+    if (RedisModule_EventLoopAdd(fds[0],REDISMODULE_EVENTLOOP_READABLE,
+                                 pipeReadable,NULL) == REDISMODULE_ERR ||
+        RedisModule_EventLoopAdd(fds[1],REDISMODULE_EVENTLOOP_WRITABLE,
+                                 pipeWritable,NULL) == REDISMODULE_ERR)
+    {
+        return RedisModule_ReplyWithError(ctx,"ERR can't register the pipe");
+    }
+    return RedisModule_ReplyWithSimpleString(ctx,"OK");
+}
+
+/* Reply with the number of writes and of bytes read since the last pipe
+ * was created. */
+int eventloopStats(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    RedisModule_ReplyWithArray(ctx,2);
+    RedisModule_ReplyWithLongLong(ctx,writes);
+    RedisModule_ReplyWithLongLong(ctx,bytesRead);
+    return REDISMODULE_OK;
+}
+
+void dummyCallback(int fd, void *user_data, int mask) {
+    REDISMODULE_NOT_USED(fd);
+    REDISMODULE_NOT_USED(user_data);
+    REDISMODULE_NOT_USED(mask);
+}
+
+/* Check the errors reported for invalid arguments. */
+int eventloopErrors(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    errno = 0;
+    if (RedisModule_EventLoopAdd(-1,REDISMODULE_EVENTLOOP_READABLE,
+            dummyCallback,NULL) != REDISMODULE_ERR || errno != ERANGE)
+        return RedisModule_ReplyWithError(ctx,"ERR negative fd accepted");
+    if (RedisModule_EventLoopAdd(0,0,dummyCallback,NULL) != REDISMODULE_ERR ||
+        errno != EINVAL)
+        return RedisModule_ReplyWithError(ctx,"ERR empty mask accepted");
+    if (RedisModule_EventLoopAdd(0,REDISMODULE_EVENTLOOP_READABLE,NULL,NULL)
+            != REDISMODULE_ERR || errno != EINVAL)
+        return RedisModule_ReplyWithError(ctx,"ERR NULL callback accepted");
+    if (RedisModule_EventLoopDel(-1,REDISMODULE_EVENTLOOP_READABLE)
+            != REDISMODULE_ERR || errno != ERANGE)
+        return RedisModule_ReplyWithError(ctx,"ERR negative fd accepted");
+    return RedisModule_ReplyWithSimpleString(ctx,"OK");
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    if (RedisModule_Init(ctx,"eventloop",1,REDISMODULE_APIVER_1)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"eventloop.pipe",eventloopPipe,"",0,0,0)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"eventloop.stats",eventloopStats,"",0,0,0)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"eventloop.errors",eventloopErrors,"",0,0,0)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+    return REDISMODULE_OK;
+}
@@ -26,6 +26,40 @@ int test_call_generic(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     return REDISMODULE_OK;
 }
 
+int test_call_argv(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if (argc<2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_OK;
+    }
+
+    RedisModuleCallReply *reply = RedisModule_CallArgv(ctx, 0, argv+1, argc-1);
+    if (reply) {
+        RedisModule_ReplyWithCallReply(ctx, reply);
+        RedisModule_FreeCallReply(reply);
+    } else {
+        RedisModule_ReplyWithError(ctx, strerror(errno));
+    }
+    return REDISMODULE_OK;
+}
+
+/* Reply with a string of the given length, without copying it. */
+int test_reply_nocopy(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    long long len;
+    if (argc != 2) return RedisModule_WrongArity(ctx);
+    if (RedisModule_StringToLongLong(argv[1], &len) != REDISMODULE_OK || len < 0)
+        return RedisModule_ReplyWithError(ctx, "ERR invalid length");
+
+    char *buf = RedisModule_Alloc(len);
+    for (long long j = 0; j < len; j++) buf[j] = 'a'+j%26;
+    RedisModuleString *str = RedisModule_CreateString(ctx, buf, len);
+    RedisModule_Free(buf);
+    RedisModule_ReplyWithStringNoCopy(ctx, str);
+    RedisModule_FreeString(ctx, str);
+    return REDISMODULE_OK;
+}
+
 int test_call_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
     RedisModuleCallReply *reply;
@@ -190,6 +224,10 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 
     if (RedisModule_CreateCommand(ctx,"test.call_generic", test_call_generic,"",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.call_argv", test_call_argv,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx,"test.reply_nocopy", test_reply_nocopy,"",0,0,0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
     if (RedisModule_CreateCommand(ctx,"test.call_info", test_call_info,"",0,0,0) == REDISMODULE_ERR)
         return REDISMODULE_ERR;
     if (RedisModule_CreateCommand(ctx,"test.ld_conversion", test_ld_conv, "",0,0,0) == REDISMODULE_ERR)
@@ -0,0 +1,99 @@
+/* This module is used to test the thread safe keys snapshots API: the
+ * snapshot.get command blocks the client and reads the key from a thread,
+ * without holding the GIL. */
+
+#define REDISMODULE_EXPERIMENTAL_API
+
+/* define macros for having usleep */
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#include "redismodule.h"
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct {
+    RedisModuleBlockedClient *bc;
+    RedisModuleString *keyname;
+    long long delay;    /* Milliseconds to wait after taking the snapshot. */
+} snapshotJob;
+
+/* Reply with the type and the elements of the snapshot, returned by the
+ * thread as private data of the blocked client. */
+int snapshotReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    RedisModuleKeySnapshot *snap = RedisModule_GetBlockedClientPrivateData(ctx);
+
+    if (snap == NULL) return RedisModule_ReplyWithNull(ctx);
+    size_t len = RedisModule_KeySnapshotLength(snap);
+    RedisModule_ReplyWithArray(ctx,len+1);
+    RedisModule_ReplyWithLongLong(ctx,RedisModule_KeySnapshotType(snap));
+    for (size_t j = 0; j < len; j++) {
+        size_t elelen;
+        const char *ele = RedisModule_KeySnapshotElement(snap,j,&elelen);
+        RedisModule_ReplyWithStringBuffer(ctx,ele,elelen);
+    }
+    return REDISMODULE_OK;
+}
+
+void snapshotFree(RedisModuleCtx *ctx, void *privdata) {
+    REDISMODULE_NOT_USED(ctx);
+    if (privdata) RedisModule_FreeKeySnapshot(privdata);
+}
+
+void *snapshotThread(void *arg) {
+    snapshotJob *job = arg;
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->bc);
+
+    /* No GIL here: the snapshot is taken by the main thread. */
+    RedisModuleKeySnapshot *snap =
+        RedisModule_ThreadSafeKeySnapshot(ctx,job->keyname);
+    if (job->delay) usleep(job->delay*1000);
+
+    RedisModule_ThreadSafeContextLock(ctx);
+    RedisModule_FreeString(ctx,job->keyname);
+    RedisModule_ThreadSafeContextUnlock(ctx);
+    RedisModule_UnblockClient(job->bc,snap);
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_Free(job);
+    return NULL;
+}
+
+/* SNAPSHOT.GET <key> [<delay ms>] */
+int snapshotGet(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2 && argc != 3) return RedisModule_WrongArity(ctx);
+
+    snapshotJob *job = RedisModule_Alloc(sizeof(*job));
+    job->delay = 0;
+    if (argc == 3 &&
+        RedisModule_StringToLongLong(argv[2],&job->delay) != REDISMODULE_OK)
+    {
+        RedisModule_Free(job);
+        return RedisModule_ReplyWithError(ctx,"ERR invalid delay");
+    }
+    job->keyname = RedisModule_CreateStringFromString(NULL,argv[1]);
+    job->bc = RedisModule_BlockClient(ctx,snapshotReply,NULL,snapshotFree,0);
+
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,snapshotThread,job) != 0) {
+        RedisModule_AbortBlock(job->bc);
+        RedisModule_FreeString(NULL,job->keyname);
+        RedisModule_Free(job);
+        return RedisModule_ReplyWithError(ctx,"-ERR Can't start thread");
+    }
+    pthread_detach(tid);
+    return REDISMODULE_OK;
+}
+
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+
+    if (RedisModule_Init(ctx,"snapshot",1,REDISMODULE_APIVER_1)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+    if (RedisModule_CreateCommand(ctx,"snapshot.get",snapshotGet,"",1,1,1)
+            == REDISMODULE_ERR) return REDISMODULE_ERR;
+    return REDISMODULE_OK;
+}
@@ -0,0 +1,36 @@
+# Throughput and latency of the most common commands, measured with
+# redis-benchmark. See tests/support/perf.tcl.
+
+set perf_overrides {save {""} notify-keyspace-events {""} latency-monitor-threshold 0}
+
+start_server [list tags {"perf"} overrides $perf_overrides] {
+    test {Perf: single commands} {
+        set results [perf_benchmark 0 -n 200000 -c 50 -r 100000 \
+            -t ping,set,get,incr,lpush,lpop,sadd,hset,spop,zadd,lrange_100,mset]
+        assert {[dict size $results] > 0}
+        perf_check_benchmark bench $results
+    }
+
+    test {Perf: pipelined commands} {
+        set results [perf_benchmark 0 -n 1000000 -c 50 -P 16 -r 100000 \
+            -t set,get]
+        assert {[dict size $results] > 0}
+        perf_check_benchmark pipeline $results
+    }
+
+    test {Perf: latency at a fixed rate} {
+        # In the open loop mode the latency is measured from the time the
+        # requests should be sent, so the p99 includes the queueing delay.
+        set results [perf_benchmark 0 -n 200000 -c 50 -r 100000 \
+            --rps 50000 -t set,get]
+        assert {[dict size $results] > 0}
+        perf_check_benchmark openloop $results
+    }
+
+    test {Perf: large values} {
+        set results [perf_benchmark 0 -n 50000 -c 50 -r 1000 -d 16384 \
+            -t set,get]
+        assert {[dict size $results] > 0}
+        perf_check_benchmark largevalues $results
+    }
+}
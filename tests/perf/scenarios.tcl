@@ -0,0 +1,76 @@
+# Throughput and latency of the server while it is busy with background
+# work: saving, feeding a replica, evicting and expiring keys. See
+# tests/support/perf.tcl.
+
+set perf_overrides {save {""} notify-keyspace-events {""} latency-monitor-threshold 0}
+
+start_server [list tags {"perf"} overrides $perf_overrides] {
+    test {Perf: writes during BGSAVE} {
+        r debug populate 1000000 key 100
+        r bgsave
+        set results [perf_benchmark 0 -n 200000 -c 50 -r 1000000 -t set]
+        waitForBgsave r
+        perf_check_benchmark bgsave $results
+        perf_check bgsave.fork_usec [s latest_fork_usec] lower
+    }
+
+    test {Perf: writes at maxmemory} {
+        r flushall
+        r config set maxmemory 64mb
+        r config set maxmemory-policy allkeys-lru
+        set results [perf_benchmark 0 -n 300000 -c 50 -r 10000000 -d 256 \
+            -t set]
+        assert {[s evicted_keys] > 0}
+        r config set maxmemory 0
+        perf_check_benchmark eviction $results
+    }
+
+    test {Perf: reads during an active expire storm} {
+        r flushall
+        # Create keys that expire before the active expire cycle can
+        # reclaim them, then let it reclaim all of them at once.
+        r debug set-active-expire 0
+        perf_benchmark 0 -n 500000 -c 50 -P 16 -r 100000000 \
+            set key:__rand_int__ x px 100
+        after 200
+        r debug set-active-expire 1
+        set results [perf_benchmark 0 -n 200000 -c 50 -r 100000 -t get]
+        assert {[s expired_keys] > 0}
+        perf_check_benchmark expire $results
+    }
+}
+
+start_server [list tags {"perf"} overrides $perf_overrides] {
+    start_server [list overrides $perf_overrides] {
+        set master [srv -1 client]
+        set master_host [srv -1 host]
+        set master_port [srv -1 port]
+        set replica [srv 0 client]
+
+        test {Perf: full sync} {
+            $master debug populate 1000000 key 100
+            set start [clock milliseconds]
+            $replica replicaof $master_host $master_port
+            wait_for_condition 6000 10 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica not synchronized"
+            }
+            perf_check fullsync.msec [expr {[clock milliseconds]-$start}] lower
+        }
+
+        test {Perf: writes during a full sync} {
+            # A replica that stops and restarts replicating has a new
+            # replication ID, so it needs a full sync again.
+            $replica replicaof no one
+            $replica replicaof $master_host $master_port
+            set results [perf_benchmark -1 -n 200000 -c 50 -r 1000000 -t set]
+            wait_for_condition 6000 10 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Replica not synchronized"
+            }
+            perf_check_benchmark fullsync $results
+        }
+    }
+}
@@ -1 +1,23 @@
 # Test runtime reconfiguration command SENTINEL SET.
+
+source "../tests/includes/init-tests.tcl"
+
+test "The INFO period can be changed at runtime" {
+    foreach_sentinel_id id {
+        assert {[dict get [S $id SENTINEL MASTER mymaster] info-period] == 10000}
+        S $id SENTINEL SET mymaster info-period 2000
+        assert {[dict get [S $id SENTINEL MASTER mymaster] info-period] == 2000}
+        foreach slave [S $id SENTINEL SLAVES mymaster] {
+            assert {[dict get $slave info-period] == 2000}
+        }
+    }
+    # The INFO output is refreshed at the new pace.
+    wait_for_condition 100 50 {
+        [dict get [S 0 SENTINEL MASTER mymaster] info-refresh] < 2100
+    } else {
+        fail "INFO is not refreshed at the configured period"
+    }
+    foreach_sentinel_id id {
+        S $id SENTINEL SET mymaster info-period 10000
+    }
+}
@@ -6,8 +6,17 @@ test "Manual failover works" {
     set old_port [RI $master_id tcp_port]
     set addr [S 0 SENTINEL GET-MASTER-ADDR-BY-NAME mymaster]
     assert {[lindex $addr 1] == $old_port}
+    set start [clock milliseconds]
     catch {S 0 SENTINEL FAILOVER mymaster} reply
     assert {$reply eq "OK"}
+    # The leader promotes the slave without waiting for the timer or for the
+    # next INFO period.
+    wait_for_condition 100 10 {
+        [lindex [S 0 SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] 1] != $old_port
+    } else {
+        fail "The slave was not promoted"
+    }
+    assert {[clock milliseconds]-$start < 800}
     foreach_sentinel_id id {
         wait_for_condition 1000 50 {
             [lindex [S $id SENTINEL GET-MASTER-ADDR-BY-NAME mymaster] 1] != $old_port
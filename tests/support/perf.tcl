@@ -0,0 +1,97 @@
+# Helpers of the performance regression tests under tests/perf, that are
+# run by ./runtest-perf.
+#
+# Every measured metric is compared with the value stored for it in the
+# baseline file (--perf-baseline), and the test fails if it is worse than
+# the baseline by more than the tolerance (--perf-tolerance percent).
+# Metrics missing from the baseline are just reported. Running with
+# --perf-update-baseline stores the measured values in the baseline file
+# instead of checking them: the baseline must be created on the same
+# machine the regressions are checked on.
+
+# Return the metrics of the baseline file as a dictionary.
+proc perf_read_baseline {} {
+    set baseline {}
+    if {[file exists $::perf_baseline]} {
+        set fp [open $::perf_baseline r]
+        foreach line [split [read $fp] "\n"] {
+            if {[llength $line] == 2} {
+                dict set baseline [lindex $line 0] [lindex $line 1]
+            }
+        }
+        close $fp
+    }
+    return $baseline
+}
+
+proc perf_write_baseline {baseline} {
+    set fp [open $::perf_baseline w]
+    foreach metric [lsort [dict keys $baseline]] {
+        puts $fp "$metric [dict get $baseline $metric]"
+    }
+    close $fp
+}
+
+# Check the metric 'name' against the baseline. 'better' is "higher" for
+# metrics like the throughput, or "lower" for metrics like the latency.
+proc perf_check {name value better} {
+    set baseline [perf_read_baseline]
+    if {$::perf_update_baseline} {
+        dict set baseline $name $value
+        perf_write_baseline $baseline
+        return
+    }
+    if {![dict exists $baseline $name]} {
+        puts "    $name: $value (no baseline)"
+        return
+    }
+    set expected [dict get $baseline $name]
+    set tolerance [expr {$::perf_tolerance/100.0}]
+    set delta [expr {$expected ? ($value-$expected)*100.0/$expected : 0}]
+    if {$::verbose} {
+        puts [format "    %s: %s (baseline %s, %+.1f%%)" \
+            $name $value $expected $delta]
+    }
+    if {$better eq "higher"} {
+        set limit [expr {$expected*(1-$tolerance)}]
+        if {$value < $limit} {
+            error "assertion:$name regressed: $value, baseline $expected ([format %+.1f $delta]%)"
+        }
+    } else {
+        set limit [expr {$expected*(1+$tolerance)}]
+        if {$value > $limit} {
+            error "assertion:$name regressed: $value, baseline $expected ([format %+.1f $delta]%)"
+        }
+    }
+}
+
+# Run redis-benchmark against the server 'level' (see srv) with the given
+# arguments, and return a dictionary mapping every test it ran to the
+# list of its throughput, p50, p99, p99.9 and max latency.
+proc perf_benchmark {level args} {
+    set output [exec src/redis-benchmark -h [srv $level host] \
+        -p [srv $level port] --csv {*}$args 2>/dev/null]
+    set results {}
+    foreach line [split $output "\n"] {
+        set fields {}
+        foreach field [split $line ","] {
+            lappend fields [string trim $field "\""]
+        }
+        if {[llength $fields] == 6} {
+            dict set results [lindex $fields 0] [lrange $fields 1 end]
+        }
+    }
+    return $results
+}
+
+# Check the throughput and the p99 latency of every test of the results
+# of perf_benchmark, naming the metrics with the given prefix.
+proc perf_check_benchmark {prefix results} {
+    dict for {test values} $results {
+        lassign $values rps p50 p99
+        regsub -all {[^a-z0-9]+} [string tolower $test] _ test
+        set test [string trim $test _]
+        perf_check $prefix.$test.rps $rps higher
+        perf_check $prefix.$test.p99 $p99 lower
+    }
+}
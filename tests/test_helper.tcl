@@ -10,6 +10,7 @@ source tests/support/server.tcl
 source tests/support/tmpfile.tcl
 source tests/support/test.tcl
 source tests/support/util.tcl
+source tests/support/perf.tcl
 
 set ::all_tests {
     unit/printver
@@ -41,29 +42,39 @@ set ::all_tests {
     integration/replication-3
     integration/replication-4
     integration/replication-psync
+    integration/replication-buffer
+    integration/replication-backlog-file
+    integration/replication-cdc
     integration/aof
     integration/rdb
     integration/convert-zipmap-hash-on-load
+    integration/convert-ziplist-on-load
     integration/logging
     integration/psync2
     integration/psync2-reg
+    integration/shards
     unit/pubsub
     unit/slowlog
     unit/scripting
     unit/maxmemory
     unit/introspection
     unit/introspection-2
+    unit/threaded-io
     unit/limits
     unit/obuf-limits
+    unit/client-eviction
+    unit/shm
     unit/bitops
     unit/bitfield
     unit/geo
     unit/memefficiency
     unit/hyperloglog
+    unit/bloom
     unit/lazyfree
     unit/wait
     unit/pendingquerybuf
     unit/tls
+    unit/tracking
 }
 # Index to the next test to run in the ::all_tests list.
 set ::next_test 0
@@ -95,6 +106,9 @@ set ::wait_server 0
 set ::stop_on_failure 0
 set ::loop 0
 set ::tlsdir "tests/tls"
+set ::perf_baseline "tests/perf/baseline.txt"; # See tests/support/perf.tcl
+set ::perf_tolerance 20
+set ::perf_update_baseline 0
 
 # Set to 1 when we are running in client mode. The Redis test uses a
 # server-client model to run tests simultaneously. The server instance
@@ -454,6 +468,9 @@ proc print_help_screen {} {
         "--loop             Execute the specified set of tests forever."
         "--wait-server      Wait after server is started (so that you can attach a debugger)."
         "--tls              Run tests in TLS mode."
+        "--perf-baseline <file>   Baseline of the performance tests (default tests/perf/baseline.txt)."
+        "--perf-tolerance <perc>  Regression tolerated by the performance tests (default 20)."
+        "--perf-update-baseline   Store the performance tests results as the baseline."
         "--help             Print this help screen."
     } "\n"]
 }
@@ -542,6 +559,14 @@ for {set j 0} {$j < [llength $argv]} {incr j} {
     } elseif {$opt eq {--timeout}} {
         set ::timeout $arg
         incr j
+    } elseif {$opt eq {--perf-baseline}} {
+        set ::perf_baseline $arg
+        incr j
+    } elseif {$opt eq {--perf-tolerance}} {
+        set ::perf_tolerance $arg
+        incr j
+    } elseif {$opt eq {--perf-update-baseline}} {
+        set ::perf_update_baseline 1
     } elseif {$opt eq {--help}} {
         print_help_screen
         exit 0
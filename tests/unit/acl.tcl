@@ -61,6 +61,25 @@ start_server {tags {"acl"}} {
         assert_no_match {*34344e4d60c2b6d639b7bd22e18f2b0b91bc34bf0ac5f9952744435093cfb4e6*} $passstr
     }
 
+    test {Repeated AUTH uses the cache until the passwords change} {
+        r ACL setuser cacheuser on >cachepass +@all
+        r AUTH cacheuser cachepass
+        r config resetstat
+        r AUTH cacheuser cachepass
+        r AUTH cacheuser cachepass
+        assert_equal 0 [s acl_auth_cache_misses]
+        assert_equal 2 [s acl_auth_cache_hits]
+        r AUTH newuser passwd2
+        catch {r AUTH cacheuser wrongpass} e
+        assert_match {*WRONGPASS*} $e
+        r ACL setuser cacheuser resetpass >otherpass
+        catch {r AUTH cacheuser cachepass} e
+        assert_match {*WRONGPASS*} $e
+        r AUTH cacheuser otherpass
+        r AUTH newuser passwd2
+        r ACL deluser cacheuser
+    } {1}
+
     test {By default users are not able to access any command} {
         catch {r SET foo bar} e
         set e
@@ -81,6 +100,49 @@ start_server {tags {"acl"}} {
         set e
     } {*NOPERM*key*}
 
+    test {Plain keys, prefixes and glob patterns are all matched} {
+        r ACL setuser newuser allcommands resetkeys ~plain ~a:* ~a:b:* ~user:?:x ~esc\\* ~\[xy\]z*
+        r SET plain 1
+        r SET a: 1
+        r SET a:b:c 1
+        r SET user:1:x 1
+        r SET esc* 1
+        r SET yz1 1
+        foreach key {plai plainx b:a user:12:x esc esc1 z1} {
+            catch {r SET $key 1} e
+            assert_match {*NOPERM*key*} $e
+        }
+        # Every key of the command must match.
+        r MSET plain 1 a:1 2
+        catch {r MSET plain 1 zap 2} e
+        assert_match {*NOPERM*key*} $e
+        r ACL setuser newuser allkeys
+    }
+
+    test {Changing the key patterns applies to the keys already allowed} {
+        r ACL setuser newuser allcommands resetkeys ~foo:?
+        r SET foo:1 a
+        r SET foo:1 a
+        r ACL setuser newuser resetkeys ~bar:*
+        catch {r SET foo:1 a} e
+        assert_match {*NOPERM*key*} $e
+        r ACL setuser newuser allkeys
+    }
+
+    test {Key patterns are checked against the keys of every command} {
+        r ACL setuser newuser allcommands resetkeys ~foo:* ~zs:* ~dst
+        r ZUNIONSTORE dst 1 zs:1
+        catch {r ZUNIONSTORE dst 2 zs:1 bar:1} e
+        assert_match {*NOPERM*key*} $e
+        r MULTI
+        r SET foo:1 a
+        catch {r SET bar:1 b} e
+        assert_match {*NOPERM*key*} $e
+        catch {r EXEC} e
+        assert_match {*EXECABORT*} $e
+        r ACL setuser newuser allkeys
+    }
+
     test {Users can be configured to authenticate with any password} {
         r ACL setuser newuser nopass
         r AUTH newuser zipzapblabla
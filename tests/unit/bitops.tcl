@@ -348,4 +348,152 @@ start_server {tags {"bitops"}} {
             }
         }
     }
+
+    test {The SIMD kernels return the same results of the portable code} {
+        foreach bytes {1 127 128 129 1000 65536 100003} {
+            set reply [r debug bitops-benchmark $bytes 2]
+            assert_match {kernels: *} [lindex $reply 0]
+            assert_equal 4 [llength $reply]
+        }
+    }
+
+    test {SETBIT at a large offset creates a roaring bitmap} {
+        r del rb
+        r config set bitmap-roaring-min-bytes 1000
+        r setbit rb 4000000000 1
+        r setbit rb 7 1
+        assert_encoding roaring rb
+        assert {[r memory usage rb] < 1000}
+        list [r getbit rb 4000000000] [r getbit rb 7] [r getbit rb 8] \
+             [r bitcount rb] [r bitpos rb 1 1]
+    } {1 1 0 2 4000000000}
+
+    test {Roaring bitmaps BITCOUNT, BITPOS and GETBIT fuzzing} {
+        r del rb plain
+        set max 2000000; # About 250k bytes, bits in 31 chunks.
+        set bits {}
+        for {set j 0} {$j < 1000} {incr j} {
+            lappend bits [randomInt $max]
+        }
+        # Crowd a chunk so that it uses the bitmap representation.
+        for {set j 0} {$j < 5000} {incr j} {
+            lappend bits [expr {65536*3+[randomInt 30000]}]
+        }
+        lappend bits $max
+        foreach bit $bits {r setbit rb $bit 1}
+        r config set bitmap-roaring-min-bytes 0
+        foreach bit $bits {r setbit plain $bit 1}
+        r config set bitmap-roaring-min-bytes 1000
+        assert_encoding roaring rb
+        assert_encoding raw plain
+
+        assert_equal [r bitcount plain] [r bitcount rb]
+        for {set j 0} {$j < 200} {incr j} {
+            set start [expr {[randomInt 260000]-5000}]
+            set end [expr {$start+[randomInt 50000]}]
+            assert_equal [r bitcount plain $start $end] \
+                         [r bitcount rb $start $end]
+            assert_equal [r bitpos plain 1 $start $end] \
+                         [r bitpos rb 1 $start $end]
+            assert_equal [r bitpos plain 0 $start $end] \
+                         [r bitpos rb 0 $start $end]
+            assert_equal [r bitpos plain 1 $start] [r bitpos rb 1 $start]
+            set bit [randomInt $max]
+            assert_equal [r getbit plain $bit] [r getbit rb $bit]
+            set bit [lindex $bits [randomInt [llength $bits]]]
+            assert_equal [r bitfield plain get u8 $bit] \
+                         [r bitfield rb get u8 $bit]
+        }
+        assert_encoding roaring rb
+        assert_equal [r get plain] [r get rb]
+        assert_encoding raw rb
+    }
+
+    test {BITOP among roaring bitmaps} {
+        r del a b plain_a plain_b
+        foreach key {a b} {
+            set bits {}
+            for {set j 0} {$j < 2000} {incr j} {
+                lappend bits [randomInt 3000000]
+            }
+            foreach bit $bits {r setbit $key $bit 1}
+            r config set bitmap-roaring-min-bytes 0
+            foreach bit $bits {r setbit plain_$key $bit 1}
+            r config set bitmap-roaring-min-bytes 1000
+        }
+        # Make one bitmap longer than the other.
+        r setbit b 4000000 0
+        r setbit plain_b 4000000 0
+        foreach op {and or xor} {
+            r bitop $op dest a b nokey
+            r bitop $op plain_dest plain_a plain_b nokey
+            assert_encoding roaring a
+            assert_equal [r strlen plain_dest] [r bitop $op dest a b nokey]
+            assert_equal [r get plain_dest] [r get dest]
+        }
+        r bitop or dest a b
+        assert_encoding roaring dest
+        r bitop not dest a
+        r bitop not plain_dest plain_a
+        assert_equal [r get plain_dest] [r get dest]
+    }
+
+    test {Roaring bitmaps are converted to plain strings when denser} {
+        r del rb
+        r setbit rb 80000 0
+        assert_encoding roaring rb
+        for {set j 0} {$j < 5000} {incr j} {
+            r setbit rb [expr {$j*16}] 1
+        }
+        assert_encoding raw rb
+        list [r bitcount rb] [r strlen rb]
+    } {5000 10001}
+
+    test {Growing a sparse plain bitmap converts it to a roaring bitmap} {
+        r del rb
+        r setbit rb 100 1
+        assert_encoding raw rb
+        r setbit rb 1000000 1
+        assert_encoding roaring rb
+        list [r bitcount rb] [r strlen rb]
+    } {2 125001}
+
+    test {String commands convert roaring bitmaps to plain strings} {
+        r del rb
+        r setbit rb 1000000 1
+        assert_encoding roaring rb
+        r append rb "x"
+        assert_encoding raw rb
+        assert_equal 125002 [r strlen rb]
+        assert_equal 5 [r bitcount rb 125000 -1]
+        r del rb
+        r setbit rb 1000000 1
+        assert_equal [string length [r getrange rb 0 -1]] 125001
+    }
+
+    test {Roaring bitmaps are persisted by DEBUG RELOAD and AOF rewrites} {
+        r del rb
+        r setbit rb 3000000 0
+        for {set j 0} {$j < 100} {incr j} {
+            r setbit rb [randomInt 3000000] 1
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            r setbit rb [expr {65536+$j}] 1
+        }
+        r setbit rb 70000 0
+        set digest [r debug digest-value rb]
+        r debug reload
+        assert_encoding roaring rb
+        assert_equal $digest [r debug digest-value rb]
+
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_encoding roaring rb
+        assert_equal $digest [r debug digest-value rb]
+        r config set bitmap-roaring-min-bytes 1mb
+    } {OK}
 }
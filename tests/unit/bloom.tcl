@@ -0,0 +1,95 @@
+start_server {tags {"bloom"}} {
+    test {BFADD creates a filter and returns 1 only for new elements} {
+        r del bf
+        list [r bfadd bf a] [r bfadd bf a] [r bfexists bf a] \
+             [r bfexists bf b] [r type bf]
+    } {1 0 1 0 string}
+
+    test {BFMADD and BFMEXISTS work on many elements} {
+        r del bf
+        list [r bfmadd bf a b a c] [r bfmexists bf a b c d]
+    } {{1 1 0 1} {1 1 1 0}}
+
+    test {BFEXISTS and BFMEXISTS on a missing key} {
+        r del bf
+        list [r bfexists bf a] [r bfmexists bf a b]
+    } {0 {0 0}}
+
+    test {BFRESERVE creates an empty filter} {
+        r del bf
+        r bfreserve bf 0.001 1000 expansion 4
+        set info [r bfinfo bf]
+        list [dict get $info capacity] [dict get $info items] \
+             [dict get $info filters] [dict get $info expansion] \
+             [dict get $info error-rate]
+    } {1000 0 1 4 0.001}
+
+    test {BFRESERVE errors} {
+        assert_error {*already exists*} {r bfreserve bf 0.01 100}
+        assert_error {*error rate*} {r bfreserve bf2 1.5 100}
+        assert_error {*capacity*} {r bfreserve bf2 0.01 0}
+        assert_error {*expansion*} {r bfreserve bf2 0.01 100 expansion 100}
+        assert_error {*syntax*} {r bfreserve bf2 0.01 100 foo}
+        assert_error {*capacity too large*} {r bfreserve bf2 0.01 1000000000000}
+    }
+
+    test {Bloom commands refuse other values} {
+        r set str foo
+        r lpush list foo
+        assert_error {WRONGTYPE*Bloom*} {r bfadd str a}
+        assert_error {WRONGTYPE*Bloom*} {r bfexists str a}
+        assert_error {WRONGTYPE*} {r bfmadd list a}
+        assert_error {*no such key*} {r bfinfo nokey}
+    }
+
+    test {Filters grow when full and keep the error rate} {
+        r del bf
+        r bfreserve bf 0.01 100
+        set elements {}
+        for {set j 0} {$j < 5000} {incr j} {lappend elements "item:$j"}
+        foreach {a b c d e f g h i l} $elements {
+            r bfmadd bf $a $b $c $d $e $f $g $h $i $l
+        }
+        set info [r bfinfo bf]
+        assert {[dict get $info filters] > 1}
+        assert {[dict get $info capacity] >= 5000}
+        assert {[dict get $info items] > 4900}
+
+        # No false negatives.
+        assert_equal [lrepeat 5000 1] [r bfmexists bf {*}$elements]
+
+        set others {}
+        for {set j 0} {$j < 5000} {incr j} {lappend others "other:$j"}
+        set fp [tcl::mathop::+ {*}[r bfmexists bf {*}$others]]
+        assert {$fp < 100}
+    }
+
+    test {Filters without expansion refuse new elements when full} {
+        r del bf
+        r bfreserve bf 0.01 10 expansion 0
+        for {set j 0} {$j < 10} {incr j} {r bfadd bf $j}
+        assert_error {*full*} {r bfadd bf another}
+        dict get [r bfinfo bf] filters
+    } {1}
+
+    test {Filters are persisted and dumped as strings} {
+        r del bf bf2
+        r bfmadd bf a b c
+        set digest [r debug digest-value bf]
+        r debug reload
+        assert_equal $digest [r debug digest-value bf]
+        r restore bf2 0 [r dump bf]
+        list [r bfmexists bf2 a b c d] [r bfadd bf2 d]
+    } {{1 1 1 0} 1}
+
+    test {Corrupted filters are detected} {
+        r set bf [string replace [r get bf] end-80 end]
+        assert_error {WRONGTYPE*Bloom*} {r bfexists bf a}
+        r setrange bf2 5 "\x00"
+        assert_error {WRONGTYPE*Bloom*} {r bfexists bf2 a}
+    }
+
+    test {Bloom commands are in the @bloom ACL category} {
+        lsort [r acl cat bloom]
+    } {bfadd bfexists bfinfo bfmadd bfmexists bfreserve}
+}
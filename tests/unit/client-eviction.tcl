@@ -0,0 +1,115 @@
+proc client_field {name field} {
+    foreach line [split [r client list] "\r\n"] {
+        if {[string match "* name=$name *" $line] &&
+            [regexp "$field=(\[^ \]+)" $line - value]} {
+            return $value
+        }
+    }
+    return {}
+}
+
+# Send the start of a command with a bulk argument of 'size' bytes, of
+# which only 'sent' bytes are sent, so that they stay in the query buffer.
+# The client may be evicted while writing.
+proc send_partial_command {rd size sent} {
+    catch {
+        $rd write "*2\r\n\$4\r\necho\r\n\$$size\r\n"
+        $rd write [string repeat x $sent]
+        $rd flush
+    }
+}
+
+start_server {tags {"client-eviction"}} {
+    test {Client with a large query buffer is evicted} {
+        r config set maxmemory-clients 1mb
+        set evicted [s evicted_clients]
+        set rd [redis_deferring_client]
+        $rd client setname bigquery
+        assert_equal [$rd read] "OK"
+        send_partial_command $rd 4000000 2000000
+        wait_for_condition 50 100 {
+            [client_field bigquery qbuf] eq {}
+        } else {
+            fail "The client was not evicted"
+        }
+        assert_equal [expr {$evicted+1}] [s evicted_clients]
+        $rd close
+        r config set maxmemory-clients 0
+    }
+
+    test {The clients using the most memory are evicted first} {
+        set small [redis_deferring_client]
+        $small client setname small
+        assert_equal [$small read] "OK"
+        set big [redis_deferring_client]
+        $big client setname big
+        assert_equal [$big read] "OK"
+
+        send_partial_command $small 4000000 500000
+        wait_for_condition 50 100 {
+            [client_field small qbuf] >= 500000
+        } else {
+            fail "The query buffer of the client didn't grow"
+        }
+        r config set maxmemory-clients 3mb
+        send_partial_command $big 8000000 4000000
+        wait_for_condition 50 100 {
+            [client_field big qbuf] eq {}
+        } else {
+            fail "The biggest client was not evicted"
+        }
+        assert {[client_field small qbuf] >= 500000}
+        $small close
+        $big close
+        r config set maxmemory-clients 0
+    }
+
+    test {CLIENT NO-EVICT protects the client from eviction} {
+        set rd [redis_deferring_client]
+        $rd client setname noevict
+        assert_equal [$rd read] "OK"
+        $rd client no-evict on
+        assert_equal [$rd read] "OK"
+        assert_match {*e*} [client_field noevict flags]
+        # The other clients are evicted while the limit is exceeded.
+        r client no-evict on
+        r config set maxmemory-clients 1mb
+        send_partial_command $rd 4000000 2000000
+        wait_for_condition 50 100 {
+            [client_field noevict qbuf] >= 2000000
+        } else {
+            fail "The query buffer of the client didn't grow"
+        }
+        # The limit is still exceeded, yet the client is not evicted.
+        after 200
+        assert {[client_field noevict qbuf] >= 2000000}
+        $rd close
+        r config set maxmemory-clients 0
+        r client no-evict off
+    }
+
+    test {Client with a large output buffer is evicted} {
+        r set bigval [string repeat x 1000000]
+        set rd [redis_deferring_client]
+        $rd client setname bigoutput
+        assert_equal [$rd read] "OK"
+        r config set maxmemory-clients 5mb
+        set evicted [s evicted_clients]
+        # The replies are never read: once the socket buffers are full they
+        # accumulate in the output buffer.
+        catch {
+            for {set j 0} {$j < 50} {incr j} {
+                $rd get bigval
+            }
+            $rd flush
+        }
+        wait_for_condition 50 100 {
+            [client_field bigoutput omem] eq {}
+        } else {
+            fail "The client was not evicted"
+        }
+        assert {[s evicted_clients] > $evicted}
+        $rd close
+        r config set maxmemory-clients 0
+    }
+}
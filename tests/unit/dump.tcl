@@ -86,6 +86,53 @@ start_server {tags {"dump"}} {
         r dump nonexisting_key
     } {}
 
+    test {Chunked DUMP / RESTORE CHUNK transfer big keys of every type} {
+        r flushdb
+        set padding [string repeat x 50]
+        for {set j 0} {$j < 5000} {incr j} {
+            lappend chunk_elements "$padding:$j"
+            lappend chunk_pairs "$padding:$j" "value:$j"
+            lappend chunk_scored [expr {$j*1.5}] "$padding:$j"
+        }
+        r rpush list {*}$chunk_elements
+        r sadd set {*}$chunk_elements
+        r hset hash {*}$chunk_pairs
+        r zadd zset {*}$chunk_scored
+        r set string [string repeat abcdefgh 100000]
+        r set small 1234
+        foreach key {list set hash zset string small} {
+            set chunk_digest [r debug digest-value $key]
+            set cursor 0
+            set chunks 0
+            while 1 {
+                lassign [r dump $key cursor $cursor size 10000] cursor payload
+                if {$chunks == 0} {
+                    r restore copy 0 $payload
+                } elseif {$payload ne {}} {
+                    r restore copy 0 $payload chunk
+                }
+                incr chunks
+                if {$cursor == 0} break
+            }
+            if {$key ne {small}} {assert {$chunks > 10}}
+            assert_equal $chunk_digest [r debug digest-value copy]
+            r del copy
+        }
+    }
+
+    test {RESTORE CHUNK checks the type of the existing key} {
+        r del foo copy
+        r rpush foo a b c
+        r set copy bar
+        catch {r restore copy 0 [r dump foo] chunk} e
+        set e
+    } {WRONGTYPE*}
+
+    test {RESTORE CHUNK can't be used with REPLACE} {
+        catch {r restore foo 0 "..." chunk replace} e
+        set e
+    } {*syntax*}
+
     test {MIGRATE is caching connections} {
         # Note, we run this as first test so that the connection cache
         # is empty.
@@ -365,4 +412,96 @@ start_server {tags {"dump"}} {
             assert_match {*WRONGPASS*} $err
         }
     }
+
+    test {MIGRATE transfers big keys of every type in chunks} {
+        set first [srv 0 client]
+        r flushdb
+        # Big enough to need multiple chunks.
+        set padding [string repeat x 50]
+        for {set j 0} {$j < 5000} {incr j} {
+            lappend elements "$padding:$j"
+            lappend pairs "$padding:$j" "value:$j"
+            lappend scored [expr {$j*1.5}] "$padding:$j"
+        }
+        r rpush list {*}$elements
+        r sadd set {*}$elements
+        r hset hash {*}$pairs
+        r zadd zset {*}$scored
+        r set string [string repeat abcdefgh 100000]
+        r pexpire zset 100000
+        foreach key {list set hash zset string} {
+            set digest($key) [r debug digest-value $key]
+        }
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set ret [r -1 migrate $second_host $second_port "" 9 5000 keys list set hash zset string]
+            assert {$ret eq {OK}}
+            assert {[$first dbsize] == 0}
+            foreach key {list set hash zset string} {
+                assert_equal $digest($key) [$second debug digest-value $key]
+            }
+            set ttl [$second pttl zset]
+            assert {$ttl > 0 && $ttl <= 100000}
+            assert {[$second ttl list] == -1}
+        }
+    }
+
+    test {MIGRATE of a big key doesn't modify an existing key without REPLACE} {
+        set first [srv 0 client]
+        r del set
+        r sadd set {*}$elements
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            $second sadd set existing
+            catch {r -1 migrate $second_host $second_port set 9 5000} e
+            assert_match {*BUSYKEY*} $e
+            assert {[$first scard set] == 5000}
+            assert {[$second smembers set] eq {existing}}
+        }
+    }
+
+    test {MIGRATE blocks only the calling client, and locks the keys} {
+        set first [srv 0 client]
+        r flushdb
+        r set key "Some Value"
+        r set other "Other Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set sleeper [redis_deferring_client]
+            $sleeper debug sleep 1.0
+            set rd [redis_deferring_client -1]
+            $rd migrate $second_host $second_port key 9 5000
+            wait_for_condition 50 10 {
+                [s -1 blocked_clients] == 1
+            } else {
+                fail "MIGRATE didn't block the client"
+            }
+            assert_equal {Some Value} [r -1 get key]
+            catch {r -1 set key "New Value"} e
+            assert_match {TRYAGAIN*} $e
+            catch {r -1 eval {return redis.call('del',KEYS[1])} 1 key} e
+            assert_match {TRYAGAIN*} $e
+            r -1 multi
+            r -1 set key "New Value"
+            catch {r -1 exec} e
+            assert_match {TRYAGAIN*} $e
+            r -1 set other "Written"
+            assert_equal {OK} [$rd read]
+            $rd close
+            $sleeper read
+            $sleeper close
+            assert {[$first exists key] == 0}
+            assert_equal {Some Value} [$second get key]
+            r -1 set key "New Value"
+        }
+    }
 }
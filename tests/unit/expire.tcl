@@ -219,4 +219,92 @@ start_server {tags {"expire"}} {
         set ttl [r ttl foo]
         assert {$ttl <= 98 && $ttl > 90}
     }
+
+    test {Expires are kept right while keys with a TTL are removed} {
+        r flushdb
+        for {set j 0} {$j < 100} {incr j} {
+            r setex key:$j [expr {1000+$j}] value
+        }
+        # Removing keys and expires from the middle moves other expires
+        # around inside the expire index.
+        for {set j 0} {$j < 100} {incr j 3} {r del key:$j}
+        for {set j 1} {$j < 100} {incr j 3} {r persist key:$j}
+        for {set j 0} {$j < 100} {incr j} {
+            set ttl [r ttl key:$j]
+            if {$j % 3 == 0} {
+                assert_equal -2 $ttl
+            } elseif {$j % 3 == 1} {
+                assert_equal -1 $ttl
+            } else {
+                assert {$ttl > 1000+$j-10 && $ttl <= 1000+$j}
+            }
+        }
+        assert_match {*keys=66,expires=33,*} [r info keyspace]
+        r debug reload
+        assert_match {*keys=66,expires=33,*} [r info keyspace]
+    }
+
+    test {Active expire removes keys while others keep their TTL} {
+        r flushdb
+        for {set j 0} {$j < 200} {incr j} {
+            if {$j % 2} {
+                r psetex key:$j 100 value
+            } else {
+                r setex key:$j 1000 value
+            }
+        }
+        wait_for_condition 50 100 {
+            [r dbsize] == 100
+        } else {
+            fail "Keys with a short TTL were not expired"
+        }
+        for {set j 0} {$j < 200} {incr j 2} {
+            assert {[r ttl key:$j] > 900}
+        }
+    }
+}
+
+start_server {tags {"expire"} overrides {expire-time-index yes}} {
+    test {Expire time index: due keys are reclaimed and reported as backlog} {
+        r flushall
+        r debug set-active-expire 0
+        # Keys whose expire is changed or removed must leave the index.
+        # They are changed ASAP, before their short TTL is reached.
+        r psetex short:0 100 value
+        r pexpire short:0 1000000
+        r psetex short:1 100 value
+        r persist short:1
+        for {set j 2} {$j < 1000} {incr j} {
+            r psetex short:$j 100 value
+        }
+        for {set j 0} {$j < 1000} {incr j} {
+            r setex long:$j 1000 value
+        }
+        after 1200
+        assert {[s expired_backlog_keys] > 900}
+        assert {[s expired_backlog_lag_ms] >= 1000}
+        r debug set-active-expire 1
+        wait_for_condition 50 100 {
+            [r dbsize] == 1002
+        } else {
+            fail "Due keys were not reclaimed"
+        }
+        assert_equal 0 [s expired_backlog_keys]
+        assert_equal 0 [s expired_backlog_lag_ms]
+        assert {[r ttl short:0] > 900}
+        assert_equal -1 [r ttl short:1]
+    }
+
+    test {Expire time index is kept across FLUSHALL ASYNC and DEBUG RELOAD} {
+        r flushall async
+        r psetex foo 100000 bar
+        r psetex bar 100 foo
+        r debug reload
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Key was not reclaimed after reload"
+        }
+        assert {[r pttl foo] > 90000}
+    }
 }
@@ -111,6 +111,103 @@ start_server {tags {"geo"}} {
         r georadius nyc -73.9798091 40.7598464 10 km COUNT 2 DESC
     } {{wtc one} q4}
 
+    test {GEORADIUS with ANY not sorted by default} {
+        r georadius nyc -73.9798091 40.7598464 10 km COUNT 3 ANY
+    } {{wtc one} {union square} {central park n/q/r}}
+
+    test {GEORADIUS with ANY sorted by ASC} {
+        r georadius nyc -73.9798091 40.7598464 10 km COUNT 3 ANY ASC
+    } {{central park n/q/r} {union square} {wtc one}}
+
+    test {GEORADIUS with ANY but no COUNT} {
+        catch {r georadius nyc -73.9798091 40.7598464 10 km ANY ASC} e
+        set e
+    } {ERR*ANY*requires*COUNT*}
+
+    test {GEOSEARCH FROMLONLAT and FROMMEMBER cannot exist at the same time} {
+        catch {r geosearch nyc fromlonlat -73.9798091 40.7598464 frommember xxx bybox 6 6 km asc} e
+        set e
+    } {ERR*syntax*}
+
+    test {GEOSEARCH FROMLONLAT and FROMMEMBER one must exist} {
+        catch {r geosearch nyc bybox 3 3 km asc desc withhash withdist withcoord} e
+        set e
+    } {ERR*exactly one of FROMMEMBER or FROMLONLAT*}
+
+    test {GEOSEARCH BYRADIUS and BYBOX cannot exist at the same time} {
+        catch {r geosearch nyc fromlonlat -73.9798091 40.7598464 byradius 3 km bybox 3 3 km asc} e
+        set e
+    } {ERR*syntax*}
+
+    test {GEOSEARCH BYRADIUS and BYBOX one must exist} {
+        catch {r geosearch nyc fromlonlat -73.9798091 40.7598464 asc desc withhash withdist withcoord} e
+        set e
+    } {ERR*exactly one of BYRADIUS and BYBOX*}
+
+    test {GEOSEARCH with STOREDIST option} {
+        catch {r geosearch nyc fromlonlat -73.9798091 40.7598464 bybox 6 6 km asc storedist} e
+        set e
+    } {ERR*syntax*}
+
+    test {GEOSEARCH non square, long and narrow} {
+        r del Sicily
+        r geoadd Sicily 12.75 37.00 "test1"
+        r geoadd Sicily 12.75 36.50 "test2"
+        r geoadd Sicily 13.00 36.50 "test3"
+        # box height=2km width=400km
+        set ret1 [r geosearch Sicily fromlonlat 15 37 bybox 400 2 km]
+        assert_equal $ret1 {test1}
+
+        # Add a western Hemisphere point
+        r geoadd Sicily -1 37.00 "test3"
+        set ret2 [r geosearch Sicily fromlonlat 15 37 bybox 3000 2 km asc]
+        assert_equal $ret2 {test1 test3}
+    }
+
+    test {GEOSEARCH simple (sorted)} {
+        r geosearch nyc fromlonlat -73.9798091 40.7598464 bybox 6 6 km asc
+    } {{central park n/q/r} 4545 {union square} {lic market}}
+
+    test {GEOSEARCH BYRADIUS matches GEORADIUS} {
+        assert_equal [r georadius nyc -73.9798091 40.7598464 10 km withdist asc] \
+                     [r geosearch nyc fromlonlat -73.9798091 40.7598464 byradius 10 km withdist asc]
+        assert_equal [r georadiusbymember nyc "wtc one" 7 km] \
+                     [r geosearch nyc frommember "wtc one" byradius 7 km]
+    }
+
+    test {GEOSEARCH with COUNT returns the nearest points} {
+        r geosearch nyc fromlonlat -73.9798091 40.7598464 bybox 20 20 km count 2
+    } {{central park n/q/r} 4545}
+
+    test {GEOSEARCH the box spans -180° or 180°} {
+        r del points
+        r geoadd points 179.5 36 point1
+        r geoadd points -179.5 36 point2
+        assert_equal {point1 point2} [r geosearch points fromlonlat 179 36 bybox 400 400 km asc]
+        assert_equal {point2 point1} [r geosearch points fromlonlat -179 36 bybox 400 400 km asc]
+    }
+
+    test {GEOSEARCH against a non existing key} {
+        r del nokey
+        r geosearch nokey frommember samplemember bybox 10 10 km
+    } {}
+
+    test {GEOSEARCHSTORE stores the points with their score or distance} {
+        r del points points2
+        r geoadd points 13.361389 38.115556 "Palermo" \
+                        15.087269 37.502669 "Catania"
+        assert_equal 2 [r geosearchstore points2 points fromlonlat 13.361389 38.115556 byradius 500 km]
+        assert_equal [r zrange points 0 -1 withscores] [r zrange points2 0 -1 withscores]
+        assert_equal 1 [r geosearchstore points2 points frommember Palermo bybox 400 400 km desc count 1 storedist]
+        set res [r zrange points2 0 -1 withscores]
+        assert_equal Catania [lindex $res 0]
+        assert {[lindex $res 1] > 166 && [lindex $res 1] < 167}
+        catch {r geosearchstore points2 points frommember Palermo bybox 400 400 km withdist} e
+        assert_match {*ERR*GEOSEARCHSTORE*} $e
+        assert_equal 0 [r geosearchstore points2 nokey frommember Palermo bybox 400 400 km]
+        assert_equal 0 [r exists points2]
+    }
+
     test {GEORADIUS HUGE, issue #2767} {
         r geoadd users -47.271613776683807 -54.534504198047678 user_000000
         llength [r GEORADIUS users 0 0 50000 km WITHCOORD]
@@ -266,6 +363,7 @@ start_server {tags {"geo"}} {
             }
             r geoadd mypoints {*}$argv
             set res [lsort [r georadius mypoints $search_lon $search_lat $radius_km km]]
+            assert_equal $res [lsort [r geosearch mypoints fromlonlat $search_lon $search_lat byradius $radius_km km]]
             set res2 [lsort $tcl_result]
             set test_result OK
 
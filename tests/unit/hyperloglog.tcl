@@ -194,6 +194,50 @@ start_server {tags {"hll"}} {
         assert {$err < (double($card)/100)*5}
     }
 
+    test {PFCOUNT multiple-keys merge of dense HLLs retains the max registers} {
+        r del hll hll1 hll2
+        for {set x 1} {$x < 1000} {incr x} {
+            r pfadd hll1 "foo-$x"
+            r pfadd hll2 "bar-$x"
+        }
+        r pfdebug todense hll1
+        r pfdebug todense hll2
+        r pfmerge hll hll1 hll2
+        assert {[r pfdebug encoding hll] eq {dense}}
+        set regs1 [r pfdebug getreg hll1]
+        set regs2 [r pfdebug getreg hll2]
+        foreach reg [r pfdebug getreg hll] reg1 $regs1 reg2 $regs2 {
+            assert {$reg == max($reg1,$reg2)}
+        }
+        assert {[r pfcount hll] == [r pfcount hll1 hll2]}
+    }
+
+    test {PFCOUNT multiple-keys cached union is invalidated by writes} {
+        r del hll1 hll2 hll3
+        r pfadd hll1 a b c
+        r pfadd hll2 d e
+        assert {[r pfcount hll1 hll2 hll3] == 5}
+        assert {[r pfcount hll1 hll2 hll3] == 5}
+        r pfadd hll3 f
+        assert {[r pfcount hll1 hll2 hll3] == 6}
+        r pfadd hll1 g
+        assert {[r pfcount hll1 hll2 hll3] == 7}
+        r set hll2 [r get hll3]
+        assert {[r pfcount hll1 hll2 hll3] == 5}
+        r del hll1
+        assert {[r pfcount hll1 hll2 hll3] == 1}
+        r pfmerge hll1 hll3
+        r pfadd hll1 h
+        assert {[r pfcount hll1 hll2 hll3] == 2}
+        r debug reload
+        assert {[r pfcount hll1 hll2 hll3] == 2}
+        r pexpire hll1 1
+        after 10
+        assert {[r pfcount hll1 hll2 hll3] == 1}
+        r flushall
+        assert {[r pfcount hll1 hll2 hll3] == 0}
+    }
+
     test {PFDEBUG GETREG returns the HyperLogLog raw registers} {
         r del hll
         r pfadd hll 1 2 3
@@ -78,3 +78,37 @@ start_server {tags {"introspection"}} {
         assert_match {*calls=1,*} [cmdstat geoadd]
     }
 }
+
+start_server {tags {"introspection"}} {
+    test {INFO MAP replies with the fields of each section} {
+        set info [r info server map]
+        assert_equal {Server} [dict keys $info]
+        assert_equal [s redis_version] [dict get $info Server redis_version]
+        set info [r info map]
+        assert {[dict exists $info Memory used_memory]}
+        assert {[dict exists $info Clients connected_clients]}
+        catch {r info server memory map} e
+        set e
+    } {ERR*syntax*}
+
+    test {mem_clients_normal follows the clients buffers} {
+        set orig [s mem_clients_normal]
+        set rd [redis_deferring_client]
+        $rd client setname reader
+        $rd read
+        r set bigkey [string repeat x 1000000]
+        # the output buffer of the client grows as it is not reading
+        for {set j 0} {$j < 10} {incr j} {$rd get bigkey}
+        wait_for_condition 50 100 {
+            [s mem_clients_normal] > $orig + 1000000
+        } else {
+            fail "Output buffer memory not accounted"
+        }
+        $rd close
+        wait_for_condition 50 100 {
+            [s mem_clients_normal] < $orig + 100000
+        } else {
+            fail "Memory of the freed client still accounted"
+        }
+    }
+}
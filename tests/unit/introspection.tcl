@@ -3,6 +3,29 @@ start_server {tags {"introspection"}} {
         r client list
     } {*addr=*:* fd=* age=* idle=* flags=N db=9 sub=0 psub=0 multi=-1 qbuf=26 qbuf-free=* obl=0 oll=0 omem=0 events=r cmd=client*}
 
+    test {CLIENT INFO reports the resources used by the client} {
+        set rd [redis_deferring_client]
+        $rd client setname busy
+        $rd read
+        for {set j 0} {$j < 10} {incr j} {
+            $rd set key:$j [string repeat x 1000]
+            $rd read
+        }
+        $rd client info
+        set info [$rd read]
+        assert_match {*tot-net-in=*} $info
+        regexp {tot-net-in=([0-9]+)} $info - netin
+        regexp {tot-cmds=([0-9]+)} $info - cmds
+        assert {$netin > 10000}
+        assert_equal 12 $cmds
+        # The busiest client by network input is listed first.
+        assert_match {*name=busy *} [lindex [split [r client top net-in count 1] "\n"] 0]
+        assert_equal 2 [llength [split [string trim [r client top cmds count 2]] "\n"]]
+        $rd close
+        catch {r client top count 0} e
+        set e
+    } {ERR*positive*}
+
     test {MONITOR can log executed commands} {
         set rd [redis_deferring_client]
         $rd monitor
@@ -57,4 +80,92 @@ start_server {tags {"introspection"}} {
             fail "Client still listed in CLIENT LIST after SETNAME."
         }
     }
+
+    test {CLIENT PRIORITY sets the client flag} {
+        set rd [redis_deferring_client]
+        $rd client setname prioclient
+        assert_equal [$rd read] "OK"
+        $rd client priority on
+        assert_equal [$rd read] "OK"
+        assert_match {*name=prioclient * flags=p *} [r client list]
+        $rd client priority off
+        assert_equal [$rd read] "OK"
+        assert_match {*name=prioclient * flags=N *} [r client list]
+        catch {r client priority maybe} e
+        assert_match {*syntax*} $e
+        $rd close
+    }
+
+    test {Reads are delayed once the event loop is over its latency target} {
+        r config set eventloop-latency-target 10
+        set throttled [s throttled_reads]
+        set busy [redis_deferring_client]
+        set clients {}
+        for {set j 0} {$j < 3} {incr j} {lappend clients [redis_deferring_client]}
+        set prio [redis_deferring_client]
+        $prio client priority on
+        assert_equal [$prio read] "OK"
+        # The commands of all the clients are read by the same iteration,
+        # once the server is done sleeping.
+        $busy debug sleep 0.2
+        after 50
+        foreach rd $clients {$rd debug sleep 0.05}
+        $prio ping
+        assert_equal [$prio read] "PONG"
+        foreach rd $clients {assert_equal [$rd read] "OK"}
+        assert_equal [$busy read] "OK"
+        assert {[s throttled_reads] >= $throttled+2}
+        foreach rd [concat $clients $busy $prio] {$rd close}
+        r config set eventloop-latency-target 0
+    }
+
+    test {Idle clients give their query buffer back} {
+        set rd [redis_deferring_client]
+        $rd client setname idleclient
+        assert_equal [$rd read] "OK"
+        # The buffer is released once the command is processed, or by
+        # clientsCron() for the clients that have one of their own.
+        wait_for_condition 50 100 {
+            [string match {*name=idleclient * qbuf=0 qbuf-free=0 *} [r client list]]
+        } else {
+            fail "The query buffer of the idle client was not released"
+        }
+        # The client keeps working with a buffer taken from the pool.
+        $rd set foo [string repeat x 100]
+        assert_equal [$rd read] "OK"
+        $rd get foo
+        assert_equal [$rd read] [string repeat x 100]
+        $rd close
+    }
+
+    test {Clients processing complete commands don't hold a query buffer} {
+        set rd [redis_deferring_client]
+        $rd client setname sharedqb
+        assert_equal [$rd read] "OK"
+        $rd ping
+        assert_equal [$rd read] "PONG"
+        assert_match {*name=sharedqb * qbuf=0 qbuf-free=0 *} [r client list]
+        $rd close
+    }
+
+    test {Partially received commands are kept in a private query buffer} {
+        set rd [redis_deferring_client]
+        $rd client setname partialqb
+        assert_equal [$rd read] "OK"
+        # The data after the last complete command of the read is retained,
+        # the arguments parsed so far are kept by the client.
+        $rd write "*1\r\n\$4\r\nping\r\n*3\r\n\$3\r\nset\r\n\$7\r\npartial"
+        $rd flush
+        assert_equal [$rd read] "PONG"
+        wait_for_condition 50 100 {
+            [string match {*name=partialqb * qbuf=7 *} [r client list]]
+        } else {
+            fail "The partial command was not retained"
+        }
+        $rd write "\r\n\$5\r\nvalue\r\n"
+        $rd flush
+        assert_equal [$rd read] "OK"
+        assert_equal [r get partial] "value"
+        $rd close
+    }
 }
@@ -57,6 +57,23 @@ start_server {tags {"keyspace"}} {
         append res [r exists emptykey]
     } {10}
 
+    test {Keys of every length around the hash block size are distinct} {
+        r flushdb
+        assert_match {*hash_function:*} [r info server]
+        # Keys sharing a prefix, that differ only in the last byte or in
+        # the length, for the short and the multi block hashing paths.
+        for {set len 1} {$len <= 40} {incr len} {
+            r set [string repeat a $len] $len
+            r set "[string repeat a [expr {$len-1}]]b" b$len
+        }
+        assert_equal 80 [r dbsize]
+        for {set len 1} {$len <= 40} {incr len} {
+            assert_equal $len [r get [string repeat a $len]]
+            assert_equal b$len [r get "[string repeat a [expr {$len-1}]]b"]
+        }
+        r flushdb
+    } {OK}
+
     test {Commands pipelining} {
         set fd [r channel]
         puts -nonewline $fd "SET k1 xyzk\r\nGET k1\r\nPING\r\n"
@@ -272,4 +289,176 @@ start_server {tags {"keyspace"}} {
         r keys *
         r keys *
     } {dlskeriewrioeuwqoirueioqwrueoqwrueqw}
+
+    test {KEYS replied in the background} {
+        r flushdb
+        r debug populate 100000
+        r pexpire key:7 1
+        after 10
+        set expected [lsort [r keys key:1*]]
+        r config set replies-incremental-threshold 1
+        assert_equal $expected [lsort [r keys key:1*]]
+        assert_equal 99999 [llength [r keys *]]
+        assert_equal {} [r keys nomatch*]
+        r config set replies-incremental-threshold 100000
+    }
+
+    test {KEYS replied in the background is completed before a key is deleted} {
+        r config set replies-incremental-threshold 1
+        set rd [redis_deferring_client]
+        $rd keys *
+        r del key:1
+        set reply [$rd read]
+        assert_equal [llength $reply] [llength [lsort -unique $reply]]
+        if {[lsearch -exact $reply key:1] == -1} {
+            assert_equal 99998 [llength $reply]
+        } else {
+            assert_equal 99999 [llength $reply]
+        }
+        $rd close
+        r config set replies-incremental-threshold 100000
+    }
+}
+
+start_server {tags {"keyspace"} overrides {keyspace-open-addressing yes}} {
+    test {Open addressing keyspace: add, lookup and delete} {
+        r flushdb
+        r debug populate 10000
+        for {set j 0} {$j < 10000} {incr j 2} {
+            r del key:$j
+        }
+        set err {}
+        for {set j 0} {$j < 10000} {incr j} {
+            set exists [r exists key:$j]
+            if {$exists != ($j % 2)} {
+                set err "key:$j exists: $exists"
+                break
+            }
+        }
+        list $err [r dbsize]
+    } {{} 5000}
+
+    test {Open addressing keyspace: SCAN returns all the keys while resizing} {
+        r flushdb
+        r debug populate 2000
+        set cur 0
+        set keys {}
+        set added 0
+        while 1 {
+            set res [r scan $cur count 50]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            # Force resizes while scanning, deleting and adding keys.
+            if {$added < 5000} {
+                for {set j 0} {$j < 250} {incr j} {
+                    r set new:$added x
+                    incr added
+                }
+            }
+            if {$cur == 0} break
+        }
+        set keys [lsort -unique $keys]
+        set missing 0
+        for {set j 0} {$j < 2000} {incr j} {
+            if {[lsearch -sorted $keys key:$j] == -1} {incr missing}
+        }
+        set missing
+    } {0}
+
+    test {Open addressing keyspace: expires and RANDOMKEY} {
+        r flushdb
+        for {set j 0} {$j < 100} {incr j} {
+            r psetex key:$j 100 x
+        }
+        r set persistent x
+        wait_for_condition 50 100 {
+            [r dbsize] == 1
+        } else {
+            fail "Keys are not actively expired"
+        }
+        r randomkey
+    } {persistent}
+}
+
+start_server {tags {"keyspace"}} {
+    proc keystat {field} {
+        if {[regexp "\r\n$field:(.*?)\r\n" [r info keystats] - value]} {
+            return $value
+        }
+    }
+
+    test {Keyspace stats are disabled by default} {
+        r get foo
+        keystat db9
+    } {}
+
+    test {Keyspace stats count the lookups per DB and prefix} {
+        r config set keyspace-stats-sample-ratio 1
+        r config set keyspace-stats-prefixes "user: user:vip: sess:"
+        r set user:1 a
+        r set user:vip:1 b
+        r get user:1
+        r get user:2
+        r get user:vip:1
+        r get other
+        r set sess:1 c
+        r get sess:1
+        assert_equal {hits=3,misses=2,writes=3} [keystat db9]
+        # The prefixes are sorted and the longest one matching is used.
+        assert_equal {hits=1,misses=0,writes=1,prefix=sess:} [keystat prefix0]
+        assert_equal {hits=1,misses=1,writes=1,prefix=user:} [keystat prefix1]
+        keystat prefix2
+    } {hits=1,misses=0,writes=1,prefix=user:vip:}
+
+    test {Keyspace stats prefixes keep their counters when changed} {
+        r config set keyspace-stats-prefixes "user:vip: cache:"
+        assert_equal {hits=0,misses=0,writes=0,prefix=cache:} [keystat prefix0]
+        assert_equal {hits=1,misses=0,writes=1,prefix=user:vip:} [keystat prefix1]
+        r config resetstat
+        assert_equal {} [keystat db9]
+        keystat prefix1
+    } {hits=0,misses=0,writes=0,prefix=user:vip:}
+
+    test {Keyspace stats sample the lookups} {
+        r config set keyspace-stats-sample-ratio 10
+        for {set j 0} {$j < 100} {incr j} {r get nokey}
+        r config set keyspace-stats-sample-ratio 0
+        keystat db9
+    } {hits=0,misses=100,writes=0}
+}
+
+foreach openaddr {no yes} {
+    start_server [list tags {"keyspace"} overrides [list keyspace-open-addressing $openaddr keyspace-async-resize-threshold 1]] {
+        test "Keyspace tables allocated in background (open addressing: $openaddr)" {
+            r flushall
+            r config resetstat
+            for {set j 0} {$j < 50} {incr j} {
+                set args {}
+                for {set k 0} {$k < 1000} {incr k} {
+                    lappend args key:$j:$k $k
+                }
+                r mset {*}$args
+            }
+            assert_equal 50000 [r dbsize]
+            wait_for_condition 50 100 {
+                [s keyspace_async_resizes] > 0
+            } else {
+                fail "No keyspace table was allocated in background"
+            }
+            for {set j 0} {$j < 50} {incr j} {
+                assert_equal 999 [r get key:$j:999]
+            }
+        }
+
+        test "Keyspace tables are allocated in the main thread if disabled" {
+            r flushall
+            r config set keyspace-async-resize-threshold 0
+            r config resetstat
+            r debug populate 1000
+            for {set j 0} {$j < 20000} {incr j} {r set k$j $j}
+            assert_equal 21000 [r dbsize]
+            assert_equal 0 [s keyspace_async_resizes]
+            r config set keyspace-async-resize-threshold 1
+        }
+    }
 }
@@ -61,4 +61,95 @@ start_server {tags {"latency-monitor"}} {
         after 500
         assert_match {*expire-cycle*} [r latency latest]
     }
+
+    test {LATENCY HISTOGRAM reports the calls and percentiles of commands} {
+        r config resetstat
+        for {set j 0} {$j < 100} {incr j} {r set foo bar}
+        set reply [r latency histogram set unknown-command]
+        assert_equal [llength $reply] 2
+        assert_equal [lindex $reply 0] set
+        set h [lindex $reply 1]
+        assert_equal [dict get $h calls] 100
+        assert {[dict get $h p50] <= [dict get $h p99]}
+        assert {[dict get $h p99] <= [dict get $h p999]}
+        set count 0
+        foreach {bound n} [dict get $h histogram_usec] {incr count $n}
+        assert_equal $count 100
+        assert_match {*set*} [dict keys [r latency histogram]]
+    }
+
+    test {INFO commandstats reports the latency percentiles} {
+        r config resetstat
+        r set foo bar
+        assert_match {*cmdstat_set:calls=1,*,p50=*,p99=*,p999=*} \
+            [r info commandstats]
+        r config resetstat
+        assert_equal -1 [lsearch [dict keys [r latency histogram]] set]
+    }
+
+    test {INFO eventloop reports the event loop phases} {
+        r config resetstat
+        after 200
+        set info [r info eventloop]
+        foreach phase {events cron reads expire beforesleep} {
+            assert_match "*eventloop_${phase}:calls=*,max_usec=*" $info
+        }
+    }
+
+    test {LATENCY of the event loop phases are collected} {
+        # The events of the keyspace notifications stream are appended by
+        # beforeSleep(), after the command that generated them.
+        r config set notify-keyspace-events KA
+        r config set notify-keyspace-events-stream-maxlen 1000000
+        r config set notify-keyspace-events-stream evstream
+        r config set latency-monitor-threshold 20
+        r latency reset
+        r eval {
+            for i = 1, 300000 do redis.call('set','k'..i,i) end
+        } 0
+        set events [r latency latest]
+        r config set latency-monitor-threshold 0
+        r config set notify-keyspace-events-stream ""
+        r config set notify-keyspace-events ""
+        assert_match {*eventloop-blocked*} $events
+        assert_match {*eventloop-beforesleep*} $events
+    }
+
+    test {LATENCY of sub-millisecond events is collected in microseconds} {
+        r config set latency-monitor-threshold 100us
+        assert_equal {latency-monitor-threshold 100us} \
+            [r config get latency-monitor-threshold]
+        r latency reset
+        r debug sleep 0.0005
+        set e [lindex [r latency history command usec] 0]
+        assert {[lindex $e 1] >= 400 && [lindex $e 1] < 100000}
+        assert_equal 0 [lindex [lindex [r latency history command] 0] 1]
+        foreach event [r latency latest usec] {
+            lassign $event eventname time latency max
+            if {$eventname eq "command"} {assert {$max >= 400}}
+        }
+        assert_match {*command*us*} [r latency doctor]
+        r config set latency-monitor-threshold 2
+        assert_equal {latency-monitor-threshold 2} \
+            [r config get latency-monitor-threshold]
+        assert_error {*} {r config set latency-monitor-threshold 10s}
+        r config set latency-monitor-threshold 0
+    }
+
+    test {LATENCY history length can be changed at runtime} {
+        r config set latency-monitor-threshold 1
+        r latency reset
+        for {set j 0} {$j < 3} {incr j} {
+            r debug sleep 0.002
+            after 1000
+        }
+        assert_equal 3 [llength [r latency history command]]
+        r config set latency-monitor-history-len 2
+        set h [r latency history command]
+        assert_equal 2 [llength $h]
+        r config set latency-monitor-history-len 1000
+        assert_equal $h [r latency history command]
+        r config set latency-monitor-history-len 160
+        r config set latency-monitor-threshold 0
+    }
 }
@@ -36,4 +36,67 @@ start_server {tags {"lazyfree"}} {
             fail "Memory is not reclaimed by FLUSHDB ASYNC"
         }
     }
+
+    test "Lazy expire of many keys in a row reclaims all the values" {
+        r flushdb
+        r config set lazyfree-lazy-expire yes
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 100} {incr i} {
+            lappend args $i
+        }
+        # More keys than a lazyfree batch holds, each one with a value big
+        # enough to be released in background.
+        for {set j 0} {$j < 300} {incr j} {
+            r sadd set:$j {*}$args
+            r pexpire set:$j 100
+        }
+        set peak_mem [s used_memory]
+        wait_for_condition 50 100 {
+            [r dbsize] == 0 &&
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem
+        } else {
+            fail "Lazy expired values were not released"
+        }
+        r config set lazyfree-lazy-expire no
+    }
+}
+
+start_server {tags {"lazyfree"} overrides {lazyfree-threads 4}} {
+    test "UNLINK of a large hash is reclaimed by multiple lazyfree threads" {
+        set orig_mem [s used_memory]
+        set args {}
+        for {set i 0} {$i < 200000} {incr i} {
+            lappend args $i $i
+        }
+        r hset myhash {*}$args
+        assert_encoding hashtable myhash
+        set peak_mem [s used_memory]
+        assert {[r unlink myhash] == 1}
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $orig_mem*2
+        } else {
+            fail "Memory is not reclaimed by UNLINK"
+        }
+    }
+
+    test "FLUSHALL ASYNC of a large dataset with multiple lazyfree threads" {
+        r debug populate 200000
+        r select 10
+        r debug populate 100000
+        set peak_mem [s used_memory]
+        r flushall async
+        assert_equal 0 [r dbsize]
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0 &&
+            [s used_memory] < $peak_mem/2
+        } else {
+            fail "Memory is not reclaimed by FLUSHALL ASYNC"
+        }
+        r select 9
+        r debug populate 1000
+        assert_equal 1000 [r dbsize]
+    }
 }
@@ -19,3 +19,39 @@ start_server {tags {"limits"} overrides {maxclients 10}} {
         set e
     } $expected_code
 }
+
+# Accept threads only serve the plain TCP port.
+if {!$::tls} {
+    start_server {tags {"limits"} overrides {maxclients 10 accept-threads 4}} {
+        test {Check if maxclients works refusing connections with accept threads} {
+            set c 0
+            catch {
+                while {$c < 50} {
+                    incr c
+                    set rd [redis_deferring_client]
+                    $rd ping
+                    $rd read
+                    after 100
+                }
+            } e
+            assert {$c > 8 && $c <= 10}
+            set e
+        } {*ERR max*reached*}
+    }
+
+    start_server {tags {"limits"} overrides {accept-threads 4}} {
+        test {Clients accepted by the accept threads are served} {
+            set clients {}
+            for {set j 0} {$j < 50} {incr j} {
+                set rd [redis [srv 0 host] [srv 0 port]]
+                $rd select 9
+                $rd set key$j $j
+                lappend clients $rd
+            }
+            foreach rd $clients {
+                $rd close
+            }
+            list [r dbsize] [r get key49]
+        } {50 49}
+    }
+}
@@ -24,7 +24,8 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        allkeys-random allkeys-lru allkeys-lfu volatile-lru volatile-lfu volatile-random volatile-ttl
+        allkeys-random allkeys-lru allkeys-lfu allkeys-lfu-size volatile-lru
+        volatile-lfu volatile-lfu-size volatile-random volatile-ttl
     } {
         test "maxmemory - is the memory limit honoured? (policy $policy)" {
             # make sure to start with a blank instance
@@ -55,6 +56,106 @@ start_server {tags {"maxmemory"}} {
         }
     }
 
+    test "maxmemory - allkeys-lfu-size evicts large values before small keys" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lfu-size
+        r config set maxmemory-samples 10
+        for {set j 0} {$j < 1000} {incr j} {
+            r set small:$j x
+        }
+        for {set j 0} {$j < 50} {incr j} {
+            r set big:$j [string repeat x 16384]
+        }
+        r config set maxmemory [expr {[s used_memory]+10*1024}]
+        # Adding more small keys must evict the large values first.
+        for {set j 0} {$j < 1000} {incr j} {
+            r set newsmall:$j x
+        }
+        r config set maxmemory 0
+        r config set maxmemory-samples 5
+        set small 0
+        set big 0
+        foreach k [r keys *] {
+            if {[string match small:* $k]} {incr small}
+            if {[string match big:* $k]} {incr big}
+        }
+        # Eviction is approximated, so a few small keys may be evicted when
+        # no large value is sampled.
+        assert {$big > 0 && $big < 50}
+        assert {$small > 980}
+    }
+
+    test "maxmemory - background eviction keeps memory under the soft limit" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        set used [s used_memory]
+        set limit [expr {$used+400*1024}]
+        for {set j 0} {$j < 300} {incr j} {
+            r set key:$j [string repeat x 1024]
+        }
+        # Set the soft limit about 200k over the initial memory usage, that
+        # is about 100k under the memory used by our keys.
+        set soft [expr {($used+200*1024)*100/$limit}]
+        r config resetstat
+        r config set maxmemory-soft-limit $soft
+        r config set maxmemory $limit
+        # The memory is checked while INFO builds its reply, so allow a few
+        # kilobytes over the soft limit.
+        wait_for_condition 50 100 {
+            [s used_memory] < $limit*$soft/100+4096
+        } else {
+            fail "Memory is not brought under the soft limit"
+        }
+        # Keys were evicted in background, without any write command.
+        assert {[s background_evicted_keys] > 0}
+        assert_equal [s evicted_keys] [s background_evicted_keys]
+        r config set maxmemory-soft-limit 0
+        r config set maxmemory 0
+    }
+
+    test "maxmemory - MEMORY EVICTION-STATS reports evictions and the shadow LRU" {
+        r flushall
+        r config set maxmemory 0
+        r config set maxmemory-policy allkeys-lru
+        r config set maxmemory-shadow-sampling 1
+        r config resetstat
+        for {set j 0} {$j < 200} {incr j} {
+            r set key:$j [string repeat x 1024]
+        }
+        for {set j 0} {$j < 200} {incr j} {
+            r get key:$j
+            r get key:$j
+            r get nokey:$j
+        }
+        set stats [r memory eviction-stats]
+        assert_equal allkeys-lru [dict get $stats policy]
+        assert_equal 400 [dict get $stats keyspace.hits]
+        assert_equal 200 [dict get $stats keyspace.misses]
+        # Every key is tracked with a sampling of 1.
+        assert_equal 600 [dict get $stats sampled.accesses]
+        assert_equal 0 [dict get $stats evicted.keys]
+        assert {[dict get $stats shadow.keys] <= [r dbsize]}
+
+        r config set maxmemory [expr {[s used_memory]+50*1024}]
+        for {set j 200} {$j < 400} {incr j} {
+            r set key:$j [string repeat x 1024]
+        }
+        r config set maxmemory 0
+        set stats [r memory eviction-stats]
+        set evicted [dict get $stats evicted.keys]
+        assert {$evicted > 0}
+        set histogram 0
+        foreach {bucket count} [dict get $stats evicted.idle-time] {
+            incr histogram $count
+        }
+        assert_equal $evicted $histogram
+
+        r config set maxmemory-shadow-sampling 0
+        assert {![dict exists [r memory eviction-stats] shadow.policy]}
+    }
+
     foreach policy {
         allkeys-random allkeys-lru volatile-lru volatile-random volatile-ttl
     } {
@@ -98,7 +199,7 @@ start_server {tags {"maxmemory"}} {
     }
 
     foreach policy {
-        volatile-lru volatile-lfu volatile-random volatile-ttl
+        volatile-lru volatile-lfu volatile-lfu-size volatile-random volatile-ttl
     } {
         test "maxmemory - policy $policy should only remove volatile keys." {
             # make sure to start with a blank instance
@@ -173,6 +274,10 @@ proc test_slave_buffers {test_name cmd_count payload_len limit_memory pipeline}
                 fail "Replication not started."
             }
 
+            # call the commands used below once, so that their latency
+            # histograms are already allocated when measuring the memory
+            $master client list
+
             # measure used memory after the slave connected and set maxmemory
             set orig_used [s -1 used_memory]
             set orig_client_buf [s -1 mem_clients_normal]
@@ -241,3 +346,254 @@ test_slave_buffers {slave buffer are counted correctly} 1000000 10 0 1
 # test again with fewer (and bigger) commands without pipeline, but with eviction
 test_slave_buffers "replica buffer don't induce eviction" 100000 100 1 0
 
+
+start_server {tags {"maxmemory"} overrides {tiered-storage yes maxmemory-policy allkeys-lru appendonly yes}} {
+    proc swapped_keys {} {
+        set keys {}
+        foreach k [r keys *] {
+            if {[r object encoding $k] eq {swapped}} {lappend keys $k}
+        }
+        return $keys
+    }
+
+    proc fill_tiered_dataset {} {
+        set setcount 0
+        set hcount 0
+        set zcount 0
+        r flushall
+        r config set maxmemory 0
+        set used [s used_memory]
+        for {set j 0} {$j < 200} {incr j} {
+            r set str:$j [string repeat "v$j-" 250]
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            r rpush list:$j {*}[lrepeat 50 [string repeat "e$j" 10]]
+            r hset hash:$j {*}[concat {*}[lmap i [lrepeat 25 x] {list f[incr hcount] [string repeat "f$j" 10]}]]
+            r sadd set:$j {*}[lmap i [lrepeat 50 x] {incr setcount}]
+            r zadd zset:$j {*}[concat {*}[lmap i [lrepeat 50 x] {list [incr zcount] m$zcount}]]
+        }
+        r config set maxmemory [expr {$used+150*1024}]
+        # Any write command triggers the eviction.
+        r set trigger 1
+    }
+
+    test {Tiered storage moves cold values to disk instead of evicting keys} {
+        fill_tiered_dataset
+        assert_equal 281 [r dbsize]
+        assert_equal 0 [s evicted_keys]
+        assert {[s tiered_swapped_values] > 0}
+        assert {[s tiered_file_size] > 0}
+        assert {[llength [swapped_keys]] == [s tiered_swapped_values]}
+        set limit [lindex [r config get maxmemory] 1]
+        assert {[s used_memory]-[s mem_not_counted_for_evict] < ($limit+4096)}
+    }
+
+    test {Tiered storage reads back the values when accessed} {
+        set reads [s tiered_async_reads]
+        foreach k [swapped_keys] {
+            switch -glob $k {
+                str:* {
+                    set j [lindex [split $k :] 1]
+                    assert_equal [string repeat "v$j-" 250] [r get $k]
+                }
+                list:* {assert_equal 50 [llength [r lrange $k 0 -1]]}
+                hash:* {assert_equal 25 [r hlen $k]}
+                set:* {assert_equal 50 [r scard $k]}
+                zset:* {assert_equal 50 [r zcard $k]}
+            }
+        }
+        assert {[s tiered_async_reads] > $reads}
+        assert {[s tiered_swap_ins] > 0}
+    }
+
+    test {Tiered storage: the digest, RDB and AOF include the values on disk} {
+        r config set maxmemory 0
+        set digest [r debug digest]
+        fill_tiered_dataset
+        assert {[s tiered_swapped_values] > 0}
+        assert_equal $digest [r debug digest]
+
+        r config set maxmemory 0
+        r debug reload
+        assert_equal $digest [r debug digest]
+        assert_equal 0 [llength [swapped_keys]]
+
+        fill_tiered_dataset
+        assert {[s tiered_swapped_values] > 0}
+        r config set aof-use-rdb-preamble no
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r config set maxmemory 0
+        r debug loadaof
+        assert_equal $digest [r debug digest]
+    }
+
+    test {Tiered storage: pipelined commands and transactions keep their order} {
+        fill_tiered_dataset
+        set keys [lrange [lsearch -all -inline [swapped_keys] str:*] 0 9]
+        assert {[llength $keys] > 1}
+        set rd [redis_deferring_client]
+        foreach k $keys {
+            $rd get $k
+            $rd ping
+        }
+        foreach k $keys {
+            set j [lindex [split $k :] 1]
+            assert_equal [string repeat "v$j-" 250] [$rd read]
+            assert_equal PONG [$rd read]
+        }
+        $rd close
+
+        set k [lindex [swapped_keys] 0]
+        set type [r type $k]
+        r multi
+        r type $k
+        r del $k
+        r exists $k
+        assert_equal [list $type 1 0] [r exec]
+    }
+
+    test {Tiered storage: the keys on disk can be deleted, overwritten and expired} {
+        fill_tiered_dataset
+        set keys [swapped_keys]
+        assert {[llength $keys] > 3}
+        lassign $keys k1 k2 k3
+        assert_equal 1 [r del $k1]
+        r set $k2 new
+        assert_equal new [r get $k2]
+        r pexpire $k3 1
+        wait_for_condition 50 100 {
+            [r exists $k3] == 0
+        } else {
+            fail "Key on disk not expired"
+        }
+        assert {[s tiered_garbage_bytes] > 0}
+    }
+
+    test {Tiered storage file is truncated once no value is on disk} {
+        r config set maxmemory 0
+        r flushall
+        wait_for_condition 50 100 {
+            [s tiered_file_size] == 0
+        } else {
+            fail "Tiered storage file not truncated"
+        }
+        assert_equal 0 [s tiered_swapped_values]
+        assert_equal 0 [s tiered_garbage_bytes]
+    }
+}
+
+proc dbstats_field {dbid field} {
+    if {![regexp "\r\ndb$dbid:(\[^\r\n\]*)" [r info dbstats] -> line]} {
+        return 0
+    }
+    foreach kv [split $line ,] {
+        lassign [split $kv =] k v
+        if {$k eq $field} {return $v}
+    }
+    return 0
+}
+
+start_server {tags {"maxmemory"}} {
+    test {INFO dbstats accounts the memory used by the keys of every DB} {
+        r select 3
+        set before [dbstats_field 3 used_memory]
+        for {set j 0} {$j < 200} {incr j} {
+            r rpush mylist [string repeat x 100]$j
+        }
+        set used [dbstats_field 3 used_memory]
+        assert {$used - $before > 20000}
+        assert {[dbstats_field 4 used_memory] == 0}
+
+        # Overwriting a key with the same value doesn't change its memory.
+        r set foo bar
+        set used [dbstats_field 3 used_memory]
+        for {set j 0} {$j < 100} {incr j} {r set foo bar}
+        assert {abs([dbstats_field 3 used_memory] - $used) < 1000}
+
+        r del mylist foo
+        assert {[dbstats_field 3 used_memory] < $before + 1000}
+        r flushdb
+        assert {[dbstats_field 3 used_memory] < 1000}
+        r select 9
+    }
+
+    test {MOVE moves the memory of the key to the target DB} {
+        r select 3
+        r flushdb
+        r select 4
+        r flushdb
+        r select 3
+        set before [dbstats_field 3 used_memory]
+        r rpush k [string repeat x 1000]
+        r set s [string repeat y 1000]
+        assert {[dbstats_field 3 used_memory] - $before > 2000}
+        r move k 4
+        r move s 4
+        assert {[dbstats_field 3 used_memory] < $before + 500}
+        assert {[dbstats_field 4 used_memory] > 2000}
+        r select 4
+        r del k s
+        assert {[dbstats_field 4 used_memory] < 500}
+        r select 9
+    }
+
+    test {INFO dbstats counts the commands executed by every DB} {
+        r config resetstat
+        r select 5
+        for {set j 0} {$j < 10} {incr j} {r set key$j val}
+        assert_equal 10 [dbstats_field 5 ops]
+        r select 9
+        r config resetstat
+        assert_equal 0 [dbstats_field 5 ops]
+        r select 5
+        r flushdb
+        r select 9
+    }
+
+    test {CONFIG SET and GET db-maxmemory} {
+        r config set db-maxmemory "3 1mb 4 2000"
+        assert_equal {db-maxmemory {3 1048576 4 2000}} [r config get db-maxmemory]
+        assert_error {*Invalid*} {r config set db-maxmemory "100000 10"}
+        assert_error {*Invalid*} {r config set db-maxmemory "3 foo"}
+        r config set db-maxmemory "3 0 4 0"
+        assert_equal {db-maxmemory {}} [r config get db-maxmemory]
+    }
+
+    test {db-maxmemory evicts keys only from the DB over its limit} {
+        r config set maxmemory-policy allkeys-random
+        r config set db-maxmemory "3 100000"
+        r select 4
+        for {set j 0} {$j < 100} {incr j} {
+            r set key$j [string repeat x 100]
+        }
+        r select 3
+        for {set j 0} {$j < 2000} {incr j} {
+            r set key$j [string repeat x 100]
+        }
+        assert {[r dbsize] < 2000}
+        assert {[dbstats_field 3 used_memory] < 110000}
+        assert {[dbstats_field 3 evicted_keys] > 0}
+        r select 4
+        assert_equal 100 [r dbsize]
+        assert_equal 0 [dbstats_field 4 evicted_keys]
+        r select 9
+    }
+
+    test {db-maxmemory with noeviction refuses the writes of that DB only} {
+        r config set maxmemory-policy noeviction
+        r select 3
+        catch {r set bigkey [string repeat x 200000]}
+        assert_error {*OOM*db-maxmemory*} {r set anotherkey val}
+        assert_equal 0 [r exists anotherkey]
+        r get key1999
+        r select 4
+        assert_equal OK [r set anotherkey val]
+        r config set db-maxmemory "3 0"
+        r select 3
+        assert_equal OK [r set anotherkey val]
+        r flushall
+        r select 9
+        r config set maxmemory-policy noeviction
+    }
+}
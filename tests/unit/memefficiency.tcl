@@ -34,6 +34,180 @@ start_server {tags {"memefficiency"}} {
             assert {$efficiency >= $expected_min_efficiency}
         }
     }
+
+    test "MEMORY STATS reports the fragmentation of every allocation class" {
+        r debug populate 1000
+        after 200 ;# Let serverCron() sample the allocator stats.
+        set stats [r memory stats]
+        foreach class {keyspace transient module} {
+            assert {[dict get $stats allocator-fragmentation.$class.ratio] >= 0}
+            assert {[dict exists $stats allocator-fragmentation.$class.bytes]}
+        }
+        if {[string match {*jemalloc*} [s mem_allocator]]} {
+            # The keyspace arenas hold the data set we just created.
+            assert {[dict get $stats allocator-fragmentation.keyspace.ratio] >= 1}
+        }
+    }
+
+    test "MEMORY ANALYZE groups the keys by prefix and type" {
+        r flushall
+        r debug populate 1000 user
+        for {set j 0} {$j < 100} {incr j} {
+            r hset session:$j a 1 b 2
+        }
+        r set big:key [string repeat x 200000]
+        r set nosep 1
+        r memory analyze start top 3
+        wait_for_condition 100 50 {
+            [dict get [r memory analyze status] running] == 0
+        } else {
+            fail "Memory analysis not completed"
+        }
+        set res [r memory analyze result count 100]
+        assert_equal 1102 [dict get $res keys]
+        set prefixes {}
+        foreach g [dict get $res prefixes] {
+            dict set prefixes "[dict get $g type] [dict get $g prefix]" $g
+        }
+        assert_equal 4 [dict size $prefixes]
+        assert_equal 1000 [dict get $prefixes {string user:} keys]
+        assert_equal 100 [dict get $prefixes {hash session:} keys]
+        assert_equal 1 [dict get $prefixes {string big:} keys]
+        assert_equal 1 [dict get $prefixes {string } keys]
+        # The prefixes are sorted by memory usage.
+        assert_equal big: [dict get [lindex [dict get $res prefixes] 0] prefix]
+        set top [dict get $res top-keys]
+        assert_equal 3 [llength $top]
+        assert_equal big:key [dict get [lindex $top 0] key]
+        assert {[dict get [lindex $top 0] bytes] >= 200000}
+        assert {[dict get [lindex $top 1] bytes] >= [dict get [lindex $top 2] bytes]}
+    }
+
+    test "MEMORY ANALYZE can be stopped" {
+        r debug populate 100000 many
+        r memory analyze start separator _
+        assert_error "*already in progress*" {r memory analyze start}
+        r memory analyze stop
+        set status [r memory analyze status]
+        assert_equal 0 [dict get $status running]
+        assert {[dict get $status keys] < 101102}
+        r flushall
+    }
+
+    test "Repeated string values are interned" {
+        r flushall
+        r config set value-interning-max-size 1kb
+        set blob "{\"name\":\"[string repeat x 100]\"}"
+        set base_mem [s used_memory]
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j $blob
+        }
+        assert_equal 1000 [r object refcount key:0]
+        assert_equal 1 [s interned_values]
+        # A thousand copies of the value would take more than 100k.
+        assert {[s used_memory]-$base_mem < 100000}
+
+        # Values over the limit and shared integers are not interned.
+        r set big [string repeat y 2000]
+        r set int 100
+        assert_equal 1 [r object refcount big]
+        assert_equal 1 [s interned_values]
+        r config set value-interning-max-size 0
+    }
+
+    test "Interned values are released when no key references them" {
+        r config set value-interning-max-size 1kb
+        set blob [string repeat z 200]
+        r mset a $blob b $blob c $blob
+        r append a !
+        r setrange b 0 Z
+        assert_equal "$blob!" [r get a]
+        assert_equal "Z[string range $blob 1 end]" [r get b]
+        assert_equal $blob [r get c]
+        assert_equal 1 [r object refcount c]
+        r unlink c
+        r flushall async
+        wait_for_condition 50 100 {
+            [s interned_values] == 0
+        } else {
+            fail "Interned values not released"
+        }
+        r set d $blob
+        assert_equal $blob [r get d]
+        r config set value-interning-max-size 0
+    }
+
+    test "Values are re-encoded when the encoding limits change" {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r hset h f$j v$j
+            r sadd s $j
+            r sadd s2 m$j
+            r zadd z $j m$j
+        }
+        set digest [r debug digest]
+        assert_encoding listpack h
+        assert_encoding intset s
+        assert_encoding listpack s2
+        assert_encoding listpack z
+
+        # Lower the limits: the values are converted to the full encodings.
+        r config set hash-max-listpack-entries 10
+        r config set set-max-intset-entries 10
+        r config set set-max-listpack-entries 10
+        r config set zset-max-listpack-entries 10
+        wait_for_condition 50 100 {
+            [s reencode_in_progress] == 0
+        } else {
+            fail "Re-encoding not completed"
+        }
+        assert_equal 4 [s reencode_converted_keys]
+        assert_equal 100.00 [s reencode_progress_perc]
+        assert_encoding hashtable h
+        assert_encoding hashtable s
+        assert_encoding hashtable s2
+        assert_encoding skiplist z
+        assert_equal $digest [r debug digest]
+
+        # Raise them again: back to the compact encodings.
+        r config set hash-max-listpack-entries 512
+        r config set set-max-intset-entries 512
+        r config set set-max-listpack-entries 128
+        r config set zset-max-listpack-entries 128
+        wait_for_condition 50 100 {
+            [s reencode_in_progress] == 0
+        } else {
+            fail "Re-encoding not completed"
+        }
+        assert_encoding listpack h
+        assert_encoding intset s
+        assert_encoding listpack s2
+        assert_encoding listpack z
+        assert_equal $digest [r debug digest]
+        assert_equal v42 [r hget h f42]
+        assert_equal 1 [r sismember s2 m42]
+        assert_equal 42 [r zscore z m42]
+        r debug reload
+        assert_equal $digest [r debug digest]
+    }
+}
+
+start_server {tags {"memefficiency"} overrides {keyspace-hugepages yes}} {
+    test "The keyspace is allocated from huge page regions" {
+        r debug populate 100000 key 100
+        set digest [r debug digest]
+        if {[string match {*jemalloc*} [s mem_allocator]]} {
+            assert {[s mem_keyspace_hugepages] > [s used_memory_dataset]}
+        } else {
+            assert_equal 0 [s mem_keyspace_hugepages]
+        }
+        # The memory is reused after being freed.
+        set mapped [s mem_keyspace_hugepages]
+        r flushall
+        r debug populate 100000 key 100
+        assert_equal $digest [r debug digest]
+        assert {[s mem_keyspace_hugepages] <= $mapped*2}
+    }
 }
 
 start_server {tags {"defrag"}} {
@@ -87,6 +261,48 @@ start_server {tags {"defrag"}} {
             }
         } {}
 
+        test "Active defrag in the defrag thread" {
+            r flushdb
+            r config set activedefrag no
+            r config set active-defrag-thread yes
+            r latency reset
+            r debug populate 700000 asdf 150
+            r debug populate 170000 asdf 300
+            r ping ;# trigger eviction following the previous population
+            after 120 ;# serverCron only updates the info once in 100ms
+            set frag [s allocator_frag_ratio]
+            if {$::verbose} {
+                puts "frag $frag"
+            }
+            assert {$frag >= 1.4}
+            catch {r config set activedefrag yes} e
+            if {![string match {DISABLED*} $e]} {
+                wait_for_condition 50 100 {
+                    [s active_defrag_running] ne 0
+                } else {
+                    fail "defrag not started."
+                }
+                wait_for_condition 150 100 {
+                    [s active_defrag_running] eq 0
+                } else {
+                    fail "defrag didn't stop."
+                }
+
+                # The work was done by the defrag thread, not in the
+                # time slices of the main thread.
+                assert_equal {} [r latency history active-defrag-cycle]
+
+                after 120 ;# serverCron only updates the info once in 100ms
+                set frag [s allocator_frag_ratio]
+                if {$::verbose} {
+                    puts "frag $frag"
+                }
+                assert {$frag < 1.1}
+            }
+            r config set activedefrag no
+            r config set active-defrag-thread no
+        } {OK}
+
         test "Active defrag big keys" {
             r flushdb
             r config resetstat
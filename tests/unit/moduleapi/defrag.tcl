@@ -0,0 +1,37 @@
+set testmodule [file normalize tests/modules/defragtest.so]
+
+start_server {tags {"modules"}} {
+    r module load $testmodule 1000
+    r config set hz 100
+
+    if {[string match {*jemalloc*} [s mem_allocator]]} {
+        test {Module defrag: small and big values are defragged} {
+            r frag.create small 500 64
+            r frag.create big 50000 64
+            r frag.resetstats
+
+            catch {r config set activedefrag yes} e
+            if {![string match {DISABLED*} $e]} {
+                r config set active-defrag-ignore-bytes 1
+                r config set active-defrag-threshold-lower 0
+                r config set active-defrag-cycle-min 1
+                r config set active-defrag-cycle-max 1
+
+                # The big value is resumed every time the time slice of the
+                # defrag is over.
+                wait_for_condition 100 100 {
+                    [dict get [r frag.stats] datatype_resumes] > 0
+                } else {
+                    fail "defrag didn't resume the big value"
+                }
+                r config set activedefrag no
+
+                set stats [r frag.stats]
+                assert {[dict get $stats datatype_attempts] > 2}
+                assert_equal 0 [dict get $stats datatype_wrong_cursor]
+                assert_equal 500 [r frag.check small]
+                assert_equal 50000 [r frag.check big]
+            }
+        }
+    }
+}
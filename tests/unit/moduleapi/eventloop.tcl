@@ -0,0 +1,26 @@
+set testmodule [file normalize tests/modules/eventloop.so]
+
+start_server {tags {"modules"}} {
+    r module load $testmodule
+
+    test {Module event loop callbacks are called} {
+        r eventloop.pipe
+        wait_for_condition 50 100 {
+            [r eventloop.stats] eq {1 5}
+        } else {
+            fail "Pipe events not processed: [r eventloop.stats]"
+        }
+        # The pipe was unregistered and closed: it can be created again.
+        r eventloop.pipe
+        wait_for_condition 50 100 {
+            [r eventloop.stats] eq {2 5}
+        } else {
+            fail "Pipe events not processed: [r eventloop.stats]"
+        }
+        r ping
+    } {PONG}
+
+    test {Module event loop invalid arguments} {
+        r eventloop.errors
+    } {OK}
+}
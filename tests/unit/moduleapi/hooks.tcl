@@ -47,6 +47,7 @@ tags "modules" {
             r config set key-load-delay 1
             r config set dynamic-hz no
             r config set hz 500
+            after 200 ;# the new hz is applied by the next serverCron() run
             r DEBUG LOADAOF
             assert_equal [r hooks.event_last loading-aof-start] 0
             assert_equal [r hooks.event_last loading-end] 0
@@ -16,6 +16,43 @@ start_server {tags {"modules"}} {
         assert { [string match "*cmdstat_module*" $info] }
     }
 
+    test {test RM_CallArgv} {
+        r del h
+        assert_equal [r test.call_argv hset h f1 v1 f2 v2] 2
+        assert_equal [r test.call_argv hget h f2] v2
+        assert_equal [r test.call_argv hget h nofield] {}
+        catch {r test.call_argv nosuchcommand} e
+        assert_match {*No such file*} $e
+        catch {r test.call_argv hget h} e
+        assert_match {*Invalid argument*} $e
+    }
+
+    test {test RM_CallArgv does not leak state across calls} {
+        r select 9
+        r set x db9
+        assert_equal [r test.call_argv select 10] OK
+        # The next call runs in the caller DB again.
+        assert_equal [r test.call_argv get x] db9
+        assert_equal [r test.call_argv client setname foo] OK
+        assert_equal [r test.call_argv client getname] {}
+        r flushall
+    }
+
+    test {test RM_ReplyWithStringNoCopy} {
+        foreach len {0 10 100000 1000000} {
+            set s [r test.reply_nocopy $len]
+            assert_equal $len [string length $s]
+            if {$len} {assert_equal "abcd" [string range $s 0 3]}
+        }
+        # Referenced replies must be sent correctly in pipelines as well.
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 10} {incr j} {$rd test.reply_nocopy 100000}
+        for {set j 0} {$j < 10} {incr j} {
+            assert_equal 100000 [string length [$rd read]]
+        }
+        $rd close
+    }
+
     test {test long double conversions} {
         set ld [r test.ld_conversion]
         assert {[string match $ld "0.00000000000000001"]}
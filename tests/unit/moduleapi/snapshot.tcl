@@ -0,0 +1,65 @@
+set testmodule [file normalize tests/modules/snapshot.so]
+
+start_server {tags {"modules"}} {
+    r module load $testmodule
+
+    test {Module thread safe snapshot of a missing key} {
+        r snapshot.get nokey
+    } {}
+
+    test {Module thread safe snapshot of strings} {
+        r set str hello
+        r set int 12345
+        list [r snapshot.get str] [r snapshot.get int]
+    } {{1 hello} {1 12345}}
+
+    test {Module thread safe snapshot of lists} {
+        r rpush list a b c
+        r snapshot.get list
+    } {2 a b c}
+
+    test {Module thread safe snapshot of hashes} {
+        foreach {key val} {small 1 big 1000} {
+            r del hash
+            for {set j 0} {$j < $val} {incr j} {r hset hash f$j v$j}
+            set snap [r snapshot.get hash]
+            assert_equal 3 [lindex $snap 0]
+            assert_equal [lsort [r hgetall hash]] [lsort [lrange $snap 1 end]]
+        }
+    }
+
+    test {Module thread safe snapshot of sets} {
+        foreach {key val} {ints 1 strings a} {
+            r del set
+            for {set j 0} {$j < 200} {incr j} {r sadd set $val$j}
+            set snap [r snapshot.get set]
+            assert_equal 4 [lindex $snap 0]
+            assert_equal [lsort [r smembers set]] [lsort [lrange $snap 1 end]]
+        }
+    }
+
+    test {Module thread safe snapshot of sorted sets} {
+        foreach len {3 500} {
+            r del zset
+            for {set j 0} {$j < $len} {incr j} {r zadd zset $j m$j}
+            set snap [r snapshot.get zset]
+            assert_equal 5 [lindex $snap 0]
+            assert_equal [r zrange zset 0 -1 withscores] [lrange $snap 1 end]
+        }
+    }
+
+    test {Module thread safe snapshot is not affected by later writes} {
+        r set str old
+        set rd [redis_deferring_client]
+        # The thread keeps the snapshot for one second without the GIL,
+        # meanwhile the server keeps serving the other clients.
+        $rd snapshot.get str 1000
+        after 100
+        set start [clock milliseconds]
+        r set str new
+        assert {[clock milliseconds]-$start < 500}
+        assert_equal {1 old} [$rd read]
+        $rd close
+        r get str
+    } {new}
+}
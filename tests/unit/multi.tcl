@@ -196,6 +196,72 @@ start_server {tags {"multi"}} {
         r exec
     } {PONG}
 
+    test {SWAPDB is able to touch the watched keys that exist} {
+        r flushall
+        r select 0
+        r set x 30
+        r watch x ;# make sure x (set to 30) doesn't change (SWAPDB will "delete" it)
+        r swapdb 0 1
+        r multi
+        r ping
+        set res [r exec]
+        r select 9
+        set res
+    } {}
+
+    test {SWAPDB is able to touch the watched keys that do not exist} {
+        r flushall
+        r select 1
+        r set x 30
+        r select 0
+        r watch x ;# make sure the key x (currently missing) doesn't change (SWAPDB will create it)
+        r swapdb 0 1
+        r multi
+        r ping
+        set res [r exec]
+        r select 9
+        set res
+    } {}
+
+    test {WATCH is not affected by SWAPDB of unrelated keys} {
+        r flushall
+        r select 0
+        r watch x
+        r select 1
+        r set y 10
+        r swapdb 1 2
+        r select 0
+        r multi
+        r ping
+        set res [r exec]
+        r select 9
+        set res
+    } {PONG}
+
+    test {A write fails the EXEC of every client watching the key} {
+        r flushall
+        r set x 1
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rc [redis_deferring_client]
+            $rc watch x
+            $rc read
+            lappend clients $rc
+        }
+        r incr x
+        set results {}
+        foreach rc $clients {
+            $rc multi
+            $rc ping
+            $rc exec
+            $rc read
+            $rc read
+            lappend results [$rc read]
+            $rc close
+        }
+        lsort -unique $results
+    } {{}}
+
     test {WATCH is able to remember the DB a key belongs to} {
         r select 5
         r set x 30
@@ -307,6 +373,29 @@ start_server {tags {"multi"}} {
         close_replication_stream $repl
     }
 
+    test {MULTI / EXEC is propagated correctly (many commands)} {
+        r del list
+        set repl [attach_to_replication_stream]
+        r multi
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush list $j
+        }
+        r get foo
+        r select 10
+        r set foo bar
+        set res [r exec]
+        r select 9
+        assert_equal 1003 [llength $res]
+        assert_equal 1000 [r llen list]
+        set expected [list {select *} {multi}]
+        for {set j 0} {$j < 1000} {incr j} {
+            lappend expected "rpush list $j"
+        }
+        lappend expected {select 10} {set foo bar} {exec}
+        assert_replication_stream $repl $expected
+        close_replication_stream $repl
+    }
+
     test {DISCARD should not fail during OOM} {
         set rd [redis_deferring_client]
         $rd config set maxmemory 1
@@ -71,3 +71,63 @@ start_server {tags {"obuf-limits"}} {
         $rd1 close
     }
 }
+
+start_server {tags {"obuf-limits"}} {
+    test {Pub/Sub output buffer beyond the spill threshold is spilled to disk} {
+        r config set client-output-buffer-limit {pubsub 1mb 0 0}
+        r config set client-output-buffer-spill-threshold 100kb
+        set rd1 [redis_deferring_client]
+
+        $rd1 subscribe foo
+        set reply [$rd1 read]
+        assert {$reply eq "subscribe foo 1"}
+
+        # About 20MB of messages are queued before they can be written to
+        # the socket, way more than the hard limit.
+        set payload [string repeat x 1000]
+        r eval {
+            for i = 1, 20000 do
+                redis.call('publish', 'foo', i .. ':' .. ARGV[1])
+            end
+        } 0 $payload
+        set clients [split [r client list] "\r\n"]
+        set c [split [lindex $clients 1] " "]
+        assert {[regexp {omem=([0-9]+)} $c - omem]}
+        assert {$omem < 1000000}
+        assert {[s mem_clients_spilled] > 10000000}
+
+        # The messages are received in order.
+        for {set j 1} {$j <= 20000} {incr j} {
+            assert_equal [list message foo $j:$payload] [$rd1 read]
+        }
+        wait_for_condition 50 100 {
+            [s mem_clients_spilled] == 0
+        } else {
+            fail "Spilled output buffer not released"
+        }
+        $rd1 close
+    }
+
+    test {Client is disconnected beyond the spill max size} {
+        r config set client-output-buffer-spill-max-size 1mb
+        set rd1 [redis_deferring_client]
+
+        $rd1 subscribe foo
+        set reply [$rd1 read]
+        assert {$reply eq "subscribe foo 1"}
+
+        set payload [string repeat x 1000]
+        r eval {
+            for i = 1, 20000 do
+                redis.call('publish', 'foo', ARGV[1])
+            end
+        } 0 $payload
+        wait_for_condition 50 100 {
+            [s connected_clients] == 1 &&
+            [s mem_clients_spilled] == 0
+        } else {
+            fail "Client not disconnected"
+        }
+        $rd1 close
+    }
+}
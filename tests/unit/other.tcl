@@ -250,3 +250,63 @@ start_server {tags {"other"}} {
         r save
     } {OK}
 }
+
+start_server {tags {"other"}} {
+    test {DEBUG PROFILE samples the stacks of the main thread} {
+        r debug profile start 1 hz 1000
+        r eval {local i = 0 while i < 5000000 do i = i + 1 end} 0
+        wait_for_condition 50 100 {
+            [dict get [r debug profile status] running] == 0
+        } else {
+            fail "The profiler didn't stop"
+        }
+        assert {[dict get [r debug profile status] samples] > 0}
+        set stacks [r debug profile result]
+        assert_match "*;evalGenericCommand;*" $stacks
+        # Every line is a folded stack followed by its number of samples.
+        foreach line [split [string trim $stacks] "\n"] {
+            assert_match {*;* [0-9]*} $line
+        }
+    }
+
+    test {DEBUG PROFILE errors} {
+        catch {r debug profile start 0} e
+        assert_match {*duration*} $e
+        catch {r debug profile start 1 hz 100000} e
+        assert_match {*HZ*} $e
+        r debug profile start 10
+        catch {r debug profile start 10} e
+        assert_match {*already running*} $e
+        r debug profile stop
+        dict get [r debug profile status] running
+    } {0}
+
+    test {DEBUG SDSLEN reports the entry holding an embedded key name} {
+        set key [string repeat k 60]
+        r set $key bar
+        set info [r debug sdslen $key]
+        assert_match {key_sds_len:60, *} $info
+        regexp {key_zmalloc: ([0-9]+)} $info -> key_zmalloc
+        assert {$key_zmalloc > 60}
+    }
+}
+
+if {$::tcl_platform(os) eq "Linux"} {
+    start_server {tags {"other"} overrides {server-cpulist 0 bio-cpulist 0}} {
+        test {The threads are bound to the CPUs of their list} {
+            foreach task [glob /proc/[srv 0 pid]/task/*] {
+                set fd [open $task/status]
+                set status [read $fd]
+                close $fd
+                assert_match "*Cpus_allowed_list:\t0\n*" $status
+            }
+            assert_equal {server-cpulist 0} [r config get server-cpulist]
+        }
+    }
+
+    start_server {tags {"other"} overrides {server-cpulist 0-}} {
+        test {An invalid CPU list is reported in the log} {
+            wait_for_log_message 0 "*Can't set the CPU affinity to '0-'*" 50 20 100
+        }
+    }
+}
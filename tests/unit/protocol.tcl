@@ -55,6 +55,43 @@ start_server {tags {"protocol"}} {
         assert_error "*expected '$', got 'f'*" {r read}
     }
 
+    test "Pipelined commands are parsed and accounted as one batch" {
+        reconnect
+        r config resetstat
+        set proto {}
+        for {set j 0} {$j < 100} {incr j} {
+            append proto "*3\r\n\$3\r\nSET\r\n\$3\r\nkey\r\n\$[string length $j]\r\n$j\r\n"
+        }
+        append proto "*1\r\n\$4\r\nPING\r\n"
+        r write $proto
+        r flush
+        for {set j 0} {$j < 100} {incr j} {
+            assert_equal OK [r read]
+        }
+        assert_equal PONG [r read]
+        assert_equal 99 [r get key]
+        assert_match {*32-127=1,*} [s pipeline_batches]
+    }
+
+    test "Pipelined replies spanning many output buffer blocks" {
+        reconnect
+        r set small x
+        r set big [string repeat y 100000]
+        set proto {}
+        for {set j 0} {$j < 200} {incr j} {
+            append proto "*2\r\n\$3\r\nGET\r\n\$3\r\nbig\r\n"
+            append proto "*2\r\n\$3\r\nGET\r\n\$5\r\nsmall\r\n"
+            append proto "*2\r\n\$4\r\nINCR\r\n\$7\r\ncounter\r\n"
+        }
+        r write $proto
+        r flush
+        for {set j 0} {$j < 200} {incr j} {
+            assert_equal 100000 [string length [r read]]
+            assert_equal x [r read]
+            assert_equal [expr {$j+1}] [r read]
+        }
+    }
+
     test "Generic wrong number of args" {
         reconnect
         assert_error "*wrong*arguments*ping*" {r ping x y z}
@@ -68,6 +105,63 @@ start_server {tags {"protocol"}} {
         assert_error "*unbalanced*" {r read}
     }
 
+    set doubles {0 -0 1.5 -0.125 3 127 128 -42 1234567.125 0.0001220703125
+                 6.103515625e-05 0.1 -0.3 1e300 4503599627370495.5}
+
+    test "Double replies are formatted like %.17g" {
+        reconnect
+        foreach v $doubles {
+            r zadd z $v m
+            assert_equal [format %.17g $v] [r zscore z m]
+        }
+    }
+
+    test "Double replies are formatted like %.17g in RESP3" {
+        if {$::tls} {
+            set s [::tls::socket [srv 0 host] [srv 0 port]]
+        } else {
+            set s [socket [srv 0 host] [srv 0 port]]
+        }
+        fconfigure $s -translation binary
+        # Read the replies up to the PONG, returning the line before it.
+        proc read_until_pong {s} {
+            set last {}
+            while {[set line [gets $s]] ne "+PONG\r"} {set last $line}
+            return $last
+        }
+        puts -nonewline $s "HELLO 3\r\nSELECT 9\r\nPING\r\n"
+        flush $s
+        read_until_pong $s
+        foreach v $doubles {
+            r zadd z $v m
+            puts -nonewline $s "ZSCORE z m\r\nPING\r\n"
+            flush $s
+            assert_equal ",[format %.17g $v]\r" [read_until_pong $s]
+        }
+        close $s
+    }
+
+    test "Aggregate headers in RESP3" {
+        if {$::tls} {
+            set s [::tls::socket [srv 0 host] [srv 0 port]]
+        } else {
+            set s [socket [srv 0 host] [srv 0 port]]
+        }
+        fconfigure $s -translation binary
+        puts -nonewline $s "HELLO 3\r\nSELECT 9\r\nPING\r\n"
+        flush $s
+        read_until_pong $s
+        r del h s
+        r hset h a 1 b 2
+        r sadd s x y z
+        puts -nonewline $s "HGETALL h\r\nSMEMBERS s\r\n"
+        flush $s
+        assert_equal "%2\r" [gets $s]
+        for {set j 0} {$j < 8} {incr j} {gets $s}
+        assert_equal "~3\r" [gets $s]
+        close $s
+    }
+
     set c 0
     foreach seq [list "\x00" "*\x00" "$\x00"] {
         incr c
@@ -47,6 +47,16 @@ start_server {tags {"pubsub"}} {
         __consume_subscribe_messages $client punsubscribe $channels
     }
 
+    proc ssubscribe {client channels} {
+        $client ssubscribe {*}$channels
+        __consume_subscribe_messages $client ssubscribe $channels
+    }
+
+    proc sunsubscribe {client {channels {}}} {
+        $client sunsubscribe {*}$channels
+        __consume_subscribe_messages $client sunsubscribe $channels
+    }
+
     test "Pub/Sub PING" {
         set rd1 [redis_deferring_client]
         subscribe $rd1 somechannel
@@ -196,6 +206,106 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "PUBLISH/PSUBSCRIBE with patterns sharing literal prefixes" {
+        set rd1 [redis_deferring_client]
+        assert_equal {1 2 3 4 5} \
+            [psubscribe $rd1 {* news.* news.sport.* news.[st]* news\\*x}]
+        assert_equal 4 [r publish news.sport.1 hello]
+        assert_equal 2 [r publish news*x hello]
+        assert_equal 1 [r publish new hello]
+        set patterns {}
+        for {set j 0} {$j < 7} {incr j} {
+            lappend patterns [lindex [$rd1 read] 1]
+        }
+        assert_equal [lsort {* news.* news.sport.* news.[st]* * news\\*x *}] \
+            [lsort $patterns]
+        $rd1 close
+    }
+
+    test "PUBLISH/PSUBSCRIBE with the same pattern from many clients" {
+        set clients {}
+        for {set j 0} {$j < 3} {incr j} {
+            set rd [redis_deferring_client]
+            assert_equal {1} [psubscribe $rd {chan.*}]
+            lappend clients $rd
+        }
+        assert_equal 3 [r pubsub numpat]
+        assert_equal 3 [r publish chan.1 hello]
+        foreach rd $clients {
+            assert_equal {pmessage chan.* chan.1 hello} [$rd read]
+        }
+        assert_equal {0} [punsubscribe [lindex $clients 0] {chan.*}]
+        assert_equal 2 [r pubsub numpat]
+        assert_equal 2 [r publish chan.1 hello]
+        foreach rd $clients {$rd close}
+    }
+
+    test "PUBLISH of large messages to many subscribers" {
+        set payload [string repeat "abcd" 2000]
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        assert_equal {1} [subscribe $rd1 {chan}]
+        assert_equal {1} [subscribe $rd2 {chan}]
+        assert_equal {2} [psubscribe $rd1 {ch*}]
+        assert_equal {2} [psubscribe $rd2 {ch*}]
+        for {set j 0} {$j < 3} {incr j} {
+            assert_equal 4 [r publish chan $payload$j]
+        }
+        assert_equal 4 [r publish chan 12345]
+        foreach rd [list $rd1 $rd2] {
+            for {set j 0} {$j < 3} {incr j} {
+                assert_equal [list message chan $payload$j] [$rd read]
+                assert_equal [list pmessage ch* chan $payload$j] [$rd read]
+            }
+            assert_equal {message chan 12345} [$rd read]
+            assert_equal {pmessage ch* chan 12345} [$rd read]
+        }
+        $rd1 close
+        $rd2 close
+    }
+
+    test "SPUBLISH/SSUBSCRIBE basics" {
+        set rd1 [redis_deferring_client]
+
+        # subscribe to two sharded channels, and a pattern matching them
+        assert_equal {1 2} [ssubscribe $rd1 {chan1 chan2}]
+        assert_equal {1} [psubscribe $rd1 {chan*}]
+        assert_equal 1 [r spublish chan1 hello]
+        assert_equal 1 [r spublish chan2 world]
+        assert_equal {smessage chan1 hello} [$rd1 read]
+        assert_equal {smessage chan2 world} [$rd1 read]
+
+        # the sharded channels and the classic ones are separated
+        assert_equal 1 [r publish chan1 hello]
+        assert_equal {pmessage chan* chan1 hello} [$rd1 read]
+        assert_equal {chan1 chan2} [lsort [r pubsub shardchannels]]
+        assert_equal {chan1} [r pubsub shardchannels *1]
+        assert_equal {} [r pubsub channels]
+        assert_equal {chan1 1 chan3 0} [r pubsub shardnumsub chan1 chan3]
+        assert_equal 2 [s pubsubshard_channels]
+
+        # unsubscribe from one of the channels
+        assert_equal {1} [sunsubscribe $rd1 {chan1}]
+        assert_equal 0 [r spublish chan1 hello]
+        assert_equal 1 [r spublish chan2 world]
+        assert_equal {smessage chan2 world} [$rd1 read]
+
+        # unsubscribe from the remaining channel
+        assert_equal {0} [sunsubscribe $rd1 {chan2}]
+        assert_equal {0} [punsubscribe $rd1 {chan*}]
+        assert_equal 0 [r spublish chan2 world]
+        assert_equal 0 [s pubsubshard_channels]
+
+        # clean up clients
+        $rd1 close
+    }
+
+    test "SUNSUBSCRIBE from non-subscribed channels" {
+        set rd1 [redis_deferring_client]
+        assert_equal {0 0 0} [sunsubscribe $rd1 {foo bar quux}]
+        $rd1 close
+    }
+
     test "NUMSUB returns numbers, not strings (#1561)" {
         r pubsub numsub abc def
     } {abc 0 def 0}
@@ -253,6 +363,19 @@ start_server {tags {"pubsub"}} {
         $rd1 close
     }
 
+    test "Keyspace notifications: only the subscribed channels are notified" {
+        r config set notify-keyspace-events KEA
+        set rd1 [redis_deferring_client]
+        assert_equal {1} [subscribe $rd1 {__keyevent@9__:del}]
+        assert_equal {2} [psubscribe $rd1 {__keyspace@9__:b*}]
+        r set foo bar
+        r set bar foo
+        r del foo
+        assert_equal {pmessage __keyspace@9__:b* __keyspace@9__:bar set} [$rd1 read]
+        assert_equal {message __keyevent@9__:del foo} [$rd1 read]
+        $rd1 close
+    }
+
     test "Keyspace notifications: we are able to mask events" {
         r config set notify-keyspace-events KEl
         r del mylist
@@ -387,4 +510,89 @@ start_server {tags {"pubsub"}} {
         r config set notify-keyspace-events EA
         assert_equal {AE} [lindex [r config get notify-keyspace-events] 1]
     }
+
+    test "Keyspace notifications: events are appended to the stream" {
+        r config set notify-keyspace-events A
+        r config set notify-keyspace-events-stream kevents
+        r select 0
+        r del kevents
+        r select 9
+        r set foo bar
+        r del foo
+        r select 0
+        set entries [r xrange kevents - +]
+        r select 9
+        assert_equal 2 [llength $entries]
+        assert_equal {db 9 event set key foo} [lindex $entries 0 1]
+        assert_equal {db 9 event del key foo} [lindex $entries 1 1]
+    }
+
+    test "Keyspace notifications: the stream can be read with XREADGROUP" {
+        r select 0
+        r xgroup create kevents mygroup $
+        set rd [redis_deferring_client]
+        $rd select 0
+        $rd read
+        $rd xreadgroup group mygroup alice block 0 streams kevents >
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 1
+        } else {
+            fail "The consumer is not blocked"
+        }
+        r select 9
+        r lpush mylist a
+        set reply [$rd read]
+        assert_equal {db 9 event lpush key mylist} [lindex $reply 0 1 0 1]
+        r select 0
+        assert_equal 1 [lindex [r xpending kevents mygroup] 0]
+        r select 9
+        $rd close
+    }
+
+    test "Keyspace notifications: the stream is capped" {
+        r config set notify-keyspace-events-stream-maxlen 100
+        r multi
+        for {set j 0} {$j < 1000} {incr j} {
+            r set key:$j $j
+        }
+        r exec
+        r select 0
+        set len [r xlen kevents]
+        assert {$len >= 100 && $len < 300}
+        set last [lindex [r xrevrange kevents + - count 1] 0 1]
+        assert_equal {db 9 event set key key:999} $last
+        r select 9
+        r config set notify-keyspace-events-stream-maxlen 10000
+    }
+
+    test "Keyspace notifications: the stream is propagated as XADD ENTRIES" {
+        set repl [attach_to_replication_stream]
+        r multi
+        r set foo bar
+        r incr counter
+        r exec
+        assert_replication_stream $repl {
+            {select *}
+            {multi}
+            {set foo bar}
+            {incr counter}
+            {exec}
+            {select *}
+            {xadd kevents MAXLEN = * ENTRIES 2 * 3 db 9 event set key foo * 3 db 9 event incrby key counter}
+        }
+        close_replication_stream $repl
+    }
+
+    test "Keyspace notifications: the stream is not fed when disabled" {
+        r config set notify-keyspace-events-stream ""
+        r select 0
+        set len [r xlen kevents]
+        r select 9
+        r set foo bar
+        r select 0
+        assert_equal $len [r xlen kevents]
+        r del kevents
+        r select 9
+        r config set notify-keyspace-events ""
+    }
 }
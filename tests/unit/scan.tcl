@@ -98,7 +98,7 @@ start_server {tags {"scan"}} {
         assert_equal 1000 [llength $keys]
     }
 
-    foreach enc {intset hashtable} {
+    foreach enc {intset listpack hashtable} {
         test "SSCAN with encoding $enc" {
             # Create the Set
             r del set
@@ -107,8 +107,9 @@ start_server {tags {"scan"}} {
             } else {
                 set prefix "ele:"
             }
+            set count [expr {$enc eq {hashtable} ? 200 : 100}]
             set elements {}
-            for {set j 0} {$j < 100} {incr j} {
+            for {set j 0} {$j < $count} {incr j} {
                 lappend elements ${prefix}${j}
             }
             r sadd set {*}$elements
@@ -128,15 +129,15 @@ start_server {tags {"scan"}} {
             }
 
             set keys [lsort -unique $keys]
-            assert_equal 100 [llength $keys]
+            assert_equal $count [llength $keys]
         }
     }
 
-    foreach enc {ziplist hashtable} {
+    foreach enc {listpack hashtable} {
         test "HSCAN with encoding $enc" {
             # Create the Hash
             r del hash
-            if {$enc eq {ziplist}} {
+            if {$enc eq {listpack}} {
                 set count 30
             } else {
                 set count 1000
@@ -172,11 +173,11 @@ start_server {tags {"scan"}} {
         }
     }
 
-    foreach enc {ziplist skiplist} {
+    foreach enc {listpack skiplist} {
         test "ZSCAN with encoding $enc" {
             # Create the Sorted Set
             r del zset
-            if {$enc eq {ziplist}} {
+            if {$enc eq {listpack}} {
                 set count 30
             } else {
                 set count 1000
@@ -328,3 +329,132 @@ start_server {tags {"scan"}} {
         }
     }
 }
+
+start_server {tags {"scan"} overrides {keyspace-ordered-index yes}} {
+    proc scan_all {args} {
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r scan $cur {*}$args]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        lsort $keys
+    }
+
+    test "SCAN MATCH with a prefix uses the keys index" {
+        r flushdb
+        r debug populate 1000
+        assert_equal 100 [llength [scan_all match "key:1??"]]
+        assert_equal 11 [llength [scan_all match "key:10*"]]
+        assert_equal {} [scan_all match "nokey:*"]
+        assert_equal 1000 [llength [scan_all]]
+    }
+
+    test "SCAN COUNT bounds the keys with the prefix examined" {
+        r flushdb
+        r debug populate 1000
+        r set other 1
+        set res [r scan 0 match "key:*" count 10]
+        assert {[lindex $res 0] != 0}
+        assert_equal 10 [llength [lindex $res 1]]
+        set cur [lindex $res 0]
+        r scan $cur match "key:*" count 10
+        assert_error "*invalid or expired SCAN cursor*" {r scan $cur match "key:*" count 10}
+        assert_equal 1000 [llength [scan_all match "key:*" count 7]]
+    }
+
+    test "SCAN TYPE with the keys index" {
+        r flushdb
+        r debug populate 100
+        r sadd key:set a b c
+        r hset key:hash f v
+        assert_equal {key:set} [scan_all match "key:*" type set]
+        assert_equal 100 [llength [scan_all match "key:*" type string]]
+    }
+
+    test "SCAN with the keys index returns the keys existing for all the iteration" {
+        r flushdb
+        r debug populate 1000
+        set res [r scan 0 match "key:*" count 100]
+        set keys [lindex $res 1]
+        set cur [lindex $res 0]
+        for {set j 1000} {$j < 1500} {incr j} {r set key:$j x}
+        for {set j 0} {$j < 1000} {incr j 2} {r del key:$j}
+        while {$cur != 0} {
+            set res [r scan $cur match "key:*" count 100]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+        }
+        set keys [lsort -unique $keys]
+        for {set j 1} {$j < 1000} {incr j 2} {
+            assert {[lsearch -exact -sorted $keys key:$j] != -1}
+        }
+    }
+
+    test "SCAN with the keys index skips the expired keys" {
+        r flushdb
+        r debug set-active-expire 0
+        r debug populate 100
+        for {set j 0} {$j < 50} {incr j} {r pexpire key:$j 1}
+        after 10
+        assert_equal 50 [llength [scan_all match "key:*"]]
+        r debug set-active-expire 1
+    } {OK}
+
+    test "Keys index follows FLUSHDB, SWAPDB and DEBUG RELOAD" {
+        r flushall
+        r debug populate 100
+        r flushdb async
+        assert_equal {} [scan_all match "key:*"]
+        r debug populate 10
+        r swapdb 9 10
+        assert_equal {} [scan_all match "key:*"]
+        r select 10
+        assert_equal 10 [llength [scan_all match "key:*"]]
+        r select 9
+        r swapdb 9 10
+        r debug reload
+        assert_equal 10 [llength [scan_all match "key:*"]]
+        r rename key:1 key:one
+        assert_equal {key:one} [scan_all match "key:o*"]
+    }
+}
+
+start_server {tags {"keyrange"} overrides {keyspace-ordered-index yes}} {
+    test "KEYRANGE returns the keys in lexicographic order" {
+        r flushdb
+        foreach k {user:3 user:1 user:10 user:2 admin:1 zeta} {r set $k x}
+        assert_equal {admin:1 user:1 user:10 user:2 user:3 zeta} [r keyrange - +]
+        assert_equal {user:1 user:10 user:2 user:3} [r keyrange {[user:} {(user;}]
+        assert_equal {user:10 user:2} [r keyrange {(user:1} {[user:2}]
+        assert_equal {user:1 user:10} [r keyrange {[user:} + limit 2]
+        assert_equal {} [r keyrange + -]
+        assert_equal {} [r keyrange {[zz} +]
+    }
+
+    test "KEYRANGE follows the deleted and expired keys" {
+        r flushdb
+        r debug set-active-expire 0
+        foreach k {a b c d} {r set $k x}
+        r del b
+        r pexpire c 1
+        after 10
+        set res [r keyrange - +]
+        r debug set-active-expire 1
+        set res
+    } {a d}
+
+    test "KEYRANGE errors" {
+        assert_error "*string range*" {r keyrange a b}
+        assert_error "*syntax*" {r keyrange - + limit}
+        assert_error "*not an integer*" {r keyrange - + limit x}
+    }
+}
+
+start_server {tags {"keyrange"}} {
+    test "KEYRANGE requires keyspace-ordered-index" {
+        assert_error "*keyspace-ordered-index*" {r keyrange - +}
+    }
+}
@@ -111,6 +111,41 @@ start_server {tags {"scripting"}} {
         } 1 mykey
     } {boolean 1}
 
+    test {EVAL - Redis nested and deferred replies -> Lua type conversion} {
+        r del mystream myhash myzset
+        r xadd mystream 1-1 a 1 b 2
+        r xadd mystream 1-2 c 3
+        r hset myhash f1 v1
+        r zadd myzset 1 a 2 b
+        r eval {
+            local s = redis.call('xrange',KEYS[1],'-','+')
+            local h = redis.call('hgetall',KEYS[2])
+            local z = redis.call('zrange',KEYS[3],0,-1,'withscores')
+            local k = redis.call('keys','my*')
+            local e = redis.pcall('incr',KEYS[2])
+            local n = redis.call('incr','mycounter')
+            return {#s,s[1][1],s[1][2][4],s[2][2][1],h[1],h[2],z[4],#k >= 3,
+                    type(e.err),n,redis.call('del','mycounter')}
+        } 3 mystream myhash myzset
+    } {2 1-1 2 c f1 v1 2 1 string 1 1}
+
+    test {EVAL - RESP3 replies -> Lua type conversion} {
+        r del myhash myset myzset
+        r hset myhash f1 v1
+        r sadd myset a
+        r zadd myzset 1.5 a
+        r eval {
+            redis.setresp(3)
+            local h = redis.call('hgetall',KEYS[1])
+            local s = redis.call('smembers',KEYS[2])
+            local d = redis.call('zscore',KEYS[3],'a')
+            local n = redis.call('get','nokey')
+            local e = redis.call('hscan',KEYS[1],0)
+            return {h.map.f1,tostring(s.set.a),tostring(d.double),
+                    tostring(n),e[1],e[2][1]}
+        } 3 myhash myset myzset
+    } {v1 true 1.5 nil 0 f1}
+
     test {EVAL - Is the Lua client using the currently selected DB?} {
         r set mykey "this is DB 9"
         r select 10
@@ -300,6 +335,52 @@ start_server {tags {"scripting"}} {
             [r evalsha b534286061d4b9e4026607613b95c06c06015ae8 0]
     } {b534286061d4b9e4026607613b95c06c06015ae8 loaded}
 
+    test {EVAL_RO - read commands are allowed} {
+        r set mykey myval
+        list [r eval_ro {return redis.call('get',KEYS[1])} 1 mykey] \
+             [r evalsha_ro [r script load {return redis.call('get',KEYS[1])}] 1 mykey]
+    } {myval myval}
+
+    test {EVAL_RO - write commands are refused} {
+        catch {r eval_ro {return redis.call('set',KEYS[1],'x')} 1 mykey} e
+        list $e [r eval_ro {return redis.pcall('del',KEYS[1])['err']} 1 mykey] \
+             [r get mykey]
+    } {{*not allowed from read-only scripts*} {*not allowed from read-only scripts*} myval}
+
+    test {SCRIPT PROFILE - per line and per command stats} {
+        r script profile reset
+        r config set lua-profiler yes
+        set sha [r script load "redis.call('set',KEYS\[1\],'v')
+for i=1,3 do redis.call('get',KEYS\[1\]) end
+return 1"]
+        r evalsha $sha 1 mykey
+        r evalsha $sha 1 mykey
+        r config set lua-profiler no
+        r evalsha $sha 1 mykey
+        set p [lindex [r script profile $sha] 0]
+        assert_equal $sha [dict get $p sha]
+        assert_equal 2 [dict get $p calls]
+        set lines {}
+        foreach l [dict get $p lines] {
+            lassign $l line hits usec
+            dict set lines $line $hits
+        }
+        assert_equal 2 [dict get $lines 1]
+        assert {[dict get $lines 2] >= 6}
+        assert_equal 2 [dict get $lines 3]
+        set cmds {}
+        foreach cmd [dict get $p commands] {
+            lassign $cmd name calls usec
+            dict set cmds $name $calls
+        }
+        assert_equal {get 6 set 2} [lsort -stride 2 $cmds]
+    }
+
+    test {SCRIPT PROFILE RESET - the statistics are released} {
+        r script profile reset
+        list [r script profile] [r script profile [r script load "return 1"]]
+    } {{} {{}}}
+
     test "In the context of Lua the output of random commands gets ordered" {
         r debug lua-always-replicate-commands 0
         r del myset
@@ -563,6 +644,10 @@ foreach cmdrepl {0 1} {
                 }
             }
 
+            test "EVAL_RO runs on the read-only replica $rt" {
+                r -1 eval_ro {return redis.call('exists',KEYS[1])} 1 x
+            } {1}
+
             test "Now use EVALSHA against the master, with both SHAs $rt" {
                 # The server should replicate successful and unsuccessful
                 # commands as EVAL instead of EVALSHA.
@@ -741,3 +826,31 @@ start_server {tags {"scripting repl"}} {
     }
 }
 
+
+start_server {tags {"scripting"}} {
+    proc restart_and_wait {} {
+        catch {r debug restart}
+        wait_for_condition 50 100 {
+            [catch {r ping}] == 0
+        } else {
+            fail "Server didn't restart"
+        }
+    }
+
+    test {The scripts cache is persisted across restarts} {
+        set sha [r script load {return 'loaded'}]
+        r eval {return 'evaluated'} 0
+        restart_and_wait
+        assert_equal {loaded} [r evalsha $sha 0]
+        assert_equal {evaluated} [r evalsha [r eval {return redis.sha1hex(ARGV[1])} 0 {return 'evaluated'}] 0]
+    }
+
+    test {The scripts cache is not persisted with rdb-save-scripts no} {
+        r script flush
+        r config set rdb-save-scripts no
+        set sha [r script load {return 'loaded'}]
+        restart_and_wait
+        catch {r evalsha $sha 0} e
+        set e
+    } {NOSCRIPT*}
+}
@@ -0,0 +1,45 @@
+if {$::tcl_platform(os) eq "Linux"} {
+    set ::shmsock [file normalize [tmpfile shm.sock]]
+
+    proc shmcli {args} {
+        exec src/redis-cli --shm $::shmsock -n 9 {*}$args
+    }
+
+    start_server [list tags {"shm"} overrides [list shm-socket $::shmsock shm-ring-size 4096]] {
+        test {Commands are executed through the shared memory transport} {
+            assert_equal OK [shmcli set foo bar]
+            assert_equal bar [shmcli get foo]
+            assert_equal bar [r get foo]
+        }
+
+        test {Shared memory clients are flagged in CLIENT LIST} {
+            set line [shmcli client list]
+            assert_match "*addr=$::shmsock:0 *flags=Um *" $line
+        }
+
+        test {Many commands on the same shared memory connection} {
+            r del counter
+            assert_equal 1000 [lindex [split [shmcli -r 1000 incr counter] "\n"] end]
+            assert_equal 1000 [r get counter]
+        }
+
+        test {Values larger than the rings are transferred} {
+            set value [string repeat "0123456789" 50000]
+            set filename [tmpfile shmvalue]
+            set fd [open $filename w]
+            puts -nonewline $fd $value
+            close $fd
+            assert_equal OK [exec src/redis-cli --shm $::shmsock -n 9 -x set big < $filename]
+            assert {[r get big] eq $value}
+            assert {[shmcli get big] eq $value}
+        }
+
+        test {The server frees the client when it goes away} {
+            wait_for_condition 50 100 {
+                [s connected_clients] == 1
+            } else {
+                fail "The shared memory clients were not freed"
+            }
+        }
+    }
+}
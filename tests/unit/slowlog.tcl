@@ -90,4 +90,73 @@ start_server {tags {"slowlog"} overrides {slowlog-log-slower-than 1000000}} {
         r debug sleep 0.2
         assert_equal [r slowlog len] 0
     }
+
+    test {SLOWLOG - latency-tracking-breakdown logs the queue time} {
+        r config set slowlog-max-len 10
+        r config set slowlog-log-slower-than 100000
+        r config set latency-tracking-breakdown yes
+        r slowlog reset
+        # The PING is read together with DEBUG SLEEP, so it waits for it.
+        set rd [redis_deferring_client]
+        $rd write "*3\r\n\$5\r\ndebug\r\n\$5\r\nsleep\r\n\$3\r\n0.2\r\n"
+        $rd write "*1\r\n\$4\r\nping\r\n"
+        $rd flush
+        assert_equal OK [$rd read]
+        assert_equal PONG [$rd read]
+        $rd close
+        set e [lindex [r slowlog get] 0]
+        assert_equal [llength $e] 7
+        assert_equal [lindex $e 3] {ping}
+        set b [lindex $e 6]
+        assert {[dict get $b queue_usec] >= 100000}
+        assert {[dict get $b execution_usec] < 100000}
+        assert {[dict get $b write_usec] >= 0}
+        assert_match {*latency_queue_usec:p50=*latency_write_usec:p50=*} \
+            [r info stats]
+        r config set latency-tracking-breakdown no
+        set e [lindex [r slowlog get] 0]
+        assert_equal [llength $e] 7
+    }
+
+    test {SLOWLOG - SHAPES aggregates the commands by name and key pattern} {
+        r config set slowlog-log-slower-than 0
+        r slowlog reset
+        r set user:1000:name foo
+        r set user:1001:name bar
+        r get user:1002:name
+        r mset a1 x b y c z d w e v
+        set shapes {}
+        foreach sh [r slowlog shapes -1] {
+            dict set shapes [dict get $sh shape] $sh
+        }
+        r config set slowlog-log-slower-than 10000
+        assert_equal 2 [dict get $shapes {set user:*:name} calls]
+        assert_equal 1 [dict get $shapes {get user:*:name} calls]
+        assert {[dict exists $shapes {mset * b c d ... (1 more keys)}]}
+        set sh [dict get $shapes {set user:*:name}]
+        assert {[dict get $sh total_usec] >= [dict get $sh max_usec]}
+        assert_match {[0-9a-f]*} [dict get $sh fingerprint]
+        assert_equal 16 [string length [dict get $sh fingerprint]]
+        r slowlog reset
+        r slowlog shapes
+    } {}
+
+    test {SLOWLOG - slowlog-shapes-max-len and slowlog-sample-ratio} {
+        r config set slowlog-shapes-max-len 2
+        r config set slowlog-sample-ratio 1000000000
+        r config set slowlog-log-slower-than 0
+        r slowlog reset
+        for {set j 0} {$j < 10} {incr j} {
+            r set k$j v
+            r get k$j
+            r hset h$j f v
+        }
+        r config set slowlog-log-slower-than 10000
+        # Every slow command is counted in the shapes, but only one
+        # out of slowlog-sample-ratio is logged with its arguments.
+        assert {[r slowlog len] < 5}
+        assert_equal 2 [llength [r slowlog shapes]]
+        r config set slowlog-shapes-max-len 64
+        r config set slowlog-sample-ratio 1
+    }
 }
@@ -238,6 +238,50 @@ start_server {
         r sort myset by score:*
     } {a aa aaa azz b c d e f g h i l m n o p q r s t u v z}
 
+    test "SORT of many numbers orders the same scores lexicographically" {
+        r del mylist
+        set elements {}
+        for {set j 0} {$j < 2000} {incr j} {
+            set score [expr {int(rand()*100)-50}]
+            if {$j % 7 == 0} {set score [expr {$score/4.0}]}
+            if {$j % 11 == 0} {set score [lindex {0 -0 +0 0.0 -0.0} [expr {$j%5}]]}
+            lappend elements $score:$j
+            r set w:$score:$j $score
+            r rpush mylist $score:$j
+        }
+        proc cmp_score {a b} {
+            set sa [expr {double([lindex [split $a :] 0])}]
+            set sb [expr {double([lindex [split $b :] 0])}]
+            if {$sa < $sb} {return -1}
+            if {$sa > $sb} {return 1}
+            string compare $a $b
+        }
+        set asc [lsort -command cmp_score $elements]
+        assert_equal $asc [r sort mylist by w:*]
+        assert_equal [lreverse $asc] [r sort mylist by w:* desc]
+        assert_equal [lrange $asc 100 199] [r sort mylist by w:* limit 100 100]
+    }
+
+    test "SORT GET of many elements with missing keys" {
+        r del mylist
+        set expected {}
+        set stored {}
+        for {set j 0} {$j < 100} {incr j} {
+            r rpush mylist $j
+            if {$j % 3} {
+                r set v:$j val$j
+                lappend expected $j val$j
+                lappend stored $j val$j
+            } else {
+                lappend expected $j {}
+                lappend stored $j {}
+            }
+        }
+        assert_equal $expected [r sort mylist get # get v:*]
+        r sort mylist get # get v:* store dst
+        assert_equal $stored [r lrange dst 0 -1]
+    }
+
     test "SORT GET with pattern ending with just -> does not get hash field" {
         r del mylist
         r lpush mylist a
@@ -0,0 +1,59 @@
+# Key miss events need the main thread: disable the keyspace events of the
+# default test configuration.
+start_server {tags {"threaded-io"} overrides {io-threads 4 io-threads-do-reads yes io-threads-do-commands yes notify-keyspace-events {""}}} {
+    test {I/O threads execute reads mixed with writes, expires and MULTI} {
+        # The I/O threads are only used when many clients are served at
+        # the same time: keep the server busy with GETs in the background.
+        r config resetstat
+        set bench_pid [exec src/redis-benchmark -s [srv 0 unixsocket] \
+            -c 50 -n 100000000 -r 1000 get __rand_int__ > /dev/null &]
+        wait_for_condition 50 100 {
+            [s io_threaded_commands_processed] > 0
+        } else {
+            exec kill $bench_pid
+            fail "I/O threads not executing commands"
+        }
+        set numclients 20
+        set clients {}
+        for {set i 0} {$i < $numclients} {incr i} {
+            lappend clients [redis_deferring_client]
+            r set gone:$i x px 1
+        }
+        after 10
+
+        for {set round 0} {$round < 50} {incr round} {
+            set i 0
+            foreach rd $clients {
+                $rd set k:$i v$round
+                $rd get k:$i
+                $rd strlen k:$i
+                $rd multi
+                $rd incr c:$i
+                $rd get k:$i
+                $rd exec
+                $rd get gone:$i
+                $rd exists k:$i gone:$i
+                incr i
+            }
+            set i 0
+            foreach rd $clients {
+                assert_equal OK [$rd read]
+                assert_equal v$round [$rd read]
+                assert_equal [string length v$round] [$rd read]
+                assert_equal OK [$rd read]
+                assert_equal QUEUED [$rd read]
+                assert_equal QUEUED [$rd read]
+                assert_equal [list [expr {$round+1}] v$round] [$rd read]
+                assert_equal {} [$rd read]
+                assert_equal 1 [$rd read]
+                incr i
+            }
+        }
+        foreach rd $clients {$rd close}
+        exec kill $bench_pid
+
+        for {set i 0} {$i < $numclients} {incr i} {
+            assert_equal 50 [r get c:$i]
+        }
+    }
+}
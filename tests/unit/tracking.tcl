@@ -0,0 +1,147 @@
+start_server {tags {"tracking"}} {
+    # Create a deferred client we'll use to redirect invalidation
+    # messages to.
+    set rd1 [redis_deferring_client]
+    $rd1 client id
+    set redir [$rd1 read]
+    $rd1 subscribe __redis__:invalidate
+    $rd1 read ; # Consume the SUBSCRIBE reply.
+
+    test {Clients are able to enable tracking and redirect it} {
+        r CLIENT TRACKING on REDIRECT $redir
+    } {*OK}
+
+    test {The other connection is able to get invalidations} {
+        r SET a 1
+        r GET a
+        r INCR a
+        set keys [lindex [$rd1 read] 2]
+        assert {[llength $keys] == 1}
+    }
+
+    test {The client is now able to disable tracking} {
+        # Make sure to add a few more keys in the tracking list
+        # so that we can check for leaks, as a side effect.
+        r MGET a b c d e f g
+        r CLIENT TRACKING off
+    } {*OK}
+
+    test {Clients can enable the BCAST mode with the empty prefix} {
+        r CLIENT TRACKING on BCAST REDIRECT $redir
+    } {*OK*}
+
+    test {The connection gets invalidation messages about all the keys} {
+        r MSET a 1 b 2 c 3
+        set keys [lsort [lindex [$rd1 read] 2]]
+        assert {$keys eq {a b c}}
+    }
+
+    test {Clients can enable the BCAST mode with prefixes} {
+        r CLIENT TRACKING off
+        r CLIENT TRACKING on BCAST REDIRECT $redir PREFIX a: PREFIX b:
+        r MULTI
+        r INCR a:1
+        r INCR a:2
+        r INCR b:1
+        r INCR b:2
+        r EXEC
+        # Because of the internals, we know we are going to receive
+        # two separated notifications for the two different prefixes.
+        set keys1 [lsort [lindex [$rd1 read] 2]]
+        set keys2 [lsort [lindex [$rd1 read] 2]]
+        set keys [lsort [list {*}$keys1 {*}$keys2]]
+        assert {$keys eq {a:1 a:2 b:1 b:2}}
+    }
+
+    test {Adding prefixes to BCAST mode works} {
+        r CLIENT TRACKING on BCAST REDIRECT $redir PREFIX c:
+        r INCR c:1234
+        set keys [lsort [lindex [$rd1 read] 2]]
+        assert {$keys eq {c:1234}}
+    }
+
+    test {The prefixes are reported in INFO and released with tracking} {
+        assert_equal 3 [s tracking_prefixes]
+        r CLIENT TRACKING off
+        assert_equal 0 [s tracking_prefixes]
+    }
+
+    test {Only the keys matching the prefixes are reported} {
+        r CLIENT TRACKING on BCAST REDIRECT $redir PREFIX user:
+        r SET other 1
+        r SET user:1 1
+        set keys [lindex [$rd1 read] 2]
+        r CLIENT TRACKING off
+        set keys
+    } {user:1}
+
+    test {Overlapping prefixes are rejected} {
+        catch {r CLIENT TRACKING on BCAST PREFIX foo PREFIX foobar} e1
+        r CLIENT TRACKING on BCAST PREFIX foo
+        catch {r CLIENT TRACKING on BCAST PREFIX fo} e2
+        r CLIENT TRACKING off
+        list $e1 $e2
+    } {*overlaps* *overlaps*}
+
+    test {PREFIX requires BCAST and BCAST mode can't be switched on the fly} {
+        catch {r CLIENT TRACKING on PREFIX foo} e1
+        r CLIENT TRACKING on
+        catch {r CLIENT TRACKING on BCAST} e2
+        r CLIENT TRACKING off
+        list $e1 $e2
+    } {*requires BCAST* *switch BCAST*}
+
+    test {Flushing the database invalidates all the keys} {
+        r CLIENT TRACKING on REDIRECT $redir
+        r GET a
+        r FLUSHALL
+        set msg [$rd1 read]
+        assert_equal 0 [s tracking_total_keys]
+        lindex $msg 2
+    } {}
+
+    test {Only the keys fetched by the client are invalidated} {
+        r MSET k1 1 k2 2
+        r GET k1
+        r SET k2 3
+        r SET k1 4
+        set keys [lindex [$rd1 read] 2]
+        assert_equal 0 [s tracking_total_keys]
+        set keys
+    } {k1}
+
+    test {Invalidations of multiple keys are sent in a single message} {
+        r MSET k1 1 k2 2 k3 3
+        r MGET k1 k2 k3
+        r MULTI
+        r SET k1 4
+        r MSET k2 5 k3 6
+        r EXEC
+        lsort [lindex [$rd1 read] 2]
+    } {k1 k2 k3}
+
+    test {Tracked keys are reported in INFO} {
+        r MGET k1 k2 k3
+        assert_equal 3 [s tracking_total_keys]
+        assert_equal 3 [s tracking_total_items]
+    }
+
+    test {The tracking table is bounded by tracking-table-max-keys} {
+        r CONFIG RESETSTAT
+        for {set j 0} {$j < 17} {incr j} {
+            r GET key:$j
+        }
+        assert_equal 20 [s tracking_total_keys]
+        r CONFIG SET tracking-table-max-keys 10
+        r PING
+        assert_equal 10 [s tracking_total_keys]
+        assert_equal 10 [s tracking_evicted_keys]
+        # The evicted keys are invalidated with a single message.
+        set keys [lindex [$rd1 read] 2]
+        assert_equal 10 [llength $keys]
+        r CONFIG SET tracking-table-max-keys 1000000
+        r CLIENT TRACKING off
+    } {*OK*}
+
+    $rd1 close
+}
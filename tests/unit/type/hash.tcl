@@ -14,8 +14,8 @@ start_server {tags {"hash"}} {
         list [r hlen smallhash]
     } {8}
 
-    test {Is the small hash encoded with a ziplist?} {
-        assert_encoding ziplist smallhash
+    test {Is the small hash encoded with a listpack?} {
+        assert_encoding listpack smallhash
     }
 
     test {HSET/HLEN - Big hash creation} {
@@ -252,7 +252,7 @@ start_server {tags {"hash"}} {
         lappend rv [r hexists bighash nokey]
     } {1 0 1 0}
 
-    test {Is a ziplist encoded Hash promoted on big payload?} {
+    test {Is a listpack encoded Hash promoted on big payload?} {
         r hset smallhash foo [string repeat a 1024]
         r debug object smallhash
     } {*hashtable*}
@@ -438,7 +438,7 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Hash ziplist regression test for large keys} {
+    test {Hash listpack regression test for large keys} {
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk a
         r hset hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk b
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
@@ -505,8 +505,8 @@ start_server {tags {"hash"}} {
         }
     }
 
-    test {Stress test the hash ziplist -> hashtable encoding conversion} {
-        r config set hash-max-ziplist-entries 32
+    test {Stress test the hash listpack -> hashtable encoding conversion} {
+        r config set hash-max-listpack-entries 32
         for {set j 0} {$j < 100} {incr j} {
             r del myhash
             for {set i 0} {$i < 64} {incr i} {
@@ -533,4 +533,203 @@ start_server {tags {"hash"}} {
             assert {[r hincrbyfloat myhash float -0.1] eq {1.9}}
         }
     }
+
+    foreach {type size} {listpack 10 hashtable 200} {
+        test "Hash field expires - $type" {
+            r del myhash
+            for {set j 0} {$j < $size} {incr j} {
+                r hset myhash f$j v$j
+            }
+            assert_encoding $type myhash
+            assert_equal {1 1 -2} [r hpexpire myhash 100 f0 f1 nofield]
+            assert_equal {1} [r hexpire myhash 1000 f2]
+            set ttl [r hpttl myhash f0]
+            assert {$ttl > 0 && $ttl <= 100}
+            assert_equal {-1 -2} [r httl myhash f3 nofield]
+            assert_equal {1 -1} [r hpersist myhash f1 f3]
+            wait_for_condition 50 100 {
+                [r hexists myhash f0] == 0
+            } else {
+                fail "The hash field didn't expire"
+            }
+            assert_equal [expr {$size-1}] [r hlen myhash]
+            assert_equal -1 [r httl myhash f1]
+            assert {[r httl myhash f2] > 0}
+        }
+    }
+
+    test {Hash field expires - missing key and wrong type} {
+        r del myhash mystring
+        r set mystring foo
+        assert_equal {-2 -2} [r hexpire myhash 100 a b]
+        assert_equal {-2} [r httl myhash a]
+        assert_error {WRONGTYPE*} {r hexpire mystring 100 a}
+        assert_error {*invalid expire time*} {r hpexpire mystring 1000000000000000000 a}
+    }
+
+    test {Hash field expires - a time in the past deletes the fields} {
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        assert_equal {2 2 -2} [r hpexpireat myhash 1 a b nofield]
+        assert_equal {c 3} [r hgetall myhash]
+        assert_equal {2} [r hexpire myhash -1 c]
+        assert_equal 0 [r exists myhash]
+    }
+
+    test {Hash field expires - the key is deleted when all the fields expire} {
+        r del myhash
+        r hset myhash a 1 b 2
+        r hpexpire myhash 10 a b
+        wait_for_condition 50 100 {
+            [r exists myhash] == 0
+        } else {
+            fail "The hash didn't expire"
+        }
+        assert {[s expired_hash_fields] >= 2}
+    }
+
+    test {Hash field expires - HSET and HDEL remove the expire, HINCRBY keeps it} {
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        r hexpire myhash 1000 a b c
+        r hset myhash a 10
+        r hincrby myhash b 1
+        r hdel myhash c
+        r hset myhash c 30
+        assert_equal {-1 1 -1} [lmap t [r httl myhash a b c] {expr {$t > 0 ? 1 : $t}}]
+    }
+
+    test {Hash field expires - RENAME and MOVE keep the field expires} {
+        r del myhash myhash2
+        r hset myhash a 1 b 2
+        r hexpire myhash 1000 a
+        r rename myhash myhash2
+        assert {[r httl myhash2 a] > 0}
+        assert_equal {-2} [r httl myhash a]
+        r select 10
+        r del myhash2
+        r select 9
+        r move myhash2 10
+        r select 10
+        assert {[r httl myhash2 a] > 0}
+        assert_equal -1 [r httl myhash2 b]
+        r del myhash2
+        r select 9
+    }
+
+    test {Hash field expires - overwriting the key drops the field expires} {
+        r del myhash
+        r hset myhash a 1
+        r hexpire myhash 1000 a
+        r set myhash foo
+        r del myhash
+        r hset myhash a 1
+        assert_equal -1 [r httl myhash a]
+    }
+
+    foreach {type size} {listpack 10 hashtable 200} {
+        test "Hash field expires survive DEBUG RELOAD and DUMP / RESTORE - $type" {
+            r del myhash
+            for {set j 0} {$j < $size} {incr j} {
+                r hset myhash f$j v$j
+                if {$j % 2} {r hexpire myhash [expr {1000+$j}] f$j}
+            }
+            set ttls [r httl myhash f0 f1 f[expr {$size-1}]]
+            r debug reload
+            assert_equal $ttls [r httl myhash f0 f1 f[expr {$size-1}]]
+            assert_encoding $type myhash
+            set dump [r dump myhash]
+            r del myhash
+            r restore myhash 0 $dump
+            assert_equal $ttls [r httl myhash f0 f1 f[expr {$size-1}]]
+            assert_equal $size [r hlen myhash]
+        }
+    }
+
+    test {Hash field expires survive an AOF rewrite} {
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r del myhash
+        r hset myhash a 1 b 2 c 3
+        r hexpire myhash 1000 a c
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        assert_equal {1 -1 1} [lmap t [r httl myhash a b c] {expr {$t > 0 ? 1 : $t}}]
+        r config set appendonly no
+    }
+
+    test {HBUILD creates the hash with its final encoding} {
+        r del myhash
+        assert_equal 2 [r hbuild myhash 10 a 1 b 2]
+        assert_encoding listpack myhash
+        assert_equal 1 [r hbuild myhash 1000 a 3 c 4]
+        assert_encoding hashtable myhash
+        assert_equal {a 3 b 2 c 4} [lsort -stride 2 [r hgetall myhash]]
+        catch {r hbuild myhash -1 a 1} e
+        assert_match {*negative*} $e
+        catch {r hbuild myhash 10 a} e
+        assert_match {*wrong number*} $e
+    }
+
+    test {HGETALL, HKEYS and HVALS of big hashes are streamed} {
+        r del myhash
+        for {set j 0} {$j < 1000} {incr j} {r hset myhash f$j v$j}
+        assert_encoding hashtable myhash
+        foreach cmd {hgetall hkeys hvals} {
+            r config set replies-incremental-threshold 0
+            set expected [lsort [r $cmd myhash]]
+            r config set replies-incremental-threshold 1
+            assert_equal $expected [lsort [r $cmd myhash]]
+        }
+        r config set replies-incremental-threshold 100000
+    }
+
+    test {The streamed reply is completed before the hash is written} {
+        r del myhash
+        set value [string repeat x 1000]
+        for {set j 0} {$j < 20000} {incr j 100} {
+            set args {}
+            for {set k $j} {$k < $j+100} {incr k} {lappend args f$k $value}
+            r hset myhash {*}$args
+        }
+        r config set replies-incremental-threshold 1
+        set rd [redis_deferring_client]
+        $rd hgetall myhash
+        $rd hlen myhash
+        # The client doesn't read the reply, so the job pauses.
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "HGETALL didn't block the client"
+        }
+        after 100
+        assert_equal 1 [s blocked_clients]
+        assert_equal $value [r hget myhash f1]
+        r hset myhash newfield 1
+        assert_equal 0 [s blocked_clients]
+        set reply [$rd read]
+        assert_equal 40000 [llength $reply]
+        assert_equal -1 [lsearch $reply newfield]
+        assert_equal 20001 [$rd read]
+        $rd close
+    }
+
+    test {The client receiving a streamed reply can be killed} {
+        set rd [redis_deferring_client]
+        $rd client id
+        set id [$rd read]
+        $rd hgetall myhash
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "HGETALL didn't block the client"
+        }
+        assert_equal 0 [r client unblock $id]
+        r client kill id $id
+        assert_equal 0 [s blocked_clients]
+        assert_equal PONG [r ping]
+        $rd close
+        r config set replies-incremental-threshold 100000
+    }
 }
@@ -77,6 +77,32 @@ start_server {tags {"incr"}} {
         assert {$old eq $new}
     }
 
+    test {INCR modifies small integers in place if they can't be shared} {
+        r config set maxmemory 1073741824
+        r config set maxmemory-policy allkeys-lru
+        r set foo 5
+        r incr foo
+        set old [lindex [split [r debug object foo]] 1]
+        r incr foo
+        r decrby foo 3
+        set new [lindex [split [r debug object foo]] 1]
+        r config set maxmemory-policy noeviction
+        r config set maxmemory 0
+        list [r get foo] [r object refcount foo] [expr {$old eq $new}]
+    } {4 1 1}
+
+    test {INCRBYFLOAT of integers by integers} {
+        r set foo 10
+        set res {}
+        lappend res [r incrbyfloat foo 5]
+        lappend res [r incrbyfloat foo -20]
+        lappend res [r incrbyfloat foo 1.5]
+        lappend res [r incrbyfloat foo 3.5]
+        r del foo
+        lappend res [r incrbyfloat foo 12]
+        lappend res [r get foo]
+    } {15 -5 -3.5 0 12 12}
+
     test {INCRBYFLOAT against non existing key} {
         r del novar
         list    [roundFloat [r incrbyfloat novar 1]] \
@@ -152,3 +178,16 @@ start_server {tags {"incr"}} {
         format $err
     } {ERR*valid*}
 }
+
+start_server {tags {"incr"} overrides {shared-integers 100000}} {
+    test {INCR uses shared objects in the configured range} {
+        assert_equal 100000 [lindex [r config get shared-integers] 1]
+        r set foo 99998
+        r incr foo
+        assert {[r object refcount foo] > 1}
+        r incr foo
+        assert {[r object refcount foo] == 1}
+        r set bar 50000
+        assert {[r object refcount bar] > 1}
+    }
+}
@@ -120,3 +120,107 @@ start_server {
         }
     }
 }
+
+start_server {
+    tags {list ziplist}
+    overrides {
+        "list-max-ziplist-size" 16
+        "list-compress-depth" 1
+        "list-compress-codec" lz4
+    }
+} {
+    test {Compressed lists with both codecs and the nodes cache} {
+        r del l
+        set mylist {}
+        for {set j 0} {$j < 2000} {incr j} {
+            set ele "element:$j:[string repeat x [randomInt 50]]"
+            r rpush l $ele
+            lappend mylist $ele
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            # Switch codec in the middle, so that the list mixes both.
+            if {$j == 2500} {r config set list-compress-codec lzf}
+            set idx [randomInt [llength $mylist]]
+            switch [randomInt 4] {
+                0 {assert_equal [lindex $mylist $idx] [r lindex l $idx]}
+                1 {
+                    r lset l $idx "set:$j"
+                    lset mylist $idx "set:$j"
+                }
+                2 {
+                    set pivot [lindex $mylist $idx]
+                    r linsert l before $pivot "ins:$j"
+                    set mylist [linsert $mylist $idx "ins:$j"]
+                }
+                3 {
+                    set len [randomInt 20]
+                    assert_equal [lrange $mylist $idx [expr {$idx+$len}]] \
+                        [r lrange l $idx [expr {$idx+$len}]]
+                }
+            }
+        }
+        assert_equal $mylist [r lrange l 0 -1]
+        set dump [r dump l]
+        r config set rdb-compression-algorithm lz4
+        r debug reload
+        r config set rdb-compression-algorithm lzf
+        assert_equal $mylist [r lrange l 0 -1]
+        r debug reload
+        assert_equal $mylist [r lrange l 0 -1]
+        r restore l2 0 $dump
+        assert_equal $mylist [r lrange l2 0 -1]
+        assert_equal lzf [lindex [r config get list-compress-codec] 1]
+    }
+}
+
+start_server {
+    tags {list ziplist}
+    overrides {
+        "list-max-ziplist-size" 4
+        "list-index-min-nodes" 8
+    }
+} {
+    test {Lists used as ring buffers with random access} {
+        r del l
+        set mylist {}
+        for {set j 0} {$j < 1000} {incr j} {
+            r rpush l $j
+            lappend mylist $j
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            set idx [randomInt [llength $mylist]]
+            switch [randomInt 6] {
+                0 {assert_equal [lindex $mylist $idx] [r lindex l $idx]}
+                1 {assert_equal [lindex $mylist end-$idx] [r lindex l -[expr {$idx+1}]]}
+                2 {
+                    r lset l $idx "set:$j"
+                    lset mylist $idx "set:$j"
+                }
+                3 {
+                    r rpush l "push:$j"
+                    r lpop l
+                    lappend mylist "push:$j"
+                    set mylist [lrange $mylist 1 end]
+                }
+                4 {
+                    r lpush l "push:$j"
+                    r rpop l
+                    set mylist [linsert [lrange $mylist 0 end-1] 0 "push:$j"]
+                }
+                5 {
+                    # Rarely change the list in the middle too.
+                    if {[randomInt 20] == 0} {
+                        r linsert l before [lindex $mylist $idx] "ins:$j"
+                        set mylist [linsert $mylist $idx "ins:$j"]
+                    } else {
+                        assert_equal [lrange $mylist $idx [expr {$idx+10}]] \
+                            [r lrange l $idx [expr {$idx+10}]]
+                    }
+                }
+            }
+        }
+        assert_equal $mylist [r lrange l 0 -1]
+        r config set list-index-min-nodes 0
+        assert_equal [lindex $mylist 500] [r lindex l 500]
+    }
+}
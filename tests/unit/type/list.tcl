@@ -177,6 +177,33 @@ start_server {
         $rd read
     } {list b}
 
+    test "BLPOP clients unblocked in the middle keep the order of the others" {
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        set rd3 [redis_deferring_client]
+        r del blist blist2
+        $rd1 blpop blist 0
+        $rd2 client id
+        set id2 [$rd2 read]
+        $rd2 blpop blist blist2 0
+        $rd3 blpop blist 0
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 3
+        } else {
+            fail "Clients are not blocked"
+        }
+        r client unblock $id2
+        assert_equal {} [$rd2 read]
+        r rpush blist a b
+        assert_equal {blist a} [$rd1 read]
+        assert_equal {blist b} [$rd3 read]
+        r rpush blist2 c
+        assert_equal 1 [r llen blist2]
+        $rd1 close
+        $rd2 close
+        $rd3 close
+    }
+
     test "BLPOP with same key multiple times should work (issue #801)" {
         set rd [redis_deferring_client]
         r del list1 list2
@@ -486,6 +513,31 @@ start_server {
         }
     }
 
+    test {Blocking timeouts are precise regardless of hz} {
+        r config set hz 1
+        r del blist1 blist2
+        set rd1 [redis_deferring_client]
+        set rd2 [redis_deferring_client]
+        set rd3 [redis_deferring_client]
+        set start [clock milliseconds]
+        $rd3 blpop blist2 0.3
+        $rd1 blpop blist1 0.1
+        $rd2 blpop blist1 10
+        assert_equal {} [$rd1 read]
+        set elapsed [expr {[clock milliseconds]-$start}]
+        assert {$elapsed >= 100 && $elapsed < 300}
+        # The client unblocked by a push leaves the timeout index.
+        r rpush blist1 foo
+        assert_equal {blist1 foo} [$rd2 read]
+        assert_equal {} [$rd3 read]
+        set elapsed [expr {[clock milliseconds]-$start}]
+        assert {$elapsed >= 300 && $elapsed < 500}
+        $rd1 close
+        $rd2 close
+        $rd3 close
+        r config set hz 10
+    }
+
     test {BLPOP inside a transaction} {
         r del xlist
         r lpush xlist foo
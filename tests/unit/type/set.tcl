@@ -2,6 +2,7 @@ start_server {
     tags {"set"}
     overrides {
         "set-max-intset-entries" 512
+        "set-max-listpack-entries" 128
     }
 } {
     proc create_set {key entries} {
@@ -9,18 +10,29 @@ start_server {
         foreach entry $entries { r sadd $key $entry }
     }
 
-    test {SADD, SCARD, SISMEMBER, SMEMBERS basics - regular set} {
-        create_set myset {foo}
-        assert_encoding hashtable myset
-        assert_equal 1 [r sadd myset bar]
-        assert_equal 0 [r sadd myset bar]
-        assert_equal 2 [r scard myset]
-        assert_equal 1 [r sismember myset foo]
-        assert_equal 1 [r sismember myset bar]
-        assert_equal 0 [r sismember myset bla]
-        assert_equal {bar foo} [lsort [r smembers myset]]
+    # Small sets of strings are listpacks unless the listpack encoding is
+    # disabled, so that the tests can check the hashtable encoding too.
+    proc use_encoding {type} {
+        r config set set-max-listpack-entries \
+            [expr {$type eq {hashtable} ? 0 : 128}]
     }
 
+    foreach type {hashtable listpack} {
+        test "SADD, SCARD, SISMEMBER, SMEMBERS basics - $type" {
+            use_encoding $type
+            create_set myset {foo}
+            assert_encoding $type myset
+            assert_equal 1 [r sadd myset bar]
+            assert_equal 0 [r sadd myset bar]
+            assert_equal 2 [r scard myset]
+            assert_equal 1 [r sismember myset foo]
+            assert_equal 1 [r sismember myset bar]
+            assert_equal 0 [r sismember myset bla]
+            assert_equal {bar foo} [lsort [r smembers myset]]
+        }
+    }
+    use_encoding listpack
+
     test {SADD, SCARD, SISMEMBER, SMEMBERS basics - intset} {
         create_set myset {17}
         assert_encoding intset myset
@@ -42,15 +54,45 @@ start_server {
         create_set myset {1 2 3}
         assert_encoding intset myset
         assert_equal 1 [r sadd myset a]
+        assert_encoding listpack myset
+        assert_equal {1 2 3 a} [lsort [r smembers myset]]
+        assert_equal 1 [r sismember myset 2]
+    }
+
+    test "SADD a non-integer against a large intset" {
+        r del myset
+        for {set i 0} {$i < 200} {incr i} { r sadd myset $i }
+        assert_encoding intset myset
+        assert_equal 1 [r sadd myset a]
         assert_encoding hashtable myset
+        assert_equal 201 [r scard myset]
     }
 
     test "SADD an integer larger than 64 bits" {
         create_set myset {213244124402402314402033402}
-        assert_encoding hashtable myset
+        assert_encoding listpack myset
         assert_equal 1 [r sismember myset 213244124402402314402033402]
     }
 
+    test "SADD overflows the maximum allowed elements in a listpack" {
+        r del myset
+        for {set i 0} {$i < 128} {incr i} { r sadd myset "a$i" }
+        assert_encoding listpack myset
+        assert_equal 0 [r sadd myset a0]
+        assert_equal 1 [r sadd myset a128]
+        assert_encoding hashtable myset
+        assert_equal 129 [r scard myset]
+    }
+
+    test "SADD overflows the maximum allowed element size in a listpack" {
+        create_set myset {a b}
+        assert_encoding listpack myset
+        assert_equal 1 [r sadd myset [string repeat x 65]]
+        assert_encoding hashtable myset
+        create_set myset [list 1 [string repeat x 65]]
+        assert_encoding hashtable myset
+    }
+
     test "SADD overflows the maximum allowed integers in an intset" {
         r del myset
         for {set i 0} {$i < 512} {incr i} { r sadd myset $i }
@@ -67,27 +109,45 @@ start_server {
     }
 
     test "Set encoding after DEBUG RELOAD" {
-        r del myintset myhashset mylargeintset
+        r del myintset myhashset mylargeintset mylistpackset
         for {set i 0} {$i <  100} {incr i} { r sadd myintset $i }
         for {set i 0} {$i < 1280} {incr i} { r sadd mylargeintset $i }
         for {set i 0} {$i <  256} {incr i} { r sadd myhashset [format "i%03d" $i] }
+        r sadd mylistpackset a b c 1 2 3
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
 
         r debug reload
         assert_encoding intset myintset
         assert_encoding hashtable mylargeintset
         assert_encoding hashtable myhashset
+        assert_encoding listpack mylistpackset
+        assert_equal {1 2 3 a b c} [lsort [r smembers mylistpackset]]
     }
 
-    test {SREM basics - regular set} {
-        create_set myset {foo bar ciao}
+    test "Set listpack converted to hashtable on load when too big" {
+        r del myset
+        r sadd myset a b c d
+        r config set set-max-listpack-entries 2
+        r debug reload
         assert_encoding hashtable myset
-        assert_equal 0 [r srem myset qux]
-        assert_equal 1 [r srem myset foo]
-        assert_equal {bar ciao} [lsort [r smembers myset]]
+        assert_equal {a b c d} [lsort [r smembers myset]]
+        use_encoding listpack
+    }
+
+    foreach type {hashtable listpack} {
+        test "SREM basics - $type" {
+            use_encoding $type
+            create_set myset {foo bar ciao}
+            assert_encoding $type myset
+            assert_equal 0 [r srem myset qux]
+            assert_equal 1 [r srem myset foo]
+            assert_equal {bar ciao} [lsort [r smembers myset]]
+        }
     }
+    use_encoding listpack
 
     test {SREM basics - intset} {
         create_set myset {3 4 5}
@@ -112,6 +172,7 @@ start_server {
     } {3}
 
     foreach {type} {hashtable intset} {
+        use_encoding $type
         for {set i 1} {$i <= 5} {incr i} {
             r del [format "set%d" $i]
         }
@@ -206,6 +267,7 @@ start_server {
             assert_equal {1 2 3 4} [lsort [r smembers setres]]
         }
     }
+    use_encoding listpack
 
     test "SDIFF with first set empty" {
         r del set1 set2 set3
@@ -246,6 +308,150 @@ start_server {
         }
     }
 
+    test "SINTER, SUNION and SDIFF of intsets with different encodings" {
+        for {set j 0} {$j < 50} {incr j} {
+            set keys {}
+            foreach key {is1 is2 is3} {
+                unset -nocomplain $key
+                array set $key {}
+                r del $key
+                lappend keys $key
+                # Mix small values with values that need 32 and 64 bits.
+                set range [lindex {100 100000 10000000000} [randomInt 3]]
+                for {set i [randomInt 200]} {$i > 0} {incr i -1} {
+                    set ele [expr {[randomInt 200]-100}]
+                    if {[randomInt 4] == 0} {set ele [expr {$ele*$range}]}
+                    set ${key}($ele) 1
+                    r sadd $key $ele
+                }
+            }
+            foreach key $keys {
+                if {[r exists $key]} {assert_encoding intset $key}
+            }
+
+            set inter {}
+            set union [lsort -unique [concat [array names is1] \
+                [array names is2] [array names is3]]]
+            set diff {}
+            foreach ele [array names is1] {
+                if {[info exists is2($ele)] && [info exists is3($ele)]} {
+                    lappend inter $ele
+                }
+                if {![info exists is2($ele)] && ![info exists is3($ele)]} {
+                    lappend diff $ele
+                }
+            }
+            assert_equal [lsort $inter] [lsort [r sinter {*}$keys]]
+            assert_equal $union [lsort [r sunion {*}$keys]]
+            assert_equal [lsort $diff] [lsort [r sdiff {*}$keys]]
+
+            r sinterstore setres {*}$keys
+            assert_equal [lsort $inter] [lsort [r smembers setres]]
+            r sunionstore setres {*}$keys
+            assert_equal $union [lsort [r smembers setres]]
+            r sdiffstore setres {*}$keys
+            assert_equal [lsort $diff] [lsort [r smembers setres]]
+        }
+    }
+
+    test "SUNIONSTORE of intsets converts the result when too big" {
+        r del set1 set2 setres
+        for {set i 0} {$i < 300} {incr i} {
+            r sadd set1 $i
+            r sadd set2 [expr {$i+300}]
+        }
+        assert_encoding intset set1
+        assert_equal 600 [r sunionstore setres set1 set2]
+        assert_encoding hashtable setres
+    }
+
+    test "SUNIONSTORE and SDIFFSTORE executed in the background" {
+        r del set1 set2 set3 setres
+        for {set i 0} {$i < 1000} {incr i} {
+            r sadd set1 ele:$i
+            r sadd set2 ele:[expr {$i+500}]
+        }
+        r sadd set3 ele:1 ele:2 ele:3 10 20
+        foreach cmd {sunionstore sdiffstore} {
+            foreach keys {{set1 set2} {set1 set2 set3} {set3 set1}
+                          {nokey set1} {set1 nokey set2}} {
+                r config set setops-incremental-threshold 0
+                set expected [r $cmd setres {*}$keys]
+                set members [lsort [r smembers setres]]
+                r del setres
+                r config set setops-incremental-threshold 1
+                assert_equal $expected [r $cmd setres {*}$keys]
+                assert_equal $members [lsort [r smembers setres]]
+            }
+        }
+        r config set setops-incremental-threshold 1000000
+    }
+
+    test "SBUILD creates the set with its final encoding" {
+        r del myset
+        assert_equal 3 [r sbuild myset 10 3 1 2 1]
+        assert_encoding intset myset
+        assert_equal 2 [r sbuild myset 10 5 -100000000000]
+        assert_encoding intset myset
+        assert_equal {-100000000000 1 2 3 5} [lsort -integer [r smembers myset]]
+        assert_equal 1 [r sbuild myset 10 a 1]
+        assert_encoding listpack myset
+        assert_equal 1 [r sbuild myset 10000 b]
+        assert_encoding hashtable myset
+        assert_equal 7 [r scard myset]
+        r del myset
+        assert_equal 1 [r sbuild myset 10000 1]
+        assert_encoding hashtable myset
+        catch {r sbuild myset -1 a} e
+        assert_match {*negative*} $e
+    }
+
+    test "SMEMBERS of a big set is streamed" {
+        r del set1
+        for {set i 0} {$i < 1000} {incr i} {r sadd set1 ele:$i}
+        r config set replies-incremental-threshold 0
+        set expected [lsort [r smembers set1]]
+        r config set replies-incremental-threshold 1
+        assert_equal $expected [lsort [r smembers set1]]
+        r config set replies-incremental-threshold 100000
+    }
+
+    test "The keys of a background set operation can't be written" {
+        r del set1 set2 setres
+        r eval {
+            for i=1,200000 do
+                redis.call('sadd',KEYS[1],'ele:'..i)
+                redis.call('sadd',KEYS[2],'ele:'..(i+100000))
+            end
+        } 2 set1 set2
+        r config set setops-incremental-threshold 1
+        set repl [attach_to_replication_stream]
+        set rd [redis_deferring_client]
+        $rd sunionstore setres set1 set2
+        wait_for_condition 50 10 {
+            [s blocked_clients] == 1
+        } else {
+            fail "SUNIONSTORE didn't block the client"
+        }
+        catch {r sadd set1 foo} e
+        assert_match {TRYAGAIN*} $e
+        catch {r del setres} e
+        assert_match {TRYAGAIN*} $e
+        assert_equal 1 [r sismember set2 ele:300000]
+        r set other value
+        assert_equal 300000 [$rd read]
+        assert_equal 300000 [r scard setres]
+        # The command is propagated once the result is stored.
+        assert_replication_stream $repl {
+            {select *}
+            {set other value}
+            {sunionstore setres set1 set2}
+        }
+        close_replication_stream $repl
+        $rd close
+        r config set setops-incremental-threshold 1000000
+    }
+
     test "SINTER against non-set should throw error" {
         r set key1 x
         assert_error "WRONGTYPE*" {r sinter key1 noset}
@@ -269,9 +475,10 @@ start_server {
         r sadd set2 1 2 3 a
         r srem set2 a
         assert_encoding intset set1
-        assert_encoding hashtable set2
-        lsort [r sinter set1 set2]
-    } {1 2 3}
+        assert_encoding listpack set2
+        assert_equal {1 2 3} [lsort [r sinter set1 set2]]
+        assert_equal {1 2 3} [lsort [r sinter set2 set1]]
+    }
 
     test "SINTERSTORE against non existing keys should delete dstkey" {
         r set setres xxx
@@ -285,8 +492,11 @@ start_server {
         assert_equal 0 [r exists setres]
     }
 
-    foreach {type contents} {hashtable {a b c} intset {1 2 3}} {
+    foreach {type contents} {
+        hashtable {a b c} listpack {a b c} listpack {1 2 a} intset {1 2 3}
+    } {
         test "SPOP basics - $type" {
+            use_encoding $type
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [list [r spop myset] [r spop myset] [r spop myset]]]
@@ -313,15 +523,18 @@ start_server {
 
     foreach {type contents} {
         hashtable {a b c d e f g h i j k l m n o p q r s t u v w x y z} 
+        listpack {a b c d e f g h i j k l m n o p q r s t u v w x y z} 
         intset {1 10 11 12 13 14 15 16 17 18 19 2 20 21 22 23 24 25 26 3 4 5 6 7 8 9}
     } {
-        test "SPOP with <count>" {
+        test "SPOP with <count> - $type" {
+            use_encoding $type
             create_set myset $contents
             assert_encoding $type myset
             assert_equal $contents [lsort [concat [r spop myset 11] [r spop myset 9] [r spop myset 0] [r spop myset 4] [r spop myset 1] [r spop myset 0] [r spop myset 1] [r spop myset 0]]]
             assert_equal 0 [r scard myset]
         }
     }
+    use_encoding listpack
 
     # As seen in intsetRandomMembers
     test "SPOP using integers, testing Knuth's and Floyd's algorithm" {
@@ -387,6 +600,15 @@ start_server {
             KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
             BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
         }
+        listpack {
+            1 5 10 50 125 50000 33959417 4775547 65434162
+            12098459 427716 483706 2726473884 72615637475
+            MARY PATRICIA LINDA BARBARA ELIZABETH JENNIFER MARIA
+            SUSAN MARGARET DOROTHY LISA NANCY KAREN BETTY HELEN
+            SANDRA DONNA CAROL RUTH SHARON MICHELLE LAURA SARAH
+            KIMBERLY DEBORAH JESSICA SHIRLEY CYNTHIA ANGELA MELISSA
+            BRENDA AMY ANNA REBECCA VIRGINIA KATHLEEN
+        }
         intset {
             0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19
             20 21 22 23 24 25 26 27 28 29
@@ -395,7 +617,9 @@ start_server {
         }
     } {
         test "SRANDMEMBER with <count> - $type" {
+            use_encoding $type
             create_set myset $contents
+            assert_encoding $type myset
             unset -nocomplain myset
             array set myset {}
             foreach ele [r smembers myset] {
@@ -484,12 +708,13 @@ start_server {
             }
         }
     }
+    use_encoding listpack
 
     proc setup_move {} {
         r del myset3 myset4
         create_set myset1 {1 a b}
         create_set myset2 {2 3 4}
-        assert_encoding hashtable myset1
+        assert_encoding listpack myset1
         assert_encoding intset myset2
     }
 
@@ -499,7 +724,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset2 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {2 3 4 a} [lsort [r smembers myset2]]
-        assert_encoding hashtable myset2
+        assert_encoding listpack myset2
 
         # move an integer element should not convert the encoding
         setup_move
@@ -535,7 +760,7 @@ start_server {
         assert_equal 1 [r smove myset1 myset3 a]
         assert_equal {1 b} [lsort [r smembers myset1]]
         assert_equal {a} [lsort [r smembers myset3]]
-        assert_encoding hashtable myset3
+        assert_encoding listpack myset3
     }
 
     test "SMOVE from intset to non existing destination set" {
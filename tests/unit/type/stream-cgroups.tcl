@@ -93,6 +93,34 @@ start_server {
         assert {[r XACK mystream mygroup $id1 $id2] eq 1}
     }
 
+    test {XACK RANGE acknowledges the pending entries in the range} {
+        r DEL mystream
+        for {set j 1} {$j <= 10} {incr j} {r XADD mystream $j-0 a $j}
+        r XGROUP CREATE mystream mygroup 0
+        r XREADGROUP GROUP mygroup c1 COUNT 5 STREAMS mystream >
+        r XREADGROUP GROUP mygroup c2 STREAMS mystream >
+        assert_equal 4 [r XACK mystream mygroup RANGE 3 6-0]
+        assert_equal 0 [r XACK mystream mygroup RANGE 3 6]
+        assert_equal 3 [r XACK mystream mygroup 1-0 RANGE 9 + 3-0]
+        set pending [r XPENDING mystream mygroup - + 10]
+        assert_equal {2-0 7-0 8-0} [lmap e $pending {lindex $e 0}]
+        assert_equal {{c1 1} {c2 2}} [lindex [r XPENDING mystream mygroup] 3]
+        assert_equal 0 [r XACK mystream mygroup RANGE 8 7]
+        assert_equal 3 [r XACK mystream mygroup RANGE - +]
+        assert_equal 0 [lindex [r XPENDING mystream mygroup] 0]
+    }
+
+    test {XACK checks all the arguments before acknowledging} {
+        r XREADGROUP GROUP mygroup c1 STREAMS mystream 0
+        r XGROUP SETID mystream mygroup 0
+        r XREADGROUP GROUP mygroup c1 STREAMS mystream >
+        catch {r XACK mystream mygroup 1-0 RANGE 5} err
+        assert_match {*syntax*} $err
+        catch {r XACK mystream mygroup 1-0 RANGE 5 foo} err
+        assert_match {*Invalid stream ID*} $err
+        assert_equal 10 [lindex [r XPENDING mystream mygroup] 0]
+    }
+
     test {PEL NACK reassignment after XGROUP SETID event} {
         r del events
         r xadd events * f1 v1
@@ -238,6 +266,183 @@ start_server {
         assert {[lindex $reply 0 3] == 2}
     }
 
+    test {Blocking XREADGROUP wakes up one consumer per group for new entries} {
+        r DEL mystream
+        r XGROUP CREATE mystream mygroup $ MKSTREAM
+        set clients {}
+        foreach consumer {c1 c2 c3} {
+            set rd [redis_deferring_client]
+            $rd XREADGROUP GROUP mygroup $consumer BLOCK 0 STREAMS mystream ">"
+            lappend clients $rd
+        }
+        set reader [redis_deferring_client]
+        $reader XREAD BLOCK 0 STREAMS mystream $
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 4
+        } else {
+            fail "Clients are not blocked"
+        }
+
+        # Every new entry goes to a single consumer, round-robin, while the
+        # XREAD client is served anyway.
+        r XADD mystream 1-0 f v1
+        assert_equal {mystream {{1-0 {f v1}}}} [lindex [[lindex $clients 0] read] 0]
+        assert_equal {mystream {{1-0 {f v1}}}} [lindex [$reader read] 0]
+        wait_for_condition 50 100 {
+            [s blocked_clients] == 2
+        } else {
+            fail "More than one consumer was served"
+        }
+        r XADD mystream 2-0 f v2
+        assert_equal {mystream {{2-0 {f v2}}}} [lindex [[lindex $clients 1] read] 0]
+        assert_equal 1 [s blocked_clients]
+
+        # Destroying the group unblocks the remaining consumer.
+        r XGROUP DESTROY mystream mygroup
+        r XADD mystream 3-0 f v3
+        assert_error "*NOGROUP*" {[lindex $clients 2] read}
+        assert_equal 0 [s blocked_clients]
+        foreach rd [concat $clients $reader] {$rd close}
+    }
+
+    test {XAUTOCLAIM claims the entries idle for the longest time first} {
+        r del mystream
+        set id1 [r XADD mystream * a 1]
+        set id2 [r XADD mystream * b 2]
+        set id3 [r XADD mystream * c 3]
+        r XGROUP CREATE mystream mygroup 0
+        r XREADGROUP GROUP mygroup client1 count 1 STREAMS mystream >
+        r debug sleep 0.1
+        r XREADGROUP GROUP mygroup client1 count 2 STREAMS mystream >
+        after 10
+        # Redeliver the first entry, that is now the youngest one.
+        r XCLAIM mystream mygroup client1 0 $id1
+        r debug sleep 0.1
+        assert_equal {} [r XAUTOCLAIM mystream mygroup client2 1000]
+
+        set reply [r XAUTOCLAIM mystream mygroup client2 50 COUNT 1]
+        assert_equal [list [list $id2 {b 2}]] $reply
+        assert_equal [list $id3 $id1] \
+            [r XAUTOCLAIM mystream mygroup client2 50 COUNT 10 JUSTID]
+        assert_equal {} [r XAUTOCLAIM mystream mygroup client3 50]
+
+        set pending [r XPENDING mystream mygroup - + 10]
+        assert_equal [list $id1 client2 2] [lreplace [lindex $pending 0] 2 2]
+        assert_equal [list $id2 client2 2] [lreplace [lindex $pending 1] 2 2]
+        assert_equal [list $id3 client2 1] [lreplace [lindex $pending 2] 2 2]
+
+        # Acknowledged entries leave the index, that is rebuilt on loading.
+        r XACK mystream mygroup $id2
+        r debug reload
+        r debug sleep 0.1
+        assert_equal [list $id1 $id3] \
+            [r XAUTOCLAIM mystream mygroup client3 50 JUSTID]
+        catch {r XAUTOCLAIM mystream mygroup client3 50 COUNT 0} e
+        assert_match {*COUNT*} $e
+        catch {r XAUTOCLAIM mystream nogroup client3 50} e
+        assert_match {NOGROUP*} $e
+    }
+
+    proc group_info {key field} {
+        dict get [lindex [r XINFO GROUPS $key] 0] $field
+    }
+
+    test {Consumer group lag and entries read are tracked} {
+        r DEL x
+        r XADD x 1-0 data a
+        r XADD x 2-0 data b
+        r XADD x 3-0 data c
+        r XADD x 4-0 data d
+        r XADD x 5-0 data e
+        r XGROUP CREATE x g1 0
+        assert_equal 0 [group_info x entries-read]
+        assert_equal 5 [group_info x lag]
+
+        r XREADGROUP GROUP g1 c11 COUNT 1 STREAMS x >
+        assert_equal 1 [group_info x entries-read]
+        assert_equal 4 [group_info x lag]
+
+        r XREADGROUP GROUP g1 c12 COUNT 10 STREAMS x >
+        assert_equal 5 [group_info x entries-read]
+        assert_equal 0 [group_info x lag]
+
+        r XADD x 6-0 data f
+        assert_equal 1 [group_info x lag]
+
+        r XGROUP CREATE x g2 $
+        assert_equal 6 [dict get [lindex [r XINFO GROUPS x] 1] entries-read]
+        assert_equal 0 [dict get [lindex [r XINFO GROUPS x] 1] lag]
+    }
+
+    test {Consumer group lag with deletions} {
+        r DEL x
+        r XADD x 1-0 data a
+        r XADD x 2-0 data b
+        r XADD x 3-0 data c
+        r XADD x 4-0 data d
+        r XADD x 5-0 data e
+        r XGROUP CREATE x g1 0
+
+        # Deleting the first entry keeps the lag valid.
+        r XDEL x 1-0
+        assert_equal 4 [group_info x lag]
+        assert_equal 2-0 [dict get [r XINFO STREAM x] recorded-first-entry-id]
+
+        # A tombstone in the middle of the unread entries makes it unknown.
+        r XDEL x 3-0
+        assert_equal {} [group_info x lag]
+        assert_equal 3-0 [dict get [r XINFO STREAM x] max-deleted-entry-id]
+        assert_equal 5 [dict get [r XINFO STREAM x] entries-added]
+
+        # Until the group reaches the last entry the counter stays unknown,
+        # then it is exact again.
+        r XREADGROUP GROUP g1 c1 COUNT 2 STREAMS x >
+        assert_equal 4-0 [group_info x last-delivered-id]
+        assert_equal {} [group_info x entries-read]
+        assert_equal {} [group_info x lag]
+        r XREADGROUP GROUP g1 c1 STREAMS x >
+        assert_equal 5 [group_info x entries-read]
+        assert_equal 0 [group_info x lag]
+
+        # Trimming doesn't invalidate the counters.
+        r XADD x 6-0 data f
+        r XTRIM x MAXLEN 1
+        assert_equal 6-0 [dict get [r XINFO STREAM x] recorded-first-entry-id]
+        assert_equal 1 [group_info x lag]
+    }
+
+    test {XGROUP SETID and CREATE accept ENTRIESREAD} {
+        r DEL x
+        for {set j 1} {$j <= 5} {incr j} {r XADD x $j-0 data $j}
+        r XGROUP CREATE x g1 2-0 ENTRIESREAD 2
+        assert_equal 2 [group_info x entries-read]
+        assert_equal 3 [group_info x lag]
+        r XGROUP SETID x g1 4-0 ENTRIESREAD 4
+        assert_equal 1 [group_info x lag]
+        r XGROUP SETID x g1 $
+        assert_equal 0 [group_info x lag]
+        r XGROUP DESTROY x g1
+        r XGROUP CREATE x g1 $ MKSTREAM ENTRIESREAD 5
+        assert_equal 5 [group_info x entries-read]
+        catch {r XGROUP CREATE x g2 0 ENTRIESREAD -3} e
+        assert_match {*ENTRIESREAD*} $e
+        catch {r XGROUP CREATE x g2 0 FOO} e
+        assert_match {*Unknown subcommand*} $e
+    }
+
+    test {Consumer group lag counters are persisted} {
+        r DEL x
+        for {set j 1} {$j <= 5} {incr j} {r XADD x $j-0 data $j}
+        r XDEL x 2-0
+        r XGROUP CREATE x g1 0
+        r XREADGROUP GROUP g1 c1 COUNT 2 STREAMS x >
+        set groups [r XINFO GROUPS x]
+        r DEBUG RELOAD
+        assert_equal $groups [r XINFO GROUPS x]
+        assert_equal 5 [dict get [r XINFO STREAM x] entries-added]
+        assert_equal 2-0 [dict get [r XINFO STREAM x] max-deleted-entry-id]
+    }
+
     start_server {} {
         set master [srv -1 client]
         set master_host [srv -1 host]
@@ -285,6 +490,9 @@ start_server {
                 # The consumed enty should be the third
                 set myentry [lindex $item 0 1 0 1]
                 assert {$myentry eq {a 3}}
+                set group [lindex [$slave xinfo groups stream] 0]
+                assert_equal 3 [dict get $group entries-read]
+                assert_equal 0 [dict get $group lag]
             }
         }
     }
@@ -313,6 +313,92 @@ start_server {
         }
     }
 
+    test {XADD with values coded against the first entry of the node} {
+        r DEL mystream
+        set items {}
+        set values {
+            {ts 1600000000000 host web1 cpu 10 req -5}
+            {ts 1600000000100 host web1 cpu 12 req 9223372036854775807}
+            {ts 1600000000200 host web2 cpu 0 req -9223372036854775808}
+            {ts 1600000000300 host 15 cpu 7 req 0}
+            {ts abc host web1 cpu -9223372036854775808 req 3}
+            {ts 1600000000400 host web1 cpu 9223372036854775807 req 007}
+        }
+        foreach fields $values {
+            set id [r XADD mystream * {*}$fields]
+            lappend items [list $id $fields]
+        }
+        assert_equal $items [r XRANGE mystream - +]
+        assert_equal [lreverse $items] [r XREVRANGE mystream + -]
+        r DEBUG RELOAD
+        assert_equal $items [r XRANGE mystream - +]
+
+        # Removing entries, including the first one, doesn't affect the
+        # values coded against it.
+        r XDEL mystream [lindex $items 0 0] [lindex $items 2 0]
+        assert_equal [lreplace [lreplace $items 2 2] 0 0] \
+            [r XRANGE mystream - +]
+    }
+
+    test {XADD ENTRIES adds multiple entries at once} {
+        r DEL mystream
+        r XADD mystream 1-0 a 1
+        set ids [r XADD mystream ENTRIES 3 2-0 1 a 2 * 2 a 3 b 4 * 1 c 5]
+        assert_equal 3 [llength $ids]
+        assert_equal 2-0 [lindex $ids 0]
+        assert {[streamCompareID [lindex $ids 1] [lindex $ids 2]] == -1}
+        set items [r XRANGE mystream - +]
+        assert_equal [list 1-0 {a 1}] [lindex $items 0]
+        assert_equal [list 2-0 {a 2}] [lindex $items 1]
+        assert_equal [list [lindex $ids 1] {a 3 b 4}] [lindex $items 2]
+        assert_equal [list [lindex $ids 2] {c 5}] [lindex $items 3]
+        assert_equal 4 [dict get [r XINFO STREAM mystream] entries-added]
+    }
+
+    test {XADD ENTRIES fills the nodes like single XADDs} {
+        r DEL s1 s2
+        r config set stream-node-max-entries 7
+        set args {}
+        for {set j 1} {$j <= 100} {incr j} {
+            set fields [list ts [expr {1000+$j}] host web[expr {$j%3}]]
+            if {$j % 10 == 0} {lappend fields extra $j}
+            r XADD s1 $j-0 {*}$fields
+            lappend args $j-0 [expr {[llength $fields]/2}] {*}$fields
+        }
+        r XADD s2 ENTRIES 100 {*}$args
+        assert_equal [r XRANGE s1 - +] [r XRANGE s2 - +]
+        assert_equal [r XREVRANGE s1 + -] [r XREVRANGE s2 + -]
+        assert_equal [dict get [r XINFO STREAM s1] radix-tree-keys] \
+                     [dict get [r XINFO STREAM s2] radix-tree-keys]
+        r DEBUG RELOAD
+        assert_equal [r XRANGE s1 - +] [r XRANGE s2 - +]
+        r config set stream-node-max-entries 100
+    }
+
+    test {XADD ENTRIES is atomic} {
+        r DEL mystream
+        r XADD mystream 10-0 a 1
+        catch {r XADD mystream ENTRIES 2 11-0 1 a 2 5-0 1 a 3} err
+        assert_match {*equal or smaller*} $err
+        catch {r XADD mystream ENTRIES 2 11-0 1 a 2 12-0 2 a 3} err
+        assert_match {*out of range*} $err
+        catch {r XADD mystream ENTRIES 2 11-0 1 a 2} err
+        assert_match {*wrong number*} $err
+        catch {r XADD mystream ENTRIES 0 11-0 1 a 2} err
+        assert_match {*positive*} $err
+        catch {r XADD newstream ENTRIES 2 * 1 a 2 1-0 1 a 3} err
+        assert_match {*equal or smaller*} $err
+        assert_equal 0 [r EXISTS newstream]
+        assert_equal 1 [r XLEN mystream]
+    }
+
+    test {XADD ENTRIES with MAXLEN} {
+        r DEL mystream
+        r XADD mystream MAXLEN 2 ENTRIES 3 * 1 a 1 * 1 a 2 * 1 a 3
+        assert_equal 2 [r XLEN mystream]
+        assert_equal {a 3} [lindex [r XRANGE mystream - +] 1 1]
+    }
+
     test {XREVRANGE regression test for issue #5006} {
         # Add non compressed entries
         r xadd teststream 1234567891230 key1 value1
@@ -361,6 +447,16 @@ start_server {tags {"stream"} overrides {appendonly yes}} {
     }
 }
 
+start_server {tags {"stream"} overrides {appendonly yes}} {
+    test {XADD ENTRIES propagates the generated IDs} {
+        r XADD mystream ENTRIES 3 * 1 a 1 * 1 a 2 * 1 a 3
+        r XADD mystream MAXLEN ~ 1 ENTRIES 2 * 1 a 4 * 1 a 5
+        set items [r XRANGE mystream - +]
+        r debug loadaof
+        assert_equal $items [r XRANGE mystream - +]
+    }
+}
+
 start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries 10}} {
     test {XTRIM with ~ MAXLEN can propagate correctly} {
         for {set j 0} {$j < 100} {incr j} {
@@ -376,6 +472,67 @@ start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries
     }
 }
 
+start_server {tags {"stream"} overrides {stream-node-max-entries 10}} {
+    test {XTRIM with MINID removes the entries older than the ID} {
+        r DEL mystream
+        for {set j 1} {$j <= 100} {incr j} {
+            r XADD mystream $j-1 xitem $j
+        }
+        assert_equal 0 [r XTRIM mystream MINID 1]
+        assert_equal 34 [r XTRIM mystream MINID 35]
+        assert_equal 66 [r XLEN mystream]
+        assert_equal {35-1} [lindex [r XRANGE mystream - + COUNT 1] 0 0]
+        # Entries already deleted are skipped.
+        r XDEL mystream 36-1
+        assert_equal 1 [r XTRIM mystream MINID 37-0]
+        assert_equal {37-1} [lindex [r XRANGE mystream - + COUNT 1] 0 0]
+        assert_equal 64 [r XTRIM mystream MINID 1000]
+        assert_equal 0 [r XLEN mystream]
+    }
+
+    test {XTRIM with ~ MINID only removes whole nodes} {
+        r DEL mystream
+        for {set j 1} {$j <= 100} {incr j} {
+            r XADD mystream $j-1 xitem $j
+        }
+        assert_equal 30 [r XTRIM mystream MINID ~ 35]
+        assert_equal {31-1} [lindex [r XRANGE mystream - + COUNT 1] 0 0]
+        assert_equal 0 [r XTRIM mystream MINID ~ 35]
+        assert_equal 4 [r XTRIM mystream MINID = 35]
+    }
+
+    test {XADD with MINID trims the stream} {
+        r DEL mystream
+        for {set j 1} {$j <= 20} {incr j} {
+            r XADD mystream $j-1 xitem $j
+        }
+        r XADD mystream MINID 15 21-1 xitem 21
+        assert_equal 7 [r XLEN mystream]
+        r XADD mystream MINID ~ 20 22-1 xitem 22
+        assert_equal 8 [r XLEN mystream]
+    }
+
+    test {MAXLEN and MINID can't be used together} {
+        catch {r XTRIM mystream MAXLEN 10 MINID 5} err
+        assert_match {*MAXLEN and MINID*} $err
+        catch {r XTRIM mystream MINID foo} err
+        assert_match {*Invalid stream ID*} $err
+    }
+}
+
+start_server {tags {"stream"} overrides {appendonly yes stream-node-max-entries 10}} {
+    test {XTRIM with ~ MINID can propagate correctly} {
+        for {set j 1} {$j <= 100} {incr j} {
+            r XADD mystream $j-1 xitem v
+        }
+        r XTRIM mystream MINID ~ 35
+        assert {[r xlen mystream] == 70}
+        r config set stream-node-max-entries 1
+        r debug loadaof
+        assert {[r xlen mystream] == 70}
+    }
+}
+
 start_server {tags {"xsetid"}} {
     test {XADD can CREATE an empty stream} {
         r XADD mystream MAXLEN 0 * a b
@@ -398,6 +555,25 @@ start_server {tags {"xsetid"}} {
         catch {r XSETID stream 1-1} err
         set _ $err
     } {ERR no such key}
+
+    test {XSETID can set the entries added and max deleted ID} {
+        r DEL x
+        r XADD x 1-0 a b
+        r XSETID x 200-0 ENTRIESADDED 50 MAXDELETEDID 100-0
+        set info [r XINFO STREAM x]
+        assert_equal 200-0 [dict get $info last-generated-id]
+        assert_equal 50 [dict get $info entries-added]
+        assert_equal 100-0 [dict get $info max-deleted-entry-id]
+    }
+
+    test {XSETID options are checked} {
+        catch {r XSETID x 300-0 ENTRIESADDED 0} err
+        assert_match {*smaller than the target stream length*} $err
+        catch {r XSETID x 300-0 MAXDELETEDID 400-0} err
+        assert_match {*smaller than the provided max_deleted_entry_id*} $err
+        catch {r XSETID x 300-0 FOO} err
+        assert_match {*syntax*} $err
+    }
 }
 
 start_server {tags {"stream"} overrides {appendonly yes aof-use-rdb-preamble no}} {
@@ -410,6 +586,22 @@ start_server {tags {"stream"} overrides {appendonly yes aof-use-rdb-preamble no}
         assert {[dict get [r xinfo stream mystream] length] == 0}
     }
 
+    test {Stream lag counters are rewritten into AOF} {
+        r DEL x
+        for {set j 1} {$j <= 5} {incr j} {r XADD x $j-0 data $j}
+        r XDEL x 2-0
+        r XGROUP CREATE x g1 0
+        r XREADGROUP GROUP g1 c1 COUNT 2 STREAMS x >
+        set groups [r XINFO GROUPS x]
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        assert_equal $groups [r XINFO GROUPS x]
+        assert_equal 5 [dict get [r XINFO STREAM x] entries-added]
+        assert_equal 2-0 [dict get [r XINFO STREAM x] max-deleted-entry-id]
+        r DEL x
+    }
+
     test {Stream can be rewrite into AOF correctly after XDEL lastid} {
         r XSETID mystream 0-0
         r XADD mystream 1-1 a b
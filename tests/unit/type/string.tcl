@@ -9,12 +9,59 @@ start_server {tags {"string"}} {
         r get x
     } {}
 
+    test {Embedded strings of every length} {
+        for {set len 0} {$len <= 50} {incr len} {
+            set val [string repeat x $len]
+            r set x $val
+            if {$len <= 44} {
+                assert_encoding embstr x
+            }
+            assert_equal $val [r get x]
+            assert_equal $len [r strlen x]
+            assert_equal $val [r getrange x 0 -1]
+            r append x yz
+            assert_equal "${val}yz" [r get x]
+            r set x $val
+            r setrange x $len !
+            assert_equal "${val}!" [r get x]
+        }
+    }
+
+    test {Values taken from the argv pool use the smallest bin} {
+        foreach {len bytes} {13 32 14 32 29 48 30 48} {
+            # Leave argument objects of every size class in the pool.
+            r exists [string repeat a 10] [string repeat b 20] \
+                     [string repeat c 40]
+            r set x [string repeat v $len]
+            set info [r debug sdslen x]
+            regexp {val_zmalloc: ([0-9]+)} $info -> val_zmalloc
+            assert_equal [expr {$val_zmalloc+16}] $bytes
+        }
+    }
+
     test {Very big payload in GET/SET} {
         set buf [string repeat "abcd" 1000000]
         r set foo $buf
         r get foo
     } [string repeat "abcd" 1000000]
 
+    test {Big payload GET replies are not affected by later writes} {
+        set buf [string repeat "abcd" 100000]
+        r set foo $buf
+        set rd [redis_deferring_client]
+        $rd get foo
+        $rd append foo "efgh"
+        $rd get foo
+        $rd del foo
+        $rd get foo
+        set res {}
+        for {set j 0} {$j < 5} {incr j} {
+            lappend res [string length [$rd read]]
+        }
+        $rd close
+        set res
+    } {400000 6 400004 1 0}
+
     tags {"slow"} {
         test {Very big payload random access} {
             set err {}
@@ -147,6 +194,47 @@ start_server {tags {"string"}} {
         list [r msetnx x1 xxx y2 yyy] [r get x1] [r get y2]
     } {1 xxx yyy}
 
+    test {MSET / MGET of many keys, some missing or not strings} {
+        set args {}
+        set expected {}
+        for {set j 0} {$j < 100} {incr j} {
+            lappend args many:$j $j
+        }
+        r mset {*}$args
+        r del many:17 many:33 many:50
+        r sadd many:33 member
+        set keys {}
+        for {set j 0} {$j < 105} {incr j} {
+            lappend keys many:$j
+            if {$j == 17 || $j == 50 || $j == 33 || $j >= 100} {
+                lappend expected {}
+            } else {
+                lappend expected $j
+            }
+        }
+        assert_equal $expected [r mget {*}$keys]
+        assert_equal 0 [r msetnx many:200 x {*}$args]
+        assert_equal 0 [r exists many:200]
+    }
+
+    test {Pipelined commands see the keys written by the previous ones} {
+        r del pipe:a pipe:b
+        set fd [r channel]
+        set buf {}
+        for {set j 0} {$j < 50} {incr j} {
+            append buf [formatCommand set pipe:$j $j]
+            append buf [formatCommand get pipe:$j]
+            append buf [formatCommand incr pipe:$j]
+        }
+        puts -nonewline $fd $buf
+        flush $fd
+        set replies {}
+        for {set j 0} {$j < 150} {incr j} {
+            lappend replies [r read]
+        }
+        lrange $replies 0 5
+    } {OK 0 1 OK 1 2}
+
     test "STRLEN against non-existing key" {
         assert_equal 0 [r strlen notakey]
     }
@@ -420,3 +508,117 @@ start_server {tags {"string"}} {
         r getrange foo 0 4294967297
     } {bar}
 }
+
+start_server {tags {"string"} overrides {string-compression-threshold 1kb}} {
+    proc json_payload {first count} {
+        set items {}
+        for {set j $first} {$j < $first+$count} {incr j} {
+            lappend items "{\"id\":$j,\"name\":\"user$j\",\"email\":\"user$j@example.com\",\"active\":true}"
+        }
+        return "\[[join $items ,]\]"
+    }
+
+    test {Large strings are compressed and read back} {
+        set v [json_payload 0 200]
+        r set doc $v
+        assert_encoding compressed doc
+        assert {[r memory usage doc] < [string length $v]/2}
+        assert_equal $v [r get doc]
+        assert_equal [list $v {}] [r mget doc nokey]
+        assert_equal [string length $v] [r strlen doc]
+        assert_equal [string range $v 100 199] [r getrange doc 100 199]
+        assert_equal $v [r getset doc $v]
+        assert_encoding compressed doc
+    }
+
+    test {Small and incompressible strings are not compressed} {
+        r set small [string repeat x 1000]
+        r set random [randstring 4000 4000 binary]
+        r config set string-compression-threshold 0
+        r set disabled [json_payload 0 200]
+        r config set string-compression-threshold 1kb
+        list [r object encoding small] [r object encoding random] \
+             [r object encoding disabled]
+    } {raw raw raw}
+
+    test {APPEND and SETRANGE turn compressed strings into raw strings} {
+        set v [json_payload 0 200]
+        r set doc $v
+        r append doc "tail"
+        assert_encoding raw doc
+        assert_equal "${v}tail" [r get doc]
+
+        r set doc $v
+        r setrange doc 1 "X"
+        assert_encoding raw doc
+        assert_equal [string replace $v 1 1 X] [r get doc]
+
+        r del doc
+        r append doc $v
+        assert_encoding raw doc
+        r set doc $v
+        r getbit doc 0
+        assert_encoding raw doc
+    }
+
+    test {Compressed strings are saved, dumped and rewritten as strings} {
+        r flushall
+        set v [json_payload 0 300]
+        r set doc $v
+        set digest [r debug digest-value doc]
+        r debug reload
+        assert_encoding compressed doc
+        assert_equal $digest [r debug digest-value doc]
+
+        r restore doc2 0 [r dump doc]
+        assert_encoding compressed doc2
+        assert_equal $v [r get doc2]
+
+        r config set appendonly yes
+        waitForBgrewriteaof r
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        r config set appendonly no
+        assert_encoding compressed doc
+        assert_equal $digest [r debug digest-value doc]
+    } {}
+
+    test {Compressed strings are propagated to replicas as strings} {
+        set v [json_payload 0 100]
+        set repl [attach_to_replication_stream]
+        r set doc $v
+        read_from_replication_stream $repl
+        assert_equal [list set doc $v] [read_from_replication_stream $repl]
+        close_replication_stream $repl
+    }
+
+    test {INFO reports the compressed and decompressed strings} {
+        r config resetstat
+        r set doc [json_payload 0 200]
+        r append doc x
+        list [s string_compressions] [s string_decompressions]
+    } {1 1}
+}
+
+set dictfile [file normalize [tmpfile "compression-dict"]]
+set fd [open $dictfile w]
+for {set j 1000} {$j < 1100} {incr j} {
+    puts -nonewline $fd "{\"id\":$j,\"name\":\"user$j\",\"email\":\"user$j@example.com\",\"active\":true},"
+}
+close $fd
+start_server [list tags {"string"} overrides [list string-compression-threshold 1kb string-compression-dict $dictfile]] {
+    test {Strings are compressed with the dictionary} {
+        set items {}
+        for {set j 0} {$j < 20} {incr j} {
+            lappend items "{\"id\":$j,\"name\":\"user$j\",\"email\":\"user$j@example.com\",\"active\":true}"
+        }
+        set v "\[[join $items ,]\]"
+        r set doc $v
+        assert_encoding compressed doc
+        assert {[r memory usage doc] < [string length $v]/4}
+        r debug reload
+        assert_equal $v [r get doc]
+        assert_equal [lindex [r config get string-compression-dict] 1] $dictfile
+    }
+}
@@ -7,12 +7,12 @@ start_server {tags {"zset"}} {
     }
 
     proc basics {encoding} {
-        if {$encoding == "ziplist"} {
-            r config set zset-max-ziplist-entries 128
-            r config set zset-max-ziplist-value 64
+        if {$encoding == "listpack"} {
+            r config set zset-max-listpack-entries 128
+            r config set zset-max-listpack-value 64
         } elseif {$encoding == "skiplist"} {
-            r config set zset-max-ziplist-entries 0
-            r config set zset-max-ziplist-value 0
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -735,7 +735,7 @@ start_server {tags {"zset"}} {
         }
     }
 
-    basics ziplist
+    basics listpack
     basics skiplist
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
@@ -751,7 +751,7 @@ start_server {tags {"zset"}} {
         r zrange out 0 -1 withscores
     } {neginf 0}
 
-    test {ZINTERSTORE #516 regression, mixed sets and ziplist zsets} {
+    test {ZINTERSTORE #516 regression, mixed sets and listpack zsets} {
         r sadd one 100 101 102 103
         r sadd two 100 200 201 202
         r zadd three 1 500 1 501 1 502 1 503 1 100
@@ -759,6 +759,67 @@ start_server {tags {"zset"}} {
         r zrange to_here 0 -1
     } {100}
 
+    test {ZUNIONSTORE and ZINTERSTORE executed in the background} {
+        r del zset1 zset2 set1 dst
+        for {set j 0} {$j < 1000} {incr j} {
+            r zadd zset1 $j ele:$j
+            r zadd zset2 [expr {$j*2}] ele:[expr {$j+500}]
+        }
+        r sadd set1 ele:1 ele:600 ele:2000
+        foreach cmd {zunionstore zinterstore} {
+            foreach args {{2 zset1 zset2} {3 zset1 zset2 set1}
+                          {2 zset1 zset2 weights 2 3 aggregate max}
+                          {3 zset1 nokey zset2} {2 set1 zset1 aggregate min}} {
+                r config set setops-incremental-threshold 0
+                set expected [r $cmd dst {*}$args]
+                set result [r zrange dst 0 -1 withscores]
+                r del dst
+                r config set setops-incremental-threshold 1
+                assert_equal $expected [r $cmd dst {*}$args]
+                assert_equal $result [r zrange dst 0 -1 withscores]
+            }
+        }
+        r config set setops-incremental-threshold 1000000
+    }
+
+    test {ZBUILD creates the sorted set with its final encoding} {
+        set entries [lindex [r config get zset-max-listpack-entries] 1]
+        set value [lindex [r config get zset-max-listpack-value] 1]
+        r config set zset-max-listpack-entries 128
+        r config set zset-max-listpack-value 64
+        r del zset1
+        assert_equal 2 [r zbuild zset1 10 1 a 2 b]
+        assert_encoding listpack zset1
+        assert_equal 1 [r zbuild zset1 1000 3 a 4 c]
+        assert_encoding skiplist zset1
+        assert_equal {b 2 a 3 c 4} [r zrange zset1 0 -1 withscores]
+        r del zset1
+        assert_equal 1 [r zbuild zset1 1000 1 a]
+        assert_encoding skiplist zset1
+        catch {r zbuild zset1 10 foo a} e
+        assert_match {*not a valid float*} $e
+        catch {r zbuild zset1 10 1 a 2} e
+        assert_match {*syntax*} $e
+        r config set zset-max-listpack-entries $entries
+        r config set zset-max-listpack-value $value
+    }
+
+    test {ZRANGE and ZREVRANGE of big sorted sets are streamed} {
+        r del zset1
+        for {set j 0} {$j < 1000} {incr j} {r zadd zset1 $j ele:$j}
+        assert_encoding skiplist zset1
+        foreach cmd {zrange zrevrange} {
+            foreach args {{0 -1} {0 -1 withscores} {10 500 withscores}
+                          {-100 -1} {999 2000} {500 10}} {
+                r config set replies-incremental-threshold 0
+                set expected [r $cmd zset1 {*}$args]
+                r config set replies-incremental-threshold 1
+                assert_equal $expected [r $cmd zset1 {*}$args]
+            }
+        }
+        r config set replies-incremental-threshold 100000
+    }
+
     test {ZUNIONSTORE result is sorted} {
         # Create two sets with common and not common elements, perform
         # the UNION, check that elements are still sorted.
@@ -786,14 +847,14 @@ start_server {tags {"zset"}} {
     }
 
     proc stressers {encoding} {
-        if {$encoding == "ziplist"} {
+        if {$encoding == "listpack"} {
             # Little extra to allow proper fuzzing in the sorting stresser
-            r config set zset-max-ziplist-entries 256
-            r config set zset-max-ziplist-value 64
+            r config set zset-max-listpack-entries 256
+            r config set zset-max-listpack-value 64
             set elements 128
         } elseif {$encoding == "skiplist"} {
-            r config set zset-max-ziplist-entries 0
-            r config set zset-max-ziplist-value 0
+            r config set zset-max-listpack-entries 0
+            r config set zset-max-listpack-value 0
             if {$::accurate} {set elements 1000} else {set elements 100}
         } else {
             puts "Unknown sorted set encoding"
@@ -1198,13 +1259,13 @@ start_server {tags {"zset"}} {
     }
 
     tags {"slow"} {
-        stressers ziplist
+        stressers listpack
         stressers skiplist
     }
 
     test {ZSET skiplist order consistency when elements are moved} {
-        set original_max [lindex [r config get zset-max-ziplist-entries] 1]
-        r config set zset-max-ziplist-entries 0
+        set original_max [lindex [r config get zset-max-listpack-entries] 1]
+        r config set zset-max-listpack-entries 0
         for {set times 0} {$times < 10} {incr times} {
             r del zset
             for {set j 0} {$j < 1000} {incr j} {
@@ -1225,6 +1286,6 @@ start_server {tags {"zset"}} {
                 set prev_score $score
             }
         }
-        r config set zset-max-ziplist-entries $original_max
+        r config set zset-max-listpack-entries $original_max
     }
 }
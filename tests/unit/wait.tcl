@@ -42,4 +42,102 @@ start_server {} {
         $master incr foo
         assert {[$master wait 1 3000] == 0}
     }
+
+    test {Slave acknowledges the applied stream without waiting for GETACK} {
+        # Wait for the slave to be done with the DEBUG SLEEP.
+        $slave ping
+        wait_for_ofs_sync $master $slave
+        for {set j 0} {$j < 5} {incr j} {
+            $master incr foo
+            wait_for_condition 10 20 {
+                [string match "*offset=[status $master master_repl_offset],*" [status $master slave0]]
+            } else {
+                fail "Slave didn't acknowledge the stream"
+            }
+        }
+    }
+
+    test {WAIT unblocks all the clients once the slave catches up} {
+        set cmd [rediscli $slave_port "-h $slave_host debug sleep 2"]
+        exec {*}$cmd > /dev/null 2> /dev/null &
+        after 500 ;# Give redis-cli the time to execute the command.
+        set rd1 [redis_deferring_client -1]
+        set rd2 [redis_deferring_client -1]
+        set rd3 [redis_deferring_client -1]
+        $rd1 incr foo
+        $rd1 read
+        $rd2 incr foo
+        $rd2 read
+        $rd3 incr foo
+        $rd3 read
+        $rd2 wait 1 5000
+        $rd1 wait 1 5000
+        $rd3 wait 2 3000
+        wait_for_condition 50 100 {
+            [status $master blocked_clients] == 3
+        } else {
+            fail "Clients not blocked in WAIT"
+        }
+        assert_equal 1 [$rd1 read]
+        assert_equal 1 [$rd2 read]
+        assert_equal 1 [$rd3 read]
+        $rd1 close
+        $rd2 close
+        $rd3 close
+    }
+
+    test {CLIENT WRITEOFFSET returns the offset of the last write} {
+        $master set foo bar
+        set offset [$master client writeoffset]
+        $master get foo
+        assert_equal $offset [$master client writeoffset]
+        assert_equal $offset [status $master master_repl_offset]
+    }
+
+    test {WAITOFFSET waits for the replica to process the offset} {
+        set cmd [rediscli $slave_port "-h $slave_host debug sleep 2"]
+        exec {*}$cmd > /dev/null 2> /dev/null &
+        after 500 ;# Give redis-cli the time to execute the command.
+        $master set foo written
+        set offset [$master client writeoffset]
+        set rd [redis_deferring_client]
+        $rd waitoffset $offset 5000
+        $rd get foo
+        assert_equal 1 [$rd read]
+        assert_equal written [$rd read]
+        $rd close
+    }
+
+    test {WAITOFFSET times out with 0} {
+        set offset [expr {[status $master master_repl_offset]+1000000}]
+        assert_equal 0 [$slave waitoffset $offset 100]
+        assert_equal 1 [$slave waitoffset 0 100]
+        assert_equal 1 [$master waitoffset 0 100]
+    }
+
+    test {CLIENT WRITEOFFSET ON adds the offset to the replies to writes} {
+        assert_error {*RESP3*} {$master client writeoffset on}
+        if {$::tls} {
+            set s [::tls::socket $master_host $master_port]
+        } else {
+            set s [socket $master_host $master_port]
+        }
+        fconfigure $s -translation binary
+        puts -nonewline $s "HELLO 3\r\nSELECT 9\r\nCLIENT WRITEOFFSET ON\r\nPING\r\n"
+        flush $s
+        while {[gets $s] ne "+PONG\r"} {}
+        puts -nonewline $s "SET foo attr\r\nGET foo\r\n"
+        flush $s
+        assert_equal "|1\r" [gets $s]
+        assert_equal "\$6\r" [gets $s]
+        assert_equal "offset\r" [gets $s]
+        set offset [string range [string trim [gets $s]] 1 end]
+        assert_equal "+OK\r" [gets $s]
+        assert_equal "\$4\r" [gets $s]
+        assert_equal "attr\r" [gets $s]
+        assert_equal $offset [status $master master_repl_offset]
+        close $s
+        assert_equal 1 [$slave waitoffset $offset 5000]
+        $slave get foo
+    } {attr}
 }}